@@ -41,6 +41,12 @@ ZSTD_LIB_PATH = $(ZSTD_DIR)/lib
 CC := gcc
 CPP := g++
 BASE_CFLAGS := -Wall -g -Wno-unknown-pragmas
+# Log levels above TG_LOG_LEVEL (DISABLED, SCREEN, ERROR, WARN, INFO or DEBUG)
+# are compiled out, see logdef.h
+TG_LOG_LEVEL ?=
+ifneq ($(TG_LOG_LEVEL),)
+BASE_CFLAGS += -DTG_LOG_LEVEL=TG_LOG_LEVEL_$(TG_LOG_LEVEL)
+endif
 BASE_INCLUDES := -I$(ROOT_DIR) -I$(ROOT_DIR)/layers -I$(ROOT_DIR)/shared \
                  -I$(ZLOG_INCLUDE_PATH) -I$(LZ4_DIR)/lib -I$(ZSTD_DIR)/lib \
                  $(shell pkg-config --cflags glib-2.0)
@@ -48,55 +54,176 @@ BASE_INCLUDES := -I$(ROOT_DIR) -I$(ROOT_DIR)/layers -I$(ROOT_DIR)/shared \
 # Common dependencies
 SHARED_DEPS = $(ROOT_DIR)/lib.h \
               $(ROOT_DIR)/layers/local/local.h \
+              $(ROOT_DIR)/layers/local/local_uring.h \
               $(ROOT_DIR)/layers/remote/remote.h \
+              $(ROOT_DIR)/layers/remote/protocol.h \
+              $(ROOT_DIR)/layers/remote/shm.h \
+              $(ROOT_DIR)/layers/remote/transport.h \
               $(ROOT_DIR)/layers/demultiplexer/demultiplexer.h \
               $(ROOT_DIR)/layers/demultiplexer/passthrough_ops.h \
+              $(ROOT_DIR)/layers/demultiplexer/read_policy.h \
+              $(ROOT_DIR)/layers/demultiplexer/replica_check.h \
+              $(ROOT_DIR)/layers/demultiplexer/replication.h \
+              $(ROOT_DIR)/layers/demultiplexer/striping.h \
+              $(ROOT_DIR)/layers/demultiplexer/erasure.h \
+              $(ROOT_DIR)/layers/demultiplexer/attr_cache.h \
               $(ROOT_DIR)/layers/anti_tampering/anti_tampering.h \
+              $(ROOT_DIR)/layers/anti_tampering/merkle_anti_tampering.h \
+              $(ROOT_DIR)/layers/anti_tampering/verify_cache.h \
+              $(ROOT_DIR)/layers/anti_tampering/verified_blocks.h \
+              $(ROOT_DIR)/layers/anti_tampering/async_commit.h \
+              $(ROOT_DIR)/layers/anti_tampering/hash_reaper.h \
+              $(ROOT_DIR)/layers/anti_tampering/scrubber.h \
+              $(ROOT_DIR)/layers/anti_tampering/hash_manifest.h \
+              $(ROOT_DIR)/layers/anti_tampering/manifest_anchor.h \
+              $(ROOT_DIR)/layers/anti_tampering/dirty_journal.h \
               $(ROOT_DIR)/layers/block_align/block_align.h \
               $(ROOT_DIR)/config/declarations.h \
               $(ROOT_DIR)/lib/tomlc17/src/tomlc17.h \
               $(ROOT_DIR)/layers/encryption/encryption.h \
+              $(ROOT_DIR)/layers/encryption/key_cache.h \
+              $(ROOT_DIR)/layers/encryption/ciphers/aes_xts.h \
+              $(ROOT_DIR)/layers/encryption/ciphers/aead.h \
               $(ROOT_DIR)/layers/compression/compression.h \
+              $(ROOT_DIR)/layers/compression/seekable.h \
+              $(ROOT_DIR)/layers/compression/append_block.h \
+              $(ROOT_DIR)/layers/compression/index_file.h \
+              $(ROOT_DIR)/layers/compression/policy.h \
+              $(ROOT_DIR)/layers/compression/block_cache.h \
+              $(ROOT_DIR)/layers/compression/compactor.h \
               $(ROOT_DIR)/layers/benchmark/benchmark.h \
+              $(ROOT_DIR)/layers/staging/staging.h \
+              $(ROOT_DIR)/layers/memory/memory.h \
+              $(ROOT_DIR)/layers/hash_store/hash_store.h \
+              $(ROOT_DIR)/layers/dedup/dedup.h \
+              $(ROOT_DIR)/layers/qos/qos.h \
+              $(ROOT_DIR)/layers/invisible_storage/s3_opendal/s3_parallel.h \
+              $(ROOT_DIR)/layers/invisible_storage/ipfs_opendal/ipfs_cache.h \
+              $(ROOT_DIR)/layers/cache/read_cache/cache_key.h \
               $(ROOT_DIR)/layers/cache/read_cache/read_cache.h \
+              $(ROOT_DIR)/layers/cache/read_cache/readahead.h \
+              $(ROOT_DIR)/layers/cache/read_cache/write_back.h \
+              $(ROOT_DIR)/layers/cache/read_cache/admission.h \
               $(ROOT_DIR)/shared/utils/parallel.h \
+              $(ROOT_DIR)/shared/utils/thread_pool.h \
+              $(ROOT_DIR)/shared/utils/reed_solomon.h \
+              $(ROOT_DIR)/shared/utils/buffer_pool.h \
+              $(ROOT_DIR)/shared/utils/numa_policy.h \
+              $(ROOT_DIR)/shared/utils/memory_budget.h \
+              $(ROOT_DIR)/shared/utils/fiber.h \
+              $(ROOT_DIR)/shared/utils/cpu.h \
+              $(ROOT_DIR)/shared/utils/zero.h \
+              $(ROOT_DIR)/shared/utils/group_commit.h \
+              $(ROOT_DIR)/shared/utils/metadata_service.h \
+              $(ROOT_DIR)/shared/utils/fd_table.h \
+              $(ROOT_DIR)/shared/utils/layer_iov.h \
+              $(ROOT_DIR)/shared/utils/invalidation.h \
+              $(ROOT_DIR)/shared/utils/layer_async.h \
+              $(ROOT_DIR)/shared/utils/lazy_layer.h \
+              $(ROOT_DIR)/shared/utils/metrics.h \
+              $(ROOT_DIR)/shared/utils/metrics_layer.h \
               $(ROOT_DIR)/shared/utils/locking.h \
               $(ROOT_DIR)/shared/utils/hasher/hasher.h \
               $(ROOT_DIR)/shared/utils/hasher/evp.h \
+              $(ROOT_DIR)/shared/utils/hasher/hasher_context.h \
               $(ROOT_DIR)/shared/utils/hasher/sha256_hasher.h \
-              $(ROOT_DIR)/shared/utils/hasher/sha512_hasher.h
+              $(ROOT_DIR)/shared/utils/hasher/sha256_mb.h \
+              $(ROOT_DIR)/shared/utils/hasher/sha512_hasher.h \
+              $(ROOT_DIR)/shared/utils/hasher/blake3.h \
+              $(ROOT_DIR)/shared/utils/hasher/blake3_hasher.h \
+              $(ROOT_DIR)/shared/utils/hasher/merkle_tree.h \
+              $(ROOT_DIR)/shared/utils/hasher/chunk_hasher.h
 
 # Common shared objects
 SHARED_OBJS = $(ROOT_BUILD_DIR)/lib.o \
               $(ROOT_BUILD_DIR)/logdef.o \
               $(LAYERS_BUILD_DIR)/local.o \
+              $(LAYERS_BUILD_DIR)/local_uring.o \
               $(LAYERS_BUILD_DIR)/remote.o \
+              $(LAYERS_BUILD_DIR)/transport.o \
               $(LAYERS_BUILD_DIR)/demultiplexer.o \
               $(LAYERS_BUILD_DIR)/passthrough_ops.o \
               $(LAYERS_BUILD_DIR)/enforcement.o \
+              $(LAYERS_BUILD_DIR)/read_policy.o \
+              $(LAYERS_BUILD_DIR)/replica_check.o \
+              $(LAYERS_BUILD_DIR)/replication.o \
+              $(LAYERS_BUILD_DIR)/striping.o \
+              $(LAYERS_BUILD_DIR)/erasure.o \
+              $(LAYERS_BUILD_DIR)/attr_cache.o \
               $(LAYERS_BUILD_DIR)/anti_tampering.o \
               $(LAYERS_BUILD_DIR)/block_anti_tampering.o \
               $(LAYERS_BUILD_DIR)/anti_tampering_utils.o \
+              $(LAYERS_BUILD_DIR)/merkle_anti_tampering.o \
+              $(LAYERS_BUILD_DIR)/verify_cache.o \
+              $(LAYERS_BUILD_DIR)/verified_blocks.o \
+              $(LAYERS_BUILD_DIR)/async_commit.o \
+              $(LAYERS_BUILD_DIR)/hash_reaper.o \
+              $(LAYERS_BUILD_DIR)/scrubber.o \
+              $(LAYERS_BUILD_DIR)/hash_manifest.o \
+              $(LAYERS_BUILD_DIR)/manifest_anchor.o \
+              $(LAYERS_BUILD_DIR)/dirty_journal.o \
               $(LAYERS_BUILD_DIR)/block_align.o \
               $(LAYERS_BUILD_DIR)/benchmark.o \
               $(LAYERS_BUILD_DIR)/read_cache.o \
+              $(LAYERS_BUILD_DIR)/readahead.o \
+              $(LAYERS_BUILD_DIR)/write_back.o \
+              $(LAYERS_BUILD_DIR)/admission.o \
               $(LAYERS_BUILD_DIR)/encryption.o \
+              $(LAYERS_BUILD_DIR)/key_cache.o \
               $(LAYERS_BUILD_DIR)/aes_xts.o \
+              $(LAYERS_BUILD_DIR)/aead.o \
+              $(LAYERS_BUILD_DIR)/staging.o \
+              $(LAYERS_BUILD_DIR)/memory.o \
+              $(LAYERS_BUILD_DIR)/hash_store.o \
+              $(LAYERS_BUILD_DIR)/dedup.o \
+              $(LAYERS_BUILD_DIR)/qos.o \
+              $(LAYERS_BUILD_DIR)/s3_parallel.o \
+              $(LAYERS_BUILD_DIR)/ipfs_cache.o \
               $(ROOT_BUILD_DIR)/loader.o \
               $(ROOT_BUILD_DIR)/parser.o \
               $(ROOT_BUILD_DIR)/builder.o \
+              $(ROOT_BUILD_DIR)/reload.o \
               $(ROOT_BUILD_DIR)/toml.o \
               $(LAYERS_BUILD_DIR)/compressor.o \
               $(LAYERS_BUILD_DIR)/compression.o \
               $(LAYERS_BUILD_DIR)/sparse_block.o \
               $(LAYERS_BUILD_DIR)/compression_utils.o \
+              $(LAYERS_BUILD_DIR)/seekable.o \
+              $(LAYERS_BUILD_DIR)/append_block.o \
+              $(LAYERS_BUILD_DIR)/index_file.o \
+              $(LAYERS_BUILD_DIR)/policy.o \
+              $(LAYERS_BUILD_DIR)/block_cache.o \
+              $(LAYERS_BUILD_DIR)/compactor.o \
               $(UTILS_BUILD_DIR)/parallel.o \
+              $(UTILS_BUILD_DIR)/thread_pool.o \
+              $(UTILS_BUILD_DIR)/reed_solomon.o \
+              $(UTILS_BUILD_DIR)/buffer_pool.o \
+              $(UTILS_BUILD_DIR)/numa_policy.o \
+              $(UTILS_BUILD_DIR)/memory_budget.o \
+              $(UTILS_BUILD_DIR)/fiber.o \
+              $(UTILS_BUILD_DIR)/cpu.o \
+              $(UTILS_BUILD_DIR)/zero.o \
+              $(UTILS_BUILD_DIR)/group_commit.o \
+              $(UTILS_BUILD_DIR)/metadata_service.o \
+              $(UTILS_BUILD_DIR)/fd_table.o \
+              $(UTILS_BUILD_DIR)/layer_iov.o \
+              $(UTILS_BUILD_DIR)/invalidation.o \
+              $(UTILS_BUILD_DIR)/layer_async.o \
+              $(UTILS_BUILD_DIR)/lazy_layer.o \
+              $(UTILS_BUILD_DIR)/metrics.o \
+              $(UTILS_BUILD_DIR)/metrics_layer.o \
               $(UTILS_BUILD_DIR)/locking.o \
               $(UTILS_BUILD_DIR)/conversion.o \
               $(UTILS_BUILD_DIR)/hasher/hasher.o \
               $(UTILS_BUILD_DIR)/hasher/evp.o \
+              $(UTILS_BUILD_DIR)/hasher/hasher_context.o \
               $(UTILS_BUILD_DIR)/hasher/sha256_hasher.o \
+              $(UTILS_BUILD_DIR)/hasher/sha256_mb.o \
               $(UTILS_BUILD_DIR)/hasher/sha512_hasher.o \
+              $(UTILS_BUILD_DIR)/hasher/blake3.o \
+              $(UTILS_BUILD_DIR)/hasher/blake3_hasher.o \
+              $(UTILS_BUILD_DIR)/hasher/merkle_tree.o \
+              $(UTILS_BUILD_DIR)/hasher/chunk_hasher.o \
 
 # External library paths
 INVISIBLE_LIB_DIR = $(ROOT_DIR)/lib/invisible-storage-bindings
@@ -122,30 +249,89 @@ endef
 # Generate fallback rules for all shared objects
 $(eval $(call create_fallback_rule,$(ROOT_BUILD_DIR)/lib.o))
 $(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/local.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/local_uring.o))
 $(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/remote.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/transport.o))
 $(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/demultiplexer.o))
 $(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/passthrough_ops.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/read_policy.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/replica_check.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/replication.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/striping.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/erasure.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/attr_cache.o))
 $(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/anti_tampering.o))
 $(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/block_anti_tampering.o))
 $(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/anti_tampering_utils.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/merkle_anti_tampering.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/verify_cache.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/verified_blocks.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/async_commit.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/hash_reaper.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/scrubber.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/hash_manifest.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/manifest_anchor.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/dirty_journal.o))
 $(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/block_align.o))
 $(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/benchmark.o))
 $(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/read_cache.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/readahead.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/write_back.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/admission.o))
 $(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/compression.o))
 $(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/sparse_block.o))
 $(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/compression_utils.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/seekable.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/append_block.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/index_file.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/policy.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/block_cache.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/compactor.o))
 $(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/compressor.o))
 $(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/encryption.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/key_cache.o))
 $(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/aes_xts.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/aead.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/staging.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/memory.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/hash_store.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/dedup.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/qos.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/s3_parallel.o))
+$(eval $(call create_fallback_rule,$(LAYERS_BUILD_DIR)/ipfs_cache.o))
 $(eval $(call create_fallback_rule,$(ROOT_BUILD_DIR)/loader.o))
 $(eval $(call create_fallback_rule,$(ROOT_BUILD_DIR)/parser.o))
 $(eval $(call create_fallback_rule,$(ROOT_BUILD_DIR)/builder.o))
+$(eval $(call create_fallback_rule,$(ROOT_BUILD_DIR)/reload.o))
 $(eval $(call create_fallback_rule,$(ROOT_BUILD_DIR)/toml.o))
 $(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/locking.o))
 $(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/parallel.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/thread_pool.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/reed_solomon.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/buffer_pool.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/numa_policy.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/memory_budget.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/fiber.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/cpu.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/zero.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/group_commit.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/metadata_service.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/fd_table.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/layer_iov.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/invalidation.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/layer_async.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/lazy_layer.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/metrics.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/metrics_layer.o))
 $(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/hasher/hasher.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/hasher/hasher_context.o))
 $(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/hasher/sha256_hasher.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/hasher/sha256_mb.o))
 $(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/hasher/sha512_hasher.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/hasher/blake3.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/hasher/blake3_hasher.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/hasher/merkle_tree.o))
+$(eval $(call create_fallback_rule,$(UTILS_BUILD_DIR)/hasher/chunk_hasher.o))
 $(eval $(call create_fallback_rule,$(SERVICES_BUILD_DIR)/metadata.o))
 
 #==============================================================================
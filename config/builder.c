@@ -1,10 +1,55 @@
 #include "builder.h"
+#include "../logdef.h"
 #include "../shared/enums/layer_type.h"
 #include "../shared/types/layer_context.h"
+#include "../layers/invisible_storage/ipfs_opendal/ipfs_cache.h"
+#include "../layers/invisible_storage/s3_opendal/s3_parallel.h"
 #include "../shared/utils/hasher/hasher.h"
+#include "../shared/utils/lazy_layer.h"
+#include "../shared/utils/metrics_layer.h"
+#include "parser.h"
+#include "reload.h"
 #include "utils.h"
+#ifdef STATIC_PIPELINE
+#include "static_layers.h"
+#endif
+#include <pthread.h>
 #include <stddef.h>
 
+// Shared libraries of the init functions, opened on first use
+static pthread_mutex_t handles_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void *shared_handle;
+static void *external_handle;
+
+/*
+ * Configuration of a tree with lazy layers. build_layer_tree moves the
+ * configuration here (config is the first member, so the builder gets back
+ * to it from the Config *) and it is freed once the tree is built and every
+ * lazy layer is built or destroyed.
+ */
+typedef struct {
+  Config config;
+  int refs; // build_layer_tree and the lazy layers not built yet
+  pthread_mutex_t mutex;
+} SharedConfig;
+
+// Argument of the build of a lazy layer
+typedef struct {
+  SharedConfig *shared;
+  LayerConfig *layer_config;
+} LazyBuild;
+
+// A layer built on its own thread by build_layers
+typedef struct {
+  Config *config;
+  const char *name;
+  LayerContext result;
+  pthread_t thread;
+  int started;
+} BuildTask;
+
+static LayerContext build_layer(Config *config, const char *layer_name);
+
 /**
  * @brief Find layer configuration by name
  */
@@ -49,6 +94,16 @@ const char *get_layer_init_function(LayerType type) {
     return LAYER_READ_CACHE_INIT;
   case LAYER_ENCRYPTION:
     return LAYER_ENCRYPTION_INIT;
+  case LAYER_STAGING:
+    return LAYER_STAGING_INIT;
+  case LAYER_MEMORY:
+    return LAYER_MEMORY_INIT;
+  case LAYER_HASH_STORE:
+    return LAYER_HASH_STORE_INIT;
+  case LAYER_DEDUP:
+    return LAYER_DEDUP_INIT;
+  case LAYER_QOS:
+    return LAYER_QOS_INIT;
   default:
     toml_error("Unknown layer type");
     return NULL; // Should not be reached
@@ -58,21 +113,34 @@ const char *get_layer_init_function(LayerType type) {
 /**
  * @brief Load the init function for a layer specified by the layer type
  */
-static void *load_init_function(LayerType type) {
-  // Get the init function name from constants
-  const char *init_name = get_layer_init_function(type);
-
+static void *load_init_function_by_name(LayerType type,
+                                        const char *init_name) {
   // check if layer is external
   int is_external = (type == LAYER_S3_OPENDAL || type == LAYER_SOLANA ||
                      type == LAYER_IPFS_OPENDAL);
 
-  // load appropriate shared library based on layer type
-  void *layers_handle;
-  if (is_external) {
-    layers_handle = dlopen(EXTERNAL_LIB, RTLD_LAZY);
-  } else {
-    layers_handle = dlopen(SHARED_LIB, RTLD_LAZY);
+#ifdef STATIC_PIPELINE
+  // the layers are linked in the application with the builder
+  if (!is_external) {
+    void *layer_init = static_layer_init(init_name);
+    if (!layer_init) {
+      char buf[256];
+      (void)snprintf(buf, sizeof(buf), "Layer init %s not linked in",
+                     init_name);
+      toml_error(buf);
+    }
+    return layer_init;
+  }
+#endif
+
+  // load appropriate shared library based on layer type, once per library
+  pthread_mutex_lock(&handles_mutex);
+  void **handle = is_external ? &external_handle : &shared_handle;
+  if (!*handle) {
+    *handle = dlopen(is_external ? EXTERNAL_LIB : SHARED_LIB, RTLD_LAZY);
   }
+  void *layers_handle = *handle;
+  pthread_mutex_unlock(&handles_mutex);
 
   if (!layers_handle) {
     toml_error("Failed to load shared libraries");
@@ -91,8 +159,97 @@ static void *load_init_function(LayerType type) {
   return layer_init;
 }
 
+static void *load_init_function(LayerType type) {
+  // Get the init function name from constants
+  return load_init_function_by_name(type, get_layer_init_function(type));
+}
+
+static void *build_layer_worker(void *arg) {
+  BuildTask *task = (BuildTask *)arg;
+  task->result = build_layer(task->config, task->name);
+  return NULL;
+}
+
 /**
- * @brief Build a single layer and its dependencies
+ * @brief Build independent layers, in parallel with parallel_init
+ *
+ * The first layer is built on the calling thread, the others on a thread
+ * each (inline if the thread cannot be started).
+ */
+static void build_layers(Config *config, char *const *names, int n,
+                         LayerContext *out) {
+  BuildTask *tasks = NULL;
+  if (config->parallel_init && n > 1) {
+    tasks = calloc(n, sizeof(BuildTask));
+  }
+  if (!tasks) {
+    for (int i = 0; i < n; i++) {
+      out[i] = build_layer(config, names[i]);
+    }
+    return;
+  }
+
+  for (int i = 1; i < n; i++) {
+    tasks[i].config = config;
+    tasks[i].name = names[i];
+    tasks[i].started = pthread_create(&tasks[i].thread, NULL,
+                                      build_layer_worker, &tasks[i]) == 0;
+  }
+  out[0] = build_layer(config, names[0]);
+  for (int i = 1; i < n; i++) {
+    if (tasks[i].started) {
+      pthread_join(tasks[i].thread, NULL);
+    } else {
+      tasks[i].result = build_layer(config, names[i]);
+    }
+    out[i] = tasks[i].result;
+  }
+  free(tasks);
+}
+
+static void release_shared_config(SharedConfig *shared) {
+  pthread_mutex_lock(&shared->mutex);
+  int refs = --shared->refs;
+  pthread_mutex_unlock(&shared->mutex);
+  if (refs == 0) {
+    free_config(&shared->config);
+    pthread_mutex_destroy(&shared->mutex);
+    free(shared);
+  }
+}
+
+static LayerContext build_layer_config(Config *config,
+                                       LayerConfig *layer_config);
+
+static LayerContext build_lazy_layer(void *arg) {
+  LazyBuild *lazy = (LazyBuild *)arg;
+  DEBUG_MSG("[BUILDER] Building lazy layer %s", lazy->layer_config->name);
+  return build_layer_config(&lazy->shared->config, lazy->layer_config);
+}
+
+static void release_lazy_layer(void *arg) {
+  LazyBuild *lazy = (LazyBuild *)arg;
+  release_shared_config(lazy->shared);
+  free(lazy);
+}
+
+/**
+ * @brief Wrap a built layer in a metrics layer when the tree is timed
+ */
+static LayerContext with_metrics(const Config *config, LayerContext l,
+                                 const char *layer_name) {
+  if (!config->metrics) {
+    return l;
+  }
+  LayerContext timed = metrics_layer_init(&l, layer_name);
+  if (!timed.ops) {
+    toml_error("Failed to create metrics layer");
+  }
+  return timed;
+}
+
+/**
+ * @brief Build a single layer and its dependencies, or a lazy layer for it
  */
 static LayerContext build_layer(Config *config, const char *layer_name) {
   LayerConfig *layer_config = find_layer_config(config, layer_name);
@@ -101,21 +258,69 @@ static LayerContext build_layer(Config *config, const char *layer_name) {
     (void)snprintf(buf, sizeof(buf), "Layer not found: %s", layer_name);
     toml_error(buf);
   }
+  if (!layer_config->lazy) {
+    LayerContext l = build_layer_config(config, layer_config);
+    reload_track_layer(layer_name, l);
+    return with_metrics(config, l, layer_name);
+  }
 
+  // config is the one moved by build_layer_tree
+  SharedConfig *shared = (SharedConfig *)config;
+  LazyBuild *lazy = malloc(sizeof(LazyBuild));
+  if (!lazy) {
+    toml_error("Failed to allocate memory for lazy layer");
+  }
+  lazy->shared = shared;
+  lazy->layer_config = layer_config;
+  pthread_mutex_lock(&shared->mutex);
+  shared->refs++;
+  pthread_mutex_unlock(&shared->mutex);
+  LayerContext l =
+      lazy_layer_init(build_lazy_layer, release_lazy_layer, lazy);
+  if (!l.ops) {
+    toml_error("Failed to create lazy layer");
+  }
+  return with_metrics(config, l, layer_name);
+}
+
+/**
+ * @brief Build the layer of a configuration and its dependencies
+ */
+static LayerContext build_layer_config(Config *config,
+                                       LayerConfig *layer_config) {
   // Handle each layer type with its specific initialization signature
   switch (layer_config->type) {
   case LAYER_LOCAL: {
     // Local layer has no dependencies
+    if (layer_config->params.local.mode == LOCAL_MODE_URING) {
+      LayerContext (*init)(LocalConfig *) = load_init_function_by_name(
+          layer_config->type, LAYER_LOCAL_URING_INIT);
+      return init(&layer_config->params.local);
+    }
     LayerContext (*init)() = load_init_function(layer_config->type);
     return init();
   }
 
   case LAYER_REMOTE: {
     // Remote layer has no dependencies
+    LayerContext (*init)(const RemoteConfig *) =
+        load_init_function(layer_config->type);
+    return init(&layer_config->params.remote);
+  }
+
+  case LAYER_MEMORY: {
+    // Memory layer has no dependencies
     LayerContext (*init)() = load_init_function(layer_config->type);
     return init();
   }
 
+  case LAYER_HASH_STORE: {
+    // Hash store layer has no dependencies
+    LayerContext (*init)(const HashStoreConfig *) =
+        load_init_function(layer_config->type);
+    return init(&layer_config->params.hash_store);
+  }
+
   case LAYER_BLOCK_ALIGN: {
     // Block_align layer takes a single next layer as dependency
     const char *next_layer = layer_config->params.block_align.next_Layer;
@@ -123,9 +328,9 @@ static LayerContext build_layer(Config *config, const char *layer_name) {
       toml_error("Block_align layer must have a 'next' layer");
     }
     LayerContext next_ctx = build_layer(config, next_layer);
-    LayerContext (*init)(LayerContext *, int, size_t) =
+    LayerContext (*init)(LayerContext *, int, const BlockAlignConfig *) =
         load_init_function(layer_config->type);
-    return init(&next_ctx, 1, layer_config->params.block_align.block_size);
+    return init(&next_ctx, 1, &layer_config->params.block_align);
   }
 
   case LAYER_BENCHMARK: {
@@ -138,10 +343,16 @@ static LayerContext build_layer(Config *config, const char *layer_name) {
       toml_error("Benchmark layer must have a 'reps' parameter, and it must be "
                  "greater than 0.");
     }
+    if (layer_config->params.benchmark.mode == BENCHMARK_MODE_TRACE &&
+        !layer_config->params.benchmark.trace) {
+      toml_error("Benchmark layer in trace mode must have a 'trace' file");
+    }
+    BenchmarkConfig params = layer_config->params.benchmark;
+    params.name = layer_config->name;
     LayerContext next_ctx = build_layer(config, next_layer);
-    LayerContext (*init)(LayerContext *, int, int) =
+    LayerContext (*init)(LayerContext *, int, const BenchmarkConfig *) =
         load_init_function(layer_config->type);
-    return init(&next_ctx, 1, layer_config->params.benchmark.ops_reps);
+    return init(&next_ctx, 1, &params);
   }
 
   case LAYER_READ_CACHE: {
@@ -150,10 +361,9 @@ static LayerContext build_layer(Config *config, const char *layer_name) {
       toml_error("Read_Cache layer must have a 'next' layer");
     }
     LayerContext next_ctx = build_layer(config, next_layer);
-    LayerContext (*init)(LayerContext *, int, size_t, size_t) =
+    LayerContext (*init)(LayerContext *, int, const ReadCacheLayerConfig *) =
         load_init_function(layer_config->type);
-    return init(&next_ctx, 1, layer_config->params.read_cache.block_size,
-                layer_config->params.read_cache.num_blocks);
+    return init(&next_ctx, 1, &layer_config->params.read_cache);
   }
 
   case LAYER_S3_OPENDAL: {
@@ -161,20 +371,30 @@ static LayerContext build_layer(Config *config, const char *layer_name) {
     LayerContext (*init)(const char *, const char *, const char *, const char *,
                          const char *, const char *) =
         load_init_function(layer_config->type);
-    return init(layer_config->params.s3_opendal.endpoint,
-                layer_config->params.s3_opendal.access_key_id,
-                layer_config->params.s3_opendal.secret_access_key,
-                layer_config->params.s3_opendal.region,
-                layer_config->params.s3_opendal.bucket,
-                layer_config->params.s3_opendal.root);
+    LayerContext s3 = init(layer_config->params.s3_opendal.endpoint,
+                           layer_config->params.s3_opendal.access_key_id,
+                           layer_config->params.s3_opendal.secret_access_key,
+                           layer_config->params.s3_opendal.region,
+                           layer_config->params.s3_opendal.bucket,
+                           layer_config->params.s3_opendal.root);
+    // Large transfers split over several connections
+    if (layer_config->params.s3_opendal.connections > 1) {
+      return s3_parallel_init(&s3, &layer_config->params.s3_opendal);
+    }
+    return s3;
   }
 
   case LAYER_IPFS_OPENDAL: {
     // IPFS layer takes configuration parameters
     LayerContext (*init)(const char *, const char *) =
         load_init_function(layer_config->type);
-    return init(layer_config->params.ipfs_opendal.api_endpoint,
-                layer_config->params.ipfs_opendal.root);
+    LayerContext ipfs = init(layer_config->params.ipfs_opendal.api_endpoint,
+                             layer_config->params.ipfs_opendal.root);
+    // Objects read again come from a local cache
+    if (layer_config->params.ipfs_opendal.cache_dir) {
+      return ipfs_cache_init(&ipfs, &layer_config->params.ipfs_opendal);
+    }
+    return ipfs;
   }
   case LAYER_SOLANA: {
     // Solana layer takes configuration parameters
@@ -185,10 +405,23 @@ static LayerContext build_layer(Config *config, const char *layer_name) {
   }
 
   case LAYER_ANTI_TAMPERING: {
-    LayerContext data_layer =
-        build_layer(config, layer_config->params.anti_tampering.data_layer);
-    LayerContext hash_layer =
-        build_layer(config, layer_config->params.anti_tampering.hash_layer);
+    // the manifest roots are anchored in their own layer (e.g. Solana)
+    AntiTamperingConfig *at = &layer_config->params.anti_tampering;
+    char *names[3] = {at->data_layer, at->hash_layer, at->anchor_layer};
+    LayerContext layers[3];
+    build_layers(config, names, at->anchor_layer ? 3 : 2, layers);
+    LayerContext data_layer = layers[0];
+    LayerContext hash_layer = layers[1];
+    if (at->anchor_layer) {
+      at->anchor = layers[2];
+    }
+
+    // chunk hashing uses the metadata service background threads
+    if (config->serviceConfig &&
+        config->serviceConfig->type == SERVICE_METADATA) {
+      layer_config->params.anti_tampering.hash_threads =
+          config->serviceConfig->service.metadata.num_background_threads;
+    }
 
     LayerContext (*init)(LayerContext, LayerContext,
                          const AntiTamperingConfig *) =
@@ -218,16 +451,17 @@ static LayerContext build_layer(Config *config, const char *layer_name) {
 
     int *passthrough_reads = malloc(sizeof(int) * n_layers);
     int *passthrough_writes = malloc(sizeof(int) * n_layers);
-    int *enforced_layers = malloc(sizeof(int) * n_enforced_layers);
+    int *enforced_layers = malloc(sizeof(int) * n_layers);
 
     LayerContext *layers = malloc(sizeof(LayerContext) * n_layers);
     if (!layers) {
       toml_error("Failed to allocate memory for demultiplexer layers");
     }
 
+    build_layers(config, layer_config->params.demultiplexer.layers, n_layers,
+                 layers);
     for (int i = 0; i < n_layers; i++) {
       char *next_layer_name = layer_config->params.demultiplexer.layers[i];
-      layers[i] = build_layer(config, next_layer_name);
 
       // Check if layer name exists in passthrough arrays
       passthrough_reads[i] = is_layer_in_array(
@@ -238,10 +472,12 @@ static LayerContext build_layer(Config *config, const char *layer_name) {
           enforced_layers_names, n_enforced_layers, next_layer_name);
     }
 
-    LayerContext (*init)(LayerContext *, int, int *, int *, int *) =
+    LayerContext (*init)(LayerContext *, int, int *, int *, int *,
+                         const DemultiplexerConfig *) =
         load_init_function(layer_config->type);
-    LayerContext result = init(layers, n_layers, passthrough_reads,
-                               passthrough_writes, enforced_layers);
+    LayerContext result =
+        init(layers, n_layers, passthrough_reads, passthrough_writes,
+             enforced_layers, &layer_config->params.demultiplexer);
 
     free(passthrough_reads);
     free(passthrough_writes);
@@ -274,6 +510,42 @@ static LayerContext build_layer(Config *config, const char *layer_name) {
     return init(&next_ctx, &layer_config->params.encryption);
   }
 
+  case LAYER_STAGING: {
+    // Staging layer takes a single next layer as dependency
+    const char *next_layer = layer_config->params.staging.next_layer;
+    if (!next_layer) {
+      toml_error("Staging layer must have a 'next' layer");
+    }
+    LayerContext next_ctx = build_layer(config, next_layer);
+    LayerContext (*init)(LayerContext *, const StagingConfig *) =
+        load_init_function(layer_config->type);
+    return init(&next_ctx, &layer_config->params.staging);
+  }
+
+  case LAYER_DEDUP: {
+    // Dedup layer takes a single next layer as dependency
+    const char *next_layer = layer_config->params.dedup.next_layer;
+    if (!next_layer) {
+      toml_error("Dedup layer must have a 'next' layer");
+    }
+    LayerContext next_ctx = build_layer(config, next_layer);
+    LayerContext (*init)(LayerContext *, const DedupConfig *) =
+        load_init_function(layer_config->type);
+    return init(&next_ctx, &layer_config->params.dedup);
+  }
+
+  case LAYER_QOS: {
+    // QoS layer takes a single next layer as dependency
+    const char *next_layer = layer_config->params.qos.next_layer;
+    if (!next_layer) {
+      toml_error("QoS layer must have a 'next' layer");
+    }
+    LayerContext next_ctx = build_layer(config, next_layer);
+    LayerContext (*init)(LayerContext *, const QosConfig *) =
+        load_init_function(layer_config->type);
+    return init(&next_ctx, &layer_config->params.qos);
+  }
+
   default:
     toml_error("Unknown layer type");
     exit(1); // Should not be reached
@@ -281,5 +553,25 @@ static LayerContext build_layer(Config *config, const char *layer_name) {
 }
 
 LayerContext build_layer_tree(Config *config) {
-  return build_layer(config, config->root_layer);
+  int lazy = 0;
+  for (int i = 0; i < config->n_layers; i++) {
+    lazy |= config->layers[i].lazy;
+  }
+  if (!lazy) {
+    return build_layer(config, config->root_layer);
+  }
+
+  // the lazy layers build their subtrees after the caller frees config
+  SharedConfig *shared = malloc(sizeof(SharedConfig));
+  if (!shared) {
+    toml_error("Failed to allocate memory for the configuration");
+  }
+  shared->config = *config;
+  shared->refs = 1;
+  pthread_mutex_init(&shared->mutex, NULL);
+  memset(config, 0, sizeof(Config));
+
+  LayerContext root = build_layer(&shared->config, shared->config.root_layer);
+  release_shared_config(shared);
+  return root;
 }
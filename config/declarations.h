@@ -19,13 +19,17 @@ typedef struct layer_context LayerContext;
 #include "../layers/block_align/config.h"
 #include "../layers/cache/read_cache/config.h"
 #include "../layers/compression/config.h"
+#include "../layers/dedup/config.h"
 #include "../layers/demultiplexer/config.h"
 #include "../layers/encryption/config.h"
+#include "../layers/hash_store/config.h"
 #include "../layers/invisible_storage/ipfs_opendal/config.h"
 #include "../layers/invisible_storage/s3_opendal/config.h"
 #include "../layers/invisible_storage/solana/config.h"
 #include "../layers/local/config.h"
+#include "../layers/qos/config.h"
 #include "../layers/remote/config.h"
+#include "../layers/staging/config.h"
 
 #define LAYER_DEPS "layer_dependencies"
 #define SHARED_LIB "libmodular.so"
@@ -49,12 +53,17 @@ typedef union {
   BenchmarkConfig benchmark;
   ReadCacheLayerConfig read_cache;
   EncryptionConfig encryption;
+  StagingConfig staging;
+  HashStoreConfig hash_store;
+  DedupConfig dedup;
+  QosConfig qos;
 } LayerParams;
 
 // New layer configuration structure
 typedef struct layer_config {
   char *name;
   LayerType type;
+  int lazy;           // built on its first operation (lazy_layer.h)
   LayerParams params; // type-specific parameters
 } LayerConfig;
 
@@ -64,6 +73,26 @@ typedef struct {
   LayerConfig *layers; // array of layer configurations
   int n_layers;        // number of layers
   LogMode log_mode;    // logging mode
+  int hugepages;       // back large scratch buffers with hugepages
+  int parallel_init;   // build independent subtrees on their own threads
+  int log_async;       // debug, info and warn messages drained on a thread
+  int log_rate_limit;  // messages a second of hot path call sites, 0: all
+  char *metrics;       // address the metrics are served on, NULL for none
+
+  // memory_budget.h: MiB all the accounts may take, 0 for no limit, and the
+  // budgets of some of them
+  size_t memory_limit_mb;
+  char **memory_budget_names;
+  size_t *memory_budget_mb;
+  int n_memory_budgets;
+
+  // cpu.h: features the kernels must not use, and the implementations some
+  // kernels must use
+  unsigned cpu_disabled;
+  char **cpu_kernel_names;
+  char **cpu_kernel_impls;
+  int n_cpu_kernels;
+
   ServiceConfig *serviceConfig;
 } Config;
 
@@ -1,10 +1,87 @@
 #include "loader.h"
 #include "../logdef.h"
 #include "../shared/types/layer_context.h"
+#include "../shared/utils/buffer_pool.h"
+#include "../shared/utils/cpu.h"
+#include "../shared/utils/memory_budget.h"
+#include "../shared/utils/metadata_service.h"
+#include "../shared/utils/numa_policy.h"
+#include "../shared/utils/metrics.h"
 #include "builder.h"
 #include "parser.h"
+#include "reload.h"
 #include "utils.h"
 
+/**
+ * @brief  Builds the layers of a parsed configuration and frees it
+ *
+ * @param conf          -> parsed toml configuration
+ * @return LayerContext -> built layers
+ */
+static LayerContext load_config(toml_result_t conf) {
+  if (!conf.ok) {
+    toml_error("Failed to parse TOML file");
+  }
+
+  // Parse the configuration
+  Config config = parse_config(conf.toptab);
+
+  // Initialize logging
+  LOG_INIT(config.log_mode);
+  LogOptions log_options = {.async = config.log_async,
+                            .rate_limit = (unsigned)config.log_rate_limit};
+  LOG_CONFIGURE(&log_options);
+  DEBUG_MSG("Log mode integer: %d", config.log_mode);
+  if (config.hugepages) {
+    (void)buffer_pool_configure_shared(BUFFER_POOL_HUGEPAGES);
+  }
+  if (config.serviceConfig &&
+      config.serviceConfig->type == SERVICE_METADATA &&
+      config.serviceConfig->service.metadata.numa) {
+    // before any pool starts; on error the process runs on a single node
+    (void)numa_policy_configure(
+        config.serviceConfig->service.metadata.numa_node_mask);
+  }
+  if (config.serviceConfig &&
+      config.serviceConfig->type == SERVICE_METADATA) {
+    (void)metadata_service_configure(&config.serviceConfig->service.metadata);
+  }
+  // before the layers pick their kernels
+  cpu_configure(config.cpu_disabled);
+  for (int i = 0; i < config.n_cpu_kernels; i++) {
+    if (cpu_kernel_override(config.cpu_kernel_names[i],
+                            config.cpu_kernel_impls[i]) != 0) {
+      WARN_MSG("CPU kernel %s ignored: name too long or too many kernels",
+               config.cpu_kernel_names[i]);
+    }
+  }
+  char features[64];
+  cpu_feature_names(cpu_features(), features, sizeof(features));
+  INFO_MSG("[CPU] Kernels may use: %s", features);
+  // before the layers size their caches
+  memory_budget_configure(config.memory_limit_mb * 1024 * 1024);
+  for (int i = 0; i < config.n_memory_budgets; i++) {
+    if (memory_budget_set(config.memory_budget_names[i],
+                          config.memory_budget_mb[i] * 1024 * 1024) != 0) {
+      WARN_MSG("Memory budget %s ignored: name too long or too many budgets",
+               config.memory_budget_names[i]);
+    }
+  }
+  if (config.metrics) {
+    // the tree still works without its exporter, the error is logged
+    (void)metrics_serve(config.metrics);
+  }
+  // Build the layer tree starting from root
+  reload_track_begin();
+  LayerContext result = build_layer_tree(&config);
+
+  // Cleanup, the parsed file is kept for the reloads to compare with
+  free_config(&config);
+  reload_track_end(conf, result);
+
+  return result;
+}
+
 /**
  * @brief  Loads configuration file and builds the necessary layers
  *
@@ -27,22 +104,15 @@ LayerContext load_config_toml(char *filepath) {
   toml_result_t conf = toml_parse_file(fp);
   (void)fclose(fp);
 
-  if (!conf.ok) {
-    toml_error("Failed to parse TOML file");
-  }
-
-  // Parse the configuration
-  Config config = parse_config(conf.toptab);
-
-  // Initialize logging
-  LOG_INIT(config.log_mode);
-  DEBUG_MSG("Log mode integer: %d", config.log_mode);
-  // Build the layer tree starting from root
-  LayerContext result = build_layer_tree(&config);
-
-  // Cleanup
-  free_config(&config);
-  toml_free(conf);
+  return load_config(conf);
+}
 
-  return result;
+/**
+ * @brief  Builds the layers of a configuration held in memory
+ *
+ * @param toml          -> toml configuration text
+ * @return LayerContext -> built layers
+ */
+LayerContext load_config_toml_string(const char *toml) {
+  return load_config(toml_parse(toml, (int)strlen(toml)));
 }
@@ -3,5 +3,6 @@
 #include "../shared/types/layer_context.h"
 
 LayerContext load_config_toml(char *filepath);
+LayerContext load_config_toml_string(const char *toml);
 
 #endif // __CONFIG_LOADER_H__
@@ -1,7 +1,9 @@
 #include "parser.h"
 #include "lib/tomlc17/src/tomlc17.h"
 #include "types/services_context.h"
+#include "utils/cpu.h"
 #include "utils.h"
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h> // For strcasecmp
@@ -34,6 +36,16 @@ static LayerType string_to_layer_type(const char *type_str) {
     return LAYER_READ_CACHE;
   if (strcmp(type_str, "encryption") == 0)
     return LAYER_ENCRYPTION;
+  if (strcmp(type_str, "staging") == 0)
+    return LAYER_STAGING;
+  if (strcmp(type_str, "memory") == 0)
+    return LAYER_MEMORY;
+  if (strcmp(type_str, "hash_store") == 0)
+    return LAYER_HASH_STORE;
+  if (strcmp(type_str, "dedup") == 0)
+    return LAYER_DEDUP;
+  if (strcmp(type_str, "qos") == 0)
+    return LAYER_QOS;
 
   char buf[256];
   (void)snprintf(buf, sizeof(buf), "Unknown layer type: %s", type_str);
@@ -102,6 +114,29 @@ static ServiceConfig *parse_service_config(toml_datum_t service_table) {
     config->type = SERVICE_METADATA;
     config->service.metadata.cache_size_bytes = (size_t)cache_size;
     config->service.metadata.num_background_threads = (size_t)threads;
+
+    // Optional: NUMA placement of the workers and buffers
+    config->service.metadata.numa = 0;
+    config->service.metadata.numa_node_mask = 0;
+    toml_datum_t numa_d = toml_get(service_table, "numa");
+    if (numa_d.type == TOML_BOOLEAN) {
+      config->service.metadata.numa = numa_d.u.boolean;
+    } else if (numa_d.type != TOML_UNKNOWN) {
+      toml_error("services numa must be a boolean");
+    }
+    toml_datum_t nodes_d = toml_get(service_table, "numa_nodes");
+    if (nodes_d.type == TOML_ARRAY) {
+      for (int i = 0; i < nodes_d.u.arr.size; i++) {
+        toml_datum_t node = nodes_d.u.arr.elem[i];
+        if (node.type != TOML_INT64 || node.u.int64 < 0 ||
+            node.u.int64 >= (int64_t)(8 * sizeof(unsigned long))) {
+          toml_error("services numa_nodes must be node ids from 0 to 63");
+        }
+        config->service.metadata.numa_node_mask |= 1UL << node.u.int64;
+      }
+    } else if (nodes_d.type != TOML_UNKNOWN) {
+      toml_error("services numa_nodes must be an array of node ids");
+    }
     break;
   }
   }
@@ -149,6 +184,20 @@ static void parse_layer_params(toml_datum_t layer_table, LayerType type,
   case LAYER_ENCRYPTION:
     encryption_parse_params(layer_table, &params->encryption);
     break;
+  case LAYER_STAGING:
+    staging_parse_params(layer_table, &params->staging);
+    break;
+  case LAYER_MEMORY:
+    break; // no parameters
+  case LAYER_HASH_STORE:
+    hash_store_parse_params(layer_table, &params->hash_store);
+    break;
+  case LAYER_DEDUP:
+    dedup_parse_params(layer_table, &params->dedup);
+    break;
+  case LAYER_QOS:
+    qos_parse_params(layer_table, &params->qos);
+    break;
   }
 }
 
@@ -172,6 +221,14 @@ static LayerConfig parse_layer_config(const char *layer_name,
   }
   config.type = string_to_layer_type(type_datum.u.s);
 
+  // Optional: build the layer on its first operation instead of at init
+  toml_datum_t lazy = toml_get(layer_table, "lazy");
+  if (lazy.type == TOML_BOOLEAN) {
+    config.lazy = lazy.u.boolean;
+  } else if (lazy.type != TOML_UNKNOWN) {
+    toml_error("lazy must be a boolean");
+  }
+
   // Parse type-specific parameters (including layer references)
   parse_layer_params(layer_table, config.type, &config.params);
 
@@ -206,18 +263,136 @@ Config parse_config(toml_datum_t root_table) {
   // Convert log mode string to LogMode enum
   config.log_mode = string_to_log_mode(log_mode.u.s);
 
+  // Optional: large scratch buffers of the layers on hugepages
+  toml_datum_t hugepages = toml_get(root_table, "hugepages");
+  if (hugepages.type == TOML_BOOLEAN) {
+    config.hugepages = hugepages.u.boolean;
+  } else if (hugepages.type != TOML_UNKNOWN) {
+    toml_error("hugepages must be a boolean");
+  }
+
+  // Optional: build independent subtrees of the tree in parallel
+  toml_datum_t parallel_init = toml_get(root_table, "parallel_init");
+  if (parallel_init.type == TOML_BOOLEAN) {
+    config.parallel_init = parallel_init.u.boolean;
+  } else if (parallel_init.type != TOML_UNKNOWN) {
+    toml_error("parallel_init must be a boolean");
+  }
+
+  // Optional: asynchronous logging and the rate of hot path messages
+  toml_datum_t log_async = toml_get(root_table, "log_async");
+  if (log_async.type == TOML_BOOLEAN) {
+    config.log_async = log_async.u.boolean;
+  } else if (log_async.type != TOML_UNKNOWN) {
+    toml_error("log_async must be a boolean");
+  }
+  toml_datum_t log_rate_limit = toml_get(root_table, "log_rate_limit");
+  if (log_rate_limit.type == TOML_INT64 && log_rate_limit.u.int64 >= 0 &&
+      log_rate_limit.u.int64 <= INT_MAX) {
+    config.log_rate_limit = (int)log_rate_limit.u.int64;
+  } else if (log_rate_limit.type != TOML_UNKNOWN) {
+    toml_error("log_rate_limit must be a non-negative integer");
+  }
+
+  // Optional: time the layers and serve their metrics
+  toml_datum_t metrics = toml_get(root_table, "metrics");
+  if (metrics.type == TOML_STRING) {
+    config.metrics = strdup(metrics.u.s);
+    if (!config.metrics) {
+      toml_error("Failed to duplicate metrics address");
+    }
+  } else if (metrics.type != TOML_UNKNOWN) {
+    toml_error("metrics must be an address: tcp:HOST:PORT or unix:PATH");
+  }
+
+  // Optional: memory the caches and queues of the layers may take
+  toml_datum_t memory_limit = toml_get(root_table, "memory_limit_mb");
+  if (memory_limit.type == TOML_INT64 && memory_limit.u.int64 >= 0) {
+    config.memory_limit_mb = (size_t)memory_limit.u.int64;
+  } else if (memory_limit.type != TOML_UNKNOWN) {
+    toml_error("memory_limit_mb must be a non-negative integer");
+  }
+  toml_datum_t budgets = toml_get(root_table, "memory_budgets");
+  if (budgets.type == TOML_TABLE && budgets.u.tab.size > 0) {
+    config.n_memory_budgets = budgets.u.tab.size;
+    config.memory_budget_names = calloc(budgets.u.tab.size, sizeof(char *));
+    config.memory_budget_mb = calloc(budgets.u.tab.size, sizeof(size_t));
+    if (!config.memory_budget_names || !config.memory_budget_mb) {
+      toml_error("Failed to allocate memory for memory budgets");
+    }
+    for (int i = 0; i < budgets.u.tab.size; i++) {
+      toml_datum_t budget = budgets.u.tab.value[i];
+      if (budget.type != TOML_INT64 || budget.u.int64 < 0) {
+        toml_error("memory_budgets must map account names to MiB");
+      }
+      config.memory_budget_names[i] = strdup(budgets.u.tab.key[i]);
+      if (!config.memory_budget_names[i]) {
+        toml_error("Failed to duplicate memory budget name");
+      }
+      config.memory_budget_mb[i] = (size_t)budget.u.int64;
+    }
+  } else if (budgets.type != TOML_UNKNOWN && budgets.type != TOML_TABLE) {
+    toml_error("memory_budgets must be a table of account names to MiB");
+  }
+
+  // Optional: CPU features and kernels, for A/B benchmarks
+  toml_datum_t cpu_disable = toml_get(root_table, "cpu_disable");
+  if (cpu_disable.type == TOML_ARRAY) {
+    for (int i = 0; i < cpu_disable.u.arr.size; i++) {
+      toml_datum_t feature = cpu_disable.u.arr.elem[i];
+      unsigned flag =
+          feature.type == TOML_STRING ? cpu_feature(feature.u.s) : 0;
+      if (flag == 0) {
+        toml_error("cpu_disable must list features among avx2, avx512, sha, "
+                   "vaes and neon");
+      }
+      config.cpu_disabled |= flag;
+    }
+  } else if (cpu_disable.type != TOML_UNKNOWN) {
+    toml_error("cpu_disable must be an array of feature names");
+  }
+  toml_datum_t cpu_kernels = toml_get(root_table, "cpu_kernels");
+  if (cpu_kernels.type == TOML_TABLE && cpu_kernels.u.tab.size > 0) {
+    config.n_cpu_kernels = cpu_kernels.u.tab.size;
+    config.cpu_kernel_names = calloc(cpu_kernels.u.tab.size, sizeof(char *));
+    config.cpu_kernel_impls = calloc(cpu_kernels.u.tab.size, sizeof(char *));
+    if (!config.cpu_kernel_names || !config.cpu_kernel_impls) {
+      toml_error("Failed to allocate memory for CPU kernels");
+    }
+    for (int i = 0; i < cpu_kernels.u.tab.size; i++) {
+      toml_datum_t impl = cpu_kernels.u.tab.value[i];
+      if (impl.type != TOML_STRING) {
+        toml_error("cpu_kernels must map kernel names to implementations");
+      }
+      config.cpu_kernel_names[i] = strdup(cpu_kernels.u.tab.key[i]);
+      config.cpu_kernel_impls[i] = strdup(impl.u.s);
+      if (!config.cpu_kernel_names[i] || !config.cpu_kernel_impls[i]) {
+        toml_error("Failed to duplicate CPU kernel name");
+      }
+    }
+  } else if (cpu_kernels.type != TOML_UNKNOWN &&
+             cpu_kernels.type != TOML_TABLE) {
+    toml_error("cpu_kernels must be a table of kernel names to "
+               "implementations");
+  }
+
   toml_datum_t service_table = toml_get(root_table, "services");
   if (service_table.type == TOML_UNKNOWN)
     config.serviceConfig = NULL;
   else
     config.serviceConfig = parse_service_config(service_table);
 
-  // Count non-root, non-log_mode keys (layer definitions)
+  // Count the keys that aren't global settings (layer definitions)
   config.n_layers = 0;
   for (int i = 0; i < root_table.u.tab.size; i++) {
     const char *key = root_table.u.tab.key[i];
     if (strcmp(key, "root") != 0 && strcmp(key, "log_mode") != 0 &&
-        strcmp(key, "services") != 0) {
+        strcmp(key, "services") != 0 && strcmp(key, "hugepages") != 0 &&
+        strcmp(key, "parallel_init") != 0 && strcmp(key, "log_async") != 0 &&
+        strcmp(key, "log_rate_limit") != 0 && strcmp(key, "metrics") != 0 &&
+        strcmp(key, "memory_limit_mb") != 0 &&
+        strcmp(key, "memory_budgets") != 0 &&
+        strcmp(key, "cpu_disable") != 0 && strcmp(key, "cpu_kernels") != 0) {
       config.n_layers++;
     }
   }
@@ -237,7 +412,12 @@ Config parse_config(toml_datum_t root_table) {
   for (int i = 0; i < root_table.u.tab.size; i++) {
     const char *key = root_table.u.tab.key[i];
     if (strcmp(key, "root") == 0 || strcmp(key, "log_mode") == 0 ||
-        strcmp(key, "services") == 0)
+        strcmp(key, "services") == 0 || strcmp(key, "hugepages") == 0 ||
+        strcmp(key, "parallel_init") == 0 || strcmp(key, "log_async") == 0 ||
+        strcmp(key, "log_rate_limit") == 0 || strcmp(key, "metrics") == 0 ||
+        strcmp(key, "memory_limit_mb") == 0 ||
+        strcmp(key, "memory_budgets") == 0 ||
+        strcmp(key, "cpu_disable") == 0 || strcmp(key, "cpu_kernels") == 0)
       continue;
 
     toml_datum_t layer_datum = root_table.u.tab.value[i];
@@ -254,6 +434,26 @@ Config parse_config(toml_datum_t root_table) {
   return config;
 }
 
+/**
+ * @brief Parse the entire configuration, failing instead of exiting
+ *
+ * The parameters of a rejected configuration that were already parsed are
+ * not freed: this is for reloads, few and far between.
+ */
+int parse_config_checked(toml_datum_t root_table, Config *config, char *error,
+                         size_t error_size) {
+  jmp_buf failed;
+  if (setjmp(failed) != 0) {
+    toml_error_jmp = NULL;
+    (void)snprintf(error, error_size, "%s", toml_error_msg);
+    return -1;
+  }
+  toml_error_jmp = &failed;
+  *config = parse_config(root_table);
+  toml_error_jmp = NULL;
+  return 0;
+}
+
 /**
  * @brief Free configuration data structures
  */
@@ -264,6 +464,18 @@ void free_config(Config *config) {
   if (config->root_layer) {
     free(config->root_layer);
   }
+  free(config->metrics);
+  for (int i = 0; i < config->n_memory_budgets; i++) {
+    free(config->memory_budget_names[i]);
+  }
+  free(config->memory_budget_names);
+  free(config->memory_budget_mb);
+  for (int i = 0; i < config->n_cpu_kernels; i++) {
+    free(config->cpu_kernel_names[i]);
+    free(config->cpu_kernel_impls[i]);
+  }
+  free(config->cpu_kernel_names);
+  free(config->cpu_kernel_impls);
 
   for (int i = 0; i < config->n_layers; i++) {
     LayerConfig *layer = &config->layers[i];
@@ -292,6 +504,13 @@ void free_config(Config *config) {
         free(layer->params.ipfs_opendal.api_endpoint);
       if (layer->params.ipfs_opendal.root)
         free(layer->params.ipfs_opendal.root);
+      free(layer->params.ipfs_opendal.cache_dir);
+      break;
+    case LAYER_REMOTE:
+      if (layer->params.remote.host)
+        free(layer->params.remote.host);
+      if (layer->params.remote.shm_path)
+        free(layer->params.remote.shm_path);
       break;
     case LAYER_SOLANA:
       if (layer->params.solana.keypair_path)
@@ -306,6 +525,16 @@ void free_config(Config *config) {
         free(layer->params.anti_tampering.hash_layer);
       if (layer->params.anti_tampering.hashes_storage)
         free(layer->params.anti_tampering.hashes_storage);
+      free(layer->params.anti_tampering.anchor_layer);
+      free(layer->params.anti_tampering.scrub_root);
+      free(layer->params.anti_tampering.cleanup_journal);
+      free(layer->params.anti_tampering.dirty_journal);
+      for (int r = 0; r < layer->params.anti_tampering.nblock_size_rules;
+           r++) {
+        free(layer->params.anti_tampering.block_size_rules[r].path_prefix);
+        free(layer->params.anti_tampering.block_size_rules[r].suffix);
+      }
+      free(layer->params.anti_tampering.block_size_rules);
       break;
     case LAYER_DEMULTIPLEXER:
       // Free string arrays for demultiplexer layer
@@ -339,13 +568,39 @@ void free_config(Config *config) {
       break;
     case LAYER_BENCHMARK:
       free(layer->params.benchmark.next_Layer);
+      free(layer->params.benchmark.trace);
       break;
     case LAYER_READ_CACHE:
       free(layer->params.read_cache.next_Layer);
+      free(layer->params.read_cache.nvm_path);
+      free(layer->params.read_cache.persist_dir);
+      for (int i = 0; i < layer->params.read_cache.num_pool_prefixes; i++)
+        free(layer->params.read_cache.pool_prefixes[i]);
+      free(layer->params.read_cache.pool_prefixes);
       break;
     case LAYER_ENCRYPTION:
       free(layer->params.encryption.next_layer);
       break;
+    case LAYER_STAGING:
+      free(layer->params.staging.next_layer);
+      free(layer->params.staging.journal_dir);
+      break;
+    case LAYER_HASH_STORE:
+      free(layer->params.hash_store.path);
+      break;
+    case LAYER_DEDUP:
+      free(layer->params.dedup.next_layer);
+      free(layer->params.dedup.block_store);
+      break;
+    case LAYER_QOS:
+      free(layer->params.qos.next_layer);
+      for (int c = 0; c < layer->params.qos.nclasses; c++) {
+        free(layer->params.qos.classes[c].name);
+        free(layer->params.qos.classes[c].path_prefix);
+        free(layer->params.qos.classes[c].cgroup);
+      }
+      free(layer->params.qos.classes);
+      break;
     default:
       break;
     }
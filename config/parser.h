@@ -4,6 +4,10 @@
 #include "declarations.h"
 
 Config parse_config(toml_datum_t root_table);
+// parse_config, with -1 and the message of the first error in error instead
+// of exiting on an invalid configuration
+int parse_config_checked(toml_datum_t root_table, Config *config, char *error,
+                         size_t error_size);
 void free_config(Config *config);
 
 #endif // __CONFIG_PARSER_H__
@@ -0,0 +1,532 @@
+#define _GNU_SOURCE
+#include "reload.h"
+#include "../logdef.h"
+#include "../shared/utils/metadata_service.h"
+#include "parser.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define RELOAD_PATH_SIZE 256  // bytes of the dotted key of a parameter
+#define RELOAD_ERROR_SIZE 512 // bytes of the message of a rejected reload
+
+// A layer of the tracked tree, several when a name is built more than once
+typedef struct {
+  char *name;
+  LayerContext layer;
+} TrackedLayer;
+
+// Keys of a layer type that its lreconfigure takes, "table.key" when nested
+typedef struct {
+  const char *type;
+  const char *const *keys;
+} LayerTunables;
+
+static const char *const compression_tunables[] = {"level", NULL};
+static const char *const demultiplexer_tunables[] = {
+    "options.read_policy", "options.verify_replicas", NULL};
+static const char *const read_cache_tunables[] = {"admit_misses",
+                                                  "bypass_blocks", NULL};
+static const char *const no_tunables[] = {NULL};
+
+static const LayerTunables layer_tunables[] = {
+    {"compression", compression_tunables},
+    {"demultiplexer", demultiplexer_tunables},
+    {"read_cache", read_cache_tunables},
+};
+
+// Global settings that change in place
+static const char *const global_tunables[] = {
+    "log_mode", "log_async", "log_rate_limit", "services.cache_size", NULL};
+
+static pthread_mutex_t reload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int tracking;          // reload_track_layer records layers
+static TrackedLayer *tracked; // layers of the tracked tree
+static int n_tracked;
+static toml_result_t tracked_conf; // configuration of the tracked tree
+static int has_conf;               // tracked_conf is set
+static LayerContext tracked_root;
+
+static int sighup_pipe[2] = {-1, -1}; // written by the SIGHUP handler
+static char *sighup_path;
+
+/**
+ * @brief Drop the tracked tree, called with reload_mutex held
+ */
+static void forget_locked(void) {
+  for (int i = 0; i < n_tracked; i++) {
+    free(tracked[i].name);
+  }
+  free(tracked);
+  tracked = NULL;
+  n_tracked = 0;
+  if (has_conf) {
+    toml_free(tracked_conf);
+    has_conf = 0;
+  }
+  tracked_root = (LayerContext){0};
+}
+
+void reload_track_begin(void) {
+  pthread_mutex_lock(&reload_mutex);
+  forget_locked();
+  tracking = 1;
+  pthread_mutex_unlock(&reload_mutex);
+}
+
+void reload_track_layer(const char *name, LayerContext l) {
+  pthread_mutex_lock(&reload_mutex);
+  if (tracking) {
+    TrackedLayer *grown =
+        realloc(tracked, (n_tracked + 1) * sizeof(TrackedLayer));
+    char *copy = strdup(name);
+    if (grown && copy) {
+      tracked = grown;
+      tracked[n_tracked].name = copy;
+      tracked[n_tracked].layer = l;
+      n_tracked++;
+    } else {
+      // the layer keeps the parameters it was built with
+      if (grown) {
+        tracked = grown;
+      }
+      free(copy);
+      WARN_MSG("[RELOAD] Failed to track layer %s", name);
+    }
+  }
+  pthread_mutex_unlock(&reload_mutex);
+}
+
+void reload_track_end(toml_result_t conf, LayerContext root) {
+  pthread_mutex_lock(&reload_mutex);
+  tracked_conf = conf;
+  has_conf = 1;
+  tracked_root = root;
+  tracking = 0;
+  pthread_mutex_unlock(&reload_mutex);
+}
+
+void reload_forget(LayerContext root) {
+  pthread_mutex_lock(&reload_mutex);
+  if (has_conf && root.ops == tracked_root.ops &&
+      root.internal_state == tracked_root.internal_state) {
+    forget_locked();
+  }
+  pthread_mutex_unlock(&reload_mutex);
+}
+
+/**
+ * @brief Whether two parsed values are the same
+ */
+static int datum_equal(toml_datum_t a, toml_datum_t b) {
+  if (a.type != b.type) {
+    return 0;
+  }
+  switch (a.type) {
+  case TOML_UNKNOWN:
+    return 1;
+  case TOML_STRING:
+    return strcmp(a.u.s, b.u.s) == 0;
+  case TOML_INT64:
+    return a.u.int64 == b.u.int64;
+  case TOML_FP64:
+    return a.u.fp64 == b.u.fp64;
+  case TOML_BOOLEAN:
+    return a.u.boolean == b.u.boolean;
+  case TOML_ARRAY:
+    if (a.u.arr.size != b.u.arr.size) {
+      return 0;
+    }
+    for (int i = 0; i < a.u.arr.size; i++) {
+      if (!datum_equal(a.u.arr.elem[i], b.u.arr.elem[i])) {
+        return 0;
+      }
+    }
+    return 1;
+  case TOML_TABLE:
+    if (a.u.tab.size != b.u.tab.size) {
+      return 0;
+    }
+    for (int i = 0; i < a.u.tab.size; i++) {
+      if (!datum_equal(a.u.tab.value[i], toml_get(b, a.u.tab.key[i]))) {
+        return 0;
+      }
+    }
+    return 1;
+  default:
+    // dates and times
+    return memcmp(&a.u.ts, &b.u.ts, sizeof(a.u.ts)) == 0;
+  }
+}
+
+static int is_tunable(const char *const *tunables, const char *path) {
+  for (int i = 0; tunables[i]; i++) {
+    if (strcmp(tunables[i], path) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Whether a tunable is a key of the table at path
+static int has_tunable_below(const char *const *tunables, const char *path) {
+  size_t len = strlen(path);
+  for (int i = 0; tunables[i]; i++) {
+    if (strncmp(tunables[i], path, len) == 0 && tunables[i][len] == '.') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static const char *const *tunables_of(toml_datum_t layer_table) {
+  toml_datum_t type = toml_get(layer_table, "type");
+  for (size_t i = 0; type.type == TOML_STRING &&
+                     i < sizeof(layer_tunables) / sizeof(layer_tunables[0]);
+       i++) {
+    if (strcmp(layer_tunables[i].type, type.u.s) == 0) {
+      return layer_tunables[i].keys;
+    }
+  }
+  return no_tunables;
+}
+
+// Whether a key of the top table is a layer rather than a global setting
+static int is_layer_key(const char *key, toml_datum_t value) {
+  return value.type == TOML_TABLE && strcmp(key, "services") != 0 &&
+         strcmp(key, "memory_budgets") != 0 &&
+         strcmp(key, "cpu_kernels") != 0;
+}
+
+/**
+ * @brief First key of two tables that differs but is not a tunable
+ *
+ * @param prefix           -> path of the tables, "" for the top ones
+ * @param skip_layers      -> leave out the layers of the top table
+ * @param tunables_changed -> set if a tunable differs
+ * @param where            -> receives the path of the key
+ * @return int             -> 1 if one differs, 0 if none does
+ */
+static int find_structural(const char *prefix, toml_datum_t a, toml_datum_t b,
+                           const char *const *tunables, int skip_layers,
+                           int *tunables_changed, char *where,
+                           size_t where_size) {
+  char path[RELOAD_PATH_SIZE];
+  // the keys of a, then the keys only b has
+  for (int pass = 0; pass < 2; pass++) {
+    toml_datum_t from = pass ? b : a;
+    toml_datum_t other = pass ? a : b;
+    for (int i = 0; i < from.u.tab.size; i++) {
+      const char *key = from.u.tab.key[i];
+      if (pass == 1 && toml_get(other, key).type != TOML_UNKNOWN) {
+        continue;
+      }
+      toml_datum_t va = toml_get(a, key);
+      toml_datum_t vb = toml_get(b, key);
+      if (skip_layers && (is_layer_key(key, va) || is_layer_key(key, vb))) {
+        continue;
+      }
+      (void)snprintf(path, sizeof(path), "%s%s%s", prefix, *prefix ? "." : "",
+                     key);
+      if (is_tunable(tunables, path)) {
+        *tunables_changed |= !datum_equal(va, vb);
+      } else if (va.type == TOML_TABLE && vb.type == TOML_TABLE &&
+                 has_tunable_below(tunables, path)) {
+        if (find_structural(path, va, vb, tunables, 0, tunables_changed,
+                            where, where_size)) {
+          return 1;
+        }
+      } else if (!datum_equal(va, vb)) {
+        (void)snprintf(where, where_size, "%s", path);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Names of the layers whose tunables changed, and only them
+ *
+ * @param changed   -> receives the names, as keys of new_root
+ * @param n_changed -> receives their number
+ * @return int      -> 0, or -1 with error set on a structural change
+ */
+static int changed_layers(toml_datum_t old_root, toml_datum_t new_root,
+                          const char **changed, int *n_changed, char *error,
+                          size_t error_size) {
+  char where[RELOAD_PATH_SIZE];
+  *n_changed = 0;
+  for (int i = 0; i < new_root.u.tab.size; i++) {
+    const char *name = new_root.u.tab.key[i];
+    if (is_layer_key(name, new_root.u.tab.value[i]) &&
+        toml_get(old_root, name).type != TOML_TABLE) {
+      (void)snprintf(error, error_size,
+                     "layer %s is new, adding a layer needs a remount", name);
+      return -1;
+    }
+  }
+  for (int i = 0; i < old_root.u.tab.size; i++) {
+    const char *name = old_root.u.tab.key[i];
+    toml_datum_t old_layer = old_root.u.tab.value[i];
+    if (!is_layer_key(name, old_layer)) {
+      continue;
+    }
+    toml_datum_t new_layer = toml_get(new_root, name);
+    if (new_layer.type != TOML_TABLE) {
+      (void)snprintf(error, error_size,
+                     "layer %s is gone, removing a layer needs a remount",
+                     name);
+      return -1;
+    }
+    int tunables_changed = 0;
+    if (find_structural("", old_layer, new_layer, tunables_of(old_layer), 0,
+                        &tunables_changed, where, sizeof(where))) {
+      (void)snprintf(error, error_size,
+                     "%s of layer %s cannot change without a remount", where,
+                     name);
+      return -1;
+    }
+    if (tunables_changed) {
+      changed[(*n_changed)++] = name;
+    }
+  }
+  return 0;
+}
+
+static LayerConfig *find_layer(Config *config, const char *name) {
+  for (int i = 0; i < config->n_layers; i++) {
+    if (strcmp(config->layers[i].name, name) == 0) {
+      return &config->layers[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Check, then apply, the parameters of the layers that changed
+ *
+ * Called with reload_mutex held.
+ */
+static int reconfigure_layers(Config *config, const char **changed,
+                              int n_changed, int apply, char *error,
+                              size_t error_size) {
+  for (int c = 0; c < n_changed; c++) {
+    LayerConfig *layer_config = find_layer(config, changed[c]);
+    int found = 0;
+    for (int i = 0; layer_config && i < n_tracked; i++) {
+      if (strcmp(tracked[i].name, changed[c]) != 0) {
+        continue;
+      }
+      found = 1;
+      LayerContext l = tracked[i].layer;
+      const char *why = "it has nothing to change live";
+      if (!l.ops->lreconfigure ||
+          l.ops->lreconfigure(&layer_config->params, apply, &why, l) != 0) {
+        (void)snprintf(error, error_size, "layer %s: %s", changed[c], why);
+        return -1;
+      }
+    }
+    if (!found) {
+      (void)snprintf(error, error_size,
+                     "layer %s is lazy or below a lazy layer, its parameters "
+                     "need a remount",
+                     changed[c]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int reload_config_toml(const char *filepath, char *error, size_t error_size) {
+  FILE *fp = fopen(filepath, "r");
+  if (!fp) {
+    (void)snprintf(error, error_size, "failed to open %s: %s", filepath,
+                   strerror(errno));
+    return -1;
+  }
+  toml_result_t conf = toml_parse_file(fp);
+  (void)fclose(fp);
+  if (!conf.ok) {
+    (void)snprintf(error, error_size, "failed to parse %s: %s", filepath,
+                   conf.errmsg);
+    toml_free(conf);
+    return -1;
+  }
+
+  pthread_mutex_lock(&reload_mutex);
+  int res = -1;
+  Config config = {0};
+  int parsed = 0;
+  const char **changed = NULL;
+  int n_changed = 0;
+  char where[RELOAD_PATH_SIZE];
+  if (!has_conf) {
+    (void)snprintf(error, error_size, "no tree was loaded to reload");
+    goto out;
+  }
+
+  // only tunables may differ
+  toml_datum_t old_root = tracked_conf.toptab;
+  toml_datum_t new_root = conf.toptab;
+  int globals_changed = 0;
+  if (find_structural("", old_root, new_root, global_tunables, 1,
+                      &globals_changed, where, sizeof(where))) {
+    (void)snprintf(error, error_size, "%s cannot change without a remount",
+                   where);
+    goto out;
+  }
+  changed = malloc((new_root.u.tab.size + 1) * sizeof(char *));
+  if (!changed) {
+    (void)snprintf(error, error_size, "out of memory");
+    goto out;
+  }
+  if (changed_layers(old_root, new_root, changed, &n_changed, error,
+                     error_size) != 0) {
+    goto out;
+  }
+
+  // the values of the tunables are checked as at startup
+  char parse_error[RELOAD_ERROR_SIZE];
+  if (parse_config_checked(new_root, &config, parse_error,
+                           sizeof(parse_error)) != 0) {
+    (void)snprintf(error, error_size, "invalid configuration: %s",
+                   parse_error);
+    goto out;
+  }
+  parsed = 1;
+
+  int cache_changed = !datum_equal(
+      toml_get(toml_get(old_root, "services"), "cache_size"),
+      toml_get(toml_get(new_root, "services"), "cache_size"));
+  MetadataCache *cache = NULL;
+  size_t cache_size = 0;
+  if (cache_changed) {
+    cache = metadata_service_cache();
+    cache_size = config.serviceConfig->service.metadata.cache_size_bytes;
+    if (!cache || cache_size < sizeof(MetadataEntry) * METADATA_CACHE_SHARDS) {
+      (void)snprintf(error, error_size,
+                     "the metadata cache cannot be created or removed live, "
+                     "and takes at least %zu bytes",
+                     sizeof(MetadataEntry) * METADATA_CACHE_SHARDS);
+      goto out;
+    }
+  }
+
+  // every layer accepts its parameters before any takes them, so taking
+  // them cannot fail (see lreconfigure); a layer breaking that is logged, and
+  // it and the layers after it keep their old parameters
+  if (reconfigure_layers(&config, changed, n_changed, 0, error, error_size) !=
+      0) {
+    goto out;
+  }
+  char apply_error[RELOAD_ERROR_SIZE];
+  if (reconfigure_layers(&config, changed, n_changed, 1, apply_error,
+                         sizeof(apply_error)) != 0) {
+    ERROR_MSG("[RELOAD] Failed to apply the parameters it accepted, %s",
+              apply_error);
+  }
+  if (globals_changed) {
+    if (!datum_equal(toml_get(old_root, "log_mode"),
+                     toml_get(new_root, "log_mode"))) {
+      LOG_INIT(config.log_mode);
+    }
+    LogOptions log_options = {.async = config.log_async,
+                              .rate_limit = (unsigned)config.log_rate_limit};
+    LOG_CONFIGURE(&log_options);
+  }
+  if (cache_changed) {
+    (void)metadata_cache_resize(cache, cache_size);
+  }
+
+  // the next reload compares with this configuration
+  toml_free(tracked_conf);
+  tracked_conf = conf;
+  conf = (toml_result_t){0};
+  res = 0;
+
+out:
+  pthread_mutex_unlock(&reload_mutex);
+  if (parsed) {
+    free(config.serviceConfig);
+    free_config(&config);
+  }
+  free((void *)changed);
+  if (res != 0) {
+    toml_free(conf);
+  }
+  return res;
+}
+
+static void sighup_handler(int sig) {
+  (void)sig;
+  int saved_errno = errno;
+  char byte = 0;
+  // a full pipe already has a reload pending
+  (void)!write(sighup_pipe[1], &byte, 1);
+  errno = saved_errno;
+}
+
+static void *sighup_worker(void *arg) {
+  (void)arg;
+  char byte;
+  char error[RELOAD_ERROR_SIZE];
+  for (;;) {
+    ssize_t n = read(sighup_pipe[0], &byte, 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    if (reload_config_toml(sighup_path, error, sizeof(error)) == 0) {
+      INFO_MSG("[RELOAD] Reloaded %s", sighup_path);
+    } else {
+      ERROR_MSG("[RELOAD] Kept the configuration, %s", error);
+    }
+  }
+  return NULL;
+}
+
+int reload_on_sighup(const char *filepath) {
+  if (!filepath || sighup_pipe[0] >= 0) {
+    return -1;
+  }
+  sighup_path = strdup(filepath);
+  if (!sighup_path || pipe2(sighup_pipe, O_CLOEXEC) != 0) {
+    goto fail;
+  }
+  // the handler never blocks, signals coalesce in a full pipe
+  (void)fcntl(sighup_pipe[1], F_SETFL, O_NONBLOCK);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, sighup_worker, NULL) != 0) {
+    goto fail;
+  }
+  (void)pthread_detach(thread);
+
+  struct sigaction action = {0};
+  action.sa_handler = sighup_handler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGHUP, &action, NULL) != 0) {
+    // the thread stays blocked on a pipe nobody writes
+    ERROR_MSG("[RELOAD] Failed to set the SIGHUP handler: %s",
+              strerror(errno));
+    return -1;
+  }
+  return 0;
+
+fail:
+  if (sighup_pipe[0] >= 0) {
+    (void)close(sighup_pipe[0]);
+    (void)close(sighup_pipe[1]);
+    sighup_pipe[0] = sighup_pipe[1] = -1;
+  }
+  free(sighup_path);
+  sighup_path = NULL;
+  return -1;
+}
@@ -0,0 +1,87 @@
+#ifndef __CONFIG_RELOAD_H__
+#define __CONFIG_RELOAD_H__
+
+#include "../shared/types/layer_context.h"
+#include "declarations.h"
+#include <stddef.h>
+
+/*
+ * ============================================================================
+ * CONFIGURATION RELOAD - LIVE TUNABLES OF A RUNNING TREE
+ * ============================================================================
+ *
+ * The loader keeps the configuration of the last tree it built, and the
+ * builder the layer it built for each name. A reload parses the file again
+ * and compares it with that configuration, key by key:
+ *
+ * - The tunables change in place: log_mode, log_async, log_rate_limit and the
+ *   cache_size of the metadata service; the level of a compression layer;
+ *   the read_policy and verify_replicas options of a demultiplexer; the
+ *   admit_misses and bypass_blocks of a read_cache. A layer takes its own
+ *   through lreconfigure (see LayerOps).
+ * - Any other difference (a layer added, removed or retyped, a block_size, a
+ *   path, the threads of the metadata service...) is structural: the reload
+ *   is rejected with the first one found and nothing changes.
+ *
+ * The layers first check the parameters they are given, and only once they
+ * all accept them are the parameters applied. The layers of a lazy subtree
+ * cannot change, being built after the tracking ends.
+ * ============================================================================
+ */
+
+/**
+ * @brief Start tracking the layers of a tree being built
+ *
+ * Forgets the tree tracked before, if any.
+ */
+void reload_track_begin(void);
+
+/**
+ * @brief Record the layer built for a name, before any metrics wrapping
+ *
+ * Does nothing outside of reload_track_begin() and reload_track_end().
+ *
+ * @param name -> name of the layer in the configuration
+ * @param l    -> built layer
+ */
+void reload_track_layer(const char *name, LayerContext l);
+
+/**
+ * @brief Keep the configuration of the tree built
+ *
+ * @param conf -> parsed configuration of the tree, freed on the next track
+ * or reload
+ * @param root -> root of the tree, as returned to the application
+ */
+void reload_track_end(toml_result_t conf, LayerContext root);
+
+/**
+ * @brief Stop tracking a tree that is being destroyed
+ *
+ * @param root -> root of the tree, does nothing if it is not the tracked one
+ */
+void reload_forget(LayerContext root);
+
+/**
+ * @brief Apply the tunables of a configuration file to the tracked tree
+ *
+ * @param filepath   -> toml config file path
+ * @param error      -> receives why the reload was rejected
+ * @param error_size -> bytes of error
+ * @return int       -> 0, or -1 with nothing changed
+ */
+int reload_config_toml(const char *filepath, char *error, size_t error_size);
+
+/**
+ * @brief Reload a configuration file on every SIGHUP
+ *
+ * The signal only wakes a thread, which reloads and logs the outcome. Call it
+ * once, after any fork of the process and after the handlers of other
+ * libraries are set, as it replaces the SIGHUP handler.
+ *
+ * @param filepath -> toml config file path, copied
+ * @return int     -> 0, or -1 if the thread or the handler cannot be set
+ */
+int reload_on_sighup(const char *filepath);
+
+#endif // __CONFIG_RELOAD_H__
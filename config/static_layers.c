@@ -0,0 +1,48 @@
+#include "static_layers.h"
+#include "../layers/anti_tampering/anti_tampering.h"
+#include "../layers/benchmark/benchmark.h"
+#include "../layers/block_align/block_align.h"
+#include "../layers/cache/read_cache/read_cache.h"
+#include "../layers/compression/compression.h"
+#include "../layers/demultiplexer/demultiplexer.h"
+#include "../layers/encryption/encryption.h"
+#include "../layers/dedup/dedup.h"
+#include "../layers/hash_store/hash_store.h"
+#include "../layers/local/local.h"
+#include "../layers/local/local_uring.h"
+#include "../layers/memory/memory.h"
+#include "../layers/qos/qos.h"
+#include "../layers/remote/remote.h"
+#include "../layers/staging/staging.h"
+#include "../shared/enums/layer_type.h"
+#include <stddef.h>
+#include <string.h>
+
+const StaticLayerInit static_layer_inits[] = {
+    {LAYER_ANTI_TAMPERING_INIT, (void *)anti_tampering_init},
+    {LAYER_LOCAL_INIT, (void *)local_init},
+    {LAYER_LOCAL_URING_INIT, (void *)local_uring_init},
+    {LAYER_REMOTE_INIT, (void *)remote_init},
+    {LAYER_COMPRESSION_INIT, (void *)compression_init},
+    {LAYER_BLOCK_ALIGN_INIT, (void *)block_align_init},
+    {LAYER_DEMULTIPLEXER_INIT, (void *)demultiplexer_init},
+    {LAYER_BENCHMARK_INIT, (void *)benchmark_init},
+    {LAYER_READ_CACHE_INIT, (void *)read_cache_init},
+    {LAYER_ENCRYPTION_INIT, (void *)encryption_init},
+    {LAYER_STAGING_INIT, (void *)staging_init},
+    {LAYER_MEMORY_INIT, (void *)memory_init},
+    {LAYER_HASH_STORE_INIT, (void *)hash_store_init},
+    {LAYER_DEDUP_INIT, (void *)dedup_init},
+    {LAYER_QOS_INIT, (void *)qos_init},
+    {NULL, NULL},
+};
+
+void *static_layer_init(const char *init_name) {
+  for (const StaticLayerInit *entry = static_layer_inits; entry->name;
+       entry++) {
+    if (strcmp(entry->name, init_name) == 0) {
+      return entry->init;
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef __CONFIG_STATIC_LAYERS_H__
+#define __CONFIG_STATIC_LAYERS_H__
+
+/*
+ * ============================================================================
+ * STATIC LAYERS - THE LAYER TREE OF A STATIC PIPELINE BUILD
+ * ============================================================================
+ *
+ * make static/build compiles the library with STATIC_PIPELINE defined into a
+ * static archive, with -O3 -flto, for one fixed configuration file. In that
+ * build:
+ *
+ * - the builder takes the init functions from static_layer_inits instead of
+ *   dlopen'ing libmodular.so (which would be a second copy of the layers),
+ *   so the linker, and LTO, see every layer the tree can use
+ * - the configuration file is compiled in as static_pipeline_config, and
+ *   libinit(NULL) builds the tree from it
+ *
+ * The layers still call each other through their LayerOps. The application
+ * is linked with the archive and -flto, so the calls across translation
+ * units that libmodular.so makes through the PLT are direct, and can be
+ * inlined; with STATIC_PROFILE=use the indirect ops calls of the fixed tree
+ * are specialized too (see the static/build target of the Makefile).
+ *
+ * The external layers (S3, IPFS, Solana) still come from their library.
+ * ============================================================================
+ */
+
+typedef struct {
+  const char *name; // LAYER_*_INIT
+  void *init;       // the init function with that name
+} StaticLayerInit;
+
+// The init functions of the layers linked in, ended by a NULL name
+extern const StaticLayerInit static_layer_inits[];
+
+// The TOML configuration the pipeline was built for, generated by make
+extern const char static_pipeline_config[];
+
+/**
+ * @brief Init function of a layer linked in the static pipeline
+ *
+ * @param init_name -> LAYER_*_INIT name of the function
+ * @return void*    -> the function, NULL if the layer is not linked in
+ */
+void *static_layer_init(const char *init_name);
+
+#endif // __CONFIG_STATIC_LAYERS_H__
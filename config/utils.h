@@ -1,11 +1,22 @@
 #ifndef __CONFIG_UTILS_H__
 #define __CONFIG_UTILS_H__
 #include "../lib/tomlc17/src/tomlc17.h"
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// Set by parse_config_checked while it parses: toml_error copies its message
+// and jumps back there instead of exiting. One per translation unit, the
+// parsing ones being inlined in parser.c
+static __thread jmp_buf *toml_error_jmp __attribute__((unused));
+static __thread char toml_error_msg[256] __attribute__((unused));
+
 static inline void toml_error(const char *msg) {
+  if (toml_error_jmp) {
+    (void)snprintf(toml_error_msg, sizeof(toml_error_msg), "%s", msg);
+    longjmp(*toml_error_jmp, 1);
+  }
   fprintf(stderr, "ERROR: %s\n", msg);
   exit(1);
 }
@@ -0,0 +1,1678 @@
+/** @file
+ *
+ * Low-level FUSE frontend of the Modular IO Library.
+ *
+ * Mirrors the directory given with -o source=DIR through the configured layer
+ * stack, like passthrough.c, but on the low-level API:
+ *
+ * - requests are served by a multithreaded loop (-o max_threads=N,
+ *   -o clone_fd gives each thread its own /dev/fuse fd)
+ * - the kernel writeback cache is enabled, so small writes are merged in the
+ *   page cache before they reach the layers
+ * - requests and replies are spliced between /dev/fuse and the daemon, and
+ *   writes of up to max_write bytes (1 MiB by default) are accepted
+ * - read and write_buf go to the layers' vectored ops, with the data in the
+ *   buffers it arrived in or in a pooled buffer. With NUMA placement (`numa`
+ *   in `[services]`), the thread serving them is pinned to a node on its
+ *   first one, so the work of its channel and its pooled buffers stay there
+ * - attributes and entries are cached by the kernel for -o attr_timeout and
+ *   -o entry_timeout seconds, and failed lookups for -o negative_timeout.
+ *   Layers that change attributes on their own (e.g. the logical size of a
+ *   compressed file) have the kernel copy invalidated, by a thread of its
+ *   own, through the hook of shared/utils/invalidation.h
+ * - directories are listed by the layers, and readdirplus replies carry the
+ *   attributes the layers give with the names (logical sizes included), so
+ *   the kernel does not look the entries up one by one
+ * - with -o fibers=N, read and write_buf run as tasks of N fiber loops
+ *   (shared/utils/fiber.h) and reply from there: the thread that received the
+ *   request goes back to /dev/fuse at once, and a loop keeps thousands of
+ *   reads and writes outstanding on layers that wait for replies, such as
+ *   remote. Their data is copied into a pooled buffer first
+ * - with -o passthrough (Linux 6.9+, libfuse 3.16+), read-only opens of files
+ *   the layers report a backing file for (see libbacking_fd) are read by the
+ *   kernel from that file, with no round trip to the daemon. The writeback
+ *   cache is then off, as the kernel does not combine the two
+ *
+ * Run with
+ *
+ *     lowlevel <mountpoint> -o source=<backend dir> [--config <config.toml>]
+ *              [-o max_threads=N] [-o clone_fd] [-o max_write=N]
+ *              [-o no_writeback_cache] [-o no_splice] [-o passthrough]
+ *              [-o fibers=N]
+ *              [-o attr_timeout=S] [-o entry_timeout=S]
+ *              [-o negative_timeout=S] [FUSE options]
+ */
+
+#define FUSE_USE_VERSION 312
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse3/fuse_lowlevel.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include "../../lib/uthash/src/uthash.h"
+#include "../../logdef.h"
+#include "../../shared/utils/buffer_pool.h"
+#include "../../shared/utils/fiber.h"
+#include "../../shared/utils/invalidation.h"
+#include "../../shared/utils/numa_policy.h"
+#include "passthrough_helpers.h"
+
+#define LL_MAX_WRITE (1024 * 1024) // default and largest max_write
+#define LL_ATTR_TIMEOUT 1.0        // default attr_timeout and entry_timeout
+
+// Backend file of a node, the key layers invalidate attributes by
+typedef struct {
+  dev_t device;
+  ino_t inode;
+} LLInodeKey;
+
+/*
+ * Node of the tree of names the kernel knows: its inode number is the
+ * address of the node (FUSE_ROOT_ID for the root). Paths are built from the
+ * names up to the root, so a rename only moves one node.
+ */
+typedef struct Node {
+  struct Node *parent;        // NULL for the root
+  char *name;                 // name in the parent, "" for the root
+  char *key;                  // parent address followed by name, hash key
+  size_t key_len;             // bytes of key
+  uint64_t nlookup;           // lookups the kernel has not forgotten yet
+  uint64_t children;          // nodes that have this one as parent
+  int attached;               // reachable by name (not unlinked nor replaced)
+  int backing_id;             // kernel backing file of the passthrough opens
+  uint64_t passthrough_opens; // opens reading from backing_id
+  uint64_t cached_opens;      // opens using the page cache
+  LLInodeKey backend;         // backend file at the last lookup
+  int indexed;                // in inodes by backend
+  UT_hash_handle hh;
+  UT_hash_handle hh_inode;
+} Node;
+
+// How the kernel does the I/O of an open file
+typedef enum {
+  LL_IO_CACHED,      // through the daemon and the page cache
+  LL_IO_DIRECT,      // through the daemon, next to passthrough opens
+  LL_IO_PASSTHROUGH, // from the backing file of the node
+} LLIoMode;
+
+// Open file: fi->fh points to it
+typedef struct {
+  int fd;      // fd of the layer stack
+  char *path;  // path at open, given to the layers as app_context
+  LLIoMode io; // I/O mode of the open
+} LLFile;
+
+// Entry of a directory listing
+typedef struct {
+  char *name;
+  struct stat st; // all the attributes if plus, else inode number and type
+  int plus;       // the layers gave the attributes
+} LLDirEntry;
+
+// Open directory: fi->fh points to it. The listing is taken from the layers
+// at offset 0, the offset of an entry is its index in the listing plus one
+typedef struct {
+  LLDirEntry *entries;
+  size_t count;    // entries of the listing
+  size_t capacity; // allocated entries
+  int error;       // errno of the listing, 0 if it is complete
+} LLDir;
+
+typedef struct {
+  char *source;            // backend directory
+  char *config;            // layer configuration, NULL for the default
+  unsigned max_write;      // largest write request
+  int no_writeback_cache;  // keep the kernel writeback cache off
+  int no_splice;           // keep splicing off
+  int passthrough;         // read verified read-only files in the kernel
+  unsigned fibers;         // fiber loops running read and write_buf, 0: none
+  double attr_timeout;     // seconds the kernel caches attributes
+  double entry_timeout;    // seconds the kernel caches names
+  double negative_timeout; // seconds the kernel caches missing names
+} LLOptions;
+
+static LayerContext lroot;
+static LLOptions options = {.max_write = LL_MAX_WRITE,
+                             .attr_timeout = LL_ATTR_TIMEOUT,
+                             .entry_timeout = LL_ATTR_TIMEOUT};
+static Node root = {.name = "", .attached = 1};
+static Node *names = NULL;  // attached nodes by (parent, name)
+static Node *inodes = NULL; // nodes by backend file
+static int writeback_enabled = 0;   // the kernel writeback cache is on
+static int passthrough_enabled = 0; // the kernel takes backing files
+static pthread_mutex_t names_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FiberLoop **fiber_loops = NULL; // options.fibers loops, or NULL
+static unsigned next_fiber_loop = 0;   // loop of the next task, round robin
+
+// Attribute invalidations queued by the layers, sent by inval_thread: the
+// kernel must not be notified from the path of a request on the inode
+static struct fuse_session *session = NULL;
+static fuse_ino_t *inval_queue = NULL; // inodes to invalidate
+static size_t inval_count = 0;         // entries of inval_queue
+static size_t inval_capacity = 0;      // allocated entries of inval_queue
+static int inval_stop = 0;             // inval_thread exits when set
+static pthread_t inval_thread;
+static pthread_mutex_t inval_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+
+static const struct fuse_opt ll_opts[] = {
+    {"source=%s", offsetof(LLOptions, source), 0},
+    {"--config=%s", offsetof(LLOptions, config), 0},
+    {"--config %s", offsetof(LLOptions, config), 0},
+    {"max_write=%u", offsetof(LLOptions, max_write), 0},
+    {"no_writeback_cache", offsetof(LLOptions, no_writeback_cache), 1},
+    {"no_splice", offsetof(LLOptions, no_splice), 1},
+    {"passthrough", offsetof(LLOptions, passthrough), 1},
+    {"fibers=%u", offsetof(LLOptions, fibers), 0},
+    {"attr_timeout=%lf", offsetof(LLOptions, attr_timeout), 0},
+    {"entry_timeout=%lf", offsetof(LLOptions, entry_timeout), 0},
+    {"negative_timeout=%lf", offsetof(LLOptions, negative_timeout), 0},
+    FUSE_OPT_END};
+
+static inline Node *node_of(fuse_ino_t ino) {
+  return ino == FUSE_ROOT_ID ? &root : (Node *)(uintptr_t)ino;
+}
+
+static inline fuse_ino_t ino_of(Node *node) {
+  return node == &root ? FUSE_ROOT_ID : (fuse_ino_t)(uintptr_t)node;
+}
+
+static inline LLFile *file_of(struct fuse_file_info *fi) {
+  return (LLFile *)(uintptr_t)fi->fh;
+}
+
+/**
+ * @brief Layer context of a request on path, the shared root is not written
+ * by the threads of the loop
+ */
+static inline LayerContext layers_for(char *path) {
+  LayerContext l = lroot;
+  l.app_context = path;
+  return l;
+}
+
+/**
+ * @brief Hash key of the entry name of parent
+ *
+ * @return char* -> key of *key_len bytes, NULL if out of memory
+ */
+static char *make_key(Node *parent, const char *name, size_t *key_len) {
+  size_t name_len = strlen(name);
+  char *key = malloc(sizeof(parent) + name_len);
+  if (key) {
+    memcpy(key, &parent, sizeof(parent));
+    memcpy(key + sizeof(parent), name, name_len);
+    *key_len = sizeof(parent) + name_len;
+  }
+  return key;
+}
+
+/**
+ * @brief Free a node nobody references anymore, then its parent if it was
+ * the last reference to it (names_mutex held)
+ */
+static void node_release(Node *node) {
+  while (node != &root && node->nlookup == 0 && node->children == 0) {
+    Node *parent = node->parent;
+    if (node->attached) {
+      HASH_DEL(names, node);
+    }
+    if (node->indexed) {
+      HASH_DELETE(hh_inode, inodes, node);
+    }
+    free(node->name);
+    free(node->key);
+    free(node);
+    parent->children--;
+    node = parent;
+  }
+}
+
+/**
+ * @brief Detach a node from its name, it stays alive until forgotten
+ * (names_mutex held)
+ */
+static void node_detach(Node *node) {
+  if (node->attached) {
+    HASH_DEL(names, node);
+    node->attached = 0;
+  }
+}
+
+/**
+ * @brief Find the node of an entry (names_mutex held)
+ */
+static Node *node_find(Node *parent, const char *name) {
+  size_t key_len;
+  char *key = make_key(parent, name, &key_len);
+  Node *node = NULL;
+  if (key) {
+    HASH_FIND(hh, names, key, key_len, node);
+    free(key);
+  }
+  return node;
+}
+
+/**
+ * @brief Index a node by its backend file (names_mutex held)
+ */
+static void node_index(Node *node, const struct stat *st) {
+  LLInodeKey backend = {.device = st->st_dev, .inode = st->st_ino};
+  if (node->indexed) {
+    if (memcmp(&node->backend, &backend, sizeof(backend)) == 0) {
+      return;
+    }
+    HASH_DELETE(hh_inode, inodes, node);
+  }
+  node->backend = backend;
+  node->indexed = 1;
+  HASH_ADD(hh_inode, inodes, backend, sizeof(LLInodeKey), node);
+}
+
+/**
+ * @brief Node of an entry the kernel looked up, created on first lookup
+ *
+ * @param st -> attributes of the entry, from the layers
+ * @return Node* -> node with one more lookup, NULL if out of memory
+ */
+static Node *node_lookup(Node *parent, const char *name,
+                         const struct stat *st) {
+  pthread_mutex_lock(&names_mutex);
+  Node *node = node_find(parent, name);
+  if (!node) {
+    node = calloc(1, sizeof(Node));
+    if (node) {
+      node->name = strdup(name);
+      node->key = make_key(parent, name, &node->key_len);
+    }
+    if (!node || !node->name || !node->key) {
+      if (node) {
+        free(node->name);
+        free(node->key);
+        free(node);
+      }
+      pthread_mutex_unlock(&names_mutex);
+      return NULL;
+    }
+    node->parent = parent;
+    node->attached = 1;
+    parent->children++;
+    HASH_ADD_KEYPTR(hh, names, node->key, node->key_len, node);
+  }
+  node_index(node, st);
+  node->nlookup++;
+  pthread_mutex_unlock(&names_mutex);
+  return node;
+}
+
+/**
+ * @brief Backend path of a node, or of the entry name of it if name is not
+ * NULL
+ *
+ * @return char* -> malloc'd path, NULL if out of memory
+ */
+static char *node_path(Node *node, const char *name) {
+  pthread_mutex_lock(&names_mutex);
+  size_t len = strlen(options.source) + (name ? strlen(name) + 1 : 0);
+  for (Node *n = node; n != &root; n = n->parent) {
+    len += strlen(n->name) + 1;
+  }
+  char *path = malloc(len + 1);
+  if (!path) {
+    pthread_mutex_unlock(&names_mutex);
+    return NULL;
+  }
+  // filled from the end, the names come leaf first
+  char *p = path + len;
+  *p = '\0';
+  if (name) {
+    p -= strlen(name);
+    memcpy(p, name, strlen(name));
+    *--p = '/';
+  }
+  for (Node *n = node; n != &root; n = n->parent) {
+    size_t n_len = strlen(n->name);
+    p -= n_len;
+    memcpy(p, n->name, n_len);
+    *--p = '/';
+  }
+  memcpy(path, options.source, strlen(options.source));
+  pthread_mutex_unlock(&names_mutex);
+  return path;
+}
+
+/**
+ * @brief Entry reply with the cache timeouts of the options
+ */
+static struct fuse_entry_param entry_param(void) {
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  e.attr_timeout = options.attr_timeout;
+  e.entry_timeout = options.entry_timeout;
+  return e;
+}
+
+/**
+ * @brief Reply to a lookup-like request with the entry name of parent
+ *
+ * @param negative -> a missing entry is cached for negative_timeout (lookup)
+ */
+static void reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        int negative) {
+  char *path = node_path(node_of(parent), name);
+  if (!path) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  struct fuse_entry_param e = entry_param();
+  int res = liblstat(path, &e.attr, layers_for(path));
+  int err = errno;
+  free(path);
+  if (res == -1 && err == ENOENT && negative &&
+      options.negative_timeout > 0) {
+    // inode 0: the kernel remembers the name does not exist
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = options.negative_timeout;
+    fuse_reply_entry(req, &e);
+    return;
+  }
+  if (res == -1) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  Node *node = node_lookup(node_of(parent), name, &e.attr);
+  if (!node) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  e.ino = ino_of(node);
+  if (fuse_reply_entry(req, &e) != 0) {
+    // the kernel never got the entry, so it will not forget it
+    pthread_mutex_lock(&names_mutex);
+    node->nlookup--;
+    node_release(node);
+    pthread_mutex_unlock(&names_mutex);
+  }
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn) {
+  (void)userdata;
+
+  if (options.passthrough && (conn->capable & FUSE_CAP_PASSTHROUGH)) {
+    conn->want |= FUSE_CAP_PASSTHROUGH;
+    conn->want &= ~FUSE_CAP_WRITEBACK_CACHE;
+    passthrough_enabled = 1;
+  } else if (!options.no_writeback_cache &&
+             (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+    conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    writeback_enabled = 1;
+  }
+  if (!options.no_splice) {
+    conn->want |= conn->capable &
+                  (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE |
+                   FUSE_CAP_SPLICE_MOVE);
+  } else {
+    conn->want &= ~(FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE |
+                    FUSE_CAP_SPLICE_MOVE);
+  }
+  conn->max_write = options.max_write;
+
+  if (DEBUG_ENABLED()) {
+    DEBUG_MSG("FUSE low-level init, want 0x%x, max_write %u", conn->want,
+              conn->max_write);
+  }
+}
+
+static void ll_destroy(void *userdata) {
+  (void)userdata;
+
+  if (DEBUG_ENABLED()) {
+    DEBUG_MSG("FUSE low-level destroy called");
+  }
+
+  libdestroy(lroot);
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  if (DEBUG_ENABLED()) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    DEBUG_MSG("lookup called for %s in %lu, userid %d, pid %d", name,
+              (unsigned long)parent, ctx->uid, ctx->pid);
+  }
+
+  reply_entry(req, parent, name, 1);
+}
+
+static void forget_one(fuse_ino_t ino, uint64_t nlookup) {
+  Node *node = node_of(ino);
+  pthread_mutex_lock(&names_mutex);
+  if (node != &root) {
+    node->nlookup -= nlookup < node->nlookup ? nlookup : node->nlookup;
+    node_release(node);
+  }
+  pthread_mutex_unlock(&names_mutex);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+  forget_one(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count,
+                            struct fuse_forget_data *forgets) {
+  for (size_t i = 0; i < count; i++) {
+    forget_one(forgets[i].ino, forgets[i].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi) {
+  (void)fi;
+  char *path = node_path(node_of(ino), NULL);
+  if (!path) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  if (DEBUG_ENABLED()) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    DEBUG_MSG("getattr called for %s, userid %d, pid %d", path, ctx->uid,
+              ctx->pid);
+  }
+
+  struct stat st;
+  int res = liblstat(path, &st, layers_for(path));
+  free(path);
+  if (res == -1) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  fuse_reply_attr(req, &st, options.attr_timeout);
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                       int valid, struct fuse_file_info *fi) {
+  char *path = node_path(node_of(ino), NULL);
+  if (!path) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  if (DEBUG_ENABLED()) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    DEBUG_MSG("setattr called for %s, valid 0x%x, userid %d, pid %d", path,
+              valid, ctx->uid, ctx->pid);
+  }
+
+  LayerContext l = layers_for(path);
+  int res = 0;
+  if (valid & FUSE_SET_ATTR_MODE) {
+    res = libchmod(path, attr->st_mode, l);
+  }
+  if (res == 0 && (valid & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+    uid_t uid = (valid & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1;
+    gid_t gid = (valid & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1;
+    res = lchown(path, uid, gid);
+  }
+  if (res == 0 && (valid & FUSE_SET_ATTR_SIZE)) {
+    if (fi != NULL) {
+      res = libftruncate(file_of(fi)->fd, attr->st_size, l);
+    } else {
+      int fd = libopen(path, O_WRONLY, 0, l);
+      res = fd < 0 ? -1 : libftruncate(fd, attr->st_size, l);
+      if (fd >= 0) {
+        libclose(fd, l);
+      }
+    }
+  }
+  if (res == 0 && (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+    struct timespec tv[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_nsec = UTIME_OMIT}};
+    if (valid & FUSE_SET_ATTR_ATIME_NOW) {
+      tv[0].tv_nsec = UTIME_NOW;
+    } else if (valid & FUSE_SET_ATTR_ATIME) {
+      tv[0] = attr->st_atim;
+    }
+    if (valid & FUSE_SET_ATTR_MTIME_NOW) {
+      tv[1].tv_nsec = UTIME_NOW;
+    } else if (valid & FUSE_SET_ATTR_MTIME) {
+      tv[1] = attr->st_mtim;
+    }
+    res = utimensat(AT_FDCWD, path, tv, AT_SYMLINK_NOFOLLOW);
+  }
+
+  struct stat st;
+  if (res == 0) {
+    res = liblstat(path, &st, l);
+  }
+  free(path);
+  if (res == -1) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  fuse_reply_attr(req, &st, options.attr_timeout);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+  char *path = node_path(node_of(ino), NULL);
+  if (!path) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  char target[PATH_MAX + 1];
+  ssize_t res = readlink(path, target, PATH_MAX);
+  free(path);
+  if (res == -1) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  target[res] = '\0';
+  fuse_reply_readlink(req, target);
+}
+
+/**
+ * @brief Create an entry with make, then reply with it
+ */
+static void make_entry(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       int (*make)(const char *path, const void *arg),
+                       const void *arg) {
+  char *path = node_path(node_of(parent), name);
+  if (!path) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  int res = make(path, arg);
+  free(path);
+  if (res == -1) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  reply_entry(req, parent, name, 0);
+}
+
+typedef struct {
+  mode_t mode;
+  dev_t rdev;
+  const char *target;
+} MakeArgs;
+
+static int make_node(const char *path, const void *arg) {
+  const MakeArgs *a = arg;
+  return mknod_wrapper(AT_FDCWD, path, NULL, (int)a->mode, a->rdev);
+}
+
+static int make_dir(const char *path, const void *arg) {
+  return mkdir(path, ((const MakeArgs *)arg)->mode);
+}
+
+static int make_symlink(const char *path, const void *arg) {
+  return symlink(((const MakeArgs *)arg)->target, path);
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode, dev_t rdev) {
+  MakeArgs args = {.mode = mode, .rdev = rdev};
+  make_entry(req, parent, name, make_node, &args);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode) {
+  MakeArgs args = {.mode = mode};
+  make_entry(req, parent, name, make_dir, &args);
+}
+
+static void ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                       const char *name) {
+  MakeArgs args = {.target = link};
+  make_entry(req, parent, name, make_symlink, &args);
+}
+
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                    const char *newname) {
+  char *from = node_path(node_of(ino), NULL);
+  char *to = node_path(node_of(newparent), newname);
+  int res = from && to ? link(from, to) : -1;
+  int err = from && to ? errno : ENOMEM;
+  free(from);
+  free(to);
+  if (res == -1) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  reply_entry(req, newparent, newname, 0);
+}
+
+/**
+ * @brief Remove an entry with remove, and forget its name
+ */
+static void remove_entry(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         int dir) {
+  char *path = node_path(node_of(parent), name);
+  if (!path) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  if (DEBUG_ENABLED()) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    DEBUG_MSG("%s called for %s, userid %d, pid %d", dir ? "rmdir" : "unlink",
+              path, ctx->uid, ctx->pid);
+  }
+
+  int res = dir ? rmdir(path) : libunlink(path, layers_for(path));
+  int err = errno;
+  free(path);
+  if (res == -1) {
+    fuse_reply_err(req, err);
+    return;
+  }
+  pthread_mutex_lock(&names_mutex);
+  Node *node = node_find(node_of(parent), name);
+  if (node) {
+    node_detach(node);
+  }
+  pthread_mutex_unlock(&names_mutex);
+  fuse_reply_err(req, 0);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  remove_entry(req, parent, name, 0);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  remove_entry(req, parent, name, 1);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      fuse_ino_t newparent, const char *newname,
+                      unsigned int flags) {
+  if (flags) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+  char *from = node_path(node_of(parent), name);
+  char *to = node_path(node_of(newparent), newname);
+  if (!from || !to) {
+    free(from);
+    free(to);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  if (DEBUG_ENABLED()) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    DEBUG_MSG("rename called from %s to %s, userid %d, pid %d", from, to,
+              ctx->uid, ctx->pid);
+  }
+
+  int res = librename(from, to, flags, layers_for(from));
+  int err = errno;
+  free(from);
+  free(to);
+  if (res == -1) {
+    fuse_reply_err(req, err);
+    return;
+  }
+
+  // the replaced entry keeps its node until forgotten, the moved one takes
+  // its name
+  pthread_mutex_lock(&names_mutex);
+  Node *replaced = node_find(node_of(newparent), newname);
+  if (replaced) {
+    node_detach(replaced);
+  }
+  Node *node = node_find(node_of(parent), name);
+  if (node) {
+    size_t key_len;
+    char *key = make_key(node_of(newparent), newname, &key_len);
+    char *new_name = strdup(newname);
+    HASH_DEL(names, node);
+    if (key && new_name) {
+      free(node->key);
+      free(node->name);
+      node->key = key;
+      node->key_len = key_len;
+      node->name = new_name;
+      node_of(newparent)->children++;
+      node->parent->children--;
+      Node *old_parent = node->parent;
+      node->parent = node_of(newparent);
+      HASH_ADD_KEYPTR(hh, names, node->key, node->key_len, node);
+      node_release(old_parent);
+    } else {
+      // out of memory: the next lookup gets a new node
+      free(key);
+      free(new_name);
+      node->attached = 0;
+    }
+  }
+  pthread_mutex_unlock(&names_mutex);
+  fuse_reply_err(req, 0);
+}
+
+/**
+ * @brief Flags of an open to the layers: with the writeback cache the kernel
+ * reads write-only files to fill its pages, and does O_APPEND itself
+ */
+static int open_flags(int flags) {
+  if (writeback_enabled) {
+    if ((flags & O_ACCMODE) == O_WRONLY) {
+      flags = (flags & ~O_ACCMODE) | O_RDWR;
+    }
+    flags &= ~O_APPEND;
+  }
+  return flags;
+}
+
+/**
+ * @brief Open path through the layers into fi
+ *
+ * @return int -> 0 on success, an errno value on error
+ */
+static int open_file(char *path, int flags, mode_t mode,
+                     struct fuse_file_info *fi) {
+  LLFile *file = malloc(sizeof(LLFile));
+  if (!file) {
+    return ENOMEM;
+  }
+  file->path = path;
+  file->io = LL_IO_CACHED;
+  file->fd = libopen(path, open_flags(flags), mode, layers_for(path));
+  if (file->fd == -1) {
+    int err = errno;
+    free(file);
+    return err;
+  }
+  fi->fh = (uint64_t)(uintptr_t)file;
+  return 0;
+}
+
+/**
+ * @brief Choose the I/O mode of a new open of node
+ *
+ * Opens read-only of files with a backing file are passed through. The
+ * kernel reads an inode either through passthrough or through the page
+ * cache, so opens next to passthrough ones use direct I/O, and files with
+ * cached opens are not passed through.
+ */
+static void choose_io(fuse_req_t req, Node *node, struct fuse_file_info *fi) {
+  LLFile *file = file_of(fi);
+  int backing_fd = -1;
+  if (passthrough_enabled && (fi->flags & O_ACCMODE) == O_RDONLY) {
+    backing_fd = libbacking_fd(file->fd, layers_for(file->path));
+  }
+
+  pthread_mutex_lock(&names_mutex);
+  if (backing_fd >= 0 && node->cached_opens == 0) {
+    // the kernel keeps its own reference to the file, the first open's fd
+    // can be closed before the others
+    if (node->passthrough_opens == 0) {
+      node->backing_id = fuse_passthrough_open(req, backing_fd);
+    }
+    if (node->backing_id > 0) {
+      node->passthrough_opens++;
+      fi->backing_id = node->backing_id;
+      file->io = LL_IO_PASSTHROUGH;
+    }
+  }
+  if (file->io != LL_IO_PASSTHROUGH) {
+    if (node->passthrough_opens > 0) {
+      fi->direct_io = 1;
+      file->io = LL_IO_DIRECT;
+    } else {
+      node->cached_opens++;
+      file->io = LL_IO_CACHED;
+    }
+  }
+  pthread_mutex_unlock(&names_mutex);
+
+  if (DEBUG_ENABLED() && file->io == LL_IO_PASSTHROUGH) {
+    DEBUG_MSG("open of %s passed through, backing id %d", file->path,
+              fi->backing_id);
+  }
+}
+
+/**
+ * @brief Close an open file of node, and drop its share of the I/O mode
+ *
+ * @return int -> 0 on success, an errno value on error
+ */
+static int close_file(fuse_req_t req, Node *node, LLFile *file) {
+  pthread_mutex_lock(&names_mutex);
+  if (file->io == LL_IO_PASSTHROUGH && --node->passthrough_opens == 0) {
+    fuse_passthrough_close(req, node->backing_id);
+    node->backing_id = 0;
+  } else if (file->io == LL_IO_CACHED && node->cached_opens > 0) {
+    node->cached_opens--;
+  }
+  pthread_mutex_unlock(&names_mutex);
+
+  int res = libclose(file->fd, layers_for(file->path));
+  int err = errno;
+  free(file->path);
+  free(file);
+  return res == -1 ? err : 0;
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino,
+                    struct fuse_file_info *fi) {
+  char *path = node_path(node_of(ino), NULL);
+  if (!path) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  if (DEBUG_ENABLED()) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    DEBUG_MSG("open called for %s, flags 0x%x, userid %d, pid %d", path,
+              fi->flags, ctx->uid, ctx->pid);
+  }
+
+  int err = open_file(path, fi->flags, 0, fi);
+  if (err != 0) {
+    free(path);
+    fuse_reply_err(req, err);
+    return;
+  }
+  choose_io(req, node_of(ino), fi);
+  if (fuse_reply_open(req, fi) != 0) {
+    close_file(req, node_of(ino), file_of(fi));
+  }
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      mode_t mode, struct fuse_file_info *fi) {
+  char *path = node_path(node_of(parent), name);
+  if (!path) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  if (DEBUG_ENABLED()) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    DEBUG_MSG("create called for %s, userid %d, pid %d", path, ctx->uid,
+              ctx->pid);
+  }
+
+  struct fuse_entry_param e = entry_param();
+  int err = open_file(path, fi->flags | O_CREAT, mode, fi);
+  if (err != 0) {
+    free(path);
+    fuse_reply_err(req, err);
+    return;
+  }
+  LLFile *file = file_of(fi);
+  Node *node = NULL;
+  if (liblstat(file->path, &e.attr, layers_for(file->path)) == -1) {
+    err = errno;
+  } else if (!(node = node_lookup(node_of(parent), name, &e.attr))) {
+    err = ENOMEM;
+  }
+  if (err != 0) {
+    fuse_reply_err(req, err);
+    libclose(file->fd, layers_for(file->path));
+    free(file->path);
+    free(file);
+    return;
+  }
+  e.ino = ino_of(node);
+  choose_io(req, node, fi);
+  if (fuse_reply_create(req, &e, fi) != 0) {
+    close_file(req, node, file);
+    forget_one(e.ino, 1);
+  }
+}
+
+// read or write_buf handed to a fiber loop
+typedef struct {
+  fuse_req_t req; // request to reply to
+  LLFile *file;   // open file
+  size_t size;    // bytes to read, or of data
+  off_t off;      // offset in the file
+  char *data;     // write_buf: pooled copy of the data
+} LLTask;
+
+/**
+ * @brief Run an LLTask on the next fiber loop
+ *
+ * @return int -> 0 if queued, -1 if the caller must run it (no loops, or the
+ * loop is full)
+ */
+static int fiber_submit(FiberFn fn, fuse_req_t req, LLFile *file, size_t size,
+                        off_t off, char *data) {
+  if (!fiber_loops) {
+    return -1;
+  }
+  LLTask *task = malloc(sizeof(LLTask));
+  if (!task) {
+    return -1;
+  }
+  *task = (LLTask){
+      .req = req, .file = file, .size = size, .off = off, .data = data};
+  unsigned n = __atomic_fetch_add(&next_fiber_loop, 1, __ATOMIC_RELAXED);
+  if (fiber_loop_submit(fiber_loops[n % options.fibers], fn, task) != 0) {
+    free(task);
+    return -1;
+  }
+  return 0;
+}
+
+static void read_reply(fuse_req_t req, LLFile *file, size_t size, off_t off) {
+  // the buffers and the pool tasks of this thread then stay on its node
+  (void)numa_policy_steer_thread();
+
+  // fuse_reply_data has copied or spliced the buffer once it returns
+  BufferPool *pool = buffer_pool_shared();
+  char *buffer = buffer_pool_get(pool, size);
+  if (!buffer) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  struct iovec iov = {.iov_base = buffer, .iov_len = size};
+  ssize_t res = libpreadv(file->fd, &iov, 1, off, layers_for(file->path));
+  if (res == -1) {
+    fuse_reply_err(req, errno);
+  } else {
+    struct fuse_bufvec data = FUSE_BUFVEC_INIT((size_t)res);
+    data.buf[0].mem = buffer;
+    fuse_reply_data(req, &data, 0);
+  }
+  buffer_pool_put(pool, buffer);
+}
+
+static void read_task(void *arg) {
+  LLTask *task = arg;
+  read_reply(task->req, task->file, task->size, task->off);
+  free(task);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info *fi) {
+  (void)ino;
+  LLFile *file = file_of(fi);
+
+  if (DEBUG_ENABLED()) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    DEBUG_MSG("read called for %s, size %zu, offset %ld, userid %d, pid %d",
+              file->path, size, (long)off, ctx->uid, ctx->pid);
+  }
+
+  // the kernel sends no release of the file before the reply
+  if (fiber_submit(read_task, req, file, size, off, NULL) != 0) {
+    read_reply(req, file, size, off);
+  }
+}
+
+static void write_reply(fuse_req_t req, LLFile *file,
+                        const struct iovec *iov, int iovcnt, off_t off) {
+  ssize_t res = libpwritev(file->fd, iov, iovcnt, off, layers_for(file->path));
+  if (res == -1) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  fuse_reply_write(req, (size_t)res);
+}
+
+static void write_task(void *arg) {
+  LLTask *task = arg;
+  (void)numa_policy_steer_thread(); // as in ll_read
+  struct iovec iov = {.iov_base = task->data, .iov_len = task->size};
+  write_reply(task->req, task->file, &iov, 1, task->off);
+  buffer_pool_put(buffer_pool_shared(), task->data);
+  free(task);
+}
+
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_bufvec *in, off_t off,
+                         struct fuse_file_info *fi) {
+  (void)ino;
+  LLFile *file = file_of(fi);
+  size_t size = fuse_buf_size(in);
+
+  if (DEBUG_ENABLED()) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    DEBUG_MSG("write_buf called for %s, size %zu, offset %ld, userid %d, "
+              "pid %d",
+              file->path, size, (long)off, ctx->uid, ctx->pid);
+  }
+
+  (void)numa_policy_steer_thread(); // as in ll_read
+
+  // data spliced from the kernel is in a pipe, it is copied once into a
+  // pooled buffer; memory buffers go to the layers as they are, unless a
+  // fiber loop writes them after the buffers are reused
+  BufferPool *pool = buffer_pool_shared();
+  char *copy = NULL;
+  for (size_t i = in->idx; i < in->count; i++) {
+    if (fiber_loops || (in->buf[i].flags & FUSE_BUF_IS_FD)) {
+      copy = buffer_pool_get(pool, size);
+      if (!copy) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+      }
+      struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+      dst.buf[0].mem = copy;
+      ssize_t copied = fuse_buf_copy(&dst, in, 0);
+      if (copied < 0) {
+        buffer_pool_put(pool, copy);
+        fuse_reply_err(req, (int)-copied);
+        return;
+      }
+      size = (size_t)copied;
+      break;
+    }
+  }
+  if (copy && fiber_submit(write_task, req, file, size, off, copy) == 0) {
+    return;
+  }
+
+  int iovcnt = copy ? 1 : (int)(in->count - in->idx);
+  struct iovec iov[iovcnt > 0 ? iovcnt : 1];
+  if (copy) {
+    iov[0] = (struct iovec){.iov_base = copy, .iov_len = size};
+  } else {
+    for (int i = 0; i < iovcnt; i++) {
+      const struct fuse_buf *b = &in->buf[in->idx + i];
+      size_t skip = i == 0 ? in->off : 0;
+      iov[i].iov_base = (char *)b->mem + skip;
+      iov[i].iov_len = b->size - skip;
+    }
+  }
+
+  write_reply(req, file, iov, iovcnt, off);
+  buffer_pool_put(pool, copy);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino,
+                     struct fuse_file_info *fi) {
+  (void)ino;
+  (void)fi;
+  // the writeback cache already sent the dirty pages, and the layers keep
+  // nothing per close(2) of a duplicated fd
+  fuse_reply_err(req, 0);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi) {
+  LLFile *file = file_of(fi);
+
+  if (DEBUG_ENABLED()) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    DEBUG_MSG("release called for %s, userid %d, pid %d", file->path, ctx->uid,
+              ctx->pid);
+  }
+
+  fuse_reply_err(req, close_file(req, node_of(ino), file));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                     struct fuse_file_info *fi) {
+  (void)ino;
+  LLFile *file = file_of(fi);
+  int res = libfsync(file->fd, datasync, layers_for(file->path));
+  fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+                               struct fuse_file_info *fi_in,
+                               fuse_ino_t ino_out, off_t off_out,
+                               struct fuse_file_info *fi_out, size_t len,
+                               int flags) {
+  (void)ino_in;
+  (void)ino_out;
+  LLFile *in = file_of(fi_in);
+  LLFile *out = file_of(fi_out);
+
+  if (DEBUG_ENABLED()) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    DEBUG_MSG("copy_file_range called from %s to %s, size %zu, userid %d, "
+              "pid %d",
+              in->path, out->path, len, ctx->uid, ctx->pid);
+  }
+
+  // the kernel flushed the source and dropped the cached destination pages;
+  // the layers clone what they can and read and write the rest
+  ssize_t res = libcopy_file_range(in->fd, off_in, out->fd, off_out, len,
+                                   (unsigned int)flags, layers_for(out->path));
+  if (res == -1) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  fuse_reply_write(req, (size_t)res);
+}
+
+static void dir_clear(LLDir *dir) {
+  for (size_t i = 0; i < dir->count; i++) {
+    free(dir->entries[i].name);
+  }
+  dir->count = 0;
+  dir->error = 0;
+}
+
+static int dir_add(void *buf, const char *name, const struct stat *stbuf,
+                   off_t off, unsigned int flags) {
+  (void)off;
+  LLDir *dir = buf;
+  if (dir->count == dir->capacity) {
+    size_t capacity = dir->capacity ? 2 * dir->capacity : 64;
+    LLDirEntry *entries =
+        realloc(dir->entries, capacity * sizeof(LLDirEntry));
+    if (!entries) {
+      dir->error = ENOMEM;
+      return 1;
+    }
+    dir->entries = entries;
+    dir->capacity = capacity;
+  }
+  LLDirEntry *entry = &dir->entries[dir->count];
+  entry->name = strdup(name);
+  if (!entry->name) {
+    dir->error = ENOMEM;
+    return 1;
+  }
+  entry->st = *stbuf;
+  entry->plus = (flags & LAYER_FILL_DIR_PLUS) != 0;
+  dir->count++;
+  return 0;
+}
+
+/**
+ * @brief Take the listing of a directory from the layers
+ *
+ * @param plus -> ask the layers for the attributes of the entries
+ * @return int -> 0 if successful, errno otherwise
+ */
+static int dir_list(LLDir *dir, fuse_ino_t ino, int plus) {
+  dir_clear(dir);
+  char *path = node_path(node_of(ino), NULL);
+  if (!path) {
+    return ENOMEM;
+  }
+  int res = libreaddir(path, dir, dir_add, 0, NULL,
+                       plus ? LAYER_READDIR_PLUS : 0, layers_for(path));
+  free(path);
+  if (res < 0) {
+    dir_clear(dir);
+    return -res;
+  }
+  return dir->error;
+}
+
+static inline int is_dot_or_dotdot(const char *name) {
+  return name[0] == '.' &&
+         (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+/**
+ * @brief Entry of a readdirplus reply, with a lookup of the entry the kernel
+ * will forget. Entries the layers gave no attributes for are looked up
+ * through them; . and .. and entries that can't be looked up go without
+ * (inode 0), and the kernel looks them up itself if needed
+ *
+ * @return Node* -> node looked up, NULL if none
+ */
+static Node *dir_entry_param(Node *parent, const LLDirEntry *entry,
+                             struct fuse_entry_param *e) {
+  *e = entry_param();
+  e->attr = entry->st;
+  if (is_dot_or_dotdot(entry->name)) {
+    return NULL;
+  }
+  if (!entry->plus) {
+    char *path = node_path(parent, entry->name);
+    struct stat st;
+    int res = path ? liblstat(path, &st, layers_for(path)) : -1;
+    free(path);
+    if (res != 0) {
+      return NULL;
+    }
+    e->attr = st;
+  }
+  Node *node = node_lookup(parent, entry->name, &e->attr);
+  if (node) {
+    e->ino = ino_of(node);
+  }
+  return node;
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi) {
+  (void)ino;
+  LLDir *dir = calloc(1, sizeof(LLDir));
+  if (!dir) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  fi->fh = (uint64_t)(uintptr_t)dir;
+  if (fuse_reply_open(req, fi) != 0) {
+    free(dir);
+  }
+}
+
+/**
+ * @brief Reply to readdir and readdirplus, from a listing taken again at
+ * offset 0 (rewinddir sees new entries)
+ */
+static void reply_dir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                      off_t offset, struct fuse_file_info *fi, int plus) {
+  LLDir *dir = (LLDir *)(uintptr_t)fi->fh;
+  if (offset == 0) {
+    int err = dir_list(dir, ino, plus);
+    if (err != 0) {
+      fuse_reply_err(req, err);
+      return;
+    }
+  }
+  size_t first = (size_t)offset < dir->count ? (size_t)offset : dir->count;
+  char *buf = malloc(size);
+  // nodes of the reply, forgotten again if the kernel doesn't get it
+  Node **nodes = plus ? calloc(dir->count - first + 1, sizeof(Node *)) : NULL;
+  if (!buf || (plus && !nodes)) {
+    free(buf);
+    free(nodes);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  size_t used = 0;
+  size_t looked_up = 0;
+  for (size_t i = first; i < dir->count; i++) {
+    const LLDirEntry *entry = &dir->entries[i];
+    off_t next = (off_t)i + 1;
+    size_t entsize;
+    if (!plus) {
+      entsize = fuse_add_direntry(req, buf + used, size - used, entry->name,
+                                  &entry->st, next);
+      if (entsize > size - used) {
+        break;
+      }
+    } else {
+      // the size only depends on the name, check it before the lookup
+      if (fuse_add_direntry_plus(req, NULL, 0, entry->name, NULL, 0) >
+          size - used) {
+        break;
+      }
+      struct fuse_entry_param e;
+      Node *node = dir_entry_param(node_of(ino), entry, &e);
+      if (node) {
+        nodes[looked_up++] = node;
+      }
+      entsize = fuse_add_direntry_plus(req, buf + used, size - used,
+                                       entry->name, &e, next);
+    }
+    used += entsize;
+  }
+  if (fuse_reply_buf(req, buf, used) != 0) {
+    for (size_t i = 0; i < looked_up; i++) {
+      forget_one(ino_of(nodes[i]), 1);
+    }
+  }
+  free(nodes);
+  free(buf);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                       off_t offset, struct fuse_file_info *fi) {
+  reply_dir(req, ino, size, offset, fi, 0);
+}
+
+static void ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                           off_t offset, struct fuse_file_info *fi) {
+  if (DEBUG_ENABLED()) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    DEBUG_MSG("readdirplus called for %lu at %ld, userid %d, pid %d",
+              (unsigned long)ino, (long)offset, ctx->uid, ctx->pid);
+  }
+
+  reply_dir(req, ino, size, offset, fi, 1);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi) {
+  (void)ino;
+  LLDir *dir = (LLDir *)(uintptr_t)fi->fh;
+  dir_clear(dir);
+  free(dir->entries);
+  free(dir);
+  fuse_reply_err(req, 0);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+  char *path = node_path(node_of(ino), NULL);
+  if (!path) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  struct statvfs stbuf;
+  int res = statvfs(path, &stbuf);
+  free(path);
+  if (res == -1) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  fuse_reply_statfs(req, &stbuf);
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+  char *path = node_path(node_of(ino), NULL);
+  if (!path) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  int res = access(path, mask);
+  free(path);
+  fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+/**
+ * @brief Invalidation hook of the layers: queue the node of the backend file
+ */
+static void queue_invalidation(dev_t device, ino_t inode, void *ctx) {
+  (void)ctx;
+  LLInodeKey backend = {.device = device, .inode = inode};
+  Node *node = NULL;
+  pthread_mutex_lock(&names_mutex);
+  HASH_FIND(hh_inode, inodes, &backend, sizeof(LLInodeKey), node);
+  fuse_ino_t ino = node ? ino_of(node) : 0;
+  pthread_mutex_unlock(&names_mutex);
+  if (ino == 0) {
+    return; // the kernel has no attributes of it
+  }
+
+  pthread_mutex_lock(&inval_mutex);
+  // repeated invalidations of an inode are merged on the way out, this only
+  // skips the common case of a file growing write after write
+  if (inval_count == 0 || inval_queue[inval_count - 1] != ino) {
+    if (inval_count == inval_capacity) {
+      size_t capacity = inval_capacity ? 2 * inval_capacity : 64;
+      fuse_ino_t *queue = realloc(inval_queue, capacity * sizeof(fuse_ino_t));
+      if (!queue) {
+        // out of memory: the attributes expire with attr_timeout
+        pthread_mutex_unlock(&inval_mutex);
+        return;
+      }
+      inval_queue = queue;
+      inval_capacity = capacity;
+    }
+    inval_queue[inval_count++] = ino;
+    pthread_cond_signal(&inval_cond);
+  }
+  pthread_mutex_unlock(&inval_mutex);
+}
+
+static int compare_ino(const void *a, const void *b) {
+  fuse_ino_t x = *(const fuse_ino_t *)a, y = *(const fuse_ino_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Send the queued invalidations to the kernel, attributes only
+ */
+static void *inval_loop(void *arg) {
+  (void)arg;
+  fuse_ino_t *batch = NULL;
+  size_t batch_capacity = 0;
+
+  pthread_mutex_lock(&inval_mutex);
+  while (!inval_stop) {
+    if (inval_count == 0) {
+      pthread_cond_wait(&inval_cond, &inval_mutex);
+      continue;
+    }
+    // take the queue, and leave the spare buffer for the next one
+    fuse_ino_t *queue = inval_queue;
+    size_t count = inval_count;
+    size_t capacity = inval_capacity;
+    inval_queue = batch;
+    inval_capacity = batch_capacity;
+    inval_count = 0;
+    batch = queue;
+    batch_capacity = capacity;
+    pthread_mutex_unlock(&inval_mutex);
+
+    qsort(batch, count, sizeof(fuse_ino_t), compare_ino);
+    for (size_t i = 0; i < count; i++) {
+      if (i == 0 || batch[i] != batch[i - 1]) {
+        // -ENOENT when the kernel already forgot the inode
+        (void)fuse_lowlevel_notify_inval_inode(session, batch[i], -1, 0);
+      }
+    }
+    pthread_mutex_lock(&inval_mutex);
+  }
+  pthread_mutex_unlock(&inval_mutex);
+  free(batch);
+  return NULL;
+}
+
+/**
+ * @brief Start sending the layers' invalidations, if attributes are cached
+ *
+ * @return int -> 0 on success, -1 if the thread could not be started
+ */
+static int inval_start(struct fuse_session *se) {
+  if (options.attr_timeout <= 0) {
+    return 0;
+  }
+  session = se;
+  if (pthread_create(&inval_thread, NULL, inval_loop, NULL) != 0) {
+    return -1;
+  }
+  layer_invalidate_hook_set(queue_invalidation, NULL);
+  return 0;
+}
+
+static void inval_stop_thread(void) {
+  if (!session) {
+    return;
+  }
+  layer_invalidate_hook_set(NULL, NULL);
+  pthread_mutex_lock(&inval_mutex);
+  inval_stop = 1;
+  pthread_cond_signal(&inval_cond);
+  pthread_mutex_unlock(&inval_mutex);
+  pthread_join(inval_thread, NULL);
+  free(inval_queue);
+  inval_queue = NULL;
+  session = NULL;
+}
+
+/**
+ * @brief Start the fiber loops of -o fibers
+ *
+ * @return int -> 0 on success, -1 if a loop could not be started
+ */
+static int fibers_start(void) {
+  if (options.fibers == 0) {
+    return 0;
+  }
+  FiberLoop **loops = calloc(options.fibers, sizeof(FiberLoop *));
+  if (!loops) {
+    return -1;
+  }
+  for (unsigned i = 0; i < options.fibers; i++) {
+    loops[i] = fiber_loop_init(0, 0);
+    if (!loops[i]) {
+      while (i > 0) {
+        fiber_loop_destroy(loops[--i]);
+      }
+      free(loops);
+      return -1;
+    }
+  }
+  fiber_loops = loops;
+  return 0;
+}
+
+// once the session loop returned: the tasks left reply, then the loops stop
+static void fibers_stop(void) {
+  if (!fiber_loops) {
+    return;
+  }
+  for (unsigned i = 0; i < options.fibers; i++) {
+    fiber_loop_destroy(fiber_loops[i]);
+  }
+  free(fiber_loops);
+  fiber_loops = NULL;
+}
+
+static const struct fuse_lowlevel_ops ll_oper = {
+    .init = ll_init,
+    .destroy = ll_destroy,
+    .lookup = ll_lookup,
+    .forget = ll_forget,
+    .forget_multi = ll_forget_multi,
+    .getattr = ll_getattr,
+    .setattr = ll_setattr,
+    .readlink = ll_readlink,
+    .mknod = ll_mknod,
+    .mkdir = ll_mkdir,
+    .symlink = ll_symlink,
+    .link = ll_link,
+    .unlink = ll_unlink,
+    .rmdir = ll_rmdir,
+    .rename = ll_rename,
+    .open = ll_open,
+    .create = ll_create,
+    .read = ll_read,
+    .write_buf = ll_write_buf,
+    .flush = ll_flush,
+    .release = ll_release,
+    .fsync = ll_fsync,
+    .copy_file_range = ll_copy_file_range,
+    .opendir = ll_opendir,
+    .readdir = ll_readdir,
+    .readdirplus = ll_readdirplus,
+    .releasedir = ll_releasedir,
+    .statfs = ll_statfs,
+    .access = ll_access,
+};
+
+int main(int argc, char *argv[]) {
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct fuse_cmdline_opts opts;
+  struct fuse_session *se;
+  int ret = 1;
+
+  umask(0);
+
+  // before the FUSE options, so that the path of --config is not taken for
+  // the mountpoint
+  if (fuse_opt_parse(&args, &options, ll_opts, NULL) == -1 ||
+      fuse_parse_cmdline(&args, &opts) != 0) {
+    fuse_opt_free_args(&args);
+    return 1;
+  }
+  if (opts.show_help) {
+    printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+    printf("    -o source=DIR          backend directory to mirror\n"
+           "    --config=PATH          layer configuration\n"
+           "    -o max_write=N         largest write request (default: %d)\n"
+           "    -o no_writeback_cache  disable the kernel writeback cache\n"
+           "    -o no_splice           disable splicing to and from "
+           "/dev/fuse\n"
+           "    -o passthrough         read verified read-only files from "
+           "their backing file\n"
+           "    -o fibers=N            run read and write on N fiber loops "
+           "(default: 0)\n"
+           "    -o attr_timeout=S      seconds attributes are cached "
+           "(default: %.0f)\n"
+           "    -o entry_timeout=S     seconds names are cached (default: "
+           "%.0f)\n"
+           "    -o negative_timeout=S  seconds missing names are cached "
+           "(default: 0)\n\n",
+           LL_MAX_WRITE, LL_ATTR_TIMEOUT, LL_ATTR_TIMEOUT);
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
+    ret = 0;
+    goto out_args;
+  }
+  if (opts.show_version) {
+    printf("FUSE library version %s\n", fuse_pkgversion());
+    fuse_lowlevel_version();
+    ret = 0;
+    goto out_args;
+  }
+  if (opts.mountpoint == NULL) {
+    (void)fprintf(stderr, "usage: %s [options] <mountpoint>\n", argv[0]);
+    goto out_args;
+  }
+
+  if (options.source == NULL) {
+    (void)fprintf(stderr, "-o source=DIR is required\n");
+    goto out_args;
+  }
+  if (options.max_write == 0 || options.max_write > LL_MAX_WRITE) {
+    options.max_write = LL_MAX_WRITE;
+  }
+
+  lroot = libinit(options.config);
+  if (!lroot.ops) {
+    (void)fprintf(stderr, "Failed to initialize library with config: %s\n",
+                  options.config ? options.config : "./config.toml");
+    goto out_args;
+  }
+
+  se = fuse_session_new(&args, &ll_oper, sizeof(ll_oper), NULL);
+  if (se == NULL) {
+    libdestroy(lroot);
+    goto out_args;
+  }
+  if (fuse_set_signal_handlers(se) != 0) {
+    goto out_session;
+  }
+  if (fuse_session_mount(se, opts.mountpoint) != 0) {
+    goto out_signals;
+  }
+
+  fuse_daemonize(opts.foreground);
+
+  // after fuse_daemonize, the threads of the parent do not survive the fork
+  if (inval_start(se) != 0) {
+    (void)fprintf(stderr, "Failed to start the invalidation thread\n");
+    goto out_unmount;
+  }
+  if (fibers_start() != 0) {
+    (void)fprintf(stderr, "Failed to start the fiber loops\n");
+    inval_stop_thread();
+    goto out_unmount;
+  }
+  // replaces the SIGHUP handler of fuse_set_signal_handlers, which unmounts
+  if (libreload_on_sighup(options.config) != 0) {
+    (void)fprintf(stderr, "Failed to reload the configuration on SIGHUP\n");
+  }
+
+  if (opts.singlethread) {
+    ret = fuse_session_loop(se);
+  } else {
+    struct fuse_loop_config *config = fuse_loop_cfg_create();
+    fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+    fuse_loop_cfg_set_max_threads(config, opts.max_threads);
+    ret = fuse_session_loop_mt(se, config);
+    fuse_loop_cfg_destroy(config);
+  }
+  fibers_stop();
+  inval_stop_thread();
+
+out_unmount:
+  fuse_session_unmount(se);
+out_signals:
+  fuse_remove_signal_handlers(se);
+out_session:
+  fuse_session_destroy(se);
+out_args:
+  free(opts.mountpoint);
+  fuse_opt_free_args(&args);
+  return ret ? 1 : 0;
+}
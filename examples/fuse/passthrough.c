@@ -54,6 +54,9 @@
 #include "passthrough_helpers.h"
 
 static int fill_dir_plus = 0;
+static double entry_timeout = 0;
+static double attr_timeout = 0;
+static double negative_timeout = 0;
 LayerContext lroot;
 
 static void *xmp_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
@@ -66,10 +69,13 @@ static void *xmp_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
      the to-be-removed entry and can therefore not invalidate
      the cache of the associated inode - resulting in an
      incorrect st_nlink value being reported for any remaining
-     hardlinks to this inode. */
-  cfg->entry_timeout = 0;
-  cfg->attr_timeout = 0;
-  cfg->negative_timeout = 0;
+     hardlinks to this inode. Layers changing sizes behind the kernel
+     (compression) can't invalidate the cache of this frontend either, so
+     caching stays off unless asked for with --entry-timeout,
+     --attr-timeout and --negative-timeout. */
+  cfg->entry_timeout = entry_timeout;
+  cfg->attr_timeout = attr_timeout;
+  cfg->negative_timeout = negative_timeout;
 
   if (DEBUG_ENABLED()) {
     struct fuse_context *f_ctx = fuse_get_context();
@@ -142,36 +148,35 @@ static int xmp_readlink(const char *path, char *buf, size_t size) {
   return 0;
 }
 
+// Hands the entries listed by the layers over to FUSE
+typedef struct {
+  void *buf;
+  fuse_fill_dir_t filler;
+} XmpDirFill;
+
+static int xmp_filler(void *buf, const char *name, const struct stat *stbuf,
+                      off_t off, unsigned int flags) {
+  XmpDirFill *fill = (XmpDirFill *)buf;
+  return fill->filler(fill->buf, name, stbuf, off,
+                      (enum fuse_fill_dir_flags)(flags & FUSE_FILL_DIR_PLUS));
+}
+
 static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                        off_t offset, struct fuse_file_info *fi,
                        enum fuse_readdir_flags flags) {
-  DIR *dp;
-  struct dirent *de;
-
-  (void)offset;
-  (void)fi;
-  (void)flags;
   if (DEBUG_ENABLED()) {
     struct fuse_context *f_ctx = fuse_get_context();
     DEBUG_MSG("readdir called for %s, userid %d, pid %d", path, f_ctx->uid,
               f_ctx->pid);
   }
 
-  dp = opendir(path);
-  if (dp == NULL)
-    return -errno;
-
-  while ((de = readdir(dp)) != NULL) {
-    struct stat st;
-    memset(&st, 0, sizeof(st));
-    st.st_ino = de->d_ino;
-    st.st_mode = de->d_type << 12;
-    if (filler(buf, de->d_name, &st, 0, fill_dir_plus))
-      break;
-  }
-
-  closedir(dp);
-  return 0;
+  /* With --plus, the layers give the attributes of the entries (with the
+     logical sizes of compressed files), and FUSE gets them without a
+     lookup per entry */
+  XmpDirFill fill = {buf, filler};
+  unsigned int layer_flags =
+      fill_dir_plus && (flags & FUSE_READDIR_PLUS) ? LAYER_READDIR_PLUS : 0;
+  return libreaddir(path, &fill, xmp_filler, offset, fi, layer_flags, lroot);
 }
 
 static int xmp_mknod(const char *path, mode_t mode, dev_t rdev) {
@@ -422,8 +427,9 @@ static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
   if (fd == -1)
     return -errno;
 
-  lroot.app_context = strdup(path);
-  res = (int)libpread(fd, buf, size, offset, lroot);
+  // the path of the request, without writing the shared root
+  res = (int)libpread(fd, buf, size, offset,
+                      layer_with_app_context(lroot, (void *)path));
 
   if (res == -1)
     res = -errno;
@@ -453,8 +459,65 @@ static int xmp_write(const char *path, const char *buf, size_t size,
   if (fd == -1)
     return -errno;
 
-  lroot.app_context = strdup(path);
-  res = (int)libpwrite(fd, buf, size, offset, lroot);
+  res = (int)libpwrite(fd, buf, size, offset,
+                       layer_with_app_context(lroot, (void *)path));
+  if (res == -1)
+    res = -errno;
+
+  if (fi == NULL)
+    libclose(fd, lroot);
+
+  return res;
+}
+
+static int xmp_write_buf(const char *path, struct fuse_bufvec *buf,
+                         off_t offset, struct fuse_file_info *fi) {
+  int res, fd;
+  size_t size = fuse_buf_size(buf);
+
+  if (DEBUG_ENABLED()) {
+    struct fuse_context *f_ctx = fuse_get_context();
+    DEBUG_MSG("write_buf called for %s, size %zu, offset %ld, userid %d, "
+              "pid %d",
+              path, size, offset, f_ctx->uid, f_ctx->pid);
+  }
+
+  // buffers spliced from the kernel are not in memory, copy them once
+  for (size_t i = buf->idx; i < buf->count; i++) {
+    if (buf->buf[i].flags & FUSE_BUF_IS_FD) {
+      char *mem = malloc(size);
+      if (mem == NULL)
+        return -ENOMEM;
+      struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+      dst.buf[0].mem = mem;
+      ssize_t copied = fuse_buf_copy(&dst, buf, 0);
+      res = copied < 0 ? (int)copied
+                       : xmp_write(path, mem, (size_t)copied, offset, fi);
+      free(mem);
+      return res;
+    }
+  }
+
+  if (fi == NULL)
+    fd = libopen(path, O_WRONLY, 0, lroot);
+  else
+    fd = (int)fi->fh;
+
+  if (fd == -1)
+    return -errno;
+
+  // hand the memory buffers to the layers as they are
+  int iovcnt = (int)(buf->count - buf->idx);
+  struct iovec iov[iovcnt];
+  for (int i = 0; i < iovcnt; i++) {
+    const struct fuse_buf *b = &buf->buf[buf->idx + i];
+    size_t skip = i == 0 ? buf->off : 0;
+    iov[i].iov_base = (char *)b->mem + skip;
+    iov[i].iov_len = b->size - skip;
+  }
+
+  res = (int)libpwritev(fd, iov, iovcnt, offset,
+                        layer_with_app_context(lroot, (void *)path));
   if (res == -1)
     res = -errno;
 
@@ -510,6 +573,27 @@ static int xmp_fsync(const char *path, int isdatasync,
   return fdatasync((int)fi->fh);
 }
 
+static ssize_t xmp_copy_file_range(const char *path_in,
+                                   struct fuse_file_info *fi_in,
+                                   off_t offset_in, const char *path_out,
+                                   struct fuse_file_info *fi_out,
+                                   off_t offset_out, size_t len, int flags) {
+  if (DEBUG_ENABLED()) {
+    struct fuse_context *f_ctx = fuse_get_context();
+    DEBUG_MSG("copy_file_range called from %s to %s, size %zu, userid %d, "
+              "pid %d",
+              path_in, path_out, len, f_ctx->uid, f_ctx->pid);
+  }
+
+  ssize_t res = libcopy_file_range(
+      (int)fi_in->fh, offset_in, (int)fi_out->fh, offset_out, len,
+      (unsigned int)flags, layer_with_app_context(lroot, (void *)path_out));
+  if (res == -1)
+    return -errno;
+
+  return res;
+}
+
 #ifdef HAVE_SETXATTR
 /* xattr operations are optional and can safely be left unimplemented */
 static int xmp_setxattr(const char *path, const char *name, const char *value,
@@ -620,9 +704,11 @@ static const struct fuse_operations xmp_oper = {
     .create = xmp_create,
     .read = xmp_read,
     .write = xmp_write,
+    .write_buf = xmp_write_buf,
     .statfs = xmp_statfs,
     .release = xmp_release,
     .fsync = xmp_fsync,
+    .copy_file_range = xmp_copy_file_range,
 #ifdef HAVE_SETXATTR
     .setxattr = xmp_setxattr,
     .getxattr = xmp_getxattr,
@@ -640,12 +726,18 @@ int main(int argc, char *argv[]) {
 
   umask(0);
 
-  /* Process the "--plus" and "--config" options */
+  /* Process the "--plus", "--config" and timeout options */
   for (i = 0, new_argc = 0; (i < argc) && (new_argc < MAX_ARGS); i++) {
     if (!strcmp(argv[i], "--plus")) {
       fill_dir_plus = FUSE_FILL_DIR_PLUS;
     } else if (!strcmp(argv[i], "--config") && i + 1 < argc) {
       config_path = argv[++i]; // Skip the next argument (config path)
+    } else if (!strcmp(argv[i], "--entry-timeout") && i + 1 < argc) {
+      entry_timeout = strtod(argv[++i], NULL);
+    } else if (!strcmp(argv[i], "--attr-timeout") && i + 1 < argc) {
+      attr_timeout = strtod(argv[++i], NULL);
+    } else if (!strcmp(argv[i], "--negative-timeout") && i + 1 < argc) {
+      negative_timeout = strtod(argv[++i], NULL);
     } else {
       new_argv[new_argc++] = argv[i];
     }
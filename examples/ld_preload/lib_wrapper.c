@@ -1,224 +1,440 @@
 /* Define function wrappers for our library with proper name and setup, suitable
- * to use LD_PRELOAD */
+ * to use LD_PRELOAD
+ *
+ * The library is initialized once, by a constructor, before main. Files
+ * opened after that go through the layers, and their fds are marked in an
+ * ownership bitmap: the I/O calls of an fd test its bit and go to the layers
+ * or straight to libc (sockets, pipes, inherited fds, ...), without a lookup
+ * nor an init check. read/write/lseek keep the file position of an owned fd
+ * here, since the layers only take positioned I/O.
+ *
+ * Calls the layers make themselves (a thread in the library) always go to
+ * libc, even on owned fds: the local layer works on the fds it returned.
+ *
+ * dup/dup2/fcntl(F_DUPFD) copies of an owned fd and FILE streams over one
+ * are not tracked, their I/O goes to libc. */
+
+#define _GNU_SOURCE
 
-#include "glib.h"
-#include "glibconfig.h"
 #include "lib.h"
 #include "shared/types/layer_context.h"
 #include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#define WRAPPER_MAX_FDS 65536      // fds of files opened through the layers
+#define WRAPPER_POSITION_LOCKS 64  // stripes of the file position locks
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
 LayerContext lroot = {0};
 
-// these booleans are used to detect if the lib needs to be initialized and if
-// it is currently being initialized (avoid infinite cycles)
-static int lib_is_initializing = 0;
+// set once libinit returned, opens go to libc before
 static int lib_is_init = 0;
 
-// this hash table (working as a set) contains file descriptors that weren't
-// opened with our library and therefore must be closed with libc close
-GHashTable *fds_set = NULL;
+// set while the thread runs library code, its calls go to libc
+static __thread int in_library
+    __attribute__((tls_model("initial-exec"))) = 0;
 
-// original libc functions that will be dinamically loaded
-static void *libc_handle = NULL;
-static int (*libc_close)(int fd) = NULL;
+// fds opened through the library, and the ones of them opened with O_APPEND
+static unsigned long owned_fds[WRAPPER_MAX_FDS / BITS_PER_WORD];
+static unsigned long append_fds[WRAPPER_MAX_FDS / BITS_PER_WORD];
+
+// file positions of read/write/lseek on owned fds
+static off_t positions[WRAPPER_MAX_FDS];
+static pthread_mutex_t position_locks[WRAPPER_POSITION_LOCKS] = {
+    [0 ... WRAPPER_POSITION_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER};
+
+// original libc functions, resolved by the constructor (or by the first call
+// that comes before it, from another constructor)
+static pthread_once_t libc_once = PTHREAD_ONCE_INIT;
 static int (*libc_open)(const char *pathname, int flags, ...) = NULL;
 static int (*libc_openat)(int dirfd, const char *pathname, int flags,
                           ...) = NULL;
+static int (*libc_close)(int fd) = NULL;
+static ssize_t (*libc_read)(int fd, void *buf, size_t count) = NULL;
+static ssize_t (*libc_write)(int fd, const void *buf, size_t count) = NULL;
 static ssize_t (*libc_pread)(int fd, void *buf, size_t count,
                              off_t offset) = NULL;
 static ssize_t (*libc_pwrite)(int fd, const void *buf, size_t count,
                               off_t offset) = NULL;
-static int (*libc_timerfd_create)(int clockid, int flags) = NULL;
-static int (*libc_pipe2)(int pipefd[2], int flags) = NULL;
-
-__attribute__((destructor)) static void preload_destructor() {
-  g_hash_table_destroy(fds_set);
-  dlclose(libc_handle);
-}
-
-void check_lib_init() {
-
-  if (fds_set == NULL)
-    fds_set = g_hash_table_new(g_direct_hash, g_direct_equal);
-  if (libc_handle == NULL)
-    libc_handle = dlopen("libc.so.6", RTLD_LAZY);
-  if (libc_pipe2 == NULL)
-    libc_pipe2 = dlsym(libc_handle, "pipe2");
-  if (libc_close == NULL)
-    libc_close = dlsym(libc_handle, "close");
-  if (libc_timerfd_create == NULL)
-    libc_timerfd_create = dlsym(libc_handle, "timerfd_create");
-  if (libc_open == NULL)
-    libc_open = dlsym(libc_handle, "open");
-  if (libc_openat == NULL)
-    libc_openat = dlsym(libc_handle, "openat");
-  if (libc_pread == NULL)
-    libc_pread = dlsym(libc_handle, "pread");
-  if (libc_pwrite == NULL)
-    libc_pwrite = dlsym(libc_handle, "pwrite");
-
-  // if we haven't started libinit yet, call it and accordingly update
-  // lib_is_initializing to avoid infinite cycles
-  if (!lib_is_init) {
-    lib_is_initializing = 1;
-    lroot = libinit(NULL);
-    lib_is_initializing = 0;
-    lib_is_init = 1;
-  }
-}
-
-int timerfd_create(int clockid, int flags) {
-  if (lib_is_initializing)
-    return libc_timerfd_create(clockid, flags);
-  check_lib_init();
-
-  int fd = libc_timerfd_create(clockid, flags);
-
-  // mark this fd to make a distinction in the close function, avoiding
-  // entering our library with an fd that wasn't opened there
-  if (fd >= 0)
-    g_hash_table_add(fds_set, GINT_TO_POINTER(fd));
+static ssize_t (*libc_preadv)(int fd, const struct iovec *iov, int iovcnt,
+                              off_t offset) = NULL;
+static ssize_t (*libc_pwritev)(int fd, const struct iovec *iov, int iovcnt,
+                               off_t offset) = NULL;
+static off_t (*libc_lseek)(int fd, off_t offset, int whence) = NULL;
+static int (*libc_fsync)(int fd) = NULL;
+static int (*libc_fdatasync)(int fd) = NULL;
+static int (*libc_ftruncate)(int fd, off_t length) = NULL;
+
+static void resolve_libc(void) {
+  libc_open = dlsym(RTLD_NEXT, "open");
+  libc_openat = dlsym(RTLD_NEXT, "openat");
+  libc_close = dlsym(RTLD_NEXT, "close");
+  libc_read = dlsym(RTLD_NEXT, "read");
+  libc_write = dlsym(RTLD_NEXT, "write");
+  libc_pread = dlsym(RTLD_NEXT, "pread");
+  libc_pwrite = dlsym(RTLD_NEXT, "pwrite");
+  libc_preadv = dlsym(RTLD_NEXT, "preadv");
+  libc_pwritev = dlsym(RTLD_NEXT, "pwritev");
+  libc_lseek = dlsym(RTLD_NEXT, "lseek");
+  libc_fsync = dlsym(RTLD_NEXT, "fsync");
+  libc_fdatasync = dlsym(RTLD_NEXT, "fdatasync");
+  libc_ftruncate = dlsym(RTLD_NEXT, "ftruncate");
+}
 
-  return fd;
+// libc function of a name, resolved on first use if the constructor did not
+// run yet
+#define LIBC(name)                                                             \
+  (__builtin_expect(libc_##name != NULL, 1)                                    \
+       ? libc_##name                                                           \
+       : (pthread_once(&libc_once, resolve_libc), libc_##name))
+
+__attribute__((constructor)) static void preload_constructor() {
+  pthread_once(&libc_once, resolve_libc);
+  // the opens and reads of libinit (configuration, ...) go to libc
+  in_library = 1;
+  lroot = libinit(NULL);
+  in_library = 0;
+  if (lroot.ops) {
+    __atomic_store_n(&lib_is_init, 1, __ATOMIC_RELEASE);
+  }
 }
 
-int pipe2(int pipefd[2], int flags) {
-  if (lib_is_initializing)
-    return libc_pipe2(pipefd, flags);
-  check_lib_init();
+static inline int fd_marked(const unsigned long *bitmap, int fd) {
+  return (bitmap[fd / BITS_PER_WORD] & (1UL << (fd % BITS_PER_WORD))) != 0;
+}
 
-  int ret = libc_pipe2(pipefd, flags);
+/**
+ * @brief Whether the I/O of fd goes to the layers
+ */
+static inline int fd_owned(int fd) {
+  if ((unsigned)fd >= WRAPPER_MAX_FDS) {
+    return 0;
+  }
+  unsigned long word =
+      __atomic_load_n(&owned_fds[fd / BITS_PER_WORD], __ATOMIC_ACQUIRE);
+  return (word & (1UL << (fd % BITS_PER_WORD))) != 0 && !in_library;
+}
 
-  // mark this fd to make a distinction in the close function, avoiding
-  // entering our library with an fd that wasn't opened there
-  if (ret == 0) {
-    g_hash_table_add(fds_set, GINT_TO_POINTER(pipefd[0]));
-    g_hash_table_add(fds_set, GINT_TO_POINTER(pipefd[1]));
+static inline void fd_set_bit(unsigned long *bitmap, int fd, int set) {
+  unsigned long bit = 1UL << (fd % BITS_PER_WORD);
+  if (set) {
+    __atomic_fetch_or(&bitmap[fd / BITS_PER_WORD], bit, __ATOMIC_RELEASE);
+  } else {
+    __atomic_fetch_and(&bitmap[fd / BITS_PER_WORD], ~bit, __ATOMIC_RELEASE);
   }
+}
 
-  return ret;
+static inline pthread_mutex_t *position_lock(int fd) {
+  return &position_locks[fd % WRAPPER_POSITION_LOCKS];
 }
 
-int open64(const char *pathname, int flags, ...) {
+static inline void enter_library(void) { in_library = 1; }
+
+static inline void leave_library(void) { in_library = 0; }
+
+/**
+ * @brief Open a file through the layers and take ownership of its fd
+ *
+ * @return int -> fd, -1 on error (EMFILE past WRAPPER_MAX_FDS)
+ */
+static int open_owned(const char *pathname, int flags, mode_t mode) {
+  enter_library();
+  int fd = libopen(pathname, flags, mode, lroot);
+  if (fd >= WRAPPER_MAX_FDS) {
+    libclose(fd, lroot);
+    leave_library();
+    errno = EMFILE;
+    return -1;
+  }
+  leave_library();
+  if (fd >= 0) {
+    positions[fd] = 0;
+    fd_set_bit(append_fds, fd, (flags & O_APPEND) != 0);
+    fd_set_bit(owned_fds, fd, 1);
+  }
+  return fd;
+}
+
+static inline int takes_mode(int flags) {
+  return (flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE;
+}
 
+/**
+ * @brief Whether an open goes to libc: before init, from the library, and
+ * for directories and O_PATH fds, which have no data for the layers
+ */
+static inline int open_in_libc(int flags) {
+  return !__atomic_load_n(&lib_is_init, __ATOMIC_ACQUIRE) || in_library ||
+         ((flags & O_DIRECTORY) && (flags & O_TMPFILE) != O_TMPFILE) ||
+         (flags & O_PATH);
+}
+
+int open(const char *pathname, int flags, ...) {
   mode_t mode = 0;
-  if (flags & O_CREAT) {
+  if (takes_mode(flags)) {
     va_list args;
     va_start(args, flags);
     mode = va_arg(args, mode_t);
     va_end(args);
   }
 
-  if (lib_is_initializing)
-    return libc_open(pathname, flags, mode);
-  check_lib_init();
-
-  int fd = libopen(pathname, flags, mode, lroot);
+  if (open_in_libc(flags)) {
+    return LIBC(open)(pathname, flags, mode);
+  }
+  return open_owned(pathname, flags, mode);
+}
 
-  return fd;
+int open64(const char *pathname, int flags, ...) {
+  mode_t mode = 0;
+  if (takes_mode(flags)) {
+    va_list args;
+    va_start(args, flags);
+    mode = va_arg(args, mode_t);
+    va_end(args);
+  }
+  return open(pathname, flags, mode);
 }
 
-// Fow now, this function isn't thread safe
 int openat(int dirfd, const char *pathname, int flags, ...) {
-
   mode_t mode = 0;
-
-  if (flags & O_CREAT) {
+  if (takes_mode(flags)) {
     va_list args;
     va_start(args, flags);
     mode = va_arg(args, mode_t);
     va_end(args);
   }
 
-  if (lib_is_initializing)
-    return libc_openat(dirfd, pathname, flags, mode);
-  check_lib_init();
-
-  int fd;
-
+  if (open_in_libc(flags)) {
+    return LIBC(openat)(dirfd, pathname, flags, mode);
+  }
   if (pathname[0] == '/' || dirfd == AT_FDCWD) {
     // the behavior of openat in these conditions is the same as open
-    fd = libopen(pathname, flags, mode, lroot);
-  } else {
-
-    // save current working directory
-    int prev_dir = libopen(".", O_RDONLY | O_DIRECTORY, mode, lroot);
+    return open_owned(pathname, flags, mode);
+  }
 
-    if (prev_dir == -1) {
-      perror("Failed save working directory: ");
-      return -1;
-    }
+  // the layers take paths: resolve the one of dirfd, without changing the
+  // working directory other threads use
+  char link[32];
+  char path[PATH_MAX];
+  (void)snprintf(link, sizeof(link), "/proc/self/fd/%d", dirfd);
+  ssize_t len = readlink(link, path, sizeof(path) - 1);
+  if (len < 0) {
+    errno = errno == ENOENT ? EBADF : errno;
+    return -1;
+  }
+  if ((size_t)len + 1 + strlen(pathname) >= sizeof(path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  path[len] = '/';
+  strcpy(path + len + 1, pathname);
+  return open_owned(path, flags, mode);
+}
 
-    // change to the target directory
-    int r = fchdir(dirfd);
+int openat64(int dirfd, const char *pathname, int flags, ...) {
+  mode_t mode = 0;
+  if (takes_mode(flags)) {
+    va_list args;
+    va_start(args, flags);
+    mode = va_arg(args, mode_t);
+    va_end(args);
+  }
+  return openat(dirfd, pathname, flags, mode);
+}
 
-    if (r == -1) {
-      perror("Failed to change directory: ");
-      close(prev_dir);
-      return -1;
-    }
+int close(int fd) {
+  if (!fd_owned(fd)) {
+    return LIBC(close)(fd);
+  }
+  // the fd number is free again once the layers closed it, release it first
+  fd_set_bit(owned_fds, fd, 0);
+  enter_library();
+  int res = libclose(fd, lroot);
+  leave_library();
+  return res;
+}
 
-    fd = libopen(pathname, flags, mode, lroot);
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+  if (!fd_owned(fd)) {
+    return LIBC(pread)(fd, buf, count, offset);
+  }
+  enter_library();
+  ssize_t res = libpread(fd, buf, count, offset, lroot);
+  leave_library();
+  return res;
+}
 
-    if (fd == -1) {
-      perror("Failed to open file: ");
-      close(prev_dir);
-      return -1;
-    }
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset) {
+  return pread(fd, buf, count, offset);
+}
 
-    // return to the original working directory
-    r = fchdir(prev_dir);
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+  if (!fd_owned(fd)) {
+    return LIBC(pwrite)(fd, buf, count, offset);
+  }
+  enter_library();
+  ssize_t res = libpwrite(fd, buf, count, offset, lroot);
+  leave_library();
+  return res;
+}
 
-    close(prev_dir);
+ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset) {
+  return pwrite(fd, buf, count, offset);
+}
 
-    if (r == -1) {
-      perror("Failed to return to the working directory: ");
-      close(fd);
-      return -1;
-    }
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+  if (!fd_owned(fd)) {
+    return LIBC(preadv)(fd, iov, iovcnt, offset);
   }
+  enter_library();
+  ssize_t res = libpreadv(fd, iov, iovcnt, offset, lroot);
+  leave_library();
+  return res;
+}
 
-  return fd;
+ssize_t preadv64(int fd, const struct iovec *iov, int iovcnt,
+                 off64_t offset) {
+  return preadv(fd, iov, iovcnt, offset);
 }
 
-int close(int fd) {
-  gpointer key = GINT_TO_POINTER(fd);
-  gboolean contains = g_hash_table_contains(fds_set, key);
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+  if (!fd_owned(fd)) {
+    return LIBC(pwritev)(fd, iov, iovcnt, offset);
+  }
+  enter_library();
+  ssize_t res = libpwritev(fd, iov, iovcnt, offset, lroot);
+  leave_library();
+  return res;
+}
+
+ssize_t pwritev64(int fd, const struct iovec *iov, int iovcnt,
+                  off64_t offset) {
+  return pwritev(fd, iov, iovcnt, offset);
+}
 
-  if (lib_is_initializing) {
-    if (contains)
-      g_hash_table_remove(fds_set, key);
-    return libc_close(fd);
+/**
+ * @brief Logical size of an owned fd (library entered)
+ *
+ * @return off_t -> size, -1 on error
+ */
+static off_t owned_size(int fd) {
+  struct stat st;
+  if (libfstat(fd, &st, lroot) != 0) {
+    return -1;
   }
+  return st.st_size;
+}
 
-  check_lib_init();
+ssize_t read(int fd, void *buf, size_t count) {
+  if (!fd_owned(fd)) {
+    return LIBC(read)(fd, buf, count);
+  }
+  pthread_mutex_t *lock = position_lock(fd);
+  pthread_mutex_lock(lock);
+  enter_library();
+  ssize_t res = libpread(fd, buf, count, positions[fd], lroot);
+  leave_library();
+  if (res > 0) {
+    positions[fd] += res;
+  }
+  pthread_mutex_unlock(lock);
+  return res;
+}
 
-  if (contains) {
-    g_hash_table_remove(fds_set, key);
-    return libc_close(fd);
+ssize_t write(int fd, const void *buf, size_t count) {
+  if (!fd_owned(fd)) {
+    return LIBC(write)(fd, buf, count);
+  }
+  pthread_mutex_t *lock = position_lock(fd);
+  pthread_mutex_lock(lock);
+  enter_library();
+  ssize_t res = -1;
+  off_t offset =
+      fd_marked(append_fds, fd) ? owned_size(fd) : positions[fd];
+  if (offset >= 0) {
+    res = libpwrite(fd, buf, count, offset, lroot);
+  }
+  leave_library();
+  if (res > 0) {
+    positions[fd] = offset + res;
   }
-  return libclose(fd, lroot);
+  pthread_mutex_unlock(lock);
+  return res;
 }
 
-ssize_t pread64(int fd, void *buf, size_t count, off_t offset) {
+off_t lseek(int fd, off_t offset, int whence) {
+  if (!fd_owned(fd)) {
+    return LIBC(lseek)(fd, offset, whence);
+  }
+  pthread_mutex_t *lock = position_lock(fd);
+  pthread_mutex_lock(lock);
+  off_t base = 0;
+  if (whence == SEEK_CUR) {
+    base = positions[fd];
+  } else if (whence == SEEK_END) {
+    enter_library();
+    base = owned_size(fd);
+    leave_library();
+  } else if (whence != SEEK_SET) {
+    // the layers report no holes
+    base = -1;
+    errno = EINVAL;
+  }
+  off_t res = -1;
+  if (base >= 0) {
+    if (offset < 0 ? base + offset < 0 : base > LLONG_MAX - offset) {
+      errno = EINVAL;
+    } else {
+      res = base + offset;
+      positions[fd] = res;
+    }
+  }
+  pthread_mutex_unlock(lock);
+  return res;
+}
 
-  if (lib_is_initializing)
-    return libc_pread(fd, buf, count, offset);
-  check_lib_init();
+off64_t lseek64(int fd, off64_t offset, int whence) {
+  return lseek(fd, offset, whence);
+}
 
-  return libpread(fd, buf, count, offset, lroot);
+int fsync(int fd) {
+  if (!fd_owned(fd)) {
+    return LIBC(fsync)(fd);
+  }
+  enter_library();
+  int res = libfsync(fd, 0, lroot);
+  leave_library();
+  return res;
 }
 
-ssize_t pwrite64(int fd, const void *buf, size_t count, off_t offset) {
+int fdatasync(int fd) {
+  if (!fd_owned(fd)) {
+    return LIBC(fdatasync)(fd);
+  }
+  enter_library();
+  int res = libfsync(fd, 1, lroot);
+  leave_library();
+  return res;
+}
 
-  if (lib_is_initializing)
-    return libc_pwrite(fd, buf, count, offset);
-  check_lib_init();
-  return libpwrite(fd, buf, count, offset, lroot);
+int ftruncate(int fd, off_t length) {
+  if (!fd_owned(fd)) {
+    return LIBC(ftruncate)(fd, length);
+  }
+  enter_library();
+  int res = libftruncate(fd, length, lroot);
+  leave_library();
+  return res;
 }
+
+int ftruncate64(int fd, off64_t length) { return ftruncate(fd, length); }
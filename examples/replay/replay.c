@@ -0,0 +1,952 @@
+#define _GNU_SOURCE
+#include "replay.h"
+#include "../../layers/benchmark/benchmark.h"
+#include "../../lib.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Workload replay
+ * - reads a trace, either the binary trace of a benchmark layer in trace
+ *   mode (layers/benchmark/benchmark.h) or a strace log, and replays its
+ *   calls through libinit's layer tree
+ * - each thread of the trace is replayed by a thread of its own, which
+ *   makes the calls of that thread in order; a call on an fd waits for the
+ *   open of the fd, and a close for the calls on the fd before it, whatever
+ *   thread made them
+ * - at speed 1 each call starts when it started in the trace, as much
+ *   later as the replay falls behind; speed 0 replays as fast as possible
+ * - the latency of every call is recorded in a MetricsSet
+ *   (shared/utils/metrics.h), the report gives the throughput and the
+ *   percentiles of each operation
+ * - calls that failed in the trace are not replayed
+ */
+
+#define REPLAY_LINE_MAX 65536
+#define REPLAY_MAX_ARGS 8
+#define REPLAY_PENDING_MAX 64
+#define REPLAY_DEFAULT_CONFIG "./config.toml"
+
+static const char *const replay_op_names[REPLAY_N_OPS] = {
+    "pread", "pwrite", "open",  "close", "ftruncate",
+    "fstat", "lstat",  "unlink", "fsync"};
+
+static const MetricsOp replay_metrics_ops[REPLAY_N_OPS] = {
+    METRICS_OP_PREAD,  METRICS_OP_PWRITE, METRICS_OP_OPEN,
+    METRICS_OP_CLOSE,  METRICS_OP_FTRUNCATE, METRICS_OP_FSTAT,
+    METRICS_OP_LSTAT,  METRICS_OP_UNLINK, METRICS_OP_FSYNC};
+
+static LayerContext root;
+static MetricsSet *metrics;
+static const char *prefix;
+static double speed = 1.0;
+static uint64_t replay_start_ns;
+static pthread_barrier_t start_barrier; // the threads start together
+
+static ReplayCall *calls;
+static size_t ncalls, calls_cap;
+static size_t skipped; // calls that failed in the trace, or not supported
+static ReplaySlot *slots;
+static size_t nslots, slots_cap;
+static ReplayThread *threads;
+static uint32_t *thread_tids;
+static int nthreads;
+
+// slots are opened, and their users counted, under slots_mutex
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slots_cond = PTHREAD_COND_INITIALIZER;
+
+static void die(const char *msg) {
+  (void)fprintf(stderr, "replay: %s\n", msg);
+  exit(EXIT_FAILURE);
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+  void *res = realloc(ptr, size);
+  if (!res) {
+    die("out of memory");
+  }
+  return res;
+}
+
+static ReplayCall *add_call(void) {
+  if (ncalls == calls_cap) {
+    calls_cap = calls_cap ? calls_cap * 2 : 1024;
+    calls = xrealloc(calls, calls_cap * sizeof(ReplayCall));
+  }
+  ReplayCall *call = &calls[ncalls++];
+  memset(call, 0, sizeof(*call));
+  call->offset = -1;
+  return call;
+}
+
+/* ==== BENCHMARK LAYER TRACES ==== */
+
+/**
+ * @brief Read the calls of a trace file of a benchmark layer
+ *
+ * @return int -> 0 on success, -1 if it is not such a trace
+ */
+static int read_benchmark_trace(FILE *file) {
+  BenchmarkTraceHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, BENCHMARK_TRACE_MAGIC,
+             sizeof(BENCHMARK_TRACE_MAGIC)) != 0) {
+    return -1;
+  }
+  if (header.version != BENCHMARK_TRACE_VERSION ||
+      header.record_size != sizeof(BenchmarkTraceRecord)) {
+    die("unsupported benchmark trace version");
+  }
+  if (header.sample > 1) {
+    (void)fprintf(stderr,
+                  "replay: the trace has one call of every %u, only those "
+                  "are replayed\n",
+                  header.sample);
+  }
+  static const ReplayOp ops[] = {
+      [BENCHMARK_TRACE_PREAD] = REPLAY_PREAD,
+      [BENCHMARK_TRACE_PWRITE] = REPLAY_PWRITE,
+      [BENCHMARK_TRACE_OPEN] = REPLAY_OPEN,
+      [BENCHMARK_TRACE_CLOSE] = REPLAY_CLOSE,
+      [BENCHMARK_TRACE_FTRUNCATE] = REPLAY_FTRUNCATE,
+      [BENCHMARK_TRACE_FSTAT] = REPLAY_FSTAT,
+      [BENCHMARK_TRACE_LSTAT] = REPLAY_LSTAT,
+      [BENCHMARK_TRACE_UNLINK] = REPLAY_UNLINK,
+  };
+  BenchmarkTraceRecord record;
+  for (uint64_t i = 0; i < header.records; i++) {
+    if (fread(&record, sizeof(record), 1, file) != 1) {
+      die("truncated benchmark trace");
+    }
+    // the trace has no paths, the path operations can't be replayed
+    if (record.result < 0 || record.op >= sizeof(ops) / sizeof(ops[0]) ||
+        ops[record.op] == REPLAY_LSTAT || ops[record.op] == REPLAY_UNLINK) {
+      skipped++;
+      continue;
+    }
+    ReplayCall *call = add_call();
+    call->time_ns = record.start_ns;
+    call->op = ops[record.op];
+    call->tid = record.tid;
+    call->fd = record.fd;
+    call->result = record.result;
+    call->offset = record.offset;
+    call->size = record.size;
+    // opened like the files of the fds the trace never opens
+    call->flags = O_CREAT | O_RDWR;
+    call->mode = 0644;
+  }
+  return 0;
+}
+
+/* ==== STRACE LOGS ==== */
+
+typedef struct {
+  uint32_t tid;
+  uint64_t time_ns;
+  char *text; // the call up to " <unfinished ...>"
+} PendingCall;
+
+static PendingCall pending[REPLAY_PENDING_MAX];
+
+/**
+ * @brief Split the arguments of a call at its top level commas
+ *
+ * @param args   -> text after the '(' of the call, cut at its ')'
+ * @return int   -> number of arguments, -1 if the call is not complete
+ */
+static int split_args(char *args, char **argv, char **end) {
+  int argc = 0, depth = 0, quoted = 0;
+  char *start = args;
+  for (char *p = args; *p; p++) {
+    if (quoted) {
+      if (*p == '\\' && p[1]) {
+        p++;
+      } else if (*p == '"') {
+        quoted = 0;
+      }
+    } else if (*p == '"') {
+      quoted = 1;
+    } else if (*p == '(' || *p == '[' || *p == '{') {
+      depth++;
+    } else if ((*p == ']' || *p == '}') && depth > 0) {
+      depth--;
+    } else if (*p == ')') {
+      if (depth == 0) {
+        *p = '\0';
+        *end = p + 1;
+        if (argc < REPLAY_MAX_ARGS && (argc > 0 || *start)) {
+          argv[argc++] = start;
+        }
+        return argc;
+      }
+      depth--;
+    } else if (*p == ',' && depth == 0 && argc < REPLAY_MAX_ARGS) {
+      *p = '\0';
+      argv[argc++] = start;
+      start = p[1] == ' ' ? p + 2 : p + 1;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Decode a quoted string argument
+ *
+ * @return char* -> the string, to free, NULL if the argument isn't one
+ */
+static char *parse_path(const char *arg) {
+  if (*arg != '"') {
+    return NULL;
+  }
+  char *path = xrealloc(NULL, strlen(arg) + 1);
+  size_t n = 0;
+  for (const char *p = arg + 1; *p && *p != '"'; p++) {
+    if (*p != '\\' || !p[1]) {
+      path[n++] = *p;
+      continue;
+    }
+    p++;
+    switch (*p) {
+    case 'n':
+      path[n++] = '\n';
+      break;
+    case 't':
+      path[n++] = '\t';
+      break;
+    case 'x': {
+      char hex[3] = {p[1], p[1] ? p[2] : '\0', '\0'};
+      path[n++] = (char)strtol(hex, NULL, 16);
+      p += strlen(hex);
+      break;
+    }
+    default:
+      if (*p >= '0' && *p <= '7') {
+        int value = 0;
+        for (int i = 0; i < 3 && *p >= '0' && *p <= '7'; i++, p++) {
+          value = value * 8 + (*p - '0');
+        }
+        p--;
+        path[n++] = (char)value;
+      } else {
+        path[n++] = *p;
+      }
+    }
+  }
+  path[n] = '\0';
+  return path;
+}
+
+/**
+ * @brief fd of an argument, and the path strace -y shows after it
+ */
+static int parse_fd(const char *arg, char **path) {
+  char *end;
+  long fd = strtol(arg, &end, 10);
+  if (end == arg) {
+    return -1;
+  }
+  if (*end == '<' && path) {
+    const char *close = strrchr(end, '>');
+    if (close && close > end + 1) {
+      *path = strndup(end + 1, (size_t)(close - end - 1));
+    }
+  }
+  return (int)fd;
+}
+
+static int parse_open_flags(const char *arg) {
+  static const struct {
+    const char *name;
+    int flag;
+  } names[] = {
+      {"O_WRONLY", O_WRONLY}, {"O_RDWR", O_RDWR},   {"O_CREAT", O_CREAT},
+      {"O_EXCL", O_EXCL},     {"O_TRUNC", O_TRUNC}, {"O_APPEND", O_APPEND},
+      {"O_DIRECT", O_DIRECT}, {"O_SYNC", O_SYNC},   {"O_DSYNC", O_DSYNC},
+  };
+  int flags = 0;
+  char *copy = strdup(arg);
+  char *save = NULL;
+  for (char *name = strtok_r(copy, "|", &save); name;
+       name = strtok_r(NULL, "|", &save)) {
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+      if (strcmp(name, names[i].name) == 0) {
+        flags |= names[i].flag;
+      }
+    }
+  }
+  free(copy);
+  return flags;
+}
+
+/**
+ * @brief Parse the leading pid and timestamp of a strace line
+ *
+ * @return char* -> the text of the call
+ */
+static char *parse_prefix(char *line, uint32_t *tid, uint64_t *time_ns) {
+  *tid = 0;
+  *time_ns = 0;
+  char *p = line;
+  if (strncmp(p, "[pid", 4) == 0) {
+    *tid = (uint32_t)strtoul(p + 4, &p, 10);
+    p = strchr(p, ']') ? strchr(p, ']') + 1 : p;
+  }
+  for (int field = 0; field < 2; field++) {
+    while (*p == ' ') {
+      p++;
+    }
+    char *end = p;
+    while (isdigit((unsigned char)*end) || *end == '.' || *end == ':') {
+      end++;
+    }
+    if (end == p || *end != ' ') {
+      break;
+    }
+    char *colon = memchr(p, ':', (size_t)(end - p));
+    char *dot = memchr(p, '.', (size_t)(end - p));
+    if (colon) {
+      // -tt: HH:MM:SS.us of the day
+      unsigned h = 0, m = 0;
+      double s = 0;
+      (void)sscanf(p, "%u:%u:%lf", &h, &m, &s);
+      *time_ns = ((uint64_t)h * 3600 + m * 60) * 1000000000ULL +
+                 (uint64_t)(s * 1e9);
+    } else if (dot) {
+      // -ttt: seconds since the epoch
+      *time_ns = (uint64_t)(strtod(p, NULL) * 1e9);
+    } else {
+      // strace -f: pid of the thread
+      *tid = (uint32_t)strtoul(p, NULL, 10);
+    }
+    p = end;
+  }
+  while (*p == ' ') {
+    p++;
+  }
+  return p;
+}
+
+/**
+ * @brief Join the two lines of a call another thread interrupted
+ *
+ * @return char* -> the whole call, to free, or NULL to wait for its end
+ */
+static char *join_unfinished(char *text, uint32_t tid, uint64_t *time_ns) {
+  char *unfinished = strstr(text, " <unfinished ...>");
+  if (unfinished) {
+    *unfinished = '\0';
+    for (int i = 0; i < REPLAY_PENDING_MAX; i++) {
+      if (!pending[i].text) {
+        pending[i] = (PendingCall){tid, *time_ns, strdup(text)};
+        return NULL;
+      }
+    }
+    skipped++;
+    return NULL;
+  }
+  if (strncmp(text, "<... ", 5) == 0) {
+    char *resumed = strstr(text, " resumed>");
+    for (int i = 0; resumed && i < REPLAY_PENDING_MAX; i++) {
+      if (pending[i].text && pending[i].tid == tid) {
+        char *whole =
+            xrealloc(pending[i].text,
+                     strlen(pending[i].text) + strlen(resumed + 9) + 1);
+        strcat(whole, resumed + 9);
+        *time_ns = pending[i].time_ns;
+        pending[i].text = NULL;
+        return whole;
+      }
+    }
+    skipped++;
+    return NULL;
+  }
+  return strdup(text);
+}
+
+/**
+ * @brief Add the call of a strace line, if it is one replayed
+ */
+static void parse_strace_call(char *text, uint32_t tid, uint64_t time_ns) {
+  char *paren = strchr(text, '(');
+  if (!paren || !isalpha((unsigned char)*text)) {
+    return; // signals, exits
+  }
+  *paren = '\0';
+  const char *name = text;
+  char *argv[REPLAY_MAX_ARGS];
+  char *end;
+  int argc = split_args(paren + 1, argv, &end);
+  char *equal = argc < 0 ? NULL : strstr(end, "= ");
+  if (!equal || !(isdigit((unsigned char)equal[2]) || equal[2] == '-')) {
+    skipped++;
+    return;
+  }
+  int64_t result = strtoll(equal + 2, NULL, 0);
+  if (result < 0) {
+    skipped++;
+    return;
+  }
+
+  ReplayCall call = {.time_ns = time_ns, .tid = tid, .result = result,
+                     .offset = -1, .fd = -1};
+  int path_arg = -1; // argument of the path, or of the fd when negative
+  int dirfd_call = strcmp(name, "openat") == 0 ||
+                   strcmp(name, "newfstatat") == 0 ||
+                   strcmp(name, "statx") == 0 || strcmp(name, "unlinkat") == 0;
+  if (strcmp(name, "open") == 0 || strcmp(name, "openat") == 0) {
+    int base = dirfd_call;
+    if (argc < base + 2) {
+      goto unsupported;
+    }
+    call.op = REPLAY_OPEN;
+    call.fd = (int)result;
+    path_arg = base;
+    call.flags = parse_open_flags(argv[base + 1]);
+    call.mode = argc > base + 2 ? (mode_t)strtoul(argv[base + 2], NULL, 0) : 0;
+  } else if (strcmp(name, "creat") == 0 && argc == 2) {
+    call.op = REPLAY_OPEN;
+    call.fd = (int)result;
+    path_arg = 0;
+    call.flags = O_CREAT | O_WRONLY | O_TRUNC;
+    call.mode = (mode_t)strtoul(argv[1], NULL, 0);
+  } else if (strcmp(name, "close") == 0 && argc == 1) {
+    call.op = REPLAY_CLOSE;
+  } else if ((strcmp(name, "read") == 0 || strcmp(name, "write") == 0) &&
+             argc == 3) {
+    call.op = name[0] == 'r' ? REPLAY_PREAD : REPLAY_PWRITE;
+    call.size = strtoull(argv[2], NULL, 0);
+  } else if ((strcmp(name, "pread64") == 0 || strcmp(name, "pwrite64") == 0) &&
+             argc == 4) {
+    call.op = name[1] == 'r' ? REPLAY_PREAD : REPLAY_PWRITE;
+    call.size = strtoull(argv[2], NULL, 0);
+    call.offset = (off_t)strtoll(argv[3], NULL, 0);
+  } else if ((strcmp(name, "readv") == 0 || strcmp(name, "writev") == 0 ||
+              strcmp(name, "preadv") == 0 || strcmp(name, "pwritev") == 0) &&
+             argc >= 3) {
+    // the result stands for the sizes of the vector
+    call.op = strstr(name, "read") ? REPLAY_PREAD : REPLAY_PWRITE;
+    call.size = (size_t)result;
+    if (name[0] == 'p' && argc >= 4) {
+      call.offset = (off_t)strtoll(argv[3], NULL, 0);
+    }
+  } else if (strcmp(name, "lseek") == 0 && argc == 3) {
+    call.op = REPLAY_SEEK;
+  } else if (strcmp(name, "ftruncate") == 0 && argc == 2) {
+    call.op = REPLAY_FTRUNCATE;
+    call.size = strtoull(argv[1], NULL, 0);
+  } else if ((strcmp(name, "fsync") == 0 || strcmp(name, "fdatasync") == 0) &&
+             argc == 1) {
+    call.op = REPLAY_FSYNC;
+  } else if (strcmp(name, "fstat") == 0 && argc == 2) {
+    call.op = REPLAY_FSTAT;
+  } else if ((strcmp(name, "stat") == 0 || strcmp(name, "lstat") == 0) &&
+             argc == 2) {
+    call.op = REPLAY_LSTAT;
+    path_arg = 0;
+  } else if ((strcmp(name, "newfstatat") == 0 || strcmp(name, "statx") == 0) &&
+             argc >= 3) {
+    // an empty path with AT_EMPTY_PATH is an fstat of the dirfd
+    call.op = strcmp(argv[1], "\"\"") == 0 ? REPLAY_FSTAT : REPLAY_LSTAT;
+    path_arg = call.op == REPLAY_LSTAT ? 1 : -1;
+  } else if (strcmp(name, "unlink") == 0 && argc == 1) {
+    call.op = REPLAY_UNLINK;
+    path_arg = 0;
+  } else if (strcmp(name, "unlinkat") == 0 && argc == 3 &&
+             !strstr(argv[2], "AT_REMOVEDIR")) {
+    call.op = REPLAY_UNLINK;
+    path_arg = 1;
+  } else {
+    goto unsupported;
+  }
+
+  if (path_arg >= 0) {
+    call.path = parse_path(argv[path_arg]);
+    if (!call.path) {
+      goto unsupported;
+    }
+  } else if (call.op != REPLAY_OPEN) {
+    call.fd = parse_fd(argv[0], &call.path);
+    if (call.fd < 0) {
+      goto unsupported;
+    }
+  }
+  *add_call() = call;
+  return;
+
+unsupported:
+  skipped++;
+}
+
+/**
+ * @brief Read the calls of a strace log
+ */
+static void read_strace(FILE *file) {
+  char *line = xrealloc(NULL, REPLAY_LINE_MAX);
+  while (fgets(line, REPLAY_LINE_MAX, file)) {
+    line[strcspn(line, "\n")] = '\0';
+    uint32_t tid;
+    uint64_t time_ns;
+    char *text = parse_prefix(line, &tid, &time_ns);
+    char *whole = join_unfinished(text, tid, &time_ns);
+    if (whole) {
+      parse_strace_call(whole, tid, time_ns);
+      free(whole);
+    }
+  }
+  free(line);
+  for (int i = 0; i < REPLAY_PENDING_MAX; i++) {
+    free(pending[i].text);
+  }
+}
+
+/* ==== REPLAY PLAN ==== */
+
+static int compare_calls(const void *a, const void *b) {
+  const ReplayCall *x = a, *y = b;
+  if (x->time_ns != y->time_ns) {
+    return x->time_ns < y->time_ns ? -1 : 1;
+  }
+  // read in trace order, keep it
+  return x < y ? -1 : x > y;
+}
+
+static size_t add_slot(int trace_fd) {
+  if (nslots == slots_cap) {
+    slots_cap = slots_cap ? slots_cap * 2 : 64;
+    slots = xrealloc(slots, slots_cap * sizeof(ReplaySlot));
+  }
+  ReplaySlot *slot = &slots[nslots];
+  memset(slot, 0, sizeof(*slot));
+  slot->trace_fd = trace_fd;
+  slot->fd = -1;
+  return nslots++;
+}
+
+static char *replay_path(const char *path) {
+  if (!prefix) {
+    return strdup(path);
+  }
+  char *res = NULL;
+  if (asprintf(&res, "%s%s%s", prefix, path[0] == '/' ? "" : "/", path) < 0) {
+    die("out of memory");
+  }
+  return res;
+}
+
+/**
+ * @brief Sort the calls, give them their slots and threads
+ */
+static void plan_replay(void) {
+  qsort(calls, ncalls, sizeof(ReplayCall), compare_calls);
+  uint64_t first = ncalls ? calls[0].time_ns : 0;
+  size_t *current = NULL; // slot + 1 of each fd of the trace, 0 if closed
+  int ncurrent = 0;
+
+  for (size_t i = 0; i < ncalls; i++) {
+    ReplayCall *call = &calls[i];
+    call->time_ns -= first;
+    // the path of the other calls is the one strace -y shows for their fd
+    if (call->path && (call->op == REPLAY_OPEN || call->op == REPLAY_LSTAT ||
+                       call->op == REPLAY_UNLINK)) {
+      char *path = replay_path(call->path);
+      free(call->path);
+      call->path = path;
+    }
+
+    int t = 0;
+    while (t < nthreads && thread_tids[t] != call->tid) {
+      t++;
+    }
+    if (t == nthreads) {
+      nthreads++;
+      thread_tids = xrealloc(thread_tids, nthreads * sizeof(uint32_t));
+      threads = xrealloc(threads, nthreads * sizeof(ReplayThread));
+      memset(&threads[t], 0, sizeof(ReplayThread));
+      thread_tids[t] = call->tid;
+    }
+    call->thread = t;
+    ReplayThread *thread = &threads[t];
+    thread->calls = xrealloc(thread->calls, (thread->ncalls + 1) *
+                                                sizeof(size_t));
+    thread->calls[thread->ncalls++] = i;
+    if (call->size > thread->max_size &&
+        (call->op == REPLAY_PREAD || call->op == REPLAY_PWRITE)) {
+      thread->max_size = call->size;
+    }
+
+    if (call->op == REPLAY_LSTAT || call->op == REPLAY_UNLINK) {
+      continue;
+    }
+    if (call->fd >= ncurrent) {
+      int n = call->fd + 64;
+      current = xrealloc(current, n * sizeof(size_t));
+      memset(current + ncurrent, 0, (n - ncurrent) * sizeof(size_t));
+      ncurrent = n;
+    }
+    if (call->op == REPLAY_OPEN) {
+      size_t s = add_slot(call->fd);
+      slots[s].path = call->path;
+      slots[s].flags = call->flags;
+      slots[s].mode = call->mode;
+      call->path = NULL;
+      current[call->fd] = s + 1;
+      call->slot = s;
+      continue;
+    }
+    if (current[call->fd] == 0) {
+      // an fd of the trace opened before it started
+      size_t s = add_slot(call->fd);
+      slots[s].implicit = 1;
+      slots[s].path = call->path ? replay_path(call->path) : NULL;
+      slots[s].flags = O_CREAT | O_RDWR;
+      slots[s].mode = 0644;
+      current[call->fd] = s + 1;
+    }
+    free(call->path);
+    call->path = NULL;
+    call->slot = current[call->fd] - 1;
+    ReplaySlot *slot = &slots[call->slot];
+    switch (call->op) {
+    case REPLAY_CLOSE:
+      slot->closed = 1;
+      current[call->fd] = 0;
+      break;
+    case REPLAY_SEEK:
+      slot->pos = (off_t)call->result;
+      break;
+    case REPLAY_PREAD:
+    case REPLAY_PWRITE:
+      if (call->offset < 0) {
+        call->offset = slot->pos;
+        slot->pos += (off_t)call->result;
+      }
+      slot->users++;
+      break;
+    default:
+      slot->users++;
+    }
+  }
+  free(current);
+}
+
+/* ==== REPLAY ==== */
+
+/**
+ * @brief Path a slot is opened at
+ *
+ * @return char* -> the path, to free
+ */
+static char *slot_path(const ReplaySlot *slot) {
+  if (slot->path) {
+    return strdup(slot->path);
+  }
+  char name[64];
+  (void)snprintf(name, sizeof(name), "tg-replay-fd%d", slot->trace_fd);
+  return replay_path(name);
+}
+
+/**
+ * @brief Open a slot with libopen
+ *
+ * @return int -> the fd, -1 on failure
+ */
+static int open_slot(ReplaySlot *slot) {
+  char *path = slot_path(slot);
+  int fd = libopen(path, slot->flags, slot->mode, root);
+  if (fd < 0) {
+    (void)fprintf(stderr, "replay: %s: %s\n", path, strerror(errno));
+  }
+  free(path);
+  return fd;
+}
+
+/**
+ * @brief Open the slot of a call, once its open was replayed
+ *
+ * Called with slots_mutex held.
+ */
+static void wait_slot_open(ReplaySlot *slot) {
+  while (slot->state == SLOT_PENDING && !slot->implicit) {
+    pthread_cond_wait(&slots_cond, &slots_mutex);
+  }
+  if (slot->state == SLOT_PENDING) {
+    slot->fd = open_slot(slot);
+    slot->state = slot->fd >= 0 ? SLOT_OPEN : SLOT_FAILED;
+  }
+}
+
+static void replay_call(ReplayCall *call, char *buffer) {
+  if (call->op == REPLAY_SEEK) {
+    return;
+  }
+  ReplaySlot *slot =
+      call->op == REPLAY_LSTAT || call->op == REPLAY_UNLINK
+          ? NULL
+          : &slots[call->slot];
+  if (slot && call->op != REPLAY_OPEN) {
+    pthread_mutex_lock(&slots_mutex);
+    wait_slot_open(slot);
+    if (call->op == REPLAY_CLOSE) {
+      while (slot->users > 0) {
+        pthread_cond_wait(&slots_cond, &slots_mutex);
+      }
+    }
+    pthread_mutex_unlock(&slots_mutex);
+  }
+
+  int fd = slot ? slot->fd : -1;
+  char *path = call->op == REPLAY_OPEN ? slot_path(slot) : NULL;
+  struct stat st;
+  ssize_t res = -1;
+  uint64_t start = metrics_now();
+  if (slot && call->op != REPLAY_OPEN && slot->state == SLOT_FAILED) {
+    errno = EBADF;
+  } else {
+    switch (call->op) {
+    case REPLAY_PREAD:
+      res = libpread(fd, buffer, call->size, call->offset, root);
+      break;
+    case REPLAY_PWRITE:
+      res = libpwrite(fd, buffer, call->size, call->offset, root);
+      break;
+    case REPLAY_OPEN:
+      res = libopen(path, slot->flags, slot->mode, root);
+      break;
+    case REPLAY_CLOSE:
+      res = libclose(fd, root);
+      break;
+    case REPLAY_FTRUNCATE:
+      res = libftruncate(fd, (off_t)call->size, root);
+      break;
+    case REPLAY_FSTAT:
+      res = libfstat(fd, &st, root);
+      break;
+    case REPLAY_LSTAT:
+      res = liblstat(call->path, &st, root);
+      break;
+    case REPLAY_UNLINK:
+      res = libunlink(call->path, root);
+      break;
+    case REPLAY_FSYNC:
+      res = libfsync(fd, 0, root);
+      break;
+    default:
+      break;
+    }
+  }
+  metrics_record(metrics, replay_metrics_ops[call->op], start, res);
+  int saved_errno = errno;
+
+  if (!slot) {
+    return;
+  }
+  if (call->op == REPLAY_OPEN && res < 0) {
+    (void)fprintf(stderr, "replay: %s: %s\n", path, strerror(saved_errno));
+  }
+  free(path);
+  pthread_mutex_lock(&slots_mutex);
+  if (call->op == REPLAY_OPEN) {
+    slot->fd = (int)res;
+    slot->state = res >= 0 ? SLOT_OPEN : SLOT_FAILED;
+    pthread_cond_broadcast(&slots_cond);
+  } else if (call->op == REPLAY_CLOSE) {
+    slot->fd = -1;
+  } else if (--slot->users == 0) {
+    pthread_cond_broadcast(&slots_cond);
+  }
+  pthread_mutex_unlock(&slots_mutex);
+}
+
+static void *replay_thread(void *arg) {
+  ReplayThread *thread = (ReplayThread *)arg;
+  char *buffer = malloc(thread->max_size ? thread->max_size : 1);
+  if (!buffer) {
+    die("out of memory");
+  }
+  memset(buffer, 'x', thread->max_size);
+  pthread_barrier_wait(&start_barrier);
+  for (size_t i = 0; i < thread->ncalls; i++) {
+    ReplayCall *call = &calls[thread->calls[i]];
+    if (speed > 0) {
+      uint64_t due =
+          replay_start_ns + (uint64_t)((double)call->time_ns / speed);
+      struct timespec ts = {(time_t)(due / 1000000000ULL),
+                            (long)(due % 1000000000ULL)};
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+             EINTR) {
+      }
+      uint64_t lag = metrics_now() - due;
+      if (lag > thread->max_lag_ns) {
+        thread->max_lag_ns = lag;
+      }
+    }
+    replay_call(call, buffer);
+  }
+  free(buffer);
+  return NULL;
+}
+
+/* ==== REPORT ==== */
+
+static void report(double elapsed) {
+  unsigned long long replayed = 0, errors = 0;
+  MetricsSummary summary[REPLAY_N_OPS];
+  for (int op = 0; op < REPLAY_N_OPS; op++) {
+    metrics_summary(metrics, replay_metrics_ops[op], &summary[op]);
+    replayed += summary[op].count;
+    errors += summary[op].errors;
+  }
+  uint64_t max_lag = 0;
+  for (int t = 0; t < nthreads; t++) {
+    if (threads[t].max_lag_ns > max_lag) {
+      max_lag = threads[t].max_lag_ns;
+    }
+  }
+  double mib_read = (double)summary[REPLAY_PREAD].bytes / (1 << 20);
+  double mib_written = (double)summary[REPLAY_PWRITE].bytes / (1 << 20);
+
+  printf("Replayed %llu calls (%llu failed) of %d threads in %.3f s: "
+         "%.0f calls/s\n",
+         replayed, errors, nthreads, elapsed, replayed / elapsed);
+  printf("Read %.1f MiB (%.1f MiB/s), wrote %.1f MiB (%.1f MiB/s)\n",
+         mib_read, mib_read / elapsed, mib_written, mib_written / elapsed);
+  if (skipped) {
+    printf("Skipped %zu calls of the trace that failed or aren't "
+           "replayed\n",
+           skipped);
+  }
+  if (speed > 0) {
+    printf("Behind the trace by up to %.3f ms\n", (double)max_lag / 1e6);
+  }
+  printf("\n%-10s %10s %8s %10s %10s %10s %10s\n", "op", "calls", "errors",
+         "p50 us", "p90 us", "p99 us", "max us");
+  for (int op = 0; op < REPLAY_N_OPS; op++) {
+    MetricsSummary *s = &summary[op];
+    if (s->count == 0) {
+      continue;
+    }
+    printf("%-10s %10llu %8llu %10.1f %10.1f %10.1f %10.1f\n",
+           replay_op_names[op], s->count, s->errors, (double)s->p50_ns / 1e3,
+           (double)s->p90_ns / 1e3, (double)s->p99_ns / 1e3,
+           (double)s->max_ns / 1e3);
+  }
+}
+
+static void usage(const char *name) {
+  (void)fprintf(stderr,
+                "Usage: %s [-c config.toml] [-p prefix] [-s speed] TRACE\n"
+                "  TRACE      trace file of a benchmark layer in trace mode, "
+                "or strace log\n"
+                "             (strace -f -ttt -y -o TRACE ...)\n"
+                "  -c FILE    configuration of the layer tree (default %s)\n"
+                "  -p DIR     directory the paths of the trace are under\n"
+                "  -s SPEED   1: calls at their time in the trace (default), "
+                "2: twice\n"
+                "             as fast, 0: as fast as possible\n",
+                name, REPLAY_DEFAULT_CONFIG);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  const char *config = REPLAY_DEFAULT_CONFIG;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:p:s:h")) != -1) {
+    switch (opt) {
+    case 'c':
+      config = optarg;
+      break;
+    case 'p':
+      prefix = optarg;
+      break;
+    case 's':
+      speed = strtod(optarg, NULL);
+      if (speed < 0) {
+        usage(argv[0]);
+      }
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+  }
+
+  FILE *file = fopen(argv[optind], "rb");
+  if (!file) {
+    perror(argv[optind]);
+    return EXIT_FAILURE;
+  }
+  if (read_benchmark_trace(file) != 0) {
+    rewind(file);
+    read_strace(file);
+  }
+  (void)fclose(file);
+  plan_replay();
+  if (ncalls == 0) {
+    die("no call of the trace can be replayed");
+  }
+
+  root = libinit(config);
+  if (!root.ops) {
+    die("failed to build the layer tree");
+  }
+  metrics = metrics_register("replay");
+  if (!metrics) {
+    die("out of memory");
+  }
+
+  pthread_barrier_init(&start_barrier, NULL, (unsigned)nthreads + 1);
+  for (int t = 0; t < nthreads; t++) {
+    if (pthread_create(&threads[t].thread, NULL, replay_thread,
+                       &threads[t]) != 0) {
+      die("failed to create a replay thread");
+    }
+  }
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  replay_start_ns = metrics_now();
+  pthread_barrier_wait(&start_barrier);
+  for (int t = 0; t < nthreads; t++) {
+    pthread_join(threads[t].thread, NULL);
+  }
+  pthread_barrier_destroy(&start_barrier);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double elapsed = (double)(end.tv_sec - start.tv_sec) +
+                   (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+  // close the fds the trace left open
+  for (size_t s = 0; s < nslots; s++) {
+    if (slots[s].state == SLOT_OPEN && slots[s].fd >= 0) {
+      libclose(slots[s].fd, root);
+    }
+  }
+  report(elapsed > 0 ? elapsed : 1e-9);
+
+  metrics_unregister(metrics);
+  libdestroy(root);
+  for (size_t i = 0; i < ncalls; i++) {
+    free(calls[i].path);
+  }
+  for (size_t s = 0; s < nslots; s++) {
+    free(slots[s].path);
+  }
+  for (int t = 0; t < nthreads; t++) {
+    free(threads[t].calls);
+  }
+  free(calls);
+  free(slots);
+  free(threads);
+  free(thread_tids);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,73 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include "../../shared/utils/metrics.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Operations of a trace, those up to REPLAY_FSYNC are replayed
+typedef enum {
+  REPLAY_PREAD,
+  REPLAY_PWRITE,
+  REPLAY_OPEN,
+  REPLAY_CLOSE,
+  REPLAY_FTRUNCATE,
+  REPLAY_FSTAT,
+  REPLAY_LSTAT,
+  REPLAY_UNLINK,
+  REPLAY_FSYNC,
+  REPLAY_N_OPS,
+  REPLAY_SEEK, // only moves the position of read and write
+} ReplayOp;
+
+/**
+ * @brief A call of the trace
+ *
+ * The calls on an fd refer to a ReplaySlot, one for each open of the fd in
+ * the trace, or for an fd the trace uses without opening it.
+ */
+typedef struct {
+  uint64_t time_ns; // start, from the first call of the trace
+  ReplayOp op;
+  uint32_t tid;     // thread of the trace
+  int thread;       // replay thread
+  int fd;           // fd in the trace, the result of open
+  int64_t result;   // result in the trace
+  off_t offset;     // of pread and pwrite, -1: position of the fd
+  size_t size;      // bytes asked for, or the length of ftruncate
+  int flags;        // of open
+  mode_t mode;      // of open
+  char *path;       // of open, lstat and unlink, or of the fd (strace -y)
+  size_t slot;      // ReplaySlot of the fd
+} ReplayCall;
+
+typedef enum {
+  SLOT_PENDING, // not opened yet
+  SLOT_OPEN,
+  SLOT_FAILED, // the open failed, its calls are counted as errors
+} ReplaySlotState;
+
+typedef struct {
+  char *path;      // opened, NULL: tg-replay-fd<N> in the prefix
+  int trace_fd;    // fd in the trace
+  int flags;       // of the open
+  mode_t mode;     // of the open
+  int implicit;    // opened by its first call, not by an open of the trace
+  off_t pos;       // position of read and write, while parsing
+  size_t users;    // calls on the slot not yet replayed
+  ReplaySlotState state;
+  int fd;          // fd returned by libopen
+  int closed;      // by a close of the trace
+} ReplaySlot;
+
+typedef struct {
+  size_t *calls;  // indexes of its calls, in trace order
+  size_t ncalls;
+  size_t max_size; // largest read or write, the size of its buffer
+  uint64_t max_lag_ns;
+  pthread_t thread;
+} ReplayThread;
+
+#endif // __REPLAY_H__
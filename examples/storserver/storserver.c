@@ -1,178 +1,818 @@
+#define _GNU_SOURCE
 #include "storserver.h"
+#include <errno.h>
 #include <fcntl.h>
-#include <glib.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * Storage server of the remote layer
+ * - a single thread serves all clients from an epoll loop, over
+ *   non-blocking sockets
+ * - requests are framed as in layers/remote/protocol.h; a client may send
+ *   many before reading the replies, which come back in request order
+ * - files live under a root directory, a client names them by path on
+ *   OPEN and then by the handle the reply gave it
+ * - handles belong to the session the connection joined with HELLO, so a
+ *   client may use them on all its connections; a session without
+ *   connections is kept SESSION_LINGER seconds for them to come back
+ * - connections whose replies are not read stop being read themselves once
+ *   OUT_HIGH_WATER bytes are waiting
+ * - clients on the same host may connect to a unix socket instead, and pass
+ *   the shared-memory rings of layers/remote/shm.h the frames then go
+ *   through; the socket only carries their wake-ups
+ */
 
 #define SPATH "/home/vagrant/server/"
-// #define DEBUG "/home/vagrant/log"
+// #define DEBUG
 
-int server_fd;
-GHashTable *opened_files;
+static volatile sig_atomic_t stop;
+static int root_fd;
+static int tcp_fd;  // listening sockets, whose address is the epoll data of
+static int unix_fd; // their events
+static Session *sessions; // by id, the ones joined with HELLO
 
-void intHandler(int dummy) {
-  // NOLINTNEXTLINE(bugprone-signal-handler,cert-msc54-cpp)
-  printf("Server shutting down\n");
-  close(server_fd);
-  // NOLINTNEXTLINE(bugprone-signal-handler,cert-msc54-cpp)
-  exit(0);
+static void intHandler(int dummy) {
+  (void)dummy;
+  stop = 1;
 }
 
-// replaces path given by client (fuse) (e.g., /backend/file1.txt with
-// /home/vagrant/server/file1.txt)
-void handle_path(char *oldpath, char *newpath) {
+/**
+ * @brief Path of a request, relative to the root directory
+ *
+ * Leading slashes are dropped and ".." components are refused, so a client
+ * cannot leave the root.
+ *
+ * @return int -> 0 on success, -errno otherwise
+ */
+static int request_path(const char *payload, size_t length, char *path) {
+  if (length > REMOTE_MAX_PATH) {
+    return -ENAMETOOLONG;
+  }
+  while (length > 0 && *payload == '/') {
+    payload++;
+    length--;
+  }
+  if (length == 0) {
+    strcpy(path, ".");
+    return 0;
+  }
+  memcpy(path, payload, length);
+  path[length] = '\0';
+  if (strlen(path) != length) {
+    return -EINVAL;
+  }
+
+  for (const char *c = path; *c;) {
+    size_t n = strcspn(c, "/");
+    if (n == 2 && c[0] == '.' && c[1] == '.') {
+      return -EACCES;
+    }
+    c += n;
+    c += *c == '/';
+  }
+  return 0;
+}
 
-  char *token, *string, *tofree;
-  tofree = string = strdup(oldpath);
-  int count = 0;
+static OpenFile *find_file(Session *session, uint32_t handle) {
+  OpenFile *file;
+  HASH_FIND(hh, session->files, &handle, sizeof(handle), file);
+  return file;
+}
 
-  while ((token = strsep(&string, "/")) != NULL) {
-    if (count == 2) { // After the second '/'
-      break;
+static Session *session_new(uint64_t id) {
+  Session *session = calloc(1, sizeof(Session));
+  if (!session) {
+    return NULL;
+  }
+  session->id = id;
+  if (id != 0) {
+    HASH_ADD(hh, sessions, id, sizeof(session->id), session);
+  }
+  return session;
+}
+
+static void session_free(Session *session) {
+  if (session->id != 0) {
+    HASH_DEL(sessions, session);
+  }
+  OpenFile *file, *tmp;
+  HASH_ITER(hh, session->files, file, tmp) {
+    HASH_DEL(session->files, file);
+    close(file->fd);
+    free(file);
+  }
+  free(session);
+}
+
+/**
+ * @brief Detach a connection from its session, which lingers if shared
+ */
+static void session_leave(Session *session) {
+  if (--session->nclients > 0) {
+    return;
+  }
+  if (session->id == 0) {
+    session_free(session);
+  } else {
+    session->expires = time(NULL) + SESSION_LINGER;
+  }
+}
+
+static void expire_sessions(void) {
+  time_t now = time(NULL);
+  Session *session, *tmp;
+  HASH_ITER(hh, sessions, session, tmp) {
+    if (session->nclients == 0 && session->expires <= now) {
+      printf("[ Server ]: session %llx expired\n",
+             (unsigned long long)session->id);
+      session_free(session);
     }
-    count++;
   }
+}
+
+/**
+ * @brief Join the session of a HELLO, created if unknown
+ *
+ * @return int64_t -> 1 if created, 0 if joined, -errno on failure
+ */
+static int64_t handle_hello(Client *client, const RemoteHeader *h) {
+  if (client->session) {
+    return -EISCONN;
+  }
+  uint64_t id = (uint64_t)h->arg;
+  Session *session = NULL;
+  if (id != 0) {
+    HASH_FIND(hh, sessions, &id, sizeof(id), session);
+  }
+  int64_t created = session == NULL;
+  if (!session && !(session = session_new(id))) {
+    return -ENOMEM;
+  }
+  session->nclients++;
+  client->session = session;
+  return created;
+}
 
-  strcpy(newpath, SPATH);
-  if (token != NULL) {
-    strcat(newpath, token); // SPATH+filename
+static int64_t handle_open(Session *session, const RemoteHeader *h,
+                           const char *path) {
+  int fd = openat(root_fd, path, (int)h->arg | O_CLOEXEC, (mode_t)h->offset);
+  if (fd < 0) {
+    return -errno;
   }
 
-  free(tofree);
+  OpenFile *file = malloc(sizeof(OpenFile));
+  if (!file) {
+    close(fd);
+    return -ENOMEM;
+  }
+  // handles stay positive ints, the remote layer gives them out as fds
+  do {
+    session->next_handle = session->next_handle % INT32_MAX + 1;
+  } while (find_file(session, session->next_handle));
+  file->handle = session->next_handle;
+  file->fd = fd;
+  HASH_ADD(hh, session->files, handle, sizeof(file->handle), file);
+  return file->handle;
 }
 
-// Note: Create file if it doesn't exist
-void handle_write(int socket_fd, MSG m) {
-  ssize_t res;
-  int fd;
-  char path[PSIZE];
+static int64_t handle_close(Session *session, OpenFile *file) {
+  HASH_DEL(session->files, file);
+  int res = close(file->fd);
+  free(file);
+  return res < 0 ? -errno : 0;
+}
 
-  // convert remote path to local path (SPATH+filename)
-  handle_path(m.path, path);
+static int64_t handle_read(OpenFile *file, const RemoteHeader *h,
+                           char *data) {
+  if (h->arg < 0 || h->arg > REMOTE_MAX_PAYLOAD) {
+    return -EINVAL;
+  }
+  size_t done = 0;
+  while (done < (size_t)h->arg) {
+    ssize_t n = pread(file->fd, data + done, (size_t)h->arg - done,
+                      (off_t)(h->offset + done));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return done > 0 ? (int64_t)done : -errno;
+    }
+    if (n == 0) {
+      break;
+    }
+    done += (size_t)n;
+  }
+  return (int64_t)done;
+}
 
-  fd = open(path, O_CREAT | O_WRONLY, 0600);
-  if (fd < 0) { // check for errors
-    perror("open");
+static int64_t handle_write(OpenFile *file, const RemoteHeader *h,
+                            const char *data) {
+  size_t done = 0;
+  while (done < h->length) {
+    ssize_t n = pwrite(file->fd, data + done, h->length - done,
+                       (off_t)(h->offset + done));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return done > 0 ? (int64_t)done : -errno;
+    }
+    done += (size_t)n;
   }
+  return (int64_t)done;
+}
 
-  m.res = write(fd, &m.buffer, m.size);
-  if (m.res < 0) { // check for errors
-    perror("write");
+static int64_t handle_stat(int res, const struct stat *st, char *data,
+                           uint32_t *length) {
+  if (res < 0) {
+    return -errno;
   }
+  remote_stat_encode((RemoteStat *)data, st);
+  *length = sizeof(RemoteStat);
+  return 0;
+}
 
-  // close file descriptor
-  close(fd);
+/**
+ * @brief Map the rings a local client passes in its first message
+ *
+ * @return int -> 0 once mapped, 1 if the message is not there yet, -1 if the
+ * client has to be dropped
+ */
+static int attach_shm(Client *client) {
+  char byte;
+  struct iovec iov = {&byte, 1};
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  ssize_t n = recvmsg(client->sock, &msg, MSG_CMSG_CLOEXEC);
+  if (n < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 1 : -1;
+  }
+  int memfd = -1;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (n == 1 && cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+    memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  if (memfd < 0) {
+    fprintf(stderr, "[ Server ]: client %d sent no shared memory\n",
+            client->sock);
+    return -1;
+  }
 
-  // inform client that write was received
-  strcpy(m.buffer, "write received");
-  m.buffer[15] = '\0';
-  res = write(socket_fd, &m, sizeof(m));
-  if (res < 0)
-    perror("write");
+  // the client must not be able to shrink the memory under the mapping
+  struct stat st;
+  int seals = fcntl(memfd, F_GET_SEALS);
+  if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(memfd, &st) < 0 ||
+      (size_t)st.st_size < sizeof(RemoteShm)) {
+    fprintf(stderr, "[ Server ]: client %d sent an unsealed memory\n",
+            client->sock);
+    close(memfd);
+    return -1;
+  }
+  RemoteShm *shm = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, memfd, 0);
+  close(memfd);
+  if (shm == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  uint32_t ring_size = __atomic_load_n(&shm->ring_size, __ATOMIC_RELAXED);
+  if (shm->magic != REMOTE_SHM_MAGIC ||
+      !remote_shm_ring_size_valid(ring_size) ||
+      remote_shm_size(ring_size) != (size_t)st.st_size) {
+    fprintf(stderr, "[ Server ]: client %d sent invalid rings\n",
+            client->sock);
+    munmap(shm, (size_t)st.st_size);
+    return -1;
+  }
+  client->shm = shm;
+  client->shm_size = (size_t)st.st_size;
+  remote_ring_end_init(&client->requests, shm, ring_size,
+                       REMOTE_RING_REQUESTS, false);
+  remote_ring_end_init(&client->replies, shm, ring_size, REMOTE_RING_REPLIES,
+                       true);
+
+  // wait for the first request, then tell the client it may send it
+  uint32_t peer;
+  (void)remote_ring_sleep(&client->requests, &peer);
+  return send(client->sock, "", 1, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
 
-  printf("write for path: %s returned %ld\n", path, m.res);
+/**
+ * @brief Wake a local client waiting for what end just moved
+ */
+static void shm_wake_client(RemoteRingEnd *end) {
+  if (remote_ring_wake_peer(end)) {
+    remote_futex_wake(remote_ring_word(end));
+  }
 }
 
-void handle_read(int socket_fd, MSG m) {
-  int fd;
+/**
+ * @brief Move bytes through a ring of a local client, as recv and send do
+ * on a non-blocking socket
+ *
+ * @return ssize_t -> bytes moved, -1 with errno EAGAIN once the ring has to
+ * be waited for (the client then wakes the server), EPROTO if it is corrupted
+ */
+static ssize_t shm_move(RemoteRingEnd *end, void *buffer, size_t size) {
+  while (1) {
+    int64_t n = remote_ring_move(end, buffer, size);
+    if (n > 0) {
+      shm_wake_client(end);
+      return (ssize_t)n;
+    }
+    uint32_t peer;
+    if (n < 0) {
+      errno = EPROTO;
+      return -1;
+    }
+    if (remote_ring_sleep(end, &peer)) {
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+}
 
-  char path[PSIZE];
-  char buff[m.size];
-  handle_path(m.path, path);
+static ssize_t shm_recv(Client *client, void *buffer, size_t size) {
+  return shm_move(&client->requests, buffer, size);
+}
 
-  // open file to read from
-  fd = open(path, O_RDONLY);
-  if (fd < 0) { // checko for errors
-    perror("open");
-    m.res = 0;
-  } else {
-    m.res = read(fd, buff, m.size);
-    if (m.res < 0) // check for errors
-      perror("read");
+static ssize_t shm_send(Client *client, const void *buffer, size_t size) {
+  return shm_move(&client->replies, (void *)buffer, size);
+}
 
-    // send read content to client
-    memcpy(m.buffer, buff, m.size);
-    write(socket_fd, &m, sizeof(m));
+/**
+ * @brief Consume the wake-ups a local client sent on its socket
+ *
+ * @return int -> 0 on success, -1 if the client left
+ */
+static int drain_wakeups(Client *client) {
+  char buf[64];
+  while (1) {
+    ssize_t n = recv(client->sock, buf, sizeof(buf), 0);
+    if (n == 0) {
+      return -1;
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+  }
+}
 
-    close(fd);
+static int reserve(char **buffer, size_t *cap, size_t needed) {
+  if (needed <= *cap) {
+    return 0;
+  }
+  size_t new_cap = *cap ? *cap : READ_CHUNK;
+  while (new_cap < needed) {
+    new_cap *= 2;
   }
-  printf("read for path %s returned %ld\n", path, m.res);
+  char *p = realloc(*buffer, new_cap);
+  if (!p) {
+    return -1;
+  }
+  *buffer = p;
+  *cap = new_cap;
+  return 0;
 }
 
-void handle_stat(int socket_fd, MSG m) {
-  int res;
-  char path[PSIZE];
-  struct stat stbuf;
+/**
+ * @brief Run a request and queue its reply
+ *
+ * @return int -> 0 on success, -1 if the connection has to be dropped
+ */
+static int handle_request(Client *client, const RemoteHeader *h,
+                          const char *payload) {
+  // compact the replies not sent yet, then make room for this one
+  if (client->out_off > 0) {
+    memmove(client->out, client->out + client->out_off,
+            client->out_len - client->out_off);
+    client->out_len -= client->out_off;
+    client->out_off = 0;
+  }
+  size_t room = sizeof(RemoteStat);
+  if (h->op == REMOTE_OP_READ && h->arg > (int64_t)room &&
+      h->arg <= REMOTE_MAX_PAYLOAD) {
+    room = (size_t)h->arg;
+  }
+  if (reserve(&client->out, &client->out_cap,
+              client->out_len + sizeof(RemoteHeader) + room) != 0) {
+    return -1;
+  }
+  char *data = client->out + client->out_len + sizeof(RemoteHeader);
+  uint32_t length = 0;
+
+  char path[REMOTE_MAX_PATH + 1];
+  OpenFile *file = NULL;
+  struct stat st;
+  int64_t res = 0;
+
+  // a connection that does not join a session gets its own
+  if (h->op != REMOTE_OP_HELLO && !client->session) {
+    client->session = session_new(0);
+    if (!client->session) {
+      return -1;
+    }
+    client->session->nclients = 1;
+  }
+  Session *session = client->session;
+
+  switch (h->op) {
+  case REMOTE_OP_HELLO:
+    res = handle_hello(client, h);
+    break;
+  case REMOTE_OP_OPEN:
+  case REMOTE_OP_LSTAT:
+  case REMOTE_OP_TRUNCATE:
+  case REMOTE_OP_UNLINK:
+    res = request_path(payload, h->length, path);
+    break;
+  case REMOTE_OP_CLOSE:
+  case REMOTE_OP_READ:
+  case REMOTE_OP_WRITE:
+  case REMOTE_OP_FSTAT:
+  case REMOTE_OP_FTRUNCATE:
+  case REMOTE_OP_FSYNC:
+    file = find_file(session, h->handle);
+    res = file ? 0 : -EBADF;
+    break;
+  default:
+    res = -ENOSYS;
+    break;
+  }
 
-  handle_path(m.path, path);
+  if (res == 0 && h->op != REMOTE_OP_HELLO) {
+    switch (h->op) {
+    case REMOTE_OP_OPEN:
+      res = handle_open(session, h, path);
+      break;
+    case REMOTE_OP_CLOSE:
+      res = handle_close(session, file);
+      break;
+    case REMOTE_OP_READ:
+      res = handle_read(file, h, data);
+      length = res > 0 ? (uint32_t)res : 0;
+      break;
+    case REMOTE_OP_WRITE:
+      res = handle_write(file, h, payload);
+      break;
+    case REMOTE_OP_FSTAT:
+      res = handle_stat(fstat(file->fd, &st), &st, data, &length);
+      break;
+    case REMOTE_OP_LSTAT:
+      res = handle_stat(fstatat(root_fd, path, &st, AT_SYMLINK_NOFOLLOW),
+                        &st, data, &length);
+      break;
+    case REMOTE_OP_FTRUNCATE:
+      res = ftruncate(file->fd, (off_t)h->offset) < 0 ? -errno : 0;
+      break;
+    case REMOTE_OP_TRUNCATE: {
+      int fd = openat(root_fd, path, O_WRONLY | O_CLOEXEC);
+      if (fd < 0 || ftruncate(fd, (off_t)h->offset) < 0) {
+        res = -errno;
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+      break;
+    }
+    case REMOTE_OP_UNLINK:
+      res = unlinkat(root_fd, path, 0) < 0 ? -errno : 0;
+      break;
+    case REMOTE_OP_FSYNC:
+      res = (h->arg ? fdatasync(file->fd) : fsync(file->fd)) < 0 ? -errno : 0;
+      break;
+    }
+  }
 
-  res = stat(path, &stbuf);
-  if (res < 0)
-    perror("stat");
+#ifdef DEBUG
+  printf("[ Server ]: client %d op %u id %llu handle %u returned %lld\n",
+         client->sock, h->op, (unsigned long long)h->id, h->handle,
+         (long long)res);
+#endif
 
-  // send stat struct
-  m.res = res;
-  memcpy(&m.st, &stbuf, sizeof(struct stat));
-  write(socket_fd, &m, sizeof(m));
+  remote_header_encode((RemoteHeader *)(client->out + client->out_len), h->op,
+                       h->id, h->handle, h->offset, res, length);
+  client->out_len += sizeof(RemoteHeader) + length;
+  return 0;
+}
 
-  printf("stat for path %s returned %ld\n", path, m.res);
+static size_t pending_out(const Client *client) {
+  return client->out_len - client->out_off;
 }
 
-void handle_open(int socket_fd, MSG m) {
-  int fd;
-  char path[PSIZE];
-  handle_path(m.path, path);
+/**
+ * @brief Handle the complete requests received, while replies can be queued
+ *
+ * @return int -> 0 on success, -1 if the connection has to be dropped
+ */
+static int handle_requests(Client *client) {
+  size_t off = 0;
+  while (pending_out(client) < OUT_HIGH_WATER &&
+         client->in_len - off >= sizeof(RemoteHeader)) {
+    RemoteHeader h;
+    memcpy(&h, client->in + off, sizeof(h));
+    if (remote_header_decode(&h, REMOTE_MAX_PAYLOAD) != 0) {
+      fprintf(stderr, "[ Server ]: invalid request from client %d\n",
+              client->sock);
+      return -1;
+    }
+    if (client->in_len - off < sizeof(h) + h.length) {
+      break;
+    }
+    if (handle_request(client, &h, client->in + off + sizeof(h)) != 0) {
+      return -1;
+    }
+    off += sizeof(h) + h.length;
+  }
 
-  fd = open(path, m.flags, m.mode);
-  m.res = fd;
-  write(socket_fd, &m, sizeof(m));
+  if (off > 0) {
+    memmove(client->in, client->in + off, client->in_len - off);
+    client->in_len -= off;
+  }
+  return 0;
 }
 
-void handle_unlink(int socket_fd, MSG m) {
-  char path[PSIZE];
-  ssize_t res;
+/**
+ * @brief Send the queued replies, as much as the socket takes
+ *
+ * @return int -> 0 on success, -1 if the connection has to be dropped
+ */
+static int flush_out(Client *client) {
+  while (pending_out(client) > 0) {
+    ssize_t n = client->local
+                    ? shm_send(client, client->out + client->out_off,
+                               pending_out(client))
+                    : send(client->sock, client->out + client->out_off,
+                           pending_out(client), MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    client->out_off += (size_t)n;
+  }
+  client->out_off = client->out_len = 0;
+  return 0;
+}
 
-  handle_path(m.path, path);
+/**
+ * @brief Read what the client sent, handling the requests as they complete
+ *
+ * @return int -> 0 on success, -1 if the client left or has to be dropped
+ */
+static int read_in(Client *client) {
+  while (pending_out(client) < OUT_HIGH_WATER) {
+    if (reserve(&client->in, &client->in_cap, client->in_len + READ_CHUNK) !=
+        0) {
+      return -1;
+    }
+    ssize_t n =
+        client->local
+            ? shm_recv(client, client->in + client->in_len, READ_CHUNK)
+            : recv(client->sock, client->in + client->in_len, READ_CHUNK, 0);
+    if (n == 0) {
+      return -1;
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    client->in_len += (size_t)n;
+    if (handle_requests(client) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
 
-  res = unlink(path);
-  if (res < 0)
-    perror("unlink");
+static void drop_client(int epfd, Client *client) {
+  printf("[ Server ]: client %d disconnected\n", client->sock);
+  epoll_ctl(epfd, EPOLL_CTL_DEL, client->sock, NULL);
+  close(client->sock);
 
-  m.res = res;
+  if (client->session) {
+    session_leave(client->session);
+  }
+  if (client->shm) {
+    // the client may be waiting on the rings, not on the socket
+    __atomic_store_n(&client->shm->closed, 1, __ATOMIC_RELEASE);
+    remote_futex_wake(remote_ring_word(&client->requests));
+    remote_futex_wake(remote_ring_word(&client->replies));
+    munmap(client->shm, client->shm_size);
+  }
+  free(client->in);
+  free(client->out);
+  free(client);
+}
 
-  res = write(socket_fd, &m, sizeof(m));
-  ;
-  if (res < 0)
-    perror("write");
-  printf("unlink for path %s returned %ld\n", path, m.res);
+/**
+ * @brief Read while the replies keep up, wait for the socket to take them
+ * otherwise
+ */
+static int update_events(int epfd, Client *client) {
+  unsigned events = 0;
+  if (client->local || pending_out(client) < OUT_HIGH_WATER) {
+    events |= EPOLLIN;
+  }
+  if (!client->local && pending_out(client) > 0) {
+    events |= EPOLLOUT;
+  }
+  if (events == client->events) {
+    return 0;
+  }
+  struct epoll_event ev = {.events = events, .data.ptr = client};
+  client->events = events;
+  return epoll_ctl(epfd, EPOLL_CTL_MOD, client->sock, &ev);
 }
 
-void handle_close(int socket_fd, MSG m) {
-  (void)close(m.fd); // Ignore return value
-  write(socket_fd, &m, sizeof(m));
+static void accept_clients(int epfd, int server_fd) {
+  bool local = server_fd == unix_fd;
+  while (1) {
+    int sock = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sock < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("accept");
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    if (!local) {
+      (void)setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &(int){1},
+                       sizeof(int));
+    }
+
+    Client *client = calloc(1, sizeof(Client));
+    if (!client) {
+      close(sock);
+      continue;
+    }
+    client->sock = sock;
+    client->local = local;
+    client->events = EPOLLIN;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = client};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+      perror("epoll_ctl");
+      close(sock);
+      free(client);
+      continue;
+    }
+    printf("[ Server ]: %s client %d connected\n", local ? "local" : "tcp",
+           sock);
+  }
+}
+
+static int serve_tcp(Client *client, unsigned events) {
+  int res = 0;
+  if (events & EPOLLOUT) {
+    res = flush_out(client);
+    // room for replies again, handle what was left in the input
+    if (res == 0) {
+      res = handle_requests(client);
+    }
+  }
+  if (res == 0 && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+    res = read_in(client);
+  }
+  if (res == 0) {
+    res = flush_out(client);
+  }
+  return res;
+}
+
+/**
+ * @brief Serve a local client until both of its rings have to be waited for
+ *
+ * Each ring that stops the loop is left with the sleeping flag of the server
+ * set, so that the client wakes it up once it moves.
+ *
+ * @return int -> 0 on success, -1 if the client has to be dropped
+ */
+static int serve_local(Client *client) {
+  if (!client->shm) {
+    int res = attach_shm(client);
+    return res < 0 ? -1 : 0;
+  }
+  if (drain_wakeups(client) != 0) {
+    return -1;
+  }
+  while (1) {
+    if (flush_out(client) != 0 || handle_requests(client) != 0) {
+      return -1;
+    }
+    if (pending_out(client) >= OUT_HIGH_WATER) {
+      // the replies ring is full, the client makes room
+      return 0;
+    }
+    if (read_in(client) != 0) {
+      return -1;
+    }
+    if (pending_out(client) < OUT_HIGH_WATER) {
+      // the requests ring is empty
+      return flush_out(client);
+    }
+  }
+}
+
+static void serve_client(int epfd, Client *client, unsigned events) {
+  int res = client->local ? serve_local(client) : serve_tcp(client, events);
+  if (res == 0) {
+    res = update_events(epfd, client);
+  }
+  if (res != 0) {
+    drop_client(epfd, client);
+  }
+}
+
+/**
+ * @brief Listen for local clients on the unix socket path
+ *
+ * @return int -> the listening socket, -1 on failure
+ */
+static int listen_unix(const char *path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "%s: path too long\n", path);
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+
+  // a socket left by a previous run, never another kind of file
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    (void)unlink(path);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket failed");
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(fd, LISTEN_BACKLOG) < 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  return fd;
 }
 
 int main(int argc, char const *argv[]) {
+  const char *root = argc > 1 ? argv[1] : SPATH;
+  int port = argc > 2 ? atoi(argv[2]) : REMOTE_DEFAULT_PORT;
+  const char *unix_path = argc > 3 ? argv[3] : REMOTE_DEFAULT_SHM_PATH;
 
   (void)signal(SIGINT, intHandler);
-  opened_files = g_hash_table_new(
-      g_direct_hash, g_str_equal); // create hash table to store files
+  (void)signal(SIGTERM, intHandler);
+
+  root_fd = open(root, O_DIRECTORY | O_PATH | O_CLOEXEC);
+  if (root_fd < 0) {
+    perror(root);
+    exit(EXIT_FAILURE);
+  }
 
   // structure for dealing with internet addresses
   struct sockaddr_in address;
 
   // Creating socket file descriptor
   // https://man7.org/linux/man-pages/man2/socket.2.html
-  server_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_fd < 0) {
+  tcp_fd =
+      socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (tcp_fd < 0) {
     perror("socket failed");
     exit(EXIT_FAILURE);
   }
 
-  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) <
+  if (setsockopt(tcp_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) <
       0)
     perror("setsockopt(SO_REUSEADDR) failed");
 
@@ -180,94 +820,72 @@ int main(int argc, char const *argv[]) {
   memset(&address, 0, sizeof(address));
   address.sin_family = AF_INET;
   address.sin_addr.s_addr = INADDR_ANY;
-  address.sin_port = htons(PORT);
+  address.sin_port = htons((uint16_t)port);
 
   // Attaches address to socket
   // https://man7.org/linux/man-pages/man2/bind.2.html
-  if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+  if (bind(tcp_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
     perror("bind failed");
     exit(EXIT_FAILURE);
   }
 
   // Listen for connections
   // https://man7.org/linux/man-pages/man2/listen.2.html
-  if (listen(server_fd, LISTEN_BACKLOG) < 0) {
+  if (listen(tcp_fd, LISTEN_BACKLOG) < 0) {
     perror("listen");
     exit(EXIT_FAILURE);
   }
 
-  while (1) {
-
-    int new_socket;
-
-    socklen_t addrlen = sizeof(address);
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    perror("epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+  unix_fd = listen_unix(unix_path);
+  if (unix_fd < 0) {
+    exit(EXIT_FAILURE);
+  }
 
-    // https://man7.org/linux/man-pages/man2/accept.2.html
-    new_socket = accept(server_fd, (struct sockaddr *)&address, &addrlen);
-    if (new_socket < 0) {
-      perror("accept");
-      exit(EXIT_FAILURE);
+  // the events of the listening sockets point to their fd
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &tcp_fd};
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, tcp_fd, &ev) < 0) {
+    perror("epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+  ev.data.ptr = &unix_fd;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, unix_fd, &ev) < 0) {
+    perror("epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+  printf("[ Server ]: serving %s on port %d and %s\n", root, port,
+         unix_path);
+
+  struct epoll_event events[MAX_EVENTS];
+  while (!stop) {
+    // wake up to expire the sessions left without connections
+    int n = epoll_wait(epfd, events, MAX_EVENTS, sessions ? 1000 : -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      break;
     }
-
-    // single threaded server...
-    ssize_t res;
-    MSG m;
-    // NOLINTNEXTLINE(clang-analyzer-deadcode.DeadStores)
-    while ((res = read(new_socket, &m, sizeof(m))) > 0) {
-
-#ifdef DEBUG
-      printf("\n\n\tm.op: %d,\n\tm.path: %s,\n\tm.buffer: %s\n\tm.offset: "
-             "%ld\n\tm.size: %ld\n\tm.res: %ld\n",
-             m.op, m.path, m.buffer, m.offset, m.size, m.res);
-      printf("\tres: %ld\n", res);
-#endif
-
-      switch (m.op) {
-      case WRITE:
-        printf("[ Server ]: WRITE message received from remote path: %s\n",
-               m.path);
-        handle_write(new_socket, m);
-        break;
-
-      case READ:
-        printf("[ Server ]: READ message received from remote path: %s\n",
-               m.path);
-        handle_read(new_socket, m);
-        break;
-
-      case STAT:
-        printf("[ Server ]: STAT message received from remote path: %s\n",
-               m.path);
-        handle_stat(new_socket, m);
-        break;
-
-      case OPEN:
-        printf("[ Server ]: OPEN message received from remote path: %s\n",
-               m.path);
-        handle_open(new_socket, m);
-        break;
-
-      case UNLINK:
-        printf("[ Server ]: UNLINK message received from remote path: %s\n",
-               m.path);
-        handle_unlink(new_socket, m);
-        break;
-
-      case CLOSE:
-        printf("[ Server ]: CLOSE message received from remote path: %s\n",
-               m.path);
-        handle_close(new_socket, m);
-        break;
-      default:
-        printf("[ Server ]: Operation not supported\n");
-        break;
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == &tcp_fd || events[i].data.ptr == &unix_fd) {
+        accept_clients(epfd, *(int *)events[i].data.ptr);
+      } else {
+        serve_client(epfd, events[i].data.ptr, events[i].events);
       }
     }
-
-    close(new_socket);
+    expire_sessions();
   }
 
-  // closing the listening socket
-  close(server_fd);
+  printf("Server shutting down\n");
+  close(epfd);
+  close(tcp_fd);
+  close(unix_fd);
+  (void)unlink(unix_path);
+  close(root_fd);
   return 0;
 }
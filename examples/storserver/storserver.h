@@ -1,33 +1,61 @@
-#include <arpa/inet.h>
-#include <stdio.h>
-#include <string.h>
-#include <sys/socket.h>
-#include <sys/stat.h>
-#include <unistd.h>
-
-#define PORT 5000
+#include "../../layers/remote/protocol.h"
+#include "../../layers/remote/shm.h"
+#include "../../lib/uthash/src/uthash.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
 #define LISTEN_BACKLOG 50
-#define BSIZE 4096
-#define PSIZE 512
-#define PORT 5000
-#define IP "127.0.0.1"
-
-#define READ 0
-#define WRITE 1
-#define STAT 2
-#define OPEN 3
-#define UNLINK 4
-#define CLOSE 5
-
-typedef struct msg {
-  int op;
-  char path[PSIZE];
-  char buffer[BSIZE];
-  int flags;
-  off_t offset;
-  size_t size;
-  ssize_t res;
+#define MAX_EVENTS 64
+
+// seconds a session outlives its last connection, for clients to reconnect
+#define SESSION_LINGER 30
+
+// replies queued on a connection before its requests stop being read
+#define OUT_HIGH_WATER (2 * REMOTE_MAX_PAYLOAD)
+// bytes asked to the socket per read
+#define READ_CHUNK (64 * 1024)
+
+// file opened by a client, named by its handle in the session
+typedef struct {
+  uint32_t handle;
   int fd;
-  mode_t mode;
-  struct stat st;
-} MSG;
+  UT_hash_handle hh;
+} OpenFile;
+
+// files of a client, shared by the connections that joined it
+typedef struct {
+  uint64_t id; // 0 for the private session of a connection without HELLO
+  OpenFile *files; // by handle
+  uint32_t next_handle;
+  int nclients;   // connections in the session
+  time_t expires; // when the session goes, once nclients is 0
+  UT_hash_handle hh;
+} Session;
+
+// state of a client connection
+typedef struct {
+  int sock;         // TCP connection, or unix socket of a shared memory
+  bool local;       // accepted on the unix socket, frames go through shm
+  Session *session; // NULL until HELLO or the first request
+
+  // rings of a local client, NULL until its memfd is received
+  RemoteShm *shm;
+  size_t shm_size;
+  RemoteRingEnd requests; // consumed by the server
+  RemoteRingEnd replies;  // produced by the server
+
+  // received bytes, requests are handled once complete
+  char *in;
+  size_t in_len;
+  size_t in_cap;
+
+  // replies not sent yet, from out_off to out_len
+  char *out;
+  size_t out_off;
+  size_t out_len;
+  size_t out_cap;
+
+  unsigned events; // epoll events the connection is registered for, a
+                   // local client always waits for EPOLLIN (its wake-ups)
+} Client;
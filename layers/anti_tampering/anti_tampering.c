@@ -1,9 +1,19 @@
+#define _GNU_SOURCE
 #include "anti_tampering.h"
 #include "../../logdef.h"
+#include "../../shared/utils/hasher/blake3_hasher.h"
 #include "../../shared/utils/hasher/hasher.h"
+#include "../../shared/utils/layer_iov.h"
 #include "anti_tampering_utils.h"
+#include "async_commit.h"
+#include "hash_reaper.h"
 #include "block_anti_tampering.h"
 #include "config.h"
+#include "merkle_anti_tampering.h"
+#include "scrubber.h"
+#include "verified_blocks.h"
+#include "verify_cache.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -30,10 +40,16 @@ static const LayerOps default_mode_ops = {
     .lpwrite = anti_tampering_write,
     .lopen = anti_tampering_open,
     .lclose = anti_tampering_close,
+    .lfsync = anti_tampering_fsync,
     .lftruncate = anti_tampering_ftruncate,
     .lfstat = anti_tampering_fstat,
     .llstat = anti_tampering_lstat,
     .lunlink = anti_tampering_unlink,
+    .lrename = anti_tampering_rename,
+    .ldirect_alignment = anti_tampering_direct_alignment,
+    .lbacking_fd = anti_tampering_backing_fd,
+    .lverify = anti_tampering_verify,
+    .lcopy_file_range = anti_tampering_copy_file_range,
 };
 
 static const LayerOps block_mode_ops = {
@@ -41,10 +57,30 @@ static const LayerOps block_mode_ops = {
     .lpwrite = block_anti_tampering_write,
     .lopen = block_anti_tampering_open,
     .lclose = block_anti_tampering_close,
+    .lfsync = block_anti_tampering_fsync,
     .lftruncate = block_anti_tampering_ftruncate,
     .lfstat = block_anti_tampering_fstat,
     .llstat = block_anti_tampering_lstat,
     .lunlink = block_anti_tampering_unlink,
+    .lrename = anti_tampering_rename,
+    .ldirect_alignment = anti_tampering_direct_alignment,
+    .lverify = anti_tampering_verify,
+    .lgetdigest = block_anti_tampering_getdigest,
+};
+
+static const LayerOps merkle_mode_ops = {
+    .lpread = anti_tampering_read,
+    .lpwrite = merkle_anti_tampering_write,
+    .lopen = merkle_anti_tampering_open,
+    .lclose = merkle_anti_tampering_close,
+    .lfsync = merkle_anti_tampering_fsync,
+    .lftruncate = merkle_anti_tampering_ftruncate,
+    .lfstat = anti_tampering_fstat,
+    .llstat = anti_tampering_lstat,
+    .lunlink = merkle_anti_tampering_unlink,
+    .lrename = anti_tampering_rename,
+    .ldirect_alignment = anti_tampering_direct_alignment,
+    .lverify = anti_tampering_verify,
 };
 
 static inline void
@@ -59,6 +95,8 @@ static inline const LayerOps *ops_for_mode(anti_tampering_mode_t mode) {
   switch (mode) {
   case ANTI_TAMPERING_MODE_BLOCK:
     return &block_mode_ops;
+  case ANTI_TAMPERING_MODE_MERKLE:
+    return &merkle_mode_ops;
   case ANTI_TAMPERING_MODE_FILE:
   default:
     return &default_mode_ops;
@@ -71,6 +109,190 @@ static inline const LayerOps *ops_for_mode(anti_tampering_mode_t mode) {
  * @param mapping -> pointer to the FileMapping to free
  */
 
+/**
+ * @brief Name of a hash in the metadata service cache
+ *
+ * @param state    -> AntiTamperingState pointer
+ * @param hex_hash -> hex hash of the file
+ * @param tag      -> receives the name
+ * @param size     -> size of tag
+ */
+static void verification_tag(const AntiTamperingState *state,
+                             const char *hex_hash, char *tag, size_t size) {
+  (void)snprintf(tag, size, "%d:%s", (int)state->hasher.algorithm, hex_hash);
+}
+
+/**
+ * @brief Record in the verify cache that a file matches its stored hash
+ *
+ * Must be called with the path lock held, so the stat taken here is the
+ * watermark of the content that was just hashed. The hash of that content is
+ * also shared through the metadata service cache, if any.
+ *
+ * @param state       -> AntiTamperingState pointer
+ * @param fd          -> data layer file descriptor of the file
+ * @param file_path   -> file path used as cache key
+ * @param hex_hash    -> hex hash of the file, equal to the stored one
+ * @param app_context -> application context of the layer calls
+ */
+static void remember_verified(AntiTamperingState *state, int fd,
+                              const char *file_path, const char *hex_hash,
+                              void *app_context) {
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, app_context);
+  if (!state->verify_cache) {
+    return;
+  }
+  struct stat stbuf;
+  if (data_layer.ops->lfstat(fd, &stbuf, data_layer) == 0) {
+    verify_cache_insert(state->verify_cache, file_path, &stbuf);
+    if (state->metadata) {
+      char tag[HASHER_MAX_HEX_SIZE + 16];
+      verification_tag(state, hex_hash, tag, sizeof(tag));
+      metadata_cache_set_verified(state->metadata, &stbuf, tag);
+    }
+  }
+}
+
+/**
+ * @brief Check the metadata service cache for the hash of a file
+ *
+ * Another layer, or this one under another path, may have hashed the same
+ * content: it matches stored_hash if that is the hash recorded for its
+ * current watermark. A hit is added to the verify cache, which has the same
+ * TTL.
+ *
+ * @return int -> 1 if the file is known to match stored_hash, 0 otherwise
+ */
+static int shared_verified(AntiTamperingState *state, int fd,
+                           const char *file_path, const char *stored_hash,
+                           void *app_context) {
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, app_context);
+  struct stat stbuf;
+  if (!state->metadata ||
+      data_layer.ops->lfstat(fd, &stbuf, data_layer) != 0) {
+    return 0;
+  }
+  char tag[HASHER_MAX_HEX_SIZE + 16];
+  verification_tag(state, stored_hash, tag, sizeof(tag));
+  if (!metadata_cache_is_verified(state->metadata, &stbuf, tag,
+                                  state->verify_cache->ttl_seconds)) {
+    return 0;
+  }
+  verify_cache_insert(state->verify_cache, file_path, &stbuf);
+  return 1;
+}
+
+/**
+ * @brief Compare the hash computed for a file with its stored hash
+ *
+ * On a match the file watermark is added to the verify cache (if enabled), on
+ * a mismatch of a non-empty file it is logged and counted.
+ *
+ * @param state         -> AntiTamperingState pointer
+ * @param verify_fd     -> data layer file descriptor the hash was computed on
+ * @param file_path     -> file path used as cache key
+ * @param stored_hash   -> hex hash of the hash layer
+ * @param file_hex_hash -> hex hash of the file
+ * @param app_context   -> application context of the layer calls
+ * @return int -> 1 if they match, 0 if they do not, -1 on error
+ */
+static int compare_file_hash(AntiTamperingState *state, int verify_fd,
+                             const char *file_path, const char *stored_hash,
+                             const char *file_hex_hash, void *app_context) {
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, app_context);
+  if (strcmp(file_hex_hash, stored_hash) == 0) {
+    remember_verified(state, verify_fd, file_path, file_hex_hash, app_context);
+    return 1;
+  }
+  if (WARN_ENABLED()) {
+    // Get file size first for debugging
+    struct stat stbuf;
+    int res = data_layer.ops->lfstat(verify_fd, &stbuf, data_layer);
+    if (res == -1) {
+      ERROR_MSG("[ANTI_TAMPERING_VERIFY] Failed to get file size for file "
+                "%s (fd=%d)",
+                file_path, verify_fd);
+      return -1;
+    }
+    off_t file_size = stbuf.st_size;
+
+    // ignore files with size 0: could have been just created
+    if (file_size != 0) {
+      count_hash_mismatch();
+      WARN_MSG("[ANTI_TAMPERING_OPEN] Hash mismatch for file %s "
+               "(size=%ld, verify_fd=%d); Stored "
+               "hash: %s; Computed hash: %s",
+               file_path, (long)file_size, verify_fd, stored_hash,
+               file_hex_hash);
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Verify a file against its stored hash, with the path lock held
+ *
+ * On a match the file watermark is added to the verify cache (if enabled).
+ * See atomic_hash_verify for the parameters and the result. With
+ * trust_shared, a hash of the file's content recorded in the metadata service
+ * cache stands in for hashing it; the scrubber, which is there to read the
+ * bytes at rest, always hashes.
+ */
+static int hash_verify_locked(int verify_fd, int hash_fd,
+                              const char *hash_path, AntiTamperingState *state,
+                              const char *file_path, int trust_shared,
+                              LayerContext l) {
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, l.app_context);
+  int result = 0;
+
+  // read the hash from the hash layer
+  size_t hex_size = state->hasher.get_hex_size();
+  char stored_hash[HASHER_MAX_HEX_SIZE];
+
+  ssize_t hash_res;
+  if (hash_fd < 0) {
+    // no hash file: the hash is published in a manifest
+    hash_res = hash_manifest_get(state->hash_manifest, hash_path, stored_hash,
+                                 sizeof(stored_hash));
+  } else {
+    hash_res = hash_layer.ops->lpread(hash_fd, stored_hash, hex_size - 1, 0,
+                                      hash_layer);
+  }
+  if (hash_res > 0) {
+    stored_hash[hash_res] = '\0';
+    if (trust_shared &&
+        shared_verified(state, verify_fd, file_path, stored_hash,
+                        l.app_context)) {
+      return 1;
+    }
+
+    // compute the hash of the file (file is already locked)
+    char file_hex_hash[HASHER_MAX_HEX_SIZE];
+    if (state->hasher.hash_file_hex_into(verify_fd, data_layer,
+                                         file_hex_hash,
+                                         sizeof(file_hex_hash)) >= 0) {
+      result = compare_file_hash(state, verify_fd, file_path, stored_hash,
+                                 file_hex_hash, l.app_context);
+    } else {
+      ERROR_MSG(
+          "[ANTI_TAMPERING_VERIFY] Failed to compute hash for file %s (fd=%d)",
+          file_path, verify_fd);
+
+      result = -1;
+    }
+  } else {
+    result = -1;
+  }
+
+  return result;
+}
+
 /**
  * @brief Perform atomic hash verification with shared file locking
  *
@@ -81,6 +303,8 @@ static inline const LayerOps *ops_for_mode(anti_tampering_mode_t mode) {
  * 4. Comparing stored vs computed hashes
  * 5. Releasing the read lock
  *
+ * On a match the file watermark is added to the verify cache (if enabled).
+ *
  * The read lock ensures that:
  * - Hash verification is atomic (no partial file modifications)
  * - Multiple verifications can run concurrently
@@ -88,91 +312,651 @@ static inline const LayerOps *ops_for_mode(anti_tampering_mode_t mode) {
  *
  * @param file_fd         -> File descriptor for acquiring read lock
  * @param verify_fd       -> File descriptor to read data for hash computation
- * @param hash_fd         -> File descriptor of the hash storage file
+ * @param hash_fd         -> File descriptor of the hash storage file, or
+ * INVALID_FD to read the hash from the hash manifest
  * @param state           -> AntiTamperingState pointer with layer contexts and
  * lock table
- * @param file_path       -> File path used as locking key
+ * @param path            -> file path used as locking key and its hash layer
+ * path (manifest key)
  * @param l               -> LayerContext passed to underlying layers
- * @return int            -> 0 on success, -1 on error
+ * @return int            -> 1 if the file matches the stored hash, 0 if it does
+ * not, -1 on error
  */
 static int atomic_hash_verify(int file_fd, int verify_fd, int hash_fd,
-                              AntiTamperingState *state, const char *file_path,
-                              LayerContext l) {
+                              AntiTamperingState *state,
+                              const InternedPath *path, LayerContext l) {
   // Acquire shared lock for atomic verification
-  if (locking_acquire_read(state->lock_table, file_path) != 0) {
+  if (locking_acquire_read_key(state->lock_table, &path->lock_key) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_VERIFY] Failed to acquire read lock on file %s "
+              "(fd=%d)",
+              path->file_path, file_fd);
+    return -1;
+  }
+
+  int result = hash_verify_locked(verify_fd, hash_fd, path->hash_path, state,
+                                  path->file_path, 1, l);
+
+  // Release the lock
+  locking_release_key(state->lock_table, &path->lock_key);
+
+  return result;
+}
+
+// Stored hash of a file read from the hash layer, by prefetched_hash_verify
+typedef struct {
+  LayerContext hash_layer; // with the app_context of the open
+  const char *hash_path;
+  size_t hex_size;
+  char hash[HASHER_MAX_HEX_SIZE];
+  ssize_t size; // bytes of hash, 0 without a hash file, -1 on error
+} HashFetch;
+
+static void *fetch_stored_hash(void *arg) {
+  HashFetch *fetch = arg;
+  int hash_fd = fetch->hash_layer.ops->lopen(fetch->hash_path, O_RDONLY, 0644,
+                                             fetch->hash_layer);
+  if (hash_fd < 0) {
+    fetch->size = 0;
+    return NULL;
+  }
+  fetch->size = fetch->hash_layer.ops->lpread(
+      hash_fd, fetch->hash, fetch->hex_size - 1, 0, fetch->hash_layer);
+  if (fetch->size == 0) {
+    fetch->size = -1; // an empty hash file is not a missing one
+  }
+  fetch->hash_layer.ops->lclose(hash_fd, fetch->hash_layer);
+  return NULL;
+}
+
+/**
+ * @brief atomic_hash_verify with the stored hash read from the hash layer
+ * while the file is hashed (hash_prefetch)
+ *
+ * The hash file is opened and read by a task of the metadata service pool,
+ * or by a thread of its own, so the round trip of a remote hash layer
+ * overlaps the local hash instead of preceding it. Both happen with the path
+ * read lock held, as in atomic_hash_verify: no commit can write the hash in
+ * between. A file without a hash file is hashed for nothing.
+ *
+ * @param file_fd -> data layer file descriptor of the open, for the messages
+ * @param state   -> AntiTamperingState pointer
+ * @param path    -> file path used as locking key and its hash layer path
+ * @param l       -> LayerContext passed to underlying layers
+ * @return int -> 1 if the file matches the stored hash, 0 if it does not or
+ * has none, -1 on error
+ */
+static int prefetched_hash_verify(int file_fd, AntiTamperingState *state,
+                                  const InternedPath *path, LayerContext l) {
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, l.app_context);
+  const char *file_path = path->file_path;
+  int verify_fd = data_layer.ops->lopen(file_path, O_RDONLY, 0644, data_layer);
+  if (verify_fd < 0) {
+    ERROR_MSG(
+        "[ANTI_TAMPERING_OPEN] Failed to open verification fd for file %s",
+        file_path);
+    return -1;
+  }
+  if (locking_acquire_read_key(state->lock_table, &path->lock_key) != 0) {
     ERROR_MSG("[ANTI_TAMPERING_VERIFY] Failed to acquire read lock on file %s "
               "(fd=%d)",
               file_path, file_fd);
+    data_layer.ops->lclose(verify_fd, data_layer);
     return -1;
   }
 
+  HashFetch fetch = {
+      .hash_layer = hash_layer,
+      .hash_path = path->hash_path,
+      .hex_size = state->hasher.get_hex_size(),
+      .size = -1,
+  };
+  ThreadPool *pool = metadata_service_pool();
+  ThreadPoolTask task;
+  ThreadPoolBatch batch;
+  pthread_t thread;
+  int started = 0;
+  if (pool) {
+    thread_pool_batch_init(&batch);
+    started = thread_pool_submit(pool, THREAD_POOL_LOCAL_QUEUE, &task, &batch,
+                                 fetch_stored_hash, &fetch) == 0;
+  } else {
+    started = pthread_create(&thread, NULL, fetch_stored_hash, &fetch) == 0;
+  }
+
+  char file_hex_hash[HASHER_MAX_HEX_SIZE];
+  int hashed = state->hasher.hash_file_hex_into(verify_fd, data_layer,
+                                                file_hex_hash,
+                                                sizeof(file_hex_hash)) >= 0;
+
+  if (pool) {
+    thread_pool_wait(pool, &batch);
+  } else if (started) {
+    pthread_join(thread, NULL);
+  }
+  if (!started) {
+    fetch_stored_hash(&fetch); // no worker: after the hash, as without
+  }
+
+  int result = -1;
+  if (fetch.size == 0) {
+    DEBUG_MSG("[ANTI_TAMPERING_OPEN] Hash file %s does not exist for file %s. "
+              "Note: it is only created on close.",
+              path->hash_path, file_path);
+    result = 0;
+  } else if (fetch.size > 0 && hashed) {
+    fetch.hash[fetch.size] = '\0';
+    result = compare_file_hash(state, verify_fd, file_path, fetch.hash,
+                               file_hex_hash, l.app_context);
+  } else if (!hashed) {
+    ERROR_MSG(
+        "[ANTI_TAMPERING_VERIFY] Failed to compute hash for file %s (fd=%d)",
+        file_path, verify_fd);
+  }
+
+  locking_release_key(state->lock_table, &path->lock_key);
+  data_layer.ops->lclose(verify_fd, data_layer);
+  return result;
+}
+
+// Hash of a whole verified file copied by copy_file_range, stored for the
+// copy instead of hashing it while the copy is as it was made (file mode)
+typedef struct CopiedHash {
+  char hash[HASHER_MAX_HEX_SIZE]; // stored hash of the source
+  struct stat stbuf;              // watermark of the copy once made
+} CopiedHash;
+
+/**
+ * @brief 1 if two stats have the watermark of the verify cache (device,
+ * inode, size, mtime and ctime), 0 otherwise
+ */
+static int same_watermark(const struct stat *a, const struct stat *b) {
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+         a->st_size == b->st_size &&
+         a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+         a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+         a->st_ctim.tv_sec == b->st_ctim.tv_sec &&
+         a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+/**
+ * @brief Read the stored hash of a file, from a manifest or its hash file
+ *
+ * @param state     -> AntiTamperingState pointer
+ * @param hash_path -> hash layer path of the file hash
+ * @param hash      -> receives the hex hash, terminated
+ * @param size      -> size of hash, at least HASHER_MAX_HEX_SIZE
+ * @param l         -> LayerContext passed to underlying layers
+ * @return ssize_t  -> length of the hash, 0 if there is none, -1 on error
+ */
+static ssize_t read_stored_hash(AntiTamperingState *state,
+                                const char *hash_path, char *hash, size_t size,
+                                LayerContext l) {
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, l.app_context);
+  ssize_t res;
+  if (hash_manifest_contains(state->hash_manifest, hash_path)) {
+    res = hash_manifest_get(state->hash_manifest, hash_path, hash, size);
+  } else {
+    int hash_fd = hash_layer.ops->lopen(hash_path, O_RDONLY, 0644, hash_layer);
+    if (hash_fd < 0) {
+      return -1;
+    }
+    res = hash_layer.ops->lpread(hash_fd, hash,
+                                 state->hasher.get_hex_size() - 1, 0,
+                                 hash_layer);
+    hash_layer.ops->lclose(hash_fd, hash_layer);
+  }
+  if (res >= 0) {
+    hash[res] = '\0';
+  }
+  return res;
+}
+
+/**
+ * @brief Compute the hash of a file and store it in the hash layer, with
+ * exclusive locking to ensure data integrity
+ *
+ * This function:
+ * 1. Acquires WRITE lock on the file path
+ * 2. Opens a new read-only file descriptor for hash computation
+ * 3. Computes the hash of the entire file content
+ * 4. Stores the hash in the hash layer
+ * 5. Releases the write lock
+ *
+ * The write lock ensures that:
+ * - Hash computation captures a consistent snapshot of the file
+ * - No other operations can modify the file during hash computation
+ * - Hash computation is fully atomic and reliable
+ *
+ * Runs in close, in fsync, or in the committer thread in async commit mode.
+ *
+ * @param state     -> AntiTamperingState pointer
+ * @param file      -> file path, with its lock table hash
+ * @param hash_path -> hash layer path of the file hash
+ * @param sync      -> make the hash durable: fsync the hash file, or write
+ * the manifest
+ * @param copied    -> hash of a copy of the file, read with the lock held,
+ * stored instead of hashing the file if the file is as the copy left it; NULL
+ * or a pointer to NULL to hash it
+ * @param l         -> LayerContext passed to underlying layers
+ * @return int      -> 0 on success, INVALID_FD on error
+ */
+static int store_file_hash(AntiTamperingState *state, const LockKey *file,
+                           const char *hash_path, int sync,
+                           CopiedHash *const *copied, LayerContext l) {
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, l.app_context);
+  const char *file_path = file->file_path;
   int result = 0;
 
-  // read the hash from the hash layer
-  size_t hex_size = state->hasher.get_hex_size();
-  char *stored_hash = malloc(hex_size);
-  if (!stored_hash) {
-    locking_release(state->lock_table, file_path);
-    return -1;
+  // Acquire exclusive lock on the original file for atomic hash computation
+  if (locking_acquire_write_key(state->lock_table, file) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_CLOSE] Failed to acquire write lock on file %s",
+              file_path);
+    return INVALID_FD;
   }
 
-  state->hash_layer.app_context = l.app_context;
-  ssize_t hash_res = state->hash_layer.ops->lpread(
-      hash_fd, stored_hash, hex_size - 1, 0, state->hash_layer);
-  if (hash_res > 0) {
-    stored_hash[hash_res] = '\0';
+  // Open separate read-only FD for hash computation: avoids interfering with
+  // original FD state New FD ensures clean read from start of file, regardless
+  // of original FD's current position
+  int new_file_fd = data_layer.ops->lopen(file_path, O_RDONLY, 0644,
+                                          data_layer);
+  if (new_file_fd < 0) {
+    locking_release_key(state->lock_table, file); // Release lock on error
+    return 0;
+  }
 
-    // compute the hash of the file (file is already locked)
-    char *file_hex_hash =
-        state->hasher.hash_file_hex(verify_fd, state->data_layer);
-    if (file_hex_hash) {
-      // compare the computed hash with the stored hash
-      if (strcmp(file_hex_hash, stored_hash) != 0 && WARN_ENABLED()) {
-        // Get file size first for debugging
-        struct stat stbuf;
-        int res =
-            state->data_layer.ops->lfstat(verify_fd, &stbuf, state->data_layer);
-        if (res == -1) {
-          ERROR_MSG("[ANTI_TAMPERING_VERIFY] Failed to get file size for file "
-                    "%s (fd=%d)",
-                    file_path, verify_fd);
-          free(file_hex_hash);
-          free(stored_hash);
-          locking_release(state->lock_table, file_path);
-          return -1;
-        }
-        off_t file_size = stbuf.st_size;
-
-        // ignore files with size 0: could have been just created
-        if (file_size != 0) {
-          WARN_MSG("[ANTI_TAMPERING_OPEN] Hash mismatch for file %s "
-                   "(size=%ld, verify_fd=%d); Stored "
-                   "hash: %s; Computed hash: %s",
-                   file_path, (long)file_size, verify_fd, stored_hash,
-                   file_hex_hash);
-        }
-      }
-      free(file_hex_hash);
-    } else {
-      ERROR_MSG(
-          "[ANTI_TAMPERING_VERIFY] Failed to compute hash for file %s (fd=%d)",
-          file_path, verify_fd);
+  // compute hash of the file (file is already locked), unless it is an
+  // unchanged copy whose source hash is known
+  char file_hex_hash[HASHER_MAX_HEX_SIZE];
+  const CopiedHash *copy = copied ? *copied : NULL;
+  struct stat stbuf;
+  if (copy && data_layer.ops->lfstat(new_file_fd, &stbuf, data_layer) == 0 &&
+      same_watermark(&copy->stbuf, &stbuf)) {
+    memcpy(file_hex_hash, copy->hash, sizeof(file_hex_hash));
+  } else if (state->hasher.hash_file_hex_into(new_file_fd, data_layer,
+                                              file_hex_hash,
+                                              sizeof(file_hex_hash)) < 0) {
+    locking_release_key(state->lock_table, file); // Release lock on error
+    data_layer.ops->lclose(new_file_fd, data_layer);
+    return INVALID_FD;
+  }
 
+  if (state->hash_manifest) {
+    // batched publication: the next manifest flush writes the hash
+    if (hash_manifest_put(state->hash_manifest, hash_path, file_hex_hash) ==
+        0) {
+      remember_verified(state, new_file_fd, file_path, file_hex_hash,
+                        l.app_context);
+    } else {
+      ERROR_MSG("[ANTI_TAMPERING_CLOSE] Failed to buffer hash of file %s",
+                file_path);
+      result = INVALID_FD;
+    }
+    locking_release_key(state->lock_table, file);
+    if (data_layer.ops->lclose(new_file_fd, data_layer) < 0 &&
+        result == 0) {
       result = -1;
     }
+    if (sync && result == 0 && hash_manifest_flush(state->hash_manifest) != 0) {
+      result = INVALID_FD;
+    }
+    return result;
+  }
+
+  // open the hash file in the hash layer using the computed hash path
+  int hash_fd = hash_layer_open(state, hash_path, O_RDWR | O_CREAT | O_TRUNC,
+                                l.app_context);
+
+  if (hash_fd < 0) {
+    ERROR_MSG(
+        "[ANTI_TAMPERING_CLOSE] Failed to open hash file %s; [HINT] use an "
+        "absolute path for the hashes_storage: %s",
+        hash_path, state->hash_prefix);
+
+    locking_release_key(state->lock_table, file); // Release lock on error
+    data_layer.ops->lclose(
+        new_file_fd, data_layer); // Close the hash computation fd
+    return INVALID_FD;
   } else {
-    result = -1;
+    DEBUG_MSG("[ANTI_TAMPERING_CLOSE] Hash file %s created for file %s",
+              hash_path, file_path);
   }
 
-  // Release the lock
-  locking_release(state->lock_table, file_path);
+  // write the hex hash string to the hash layer while still with the lock
+  ssize_t hash_res = hash_layer.ops->lpwrite(
+      hash_fd, file_hex_hash, strlen(file_hex_hash), 0, hash_layer);
 
-  // Free the allocated stored_hash
-  free(stored_hash);
+  if (hash_res > 0) {
+    DEBUG_MSG("[ANTI_TAMPERING_CLOSE] Hash file %s written (%ld bytes) to hash "
+              "layer",
+              hash_path, hash_res);
+    // the stored hash now matches the content: next open can skip the check
+    remember_verified(state, new_file_fd, file_path, file_hex_hash,
+                      l.app_context);
+  } else {
+    ERROR_MSG("[ANTI_TAMPERING_CLOSE] Failed to write hash file %s to hash "
+              "layer",
+              hash_path);
+  }
+
+  // Release the exclusive lock after hash computation and storage
+  locking_release_key(state->lock_table, file);
+
+  if (hash_res < 0) {
+    data_layer.ops->lclose(new_file_fd, data_layer);
+    hash_layer.ops->lclose(hash_fd, hash_layer);
+    return INVALID_FD;
+  }
+
+  // close the new file descriptor
+  int new_file_fd_close_res = data_layer.ops->lclose(new_file_fd, data_layer);
+  if (new_file_fd_close_res < 0) {
+    result = new_file_fd_close_res;
+  }
+
+  if (sync && hash_layer.ops->lfsync &&
+      hash_layer.ops->lfsync(hash_fd, 0, hash_layer) != 0) {
+    result = INVALID_FD;
+  }
+
+  // close the hash layer
+  int hash_fd_close_res = hash_layer.ops->lclose(hash_fd, hash_layer);
+  if (hash_fd_close_res < 0) {
+    result = hash_fd_close_res;
+  }
 
   return result;
 }
 
+/**
+ * @brief Store the hash of a file (see store_file_hash) and clear the file in
+ * the dirty journal once the hash survives a crash
+ *
+ * A hash left in the manifest buffer is only cleared once a flush wrote it.
+ *
+ * @return int -> 0 on success, INVALID_FD on error
+ */
+static int commit_file_hash(AntiTamperingState *state, const LockKey *file,
+                            const char *hash_path, int sync,
+                            CopiedHash *const *copied, LayerContext l) {
+  int result = store_file_hash(state, file, hash_path, sync, copied, l);
+  if (result == 0) {
+    dirty_journal_committed(state->dirty_journal, file->file_path,
+                            state->hash_manifest && !sync ? hash_path : NULL);
+  }
+  return result;
+}
+
+/**
+ * @brief Committer thread callback: commit_file_hash without an application
+ * context
+ */
+static int async_commit_file_hash(void *arg, const char *file_path,
+                                  const char *hash_path) {
+  LayerContext l = {.internal_state = arg, .app_context = NULL};
+  LockKey file;
+  locking_key_init(&file, file_path);
+  return commit_file_hash((AntiTamperingState *)arg, &file, hash_path, 0, NULL,
+                          l);
+}
+
+/**
+ * @brief The verification of open, at rest (file mode)
+ *
+ * A path open for writing, or whose hash is still being committed, has a
+ * stale hash: it is skipped. Both are checked with the path lock held, so
+ * no writer can get in between the check and the verification.
+ *
+ * @param state     -> state of the layer
+ * @param file_path -> data layer path of the file to verify
+ * @param l         -> context of the layer, for the app_context of the calls
+ * @return ScrubResult
+ */
+static ScrubResult verify_at_rest(AntiTamperingState *state,
+                                  const char *file_path, LayerContext l) {
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, l.app_context);
+  InternedPath *path = intern_path(state, file_path);
+  if (!path) {
+    return SCRUB_FAILED;
+  }
+  const char *hash_path = path->hash_path;
+  hash_reaper_claim(state->hash_reaper, hash_path);
+
+  int in_manifest = hash_manifest_contains(state->hash_manifest, hash_path);
+  int hash_fd = INVALID_FD;
+  if (!in_manifest) {
+    hash_fd = hash_layer.ops->lopen(hash_path, O_RDONLY, 0644, hash_layer);
+  }
+  if (!in_manifest && hash_fd < 0) {
+    interned_path_unref(path);
+    return SCRUB_UNPROTECTED;
+  }
+
+  ScrubResult result = SCRUB_FAILED;
+  int verify_fd = data_layer.ops->lopen(file_path, O_RDONLY, 0644, data_layer);
+  if (verify_fd >= 0) {
+    if (locking_acquire_read_key(state->lock_table, &path->lock_key) == 0) {
+      if (scrubber_is_busy(state->scrubber, file_path) ||
+          async_commit_pending(state->async_commit, file_path)) {
+        result = SCRUB_UNPROTECTED;
+      } else {
+        int match = hash_verify_locked(verify_fd, hash_fd, hash_path, state,
+                                       file_path, 0, l);
+        result = match == 1   ? SCRUB_VERIFIED
+                 : match == 0 ? SCRUB_MISMATCH
+                              : SCRUB_FAILED;
+      }
+      locking_release_key(state->lock_table, &path->lock_key);
+    }
+    data_layer.ops->lclose(verify_fd, data_layer);
+  }
+
+  if (hash_fd >= 0) {
+    hash_layer.ops->lclose(hash_fd, hash_layer);
+  }
+  interned_path_unref(path);
+  return result;
+}
+
+/**
+ * @brief Dirty journal callback: whether the hash committed to a manifest
+ * was written by a flush
+ */
+static int manifest_durable(void *arg, const char *hash_path) {
+  AntiTamperingState *state = arg;
+  return !hash_manifest_buffered(state->hash_manifest, hash_path);
+}
+
+/**
+ * @brief Dirty journal callback: rehash a file left dirty by a crash
+ *
+ * Its content is trusted as it is: the hash of the last close is stale.
+ */
+static int recover_file_hash(void *arg, const char *file_path) {
+  AntiTamperingState *state = arg;
+  LayerContext l = {.internal_state = state, .app_context = NULL};
+  InternedPath *path = intern_path(state, file_path);
+  if (!path) {
+    return -1;
+  }
+  int res = commit_file_hash(state, &path->lock_key, path->hash_path, 0, NULL,
+                             l);
+  interned_path_unref(path);
+  return res;
+}
+
+/**
+ * @brief Scrubber thread callback: verify_at_rest without an app context
+ */
+static ScrubResult scrub_file_hash(void *arg, const char *file_path) {
+  AntiTamperingState *state = (AntiTamperingState *)arg;
+  LayerContext l = {.internal_state = state, .app_context = NULL};
+  return verify_at_rest(state, file_path, l);
+}
+
+/**
+ * @brief Copy a hash file to another path of the hash layer, for hash layers
+ * without a rename
+ *
+ * @return int -> 0, or -1 on error (errno set)
+ */
+static int copy_hash_file(AntiTamperingState *state, const char *from,
+                          const char *to, void *app_context) {
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, app_context);
+  int src = hash_layer.ops->lopen(from, O_RDONLY, 0644, hash_layer);
+  if (src < 0) {
+    return -1;
+  }
+  int dst = hash_layer_open(state, to, O_WRONLY | O_CREAT | O_TRUNC,
+                            app_context);
+  if (dst < 0) {
+    hash_layer.ops->lclose(src, hash_layer);
+    return -1;
+  }
+
+  char buf[4096];
+  off_t offset = 0;
+  ssize_t n;
+  while ((n = hash_layer.ops->lpread(src, buf, sizeof(buf), offset,
+                                     hash_layer)) > 0) {
+    if (hash_layer.ops->lpwrite(dst, buf, (size_t)n, offset, hash_layer) != n) {
+      n = -1;
+      break;
+    }
+    offset += n;
+  }
+  int res = n < 0 ? -1 : 0;
+  hash_layer.ops->lclose(src, hash_layer);
+  if (hash_layer.ops->lclose(dst, hash_layer) != 0) {
+    res = -1;
+  }
+  return res;
+}
+
+/**
+ * @brief Remove a hash file, or move it to another path of the hash layer
+ *
+ * A missing hash file is not an error. When a moved hash file is missing,
+ * the target is removed: the file renamed over it had no hash, and the one
+ * of the file it replaced must not be checked against it.
+ *
+ * @param state       -> state of the layer
+ * @param hash_path   -> hash layer path to remove or move
+ * @param target      -> hash layer path to move it to, NULL to remove it
+ * @param app_context -> application context of the hash layer calls
+ * @return int -> 0, or -1 on error
+ */
+static int reap_hash_file(AntiTamperingState *state, const char *hash_path,
+                          const char *target, void *app_context) {
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, app_context);
+  if (!target) {
+    return hash_layer.ops->lunlink(hash_path, hash_layer) == 0 ||
+                   errno == ENOENT
+               ? 0
+               : -1;
+  }
+
+  int res;
+  if (hash_layer.ops->lrename) {
+    res = hash_layer.ops->lrename(hash_path, target, 0, hash_layer);
+    struct stat stbuf;
+    if (res != 0 && errno == ENOENT && state->hash_fanout > 0 &&
+        hash_layer.ops->llstat(hash_path, &stbuf, hash_layer) == 0 &&
+        make_hash_dirs(state, target, app_context) == 0) {
+      // the fan-out directory of the target does not exist yet
+      res = hash_layer.ops->lrename(hash_path, target, 0, hash_layer);
+    }
+  } else if ((res = copy_hash_file(state, hash_path, target, app_context)) ==
+             0) {
+      res = hash_layer.ops->lunlink(hash_path, hash_layer);
+  }
+  if (res != 0 && errno == ENOENT) {
+    return reap_hash_file(state, target, NULL, app_context);
+  }
+  return res;
+}
+
+/**
+ * @brief Remove or move the hash files of a path: the hash file, and the
+ * chunk list in merkle mode
+ *
+ * @return int -> 0, or -1 if one of them failed
+ */
+static int reap_hash_files(AntiTamperingState *state, const char *hash_path,
+                           const char *target, void *app_context) {
+  int res = reap_hash_file(state, hash_path, target, app_context);
+  if (state->mode != ANTI_TAMPERING_MODE_MERKLE) {
+    return res;
+  }
+
+  size_t suffix = strlen(MERKLE_CHUNKS_SUFFIX);
+  size_t len = strlen(hash_path) + suffix + 1;
+  size_t target_len = target ? strlen(target) + suffix + 1 : 0;
+  char *chunks_path = malloc(len);
+  char *chunks_target = target ? malloc(target_len) : NULL;
+  if (!chunks_path || (target && !chunks_target)) {
+    free(chunks_path);
+    free(chunks_target);
+    return -1;
+  }
+  (void)snprintf(chunks_path, len, "%s%s", hash_path, MERKLE_CHUNKS_SUFFIX);
+  if (target) {
+    (void)snprintf(chunks_target, target_len, "%s%s", target,
+                   MERKLE_CHUNKS_SUFFIX);
+  }
+  if (reap_hash_file(state, chunks_path, chunks_target, app_context) != 0) {
+    res = -1;
+  }
+  free(chunks_path);
+  free(chunks_target);
+  return res;
+}
+
+/**
+ * @brief Reaper thread callback: reap_hash_files without an application
+ * context
+ */
+static int reap_hash_files_async(void *arg, const char *hash_path,
+                                 const char *target) {
+  return reap_hash_files((AntiTamperingState *)arg, hash_path, target, NULL);
+}
+
+/**
+ * @brief Digest of a block of zeroes, the one of the whole blocks (block
+ * mode) and chunks (merkle mode) in holes, so they are not hashed
+ *
+ * @param state -> state with its mode, block size and hasher
+ * @return uint8_t* -> allocated digest, or NULL in file mode or on failure
+ * (the blocks are then hashed)
+ */
+static uint8_t *zero_block_digest(AntiTamperingState *state) {
+  if (state->block_size == 0) {
+    return NULL;
+  }
+  const size_t ds = state->hasher.get_hash_size();
+  uint8_t *zeroes = calloc(1, state->block_size);
+  uint8_t *digest = malloc(ds);
+  if (!zeroes || !digest ||
+      state->hasher.hash_buffer_binary(zeroes, state->block_size, digest,
+                                       ds) != (int)ds) {
+    free(digest);
+    digest = NULL;
+  }
+  free(zeroes);
+  return digest;
+}
+
 /**
  * @brief Init Anti-Tampering Layer
  * @param data_layer     -> data layer
@@ -197,10 +981,11 @@ LayerContext anti_tampering_init(LayerContext data_layer,
     exit(1);
   }
 
-  for (int i = 0; i < MAX_FDS; i++) {
-    state->mappings[i].file_fd = INVALID_FD;
-    state->mappings[i].file_path = NULL;
-    state->mappings[i].hash_path = NULL;
+  fd_table_init(&state->mappings, sizeof(FileMapping), init_file_mapping);
+  if (group_commit_init(&state->fsyncs) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_INIT] Failed to initialize the fsync group "
+              "commit");
+    exit(1);
   }
   new_layer.internal_state = state;
   // one data layer and one hash layer
@@ -210,6 +995,7 @@ LayerContext anti_tampering_init(LayerContext data_layer,
 
   // Configurable hash prefix
   state->hash_prefix = strdup(config->hashes_storage);
+  state->hash_fanout = config->hash_fanout;
 
   // Mode selection (default: file mode)
   state->mode = config->mode;
@@ -217,6 +1003,112 @@ LayerContext anti_tampering_init(LayerContext data_layer,
   if (state->mode == ANTI_TAMPERING_MODE_BLOCK) {
     require_block_size_or_exit(config);
     state->block_size = config->block_size;
+  } else if (state->mode == ANTI_TAMPERING_MODE_MERKLE) {
+    state->block_size = config->block_size > 0
+                            ? config->block_size
+                            : ANTI_TAMPERING_DEFAULT_CHUNK_SIZE;
+  }
+
+  // Block sizes of new files by path (block mode); the others get block_size
+  state->block_size_rules = NULL;
+  state->nblock_size_rules = 0;
+  if (state->mode == ANTI_TAMPERING_MODE_BLOCK &&
+      config->nblock_size_rules > 0) {
+    state->block_size_rules = calloc((size_t)config->nblock_size_rules,
+                                     sizeof(AntiTamperingBlockSizeRule));
+    if (!state->block_size_rules) {
+      exit(1);
+    }
+    for (int r = 0; r < config->nblock_size_rules; r++) {
+      const AntiTamperingBlockSizeRule *rule = &config->block_size_rules[r];
+      AntiTamperingBlockSizeRule *copy = &state->block_size_rules[r];
+      copy->block_size = rule->block_size;
+      copy->path_prefix = rule->path_prefix ? strdup(rule->path_prefix) : NULL;
+      copy->suffix = rule->suffix ? strdup(rule->suffix) : NULL;
+      state->nblock_size_rules++;
+      if ((rule->path_prefix && !copy->path_prefix) ||
+          (rule->suffix && !copy->suffix)) {
+        exit(1);
+      }
+    }
+  }
+
+  state->buffers = buffer_pool_shared();
+
+  // Digest trees of open files (merkle mode)
+  state->merkle_files = NULL;
+  state->hash_threads = config->hash_threads;
+  state->hash_pool = state->mode == ANTI_TAMPERING_MODE_MERKLE &&
+                             state->hash_threads > 1
+                         ? metadata_service_pool()
+                         : NULL;
+  pthread_mutex_init(&state->merkle_mutex, NULL);
+
+  // Cached block digests of open files (block mode)
+  state->block_files = NULL;
+  state->digest_cache =
+      state->mode == ANTI_TAMPERING_MODE_BLOCK && config->digest_cache;
+  pthread_mutex_init(&state->block_mutex, NULL);
+
+  // Verify-on-open cache (file mode only, disabled when no entries)
+  state->verify_cache = NULL;
+  if (state->mode == ANTI_TAMPERING_MODE_FILE &&
+      config->verify_cache_entries > 0) {
+    state->verify_cache = verify_cache_init(config->verify_cache_entries,
+                                            (time_t)config->verify_cache_ttl);
+    if (!state->verify_cache) {
+      ERROR_MSG("[ANTI_TAMPERING_INIT] Failed to create verify cache");
+      free(state);
+      exit(1);
+    }
+  }
+  state->metadata = state->verify_cache ? metadata_service_cache() : NULL;
+
+  // Stored hash read while the file is hashed on open (file mode only); a
+  // hash shared through the metadata service cache is only found by reading
+  // the stored hash first
+  state->hash_prefetch = state->mode == ANTI_TAMPERING_MODE_FILE &&
+                         config->hash_prefetch && !state->metadata;
+
+  // Verified blocks of read files (block mode only, disabled when no files)
+  state->verified = NULL;
+  if (state->mode == ANTI_TAMPERING_MODE_BLOCK &&
+      config->verified_block_files > 0) {
+    state->verified = verified_blocks_init(config->verified_block_files,
+                                           (time_t)config->verify_cache_ttl);
+    if (!state->verified) {
+      ERROR_MSG("[ANTI_TAMPERING_INIT] Failed to create the verified blocks "
+                "table");
+      free(state);
+      exit(1);
+    }
+  }
+
+  // Background hash commit on close (file mode only, disabled by default)
+  state->async_commit = NULL;
+  if (state->mode == ANTI_TAMPERING_MODE_FILE && config->async_commit) {
+    state->async_commit = async_commit_init(async_commit_file_hash, state);
+    if (!state->async_commit) {
+      ERROR_MSG("[ANTI_TAMPERING_INIT] Failed to start the async committer");
+      verify_cache_destroy(state->verify_cache);
+      free(state);
+      exit(1);
+    }
+  }
+
+  // Background hash removal on unlink and move on rename (disabled by
+  // default)
+  state->hash_reaper = NULL;
+  if (config->async_cleanup) {
+    state->hash_reaper = hash_reaper_init(reap_hash_files_async, state,
+                                          config->cleanup_journal);
+    if (!state->hash_reaper) {
+      ERROR_MSG("[ANTI_TAMPERING_INIT] Failed to start the hash reaper");
+      async_commit_destroy(state->async_commit);
+      verify_cache_destroy(state->verify_cache);
+      free(state);
+      exit(1);
+    }
   }
 
   // Initialize the path-based locking system
@@ -226,6 +1118,16 @@ LayerContext anti_tampering_init(LayerContext data_layer,
     exit(1);
   }
 
+  // The keyed hasher reads its key from the process-wide keyed hash state
+  if (config->algorithm == HASH_BLAKE3_KEYED &&
+      blake3_hasher_set_key(config->hash_key) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_INIT] A different blake3-keyed hash_key is "
+              "already in use by this process");
+    locking_destroy(state->lock_table);
+    free(state);
+    exit(1);
+  }
+
   // Initialize the hasher with the specified algorithm
   if (hasher_init(&state->hasher, config->algorithm) != 0) {
     ERROR_MSG("[ANTI_TAMPERING_INIT] Failed to initialize hasher with "
@@ -236,9 +1138,63 @@ LayerContext anti_tampering_init(LayerContext data_layer,
     exit(1);
   }
 
-  INFO_MSG("[ANTI_TAMPERING_INIT] Hasher initialized successfully with "
-           "algorithm: %s",
-           hash_algorithm_to_string(config->algorithm));
+  INFO_MSG("[ANTI_TAMPERING_INIT] Hasher initialized successfully with "
+           "algorithm: %s",
+           hash_algorithm_to_string(config->algorithm));
+
+  // Digest of a block of zeroes (block and merkle modes), needs the hasher
+  state->zero_block_digest = zero_block_digest(state);
+
+  // Batched hash publication (file mode only, disabled when no records)
+  state->hash_manifest = NULL;
+  if (state->mode == ANTI_TAMPERING_MODE_FILE &&
+      config->hash_batch_records > 0) {
+    state->hash_manifest = hash_manifest_init_anchored(
+        hash_layer, config->anchor, &state->hasher, state->hash_prefix,
+        state->hasher.get_hex_size() - 1, config->hash_batch_records,
+        config->hash_batch_interval_ms);
+    if (!state->hash_manifest) {
+      ERROR_MSG("[ANTI_TAMPERING_INIT] Failed to load the hash manifests of "
+                "%s",
+                state->hash_prefix);
+      locking_destroy(state->lock_table);
+      free(state);
+      exit(1);
+    }
+  }
+
+  // Paths whose stored hash may be stale (file mode only, disabled without a
+  // dirty_journal): those a crash left dirty are rehashed now
+  state->dirty_journal = NULL;
+  if (state->mode == ANTI_TAMPERING_MODE_FILE && config->dirty_journal) {
+    state->dirty_journal =
+        dirty_journal_init(config->dirty_journal,
+                           state->hash_manifest ? manifest_durable : NULL,
+                           state);
+    if (!state->dirty_journal) {
+      ERROR_MSG("[ANTI_TAMPERING_INIT] Failed to open the dirty journal %s",
+                config->dirty_journal);
+      exit(1);
+    }
+    dirty_journal_recover(state->dirty_journal, recover_file_hash, state);
+    if (state->hash_manifest) {
+      hash_manifest_flush(state->hash_manifest);
+    }
+  }
+
+  // Background verification of files at rest (file mode only, disabled
+  // without a scrub_root); started last, it uses the whole state
+  state->scrubber = NULL;
+  if (state->mode == ANTI_TAMPERING_MODE_FILE && config->scrub_root) {
+    state->scrubber =
+        scrubber_init(data_layer, config->scrub_root, config->scrub_rate,
+                      config->scrub_interval, scrub_file_hash, state);
+    if (!state->scrubber) {
+      ERROR_MSG("[ANTI_TAMPERING_INIT] Failed to start the scrubber of %s",
+                config->scrub_root);
+      exit(1);
+    }
+  }
 
   // NULL as the layers are in its internal state
   new_layer.next_layers = NULL;
@@ -293,16 +1249,20 @@ LayerContext anti_tampering_init(LayerContext data_layer,
 ssize_t anti_tampering_write(int fd, const void *buffer, size_t nbyte,
                              off_t offset, LayerContext l) {
   AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
 
-  if (!is_valid_anti_tampering_fd(fd)) {
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
     return INVALID_FD;
   }
 
-  int file_fd = state->mappings[fd].file_fd;
-  char *file_path = state->mappings[fd].file_path;
+  int file_fd = mapping->file_fd;
+  const char *file_path = mapping->file_path;
+  const LockKey *lock_key = &mapping->path->lock_key;
 
   // Acquire exclusive lock for atomic write operation
-  if (locking_acquire_write(state->lock_table, file_path) != 0) {
+  if (locking_acquire_write_key(state->lock_table, lock_key) != 0) {
     ERROR_MSG("[ANTI_TAMPERING_WRITE] Failed to acquire write lock on file %s "
               "(fd=%d)",
               file_path, file_fd);
@@ -310,12 +1270,16 @@ ssize_t anti_tampering_write(int fd, const void *buffer, size_t nbyte,
   }
 
   // write to the file layer
-  state->data_layer.app_context = l.app_context;
-  ssize_t res = state->data_layer.ops->lpwrite(file_fd, buffer, nbyte, offset,
-                                               state->data_layer);
+  ssize_t res = data_layer.ops->lpwrite(file_fd, buffer, nbyte, offset,
+                                        data_layer);
+  verify_cache_invalidate(state->verify_cache, file_path);
+  free(mapping->copied);
+  mapping->copied = NULL;
+  metadata_cache_invalidate(state->metadata, mapping->device,
+                            mapping->inode);
 
   // Release the exclusive lock
-  locking_release(state->lock_table, file_path);
+  locking_release_key(state->lock_table, lock_key);
 
   return res;
 }
@@ -345,16 +1309,20 @@ ssize_t anti_tampering_write(int fd, const void *buffer, size_t nbyte,
 ssize_t anti_tampering_read(int fd, void *buff, size_t nbyte, off_t offset,
                             LayerContext l) {
   AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
 
-  if (!is_valid_anti_tampering_fd(fd)) {
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
     return INVALID_FD;
   }
 
-  int file_fd = state->mappings[fd].file_fd;
-  char *file_path = state->mappings[fd].file_path;
+  int file_fd = mapping->file_fd;
+  const char *file_path = mapping->file_path;
+  const LockKey *lock_key = &mapping->path->lock_key;
 
   // Acquire shared lock for consistent read operation
-  if (locking_acquire_read(state->lock_table, file_path) != 0) {
+  if (locking_acquire_read_key(state->lock_table, lock_key) != 0) {
     ERROR_MSG(
         "[ANTI_TAMPERING_READ] Failed to acquire read lock on file %s (fd=%d)",
         file_path, file_fd);
@@ -362,12 +1330,11 @@ ssize_t anti_tampering_read(int fd, void *buff, size_t nbyte, off_t offset,
   }
 
   // read the file from the file layer
-  state->data_layer.app_context = l.app_context;
-  ssize_t res = state->data_layer.ops->lpread(file_fd, buff, nbyte, offset,
-                                              state->data_layer);
+  ssize_t res = data_layer.ops->lpread(file_fd, buff, nbyte, offset,
+                                       data_layer);
 
   // Release the shared lock
-  locking_release(state->lock_table, file_path);
+  locking_release_key(state->lock_table, lock_key);
 
   return res;
 }
@@ -379,7 +1346,9 @@ ssize_t anti_tampering_read(int fd, void *buff, size_t nbyte, off_t offset,
  * This function:
  * 1. Opens the file in the underlying layer
  * 2. Constructs hash file path from the original file path
- * 3. If hash file exists, performs atomic hash verification:
+ * 3. If the verify cache holds the current watermark of the file (same
+ *    device, inode, size, mtime and ctime), returns without verifying
+ * 4. If hash file exists, performs atomic hash verification:
  *    - Acquires READ lock on the file path
  *    - Reads stored hash and computes current file hash
  *    - Compares hashes while file is locked
@@ -397,142 +1366,169 @@ ssize_t anti_tampering_read(int fd, void *buff, size_t nbyte, off_t offset,
  * @return int     -> anti-tampering layer file descriptor, or INVALID_FD on
  * error
  */
-int anti_tampering_open(const char *pathname, int flags, mode_t mode,
-                        LayerContext l) {
+static int open_and_verify(const char *pathname, int flags, mode_t mode,
+                           LayerContext l) {
   AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
-
-  if (!pathname) {
-    return INVALID_FD;
-  }
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, l.app_context);
 
   // open the file in the file layer
-  state->data_layer.app_context = l.app_context;
-  int file_fd =
-      state->data_layer.ops->lopen(pathname, flags, mode, state->data_layer);
+  int file_fd = data_layer.ops->lopen(pathname, flags, mode, data_layer);
 
   if (file_fd < 0) {
     return file_fd;
   }
 
-  if (file_fd >= MAX_FDS) {
-    state->data_layer.ops->lclose(file_fd, state->data_layer);
+  FileMapping *mapping = fd_table_slot(&state->mappings, file_fd);
+  if (!mapping) {
+    ERROR_MSG("[ANTI_TAMPERING_OPEN] No mapping for file descriptor %d",
+              file_fd);
+    data_layer.ops->lclose(file_fd, data_layer);
     return INVALID_FD;
   }
 
   // Clean any existing mapping first
-  if (state->mappings[file_fd].file_path) {
-    free(state->mappings[file_fd].file_path);
-  }
-  if (state->mappings[file_fd].hash_path) {
-    free(state->mappings[file_fd].hash_path);
-  }
+  free_file_mapping(mapping);
 
-  // set the mapping for the file layer
-  char *path_copy = strdup(pathname);
-  if (!path_copy) {
-    state->data_layer.ops->lclose(file_fd, state->data_layer);
+  // the file path, its lock key and its hash layer path, in one allocation
+  InternedPath *path = intern_path(state, pathname);
+  if (!path) {
+    ERROR_MSG("[ANTI_TAMPERING_OPEN] Failed to construct hash pathname");
+    data_layer.ops->lclose(file_fd, data_layer);
     return INVALID_FD;
   }
 
-  state->mappings[file_fd].file_fd = file_fd;
-  state->mappings[file_fd].file_path = path_copy;
-  state->mappings[file_fd].hash_path = NULL;
-
-  // construct the hash file path, from the file path
-  char *file_path_hex_hash =
-      state->hasher.hash_buffer_hex(pathname, strlen(pathname));
-  if (!file_path_hex_hash) {
-    // Clean up allocated memory
-    free(state->mappings[file_fd].file_path);
-    state->mappings[file_fd].file_path = NULL;
-    state->mappings[file_fd].file_fd = INVALID_FD;
-    // Close the file we already opened
-    state->data_layer.ops->lclose(file_fd, state->data_layer);
-    return INVALID_FD;
+  mapping->file_fd = file_fd;
+  set_file_mapping_path(mapping, path);
+  const char *file_path = path->file_path;
+  const char *hash_path = path->hash_path;
+  int read_only = (flags & O_ACCMODE) == O_RDONLY;
+
+  // verify against the hash of the last close, not a stale one, nor the one
+  // of a file unlinked or renamed away from the path
+  async_commit_wait(state->async_commit, file_path);
+  hash_reaper_claim(state->hash_reaper, hash_path);
+
+  // skip verification if the file has not changed since it was last verified
+  if (state->verify_cache) {
+    struct stat stbuf;
+    int stat_res = data_layer.ops->lfstat(file_fd, &stbuf, data_layer);
+    if (stat_res == 0) {
+      mapping->device = stbuf.st_dev;
+      mapping->inode = stbuf.st_ino;
+    }
+    if (stat_res == 0 &&
+        verify_cache_lookup(state->verify_cache, file_path, &stbuf)) {
+      DEBUG_MSG("[ANTI_TAMPERING_OPEN] File %s unchanged since last "
+                "verification, skipping hash check",
+                file_path);
+      mapping->verified = read_only;
+      return file_fd;
+    }
   }
 
-  // construct the hash file path, from the file path hash
-  char *hash_pathname = construct_hash_pathname(state, file_path_hex_hash);
-  if (!hash_pathname) {
-    ERROR_MSG("[ANTI_TAMPERING] Failed to construct hash pathname");
-    free(file_path_hex_hash);
-    return -1;
+  // Skip verification in block and merkle mode - block mode verifies per-block
+  // hashes during reads and merkle mode verifies its chunks itself, so the hash
+  // file is not even opened here (it may live on a remote hash layer)
+  if (state->mode != ANTI_TAMPERING_MODE_FILE) {
+    return file_fd;
   }
-  free(file_path_hex_hash);
 
-  // set the mapping for the hash layer
-  char *hash_path_copy = strdup(hash_pathname);
-  free(hash_pathname);
-
-  if (!hash_path_copy) {
-    free(state->mappings[file_fd].file_path);
-    state->mappings[file_fd].file_path = NULL;
-    state->mappings[file_fd].file_fd = INVALID_FD;
-    state->data_layer.ops->lclose(file_fd, state->data_layer);
-    return INVALID_FD;
+  // check if the hash exists: in a manifest, or else as a hash file
+  int in_manifest = hash_manifest_contains(state->hash_manifest, hash_path);
+  if (state->hash_prefetch && !in_manifest) {
+    int match = prefetched_hash_verify(file_fd, state, path, l);
+    mapping->verified = read_only && match == 1;
+    return file_fd;
+  }
+  int hash_fd = INVALID_FD;
+  if (!in_manifest) {
+    hash_fd = hash_layer.ops->lopen(hash_path, O_RDONLY, 0644, hash_layer);
   }
-  state->mappings[file_fd].hash_path = hash_path_copy;
-
-  // check if the hash file exists
-  state->hash_layer.app_context = l.app_context;
-  int hash_fd = state->hash_layer.ops->lopen(hash_path_copy, O_RDONLY, 0644,
-                                             state->hash_layer);
 
-  // if the hash file exists, we make a anti-tampering check
-  // Skip verification in block mode - block mode uses per-block hashes and
-  // verification happens during read operations, not on open
-  if (hash_fd > 0 && state->mode == ANTI_TAMPERING_MODE_FILE) {
+  // if the hash exists, we make a anti-tampering check
+  if (in_manifest || hash_fd >= 0) {
     // Open separate read-only FD for verification: original FD for locking,
     // verify FD for reading. This separation ensures the verification process
     // doesn't interfere with the file's current state or position, and provides
     // a clean read-only view of the file for hash calculation. But we'll do it
     // AFTER acquiring the lock on the original file to ensure atomicity
-    state->data_layer.app_context = l.app_context;
-    int verify_fd = state->data_layer.ops->lopen(path_copy, O_RDONLY, 0644,
-                                                 state->data_layer);
+    int verify_fd = data_layer.ops->lopen(file_path, O_RDONLY, 0644,
+                                          data_layer);
 
-    if (verify_fd > 0) {
+    if (verify_fd >= 0) {
       // Use the original file descriptor for locking, verify_fd for reading
-      atomic_hash_verify(file_fd, verify_fd, hash_fd, state, path_copy, l);
+      int match =
+          atomic_hash_verify(file_fd, verify_fd, hash_fd, state, path, l);
+      mapping->verified = read_only && match == 1;
 
       // close the verification file descriptor
-      state->data_layer.ops->lclose(verify_fd, state->data_layer);
+      data_layer.ops->lclose(verify_fd, data_layer);
     } else {
       ERROR_MSG(
           "[ANTI_TAMPERING_OPEN] Failed to open verification fd for file %s",
-          path_copy);
+          file_path);
     }
 
     // close the hash file
-    state->hash_layer.ops->lclose(hash_fd, state->hash_layer);
-  } else if (hash_fd > 0) {
-
-    state->hash_layer.ops->lclose(hash_fd, state->hash_layer);
-  } else if (state->mode == ANTI_TAMPERING_MODE_FILE) {
+    if (hash_fd >= 0) {
+      hash_layer.ops->lclose(hash_fd, hash_layer);
+    }
+  } else {
     DEBUG_MSG("[ANTI_TAMPERING_OPEN] Hash file %s does not exist for file %s. "
               "Note: it is only created on close.",
-              hash_path_copy, path_copy);
+              hash_path, file_path);
   }
 
   return file_fd;
 }
 
+int anti_tampering_open(const char *pathname, int flags, mode_t mode,
+                        LayerContext l) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+
+  if (!pathname) {
+    return INVALID_FD;
+  }
+
+  // busy for the scrubber, and dirty on disk, before the data layer sees
+  // O_TRUNC or a write
+  int writes = (flags & O_ACCMODE) != O_RDONLY;
+  int journaled = state->dirty_journal && writes;
+  if (journaled && dirty_journal_mark(state->dirty_journal, pathname) != 0) {
+    errno = EIO;
+    return INVALID_FD;
+  }
+  int writer = state->scrubber && writes;
+  if (writer) {
+    scrubber_mark_writer(state->scrubber, pathname);
+  }
+  int fd = open_and_verify(pathname, flags, mode, l);
+  if (fd < 0) {
+    if (writer) {
+      scrubber_unmark_writer(state->scrubber, pathname);
+    }
+    if (journaled) {
+      // the file is as its stored hash left it
+      dirty_journal_unmark(state->dirty_journal, pathname);
+      dirty_journal_committed(state->dirty_journal, pathname, NULL);
+    }
+  } else {
+    FileMapping *mapping = anti_tampering_mapping(state, fd);
+    mapping->writer = writer;
+    mapping->journaled = journaled;
+  }
+  return fd;
+}
+
 /**
- * @brief close anti-tampering layer - performs atomic hash computation and
- * closes files with exclusive locking to ensure data integrity
- *
- * This function:
- * 1. Acquires WRITE lock on the file path
- * 2. Opens a new read-only file descriptor for hash computation
- * 3. Computes SHA-256 hash of the entire file content
- * 4. Stores the hash in the hash layer
- * 5. Releases the write lock
- * 6. Closes all file descriptors
+ * @brief close anti-tampering layer - computes and stores the file hash (see
+ * commit_file_hash) and closes the file
  *
- * The write lock ensures that:
- * - Hash computation captures a consistent snapshot of the file
- * - No other operations can modify the file during hash computation
- * - Hash computation is fully atomic and reliable
+ * In async commit mode the file is closed first and the hash is computed and
+ * stored by the committer thread; a later open of the path waits for it.
  *
  * @param fd    -> anti-tampering layer file descriptor
  * @param l     -> LayerContext for current layer
@@ -540,158 +1536,130 @@ int anti_tampering_open(const char *pathname, int flags, mode_t mode,
  */
 int anti_tampering_close(int fd, LayerContext l) {
   AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
 
-  if (!is_valid_anti_tampering_fd(fd)) {
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
     return INVALID_FD;
   }
 
   int result = 0; // Track the result of operations
 
   // get FD from the mapping
-  int file_fd = state->mappings[fd].file_fd;
-  char *file_path = state->mappings[fd].file_path;
-  char *hash_path = state->mappings[fd].hash_path;
-
-  // Validate we have a valid file path
-  if (!file_path) {
-    return INVALID_FD;
-  }
-
-  // Make a copy of the paths since we'll need them after clearing the mapping
-  char *file_path_copy = strdup(file_path);
-  char *hash_path_copy = hash_path ? strdup(hash_path) : NULL;
-
-  if (!file_path_copy) {
-    if (hash_path_copy)
-      free(hash_path_copy);
-    return INVALID_FD;
-  }
+  int file_fd = mapping->file_fd;
+
+  // Keep a reference on the paths since we'll need them after clearing the
+  // mapping
+  int writer = mapping->writer;
+  int journaled = mapping->journaled;
+  InternedPath *path = interned_path_ref(mapping->path);
+  const char *file_path = path->file_path;
+  const char *hash_path = path->hash_path;
+  CopiedHash *copied = mapping->copied;
+  mapping->copied = NULL;
 
   // Clear the mapping
-  free_file_mapping(&state->mappings[fd]);
+  free_file_mapping(mapping);
 
-  // Acquire exclusive lock on the original file for atomic hash computation
-  if (locking_acquire_write(state->lock_table, file_path_copy) != 0) {
-    ERROR_MSG("[ANTI_TAMPERING_CLOSE] Failed to acquire write lock on file %s "
-              "(fd=%d)",
-              file_path_copy, file_fd);
-    free(file_path_copy);
-    if (hash_path_copy)
-      free(hash_path_copy);
-    return INVALID_FD;
+  // no more writes through the fd: the commit below can clear the path
+  if (journaled) {
+    dirty_journal_unmark(state->dirty_journal, file_path);
   }
 
-  // Open separate read-only FD for hash computation: avoids interfering with
-  // original FD state New FD ensures clean read from start of file, regardless
-  // of original FD's current position
-  state->data_layer.app_context = l.app_context;
-  int new_file_fd = state->data_layer.ops->lopen(file_path_copy, O_RDONLY, 0644,
-                                                 state->data_layer);
-  if (new_file_fd < 0) {
-    locking_release(state->lock_table, file_path_copy); // Release lock on error
-    free(file_path_copy);
-    if (hash_path_copy)
-      free(hash_path_copy);
-    return 0;
+  // close the data layer file first, the committer reopens it by path; a
+  // copy has its hash already, it is stored right away
+  if (state->async_commit && !copied) {
+    int file_fd_close_res = data_layer.ops->lclose(file_fd, data_layer);
+    if (async_commit_enqueue(state->async_commit, file_path,
+                             hash_path) != 0) {
+      result = commit_file_hash(state, &path->lock_key, hash_path, 0, NULL, l);
+    }
+    // a queued commit keeps the path busy for the scrubber
+    if (writer) {
+      scrubber_unmark_writer(state->scrubber, file_path);
+    }
+    if (file_fd_close_res < 0) {
+      result = file_fd_close_res;
+    }
+    interned_path_unref(path);
+    return result;
   }
 
-  // compute hash of the file (file is already locked)
-  char *file_hex_hash =
-      state->hasher.hash_file_hex(new_file_fd, state->data_layer);
-  if (!file_hex_hash) {
-    locking_release(state->lock_table, file_path_copy); // Release lock on error
-    free(file_path_copy);
-    if (hash_path_copy)
-      free(hash_path_copy);
-    state->data_layer.ops->lclose(new_file_fd, state->data_layer);
-    return INVALID_FD;
+  // hash the file while the original file descriptor is still open
+  result = commit_file_hash(state, &path->lock_key, hash_path, 0, &copied, l);
+  free(copied);
+  if (writer) {
+    scrubber_unmark_writer(state->scrubber, file_path);
   }
 
-  // open the hash file in the hash layer using the computed hash path
-  state->hash_layer.app_context = l.app_context;
-  int hash_fd = state->hash_layer.ops->lopen(
-      hash_path_copy, O_RDWR | O_CREAT | O_TRUNC, 0644, state->hash_layer);
-
-  if (hash_fd < 0) {
-    ERROR_MSG(
-        "[ANTI_TAMPERING_CLOSE] Failed to open hash file %s; [HINT] use an "
-        "absolute path for the hashes_storage: %s",
-        hash_path_copy, state->hash_prefix);
-
-    locking_release(state->lock_table, file_path_copy); // Release lock on error
-    free(file_path_copy);
-    if (hash_path_copy)
-      free(hash_path_copy);
-    free(file_hex_hash); // Free the computed hash
-    state->data_layer.ops->lclose(
-        new_file_fd, state->data_layer); // Close the hash computation fd
-    return INVALID_FD;
-  } else {
-    DEBUG_MSG("[ANTI_TAMPERING_CLOSE] Hash file %s created for file %s",
-              hash_path_copy, file_path_copy);
+  // close the file layer if it exists
+  if (file_fd != INVALID_FD) {
+    int file_fd_close_res = data_layer.ops->lclose(file_fd, data_layer);
+    if (file_fd_close_res < 0 && result == 0) {
+      result = file_fd_close_res;
+    }
   }
 
-  // write the hex hash string to the hash layer while still with the lock
-  state->hash_layer.app_context = l.app_context;
-  ssize_t hash_res = state->hash_layer.ops->lpwrite(
-      hash_fd, file_hex_hash, strlen(file_hex_hash), 0, state->hash_layer);
+  interned_path_unref(path);
 
-  if (hash_res > 0) {
-    DEBUG_MSG("[ANTI_TAMPERING_CLOSE] Hash file %s written (%ld bytes) to hash "
-              "layer",
-              hash_path_copy, hash_res);
-  } else {
-    ERROR_MSG("[ANTI_TAMPERING_CLOSE] Failed to write hash file %s to hash "
-              "layer",
-              hash_path_copy);
-  }
+  return result;
+}
 
-  // Release the exclusive lock after hash computation and storage
-  locking_release(state->lock_table, file_path_copy);
+// The fsync leading a batch of fsyncs of a path (file mode)
+typedef struct {
+  AntiTamperingState *state;
+  int file_fd;
+  const InternedPath *path;
+  CopiedHash *const *copied; // of the fd, read with the path lock held
+  LayerContext l;
+} FileSync;
 
-  free(file_hex_hash);
-  if (hash_res < 0) {
-    free(file_path_copy);
-    if (hash_path_copy)
-      free(hash_path_copy);
-    state->data_layer.ops->lclose(new_file_fd, state->data_layer);
+/**
+ * @brief fsync the file and publish its hash, for a batch of fsyncs
+ */
+static int file_sync(void *arg, int isdatasync) {
+  FileSync *sync = arg;
+  AntiTamperingState *state = sync->state;
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, sync->l.app_context);
+  if (data_layer.ops->lfsync &&
+      data_layer.ops->lfsync(sync->file_fd, isdatasync, data_layer) != 0) {
     return INVALID_FD;
   }
+  return commit_file_hash(state, &sync->path->lock_key, sync->path->hash_path,
+                          1, sync->copied, sync->l);
+}
 
-  // close the new file descriptor
-  state->data_layer.app_context = l.app_context;
-  if (new_file_fd != INVALID_FD) {
-    int new_file_fd_close_res =
-        state->data_layer.ops->lclose(new_file_fd, state->data_layer);
-    if (new_file_fd_close_res < 0) {
-      result = new_file_fd_close_res;
-    }
-  }
-
-  // close the file layer if it exists
-  state->data_layer.app_context = l.app_context;
-  if (file_fd != INVALID_FD) {
-    int file_fd_close_res =
-        state->data_layer.ops->lclose(file_fd, state->data_layer);
-    if (file_fd_close_res < 0) {
-      result = file_fd_close_res;
-    }
-  }
-
-  // close the hash layer if it exists
-  state->hash_layer.app_context = l.app_context;
-  if (hash_fd != INVALID_FD) {
-    int hash_fd_close_res =
-        state->hash_layer.ops->lclose(hash_fd, state->hash_layer);
-    if (hash_fd_close_res < 0) {
-      result = hash_fd_close_res;
-    }
+/**
+ * @brief fsync anti-tampering layer - fsyncs the file and stores its hash
+ *
+ * The hash of the synced content is durable once fsync returns, so a crash
+ * after it does not leave a file that fails its verification. Concurrent
+ * fsyncs of a path are served by one fsync and one hash commit (see
+ * group_commit.h).
+ *
+ * @param fd         -> anti-tampering layer file descriptor
+ * @param isdatasync -> fdatasync instead of fsync
+ * @param l          -> LayerContext for current layer
+ * @return int       -> 0 on success, INVALID_FD on error
+ */
+int anti_tampering_fsync(int fd, int isdatasync, LayerContext l) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
+    return INVALID_FD;
   }
-
-  free(file_path_copy);
-  if (hash_path_copy)
-    free(hash_path_copy);
-
+  InternedPath *path = interned_path_ref(mapping->path);
+  FileSync sync = {.state = state,
+                   .file_fd = mapping->file_fd,
+                   .path = path,
+                   .copied = &mapping->copied,
+                   .l = l};
+  int result =
+      group_commit_sync(&state->fsyncs, path->file_path,
+                        strlen(path->file_path), isdatasync, file_sync, &sync);
+  interned_path_unref(path);
   return result;
 }
 
@@ -705,17 +1673,21 @@ int anti_tampering_close(int fd, LayerContext l) {
  */
 int anti_tampering_ftruncate(int fd, off_t length, LayerContext l) {
   AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
 
-  if (!is_valid_anti_tampering_fd(fd)) {
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
     return INVALID_FD;
   }
 
   // Get the file descriptor from the mapping
-  int file_fd = state->mappings[fd].file_fd;
-  char *file_path = state->mappings[fd].file_path;
+  int file_fd = mapping->file_fd;
+  const char *file_path = mapping->file_path;
+  const LockKey *lock_key = &mapping->path->lock_key;
 
   // Acquire exclusive lock for atomic write operation
-  if (locking_acquire_write(state->lock_table, file_path) != 0) {
+  if (locking_acquire_write_key(state->lock_table, lock_key) != 0) {
     ERROR_MSG("[ANTI_TAMPERING_FTRUNCATE] Failed to acquire write lock on file "
               "%s (fd=%d)",
               file_path, file_fd);
@@ -723,13 +1695,131 @@ int anti_tampering_ftruncate(int fd, off_t length, LayerContext l) {
   }
 
   // Call the next layer's ftruncate operation
-  state->data_layer.app_context = l.app_context;
-  int res =
-      state->data_layer.ops->lftruncate(file_fd, length, state->data_layer);
+  int res = data_layer.ops->lftruncate(file_fd, length, data_layer);
+  verify_cache_invalidate(state->verify_cache, file_path);
+  free(mapping->copied);
+  mapping->copied = NULL;
+  metadata_cache_invalidate(state->metadata, mapping->device,
+                            mapping->inode);
+  verified_blocks_reset(state->verified, file_path);
 
   // Release the exclusive lock
-  locking_release(state->lock_table, file_path);
+  locking_release_key(state->lock_table, lock_key);
+
+  return res;
+}
+
+/**
+ * @brief Hash of the source of a whole file copy, if the source matches it
+ *
+ * The source must have been verified on open and still be as the verify
+ * cache recorded it, and the copy hold exactly its bytes. Called with the
+ * locks of both paths held.
+ *
+ * @return CopiedHash* -> hash and watermark of the copy, NULL to hash it
+ */
+static CopiedHash *copy_stored_hash(AntiTamperingState *state,
+                                    const FileMapping *in,
+                                    const FileMapping *out, off_t copied,
+                                    LayerContext l) {
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  struct stat src_stbuf;
+  struct stat dst_stbuf;
+  if (!state->verify_cache || !in->verified ||
+      data_layer.ops->lfstat(in->file_fd, &src_stbuf, data_layer) != 0 ||
+      src_stbuf.st_size != copied ||
+      data_layer.ops->lfstat(out->file_fd, &dst_stbuf, data_layer) != 0 ||
+      dst_stbuf.st_size != copied ||
+      !verify_cache_lookup(state->verify_cache, in->file_path, &src_stbuf)) {
+    return NULL;
+  }
+  CopiedHash *hash = malloc(sizeof(CopiedHash));
+  if (!hash || read_stored_hash(state, in->hash_path, hash->hash,
+                                sizeof(hash->hash), l) <= 0) {
+    free(hash);
+    return NULL;
+  }
+  hash->stbuf = dst_stbuf;
+  return hash;
+}
+
+/**
+ * @brief copy_file_range anti-tampering layer (file mode) - copies a range
+ * in the data layer, with the locks of both files
+ *
+ * The source is read locked and the destination write locked, in the order
+ * of their paths. A copy of a whole verified file into an empty one takes
+ * the stored hash of the source along: the destination stores it on close or
+ * fsync instead of being hashed, if it did not change in between.
+ *
+ * @param fd_in      -> anti-tampering layer file descriptor to copy from
+ * @param offset_in  -> offset value in fd_in
+ * @param fd_out     -> anti-tampering layer file descriptor to copy to
+ * @param offset_out -> offset value in fd_out
+ * @param len        -> number of bytes to copy
+ * @param flags      -> flags of copy_file_range(2)
+ * @param l          -> LayerContext for current layer
+ * @return ssize_t   -> number of copied bytes, or -1 on error
+ */
+ssize_t anti_tampering_copy_file_range(int fd_in, off_t offset_in, int fd_out,
+                                       off_t offset_out, size_t len,
+                                       unsigned int flags, LayerContext l) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+
+  FileMapping *in = anti_tampering_mapping(state, fd_in);
+  FileMapping *out = anti_tampering_mapping(state, fd_out);
+  if (!in || !out) {
+    errno = EBADF;
+    return INVALID_FD;
+  }
+
+  const LockKey *src_key = &in->path->lock_key;
+  const LockKey *dst_key = &out->path->lock_key;
+  int order = strcmp(in->file_path, out->file_path);
+  if (order < 0 &&
+      locking_acquire_read_key(state->lock_table, src_key) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_COPY_FILE_RANGE] Failed to acquire read lock "
+              "on file %s",
+              in->file_path);
+    return -1;
+  }
+  if (locking_acquire_write_key(state->lock_table, dst_key) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_COPY_FILE_RANGE] Failed to acquire write lock "
+              "on file %s",
+              out->file_path);
+    if (order < 0) {
+      locking_release_key(state->lock_table, src_key);
+    }
+    return -1;
+  }
+  if (order > 0 &&
+      locking_acquire_read_key(state->lock_table, src_key) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_COPY_FILE_RANGE] Failed to acquire read lock "
+              "on file %s",
+              in->file_path);
+    locking_release_key(state->lock_table, dst_key);
+    return -1;
+  }
+
+  ssize_t res = layer_copy_file_range(in->file_fd, offset_in, out->file_fd,
+                                      offset_out, len, flags, data_layer);
+  int err = errno;
+  verify_cache_invalidate(state->verify_cache, out->file_path);
+  metadata_cache_invalidate(state->metadata, out->device, out->inode);
+  free(out->copied);
+  out->copied = NULL;
+  if (res > 0 && order != 0 && offset_in == 0 && offset_out == 0) {
+    out->copied = copy_stored_hash(state, in, out, (off_t)res, l);
+  }
 
+  if (order != 0) {
+    locking_release_key(state->lock_table, src_key);
+  }
+  locking_release_key(state->lock_table, dst_key);
+  errno = err;
   return res;
 }
 
@@ -744,10 +1834,79 @@ void anti_tampering_destroy(LayerContext l) {
     return;
   }
 
+  // Stop verifying before anything the scrubber uses goes away
+  if (state->scrubber) {
+    ScrubberStats stats;
+    scrubber_get_stats(state->scrubber, &stats);
+    INFO_MSG("[ANTI_TAMPERING_DESTROY] Scrubber: %zu passes, %zu files "
+             "verified, %zu mismatches, %zu skipped, %zu failed",
+             stats.passes, stats.verified, stats.mismatches, stats.unprotected,
+             stats.failed);
+    scrubber_destroy(state->scrubber);
+  }
+
+  // Publish the pending hashes before the layers go away
+  if (state->async_commit) {
+    AsyncCommitStats stats;
+    async_commit_flush(state->async_commit);
+    async_commit_get_stats(state->async_commit, &stats);
+    INFO_MSG("[ANTI_TAMPERING_DESTROY] Async commits: %zu committed, %zu "
+             "failed, %zu coalesced, max queue depth %zu, mean lag %.3f ms, "
+             "max lag %.3f ms",
+             stats.committed, stats.failed, stats.coalesced,
+             stats.max_queue_depth,
+             stats.committed ? stats.total_lag_ms / (double)stats.committed
+                             : 0.0,
+             stats.max_lag_ms);
+    async_commit_destroy(state->async_commit);
+  }
+
+  // Remove and move the pending hash files before the layers go away
+  if (state->hash_reaper) {
+    HashReaperStats stats;
+    hash_reaper_flush(state->hash_reaper);
+    hash_reaper_get_stats(state->hash_reaper, &stats);
+    INFO_MSG("[ANTI_TAMPERING_DESTROY] Hash reaper: %zu removals, %zu moves, "
+             "%zu claimed, %zu replayed, %zu failed, %zu batches, max queue "
+             "depth %zu, max lag %.3f ms",
+             stats.removals, stats.moves, stats.claimed, stats.replayed,
+             stats.failed, stats.batches, stats.max_queue_depth,
+             stats.max_lag_ms);
+    hash_reaper_destroy(state->hash_reaper);
+  }
+
+  // Write the buffered hashes as a last manifest, which clears their paths
+  // in the dirty journal
+  if (state->dirty_journal) {
+    DirtyJournalStats stats;
+    hash_manifest_flush(state->hash_manifest);
+    dirty_journal_get_stats(state->dirty_journal, &stats);
+    INFO_MSG("[ANTI_TAMPERING_DESTROY] Dirty journal: %zu marked, %zu "
+             "cleared, %zu replayed, %zu syncs",
+             stats.marked, stats.cleared, stats.replayed, stats.syncs);
+    dirty_journal_destroy(state->dirty_journal);
+  }
+  hash_manifest_destroy(state->hash_manifest);
+
+  // Write the cached block digests of the fds still open, while their hash
+  // fds are known
+  block_anti_tampering_destroy(state);
+
   // Free all mappings
-  for (int i = 0; i < MAX_FDS; i++) {
-    free_file_mapping(&state->mappings[i]);
+  for (int i = 0; i < fd_table_end(&state->mappings); i++) {
+    free_file_mapping(anti_tampering_mapping(state, i));
   }
+  fd_table_destroy(&state->mappings);
+  group_commit_destroy(&state->fsyncs);
+  merkle_anti_tampering_destroy(state);
+  free(state->zero_block_digest);
+  for (int r = 0; r < state->nblock_size_rules; r++) {
+    free(state->block_size_rules[r].path_prefix);
+    free(state->block_size_rules[r].suffix);
+  }
+  free(state->block_size_rules);
+  verify_cache_destroy(state->verify_cache);
+  verified_blocks_destroy(state->verified);
 
   // Destroy the locking system
   if (state->lock_table) {
@@ -773,25 +1932,28 @@ void anti_tampering_destroy(LayerContext l) {
  */
 int anti_tampering_fstat(int fd, struct stat *stbuf, LayerContext l) {
   AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
-  if (!is_valid_anti_tampering_fd(fd)) {
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
     return INVALID_FD;
   }
 
   // Get the file descriptor from the mapping
-  int file_fd = state->mappings[fd].file_fd;
-  char *file_path = state->mappings[fd].file_path;
+  int file_fd = mapping->file_fd;
+  const char *file_path = mapping->file_path;
+  const LockKey *lock_key = &mapping->path->lock_key;
 
-  if (locking_acquire_read(state->lock_table, file_path) != 0) {
+  if (locking_acquire_read_key(state->lock_table, lock_key) != 0) {
     ERROR_MSG("[ANTI_TAMPERING_FSTAT] Failed to acquire read lock on file %s "
               "(fd=%d)",
               file_path, file_fd);
     return -1;
   }
 
-  state->data_layer.app_context = l.app_context;
-  int res = state->data_layer.ops->lfstat(fd, stbuf, state->data_layer);
+  int res = data_layer.ops->lfstat(fd, stbuf, data_layer);
 
-  locking_release(state->lock_table, file_path);
+  locking_release_key(state->lock_table, lock_key);
 
   return res;
 }
@@ -799,54 +1961,307 @@ int anti_tampering_fstat(int fd, struct stat *stbuf, LayerContext l) {
 int anti_tampering_lstat(const char *pathname, struct stat *stbuf,
                          LayerContext l) {
   AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
 
   if (locking_acquire_read(state->lock_table, pathname) != 0) {
     ERROR_MSG("[ANTI_TAMPERING_LSTAT] Failed to acquire read lock on file %s",
               pathname);
     return -1;
   }
-  state->data_layer.app_context = l.app_context;
-  int res = state->data_layer.ops->llstat(pathname, stbuf, state->data_layer);
+  int res = data_layer.ops->llstat(pathname, stbuf, data_layer);
   locking_release(state->lock_table, pathname);
   return res;
 }
 
+/**
+ * @brief O_DIRECT alignment of the anti-tampering layer
+ *
+ * Data requests reach the data layer with the caller's buffers, offsets and
+ * sizes, so they need the alignment of the data layer. Hash files are never
+ * opened with O_DIRECT.
+ *
+ * @param l       -> context of the anti-tampering layer
+ * @return size_t -> alignment of the data layer
+ */
+size_t anti_tampering_direct_alignment(LayerContext l) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  return layer_direct_alignment(data_layer);
+}
+
+/**
+ * @brief Backing file of an fd, for files opened read-only that matched their
+ * hash at open (file mode), whose data are not checked again on reads
+ *
+ * @param fd   -> anti-tampering layer file descriptor
+ * @param l    -> context of the anti-tampering layer
+ * @return int -> backing file of the data layer fd, -1 if the file was not
+ * verified or the data layer has none
+ */
+int anti_tampering_backing_fd(int fd, LayerContext l) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping || !mapping->verified) {
+    return -1;
+  }
+  return layer_backing_fd(mapping->file_fd, data_layer);
+}
+
+/**
+ * @brief Integrity check of a file at rest, as the scrubber does it (file
+ * mode): the file is not left open, and any verify cache is not consulted
+ * but updated on a match
+ *
+ * Opens for writing are tracked by the scrubber: without scrub_root, a file
+ * being written through the layer may be reported as a mismatch.
+ *
+ * @param pathname -> path of the file
+ * @param l        -> context of the anti-tampering layer
+ * @return int -> LayerVerifyResult; LAYER_VERIFY_FAILED with errno ENOTSUP in
+ * block and merkle modes, whose blocks are only checked as they are read
+ */
+int anti_tampering_verify(const char *pathname, LayerContext l) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  if (state->mode != ANTI_TAMPERING_MODE_FILE) {
+    errno = ENOTSUP;
+    return LAYER_VERIFY_FAILED;
+  }
+  switch (verify_at_rest(state, pathname, l)) {
+  case SCRUB_VERIFIED:
+    return LAYER_VERIFY_OK;
+  case SCRUB_MISMATCH:
+    return LAYER_VERIFY_MISMATCH;
+  case SCRUB_UNPROTECTED:
+    return LAYER_VERIFY_UNPROTECTED;
+  default:
+    return LAYER_VERIFY_FAILED;
+  }
+}
+
 int anti_tampering_unlink(const char *pathname, LayerContext l) {
   AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
-  if (locking_acquire_write(state->lock_table, pathname) != 0) {
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, l.app_context);
+  InternedPath *path = intern_path(state, pathname);
+  if (!path) {
+    ERROR_MSG("[ANTI_TAMPERING_UNLINK] Failed to construct hash pathname of "
+              "file %s",
+              pathname);
+    return -1;
+  }
+
+  // a pending commit would publish the hash again after the unlink
+  async_commit_wait(state->async_commit, pathname);
+  if (locking_acquire_write_key(state->lock_table, &path->lock_key) != 0) {
     ERROR_MSG("[ANTI_TAMPERING_UNLINK] Failed to acquire write lock on file %s",
               pathname);
+    interned_path_unref(path);
     return -1;
   }
 
-  state->data_layer.app_context = l.app_context;
-  int res = state->data_layer.ops->lunlink(pathname, state->data_layer);
+  // the inode of the file could come back with the same watermark
+  struct stat stbuf;
+  if (state->metadata &&
+      data_layer.ops->llstat(pathname, &stbuf, data_layer) == 0) {
+    metadata_cache_invalidate(state->metadata, stbuf.st_dev, stbuf.st_ino);
+  }
+  int res = data_layer.ops->lunlink(pathname, data_layer);
+  verify_cache_invalidate(state->verify_cache, pathname);
+  verified_blocks_reset(state->verified, pathname);
   if (res == 0) {
+    // the fds still open on the file keep its digests to themselves
+    block_anti_tampering_forget(state, pathname);
+
     // remove the hash file
-    // construct the hash file path, from the file path
-    char *file_path_hex_hash =
-        state->hasher.hash_buffer_hex(pathname, strlen(pathname));
-    if (!file_path_hex_hash) {
-      ERROR_MSG("[ANTI_TAMPERING_UNLINK] Failed to get hex hash of file %s",
-                pathname);
-      return -1;
+    const char *hash_pathname = path->hash_path;
+    if (state->hash_manifest) {
+      // tombstone the manifest record; a hash file may predate batching
+      res = hash_manifest_remove(state->hash_manifest, hash_pathname);
     }
+    if (hash_reaper_remove(state->hash_reaper, hash_pathname) == 0) {
+      // removed in the background; the next open of the path claims it
+    } else if (state->hash_manifest) {
+      (void)hash_layer.ops->lunlink(hash_pathname, hash_layer);
+    } else {
+      res = hash_layer.ops->lunlink(hash_pathname, hash_layer);
+    }
+  }
+  locking_release_key(state->lock_table, &path->lock_key);
+  interned_path_unref(path);
+  return res;
+}
 
-    // construct the hash file path, from the file path hash
-    char *hash_pathname = construct_hash_pathname(state, file_path_hex_hash);
-    if (!hash_pathname) {
-      ERROR_MSG("[ANTI_TAMPERING] Failed to construct hash pathname");
-      free(file_path_hex_hash);
+/**
+ * @brief Give the hash of a renamed file the new name: the manifest record,
+ * or else the hash files
+ *
+ * @param state       -> state of the layer
+ * @param from_hash   -> hash layer path of the old name
+ * @param to_hash     -> hash layer path of the new name
+ * @param app_context -> application context of the hash layer calls
+ * @return int -> 0, or -1 on error
+ */
+static int rename_hash(AntiTamperingState *state, const char *from_hash,
+                       const char *to_hash, void *app_context) {
+  if (state->hash_manifest) {
+    char value[HASHER_MAX_HEX_SIZE];
+    ssize_t len =
+        hash_manifest_get(state->hash_manifest, from_hash, value, sizeof(value));
+    if (len > 0) {
+      // the record moves; a hash file of the old name may predate batching
+      if (hash_manifest_put(state->hash_manifest, to_hash, value) != 0 ||
+          hash_manifest_remove(state->hash_manifest, from_hash) != 0) {
+        return -1;
+      }
+      if (hash_reaper_remove(state->hash_reaper, from_hash) != 0) {
+        (void)reap_hash_file(state, from_hash, NULL, app_context);
+      }
+      return 0;
+    }
+    // the hash file of the old name moves, over the record of the new one
+    if (hash_manifest_contains(state->hash_manifest, to_hash) &&
+        hash_manifest_remove(state->hash_manifest, to_hash) != 0) {
       return -1;
     }
+  }
+  if (hash_reaper_move(state->hash_reaper, from_hash, to_hash) == 0) {
+    return 0;
+  }
+  return reap_hash_files(state, from_hash, to_hash, app_context);
+}
 
-    res = state->hash_layer.ops->lunlink(hash_pathname, state->hash_layer);
-    free(hash_pathname);
+/**
+ * @brief rename anti-tampering layer - renames the file in the data layer and
+ * gives its hash the new name, in the background with async_cleanup
+ *
+ * Both paths are write locked. A file open under the old name is committed
+ * under it on close: files are not renamed while open for writing.
+ *
+ * @param from  -> path of the file
+ * @param to    -> new path of the file
+ * @param flags -> 0 or RENAME_NOREPLACE
+ * @param l     -> LayerContext for current layer
+ * @return int  -> result from the data layer, or -1 if the hash could not be
+ * renamed
+ */
+int anti_tampering_rename(const char *from, const char *to, unsigned int flags,
+                          LayerContext l) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  if (!data_layer.ops->lrename) {
+    errno = ENOSYS;
+    return -1;
   }
-  locking_release(state->lock_table, pathname);
+  if (flags & ~RENAME_NOREPLACE) {
+    // exchanging two files would exchange their hashes
+    errno = EINVAL;
+    return -1;
+  }
+
+  InternedPath *src = intern_path(state, from);
+  InternedPath *dst = src ? intern_path(state, to) : NULL;
+  if (!dst) {
+    ERROR_MSG("[ANTI_TAMPERING_RENAME] Failed to construct hash pathnames of "
+              "%s and %s",
+              from, to);
+    interned_path_unref(src);
+    return -1;
+  }
+  int same = strcmp(from, to) == 0;
+
+  // a pending commit would publish a hash under the old name after the move
+  async_commit_wait(state->async_commit, from);
+  async_commit_wait(state->async_commit, to);
+
+  // both paths, in a global order
+  InternedPath *first = strcmp(from, to) <= 0 ? src : dst;
+  InternedPath *second = first == src ? dst : src;
+  if (locking_acquire_write_key(state->lock_table, &first->lock_key) != 0) {
+    interned_path_unref(src);
+    interned_path_unref(dst);
+    return -1;
+  }
+  if (!same &&
+      locking_acquire_write_key(state->lock_table, &second->lock_key) != 0) {
+    locking_release_key(state->lock_table, &first->lock_key);
+    interned_path_unref(src);
+    interned_path_unref(dst);
+    return -1;
+  }
+
+  // the inode of the replaced file could come back with the same watermark
+  struct stat stbuf;
+  if (state->metadata && !same &&
+      data_layer.ops->llstat(to, &stbuf, data_layer) == 0) {
+    metadata_cache_invalidate(state->metadata, stbuf.st_dev, stbuf.st_ino);
+  }
+  int res = data_layer.ops->lrename(from, to, flags, data_layer);
+  if (res == 0 && !same) {
+    verify_cache_invalidate(state->verify_cache, from);
+    verify_cache_invalidate(state->verify_cache, to);
+    verified_blocks_reset(state->verified, from);
+    verified_blocks_reset(state->verified, to);
+    block_anti_tampering_forget(state, from);
+    block_anti_tampering_forget(state, to);
+    if (rename_hash(state, src->hash_path, dst->hash_path, l.app_context) !=
+        0) {
+      ERROR_MSG("[ANTI_TAMPERING_RENAME] Failed to rename the hash of %s to "
+                "%s",
+                from, to);
+      res = -1;
+    }
+  }
+
+  if (!same) {
+    locking_release_key(state->lock_table, &second->lock_key);
+  }
+  locking_release_key(state->lock_table, &first->lock_key);
+  interned_path_unref(src);
+  interned_path_unref(dst);
   return res;
 }
 
+/**
+ * @brief Queue depth and commit lag metrics of the async committer
+ *
+ * @param l     -> LayerContext of the anti-tampering layer
+ * @param stats -> output, all zero when async commit is disabled
+ */
+void anti_tampering_async_commit_stats(LayerContext l,
+                                       AsyncCommitStats *stats) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  async_commit_get_stats(state ? state->async_commit : NULL, stats);
+}
+
+/**
+ * @brief Pass and file counters of the scrubber
+ *
+ * @param l     -> LayerContext of the anti-tampering layer
+ * @param stats -> output, all zero when the scrubber is disabled
+ */
+void anti_tampering_scrub_stats(LayerContext l, ScrubberStats *stats) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  scrubber_get_stats(state ? state->scrubber : NULL, stats);
+}
+
+/**
+ * @brief Queue depth and lag metrics of the hash reaper
+ *
+ * @param l     -> LayerContext of the anti-tampering layer
+ * @param stats -> output, all zero when async cleanup is disabled
+ */
+void anti_tampering_hash_reaper_stats(LayerContext l, HashReaperStats *stats) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  hash_reaper_get_stats(state ? state->hash_reaper : NULL, stats);
+}
+
 /**
  * @brief Construct the hash pathname from the file path hex hash
  *
@@ -2,29 +2,87 @@
 #define __ANTI_TAMPERING_H__
 
 #include "../../shared/types/layer_context.h"
+#include "../../shared/utils/buffer_pool.h"
+#include "../../shared/utils/fd_table.h"
+#include "../../shared/utils/group_commit.h"
 #include "../../shared/utils/hasher/hasher.h"
 #include "../../shared/utils/locking.h"
+#include "../../shared/utils/metadata_service.h"
+#include "async_commit.h"
 #include "config.h"
+#include "dirty_journal.h"
+#include "hash_manifest.h"
+#include "hash_reaper.h"
+#include "scrubber.h"
+#include <pthread.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-#define MAX_FDS 1000000 // TODO: This number should be dynamic and configurable
+struct MerkleFile;     // per-path chunk digest tree (merkle mode only)
+struct BlockDigests;   // per-path cached block digests (block mode only)
+struct VerifyCache;    // verify-on-open cache (file mode only)
+struct VerifiedBlocks; // blocks verified since their last write (block mode)
+struct CopiedHash;     // stored hash of the source of a copy (file mode)
+
+// Path of an open file, hashed once on open and shared by reference
+typedef struct InternedPath {
+  int refs;              // atomic, freed with the last reference
+  LockKey lock_key;      // lock table key of file_path
+  const char *hash_path; // hash layer path of the file hash
+  char file_path[];      // data layer path
+} InternedPath;
 
 typedef struct {
   int file_fd;
-  char *file_path;
-  char *hash_path;
+  InternedPath *path;          // paths of the open file, NULL when closed
+  const char *file_path;       // path->file_path
+  const char *hash_path;       // path->hash_path
+  int hash_fd;                 // hash layer fd kept open by block mode
+  struct MerkleFile *merkle;   // shared by all fds of the path, merkle mode
+  struct BlockDigests *blocks; // shared by all fds of the path, block mode
+  int verified; // file mode: opened read-only and matched its hash at open
+  int writer;   // file mode: busy for the scrubber until its hash is committed
+  int journaled; // file mode: marked dirty in the dirty journal
+  dev_t device; // file mode: data layer file, stat'ed on open with a verify
+  ino_t inode;  // cache (0 otherwise)
+  struct CopiedHash *copied; // file mode: hash of the copy made to it, or NULL
+  size_t block_size;         // block mode: from the hash file header
 } FileMapping;
 
 typedef struct {
-  Hasher hasher;                 // hasher instance for computing hashes
-  LayerContext hash_layer;       // hash layer where the hash will be stored
-  LayerContext data_layer;       // data layer where the data is stored
-  FileMapping mappings[MAX_FDS]; // centralized mapping
-  char *hash_prefix;             // prefix for the hash path
-  LockTable *lock_table;         // path-based reader-writer lock table
-  anti_tampering_mode_t mode;    // file or block mode
-  size_t block_size;             // only meaningful for block mode
+  Hasher hasher;                    // hasher instance for computing hashes
+  LayerContext hash_layer;          // hash layer where the hash will be stored
+  LayerContext data_layer;          // data layer where the data is stored
+  FdTable mappings;                 // FileMapping of each fd
+  char *hash_prefix;                // prefix for the hash path
+  size_t hash_fanout;               // directory levels under hash_prefix
+  LockTable *lock_table;            // path-based reader-writer lock table
+  anti_tampering_mode_t mode;       // file, block or merkle mode
+  size_t block_size;                // block size, or chunk size in merkle mode
+  struct MerkleFile *merkle_files;  // digest trees of open files (merkle mode)
+  pthread_mutex_t merkle_mutex;     // protects merkle_files membership
+  uint8_t *zero_block_digest;       // of a block (chunk) of zeroes, or NULL
+  struct BlockDigests *block_files; // cached digests of open files, or NULL
+  pthread_mutex_t block_mutex;      // protects block_files membership
+  int digest_cache;                 // block mode: cache the digests of files
+  struct VerifyCache *verify_cache; // skips unchanged files on open, or NULL
+  struct VerifiedBlocks *verified;  // skips verified blocks on read, or NULL
+  size_t hash_threads;              // threads hashing merkle chunks, 0/1: off
+  ThreadPool *hash_pool;            // workers of hash_threads, or NULL
+  MetadataCache *metadata;          // verifications shared by layers, or NULL
+  int hash_prefetch;                // file mode: read the hash while hashing
+  AsyncCommitter *async_commit;     // hashes closed files, or NULL
+  HashManifest *hash_manifest;      // batches file-mode hashes, or NULL
+  DirtyJournal *dirty_journal;      // files with a stale hash, or NULL
+  HashReaper *hash_reaper;          // removes and moves hashes, or NULL
+  Scrubber *scrubber;               // verifies files at rest, or NULL
+  BufferPool *buffers;              // scratch digests (buffer_pool_shared())
+  GroupCommit fsyncs;               // concurrent fsyncs of a path
+
+  // Block mode: rules choosing the block size of new files by their path,
+  // those of no rule get block_size
+  AntiTamperingBlockSizeRule *block_size_rules;
+  int nblock_size_rules;
 } AntiTamperingState;
 
 LayerContext anti_tampering_init(LayerContext data_layer,
@@ -38,11 +96,23 @@ ssize_t anti_tampering_read(int fd, void *buffer, size_t nbyte, off_t offset,
 int anti_tampering_open(const char *pathname, int flags, __mode_t mode,
                         LayerContext l);
 int anti_tampering_close(int fd, LayerContext l);
+int anti_tampering_fsync(int fd, int isdatasync, LayerContext l);
 void anti_tampering_destroy(LayerContext l);
 int anti_tampering_ftruncate(int fd, off_t length, LayerContext l);
+ssize_t anti_tampering_copy_file_range(int fd_in, off_t offset_in, int fd_out,
+                                       off_t offset_out, size_t len,
+                                       unsigned int flags, LayerContext l);
 int anti_tampering_fstat(int fd, struct stat *stbuf, LayerContext l);
 int anti_tampering_lstat(const char *pathname, struct stat *stbuf,
                          LayerContext l);
 int anti_tampering_unlink(const char *pathname, LayerContext l);
+int anti_tampering_rename(const char *from, const char *to, unsigned int flags,
+                          LayerContext l);
+size_t anti_tampering_direct_alignment(LayerContext l);
+int anti_tampering_backing_fd(int fd, LayerContext l);
+int anti_tampering_verify(const char *pathname, LayerContext l);
+void anti_tampering_async_commit_stats(LayerContext l, AsyncCommitStats *stats);
+void anti_tampering_scrub_stats(LayerContext l, ScrubberStats *stats);
+void anti_tampering_hash_reaper_stats(LayerContext l, HashReaperStats *stats);
 
 #endif
@@ -1,34 +1,164 @@
 #include "anti_tampering_utils.h"
+#include "../../shared/utils/metrics.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define INVALID_FD (-1)
+#define HASH_BLOCKS_BATCH 64 // blocks handed to the hasher per call
 
 /**
- * @brief Check if a file descriptor is valid for the limit of MAX_FDS
+ * @brief Mapping of an open file descriptor
  *
- * @param fd File descriptor to check
- * @return int 1 if valid, 0 otherwise
+ * @param state AntiTamperingState (may be NULL)
+ * @param fd File descriptor of the layer
+ * @return FileMapping* Mapping of fd, or NULL if fd is not open
  */
-int is_valid_anti_tampering_fd(int fd) { return (fd >= 0 && fd < MAX_FDS); }
+FileMapping *anti_tampering_mapping(AntiTamperingState *state, int fd) {
+  FileMapping *mapping = state ? fd_table_get(&state->mappings, fd) : NULL;
+  return mapping && mapping->path ? mapping : NULL;
+}
+
+/**
+ * @brief Set a FileMapping to an unused mapping (fd table entry initializer)
+ *
+ * @param mapping Pointer to the FileMapping to set
+ */
+void init_file_mapping(void *mapping) {
+  FileMapping *file_mapping = mapping;
+  file_mapping->file_fd = INVALID_FD;
+  file_mapping->path = NULL;
+  file_mapping->file_path = NULL;
+  file_mapping->hash_path = NULL;
+  file_mapping->hash_fd = INVALID_FD;
+  file_mapping->merkle = NULL;
+  file_mapping->blocks = NULL;
+  file_mapping->verified = 0;
+  file_mapping->writer = 0;
+  file_mapping->journaled = 0;
+  file_mapping->device = 0;
+  file_mapping->inode = 0;
+  file_mapping->copied = NULL;
+  file_mapping->block_size = 0;
+}
 
 /**
- * @brief Free the memory allocated for a FileMapping's file_path and hash_path
+ * @brief Drop the paths of a FileMapping and set it to an unused mapping
  *
  * @param mapping Pointer to the FileMapping to free
  */
 void free_file_mapping(FileMapping *mapping) {
   if (mapping) {
-    free(mapping->file_path);
-    free(mapping->hash_path);
+    interned_path_unref(mapping->path);
+    free(mapping->copied);
+    init_file_mapping(mapping);
+  }
+}
+
+/**
+ * @brief Point a FileMapping at the paths of its open file
+ *
+ * @param mapping Pointer to the FileMapping to set
+ * @param path Paths of the file, whose reference the mapping takes over
+ */
+void set_file_mapping_path(FileMapping *mapping, InternedPath *path) {
+  mapping->path = path;
+  mapping->file_path = path->file_path;
+  mapping->hash_path = path->hash_path;
+}
+
+/**
+ * @brief Size of the hash pathname of a file path hex hash, with its
+ * terminator
+ */
+static size_t hash_pathname_size(const AntiTamperingState *state,
+                                 const char *file_path_hex_hash) {
+  // "/" and ".hash\0", and "/xx" per fan-out level
+  return strlen(state->hash_prefix) + strlen(file_path_hex_hash) + 7 +
+         (3 * state->hash_fanout);
+}
+
+/**
+ * @brief Write the hash pathname of a file path hex hash:
+ * "<prefix>/<hash>.hash" or, with a fan-out, "<prefix>/ab/cd/<hash>.hash"
+ * where ab and cd are the first hex characters of the hash
+ */
+static void format_hash_pathname(const AntiTamperingState *state,
+                                 const char *file_path_hex_hash, char *out,
+                                 size_t out_size) {
+  size_t off = (size_t)snprintf(out, out_size, "%s", state->hash_prefix);
+  for (size_t level = 0; level < state->hash_fanout && off < out_size;
+       level++) {
+    off += (size_t)snprintf(out + off, out_size - off, "/%.2s",
+                            file_path_hex_hash + (2 * level));
+  }
+  if (off < out_size) {
+    (void)snprintf(out + off, out_size - off, "/%s.hash", file_path_hex_hash);
+  }
+}
+
+/**
+ * @brief Intern the path of a file: hash it once for the lock table and
+ * derive its hash layer path, in a single allocation
+ *
+ * @param state AntiTamperingState containing the hasher and hash_prefix
+ * @param file_path Data layer path of the file
+ * @return InternedPath* Path with one reference, or NULL on error
+ */
+InternedPath *intern_path(const AntiTamperingState *state,
+                          const char *file_path) {
+  if (!state || !file_path) {
+    return NULL;
+  }
+
+  char file_path_hex_hash[HASHER_MAX_HEX_SIZE];
+  if (state->hasher.hash_buffer_hex_into(file_path, strlen(file_path),
+                                         file_path_hex_hash,
+                                         sizeof(file_path_hex_hash)) < 0) {
+    return NULL;
+  }
+
+  size_t file_path_size = strlen(file_path) + 1;
+  size_t hash_path_size = hash_pathname_size(state, file_path_hex_hash);
+  InternedPath *path =
+      malloc(sizeof(InternedPath) + file_path_size + hash_path_size);
+  if (!path) {
+    return NULL;
+  }
+
+  memcpy(path->file_path, file_path, file_path_size);
+  char *hash_path = path->file_path + file_path_size;
+  format_hash_pathname(state, file_path_hex_hash, hash_path, hash_path_size);
+  path->hash_path = hash_path;
+  locking_key_init(&path->lock_key, path->file_path);
+  path->refs = 1;
+  return path;
+}
+
+/**
+ * @brief Take a reference on an interned path
+ *
+ * @param path Interned path
+ * @return InternedPath* path
+ */
+InternedPath *interned_path_ref(InternedPath *path) {
+  __atomic_add_fetch(&path->refs, 1, __ATOMIC_RELAXED);
+  return path;
+}
 
-    mapping->file_fd = INVALID_FD;
-    mapping->file_path = NULL;
-    mapping->hash_path = NULL;
+/**
+ * @brief Drop a reference on an interned path, freeing it with the last one
+ *
+ * @param path Interned path (may be NULL)
+ */
+void interned_path_unref(InternedPath *path) {
+  if (path && __atomic_sub_fetch(&path->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(path);
   }
 }
 
@@ -45,106 +175,189 @@ char *construct_hash_pathname(const AntiTamperingState *state,
     return NULL;
   }
 
-  size_t path_len = strlen(state->hash_prefix) + strlen(file_path_hex_hash) +
-                    7; // +6 for ".hash\0" + 1 for "/"
+  size_t path_len = hash_pathname_size(state, file_path_hex_hash);
   char *hash_pathname = malloc(path_len);
   if (!hash_pathname) {
     return NULL;
   }
 
-  (void)sprintf(hash_pathname, "%s/%s.hash", state->hash_prefix,
-                file_path_hex_hash);
+  format_hash_pathname(state, file_path_hex_hash, hash_pathname, path_len);
   return hash_pathname;
 }
 
 /**
- * @brief Ensure a hash file exists by creating it if necessary
+ * @brief Open a hash file for reading and writing, creating it if necessary
  *
  * @param state AntiTamperingState containing hash_layer
  * @param path Path to the hash file
  * @param l LayerContext to pass to underlying layers
- * @return int 0 on success, -1 on error
+ * @return int hash layer file descriptor, or -1 on error
  */
-int ensure_hash_file_exists(AntiTamperingState *state, const char *path,
-                            LayerContext l) {
+int open_hash_file(AntiTamperingState *state, const char *path,
+                   LayerContext l) {
   if (!state || !path) {
     errno = EINVAL;
     return -1;
   }
-  state->hash_layer.app_context = l.app_context;
-  int hash_fd = state->hash_layer.ops->lopen(path, O_RDWR | O_CREAT, 0644,
-                                             state->hash_layer);
-  if (hash_fd < 0) {
-    return -1;
+  return hash_layer_open(state, path, O_RDWR | O_CREAT, l.app_context);
+}
+
+/**
+ * @brief Create the fan-out directories of a hash path in the hash layer
+ *
+ * The hashes_storage directory itself must exist. Directories that exist
+ * already are skipped.
+ *
+ * @param state AntiTamperingState containing hash_layer and hash_fanout
+ * @param hash_path Hash layer path of a hash file (or of its chunk list)
+ * @param app_context Application context of the hash layer calls
+ * @return int 0, also when the hash layer has no directories to create, or
+ * -1 on error
+ */
+int make_hash_dirs(AntiTamperingState *state, const char *hash_path,
+                   void *app_context) {
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, app_context);
+  if (state->hash_fanout == 0 || !hash_layer.ops->lmkdir) {
+    return 0;
+  }
+  size_t prefix_len = strlen(state->hash_prefix);
+  size_t path_len = strlen(hash_path);
+  char dir[PATH_MAX];
+  for (size_t level = 1; level <= state->hash_fanout; level++) {
+    size_t dir_len = prefix_len + (3 * level); // "/xx" per level
+    if (dir_len >= path_len || dir_len >= sizeof(dir)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    memcpy(dir, hash_path, dir_len);
+    dir[dir_len] = '\0';
+    if (hash_layer.ops->lmkdir(dir, 0755, hash_layer) != 0) {
+      if (errno == ENOSYS) {
+        return 0;
+      }
+      if (errno != EEXIST) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief lopen of the hash layer that, creating a hash file under a fan-out
+ * directory that does not exist yet, creates the directory and opens again
+ *
+ * @param state AntiTamperingState containing hash_layer
+ * @param path Path to the hash file
+ * @param flags Open flags
+ * @param app_context Application context of the hash layer calls
+ * @return int hash layer file descriptor, or -1 on error
+ */
+int hash_layer_open(AntiTamperingState *state, const char *path, int flags,
+                    void *app_context) {
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, app_context);
+  int fd = hash_layer.ops->lopen(path, flags, 0644, hash_layer);
+  if (fd < 0 && errno == ENOENT && (flags & O_CREAT) &&
+      state->hash_fanout > 0 && make_hash_dirs(state, path, app_context) == 0) {
+    fd = hash_layer.ops->lopen(path, flags, 0644, hash_layer);
   }
-  return state->hash_layer.ops->lclose(hash_fd, state->hash_layer);
+  return fd;
+}
+
+// Whether a block only holds zeroes
+static int is_zero_block(const uint8_t *block, size_t size) {
+  return block[0] == 0 && memcmp(block, block + 1, size - 1) == 0;
 }
 
 /**
- * @brief Allocate buffer and hash multiple blocks into it.
+ * @brief Hash consecutive blocks of a buffer into a caller provided buffer.
+ *
+ * Whole blocks of zeroes (e.g. the holes of sparse files) get zero_digest
+ * without being hashed: checking a block for zeroes costs far less than
+ * hashing it, and gives up at the first byte of data.
  *
  * @param buffer Source buffer containing the data blocks
  * @param buffer_size Total size of the buffer in bytes
- * @param block_size Size of each full block in bytes
+ * @param block_size Size of each full block in bytes (last one may be partial)
  * @param hasher Hasher instance
- * @param out_hex_chars Output: number of hex characters per hash
- * @param out_concat_len Output: total length of allocated buffer
- * @return Allocated and hashed buffer on success, NULL on error (errno is set)
+ * @param zero_digest Digest of a whole block of zeroes, or NULL to hash them
+ * @param out Output: one binary digest per block, back to back
+ * @param out_size Size of out, at least num_blocks * get_hash_size() bytes
+ * @return Number of blocks hashed on success, -1 on error (errno is set)
  */
-char *hash_blocks_to_hex(const void *buffer, size_t buffer_size,
-                         size_t block_size, const Hasher *hasher,
-                         size_t *out_hex_chars, size_t *out_concat_len) {
-  if (!buffer || !hasher || !hasher->hash_buffer_hex || !hasher->get_hex_size ||
-      buffer_size == 0 || block_size == 0 || !out_hex_chars ||
-      !out_concat_len) {
+ssize_t hash_blocks_to_binary(const void *buffer, size_t buffer_size,
+                              size_t block_size, const Hasher *hasher,
+                              const uint8_t *zero_digest, uint8_t *out,
+                              size_t out_size) {
+  if (!buffer || !hasher || !hasher->hash_blocks_binary ||
+      !hasher->get_hash_size || buffer_size == 0 || block_size == 0 || !out) {
     errno = EINVAL;
-    return NULL;
+    return -1;
   }
 
   // Calculate number of blocks (including partial last block)
   const size_t num_blocks = (buffer_size + block_size - 1) / block_size;
-
-  // Calculate hex parameters
-  const size_t hex_size = hasher->get_hex_size();
-  if (hex_size < 2) {
+  const size_t digest_size = hasher->get_hash_size();
+  if (out_size < num_blocks * digest_size) {
     errno = EINVAL;
-    return NULL;
+    return -1;
   }
-  *out_hex_chars = hex_size - 1;
-  *out_concat_len = num_blocks * (*out_hex_chars);
 
-  // Allocate destination buffer
-  char *dest = malloc(*out_concat_len);
-  if (!dest) {
-    errno = ENOMEM;
-    return NULL;
-  }
+  // Hash batches of consecutive blocks with data straight into their slots
+  // of the output buffer
+  const void *blocks[HASH_BLOCKS_BATCH];
+  size_t sizes[HASH_BLOCKS_BATCH];
+  size_t first = 0; // first block of the batch
+  size_t batch = 0; // blocks in the batch
+  for (size_t idx = 0; idx <= num_blocks; idx++) {
+    const uint8_t *block = NULL;
+    size_t size = 0;
+    int zero = 0;
+    if (idx < num_blocks) {
+      const size_t offset = idx * block_size;
+      block = (const uint8_t *)buffer + offset;
+      // Last block (which can also be the first) may be partial
+      size = offset + block_size <= buffer_size ? block_size
+                                                : buffer_size - offset;
+      zero = zero_digest && size == block_size && is_zero_block(block, size);
+    }
 
-  // Hash each block and concatenate hex strings
-  for (size_t i = 0; i < num_blocks; i++) {
-    const size_t offset = i * block_size;
-    const void *blk = (const uint8_t *)buffer + offset;
-
-    // Last block (which can also be the first if there's only one) may be
-    // partial
-    size_t blk_size;
-    if (offset + block_size <= buffer_size) {
-      // Full block
-      blk_size = block_size;
-    } else {
-      // Partial last block
-      blk_size = buffer_size - offset;
+    if (batch > 0 &&
+        (idx == num_blocks || zero || batch == HASH_BLOCKS_BATCH)) {
+      if (hasher->hash_blocks_binary(blocks, sizes, batch,
+                                     out + (first * digest_size),
+                                     batch * digest_size) != (int)batch) {
+        errno = EIO;
+        return -1;
+      }
+      batch = 0;
+    }
+    if (idx == num_blocks) {
+      break;
     }
 
-    char *hex = hasher->hash_buffer_hex(blk, blk_size);
-    if (!hex) {
-      free(dest);
-      errno = EIO;
-      return NULL;
+    if (zero) {
+      memcpy(out + (idx * digest_size), zero_digest, digest_size);
+      continue;
     }
-    memcpy(dest + (i * (*out_hex_chars)), hex, *out_hex_chars);
-    free(hex);
+    if (batch == 0) {
+      first = idx;
+    }
+    blocks[batch] = block;
+    sizes[batch] = size;
+    batch++;
   }
 
-  return dest;
+  return (ssize_t)num_blocks;
+}
+
+/**
+ * @brief Count a hash mismatch in tg_anti_tampering_mismatches_total
+ */
+void count_hash_mismatch(void) {
+  metrics_count("tg_anti_tampering_mismatches_total",
+                "Files, chunks or blocks that did not match their stored hash",
+                1);
 }
@@ -5,23 +5,38 @@
 #include "../../shared/utils/hasher/hasher.h"
 #include "anti_tampering.h"
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 
-// FD validation
-int is_valid_anti_tampering_fd(int fd);
-
-// File mapping utilities
+// FD mappings
+FileMapping *anti_tampering_mapping(AntiTamperingState *state, int fd);
+void init_file_mapping(void *mapping);
 void free_file_mapping(FileMapping *mapping);
+void set_file_mapping_path(FileMapping *mapping, InternedPath *path);
 char *construct_hash_pathname(const AntiTamperingState *state,
                               const char *file_path_hex_hash);
 
+// Interned paths: the file path and its hash path, hashed once on open
+InternedPath *intern_path(const AntiTamperingState *state,
+                          const char *file_path);
+InternedPath *interned_path_ref(InternedPath *path);
+void interned_path_unref(InternedPath *path);
+
 // Hash file utilities
-int ensure_hash_file_exists(AntiTamperingState *state, const char *path,
-                            LayerContext l);
+int open_hash_file(AntiTamperingState *state, const char *path,
+                   LayerContext l);
+int hash_layer_open(AntiTamperingState *state, const char *path, int flags,
+                    void *app_context);
+int make_hash_dirs(AntiTamperingState *state, const char *hash_path,
+                   void *app_context);
 
 // Block hashing utilities (for block mode)
-char *hash_blocks_to_hex(const void *buffer, size_t buffer_size,
-                         size_t block_size, const Hasher *hasher,
-                         size_t *out_hex_chars, size_t *out_concat_len);
+ssize_t hash_blocks_to_binary(const void *buffer, size_t buffer_size,
+                              size_t block_size, const Hasher *hasher,
+                              const uint8_t *zero_digest, uint8_t *out,
+                              size_t out_size);
+
+// Metrics: counts a file, chunk or block that doesn't match its stored hash
+void count_hash_mismatch(void);
 
 #endif // __ANTI_TAMPERING_UTILS_H__
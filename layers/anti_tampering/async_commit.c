@@ -0,0 +1,332 @@
+#include "async_commit.h"
+
+#include "../../logdef.h"
+#include <stdlib.h>
+#include <string.h>
+
+static inline double elapsed_ms(const struct timespec *from,
+                                const struct timespec *to) {
+  return ((double)(to->tv_sec - from->tv_sec) * 1000.0) +
+         ((double)(to->tv_nsec - from->tv_nsec) / 1e6);
+}
+
+static void free_entry(AsyncCommitter *committer, AsyncCommitEntry *entry) {
+  memory_budget_release(committer->memory, entry->bytes);
+  free(entry->file_path);
+  free(entry->hash_path);
+  free(entry);
+}
+
+/**
+ * @brief Append an entry to the commit order (mutex held)
+ */
+static void push_entry(AsyncCommitter *committer, AsyncCommitEntry *entry) {
+  entry->next = NULL;
+  if (committer->tail) {
+    committer->tail->next = entry;
+  } else {
+    committer->head = entry;
+  }
+  committer->tail = entry;
+}
+
+/**
+ * @brief Take the next entry to commit (mutex held)
+ */
+static AsyncCommitEntry *pop_entry(AsyncCommitter *committer) {
+  AsyncCommitEntry *entry = committer->head;
+  if (entry) {
+    committer->head = entry->next;
+    if (!committer->head) {
+      committer->tail = NULL;
+    }
+    entry->next = NULL;
+  }
+  return entry;
+}
+
+/**
+ * @brief Committer thread: commits queued paths until stopped and drained
+ */
+static void *committer_worker(void *arg) {
+  AsyncCommitter *committer = arg;
+
+  pthread_mutex_lock(&committer->mutex);
+  for (;;) {
+    while (!committer->head && !committer->stopping) {
+      pthread_cond_wait(&committer->work, &committer->mutex);
+    }
+    AsyncCommitEntry *entry = pop_entry(committer);
+    if (!entry) {
+      break; // stopping and nothing left to commit
+    }
+    entry->running = 1;
+    const struct timespec queued = entry->queued;
+    pthread_mutex_unlock(&committer->mutex);
+
+    // the entry is not freed while running: paths stay valid unlocked
+    int res = committer->commit(committer->arg, entry->file_path,
+                                entry->hash_path);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&committer->mutex);
+    entry->running = 0;
+    AsyncCommitStats *stats = &committer->stats;
+    if (res < 0) {
+      stats->failed++;
+      ERROR_MSG("[ANTI_TAMPERING_ASYNC_COMMIT] Failed to commit hash of file "
+                "%s",
+                entry->file_path);
+    } else {
+      const double lag = elapsed_ms(&queued, &now);
+      stats->committed++;
+      stats->last_lag_ms = lag;
+      stats->total_lag_ms += lag;
+      if (lag > stats->max_lag_ms) {
+        stats->max_lag_ms = lag;
+      }
+    }
+
+    if (entry->again) {
+      // closed again while being hashed: the published hash may be stale
+      entry->again = 0;
+      entry->queued = entry->again_queued;
+      push_entry(committer, entry);
+    } else {
+      HASH_DEL(committer->pending, entry);
+      free_entry(committer, entry);
+      stats->queue_depth--;
+    }
+    pthread_cond_broadcast(&committer->done);
+  }
+  pthread_mutex_unlock(&committer->mutex);
+  return NULL;
+}
+
+/**
+ * @brief Create a committer and start its thread
+ *
+ * @param commit -> callback computing and publishing the hash of a path
+ * @param arg    -> argument passed to the callback
+ * @return AsyncCommitter* -> committer, or NULL on error
+ */
+AsyncCommitter *async_commit_init(async_commit_fn commit, void *arg) {
+  if (!commit) {
+    return NULL;
+  }
+  AsyncCommitter *committer = calloc(1, sizeof(AsyncCommitter));
+  if (!committer) {
+    return NULL;
+  }
+  committer->commit = commit;
+  committer->arg = arg;
+  committer->memory = memory_budget_account("async_commit");
+
+  if (pthread_mutex_init(&committer->mutex, NULL) != 0) {
+    free(committer);
+    return NULL;
+  }
+  if (pthread_cond_init(&committer->work, NULL) != 0) {
+    pthread_mutex_destroy(&committer->mutex);
+    free(committer);
+    return NULL;
+  }
+  if (pthread_cond_init(&committer->done, NULL) != 0) {
+    pthread_cond_destroy(&committer->work);
+    pthread_mutex_destroy(&committer->mutex);
+    free(committer);
+    return NULL;
+  }
+  if (pthread_create(&committer->worker, NULL, committer_worker, committer) !=
+      0) {
+    pthread_cond_destroy(&committer->done);
+    pthread_cond_destroy(&committer->work);
+    pthread_mutex_destroy(&committer->mutex);
+    free(committer);
+    return NULL;
+  }
+  return committer;
+}
+
+/**
+ * @brief Commit everything still pending, stop the thread and free the
+ * committer
+ *
+ * @param committer -> committer to destroy (may be NULL)
+ */
+void async_commit_destroy(AsyncCommitter *committer) {
+  if (!committer) {
+    return;
+  }
+  pthread_mutex_lock(&committer->mutex);
+  committer->stopping = 1;
+  pthread_cond_signal(&committer->work);
+  pthread_mutex_unlock(&committer->mutex);
+  pthread_join(committer->worker, NULL);
+
+  AsyncCommitEntry *entry, *tmp;
+  HASH_ITER(hh, committer->pending, entry, tmp) {
+    HASH_DEL(committer->pending, entry);
+    free_entry(committer, entry);
+  }
+  pthread_cond_destroy(&committer->done);
+  pthread_cond_destroy(&committer->work);
+  pthread_mutex_destroy(&committer->mutex);
+  free(committer);
+}
+
+/**
+ * @brief Schedule the hash commit of a closed file
+ *
+ * @param committer -> committer
+ * @param file_path -> data layer path of the file
+ * @param hash_path -> hash layer path of its hash
+ * @return int      -> 0 if the commit is pending, -1 on error (the caller
+ * must commit synchronously)
+ */
+int async_commit_enqueue(AsyncCommitter *committer, const char *file_path,
+                         const char *hash_path) {
+  if (!committer || !file_path || !hash_path) {
+    return -1;
+  }
+
+  // charged before the lock, as the committer releases under it; a close
+  // that is coalesced gives it back
+  const size_t bytes =
+      sizeof(AsyncCommitEntry) + strlen(file_path) + strlen(hash_path) + 2;
+  memory_budget_charge(committer->memory, bytes);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&committer->mutex);
+  if (committer->stopping) {
+    pthread_mutex_unlock(&committer->mutex);
+    memory_budget_release(committer->memory, bytes);
+    return -1;
+  }
+
+  AsyncCommitEntry *entry = NULL;
+  HASH_FIND(hh, committer->pending, file_path, strlen(file_path), entry);
+  if (entry) {
+    if (entry->running && !entry->again) {
+      entry->again = 1;
+      entry->again_queued = now;
+      committer->stats.enqueued++;
+    } else {
+      // the queued commit will hash the latest content
+      committer->stats.coalesced++;
+    }
+    pthread_mutex_unlock(&committer->mutex);
+    memory_budget_release(committer->memory, bytes);
+    return 0;
+  }
+
+  entry = calloc(1, sizeof(AsyncCommitEntry));
+  if (entry) {
+    entry->bytes = bytes;
+    entry->file_path = strdup(file_path);
+    entry->hash_path = strdup(hash_path);
+  }
+  if (!entry || !entry->file_path || !entry->hash_path) {
+    if (entry) {
+      free_entry(committer, entry);
+    } else {
+      memory_budget_release(committer->memory, bytes);
+    }
+    pthread_mutex_unlock(&committer->mutex);
+    return -1;
+  }
+  entry->queued = now;
+  HASH_ADD_KEYPTR(hh, committer->pending, entry->file_path,
+                  strlen(entry->file_path), entry);
+  push_entry(committer, entry);
+
+  AsyncCommitStats *stats = &committer->stats;
+  stats->enqueued++;
+  stats->queue_depth++;
+  if (stats->queue_depth > stats->max_queue_depth) {
+    stats->max_queue_depth = stats->queue_depth;
+  }
+  pthread_cond_signal(&committer->work);
+  pthread_mutex_unlock(&committer->mutex);
+  return 0;
+}
+
+/**
+ * @brief Wait until no commit of a path is pending
+ *
+ * Must not be called with the path lock held: the commit takes it.
+ *
+ * @param committer -> committer (NULL: no-op)
+ * @param file_path -> data layer path of the file
+ */
+void async_commit_wait(AsyncCommitter *committer, const char *file_path) {
+  if (!committer || !file_path) {
+    return;
+  }
+  pthread_mutex_lock(&committer->mutex);
+  AsyncCommitEntry *entry = NULL;
+  HASH_FIND(hh, committer->pending, file_path, strlen(file_path), entry);
+  while (entry) {
+    pthread_cond_wait(&committer->done, &committer->mutex);
+    HASH_FIND(hh, committer->pending, file_path, strlen(file_path), entry);
+  }
+  pthread_mutex_unlock(&committer->mutex);
+}
+
+/**
+ * @brief Check whether a commit of a path is queued or running
+ *
+ * @param committer -> committer (NULL: never pending)
+ * @param file_path -> data layer path of the file
+ * @return int      -> 1 if pending, 0 otherwise
+ */
+int async_commit_pending(AsyncCommitter *committer, const char *file_path) {
+  if (!committer || !file_path) {
+    return 0;
+  }
+  pthread_mutex_lock(&committer->mutex);
+  AsyncCommitEntry *entry = NULL;
+  HASH_FIND(hh, committer->pending, file_path, strlen(file_path), entry);
+  pthread_mutex_unlock(&committer->mutex);
+  return entry != NULL;
+}
+
+/**
+ * @brief Wait until every pending commit is done
+ *
+ * @param committer -> committer (NULL: no-op)
+ */
+void async_commit_flush(AsyncCommitter *committer) {
+  if (!committer) {
+    return;
+  }
+  pthread_mutex_lock(&committer->mutex);
+  while (committer->pending) {
+    pthread_cond_wait(&committer->done, &committer->mutex);
+  }
+  pthread_mutex_unlock(&committer->mutex);
+}
+
+/**
+ * @brief Snapshot of the queue depth and commit lag metrics
+ *
+ * @param committer -> committer (NULL: all zero)
+ * @param stats     -> output
+ */
+void async_commit_get_stats(AsyncCommitter *committer,
+                            AsyncCommitStats *stats) {
+  if (!stats) {
+    return;
+  }
+  if (!committer) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  pthread_mutex_lock(&committer->mutex);
+  *stats = committer->stats;
+  pthread_mutex_unlock(&committer->mutex);
+}
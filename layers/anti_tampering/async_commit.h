@@ -0,0 +1,91 @@
+#ifndef __ASYNC_COMMIT_H__
+#define __ASYNC_COMMIT_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include "../../shared/utils/memory_budget.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * ============================================================================
+ * ASYNC COMMIT - DEFERRED FILE-MODE HASH COMPUTATION ON CLOSE
+ * ============================================================================
+ *
+ * Closes hand the path of the file to a background committer thread, which
+ * rehashes the file and publishes its hash to the hash layer, so the caller
+ * does not wait for the rehash nor for a (possibly remote) hash layer write.
+ *
+ * - At most one commit is pending per path: closes of a path that is still
+ *   queued are coalesced into the queued commit, and a close while the path
+ *   is being committed schedules exactly one more commit after it.
+ * - Paths are committed in the order they were first closed.
+ * - Opening or unlinking a path waits only while a commit of that path is
+ *   pending, so verification always sees the hash of the last close.
+ * - Entries are charged to the "async_commit" memory account: with no room
+ *   left, a close that queues a new path waits for the committer to drain
+ *   some, so writers slow down to its pace.
+ * ============================================================================
+ */
+
+/**
+ * @brief Commit callback, run by the committer thread
+ *
+ * @param arg       -> argument given to async_commit_init
+ * @param file_path -> data layer path of the file to hash
+ * @param hash_path -> hash layer path where the hash is published
+ * @return int      -> 0 on success, negative on error
+ */
+typedef int (*async_commit_fn)(void *arg, const char *file_path,
+                               const char *hash_path);
+
+typedef struct AsyncCommitEntry {
+  char *file_path;               // key
+  char *hash_path;               // hash layer path of the file
+  int running;                   // being committed by the worker
+  int again;                     // closed again while running
+  struct timespec queued;        // monotonic time of the first pending close
+  struct timespec again_queued;  // monotonic time of the close while running
+  size_t bytes;                  // charged to the memory account
+  struct AsyncCommitEntry *next; // next entry in commit order
+  UT_hash_handle hh;
+} AsyncCommitEntry;
+
+typedef struct {
+  size_t queue_depth;     // paths queued or being committed
+  size_t max_queue_depth; // highest queue_depth seen
+  size_t enqueued;        // closes that scheduled a commit
+  size_t coalesced;       // closes merged into an already pending commit
+  size_t committed;       // commits that published a hash
+  size_t failed;          // commits that returned an error
+  double last_lag_ms;     // close to hash publication, last commit
+  double max_lag_ms;      // close to hash publication, worst commit
+  double total_lag_ms;    // sum over all commits, for the mean lag
+} AsyncCommitStats;
+
+typedef struct AsyncCommitter {
+  AsyncCommitEntry *pending; // pending commits by path
+  AsyncCommitEntry *head;    // next entry to commit (not running)
+  AsyncCommitEntry *tail;    // last entry to commit
+  async_commit_fn commit;    // commit callback
+  void *arg;                 // commit callback argument
+  AsyncCommitStats stats;    // queue depth and commit lag metrics
+  MemoryAccount *memory;     // account charged for the entries
+  int stopping;              // set by destroy, worker drains and exits
+  pthread_t worker;          // committer thread
+  pthread_mutex_t mutex;     // protects all the fields above
+  pthread_cond_t work;       // signalled when a commit is queued or on stop
+  pthread_cond_t done;       // broadcast when a commit finishes
+} AsyncCommitter;
+
+AsyncCommitter *async_commit_init(async_commit_fn commit, void *arg);
+void async_commit_destroy(AsyncCommitter *committer);
+int async_commit_enqueue(AsyncCommitter *committer, const char *file_path,
+                         const char *hash_path);
+void async_commit_wait(AsyncCommitter *committer, const char *file_path);
+int async_commit_pending(AsyncCommitter *committer, const char *file_path);
+void async_commit_flush(AsyncCommitter *committer);
+void async_commit_get_stats(AsyncCommitter *committer,
+                            AsyncCommitStats *stats);
+
+#endif // __ASYNC_COMMIT_H__
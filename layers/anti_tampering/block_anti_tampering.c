@@ -1,9 +1,13 @@
 #include "block_anti_tampering.h"
 
 #include "../../logdef.h"
+#include "../../shared/utils/conversion.h"
+#include "../../shared/utils/hasher/hasher_context.h"
 #include "anti_tampering.h"
 #include "anti_tampering_utils.h"
+#include "verified_blocks.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -11,6 +15,475 @@
 
 #define INVALID_FD (-1)
 
+/**
+ * @brief Offset of the digest of a block in the hash file
+ */
+static inline off_t block_hash_offset(size_t block_idx, size_t digest_size) {
+  return (off_t)sizeof(BlockHashesHeader) + (off_t)(block_idx * digest_size);
+}
+
+static void fill_block_hashes_header(const AntiTamperingState *state,
+                                     size_t block_size,
+                                     BlockHashesHeader *header) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, BLOCK_HASHES_MAGIC, sizeof(header->magic));
+  header->version = BLOCK_HASHES_VERSION;
+  header->algorithm = (uint32_t)state->hasher.algorithm;
+  header->digest_size = (uint32_t)state->hasher.get_hash_size();
+  header->block_size = block_size;
+}
+
+// Whether path is prefix or under it, by whole components
+static int path_under(const char *path, const char *prefix) {
+  size_t len = strlen(prefix);
+  while (len > 1 && prefix[len - 1] == '/') {
+    len--;
+  }
+  if (len == 1 && prefix[0] == '/') {
+    return path[0] == '/';
+  }
+  return strncmp(path, prefix, len) == 0 &&
+         (path[len] == '\0' || path[len] == '/');
+}
+
+/**
+ * @brief Block size of a new file: the one of the first block size rule its
+ * path matches, or the block_size of the layer
+ */
+static size_t block_size_for_path(const AntiTamperingState *state,
+                                  const char *file_path) {
+  const size_t path_len = strlen(file_path);
+  for (int r = 0; r < state->nblock_size_rules; r++) {
+    const AntiTamperingBlockSizeRule *rule = &state->block_size_rules[r];
+    if (rule->path_prefix && !path_under(file_path, rule->path_prefix)) {
+      continue;
+    }
+    if (rule->suffix) {
+      const size_t suffix_len = strlen(rule->suffix);
+      if (suffix_len > path_len ||
+          strcmp(file_path + path_len - suffix_len, rule->suffix) != 0) {
+        continue;
+      }
+    }
+    return rule->block_size;
+  }
+  return state->block_size;
+}
+
+/**
+ * @brief Digest of a whole block of zeroes of a file, NULL if its block size
+ * is not the one of the layer (its blocks of zeroes are then hashed)
+ */
+static const uint8_t *file_zero_digest(const AntiTamperingState *state,
+                                       const FileMapping *mapping) {
+  return mapping->block_size == state->block_size ? state->zero_block_digest
+                                                  : NULL;
+}
+
+/**
+ * @brief Rewrite a legacy hash file (one hex digest per block) in the binary
+ * format
+ *
+ * Blocks whose legacy digest is not valid hex (e.g. holes left by writes past
+ * the end) get a zero digest, which reports a mismatch on read just like
+ * before.
+ *
+ * @param state       -> AntiTamperingState
+ * @param hash_fd     -> hash layer fd of the legacy file
+ * @param hash_path   -> hash file path (for logging)
+ * @param legacy_size -> size of the legacy file in bytes
+ * @param app_context -> application context of the layer calls
+ * @return int        -> 0 on success, -1 on error
+ */
+static int migrate_hex_hash_file(AntiTamperingState *state, int hash_fd,
+                                 const char *hash_path, off_t legacy_size,
+                                 void *app_context) {
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, app_context);
+  const size_t ds = state->hasher.get_hash_size();
+  const size_t hex_chars = ds * 2;
+  const size_t num_blocks = (size_t)legacy_size / hex_chars;
+  if ((size_t)legacy_size % hex_chars != 0) {
+    WARN_MSG("[ANTI_TAMPERING_BLOCK_OPEN] Legacy hash file %s has a truncated "
+             "digest, ignoring its last %zu bytes",
+             hash_path, (size_t)legacy_size % hex_chars);
+  }
+
+  char *legacy = malloc((size_t)legacy_size);
+  const size_t out_len = sizeof(BlockHashesHeader) + (num_blocks * ds);
+  uint8_t *out = calloc(1, out_len);
+  if (!legacy || !out) {
+    free(legacy);
+    free(out);
+    return -1;
+  }
+
+  int result = -1;
+  ssize_t lr = hash_layer.ops->lpread(hash_fd, legacy, (size_t)legacy_size, 0,
+                                      hash_layer);
+  if (lr == (ssize_t)legacy_size) {
+    fill_block_hashes_header(state, state->block_size,
+                             (BlockHashesHeader *)out);
+    char hex[HASHER_MAX_HEX_SIZE];
+    for (size_t i = 0; i < num_blocks; i++) {
+      uint8_t *digest = out + block_hash_offset(i, ds);
+      memcpy(hex, legacy + (i * hex_chars), hex_chars);
+      hex[hex_chars] = '\0';
+      if (hex_to_bytes(hex, digest, ds) != ds) {
+        memset(digest, 0, ds);
+      }
+    }
+
+    ssize_t w = hash_layer.ops->lpwrite(hash_fd, out, out_len, 0, hash_layer);
+    if (w == (ssize_t)out_len &&
+        hash_layer.ops->lftruncate(hash_fd, (off_t)out_len, hash_layer) == 0) {
+      INFO_MSG("[ANTI_TAMPERING_BLOCK_OPEN] Converted legacy hash file %s (%zu "
+               "blocks) to the binary format",
+               hash_path, num_blocks);
+      result = 0;
+    }
+  }
+
+  free(legacy);
+  free(out);
+  return result;
+}
+
+/**
+ * @brief Check the header of an open hash file, writing it for new files and
+ * converting legacy hex files
+ *
+ * The block size of a file is chosen when its hash file is created, from the
+ * block size rules, and kept in the header: a file keeps it when the rules or
+ * the block_size of the layer change. Legacy files have the one of the layer.
+ * Must be called with the path write lock held.
+ *
+ * @param state       -> AntiTamperingState
+ * @param hash_fd     -> hash layer fd (read/write)
+ * @param hash_path   -> hash file path (for logging)
+ * @param file_path   -> data layer path of the file
+ * @param block_size  -> set to the block size of the file
+ * @param app_context -> application context of the layer calls
+ * @return int        -> 0 if the file is ready, -1 on error or if it was
+ * written with another algorithm
+ */
+static int prepare_block_hash_file(AntiTamperingState *state, int hash_fd,
+                                   const char *hash_path,
+                                   const char *file_path, size_t *block_size,
+                                   void *app_context) {
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, app_context);
+  BlockHashesHeader header;
+  ssize_t hr = hash_layer.ops->lpread(hash_fd, &header, sizeof(header), 0,
+                                      hash_layer);
+  if (hr == 0) {
+    // new hash file
+    BlockHashesHeader created;
+    *block_size = block_size_for_path(state, file_path);
+    fill_block_hashes_header(state, *block_size, &created);
+    ssize_t w = hash_layer.ops->lpwrite(hash_fd, &created, sizeof(created), 0,
+                                        hash_layer);
+    return w == (ssize_t)sizeof(created) ? 0 : -1;
+  }
+
+  if (hr == (ssize_t)sizeof(header) &&
+      memcmp(header.magic, BLOCK_HASHES_MAGIC, sizeof(header.magic)) == 0) {
+    BlockHashesHeader expected;
+    fill_block_hashes_header(state, (size_t)header.block_size, &expected);
+    if (header.block_size == 0 ||
+        memcmp(&header, &expected, sizeof(header)) != 0) {
+      ERROR_MSG("[ANTI_TAMPERING_BLOCK_OPEN] Hash file %s was written with "
+                "another configuration (version %u, algorithm %u, block size "
+                "%lu)",
+                hash_path, header.version, header.algorithm,
+                (unsigned long)header.block_size);
+      return -1;
+    }
+    *block_size = (size_t)header.block_size;
+    return 0;
+  }
+  if (hr < 0) {
+    return -1;
+  }
+  *block_size = state->block_size;
+
+  // no header: legacy hex format
+  struct stat stbuf;
+  if (hash_layer.ops->lfstat(hash_fd, &stbuf, hash_layer) != 0) {
+    return -1;
+  }
+  return migrate_hex_hash_file(state, hash_fd, hash_path, stbuf.st_size,
+                               app_context);
+}
+
+// LayerDigest callback: hash one block with the hasher of the layer
+static int hash_block_binary(const void *data, size_t size, void *digest,
+                             void *arg) {
+  const Hasher *hasher = arg;
+  return hasher->hash_buffer_binary(data, size, digest,
+                                    hasher->get_hash_size());
+}
+
+/**
+ * @brief Describe the digests of a request for a digesting data layer
+ *
+ * A data layer that sets lpread_digest/lpwrite_digest (e.g. encryption)
+ * hashes each block in the pass that transforms it, so the data is not read
+ * again to hash it here.
+ */
+static void fill_layer_digest(AntiTamperingState *state, size_t block_size,
+                              uint8_t *digests, LayerDigest *digest) {
+  digest->block_size = block_size;
+  digest->digest_size = state->hasher.get_hash_size();
+  digest->hash_block = hash_block_binary;
+  digest->arg = &state->hasher;
+  digest->digests = digests;
+}
+
+/**
+ * @brief Get (or create) the shared BlockDigests of a path and take a
+ * reference
+ *
+ * @param state      -> AntiTamperingState
+ * @param file_path  -> file path (key)
+ * @return BlockDigests* -> entry, or NULL on allocation error
+ */
+static BlockDigests *block_digests_acquire(AntiTamperingState *state,
+                                           const char *file_path) {
+  pthread_mutex_lock(&state->block_mutex);
+
+  BlockDigests *entry = NULL;
+  HASH_FIND(hh, state->block_files, file_path, strlen(file_path), entry);
+  if (!entry) {
+    entry = calloc(1, sizeof(BlockDigests));
+    if (!entry) {
+      pthread_mutex_unlock(&state->block_mutex);
+      return NULL;
+    }
+    entry->file_path = strdup(file_path);
+    if (!entry->file_path || pthread_mutex_init(&entry->mutex, NULL) != 0) {
+      free(entry->file_path);
+      free(entry);
+      pthread_mutex_unlock(&state->block_mutex);
+      return NULL;
+    }
+    HASH_ADD_KEYPTR(hh, state->block_files, entry->file_path,
+                    strlen(entry->file_path), entry);
+  }
+  entry->ref_count++;
+
+  pthread_mutex_unlock(&state->block_mutex);
+  return entry;
+}
+
+static void block_digests_free(BlockDigests *entry) {
+  pthread_mutex_destroy(&entry->mutex);
+  free(entry->digests);
+  free(entry->file_path);
+  free(entry);
+}
+
+/**
+ * @brief Drop a reference to a BlockDigests, freeing it with the last one
+ *
+ * @param state -> AntiTamperingState
+ * @param entry -> entry to release
+ */
+static void block_digests_release(AntiTamperingState *state,
+                                  BlockDigests *entry) {
+  if (!entry) {
+    return;
+  }
+  pthread_mutex_lock(&state->block_mutex);
+  if (--entry->ref_count <= 0) {
+    if (!entry->unlinked) {
+      HASH_DEL(state->block_files, entry);
+    }
+    block_digests_free(entry);
+  }
+  pthread_mutex_unlock(&state->block_mutex);
+}
+
+/**
+ * @brief Make room for the digests of blocks [0, n_blocks) (entry mutex held)
+ *
+ * @return int -> 0 on success, -1 on allocation error
+ */
+static int block_digests_reserve(BlockDigests *entry, size_t n_blocks,
+                                 size_t ds) {
+  if (n_blocks <= entry->capacity) {
+    return 0;
+  }
+  size_t capacity = entry->capacity > 0 ? entry->capacity : 64;
+  while (capacity < n_blocks) {
+    capacity *= 2;
+  }
+  uint8_t *digests = realloc(entry->digests, capacity * ds);
+  if (!digests) {
+    return -1;
+  }
+  entry->digests = digests;
+  entry->capacity = capacity;
+  return 0;
+}
+
+/**
+ * @brief Add blocks [first, end) to the dirty range (entry mutex held)
+ */
+static void block_digests_dirty(BlockDigests *entry, size_t first,
+                                size_t end) {
+  if (entry->dirty_first == entry->dirty_end) {
+    entry->dirty_first = first;
+    entry->dirty_end = end;
+    return;
+  }
+  if (first < entry->dirty_first) {
+    entry->dirty_first = first;
+  }
+  if (end > entry->dirty_end) {
+    entry->dirty_end = end;
+  }
+}
+
+/**
+ * @brief Read all the stored digests of a file in one request
+ *
+ * Must be called with the path write lock held, on a prepared hash file.
+ *
+ * @param state       -> AntiTamperingState
+ * @param entry       -> empty entry of the path
+ * @param hash_fd     -> hash layer fd
+ * @param app_context -> application context of the layer calls
+ * @return int        -> 0 on success, -1 on error
+ */
+static int block_digests_load(AntiTamperingState *state, BlockDigests *entry,
+                              int hash_fd, void *app_context) {
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, app_context);
+  const size_t ds = state->hasher.get_hash_size();
+  struct stat stbuf;
+  if (hash_layer.ops->lfstat(hash_fd, &stbuf, hash_layer) != 0) {
+    return -1;
+  }
+  size_t n_blocks = 0;
+  if (stbuf.st_size > (off_t)sizeof(BlockHashesHeader)) {
+    n_blocks =
+        ((size_t)stbuf.st_size - sizeof(BlockHashesHeader) + ds - 1) / ds;
+  }
+  if (n_blocks == 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&entry->mutex);
+  if (block_digests_reserve(entry, n_blocks, ds) != 0) {
+    pthread_mutex_unlock(&entry->mutex);
+    return -1;
+  }
+  // digests missing from a short hash file are zero, as if read from a hole
+  memset(entry->digests, 0, n_blocks * ds);
+  ssize_t r = hash_layer.ops->lpread(hash_fd, entry->digests, n_blocks * ds,
+                                     block_hash_offset(0, ds), hash_layer);
+  if (r >= 0) {
+    entry->n_blocks = n_blocks;
+  }
+  pthread_mutex_unlock(&entry->mutex);
+  return r >= 0 ? 0 : -1;
+}
+
+/**
+ * @brief Copy the stored digests of blocks [first, first + count), zero for
+ * blocks without one
+ *
+ * @return size_t -> number of blocks that have a stored digest
+ */
+static size_t block_digests_get(BlockDigests *entry, size_t first,
+                                size_t count, size_t ds, uint8_t *out) {
+  memset(out, 0, count * ds);
+  size_t n = 0;
+  pthread_mutex_lock(&entry->mutex);
+  if (first < entry->n_blocks) {
+    n = entry->n_blocks - first < count ? entry->n_blocks - first : count;
+    memcpy(out, entry->digests + first * ds, n * ds);
+  }
+  pthread_mutex_unlock(&entry->mutex);
+  return n;
+}
+
+/**
+ * @brief Store the digests of blocks [first, first + count) and add them to
+ * the dirty range
+ *
+ * @return int -> 0 on success, -1 on allocation error
+ */
+static int block_digests_put(BlockDigests *entry, size_t first, size_t count,
+                             size_t ds, const uint8_t *in) {
+  pthread_mutex_lock(&entry->mutex);
+  const size_t end = first + count;
+  if (block_digests_reserve(entry, end, ds) != 0) {
+    pthread_mutex_unlock(&entry->mutex);
+    return -1;
+  }
+  if (first > entry->n_blocks) {
+    // blocks skipped by a write past the end, a hole in the hash file
+    memset(entry->digests + entry->n_blocks * ds, 0,
+           (first - entry->n_blocks) * ds);
+  }
+  memcpy(entry->digests + first * ds, in, count * ds);
+  if (end > entry->n_blocks) {
+    entry->n_blocks = end;
+  }
+  block_digests_dirty(entry, first, end);
+  pthread_mutex_unlock(&entry->mutex);
+  return 0;
+}
+
+/**
+ * @brief Write the dirty range of an entry to the hash file
+ *
+ * The range is taken out of the entry before the write, so writes of other
+ * fds can keep updating the digests meanwhile; it is put back if the write
+ * fails.
+ *
+ * @param state       -> AntiTamperingState
+ * @param entry       -> entry to write
+ * @param hash_fd     -> hash layer fd of the path
+ * @param app_context -> application context of the layer calls
+ * @return int        -> 0 on success (or if clean), -1 on error
+ */
+static int block_digests_flush(AntiTamperingState *state, BlockDigests *entry,
+                               int hash_fd, void *app_context) {
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, app_context);
+  const size_t ds = state->hasher.get_hash_size();
+  pthread_mutex_lock(&entry->mutex);
+  size_t first = entry->dirty_first;
+  size_t end = entry->dirty_end;
+  if (first == end || entry->unlinked) {
+    pthread_mutex_unlock(&entry->mutex);
+    return 0;
+  }
+  uint8_t *copy = buffer_pool_get(state->buffers, (end - first) * ds);
+  if (!copy) {
+    pthread_mutex_unlock(&entry->mutex);
+    return -1;
+  }
+  memcpy(copy, entry->digests + first * ds, (end - first) * ds);
+  entry->dirty_first = entry->dirty_end = 0;
+  pthread_mutex_unlock(&entry->mutex);
+
+  ssize_t w = hash_layer.ops->lpwrite(hash_fd, copy, (end - first) * ds,
+                                      block_hash_offset(first, ds), hash_layer);
+  buffer_pool_put(state->buffers, copy);
+  if (w == (ssize_t)((end - first) * ds)) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&entry->mutex);
+  block_digests_dirty(entry, first, end);
+  pthread_mutex_unlock(&entry->mutex);
+  return -1;
+}
+
 int block_anti_tampering_open(const char *pathname, int flags, __mode_t mode,
                               LayerContext l) {
   // Reuse the normal open path to populate fd->(file_path, hash_path) mapping
@@ -20,53 +493,188 @@ int block_anti_tampering_open(const char *pathname, int flags, __mode_t mode,
   }
 
   AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
-  if (!state || !is_valid_anti_tampering_fd(fd)) {
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, l.app_context);
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
+    return fd;
+  }
+  mapping->block_size = state->block_size;
+
+  // Keep the hash file open until close: every block read/write uses it and
+  // the hash layer may be remote
+  const char *hash_path = mapping->hash_path;
+  if (!hash_path || hash_path[0] == '\0') {
+    return fd;
+  }
+  int hash_fd = open_hash_file(state, hash_path, l);
+  if (hash_fd < 0) {
+    WARN_MSG("[ANTI_TAMPERING_BLOCK_OPEN] Failed to open hash file %s for "
+             "file %s",
+             hash_path, pathname);
     return fd;
   }
 
-  const char *hash_path = state->mappings[fd].hash_path;
-  if (hash_path && hash_path[0] != '\0') {
-    (void)ensure_hash_file_exists(state, hash_path, l);
+  const LockKey *lock_key = &mapping->path->lock_key;
+  if (locking_acquire_write_key(state->lock_table, lock_key) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_BLOCK_OPEN] Failed to acquire write lock on "
+              "file %s",
+              pathname);
+    hash_layer.ops->lclose(hash_fd, hash_layer);
+    block_anti_tampering_close(fd, l);
+    return INVALID_FD;
+  }
+  size_t block_size = state->block_size;
+  int prepared = prepare_block_hash_file(state, hash_fd, hash_path, pathname,
+                                         &block_size, l.app_context);
+  // the file may have changed below the layer since its blocks were verified
+  verified_blocks_reset(state->verified, pathname);
+
+  // the first open of the path reads its digests, the others share them
+  BlockDigests *blocks = NULL;
+  if (prepared == 0 && state->digest_cache) {
+    blocks = block_digests_acquire(state, pathname);
+    if (!blocks || (blocks->ref_count == 1 &&
+                    block_digests_load(state, blocks, hash_fd,
+                                       l.app_context) != 0)) {
+      prepared = -1;
+    }
+  }
+  locking_release_key(state->lock_table, lock_key);
+
+  if (prepared != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_BLOCK_OPEN] Unusable hash file %s for file %s",
+              hash_path, pathname);
+    block_digests_release(state, blocks);
+    hash_layer.ops->lclose(hash_fd, hash_layer);
+    block_anti_tampering_close(fd, l);
+    return INVALID_FD;
   }
+  mapping->hash_fd = hash_fd;
+  mapping->blocks = blocks;
+  mapping->block_size = block_size;
 
   return fd;
 }
 
 int block_anti_tampering_close(int fd, LayerContext l) {
   AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
-  if (!state || !is_valid_anti_tampering_fd(fd)) {
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, l.app_context);
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
     return INVALID_FD;
   }
 
-  int file_fd = state->mappings[fd].file_fd;
-  char *file_path = state->mappings[fd].file_path;
-  char *hash_path = state->mappings[fd].hash_path;
+  int file_fd = mapping->file_fd;
+  int hash_fd = mapping->hash_fd;
+  const char *file_path = mapping->file_path;
 
-  if (!file_path) {
-    return INVALID_FD;
+  // the digests written through any fd of the path reach the hash file
+  BlockDigests *blocks = mapping->blocks;
+  int flushed = 0;
+  if (blocks) {
+    flushed = block_digests_flush(state, blocks, hash_fd, l.app_context);
+    if (flushed != 0) {
+      ERROR_MSG("[ANTI_TAMPERING_BLOCK_CLOSE] Failed to write the block "
+                "digests of file %s",
+                file_path);
+    }
+    block_digests_release(state, blocks);
   }
 
-  state->data_layer.app_context = l.app_context;
-  int rc = 0;
+  int rc = flushed;
   if (file_fd != INVALID_FD) {
-    rc = state->data_layer.ops->lclose(file_fd, state->data_layer);
+    int data_rc = data_layer.ops->lclose(file_fd, data_layer);
+    if (data_rc < 0) {
+      rc = data_rc;
+    }
   }
 
-  if (hash_path) {
-    free(hash_path);
+  if (hash_fd != INVALID_FD) {
+    int hash_rc = hash_layer.ops->lclose(hash_fd, hash_layer);
+    if (hash_rc < 0) {
+      rc = hash_rc;
+    }
   }
-  free(file_path);
-  state->mappings[fd].file_fd = INVALID_FD;
-  state->mappings[fd].file_path = NULL;
-  state->mappings[fd].hash_path = NULL;
+
+  free_file_mapping(mapping);
 
   return rc;
 }
 
+// The fsync leading a batch of fsyncs of a path (block mode)
+typedef struct {
+  AntiTamperingState *state;
+  FileMapping *mapping;
+  LayerContext l;
+} BlockSync;
+
+/**
+ * @brief Write the cached digests of the path, then fsync the file and the
+ * hash file, for a batch of fsyncs
+ */
+static int block_sync(void *arg, int isdatasync) {
+  BlockSync *sync = arg;
+  AntiTamperingState *state = sync->state;
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, sync->l.app_context);
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, sync->l.app_context);
+  const FileMapping *mapping = sync->mapping;
+  if (mapping->blocks &&
+      block_digests_flush(state, mapping->blocks, mapping->hash_fd,
+                          sync->l.app_context) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_BLOCK_FSYNC] Failed to write the block "
+              "digests of file %s",
+              mapping->file_path);
+    return INVALID_FD;
+  }
+  if (data_layer.ops->lfsync &&
+      data_layer.ops->lfsync(mapping->file_fd, isdatasync, data_layer) != 0) {
+    return INVALID_FD;
+  }
+  if (mapping->hash_fd != INVALID_FD && hash_layer.ops->lfsync &&
+      hash_layer.ops->lfsync(mapping->hash_fd, isdatasync, hash_layer) != 0) {
+    return INVALID_FD;
+  }
+  return 0;
+}
+
+/**
+ * @brief fsync in block mode - the file and the digests of its blocks
+ *
+ * Concurrent fsyncs of a path are served by one digest write and one fsync
+ * of each file (see group_commit.h).
+ *
+ * @param fd         -> anti-tampering layer file descriptor
+ * @param isdatasync -> fdatasync instead of fsync
+ * @param l          -> context of the anti-tampering layer
+ * @return int       -> 0 on success, INVALID_FD on error
+ */
+int block_anti_tampering_fsync(int fd, int isdatasync, LayerContext l) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
+    return INVALID_FD;
+  }
+  BlockSync sync = {.state = state, .mapping = mapping, .l = l};
+  return group_commit_sync(&state->fsyncs, mapping->file_path,
+                           strlen(mapping->file_path), isdatasync, block_sync,
+                           &sync);
+}
+
 ssize_t block_anti_tampering_write(int fd, const void *buffer, size_t nbyte,
                                    off_t offset, LayerContext l) {
   AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
-  if (!state || !is_valid_anti_tampering_fd(fd)) {
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, l.app_context);
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
     ERROR_MSG("[ANTI_TAMPERING_WRITE] Invalid file descriptor");
     return -1;
   }
@@ -75,7 +683,7 @@ ssize_t block_anti_tampering_write(int fd, const void *buffer, size_t nbyte,
     return 0;
   }
 
-  const size_t block_size = state->block_size;
+  const size_t block_size = mapping->block_size;
   if (block_size == 0) {
     ERROR_MSG("[ANTI_TAMPERING_WRITE] Block size is 0");
     return -1;
@@ -83,60 +691,99 @@ ssize_t block_anti_tampering_write(int fd, const void *buffer, size_t nbyte,
 
   const size_t first_block_idx = (size_t)(offset / (off_t)block_size);
 
-  int file_fd = state->mappings[fd].file_fd;
-  char *file_path = state->mappings[fd].file_path;
-  char *hash_path = state->mappings[fd].hash_path;
+  // Lock only the blocks touched: their data and their stored digests
+  const size_t last_block_idx =
+      (size_t)((offset + (off_t)nbyte - 1) / (off_t)block_size);
+  const off_t lock_offset = (off_t)(first_block_idx * block_size);
+  const size_t lock_len = (last_block_idx - first_block_idx + 1) * block_size;
+
+  int file_fd = mapping->file_fd;
+  int hash_fd = mapping->hash_fd;
+  const char *file_path = mapping->file_path;
+  const char *hash_path = mapping->hash_path;
+  const LockKey *lock_key = &mapping->path->lock_key;
   if (!file_path || !hash_path) {
     ERROR_MSG("[ANTI_TAMPERING_WRITE] File path or hash path is NULL");
     return -1;
   }
+  if (hash_fd < 0) {
+    ERROR_MSG("[ANTI_TAMPERING_WRITE] Hash file %s is not open", hash_path);
+    return INVALID_FD;
+  }
 
-  // Serialize data write + hash update.
-  if (locking_acquire_write(state->lock_table, file_path) != 0) {
-    ERROR_MSG("[ANTI_TAMPERING_WRITE] Failed to acquire write lock on file %s "
-              "(fd=%d)",
-              file_path, file_fd);
+  // Serialize data write + hash update of these blocks.
+  if (locking_acquire_range_write_key(state->lock_table, lock_key, lock_offset,
+                                      lock_len) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_WRITE] Failed to acquire write lock on blocks "
+              "%zu-%zu of file %s (fd=%d)",
+              first_block_idx, last_block_idx, file_path, file_fd);
     return -1;
   }
+  verified_blocks_clear(state->verified, file_path, first_block_idx,
+                        last_block_idx - first_block_idx + 1);
+
+  const size_t ds = state->hasher.get_hash_size();
+  const size_t num_blocks = (nbyte + block_size - 1) / block_size;
+  const size_t concat_len = num_blocks * ds;
 
-  // 1) Write to the data layer.
-  state->data_layer.app_context = l.app_context;
-  ssize_t res = state->data_layer.ops->lpwrite(file_fd, buffer, nbyte, offset,
-                                               state->data_layer);
+  // 1) Write to the data layer, which computes the per-block digests in the
+  // same pass when it can. Its digests are not kept in the thread scratch
+  // area: the layers below may use it.
+  uint8_t *fused = NULL;
+  ssize_t res;
+  if (data_layer.ops->lpwrite_digest) {
+    fused = buffer_pool_get(state->buffers, concat_len);
+    if (!fused) {
+      locking_release_range_key(state->lock_table, lock_key, lock_offset,
+                                lock_len);
+      return INVALID_FD;
+    }
+    LayerDigest digest;
+    fill_layer_digest(state, block_size, fused, &digest);
+    res = data_layer.ops->lpwrite_digest(file_fd, buffer, nbyte, offset,
+                                         &digest, data_layer);
+  } else {
+    res = data_layer.ops->lpwrite(file_fd, buffer, nbyte, offset, data_layer);
+  }
   if (res != (ssize_t)nbyte) {
-    locking_release(state->lock_table, file_path);
+    buffer_pool_put(state->buffers, fused);
+    locking_release_range_key(state->lock_table, lock_key, lock_offset,
+                              lock_len);
     return res;
   }
 
-  // 2) Compute per-block hashes (fixed-length hex strings).
-  // hash_blocks_to_hex will calculate num_blocks internally, including partial
-  // last block
-  size_t hex_chars, concat_len;
-  char *concat = hash_blocks_to_hex(buffer, nbyte, block_size, &state->hasher,
-                                    &hex_chars, &concat_len);
+  // 2) Otherwise compute per-block binary digests, including a partial last
+  // block.
+  uint8_t *concat = fused;
   if (!concat) {
-    locking_release(state->lock_table, file_path);
-    return INVALID_FD;
+    concat = hasher_context_scratch(hasher_context_get(), concat_len);
+    if (!concat ||
+        hash_blocks_to_binary(buffer, nbyte, block_size, &state->hasher,
+                              file_zero_digest(state, mapping), concat,
+                              concat_len) != (ssize_t)num_blocks) {
+      locking_release_range_key(state->lock_table, lock_key, lock_offset,
+                                lock_len);
+      return INVALID_FD;
+    }
   }
 
-  // 3) Write concatenated hashes into the per-file hash file.
-  // Each block hash occupies `hex_chars` bytes at offset block_idx*hex_chars.
-  const off_t hash_off = (off_t)(first_block_idx * hex_chars);
-  state->hash_layer.app_context = l.app_context;
-  int hash_fd = state->hash_layer.ops->lopen(hash_path, O_RDWR | O_CREAT, 0644,
-                                             state->hash_layer);
-  if (hash_fd < 0) {
-    free(concat);
-    locking_release(state->lock_table, file_path);
-    return INVALID_FD;
+  // 3) Write the digests into the per-file hash file, after the header, or
+  // into the cached digests, which close writes to it.
+  BlockDigests *blocks = mapping->blocks;
+  ssize_t hw = -1;
+  if (blocks) {
+    if (block_digests_put(blocks, first_block_idx, num_blocks, ds, concat) ==
+        0) {
+      hw = (ssize_t)concat_len;
+    }
+  } else {
+    hw = hash_layer.ops->lpwrite(hash_fd, concat, concat_len,
+                                 block_hash_offset(first_block_idx, ds),
+                                 hash_layer);
   }
 
-  ssize_t hw = state->hash_layer.ops->lpwrite(hash_fd, concat, concat_len,
-                                              hash_off, state->hash_layer);
-  (void)state->hash_layer.ops->lclose(hash_fd, state->hash_layer);
-  free(concat);
-
-  locking_release(state->lock_table, file_path);
+  locking_release_range_key(state->lock_table, lock_key, lock_offset, lock_len);
+  buffer_pool_put(state->buffers, fused);
 
   if (hw != (ssize_t)concat_len) {
     ERROR_MSG("[ANTI_TAMPERING_WRITE] Failed to write concatenated hashes into "
@@ -149,7 +796,12 @@ ssize_t block_anti_tampering_write(int fd, const void *buffer, size_t nbyte,
 ssize_t block_anti_tampering_read(int fd, void *buffer, size_t nbyte,
                                   off_t offset, LayerContext l) {
   AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
-  if (!state || !is_valid_anti_tampering_fd(fd)) {
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, l.app_context);
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
     ERROR_MSG("[ANTI_TAMPERING_READ] Invalid file descriptor");
     return INVALID_FD;
   }
@@ -158,7 +810,7 @@ ssize_t block_anti_tampering_read(int fd, void *buffer, size_t nbyte,
     return 0;
   }
 
-  const size_t block_size = state->block_size;
+  const size_t block_size = mapping->block_size;
   if (block_size == 0) {
     ERROR_MSG("[ANTI_TAMPERING_READ] Block size is 0");
     return INVALID_FD;
@@ -166,63 +818,104 @@ ssize_t block_anti_tampering_read(int fd, void *buffer, size_t nbyte,
 
   const size_t first_block_idx = (size_t)(offset / (off_t)block_size);
 
-  int file_fd = state->mappings[fd].file_fd;
-  char *file_path = state->mappings[fd].file_path;
-  char *hash_path = state->mappings[fd].hash_path;
+  // Lock only the blocks touched: their data and their stored digests
+  const size_t last_block_idx =
+      (size_t)((offset + (off_t)nbyte - 1) / (off_t)block_size);
+  const off_t lock_offset = (off_t)(first_block_idx * block_size);
+  const size_t lock_len = (last_block_idx - first_block_idx + 1) * block_size;
+
+  int file_fd = mapping->file_fd;
+  int hash_fd = mapping->hash_fd;
+  const char *file_path = mapping->file_path;
+  const char *hash_path = mapping->hash_path;
+  const LockKey *lock_key = &mapping->path->lock_key;
   if (!file_path || !hash_path) {
     ERROR_MSG("[ANTI_TAMPERING_READ] File path or hash path is NULL");
     return INVALID_FD;
   }
 
-  if (locking_acquire_read(state->lock_table, file_path) != 0) {
-    ERROR_MSG("[ANTI_TAMPERING_READ] Failed to acquire read lock on file %s "
-              "(fd=%d)",
-              file_path, file_fd);
+  if (locking_acquire_range_read_key(state->lock_table, lock_key, lock_offset,
+                                     lock_len) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_READ] Failed to acquire read lock on blocks "
+              "%zu-%zu of file %s (fd=%d)",
+              first_block_idx, last_block_idx, file_path, file_fd);
     return INVALID_FD;
   }
 
-  // 1) Read full blocks
-  state->data_layer.app_context = l.app_context;
-  ssize_t rr = state->data_layer.ops->lpread(file_fd, buffer, nbyte, offset,
-                                             state->data_layer);
+  // 0) Blocks verified since their last write are trusted as they are
+  if (verified_blocks_test(state->verified, file_path, first_block_idx,
+                           last_block_idx - first_block_idx + 1)) {
+    ssize_t rr = data_layer.ops->lpread(file_fd, buffer, nbyte, offset,
+                                        data_layer);
+    locking_release_range_key(state->lock_table, lock_key, lock_offset,
+                              lock_len);
+    return rr;
+  }
+
+  const size_t ds = state->hasher.get_hash_size();
+  const size_t num_blocks = (nbyte + block_size - 1) / block_size;
+  const size_t concat_len = num_blocks * ds;
+
+  // 1) Read full blocks, with their digests when the data layer computes them
+  uint8_t *fused = NULL;
+  ssize_t rr;
+  if (data_layer.ops->lpread_digest) {
+    fused = buffer_pool_get(state->buffers, concat_len);
+    if (!fused) {
+      locking_release_range_key(state->lock_table, lock_key, lock_offset,
+                                lock_len);
+      ERROR_MSG("[ANTI_TAMPERING_READ] Failed to allocate memory for hashes");
+      return -1;
+    }
+    LayerDigest digest;
+    fill_layer_digest(state, block_size, fused, &digest);
+    rr = data_layer.ops->lpread_digest(file_fd, buffer, nbyte, offset, &digest,
+                                       data_layer);
+  } else {
+    rr = data_layer.ops->lpread(file_fd, buffer, nbyte, offset, data_layer);
+  }
   if (rr != (ssize_t)nbyte) {
-    locking_release(state->lock_table, file_path);
+    buffer_pool_put(state->buffers, fused);
+    locking_release_range_key(state->lock_table, lock_key, lock_offset,
+                              lock_len);
     return rr;
   }
 
-  // 2) Hash each individual block to hex
-  // hash_blocks_to_hex will calculate num_blocks internally, including partial
-  // last block
-  size_t hex_chars, concat_len;
-  char *computed = hash_blocks_to_hex(buffer, nbyte, block_size, &state->hasher,
-                                      &hex_chars, &concat_len);
+  // 2) Hash each individual block, including a partial last block, unless the
+  // data layer did
+
+  // computed and stored digests share the thread's hasher scratch area
+  uint8_t *computed =
+      hasher_context_scratch(hasher_context_get(), concat_len * 2);
   if (!computed) {
-    locking_release(state->lock_table, file_path);
+    buffer_pool_put(state->buffers, fused);
+    locking_release_range_key(state->lock_table, lock_key, lock_offset,
+                              lock_len);
+    ERROR_MSG("[ANTI_TAMPERING_READ] Failed to allocate memory for hashes");
     return -1;
   }
-
-  // Calculate num_blocks from concat_len and hex_chars for comparison loop
-  const size_t num_blocks = concat_len / hex_chars;
-
-  char *stored = malloc(concat_len);
-  if (!stored) {
-    free(computed);
-    locking_release(state->lock_table, file_path);
-    ERROR_MSG(
-        "[ANTI_TAMPERING_READ] Failed to allocate memory for stored hashes");
+  uint8_t *stored = computed + concat_len;
+  if (fused) {
+    memcpy(computed, fused, concat_len);
+    buffer_pool_put(state->buffers, fused);
+  } else if (hash_blocks_to_binary(
+                 buffer, nbyte, block_size, &state->hasher,
+                 file_zero_digest(state, mapping), computed,
+                 concat_len) != (ssize_t)num_blocks) {
+    locking_release_range_key(state->lock_table, lock_key, lock_offset,
+                              lock_len);
     return -1;
   }
 
   // 3) Read the stored hashes for these blocks
   memset(stored, 0, concat_len);
-  const off_t hash_off = (off_t)(first_block_idx * hex_chars);
-  state->hash_layer.app_context = l.app_context;
-  int hash_fd = state->hash_layer.ops->lopen(hash_path, O_RDONLY, 0644,
-                                             state->hash_layer);
-  if (hash_fd >= 0) {
-    (void)state->hash_layer.ops->lpread(hash_fd, stored, concat_len, hash_off,
-                                        state->hash_layer);
-    (void)state->hash_layer.ops->lclose(hash_fd, state->hash_layer);
+  if (mapping->blocks) {
+    block_digests_get(mapping->blocks, first_block_idx, num_blocks,
+                      ds, stored);
+  } else if (hash_fd >= 0) {
+    (void)hash_layer.ops->lpread(hash_fd, stored, concat_len,
+                                 block_hash_offset(first_block_idx, ds),
+                                 hash_layer);
   }
 
   // 4) Compare and emit warnings on mismatch
@@ -231,33 +924,104 @@ ssize_t block_anti_tampering_read(int fd, void *buffer, size_t nbyte,
              file_path, hash_path);
   }
 
+  // only whole blocks read from their start can be marked as verified
+  const size_t whole_blocks =
+      (offset % (off_t)block_size == 0) ? nbyte / block_size : 0;
+  size_t run = 0; // verified whole blocks right before block i
   for (size_t i = 0; i < num_blocks; i++) {
-    const size_t off = i * hex_chars;
-    if (memcmp(stored + off, computed + off, hex_chars) != 0) {
-      char *s_stored = malloc(hex_chars + 1);
-      char *s_computed = malloc(hex_chars + 1);
-      if (s_stored && s_computed) {
-        memcpy(s_stored, stored + off, hex_chars);
-        s_stored[hex_chars] = '\0';
-        memcpy(s_computed, computed + off, hex_chars);
-        s_computed[hex_chars] = '\0';
-        WARN_MSG("[ANTI_TAMPERING_BLOCK_READ] hash mismatch file=%s block=%zu "
-                 "data_off=%ld stored=%s computed=%s",
-                 file_path, first_block_idx + i,
-                 (long)(offset + (off_t)(i * block_size)), s_stored,
-                 s_computed);
-      }
-      free(s_stored);
-      free(s_computed);
+    const size_t off = i * ds;
+    int matches = hash_fd >= 0 && memcmp(stored + off, computed + off, ds) == 0;
+    if (matches && i < whole_blocks) {
+      run++;
+    } else if (run > 0) {
+      verified_blocks_mark(state->verified, file_path,
+                           first_block_idx + i - run, run);
+      run = 0;
+    }
+    if (memcmp(stored + off, computed + off, ds) != 0) {
+      char s_stored[HASHER_MAX_HEX_SIZE];
+      char s_computed[HASHER_MAX_HEX_SIZE];
+      bytes_to_hex(stored + off, ds, s_stored);
+      bytes_to_hex(computed + off, ds, s_computed);
+      count_hash_mismatch();
+      WARN_MSG("[ANTI_TAMPERING_BLOCK_READ] hash mismatch file=%s block=%zu "
+               "data_off=%ld stored=%s computed=%s",
+               file_path, first_block_idx + i,
+               (long)(offset + (off_t)(i * block_size)), s_stored, s_computed);
     }
   }
+  if (run > 0) {
+    verified_blocks_mark(state->verified, file_path,
+                         first_block_idx + num_blocks - run, run);
+  }
 
-  free(computed);
-  free(stored);
-  locking_release(state->lock_table, file_path);
+  locking_release_range_key(state->lock_table, lock_key, lock_offset, lock_len);
   return rr;
 }
 
+ssize_t block_anti_tampering_getdigest(int fd, off_t offset, size_t nbyte,
+                                       LayerStoredDigests *digests,
+                                       LayerContext l) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, l.app_context);
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
+    ERROR_MSG("[ANTI_TAMPERING_GETDIGEST] Invalid file descriptor");
+    errno = EBADF;
+    return -1;
+  }
+  if (mapping->hash_fd < 0) {
+    errno = ENOENT; // no hash file, no digests to give
+    return -1;
+  }
+
+  const size_t block_size = mapping->block_size;
+  const size_t ds = state->hasher.get_hash_size();
+  const size_t first_block_idx = (size_t)(offset / (off_t)block_size);
+  digests->algorithm = (int)state->hasher.algorithm;
+  digests->block_size = block_size;
+  digests->digest_size = ds;
+  digests->first_block = first_block_idx;
+  if (nbyte == 0) {
+    return 0;
+  }
+  const size_t last_block_idx =
+      (size_t)((offset + (off_t)nbyte - 1) / (off_t)block_size);
+  const size_t num_blocks = last_block_idx - first_block_idx + 1;
+  if (digests->capacity < num_blocks * ds) {
+    errno = ERANGE;
+    return -1;
+  }
+
+  // the digests of the blocks being written are not taken half updated
+  const off_t lock_offset = (off_t)(first_block_idx * block_size);
+  const size_t lock_len = num_blocks * block_size;
+  const LockKey *lock_key = &mapping->path->lock_key;
+  if (locking_acquire_range_read_key(state->lock_table, lock_key, lock_offset,
+                                     lock_len) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_GETDIGEST] Failed to acquire read lock on "
+              "blocks %zu-%zu of file %s",
+              first_block_idx, last_block_idx, mapping->file_path);
+    errno = EIO;
+    return -1;
+  }
+  ssize_t count;
+  if (mapping->blocks) {
+    count = (ssize_t)block_digests_get(mapping->blocks, first_block_idx,
+                                       num_blocks, ds, digests->digests);
+  } else {
+    ssize_t r = hash_layer.ops->lpread(mapping->hash_fd, digests->digests,
+                                       num_blocks * ds,
+                                       block_hash_offset(first_block_idx, ds),
+                                       hash_layer);
+    count = r < 0 ? -1 : r / (ssize_t)ds;
+  }
+  locking_release_range_key(state->lock_table, lock_key, lock_offset,
+                            lock_len);
+  return count;
+}
+
 int block_anti_tampering_ftruncate(int fd, off_t length, LayerContext l) {
   return anti_tampering_ftruncate(fd, length, l);
 }
@@ -274,3 +1038,54 @@ int block_anti_tampering_lstat(const char *pathname, struct stat *stbuf,
 int block_anti_tampering_unlink(const char *pathname, LayerContext l) {
   return anti_tampering_unlink(pathname, l);
 }
+
+/**
+ * @brief Take the cached digests of an unlinked path out of the table
+ *
+ * Must be called with the path write lock held. The fds still open on the
+ * file keep using the entry, which is never written again, and the next open
+ * of the path starts from the hash file of the new file.
+ *
+ * @param state    -> AntiTamperingState
+ * @param pathname -> unlinked path
+ */
+void block_anti_tampering_forget(AntiTamperingState *state,
+                                 const char *pathname) {
+  if (!state->digest_cache) {
+    return;
+  }
+  pthread_mutex_lock(&state->block_mutex);
+  BlockDigests *entry = NULL;
+  HASH_FIND(hh, state->block_files, pathname, strlen(pathname), entry);
+  if (entry) {
+    HASH_DEL(state->block_files, entry);
+    pthread_mutex_lock(&entry->mutex);
+    entry->unlinked = 1;
+    pthread_mutex_unlock(&entry->mutex);
+  }
+  pthread_mutex_unlock(&state->block_mutex);
+}
+
+/**
+ * @brief Write the cached digests of the fds still open and free them
+ *
+ * @param state -> AntiTamperingState being destroyed
+ */
+void block_anti_tampering_destroy(AntiTamperingState *state) {
+  for (int i = 0; state->digest_cache && i < fd_table_end(&state->mappings);
+       i++) {
+    FileMapping *mapping = anti_tampering_mapping(state, i);
+    BlockDigests *entry = mapping ? mapping->blocks : NULL;
+    if (!entry) {
+      continue;
+    }
+    if (block_digests_flush(state, entry, mapping->hash_fd, NULL) != 0) {
+      ERROR_MSG("[ANTI_TAMPERING_BLOCK_DESTROY] Failed to write the block "
+                "digests of file %s",
+                entry->file_path);
+    }
+    mapping->blocks = NULL;
+    block_digests_release(state, entry);
+  }
+  pthread_mutex_destroy(&state->block_mutex);
+}
@@ -1,10 +1,57 @@
 #ifndef __BLOCK_ANTI_TAMPERING_H__
 #define __BLOCK_ANTI_TAMPERING_H__
 
+#include "../../lib/uthash/src/uthash.h"
 #include "../../shared/types/layer_context.h"
+#include "anti_tampering.h"
+#include <pthread.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#define BLOCK_HASHES_MAGIC "TGBH"
+#define BLOCK_HASHES_VERSION 1
+
+/**
+ * @brief Header of the per-file block hash file
+ *
+ * The header is followed by one binary digest per block: the digest of block i
+ * is stored at sizeof(BlockHashesHeader) + i * digest_size. Hash files without
+ * this header are the legacy format (one hex digest per block) and are
+ * converted when opened.
+ */
+typedef struct {
+  char magic[4];        // BLOCK_HASHES_MAGIC
+  uint32_t version;     // BLOCK_HASHES_VERSION
+  uint32_t algorithm;   // hash_algorithm_t of the digests
+  uint32_t digest_size; // size of each digest in bytes
+  uint64_t block_size;  // block size in bytes
+  uint64_t reserved;    // zero
+} BlockHashesHeader;
+
+/**
+ * @brief Stored block digests of a file, shared by all its open fds
+ *
+ * With digest_cache, the whole hash file is read at the first open of the
+ * file and reads take the stored digests from here. Writes update them in
+ * memory and extend the dirty range, which every close (and the layer's
+ * destroy) writes to the hash file in one request. Membership in the state's
+ * table is protected by block_mutex; unlink takes the entry out of it so that
+ * a new file at the path starts from its own hash file.
+ */
+typedef struct BlockDigests {
+  char *file_path;       // key
+  uint8_t *digests;      // digest of block i at i * digest_size
+  size_t n_blocks;       // blocks with a digest
+  size_t capacity;       // blocks digests can hold
+  size_t dirty_first;    // first block not written to the hash file
+  size_t dirty_end;      // end of the dirty range, dirty_first if clean
+  int ref_count;         // open fds referencing this entry
+  int unlinked;          // unlinked path, the digests are never written
+  pthread_mutex_t mutex; // protects the digests and the dirty range
+  UT_hash_handle hh;
+} BlockDigests;
+
 ssize_t block_anti_tampering_write(int fd, const void *buffer, size_t nbyte,
                                    off_t offset, LayerContext l);
 ssize_t block_anti_tampering_read(int fd, void *buffer, size_t nbyte,
@@ -12,11 +59,30 @@ ssize_t block_anti_tampering_read(int fd, void *buffer, size_t nbyte,
 int block_anti_tampering_open(const char *pathname, int flags, __mode_t mode,
                               LayerContext l);
 int block_anti_tampering_close(int fd, LayerContext l);
+int block_anti_tampering_fsync(int fd, int isdatasync, LayerContext l);
 int block_anti_tampering_ftruncate(int fd, off_t length, LayerContext l);
 int block_anti_tampering_fstat(int fd, struct stat *stbuf, LayerContext l);
 int block_anti_tampering_lstat(const char *pathname, struct stat *stbuf,
                                LayerContext l);
 int block_anti_tampering_unlink(const char *pathname, LayerContext l);
 
+/**
+ * @brief Stored digests of the blocks of a range, from the digest cache or
+ * the hash file, without reading the data
+ *
+ * @param fd       -> file descriptor of the layer
+ * @param offset   -> offset value
+ * @param nbyte    -> number of bytes of the range
+ * @param digests  -> filled with the digests and their format
+ * @param l        -> layer
+ * @return ssize_t -> number of stored digests, -1 with errno on error
+ */
+ssize_t block_anti_tampering_getdigest(int fd, off_t offset, size_t nbyte,
+                                       LayerStoredDigests *digests,
+                                       LayerContext l);
+void block_anti_tampering_forget(AntiTamperingState *state,
+                                 const char *pathname);
+void block_anti_tampering_destroy(AntiTamperingState *state);
+
 #endif // __BLOCK_ANTI_TAMPERING_H__
 
@@ -2,6 +2,9 @@
 #define __ANTI_TAMPERING_CONFIG_H__
 
 #include "../../config/utils.h"
+#include "../../shared/types/layer_context.h"
+#include "../../shared/utils/conversion.h"
+#include "../../shared/utils/hasher/blake3.h"
 #include "../../shared/utils/hasher/hasher.h"
 #include <stddef.h>
 #include <string.h>
@@ -11,15 +14,59 @@
 typedef enum {
   ANTI_TAMPERING_MODE_FILE,
   ANTI_TAMPERING_MODE_BLOCK,
+  ANTI_TAMPERING_MODE_MERKLE,
 } anti_tampering_mode_t;
 
+#define ANTI_TAMPERING_DEFAULT_CHUNK_SIZE                                      \
+  ((size_t)64 * 1024) // merkle mode chunk size when block_size is not set
+#define ANTI_TAMPERING_DEFAULT_VERIFY_CACHE_TTL                                \
+  60 // seconds a file mode verification stays valid in the verify cache
+#define ANTI_TAMPERING_DEFAULT_HASH_BATCH_INTERVAL_MS                          \
+  1000 // age of the oldest buffered hash that triggers a manifest flush
+#define ANTI_TAMPERING_DEFAULT_SCRUB_RATE                                      \
+  ((size_t)16 * 1024 * 1024) // scrubber I/O budget in bytes per second
+#define ANTI_TAMPERING_DEFAULT_SCRUB_INTERVAL                                  \
+  3600 // seconds from the end of a scrubber pass to the next one
+#define ANTI_TAMPERING_MAX_HASH_FANOUT                                         \
+  4 // directory levels of hashes_storage, two hex characters each
+#define ANTI_TAMPERING_MAX_BLOCK_SIZE_RULES                                    \
+  64 // block mode: rules choosing the block size of new files
+
+// Block size of the new files a rule matches (block mode)
+typedef struct {
+  char *path_prefix; // match: paths under it, or NULL
+  char *suffix;      // match: paths ending with it (e.g. ".db"), or NULL
+  size_t block_size; // block size of the files it matches
+} AntiTamperingBlockSizeRule;
+
 typedef struct {
   char *data_layer;
   char *hash_layer;
   char *hashes_storage;
   hash_algorithm_t algorithm;
-  anti_tampering_mode_t mode; // file or block mode
-  size_t block_size;          // required for block mode (bytes)
+  anti_tampering_mode_t mode; // file, block or merkle mode
+  size_t block_size; // required for block mode, chunk size in merkle mode
+  AntiTamperingBlockSizeRule *block_size_rules; // block mode, in match order
+  int nblock_size_rules;
+  size_t verify_cache_entries; // file mode verify cache size, 0 disables it
+  long verify_cache_ttl;       // verify cache entry lifetime in seconds
+  size_t verified_block_files; // block mode verified blocks paths, 0: off
+  int digest_cache;            // block mode: keep block digests in memory
+  unsigned char hash_key[BLAKE3_KEY_LEN]; // key of the blake3-keyed algorithm
+  size_t hash_threads; // merkle chunk hashing threads (metadata service)
+  int async_commit;    // file mode: hash closed files in a background thread
+  int hash_prefetch;   // file mode: read the stored hash while hashing on open
+  size_t hash_batch_records;   // file mode hashes per manifest, 0 disables it
+  long hash_batch_interval_ms; // manifest flush interval in milliseconds
+  char *anchor_layer;          // layer of the manifest roots, or NULL
+  LayerContext anchor;         // built from anchor_layer by the builder
+  char *scrub_root;            // file mode: data layer tree to scrub, or NULL
+  size_t scrub_rate;           // scrubber bytes per second, 0: unlimited
+  long scrub_interval;         // seconds between scrubber passes
+  int async_cleanup;     // remove and move hashes in a background thread
+  char *cleanup_journal; // local file of the pending removals, or NULL
+  char *dirty_journal;   // file mode: local file of the dirty paths, or NULL
+  size_t hash_fanout;    // directory levels of hashes_storage, 0: flat
 } AntiTamperingConfig;
 
 /**
@@ -31,9 +78,15 @@ string_to_hash_algorithm(const char *algorithm_str) {
     return HASH_SHA256;
   if (strcasecmp(algorithm_str, "sha512") == 0)
     return HASH_SHA512;
+  if (strcasecmp(algorithm_str, "blake3") == 0)
+    return HASH_BLAKE3;
+  if (strcasecmp(algorithm_str, "blake3-keyed") == 0)
+    return HASH_BLAKE3_KEYED;
 
   char buf[256];
-  snprintf(buf, sizeof(buf), "Invalid hash algorithm: %s; use: sha256, sha512",
+  snprintf(buf, sizeof(buf),
+           "Invalid hash algorithm: %s; use: sha256, sha512, blake3, "
+           "blake3-keyed",
            algorithm_str);
   toml_error(buf);
   return HASH_SHA256; // This line should never be reached due to toml_error
@@ -48,11 +101,67 @@ static inline const char *hash_algorithm_to_string(hash_algorithm_t algorithm) {
     return "SHA256";
   case HASH_SHA512:
     return "SHA512";
+  case HASH_BLAKE3:
+    return "BLAKE3";
+  case HASH_BLAKE3_KEYED:
+    return "BLAKE3-KEYED";
   default:
     return "UNKNOWN";
   }
 }
 
+/**
+ * @brief Parse the block size rules of block mode
+ *
+ * The rules are an array of tables, matched in order against the path of a
+ * file when its hash file is created; files no rule matches get block_size.
+ */
+static inline void
+anti_tampering_parse_block_sizes(toml_datum_t layer_table,
+                                 AntiTamperingConfig *config) {
+  config->block_size_rules = NULL;
+  config->nblock_size_rules = 0;
+  toml_datum_t rules = toml_get(layer_table, "block_sizes");
+  if (rules.type == TOML_UNKNOWN) {
+    return;
+  }
+  if (rules.type != TOML_ARRAY) {
+    toml_error("Anti-tampering layer block_sizes must be an array of tables");
+  }
+  if (config->mode != ANTI_TAMPERING_MODE_BLOCK) {
+    toml_error("Anti-tampering layer block_sizes requires block mode");
+  }
+  int n = rules.u.arr.size;
+  if (n > ANTI_TAMPERING_MAX_BLOCK_SIZE_RULES) {
+    toml_error("Anti-tampering layer has too many block_sizes (at most 64)");
+  }
+  config->block_size_rules =
+      calloc((size_t)n, sizeof(AntiTamperingBlockSizeRule));
+  if (n > 0 && !config->block_size_rules) {
+    toml_error("Failed to allocate memory for the block size rules");
+  }
+  for (int i = 0; i < n; i++) {
+    toml_datum_t table = rules.u.arr.elem[i];
+    if (table.type != TOML_TABLE) {
+      toml_error("Anti-tampering layer block_sizes must be tables");
+    }
+    AntiTamperingBlockSizeRule *rule = &config->block_size_rules[i];
+    rule->path_prefix = parse_string(toml_get(table, "path_prefix"));
+    rule->suffix = parse_string(toml_get(table, "suffix"));
+    config->nblock_size_rules++;
+    if (!rule->path_prefix && !rule->suffix) {
+      toml_error("Anti-tampering block size rule must match a path_prefix or "
+                 "a suffix");
+    }
+    toml_datum_t block_size = toml_get(table, "block_size");
+    if (block_size.type != TOML_INT64 || block_size.u.int64 <= 0) {
+      toml_error("Anti-tampering block size rule must have a positive "
+                 "block_size");
+    }
+    rule->block_size = (size_t)block_size.u.int64;
+  }
+}
+
 /**
  * @brief Parse anti-tampering layer parameters
  */
@@ -84,6 +193,19 @@ static inline void anti_tampering_parse_params(toml_datum_t layer_table,
     config->algorithm = HASH_SHA256; // Default to SHA256 if not specified
   }
 
+  // Parse hash_key (required for blake3-keyed, 64 hex characters)
+  memset(config->hash_key, 0, sizeof(config->hash_key));
+  if (config->algorithm == HASH_BLAKE3_KEYED) {
+    toml_datum_t hash_key = toml_get(layer_table, "hash_key");
+    if (hash_key.type != TOML_STRING ||
+        strlen(hash_key.u.str.ptr) != 2 * BLAKE3_KEY_LEN ||
+        hex_to_bytes(hash_key.u.str.ptr, config->hash_key,
+                     sizeof(config->hash_key)) != BLAKE3_KEY_LEN) {
+      toml_error("Anti-tampering layer with blake3-keyed must have a hash_key "
+                 "of 64 hex characters");
+    }
+  }
+
   // Parse mode (optional, defaults to file)
   config->mode = ANTI_TAMPERING_MODE_FILE;
   toml_datum_t mode = toml_get(layer_table, "mode");
@@ -92,21 +214,194 @@ static inline void anti_tampering_parse_params(toml_datum_t layer_table,
       config->mode = ANTI_TAMPERING_MODE_FILE;
     } else if (strcasecmp(mode.u.str.ptr, "block") == 0) {
       config->mode = ANTI_TAMPERING_MODE_BLOCK;
+    } else if (strcasecmp(mode.u.str.ptr, "merkle") == 0) {
+      config->mode = ANTI_TAMPERING_MODE_MERKLE;
     } else {
-      toml_error(
-          "Anti-tampering layer has unsupported mode (use 'file' or 'block')");
+      toml_error("Anti-tampering layer has unsupported mode (use 'file', "
+                 "'block' or 'merkle')");
     }
   }
 
-  // Parse block_size (required only for block mode)
+  // Parse block_size (required for block mode, optional chunk size for
+  // merkle mode)
   config->block_size = 0;
   toml_datum_t block_size = toml_get(layer_table, "block_size");
   if (block_size.type == TOML_INT64) {
+    if (block_size.u.int64 <= 0) {
+      toml_error("Anti-tampering layer block_size must be positive");
+    }
     config->block_size = (size_t)block_size.u.int64;
   } else if (config->mode == ANTI_TAMPERING_MODE_BLOCK) {
     toml_error("Anti-tampering layer in block mode must have an integer for "
                "block_size");
+  } else if (config->mode == ANTI_TAMPERING_MODE_MERKLE) {
+    config->block_size = ANTI_TAMPERING_DEFAULT_CHUNK_SIZE;
+  }
+  anti_tampering_parse_block_sizes(layer_table, config);
+
+  // Parse verify cache (optional, file mode only, disabled by default)
+  config->verify_cache_entries = 0;
+  toml_datum_t verify_cache_entries =
+      toml_get(layer_table, "verify_cache_entries");
+  if (verify_cache_entries.type == TOML_INT64) {
+    if (verify_cache_entries.u.int64 < 0) {
+      toml_error("Anti-tampering layer verify_cache_entries must not be "
+                 "negative");
+    }
+    config->verify_cache_entries = (size_t)verify_cache_entries.u.int64;
+  }
+
+  config->verify_cache_ttl = ANTI_TAMPERING_DEFAULT_VERIFY_CACHE_TTL;
+  toml_datum_t verify_cache_ttl = toml_get(layer_table, "verify_cache_ttl");
+  if (verify_cache_ttl.type == TOML_INT64) {
+    if (verify_cache_ttl.u.int64 < 0) {
+      toml_error("Anti-tampering layer verify_cache_ttl must not be negative");
+    }
+    config->verify_cache_ttl = (long)verify_cache_ttl.u.int64;
+  }
+
+  // Parse verified blocks (optional, block mode only, disabled by default)
+  config->verified_block_files = 0;
+  toml_datum_t verified_block_files =
+      toml_get(layer_table, "verified_block_files");
+  if (verified_block_files.type == TOML_INT64) {
+    if (verified_block_files.u.int64 < 0) {
+      toml_error("Anti-tampering layer verified_block_files must not be "
+                 "negative");
+    }
+    config->verified_block_files = (size_t)verified_block_files.u.int64;
+  }
+
+  // Parse digest_cache (optional, block mode only, disabled by default)
+  config->digest_cache = 0;
+  toml_datum_t digest_cache = toml_get(layer_table, "digest_cache");
+  if (digest_cache.type == TOML_BOOLEAN) {
+    config->digest_cache = digest_cache.u.boolean ? 1 : 0;
+  }
+
+  // Parse async_commit (optional, file mode only, disabled by default)
+  config->async_commit = 0;
+  toml_datum_t async_commit = toml_get(layer_table, "async_commit");
+  if (async_commit.type == TOML_BOOLEAN) {
+    config->async_commit = async_commit.u.boolean ? 1 : 0;
   }
+
+  // Parse hash_prefetch (optional, file mode only, disabled by default)
+  config->hash_prefetch = 0;
+  toml_datum_t hash_prefetch = toml_get(layer_table, "hash_prefetch");
+  if (hash_prefetch.type == TOML_BOOLEAN) {
+    config->hash_prefetch = hash_prefetch.u.boolean ? 1 : 0;
+  }
+
+  // Parse hash batching (optional, file mode only, disabled by default)
+  config->hash_batch_records = 0;
+  toml_datum_t hash_batch_records = toml_get(layer_table, "hash_batch_records");
+  if (hash_batch_records.type == TOML_INT64) {
+    if (hash_batch_records.u.int64 < 0) {
+      toml_error("Anti-tampering layer hash_batch_records must not be "
+                 "negative");
+    }
+    config->hash_batch_records = (size_t)hash_batch_records.u.int64;
+  }
+
+  config->hash_batch_interval_ms =
+      ANTI_TAMPERING_DEFAULT_HASH_BATCH_INTERVAL_MS;
+  toml_datum_t hash_batch_interval_ms =
+      toml_get(layer_table, "hash_batch_interval_ms");
+  if (hash_batch_interval_ms.type == TOML_INT64) {
+    if (hash_batch_interval_ms.u.int64 < 0) {
+      toml_error("Anti-tampering layer hash_batch_interval_ms must not be "
+                 "negative");
+    }
+    config->hash_batch_interval_ms = (long)hash_batch_interval_ms.u.int64;
+  }
+
+  // Parse anchor_layer (optional, anchors the manifests of hash batching)
+  config->anchor_layer = NULL;
+  memset(&config->anchor, 0, sizeof(config->anchor));
+  toml_datum_t anchor_layer = toml_get(layer_table, "anchor_layer");
+  if (anchor_layer.type == TOML_STRING) {
+    if (config->mode != ANTI_TAMPERING_MODE_FILE ||
+        config->hash_batch_records == 0) {
+      toml_error("Anti-tampering layer anchor_layer requires file mode and "
+                 "hash_batch_records");
+    }
+    config->anchor_layer = strdup(anchor_layer.u.str.ptr);
+  }
+
+  // Parse the scrubber (optional, file mode only, disabled by default)
+  config->scrub_root = NULL;
+  toml_datum_t scrub_root = toml_get(layer_table, "scrub_root");
+  if (scrub_root.type == TOML_STRING) {
+    if (config->mode != ANTI_TAMPERING_MODE_FILE) {
+      toml_error("Anti-tampering layer scrub_root requires file mode");
+    }
+    config->scrub_root = strdup(scrub_root.u.str.ptr);
+  }
+
+  config->scrub_rate = ANTI_TAMPERING_DEFAULT_SCRUB_RATE;
+  toml_datum_t scrub_rate = toml_get(layer_table, "scrub_rate");
+  if (scrub_rate.type == TOML_INT64) {
+    if (scrub_rate.u.int64 < 0) {
+      toml_error("Anti-tampering layer scrub_rate must not be negative");
+    }
+    config->scrub_rate = (size_t)scrub_rate.u.int64;
+  }
+
+  config->scrub_interval = ANTI_TAMPERING_DEFAULT_SCRUB_INTERVAL;
+  toml_datum_t scrub_interval = toml_get(layer_table, "scrub_interval");
+  if (scrub_interval.type == TOML_INT64) {
+    if (scrub_interval.u.int64 < 0) {
+      toml_error("Anti-tampering layer scrub_interval must not be negative");
+    }
+    config->scrub_interval = (long)scrub_interval.u.int64;
+  }
+
+  // Parse async_cleanup (optional, disabled by default)
+  config->async_cleanup = 0;
+  toml_datum_t async_cleanup = toml_get(layer_table, "async_cleanup");
+  if (async_cleanup.type == TOML_BOOLEAN) {
+    config->async_cleanup = async_cleanup.u.boolean ? 1 : 0;
+  }
+
+  config->cleanup_journal = NULL;
+  toml_datum_t cleanup_journal = toml_get(layer_table, "cleanup_journal");
+  if (cleanup_journal.type == TOML_STRING) {
+    if (!config->async_cleanup) {
+      toml_error("Anti-tampering layer cleanup_journal requires "
+                 "async_cleanup");
+    }
+    config->cleanup_journal = strdup(cleanup_journal.u.str.ptr);
+  }
+
+  // Parse the dirty journal (optional, file mode only, disabled by default)
+  config->dirty_journal = NULL;
+  toml_datum_t dirty_journal = toml_get(layer_table, "dirty_journal");
+  if (dirty_journal.type == TOML_STRING) {
+    if (config->mode != ANTI_TAMPERING_MODE_FILE) {
+      toml_error("Anti-tampering layer dirty_journal requires file mode");
+    }
+    config->dirty_journal = strdup(dirty_journal.u.str.ptr);
+  }
+
+  // Parse hash_fanout (optional, flat hashes_storage by default)
+  config->hash_fanout = 0;
+  toml_datum_t hash_fanout = toml_get(layer_table, "hash_fanout");
+  if (hash_fanout.type == TOML_INT64) {
+    if (hash_fanout.u.int64 < 0 ||
+        hash_fanout.u.int64 > ANTI_TAMPERING_MAX_HASH_FANOUT) {
+      toml_error("Anti-tampering layer hash_fanout must be between 0 and 4");
+    }
+    if (hash_fanout.u.int64 > 0 && config->hash_batch_records > 0) {
+      // the manifest keeps the hashes as records, not as files
+      toml_error("Anti-tampering layer hash_fanout does not apply with "
+                 "hash_batch_records");
+    }
+    config->hash_fanout = (size_t)hash_fanout.u.int64;
+  }
+
+  // Set by the builder from the metadata service num_background_threads
+  config->hash_threads = 0;
 }
 
 #endif // __ANTI_TAMPERING_CONFIG_H__
@@ -0,0 +1,563 @@
+#include "dirty_journal.h"
+
+#include "../../logdef.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * The journal is a text file of one record a line, newlines and backslashes
+ * of the paths escaped as "\n" and "\\":
+ *
+ *   O <gen> <file_path>   path made dirty, with generation gen
+ *   C <gen>               generation gen committed
+ *
+ * It is truncated whenever no path is dirty. It is rewritten, on init and
+ * to compact it, by writing the records of the dirty paths to
+ * "<journal>.tmp" and renaming that over it, so a crash always leaves one of
+ * the two complete.
+ */
+
+#define DIRTY_JOURNAL_SYNC_KEY "dirty"
+
+static void free_entry(DirtyJournalEntry *entry) {
+  free(entry->file_path);
+  free(entry->awaiting);
+  free(entry);
+}
+
+/**
+ * @brief Write whole records to the journal
+ *
+ * @return int -> 0, or -1 if the journal could not be written
+ */
+static int journal_write(DirtyJournal *journal, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(journal->fd, buf, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+/**
+ * @brief Append the record making an entry dirty (mutex held)
+ */
+static int journal_dirty(DirtyJournal *journal,
+                         const DirtyJournalEntry *entry) {
+  const size_t path_len = strlen(entry->file_path);
+  char *record = malloc((2 * path_len) + 32);
+  if (!record) {
+    return -1;
+  }
+  size_t len = (size_t)sprintf(record, "O %lu ", entry->gen);
+  for (size_t i = 0; i < path_len; i++) {
+    char c = entry->file_path[i];
+    if (c == '\n' || c == '\\') {
+      record[len++] = '\\';
+      c = c == '\n' ? 'n' : '\\';
+    }
+    record[len++] = c;
+  }
+  record[len++] = '\n';
+  int res = journal_write(journal, record, len);
+  free(record);
+  journal->records += res == 0;
+  return res;
+}
+
+/**
+ * @brief Replace the journal with the records of the dirty paths, synced
+ * (mutex held, or before the journal is shared)
+ *
+ * @return int -> 0, or -1 with the journal left as it was
+ */
+static int journal_rewrite(DirtyJournal *journal) {
+  const size_t path_len = strlen(journal->path);
+  char *tmp_path = malloc(path_len + sizeof(".tmp"));
+  if (!tmp_path) {
+    return -1;
+  }
+  memcpy(tmp_path, journal->path, path_len);
+  memcpy(tmp_path + path_len, ".tmp", sizeof(".tmp"));
+
+  int old_fd = journal->fd;
+  size_t old_records = journal->records;
+  journal->fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND |
+                                   O_CLOEXEC,
+                     0600);
+  journal->records = 0;
+  int res = journal->fd < 0 ? -1 : 0;
+  DirtyJournalEntry *entry, *tmp;
+  HASH_ITER(hh, journal->entries, entry, tmp) {
+    if (res == 0 && journal_dirty(journal, entry) != 0) {
+      res = -1;
+    }
+  }
+  if (res == 0 && (fdatasync(journal->fd) != 0 ||
+                   rename(tmp_path, journal->path) != 0)) {
+    res = -1;
+  }
+  if (res != 0) {
+    if (journal->fd >= 0) {
+      close(journal->fd);
+      unlink(tmp_path);
+    }
+    journal->fd = old_fd;
+    journal->records = old_records;
+    free(tmp_path);
+    return -1;
+  }
+  close(old_fd);
+  free(tmp_path);
+  // every dirty path is on disk now
+  HASH_ITER(hh, journal->entries, entry, tmp) { entry->synced = 1; }
+  return 0;
+}
+
+/**
+ * @brief Take a committed entry out of the journal (mutex held)
+ *
+ * The clearing record is not synced: losing it only rehashes the file once
+ * more on the next init.
+ */
+static void journal_clear(DirtyJournal *journal, DirtyJournalEntry *entry) {
+  HASH_DEL(journal->entries, entry);
+  if (entry->awaiting) {
+    journal->awaiting--;
+  }
+  journal->stats.cleared++;
+  const size_t dirty = HASH_COUNT(journal->entries);
+  if (dirty == 0) {
+    if (ftruncate(journal->fd, 0) != 0) {
+      ERROR_MSG("[ANTI_TAMPERING_DIRTY_JOURNAL] Failed to truncate the "
+                "journal");
+    }
+    journal->records = 0;
+  } else if (journal->records >= DIRTY_JOURNAL_COMPACT_RECORDS &&
+             journal->records >= 4 * dirty &&
+             journal_rewrite(journal) == 0) {
+    // the rewritten journal no longer has the entry
+  } else {
+    char record[32];
+    int len = snprintf(record, sizeof(record), "C %lu\n", entry->gen);
+    if (journal_write(journal, record, (size_t)len) != 0) {
+      ERROR_MSG("[ANTI_TAMPERING_DIRTY_JOURNAL] Failed to journal the commit "
+                "of file %s",
+                entry->file_path);
+    }
+    journal->records++;
+  }
+  free_entry(entry);
+}
+
+/**
+ * @brief Clear the entries whose buffered hash is now durable (mutex held)
+ */
+static void journal_sweep(DirtyJournal *journal) {
+  if (journal->awaiting == 0) {
+    return;
+  }
+  DirtyJournalEntry *entry, *tmp;
+  HASH_ITER(hh, journal->entries, entry, tmp) {
+    if (entry->awaiting && entry->writers == 0 &&
+        journal->durable(journal->arg, entry->awaiting)) {
+      journal_clear(journal, entry);
+    }
+  }
+}
+
+// group commit callback: one fdatasync for the records of a batch of marks.
+// It syncs a duplicate of the fd: a compaction meanwhile replaces the file
+// with a synced one holding the same records.
+static int journal_sync(void *arg, int isdatasync) {
+  DirtyJournal *journal = arg;
+  (void)isdatasync;
+  pthread_mutex_lock(&journal->mutex);
+  int fd = dup(journal->fd);
+  journal->stats.syncs++;
+  pthread_mutex_unlock(&journal->mutex);
+  if (fd < 0) {
+    return -1;
+  }
+  int res = fdatasync(fd);
+  int error = errno;
+  close(fd);
+  errno = error;
+  return res;
+}
+
+static DirtyJournalEntry *add_entry(DirtyJournal *journal,
+                                    const char *file_path,
+                                    unsigned long gen) {
+  DirtyJournalEntry *entry = calloc(1, sizeof(DirtyJournalEntry));
+  if (!entry) {
+    return NULL;
+  }
+  entry->file_path = strdup(file_path);
+  if (!entry->file_path) {
+    free(entry);
+    return NULL;
+  }
+  entry->gen = gen;
+  HASH_ADD_KEYPTR(hh, journal->entries, entry->file_path,
+                  strlen(entry->file_path), entry);
+  return entry;
+}
+
+/**
+ * @brief Undo the escaping of a path in place
+ */
+static void unescape_path(char *path) {
+  char *out = path;
+  for (const char *in = path; *in; in++) {
+    if (*in == '\\' && (in[1] == 'n' || in[1] == '\\')) {
+      in++;
+      *out++ = *in == 'n' ? '\n' : '\\';
+    } else {
+      *out++ = *in;
+    }
+  }
+  *out = '\0';
+}
+
+/**
+ * @brief Load the paths the journal leaves dirty and rewrite it with them
+ * only (before any mark)
+ *
+ * @return int -> 0, or -1 if the journal could not be read or rewritten
+ */
+static int journal_replay(DirtyJournal *journal) {
+  struct stat st;
+  if (fstat(journal->fd, &st) != 0) {
+    return -1;
+  }
+  char *data = malloc((size_t)st.st_size + 1);
+  if (!data) {
+    return -1;
+  }
+  size_t len = 0;
+  while (len < (size_t)st.st_size) {
+    ssize_t n = pread(journal->fd, data + len, (size_t)st.st_size - len,
+                      (off_t)len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    len += (size_t)n;
+  }
+  data[len] = '\0';
+
+  // a record cut by a crash has no newline, and its mark did not return
+  char *line = data;
+  char *end;
+  while ((end = strchr(line, '\n')) != NULL) {
+    *end = '\0';
+    char *rest = NULL;
+    unsigned long gen =
+        strlen(line) > 2 && line[1] == ' ' ? strtoul(line + 2, &rest, 10) : 0;
+    if (gen >= journal->next_gen) {
+      journal->next_gen = gen + 1;
+    }
+    if (line[0] == 'O' && rest && *rest == ' ' && rest[1] != '\0') {
+      char *file_path = rest + 1;
+      unescape_path(file_path);
+      DirtyJournalEntry *entry = NULL;
+      HASH_FIND(hh, journal->entries, file_path, strlen(file_path), entry);
+      if (entry) {
+        entry->gen = gen;
+      } else if (!add_entry(journal, file_path, gen)) {
+        free(data);
+        return -1;
+      }
+    } else if (line[0] == 'C' && rest) {
+      DirtyJournalEntry *entry, *tmp;
+      HASH_ITER(hh, journal->entries, entry, tmp) {
+        if (entry->gen == gen) {
+          HASH_DEL(journal->entries, entry);
+          free_entry(entry);
+        }
+      }
+    }
+    line = end + 1;
+  }
+  free(data);
+
+  journal->stats.replayed = HASH_COUNT(journal->entries);
+  if (!journal->entries) {
+    return ftruncate(journal->fd, 0);
+  }
+  return journal_rewrite(journal);
+}
+
+/**
+ * @brief Free the entries and close the journal
+ */
+static void free_journal(DirtyJournal *journal) {
+  DirtyJournalEntry *entry, *tmp;
+  HASH_ITER(hh, journal->entries, entry, tmp) {
+    HASH_DEL(journal->entries, entry);
+    free_entry(entry);
+  }
+  if (journal->fd >= 0) {
+    close(journal->fd);
+  }
+  free(journal->path);
+  free(journal);
+}
+
+/**
+ * @brief Open a dirty journal and load the paths a crash left dirty
+ *
+ * @param journal_path  -> local file of the journal
+ * @param durable       -> whether a hash committed with a key survives a
+ * crash, or NULL if committed hashes always do
+ * @param arg           -> argument passed to durable
+ * @return DirtyJournal* -> journal, or NULL on error
+ */
+DirtyJournal *dirty_journal_init(const char *journal_path,
+                                 dirty_durable_fn durable, void *arg) {
+  if (!journal_path) {
+    return NULL;
+  }
+  DirtyJournal *journal = calloc(1, sizeof(DirtyJournal));
+  if (!journal) {
+    return NULL;
+  }
+  journal->durable = durable;
+  journal->arg = arg;
+  journal->next_gen = 1;
+  journal->path = strdup(journal_path);
+  journal->fd =
+      open(journal_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (!journal->path || journal->fd < 0 || journal_replay(journal) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_DIRTY_JOURNAL] Failed to replay the journal %s",
+              journal_path);
+    free_journal(journal);
+    return NULL;
+  }
+  if (pthread_mutex_init(&journal->mutex, NULL) != 0) {
+    free_journal(journal);
+    return NULL;
+  }
+  if (group_commit_init(&journal->syncs) != 0) {
+    pthread_mutex_destroy(&journal->mutex);
+    free_journal(journal);
+    return NULL;
+  }
+  return journal;
+}
+
+/**
+ * @brief Close a journal, emptying it if every dirty path is committed
+ *
+ * The paths still dirty (open for writing, or whose commit failed) stay in
+ * it for the next init.
+ *
+ * @param journal -> journal to destroy (may be NULL)
+ */
+void dirty_journal_destroy(DirtyJournal *journal) {
+  if (!journal) {
+    return;
+  }
+  pthread_mutex_lock(&journal->mutex);
+  journal_sweep(journal);
+  if (journal->entries) {
+    INFO_MSG("[ANTI_TAMPERING_DIRTY_JOURNAL] %zu files left dirty",
+             (size_t)HASH_COUNT(journal->entries));
+  }
+  pthread_mutex_unlock(&journal->mutex);
+  group_commit_destroy(&journal->syncs);
+  pthread_mutex_destroy(&journal->mutex);
+  free_journal(journal);
+}
+
+/**
+ * @brief Make a path dirty before it is written
+ *
+ * @param journal   -> journal (NULL: nothing to do)
+ * @param file_path -> data layer path of the file opened for writing
+ * @return int      -> 0 once the path is dirty on disk, -1 on error
+ */
+int dirty_journal_mark(DirtyJournal *journal, const char *file_path) {
+  if (!journal) {
+    return 0;
+  }
+  pthread_mutex_lock(&journal->mutex);
+  DirtyJournalEntry *entry = NULL;
+  HASH_FIND(hh, journal->entries, file_path, strlen(file_path), entry);
+  if (!entry) {
+    entry = add_entry(journal, file_path, journal->next_gen);
+    if (!entry) {
+      pthread_mutex_unlock(&journal->mutex);
+      return -1;
+    }
+    if (journal_dirty(journal, entry) != 0) {
+      ERROR_MSG("[ANTI_TAMPERING_DIRTY_JOURNAL] Failed to journal file %s",
+                file_path);
+      HASH_DEL(journal->entries, entry);
+      free_entry(entry);
+      pthread_mutex_unlock(&journal->mutex);
+      return -1;
+    }
+    journal->next_gen++;
+    journal->stats.marked++;
+  } else if (entry->awaiting) {
+    // written again: the buffered hash is stale before being durable
+    free(entry->awaiting);
+    entry->awaiting = NULL;
+    journal->awaiting--;
+  }
+  entry->writers++;
+  int synced = entry->synced;
+  pthread_mutex_unlock(&journal->mutex);
+  if (synced) {
+    return 0;
+  }
+
+  // the record of the path, and of any other path marked meanwhile
+  if (group_commit_sync(&journal->syncs, DIRTY_JOURNAL_SYNC_KEY,
+                        strlen(DIRTY_JOURNAL_SYNC_KEY), 1, journal_sync,
+                        journal) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_DIRTY_JOURNAL] Failed to sync the journal for "
+              "file %s",
+              file_path);
+    dirty_journal_unmark(journal, file_path);
+    return -1;
+  }
+  pthread_mutex_lock(&journal->mutex);
+  entry->synced = 1;
+  pthread_mutex_unlock(&journal->mutex);
+  return 0;
+}
+
+/**
+ * @brief Note that an fd of a dirty path open for writing is closed
+ *
+ * The path stays dirty until its hash is committed.
+ *
+ * @param journal   -> journal (NULL: nothing to do)
+ * @param file_path -> data layer path of the file
+ */
+void dirty_journal_unmark(DirtyJournal *journal, const char *file_path) {
+  if (!journal) {
+    return;
+  }
+  pthread_mutex_lock(&journal->mutex);
+  DirtyJournalEntry *entry = NULL;
+  HASH_FIND(hh, journal->entries, file_path, strlen(file_path), entry);
+  if (entry && entry->writers > 0) {
+    entry->writers--;
+  }
+  pthread_mutex_unlock(&journal->mutex);
+}
+
+/**
+ * @brief Note that the hash of a path is committed
+ *
+ * The path is cleared if no fd has it open for writing, right away or, with
+ * a key, once durable(key) says the committed hash survives a crash.
+ *
+ * @param journal   -> journal (NULL: nothing to do)
+ * @param file_path -> data layer path of the file
+ * @param key       -> key of a buffered hash for the durable callback, or
+ * NULL if the hash is stored
+ */
+void dirty_journal_committed(DirtyJournal *journal, const char *file_path,
+                             const char *key) {
+  if (!journal) {
+    return;
+  }
+  pthread_mutex_lock(&journal->mutex);
+  journal_sweep(journal);
+  DirtyJournalEntry *entry = NULL;
+  HASH_FIND(hh, journal->entries, file_path, strlen(file_path), entry);
+  if (entry && entry->writers == 0) {
+    if (key && journal->durable) {
+      char *awaiting = strdup(key);
+      if (awaiting) {
+        journal->awaiting += entry->awaiting ? 0 : 1;
+        free(entry->awaiting);
+        entry->awaiting = awaiting;
+      }
+    } else {
+      journal_clear(journal, entry);
+    }
+  }
+  pthread_mutex_unlock(&journal->mutex);
+}
+
+/**
+ * @brief Rehash the paths the journal was left with by a crash
+ *
+ * Run once after init, before any mark; recover commits the hash of a path,
+ * which clears it. The paths whose recover fails stay dirty.
+ *
+ * @param journal -> journal (NULL: nothing to do)
+ * @param recover -> callback committing the hash of a path
+ * @param arg     -> argument passed to recover
+ * @return int    -> number of paths recover failed for
+ */
+int dirty_journal_recover(DirtyJournal *journal, dirty_recover_fn recover,
+                          void *arg) {
+  if (!journal) {
+    return 0;
+  }
+  pthread_mutex_lock(&journal->mutex);
+  size_t n = HASH_COUNT(journal->entries);
+  char **paths = n > 0 ? calloc(n, sizeof(char *)) : NULL;
+  size_t count = 0;
+  DirtyJournalEntry *entry, *tmp;
+  HASH_ITER(hh, journal->entries, entry, tmp) {
+    if (paths && (paths[count] = strdup(entry->file_path)) != NULL) {
+      count++;
+    }
+  }
+  pthread_mutex_unlock(&journal->mutex);
+
+  int failed = (int)(n - count);
+  for (size_t i = 0; i < count; i++) {
+    if (recover(arg, paths[i]) != 0) {
+      ERROR_MSG("[ANTI_TAMPERING_DIRTY_JOURNAL] Failed to rehash file %s",
+                paths[i]);
+      failed++;
+    }
+    free(paths[i]);
+  }
+  free(paths);
+  if (count > 0) {
+    INFO_MSG("[ANTI_TAMPERING_DIRTY_JOURNAL] Rehashed %zu files left dirty "
+             "by a crash, %d failed",
+             count, failed);
+  }
+  return failed;
+}
+
+/**
+ * @brief Copy the counters of a journal
+ *
+ * @param journal -> journal (NULL: all zero)
+ * @param stats   -> filled with the counters
+ */
+void dirty_journal_get_stats(DirtyJournal *journal, DirtyJournalStats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (!journal) {
+    return;
+  }
+  pthread_mutex_lock(&journal->mutex);
+  *stats = journal->stats;
+  stats->dirty = HASH_COUNT(journal->entries);
+  pthread_mutex_unlock(&journal->mutex);
+}
@@ -0,0 +1,97 @@
+#ifndef __DIRTY_JOURNAL_H__
+#define __DIRTY_JOURNAL_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include "../../shared/utils/group_commit.h"
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * ============================================================================
+ * DIRTY JOURNAL - FILES WHOSE STORED HASH MAY BE STALE (FILE MODE)
+ * ============================================================================
+ *
+ * A file opened for writing has a stale hash until the commit that follows
+ * its last close. A crash in between leaves a file that fails its next
+ * verification although nobody tampered with it. The dirty journal is a
+ * local append-only file of the paths in that window:
+ *
+ * - The first open for writing of a path appends a record with a new
+ *   generation number, and returns once the record is on disk. The
+ *   fdatasyncs of concurrent opens are served by one (see group_commit.h);
+ *   the other opens of a path that is already dirty write nothing.
+ * - Once no fd of the path is open for writing and its hash is committed,
+ *   a record clears its generation. A hash published in a manifest buffer
+ *   is only committed once a flush wrote it (the durable callback).
+ * - The journal is truncated whenever no path is dirty, and rewritten with
+ *   the dirty paths only once it holds DIRTY_JOURNAL_COMPACT_RECORDS records
+ *   and four times as many as there are dirty paths: a file kept open for
+ *   writing never lets it be truncated.
+ * - On init, the paths it leaves dirty are handed to the caller to rehash
+ *   and republish, and it is rewritten with them only.
+ * ============================================================================
+ */
+
+#define DIRTY_JOURNAL_COMPACT_RECORDS 4096 // records that allow a rewrite
+
+/**
+ * @brief Whether the hash committed for a path survives a crash
+ *
+ * @param arg  -> argument given to dirty_journal_init
+ * @param key  -> key given to dirty_journal_committed
+ * @return int -> 1 if it does, 0 if it is still buffered
+ */
+typedef int (*dirty_durable_fn)(void *arg, const char *key);
+
+/**
+ * @brief Rehash callback of dirty_journal_recover
+ *
+ * @param arg       -> argument of dirty_journal_recover
+ * @param file_path -> data layer path of a file left dirty by a crash
+ * @return int      -> 0 once its hash is committed, negative on error
+ */
+typedef int (*dirty_recover_fn)(void *arg, const char *file_path);
+
+typedef struct DirtyJournalEntry {
+  char *file_path;   // key
+  unsigned long gen; // generation of its record
+  int writers;       // fds of the path open for writing
+  int synced;        // its record is on disk
+  char *awaiting;    // key of a committed hash not durable yet, or NULL
+  UT_hash_handle hh;
+} DirtyJournalEntry;
+
+typedef struct {
+  size_t dirty;    // paths dirty now
+  size_t marked;   // paths made dirty
+  size_t cleared;  // paths cleared once committed
+  size_t replayed; // paths found dirty on init
+  size_t syncs;    // fdatasyncs of the journal
+} DirtyJournalStats;
+
+typedef struct DirtyJournal {
+  DirtyJournalEntry *entries; // dirty paths
+  size_t awaiting;            // entries with a buffered hash
+  unsigned long next_gen;     // generation of the next record
+  char *path;                 // journal file
+  int fd;                     // journal file, opened for appending
+  size_t records;             // records in it
+  dirty_durable_fn durable;   // durability of buffered hashes, or NULL
+  void *arg;                  // durable callback argument
+  DirtyJournalStats stats;    // counters
+  pthread_mutex_t mutex;      // protects all the fields above
+  GroupCommit syncs;          // concurrent fdatasyncs of the journal
+} DirtyJournal;
+
+DirtyJournal *dirty_journal_init(const char *journal_path,
+                                 dirty_durable_fn durable, void *arg);
+void dirty_journal_destroy(DirtyJournal *journal);
+int dirty_journal_mark(DirtyJournal *journal, const char *file_path);
+void dirty_journal_unmark(DirtyJournal *journal, const char *file_path);
+void dirty_journal_committed(DirtyJournal *journal, const char *file_path,
+                             const char *key);
+int dirty_journal_recover(DirtyJournal *journal, dirty_recover_fn recover,
+                          void *arg);
+void dirty_journal_get_stats(DirtyJournal *journal, DirtyJournalStats *stats);
+
+#endif // __DIRTY_JOURNAL_H__
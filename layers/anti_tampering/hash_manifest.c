@@ -0,0 +1,748 @@
+#include "hash_manifest.h"
+
+#include "../../logdef.h"
+#include "manifest_anchor.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MANIFEST_READ_CHUNK ((size_t)64 * 1024) // manifest load read size
+
+/**
+ * @brief Path of the manifest with a given sequence number
+ *
+ * @return char* -> allocated path, or NULL on error
+ */
+static char *manifest_pathname(const HashManifest *manifest, size_t seq) {
+  size_t len = strlen(manifest->prefix) + 32; // "/manifest-" + 20 digits
+  char *path = malloc(len);
+  if (!path) {
+    return NULL;
+  }
+  (void)snprintf(path, len, "%s/manifest-%010zu", manifest->prefix, seq);
+  return path;
+}
+
+static void free_entry(HashManifestEntry *entry) {
+  free(entry->key);
+  free(entry);
+}
+
+/**
+ * @brief Find the index entry of a key, creating it if needed (mutex held)
+ */
+static HashManifestEntry *entry_for(HashManifest *manifest, const char *key,
+                                    size_t key_len) {
+  HashManifestEntry *entry = NULL;
+  HASH_FIND(hh, manifest->entries, key, key_len, entry);
+  if (entry) {
+    return entry;
+  }
+  entry = calloc(1, sizeof(HashManifestEntry));
+  if (!entry) {
+    return NULL;
+  }
+  entry->key = strndup(key, key_len);
+  if (!entry->key) {
+    free(entry);
+    return NULL;
+  }
+  HASH_ADD_KEYPTR(hh, manifest->entries, entry->key, key_len, entry);
+  return entry;
+}
+
+/**
+ * @brief Add an entry to the next flush (mutex held)
+ *
+ * Wakes the flusher on the first record (to start the interval timer) and
+ * when the batch is full.
+ */
+static int batch_push(HashManifest *manifest, HashManifestEntry *entry,
+                      const struct timespec *now) {
+  if (entry->queued) {
+    return 0;
+  }
+  if (manifest->n_batch == manifest->batch_capacity) {
+    size_t capacity =
+        manifest->batch_capacity > 0 ? manifest->batch_capacity * 2 : 64;
+    HashManifestEntry **grown =
+        realloc(manifest->batch, capacity * sizeof(HashManifestEntry *));
+    if (!grown) {
+      return -1;
+    }
+    manifest->batch = grown;
+    manifest->batch_capacity = capacity;
+  }
+  if (manifest->n_batch == 0) {
+    manifest->batch_start = *now;
+    pthread_cond_signal(&manifest->wake);
+  }
+  manifest->batch[manifest->n_batch++] = entry;
+  entry->queued = 1;
+  if (manifest->n_batch >= manifest->max_records) {
+    pthread_cond_signal(&manifest->wake);
+  }
+  return 0;
+}
+
+/**
+ * @brief Write a whole manifest object to the hash layer
+ *
+ * @return int -> 0 on success, -1 on error
+ */
+static int write_manifest(HashManifest *manifest, size_t seq,
+                          const uint8_t *buffer, size_t size) {
+  char *path = manifest_pathname(manifest, seq);
+  if (!path) {
+    return -1;
+  }
+  int fd = manifest->hash_layer.ops->lopen(path, O_RDWR | O_CREAT | O_TRUNC,
+                                           0644, manifest->hash_layer);
+  if (fd < 0) {
+    ERROR_MSG("[HASH_MANIFEST] Failed to create manifest %s", path);
+    free(path);
+    return -1;
+  }
+
+  size_t done = 0;
+  while (done < size) {
+    ssize_t w = manifest->hash_layer.ops->lpwrite(
+        fd, buffer + done, size - done, (off_t)done, manifest->hash_layer);
+    if (w <= 0) {
+      break;
+    }
+    done += (size_t)w;
+  }
+  int close_res = manifest->hash_layer.ops->lclose(fd, manifest->hash_layer);
+  if (done != size || close_res < 0) {
+    ERROR_MSG("[HASH_MANIFEST] Failed to write manifest %s", path);
+    free(path);
+    return -1;
+  }
+  free(path);
+  return 0;
+}
+
+/**
+ * @brief Read a whole manifest object
+ *
+ * @return uint8_t* -> allocated content, or NULL if the manifest does not
+ * exist or cannot be read
+ */
+static uint8_t *read_manifest(HashManifest *manifest, size_t seq,
+                              size_t *size) {
+  char *path = manifest_pathname(manifest, seq);
+  if (!path) {
+    return NULL;
+  }
+  int fd = manifest->hash_layer.ops->lopen(path, O_RDONLY, 0644,
+                                           manifest->hash_layer);
+  free(path);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  uint8_t *buffer = NULL;
+  size_t used = 0;
+  for (;;) {
+    uint8_t *grown = realloc(buffer, used + MANIFEST_READ_CHUNK);
+    if (!grown) {
+      free(buffer);
+      buffer = NULL;
+      break;
+    }
+    buffer = grown;
+    ssize_t r = manifest->hash_layer.ops->lpread(
+        fd, buffer + used, MANIFEST_READ_CHUNK, (off_t)used,
+        manifest->hash_layer);
+    if (r < 0) {
+      free(buffer);
+      buffer = NULL;
+      break;
+    }
+    if (r == 0) {
+      break;
+    }
+    used += (size_t)r;
+  }
+  manifest->hash_layer.ops->lclose(fd, manifest->hash_layer);
+  *size = used;
+  return buffer;
+}
+
+/**
+ * @brief Apply the records of one manifest to the index (mutex held)
+ *
+ * @return int -> 0 on success, -1 if the manifest is malformed
+ */
+static int apply_manifest(HashManifest *manifest, size_t seq,
+                          const uint8_t *buffer, size_t size) {
+  HashManifestHeader header;
+  if (size < sizeof(header)) {
+    return -1;
+  }
+  memcpy(&header, buffer, sizeof(header));
+  if (memcmp(header.magic, HASH_MANIFEST_MAGIC, 4) != 0 ||
+      header.version != HASH_MANIFEST_VERSION ||
+      header.value_size != manifest->value_size) {
+    return -1;
+  }
+
+  size_t pos = sizeof(header);
+  for (uint64_t i = 0; i < header.count; i++) {
+    HashManifestRecord record;
+    if (size - pos < sizeof(record)) {
+      return -1;
+    }
+    memcpy(&record, buffer + pos, sizeof(record));
+    pos += sizeof(record);
+    if (size - pos < (size_t)record.key_len + manifest->value_size) {
+      return -1;
+    }
+    const char *key = (const char *)buffer + pos;
+    pos += record.key_len;
+
+    if (record.flags & HASH_MANIFEST_TOMBSTONE) {
+      HashManifestEntry *entry = NULL;
+      HASH_FIND(hh, manifest->entries, key, record.key_len, entry);
+      if (entry) {
+        HASH_DEL(manifest->entries, entry);
+        free_entry(entry);
+      }
+    } else {
+      HashManifestEntry *entry = entry_for(manifest, key, record.key_len);
+      if (!entry) {
+        return -1;
+      }
+      entry->stored = 1;
+      entry->removed = 0;
+      entry->manifest = seq;
+      entry->index = (size_t)i;
+      entry->offset = (off_t)pos;
+    }
+    pos += manifest->value_size;
+  }
+  return 0;
+}
+
+/**
+ * @brief Rebuild the index from the manifests already in the hash layer
+ *
+ * With an anchor, the last manifest is only applied if its root was
+ * anchored, and no root may follow it.
+ *
+ * @return int -> 0 on success, -1 if a manifest is malformed or missing
+ */
+static int load_manifests(HashManifest *manifest) {
+  size_t size = 0;
+  uint8_t *buffer = read_manifest(manifest, 0, &size);
+  size_t seq = 0;
+  while (buffer) {
+    size_t next_size = 0;
+    uint8_t *next = read_manifest(manifest, seq + 1, &next_size);
+    if (!next && manifest->anchor &&
+        manifest_anchor_exists(manifest->anchor, seq) == 0) {
+      // written, but the flush failed before its root: rewritten next
+      WARN_MSG("[HASH_MANIFEST] Manifest %zu in %s has no anchored root, "
+               "its records are dropped",
+               seq, manifest->prefix);
+      free(buffer);
+      break;
+    }
+    int res = apply_manifest(manifest, seq, buffer, size);
+    free(buffer);
+    if (res != 0) {
+      ERROR_MSG("[HASH_MANIFEST] Manifest %zu in %s is malformed or was "
+                "written with another hash algorithm",
+                seq, manifest->prefix);
+      free(next);
+      return -1;
+    }
+    buffer = next;
+    size = next_size;
+    seq++;
+  }
+  manifest->next_manifest = seq;
+
+  if (manifest->anchor &&
+      manifest_anchor_exists(manifest->anchor, seq) != 0) {
+    ERROR_MSG("[HASH_MANIFEST] Manifest %zu of %s is anchored but missing "
+              "from the hash layer",
+              seq, manifest->prefix);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Flusher thread: flushes a batch when it is full or old enough
+ */
+static void *flusher_worker(void *arg) {
+  HashManifest *manifest = arg;
+
+  pthread_mutex_lock(&manifest->mutex);
+  while (!manifest->stopping) {
+    if (manifest->n_batch == 0 || (manifest->n_batch < manifest->max_records &&
+                                   manifest->flush_interval_ms <= 0)) {
+      pthread_cond_wait(&manifest->wake, &manifest->mutex);
+      continue;
+    }
+    if (manifest->n_batch < manifest->max_records) {
+      struct timespec deadline = manifest->batch_start;
+      deadline.tv_sec += manifest->flush_interval_ms / 1000;
+      deadline.tv_nsec += (manifest->flush_interval_ms % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      if (pthread_cond_timedwait(&manifest->wake, &manifest->mutex,
+                                 &deadline) != ETIMEDOUT) {
+        continue; // woken up: the batch may be full, or we are stopping
+      }
+    }
+    pthread_mutex_unlock(&manifest->mutex);
+    (void)hash_manifest_flush(manifest);
+    pthread_mutex_lock(&manifest->mutex);
+  }
+  pthread_mutex_unlock(&manifest->mutex);
+  return NULL;
+}
+
+/**
+ * @brief Create a manifest store, load its index and start the flusher
+ *
+ * @param hash_layer        -> layer the manifests are stored in
+ * @param prefix            -> directory of the manifests
+ * @param value_size        -> size of each value (hex digest length)
+ * @param max_records       -> records per manifest before a flush (> 0)
+ * @param flush_interval_ms -> age of the oldest buffered record that
+ * triggers a flush, 0 to flush on max_records only
+ * @return HashManifest*    -> manifest store, or NULL on error
+ */
+HashManifest *hash_manifest_init(LayerContext hash_layer, const char *prefix,
+                                 size_t value_size, size_t max_records,
+                                 long flush_interval_ms) {
+  LayerContext no_anchor = {0};
+  return hash_manifest_init_anchored(hash_layer, no_anchor, NULL, prefix,
+                                     value_size, max_records,
+                                     flush_interval_ms);
+}
+
+/**
+ * @brief Create a manifest store whose manifests are anchored, load its
+ * index and start the flusher
+ *
+ * @param hash_layer        -> layer the manifests and proofs are stored in
+ * @param anchor_layer      -> layer the manifest roots are written to (no
+ * ops: the manifests are not anchored)
+ * @param hasher            -> hasher of the Merkle trees (must outlive the
+ * store), with an anchor layer
+ * @param prefix            -> directory of the manifests
+ * @param value_size        -> size of each value (hex digest length)
+ * @param max_records       -> records per manifest before a flush (> 0)
+ * @param flush_interval_ms -> age of the oldest buffered record that
+ * triggers a flush, 0 to flush on max_records only
+ * @return HashManifest*    -> manifest store, or NULL on error
+ */
+HashManifest *hash_manifest_init_anchored(LayerContext hash_layer,
+                                          LayerContext anchor_layer,
+                                          const Hasher *hasher,
+                                          const char *prefix,
+                                          size_t value_size,
+                                          size_t max_records,
+                                          long flush_interval_ms) {
+  if (!hash_layer.ops || !prefix || value_size == 0 ||
+      value_size >= HASHER_MAX_HEX_SIZE || max_records == 0) {
+    return NULL;
+  }
+  ManifestAnchor *anchor = NULL;
+  if (anchor_layer.ops) {
+    anchor = manifest_anchor_init(hash_layer, anchor_layer, hasher, prefix);
+    if (!anchor) {
+      return NULL;
+    }
+  }
+  HashManifest *manifest = calloc(1, sizeof(HashManifest));
+  if (!manifest) {
+    manifest_anchor_destroy(anchor);
+    return NULL;
+  }
+  manifest->hash_layer = hash_layer;
+  manifest->anchor = anchor;
+  manifest->prefix = strdup(prefix);
+  manifest->value_size = value_size;
+  manifest->max_records = max_records;
+  manifest->flush_interval_ms = flush_interval_ms;
+  if (!manifest->prefix) {
+    manifest_anchor_destroy(anchor);
+    free(manifest);
+    return NULL;
+  }
+
+  // the flush deadline is computed on the monotonic clock
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&manifest->wake, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&manifest->mutex, NULL);
+  pthread_mutex_init(&manifest->flush_mutex, NULL);
+
+  if (load_manifests(manifest) != 0 ||
+      pthread_create(&manifest->flusher, NULL, flusher_worker, manifest) !=
+          0) {
+    HashManifestEntry *entry, *tmp;
+    HASH_ITER(hh, manifest->entries, entry, tmp) {
+      HASH_DEL(manifest->entries, entry);
+      free_entry(entry);
+    }
+    pthread_cond_destroy(&manifest->wake);
+    pthread_mutex_destroy(&manifest->flush_mutex);
+    pthread_mutex_destroy(&manifest->mutex);
+    manifest_anchor_destroy(manifest->anchor);
+    free(manifest->prefix);
+    free(manifest);
+    return NULL;
+  }
+  return manifest;
+}
+
+/**
+ * @brief Flush the buffered records, stop the flusher and free the store
+ *
+ * @param manifest -> manifest store to destroy (may be NULL)
+ */
+void hash_manifest_destroy(HashManifest *manifest) {
+  if (!manifest) {
+    return;
+  }
+  pthread_mutex_lock(&manifest->mutex);
+  manifest->stopping = 1;
+  pthread_cond_signal(&manifest->wake);
+  pthread_mutex_unlock(&manifest->mutex);
+  pthread_join(manifest->flusher, NULL);
+
+  if (hash_manifest_flush(manifest) != 0) {
+    ERROR_MSG("[HASH_MANIFEST] Lost %zu buffered hash records of %s",
+              manifest->n_batch, manifest->prefix);
+  }
+
+  HashManifestEntry *entry, *tmp;
+  HASH_ITER(hh, manifest->entries, entry, tmp) {
+    HASH_DEL(manifest->entries, entry);
+    free_entry(entry);
+  }
+  free(manifest->batch);
+  pthread_cond_destroy(&manifest->wake);
+  pthread_mutex_destroy(&manifest->flush_mutex);
+  pthread_mutex_destroy(&manifest->mutex);
+  manifest_anchor_destroy(manifest->anchor);
+  free(manifest->prefix);
+  free(manifest);
+}
+
+/**
+ * @brief Buffer a record for a key (value NULL: tombstone)
+ */
+static int manifest_record(HashManifest *manifest, const char *key,
+                           const char *value) {
+  const size_t key_len = key ? strlen(key) : 0;
+  if (!manifest || !key || key_len == 0 || key_len > UINT16_MAX ||
+      (value && strlen(value) != manifest->value_size)) {
+    return -1;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&manifest->mutex);
+  HashManifestEntry *entry = NULL;
+  if (value) {
+    entry = entry_for(manifest, key, key_len);
+  } else {
+    HASH_FIND(hh, manifest->entries, key, key_len, entry);
+    if (!entry) {
+      // nothing stored for the key: no tombstone needed
+      pthread_mutex_unlock(&manifest->mutex);
+      return 0;
+    }
+  }
+  if (!entry || batch_push(manifest, entry, &now) != 0) {
+    pthread_mutex_unlock(&manifest->mutex);
+    return -1;
+  }
+
+  entry->generation++;
+  entry->buffered = 1;
+  entry->removed = value == NULL;
+  memset(entry->value, 0, sizeof(entry->value));
+  if (value) {
+    memcpy(entry->value, value, manifest->value_size);
+  }
+  pthread_mutex_unlock(&manifest->mutex);
+  return 0;
+}
+
+/**
+ * @brief Record the value of a key (the hash of a file)
+ *
+ * @param manifest -> manifest store
+ * @param key      -> hash path of the file
+ * @param value    -> hex digest, exactly value_size characters
+ * @return int     -> 0 on success, -1 on error
+ */
+int hash_manifest_put(HashManifest *manifest, const char *key,
+                      const char *value) {
+  if (!value) {
+    return -1;
+  }
+  return manifest_record(manifest, key, value);
+}
+
+/**
+ * @brief Record that a key was removed (the file was unlinked)
+ *
+ * @param manifest -> manifest store
+ * @param key      -> hash path of the file
+ * @return int     -> 0 on success, -1 on error
+ */
+int hash_manifest_remove(HashManifest *manifest, const char *key) {
+  return manifest_record(manifest, key, NULL);
+}
+
+/**
+ * @brief Check whether a key has a value (buffered or stored)
+ *
+ * @param manifest -> manifest store (NULL: never)
+ * @param key      -> hash path of the file
+ * @return int     -> 1 if the key has a value, 0 otherwise
+ */
+int hash_manifest_contains(HashManifest *manifest, const char *key) {
+  if (!manifest || !key) {
+    return 0;
+  }
+  pthread_mutex_lock(&manifest->mutex);
+  HashManifestEntry *entry = NULL;
+  HASH_FIND(hh, manifest->entries, key, strlen(key), entry);
+  int found = entry && !entry->removed && (entry->buffered || entry->stored);
+  pthread_mutex_unlock(&manifest->mutex);
+  return found;
+}
+
+/**
+ * @brief Check whether the latest record of a key is still to be written
+ *
+ * @param manifest -> manifest store (NULL: never)
+ * @param key      -> hash path of the file
+ * @return int     -> 1 if a flush has yet to write it, 0 otherwise
+ */
+int hash_manifest_buffered(HashManifest *manifest, const char *key) {
+  if (!manifest || !key) {
+    return 0;
+  }
+  pthread_mutex_lock(&manifest->mutex);
+  HashManifestEntry *entry = NULL;
+  HASH_FIND(hh, manifest->entries, key, strlen(key), entry);
+  int buffered = entry && entry->buffered;
+  pthread_mutex_unlock(&manifest->mutex);
+  return buffered;
+}
+
+/**
+ * @brief Get the latest value of a key
+ *
+ * Buffered values are returned from memory, stored ones are read from their
+ * manifest at the indexed offset, and checked against the anchored root of
+ * the manifest when it is anchored.
+ *
+ * @param manifest   -> manifest store
+ * @param key        -> hash path of the file
+ * @param value      -> output, null-terminated
+ * @param value_size -> size of value, at least the store value_size + 1
+ * @return ssize_t   -> length of the value, 0 if the key has no value, -1 on
+ * error
+ */
+ssize_t hash_manifest_get(HashManifest *manifest, const char *key, char *value,
+                          size_t value_size) {
+  if (!manifest || !key || !value || value_size < manifest->value_size + 1) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&manifest->mutex);
+  HashManifestEntry *entry = NULL;
+  HASH_FIND(hh, manifest->entries, key, strlen(key), entry);
+  if (!entry || entry->removed || (!entry->buffered && !entry->stored)) {
+    pthread_mutex_unlock(&manifest->mutex);
+    return 0;
+  }
+  if (entry->buffered) {
+    memcpy(value, entry->value, manifest->value_size);
+    value[manifest->value_size] = '\0';
+    pthread_mutex_unlock(&manifest->mutex);
+    return (ssize_t)manifest->value_size;
+  }
+  const size_t seq = entry->manifest;
+  const size_t index = entry->index;
+  const off_t offset = entry->offset;
+  pthread_mutex_unlock(&manifest->mutex);
+
+  // manifests are never rewritten: read without the mutex
+  char *path = manifest_pathname(manifest, seq);
+  if (!path) {
+    return -1;
+  }
+  int fd = manifest->hash_layer.ops->lopen(path, O_RDONLY, 0644,
+                                           manifest->hash_layer);
+  free(path);
+  if (fd < 0) {
+    return -1;
+  }
+  size_t done = 0;
+  while (done < manifest->value_size) {
+    ssize_t r = manifest->hash_layer.ops->lpread(
+        fd, value + done, manifest->value_size - done, offset + (off_t)done,
+        manifest->hash_layer);
+    if (r <= 0) {
+      break;
+    }
+    done += (size_t)r;
+  }
+  manifest->hash_layer.ops->lclose(fd, manifest->hash_layer);
+  if (done != manifest->value_size) {
+    return -1;
+  }
+  if (manifest->anchor &&
+      manifest_anchor_verify(manifest->anchor, seq, index, key, strlen(key),
+                             0, value, done) != 1) {
+    ERROR_MSG("[HASH_MANIFEST] Hash record of %s in manifest %zu does not "
+              "match its anchored root",
+              key, seq);
+    return -1;
+  }
+  value[done] = '\0';
+  return (ssize_t)done;
+}
+
+/**
+ * @brief Write the buffered records as one new manifest
+ *
+ * Records put while the manifest is being written go to the next one. On
+ * error the records stay buffered and are retried by the next flush.
+ *
+ * @param manifest -> manifest store
+ * @return int     -> 0 on success (or nothing to flush), -1 on error
+ */
+int hash_manifest_flush(HashManifest *manifest) {
+  if (!manifest) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&manifest->flush_mutex);
+  pthread_mutex_lock(&manifest->mutex);
+  const size_t n = manifest->n_batch;
+  if (n == 0) {
+    pthread_mutex_unlock(&manifest->mutex);
+    pthread_mutex_unlock(&manifest->flush_mutex);
+    return 0;
+  }
+
+  size_t size = sizeof(HashManifestHeader);
+  for (size_t i = 0; i < n; i++) {
+    size += sizeof(HashManifestRecord) + strlen(manifest->batch[i]->key) +
+            manifest->value_size;
+  }
+  uint8_t *buffer = malloc(size);
+  size_t *generations = malloc(n * sizeof(size_t));
+  off_t *offsets = malloc(n * sizeof(off_t));
+  if (!buffer || !generations || !offsets) {
+    free(buffer);
+    free(generations);
+    free(offsets);
+    pthread_mutex_unlock(&manifest->mutex);
+    pthread_mutex_unlock(&manifest->flush_mutex);
+    return -1;
+  }
+
+  // take the batch: later records start the next one
+  HashManifestEntry **batch = manifest->batch;
+  manifest->batch = NULL;
+  manifest->n_batch = 0;
+  manifest->batch_capacity = 0;
+
+  HashManifestHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, HASH_MANIFEST_MAGIC, 4);
+  header.version = HASH_MANIFEST_VERSION;
+  header.value_size = (uint32_t)manifest->value_size;
+  header.count = n;
+  memcpy(buffer, &header, sizeof(header));
+
+  size_t pos = sizeof(header);
+  for (size_t i = 0; i < n; i++) {
+    HashManifestEntry *entry = batch[i];
+    HashManifestRecord record;
+    const size_t key_len = strlen(entry->key);
+    record.key_len = (uint16_t)key_len;
+    record.flags = entry->removed ? HASH_MANIFEST_TOMBSTONE : 0;
+    record.reserved = 0;
+    memcpy(buffer + pos, &record, sizeof(record));
+    pos += sizeof(record);
+    memcpy(buffer + pos, entry->key, key_len);
+    pos += key_len;
+    offsets[i] = (off_t)pos;
+    memcpy(buffer + pos, entry->value, manifest->value_size);
+    pos += manifest->value_size;
+    generations[i] = entry->generation;
+    entry->queued = 0;
+  }
+  const size_t seq = manifest->next_manifest;
+  pthread_mutex_unlock(&manifest->mutex);
+
+  int res = write_manifest(manifest, seq, buffer, size);
+  if (res == 0 && manifest->anchor) {
+    // published once its root is anchored
+    res = manifest_anchor_publish(manifest->anchor, seq, buffer, size);
+  }
+
+  pthread_mutex_lock(&manifest->mutex);
+  if (res == 0) {
+    manifest->next_manifest = seq + 1;
+    manifest->flushed_manifests++;
+    manifest->flushed_records += n;
+    for (size_t i = 0; i < n; i++) {
+      HashManifestEntry *entry = batch[i];
+      entry->stored = 1;
+      entry->manifest = seq;
+      entry->index = i;
+      entry->offset = offsets[i];
+      if (entry->generation != generations[i]) {
+        continue; // superseded while writing: still buffered
+      }
+      entry->buffered = 0;
+      if (entry->removed) {
+        HASH_DEL(manifest->entries, entry);
+        free_entry(entry);
+      }
+    }
+  } else {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (size_t i = 0; i < n; i++) {
+      if (batch_push(manifest, batch[i], &now) != 0) {
+        ERROR_MSG("[HASH_MANIFEST] Dropped the buffered hash record of %s",
+                  batch[i]->key);
+        batch[i]->buffered = 0;
+      }
+    }
+  }
+  pthread_mutex_unlock(&manifest->mutex);
+  pthread_mutex_unlock(&manifest->flush_mutex);
+
+  free(batch);
+  free(buffer);
+  free(generations);
+  free(offsets);
+  return res;
+}
@@ -0,0 +1,123 @@
+#ifndef __HASH_MANIFEST_H__
+#define __HASH_MANIFEST_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include "../../shared/types/layer_context.h"
+#include "../../shared/utils/hasher/hasher.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * ============================================================================
+ * HASH MANIFEST - BATCHED FILE-MODE HASH PUBLICATION
+ * ============================================================================
+ *
+ * Instead of one hash object per file, the hashes stored on close are
+ * buffered and written to the hash layer as one manifest object per batch,
+ * once max_records records are buffered or the oldest buffered record is
+ * flush_interval_ms old. Manifests are named "<prefix>/manifest-<seq>" with
+ * consecutive sequence numbers and are never rewritten.
+ *
+ * An in-memory index maps each key (the hash path of a file) to the manifest
+ * and offset of its latest record, or to its buffered value until that is
+ * written. The index is rebuilt at init by replaying the manifests in order.
+ *
+ * Buffered records are lost on a crash: the next open of those files sees
+ * their previous hash (or none) and reports a mismatch.
+ *
+ * With an anchor layer, every manifest is also anchored (manifest_anchor.h):
+ * a flush succeeds once the Merkle root of its records is written to the
+ * anchor layer, and a stored value is only returned if it leads to that
+ * root. At init, a last manifest without a root is dropped (it was not
+ * published), and a root past the last manifest fails the load: manifests
+ * were removed from the hash layer.
+ * ============================================================================
+ */
+
+#define HASH_MANIFEST_MAGIC "TGHM"
+#define HASH_MANIFEST_VERSION 1
+#define HASH_MANIFEST_TOMBSTONE 0x1 // record flag: the key was removed
+
+/**
+ * @brief Header of a manifest object
+ *
+ * The header is followed by count records, each a HashManifestRecord, then
+ * key_len bytes of key, then value_size bytes of value (zero for tombstones).
+ */
+typedef struct {
+  char magic[4];       // HASH_MANIFEST_MAGIC
+  uint32_t version;    // HASH_MANIFEST_VERSION
+  uint32_t value_size; // size of each value in bytes (hex digest length)
+  uint32_t reserved;   // zero
+  uint64_t count;      // number of records
+} HashManifestHeader;
+
+typedef struct {
+  uint16_t key_len; // key length in bytes, not null-terminated
+  uint8_t flags;    // HASH_MANIFEST_TOMBSTONE
+  uint8_t reserved; // zero
+} HashManifestRecord;
+
+typedef struct HashManifestEntry {
+  char *key;                       // hash path of the file
+  char value[HASHER_MAX_HEX_SIZE]; // latest value while buffered
+  int buffered;                    // latest record not written yet
+  int queued;                      // in the batch of the next flush
+  int removed;                     // latest record is a tombstone
+  int stored;                      // manifest and offset are valid
+  size_t generation;               // bumped on every put or remove
+  size_t manifest;                 // manifest holding the latest stored record
+  size_t index;                    // record index in that manifest
+  off_t offset;                    // value offset in that manifest
+  UT_hash_handle hh;
+} HashManifestEntry;
+
+struct ManifestAnchor;
+
+typedef struct HashManifest {
+  LayerContext hash_layer;     // layer the manifests are written to
+  char *prefix;                // manifest directory
+  size_t value_size;           // hex digest length
+  size_t max_records;          // flush once this many records are buffered
+  long flush_interval_ms;      // flush once the oldest record is this old
+  HashManifestEntry *entries;  // index by key
+  HashManifestEntry **batch;   // records of the next flush, in put order
+  size_t n_batch;              // number of records in batch
+  size_t batch_capacity;       // allocated slots of batch
+  struct timespec batch_start; // monotonic time of the oldest batch record
+  size_t next_manifest;        // sequence number of the next manifest
+  size_t flushed_manifests;    // manifests written since init
+  size_t flushed_records;      // records written since init
+  int stopping;                // set by destroy, flusher exits
+  pthread_t flusher;           // background flush thread
+  pthread_mutex_t mutex;       // protects all the fields above
+  pthread_mutex_t flush_mutex; // serializes flushes
+  pthread_cond_t wake;         // signalled on first record, full batch, stop
+
+  struct ManifestAnchor *anchor; // roots of the manifests, or NULL
+} HashManifest;
+
+HashManifest *hash_manifest_init(LayerContext hash_layer, const char *prefix,
+                                 size_t value_size, size_t max_records,
+                                 long flush_interval_ms);
+HashManifest *hash_manifest_init_anchored(LayerContext hash_layer,
+                                          LayerContext anchor_layer,
+                                          const Hasher *hasher,
+                                          const char *prefix,
+                                          size_t value_size,
+                                          size_t max_records,
+                                          long flush_interval_ms);
+void hash_manifest_destroy(HashManifest *manifest);
+int hash_manifest_put(HashManifest *manifest, const char *key,
+                      const char *value);
+int hash_manifest_remove(HashManifest *manifest, const char *key);
+int hash_manifest_contains(HashManifest *manifest, const char *key);
+int hash_manifest_buffered(HashManifest *manifest, const char *key);
+ssize_t hash_manifest_get(HashManifest *manifest, const char *key, char *value,
+                          size_t value_size);
+int hash_manifest_flush(HashManifest *manifest);
+
+#endif // __HASH_MANIFEST_H__
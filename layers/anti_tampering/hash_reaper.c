@@ -0,0 +1,619 @@
+#include "hash_reaper.h"
+
+#include "../../logdef.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * The journal is a text file of one record a line, hash paths having no
+ * newline nor tab (they are built from the hashes_storage and a hex digest):
+ *
+ *   R <hash_path>             removal queued
+ *   M <hash_path>\t<target>   move queued
+ *   D <hash_path>             entry of hash_path done
+ *
+ * It is truncated whenever nothing is pending, and rewritten with the
+ * entries left undone on init.
+ */
+
+static inline double elapsed_ms(const struct timespec *from,
+                                const struct timespec *to) {
+  return ((double)(to->tv_sec - from->tv_sec) * 1000.0) +
+         ((double)(to->tv_nsec - from->tv_nsec) / 1e6);
+}
+
+static void free_entry(HashReaperEntry *entry) {
+  free(entry->hash_path);
+  free(entry->target);
+  free(entry);
+}
+
+/**
+ * @brief Append an entry to the reap order (mutex held)
+ */
+static void push_entry(HashReaper *reaper, HashReaperEntry *entry) {
+  entry->next = NULL;
+  entry->prev = reaper->tail;
+  if (reaper->tail) {
+    reaper->tail->next = entry;
+  } else {
+    reaper->head = entry;
+  }
+  reaper->tail = entry;
+}
+
+/**
+ * @brief Take an entry out of the reap order (mutex held)
+ */
+static void unlink_entry(HashReaper *reaper, HashReaperEntry *entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    reaper->head = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    reaper->tail = entry->prev;
+  }
+  entry->prev = entry->next = NULL;
+}
+
+/**
+ * @brief Write whole records to the journal
+ *
+ * @return int -> 0, or -1 if the journal could not be written
+ */
+static int journal_write(HashReaper *reaper, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(reaper->journal_fd, buf, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+/**
+ * @brief Append the tombstone of a new entry (mutex held)
+ */
+static int journal_queued(HashReaper *reaper, const HashReaperEntry *entry) {
+  if (reaper->journal_fd < 0) {
+    return 0;
+  }
+  size_t len = strlen(entry->hash_path) +
+               (entry->target ? strlen(entry->target) + 1 : 0) + 4;
+  char *record = malloc(len);
+  if (!record) {
+    return -1;
+  }
+  if (entry->target) {
+    snprintf(record, len, "M %s\t%s\n", entry->hash_path, entry->target);
+  } else {
+    snprintf(record, len, "R %s\n", entry->hash_path);
+  }
+  int res = journal_write(reaper, record, strlen(record));
+  free(record);
+  return res;
+}
+
+/**
+ * @brief Record entries as done, or empty the journal if nothing else is
+ * pending (mutex held)
+ */
+static void journal_done(HashReaper *reaper, HashReaperEntry **entries,
+                         size_t n) {
+  if (reaper->journal_fd < 0) {
+    return;
+  }
+  size_t others = HASH_COUNT(reaper->pending) - n;
+  if (others == 0) {
+    if (ftruncate(reaper->journal_fd, 0) != 0) {
+      ERROR_MSG("[ANTI_TAMPERING_HASH_REAPER] Failed to truncate the "
+                "journal");
+    }
+    return;
+  }
+  size_t len = 1;
+  for (size_t i = 0; i < n; i++) {
+    len += strlen(entries[i]->hash_path) + 3;
+  }
+  char *records = malloc(len);
+  size_t off = 0;
+  for (size_t i = 0; records && i < n; i++) {
+    off += (size_t)snprintf(records + off, len - off, "D %s\n",
+                            entries[i]->hash_path);
+  }
+  if (!records || journal_write(reaper, records, off) != 0) {
+    // the entries are run again after a crash, which they survive
+    ERROR_MSG("[ANTI_TAMPERING_HASH_REAPER] Failed to journal %zu reaped "
+              "hash paths",
+              n);
+  }
+  free(records);
+}
+
+/**
+ * @brief Account for a finished entry and free it (mutex held, the entry is
+ * out of the reap order)
+ */
+static void finish_entry(HashReaper *reaper, HashReaperEntry *entry, int res,
+                         const struct timespec *now) {
+  HashReaperStats *stats = &reaper->stats;
+  if (res < 0) {
+    stats->failed++;
+    ERROR_MSG("[ANTI_TAMPERING_HASH_REAPER] Failed to %s hash file %s",
+              entry->target ? "move" : "remove", entry->hash_path);
+  }
+  stats->reaped++;
+  const double lag = elapsed_ms(&entry->enqueued, now);
+  if (lag > stats->max_lag_ms) {
+    stats->max_lag_ms = lag;
+  }
+  HASH_DELETE(hh, reaper->pending, entry);
+  if (entry->target) {
+    HASH_DELETE(hh_target, reaper->by_target, entry);
+  }
+  free_entry(entry);
+  stats->queue_depth--;
+}
+
+/**
+ * @brief Pending entry that removes or moves a hash path, or moves another
+ * one onto it (mutex held)
+ */
+static HashReaperEntry *find_entry(HashReaper *reaper, const char *hash_path) {
+  HashReaperEntry *entry = NULL;
+  size_t len = strlen(hash_path);
+  HASH_FIND(hh, reaper->pending, hash_path, len, entry);
+  if (!entry) {
+    HASH_FIND(hh_target, reaper->by_target, hash_path, len, entry);
+  }
+  return entry;
+}
+
+/**
+ * @brief Run the pending entries of a hash path in the calling thread, or
+ * wait for the reaper running them (mutex held, released while running)
+ */
+static void claim_locked(HashReaper *reaper, const char *hash_path) {
+  HashReaperEntry *entry;
+  while ((entry = find_entry(reaper, hash_path)) != NULL) {
+    if (entry->running) {
+      pthread_cond_wait(&reaper->done, &reaper->mutex);
+      continue;
+    }
+    unlink_entry(reaper, entry);
+    entry->running = 1;
+    pthread_mutex_unlock(&reaper->mutex);
+
+    // the entry is not freed while running: paths stay valid unlocked
+    int res = reaper->reap(reaper->arg, entry->hash_path, entry->target);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&reaper->mutex);
+    reaper->stats.claimed++;
+    journal_done(reaper, &entry, 1);
+    finish_entry(reaper, entry, res, &now);
+    pthread_cond_broadcast(&reaper->done);
+  }
+}
+
+/**
+ * @brief Reaper thread: reaps queued entries, a batch at a time, until
+ * stopped and drained
+ */
+static void *reaper_worker(void *arg) {
+  HashReaper *reaper = arg;
+  HashReaperEntry *batch[HASH_REAPER_BATCH];
+  int results[HASH_REAPER_BATCH];
+
+  pthread_mutex_lock(&reaper->mutex);
+  for (;;) {
+    while (!reaper->head && !reaper->stopping) {
+      pthread_cond_wait(&reaper->work, &reaper->mutex);
+    }
+    size_t n = 0;
+    while (reaper->head && n < HASH_REAPER_BATCH) {
+      HashReaperEntry *entry = reaper->head;
+      unlink_entry(reaper, entry);
+      entry->running = 1;
+      batch[n++] = entry;
+    }
+    if (n == 0) {
+      break; // stopping and nothing left to reap
+    }
+    reaper->stats.batches++;
+    pthread_mutex_unlock(&reaper->mutex);
+
+    for (size_t i = 0; i < n; i++) {
+      results[i] = reaper->reap(reaper->arg, batch[i]->hash_path,
+                                batch[i]->target);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&reaper->mutex);
+    journal_done(reaper, batch, n);
+    for (size_t i = 0; i < n; i++) {
+      finish_entry(reaper, batch[i], results[i], &now);
+    }
+    pthread_cond_broadcast(&reaper->done);
+  }
+  pthread_mutex_unlock(&reaper->mutex);
+  return NULL;
+}
+
+/**
+ * @brief Create an entry and add it to the tables and the reap order (mutex
+ * held, no worker running or the paths claimed)
+ */
+static HashReaperEntry *add_entry(HashReaper *reaper, const char *hash_path,
+                                  const char *target) {
+  HashReaperEntry *entry = calloc(1, sizeof(HashReaperEntry));
+  if (entry) {
+    entry->hash_path = strdup(hash_path);
+    entry->target = target ? strdup(target) : NULL;
+  }
+  if (!entry || !entry->hash_path || (target && !entry->target)) {
+    if (entry) {
+      free_entry(entry);
+    }
+    return NULL;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &entry->enqueued);
+  HASH_ADD_KEYPTR(hh, reaper->pending, entry->hash_path,
+                  strlen(entry->hash_path), entry);
+  if (entry->target) {
+    HASH_ADD_KEYPTR(hh_target, reaper->by_target, entry->target,
+                    strlen(entry->target), entry);
+  }
+  push_entry(reaper, entry);
+
+  HashReaperStats *stats = &reaper->stats;
+  stats->queue_depth++;
+  if (stats->queue_depth > stats->max_queue_depth) {
+    stats->max_queue_depth = stats->queue_depth;
+  }
+  return entry;
+}
+
+/**
+ * @brief Drop a pending entry that was never run (mutex held)
+ */
+static void drop_entry(HashReaper *reaper, HashReaperEntry *entry) {
+  unlink_entry(reaper, entry);
+  HASH_DELETE(hh, reaper->pending, entry);
+  if (entry->target) {
+    HASH_DELETE(hh_target, reaper->by_target, entry);
+  }
+  free_entry(entry);
+  reaper->stats.queue_depth--;
+}
+
+/**
+ * @brief Queue the entries of the journal left undone and rewrite it with
+ * them only (before the worker starts)
+ *
+ * @return int -> 0, or -1 if the journal could not be read or rewritten
+ */
+static int journal_replay(HashReaper *reaper) {
+  struct stat st;
+  if (fstat(reaper->journal_fd, &st) != 0) {
+    return -1;
+  }
+  char *data = malloc((size_t)st.st_size + 1);
+  if (!data) {
+    return -1;
+  }
+  size_t len = 0;
+  while (len < (size_t)st.st_size) {
+    ssize_t n = pread(reaper->journal_fd, data + len, (size_t)st.st_size - len,
+                      (off_t)len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    len += (size_t)n;
+  }
+  data[len] = '\0';
+
+  // a record cut by a crash has no newline, and its queuing did not return
+  char *line = data;
+  char *end;
+  while ((end = strchr(line, '\n')) != NULL) {
+    *end = '\0';
+    if (strlen(line) > 2 && line[1] == ' ') {
+      char *hash_path = line + 2;
+      char *target = NULL;
+      if (line[0] == 'M' && (target = strchr(hash_path, '\t')) != NULL) {
+        *target++ = '\0';
+      }
+      // an entry is queued once the ones of its paths are done
+      HashReaperEntry *entry = NULL;
+      HASH_FIND(hh, reaper->pending, hash_path, strlen(hash_path), entry);
+      if (!entry && line[0] != 'D') {
+        entry = find_entry(reaper, hash_path);
+      }
+      if (entry) {
+        drop_entry(reaper, entry);
+      }
+      if (target && (entry = find_entry(reaper, target)) != NULL) {
+        drop_entry(reaper, entry);
+      }
+      if ((line[0] == 'R' || (line[0] == 'M' && target)) &&
+          !add_entry(reaper, hash_path, target)) {
+        free(data);
+        return -1;
+      }
+    }
+    line = end + 1;
+  }
+  free(data);
+
+  if (ftruncate(reaper->journal_fd, 0) != 0) {
+    return -1;
+  }
+  for (HashReaperEntry *entry = reaper->head; entry; entry = entry->next) {
+    if (journal_queued(reaper, entry) != 0) {
+      return -1;
+    }
+    reaper->stats.replayed++;
+  }
+  return 0;
+}
+
+/**
+ * @brief Free the entries and close the journal of a reaper without a worker
+ */
+static void free_reaper(HashReaper *reaper) {
+  HashReaperEntry *entry, *tmp;
+  HASH_ITER(hh, reaper->pending, entry, tmp) {
+    HASH_DELETE(hh, reaper->pending, entry);
+    if (entry->target) {
+      HASH_DELETE(hh_target, reaper->by_target, entry);
+    }
+    free_entry(entry);
+  }
+  if (reaper->journal_fd >= 0) {
+    close(reaper->journal_fd);
+  }
+  free(reaper);
+}
+
+/**
+ * @brief Create a reaper, queue the entries its journal left undone and
+ * start its thread
+ *
+ * @param reap         -> callback removing or moving a hash path
+ * @param arg          -> argument passed to the callback
+ * @param journal_path -> local file of the tombstones, or NULL for none
+ * @return HashReaper* -> reaper, or NULL on error
+ */
+HashReaper *hash_reaper_init(hash_reap_fn reap, void *arg,
+                             const char *journal_path) {
+  if (!reap) {
+    return NULL;
+  }
+  HashReaper *reaper = calloc(1, sizeof(HashReaper));
+  if (!reaper) {
+    return NULL;
+  }
+  reaper->reap = reap;
+  reaper->arg = arg;
+  reaper->journal_fd = -1;
+
+  if (journal_path) {
+    reaper->journal_fd =
+        open(journal_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (reaper->journal_fd < 0 || journal_replay(reaper) != 0) {
+      ERROR_MSG("[ANTI_TAMPERING_HASH_REAPER] Failed to replay the journal "
+                "%s",
+                journal_path);
+      free_reaper(reaper);
+      return NULL;
+    }
+  }
+
+  if (pthread_mutex_init(&reaper->mutex, NULL) != 0) {
+    free_reaper(reaper);
+    return NULL;
+  }
+  if (pthread_cond_init(&reaper->work, NULL) != 0) {
+    pthread_mutex_destroy(&reaper->mutex);
+    free_reaper(reaper);
+    return NULL;
+  }
+  if (pthread_cond_init(&reaper->done, NULL) != 0) {
+    pthread_cond_destroy(&reaper->work);
+    pthread_mutex_destroy(&reaper->mutex);
+    free_reaper(reaper);
+    return NULL;
+  }
+  if (pthread_create(&reaper->worker, NULL, reaper_worker, reaper) != 0) {
+    pthread_cond_destroy(&reaper->done);
+    pthread_cond_destroy(&reaper->work);
+    pthread_mutex_destroy(&reaper->mutex);
+    free_reaper(reaper);
+    return NULL;
+  }
+  return reaper;
+}
+
+/**
+ * @brief Reap everything still pending, stop the thread and free the reaper
+ *
+ * @param reaper -> reaper to destroy (may be NULL)
+ */
+void hash_reaper_destroy(HashReaper *reaper) {
+  if (!reaper) {
+    return;
+  }
+  pthread_mutex_lock(&reaper->mutex);
+  reaper->stopping = 1;
+  pthread_cond_signal(&reaper->work);
+  pthread_mutex_unlock(&reaper->mutex);
+  pthread_join(reaper->worker, NULL);
+
+  pthread_cond_destroy(&reaper->done);
+  pthread_cond_destroy(&reaper->work);
+  pthread_mutex_destroy(&reaper->mutex);
+  free_reaper(reaper);
+}
+
+/**
+ * @brief Queue an entry, after claiming the paths it touches
+ */
+static int enqueue(HashReaper *reaper, const char *hash_path,
+                   const char *target) {
+  if (!reaper || !hash_path || strpbrk(hash_path, "\t\n") ||
+      (target && strpbrk(target, "\t\n"))) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&reaper->mutex);
+  if (reaper->stopping) {
+    pthread_mutex_unlock(&reaper->mutex);
+    return -1;
+  }
+  claim_locked(reaper, hash_path);
+  if (target) {
+    claim_locked(reaper, target);
+  }
+
+  HashReaperEntry *entry = add_entry(reaper, hash_path, target);
+  if (!entry) {
+    pthread_mutex_unlock(&reaper->mutex);
+    return -1;
+  }
+  if (journal_queued(reaper, entry) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_HASH_REAPER] Failed to journal hash file %s",
+              hash_path);
+    drop_entry(reaper, entry);
+    pthread_mutex_unlock(&reaper->mutex);
+    return -1;
+  }
+  if (target) {
+    reaper->stats.moves++;
+  } else {
+    reaper->stats.removals++;
+  }
+  pthread_cond_signal(&reaper->work);
+  pthread_mutex_unlock(&reaper->mutex);
+  return 0;
+}
+
+/**
+ * @brief Schedule the removal of the hash of an unlinked file
+ *
+ * @param reaper    -> reaper
+ * @param hash_path -> hash layer path to remove
+ * @return int      -> 0 if the removal is pending, -1 on error (the caller
+ * must remove it synchronously)
+ */
+int hash_reaper_remove(HashReaper *reaper, const char *hash_path) {
+  return enqueue(reaper, hash_path, NULL);
+}
+
+/**
+ * @brief Schedule the move of the hash of a renamed file
+ *
+ * @param reaper    -> reaper
+ * @param hash_path -> hash layer path of the hash of the old name
+ * @param target    -> hash layer path of the hash of the new name
+ * @return int      -> 0 if the move is pending, -1 on error (the caller must
+ * move it synchronously)
+ */
+int hash_reaper_move(HashReaper *reaper, const char *hash_path,
+                     const char *target) {
+  if (!target) {
+    return -1;
+  }
+  if (hash_path && strcmp(hash_path, target) == 0) {
+    return 0;
+  }
+  return enqueue(reaper, hash_path, target);
+}
+
+/**
+ * @brief Finish the removal or move pending on a hash path before it is used
+ *
+ * Runs the pending entry in the calling thread, or waits for the reaper to
+ * finish it.
+ *
+ * @param reaper    -> reaper (NULL: no-op)
+ * @param hash_path -> hash layer path about to be read or written
+ */
+void hash_reaper_claim(HashReaper *reaper, const char *hash_path) {
+  if (!reaper || !hash_path) {
+    return;
+  }
+  pthread_mutex_lock(&reaper->mutex);
+  claim_locked(reaper, hash_path);
+  pthread_mutex_unlock(&reaper->mutex);
+}
+
+/**
+ * @brief Check whether an entry of a hash path is queued or running
+ *
+ * @param reaper    -> reaper (NULL: never pending)
+ * @param hash_path -> hash layer path, as a source or a target
+ * @return int      -> 1 if pending, 0 otherwise
+ */
+int hash_reaper_pending(HashReaper *reaper, const char *hash_path) {
+  if (!reaper || !hash_path) {
+    return 0;
+  }
+  pthread_mutex_lock(&reaper->mutex);
+  int pending = find_entry(reaper, hash_path) != NULL;
+  pthread_mutex_unlock(&reaper->mutex);
+  return pending;
+}
+
+/**
+ * @brief Wait until every pending entry is done
+ *
+ * @param reaper -> reaper (NULL: no-op)
+ */
+void hash_reaper_flush(HashReaper *reaper) {
+  if (!reaper) {
+    return;
+  }
+  pthread_mutex_lock(&reaper->mutex);
+  while (reaper->pending) {
+    pthread_cond_wait(&reaper->done, &reaper->mutex);
+  }
+  pthread_mutex_unlock(&reaper->mutex);
+}
+
+/**
+ * @brief Snapshot of the queue depth and lag metrics
+ *
+ * @param reaper -> reaper (NULL: all zero)
+ * @param stats  -> output
+ */
+void hash_reaper_get_stats(HashReaper *reaper, HashReaperStats *stats) {
+  if (!stats) {
+    return;
+  }
+  if (!reaper) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  pthread_mutex_lock(&reaper->mutex);
+  *stats = reaper->stats;
+  pthread_mutex_unlock(&reaper->mutex);
+}
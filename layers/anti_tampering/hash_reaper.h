@@ -0,0 +1,96 @@
+#ifndef __HASH_REAPER_H__
+#define __HASH_REAPER_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * ============================================================================
+ * HASH REAPER - DEFERRED HASH REMOVAL ON UNLINK AND MOVE ON RENAME
+ * ============================================================================
+ *
+ * Unlinks and renames hand the hash paths of the file to a background reaper
+ * thread, which removes or moves them in the hash layer, so the caller does
+ * not wait for a (possibly remote) hash layer delete.
+ *
+ * - The reaper takes up to HASH_REAPER_BATCH entries at a time, in the order
+ *   they were queued, and journals their completion with one write.
+ * - A hash path is in at most one pending entry: queuing a path that is
+ *   pending, as the source or the target of a move, first claims it.
+ * - Claiming a path runs its pending entry in the caller (or waits for the
+ *   reaper running it), so a file created or opened again at the path never
+ *   sees the hash of the file that was unlinked or renamed.
+ * - With a journal, every entry is appended to it as a tombstone before its
+ *   queuing returns, and the entries a crash left undone are queued again on
+ *   init: a leftover hash is never taken for the hash of a new file.
+ * ============================================================================
+ */
+
+#define HASH_REAPER_BATCH 64 // entries run between two journal writes
+
+/**
+ * @brief Reap callback, run by the reaper thread or a claiming caller
+ *
+ * @param arg       -> argument given to hash_reaper_init
+ * @param hash_path -> hash layer path to remove, or to move
+ * @param target    -> hash layer path to move hash_path to, NULL to remove
+ * @return int      -> 0 on success (a missing hash_path included), negative
+ * on error
+ */
+typedef int (*hash_reap_fn)(void *arg, const char *hash_path,
+                            const char *target);
+
+typedef struct HashReaperEntry {
+  char *hash_path;              // key
+  char *target;                 // key of by_target, NULL for a removal
+  int running;                  // being reaped by the worker or a claim
+  struct timespec enqueued;     // monotonic time it was queued
+  struct HashReaperEntry *prev; // previous entry in reap order
+  struct HashReaperEntry *next; // next entry in reap order
+  UT_hash_handle hh;            // pending by hash_path
+  UT_hash_handle hh_target;     // pending moves by target
+} HashReaperEntry;
+
+typedef struct {
+  size_t queue_depth;     // entries queued or being reaped
+  size_t max_queue_depth; // highest queue_depth seen
+  size_t removals;        // removals queued
+  size_t moves;           // moves queued
+  size_t claimed;         // entries run by a caller rather than the reaper
+  size_t replayed;        // entries queued again from the journal on init
+  size_t reaped;          // entries done
+  size_t failed;          // entries whose callback returned an error
+  size_t batches;         // batches taken by the reaper
+  double max_lag_ms;      // queuing to completion, worst entry
+} HashReaperStats;
+
+typedef struct HashReaper {
+  HashReaperEntry *pending;   // pending entries by hash_path
+  HashReaperEntry *by_target; // pending moves by target
+  HashReaperEntry *head;      // next entry to reap (not running)
+  HashReaperEntry *tail;      // last entry to reap
+  hash_reap_fn reap;          // reap callback
+  void *arg;                  // reap callback argument
+  int journal_fd;             // tombstone journal, -1 without
+  HashReaperStats stats;      // queue depth and lag metrics
+  int stopping;               // set by destroy, worker drains and exits
+  pthread_t worker;           // reaper thread
+  pthread_mutex_t mutex;      // protects all the fields above
+  pthread_cond_t work;        // signalled when an entry is queued or on stop
+  pthread_cond_t done;        // broadcast when entries finish
+} HashReaper;
+
+HashReaper *hash_reaper_init(hash_reap_fn reap, void *arg,
+                             const char *journal_path);
+void hash_reaper_destroy(HashReaper *reaper);
+int hash_reaper_remove(HashReaper *reaper, const char *hash_path);
+int hash_reaper_move(HashReaper *reaper, const char *hash_path,
+                     const char *target);
+void hash_reaper_claim(HashReaper *reaper, const char *hash_path);
+int hash_reaper_pending(HashReaper *reaper, const char *hash_path);
+void hash_reaper_flush(HashReaper *reaper);
+void hash_reaper_get_stats(HashReaper *reaper, HashReaperStats *stats);
+
+#endif // __HASH_REAPER_H__
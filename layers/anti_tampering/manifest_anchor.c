@@ -0,0 +1,410 @@
+#include "manifest_anchor.h"
+
+#include "../../logdef.h"
+#include "../../shared/utils/conversion.h"
+#include "../../shared/utils/hasher/merkle_tree.h"
+#include "hash_manifest.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Path of the root or proof object of a manifest
+ *
+ * @param kind     -> "root" or "proof"
+ * @return char*   -> allocated path, or NULL on error
+ */
+static char *anchor_pathname(const ManifestAnchor *anchor, const char *kind,
+                             size_t seq) {
+  size_t len = strlen(anchor->prefix) + strlen(kind) + 24; // "/-" + digits
+  char *path = malloc(len);
+  if (!path) {
+    return NULL;
+  }
+  (void)snprintf(path, len, "%s/%s-%010zu", anchor->prefix, kind, seq);
+  return path;
+}
+
+/**
+ * @brief Write a whole object to a layer
+ *
+ * @return int -> 0 on success, -1 on error
+ */
+static int write_object(LayerContext layer, const char *path,
+                        const uint8_t *buffer, size_t size) {
+  int fd = layer.ops->lopen(path, O_RDWR | O_CREAT | O_TRUNC, 0644, layer);
+  if (fd < 0) {
+    ERROR_MSG("[MANIFEST_ANCHOR] Failed to create %s", path);
+    return -1;
+  }
+  size_t done = 0;
+  while (done < size) {
+    ssize_t w = layer.ops->lpwrite(fd, buffer + done, size - done,
+                                   (off_t)done, layer);
+    if (w <= 0) {
+      break;
+    }
+    done += (size_t)w;
+  }
+  int close_res = layer.ops->lclose(fd, layer);
+  if (done != size || close_res < 0) {
+    ERROR_MSG("[MANIFEST_ANCHOR] Failed to write %s", path);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Read size bytes at offset of an open object
+ *
+ * @return int -> 0 if they were all read, -1 otherwise
+ */
+static int read_fully(LayerContext layer, int fd, void *buffer, size_t size,
+                      off_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t r = layer.ops->lpread(fd, (uint8_t *)buffer + done, size - done,
+                                  offset + (off_t)done, layer);
+    if (r <= 0) {
+      return -1;
+    }
+    done += (size_t)r;
+  }
+  return 0;
+}
+
+/**
+ * @brief Leaf digest of a manifest record
+ *
+ * @return int -> 0 on success, -1 on error
+ */
+static int leaf_digest(const ManifestAnchor *anchor, const char *key,
+                       size_t key_len, uint8_t flags, const char *value,
+                       size_t value_size, uint8_t *out) {
+  const size_t size = 1 + sizeof(uint16_t) + key_len + 1 + value_size;
+  uint8_t stack[1 + sizeof(uint16_t) + 256 + 1 + HASHER_MAX_HEX_SIZE];
+  uint8_t *input = size <= sizeof(stack) ? stack : malloc(size);
+  if (!input) {
+    return -1;
+  }
+  const uint16_t len = (uint16_t)key_len;
+  size_t pos = 0;
+  input[pos++] = MANIFEST_LEAF_PREFIX;
+  memcpy(input + pos, &len, sizeof(len));
+  pos += sizeof(len);
+  memcpy(input + pos, key, key_len);
+  pos += key_len;
+  input[pos++] = flags;
+  memcpy(input + pos, value, value_size);
+
+  int res = anchor->hasher->hash_buffer_binary(input, size, out,
+                                               anchor->digest_size);
+  if (input != stack) {
+    free(input);
+  }
+  return res == (int)anchor->digest_size ? 0 : -1;
+}
+
+/**
+ * @brief Create the anchoring of a manifest store
+ *
+ * @param hash_layer   -> layer of the manifests, where the proofs are written
+ * @param anchor_layer -> layer the roots are written to
+ * @param hasher       -> hasher of the leaves and nodes (must outlive it)
+ * @param prefix       -> manifest directory
+ * @return ManifestAnchor* -> anchoring, or NULL on error
+ */
+ManifestAnchor *manifest_anchor_init(LayerContext hash_layer,
+                                     LayerContext anchor_layer,
+                                     const Hasher *hasher, const char *prefix) {
+  if (!hash_layer.ops || !anchor_layer.ops || !hasher || !prefix ||
+      !hasher->get_hash_size || !hasher->hash_buffer_binary ||
+      hasher->get_hash_size() == 0 ||
+      hasher->get_hash_size() > HASHER_MAX_HASH_SIZE) {
+    return NULL;
+  }
+  ManifestAnchor *anchor = calloc(1, sizeof(ManifestAnchor));
+  if (!anchor) {
+    return NULL;
+  }
+  anchor->hash_layer = hash_layer;
+  anchor->anchor_layer = anchor_layer;
+  anchor->hasher = hasher;
+  anchor->digest_size = hasher->get_hash_size();
+  anchor->prefix = strdup(prefix);
+  if (!anchor->prefix) {
+    free(anchor);
+    return NULL;
+  }
+  pthread_mutex_init(&anchor->mutex, NULL);
+  return anchor;
+}
+
+/**
+ * @brief Free an anchoring
+ *
+ * @param anchor -> anchoring to free (may be NULL)
+ */
+void manifest_anchor_destroy(ManifestAnchor *anchor) {
+  if (!anchor) {
+    return;
+  }
+  DEBUG_MSG("[MANIFEST_ANCHOR] Anchored %zu manifest roots of %s",
+            anchor->anchored, anchor->prefix);
+  pthread_mutex_destroy(&anchor->mutex);
+  free(anchor->roots);
+  free(anchor->known);
+  free(anchor->prefix);
+  free(anchor);
+}
+
+/**
+ * @brief Remember the anchored root of a manifest
+ */
+static void remember_root(ManifestAnchor *anchor, size_t seq,
+                          const uint8_t *root) {
+  pthread_mutex_lock(&anchor->mutex);
+  if (seq >= anchor->n_roots) {
+    size_t n = anchor->n_roots > 0 ? anchor->n_roots : 64;
+    while (n <= seq) {
+      n *= 2;
+    }
+    uint8_t *roots = realloc(anchor->roots, n * anchor->digest_size);
+    if (roots) {
+      anchor->roots = roots;
+    }
+    uint8_t *known = realloc(anchor->known, n);
+    if (known) {
+      memset(known + anchor->n_roots, 0, n - anchor->n_roots);
+      anchor->known = known;
+    }
+    if (!roots || !known) {
+      pthread_mutex_unlock(&anchor->mutex);
+      return; // read again next time
+    }
+    anchor->n_roots = n;
+  }
+  memcpy(anchor->roots + (seq * anchor->digest_size), root,
+         anchor->digest_size);
+  anchor->known[seq] = 1;
+  pthread_mutex_unlock(&anchor->mutex);
+}
+
+/**
+ * @brief Get the anchored root of a manifest, from memory or the anchor layer
+ *
+ * @return int -> 1 if found, 0 if the manifest has no root, -1 on error
+ */
+static int anchored_root(ManifestAnchor *anchor, size_t seq, uint8_t *root) {
+  pthread_mutex_lock(&anchor->mutex);
+  if (seq < anchor->n_roots && anchor->known[seq]) {
+    memcpy(root, anchor->roots + (seq * anchor->digest_size),
+           anchor->digest_size);
+    pthread_mutex_unlock(&anchor->mutex);
+    return 1;
+  }
+  pthread_mutex_unlock(&anchor->mutex);
+
+  char *path = anchor_pathname(anchor, "root", seq);
+  if (!path) {
+    return -1;
+  }
+  int fd = anchor->anchor_layer.ops->lopen(path, O_RDONLY, 0644,
+                                           anchor->anchor_layer);
+  free(path);
+  if (fd < 0) {
+    return 0;
+  }
+  char hex[HASHER_MAX_HEX_SIZE];
+  const size_t hex_len = 2 * anchor->digest_size;
+  int res = read_fully(anchor->anchor_layer, fd, hex, hex_len, 0);
+  anchor->anchor_layer.ops->lclose(fd, anchor->anchor_layer);
+  hex[hex_len] = '\0';
+  if (res != 0 ||
+      hex_to_bytes(hex, root, anchor->digest_size) != anchor->digest_size) {
+    ERROR_MSG("[MANIFEST_ANCHOR] Root of manifest %zu in %s is unreadable",
+              seq, anchor->prefix);
+    return -1;
+  }
+  remember_root(anchor, seq, root);
+  return 1;
+}
+
+/**
+ * @brief Check whether a manifest has a root in the anchor layer
+ *
+ * @param anchor -> anchoring
+ * @param seq    -> manifest sequence number
+ * @return int   -> 1 if it has one, 0 if not, -1 on error
+ */
+int manifest_anchor_exists(ManifestAnchor *anchor, size_t seq) {
+  uint8_t root[HASHER_MAX_HASH_SIZE];
+  return anchored_root(anchor, seq, root);
+}
+
+/**
+ * @brief Write the proofs of a manifest to the hash layer, then its root to
+ * the anchor layer
+ *
+ * @param anchor   -> anchoring
+ * @param seq      -> sequence number of the manifest
+ * @param manifest -> the manifest object, already written
+ * @param size     -> its size
+ * @return int     -> 0 on success, -1 on error (the manifest is not
+ * published)
+ */
+int manifest_anchor_publish(ManifestAnchor *anchor, size_t seq,
+                            const uint8_t *manifest, size_t size) {
+  HashManifestHeader header;
+  if (!anchor || !manifest || size < sizeof(header)) {
+    return -1;
+  }
+  memcpy(&header, manifest, sizeof(header));
+  const size_t ds = anchor->digest_size;
+  const size_t n = (size_t)header.count;
+
+  MerkleTree tree;
+  if (n == 0 || merkle_tree_init(&tree, anchor->hasher) != 0) {
+    return -1;
+  }
+  if (merkle_tree_resize(&tree, n) != 0) {
+    merkle_tree_free(&tree);
+    return -1;
+  }
+  size_t pos = sizeof(header);
+  for (size_t i = 0; i < n; i++) {
+    HashManifestRecord record;
+    memcpy(&record, manifest + pos, sizeof(record));
+    pos += sizeof(record);
+    const char *key = (const char *)manifest + pos;
+    pos += record.key_len;
+    if (leaf_digest(anchor, key, record.key_len, record.flags,
+                    (const char *)manifest + pos, header.value_size,
+                    merkle_tree_leaf(&tree, i)) != 0) {
+      merkle_tree_free(&tree);
+      return -1;
+    }
+    pos += header.value_size;
+  }
+  uint8_t root[HASHER_MAX_HASH_SIZE];
+  if (merkle_tree_commit(&tree) != 0 ||
+      merkle_tree_root(&tree, root, sizeof(root)) != (int)ds) {
+    merkle_tree_free(&tree);
+    return -1;
+  }
+
+  // the proofs, one fixed size slot per record
+  const size_t depth = merkle_proof_depth(n);
+  const size_t proofs_size = sizeof(ManifestProofHeader) + (n * depth * ds);
+  uint8_t *proofs = malloc(proofs_size);
+  if (!proofs) {
+    merkle_tree_free(&tree);
+    return -1;
+  }
+  ManifestProofHeader proof_header;
+  memset(&proof_header, 0, sizeof(proof_header));
+  memcpy(proof_header.magic, MANIFEST_PROOF_MAGIC, 4);
+  proof_header.version = MANIFEST_PROOF_VERSION;
+  proof_header.digest_size = (uint32_t)ds;
+  proof_header.depth = (uint32_t)depth;
+  proof_header.count = n;
+  memcpy(proofs, &proof_header, sizeof(proof_header));
+  for (size_t i = 0; i < n && depth > 0; i++) {
+    (void)merkle_tree_proof(&tree, i,
+                            proofs + sizeof(proof_header) + (i * depth * ds),
+                            depth * ds);
+  }
+  merkle_tree_free(&tree);
+
+  int res = -1;
+  char *proof_path = anchor_pathname(anchor, "proof", seq);
+  char *root_path = anchor_pathname(anchor, "root", seq);
+  if (proof_path && root_path &&
+      write_object(anchor->hash_layer, proof_path, proofs, proofs_size) ==
+          0) {
+    char hex[HASHER_MAX_HEX_SIZE];
+    bytes_to_hex(root, ds, hex);
+    res = write_object(anchor->anchor_layer, root_path, (const uint8_t *)hex,
+                       2 * ds);
+  }
+  if (res == 0) {
+    remember_root(anchor, seq, root);
+    pthread_mutex_lock(&anchor->mutex);
+    anchor->anchored++;
+    pthread_mutex_unlock(&anchor->mutex);
+    DEBUG_MSG("[MANIFEST_ANCHOR] Anchored manifest %zu of %s (%zu records)",
+              seq, anchor->prefix, n);
+  }
+  free(proof_path);
+  free(root_path);
+  free(proofs);
+  return res;
+}
+
+/**
+ * @brief Check a stored record against the anchored root of its manifest
+ *
+ * @param anchor     -> anchoring
+ * @param seq        -> manifest of the record
+ * @param index      -> record index in the manifest
+ * @param key        -> key of the record
+ * @param key_len    -> its length
+ * @param flags      -> flags of the record
+ * @param value      -> value of the record, value_size bytes
+ * @param value_size -> value size
+ * @return int       -> 1 if the record is in the anchored manifest, 0 if
+ * not (or the manifest has no root), -1 on error
+ */
+int manifest_anchor_verify(ManifestAnchor *anchor, size_t seq, size_t index,
+                           const char *key, size_t key_len, uint8_t flags,
+                           const char *value, size_t value_size) {
+  if (!anchor || !key || !value) {
+    return -1;
+  }
+  const size_t ds = anchor->digest_size;
+  uint8_t root[HASHER_MAX_HASH_SIZE];
+  int found = anchored_root(anchor, seq, root);
+  if (found <= 0) {
+    return found;
+  }
+
+  char *path = anchor_pathname(anchor, "proof", seq);
+  if (!path) {
+    return -1;
+  }
+  int fd = anchor->hash_layer.ops->lopen(path, O_RDONLY, 0644,
+                                         anchor->hash_layer);
+  free(path);
+  if (fd < 0) {
+    return 0; // no proofs: nothing leads to the root
+  }
+  ManifestProofHeader header;
+  uint8_t *proof = NULL;
+  int res = 0;
+  if (read_fully(anchor->hash_layer, fd, &header, sizeof(header), 0) == 0 &&
+      memcmp(header.magic, MANIFEST_PROOF_MAGIC, 4) == 0 &&
+      header.version == MANIFEST_PROOF_VERSION && header.digest_size == ds &&
+      index < header.count &&
+      header.depth == merkle_proof_depth((size_t)header.count)) {
+    const size_t proof_size = (size_t)header.depth * ds;
+    proof = malloc(proof_size > 0 ? proof_size : 1);
+    if (!proof) {
+      res = -1;
+    } else if (proof_size == 0 ||
+               read_fully(anchor->hash_layer, fd, proof, proof_size,
+                          (off_t)(sizeof(header) + (index * proof_size))) ==
+                   0) {
+      uint8_t leaf[HASHER_MAX_HASH_SIZE];
+      res = leaf_digest(anchor, key, key_len, flags, value, value_size, leaf);
+      if (res == 0) {
+        res = merkle_proof_verify(anchor->hasher, leaf, index,
+                                  (size_t)header.count, proof, root);
+      }
+    }
+  }
+  anchor->hash_layer.ops->lclose(fd, anchor->hash_layer);
+  free(proof);
+  return res;
+}
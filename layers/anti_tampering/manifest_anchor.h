@@ -0,0 +1,72 @@
+#ifndef __MANIFEST_ANCHOR_H__
+#define __MANIFEST_ANCHOR_H__
+
+#include "../../shared/types/layer_context.h"
+#include "../../shared/utils/hasher/hasher.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * ============================================================================
+ * MANIFEST ANCHOR - ONE MERKLE ROOT PER HASH MANIFEST ON THE ANCHOR LAYER
+ * ============================================================================
+ *
+ * With an anchor layer (typically the Solana layer), each manifest of the
+ * hash manifest store is an epoch: its records are the leaves of a Merkle
+ * tree, and only the root of that tree is written to the anchor layer, as
+ * "<prefix>/root-<seq>". A busy mount then costs one anchor write per
+ * manifest instead of one per closed file.
+ *
+ * The leaf of a record is H(0x00 || key_len || key || flags || value), the
+ * internal nodes those of merkle_tree.h. The inclusion proofs of all the
+ * records are written next to the manifest, in the hash layer (local or
+ * IPFS), as "<prefix>/proof-<seq>": a ManifestProofHeader, then one fixed
+ * size proof per record, in record order. Checking a record reads its proof
+ * and the anchored root (kept in memory once read), so the manifest and
+ * proofs can live in an untrusted store: a changed record, proof or manifest
+ * no longer leads to the anchored root.
+ *
+ * The proofs and the root are written after the manifest, the root last: a
+ * manifest without a root was not published, and is rewritten by the next
+ * flush.
+ * ============================================================================
+ */
+
+#define MANIFEST_PROOF_MAGIC "TGHP"
+#define MANIFEST_PROOF_VERSION 1
+#define MANIFEST_LEAF_PREFIX 0x00 // domain separation for record leaves
+
+typedef struct {
+  char magic[4];        // MANIFEST_PROOF_MAGIC
+  uint32_t version;     // MANIFEST_PROOF_VERSION
+  uint32_t digest_size; // size of each digest in bytes
+  uint32_t depth;       // digests per proof (merkle_proof_depth(count))
+  uint64_t count;       // number of records (leaves)
+} ManifestProofHeader;
+
+typedef struct ManifestAnchor {
+  LayerContext hash_layer;   // layer of the proofs
+  LayerContext anchor_layer; // layer of the roots
+  const Hasher *hasher;      // hasher of the leaves and nodes
+  char *prefix;              // directory of the roots and proofs
+  size_t digest_size;        // hasher->get_hash_size()
+  uint8_t *roots;            // anchored root of each manifest read so far
+  uint8_t *known;            // roots[seq] is valid
+  size_t n_roots;            // allocated slots of roots and known
+  size_t anchored;           // roots written since init
+  pthread_mutex_t mutex;     // protects roots, known and n_roots
+} ManifestAnchor;
+
+ManifestAnchor *manifest_anchor_init(LayerContext hash_layer,
+                                     LayerContext anchor_layer,
+                                     const Hasher *hasher, const char *prefix);
+void manifest_anchor_destroy(ManifestAnchor *anchor);
+int manifest_anchor_publish(ManifestAnchor *anchor, size_t seq,
+                            const uint8_t *manifest, size_t size);
+int manifest_anchor_exists(ManifestAnchor *anchor, size_t seq);
+int manifest_anchor_verify(ManifestAnchor *anchor, size_t seq, size_t index,
+                           const char *key, size_t key_len, uint8_t flags,
+                           const char *value, size_t value_size);
+
+#endif // __MANIFEST_ANCHOR_H__
@@ -0,0 +1,1023 @@
+#include "merkle_anti_tampering.h"
+
+#include "../../logdef.h"
+#include "../../shared/utils/conversion.h"
+#include "../../shared/utils/hasher/chunk_hasher.h"
+#include "anti_tampering.h"
+#include "anti_tampering_utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * ============================================================================
+ * MERKLE MODE - INCREMENTAL FILE HASHING
+ * ============================================================================
+ *
+ * Same guarantees as file mode (verification on open, hash stored on close)
+ * but the stored root is the root of a Merkle tree over fixed-size chunks.
+ * The per-chunk digests are kept next to the root hash in
+ * "<hash_path>.chunks", and in memory while the file is open, so a close only
+ * rehashes the chunks touched by writes/truncates and the nodes on their path
+ * to the root instead of re-reading the whole file.
+ *
+ * A size change does not rehash the file either: a shrink only rehashes the
+ * new last chunk when it is cut in the middle, and the whole chunks a
+ * truncate (or a write past EOF) extends the file by are zeroes, whose digest
+ * is computed once per layer (zero_block_digest). Such leaves are "precomputed": dirty, so their
+ * digest is stored and their path to the root recomputed, but not read.
+ *
+ * For files of at most one chunk the root equals the file-mode hash, and a
+ * stored file-mode hash without a chunk list is still verified against the
+ * whole-file hash, so existing hash stores keep working.
+ * ============================================================================
+ */
+
+#define INVALID_FD (-1)
+
+static inline size_t leaves_for_size(off_t size, size_t chunk_size) {
+  return size <= 0 ? 0 : (((size_t)size - 1) / chunk_size) + 1;
+}
+
+/**
+ * @brief Build the chunk list path from the hash path
+ *
+ * @param hash_path -> hash file path
+ * @return char*    -> allocated "<hash_path>.chunks", or NULL on error
+ */
+static char *construct_chunks_pathname(const char *hash_path) {
+  size_t len = strlen(hash_path) + strlen(MERKLE_CHUNKS_SUFFIX) + 1;
+  char *chunks_path = malloc(len);
+  if (!chunks_path) {
+    return NULL;
+  }
+  (void)snprintf(chunks_path, len, "%s%s", hash_path, MERKLE_CHUNKS_SUFFIX);
+  return chunks_path;
+}
+
+/**
+ * @brief Get (or create) the shared MerkleFile of a path and take a reference
+ *
+ * @param state      -> AntiTamperingState
+ * @param file_path  -> file path (key)
+ * @return MerkleFile* -> entry, or NULL on allocation error
+ */
+static MerkleFile *merkle_file_acquire(AntiTamperingState *state,
+                                       const char *file_path) {
+  pthread_mutex_lock(&state->merkle_mutex);
+
+  MerkleFile *entry = NULL;
+  HASH_FIND(hh, state->merkle_files, file_path, strlen(file_path), entry);
+  if (!entry) {
+    entry = calloc(1, sizeof(MerkleFile));
+    if (!entry) {
+      pthread_mutex_unlock(&state->merkle_mutex);
+      return NULL;
+    }
+    entry->file_path = strdup(file_path);
+    if (!entry->file_path ||
+        merkle_tree_init(&entry->tree, &state->hasher) != 0) {
+      free(entry->file_path);
+      free(entry);
+      pthread_mutex_unlock(&state->merkle_mutex);
+      return NULL;
+    }
+    HASH_ADD_KEYPTR(hh, state->merkle_files, entry->file_path,
+                    strlen(entry->file_path), entry);
+  }
+  entry->ref_count++;
+
+  pthread_mutex_unlock(&state->merkle_mutex);
+  return entry;
+}
+
+/**
+ * @brief Drop a reference to a MerkleFile, freeing it with the last one
+ *
+ * @param state -> AntiTamperingState
+ * @param entry -> entry to release
+ */
+static void merkle_file_release(AntiTamperingState *state, MerkleFile *entry) {
+  if (!entry) {
+    return;
+  }
+  pthread_mutex_lock(&state->merkle_mutex);
+  if (--entry->ref_count <= 0) {
+    HASH_DEL(state->merkle_files, entry);
+    merkle_tree_free(&entry->tree);
+    free(entry->precomputed);
+    free(entry->file_path);
+    free(entry);
+  }
+  pthread_mutex_unlock(&state->merkle_mutex);
+}
+
+/**
+ * @brief Resize the tree of a file and its precomputed flags together
+ *
+ * @param entry    -> MerkleFile of the path
+ * @param n_leaves -> new number of leaves
+ * @return int     -> 0 on success, -1 on error (the tree is emptied)
+ */
+static int merkle_file_resize(MerkleFile *entry, size_t n_leaves) {
+  const size_t old_leaves = entry->tree.n_leaves;
+  if (merkle_tree_resize(&entry->tree, n_leaves) != 0) {
+    free(entry->precomputed);
+    entry->precomputed = NULL;
+    return -1;
+  }
+  if (n_leaves == 0) {
+    free(entry->precomputed);
+    entry->precomputed = NULL;
+    return 0;
+  }
+  uint8_t *precomputed = realloc(entry->precomputed, n_leaves);
+  if (!precomputed) {
+    merkle_tree_free(&entry->tree);
+    free(entry->precomputed);
+    entry->precomputed = NULL;
+    return -1;
+  }
+  if (n_leaves > old_leaves) {
+    memset(precomputed + old_leaves, 0, n_leaves - old_leaves);
+  }
+  entry->precomputed = precomputed;
+  return 0;
+}
+
+/**
+ * @brief Flag chunks for rehashing on close
+ *
+ * @param entry -> MerkleFile of the path
+ * @param first -> first chunk index
+ * @param last  -> last chunk index (inclusive, clamped to the tree size)
+ */
+static void merkle_file_mark_stale(MerkleFile *entry, size_t first,
+                                   size_t last) {
+  merkle_tree_mark_dirty(&entry->tree, first, last);
+  for (size_t i = first; i <= last && i < entry->tree.n_leaves; i++) {
+    entry->precomputed[i] = 0;
+  }
+}
+
+/**
+ * @brief Update the tracked file size, flagging the chunks whose content
+ * changed because of it
+ *
+ * Chunks that are whole before and after the change keep their digest. With
+ * zero_filled, the size change is one of this layer (truncate, write past
+ * EOF) and the whole chunks it adds hold zeroes: they get the digest of a
+ * zero chunk instead of being read on close.
+ *
+ * Must be called with the path write lock held.
+ *
+ * @param state       -> AntiTamperingState
+ * @param entry       -> MerkleFile of the path
+ * @param new_size    -> new file size
+ * @param zero_filled -> whether the added bytes are known to be zeroes
+ */
+static void merkle_file_set_size(AntiTamperingState *state, MerkleFile *entry,
+                                 off_t new_size, int zero_filled) {
+  const off_t old_size = entry->file_size;
+  if (new_size == old_size) {
+    return;
+  }
+  const size_t chunk_size = state->block_size;
+  const size_t old_leaves = leaves_for_size(old_size, chunk_size);
+  const size_t new_leaves = leaves_for_size(new_size, chunk_size);
+  // a shrink to a chunk boundary leaves the new last chunk as it was
+  const int last_kept =
+      new_size < old_size && new_leaves > 0 &&
+      new_leaves <= entry->tree.n_leaves &&
+      (size_t)new_size % chunk_size == 0 &&
+      (!merkle_tree_is_dirty(&entry->tree, new_leaves - 1) ||
+       entry->precomputed[new_leaves - 1]);
+  entry->file_size = new_size;
+
+  if (merkle_file_resize(entry, new_leaves) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_MERKLE] Failed to resize digest tree of file "
+              "%s, it will be fully rehashed on close",
+              entry->file_path);
+    entry->rebuild = 1;
+    return;
+  }
+  if (new_leaves == 0) {
+    return;
+  }
+
+  if (new_size < old_size) {
+    // the resize flagged the new last chunk: its path to the root changed
+    if (last_kept) {
+      entry->precomputed[new_leaves - 1] = 1;
+    } else {
+      merkle_file_mark_stale(entry, new_leaves - 1, new_leaves - 1);
+    }
+    return;
+  }
+
+  // a partial last chunk grew
+  if (old_leaves > 0 && (size_t)old_size % chunk_size != 0) {
+    merkle_file_mark_stale(entry, old_leaves - 1, old_leaves - 1);
+  }
+  if (!zero_filled || !state->zero_block_digest) {
+    return;
+  }
+  const size_t whole_leaves = (size_t)new_size / chunk_size;
+  for (size_t i = old_leaves; i < whole_leaves; i++) {
+    memcpy(merkle_tree_leaf(&entry->tree, i), state->zero_block_digest,
+           entry->tree.digest_size);
+    entry->precomputed[i] = 1;
+  }
+}
+
+/**
+ * @brief Read a chunk from the data layer and store its digest in the tree
+ *
+ * @param state       -> AntiTamperingState
+ * @param entry       -> MerkleFile of the path
+ * @param fd          -> data layer fd to read from
+ * @param idx         -> chunk index
+ * @param buffer      -> scratch buffer of at least block_size bytes
+ * @param app_context -> application context of the layer calls
+ * @return int        -> 0 on success, -1 on error
+ */
+static int merkle_hash_chunk(AntiTamperingState *state, MerkleFile *entry,
+                             int fd, size_t idx, uint8_t *buffer,
+                             void *app_context) {
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, app_context);
+  const size_t chunk_size = state->block_size;
+  const off_t chunk_off = (off_t)(idx * chunk_size);
+  size_t len = chunk_size;
+  if (chunk_off + (off_t)len > entry->file_size) {
+    len = (size_t)(entry->file_size - chunk_off);
+  }
+
+  size_t done = 0;
+  while (done < len) {
+    ssize_t r = data_layer.ops->lpread(fd, buffer + done, len - done,
+                                       chunk_off + (off_t)done, data_layer);
+    if (r < 0) {
+      return -1;
+    }
+    if (r == 0) {
+      // file shrank behind our back: hash what is there
+      len = done;
+      break;
+    }
+    done += (size_t)r;
+  }
+
+  uint8_t *leaf = merkle_tree_leaf(&entry->tree, idx);
+  if (!leaf ||
+      state->hasher.hash_buffer_binary(buffer, len, leaf,
+                                       entry->tree.digest_size) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Hex of the current tree root
+ *
+ * @param entry -> MerkleFile with a committed tree
+ * @return char* -> allocated hex string, or NULL on error
+ */
+static char *merkle_root_hex(MerkleFile *entry) {
+  uint8_t root[64];
+  int root_len = merkle_tree_root(&entry->tree, root, sizeof(root));
+  if (root_len < 0) {
+    return NULL;
+  }
+  char *hex = malloc(((size_t)root_len * 2) + 1);
+  if (!hex) {
+    return NULL;
+  }
+  bytes_to_hex(root, (size_t)root_len, hex);
+  return hex;
+}
+
+/**
+ * @brief Read the stored chunk digests if the chunk list matches the current
+ * configuration and file size
+ *
+ * @param state       -> AntiTamperingState
+ * @param chunks_path -> chunk list path
+ * @param file_size   -> current file size
+ * @param n_leaves    -> expected number of digests
+ * @param app_context -> application context of the layer calls
+ * @return uint8_t*   -> allocated digests (n_leaves * digest_size), or NULL
+ * if the chunk list is missing, stale or unreadable
+ */
+static uint8_t *merkle_read_stored_leaves(AntiTamperingState *state,
+                                          const char *chunks_path,
+                                          off_t file_size, size_t n_leaves,
+                                          void *app_context) {
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, app_context);
+  int chunks_fd = hash_layer.ops->lopen(chunks_path, O_RDONLY, 0644,
+                                        hash_layer);
+  if (chunks_fd < 0) {
+    return NULL;
+  }
+
+  uint8_t *stored = NULL;
+  const size_t ds = state->hasher.get_hash_size();
+  MerkleChunksHeader header;
+  ssize_t hr = hash_layer.ops->lpread(chunks_fd, &header, sizeof(header), 0,
+                                      hash_layer);
+  if (hr != (ssize_t)sizeof(header) ||
+      memcmp(header.magic, MERKLE_CHUNKS_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != MERKLE_CHUNKS_VERSION ||
+      header.algorithm != (uint32_t)state->hasher.algorithm ||
+      header.digest_size != ds || header.chunk_size != state->block_size ||
+      header.file_size != (uint64_t)file_size) {
+    DEBUG_MSG("[ANTI_TAMPERING_MERKLE] Chunk list %s missing or stale",
+              chunks_path);
+    hash_layer.ops->lclose(chunks_fd, hash_layer);
+    return NULL;
+  }
+
+  const size_t stored_len = n_leaves * ds;
+  stored = malloc(stored_len > 0 ? stored_len : 1);
+  if (stored && stored_len > 0) {
+    ssize_t lr = hash_layer.ops->lpread(chunks_fd, stored, stored_len,
+                                        sizeof(header), hash_layer);
+    if (lr != (ssize_t)stored_len) {
+      free(stored);
+      stored = NULL;
+    }
+  }
+  hash_layer.ops->lclose(chunks_fd, hash_layer);
+  return stored;
+}
+
+/**
+ * @brief Populate the tree from the data layer and verify it against the
+ * stored chunk list and root hash
+ *
+ * Mismatches are reported the same way as in file mode (warnings only).
+ * Must be called with the path write lock held.
+ *
+ * @param state       -> AntiTamperingState
+ * @param entry       -> MerkleFile of the path
+ * @param mapping     -> mapping of the fd being opened
+ * @param app_context -> application context of the layer calls
+ * @return int        -> 0 on success, -1 on error
+ */
+static int merkle_load_and_verify(AntiTamperingState *state, MerkleFile *entry,
+                                  const FileMapping *mapping,
+                                  void *app_context) {
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, app_context);
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, app_context);
+  int verify_fd = data_layer.ops->lopen(mapping->file_path, O_RDONLY, 0644,
+                                        data_layer);
+  if (verify_fd < 0) {
+    ERROR_MSG("[ANTI_TAMPERING_MERKLE_OPEN] Failed to open verification fd "
+              "for file %s",
+              mapping->file_path);
+    return -1;
+  }
+
+  struct stat stbuf;
+  if (data_layer.ops->lfstat(verify_fd, &stbuf, data_layer) != 0) {
+    data_layer.ops->lclose(verify_fd, data_layer);
+    return -1;
+  }
+
+  const size_t n_leaves = leaves_for_size(stbuf.st_size, state->block_size);
+  const size_t ds = entry->tree.digest_size;
+  entry->file_size = stbuf.st_size;
+  if (merkle_file_resize(entry, n_leaves) != 0) {
+    data_layer.ops->lclose(verify_fd, data_layer);
+    return -1;
+  }
+
+  // stored root hash (file mode format: hex string)
+  size_t hex_size = state->hasher.get_hex_size();
+  char *stored_root = calloc(1, hex_size);
+  if (!stored_root) {
+    data_layer.ops->lclose(verify_fd, data_layer);
+    return -1;
+  }
+  int hash_fd = hash_layer.ops->lopen(mapping->hash_path, O_RDONLY, 0644,
+                                      hash_layer);
+  if (hash_fd >= 0) {
+    ssize_t r = hash_layer.ops->lpread(hash_fd, stored_root, hex_size - 1, 0,
+                                       hash_layer);
+    stored_root[r > 0 ? r : 0] = '\0';
+    hash_layer.ops->lclose(hash_fd, hash_layer);
+  }
+
+  char *chunks_path = construct_chunks_pathname(mapping->hash_path);
+  uint8_t *stored_leaves =
+      chunks_path ? merkle_read_stored_leaves(state, chunks_path,
+                                              stbuf.st_size, n_leaves,
+                                              app_context)
+                  : NULL;
+  free(chunks_path);
+
+  int result = 0;
+  if (n_leaves > 0 &&
+      chunk_hasher_hash_file(&state->hasher, verify_fd, data_layer,
+                             stbuf.st_size, state->block_size,
+                             state->hash_threads, state->hash_pool,
+                             merkle_tree_leaf(&entry->tree, 0),
+                             n_leaves * ds) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_MERKLE_OPEN] Failed to hash the chunks of file "
+              "%s",
+              mapping->file_path);
+    result = -1;
+  }
+
+  int leaves_match = stored_leaves != NULL;
+  for (size_t i = 0; i < n_leaves && result == 0; i++) {
+    if (stored_leaves &&
+        memcmp(stored_leaves + (i * ds), merkle_tree_leaf(&entry->tree, i),
+               ds) != 0) {
+      leaves_match = 0;
+      count_hash_mismatch();
+      WARN_MSG("[ANTI_TAMPERING_MERKLE_OPEN] hash mismatch file=%s chunk=%zu "
+               "data_off=%ld",
+               mapping->file_path, i, (long)(i * state->block_size));
+    }
+  }
+  free(stored_leaves);
+
+  if (result == 0 && merkle_tree_commit(&entry->tree) != 0) {
+    result = -1;
+  }
+
+  char *root_hex = result == 0 ? merkle_root_hex(entry) : NULL;
+  if (result == 0 && !root_hex) {
+    result = -1;
+  }
+
+  if (root_hex && stored_root[0] != '\0' &&
+      strcmp(root_hex, stored_root) != 0) {
+    // No chunk list: the stored hash may be a plain file-mode hash
+    int legacy_match = 0;
+    if (!leaves_match && n_leaves > 1) {
+      char file_hex[HASHER_MAX_HEX_SIZE];
+      legacy_match = state->hasher.hash_file_hex_into(
+                         verify_fd, data_layer, file_hex,
+                         sizeof(file_hex)) >= 0 &&
+                     strcmp(file_hex, stored_root) == 0;
+    }
+    // ignore files with size 0: could have been just created
+    if (!legacy_match && stbuf.st_size != 0) {
+      count_hash_mismatch();
+      WARN_MSG("[ANTI_TAMPERING_OPEN] Hash mismatch for file %s (size=%ld); "
+               "Stored hash: %s; Computed hash: %s",
+               mapping->file_path, (long)stbuf.st_size, stored_root, root_hex);
+    } else if (legacy_match) {
+      DEBUG_MSG("[ANTI_TAMPERING_MERKLE_OPEN] File %s has a file-mode hash, "
+                "it will be migrated on close",
+                mapping->file_path);
+    }
+  } else if (root_hex && stored_root[0] != '\0' && leaves_match) {
+    entry->persisted = 1;
+    entry->stored_leaves = n_leaves;
+  }
+
+  free(root_hex);
+  free(stored_root);
+  data_layer.ops->lclose(verify_fd, data_layer);
+  return result;
+}
+
+/**
+ * @brief Write the chunk list: the whole list when it was not persisted yet (or
+ * shrank), otherwise only the header and the runs of dirty digests
+ *
+ * Must be called before merkle_tree_commit (uses the dirty flags).
+ *
+ * @param state       -> AntiTamperingState
+ * @param entry       -> MerkleFile of the path
+ * @param chunks_path -> chunk list path
+ * @param app_context -> application context of the layer calls
+ * @return int        -> 0 on success, -1 on error
+ */
+static int merkle_write_chunks(AntiTamperingState *state, MerkleFile *entry,
+                               const char *chunks_path, void *app_context) {
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, app_context);
+  const size_t ds = entry->tree.digest_size;
+  const size_t n_leaves = entry->tree.n_leaves;
+  const int full = !entry->persisted || n_leaves < entry->stored_leaves;
+
+  int flags = O_RDWR | O_CREAT | (full ? O_TRUNC : 0);
+  int chunks_fd = hash_layer_open(state, chunks_path, flags, app_context);
+  if (chunks_fd < 0) {
+    return -1;
+  }
+
+  MerkleChunksHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MERKLE_CHUNKS_MAGIC, sizeof(header.magic));
+  header.version = MERKLE_CHUNKS_VERSION;
+  header.algorithm = (uint32_t)state->hasher.algorithm;
+  header.digest_size = (uint32_t)ds;
+  header.chunk_size = state->block_size;
+  header.file_size = (uint64_t)entry->file_size;
+
+  int result = 0;
+  ssize_t w = hash_layer.ops->lpwrite(chunks_fd, &header, sizeof(header), 0,
+                                      hash_layer);
+  if (w != (ssize_t)sizeof(header)) {
+    result = -1;
+  }
+
+  size_t i = 0;
+  while (result == 0 && i < n_leaves) {
+    if (!full && !merkle_tree_is_dirty(&entry->tree, i)) {
+      i++;
+      continue;
+    }
+    size_t run_end = i + 1;
+    while (run_end < n_leaves &&
+           (full || merkle_tree_is_dirty(&entry->tree, run_end))) {
+      run_end++;
+    }
+    const size_t run_len = (run_end - i) * ds;
+    w = hash_layer.ops->lpwrite(chunks_fd, merkle_tree_leaf(&entry->tree, i),
+                                run_len, (off_t)(sizeof(header) + (i * ds)),
+                                hash_layer);
+    if (w != (ssize_t)run_len) {
+      result = -1;
+    }
+    i = run_end;
+  }
+
+  if (hash_layer.ops->lclose(chunks_fd, hash_layer) < 0) {
+    result = -1;
+  }
+  if (result == 0) {
+    entry->stored_leaves = n_leaves;
+  }
+  return result;
+}
+
+/**
+ * @brief Rehash the dirty chunks, update the tree and store chunk list and
+ * root. Must be called with the path write lock held.
+ *
+ * @param state       -> AntiTamperingState
+ * @param entry       -> MerkleFile of the path
+ * @param mapping     -> mapping of the fd being closed
+ * @param app_context -> application context of the layer calls
+ * @return int        -> 0 on success, -1 on error
+ */
+static int merkle_flush(AntiTamperingState *state, MerkleFile *entry,
+                        const FileMapping *mapping, void *app_context) {
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, app_context);
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, app_context);
+  if (!entry->loaded) {
+    return -1; // nothing trustworthy to store
+  }
+
+  int read_fd = data_layer.ops->lopen(mapping->file_path, O_RDONLY, 0644,
+                                      data_layer);
+  if (read_fd < 0) {
+    return -1;
+  }
+
+  // the data layer is authoritative for the size; a size changed behind the
+  // layer's back gives no zero-filled chunk
+  struct stat stbuf;
+  if (data_layer.ops->lfstat(read_fd, &stbuf, data_layer) == 0) {
+    merkle_file_set_size(state, entry, stbuf.st_size, 0);
+  }
+
+  if (entry->rebuild) {
+    const size_t n_leaves = leaves_for_size(entry->file_size, state->block_size);
+    if (merkle_file_resize(entry, n_leaves) != 0) {
+      data_layer.ops->lclose(read_fd, data_layer);
+      return -1;
+    }
+    if (n_leaves > 0) {
+      merkle_file_mark_stale(entry, 0, n_leaves - 1);
+    }
+    entry->rebuild = 0;
+    entry->persisted = 0;
+  }
+
+  // nothing changed since the last stored state
+  if (entry->persisted && entry->tree.dirty_count == 0 &&
+      entry->tree.n_leaves == entry->stored_leaves) {
+    data_layer.ops->lclose(read_fd, data_layer);
+    return 0;
+  }
+
+  int result = 0;
+  const size_t n_leaves = entry->tree.n_leaves;
+  size_t stale = 0;
+  for (size_t i = 0; i < n_leaves; i++) {
+    stale += merkle_tree_is_dirty(&entry->tree, i) && !entry->precomputed[i];
+  }
+  if (n_leaves > 1 && stale == n_leaves && state->hash_threads > 1) {
+    // every chunk changed (new or rebuilt file): hash them all in parallel
+    if (chunk_hasher_hash_file(&state->hasher, read_fd, data_layer,
+                               entry->file_size, state->block_size,
+                               state->hash_threads, state->hash_pool,
+                               merkle_tree_leaf(&entry->tree, 0),
+                               n_leaves * entry->tree.digest_size) != 0) {
+      ERROR_MSG("[ANTI_TAMPERING_MERKLE_CLOSE] Failed to hash the chunks of "
+                "file %s",
+                mapping->file_path);
+      result = -1;
+    }
+  } else {
+    uint8_t *buffer = malloc(state->block_size);
+    if (!buffer) {
+      data_layer.ops->lclose(read_fd, data_layer);
+      return -1;
+    }
+    for (size_t i = 0; i < n_leaves && result == 0; i++) {
+      if (merkle_tree_is_dirty(&entry->tree, i) && !entry->precomputed[i] &&
+          merkle_hash_chunk(state, entry, read_fd, i, buffer,
+                            app_context) != 0) {
+        ERROR_MSG("[ANTI_TAMPERING_MERKLE_CLOSE] Failed to hash chunk %zu of "
+                  "file %s",
+                  i, mapping->file_path);
+        result = -1;
+      }
+    }
+    free(buffer);
+  }
+  data_layer.ops->lclose(read_fd, data_layer);
+  if (result != 0) {
+    return -1;
+  }
+
+  char *chunks_path = construct_chunks_pathname(mapping->hash_path);
+  if (!chunks_path ||
+      merkle_write_chunks(state, entry, chunks_path, app_context) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_MERKLE_CLOSE] Failed to write chunk list of "
+              "file %s",
+              mapping->file_path);
+    free(chunks_path);
+    return -1;
+  }
+  free(chunks_path);
+
+  if (merkle_tree_commit(&entry->tree) != 0) {
+    return -1;
+  }
+  if (n_leaves > 0) {
+    memset(entry->precomputed, 0, n_leaves);
+  }
+  char *root_hex = merkle_root_hex(entry);
+  if (!root_hex) {
+    return -1;
+  }
+
+  int hash_fd =
+      hash_layer_open(state, mapping->hash_path, O_RDWR | O_CREAT | O_TRUNC,
+                      app_context);
+  if (hash_fd < 0) {
+    ERROR_MSG("[ANTI_TAMPERING_MERKLE_CLOSE] Failed to open hash file %s; "
+              "[HINT] use an absolute path for the hashes_storage: %s",
+              mapping->hash_path, state->hash_prefix);
+    free(root_hex);
+    return -1;
+  }
+  ssize_t hw = hash_layer.ops->lpwrite(hash_fd, root_hex, strlen(root_hex), 0,
+                                       hash_layer);
+  if (hash_layer.ops->lclose(hash_fd, hash_layer) < 0 ||
+      hw != (ssize_t)strlen(root_hex)) {
+    ERROR_MSG("[ANTI_TAMPERING_MERKLE_CLOSE] Failed to write hash file %s to "
+              "hash layer",
+              mapping->hash_path);
+    free(root_hex);
+    return -1;
+  }
+  free(root_hex);
+
+  entry->persisted = 1;
+  return 0;
+}
+
+/**
+ * @brief open in merkle mode - opens the file and, for the first fd of the
+ * path, builds the chunk digest tree while verifying the stored hashes
+ *
+ * @param pathname -> path of the file to open
+ * @param flags    -> flags for opened file
+ * @param mode     -> mode (permissions) when creating a file
+ * @param l        -> LayerContext for current layer
+ * @return int     -> anti-tampering layer file descriptor, or INVALID_FD on
+ * error
+ */
+int merkle_anti_tampering_open(const char *pathname, int flags, __mode_t mode,
+                               LayerContext l) {
+  // Reuse the normal open path to populate fd->(file_path, hash_path) mapping
+  int fd = anti_tampering_open(pathname, flags, mode, l);
+  if (fd < 0) {
+    return fd;
+  }
+
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
+    return fd;
+  }
+
+  const LockKey *lock_key = &mapping->path->lock_key;
+  if (locking_acquire_write_key(state->lock_table, lock_key) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_MERKLE_OPEN] Failed to acquire write lock on "
+              "file %s (fd=%d)",
+              mapping->file_path, fd);
+    data_layer.ops->lclose(mapping->file_fd, data_layer);
+    free_file_mapping(mapping);
+    return INVALID_FD;
+  }
+
+  MerkleFile *entry = merkle_file_acquire(state, mapping->file_path);
+  if (!entry) {
+    locking_release_key(state->lock_table, lock_key);
+    ERROR_MSG("[ANTI_TAMPERING_MERKLE_OPEN] Failed to allocate digest tree "
+              "for file %s",
+              mapping->file_path);
+    data_layer.ops->lclose(mapping->file_fd, data_layer);
+    free_file_mapping(mapping);
+    return INVALID_FD;
+  }
+
+  // Other fds of the path already verified the file and keep the tree current
+  if (!entry->loaded) {
+    if (merkle_load_and_verify(state, entry, mapping, l.app_context) == 0) {
+      entry->loaded = 1;
+    } else {
+      ERROR_MSG("[ANTI_TAMPERING_MERKLE_OPEN] Failed to verify file %s",
+                mapping->file_path);
+    }
+  } else if (flags & O_TRUNC) {
+    merkle_file_set_size(state, entry, 0, 1);
+  }
+  mapping->merkle = entry;
+
+  locking_release_key(state->lock_table, lock_key);
+  return fd;
+}
+
+/**
+ * @brief close in merkle mode - stores the incrementally updated chunk list
+ * and root hash, then closes the file
+ *
+ * @param fd    -> anti-tampering layer file descriptor
+ * @param l     -> LayerContext for current layer
+ * @return int  -> 0 on success, INVALID_FD on error
+ */
+int merkle_anti_tampering_close(int fd, LayerContext l) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
+    return INVALID_FD;
+  }
+
+  int result = 0;
+  const LockKey *lock_key = &mapping->path->lock_key;
+  MerkleFile *entry = mapping->merkle;
+  if (entry) {
+    if (locking_acquire_write_key(state->lock_table, lock_key) != 0) {
+      ERROR_MSG("[ANTI_TAMPERING_MERKLE_CLOSE] Failed to acquire write lock "
+                "on file %s (fd=%d)",
+                mapping->file_path, fd);
+      return INVALID_FD;
+    }
+
+    if (merkle_flush(state, entry, mapping, l.app_context) != 0) {
+      result = INVALID_FD;
+    }
+
+    locking_release_key(state->lock_table, lock_key);
+    merkle_file_release(state, entry);
+  }
+
+  if (mapping->file_fd != INVALID_FD) {
+    int rc = data_layer.ops->lclose(mapping->file_fd, data_layer);
+    if (rc < 0) {
+      result = rc;
+    }
+  }
+  free_file_mapping(mapping);
+
+  return result;
+}
+
+// The fsync leading a batch of fsyncs of a path (merkle mode)
+typedef struct {
+  AntiTamperingState *state;
+  FileMapping *mapping;
+  LayerContext l;
+} MerkleSync;
+
+/**
+ * @brief fsync the file, then store its tree, for a batch of fsyncs
+ */
+static int merkle_sync(void *arg, int isdatasync) {
+  MerkleSync *sync = arg;
+  AntiTamperingState *state = sync->state;
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, sync->l.app_context);
+  const FileMapping *mapping = sync->mapping;
+  if (data_layer.ops->lfsync &&
+      data_layer.ops->lfsync(mapping->file_fd, isdatasync, data_layer) != 0) {
+    return INVALID_FD;
+  }
+  if (!mapping->merkle) {
+    return 0;
+  }
+  const LockKey *lock_key = &mapping->path->lock_key;
+  if (locking_acquire_write_key(state->lock_table, lock_key) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_MERKLE_FSYNC] Failed to acquire write lock "
+              "on file %s",
+              mapping->file_path);
+    return INVALID_FD;
+  }
+  int result = merkle_flush(state, mapping->merkle, mapping,
+                            sync->l.app_context);
+  locking_release_key(state->lock_table, lock_key);
+  return result != 0 ? INVALID_FD : 0;
+}
+
+/**
+ * @brief fsync in merkle mode - the file, then its chunk list and root
+ *
+ * Concurrent fsyncs of a path are served by one fsync and one rehash of the
+ * dirty chunks (see group_commit.h).
+ *
+ * @param fd         -> anti-tampering layer file descriptor
+ * @param isdatasync -> fdatasync instead of fsync
+ * @param l          -> context of the anti-tampering layer
+ * @return int       -> 0 on success, INVALID_FD on error
+ */
+int merkle_anti_tampering_fsync(int fd, int isdatasync, LayerContext l) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
+    return INVALID_FD;
+  }
+  MerkleSync sync = {.state = state, .mapping = mapping, .l = l};
+  return group_commit_sync(&state->fsyncs, mapping->file_path,
+                           strlen(mapping->file_path), isdatasync, merkle_sync,
+                           &sync);
+}
+
+/**
+ * @brief pwrite in merkle mode - writes under the path write lock and flags
+ * the touched chunks for rehashing on close
+ *
+ * @param fd       -> anti-tampering layer file descriptor
+ * @param buffer   -> buffer to write
+ * @param nbyte    -> number of bytes to write
+ * @param offset   -> offset value
+ * @param l        -> context of the anti-tampering layer
+ * @return ssize_t -> number of written bytes from the file layer, or -1 on
+ * error
+ */
+ssize_t merkle_anti_tampering_write(int fd, const void *buffer, size_t nbyte,
+                                    off_t offset, LayerContext l) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
+    return INVALID_FD;
+  }
+
+  int file_fd = mapping->file_fd;
+  const char *file_path = mapping->file_path;
+  const LockKey *lock_key = &mapping->path->lock_key;
+  MerkleFile *entry = mapping->merkle;
+
+  if (locking_acquire_write_key(state->lock_table, lock_key) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_MERKLE_WRITE] Failed to acquire write lock on "
+              "file %s (fd=%d)",
+              file_path, file_fd);
+    return -1;
+  }
+
+  ssize_t res = data_layer.ops->lpwrite(file_fd, buffer, nbyte, offset,
+                                        data_layer);
+
+  if (res > 0 && entry) {
+    const off_t end = offset + (off_t)res;
+    if (end > entry->file_size) {
+      // the hole up to offset reads as zeroes
+      merkle_file_set_size(state, entry, end, 1);
+    }
+    merkle_file_mark_stale(entry, (size_t)offset / state->block_size,
+                           ((size_t)end - 1) / state->block_size);
+  }
+
+  locking_release_key(state->lock_table, lock_key);
+  return res;
+}
+
+/**
+ * @brief ftruncate in merkle mode - truncates under the path write lock and
+ * flags the chunks affected by the size change
+ *
+ * @param fd       -> file descriptor (master FD)
+ * @param length   -> new length of the file
+ * @param l        -> LayerContext for current layer
+ * @return int     -> result from the data layer
+ */
+int merkle_anti_tampering_ftruncate(int fd, off_t length, LayerContext l) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  LayerContext data_layer =
+      layer_with_app_context(state->data_layer, l.app_context);
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  if (!mapping) {
+    return INVALID_FD;
+  }
+
+  int file_fd = mapping->file_fd;
+  const char *file_path = mapping->file_path;
+  const LockKey *lock_key = &mapping->path->lock_key;
+  MerkleFile *entry = mapping->merkle;
+
+  if (locking_acquire_write_key(state->lock_table, lock_key) != 0) {
+    ERROR_MSG("[ANTI_TAMPERING_MERKLE_FTRUNCATE] Failed to acquire write lock "
+              "on file %s (fd=%d)",
+              file_path, file_fd);
+    return -1;
+  }
+
+  int res = data_layer.ops->lftruncate(file_fd, length, data_layer);
+  if (res == 0 && entry) {
+    merkle_file_set_size(state, entry, length, 1);
+  }
+
+  locking_release_key(state->lock_table, lock_key);
+  return res;
+}
+
+/**
+ * @brief unlink in merkle mode - removes the file, its root hash and its chunk
+ * list
+ *
+ * @param pathname -> path of the file to unlink
+ * @param l        -> LayerContext for current layer
+ * @return int     -> result from the data/hash layer
+ */
+int merkle_anti_tampering_unlink(const char *pathname, LayerContext l) {
+  AntiTamperingState *state = (AntiTamperingState *)l.internal_state;
+  LayerContext hash_layer =
+      layer_with_app_context(state->hash_layer, l.app_context);
+
+  int res = anti_tampering_unlink(pathname, l);
+  if (res != 0 || state->hash_reaper) {
+    return res; // the reaper removes the chunk list with the root hash
+  }
+
+  InternedPath *path = intern_path(state, pathname);
+  char *chunks_path = path ? construct_chunks_pathname(path->hash_path) : NULL;
+  interned_path_unref(path);
+  if (!chunks_path) {
+    ERROR_MSG("[ANTI_TAMPERING_MERKLE_UNLINK] Failed to construct chunk list "
+              "path of file %s",
+              pathname);
+    return -1;
+  }
+
+  if (hash_layer.ops->lunlink(chunks_path, hash_layer) != 0 &&
+      errno != ENOENT) {
+    DEBUG_MSG("[ANTI_TAMPERING_MERKLE_UNLINK] Failed to remove chunk list %s",
+              chunks_path);
+  }
+  free(chunks_path);
+  return 0;
+}
+
+/**
+ * @brief Free the digest trees still referenced by open fds
+ *
+ * @param state -> AntiTamperingState being destroyed
+ */
+void merkle_anti_tampering_destroy(AntiTamperingState *state) {
+  MerkleFile *entry, *tmp;
+  pthread_mutex_lock(&state->merkle_mutex);
+  HASH_ITER(hh, state->merkle_files, entry, tmp) {
+    HASH_DEL(state->merkle_files, entry);
+    merkle_tree_free(&entry->tree);
+    free(entry->precomputed);
+    free(entry->file_path);
+    free(entry);
+  }
+  pthread_mutex_unlock(&state->merkle_mutex);
+  pthread_mutex_destroy(&state->merkle_mutex);
+}
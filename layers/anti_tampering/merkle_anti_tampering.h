@@ -0,0 +1,59 @@
+#ifndef __MERKLE_ANTI_TAMPERING_H__
+#define __MERKLE_ANTI_TAMPERING_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include "../../shared/types/layer_context.h"
+#include "../../shared/utils/hasher/merkle_tree.h"
+#include "anti_tampering.h"
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MERKLE_CHUNKS_SUFFIX ".chunks"
+#define MERKLE_CHUNKS_MAGIC "TGMT"
+#define MERKLE_CHUNKS_VERSION 1
+
+/**
+ * @brief Header of the per-file chunk digest list stored next to the root hash
+ *
+ * The header is followed by one binary digest per chunk of the file.
+ */
+typedef struct {
+  char magic[4];        // MERKLE_CHUNKS_MAGIC
+  uint32_t version;     // MERKLE_CHUNKS_VERSION
+  uint32_t algorithm;   // hash_algorithm_t of the digests
+  uint32_t digest_size; // size of each digest in bytes
+  uint64_t chunk_size;  // chunk size in bytes
+  uint64_t file_size;   // file size the digests were computed for
+} MerkleChunksHeader;
+
+/**
+ * @brief In-memory digest tree of a file, shared by all its open fds
+ *
+ * Only accessed while holding the path lock of file_path; membership in the
+ * state's table is protected by merkle_mutex.
+ */
+typedef struct MerkleFile {
+  char *file_path;       // key
+  MerkleTree tree;       // per-chunk digests and internal nodes
+  off_t file_size;       // logical size, tracked across writes and truncates
+  size_t stored_leaves;  // number of digests in the stored chunk list
+  uint8_t *precomputed;  // per leaf: dirty, but its digest is already current
+  int ref_count;         // open fds referencing this entry
+  int loaded;            // tree populated from the data layer
+  int persisted;         // stored root and chunk list match the tree
+  int rebuild;           // tree lost (allocation failure), rehash everything
+  UT_hash_handle hh;
+} MerkleFile;
+
+ssize_t merkle_anti_tampering_write(int fd, const void *buffer, size_t nbyte,
+                                    off_t offset, LayerContext l);
+int merkle_anti_tampering_open(const char *pathname, int flags, __mode_t mode,
+                               LayerContext l);
+int merkle_anti_tampering_close(int fd, LayerContext l);
+int merkle_anti_tampering_fsync(int fd, int isdatasync, LayerContext l);
+int merkle_anti_tampering_ftruncate(int fd, off_t length, LayerContext l);
+int merkle_anti_tampering_unlink(const char *pathname, LayerContext l);
+void merkle_anti_tampering_destroy(AntiTamperingState *state);
+
+#endif // __MERKLE_ANTI_TAMPERING_H__
@@ -0,0 +1,509 @@
+#define _GNU_SOURCE
+#include "scrubber.h"
+
+#include "../../logdef.h"
+#include "../../shared/utils/layer_iov.h"
+#include "../../shared/utils/metrics.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// ioprio_set(2) has no glibc wrapper nor header
+#define SCRUBBER_IOPRIO_WHO_PROCESS 1 // with who 0: the calling thread
+#define SCRUBBER_IOPRIO_CLASS_IDLE 3
+#define SCRUBBER_IOPRIO_CLASS_SHIFT 13
+
+typedef struct {
+  char **names;
+  size_t n;
+  size_t capacity;
+} NameList;
+
+typedef struct {
+  size_t files;      // handed to the callback
+  size_t mismatches; // reported by the callback
+} PassCounts;
+
+static inline double elapsed_s(const struct timespec *from,
+                               const struct timespec *to) {
+  return (double)(to->tv_sec - from->tv_sec) +
+         ((double)(to->tv_nsec - from->tv_nsec) / 1e9);
+}
+
+/**
+ * @brief Move the calling thread to the idle I/O scheduling class
+ */
+static void set_idle_io_priority(void) {
+#ifdef SYS_ioprio_set
+  if (syscall(SYS_ioprio_set, SCRUBBER_IOPRIO_WHO_PROCESS, 0,
+              SCRUBBER_IOPRIO_CLASS_IDLE << SCRUBBER_IOPRIO_CLASS_SHIFT) != 0) {
+    DEBUG_MSG("[ANTI_TAMPERING_SCRUB] Failed to set the idle I/O priority: %s",
+              strerror(errno));
+  }
+#endif
+}
+
+static int stopping(Scrubber *scrubber) {
+  pthread_mutex_lock(&scrubber->mutex);
+  int res = scrubber->stopping;
+  pthread_mutex_unlock(&scrubber->mutex);
+  return res;
+}
+
+/**
+ * @brief Sleep for seconds, or until the scrubber is stopped
+ *
+ * @return int -> 0 after the sleep, -1 if stopped
+ */
+static int sleep_unless_stopped(Scrubber *scrubber, double seconds) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += (time_t)seconds;
+  deadline.tv_nsec += (long)((seconds - (double)(time_t)seconds) * 1e9);
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&scrubber->mutex);
+  while (!scrubber->stopping &&
+         pthread_cond_timedwait(&scrubber->wake, &scrubber->mutex,
+                                &deadline) != ETIMEDOUT) {
+  }
+  int res = scrubber->stopping ? -1 : 0;
+  pthread_mutex_unlock(&scrubber->mutex);
+  return res;
+}
+
+/**
+ * @brief Take bytes from the token bucket, once it is out of debt
+ *
+ * @return int -> 0 when the bytes can be read, -1 if stopped meanwhile
+ */
+static int bucket_take(Scrubber *scrubber, size_t bytes) {
+  if (scrubber->rate == 0) {
+    return 0;
+  }
+  double rate = (double)scrubber->rate;
+  for (;;) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    scrubber->tokens += elapsed_s(&scrubber->refilled, &now) * rate;
+    if (scrubber->tokens > rate) {
+      scrubber->tokens = rate; // one second of burst
+    }
+    scrubber->refilled = now;
+    if (scrubber->tokens >= 0) {
+      break;
+    }
+    if (sleep_unless_stopped(scrubber, -scrubber->tokens / rate) != 0) {
+      return -1;
+    }
+  }
+  scrubber->tokens -= (double)bytes;
+  return 0;
+}
+
+static int collect_name(void *buf, const char *name, const struct stat *stbuf,
+                        off_t off, unsigned int flags) {
+  (void)stbuf;
+  (void)off;
+  (void)flags;
+  NameList *list = buf;
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    return 0;
+  }
+  if (list->n == list->capacity) {
+    size_t capacity = list->capacity ? 2 * list->capacity : 64;
+    char **names = realloc(list->names, capacity * sizeof(*names));
+    if (!names) {
+      return 1;
+    }
+    list->names = names;
+    list->capacity = capacity;
+  }
+  list->names[list->n] = strdup(name);
+  if (!list->names[list->n]) {
+    return 1;
+  }
+  list->n++;
+  return 0;
+}
+
+static char *join_path(const char *dir, const char *name) {
+  size_t len = strlen(dir);
+  const char *sep = len > 0 && dir[len - 1] == '/' ? "" : "/";
+  char *path = malloc(len + strlen(sep) + strlen(name) + 1);
+  if (path) {
+    (void)sprintf(path, "%s%s%s", dir, sep, name);
+  }
+  return path;
+}
+
+/**
+ * @brief Verify a regular file within the I/O budget and count its result
+ *
+ * @return int -> 0 to go on, -1 if stopped
+ */
+static int scrub_file(Scrubber *scrubber, const char *path,
+                      const struct stat *stbuf, PassCounts *counts) {
+  if (bucket_take(scrubber, (size_t)stbuf->st_size) != 0) {
+    return -1;
+  }
+  ScrubResult res = scrubber->verify(scrubber->arg, path);
+
+  pthread_mutex_lock(&scrubber->mutex);
+  ScrubberStats *stats = &scrubber->stats;
+  switch (res) {
+  case SCRUB_VERIFIED:
+    stats->verified++;
+    break;
+  case SCRUB_MISMATCH:
+    stats->mismatches++;
+    counts->mismatches++; // logged with its hashes by the callback
+    break;
+  case SCRUB_UNPROTECTED:
+    stats->unprotected++;
+    break;
+  case SCRUB_FAILED:
+  default:
+    stats->failed++;
+    break;
+  }
+  stats->bytes += (size_t)stbuf->st_size;
+  pthread_mutex_unlock(&scrubber->mutex);
+
+  counts->files++;
+  metrics_count("tg_anti_tampering_scrubbed_files_total",
+                "Files verified by the anti_tampering scrubber", 1);
+  metrics_count("tg_anti_tampering_scrubbed_bytes_total",
+                "Bytes of the files verified by the anti_tampering scrubber",
+                (unsigned long long)stbuf->st_size);
+  return 0;
+}
+
+/**
+ * @brief Walk the tree under the root, depth first, verifying its files
+ *
+ * Every directory is listed before its entries are visited, so no listing
+ * is held while a file is being hashed.
+ */
+static void scrub_tree(Scrubber *scrubber, PassCounts *counts) {
+  char **dirs = malloc(sizeof(*dirs));
+  size_t ndirs = 0;
+  size_t dirs_capacity = 1;
+  if (!dirs || !(dirs[0] = strdup(scrubber->root))) {
+    free(dirs);
+    return;
+  }
+  ndirs = 1;
+
+  int stopped = 0;
+  while (ndirs > 0) {
+    char *dir = dirs[--ndirs];
+    NameList list = {0};
+    int res = stopped ? 0
+                      : layer_readdir(dir, &list, collect_name, 0, NULL, 0,
+                                      scrubber->layer);
+    if (res != 0) {
+      WARN_MSG("[ANTI_TAMPERING_SCRUB] Failed to list directory %s: %s", dir,
+               strerror(-res));
+    }
+
+    for (size_t i = 0; i < list.n; i++) {
+      char *path = stopped ? NULL : join_path(dir, list.names[i]);
+      free(list.names[i]);
+      struct stat stbuf;
+      if (!path || scrubber->layer.ops->llstat(path, &stbuf,
+                                               scrubber->layer) != 0) {
+        free(path);
+        continue;
+      }
+      if (S_ISDIR(stbuf.st_mode)) {
+        if (ndirs == dirs_capacity) {
+          char **grown = realloc(dirs, 2 * dirs_capacity * sizeof(*dirs));
+          if (!grown) {
+            free(path);
+            continue;
+          }
+          dirs = grown;
+          dirs_capacity *= 2;
+        }
+        dirs[ndirs++] = path;
+        continue;
+      }
+      if (S_ISREG(stbuf.st_mode) &&
+          (scrub_file(scrubber, path, &stbuf, counts) != 0 ||
+           stopping(scrubber))) {
+        stopped = 1;
+      }
+      free(path);
+    }
+    free(list.names);
+    free(dir);
+  }
+  free(dirs);
+}
+
+/**
+ * @brief Scrubber thread: a pass, then waits the interval or a kick
+ */
+static void *scrubber_worker(void *arg) {
+  Scrubber *scrubber = arg;
+  set_idle_io_priority();
+
+  pthread_mutex_lock(&scrubber->mutex);
+  while (!scrubber->stopping) {
+    scrubber->kicked = 0;
+    pthread_mutex_unlock(&scrubber->mutex);
+
+    PassCounts counts = {0};
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    scrub_tree(scrubber, &counts);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double pass_ms = elapsed_s(&start, &end) * 1000.0;
+    metrics_count("tg_anti_tampering_scrub_passes_total",
+                  "Walks of its tree by the anti_tampering scrubber", 1);
+    if (counts.mismatches > 0) {
+      WARN_MSG("[ANTI_TAMPERING_SCRUB] Pass over %s done in %.3f ms: %zu "
+               "files, %zu mismatches",
+               scrubber->root, pass_ms, counts.files, counts.mismatches);
+    } else {
+      INFO_MSG("[ANTI_TAMPERING_SCRUB] Pass over %s done in %.3f ms: %zu "
+               "files, no mismatch",
+               scrubber->root, pass_ms, counts.files);
+    }
+
+    pthread_mutex_lock(&scrubber->mutex);
+    scrubber->stats.passes++;
+    scrubber->stats.last_pass_ms = pass_ms;
+    scrubber->stats.last_pass_end = time(NULL);
+    scrubber->stats.last_mismatches = counts.mismatches;
+    pthread_cond_broadcast(&scrubber->done);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += scrubber->interval;
+    while (!scrubber->stopping && !scrubber->kicked &&
+           pthread_cond_timedwait(&scrubber->wake, &scrubber->mutex,
+                                  &deadline) != ETIMEDOUT) {
+    }
+  }
+  pthread_cond_broadcast(&scrubber->done);
+  pthread_mutex_unlock(&scrubber->mutex);
+  return NULL;
+}
+
+/**
+ * @brief Start a scrubber thread, its first pass starts right away
+ *
+ * @param layer    -> layer whose files are verified
+ * @param root     -> directory of the layer the walk starts from
+ * @param rate     -> bytes per second, 0: unlimited
+ * @param interval -> seconds from the end of a pass to the next one
+ * @param verify   -> verify callback
+ * @param arg      -> verify callback argument
+ * @return Scrubber* -> scrubber, or NULL on error
+ */
+Scrubber *scrubber_init(LayerContext layer, const char *root, size_t rate,
+                        long interval, scrub_fn verify, void *arg) {
+  if (!root || !verify || interval < 0) {
+    return NULL;
+  }
+  Scrubber *scrubber = calloc(1, sizeof(*scrubber));
+  if (!scrubber) {
+    return NULL;
+  }
+  scrubber->root = strdup(root);
+  if (!scrubber->root) {
+    free(scrubber);
+    return NULL;
+  }
+  scrubber->layer = layer;
+  scrubber->verify = verify;
+  scrubber->arg = arg;
+  scrubber->rate = rate;
+  scrubber->interval = interval;
+  scrubber->tokens = (double)rate;
+  clock_gettime(CLOCK_MONOTONIC, &scrubber->refilled);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&scrubber->mutex, NULL);
+  pthread_mutex_init(&scrubber->writers_mutex, NULL);
+  pthread_cond_init(&scrubber->wake, &attr);
+  pthread_cond_init(&scrubber->done, NULL);
+  pthread_condattr_destroy(&attr);
+
+  if (pthread_create(&scrubber->worker, NULL, scrubber_worker, scrubber) !=
+      0) {
+    pthread_cond_destroy(&scrubber->done);
+    pthread_cond_destroy(&scrubber->wake);
+    pthread_mutex_destroy(&scrubber->writers_mutex);
+    pthread_mutex_destroy(&scrubber->mutex);
+    free(scrubber->root);
+    free(scrubber);
+    return NULL;
+  }
+  return scrubber;
+}
+
+/**
+ * @brief Stop the scrubber thread, interrupting its pass, and free it
+ *
+ * @param scrubber -> scrubber (NULL: no-op)
+ */
+void scrubber_destroy(Scrubber *scrubber) {
+  if (!scrubber) {
+    return;
+  }
+  pthread_mutex_lock(&scrubber->mutex);
+  scrubber->stopping = 1;
+  pthread_cond_broadcast(&scrubber->wake);
+  pthread_mutex_unlock(&scrubber->mutex);
+  pthread_join(scrubber->worker, NULL);
+
+  ScrubberWriter *writer;
+  ScrubberWriter *tmp;
+  HASH_ITER(hh, scrubber->writers, writer, tmp) {
+    HASH_DEL(scrubber->writers, writer);
+    free(writer->file_path);
+    free(writer);
+  }
+  pthread_cond_destroy(&scrubber->done);
+  pthread_cond_destroy(&scrubber->wake);
+  pthread_mutex_destroy(&scrubber->writers_mutex);
+  pthread_mutex_destroy(&scrubber->mutex);
+  free(scrubber->root);
+  free(scrubber);
+}
+
+/**
+ * @brief Mark a path busy: opened for writing, its hash is stale until the
+ * matching scrubber_unmark_writer
+ *
+ * @param scrubber  -> scrubber (NULL: no-op)
+ * @param file_path -> data layer path
+ */
+void scrubber_mark_writer(Scrubber *scrubber, const char *file_path) {
+  if (!scrubber || !file_path) {
+    return;
+  }
+  pthread_mutex_lock(&scrubber->writers_mutex);
+  ScrubberWriter *writer = NULL;
+  HASH_FIND_STR(scrubber->writers, file_path, writer);
+  if (!writer) {
+    writer = calloc(1, sizeof(*writer));
+    if (writer) {
+      writer->file_path = strdup(file_path);
+      if (!writer->file_path) {
+        free(writer);
+        writer = NULL;
+      } else {
+        HASH_ADD_KEYPTR(hh, scrubber->writers, writer->file_path,
+                        strlen(writer->file_path), writer);
+      }
+    }
+  }
+  if (writer) {
+    writer->writers++;
+  }
+  pthread_mutex_unlock(&scrubber->writers_mutex);
+}
+
+/**
+ * @brief Drop a mark of scrubber_mark_writer, once the hash is committed
+ *
+ * @param scrubber  -> scrubber (NULL: no-op)
+ * @param file_path -> data layer path
+ */
+void scrubber_unmark_writer(Scrubber *scrubber, const char *file_path) {
+  if (!scrubber || !file_path) {
+    return;
+  }
+  pthread_mutex_lock(&scrubber->writers_mutex);
+  ScrubberWriter *writer = NULL;
+  HASH_FIND_STR(scrubber->writers, file_path, writer);
+  if (writer && --writer->writers == 0) {
+    HASH_DEL(scrubber->writers, writer);
+    free(writer->file_path);
+    free(writer);
+  }
+  pthread_mutex_unlock(&scrubber->writers_mutex);
+}
+
+/**
+ * @brief Check whether a path is open for writing
+ *
+ * @param scrubber  -> scrubber (NULL: never busy)
+ * @param file_path -> data layer path
+ * @return int      -> 1 if busy, 0 otherwise
+ */
+int scrubber_is_busy(Scrubber *scrubber, const char *file_path) {
+  if (!scrubber || !file_path) {
+    return 0;
+  }
+  pthread_mutex_lock(&scrubber->writers_mutex);
+  ScrubberWriter *writer = NULL;
+  HASH_FIND_STR(scrubber->writers, file_path, writer);
+  pthread_mutex_unlock(&scrubber->writers_mutex);
+  return writer != NULL;
+}
+
+/**
+ * @brief Start the next pass now instead of at the end of the interval
+ *
+ * @param scrubber -> scrubber (NULL: no-op)
+ */
+void scrubber_kick(Scrubber *scrubber) {
+  if (!scrubber) {
+    return;
+  }
+  pthread_mutex_lock(&scrubber->mutex);
+  scrubber->kicked = 1;
+  pthread_cond_broadcast(&scrubber->wake);
+  pthread_mutex_unlock(&scrubber->mutex);
+}
+
+/**
+ * @brief Wait until the scrubber completed at least passes passes
+ *
+ * @param scrubber -> scrubber (NULL: no-op)
+ * @param passes   -> number of passes since init
+ */
+void scrubber_wait_passes(Scrubber *scrubber, size_t passes) {
+  if (!scrubber) {
+    return;
+  }
+  pthread_mutex_lock(&scrubber->mutex);
+  while (scrubber->stats.passes < passes && !scrubber->stopping) {
+    pthread_cond_wait(&scrubber->done, &scrubber->mutex);
+  }
+  pthread_mutex_unlock(&scrubber->mutex);
+}
+
+/**
+ * @brief Copy the scrubber counters
+ *
+ * @param scrubber -> scrubber (NULL: all zeros)
+ * @param stats    -> filled with the counters
+ */
+void scrubber_get_stats(Scrubber *scrubber, ScrubberStats *stats) {
+  if (!stats) {
+    return;
+  }
+  if (!scrubber) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  pthread_mutex_lock(&scrubber->mutex);
+  *stats = scrubber->stats;
+  pthread_mutex_unlock(&scrubber->mutex);
+}
@@ -0,0 +1,96 @@
+#ifndef __SCRUBBER_H__
+#define __SCRUBBER_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include "../../shared/types/layer_context.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * ============================================================================
+ * SCRUBBER - BACKGROUND AT-REST VERIFICATION OF FILE-MODE HASHES
+ * ============================================================================
+ *
+ * File mode only verifies a file when it is opened, so a cold file that is
+ * tampered with goes unnoticed until its next open. The scrubber thread walks
+ * a directory tree of the data layer and verifies every file it finds against
+ * its stored hash, one pass every interval.
+ *
+ * - I/O is bounded by a token bucket of rate bytes per second (one second of
+ *   burst); a file larger than the bucket is verified on credit and the
+ *   scrubber sleeps the debt off afterwards. The thread also runs in the idle
+ *   I/O scheduling class, so it only gets the disk when nobody else wants it.
+ * - Paths open for writing are marked busy (scrubber_mark_writer) until their
+ *   hash is committed, and skipped: their stored hash is stale by design.
+ * - A file that matches its hash goes through the normal verification, which
+ *   fills the verify cache: a later open of the unchanged file trusts the
+ *   scrub instead of rehashing it.
+ * ============================================================================
+ */
+
+typedef enum {
+  SCRUB_VERIFIED,    // the file matches its stored hash
+  SCRUB_MISMATCH,    // the file does not match its stored hash
+  SCRUB_UNPROTECTED, // no stored hash (yet), or open for writing
+  SCRUB_FAILED,      // the file or its hash could not be read
+} ScrubResult;
+
+/**
+ * @brief Verify callback, run by the scrubber thread
+ *
+ * @param arg       -> argument given to scrubber_init
+ * @param file_path -> data layer path of the file to verify
+ * @return ScrubResult
+ */
+typedef ScrubResult (*scrub_fn)(void *arg, const char *file_path);
+
+typedef struct ScrubberWriter {
+  char *file_path; // key
+  int writers;     // opens for writing whose hash is not committed yet
+  UT_hash_handle hh;
+} ScrubberWriter;
+
+typedef struct {
+  size_t passes;          // completed walks of the tree
+  size_t verified;        // files that matched their hash
+  size_t mismatches;      // files that did not match their hash
+  size_t unprotected;     // files without a hash or busy, skipped
+  size_t failed;          // files that could not be verified
+  size_t bytes;           // bytes of the files handed to the callback
+  double last_pass_ms;    // duration of the last pass
+  time_t last_pass_end;   // wall clock end of the last pass, 0: none yet
+  size_t last_mismatches; // mismatches found by the last pass
+} ScrubberStats;
+
+typedef struct Scrubber {
+  LayerContext layer;       // walked for files (the data layer)
+  char *root;               // directory of the layer the walk starts from
+  scrub_fn verify;          // verify callback
+  void *arg;                // verify callback argument
+  size_t rate;              // bytes per second, 0: unlimited
+  long interval;            // seconds from the end of a pass to the next one
+  double tokens;            // bytes the bucket holds, negative when in debt
+  struct timespec refilled; // monotonic time of the last refill
+  ScrubberWriter *writers;  // busy paths (writers_mutex)
+  pthread_mutex_t writers_mutex;
+  ScrubberStats stats; // pass and file counters
+  int kicked;          // scrubber_kick: start the next pass now
+  int stopping;        // set by destroy, the worker exits
+  pthread_t worker;    // scrubber thread
+  pthread_mutex_t mutex; // protects stats, kicked and stopping
+  pthread_cond_t wake;   // signalled on kick and stop
+  pthread_cond_t done;   // broadcast when a pass ends
+} Scrubber;
+
+Scrubber *scrubber_init(LayerContext layer, const char *root, size_t rate,
+                        long interval, scrub_fn verify, void *arg);
+void scrubber_destroy(Scrubber *scrubber);
+void scrubber_mark_writer(Scrubber *scrubber, const char *file_path);
+void scrubber_unmark_writer(Scrubber *scrubber, const char *file_path);
+int scrubber_is_busy(Scrubber *scrubber, const char *file_path);
+void scrubber_kick(Scrubber *scrubber);
+void scrubber_wait_passes(Scrubber *scrubber, size_t passes);
+void scrubber_get_stats(Scrubber *scrubber, ScrubberStats *stats);
+
+#endif // __SCRUBBER_H__
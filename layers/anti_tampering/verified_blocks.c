@@ -0,0 +1,242 @@
+#include "verified_blocks.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BITS_PER_WORD 64
+
+static void free_file(VerifiedFile *file) {
+  free(file->file_path);
+  free(file->bits);
+  free(file);
+}
+
+/**
+ * @brief Drop a bitmap (mutex held)
+ */
+static void remove_file(VerifiedBlocks *verified, VerifiedFile *file) {
+  HASH_DEL(verified->files, file);
+  free_file(file);
+  verified->n_files--;
+}
+
+/**
+ * @brief Find the bitmap of a path, dropping it if it expired (mutex held)
+ */
+static VerifiedFile *find_file(VerifiedBlocks *verified,
+                               const char *file_path) {
+  VerifiedFile *file = NULL;
+  HASH_FIND(hh, verified->files, file_path, strlen(file_path), file);
+  if (file && verified->ttl_seconds > 0) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - file->since.tv_sec >= verified->ttl_seconds) {
+      remove_file(verified, file);
+      return NULL;
+    }
+  }
+  return file;
+}
+
+/**
+ * @brief Check if the bits [first, first + count) are all set
+ */
+static int all_set(const VerifiedFile *file, size_t first, size_t count) {
+  for (size_t i = first; i < first + count; i++) {
+    size_t word = i / BITS_PER_WORD;
+    if (word >= file->n_words ||
+        !(file->bits[word] & ((uint64_t)1 << (i % BITS_PER_WORD)))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief Create the verified blocks table
+ *
+ * @param max_files   -> maximum number of tracked paths (must be > 0)
+ * @param ttl_seconds -> lifetime of a bitmap in seconds, 0 for no expiry
+ * @return VerifiedBlocks* -> table, or NULL on error
+ */
+VerifiedBlocks *verified_blocks_init(size_t max_files, time_t ttl_seconds) {
+  if (max_files == 0) {
+    return NULL;
+  }
+  VerifiedBlocks *verified = calloc(1, sizeof(VerifiedBlocks));
+  if (!verified) {
+    return NULL;
+  }
+  verified->max_files = max_files;
+  verified->ttl_seconds = ttl_seconds;
+  if (pthread_mutex_init(&verified->mutex, NULL) != 0) {
+    free(verified);
+    return NULL;
+  }
+  return verified;
+}
+
+/**
+ * @brief Destroy the table and all its bitmaps
+ *
+ * @param verified -> table to destroy (may be NULL)
+ */
+void verified_blocks_destroy(VerifiedBlocks *verified) {
+  if (!verified) {
+    return;
+  }
+  VerifiedFile *file, *tmp;
+  HASH_ITER(hh, verified->files, file, tmp) {
+    HASH_DEL(verified->files, file);
+    free_file(file);
+  }
+  pthread_mutex_destroy(&verified->mutex);
+  free(verified);
+}
+
+/**
+ * @brief Check whether a read can skip verification
+ *
+ * Must be called with the range read lock of the blocks held.
+ *
+ * @param verified  -> table (NULL: always a miss)
+ * @param file_path -> file path
+ * @param first     -> first block of the read
+ * @param count     -> blocks of the read
+ * @return int      -> 1 if every block was verified since its last write and
+ * the bitmap has not expired, 0 otherwise
+ */
+int verified_blocks_test(VerifiedBlocks *verified, const char *file_path,
+                         size_t first, size_t count) {
+  if (!verified || !file_path || count == 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&verified->mutex);
+  VerifiedFile *file = find_file(verified, file_path);
+  int hit = file && all_set(file, first, count);
+  if (hit) {
+    // move to the most recently used position
+    HASH_DEL(verified->files, file);
+    HASH_ADD_KEYPTR(hh, verified->files, file->file_path,
+                    strlen(file->file_path), file);
+    verified->hits++;
+  } else {
+    verified->misses++;
+  }
+  pthread_mutex_unlock(&verified->mutex);
+  return hit;
+}
+
+/**
+ * @brief Record that blocks matched their stored digests
+ *
+ * Must be called with the range read lock of the blocks held, so that no
+ * write changed them since they were hashed. Blocks past
+ * VERIFIED_BLOCKS_MAX_BLOCKS are not tracked.
+ *
+ * @param verified  -> table (NULL: no-op)
+ * @param file_path -> file path
+ * @param first     -> first verified block
+ * @param count     -> verified blocks
+ */
+void verified_blocks_mark(VerifiedBlocks *verified, const char *file_path,
+                          size_t first, size_t count) {
+  if (!verified || !file_path || count == 0 ||
+      first >= VERIFIED_BLOCKS_MAX_BLOCKS) {
+    return;
+  }
+  if (count > VERIFIED_BLOCKS_MAX_BLOCKS - first) {
+    count = VERIFIED_BLOCKS_MAX_BLOCKS - first;
+  }
+
+  pthread_mutex_lock(&verified->mutex);
+  VerifiedFile *file = find_file(verified, file_path);
+  if (file) {
+    HASH_DEL(verified->files, file);
+  } else {
+    file = calloc(1, sizeof(VerifiedFile));
+    if (file) {
+      file->file_path = strdup(file_path);
+    }
+    if (!file || !file->file_path) {
+      free(file);
+      pthread_mutex_unlock(&verified->mutex);
+      return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &file->since);
+
+    // evict the least recently used bitmap
+    if (verified->n_files >= verified->max_files && verified->files) {
+      remove_file(verified, verified->files);
+    }
+    verified->n_files++;
+  }
+
+  // grow the bitmap to cover the blocks, it stays as it was on failure
+  size_t n_words = (first + count + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  if (n_words > file->n_words) {
+    uint64_t *bits = realloc(file->bits, n_words * sizeof(uint64_t));
+    if (bits) {
+      memset(bits + file->n_words, 0,
+             (n_words - file->n_words) * sizeof(uint64_t));
+      file->bits = bits;
+      file->n_words = n_words;
+    }
+  }
+  if (n_words <= file->n_words) {
+    for (size_t i = first; i < first + count; i++) {
+      file->bits[i / BITS_PER_WORD] |= (uint64_t)1 << (i % BITS_PER_WORD);
+    }
+  }
+  HASH_ADD_KEYPTR(hh, verified->files, file->file_path,
+                  strlen(file->file_path), file);
+  pthread_mutex_unlock(&verified->mutex);
+}
+
+/**
+ * @brief Forget blocks that are being written
+ *
+ * Must be called with the range write lock of the blocks held, before the
+ * write.
+ *
+ * @param verified  -> table (NULL: no-op)
+ * @param file_path -> file path
+ * @param first     -> first written block
+ * @param count     -> written blocks
+ */
+void verified_blocks_clear(VerifiedBlocks *verified, const char *file_path,
+                           size_t first, size_t count) {
+  if (!verified || !file_path) {
+    return;
+  }
+  pthread_mutex_lock(&verified->mutex);
+  VerifiedFile *file = NULL;
+  HASH_FIND(hh, verified->files, file_path, strlen(file_path), file);
+  if (file) {
+    for (size_t i = first;
+         i < first + count && i / BITS_PER_WORD < file->n_words; i++) {
+      file->bits[i / BITS_PER_WORD] &= ~((uint64_t)1 << (i % BITS_PER_WORD));
+    }
+  }
+  pthread_mutex_unlock(&verified->mutex);
+}
+
+/**
+ * @brief Forget a path (on open, truncate or unlink)
+ *
+ * @param verified  -> table (NULL: no-op)
+ * @param file_path -> file path
+ */
+void verified_blocks_reset(VerifiedBlocks *verified, const char *file_path) {
+  if (!verified || !file_path) {
+    return;
+  }
+  pthread_mutex_lock(&verified->mutex);
+  VerifiedFile *file = NULL;
+  HASH_FIND(hh, verified->files, file_path, strlen(file_path), file);
+  if (file) {
+    remove_file(verified, file);
+  }
+  pthread_mutex_unlock(&verified->mutex);
+}
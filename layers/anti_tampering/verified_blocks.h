@@ -0,0 +1,63 @@
+#ifndef __VERIFIED_BLOCKS_H__
+#define __VERIFIED_BLOCKS_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * ============================================================================
+ * VERIFIED BLOCKS - SKIP REPEATED BLOCK-MODE VERIFICATION ON READ
+ * ============================================================================
+ *
+ * Remembers, per path, a bitmap of the blocks whose digest matched the stored
+ * one since their last write. A read of blocks that are all verified returns
+ * the data without hashing it nor reading the stored digests.
+ *
+ * - Reads mark blocks under their range read lock and writes clear them
+ *   under their range write lock, so a bit is never set for content older
+ *   than the last write.
+ * - Truncates, unlinks and opens of a path forget its bitmap: the file may
+ *   have been changed below the layer while it was not open here.
+ * - A bitmap is forgotten once its oldest bit is older than the TTL, so that
+ *   tampering below the layer is noticed within the TTL.
+ * - Bitmaps cover up to VERIFIED_BLOCKS_MAX_BLOCKS blocks and are kept in
+ *   LRU order (uthash insertion order, refreshed on use), the least recently
+ *   used one is evicted once max_files is reached.
+ * ============================================================================
+ */
+
+#define VERIFIED_BLOCKS_MAX_BLOCKS                                             \
+  ((size_t)1 << 24) // blocks tracked per file, 2 MiB of bitmap at most
+
+typedef struct VerifiedFile {
+  char *file_path;       // key
+  uint64_t *bits;        // bit i set: block i verified since its last write
+  size_t n_words;        // words of bits
+  struct timespec since; // monotonic time of the first bit set
+  UT_hash_handle hh;
+} VerifiedFile;
+
+typedef struct VerifiedBlocks {
+  VerifiedFile *files;   // LRU ordered, oldest first
+  size_t n_files;        // current number of bitmaps
+  size_t max_files;      // LRU bound
+  time_t ttl_seconds;    // bitmap lifetime, 0 means no expiry
+  size_t hits;           // reads that skipped verification
+  size_t misses;         // reads that required verification
+  pthread_mutex_t mutex; // protects all the fields above
+} VerifiedBlocks;
+
+VerifiedBlocks *verified_blocks_init(size_t max_files, time_t ttl_seconds);
+void verified_blocks_destroy(VerifiedBlocks *verified);
+int verified_blocks_test(VerifiedBlocks *verified, const char *file_path,
+                         size_t first, size_t count);
+void verified_blocks_mark(VerifiedBlocks *verified, const char *file_path,
+                          size_t first, size_t count);
+void verified_blocks_clear(VerifiedBlocks *verified, const char *file_path,
+                           size_t first, size_t count);
+void verified_blocks_reset(VerifiedBlocks *verified, const char *file_path);
+
+#endif // __VERIFIED_BLOCKS_H__
@@ -0,0 +1,189 @@
+#include "verify_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static inline int timespec_equal(const struct timespec *a,
+                                 const struct timespec *b) {
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/**
+ * @brief Check if a stat result carries enough information to be a watermark
+ *
+ * Layers that do not report timestamps would make every watermark equal.
+ */
+static inline int has_watermark(const struct stat *stbuf) {
+  return stbuf->st_mtim.tv_sec != 0 || stbuf->st_mtim.tv_nsec != 0 ||
+         stbuf->st_ctim.tv_sec != 0 || stbuf->st_ctim.tv_nsec != 0;
+}
+
+static void free_entry(VerifyCacheEntry *entry) {
+  free(entry->file_path);
+  free(entry);
+}
+
+/**
+ * @brief Create a verify cache
+ *
+ * @param max_entries  -> maximum number of cached paths (must be > 0)
+ * @param ttl_seconds  -> lifetime of an entry in seconds, 0 for no expiry
+ * @return VerifyCache* -> cache, or NULL on error
+ */
+VerifyCache *verify_cache_init(size_t max_entries, time_t ttl_seconds) {
+  if (max_entries == 0) {
+    return NULL;
+  }
+  VerifyCache *cache = calloc(1, sizeof(VerifyCache));
+  if (!cache) {
+    return NULL;
+  }
+  cache->max_entries = max_entries;
+  cache->ttl_seconds = ttl_seconds;
+  if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+    free(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+/**
+ * @brief Destroy a verify cache and all its entries
+ *
+ * @param cache -> cache to destroy (may be NULL)
+ */
+void verify_cache_destroy(VerifyCache *cache) {
+  if (!cache) {
+    return;
+  }
+  VerifyCacheEntry *entry, *tmp;
+  HASH_ITER(hh, cache->entries, entry, tmp) {
+    HASH_DEL(cache->entries, entry);
+    free_entry(entry);
+  }
+  pthread_mutex_destroy(&cache->mutex);
+  free(cache);
+}
+
+/**
+ * @brief Check whether a file can skip verification
+ *
+ * @param cache     -> cache (NULL: always a miss)
+ * @param file_path -> file path
+ * @param stbuf     -> current stat of the file
+ * @return int      -> 1 if the file was verified with the same watermark and
+ * the entry has not expired, 0 otherwise
+ */
+int verify_cache_lookup(VerifyCache *cache, const char *file_path,
+                        const struct stat *stbuf) {
+  if (!cache || !file_path || !stbuf || !has_watermark(stbuf)) {
+    return 0;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&cache->mutex);
+  VerifyCacheEntry *entry = NULL;
+  HASH_FIND(hh, cache->entries, file_path, strlen(file_path), entry);
+
+  int hit = 0;
+  if (entry) {
+    int expired = cache->ttl_seconds > 0 &&
+                  now.tv_sec - entry->verified.tv_sec >= cache->ttl_seconds;
+    int same = entry->device == stbuf->st_dev &&
+               entry->inode == stbuf->st_ino && entry->size == stbuf->st_size &&
+               timespec_equal(&entry->mtime, &stbuf->st_mtim) &&
+               timespec_equal(&entry->ctime, &stbuf->st_ctim);
+    HASH_DEL(cache->entries, entry);
+    if (expired || !same) {
+      free_entry(entry);
+      cache->n_entries--;
+    } else {
+      // move to the most recently used position
+      HASH_ADD_KEYPTR(hh, cache->entries, entry->file_path,
+                      strlen(entry->file_path), entry);
+      hit = 1;
+    }
+  }
+
+  if (hit) {
+    cache->hits++;
+  } else {
+    cache->misses++;
+  }
+  pthread_mutex_unlock(&cache->mutex);
+  return hit;
+}
+
+/**
+ * @brief Record that a file was verified (or its hash was just computed)
+ * with the given watermark
+ *
+ * @param cache     -> cache (NULL: no-op)
+ * @param file_path -> file path
+ * @param stbuf     -> stat of the file taken under the path lock
+ */
+void verify_cache_insert(VerifyCache *cache, const char *file_path,
+                         const struct stat *stbuf) {
+  if (!cache || !file_path || !stbuf || !has_watermark(stbuf)) {
+    return;
+  }
+
+  pthread_mutex_lock(&cache->mutex);
+  VerifyCacheEntry *entry = NULL;
+  HASH_FIND(hh, cache->entries, file_path, strlen(file_path), entry);
+  if (entry) {
+    HASH_DEL(cache->entries, entry);
+  } else {
+    entry = calloc(1, sizeof(VerifyCacheEntry));
+    if (entry) {
+      entry->file_path = strdup(file_path);
+    }
+    if (!entry || !entry->file_path) {
+      free(entry);
+      pthread_mutex_unlock(&cache->mutex);
+      return;
+    }
+
+    // evict the least recently used entry
+    if (cache->n_entries >= cache->max_entries && cache->entries) {
+      VerifyCacheEntry *oldest = cache->entries;
+      HASH_DEL(cache->entries, oldest);
+      free_entry(oldest);
+      cache->n_entries--;
+    }
+    cache->n_entries++;
+  }
+
+  entry->device = stbuf->st_dev;
+  entry->inode = stbuf->st_ino;
+  entry->size = stbuf->st_size;
+  entry->mtime = stbuf->st_mtim;
+  entry->ctime = stbuf->st_ctim;
+  clock_gettime(CLOCK_MONOTONIC, &entry->verified);
+  HASH_ADD_KEYPTR(hh, cache->entries, entry->file_path,
+                  strlen(entry->file_path), entry);
+  pthread_mutex_unlock(&cache->mutex);
+}
+
+/**
+ * @brief Forget a path (on write, truncate or unlink)
+ *
+ * @param cache     -> cache (NULL: no-op)
+ * @param file_path -> file path
+ */
+void verify_cache_invalidate(VerifyCache *cache, const char *file_path) {
+  if (!cache || !file_path) {
+    return;
+  }
+  pthread_mutex_lock(&cache->mutex);
+  VerifyCacheEntry *entry = NULL;
+  HASH_FIND(hh, cache->entries, file_path, strlen(file_path), entry);
+  if (entry) {
+    HASH_DEL(cache->entries, entry);
+    free_entry(entry);
+    cache->n_entries--;
+  }
+  pthread_mutex_unlock(&cache->mutex);
+}
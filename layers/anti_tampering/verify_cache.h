@@ -0,0 +1,54 @@
+#ifndef __VERIFY_CACHE_H__
+#define __VERIFY_CACHE_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * ============================================================================
+ * VERIFY CACHE - SKIP REPEATED FILE-MODE VERIFICATION ON OPEN
+ * ============================================================================
+ *
+ * Remembers, per path, the watermark of the file (device, inode, size, mtime
+ * and ctime) at its last successful verification or hash computation. While
+ * the watermark is unchanged and the entry is younger than the TTL, opening
+ * the file again skips the full rehash.
+ *
+ * Entries are kept in LRU order (uthash insertion order, refreshed on hit) and
+ * the least recently used one is evicted once max_entries is reached.
+ * ============================================================================
+ */
+
+typedef struct VerifyCacheEntry {
+  char *file_path;           // key
+  dev_t device;              // st_dev at verification time
+  ino_t inode;               // st_ino at verification time
+  off_t size;                // st_size at verification time
+  struct timespec mtime;     // st_mtim at verification time
+  struct timespec ctime;     // st_ctim at verification time
+  struct timespec verified;  // monotonic time of the verification
+  UT_hash_handle hh;
+} VerifyCacheEntry;
+
+typedef struct VerifyCache {
+  VerifyCacheEntry *entries; // LRU ordered, oldest first
+  size_t n_entries;          // current number of entries
+  size_t max_entries;        // LRU bound
+  time_t ttl_seconds;        // entry lifetime, 0 means no expiry
+  size_t hits;               // lookups that skipped verification
+  size_t misses;             // lookups that required verification
+  pthread_mutex_t mutex;     // protects all the fields above
+} VerifyCache;
+
+VerifyCache *verify_cache_init(size_t max_entries, time_t ttl_seconds);
+void verify_cache_destroy(VerifyCache *cache);
+int verify_cache_lookup(VerifyCache *cache, const char *file_path,
+                        const struct stat *stbuf);
+void verify_cache_insert(VerifyCache *cache, const char *file_path,
+                         const struct stat *stbuf);
+void verify_cache_invalidate(VerifyCache *cache, const char *file_path);
+
+#endif // __VERIFY_CACHE_H__
@@ -1,8 +1,17 @@
 #include "benchmark.h"
 #include "../../logdef.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 
+#define BENCHMARK_STATE(l) ((BenchmarkState *)(l).internal_state)
+
+static __thread uint32_t trace_tid;
+
 void print_times(struct timespec start, struct timespec end, int reps, int fd) {
 
   double elapsed = (double)(end.tv_sec - start.tv_sec) +
@@ -15,26 +24,261 @@ void print_times(struct timespec start, struct timespec end, int reps, int fd) {
           reps, elapsed, time_per_op);
 }
 
-LayerContext benchmark_init(LayerContext *next_layer, int nlayers,
-                            int ops_rep) {
-  LayerContext layer_state;
+static inline uint64_t trace_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
 
-  int *ops_rep_mem = malloc(sizeof(int));
+/**
+ * @brief Start tracing a call, if the sampling picks it
+ *
+ * @return uint64_t -> its start time, 0 if it is not traced
+ */
+static inline uint64_t trace_start(BenchmarkState *state) {
+  if (state->sample > 1 &&
+      __atomic_fetch_add(&state->calls, 1, __ATOMIC_RELAXED) %
+              (uint64_t)state->sample !=
+          0) {
+    return 0;
+  }
+  return trace_now();
+}
 
-  *ops_rep_mem = ops_rep;
-  layer_state.internal_state = (void *)ops_rep_mem;
+/**
+ * @brief Record a traced call in the next slot of the ring
+ */
+static void trace_record(BenchmarkState *state, BenchmarkTraceOp op,
+                         uint64_t start, int fd, int64_t offset, uint64_t size,
+                         int64_t result) {
+  if (start == 0) {
+    return;
+  }
+  uint64_t end = trace_now();
+  if (trace_tid == 0) {
+    trace_tid = (uint32_t)syscall(SYS_gettid);
+  }
+  uint64_t slot = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED);
+  BenchmarkTraceRecord *record = &state->ring[slot % state->capacity];
+  // a dump skips the record until its seq is back
+  __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  record->start_ns = start;
+  record->dur_ns = end - start;
+  record->offset = offset;
+  record->size = size;
+  record->result = result;
+  record->fd = fd;
+  record->tid = trace_tid;
+  record->op = (uint16_t)op;
+  __atomic_store_n(&record->seq, slot + 1, __ATOMIC_RELEASE);
+}
+
+static ssize_t benchmark_trace_pread(int fd, void *buffer, size_t nbytes,
+                                     off_t offset, LayerContext l) {
+  uint64_t start = trace_start(BENCHMARK_STATE(l));
+  ssize_t res =
+      l.next_layers->ops->lpread(fd, buffer, nbytes, offset, *l.next_layers);
+  trace_record(BENCHMARK_STATE(l), BENCHMARK_TRACE_PREAD, start, fd, offset,
+               nbytes, res);
+  return res;
+}
+
+static ssize_t benchmark_trace_pwrite(int fd, const void *buffer,
+                                      size_t nbytes, off_t offset,
+                                      LayerContext l) {
+  uint64_t start = trace_start(BENCHMARK_STATE(l));
+  ssize_t res =
+      l.next_layers->ops->lpwrite(fd, buffer, nbytes, offset, *l.next_layers);
+  trace_record(BENCHMARK_STATE(l), BENCHMARK_TRACE_PWRITE, start, fd, offset,
+               nbytes, res);
+  return res;
+}
+
+static int benchmark_trace_open(const char *pathname, int flags, mode_t mode,
+                                LayerContext l) {
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  uint64_t start = trace_start(BENCHMARK_STATE(l));
+  int res = next_layer.ops->lopen(pathname, flags, mode, next_layer);
+  trace_record(BENCHMARK_STATE(l), BENCHMARK_TRACE_OPEN, start, res, -1, 0,
+               res);
+  return res;
+}
+
+static int benchmark_trace_close(int fd, LayerContext l) {
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  uint64_t start = trace_start(BENCHMARK_STATE(l));
+  int res = next_layer.ops->lclose(fd, next_layer);
+  trace_record(BENCHMARK_STATE(l), BENCHMARK_TRACE_CLOSE, start, fd, -1, 0,
+               res);
+  return res;
+}
+
+static int benchmark_trace_ftruncate(int fd, off_t length, LayerContext l) {
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  uint64_t start = trace_start(BENCHMARK_STATE(l));
+  int res = next_layer.ops->lftruncate(fd, length, next_layer);
+  trace_record(BENCHMARK_STATE(l), BENCHMARK_TRACE_FTRUNCATE, start, fd, -1,
+               (uint64_t)length, res);
+  return res;
+}
+
+static int benchmark_trace_fstat(int fd, struct stat *stbuf, LayerContext l) {
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  uint64_t start = trace_start(BENCHMARK_STATE(l));
+  int res = next_layer.ops->lfstat(fd, stbuf, next_layer);
+  trace_record(BENCHMARK_STATE(l), BENCHMARK_TRACE_FSTAT, start, fd, -1, 0,
+               res);
+  return res;
+}
+
+static int benchmark_trace_lstat(const char *pathname, struct stat *stbuf,
+                                 LayerContext l) {
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  uint64_t start = trace_start(BENCHMARK_STATE(l));
+  int res = next_layer.ops->llstat(pathname, stbuf, next_layer);
+  trace_record(BENCHMARK_STATE(l), BENCHMARK_TRACE_LSTAT, start, -1, -1, 0,
+               res);
+  return res;
+}
+
+static int benchmark_trace_unlink(const char *pathname, LayerContext l) {
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  uint64_t start = trace_start(BENCHMARK_STATE(l));
+  int res = next_layer.ops->lunlink(pathname, next_layer);
+  trace_record(BENCHMARK_STATE(l), BENCHMARK_TRACE_UNLINK, start, -1, -1, 0,
+               res);
+  return res;
+}
+
+int benchmark_trace_dump(LayerContext l, const char *path) {
+  BenchmarkState *state = BENCHMARK_STATE(l);
+  if (state->mode != BENCHMARK_MODE_TRACE) {
+    errno = EINVAL;
+    return -1;
+  }
+  uint64_t taken = __atomic_load_n(&state->next, __ATOMIC_ACQUIRE);
+  uint64_t first = taken > state->capacity ? taken - state->capacity : 0;
+  BenchmarkTraceRecord *records =
+      malloc((size_t)(taken - first + 1) * sizeof(BenchmarkTraceRecord));
+  if (!records) {
+    return -1;
+  }
+  // copy the complete records, oldest first
+  uint64_t n = 0;
+  for (uint64_t slot = first; slot < taken; slot++) {
+    BenchmarkTraceRecord *record = &state->ring[slot % state->capacity];
+    if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != slot + 1) {
+      continue;
+    }
+    records[n] = *record;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&record->seq, __ATOMIC_RELAXED) == slot + 1) {
+      n++;
+    }
+  }
+
+  BenchmarkTraceHeader header = {0};
+  memcpy(header.magic, BENCHMARK_TRACE_MAGIC, sizeof(BENCHMARK_TRACE_MAGIC));
+  header.version = BENCHMARK_TRACE_VERSION;
+  header.record_size = sizeof(BenchmarkTraceRecord);
+  header.records = n;
+  header.lost = taken - n;
+  header.sample = (uint32_t)state->sample;
+  header.pid = (uint32_t)getpid();
+  memcpy(header.layer, state->name, sizeof(header.layer));
+
+  int res = -1;
+  FILE *file = fopen(path, "wb");
+  if (file) {
+    if (fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(records, sizeof(BenchmarkTraceRecord), n, file) == n) {
+      res = 0;
+    }
+    if (fclose(file) != 0) {
+      res = -1;
+    }
+  }
+  free(records);
+  if (res != 0) {
+    ERROR_MSG("[BENCHMARK_LAYER] Failed to write the trace to %s", path);
+  }
+  return res;
+}
+
+void benchmark_destroy(LayerContext l) {
+  BenchmarkState *state = BENCHMARK_STATE(l);
+  if (state->mode == BENCHMARK_MODE_TRACE && state->trace) {
+    benchmark_trace_dump(l, state->trace);
+  }
+  if (l.next_layers->ops->ldestroy) {
+    l.next_layers->ops->ldestroy(*l.next_layers);
+  }
+  free(state->ring);
+  free(state->trace);
+  free(state);
+  free(l.ops);
+  free(l.next_layers);
+}
+
+LayerContext benchmark_init(LayerContext *next_layer, int nlayers,
+                            const BenchmarkConfig *config) {
+  LayerContext layer_state = {0};
+
+  BenchmarkState *state = calloc(1, sizeof(BenchmarkState));
+  if (!state) {
+    return layer_state;
+  }
+  state->ops_rep = config->ops_reps <= 0 ? 1 : config->ops_reps;
+  state->mode = config->mode;
+  state->sample = config->trace_sample <= 0 ? 1 : config->trace_sample;
+  (void)snprintf(state->name, sizeof(state->name), "%s",
+                 config->name ? config->name : "benchmark");
+  if (state->mode == BENCHMARK_MODE_TRACE) {
+    state->capacity = config->trace_records ? config->trace_records
+                                            : BENCHMARK_TRACE_DEFAULT_RECORDS;
+    state->ring = calloc(state->capacity, sizeof(BenchmarkTraceRecord));
+    state->trace = config->trace ? strdup(config->trace) : NULL;
+    if (!state->ring || (config->trace && !state->trace)) {
+      ERROR_MSG("[BENCHMARK_LAYER] Failed to allocate the trace ring");
+      free(state->ring);
+      free(state->trace);
+      free(state);
+      return layer_state;
+    }
+  }
+  layer_state.internal_state = state;
   layer_state.app_context = NULL;
 
   // Create LayerOps structure
-  LayerOps *benchmark_ops = malloc(sizeof(LayerOps));
-  benchmark_ops->lpread = benchmark_pread;
-  benchmark_ops->lpwrite = benchmark_pwrite;
-  benchmark_ops->lopen = benchmark_open;
-  benchmark_ops->lclose = benchmark_close;
-  benchmark_ops->lftruncate = benchmark_ftruncate;
-  benchmark_ops->llstat = benchmark_lstat;
-  benchmark_ops->lfstat = benchmark_fstat;
-  benchmark_ops->lunlink = benchmark_unlink;
+  LayerOps *benchmark_ops = calloc(1, sizeof(LayerOps));
+  if (state->mode == BENCHMARK_MODE_TRACE) {
+    benchmark_ops->lpread = benchmark_trace_pread;
+    benchmark_ops->lpwrite = benchmark_trace_pwrite;
+    benchmark_ops->lopen = benchmark_trace_open;
+    benchmark_ops->lclose = benchmark_trace_close;
+    benchmark_ops->lftruncate = benchmark_trace_ftruncate;
+    benchmark_ops->llstat = benchmark_trace_lstat;
+    benchmark_ops->lfstat = benchmark_trace_fstat;
+    benchmark_ops->lunlink = benchmark_trace_unlink;
+  } else {
+    benchmark_ops->lpread = benchmark_pread;
+    benchmark_ops->lpwrite = benchmark_pwrite;
+    benchmark_ops->lopen = benchmark_open;
+    benchmark_ops->lclose = benchmark_close;
+    benchmark_ops->lftruncate = benchmark_ftruncate;
+    benchmark_ops->llstat = benchmark_lstat;
+    benchmark_ops->lfstat = benchmark_fstat;
+    benchmark_ops->lunlink = benchmark_unlink;
+  }
+  benchmark_ops->lfsync = benchmark_fsync;
+  benchmark_ops->ldestroy = benchmark_destroy;
   layer_state.ops = benchmark_ops;
 
   LayerContext *aux = malloc(sizeof(LayerContext));
@@ -48,27 +292,30 @@ LayerContext benchmark_init(LayerContext *next_layer, int nlayers,
 int benchmark_open(const char *pathname, int flags, mode_t mode,
                    LayerContext l) {
   int fd;
-  l.next_layers->app_context = l.app_context;
-  fd = l.next_layers->ops->lopen(pathname, flags, mode, *l.next_layers);
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  fd = next_layer.ops->lopen(pathname, flags, mode, next_layer);
   return fd;
 }
 
 int benchmark_close(int fd, LayerContext l) {
   int res;
-  l.next_layers->app_context = l.app_context;
-  res = l.next_layers->ops->lclose(fd, *l.next_layers);
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  res = next_layer.ops->lclose(fd, next_layer);
   return res;
 }
 
 int benchmark_fstat(int fd, struct stat *stbuf, LayerContext l) {
-  int ops_rep = *(int *)l.internal_state;
-  l.next_layers->app_context = l.app_context;
+  int ops_rep = BENCHMARK_STATE(l)->ops_rep;
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
 
   struct timespec start, end;
   clock_gettime(CLOCK_MONOTONIC, &start);
   int res = -1;
   for (int i = 0; i < ops_rep; i++) {
-    res = l.next_layers->ops->lfstat(fd, stbuf, *l.next_layers);
+    res = next_layer.ops->lfstat(fd, stbuf, next_layer);
   }
   clock_gettime(CLOCK_MONOTONIC, &end);
   print_times(start, end, ops_rep, STDOUT_FILENO);
@@ -76,14 +323,15 @@ int benchmark_fstat(int fd, struct stat *stbuf, LayerContext l) {
 }
 
 int benchmark_lstat(const char *pathname, struct stat *stbuf, LayerContext l) {
-  int ops_rep = *(int *)l.internal_state;
-  l.next_layers->app_context = l.app_context;
+  int ops_rep = BENCHMARK_STATE(l)->ops_rep;
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
 
   struct timespec start, end;
   clock_gettime(CLOCK_MONOTONIC, &start);
   int res = -1;
   for (int i = 0; i < ops_rep; i++) {
-    res = l.next_layers->ops->llstat(pathname, stbuf, *l.next_layers);
+    res = next_layer.ops->llstat(pathname, stbuf, next_layer);
   }
   clock_gettime(CLOCK_MONOTONIC, &end);
   print_times(start, end, ops_rep, STDOUT_FILENO);
@@ -93,7 +341,7 @@ int benchmark_lstat(const char *pathname, struct stat *stbuf, LayerContext l) {
 
 ssize_t benchmark_pread(int fd, void *buffer, size_t nbytes, off_t offset,
                         LayerContext l) {
-  int ops_rep = *(int *)l.internal_state;
+  int ops_rep = BENCHMARK_STATE(l)->ops_rep;
 
   struct timespec start, end;
   clock_gettime(CLOCK_MONOTONIC, &start);
@@ -112,7 +360,7 @@ ssize_t benchmark_pread(int fd, void *buffer, size_t nbytes, off_t offset,
 ssize_t benchmark_pwrite(int fd, const void *buffer, size_t nbytes,
                          off_t offset, LayerContext l) {
 
-  int ops_rep = *(int *)l.internal_state;
+  int ops_rep = BENCHMARK_STATE(l)->ops_rep;
 
   struct timespec start, end;
   clock_gettime(CLOCK_MONOTONIC, &start);
@@ -129,14 +377,15 @@ ssize_t benchmark_pwrite(int fd, const void *buffer, size_t nbytes,
 }
 
 int benchmark_ftruncate(int fd, off_t length, LayerContext l) {
-  l.next_layers->app_context = l.app_context;
-  int ops_rep = *(int *)l.internal_state;
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  int ops_rep = BENCHMARK_STATE(l)->ops_rep;
   int res = -1;
 
   struct timespec start, end;
   clock_gettime(CLOCK_MONOTONIC, &start);
   for (int i = 0; i < ops_rep; i++) {
-    res = l.next_layers->ops->lftruncate(fd, length, *l.next_layers);
+    res = next_layer.ops->lftruncate(fd, length, next_layer);
   }
 
   clock_gettime(CLOCK_MONOTONIC, &end);
@@ -145,7 +394,17 @@ int benchmark_ftruncate(int fd, off_t length, LayerContext l) {
   return res;
 }
 
+int benchmark_fsync(int fd, int isdatasync, LayerContext l) {
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  if (!next_layer.ops->lfsync) {
+    return 0;
+  }
+  return next_layer.ops->lfsync(fd, isdatasync, next_layer);
+}
+
 int benchmark_unlink(const char *pathname, LayerContext l) {
-  l.next_layers->app_context = l.app_context;
-  return l.next_layers->ops->lunlink(pathname, *l.next_layers);
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  return next_layer.ops->lunlink(pathname, next_layer);
 }
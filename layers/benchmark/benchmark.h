@@ -3,15 +3,111 @@
 
 #include "../../shared/types/layer_context.h"
 #include "config.h"
+#include <stdint.h>
+
+/*
+ * ============================================================================
+ * TRACE MODE - EACH OPERATION ONCE, RECORDED IN A RING
+ * ============================================================================
+ *
+ * With mode = "trace" the layer runs each operation once, like any other
+ * layer, and records its start time, duration, fd, offset, size and result
+ * in a ring of trace_records records. A call takes a slot with one atomic
+ * add and overwrites the oldest record when the ring is full, so tracing
+ * takes no lock and its memory is fixed. With trace_sample = N only one call
+ * of every N is timed and recorded, the others are only forwarded.
+ *
+ * The ring is written to the trace file when the layer is destroyed, or by
+ * benchmark_trace_dump, as a BenchmarkTraceHeader followed by the records,
+ * oldest first. scripts/benchmark/trace_to_chrome.py converts one or more
+ * trace files to the Chrome trace format that chrome://tracing and Perfetto
+ * open; the times are CLOCK_MONOTONIC, so the traces of the layers at each
+ * level of a tree line up, each on its own track.
+ * ============================================================================
+ */
+
+#define BENCHMARK_TRACE_MAGIC "TGTRACE"
+#define BENCHMARK_TRACE_VERSION 1
+
+// The operations traced, in the order of the trace_to_chrome.py names
+typedef enum {
+  BENCHMARK_TRACE_PREAD,
+  BENCHMARK_TRACE_PWRITE,
+  BENCHMARK_TRACE_OPEN,
+  BENCHMARK_TRACE_CLOSE,
+  BENCHMARK_TRACE_FTRUNCATE,
+  BENCHMARK_TRACE_FSTAT,
+  BENCHMARK_TRACE_LSTAT,
+  BENCHMARK_TRACE_UNLINK,
+} BenchmarkTraceOp;
+
+typedef struct {
+  uint64_t seq;      // 1 + the slot taken by the call, 0 while being written
+  uint64_t start_ns; // CLOCK_MONOTONIC time the call started
+  uint64_t dur_ns;   // time the next layer took
+  int64_t offset;    // -1 for the operations without one
+  uint64_t size;     // bytes asked for, or the length of ftruncate
+  int64_t result;    // result of the next layer
+  int32_t fd;        // -1 for the operations on paths
+  uint32_t tid;      // thread of the call
+  uint16_t op;       // BenchmarkTraceOp
+  uint16_t reserved[3];
+} BenchmarkTraceRecord;
+
+typedef struct {
+  char magic[8];        // BENCHMARK_TRACE_MAGIC
+  uint32_t version;     // BENCHMARK_TRACE_VERSION
+  uint32_t record_size; // sizeof(BenchmarkTraceRecord)
+  uint64_t records;     // records following the header
+  uint64_t lost;        // calls recorded but overwritten, or being written
+  uint32_t sample;      // trace_sample of the layer
+  uint32_t pid;         // process traced
+  char layer[64];       // name of the layer
+} BenchmarkTraceHeader;
+
+typedef struct {
+  int ops_rep;
+  BenchmarkMode mode;
+  char *trace;                  // file dumped to on destroy, may be NULL
+  char name[64];                // name of the layer in the trace
+  BenchmarkTraceRecord *ring;   // trace mode: trace_records slots
+  size_t capacity;              // slots of the ring
+  uint64_t next;                // slots taken, atomic
+  uint64_t calls;               // calls seen, atomic, for the sampling
+  int sample;                   // record one call of every sample
+} BenchmarkState;
+
 /**
  * @brief Initializes the benchmark layer context.
  *
  * @param next_layer Pointer to the next layer context.
  * @param nlayers Number of layers in the stack.
- * @param ops_rep Number of repetitions for benchmarking operations.
- * @return Initialized LayerContext for the benchmark layer.
+ * @param config Layer configuration, the mode, reps and trace options.
+ * @return Initialized LayerContext for the benchmark layer, with NULL ops if
+ * the trace ring could not be allocated.
+ */
+LayerContext benchmark_init(LayerContext *next_layer, int nlayers,
+                            const BenchmarkConfig *config);
+
+/**
+ * @brief Writes the trace ring of a layer in trace mode to a file.
+ *
+ * Calls may go on during the dump; the records they are writing are left
+ * out and counted as lost.
+ *
+ * @param l Benchmark layer context.
+ * @param path File to write, replaced.
+ * @return 0 on success, or -1 on error (not in trace mode, or I/O error).
+ */
+int benchmark_trace_dump(LayerContext l, const char *path);
+
+/**
+ * @brief Dumps the trace to the trace file, if any, and destroys the layer
+ * and the layers below it.
+ *
+ * @param l Benchmark layer context.
  */
-LayerContext benchmark_init(LayerContext *next_layer, int nlayers, int ops_rep);
+void benchmark_destroy(LayerContext l);
 
 /**
  * @brief Opens a file.
@@ -95,6 +191,16 @@ ssize_t benchmark_pwrite(int fd, const void *buffer, size_t nbytes,
  */
 int benchmark_ftruncate(int fd, off_t length, LayerContext l);
 
+/**
+ * @brief Flushes a file, in both modes without timing it.
+ *
+ * @param fd File descriptor.
+ * @param isdatasync Only flush the data if non-zero.
+ * @param l Benchmark layer context.
+ * @return 0 on success, or -1 on error.
+ */
+int benchmark_fsync(int fd, int isdatasync, LayerContext l);
+
 /**
  * @brief Unlinks a file.
  *
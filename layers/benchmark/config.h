@@ -2,11 +2,25 @@
 #define __BENCHMARK__
 
 #include "../../config/utils.h"
+#include <limits.h>
+#include <stddef.h>
+
+#define BENCHMARK_TRACE_DEFAULT_RECORDS 65536
+
+typedef enum {
+  BENCHMARK_MODE_REPEAT, // repeat each operation reps times, print the time
+  BENCHMARK_MODE_TRACE,  // run each operation once, record it in a ring
+} BenchmarkMode;
 
 // Benchmark layer configuration structure
 typedef struct {
   char *next_Layer;
   int ops_reps;
+  BenchmarkMode mode;
+  char *trace;          // trace mode: file the ring is dumped to on destroy
+  size_t trace_records; // trace mode: records kept, the oldest overwritten
+  int trace_sample;     // trace mode: record one call of every trace_sample
+  const char *name;     // name of the layer in the trace, set by the builder
 } BenchmarkConfig;
 
 /**
@@ -19,6 +33,38 @@ static inline void benchmark_parse_params(toml_datum_t layer_table,
   int temp = parse_int(ops_reps);
   config->ops_reps = temp <= 0 ? 1 : temp;
   config->next_Layer = parse_string(next);
+
+  config->mode = BENCHMARK_MODE_REPEAT;
+  toml_datum_t mode = toml_get(layer_table, "mode");
+  if (mode.type == TOML_STRING) {
+    if (strcmp(mode.u.s, "repeat") == 0) {
+      config->mode = BENCHMARK_MODE_REPEAT;
+    } else if (strcmp(mode.u.s, "trace") == 0) {
+      config->mode = BENCHMARK_MODE_TRACE;
+    } else {
+      toml_error("Unsupported benchmark mode (use 'repeat' or 'trace')");
+    }
+  }
+
+  // Parse the trace options (optional)
+  config->trace = parse_string(toml_get(layer_table, "trace"));
+  config->trace_records = BENCHMARK_TRACE_DEFAULT_RECORDS;
+  toml_datum_t records = toml_get(layer_table, "trace_records");
+  if (records.type == TOML_INT64) {
+    if (records.u.int64 < 1) {
+      toml_error("Benchmark layer trace_records must be positive");
+    }
+    config->trace_records = (size_t)records.u.int64;
+  }
+  config->trace_sample = 1;
+  toml_datum_t sample = toml_get(layer_table, "trace_sample");
+  if (sample.type == TOML_INT64) {
+    if (sample.u.int64 < 1 || sample.u.int64 > INT_MAX) {
+      toml_error("Benchmark layer trace_sample must be positive");
+    }
+    config->trace_sample = (int)sample.u.int64;
+  }
+  config->name = NULL;
 }
 
 #endif // __BENCHMARK__
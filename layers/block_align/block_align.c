@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include "block_align.h"
 #include "../../logdef.h"
+#include "../../shared/utils/layer_iov.h"
 #include "glib.h"
 #include "types/layer_context.h"
 #include <dlfcn.h>
@@ -8,23 +10,171 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+static int64_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Write the pending block of an fd (combiner mutex held)
+ *
+ * The written bytes are merged onto the block as read now, not when it
+ * became pending, so the writes of other fds to the block are kept.
+ *
+ * @return int -> 0 on success or if nothing is pending, -1 on error (the
+ * block stays pending)
+ */
+static int combiner_flush(BlockAlignState *state, WriteCombiner *wc, int fd,
+                          LayerContext next) {
+  if (wc->block_start < 0) {
+    return 0;
+  }
+  size_t block_size = state->block_size;
+  char *out = wc->block;
+  size_t len = wc->dirty_to;
+  char *merged = NULL;
+  if (wc->dirty_from > 0 || wc->dirty_to < block_size) {
+    merged = buffer_pool_get(state->buffers, block_size);
+    if (merged == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    ssize_t n = next.ops->lpread(fd, merged, block_size, wc->block_start, next);
+    if (n == -1) {
+      ERROR_MSG("[BLOCK_ALIGN_LAYER] Failed to read the pending block at "
+                "offset %ld (fd=%d)",
+                (long)wc->block_start, fd);
+      buffer_pool_put(state->buffers, merged);
+      return -1;
+    }
+    // past the end of the file
+    memset(merged + n, 0, block_size - (size_t)n);
+    memcpy(merged + wc->dirty_from, wc->block + wc->dirty_from,
+           wc->dirty_to - wc->dirty_from);
+    if ((size_t)n > len) {
+      len = (size_t)n;
+    }
+    out = merged;
+  }
+  ssize_t res = next.ops->lpwrite(fd, out, len, wc->block_start, next);
+  if (merged != NULL) {
+    buffer_pool_put(state->buffers, merged);
+  }
+  if (res != (ssize_t)len) {
+    ERROR_MSG("[BLOCK_ALIGN_LAYER] Failed to write the pending block at "
+              "offset %ld (fd=%d)",
+              (long)wc->block_start, fd);
+    if (res >= 0) {
+      errno = EIO;
+    }
+    return -1;
+  }
+  wc->block_start = -1;
+  return 0;
+}
+
+static void combiner_free(WriteCombiner *wc) {
+  pthread_mutex_destroy(&wc->mutex);
+  free(wc->block);
+  free(wc);
+}
+
+/**
+ * @brief Lock the WriteCombiner of an fd
+ *
+ * @return WriteCombiner* -> locked combiner, NULL if the fd has none
+ */
+static WriteCombiner *combiner_lock(BlockAlignState *state, int fd) {
+  if (state->write_combine_ms == 0) {
+    return NULL;
+  }
+  pthread_mutex_lock(&state->combine_mutex);
+  WriteCombiner *wc =
+      g_hash_table_lookup(state->combiners, GINT_TO_POINTER(fd));
+  if (wc) {
+    pthread_mutex_lock(&wc->mutex);
+  }
+  pthread_mutex_unlock(&state->combine_mutex);
+  return wc;
+}
+
+/**
+ * @brief Write the pending block of an fd before an operation that reads it
+ * below this layer
+ *
+ * @return int -> 0 on success, -1 on error
+ */
+static int flush_fd(BlockAlignState *state, int fd, LayerContext l) {
+  WriteCombiner *wc = combiner_lock(state, fd);
+  if (!wc) {
+    return 0;
+  }
+  int res = combiner_flush(state, wc, fd, *l.next_layers);
+  pthread_mutex_unlock(&wc->mutex);
+  return res;
+}
+
+/**
+ * @brief Flusher thread: writes the blocks pending for longer than
+ * write_combine_ms
+ */
+static void *combine_worker(void *arg) {
+  BlockAlignState *state = arg;
+  int64_t period_ms = state->write_combine_ms;
+
+  pthread_mutex_lock(&state->combine_mutex);
+  while (!state->stopping) {
+    int64_t deadline_ms = now_ms() + period_ms;
+    struct timespec deadline = {.tv_sec = deadline_ms / 1000,
+                                .tv_nsec = (deadline_ms % 1000) * 1000000};
+    pthread_cond_timedwait(&state->combine_cond, &state->combine_mutex,
+                           &deadline);
+    if (state->stopping) {
+      break;
+    }
+
+    GHashTableIter iter;
+    gpointer key, value;
+    int64_t now = now_ms();
+    g_hash_table_iter_init(&iter, state->combiners);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+      WriteCombiner *wc = value;
+      pthread_mutex_lock(&wc->mutex);
+      if (wc->block_start >= 0 &&
+          now - wc->dirtied_ms >= state->write_combine_ms) {
+        (void)combiner_flush(state, wc, GPOINTER_TO_INT(key),
+                             state->next_layer);
+      }
+      pthread_mutex_unlock(&wc->mutex);
+    }
+  }
+  pthread_mutex_unlock(&state->combine_mutex);
+  return NULL;
+}
 
 LayerContext block_align_init(LayerContext *next_layer, int nlayers,
-                              size_t block_size) {
+                              const BlockAlignConfig *config) {
 
   LayerContext layer_context;
 
-  LayerOps *block_align_ops = malloc(sizeof(LayerOps));
+  LayerOps *block_align_ops = calloc(1, sizeof(LayerOps));
   layer_context.ops = block_align_ops;
   layer_context.ops->ldestroy = block_align_destroy;
   layer_context.ops->lpread = block_align_pread;
   layer_context.ops->lpwrite = block_align_pwrite;
+  layer_context.ops->lpreadv = block_align_preadv;
+  layer_context.ops->lpwritev = block_align_pwritev;
   layer_context.ops->lopen = block_align_open;
   layer_context.ops->lclose = block_align_close;
   layer_context.ops->lftruncate = block_align_ftruncate;
   layer_context.ops->lfstat = block_align_fstat;
   layer_context.ops->llstat = block_align_lstat;
   layer_context.ops->lunlink = block_align_unlink;
+  layer_context.ops->lfsync = block_align_fsync;
+  layer_context.ops->ldirect_alignment = block_align_direct_alignment;
 
   LayerContext *aux = malloc(sizeof(LayerContext));
   memcpy(aux, next_layer, sizeof(LayerContext));
@@ -33,11 +183,29 @@ LayerContext block_align_init(LayerContext *next_layer, int nlayers,
 
   layer_context.app_context = NULL;
 
-  BlockAlignState *state = malloc(sizeof(BlockAlignState));
-  state->block_size = block_size;
+  BlockAlignState *state = calloc(1, sizeof(BlockAlignState));
+  state->block_size = config->block_size;
   state->fds_special_flags = g_hash_table_new(g_direct_hash, g_direct_equal);
+  state->buffers = buffer_pool_shared();
   layer_context.internal_state = (void *)state;
 
+  state->write_combine_ms = config->write_combine_ms;
+  state->next_layer = *next_layer;
+  if (state->write_combine_ms > 0) {
+    pthread_condattr_t attr;
+    state->combiners = g_hash_table_new(g_direct_hash, g_direct_equal);
+    pthread_mutex_init(&state->combine_mutex, NULL);
+    if (pthread_condattr_init(&attr) != 0 ||
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0 ||
+        pthread_cond_init(&state->combine_cond, &attr) != 0 ||
+        pthread_create(&state->flusher, NULL, combine_worker, state) != 0) {
+      ERROR_MSG("[BLOCK_ALIGN_LAYER] Failed to start the write combining "
+                "flusher");
+      exit(1);
+    }
+    pthread_condattr_destroy(&attr);
+  }
+
   return layer_context;
 }
 
@@ -48,6 +216,25 @@ void block_align_destroy(LayerContext l) {
   }
 
   BlockAlignState *state = (BlockAlignState *)l.internal_state;
+  if (state->write_combine_ms > 0) {
+    pthread_mutex_lock(&state->combine_mutex);
+    state->stopping = 1;
+    pthread_cond_broadcast(&state->combine_cond);
+    pthread_mutex_unlock(&state->combine_mutex);
+    pthread_join(state->flusher, NULL);
+
+    // blocks left by fds never closed, their fds are still open below
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, state->combiners);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+      (void)combiner_flush(state, value, GPOINTER_TO_INT(key), *l.next_layers);
+      combiner_free(value);
+    }
+    g_hash_table_destroy(state->combiners);
+    pthread_cond_destroy(&state->combine_cond);
+    pthread_mutex_destroy(&state->combine_mutex);
+  }
   g_hash_table_destroy(state->fds_special_flags);
   l.next_layers->ops->ldestroy(*l.next_layers);
   free(l.ops);
@@ -62,6 +249,7 @@ int block_align_open(const char *pathname, int flags, mode_t mode,
 
   int append = (flags & O_APPEND) != 0;
   int write = (flags & O_WRONLY) != 0;
+  int direct = (flags & O_DIRECT) != 0;
   int value = 0; // this will accumulate the value to insert in the hash table
                  // in order to annotate what special cases this fd has
 
@@ -76,29 +264,153 @@ int block_align_open(const char *pathname, int flags, mode_t mode,
     value |= O_WRONLY;
   }
 
-  l.next_layers->app_context = l.app_context;
-  fd = l.next_layers->ops->lopen(pathname, flags, mode, *l.next_layers);
+  if (direct) {
+    value |= O_DIRECT;
+  }
+
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  fd = next_layer.ops->lopen(pathname, flags, mode, next_layer);
+
+  // the blocks, and the pool buffers they bounce through, must satisfy the
+  // alignment of the next layer
+  if (fd >= 0 && direct) {
+    size_t alignment = layer_direct_alignment(next_layer);
+    if (state->block_size % alignment != 0 ||
+        BUFFER_POOL_ALIGNMENT % alignment != 0) {
+      ERROR_MSG("[BLOCK_ALIGN_LAYER] Block size %zu does not fit the O_DIRECT "
+                "alignment %zu of the next layer",
+                state->block_size, alignment);
+      next_layer.ops->lclose(fd, next_layer);
+      errno = EINVAL;
+      return -1;
+    }
+  }
 
-  if (write || append)
+  if (write || append || direct)
     g_hash_table_insert(state->fds_special_flags, GINT_TO_POINTER(fd),
                         GINT_TO_POINTER(value));
 
+  if (fd >= 0 && state->write_combine_ms > 0 && !direct &&
+      (flags & O_ACCMODE) != O_RDONLY) {
+    WriteCombiner *wc = calloc(1, sizeof(WriteCombiner));
+    char *block = malloc(state->block_size);
+    if (!wc || !block) {
+      free(wc);
+      free(block);
+      next_layer.ops->lclose(fd, next_layer);
+      g_hash_table_remove(state->fds_special_flags, GINT_TO_POINTER(fd));
+      errno = ENOMEM;
+      return -1;
+    }
+    pthread_mutex_init(&wc->mutex, NULL);
+    wc->block = block;
+    wc->block_start = -1;
+    pthread_mutex_lock(&state->combine_mutex);
+    g_hash_table_insert(state->combiners, GINT_TO_POINTER(fd), wc);
+    pthread_mutex_unlock(&state->combine_mutex);
+  }
+
   return fd;
 }
 
 int block_align_close(int fd, LayerContext l) {
   int res;
-  l.next_layers->app_context = l.app_context;
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
   BlockAlignState *state = (BlockAlignState *)l.internal_state;
-  res = l.next_layers->ops->lclose(fd, *l.next_layers);
+
+  // the pending block goes out before the fd, the flusher may be writing it
+  int flushed = 0;
+  if (state->write_combine_ms > 0) {
+    pthread_mutex_lock(&state->combine_mutex);
+    WriteCombiner *wc =
+        g_hash_table_lookup(state->combiners, GINT_TO_POINTER(fd));
+    if (wc) {
+      g_hash_table_remove(state->combiners, GINT_TO_POINTER(fd));
+      pthread_mutex_lock(&wc->mutex);
+    }
+    pthread_mutex_unlock(&state->combine_mutex);
+    if (wc) {
+      flushed = combiner_flush(state, wc, fd, next_layer);
+      pthread_mutex_unlock(&wc->mutex);
+      combiner_free(wc);
+    }
+  }
+
+  res = next_layer.ops->lclose(fd, next_layer);
   if (res == 0) {
     g_hash_table_remove(state->fds_special_flags, GINT_TO_POINTER(fd));
   }
+  if (res == 0 && flushed != 0) {
+    errno = EIO;
+    return -1;
+  }
+  return res;
+}
+
+/**
+ * @brief Check if caller buffers can go to an O_DIRECT fd of the next layer
+ * as they are
+ */
+static int iov_direct_aligned(const struct iovec *iov, int iovcnt) {
+  for (int i = 0; i < iovcnt; i++) {
+    if ((uintptr_t)iov[i].iov_base % BUFFER_POOL_ALIGNMENT != 0 ||
+        iov[i].iov_len % BUFFER_POOL_ALIGNMENT != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief preadv of an O_DIRECT fd: the blocks are read into an aligned pool
+ * buffer, unless the request is whole blocks in aligned buffers
+ *
+ * @return ssize_t -> number of bytes read, -1 on error
+ */
+static ssize_t direct_preadv(BlockAlignState *state, int fd,
+                             const struct iovec *iov, int iovcnt, size_t nbytes,
+                             off_t offset, LayerContext l) {
+  size_t block_size = state->block_size;
+  size_t head = offset % block_size;
+  size_t span = (head + nbytes + block_size - 1) / block_size * block_size;
+
+  if (head == 0 && span == nbytes && iov_direct_aligned(iov, iovcnt)) {
+    return layer_preadv(fd, iov, iovcnt, offset, *l.next_layers);
+  }
+
+  char *bounce = buffer_pool_get(state->buffers, span);
+  if (bounce == NULL)
+    return -1;
+  ssize_t res = l.next_layers->ops->lpread(
+      fd, bounce, span, offset - (off_t)head, *l.next_layers);
+  if (res >= 0) {
+    size_t bytes = (size_t)res <= head ? 0 : (size_t)res - head;
+    if (bytes > nbytes) {
+      bytes = nbytes;
+    }
+    iov_scatter(iov, iovcnt, bounce + head, bytes);
+    res = (ssize_t)bytes;
+  }
+  buffer_pool_put(state->buffers, bounce);
   return res;
 }
 
 ssize_t block_align_pread(int fd, void *buffer, size_t nbytes, off_t offset,
                           LayerContext l) {
+  struct iovec iov = {.iov_base = buffer, .iov_len = nbytes};
+  return block_align_preadv(fd, &iov, 1, offset, l);
+}
+
+ssize_t block_align_pwrite(int fd, const void *buffer, size_t nbytes,
+                           off_t offset, LayerContext l) {
+  struct iovec iov = {.iov_base = (void *)buffer, .iov_len = nbytes};
+  return block_align_pwritev(fd, &iov, 1, offset, l);
+}
+
+ssize_t block_align_preadv(int fd, const struct iovec *iov, int iovcnt,
+                           off_t offset, LayerContext l) {
 
   BlockAlignState *state = (BlockAlignState *)l.internal_state;
 
@@ -110,158 +422,444 @@ ssize_t block_align_pread(int fd, void *buffer, size_t nbytes, off_t offset,
     return -1;
   }
 
+  size_t nbytes = iov_length(iov, iovcnt);
+  if (nbytes == 0) {
+    return 0;
+  }
+  if (flush_fd(state, fd, l) != 0) {
+    return -1;
+  }
+  if ((special & O_DIRECT) != 0) {
+    return direct_preadv(state, fd, iov, iovcnt, nbytes, offset, l);
+  }
+
   size_t block_size = state->block_size;
   size_t offset_fst_block = offset % block_size;
-  int is_offset_aligned = offset_fst_block == 0;
-  int is_nbytes_aligned = (nbytes % block_size) == 0;
-
-  ssize_t bytes_return; // the number of bytes to be returned
-
-  if (is_offset_aligned && is_nbytes_aligned) {
-    bytes_return =
-        l.next_layers->ops->lpread(fd, buffer, nbytes, offset, *l.next_layers);
-
-  } else {
-
-    size_t start_block = offset / block_size;
-    size_t start_bytes = start_block * block_size;
-    size_t final_block = (offset + nbytes - 1) / block_size;
-    size_t num_blocks = final_block - start_block + 1;
-    size_t total_block_bytes = num_blocks * block_size;
+  size_t end_lst_block = (offset + nbytes) % block_size;
+  size_t tail_bytes = end_lst_block == 0 ? 0 : block_size - end_lst_block;
 
-    char *block_buffer = malloc(total_block_bytes);
+  if (offset_fst_block == 0 && tail_bytes == 0) {
+    return layer_preadv(fd, iov, iovcnt, offset, *l.next_layers);
+  }
+  if (iovcnt > LAYER_IOV_MAX - 2) {
+    errno = EINVAL;
+    return -1;
+  }
 
-    if (block_buffer == NULL)
-      return -1;
+  // the caller's buffers get the requested bytes, only the parts of the
+  // first and last blocks outside the request go to a scratch buffer
+  char *scratch =
+      buffer_pool_get(state->buffers, offset_fst_block + tail_bytes);
+  if (scratch == NULL)
+    return -1;
 
-    ssize_t num_bytes_read =
-        l.next_layers->ops->lpread(fd, block_buffer, total_block_bytes,
-                                   (off_t)start_bytes, *l.next_layers);
+  struct iovec blocks[iovcnt + 2];
+  int nblocks = 0;
+  if (offset_fst_block > 0) {
+    blocks[nblocks++] =
+        (struct iovec){.iov_base = scratch, .iov_len = offset_fst_block};
+  }
+  memcpy(&blocks[nblocks], iov, sizeof(struct iovec) * iovcnt);
+  nblocks += iovcnt;
+  if (tail_bytes > 0) {
+    blocks[nblocks++] = (struct iovec){.iov_base = scratch + offset_fst_block,
+                                       .iov_len = tail_bytes};
+  }
 
-    if (num_bytes_read == -1) {
-      free(block_buffer);
-      return -1;
-    }
+  ssize_t num_bytes_read =
+      layer_preadv(fd, blocks, nblocks, offset - (off_t)offset_fst_block,
+                   *l.next_layers);
+  buffer_pool_put(state->buffers, scratch);
 
-    // the number of bytes to be modified and then returned
-    // depends on whether we're at the end of the file or not
-    // left case -> end of the file; right case -> middle of the file
-    bytes_return = (start_bytes + num_bytes_read < offset + nbytes)
-                       ? (ssize_t)(num_bytes_read - offset_fst_block)
-                       : (ssize_t)nbytes;
-    if (bytes_return <= 0) {
-      free(block_buffer);
-      return 0;
-    }
+  if (num_bytes_read == -1) {
+    return -1;
+  }
 
-    memcpy(buffer, block_buffer + offset_fst_block, bytes_return);
-    free(block_buffer);
+  // the number of bytes returned depends on whether we're at the end of
+  // the file or not
+  if ((size_t)num_bytes_read <= offset_fst_block) {
+    return 0;
   }
+  size_t bytes_return = (size_t)num_bytes_read - offset_fst_block;
+  return (ssize_t)(bytes_return < nbytes ? bytes_return : nbytes);
+}
 
-  return bytes_return;
+/**
+ * @brief Read the block starting at block_start, zero-filled past the end of
+ * the file
+ *
+ * @return ssize_t -> number of bytes of the file in the block, -1 on error
+ */
+static ssize_t read_block(int fd, char *block, size_t block_size,
+                          off_t block_start, LayerContext l) {
+  ssize_t res = l.next_layers->ops->lpread(fd, block, block_size, block_start,
+                                           *l.next_layers);
+  if (res >= 0 && (size_t)res < block_size) {
+    memset(block + res, 0, block_size - res);
+  }
+  return res;
 }
 
-ssize_t block_align_pwrite(int fd, const void *buffer, size_t nbytes,
+/**
+ * @brief Write whole blocks, reading the first and last blocks when the
+ * request only covers part of them
+ *
+ * @return ssize_t -> nbytes, or -1 on error
+ */
+static ssize_t rmw_pwritev(BlockAlignState *state, int fd,
+                           const struct iovec *iov, int iovcnt, size_t nbytes,
                            off_t offset, LayerContext l) {
 
-  BlockAlignState *state = (BlockAlignState *)l.internal_state;
-
   ssize_t bytes_written;
   size_t bytes_to_write;
 
   size_t block_size = state->block_size;
-
-  int value = GPOINTER_TO_INT(
-      g_hash_table_lookup(state->fds_special_flags, GINT_TO_POINTER(fd)));
-
-  if ((value & O_APPEND) != 0) // simulate O_APPEND behaviour
-  {
-    struct stat stbuf;
-    int res = l.next_layers->ops->lfstat(fd, &stbuf, *l.next_layers);
-    if (res == -1) {
-      ERROR_MSG("[BLOCK_ALIGN_PWRITE] Failed to get file size for file (fd=%d)",
-                fd);
-      return -1;
-    }
-    offset = stbuf.st_size;
-  }
   size_t offset_fst_block = offset % block_size;
-  int is_offset_aligned = offset_fst_block == 0;
-  int is_nbytes_aligned = (nbytes % block_size) == 0;
+  size_t end_lst_block = (offset + nbytes) % block_size;
 
-  if (is_offset_aligned &&
-      is_nbytes_aligned) { // we're writing whole blocks, so there's no need to
-                           // read first
+  if (offset_fst_block == 0 &&
+      end_lst_block == 0) { // we're writing whole blocks, so there's no need
+                            // to read first
 
     bytes_to_write = nbytes;
-    bytes_written = l.next_layers->ops->lpwrite(fd, buffer, bytes_to_write,
-                                                offset, *l.next_layers);
+    bytes_written = layer_pwritev(fd, iov, iovcnt, offset, *l.next_layers);
 
-  } else { // we're modifying parts of a block, so it's necessary to read and
-           // then modify
+  } else { // we're modifying parts of the first and last blocks, so only
+           // these are read and their untouched bytes written back around
+           // the caller's buffers
 
-    size_t start_block = offset / block_size;
-    size_t start_bytes = start_block * block_size;
-    size_t final_block = (offset + nbytes - 1) / block_size;
-    size_t num_blocks = final_block - start_block + 1;
-    size_t total_block_bytes = num_blocks * block_size;
+    if (iovcnt > LAYER_IOV_MAX - 2) {
+      errno = EINVAL;
+      return -1;
+    }
 
-    char *block_buffer = malloc(total_block_bytes);
+    off_t start_bytes = offset - (off_t)offset_fst_block;
+    off_t final_start = offset + (off_t)nbytes - (off_t)end_lst_block;
 
+    char *block_buffer = buffer_pool_get(state->buffers, 2 * block_size);
     if (block_buffer == NULL)
       return -1;
+    char *fst_block = block_buffer;
+    char *lst_block = block_buffer + block_size;
+
+    ssize_t fst_read = 0;
+    if (offset_fst_block > 0) {
+      fst_read = read_block(fd, fst_block, block_size, start_bytes, l);
+      if (fst_read == -1) {
+        buffer_pool_put(state->buffers, block_buffer);
+        return -1;
+      }
+    }
 
-    ssize_t num_bytes_read =
-        l.next_layers->ops->lpread(fd, block_buffer, total_block_bytes,
-                                   (off_t)start_bytes, *l.next_layers);
-
-    if (num_bytes_read == -1) {
-      free(block_buffer);
-      return -1;
+    // file bytes after the request in its last block
+    size_t suffix_bytes = 0;
+    if (end_lst_block > 0) {
+      ssize_t lst_read;
+      if (offset_fst_block > 0 && final_start == start_bytes) {
+        lst_block = fst_block;
+        lst_read = fst_read;
+      } else {
+        lst_read = read_block(fd, lst_block, block_size, final_start, l);
+        if (lst_read == -1) {
+          buffer_pool_put(state->buffers, block_buffer);
+          return -1;
+        }
+      }
+      if ((size_t)lst_read > end_lst_block) {
+        suffix_bytes = (size_t)lst_read - end_lst_block;
+      }
     }
 
-    memcpy(block_buffer + offset_fst_block, buffer, nbytes);
+    struct iovec blocks[iovcnt + 2];
+    int nblocks = 0;
+    if (offset_fst_block > 0) {
+      blocks[nblocks++] =
+          (struct iovec){.iov_base = fst_block, .iov_len = offset_fst_block};
+    }
+    memcpy(&blocks[nblocks], iov, sizeof(struct iovec) * iovcnt);
+    nblocks += iovcnt;
+    if (suffix_bytes > 0) {
+      blocks[nblocks++] = (struct iovec){.iov_base = lst_block + end_lst_block,
+                                         .iov_len = suffix_bytes};
+    }
 
     /* the number of bytes to be re-written depends on whether
-    we'll cross the end of the file or not
-    left case -> cross end of the file; right case -> middle of the file*/
-    bytes_to_write = (start_bytes + num_bytes_read < offset + nbytes)
-                         ? nbytes + offset_fst_block
-                         : num_bytes_read;
+    we'll cross the end of the file or not: past the end only the request
+    is written, otherwise the blocks are completed up to the end of file */
+    bytes_to_write = offset_fst_block + nbytes + suffix_bytes;
+    bytes_written =
+        layer_pwritev(fd, blocks, nblocks, start_bytes, *l.next_layers);
 
-    bytes_written = l.next_layers->ops->lpwrite(
-        fd, block_buffer, bytes_to_write, (off_t)start_bytes, *l.next_layers);
-
-    free(block_buffer);
+    buffer_pool_put(state->buffers, block_buffer);
   }
 
   /* if the write fails (i.e., returns -1), -1 is returned;
   however, -1 is also returned if the write
   goes partially wrong (e.g., disk full)*/
-  if (bytes_written != bytes_to_write)
+  if (bytes_written != (ssize_t)bytes_to_write)
     return -1;
   else
     return (ssize_t)nbytes;
 }
 
+/**
+ * @brief pwritev of an O_DIRECT fd: the whole blocks are built in an aligned
+ * pool buffer, unless the request is whole blocks in aligned buffers
+ *
+ * Blocks are written whole even at the end of the file, which is then cut
+ * back to its size.
+ *
+ * @return ssize_t -> nbytes, or -1 on error
+ */
+static ssize_t direct_pwritev(BlockAlignState *state, int fd,
+                              const struct iovec *iov, int iovcnt,
+                              size_t nbytes, off_t offset, LayerContext l) {
+  size_t block_size = state->block_size;
+  size_t head = offset % block_size;
+  size_t tail = (offset + nbytes) % block_size;
+  off_t start = offset - (off_t)head;
+  off_t end = offset + (off_t)nbytes;
+  size_t span = head + nbytes + (tail == 0 ? 0 : block_size - tail);
+
+  if (head == 0 && tail == 0 && iov_direct_aligned(iov, iovcnt)) {
+    ssize_t res = layer_pwritev(fd, iov, iovcnt, offset, *l.next_layers);
+    return res == (ssize_t)nbytes ? res : -1;
+  }
+
+  char *bounce = buffer_pool_get(state->buffers, span);
+  if (bounce == NULL)
+    return -1;
+
+  // size of the file once written, past end if its last block goes further
+  off_t file_end = end;
+  ssize_t fst_read = 0;
+  if (head > 0) {
+    fst_read = read_block(fd, bounce, block_size, start, l);
+    if (fst_read == -1) {
+      buffer_pool_put(state->buffers, bounce);
+      return -1;
+    }
+    if (start + fst_read > file_end) {
+      file_end = start + fst_read;
+    }
+  }
+  off_t last = end - (off_t)tail;
+  if (tail > 0 && !(head > 0 && last == start)) {
+    ssize_t lst_read = read_block(fd, bounce + (last - start), block_size,
+                                  last, l);
+    if (lst_read == -1) {
+      buffer_pool_put(state->buffers, bounce);
+      return -1;
+    }
+    if (last + lst_read > file_end) {
+      file_end = last + lst_read;
+    }
+  }
+  iov_gather(iov, iovcnt, bounce + head);
+
+  ssize_t res =
+      l.next_layers->ops->lpwrite(fd, bounce, span, start, *l.next_layers);
+  buffer_pool_put(state->buffers, bounce);
+  if (res != (ssize_t)span) {
+    return -1;
+  }
+  if (start + (off_t)span > file_end &&
+      l.next_layers->ops->lftruncate(fd, file_end, *l.next_layers) != 0) {
+    return -1;
+  }
+  return (ssize_t)nbytes;
+}
+
+/**
+ * @brief Describe the bytes [from, from + len) of an iovec array
+ *
+ * @param out -> at least iovcnt entries
+ * @return int -> number of entries of out
+ */
+static int iov_slice(const struct iovec *iov, int iovcnt, size_t from,
+                     size_t len, struct iovec *out) {
+  int n = 0;
+  for (int i = 0; i < iovcnt && len > 0; i++) {
+    if (from >= iov[i].iov_len) {
+      from -= iov[i].iov_len;
+      continue;
+    }
+    size_t take = iov[i].iov_len - from;
+    if (take > len) {
+      take = len;
+    }
+    out[n++] = (struct iovec){.iov_base = (char *)iov[i].iov_base + from,
+                              .iov_len = take};
+    len -= take;
+    from = 0;
+  }
+  return n;
+}
+
+/**
+ * @brief pwritev through the WriteCombiner of the fd (combiner mutex held)
+ *
+ * A write continuing the previous one is copied in the pending block first,
+ * which is written once complete. Of the rest, the whole blocks are written
+ * as usual and a partial last block becomes the pending block.
+ *
+ * @return ssize_t -> nbytes, or -1 on error
+ */
+static ssize_t combined_pwritev(BlockAlignState *state, WriteCombiner *wc,
+                                int fd, const struct iovec *iov, int iovcnt,
+                                size_t nbytes, off_t offset, LayerContext l) {
+  size_t block_size = state->block_size;
+  struct iovec part[iovcnt];
+  int nparts;
+
+  // a write elsewhere ends the pending block
+  if (wc->block_start >= 0 &&
+      (offset != wc->write_end || offset < wc->block_start ||
+       offset >= wc->block_start + (off_t)block_size)) {
+    if (combiner_flush(state, wc, fd, *l.next_layers) != 0) {
+      return -1;
+    }
+  }
+
+  size_t done = 0;
+  if (wc->block_start >= 0) {
+    size_t in_block = (size_t)(offset - wc->block_start);
+    done = block_size - in_block < nbytes ? block_size - in_block : nbytes;
+    nparts = iov_slice(iov, iovcnt, 0, done, part);
+    iov_gather(part, nparts, wc->block + in_block);
+    wc->dirty_to = in_block + done;
+    wc->write_end = offset + (off_t)done;
+    if (in_block + done < block_size) {
+      return (ssize_t)nbytes;
+    }
+    // up to the end of the block: written now, read only if partial
+    if (combiner_flush(state, wc, fd, *l.next_layers) != 0) {
+      return -1;
+    }
+    if (done == nbytes) {
+      return (ssize_t)nbytes;
+    }
+  }
+
+  off_t start = offset + (off_t)done;
+  off_t end = offset + (off_t)nbytes;
+  size_t tail = (size_t)(end % (off_t)block_size);
+  off_t tail_start = end - (off_t)tail;
+
+  // the blocks before the last one are written as usual
+  if (tail == 0 || tail_start > start) {
+    off_t upto = tail == 0 ? end : tail_start;
+    nparts = iov_slice(iov, iovcnt, done, (size_t)(upto - start), part);
+    if (rmw_pwritev(state, fd, part, nparts, (size_t)(upto - start), start,
+                    l) == -1) {
+      return -1;
+    }
+  }
+  wc->write_end = end;
+  if (tail == 0) {
+    return (ssize_t)nbytes;
+  }
+
+  // the last block becomes pending, it is read when written
+  off_t from = start > tail_start ? start : tail_start;
+  nparts = iov_slice(iov, iovcnt, (size_t)(from - offset), (size_t)(end - from),
+                     part);
+  iov_gather(part, nparts, wc->block + (from - tail_start));
+  wc->block_start = tail_start;
+  wc->dirty_from = (size_t)(from - tail_start);
+  wc->dirty_to = tail;
+  wc->dirtied_ms = now_ms();
+  return (ssize_t)nbytes;
+}
+
+ssize_t block_align_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                            off_t offset, LayerContext l) {
+
+  BlockAlignState *state = (BlockAlignState *)l.internal_state;
+
+  size_t nbytes = iov_length(iov, iovcnt);
+  if (nbytes == 0) {
+    return 0;
+  }
+
+  int value = GPOINTER_TO_INT(
+      g_hash_table_lookup(state->fds_special_flags, GINT_TO_POINTER(fd)));
+  WriteCombiner *wc = combiner_lock(state, fd);
+
+  if ((value & O_APPEND) != 0) // simulate O_APPEND behaviour
+  {
+    struct stat stbuf;
+    int res = l.next_layers->ops->lfstat(fd, &stbuf, *l.next_layers);
+    if (res == -1) {
+      ERROR_MSG("[BLOCK_ALIGN_PWRITE] Failed to get file size for file (fd=%d)",
+                fd);
+      if (wc) {
+        pthread_mutex_unlock(&wc->mutex);
+      }
+      return -1;
+    }
+    offset = stbuf.st_size;
+    // the pending block may extend the file past its size below
+    if (wc && wc->block_start >= 0 &&
+        wc->block_start + (off_t)wc->dirty_to > offset) {
+      offset = wc->block_start + (off_t)wc->dirty_to;
+    }
+  }
+
+  ssize_t res;
+  if (wc) {
+    res = combined_pwritev(state, wc, fd, iov, iovcnt, nbytes, offset, l);
+    pthread_mutex_unlock(&wc->mutex);
+  } else if ((value & O_DIRECT) != 0) {
+    res = direct_pwritev(state, fd, iov, iovcnt, nbytes, offset, l);
+  } else {
+    res = rmw_pwritev(state, fd, iov, iovcnt, nbytes, offset, l);
+  }
+  return res;
+}
+
 int block_align_ftruncate(int fd, off_t length, LayerContext l) {
-  l.next_layers->app_context = l.app_context;
-  return l.next_layers->ops->lftruncate(fd, length, *l.next_layers);
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  if (flush_fd((BlockAlignState *)l.internal_state, fd, l) != 0) {
+    return -1;
+  }
+  return next_layer.ops->lftruncate(fd, length, next_layer);
+}
+
+int block_align_fsync(int fd, int isdatasync, LayerContext l) {
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  if (flush_fd((BlockAlignState *)l.internal_state, fd, l) != 0) {
+    return -1;
+  }
+  if (next_layer.ops->lfsync == NULL) {
+    return 0;
+  }
+  return next_layer.ops->lfsync(fd, isdatasync, next_layer);
 }
 
 int block_align_fstat(int fd, struct stat *stbuf, LayerContext l) {
-  l.next_layers->app_context = l.app_context;
-  return l.next_layers->ops->lfstat(fd, stbuf, *l.next_layers);
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  if (flush_fd((BlockAlignState *)l.internal_state, fd, l) != 0) {
+    return -1;
+  }
+  return next_layer.ops->lfstat(fd, stbuf, next_layer);
 }
 
 int block_align_lstat(const char *pathname, struct stat *stbuf,
                       LayerContext l) {
-  l.next_layers->app_context = l.app_context;
-  return l.next_layers->ops->llstat(pathname, stbuf, *l.next_layers);
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  return next_layer.ops->llstat(pathname, stbuf, next_layer);
 }
 
+size_t block_align_direct_alignment(LayerContext l) { return 1; }
+
 int block_align_unlink(const char *pathname, LayerContext l) {
 
-  l.next_layers->app_context = l.app_context;
-  return l.next_layers->ops->lunlink(pathname, *l.next_layers);
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  return next_layer.ops->lunlink(pathname, next_layer);
 }
@@ -2,19 +2,63 @@
 #define __BLOCKALIGN_H__
 
 #include "../../shared/types/layer_context.h"
+#include "../../shared/utils/buffer_pool.h"
 #include "config.h"
 #include <glib.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 
+/**
+ * @brief Write-combining buffer of an fd
+ *
+ * Holds the bytes written to the last, partial, block of the previous write.
+ * A write continuing the previous one is copied in it instead of reading and
+ * rewriting the block, and the block is written to the next layer once
+ * complete, or on a write elsewhere, a read, fstat, ftruncate, fsync, close
+ * or after write_combine_ms. Unless they cover the whole block, the bytes are
+ * then merged onto the block read at that time, which keeps what other fds
+ * wrote to it meanwhile.
+ */
+typedef struct {
+  pthread_mutex_t mutex; // serializes the writes of the fd
+  char *block;           // block_size bytes, written bytes of the block
+  off_t block_start;     // offset of the pending block, -1 if none
+  size_t dirty_from;     // written bytes of the block: [dirty_from,
+  size_t dirty_to;       // dirty_to), contiguous as the writes are
+  off_t write_end;       // end of the last write
+  int64_t dirtied_ms;    // monotonic time the block became pending
+} WriteCombiner;
+
 typedef struct {
   size_t block_size;
   GHashTable *fds_special_flags; // indicates fds that must have special
                                  // treatment (currently O_READ and O_APPEND)
+  long write_combine_ms;         // pending block age limit, 0: no combining
+  GHashTable *combiners;         // WriteCombiner of each fd open for writing
+  pthread_mutex_t combine_mutex; // protects combiners and stopping
+  pthread_cond_t combine_cond;   // signalled on destroy
+  pthread_t flusher;             // writes the pending blocks that expired
+  int stopping;                  // set by destroy, flusher exits
+  LayerContext next_layer;       // next layer, for the flusher
+  BufferPool *buffers;           // scratch blocks (buffer_pool_shared())
 } BlockAlignState;
 
+/**
+ * @brief Initializes the block align layer.
+ *
+ * A write_combine_ms above 0 gives each fd open for writing a
+ * WriteCombiner, and starts the thread writing the blocks pending for longer.
+ *
+ * @param next_layer next layer
+ * @param nlayers number of next layers
+ * @param config layer parameters (next_Layer is not used)
+ *
+ * @return Layer context
+ */
 LayerContext block_align_init(LayerContext *next_layer, int nlayers,
-                              size_t block_size);
+                              const BlockAlignConfig *config);
 
 void block_align_destroy(LayerContext l);
 
@@ -28,6 +72,12 @@ void block_align_destroy(LayerContext l);
  * is also returned and errno is set accordingly. Finally, if @c flags includes
  * O_APPEND, the flag is removed, but the appending behaviour is preserved.
  *
+ * With O_DIRECT, the flag goes to the next layer and the fd gets no
+ * WriteCombiner. The block size must be a multiple of the O_DIRECT alignment
+ * of the next layer (which must also divide BUFFER_POOL_ALIGNMENT), or -1 is
+ * returned with errno set to EINVAL. The I/O of the fd then reaches the next
+ * layer in whole blocks and aligned buffers, whatever the caller passes.
+ *
  * @param pathname File path
  * @param flags Open flags
  * @param mode Creation mode
@@ -41,6 +91,17 @@ void block_align_destroy(LayerContext l);
 int block_align_open(const char *pathname, int flags, mode_t mode,
                      LayerContext l);
 
+/**
+ * @brief close for block_align
+ *
+ * Writes the pending block of the fd first; if that fails, the block is
+ * dropped, the fd is still closed and -1 is returned with errno set to EIO.
+ *
+ * @param fd file to close
+ * @param l current layer context
+ *
+ * @return 0 on success, -1 on error
+ */
 int block_align_close(int fd, LayerContext l);
 
 /**
@@ -64,10 +125,11 @@ ssize_t block_align_pread(int fd, void *buffer, size_t nbytes, off_t offset,
 /**
  * @brief pwrite with block alignment.
  *
- * First, it reads the necessary blocks, opening a new file descriptor for
- * reading. After this, the blocks read are modified according to the write
- * request that was made. Finally, the whole blocks are written (after being
- * modified).
+ * First, it reads the first and last blocks when the write only covers part
+ * of them. After this, the whole blocks are written: the untouched bytes of
+ * the blocks read around the content of @c buffer. The blocks are read
+ * through @c fd itself, which block_align_open made readable, so no other fd
+ * is opened for them.
  *
  * @param fd file to write
  * @param buffer buffer with the content to write
@@ -81,6 +143,48 @@ ssize_t block_align_pread(int fd, void *buffer, size_t nbytes, off_t offset,
 ssize_t block_align_pwrite(int fd, const void *buffer, size_t nbytes,
                            off_t offset, LayerContext l);
 
+/**
+ * @brief preadv with block alignment.
+ *
+ * As block_align_pread, but the next layer reads the requested bytes straight
+ * into @c iov; only the bytes of the first and last blocks outside the
+ * request go through a scratch buffer.
+ *
+ * @param fd file to read
+ * @param iov buffers to write the bytes read to
+ * @param iovcnt number of buffers
+ * @param offset position to start reading
+ * @param l current layer context
+ *
+ * @return number of bytes read (independent from the blocks read)
+ */
+ssize_t block_align_preadv(int fd, const struct iovec *iov, int iovcnt,
+                           off_t offset, LayerContext l);
+
+/**
+ * @brief pwritev with block alignment.
+ *
+ * Only the first and last blocks are read, when the write does not start or
+ * end on a block boundary. Their bytes outside the request are written back
+ * together with @c iov in a single write of whole blocks (or up to the end of
+ * the file).
+ *
+ * @param fd file to write
+ * @param iov buffers with the content to write
+ * @param iovcnt number of buffers
+ * @param offset position to start writing
+ * @param l current layer context
+ *
+ * With write combining, the last block of a write that ends inside it is
+ * kept pending in the WriteCombiner of the fd, and the writes continuing it
+ * are copied there.
+ *
+ * @return number of bytes that were written (independent from the blocks that
+ * were read and then re-written)
+ */
+ssize_t block_align_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                            off_t offset, LayerContext l);
+
 /**
  * @brief ftruncate for block align layer.
  *
@@ -92,6 +196,18 @@ ssize_t block_align_pwrite(int fd, const void *buffer, size_t nbytes,
  */
 int block_align_ftruncate(int fd, off_t length, LayerContext l);
 
+/**
+ * @brief fsync for block align layer. Writes the pending block of the fd,
+ * then calls fsync on the underlying layer.
+ *
+ * @param fd file to sync
+ * @param isdatasync only flush the data, as fdatasync
+ * @param l current layer context
+ *
+ * @return 0 on success, -1 on error
+ */
+int block_align_fsync(int fd, int isdatasync, LayerContext l);
+
 /**
  * @brief fstat for block align layer. Call fstat on the underlying layer.
  *
@@ -114,6 +230,16 @@ int block_align_fstat(int fd, struct stat *stbuf, LayerContext l);
  */
 int block_align_lstat(const char *pathname, struct stat *stbuf, LayerContext l);
 
+/**
+ * @brief O_DIRECT alignment of block align layer: none, any request is
+ * turned into aligned I/O for the next layer (see block_align_open).
+ *
+ * @param l current layer context
+ *
+ * @return 1
+ */
+size_t block_align_direct_alignment(LayerContext l);
+
 /**
  * @brief unlink for block align layer. Call unlink on the underlying layer.
  *
@@ -8,6 +8,7 @@
 typedef struct {
   char *next_Layer;
   size_t block_size;
+  long write_combine_ms; // age of a pending partial block, 0: no combining
 } BlockAlignConfig;
 
 /**
@@ -20,6 +21,16 @@ static inline void block_align_parse_params(toml_datum_t layer_table,
   long temp = parse_long(block_size);
   config->block_size = temp < 1 ? 4096 : temp;
   config->next_Layer = parse_string(next);
+
+  // Parse write_combine_ms (optional, disabled by default)
+  config->write_combine_ms = 0;
+  toml_datum_t write_combine_ms = toml_get(layer_table, "write_combine_ms");
+  if (write_combine_ms.type == TOML_INT64) {
+    if (write_combine_ms.u.int64 < 0) {
+      toml_error("Block_align layer write_combine_ms must not be negative");
+    }
+    config->write_combine_ms = (long)write_combine_ms.u.int64;
+  }
 }
 
 #endif // __BLOCK_ALIGN_H__
@@ -0,0 +1,137 @@
+#include "admission.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static uint64_t key_hash(const CacheKey *key) {
+  uint64_t h = mix64(key->dev ^ 0x9E3779B97F4A7C15ULL);
+  h = mix64(h ^ key->inode);
+  h = mix64(h ^ key->epoch);
+  return mix64(h ^ key->block);
+}
+
+/**
+ * @brief Halve every counter, so that old misses weigh less than new ones
+ */
+static void sketch_age(Admission *admission) {
+  size_t total = admission->width * ADMISSION_SKETCH_ROWS;
+  for (size_t i = 0; i < total; i++) {
+    uint8_t value = __atomic_load_n(&admission->counters[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&admission->counters[i], value / 2, __ATOMIC_RELAXED);
+  }
+}
+
+Admission *admission_init(size_t num_blocks, unsigned admit_misses) {
+  Admission *admission = calloc(1, sizeof(Admission));
+  if (!admission) {
+    return NULL;
+  }
+  admission->admit_misses = admit_misses;
+  if (admit_misses <= 1) {
+    return admission;
+  }
+  if (admission->admit_misses > ADMISSION_COUNTER_MAX) {
+    admission->admit_misses = ADMISSION_COUNTER_MAX;
+  }
+
+  admission->width = 64;
+  while (admission->width < num_blocks) {
+    admission->width *= 2;
+  }
+  admission->sample = admission->width * ADMISSION_SAMPLE_FACTOR;
+  admission->counters = calloc(admission->width * ADMISSION_SKETCH_ROWS, 1);
+  if (!admission->counters) {
+    free(admission);
+    return NULL;
+  }
+  return admission;
+}
+
+void admission_destroy(Admission *admission) {
+  if (!admission) {
+    return;
+  }
+  free(admission->counters);
+  free(admission);
+}
+
+int admission_filters(const Admission *admission) {
+  return admission->counters != NULL;
+}
+
+int admission_set_admit_misses(Admission *admission, unsigned admit_misses) {
+  if ((admit_misses > 1) != admission_filters(admission)) {
+    return -1;
+  }
+  if (admit_misses > ADMISSION_COUNTER_MAX) {
+    admit_misses = ADMISSION_COUNTER_MAX;
+  }
+  __atomic_store_n(&admission->admit_misses, admit_misses, __ATOMIC_RELAXED);
+  return 0;
+}
+
+int admission_admit(Admission *admission, const CacheKey *key,
+                    int cache_full) {
+  if (!admission->counters) {
+    __atomic_add_fetch(&admission->stats.admitted, 1, __ATOMIC_RELAXED);
+    return 1;
+  }
+
+  // one counter per row, the smallest is the estimate after this miss
+  uint64_t h = key_hash(key);
+  uint64_t step = mix64(h) | 1;
+  unsigned estimate = ADMISSION_COUNTER_MAX;
+  for (size_t row = 0; row < ADMISSION_SKETCH_ROWS; row++) {
+    uint8_t *counter =
+        &admission->counters[row * admission->width +
+                             ((h + row * step) & (admission->width - 1))];
+    uint8_t value = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    if (value < ADMISSION_COUNTER_MAX) {
+      __atomic_store_n(counter, ++value, __ATOMIC_RELAXED);
+    }
+    if (value < estimate) {
+      estimate = value;
+    }
+  }
+  if (__atomic_add_fetch(&admission->misses, 1, __ATOMIC_RELAXED) %
+          admission->sample ==
+      0) {
+    sketch_age(admission);
+  }
+
+  if (!cache_full || estimate >= admission->admit_misses) {
+    __atomic_add_fetch(&admission->stats.admitted, 1, __ATOMIC_RELAXED);
+    return 1;
+  }
+  __atomic_add_fetch(&admission->stats.rejected, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void admission_bypass(Admission *admission, size_t blocks) {
+  __atomic_add_fetch(&admission->stats.bypassed, blocks, __ATOMIC_RELAXED);
+}
+
+void admission_get_stats(Admission *admission, AdmissionStats *stats) {
+  if (!stats) {
+    return;
+  }
+  if (!admission) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  stats->admitted =
+      __atomic_load_n(&admission->stats.admitted, __ATOMIC_RELAXED);
+  stats->rejected =
+      __atomic_load_n(&admission->stats.rejected, __ATOMIC_RELAXED);
+  stats->bypassed =
+      __atomic_load_n(&admission->stats.bypassed, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,117 @@
+#ifndef __ADMISSION_H__
+#define __ADMISSION_H__
+
+#include "cache_key.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * ============================================================================
+ * ADMISSION - WHICH BLOCKS READ BY A MISS GO IN THE READ CACHE
+ * ============================================================================
+ *
+ * Without a policy, every block a miss reads is inserted, so a single scan
+ * of a tree larger than the cache (a backup) evicts the blocks the other
+ * readers keep coming back to. Misses are filtered before their blocks are
+ * inserted:
+ *
+ * - Frequency: a count-min sketch of ADMISSION_SKETCH_ROWS rows of saturating
+ *   counters, at least one per cached block, estimates how many times each
+ *   block was missed recently, as TinyLFU does. Once the cache holds its
+ *   num_blocks, a block is only admitted at its admit_misses-th miss, so
+ *   blocks read once never displace anything. Every counter is halved after
+ *   ADMISSION_SAMPLE_FACTOR misses per counter of a row, so frequencies age.
+ * - Streams and hints: the layer bypasses the cache for fds that read
+ *   sequentially for long enough and for fds opened with O_NOATIME (what
+ *   backup tools open files with), their misses are only counted here.
+ *
+ * The sketch is updated with relaxed atomics and no lock: concurrent misses
+ * may lose an increment, which only makes the estimate a little lower.
+ * ============================================================================
+ */
+
+#define ADMISSION_SKETCH_ROWS 4    // hash functions of the sketch
+#define ADMISSION_COUNTER_MAX 15   // counters saturate, as 4-bit ones
+#define ADMISSION_SAMPLE_FACTOR 10 // misses per counter between agings
+
+typedef struct {
+  size_t admitted; // missed blocks inserted in the cache
+  size_t rejected; // missed blocks not frequent enough to be inserted
+  size_t bypassed; // missed blocks of streams and O_NOATIME fds
+} AdmissionStats;
+
+typedef struct {
+  uint8_t *counters;     // ADMISSION_SKETCH_ROWS rows of width counters,
+                         // NULL if every miss is admitted
+  size_t width;          // counters per row (power of 2)
+  unsigned admit_misses; // misses a block needs once the cache is full
+  size_t misses;         // misses counted since the last aging
+  size_t sample;         // misses between agings
+  AdmissionStats stats;  // updated atomically
+} Admission;
+
+/**
+ * @brief Create the admission of a cache of num_blocks
+ *
+ * @param num_blocks   -> blocks the cache holds
+ * @param admit_misses -> misses a block needs to be admitted in a full
+ * cache, 0 or 1 admits every miss and allocates no sketch
+ * @return Admission*  -> admission, or NULL on allocation failure
+ */
+Admission *admission_init(size_t num_blocks, unsigned admit_misses);
+
+/**
+ * @brief Free the admission and its sketch
+ *
+ * @param admission -> admission (may be NULL)
+ */
+void admission_destroy(Admission *admission);
+
+/**
+ * @brief Whether the admission needs to know if the cache is full
+ *
+ * @param admission -> admission
+ * @return int      -> 1 if misses are filtered by frequency, 0 otherwise
+ */
+int admission_filters(const Admission *admission);
+
+/**
+ * @brief Change the misses a block needs once the cache is full
+ *
+ * The sketch is only allocated by init, so filtering cannot be turned on or
+ * off: both values must be above 1, or both not.
+ *
+ * @param admission    -> admission
+ * @param admit_misses -> new value, capped as by admission_init
+ * @return int         -> 0, or -1 if filtering would turn on or off
+ */
+int admission_set_admit_misses(Admission *admission, unsigned admit_misses);
+
+/**
+ * @brief Count a miss of a block and decide whether it is inserted
+ *
+ * @param admission  -> admission
+ * @param key        -> block missed
+ * @param cache_full -> whether the cache holds its num_blocks already
+ * @return int       -> 1 if the block goes in the cache, 0 if not
+ */
+int admission_admit(Admission *admission, const CacheKey *key,
+                    int cache_full);
+
+/**
+ * @brief Count missed blocks read around the cache
+ *
+ * @param admission -> admission
+ * @param blocks    -> blocks not inserted
+ */
+void admission_bypass(Admission *admission, size_t blocks);
+
+/**
+ * @brief Snapshot of the admission counters
+ *
+ * @param admission -> admission (NULL: all zero)
+ * @param stats     -> output
+ */
+void admission_get_stats(Admission *admission, AdmissionStats *stats);
+
+#endif // __ADMISSION_H__
@@ -0,0 +1,18 @@
+#ifndef __CACHE_KEY_H__
+#define __CACHE_KEY_H__
+
+#include <stdint.h>
+
+/**
+ * @brief Binary key of a cached block, passed as is to the cache
+ *
+ * Fixed size and without padding, so every byte is part of the key.
+ */
+typedef struct {
+  uint64_t dev;   // device of the file
+  uint64_t inode; // inode of the file
+  uint64_t epoch; // content version of the file
+  uint64_t block; // block index in the file
+} CacheKey;
+
+#endif // __CACHE_KEY_H__
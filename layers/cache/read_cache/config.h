@@ -2,12 +2,46 @@
 #define __READ_CACHE_H__
 
 #include "../../../config/utils.h"
+#include <strings.h>
+
+typedef enum {
+  READ_CACHE_WRITE_AROUND,  // writes update the blocks already in cache
+  READ_CACHE_WRITE_THROUGH, // writes also cache the blocks they write
+  READ_CACHE_WRITE_BACK,    // writes of whole blocks are absorbed and
+                            // written to the next layer later
+} read_cache_write_mode_t;
+
+// values of the wrapper's CACHE_EVICTION_*
+typedef enum {
+  READ_CACHE_EVICT_LRU,     // least recently used
+  READ_CACHE_EVICT_2Q,      // 2Q, a scan only reaches the cold queue
+  READ_CACHE_EVICT_TINYLFU, // TinyLFU, admits blocks by access frequency
+} read_cache_eviction_t;
+
+#define READ_CACHE_DEFAULT_READAHEAD 32  // blocks
+#define READ_CACHE_DEFAULT_FLUSH_MS 5000 // 5 seconds
 
 // CacheLayer layer configuration structure
 typedef struct {
   char *next_Layer;
   size_t block_size;
   size_t num_blocks;
+  size_t readahead_blocks;            // 0 disables read-ahead
+  read_cache_write_mode_t write_mode; // how pwrites use the cache
+  size_t dirty_blocks;                // back mode, 0: num_blocks / 4
+  long flush_ms;                      // back mode, time blocks stay dirty
+  char *nvm_path;                     // file or device of the NVM tier
+  size_t nvm_size_mb;                 // size of the NVM tier
+  char *persist_dir;                  // cache state kept across restarts
+  read_cache_eviction_t eviction;     // eviction policy
+  char **pool_prefixes;               // paths with their own pool each
+  int num_pool_prefixes;              // entries of pool_prefixes
+  size_t large_file_mb;               // files with their own pool, 0: none
+  int direct_io;                      // open files below with O_DIRECT
+  size_t admit_misses;                // misses a block needs in a full
+                                      // cache, 0: every miss is cached
+  size_t bypass_blocks;               // sequential blocks before an fd
+                                      // bypasses the cache, 0: never
 } ReadCacheLayerConfig;
 
 /**
@@ -18,11 +52,88 @@ static inline void read_cache_parse_params(toml_datum_t layer_table,
   toml_datum_t next = toml_get(layer_table, "next");
   toml_datum_t block_size = toml_get(layer_table, "block_size");
   toml_datum_t num_blocks = toml_get(layer_table, "num_blocks");
+  toml_datum_t readahead_blocks = toml_get(layer_table, "readahead_blocks");
+  toml_datum_t write_mode = toml_get(layer_table, "write_mode");
+  toml_datum_t dirty_blocks = toml_get(layer_table, "dirty_blocks");
+  toml_datum_t flush_ms = toml_get(layer_table, "flush_ms");
+  toml_datum_t nvm_path = toml_get(layer_table, "nvm_path");
+  toml_datum_t nvm_size_mb = toml_get(layer_table, "nvm_size_mb");
+  toml_datum_t persist_dir = toml_get(layer_table, "persist_dir");
+  toml_datum_t eviction = toml_get(layer_table, "eviction");
+  toml_datum_t pool_prefixes = toml_get(layer_table, "pool_prefixes");
+  toml_datum_t large_file_mb = toml_get(layer_table, "large_file_mb");
+  toml_datum_t direct_io = toml_get(layer_table, "direct_io");
+  toml_datum_t admit_misses = toml_get(layer_table, "admit_misses");
+  toml_datum_t bypass_blocks = toml_get(layer_table, "bypass_blocks");
   config->next_Layer = parse_string(next);
   long temp = parse_long(block_size);
   config->block_size = (temp < 1) ? 4096 : temp;
   temp = parse_long(num_blocks);
   config->num_blocks = (temp < 1) ? 100 : temp;
+  temp = parse_long(readahead_blocks);
+  config->readahead_blocks = (temp < 0) ? READ_CACHE_DEFAULT_READAHEAD : temp;
+
+  // Parse write mode (optional, defaults to around)
+  config->write_mode = READ_CACHE_WRITE_AROUND;
+  if (write_mode.type == TOML_STRING) {
+    if (strcasecmp(write_mode.u.str.ptr, "around") == 0) {
+      config->write_mode = READ_CACHE_WRITE_AROUND;
+    } else if (strcasecmp(write_mode.u.str.ptr, "through") == 0) {
+      config->write_mode = READ_CACHE_WRITE_THROUGH;
+    } else if (strcasecmp(write_mode.u.str.ptr, "back") == 0) {
+      config->write_mode = READ_CACHE_WRITE_BACK;
+    } else {
+      toml_error("Read_Cache layer has unsupported write_mode (use 'around', "
+                 "'through' or 'back')");
+    }
+  }
+  temp = parse_long(dirty_blocks);
+  config->dirty_blocks = (temp < 1) ? 0 : temp;
+  temp = parse_long(flush_ms);
+  config->flush_ms = (temp < 1) ? READ_CACHE_DEFAULT_FLUSH_MS : temp;
+
+  // Parse the optional NVM tier and persistence
+  config->nvm_path = parse_string(nvm_path);
+  temp = parse_long(nvm_size_mb);
+  config->nvm_size_mb = (temp < 1) ? 0 : temp;
+  if (config->nvm_path && config->nvm_size_mb == 0) {
+    toml_error("Read_Cache layer with 'nvm_path' must have a 'nvm_size_mb' "
+               "parameter, and it must be greater than 0.");
+  }
+  config->persist_dir = parse_string(persist_dir);
+
+  // Parse eviction policy (optional, defaults to lru)
+  config->eviction = READ_CACHE_EVICT_LRU;
+  if (eviction.type == TOML_STRING) {
+    if (strcasecmp(eviction.u.str.ptr, "lru") == 0) {
+      config->eviction = READ_CACHE_EVICT_LRU;
+    } else if (strcasecmp(eviction.u.str.ptr, "2q") == 0) {
+      config->eviction = READ_CACHE_EVICT_2Q;
+    } else if (strcasecmp(eviction.u.str.ptr, "tinylfu") == 0) {
+      config->eviction = READ_CACHE_EVICT_TINYLFU;
+    } else {
+      toml_error("Read_Cache layer has unsupported eviction (use 'lru', '2q' "
+                 "or 'tinylfu')");
+    }
+  }
+
+  // Parse the pools (optional, one pool by default)
+  config->pool_prefixes =
+      parse_string_array(pool_prefixes, &config->num_pool_prefixes);
+  temp = parse_long(large_file_mb);
+  config->large_file_mb = (temp < 1) ? 0 : temp;
+
+  // Parse direct_io (optional, disabled by default)
+  config->direct_io = 0;
+  if (direct_io.type == TOML_BOOLEAN) {
+    config->direct_io = direct_io.u.boolean ? 1 : 0;
+  }
+
+  // Parse the admission of missed blocks (optional, every miss by default)
+  temp = parse_long(admit_misses);
+  config->admit_misses = (temp < 1) ? 0 : temp;
+  temp = parse_long(bypass_blocks);
+  config->bypass_blocks = (temp < 1) ? 0 : temp;
 }
 
 #endif // __READ_CACHE_H__
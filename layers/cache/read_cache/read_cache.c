@@ -1,43 +1,222 @@
+#define _GNU_SOURCE
 #include "read_cache.h"
 #include "../../../logdef.h"
-#include "glibconfig.h"
+#include "../../../shared/utils/layer_iov.h"
 #include "types/layer_context.h"
 #include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <glib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 static long total_misses = 0;
 static long total_hits = 0;
 
-guint inode_hash(gconstpointer key) {
-  ino_t *inode = (ino_t *)key;
-  return (guint)(*inode ^ (*inode >> 32));
+static size_t inode_hash(ino_t inode) {
+  uint64_t h = (uint64_t)inode * 0x9E3779B97F4A7C15ULL;
+  return (size_t)(h >> 32);
 }
 
-gboolean inode_equal(gconstpointer a, gconstpointer b) {
-  ino_t *aa = (ino_t *)a;
-  ino_t *bb = (ino_t *)b;
-  return *aa == *bb;
+/**
+ * @brief Slot of an fd, NULL if no fd of its page was ever opened
+ */
+static FdInode *fd_file(ReadCacheState *state, int fd) {
+  return fd_table_get(&state->fd_to_inode, fd);
 }
 
-int remove_cached_entries_range(ino_t inode, long start, long end,
+static InodeShard *inode_shard(ReadCacheState *state, ino_t inode) {
+  return &state->inode_to_info[inode_hash(inode) % READ_CACHE_INODE_SHARDS];
+}
+
+/**
+ * @brief Link to the entry of an inode in its shard's chain (shard locked)
+ *
+ * @return link holding the entry, or the NULL link ending the chain
+ */
+static InodeInfo **inode_link(InodeShard *shard, ino_t inode) {
+  InodeInfo **link =
+      &shard->buckets[(inode_hash(inode) / READ_CACHE_INODE_SHARDS) &
+                      (READ_CACHE_SHARD_BUCKETS - 1)];
+  while (*link && (*link)->inode != inode) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+/**
+ * @brief Move the entry of a link to the shard's pool (shard locked)
+ */
+static void inode_release(InodeShard *shard, InodeInfo **link) {
+  InodeInfo *value = *link;
+  *link = value->next;
+  value->next = shard->pool;
+  shard->pool = value;
+}
+
+/**
+ * @brief Check if a file is still the version an InodeMeta recorded
+ */
+static int meta_matches(const InodeMeta *meta, const struct stat *stbuf) {
+  return meta->size == (int64_t)stbuf->st_size &&
+         meta->mtime_sec == (int64_t)stbuf->st_mtim.tv_sec &&
+         meta->mtime_nsec == (int64_t)stbuf->st_mtim.tv_nsec &&
+         meta->ctime_sec == (int64_t)stbuf->st_ctim.tv_sec &&
+         meta->ctime_nsec == (int64_t)stbuf->st_ctim.tv_nsec;
+}
+
+static CacheKey meta_key(uint64_t dev, uint64_t inode) {
+  CacheKey key = {
+      .dev = dev, .inode = inode, .epoch = 0, .block = READ_CACHE_META_BLOCK};
+  return key;
+}
+
+/**
+ * @brief Epoch of a file opened while the inode has no entry
+ *
+ * With persistence, the epoch recorded by the last close of a previous run if
+ * the file didn't change since, so that its blocks are hits again. Otherwise
+ * a new one that none of the cached blocks has: the inode may be a new file
+ * reusing the number of an unlinked one.
+ */
+static uint64_t inode_epoch(ReadCacheState *state, const struct stat *stbuf) {
+  if (!state->persistent)
+    return __atomic_add_fetch(&state->next_epoch, 1, __ATOMIC_RELAXED);
+
+  CacheKey key = meta_key(stbuf->st_dev, stbuf->st_ino);
+  CacheEntry entry;
+  uint64_t epoch = 0;
+  void *pinned = state->ops.get_items(state->cache_wrapper, &key, sizeof(key),
+                                      1, &entry);
+  if (entry.block != NULL && entry.size == sizeof(InodeMeta)) {
+    InodeMeta meta;
+    memcpy(&meta, entry.block, sizeof(meta));
+    if (meta_matches(&meta, stbuf))
+      epoch = meta.epoch;
+  }
+  state->ops.release_items(pinned);
+
+  if (epoch == 0) {
+    epoch = __atomic_add_fetch(&state->next_epoch, 1, __ATOMIC_RELAXED);
+    if (INFO_ENABLED())
+      INFO_MSG("[READ_CACHE_OPEN] Inode %lu changed or isn't cached, new "
+               "epoch %lu",
+               (unsigned long)stbuf->st_ino, (unsigned long)epoch);
+  }
+  return epoch;
+}
+
+/**
+ * @brief Record the version of a file for the next run's first open
+ */
+static void inode_record(ReadCacheState *state, const FdInode *file,
+                         const struct stat *stbuf) {
+  InodeMeta meta = {.epoch = __atomic_load_n(&file->info->epoch,
+                                            __ATOMIC_RELAXED),
+                    .size = stbuf->st_size,
+                    .mtime_sec = stbuf->st_mtim.tv_sec,
+                    .mtime_nsec = stbuf->st_mtim.tv_nsec,
+                    .ctime_sec = stbuf->st_ctim.tv_sec,
+                    .ctime_nsec = stbuf->st_ctim.tv_nsec};
+  CacheKey key = meta_key(stbuf->st_dev, stbuf->st_ino);
+  if (state->ops.insert_item(state->cache_wrapper, file->pool, &key,
+                             sizeof(key), &meta, sizeof(meta)) == -1) {
+    ERROR_MSG("[READ_CACHE_CLOSE] Failed to record the version of inode %lu",
+              (unsigned long)stbuf->st_ino);
+  }
+}
+
+/**
+ * @brief Pool of a file opened for the first time
+ *
+ * @return the pool of the first prefix the path starts with, else the large
+ * file pool for large files, else the default pool 0
+ */
+static int file_pool(ReadCacheState *state, const char *pathname,
+                     off_t size) {
+  for (int i = 0; i < state->num_pool_prefixes; i++) {
+    const char *prefix = state->pool_prefixes[i];
+    if (strncmp(pathname, prefix, strlen(prefix)) == 0)
+      return i + 1;
+  }
+  if (state->large_file_bytes > 0 && size >= state->large_file_bytes)
+    return state->num_pool_prefixes + 1;
+  return 0;
+}
+
+/**
+ * @brief Count one more fd for an inode, adding its entry if needed
+ *
+ * @param pool pool of the file, if this is its first open
+ * @param file set to the entry and pool of the file
+ * @return 0 on success, -1 if no entry could be allocated
+ */
+static int inode_open(ReadCacheState *state, const struct stat *stbuf,
+                      int pool, FdInode *file) {
+  ino_t inode = stbuf->st_ino;
+  InodeShard *shard = inode_shard(state, inode);
+  pthread_mutex_lock(&shard->mutex);
+  InodeInfo **link = inode_link(shard, inode);
+  if (*link == NULL) {
+    InodeInfo *value = shard->pool;
+    if (value != NULL)
+      shard->pool = value->next;
+    else
+      value = malloc(sizeof(InodeInfo));
+    if (value == NULL) {
+      pthread_mutex_unlock(&shard->mutex);
+      return -1;
+    }
+    value->inode = inode;
+    value->counter = 0;
+    value->unlinked = 0;
+    value->generation = 0;
+    value->epoch = inode_epoch(state, stbuf);
+    value->pool = pool;
+    value->next = NULL;
+    *link = value;
+  }
+  (*link)->counter++;
+  file->info = *link;
+  file->pool = (*link)->pool;
+  pthread_mutex_unlock(&shard->mutex);
+  return 0;
+}
+
+/**
+ * @brief Get the cache key of an open fd's file, with block 0
+ *
+ * @return 0 on success, -1 with errno set to EBADF if fd is not open here
+ */
+static int fd_key(ReadCacheState *state, int fd, CacheKey *key) {
+  const FdInode *file = fd_file(state, fd);
+  if (!file || !file->used) {
+    errno = EBADF;
+    return -1;
+  }
+  key->dev = (uint64_t)file->dev;
+  key->inode = (uint64_t)file->inode;
+  key->epoch = __atomic_load_n(&file->info->epoch, __ATOMIC_RELAXED);
+  key->block = 0;
+  return 0;
+}
+
+int remove_cached_entries_range(CacheKey key, long start, long end,
                                 ReadCacheState *state) {
-  char key[BUFSIZ] = {'\0'};
   int removed = -1;
   int contains = 0;
   for (long i = start; i <= end; i++) {
 
-    if (snprintf(key, BUFSIZ, "%ld/%ld", inode, i) < 0)
-      return -1;
-    contains = state->ops.contain_item(state->cache_wrapper, key);
+    key.block = (uint64_t)i;
+    contains =
+        state->ops.contain_item(state->cache_wrapper, &key, sizeof(key));
     if (contains == 1) {
-      removed = state->ops.remove_item(state->cache_wrapper, key);
+      removed = state->ops.remove_item(state->cache_wrapper, &key, sizeof(key));
       if (removed == -1)
         return -1;
     }
@@ -45,12 +224,198 @@ int remove_cached_entries_range(ino_t inode, long start, long end,
   return 0;
 }
 
+/**
+ * @brief Note a change of the content of an inode
+ *
+ * Prefetches that read the file before the change drop their blocks.
+ */
+static void inode_modified(ReadCacheState *state, ino_t inode) {
+  InodeShard *shard = inode_shard(state, inode);
+  pthread_mutex_lock(&shard->mutex);
+  InodeInfo *value = *inode_link(shard, inode);
+  if (value != NULL)
+    value->generation++;
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+/**
+ * @brief Invalidate every cached block of an open inode at once
+ *
+ * The inode gets a new epoch, so the keys of its blocks change: the old
+ * blocks are never looked up again and age out through the eviction, instead
+ * of being removed one block index at a time. Prefetches that read the file
+ * before drop their blocks, as after any change.
+ */
+static void inode_invalidate(ReadCacheState *state, ino_t inode) {
+  uint64_t epoch = __atomic_add_fetch(&state->next_epoch, 1, __ATOMIC_RELAXED);
+  InodeShard *shard = inode_shard(state, inode);
+  pthread_mutex_lock(&shard->mutex);
+  InodeInfo *value = *inode_link(shard, inode);
+  if (value != NULL) {
+    value->generation++;
+    __atomic_store_n(&value->epoch, epoch, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+/**
+ * @brief Prefetch callback: reads blocks ahead of a stream into the cache
+ */
+static int readahead_prefetch(void *arg, const ReadaheadRequest *request) {
+  ReadCacheState *state = arg;
+  size_t block_size = state->block_size;
+  CacheKey key = {.dev = request->dev,
+                  .inode = request->inode,
+                  .epoch = request->epoch,
+                  .block = request->block};
+  size_t count = request->count;
+
+  // blocks already in cache at the start of the window aren't read again
+  while (count > 0 && state->ops.contain_item(state->cache_wrapper, &key,
+                                              sizeof(key)) == 1) {
+    key.block++;
+    count--;
+  }
+  if (count == 0)
+    return 0;
+
+  // the fd is open (close cancels its prefetches first), so is the inode
+  InodeShard *shard = inode_shard(state, (ino_t)key.inode);
+  pthread_mutex_lock(&shard->mutex);
+  InodeInfo *value = *inode_link(shard, (ino_t)key.inode);
+  unsigned long generation = value->generation;
+  pthread_mutex_unlock(&shard->mutex);
+
+  ssize_t bytes_read = state->next_layer->ops->lpread(
+      request->fd, state->readahead_buffer, count * block_size,
+      (off_t)(key.block * block_size), *state->next_layer);
+  if (bytes_read < 0)
+    return -1;
+
+  // the blocks are inserted only if the file didn't change since they were
+  // read, writes update cached blocks after bumping the generation
+  int inserted = 0;
+  pthread_mutex_lock(&shard->mutex);
+  if (value->generation == generation) {
+    for (size_t j = 0; j * block_size < (size_t)bytes_read; j++, key.block++) {
+      size_t entry_size = (size_t)bytes_read - j * block_size;
+      if (entry_size > block_size)
+        entry_size = block_size;
+      if (state->ops.contain_item(state->cache_wrapper, &key, sizeof(key)) == 1)
+        continue;
+      // the next layer doesn't have the content of dirty blocks yet
+      if (state->write_back != NULL &&
+          write_back_is_dirty(state->write_back, &key))
+        continue;
+      if (state->ops.insert_item(
+              state->cache_wrapper, fd_file(state, request->fd)->pool, &key,
+              sizeof(key), (char *)state->readahead_buffer + j * block_size,
+              entry_size) == 0)
+        inserted++;
+    }
+  }
+  pthread_mutex_unlock(&shard->mutex);
+
+  return inserted;
+}
+
+/**
+ * @brief Follow the sequence of preads of an fd with a pread of blocks start
+ * to end
+ *
+ * @return 1 if the pread continues the previous one, 0 otherwise
+ */
+static int stream_update(FdInode *file, size_t start, size_t end) {
+  // a pread continuing the previous one (or re-reading its last, partial
+  // block) is sequential, the first pread of the file too
+  int sequential = start == file->next_block || start + 1 == file->next_block;
+  file->next_block = end + 1;
+  if (sequential)
+    file->run += end - start + 1;
+  else
+    file->run = end - start + 1;
+  return sequential;
+}
+
+/**
+ * @brief Whether the misses of an fd are read around the cache
+ *
+ * Long sequential runs are scans, whose blocks would only evict the others,
+ * and O_NOATIME is how backup tools open the files they read once.
+ */
+static int fd_bypasses(ReadCacheState *state, const FdInode *file) {
+  return file->noreuse ||
+         (state->bypass_blocks > 0 && file->run > state->bypass_blocks);
+}
+
+/**
+ * @brief Update the read-ahead window of an fd with a pread ending at block
+ * end, and request the prefetch of the next window when due
+ */
+static void readahead_update(ReadCacheState *state, int fd,
+                             const CacheKey *key, int sequential,
+                             size_t end) {
+  FdInode *file = fd_file(state, fd);
+
+  if (!sequential) {
+    file->window /= 2;
+    file->ahead = end + 1;
+    return;
+  }
+  if (file->window == 0)
+    file->window = READAHEAD_MIN_WINDOW;
+  else
+    file->window *= 2;
+  if (file->window > state->readahead_max)
+    file->window = state->readahead_max;
+
+  // prefetch the next window once the reader consumed half of the last one
+  if (file->ahead < end + 1)
+    file->ahead = end + 1;
+  if (file->ahead - (end + 1) > file->window / 2)
+    return;
+
+  ReadaheadRequest request = {.fd = fd,
+                              .dev = key->dev,
+                              .inode = key->inode,
+                              .epoch = key->epoch,
+                              .block = file->ahead,
+                              .count = end + 1 + file->window - file->ahead};
+  if (readahead_submit(state->readahead, &request) == 0)
+    file->ahead += request.count;
+}
+
+/**
+ * @brief Write callback of the dirty blocks, writes them to the next layer
+ */
+static ssize_t write_back_write(void *arg, int fd, const void *data,
+                                size_t len, off_t offset) {
+  ReadCacheState *state = arg;
+  return state->next_layer->ops->lpwrite(fd, data, len, offset,
+                                         *state->next_layer);
+}
+
+/**
+ * @brief Write the dirty blocks first..last of a file, if in write_back mode
+ *
+ * @param fd only write the blocks dirtied by this fd, -1 for all
+ * @return blocks written, -1 on error
+ */
+static int flush_file(ReadCacheState *state, const CacheKey *key,
+                      uint64_t first, uint64_t last, int fd) {
+  if (state->write_back == NULL)
+    return 0;
+  return write_back_flush(state->write_back, key, first, last, fd);
+}
+
 LayerContext read_cache_init(LayerContext *next_layer, int nlayers,
-                             size_t block_size, size_t num_blocks) {
+                             const ReadCacheLayerConfig *config) {
 
   LayerContext layer_context;
+  size_t block_size = config->block_size;
+  size_t num_blocks = config->num_blocks;
 
-  LayerOps *read_cache_ops = malloc(sizeof(LayerOps));
+  LayerOps *read_cache_ops = calloc(1, sizeof(LayerOps));
   layer_context.ops = read_cache_ops;
   layer_context.ops->ldestroy = read_cache_destroy;
   layer_context.ops->lpread = read_cache_pread;
@@ -61,6 +426,8 @@ LayerContext read_cache_init(LayerContext *next_layer, int nlayers,
   layer_context.ops->llstat = read_cache_lstat;
   layer_context.ops->lfstat = read_cache_fstat;
   layer_context.ops->lunlink = read_cache_unlink;
+  layer_context.ops->lfsync = read_cache_fsync;
+  layer_context.ops->lreconfigure = read_cache_reconfigure;
   LayerContext *aux = malloc(sizeof(LayerContext));
   memcpy(aux, next_layer, sizeof(LayerContext));
   layer_context.next_layers = aux;
@@ -68,31 +435,131 @@ LayerContext read_cache_init(LayerContext *next_layer, int nlayers,
 
   layer_context.app_context = NULL;
   ReadCacheState *state = malloc(sizeof(ReadCacheState));
+
+  // the DRAM tier is charged whole, shrunk to the memory budget if needed;
+  // in write_back mode a quarter of the room is left to the dirty blocks
+  state->memory = memory_budget_account("read_cache");
+  size_t headroom = memory_budget_headroom(state->memory);
+  if (headroom != SIZE_MAX && config->write_mode == READ_CACHE_WRITE_BACK)
+    headroom -= headroom / 4;
+  if (headroom / block_size < num_blocks) {
+    size_t fit = headroom / block_size > 0 ? headroom / block_size : 1;
+    WARN_MSG("[READ_CACHE_INIT] %zu blocks exceed the memory budget, caching "
+             "%zu",
+             num_blocks, fit);
+    num_blocks = fit;
+  }
+  // with no headroom at all, the one block left is not counted
+  state->memory_charged = num_blocks * block_size;
+  if (memory_budget_try_charge(state->memory, state->memory_charged) != 0)
+    state->memory_charged = 0;
+
   state->block_size = block_size;
   state->num_blocks = num_blocks;
-  state->fd_to_inode =
-      g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
-  state->inode_to_info =
-      g_hash_table_new_full(inode_hash, inode_equal, free, free);
+  fd_table_init(&state->fd_to_inode, sizeof(FdInode), NULL);
+  for (int i = 0; i < READ_CACHE_INODE_SHARDS; i++) {
+    memset(state->inode_to_info[i].buckets, 0,
+           sizeof(state->inode_to_info[i].buckets));
+    state->inode_to_info[i].pool = NULL;
+    pthread_mutex_init(&state->inode_to_info[i].mutex, NULL);
+  }
   state->shared_lib_handle = dlopen("libcache_lib_wrapper.so", RTLD_LAZY);
 
-  void *(*initializeCache)(size_t, size_t, char *) =
+  // pool 0 is the default one, then one per prefix and the large file pool
+  state->num_pool_prefixes = config->num_pool_prefixes;
+  state->pool_prefixes = NULL;
+  if (state->num_pool_prefixes > 0) {
+    state->pool_prefixes = malloc(state->num_pool_prefixes * sizeof(char *));
+    for (int i = 0; i < state->num_pool_prefixes; i++)
+      state->pool_prefixes[i] = strdup(config->pool_prefixes[i]);
+  }
+  state->large_file_bytes = (off_t)config->large_file_mb * 1024 * 1024;
+
+  // the cache takes the place of the host page cache below, so the misses,
+  // partial blocks and writes it passes down as they come must be accepted
+  // with O_DIRECT by the next layer
+  state->direct_io = config->direct_io;
+  if (state->direct_io && layer_direct_alignment(*aux) > 1) {
+    ERROR_MSG("[READ_CACHE_INIT] direct_io needs a next layer that aligns "
+              "its I/O, such as block_align");
+    exit(1);
+  }
+  CacheOptions options = {.nvm_path = config->nvm_path,
+                          .nvm_size = config->nvm_size_mb * 1024 * 1024,
+                          .persist_dir = config->persist_dir,
+                          .eviction = config->eviction,
+                          .num_pools = 1 + state->num_pool_prefixes +
+                                       (state->large_file_bytes > 0)};
+
+  void *(*initializeCache)(size_t, size_t, char *, const CacheOptions *) =
       dlsym(state->shared_lib_handle, "initialize_cache");
 
-  void *cacheWrapper =
-      initializeCache(state->num_blocks, state->block_size, "read_cache");
+  void *cacheWrapper = initializeCache(state->num_blocks, state->block_size,
+                                       "read_cache", &options);
   if (cacheWrapper == NULL) {
     ERROR_MSG("[READ_CACHE_INIT] Failed to create a CacheWrapper instance");
     exit(1);
   }
   state->cache_wrapper = cacheWrapper;
   state->ops.insert_item = dlsym(state->shared_lib_handle, "insert_item");
-  state->ops.get_item = dlsym(state->shared_lib_handle, "get_item");
+  state->ops.get_items = dlsym(state->shared_lib_handle, "get_items");
+  state->ops.release_items = dlsym(state->shared_lib_handle, "release_items");
   state->ops.remove_item = dlsym(state->shared_lib_handle, "remove_item");
   state->ops.contain_item = dlsym(state->shared_lib_handle, "contain_item");
   state->ops.get_item_count = dlsym(state->shared_lib_handle, "get_item_count");
   state->ops.destroy_cache = dlsym(state->shared_lib_handle, "destroy_cache");
 
+  // epochs only grow across restarts, so a new one is never one of the
+  // blocks a previous run cached
+  state->persistent = config->persist_dir != NULL;
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  state->next_epoch = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+  // read-ahead never takes more than a quarter of the cache
+  state->next_layer = aux;
+  state->readahead_max = config->readahead_blocks;
+  if (state->readahead_max > num_blocks / 4)
+    state->readahead_max = num_blocks / 4;
+  state->readahead = NULL;
+  state->readahead_buffer = NULL;
+  if (state->readahead_max > 0) {
+    state->readahead_buffer = malloc(state->readahead_max * block_size);
+    if (state->readahead_buffer != NULL)
+      state->readahead = readahead_init(readahead_prefetch, state);
+    if (state->readahead == NULL) {
+      WARN_MSG("[READ_CACHE_INIT] Failed to start read-ahead, disabling it");
+      free(state->readahead_buffer);
+      state->readahead_buffer = NULL;
+      state->readahead_max = 0;
+    }
+  }
+
+  state->write_mode = config->write_mode;
+  state->write_back = NULL;
+  if (state->write_mode == READ_CACHE_WRITE_BACK) {
+    size_t dirty_blocks = config->dirty_blocks;
+    if (dirty_blocks == 0)
+      dirty_blocks = num_blocks / 4 > 0 ? num_blocks / 4 : 1;
+    long flush_ms =
+        config->flush_ms > 0 ? config->flush_ms : READ_CACHE_DEFAULT_FLUSH_MS;
+    state->write_back = write_back_init(write_back_write, state, block_size,
+                                        dirty_blocks, flush_ms);
+    if (state->write_back == NULL) {
+      ERROR_MSG("[READ_CACHE_INIT] Failed to create the dirty block table");
+      exit(1);
+    }
+  }
+
+  // blocks missed by scans go around the cache
+  state->admission = admission_init(num_blocks, config->admit_misses);
+  if (state->admission == NULL) {
+    ERROR_MSG("[READ_CACHE_INIT] Failed to allocate the admission sketch");
+    exit(1);
+  }
+  state->bypass_blocks = config->bypass_blocks;
+  state->cache_full = 0;
+
   layer_context.internal_state = (void *)state;
 
   return layer_context;
@@ -106,11 +573,31 @@ void read_cache_destroy(LayerContext l) {
 
   ReadCacheState *state = (ReadCacheState *)l.internal_state;
 
-  g_hash_table_destroy(state->fd_to_inode);
-  g_hash_table_destroy(state->inode_to_info);
+  readahead_destroy(state->readahead);
+  free(state->readahead_buffer);
+  write_back_destroy(state->write_back);
+  admission_destroy(state->admission);
+  fd_table_destroy(&state->fd_to_inode);
+  for (int i = 0; i < READ_CACHE_INODE_SHARDS; i++) {
+    InodeShard *shard = &state->inode_to_info[i];
+    for (int j = 0; j < READ_CACHE_SHARD_BUCKETS; j++) {
+      while (shard->buckets[j] != NULL)
+        inode_release(shard, &shard->buckets[j]);
+    }
+    while (shard->pool != NULL) {
+      InodeInfo *next = shard->pool->next;
+      free(shard->pool);
+      shard->pool = next;
+    }
+    pthread_mutex_destroy(&shard->mutex);
+  }
 
   state->ops.destroy_cache(state->cache_wrapper);
   dlclose(state->shared_lib_handle);
+  memory_budget_release(state->memory, state->memory_charged);
+  for (int i = 0; i < state->num_pool_prefixes; i++)
+    free(state->pool_prefixes[i]);
+  free(state->pool_prefixes);
   free(state);
 
   l.next_layers->ops->ldestroy(*l.next_layers);
@@ -121,76 +608,74 @@ void read_cache_destroy(LayerContext l) {
 int read_cache_open(const char *pathname, int flags, mode_t mode,
                     LayerContext l) {
   int fd, trunc, create;
-  off_t size = 0;
   struct stat stbuf;
 
   ReadCacheState *state = l.internal_state;
-  l.next_layers->app_context = l.app_context;
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
 
   trunc = (flags & O_TRUNC) != 0;
   create = (flags & O_CREAT) != 0;
 
   // try to execute lstat
-  int stat_res = l.next_layers->ops->llstat(pathname, &stbuf, *l.next_layers);
+  int stat_res = next_layer.ops->llstat(pathname, &stbuf, next_layer);
   if (stat_res == -1) {
     /* if lstat failed and there's no O_CREAT flag,
     return error, else the file will be completely new*/
-    if (!create) {
+    if (!create)
       return -1;
-    } else
-      size = 0;
-  } else
-    size = stbuf.st_size;
+  }
 
-  fd = l.next_layers->ops->lopen(pathname, flags, mode, *l.next_layers);
+  if (state->direct_io) {
+    flags |= O_DIRECT;
+  }
+  fd = next_layer.ops->lopen(pathname, flags, mode, next_layer);
 
   if (fd != -1) {
 
     // check if the first lstat failed (file created just now)
     // if it did, execute it now so we can get the inode number
     if (stat_res == -1) {
-      stat_res = l.next_layers->ops->lfstat(fd, &stbuf, *l.next_layers);
+      stat_res = next_layer.ops->lfstat(fd, &stbuf, next_layer);
 
       if (stat_res == -1) {
-        l.ops->lclose(fd, l);
+        next_layer.ops->lclose(fd, next_layer);
         return -1;
       }
     }
 
-    ino_t *inode = malloc(sizeof(ino_t));
-    *inode = stbuf.st_ino;
-    g_hash_table_insert(state->fd_to_inode, GINT_TO_POINTER(fd), inode);
-
-    InodeInfo *value = g_hash_table_lookup(state->inode_to_info, inode);
+    FdInode *file = fd_table_slot(&state->fd_to_inode, fd);
+    if (!file) {
+      ERROR_MSG("[READ_CACHE_OPEN] No fd table slot for file descriptor %d "
+                "(limit %d)",
+                fd, FD_TABLE_MAX_FDS);
+      next_layer.ops->lclose(fd, next_layer);
+      errno = EMFILE;
+      return -1;
+    }
 
-    // check if the inode was being mapped (in which case, the counter just
-    // needs to be incremented) if the inode isn't present, insert a counter of
-    // 1 (the only opened fd is the one we're currently opening) and the
+    // increment the fd counter of the inode, or map it with a counter of 1
+    // (the only opened fd is the one we're currently opening) and the
     // unlinked flag as false
-    if (value == NULL) {
-      ino_t *new_key = malloc(sizeof(ino_t));
-      *new_key = stbuf.st_ino;
-
-      InodeInfo *new_value = malloc(sizeof(InodeInfo));
-      new_value->counter = 1;
-      new_value->unlinked = 0;
-
-      g_hash_table_insert(state->inode_to_info, new_key, new_value);
-    } else
-      value->counter++;
-
-    // if the file was truncated, it's necessary to remove the old content from
-    // the cache
-    if (trunc) {
-      // converting the block_size to long shouldn't be a problem, unless
-      // block_size is in the petabyte range...
-      int r = remove_cached_entries_range(
-          stbuf.st_ino, 0, ((size - 1) / (long)state->block_size), state);
-      if (r == -1) {
-        l.ops->lclose(fd, l);
-        return -1;
-      }
+    int pool = file_pool(state, pathname, stbuf.st_size);
+    if (inode_open(state, &stbuf, pool, file) == -1) {
+      next_layer.ops->lclose(fd, next_layer);
+      errno = ENOMEM;
+      return -1;
     }
+    file->dev = stbuf.st_dev;
+    file->inode = stbuf.st_ino;
+    file->next_block = 0;
+    file->window = 0;
+    file->ahead = 0;
+    file->run = 0;
+    file->noreuse = (flags & O_NOATIME) != 0;
+    file->used = 1;
+
+    // if the file was truncated, its old content must not be read from the
+    // cache anymore
+    if (trunc)
+      inode_invalidate(state, stbuf.st_ino);
   }
 
   return fd;
@@ -199,73 +684,129 @@ int read_cache_open(const char *pathname, int flags, mode_t mode,
 int read_cache_close(int fd, LayerContext l) {
   int res;
   ReadCacheState *state = l.internal_state;
-  l.next_layers->app_context = l.app_context;
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
 
-  ino_t *inodep = g_hash_table_lookup(state->fd_to_inode, GINT_TO_POINTER(fd));
-  ino_t inode = *inodep;
-  InodeInfo *value = g_hash_table_lookup(state->inode_to_info, &inode);
+  CacheKey key;
+  if (fd_key(state, fd, &key) == -1)
+    return -1;
+  ino_t inode = (ino_t)key.inode;
+  InodeShard *shard = inode_shard(state, inode);
+
+  // no prefetch may use the fd once it's closed
+  readahead_cancel(state->readahead, fd);
+
+  // nor any dirty block, those that can't be written are lost
+  int flush_failed = 0;
+  if (flush_file(state, &key, 0, UINT64_MAX, fd) == -1) {
+    size_t lost = write_back_discard(state->write_back, fd);
+    ERROR_MSG("[READ_CACHE_CLOSE] Dropped %zu dirty blocks of inode %lu", lost,
+              (unsigned long)key.inode);
+    flush_failed = 1;
+  }
 
-  // this means we're closing the last fd to the inode and unlink was called for
-  // this file, so we must remove all the cached entries relative to this inode
-  if (value->unlinked && value->counter == 1) {
+  pthread_mutex_lock(&shard->mutex);
+  InodeInfo *value = *inode_link(shard, inode);
+  int last = value->unlinked && value->counter == 1;
+  int record = state->persistent && !value->unlinked && value->counter == 1;
+  pthread_mutex_unlock(&shard->mutex);
 
+  // the file's version as of its last close, the next run's cache is only
+  // warm if the file didn't change since
+  if (record) {
     struct stat stbuf;
-    res = l.next_layers->ops->lfstat(fd, &stbuf, *l.next_layers);
-
-    if (res == -1)
-      return -1;
-
-    long end_block = stbuf.st_size / (long)state->block_size;
-    res = remove_cached_entries_range(inode, 0, end_block, state);
-
-    if (res == -1)
-      return -1;
+    if (next_layer.ops->lfstat(fd, &stbuf, next_layer) == 0)
+      inode_record(state, fd_file(state, fd), &stbuf);
+  }
 
-    res = l.next_layers->ops->lclose(fd, *l.next_layers);
+  // this means we're closing the last fd to the inode and unlink was called for
+  // this file: its blocks go with the entry of the inode below, but a
+  // persistent cache must not offer them to the next run either
+  if (last && state->persistent) {
+    CacheKey meta = meta_key(key.dev, key.inode);
+    state->ops.remove_item(state->cache_wrapper, &meta, sizeof(meta));
+  }
 
-    if (res != -1) {
-      g_hash_table_remove(state->fd_to_inode, GINT_TO_POINTER(fd));
-      g_hash_table_remove(state->inode_to_info, &inode);
-    }
-  } else {
-    res = l.next_layers->ops->lclose(fd, *l.next_layers);
+  res = next_layer.ops->lclose(fd, next_layer);
 
-    if (res != -1) {
-      g_hash_table_remove(state->fd_to_inode, GINT_TO_POINTER(fd));
-      value->counter--;
+  if (res != -1) {
+    fd_file(state, fd)->used = 0;
+
+    // the entry of an unlinked inode goes away with its last fd, the others
+    // are kept so that unlink knows the file has cached blocks
+    pthread_mutex_lock(&shard->mutex);
+    InodeInfo **link = inode_link(shard, inode);
+    if (--(*link)->counter == 0 && (*link)->unlinked)
+      inode_release(shard, link);
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (flush_failed) {
+      errno = EIO;
+      res = -1;
     }
   }
 
   return res;
 }
 
-ssize_t read_cache_pread(int fd, void *buffer, size_t nbytes, off_t offset,
-                         LayerContext l) {
-  if (nbytes == 0)
+/**
+ * @brief Whether the cache held its num_blocks, once the admission asks
+ *
+ * Caches stay full once they filled up, so the count is only queried until
+ * then.
+ */
+static int cache_is_full(ReadCacheState *state) {
+  if (!admission_filters(state->admission))
     return 0;
+  if (__atomic_load_n(&state->cache_full, __ATOMIC_RELAXED))
+    return 1;
+  if (state->ops.get_item_count(state->cache_wrapper) < state->num_blocks)
+    return 0;
+  __atomic_store_n(&state->cache_full, 1, __ATOMIC_RELAXED);
+  return 1;
+}
 
-  ReadCacheState *state = l.internal_state;
-
-  if (INFO_ENABLED()) {
-    unsigned long item_count = state->ops.get_item_count(state->cache_wrapper);
-    INFO_MSG("[READ_CACHE_LAYER] Currently cached items count: %lu",
-             item_count);
+/**
+ * @brief Insert a block read by a miss, if the admission takes it
+ *
+ * @param bypass whether the fd reads around the cache
+ * @param full whether the cache is full
+ */
+static void cache_missed_block(ReadCacheState *state, int pool, int bypass,
+                               int full, const CacheKey *key, const void *data,
+                               size_t size) {
+  if (bypass) {
+    admission_bypass(state->admission, 1);
+    return;
   }
+  if (!admission_admit(state->admission, key, full))
+    return;
+  if (state->ops.insert_item(state->cache_wrapper, pool, key, sizeof(*key),
+                             data, size) == -1) {
+    ERROR_MSG("[READ_CACHE_PREAD] Failed to insert block %lu of inode %lu",
+              (unsigned long)key->block, (unsigned long)key->inode);
+  }
+}
 
-  int insert_error = 0;
-
-  // get inode associated to the fd
-  ino_t *inode = g_hash_table_lookup(state->fd_to_inode, GINT_TO_POINTER(fd));
-
-  char key[BUFSIZ] = {'\0'};
-
+/**
+ * @brief Build up the result of a pread from looked up blocks
+ *
+ * Copies the hits out of the cache and coalesces contiguous misses into single
+ * preads to the next layer, whose blocks are then inserted in the cache if
+ * the admission takes them.
+ *
+ * @param entries lookup results of blocks start to end, pinned by the caller
+ */
+static ssize_t read_blocks(int fd, void *buffer, off_t offset, size_t start,
+                           size_t end, CacheKey key, const CacheEntry *entries,
+                           ReadCacheState *state, LayerContext l) {
   size_t block_size = state->block_size;
-  size_t start = offset / block_size;
-  size_t end = (offset + nbytes - 1) / block_size;
+  int pool = fd_file(state, fd)->pool;
+  int bypass = fd_bypasses(state, fd_file(state, fd));
+  int full = !bypass && cache_is_full(state);
 
   ssize_t bytes_read; // bytes read in an iteration
   size_t total_bytes_read = 0;
-  CacheEntry cached_block;
   size_t blocks_to_read = 0; // Number of consecutive cache misses to read at
                              // once from the lower layer
 
@@ -273,31 +814,34 @@ ssize_t read_cache_pread(int fd, void *buffer, size_t nbytes, off_t offset,
   // build up the result block by block, coalescing contiguous requests
   for (i = start; i <= end; i++) {
 
-    if (snprintf(key, BUFSIZ, "%ld/%ld", *inode, i) < 0)
-      return -1;
-
-    state->ops.get_item(state->cache_wrapper, key, &cached_block);
+    const CacheEntry *cached_block = &entries[i - start];
 
-    if (cached_block.block == NULL) { // Cache miss
-      if (INFO_ENABLED())
-        INFO_MSG("[READ_CACHE_PREAD] Cache miss for key %s (total %ld)", key,
-                 ++total_misses);
+    if (cached_block->block == NULL) { // Cache miss
+      if (INFO_ENABLED()) {
+        ++total_misses;
+        INFO_MSG_RATELIMITED("[READ_CACHE_PREAD] Cache miss for block %zu of "
+                             "inode %lu (total %ld)",
+                             i, (unsigned long)key.inode, total_misses);
+      }
       blocks_to_read++;
       bytes_read = 0;
     } else { // cache hit
 
-      if (INFO_ENABLED())
-        INFO_MSG("[READ_CACHE_PREAD] Cache hit for key %s (total %ld)", key,
-                 ++total_hits);
+      if (INFO_ENABLED()) {
+        ++total_hits;
+        INFO_MSG_RATELIMITED("[READ_CACHE_PREAD] Cache hit for block %zu of "
+                             "inode %lu (total %ld)",
+                             i, (unsigned long)key.inode, total_hits);
+      }
 
       size_t bytes_to_read = blocks_to_read * block_size;
 
       // copy the content from the cache to the buffer in the correct place,
       // i.e., after all the contiguous misses and previously read blocks
-      memcpy(buffer + bytes_to_read + total_bytes_read, cached_block.block,
-             cached_block.size);
+      memcpy(buffer + bytes_to_read + total_bytes_read, cached_block->block,
+             cached_block->size);
 
-      bytes_read = (long)cached_block.size;
+      bytes_read = (long)cached_block->size;
 
       // if there are accumulated misses, coalesce the request into a single
       // pread to the next layer
@@ -311,18 +855,11 @@ ssize_t read_cache_pread(int fd, void *buffer, size_t nbytes, off_t offset,
         // update cache, block by block
         for (int j = 0; j < blocks_to_read; j++) {
 
-          if (snprintf(key, BUFSIZ, "%ld/%d", *inode,
-                       (int)(i - blocks_to_read + j)) < 0)
-            return -1;
-          insert_error =
-              state->ops.insert_item(state->cache_wrapper, key,
-                                     (const void *)buffer + total_bytes_read +
-                                         (size_t)(j * block_size),
-                                     block_size);
-          if (insert_error == -1) {
-            ERROR_MSG("[READ_CACHE_PREAD] Failed to insert item with key %s",
-                      key);
-          }
+          key.block = i - blocks_to_read + j;
+          cache_missed_block(state, pool, bypass, full, &key,
+                             (const void *)buffer + total_bytes_read +
+                                 (size_t)(j * block_size),
+                             block_size);
         }
         blocks_to_read = 0;
       }
@@ -354,15 +891,9 @@ ssize_t read_cache_pread(int fd, void *buffer, size_t nbytes, off_t offset,
       if (j + 1 == blocks_to_add)
         entry_size = last_block_offset > 0 ? last_block_offset : block_size;
 
-      if (snprintf(key, BUFSIZ, "%ld/%d", *inode,
-                   (int)(i - blocks_to_read + j)) < 0)
-        return -1;
-      insert_error = state->ops.insert_item(
-          state->cache_wrapper, key, (const void *)buffer + total_bytes_read,
-          entry_size);
-      if (insert_error == -1) {
-        ERROR_MSG("[READ_CACHE_PREAD] Failed to insert item with key %s", key);
-      }
+      key.block = i - blocks_to_read + j;
+      cache_missed_block(state, pool, bypass, full, &key,
+                         (const void *)buffer + total_bytes_read, entry_size);
       total_bytes_read += entry_size;
     }
   }
@@ -370,41 +901,161 @@ ssize_t read_cache_pread(int fd, void *buffer, size_t nbytes, off_t offset,
   return (ssize_t)total_bytes_read;
 }
 
+ssize_t read_cache_pread(int fd, void *buffer, size_t nbytes, off_t offset,
+                         LayerContext l) {
+  if (nbytes == 0)
+    return 0;
+
+  ReadCacheState *state = l.internal_state;
+
+  if (INFO_ENABLED()) {
+    unsigned long item_count = state->ops.get_item_count(state->cache_wrapper);
+    INFO_MSG("[READ_CACHE_LAYER] Currently cached items count: %lu",
+             item_count);
+  }
+
+  // get the key of the file associated to the fd
+  CacheKey key;
+  if (fd_key(state, fd, &key) == -1)
+    return -1;
+
+  size_t block_size = state->block_size;
+  size_t start = offset / block_size;
+  size_t end = (offset + nbytes - 1) / block_size;
+  size_t count = end - start + 1;
+
+  FdInode *file = fd_file(state, fd);
+  int sequential = stream_update(file, start, end);
+  if (state->readahead != NULL && !fd_bypasses(state, file))
+    readahead_update(state, fd, &key, sequential, end);
+
+  // requests of up to READ_CACHE_LOOKUP_BATCH blocks are looked up without
+  // allocating
+  CacheKey stack_keys[READ_CACHE_LOOKUP_BATCH];
+  CacheEntry stack_entries[READ_CACHE_LOOKUP_BATCH];
+  CacheKey *keys = stack_keys;
+  CacheEntry *entries = stack_entries;
+  if (count > READ_CACHE_LOOKUP_BATCH) {
+    keys = malloc(count * sizeof(CacheKey));
+    entries = malloc(count * sizeof(CacheEntry));
+    if (keys == NULL || entries == NULL) {
+      free(keys);
+      free(entries);
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    keys[i] = key;
+    keys[i].block = start + i;
+  }
+
+  // a single lookup for the whole request, the hits stay pinned (can't be
+  // evicted) until they were copied out
+  void *pinned = state->ops.get_items(state->cache_wrapper, keys,
+                                      sizeof(CacheKey), count, entries);
+  ssize_t res = 0;
+
+  // misses are read from the next layer, which must have the dirty blocks
+  if (state->write_back != NULL) {
+    for (size_t i = 0; i < count; i++) {
+      if (entries[i].block == NULL) {
+        res = flush_file(state, &key, start, end, -1);
+        break;
+      }
+    }
+  }
+  if (res != -1)
+    res = read_blocks(fd, buffer, offset, start, end, key, entries, state, l);
+  state->ops.release_items(pinned);
+
+  if (keys != stack_keys) {
+    free(keys);
+    free(entries);
+  }
+  return res;
+}
+
+/**
+ * @brief Absorb a block aligned pwrite in dirty blocks and in the cache
+ */
+static ssize_t absorb_blocks(int fd, const void *buffer, size_t nbytes,
+                             off_t offset, CacheKey key,
+                             ReadCacheState *state) {
+  size_t block_size = state->block_size;
+  size_t start = offset / block_size;
+  size_t count = nbytes / block_size;
+
+  inode_modified(state, (ino_t)key.inode);
+  for (size_t j = 0; j < count; j++) {
+    key.block = start + j;
+    const void *block = (const char *)buffer + j * block_size;
+    if (write_back_absorb(state->write_back, fd, &key, block) == -1) {
+      ERROR_MSG("[READ_CACHE_PWRITE] Failed to absorb block %lu of inode %lu",
+                (unsigned long)key.block, (unsigned long)key.inode);
+      return j > 0 ? (ssize_t)(j * block_size) : -1;
+    }
+    int insert_error = state->ops.insert_item(
+        state->cache_wrapper, fd_file(state, fd)->pool, &key, sizeof(key),
+        block, block_size);
+    if (insert_error == -1) {
+      ERROR_MSG("[READ_CACHE_PWRITE] Failed to insert block %lu of inode %lu",
+                (unsigned long)key.block, (unsigned long)key.inode);
+    }
+  }
+  return (ssize_t)nbytes;
+}
+
 ssize_t read_cache_pwrite(int fd, const void *buffer, size_t nbytes,
                           off_t offset, LayerContext l) {
 
   ReadCacheState *state = (ReadCacheState *)l.internal_state;
 
-  char key[BUFSIZ] = {'\0'};
+  // get the key of the file associated to the fd
+  CacheKey key;
+  if (fd_key(state, fd, &key) == -1)
+    return -1;
+
+  size_t block_size = state->block_size;
+  if (state->write_back != NULL) {
+    if (offset % (off_t)block_size == 0 && nbytes % block_size == 0)
+      return absorb_blocks(fd, buffer, nbytes, offset, key, state);
+    // other writes go through, after the dirty blocks they may overlap
+    if (flush_file(state, &key, 0, UINT64_MAX, -1) == -1)
+      return -1;
+  }
+
   ssize_t bytes_written =
       l.next_layers->ops->lpwrite(fd, buffer, nbytes, offset, *l.next_layers);
   if (bytes_written <= 0)
     return bytes_written;
-  // get inode associated to the fd
-  ino_t *inode = g_hash_table_lookup(state->fd_to_inode, GINT_TO_POINTER(fd));
-  size_t block_size = state->block_size;
+  inode_modified(state, (ino_t)key.inode);
   size_t start = offset / block_size;
   size_t end = (offset + nbytes - 1) / block_size;
 
   size_t last_block_offset = nbytes % block_size;
   size_t bytes_to_write = block_size;
   int contains = 0;
+  int pool = fd_file(state, fd)->pool;
   // update the cache block by block
   for (size_t i = start, j = 0; i <= end; i++, j++) {
     if (i == end)
       bytes_to_write = last_block_offset == 0 ? block_size : last_block_offset;
 
-    if (snprintf(key, BUFSIZ, "%ld/%ld", *inode, i) < 0)
-      return -1;
-
-    contains = state->ops.contain_item(state->cache_wrapper, key);
+    key.block = i;
+    contains = state->ops.contain_item(state->cache_wrapper, &key, sizeof(key));
 
-    // the block is in cache, so we update it
-    if (contains == 1) {
-      int insert_error = state->ops.insert_item(
-          state->cache_wrapper, key, buffer + j * block_size, bytes_to_write);
+    // the block is in cache, so we update it, whole blocks are cached anyway
+    // unless in write_around mode
+    if (contains == 1 || (state->write_mode != READ_CACHE_WRITE_AROUND &&
+                          bytes_to_write == block_size)) {
+      int insert_error =
+          state->ops.insert_item(state->cache_wrapper, pool, &key, sizeof(key),
+                                 buffer + j * block_size, bytes_to_write);
       if (insert_error == -1) {
-        ERROR_MSG("[READ_CACHE_PWRITE] Failed to insert item with key %s", key);
+        ERROR_MSG("[READ_CACHE_PWRITE] Failed to insert block %zu of inode %lu",
+                  i, (unsigned long)key.inode);
       }
     }
   }
@@ -415,6 +1066,13 @@ ssize_t read_cache_pwrite(int fd, const void *buffer, size_t nbytes,
 int read_cache_ftruncate(int fd, off_t length, LayerContext l) {
 
   int insert_error = 0;
+  ReadCacheState *state = (ReadCacheState *)l.internal_state;
+  CacheKey key;
+  if (fd_key(state, fd, &key) == -1)
+    return -1;
+  if (flush_file(state, &key, 0, UINT64_MAX, -1) == -1)
+    return -1;
+
   struct stat stbuf;
   int res = l.next_layers->ops->lfstat(fd, &stbuf, *l.next_layers);
   if (res == -1)
@@ -425,10 +1083,20 @@ int read_cache_ftruncate(int fd, off_t length, LayerContext l) {
   if (res == -1)
     return -1;
 
-  ReadCacheState *state = (ReadCacheState *)l.internal_state;
-  ino_t *inode = g_hash_table_lookup(state->fd_to_inode, GINT_TO_POINTER(fd));
-
   size_t block_size = state->block_size;
+  int pool = fd_file(state, fd)->pool;
+
+  // dropping more than a few blocks costs a cache operation per block index,
+  // so the whole file is invalidated at once instead, the blocks it keeps
+  // included
+  off_t dropped_blocks =
+      (size - 1) / (off_t)block_size - length / (off_t)block_size;
+  if (length < size &&
+      (length == 0 || dropped_blocks >= READ_CACHE_REMOVE_BLOCKS)) {
+    inode_invalidate(state, (ino_t)key.inode);
+    return 0;
+  }
+  inode_modified(state, (ino_t)key.inode);
 
   // the file will be lengthened, so there's no need to remove blocks, but
   // rather fill with \0s (if it is in cache) the block that was previously the
@@ -436,11 +1104,10 @@ int read_cache_ftruncate(int fd, off_t length, LayerContext l) {
   if (length > size) {
 
     off_t last_block = (size - 1) / (off_t)block_size;
-    char key[BUFSIZ] = {'\0'};
-    if (snprintf(key, BUFSIZ, "%ld/%ld", *inode, last_block) < 0)
-      return -1;
+    key.block = (uint64_t)last_block;
     CacheEntry cached_block;
-    state->ops.get_item(state->cache_wrapper, key, &cached_block);
+    void *pinned = state->ops.get_items(state->cache_wrapper, &key,
+                                        sizeof(key), 1, &cached_block);
 
     if (cached_block.block != NULL) {
       size_t last_block_length = cached_block.size;
@@ -453,17 +1120,19 @@ int read_cache_ftruncate(int fd, off_t length, LayerContext l) {
         void *block_buffer = calloc(sizeof(void), block_size);
         memcpy(block_buffer, cached_block.block, cached_block.size);
 
-        insert_error =
-            state->ops.insert_item(state->cache_wrapper, key, block_buffer,
-                                   last_block_length + bytes_to_zero);
+        insert_error = state->ops.insert_item(
+            state->cache_wrapper, pool, &key, sizeof(key), block_buffer,
+            last_block_length + bytes_to_zero);
         if (insert_error == -1) {
-          ERROR_MSG("[READ_CACHE_FTRUNCATE] Failed to insert item with key %s",
-                    key);
+          ERROR_MSG("[READ_CACHE_FTRUNCATE] Failed to insert block %lu of "
+                    "inode %lu",
+                    (unsigned long)key.block, (unsigned long)key.inode);
         }
 
         free(block_buffer);
       }
     }
+    state->ops.release_items(pinned);
   } else { // the file will be shortened, so it's necessary to remove the
            // affected blocks
     size_t first_block_rm; // first block to remove from the cache
@@ -485,22 +1154,25 @@ int read_cache_ftruncate(int fd, off_t length, LayerContext l) {
       size_t last_block_length =
           length % block_size; // length that last block will have
 
-      char key[BUFSIZ] = {'\0'};
-      if (snprintf(key, BUFSIZ, "%ld/%ld", *inode, last_block) < 0)
-        return -1;
+      key.block = last_block;
       CacheEntry cached_block;
-      state->ops.get_item(state->cache_wrapper, key, &cached_block);
+      void *pinned = state->ops.get_items(state->cache_wrapper, &key,
+                                          sizeof(key), 1, &cached_block);
 
       if (cached_block.block != NULL) {
         /* the content of the block doesn't change, so it's only necessary to
         update the size of the cached block*/
-        insert_error = state->ops.insert_item(
-            state->cache_wrapper, key, cached_block.block, last_block_length);
+        insert_error =
+            state->ops.insert_item(state->cache_wrapper, pool, &key,
+                                   sizeof(key), cached_block.block,
+                                   last_block_length);
         if (insert_error == -1) {
-          ERROR_MSG("[READ_CACHE_FTRUNCATE] Failed to insert item with key %s",
-                    key);
+          ERROR_MSG("[READ_CACHE_FTRUNCATE] Failed to insert block %lu of "
+                    "inode %lu",
+                    (unsigned long)key.block, (unsigned long)key.inode);
         }
       }
+      state->ops.release_items(pinned);
 
       first_block_rm =
           (length / block_size) + 1; // + 1 to not remove the updated block
@@ -508,7 +1180,7 @@ int read_cache_ftruncate(int fd, off_t length, LayerContext l) {
     }
 
     int removed_entries = remove_cached_entries_range(
-        *inode, (long)first_block_rm, (long)last_block_rm, state);
+        key, (long)first_block_rm, (long)last_block_rm, state);
     if (removed_entries == -1)
       return -1;
   }
@@ -516,43 +1188,122 @@ int read_cache_ftruncate(int fd, off_t length, LayerContext l) {
   return 0;
 }
 
+void read_cache_get_readahead_stats(LayerContext l, ReadaheadStats *stats) {
+  ReadCacheState *state = (ReadCacheState *)l.internal_state;
+  readahead_get_stats(state->readahead, stats);
+}
+
+void read_cache_get_admission_stats(LayerContext l, AdmissionStats *stats) {
+  ReadCacheState *state = (ReadCacheState *)l.internal_state;
+  admission_get_stats(state->admission, stats);
+}
+
+int read_cache_reconfigure(const void *params, int apply, const char **error,
+                           LayerContext l) {
+  const ReadCacheLayerConfig *config = (const ReadCacheLayerConfig *)params;
+  ReadCacheState *state = (ReadCacheState *)l.internal_state;
+  // the sketch exists from init or not at all
+  if ((config->admit_misses > 1) != admission_filters(state->admission)) {
+    *error = "admit_misses cannot cross 1, the admission sketch is sized at "
+             "startup";
+    return -1;
+  }
+  if (apply) {
+    (void)admission_set_admit_misses(state->admission,
+                                     (unsigned)config->admit_misses);
+    __atomic_store_n(&state->bypass_blocks, config->bypass_blocks,
+                     __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+void read_cache_get_write_back_stats(LayerContext l, WriteBackStats *stats) {
+  ReadCacheState *state = (ReadCacheState *)l.internal_state;
+  write_back_get_stats(state->write_back, stats);
+}
+
 int read_cache_fstat(int fd, struct stat *stbuf, LayerContext l) {
+  ReadCacheState *state = (ReadCacheState *)l.internal_state;
+  // the size below must account for the dirty blocks
+  if (state->write_back != NULL) {
+    CacheKey key;
+    if (fd_key(state, fd, &key) == -1)
+      return -1;
+    if (flush_file(state, &key, 0, UINT64_MAX, -1) == -1)
+      return -1;
+  }
   return l.next_layers->ops->lfstat(fd, stbuf, *l.next_layers);
 }
 
 int read_cache_lstat(const char *pathname, struct stat *stbuf, LayerContext l) {
-  return l.next_layers->ops->llstat(pathname, stbuf, *l.next_layers);
+  ReadCacheState *state = (ReadCacheState *)l.internal_state;
+  int res = l.next_layers->ops->llstat(pathname, stbuf, *l.next_layers);
+  if (res == -1 || state->write_back == NULL)
+    return res;
+
+  // the inode is only known after the first lstat
+  CacheKey key = {.dev = stbuf->st_dev, .inode = stbuf->st_ino};
+  int written = flush_file(state, &key, 0, UINT64_MAX, -1);
+  if (written == -1)
+    return -1;
+  if (written > 0)
+    res = l.next_layers->ops->llstat(pathname, stbuf, *l.next_layers);
+  return res;
+}
+
+int read_cache_fsync(int fd, int isdatasync, LayerContext l) {
+  ReadCacheState *state = (ReadCacheState *)l.internal_state;
+  CacheKey key;
+  if (fd_key(state, fd, &key) == -1)
+    return -1;
+  if (flush_file(state, &key, 0, UINT64_MAX, -1) == -1)
+    return -1;
+  if (l.next_layers->ops->lfsync == NULL)
+    return 0;
+  return l.next_layers->ops->lfsync(fd, isdatasync, *l.next_layers);
 }
 
 int read_cache_unlink(const char *pathname, LayerContext l) {
 
+  ReadCacheState *state = (ReadCacheState *)l.internal_state;
   struct stat stbuf;
   int res = l.next_layers->ops->llstat(pathname, &stbuf, *l.next_layers);
   if (res == -1)
     return -1;
 
+  // the fds still open may read the file, from the next layer
+  CacheKey key = {.dev = stbuf.st_dev, .inode = stbuf.st_ino};
+  if (flush_file(state, &key, 0, UINT64_MAX, -1) == -1)
+    return -1;
+
   res = l.next_layers->ops->lunlink(pathname, *l.next_layers);
 
   if (res != -1) {
-    ReadCacheState *state = (ReadCacheState *)l.internal_state;
+    InodeShard *shard = inode_shard(state, stbuf.st_ino);
+    int remove = 0;
 
-    InodeInfo *value = g_hash_table_lookup(state->inode_to_info, &stbuf.st_ino);
-    // if value is NULL, it means the file was never opened by us, so there
+    pthread_mutex_lock(&shard->mutex);
+    InodeInfo **link = inode_link(shard, stbuf.st_ino);
+    // if there's no entry, it means the file was never opened by us, so there
     // isn't anything in cache
-    if (value != NULL) {
+    if (*link != NULL) {
 
       // there's no currently opened fds to this path, so it won't go through
-      // our close
-      if (value->counter == 0) {
-
-        long end_block = stbuf.st_size / (long)state->block_size;
-        res = remove_cached_entries_range(stbuf.st_ino, 0, end_block, state);
-        g_hash_table_remove(state->fd_to_inode, &stbuf.st_ino);
-
+      // our close. Without its entry, the epoch of its blocks is forgotten, a
+      // file reusing the inode gets a new one
+      if ((*link)->counter == 0) {
+        inode_release(shard, link);
+        remove = 1;
       }
-      // the cached entries will eventually be removed in the close
+      // the entry will eventually be released in the close
       else
-        value->unlinked = 1;
+        (*link)->unlinked = 1;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (remove && state->persistent) {
+      CacheKey meta = meta_key(key.dev, key.inode);
+      state->ops.remove_item(state->cache_wrapper, &meta, sizeof(meta));
     }
   }
 
@@ -2,28 +2,109 @@
 #define __READCACHE_H__
 
 #include "../../../shared/types/layer_context.h"
+#include "../../../shared/utils/fd_table.h"
+#include "../../../shared/utils/memory_budget.h"
+#include "admission.h"
+#include "cache_key.h"
 #include "config.h"
 #include "config/declarations.h"
-#include <glib.h>
+#include "readahead.h"
+#include "write_back.h"
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 
+#define READ_CACHE_INODE_SHARDS 64   // independently locked inode table shards
+#define READ_CACHE_SHARD_BUCKETS 256 // hash chains per shard (power of 2)
+#define READ_CACHE_LOOKUP_BATCH 32   // blocks a pread looks up on the stack
+#define READ_CACHE_META_BLOCK UINT64_MAX // block of a file's InodeMeta item
+#define READ_CACHE_REMOVE_BLOCKS 64 // most blocks a truncate removes one by one
+
 typedef struct cacheentry {
   const void *block;
   size_t size;
 } CacheEntry;
 
+// options of the wrapper's initialize_cache
 typedef struct {
-  int counter;  // number of fds opened for a certain inode
-  int unlinked; // true if unlinked was called to a certain inode
+  const char *nvm_path;           // file or device of the NVM tier, or NULL
+  size_t nvm_size;                // bytes of the NVM tier
+  const char *persist_dir;        // directory of the saved cache, or NULL
+  read_cache_eviction_t eviction; // eviction policy
+  size_t num_pools;               // pools the cache is split in
+} CacheOptions;
+
+typedef struct InodeInfo {
+  ino_t inode;              // inode number, key of the table
+  int counter;              // number of fds opened for a certain inode
+  int unlinked;             // true if unlinked was called to a certain inode
+  unsigned long generation; // bumped by every change of the file's content
+  uint64_t epoch;           // epoch of the file's cache keys, renewed when
+                            // all of its blocks are invalidated
+  int pool;                 // cache pool of the file's blocks
+  struct InodeInfo *next;   // next entry of the hash chain or of the pool
 } InodeInfo;
 
+/**
+ * @brief Version of a file whose blocks a persistent cache holds
+ *
+ * Cached, at the key of the file with epoch 0 and READ_CACHE_META_BLOCK, by
+ * the last close of the file. The first open of a file after a restart reuses
+ * its epoch, and so its blocks, only if the file still has the recorded
+ * size, mtime and ctime; otherwise the file gets a new epoch and its old
+ * blocks are never looked up again.
+ */
+typedef struct {
+  uint64_t epoch;     // epoch of the blocks
+  int64_t size;       // st_size
+  int64_t mtime_sec;  // st_mtim
+  int64_t mtime_nsec; // st_mtim
+  int64_t ctime_sec;  // st_ctim, which can't be set back by writers
+  int64_t ctime_nsec; // st_ctim
+} InodeMeta;
+
+/**
+ * @brief A slice of the inode table with its own lock
+ *
+ * Inodes are spread over the shards, so opens and closes of different files
+ * rarely contend. Removed entries go to the pool and are reused by the next
+ * opens instead of being freed.
+ */
+typedef struct {
+  pthread_mutex_t mutex;                        // protects the shard
+  InodeInfo *buckets[READ_CACHE_SHARD_BUCKETS]; // hash chains
+  InodeInfo *pool;                              // unused entries
+} InodeShard;
+
+/**
+ * @brief Inode of an open fd
+ *
+ * Read without a lock: a slot is only written by open and close of its fd,
+ * which cannot race with other calls on that fd.
+ */
+typedef struct {
+  dev_t dev;         // device of the open file
+  ino_t inode;       // inode of the open file
+  InodeInfo *info;   // entry of the inode, kept while it has open fds
+  int pool;          // cache pool of the open file
+  int used;          // set while the fd is open
+  size_t next_block; // block following the last pread
+  size_t window;     // read-ahead window, in blocks (0: random access)
+  size_t ahead;      // first block not requested for prefetch yet
+  size_t run;        // blocks read by the last preads in sequence
+  int noreuse;       // opened with O_NOATIME, its misses aren't cached
+} FdInode;
+
 typedef struct {
-  int (*insert_item)(void *cache_wrapper, const char *key, const void *block,
-                     size_t block_length);
-  void (*get_item)(void *cache_wrapper, const char *key, CacheEntry *item);
-  int (*remove_item)(void *cache_wrapper, const char *key);
-  int (*contain_item)(void *cache_wrapper, const char *key);
+  int (*insert_item)(void *cache_wrapper, int pool, const void *key,
+                     size_t key_length, const void *block, size_t block_length);
+  void *(*get_items)(void *cache_wrapper, const void *keys, size_t key_length,
+                     size_t count, CacheEntry *items);
+  void (*release_items)(void *pinned);
+  int (*remove_item)(void *cache_wrapper, const void *key, size_t key_length);
+  int (*contain_item)(void *cache_wrapper, const void *key,
+                      size_t key_length);
   unsigned long (*get_item_count)(void *cache_wrapper);
   void (*destroy_cache)(void *cache_wrapper);
 
@@ -32,32 +113,80 @@ typedef struct {
 typedef struct {
   size_t block_size;
   size_t num_blocks;
-  GHashTable *fd_to_inode;   // maps fds to inodes
-  GHashTable *inode_to_info; // maps inodes to InodeInfo structs
+  FdTable fd_to_inode; // FdInode of each fd
+  InodeShard inode_to_info[READ_CACHE_INODE_SHARDS]; // InodeInfo by inode
   void *shared_lib_handle;
   void *cache_wrapper;
   CacheLibOps ops;
+  size_t readahead_max;               // largest read-ahead window, 0: off
+  Readahead *readahead;               // prefetch thread, NULL if disabled
+  void *readahead_buffer;             // readahead_max blocks, for the thread
+  LayerContext *next_layer;           // next layer, for the threads
+  read_cache_write_mode_t write_mode; // how pwrites use the cache
+  WriteBack *write_back;              // dirty blocks, write_back mode only
+  int persistent;                     // cache kept across restarts
+  uint64_t next_epoch;                // last epoch given to a file
+  char **pool_prefixes;               // pool i + 1 holds the files in entry i
+  int num_pool_prefixes;              // entries of pool_prefixes
+  off_t large_file_bytes;             // the last pool holds larger files
+  int direct_io;                      // files are opened with O_DIRECT below
+  Admission *admission;               // which missed blocks are cached
+  size_t bypass_blocks;               // longer runs bypass the cache, 0: off
+  int cache_full;                     // set once the cache held num_blocks
+  MemoryAccount *memory;              // "read_cache" account
+  size_t memory_charged;              // bytes of the DRAM tier charged to it
 } ReadCacheState;
 
+/**
+ * @brief Initializes the read cache layer.
+ *
+ * The read-ahead window is capped to a quarter of num_blocks, 0
+ * readahead_blocks disables read-ahead. In write_back mode, dirty_blocks and
+ * flush_ms of 0 select a quarter of num_blocks and
+ * READ_CACHE_DEFAULT_FLUSH_MS.
+ * The DRAM tier and the dirty blocks are charged to the "read_cache" memory
+ * account: num_blocks is lowered to fit its headroom at init, leaving a
+ * quarter of it to the dirty blocks in write_back mode.
+ * With nvm_path, blocks evicted from DRAM go to an NVM tier of nvm_size_mb
+ * first. With persist_dir, the cache is saved there by destroy and attached
+ * again by the next init; files are revalidated on their first open.
+ * The blocks of a file are cached in the pool chosen at its first open: the
+ * one of the first pool_prefixes entry its path starts with, else the large
+ * file pool if it has at least large_file_mb, else the default pool. Pools
+ * split the cache evenly and don't evict each other's blocks.
+ * With admit_misses above 1, a full cache only takes the blocks missed that
+ * many times recently. With bypass_blocks, an fd that read more blocks in
+ * sequence neither caches nor prefetches its misses, as an fd opened with
+ * O_NOATIME.
+ *
+ * @param next_layer next layer
+ * @param nlayers number of next layers
+ * @param config layer parameters (next_Layer is not used)
+ *
+ * @return Layer context
+ */
 LayerContext read_cache_init(LayerContext *next_layer, int nlayers,
-                             size_t block_size, size_t num_blocks);
+                             const ReadCacheLayerConfig *config);
 
 void read_cache_destroy(LayerContext l);
 
 /**
  * @brief Stores important data for the cache and forwards the request.
  *
- * After getting the fd from the next layer, it is used as a key to
- * store the inode number in this layer's internal state's mapping.
+ * After getting the fd from the next layer, its slot in the fd array stores
+ * the inode number and the epoch of the file.
  * The fd counter is also incremented for this inode.
- * If O_TRUNC is used, every cache entry related to this file will be removed.
+ * If O_TRUNC is used, the file gets a new epoch, so none of its cached
+ * blocks is looked up again.
+ * With direct_io, the file is opened with O_DIRECT in the next layer.
  *
  * @param pathname path to the file to open
  * @param flags open flags
  * @param mode creation permissions
  * @param l Layer context
  *
- * @return fd of the file, -1 on error
+ * @return fd of the file, -1 on error (EMFILE if fd is not below
+ * FD_TABLE_MAX_FDS)
  */
 int read_cache_open(const char *pathname, int flags, mode_t mode,
                     LayerContext l);
@@ -66,10 +195,11 @@ int read_cache_open(const char *pathname, int flags, mode_t mode,
  * @brief Frees important data for the cache and forwards the request.
  *
  * After obtaining the result of the close from the next layer,
- * the fd->inode hash table entry for this fd is removed.
+ * the fd array slot of this fd is cleared.
  * Also, the open fd counter for the inode is decremented; if it reaches 0 and
- * the inode was previously unlinked, every cached entry related to the file is
- * removed.
+ * the inode was previously unlinked, its entry is dropped, and with it the
+ * epoch of its cached blocks. With a persistent cache, the last close of a
+ * file records its InodeMeta.
  *
  * @param fd fd to close
  * @param l Layer context
@@ -82,7 +212,11 @@ int read_cache_close(int fd, LayerContext l);
  * @brief Reads the requested data, consulting the cache.
  *
  * Reads, block by block, the requested bytes.
- * For each block, the cache is consulted. If the block is in cache,
+ * The pread also updates the read-ahead state of the fd: reads continuing the
+ * previous one grow its window and prefetch the next blocks in the
+ * background, other reads shrink it.
+ * All the blocks are looked up in the cache at once, and the hits stay pinned
+ * until the read is done. If a block is in cache,
  * it copies the content to the buffer and moves on the next block.
  * If the block is not in cache, it is requested to next layer and the cache is
  * updated.
@@ -103,7 +237,10 @@ ssize_t read_cache_pread(int fd, void *buffer, size_t nbytes, off_t offset,
  *
  * Writes the requested bytes, block by block, checking the cache for each
  * block. If the block is there, updates its content according to the passed
- * buffer.
+ * buffer. In write_through mode, whole blocks are cached even if they weren't.
+ * In write_back mode, writes of whole blocks are cached and absorbed in dirty
+ * blocks, which are written to the next layer later; other writes first write
+ * the dirty blocks of the file.
  *
  * @param fd fd to write to
  * @param buffer data to write
@@ -156,9 +293,10 @@ int read_cache_lstat(const char *pathname, struct stat *stbuf, LayerContext l);
  * @brief Unlink that updates the cache when all of the open fds for that path
  * are closed
  *
- * Removes from the cache all blocks related to this file only when there are no
- * more fds opened for the path. If there are still opened fds for that path we
- * mark the specific inode as unlinked, so the removal is handled in the close.
+ * Drops the entry of the inode, and so the epoch of its cached blocks, only
+ * when there are no more fds opened for the path. If there are still opened
+ * fds for that path we mark the specific inode as unlinked, so the entry is
+ * dropped in the close. The blocks themselves are left to the eviction.
  *
  * @param pathname path to the file to be unlinked
  * @param l Layer context
@@ -167,4 +305,56 @@ int read_cache_lstat(const char *pathname, struct stat *stbuf, LayerContext l);
  */
 int read_cache_unlink(const char *pathname, LayerContext l);
 
+/**
+ * @brief fsync for read_cache layer. Writes the dirty blocks of the file
+ * first, then calls fsync on the underlying layer.
+ *
+ * @param fd File descriptor.
+ * @param isdatasync Only flush the data, as fdatasync.
+ * @param l Layer context.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+int read_cache_fsync(int fd, int isdatasync, LayerContext l);
+
+/**
+ * @brief Take the admit_misses and bypass_blocks of a reloaded configuration
+ *
+ * Frequency filtering is set up by init: admit_misses can change, but not
+ * cross 1 either way.
+ *
+ * @param params Reloaded ReadCacheLayerConfig of the layer.
+ * @param apply 0 to only check them.
+ * @param error Why they cannot be taken.
+ * @param l Layer context.
+ *
+ * @return 0 on success, or -1 if they cannot be taken live.
+ */
+int read_cache_reconfigure(const void *params, int apply, const char **error,
+                           LayerContext l);
+
+/**
+ * @brief Snapshot of the write_back metrics
+ *
+ * @param l Layer context
+ * @param stats Output, all zero if not in write_back mode
+ */
+void read_cache_get_write_back_stats(LayerContext l, WriteBackStats *stats);
+
+/**
+ * @brief Snapshot of the read-ahead metrics
+ *
+ * @param l Layer context
+ * @param stats Output, all zero if read-ahead is disabled
+ */
+void read_cache_get_readahead_stats(LayerContext l, ReadaheadStats *stats);
+
+/**
+ * @brief Snapshot of the admission metrics
+ *
+ * @param l Layer context
+ * @param stats Output
+ */
+void read_cache_get_admission_stats(LayerContext l, AdmissionStats *stats);
+
 #endif
@@ -0,0 +1,155 @@
+#include "readahead.h"
+
+#include "../../../logdef.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Readahead thread: runs the queued requests in order until stopped
+ */
+static void *readahead_worker(void *arg) {
+  Readahead *readahead = arg;
+
+  pthread_mutex_lock(&readahead->mutex);
+  for (;;) {
+    while (readahead->len == 0 && !readahead->stopping) {
+      pthread_cond_wait(&readahead->work, &readahead->mutex);
+    }
+    if (readahead->stopping) {
+      break;
+    }
+
+    ReadaheadRequest request = readahead->queue[readahead->head];
+    readahead->head = (readahead->head + 1) % READAHEAD_QUEUE_SIZE;
+    readahead->len--;
+    readahead->active_fd = request.fd;
+    pthread_mutex_unlock(&readahead->mutex);
+
+    int res = readahead->prefetch(readahead->arg, &request);
+
+    pthread_mutex_lock(&readahead->mutex);
+    if (res < 0) {
+      readahead->stats.failed++;
+    } else {
+      readahead->stats.blocks += (size_t)res;
+    }
+    readahead->active_fd = -1;
+    pthread_cond_broadcast(&readahead->done);
+  }
+  pthread_mutex_unlock(&readahead->mutex);
+  return NULL;
+}
+
+Readahead *readahead_init(readahead_fn prefetch, void *arg) {
+  if (!prefetch) {
+    return NULL;
+  }
+  Readahead *readahead = calloc(1, sizeof(Readahead));
+  if (!readahead) {
+    return NULL;
+  }
+  readahead->prefetch = prefetch;
+  readahead->arg = arg;
+  readahead->active_fd = -1;
+
+  if (pthread_mutex_init(&readahead->mutex, NULL) != 0) {
+    free(readahead);
+    return NULL;
+  }
+  if (pthread_cond_init(&readahead->work, NULL) != 0) {
+    pthread_mutex_destroy(&readahead->mutex);
+    free(readahead);
+    return NULL;
+  }
+  if (pthread_cond_init(&readahead->done, NULL) != 0) {
+    pthread_cond_destroy(&readahead->work);
+    pthread_mutex_destroy(&readahead->mutex);
+    free(readahead);
+    return NULL;
+  }
+  if (pthread_create(&readahead->worker, NULL, readahead_worker, readahead) !=
+      0) {
+    ERROR_MSG("[READ_CACHE: READAHEAD] Failed to start the readahead thread");
+    pthread_cond_destroy(&readahead->done);
+    pthread_cond_destroy(&readahead->work);
+    pthread_mutex_destroy(&readahead->mutex);
+    free(readahead);
+    return NULL;
+  }
+  return readahead;
+}
+
+void readahead_destroy(Readahead *readahead) {
+  if (!readahead) {
+    return;
+  }
+  pthread_mutex_lock(&readahead->mutex);
+  readahead->stopping = 1;
+  pthread_cond_broadcast(&readahead->work);
+  pthread_mutex_unlock(&readahead->mutex);
+  pthread_join(readahead->worker, NULL);
+
+  pthread_cond_destroy(&readahead->done);
+  pthread_cond_destroy(&readahead->work);
+  pthread_mutex_destroy(&readahead->mutex);
+  free(readahead);
+}
+
+int readahead_submit(Readahead *readahead, const ReadaheadRequest *request) {
+  if (!readahead || !request || request->count == 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&readahead->mutex);
+  if (readahead->stopping || readahead->len == READAHEAD_QUEUE_SIZE) {
+    readahead->stats.dropped++;
+    pthread_mutex_unlock(&readahead->mutex);
+    return -1;
+  }
+  size_t tail = (readahead->head + readahead->len) % READAHEAD_QUEUE_SIZE;
+  readahead->queue[tail] = *request;
+  readahead->len++;
+  readahead->stats.requests++;
+  pthread_cond_signal(&readahead->work);
+  pthread_mutex_unlock(&readahead->mutex);
+  return 0;
+}
+
+void readahead_cancel(Readahead *readahead, int fd) {
+  if (!readahead) {
+    return;
+  }
+  pthread_mutex_lock(&readahead->mutex);
+
+  // keep the requests of the other fds, in order
+  size_t kept = 0;
+  for (size_t i = 0; i < readahead->len; i++) {
+    ReadaheadRequest *request =
+        &readahead->queue[(readahead->head + i) % READAHEAD_QUEUE_SIZE];
+    if (request->fd == fd) {
+      readahead->stats.cancelled++;
+      continue;
+    }
+    readahead->queue[(readahead->head + kept) % READAHEAD_QUEUE_SIZE] =
+        *request;
+    kept++;
+  }
+  readahead->len = kept;
+
+  while (readahead->active_fd == fd) {
+    pthread_cond_wait(&readahead->done, &readahead->mutex);
+  }
+  pthread_mutex_unlock(&readahead->mutex);
+}
+
+void readahead_get_stats(Readahead *readahead, ReadaheadStats *stats) {
+  if (!stats) {
+    return;
+  }
+  if (!readahead) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  pthread_mutex_lock(&readahead->mutex);
+  *stats = readahead->stats;
+  pthread_mutex_unlock(&readahead->mutex);
+}
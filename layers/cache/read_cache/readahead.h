@@ -0,0 +1,116 @@
+#ifndef __READAHEAD_H__
+#define __READAHEAD_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * ============================================================================
+ * READAHEAD - ASYNCHRONOUS PREFETCH OF SEQUENTIAL STREAMS
+ * ============================================================================
+ *
+ * preads of the read cache that continue the previous pread of their fd grow
+ * the read-ahead window of the fd, the others shrink it. Sequential streams
+ * hand the blocks ahead of the reader to a background thread, which reads
+ * them from the next layer into the cache before they are requested.
+ *
+ * - The window starts at READAHEAD_MIN_WINDOW blocks, doubles on every
+ *   sequential pread up to the configured maximum, and halves on every
+ *   random one, as the Linux page cache readahead does.
+ * - A new window is requested once the reader consumed half of the previous
+ *   one, so the prefetch keeps ahead of a steady stream.
+ * - Requests are dropped when the queue is full, a close cancels the queued
+ *   requests of its fd and waits for the running one.
+ * ============================================================================
+ */
+
+#define READAHEAD_MIN_WINDOW 4  // first window of a stream, in blocks
+#define READAHEAD_QUEUE_SIZE 64 // pending requests at most
+
+typedef struct {
+  int fd;         // fd to read with
+  uint64_t dev;   // device of the file
+  uint64_t inode; // inode of the file
+  uint64_t epoch; // content version of the file
+  uint64_t block; // first block to prefetch
+  size_t count;   // blocks to prefetch
+} ReadaheadRequest;
+
+/**
+ * @brief Prefetch callback, run by the readahead thread
+ *
+ * @param arg     -> argument given to readahead_init
+ * @param request -> blocks to read into the cache
+ * @return int    -> blocks inserted in the cache, negative on error
+ */
+typedef int (*readahead_fn)(void *arg, const ReadaheadRequest *request);
+
+typedef struct {
+  size_t requests;  // requests queued
+  size_t dropped;   // requests dropped on a full queue
+  size_t cancelled; // queued requests cancelled by a close
+  size_t failed;    // requests whose callback returned an error
+  size_t blocks;    // blocks inserted in the cache
+} ReadaheadStats;
+
+typedef struct {
+  ReadaheadRequest queue[READAHEAD_QUEUE_SIZE]; // ring of pending requests
+  size_t head;                                  // next request to run
+  size_t len;                                   // pending requests
+
+  int active_fd;         // fd of the running request, -1 if none
+  readahead_fn prefetch; // prefetch callback
+  void *arg;             // prefetch callback argument
+  ReadaheadStats stats;  // progress metrics
+  int stopping;          // set by destroy, worker exits
+  pthread_t worker;      // readahead thread
+  pthread_mutex_t mutex; // protects all the fields above
+  pthread_cond_t work;   // signalled when a request is queued or on stop
+  pthread_cond_t done;   // signalled when a request finished
+} Readahead;
+
+/**
+ * @brief Start the readahead thread
+ *
+ * @param prefetch -> prefetch callback
+ * @param arg      -> argument of the callback
+ * @return Readahead* -> readahead, or NULL on error
+ */
+Readahead *readahead_init(readahead_fn prefetch, void *arg);
+
+/**
+ * @brief Stop the thread, pending requests are dropped
+ *
+ * @param readahead -> readahead (may be NULL)
+ */
+void readahead_destroy(Readahead *readahead);
+
+/**
+ * @brief Queue a prefetch, never blocks
+ *
+ * @param readahead -> readahead
+ * @param request   -> blocks to prefetch
+ * @return int      -> 0 if queued, -1 if the queue is full
+ */
+int readahead_submit(Readahead *readahead, const ReadaheadRequest *request);
+
+/**
+ * @brief Drop the queued requests of an fd and wait for its running one
+ *
+ * Called before the fd is closed, so that no prefetch uses it afterwards.
+ *
+ * @param readahead -> readahead
+ * @param fd        -> fd being closed
+ */
+void readahead_cancel(Readahead *readahead, int fd);
+
+/**
+ * @brief Snapshot of the progress metrics
+ *
+ * @param readahead -> readahead (NULL: all zero)
+ * @param stats     -> output
+ */
+void readahead_get_stats(Readahead *readahead, ReadaheadStats *stats);
+
+#endif // __READAHEAD_H__
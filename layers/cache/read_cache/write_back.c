@@ -0,0 +1,305 @@
+#include "write_back.h"
+
+#include "../../../logdef.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int64_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Wait on the work condition until a monotonic deadline (mutex held)
+ */
+static void wait_until(WriteBack *write_back, int64_t deadline_ms) {
+  struct timespec deadline = {.tv_sec = deadline_ms / 1000,
+                              .tv_nsec = (deadline_ms % 1000) * 1000000};
+  pthread_cond_timedwait(&write_back->work, &write_back->mutex, &deadline);
+}
+
+/**
+ * @brief Unlink a block from the table and the flush order, and free it
+ * (mutex held)
+ */
+static void remove_block(WriteBack *write_back, DirtyBlock *block) {
+  HASH_DEL(write_back->table, block);
+  if (block->prev) {
+    block->prev->next = block->next;
+  } else {
+    write_back->head = block->next;
+  }
+  if (block->next) {
+    block->next->prev = block->prev;
+  } else {
+    write_back->tail = block->prev;
+  }
+  write_back->count--;
+  write_back->stats.dirty = write_back->count;
+  memory_budget_release(write_back->memory,
+                        sizeof(DirtyBlock) + write_back->block_size);
+  free(block);
+}
+
+/**
+ * @brief Write a dirty block and drop it once written (mutex held)
+ *
+ * @return int -> 0 on success, -1 if the write failed (the block stays dirty)
+ */
+static int write_block(WriteBack *write_back, DirtyBlock *block) {
+  off_t offset = (off_t)(block->key.block * write_back->block_size);
+  ssize_t res = write_back->write(write_back->arg, block->fd, block->data,
+                                  write_back->block_size, offset);
+  if (res != (ssize_t)write_back->block_size) {
+    write_back->stats.failed++;
+    ERROR_MSG("[READ_CACHE: WRITE_BACK] Failed to write block %lu of inode "
+              "%lu",
+              (unsigned long)block->key.block,
+              (unsigned long)block->key.inode);
+    if (res >= 0) {
+      errno = EIO;
+    }
+    return -1;
+  }
+  write_back->stats.written++;
+  remove_block(write_back, block);
+  return 0;
+}
+
+/**
+ * @brief Flusher thread: writes the blocks dirty for longer than expire_ms
+ */
+static void *write_back_worker(void *arg) {
+  WriteBack *write_back = arg;
+
+  pthread_mutex_lock(&write_back->mutex);
+  while (!write_back->stopping) {
+    if (!write_back->head) {
+      pthread_cond_wait(&write_back->work, &write_back->mutex);
+      continue;
+    }
+    int64_t expires_ms = write_back->head->dirtied_ms + write_back->expire_ms;
+    if (now_ms() < expires_ms) {
+      wait_until(write_back, expires_ms);
+      continue;
+    }
+    DirtyBlock *block = write_back->head;
+    if (write_block(write_back, block) == 0) {
+      write_back->stats.expired++;
+    } else {
+      // retried once it expires again, behind the other blocks
+      block->dirtied_ms = now_ms();
+      if (block->next) {
+        write_back->head = block->next;
+        write_back->head->prev = NULL;
+        block->prev = write_back->tail;
+        block->next = NULL;
+        write_back->tail->next = block;
+        write_back->tail = block;
+      }
+    }
+  }
+  pthread_mutex_unlock(&write_back->mutex);
+  return NULL;
+}
+
+WriteBack *write_back_init(write_back_fn write, void *arg, size_t block_size,
+                           size_t max_blocks, long expire_ms) {
+  if (!write || block_size == 0 || max_blocks == 0 || expire_ms <= 0) {
+    return NULL;
+  }
+  WriteBack *write_back = calloc(1, sizeof(WriteBack));
+  if (!write_back) {
+    return NULL;
+  }
+  write_back->write = write;
+  write_back->arg = arg;
+  write_back->block_size = block_size;
+  write_back->max_blocks = max_blocks;
+  write_back->expire_ms = expire_ms;
+  write_back->memory = memory_budget_account("read_cache");
+
+  pthread_condattr_t attr;
+  if (pthread_mutex_init(&write_back->mutex, NULL) != 0) {
+    free(write_back);
+    return NULL;
+  }
+  if (pthread_condattr_init(&attr) != 0 ||
+      pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0 ||
+      pthread_cond_init(&write_back->work, &attr) != 0) {
+    pthread_mutex_destroy(&write_back->mutex);
+    free(write_back);
+    return NULL;
+  }
+  pthread_condattr_destroy(&attr);
+  if (pthread_create(&write_back->worker, NULL, write_back_worker,
+                     write_back) != 0) {
+    ERROR_MSG("[READ_CACHE: WRITE_BACK] Failed to start the flusher thread");
+    pthread_cond_destroy(&write_back->work);
+    pthread_mutex_destroy(&write_back->mutex);
+    free(write_back);
+    return NULL;
+  }
+  return write_back;
+}
+
+void write_back_destroy(WriteBack *write_back) {
+  if (!write_back) {
+    return;
+  }
+  pthread_mutex_lock(&write_back->mutex);
+  write_back->stopping = 1;
+  pthread_cond_broadcast(&write_back->work);
+  pthread_mutex_unlock(&write_back->mutex);
+  pthread_join(write_back->worker, NULL);
+
+  // blocks left by fds never closed, their fds are still open below
+  while (write_back->head) {
+    DirtyBlock *block = write_back->head;
+    if (write_block(write_back, block) != 0) {
+      remove_block(write_back, block);
+    }
+  }
+  pthread_cond_destroy(&write_back->work);
+  pthread_mutex_destroy(&write_back->mutex);
+  free(write_back);
+}
+
+int write_back_absorb(WriteBack *write_back, int fd, const CacheKey *key,
+                      const void *data) {
+  pthread_mutex_lock(&write_back->mutex);
+  DirtyBlock *block = NULL;
+  HASH_FIND(hh, write_back->table, key, sizeof(CacheKey), block);
+  if (block) {
+    // keeps its place in the flush order
+    memcpy(block->data, data, write_back->block_size);
+    block->fd = fd;
+    write_back->stats.rewritten++;
+    pthread_mutex_unlock(&write_back->mutex);
+    return 0;
+  }
+
+  // make room by writing the oldest block
+  const size_t bytes = sizeof(DirtyBlock) + write_back->block_size;
+  int charged = memory_budget_try_charge(write_back->memory, bytes) == 0;
+  if (write_back->count >= write_back->max_blocks ||
+      (!charged && write_back->head)) {
+    if (write_block(write_back, write_back->head) != 0) {
+      if (charged) {
+        memory_budget_release(write_back->memory, bytes);
+      }
+      pthread_mutex_unlock(&write_back->mutex);
+      return -1;
+    }
+    write_back->stats.forced++;
+    if (!charged) {
+      charged = memory_budget_try_charge(write_back->memory, bytes) == 0;
+    }
+  }
+
+  // no budget left for a dirty block: the write is not absorbed
+  if (!charged) {
+    off_t offset = (off_t)(key->block * write_back->block_size);
+    ssize_t res = write_back->write(write_back->arg, fd, data,
+                                    write_back->block_size, offset);
+    write_back->stats.throttled++;
+    pthread_mutex_unlock(&write_back->mutex);
+    if (res != (ssize_t)write_back->block_size) {
+      if (res >= 0) {
+        errno = EIO;
+      }
+      return -1;
+    }
+    return 0;
+  }
+
+  block = malloc(bytes);
+  if (!block) {
+    memory_budget_release(write_back->memory, bytes);
+    pthread_mutex_unlock(&write_back->mutex);
+    errno = ENOMEM;
+    return -1;
+  }
+  block->key = *key;
+  block->fd = fd;
+  block->dirtied_ms = now_ms();
+  memcpy(block->data, data, write_back->block_size);
+  block->next = NULL;
+  block->prev = write_back->tail;
+  if (write_back->tail) {
+    write_back->tail->next = block;
+  } else {
+    write_back->head = block;
+    pthread_cond_signal(&write_back->work);
+  }
+  write_back->tail = block;
+  HASH_ADD(hh, write_back->table, key, sizeof(CacheKey), block);
+  write_back->count++;
+  write_back->stats.dirty = write_back->count;
+  write_back->stats.absorbed++;
+  pthread_mutex_unlock(&write_back->mutex);
+  return 0;
+}
+
+int write_back_flush(WriteBack *write_back, const CacheKey *key,
+                     uint64_t first, uint64_t last, int fd) {
+  int written = 0;
+  int failed = 0;
+  pthread_mutex_lock(&write_back->mutex);
+  DirtyBlock *block = write_back->head;
+  while (block) {
+    DirtyBlock *next = block->next;
+    if (block->key.dev == key->dev && block->key.inode == key->inode &&
+        block->key.block >= first && block->key.block <= last &&
+        (fd == -1 || block->fd == fd)) {
+      if (write_block(write_back, block) == 0) {
+        written++;
+      } else {
+        failed = 1;
+      }
+    }
+    block = next;
+  }
+  pthread_mutex_unlock(&write_back->mutex);
+  return failed ? -1 : written;
+}
+
+size_t write_back_discard(WriteBack *write_back, int fd) {
+  size_t dropped = 0;
+  pthread_mutex_lock(&write_back->mutex);
+  DirtyBlock *block = write_back->head;
+  while (block) {
+    DirtyBlock *next = block->next;
+    if (block->fd == fd) {
+      remove_block(write_back, block);
+      dropped++;
+    }
+    block = next;
+  }
+  pthread_mutex_unlock(&write_back->mutex);
+  return dropped;
+}
+
+int write_back_is_dirty(WriteBack *write_back, const CacheKey *key) {
+  DirtyBlock *block = NULL;
+  pthread_mutex_lock(&write_back->mutex);
+  HASH_FIND(hh, write_back->table, key, sizeof(CacheKey), block);
+  pthread_mutex_unlock(&write_back->mutex);
+  return block != NULL;
+}
+
+void write_back_get_stats(WriteBack *write_back, WriteBackStats *stats) {
+  if (!stats) {
+    return;
+  }
+  if (!write_back) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  pthread_mutex_lock(&write_back->mutex);
+  *stats = write_back->stats;
+  pthread_mutex_unlock(&write_back->mutex);
+}
@@ -0,0 +1,158 @@
+#ifndef __WRITE_BACK_H__
+#define __WRITE_BACK_H__
+
+#include "../../../lib/uthash/src/uthash.h"
+#include "../../../shared/utils/memory_budget.h"
+#include "cache_key.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * ============================================================================
+ * WRITE BACK - DIRTY BLOCKS OF THE READ CACHE IN WRITE_BACK MODE
+ * ============================================================================
+ *
+ * pwrites of whole blocks are absorbed in dirty blocks instead of going to
+ * the next layer, and written to it later, in the order the blocks were first
+ * dirtied.
+ *
+ * - The dirty blocks live out of CacheLib, which could evict them, and are
+ *   bounded: absorbing a block when max_blocks are dirty writes the oldest
+ *   one first. They are also charged to the "read_cache" memory account:
+ *   when it has no room, the oldest block is written to make some, and a
+ *   block that still doesn't fit is written through at once.
+ * - A thread writes the blocks dirty for longer than expire_ms.
+ * - The layer writes the dirty blocks of a file before any operation that
+ *   reads it below the cache (cache misses, stats, truncates, fsync,
+ *   unlink), and those written through an fd before closing it.
+ * - A block is written with the fd that dirtied it last, which is open: its
+ *   close writes the block first.
+ * ============================================================================
+ */
+
+/**
+ * @brief Write callback, writes a dirty block to the next layer
+ *
+ * @param arg    -> argument given to write_back_init
+ * @param fd     -> fd that dirtied the block
+ * @param data   -> content of the block
+ * @param len    -> bytes of the block
+ * @param offset -> offset of the block in the file
+ * @return ssize_t -> bytes written, -1 on error
+ */
+typedef ssize_t (*write_back_fn)(void *arg, int fd, const void *data,
+                                 size_t len, off_t offset);
+
+typedef struct DirtyBlock {
+  CacheKey key;            // key: file and block index
+  int fd;                  // fd of the last write of the block
+  int64_t dirtied_ms;      // monotonic time the block was first dirtied
+  struct DirtyBlock *prev; // previous block in flush order
+  struct DirtyBlock *next; // next block in flush order
+  UT_hash_handle hh;
+  char data[];             // block_size bytes
+} DirtyBlock;
+
+typedef struct {
+  size_t dirty;     // blocks currently dirty
+  size_t absorbed;  // pwrites of blocks that were clean
+  size_t rewritten; // pwrites of blocks that were already dirty
+  size_t written;   // dirty blocks written to the next layer
+  size_t forced;    // blocks written early because max_blocks were dirty
+                    // or the memory budget had no room
+  size_t throttled; // blocks written through for lack of memory budget
+  size_t expired;   // blocks written by the thread after expire_ms
+  size_t failed;    // failed writes
+} WriteBackStats;
+
+typedef struct WriteBack {
+  DirtyBlock *table;     // dirty blocks by key
+  DirtyBlock *head;      // oldest dirty block
+  DirtyBlock *tail;      // newest dirty block
+  size_t count;          // dirty blocks
+  size_t max_blocks;     // dirty blocks at most
+  size_t block_size;     // bytes per block
+  long expire_ms;        // time a block stays dirty at most
+  write_back_fn write;   // write callback
+  void *arg;             // write callback argument
+  WriteBackStats stats;  // progress metrics
+  MemoryAccount *memory; // account charged for the blocks
+  int stopping;          // set by destroy, worker exits
+  pthread_t worker;      // flusher thread
+  pthread_mutex_t mutex; // protects all the fields above, held during writes
+  pthread_cond_t work;   // signalled when a block is dirtied or on stop
+} WriteBack;
+
+/**
+ * @brief Create the dirty block table and start its flusher thread
+ *
+ * @param write      -> write callback
+ * @param arg        -> argument of the callback
+ * @param block_size -> bytes per block
+ * @param max_blocks -> dirty blocks at most (> 0)
+ * @param expire_ms  -> time a block stays dirty at most (> 0)
+ * @return WriteBack* -> table, or NULL on error
+ */
+WriteBack *write_back_init(write_back_fn write, void *arg, size_t block_size,
+                           size_t max_blocks, long expire_ms);
+
+/**
+ * @brief Write all the dirty blocks, then stop the thread and free the table
+ *
+ * @param write_back -> table (may be NULL)
+ */
+void write_back_destroy(WriteBack *write_back);
+
+/**
+ * @brief Dirty a whole block with new content
+ *
+ * @param write_back -> table
+ * @param fd         -> fd of the write
+ * @param key        -> block
+ * @param data       -> block_size bytes
+ * @return int       -> 0 on success, -1 on error (errno set)
+ */
+int write_back_absorb(WriteBack *write_back, int fd, const CacheKey *key,
+                      const void *data);
+
+/**
+ * @brief Write dirty blocks of a file, in flush order
+ *
+ * @param write_back -> table
+ * @param key        -> file (only dev and inode are used)
+ * @param first      -> first block to write
+ * @param last       -> last block to write
+ * @param fd         -> only write the blocks dirtied by this fd, -1 for all
+ * @return int       -> blocks written, -1 if a write failed (the blocks
+ * that could not be written stay dirty)
+ */
+int write_back_flush(WriteBack *write_back, const CacheKey *key,
+                     uint64_t first, uint64_t last, int fd);
+
+/**
+ * @brief Drop the dirty blocks of an fd without writing them
+ *
+ * @param write_back -> table
+ * @param fd         -> fd whose blocks are dropped
+ * @return size_t    -> blocks dropped
+ */
+size_t write_back_discard(WriteBack *write_back, int fd);
+
+/**
+ * @brief Check if a block is dirty
+ *
+ * @return int -> 1 if dirty, 0 otherwise
+ */
+int write_back_is_dirty(WriteBack *write_back, const CacheKey *key);
+
+/**
+ * @brief Snapshot of the progress metrics
+ *
+ * @param write_back -> table (NULL: all zero)
+ * @param stats      -> output
+ */
+void write_back_get_stats(WriteBack *write_back, WriteBackStats *stats);
+
+#endif // __WRITE_BACK_H__
@@ -1,10 +1,14 @@
 #include "cache_lib_wrapper.h"
+#include <algorithm>
 #include <cmath>
 #include <cstddef>
 #include <event.h>
 #include <event2/event.h>
 #include <iostream>
 #include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
 #include <stddef.h>
 
 #include <cstdio>
@@ -13,25 +17,126 @@
 #include <dlfcn.h>
 #include <unistd.h>
 
-using Cache = facebook::cachelib::LruAllocator;
+using facebook::cachelib::Lru2QAllocator;
+using facebook::cachelib::LruAllocator;
 using facebook::cachelib::PoolId;
-using RemoveRes = facebook::cachelib::LruAllocator::RemoveRes;
+using facebook::cachelib::TinyLFUAllocator;
 
 size_t BLOCK_SIZE = 0;
 
+// navy's I/O unit and the size of the regions it evicts at once
+constexpr uint32_t NVM_BLOCK_SIZE = 4096;
+constexpr uint32_t NVM_REGION_SIZE = 16 * 1024 * 1024;
+
+// keys are binary and may hold NUL bytes, so their length is always explicit
+template <typename CacheT>
+static typename CacheT::Key to_key(const void *key, size_t key_length) {
+  return typename CacheT::Key(static_cast<const char *>(key), key_length);
+}
+
+/**
+ * @brief Runs f with the cache of the wrapper's eviction policy
+ *
+ * The allocators only differ by their eviction policy, so every operation is
+ * written once, as a generic lambda.
+ */
+template <typename F> static auto with_cache(CacheWrapper *wrapper, F &&f) {
+  switch (wrapper->eviction) {
+  case CACHE_EVICTION_2Q:
+    return f(*wrapper->lru2q);
+  case CACHE_EVICTION_TINYLFU:
+    return f(*wrapper->tinylfu);
+  default:
+    return f(*wrapper->lru);
+  }
+}
+
+// handles of the hits of a get_items call, whatever their cache type
+struct PinnedItems {
+  virtual ~PinnedItems() = default;
+};
+
+template <typename CacheT> struct PinnedHandles : PinnedItems {
+  std::vector<typename CacheT::ReadHandle> handles;
+};
+
+static std::string pool_name(size_t index) {
+  return index == 0 ? "default" : "pool" + std::to_string(index);
+}
+
+/**
+ * @brief Attaches to the saved cache, or creates a new one, and its pools
+ */
+template <typename CacheT>
+static std::unique_ptr<CacheT>
+create_cache(size_t cache_size, size_t num_items_access, char *name,
+             const CacheOptions *options, std::vector<PoolId> &pools) {
+  typename CacheT::Config config;
+  config.setCacheSize(cache_size)
+      .setCacheName(name)
+      .setAccessConfig(num_items_access);
+
+  // the NVM tier holds what DRAM evicts, so the working set may exceed it
+  if (options->nvm_path) {
+    typename CacheT::NvmCacheConfig nvm_config;
+    nvm_config.navyConfig.setBlockSize(NVM_BLOCK_SIZE);
+    // a persistent cache keeps the content of the file across restarts
+    nvm_config.navyConfig.setSimpleFile(options->nvm_path, options->nvm_size,
+                                        /*truncateFile=*/!options->persist_dir);
+    nvm_config.navyConfig.blockCache().setRegionSize(NVM_REGION_SIZE);
+    config.enableNvmCache(nvm_config);
+  }
+  if (options->persist_dir)
+    config.enableCachePersistence(options->persist_dir);
+  config.validate();
+
+  std::unique_ptr<CacheT> cache;
+  if (options->persist_dir) {
+    // warm restart: attach to the cache the last destroy_cache saved, which
+    // must have the same pools
+    try {
+      cache = std::make_unique<CacheT>(CacheT::SharedMemAttach, config);
+      if (cache->getPoolIds().size() != options->num_pools)
+        throw std::invalid_argument("the saved cache has other pools");
+      for (size_t i = 0; i < options->num_pools; i++)
+        pools.push_back(cache->getPoolId(pool_name(i)));
+      std::cout << "[CACHELIB_WRAPPER] Attached to the cache saved in "
+                << options->persist_dir << "\n";
+      return cache;
+    } catch (const std::exception &e) {
+      std::cout << "[CACHELIB_WRAPPER] No cache to attach in "
+                << options->persist_dir << ", starting empty: " << e.what()
+                << "\n";
+      pools.clear();
+      cache.reset();
+    }
+    cache = std::make_unique<CacheT>(CacheT::SharedMemNew, config);
+  } else {
+    cache = std::make_unique<CacheT>(config);
+  }
+
+  size_t pool_size =
+      cache->getCacheMemoryStats().ramCacheSize / options->num_pools;
+  for (size_t i = 0; i < options->num_pools; i++)
+    pools.push_back(cache->addPool(pool_name(i), pool_size));
+  return cache;
+}
+
 extern "C" void *initialize_cache(size_t num_blocks, size_t block_size,
-                                  char *name) {
+                                  char *name, const CacheOptions *options) {
 
   BLOCK_SIZE = block_size;
+  size_t num_pools = options->num_pools > 0 ? options->num_pools : 1;
 
-  // 128 -> average path length for the key
+  // 32 -> binary block key of the read cache
   // block_size*1.5 -> item header overhead and padding precaution
-  size_t item_size =
-      sizeof(Cache::Item) + 128 + sizeof(size_t) + block_size + block_size / 2;
-  // CacheLib needs to be able to allocate at least one slab
+  size_t item_size = sizeof(LruAllocator::Item) + 32 + sizeof(size_t) +
+                     block_size + block_size / 2;
+  // CacheLib needs to be able to allocate at least one slab per pool
   // here we're multiplying by 8.1 because of integer division rounding when
   // dividing by item_size
-  size_t min_num_items = (static_cast<size_t>(1024 * 1024 * 8.1)) / item_size;
+  size_t min_num_items =
+      num_pools * (static_cast<size_t>(1024 * 1024 * 8.1)) / item_size;
   size_t final_num_items_allocation =
       (num_blocks < min_num_items) ? min_num_items : num_blocks;
 
@@ -39,118 +144,188 @@ extern "C" void *initialize_cache(size_t num_blocks, size_t block_size,
   // smaller 321...
   size_t final_num_items_access =
       (final_num_items_allocation < 321) ? 321 : final_num_items_allocation;
-  try {
-    Cache::Config config;
-    size_t cache_size = item_size * final_num_items_allocation;
-    config.setCacheSize(cache_size)
-        .setCacheName(name)
-        .setAccessConfig(final_num_items_access)
-        .validate();
-
-    CacheWrapper *wrapper = new CacheWrapper;
-    wrapper->cache = std::make_unique<Cache>(config);
-
-    wrapper->defaultPool = wrapper->cache->addPool(
-        "default", wrapper->cache->getCacheMemoryStats().ramCacheSize);
+  size_t cache_size = item_size * final_num_items_allocation;
 
+  CacheOptions pooled = *options;
+  pooled.num_pools = num_pools;
+  CacheWrapper *wrapper = new CacheWrapper;
+  wrapper->eviction = options->eviction;
+  wrapper->persistent = options->persist_dir != nullptr;
+  try {
+    switch (options->eviction) {
+    case CACHE_EVICTION_2Q:
+      wrapper->lru2q = create_cache<Lru2QAllocator>(
+          cache_size, final_num_items_access, name, &pooled, wrapper->pools);
+      break;
+    case CACHE_EVICTION_TINYLFU:
+      wrapper->tinylfu = create_cache<TinyLFUAllocator>(
+          cache_size, final_num_items_access, name, &pooled, wrapper->pools);
+      break;
+    default:
+      wrapper->eviction = CACHE_EVICTION_LRU;
+      wrapper->lru = create_cache<LruAllocator>(
+          cache_size, final_num_items_access, name, &pooled, wrapper->pools);
+      break;
+    }
     return static_cast<void *>(wrapper);
   } catch (const std::exception &e) {
     std::cout << "[CACHELIB_WRAPPER] Invalid config: " << e.what() << "\n";
+    delete wrapper;
     return nullptr;
   }
 }
 
-extern "C" int insert_item(void *cache_wrapper, const char *key,
-                           const void *block, size_t block_length) {
+extern "C" int insert_item(void *cache_wrapper, int pool, const void *key,
+                           size_t key_length, const void *block,
+                           size_t block_length) {
   CacheWrapper *wrapper = static_cast<CacheWrapper *>(cache_wrapper);
-  auto pool = wrapper->defaultPool;
+  PoolId pool_id = (pool < 0 || static_cast<size_t>(pool) >=
+                                    wrapper->pools.size())
+                       ? wrapper->pools[0]
+                       : wrapper->pools[pool];
 
-  // size_t item_size = sizeof(size_t) + block_length;
+  // the length prefix and the content, items smaller than a block (such as
+  // the read cache's file versions) still take a block
+  size_t item_size = sizeof(size_t) + std::max(BLOCK_SIZE, block_length);
 
-  try {
-    // first, check if there's an already allocated handle
-    auto write_handle = wrapper->cache->findToWrite(key);
-    bool new_item = false;
-
-    // if it doesn't already exist, allocate it
-    if (!write_handle) {
-      write_handle = wrapper->cache->allocate(pool, key, BLOCK_SIZE);
-      new_item = true;
-    }
+  return with_cache(wrapper, [&](auto &cache) {
+    using CacheT = std::remove_reference_t<decltype(cache)>;
+    try {
+      // first, check if there's an already allocated handle
+      auto write_handle = cache.findToWrite(to_key<CacheT>(key, key_length));
+      bool new_item = false;
 
-    if (!write_handle) {
-      std::cout
-          << "[CACHELIB_WRAPPER] Failed to allocate memory for a WriteHandle\n";
-      return -1;
-    }
+      // if it doesn't already exist, or is too small, allocate it
+      if (!write_handle || write_handle->getSize() < item_size) {
+        write_handle =
+            cache.allocate(pool_id, to_key<CacheT>(key, key_length), item_size);
+        new_item = true;
+      }
 
-    std::byte *memory_to_write =
-        static_cast<std::byte *>(write_handle->getMemory());
-    std::memcpy(memory_to_write, &block_length, sizeof(size_t));
-    // even though we allocate BLOCK_SIZE, it's only necessary to copy
-    // block_length bytes, since the rest is just trash
-    std::memcpy(memory_to_write + sizeof(size_t), block, block_length);
+      if (!write_handle) {
+        std::cout << "[CACHELIB_WRAPPER] Failed to allocate memory for a "
+                     "WriteHandle\n";
+        return -1;
+      }
 
-    // only insert if we the item is completely new (i.e., allocate was called)
-    // if we got the handle through findToWrite, there's no need to insert it
-    // again
-    if (new_item)
-      wrapper->cache->insert(write_handle);
+      std::byte *memory_to_write =
+          static_cast<std::byte *>(write_handle->getMemory());
+      std::memcpy(memory_to_write, &block_length, sizeof(size_t));
+      // even though we allocate BLOCK_SIZE, it's only necessary to copy
+      // block_length bytes, since the rest is just trash
+      std::memcpy(memory_to_write + sizeof(size_t), block, block_length);
 
-    return 0;
+      // only insert if we the item is completely new (i.e., allocate was
+      // called) if we got the handle through findToWrite, there's no need to
+      // insert it again
+      if (new_item)
+        cache.insertOrReplace(write_handle);
 
-  } catch (const std::exception &e) {
-    std::cout << "[CACHELIB_WRAPPER] insert exception: " << e.what() << "\n";
-    return -1;
-  }
+      return 0;
+
+    } catch (const std::exception &e) {
+      std::cout << "[CACHELIB_WRAPPER] insert exception: " << e.what()
+                << "\n";
+      return -1;
+    }
+  });
 }
 
-extern "C" void get_item(void *cache_wrapper, const char *key,
-                         CacheEntry *item) {
+extern "C" void *get_items(void *cache_wrapper, const void *keys,
+                          size_t key_length, size_t count, CacheEntry *items) {
   auto *wrapper = static_cast<CacheWrapper *>(cache_wrapper);
 
-  auto find_handle = wrapper->cache->find(key);
-  if (find_handle) {
-    const std::byte *memory_to_read =
-        static_cast<const std::byte *>(find_handle->getMemory());
-    std::memcpy(&item->size, memory_to_read, sizeof(size_t));
-    const std::byte *temp = memory_to_read + sizeof(size_t);
-    item->block = static_cast<const void *>(temp);
-  } else
-    item->block = nullptr;
+  return with_cache(wrapper, [&](auto &cache) {
+    using CacheT = std::remove_reference_t<decltype(cache)>;
+    const char *key = static_cast<const char *>(keys);
+
+    // the handles of the hits pin them until release_items
+    PinnedHandles<CacheT> *pinned = nullptr;
+    for (size_t i = 0; i < count; i++, key += key_length) {
+      items[i].block = nullptr;
+      try {
+        auto find_handle = cache.find(to_key<CacheT>(key, key_length));
+        if (!find_handle)
+          continue;
+        if (!pinned) {
+          pinned = new PinnedHandles<CacheT>;
+          pinned->handles.reserve(count - i);
+        }
+        const std::byte *memory_to_read =
+            static_cast<const std::byte *>(find_handle->getMemory());
+        std::memcpy(&items[i].size, memory_to_read, sizeof(size_t));
+        items[i].block =
+            static_cast<const void *>(memory_to_read + sizeof(size_t));
+        pinned->handles.push_back(std::move(find_handle));
+      } catch (const std::exception &e) {
+        // a failed lookup is a miss
+        items[i].block = nullptr;
+        std::cout << "[CACHELIB_WRAPPER] lookup exception: " << e.what()
+                  << "\n";
+      }
+    }
+    return static_cast<void *>(static_cast<PinnedItems *>(pinned));
+  });
+}
+
+extern "C" void release_items(void *pinned) {
+  delete static_cast<PinnedItems *>(pinned);
 }
 
-extern "C" int contain_item(void *cache_wrapper, const char *key) {
+extern "C" int contain_item(void *cache_wrapper, const void *key,
+                            size_t key_length) {
   auto *wrapper = static_cast<CacheWrapper *>(cache_wrapper);
 
-  auto find_handle = wrapper->cache->find(key);
-  if (find_handle) {
-    return 1;
-  } else {
-    return 0;
-  }
+  return with_cache(wrapper, [&](auto &cache) {
+    using CacheT = std::remove_reference_t<decltype(cache)>;
+    auto find_handle = cache.find(to_key<CacheT>(key, key_length));
+    if (find_handle) {
+      return 1;
+    } else {
+      return 0;
+    }
+  });
 }
 
-extern "C" int remove_item(void *cache_wrapper, const char *key) {
+extern "C" int remove_item(void *cache_wrapper, const void *key,
+                           size_t key_length) {
   auto *wrapper = static_cast<CacheWrapper *>(cache_wrapper);
 
-  auto removed = wrapper->cache->remove(key);
-  if (removed != RemoveRes::kSuccess)
-    return -1;
-  else
-    return 0;
+  return with_cache(wrapper, [&](auto &cache) {
+    using CacheT = std::remove_reference_t<decltype(cache)>;
+    auto removed = cache.remove(to_key<CacheT>(key, key_length));
+    if (removed != CacheT::RemoveRes::kSuccess)
+      return -1;
+    else
+      return 0;
+  });
 }
 
 extern "C" unsigned long get_item_count(void *cache_wrapper) {
 
   auto *wrapper = static_cast<CacheWrapper *>(cache_wrapper);
 
-  return wrapper->cache->getPoolStats(wrapper->defaultPool).numItems();
+  return with_cache(wrapper, [&](auto &cache) {
+    unsigned long count = 0;
+    for (PoolId pool : wrapper->pools)
+      count += cache.getPoolStats(pool).numItems();
+    return count;
+  });
 }
 
 extern "C" void destroy_cache(void *cache_wrapper) {
 
   auto *wrapper = static_cast<CacheWrapper *>(cache_wrapper);
-  wrapper->cache.reset();
+  if (wrapper->persistent) {
+    with_cache(wrapper, [&](auto &cache) {
+      auto status = cache.shutDown();
+      if (status != decltype(status)::kSuccess)
+        std::cout << "[CACHELIB_WRAPPER] Failed to save the cache, the next "
+                     "start will be cold\n";
+    });
+  }
+  wrapper->lru.reset();
+  wrapper->lru2q.reset();
+  wrapper->tinylfu.reset();
   delete wrapper;
 }
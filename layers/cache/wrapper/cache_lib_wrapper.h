@@ -2,14 +2,32 @@
 #include "cachelib/allocator/CacheAllocator.h"
 #include <cstddef>
 #include <stddef.h>
+#include <vector>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// eviction policies, the allocator a cache is built with
+#define CACHE_EVICTION_LRU 0     // LruAllocator
+#define CACHE_EVICTION_2Q 1      // Lru2QAllocator, scans don't flush hot items
+#define CACHE_EVICTION_TINYLFU 2 // TinyLFUAllocator, admits by frequency
+
+struct CacheOptions {
+  const char *nvm_path;    // file or device of the NVM tier, NULL: DRAM only
+  size_t nvm_size;         // bytes of the NVM tier
+  const char *persist_dir; // directory of the saved cache, NULL: not saved
+  int eviction;            // CACHE_EVICTION_*
+  size_t num_pools;        // pools the memory is evenly split in (>= 1)
+};
+
 struct CacheWrapper {
-  std::unique_ptr<facebook::cachelib::LruAllocator> cache;
-  facebook::cachelib::PoolId defaultPool;
+  int eviction; // which one of the caches below is used
+  std::unique_ptr<facebook::cachelib::LruAllocator> lru;
+  std::unique_ptr<facebook::cachelib::Lru2QAllocator> lru2q;
+  std::unique_ptr<facebook::cachelib::TinyLFUAllocator> tinylfu;
+  std::vector<facebook::cachelib::PoolId> pools; // pool ids by index
+  bool persistent; // saved to its cache directory by destroy_cache
 };
 
 struct CacheEntry {
@@ -23,9 +41,20 @@ struct CacheEntry {
  * Calculates the necessary size to allocate, considering the minimum size
  * of a slab (minimum amount of memory CacheLib has to allocate).
  *
+ * Items are evicted by the allocator of options->eviction, from the pool they
+ * were inserted in: the memory is split evenly in options->num_pools pools,
+ * so that the items of one pool never evict those of another.
+ *
+ * With an nvm_path, items evicted from DRAM are kept in a hybrid NVM (navy)
+ * tier of nvm_size bytes in that file or device. With a persist_dir, the
+ * cache (DRAM in shared memory, and the NVM tier) is saved there by
+ * destroy_cache and attached again by the next initialization with the same
+ * parameters; a cache that can't be attached is created empty.
+ *
  * @param num_blocks Maximum number of blocks the cache will store
  * @param block_size Maximum size of each block
  * @param name Unique name for the cache
+ * @param options Eviction, pools, NVM tier and persistence
  *
  * @return Pointer to a CacheWrapper struct or Null in the case of a failed
  * initialization.
@@ -33,36 +62,56 @@ struct CacheEntry {
  * @warning Because of memory padding and metadata overhead, the calculated size
  * is an approximation.
  */
-void *initialize_cache(size_t num_blocks, size_t block_size, char *name);
+void *initialize_cache(size_t num_blocks, size_t block_size, char *name,
+                       const struct CacheOptions *options);
 
 /**
  * @brief Inserts an item in the cache.
  *
  * Performs an insertion in the cache, updating it according to the chosen
- * eviction policy on initialization.
+ * eviction policy on initialization. An item that is already cached stays in
+ * its pool.
  *
  * @param cache_wrapper Pointer to a CacheWrapper
- * @param key Block key
+ * @param pool Index of the pool of a new item (out of range: pool 0)
+ * @param key Block key, compared byte by byte
+ * @param key_length Length of the key
  * @param block Pointer to a block to copy the content from
  * @param block_length Length of the block to insert
  *
  * @return 0 if the item was inserted correctly and -1 if the operation failed.
  */
-int insert_item(void *cache_wrapper, const char *key, const void *block,
-                size_t block_length);
+int insert_item(void *cache_wrapper, int pool, const void *key,
+                size_t key_length, const void *block, size_t block_length);
 
 /**
- * @brief Checks the cache for an item.
+ * @brief Looks up a run of items and pins the hits.
  *
- * Checks if the cache has the block identified by its key.
- * In case of a hit, the provided CacheEntry is filled with the cached content.
- * Otherwise, item->size is set to -1.
+ * Checks the cache for every key. In the case of a hit, items[i] points to
+ * the cached content, which stays valid (it can't be evicted nor removed)
+ * until release_items is called with the returned handle. Otherwise,
+ * items[i].block is set to NULL.
  *
  * @param cache_wrapper Pointer to a CacheWrapper
- * @param key Block key
- * @param item Pointer to a CacheEntry to fill with the result
+ * @param keys count block keys, stored one after the other
+ * @param key_length Length of each key
+ * @param count Number of keys
+ * @param items Array of count CacheEntry to fill with the results
+ *
+ * @return Handle of the pinned items, to pass to release_items (NULL when
+ * nothing is pinned).
  */
-void get_item(void *cache_wrapper, const char *key, CacheEntry *item);
+void *get_items(void *cache_wrapper, const void *keys, size_t key_length,
+                size_t count, CacheEntry *items);
+
+/**
+ * @brief Unpins the items of a get_items call.
+ *
+ * The CacheEntry pointers it returned must not be used anymore.
+ *
+ * @param pinned Handle returned by get_items (may be NULL)
+ */
+void release_items(void *pinned);
 
 /**
  * @brief Checks if the key exists in the cache.
@@ -71,10 +120,11 @@ void get_item(void *cache_wrapper, const char *key, CacheEntry *item);
  *
  * @param cache_wrapper Pointer to a CacheWrapper
  * @param key Block key
+ * @param key_length Length of the key
  *
  * @return 1 in the case of a cache hit and 0 in the case of a cache miss.
  */
-int contain_item(void *cache_wrapper, const char *key);
+int contain_item(void *cache_wrapper, const void *key, size_t key_length);
 
 /* @brief Removes an item from the cache.
  *
@@ -82,25 +132,28 @@ int contain_item(void *cache_wrapper, const char *key);
  *
  * @param cache_wrapper Pointer to a CacheWrapper
  * @param key Block key
+ * @param key_length Length of the key
  *
  * @return 0 in the case that the item was removed and -1 in the case that the
  * item was not removed (either by not existing or internal error in finding
  * it).
  */
-int remove_item(void *cache_wrapper, const char *key);
+int remove_item(void *cache_wrapper, const void *key, size_t key_length);
 
 /**
  * @brief Returns the number of cached items a wrapper has.
  *
  * @param cache_wrapper Pointer to a CacheWrapper
  *
- * @return number of items in the pool.
+ * @return number of items in all the pools.
  */
 unsigned long get_item_count(void *cache_wrapper);
 
 /**
  * @brief Frees the memory used by a cache wrapper.
  *
+ * A persistent cache is shut down first, which saves it to its directory.
+ *
  * @param Pointer to a CacheWrapper
  */
 void destroy_cache(void *cache_wrapper);
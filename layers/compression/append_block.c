@@ -1 +1,354 @@
+#include "append_block.h"
+#include "../../logdef.h"
+#include "../../shared/utils/invalidation.h"
+#include "compression_utils.h"
+#include "seekable.h"
+#include <fcntl.h>
+#include <string.h>
 
+// Compress the staging block into its frame if it has unstored bytes
+static int store_staging(int fd, CompressedFileMapping *mapping,
+                         LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  if (!mapping->staging_valid || !mapping->staging_dirty) {
+    return 0;
+  }
+  off_t frame_start = (off_t)(mapping->staging_frame * state->block_size);
+  size_t len = (size_t)(mapping->logical_eof - frame_start);
+  if (seekable_store_frame(fd, mapping, mapping->staging_frame,
+                           mapping->staging, len, l) != 0) {
+    return -1;
+  }
+  mapping->staging_dirty = 0;
+  return 0;
+}
+
+// Store the staging block before a write or truncate that may change the
+// tail frame behind its back
+static int drop_staging(int fd, CompressedFileMapping *mapping,
+                        LayerContext l) {
+  if (store_staging(fd, mapping, l) != 0) {
+    return -1;
+  }
+  mapping->staging_valid = 0;
+  return 0;
+}
+
+static int append_frames(int fd, const char *path,
+                         CompressedFileMapping *mapping, const uint8_t *data,
+                         size_t nbyte, LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const size_t block_size = state->block_size;
+
+  while (nbyte > 0) {
+    size_t idx = (size_t)(mapping->logical_eof / (off_t)block_size);
+    size_t pos = (size_t)(mapping->logical_eof % (off_t)block_size);
+    if (seekable_reserve_frames(mapping, idx + 1) != 0) {
+      return -1;
+    }
+
+    // Whole blocks bypass the staging block
+    if (pos == 0 && nbyte >= block_size) {
+      if (seekable_store_frame(fd, mapping, idx, data, block_size, l) != 0) {
+        return -1;
+      }
+      mapping->staging_valid = 0;
+      mapping->logical_eof += (off_t)block_size;
+      data += block_size;
+      nbyte -= block_size;
+      continue;
+    }
+
+    if (!mapping->staging && !(mapping->staging = malloc(block_size))) {
+      return -1;
+    }
+    if (!mapping->staging_valid || mapping->staging_frame != idx) {
+      // Resume the partial tail frame stored by a previous flush
+      if (pos > 0 && seekable_decode_frame(fd, path, mapping, idx,
+                                           mapping->staging, l) != 0) {
+        return -1;
+      }
+      mapping->staging_frame = idx;
+      mapping->staging_valid = 1;
+      mapping->staging_dirty = 0;
+    }
+
+    size_t take = block_size - pos < nbyte ? block_size - pos : nbyte;
+    memcpy(mapping->staging + pos, data, take);
+    mapping->staging_dirty = 1;
+    mapping->logical_eof += (off_t)take;
+    data += take;
+    nbyte -= take;
+
+    if (pos + take == block_size) {
+      if (store_staging(fd, mapping, l) != 0) {
+        return -1;
+      }
+      mapping->staging_valid = 0;
+    }
+  }
+  layer_invalidate_attr(mapping->device, mapping->inode);
+  mapping->index_dirty = 1;
+  return 0;
+}
+
+ssize_t compression_append_block_pwrite(int fd, const void *buffer,
+                                        size_t nbyte, off_t offset,
+                                        LayerContext l) {
+  if (!validate_compression_fd_offset_and_nbyte(
+          fd, offset, nbyte, "COMPRESSION_LAYER: APPEND_BLOCK_PWRITE")) {
+    return INVALID_FD;
+  }
+
+  CompressionState *state = (CompressionState *)l.internal_state;
+  FdToInode *entry = fd_to_inode_lookup(state, fd);
+  if (!entry) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: APPEND_BLOCK_PWRITE] File descriptor not found",
+        NULL, NULL);
+    return INVALID_FD;
+  }
+  const char *path = entry->path;
+
+  if (locking_acquire_write(state->lock_table, path) != 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: APPEND_BLOCK_PWRITE] Failed to acquire write lock",
+        NULL, NULL);
+    return INVALID_FD;
+  }
+
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(entry->device, entry->inode, state);
+  if (!mapping || !mapping->index_loaded) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: APPEND_BLOCK_PWRITE] Missing seek table",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+
+  if (nbyte == 0) {
+    locking_release(state->lock_table, path);
+    return 0;
+  }
+
+  int res;
+  if (offset == mapping->logical_eof) {
+    res = append_frames(fd, path, mapping, buffer, nbyte, l);
+  } else {
+    DEBUG_MSG("[COMPRESSION_LAYER: APPEND_BLOCK_PWRITE] Overwrite at %ld, "
+              "logical EOF is %ld",
+              (long)offset, (long)mapping->logical_eof);
+    res = drop_staging(fd, mapping, l);
+    if (res == 0) {
+      res = seekable_write_frames(fd, path, mapping, buffer, nbyte, offset, l);
+    }
+  }
+  if (res != 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: APPEND_BLOCK_PWRITE] Failed to write blocks",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+  locking_release(state->lock_table, path);
+  return (ssize_t)nbyte;
+}
+
+ssize_t compression_append_block_pread(int fd, void *buffer, size_t nbyte,
+                                       off_t offset, LayerContext l) {
+  if (!validate_compression_fd_offset_and_nbyte(
+          fd, offset, nbyte, "COMPRESSION_LAYER: APPEND_BLOCK_PREAD")) {
+    return INVALID_FD;
+  }
+
+  if (nbyte == 0) {
+    return 0;
+  }
+
+  CompressionState *state = (CompressionState *)l.internal_state;
+  FdToInode *entry = fd_to_inode_lookup(state, fd);
+  if (!entry) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: APPEND_BLOCK_PREAD] File descriptor not found",
+        NULL, NULL);
+    return INVALID_FD;
+  }
+  const char *path = entry->path;
+
+  if (locking_acquire_read(state->lock_table, path) != 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: APPEND_BLOCK_PREAD] Failed to acquire read lock",
+        NULL, NULL);
+    return INVALID_FD;
+  }
+
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(entry->device, entry->inode, state);
+  if (!mapping || !mapping->index_loaded) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: APPEND_BLOCK_PREAD] Missing seek table",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+
+  off_t logical_eof = mapping->logical_eof;
+  if (offset >= logical_eof) {
+    locking_release(state->lock_table, path);
+    return 0;
+  }
+  size_t bytes_to_read = nbyte;
+  if (offset + (off_t)nbyte > logical_eof) {
+    bytes_to_read = (size_t)(logical_eof - offset);
+  }
+  off_t end = offset + (off_t)bytes_to_read;
+
+  // The tail frame comes from the staging block, the rest from storage
+  off_t staged = end;
+  if (mapping->staging_valid) {
+    staged = (off_t)(mapping->staging_frame * state->block_size);
+  }
+  if (offset < staged) {
+    size_t stored = (size_t)((end < staged ? end : staged) - offset);
+    if (seekable_read_frames(fd, path, mapping, buffer, stored, offset, l) !=
+        0) {
+      error_msg_and_release_lock(
+          "[COMPRESSION_LAYER: APPEND_BLOCK_PREAD] Failed to decode blocks",
+          state->lock_table, path);
+      return INVALID_FD;
+    }
+  }
+  if (end > staged) {
+    off_t from = offset > staged ? offset : staged;
+    memcpy((uint8_t *)buffer + (from - offset),
+           mapping->staging + (from - staged), (size_t)(end - from));
+  }
+
+  locking_release(state->lock_table, path);
+  return (ssize_t)bytes_to_read;
+}
+
+int compression_append_block_ftruncate(int fd, off_t length, LayerContext l) {
+  if (length < 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: APPEND_BLOCK_FTRUNCATE] Invalid length");
+    return INVALID_FD;
+  }
+
+  CompressionState *state = (CompressionState *)l.internal_state;
+  FdToInode *entry = fd_to_inode_lookup(state, fd);
+  if (!entry) {
+    ERROR_MSG("[COMPRESSION_LAYER: APPEND_BLOCK_FTRUNCATE] File descriptor "
+              "%d not found",
+              fd);
+    return INVALID_FD;
+  }
+  const char *path = entry->path;
+
+  if (locking_acquire_write(state->lock_table, path) != 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: APPEND_BLOCK_FTRUNCATE] Failed to acquire "
+              "write lock on file %s",
+              path);
+    return INVALID_FD;
+  }
+
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(entry->device, entry->inode, state);
+  if (!mapping || !mapping->index_loaded) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: APPEND_BLOCK_FTRUNCATE] Missing seek table",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+
+  if (drop_staging(fd, mapping, l) != 0 ||
+      seekable_truncate_frames(fd, path, mapping, length, l) != 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: APPEND_BLOCK_FTRUNCATE] Failed to truncate "
+        "blocks",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+  locking_release(state->lock_table, path);
+  return 0;
+}
+
+int compression_append_block_truncate(const char *path, off_t length,
+                                      LayerContext l) {
+  if (!path || length < 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: APPEND_BLOCK_TRUNCATE] Invalid arguments");
+    return INVALID_FD;
+  }
+
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const LayerContext *next = l.next_layers;
+  if (locking_acquire_write(state->lock_table, path) != 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: APPEND_BLOCK_TRUNCATE] Failed to acquire "
+              "write lock on file %s",
+              path);
+    return INVALID_FD;
+  }
+
+  struct stat stbuf;
+  if (next->ops->llstat(path, &stbuf, *next) != 0 ||
+      seekable_load_index(path, stbuf.st_dev, stbuf.st_ino, l) != 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: APPEND_BLOCK_TRUNCATE] Failed to load seek table",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+
+  int fd = next->ops->lopen(path, O_RDWR, 0, *next);
+  if (fd < 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: APPEND_BLOCK_TRUNCATE] Failed to open file",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(stbuf.st_dev, stbuf.st_ino, state);
+  int res = drop_staging(fd, mapping, l);
+  if (res == 0) {
+    res = seekable_truncate_frames(fd, path, mapping, length, l);
+  }
+  next->ops->lclose(fd, *next);
+
+  // No descriptor of ours will flush the table on close
+  if (res != 0 ||
+      seekable_flush_index(path, stbuf.st_dev, stbuf.st_ino, l) != 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: APPEND_BLOCK_TRUNCATE] Failed to truncate blocks",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+  locking_release(state->lock_table, path);
+  return 0;
+}
+
+int append_block_flush(const char *path, dev_t device, ino_t inode,
+                       LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const LayerContext *next = l.next_layers;
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(device, inode, state);
+  if (!mapping) {
+    return 0;
+  }
+
+  if (mapping->staging_valid && mapping->staging_dirty) {
+    int fd = next->ops->lopen(path, O_RDWR, 0, *next);
+    if (fd < 0) {
+      ERROR_MSG("[COMPRESSION_LAYER: APPEND_BLOCK_FLUSH] Failed to open file "
+                "%s",
+                path);
+      return -1;
+    }
+    // The staging block stays valid, later appends keep filling it
+    int res = store_staging(fd, mapping, l);
+    next->ops->lclose(fd, *next);
+    if (res != 0) {
+      ERROR_MSG("[COMPRESSION_LAYER: APPEND_BLOCK_FLUSH] Failed to store the "
+                "staging block of %s",
+                path);
+      return -1;
+    }
+  }
+  return seekable_flush_index(path, device, inode, l);
+}
@@ -1 +1,38 @@
+#ifndef __APPEND_BLOCK_H__
+#define __APPEND_BLOCK_H__
 
+#include "compression.h"
+
+/*
+ * Append block mode: the seekable layout (see seekable.h) tuned for
+ * sequential writers. Appends fill a staging block in memory, which is
+ * compressed once when it is full, or on fsync and close, and appended after
+ * the last frame. Reads of the tail are served from the staging block. Any
+ * other write stores the staging block first and rewrites the frames it
+ * overlaps.
+ */
+
+ssize_t compression_append_block_pwrite(int fd, const void *buffer,
+                                        size_t nbyte, off_t offset,
+                                        LayerContext l);
+ssize_t compression_append_block_pread(int fd, void *buffer, size_t nbyte,
+                                       off_t offset, LayerContext l);
+int compression_append_block_ftruncate(int fd, off_t length, LayerContext l);
+int compression_append_block_truncate(const char *path, off_t length,
+                                      LayerContext l);
+
+/**
+ * @brief Store the staging block and write the seek table of a file
+ *
+ * @warning Caller must hold the write lock of the file.
+ *
+ * @param path -> path of the file in the next layer
+ * @param device -> device id
+ * @param inode -> inode number
+ * @param l -> layer context
+ * @return int -> 0 if successful, -1 otherwise
+ */
+int append_block_flush(const char *path, dev_t device, ino_t inode,
+                       LayerContext l);
+
+#endif
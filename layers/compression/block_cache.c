@@ -0,0 +1,189 @@
+#include "block_cache.h"
+#include "../../logdef.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define FILE_KEY_SIZE (sizeof(dev_t) + sizeof(ino_t))
+
+// Helper: build binary key from (device, inode, block)
+static void build_block_key(dev_t device, ino_t inode, size_t block,
+                            unsigned char *key_out) {
+  memcpy(key_out, &device, sizeof(dev_t));
+  memcpy(key_out + sizeof(dev_t), &inode, sizeof(ino_t));
+  memcpy(key_out + FILE_KEY_SIZE, &block, sizeof(size_t));
+}
+
+static size_t block_of(const BlockCacheEntry *entry) {
+  size_t block;
+  memcpy(&block, entry->key + FILE_KEY_SIZE, sizeof(size_t));
+  return block;
+}
+
+static BlockCacheEntry *find_entry(BlockCache *cache,
+                                   const unsigned char *key) {
+  BlockCacheEntry *entry = NULL;
+  // NOLINTNEXTLINE(bugprone-casting-through-void)
+  HASH_FIND(hh, cache->entries, key, BLOCK_CACHE_KEY_SIZE, entry);
+  return entry;
+}
+
+// Move an entry to the most recently used end of the table
+static void touch_entry(BlockCache *cache, BlockCacheEntry *entry) {
+  // NOLINTNEXTLINE(bugprone-casting-through-void)
+  HASH_DEL(cache->entries, entry);
+  // NOLINTNEXTLINE(bugprone-casting-through-void)
+  HASH_ADD(hh, cache->entries, key, BLOCK_CACHE_KEY_SIZE, entry);
+}
+
+static size_t entry_bytes(const BlockCache *cache) {
+  return sizeof(BlockCacheEntry) + cache->block_size;
+}
+
+static void drop_entry(BlockCache *cache, BlockCacheEntry *entry) {
+  // NOLINTNEXTLINE(bugprone-casting-through-void)
+  HASH_DEL(cache->entries, entry);
+  free(entry);
+  memory_budget_release(cache->memory, entry_bytes(cache));
+}
+
+// Memory budget shrinker: drop the least recently used blocks
+static size_t shrink_cache(void *arg, size_t bytes) {
+  BlockCache *cache = arg;
+  // a put of this cache may be the charge asking
+  if (pthread_mutex_trylock(&cache->lock) != 0) {
+    return 0;
+  }
+  size_t released = 0;
+  while (released < bytes && cache->entries) {
+    drop_entry(cache, cache->entries);
+    released += entry_bytes(cache);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return released;
+}
+
+BlockCache *block_cache_init(size_t capacity, size_t block_size) {
+  if (capacity == 0 || block_size == 0) {
+    return NULL;
+  }
+  BlockCache *cache = calloc(1, sizeof(BlockCache));
+  if (!cache) {
+    return NULL;
+  }
+  if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+    free(cache);
+    return NULL;
+  }
+  cache->capacity = capacity;
+  cache->block_size = block_size;
+  cache->memory = memory_budget_account("compression");
+  (void)memory_budget_add_shrinker(cache->memory, shrink_cache, cache);
+  return cache;
+}
+
+int block_cache_get(BlockCache *cache, dev_t device, ino_t inode, size_t block,
+                    void *dst, size_t size) {
+  if (!cache) {
+    return 0;
+  }
+  unsigned char key[BLOCK_CACHE_KEY_SIZE];
+  build_block_key(device, inode, block, key);
+
+  pthread_mutex_lock(&cache->lock);
+  BlockCacheEntry *entry = find_entry(cache, key);
+  int hit = entry && entry->size >= size;
+  if (hit) {
+    memcpy(dst, entry->data, size);
+    touch_entry(cache, entry);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return hit;
+}
+
+void block_cache_put(BlockCache *cache, dev_t device, ino_t inode, size_t block,
+                     const void *data, size_t size) {
+  if (!cache || size > cache->block_size) {
+    return;
+  }
+  unsigned char key[BLOCK_CACHE_KEY_SIZE];
+  build_block_key(device, inode, block, key);
+
+  pthread_mutex_lock(&cache->lock);
+  BlockCacheEntry *entry = find_entry(cache, key);
+  int room = !entry && HASH_COUNT(cache->entries) < cache->capacity &&
+             memory_budget_try_charge(cache->memory, entry_bytes(cache)) == 0;
+  if (entry) {
+    touch_entry(cache, entry);
+  } else if (!room && !cache->entries) {
+    // No budget for a first block
+    pthread_mutex_unlock(&cache->lock);
+    return;
+  } else if (!room) {
+    // Reuse the least recently used entry
+    entry = cache->entries;
+    // NOLINTNEXTLINE(bugprone-casting-through-void)
+    HASH_DEL(cache->entries, entry);
+    memcpy(entry->key, key, BLOCK_CACHE_KEY_SIZE);
+    // NOLINTNEXTLINE(bugprone-casting-through-void)
+    HASH_ADD(hh, cache->entries, key, BLOCK_CACHE_KEY_SIZE, entry);
+  } else {
+    entry = malloc(entry_bytes(cache));
+    if (!entry) {
+      pthread_mutex_unlock(&cache->lock);
+      memory_budget_release(cache->memory, entry_bytes(cache));
+      DEBUG_MSG("[COMPRESSION_LAYER: BLOCK_CACHE] Failed to allocate entry");
+      return;
+    }
+    memcpy(entry->key, key, BLOCK_CACHE_KEY_SIZE);
+    // NOLINTNEXTLINE(bugprone-casting-through-void)
+    HASH_ADD(hh, cache->entries, key, BLOCK_CACHE_KEY_SIZE, entry);
+  }
+  memcpy(entry->data, data, size);
+  entry->size = size;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void block_cache_invalidate(BlockCache *cache, dev_t device, ino_t inode,
+                            size_t first, size_t last) {
+  if (!cache || first > last) {
+    return;
+  }
+  unsigned char key[BLOCK_CACHE_KEY_SIZE];
+  build_block_key(device, inode, first, key);
+
+  pthread_mutex_lock(&cache->lock);
+  size_t count = HASH_COUNT(cache->entries);
+  if (last - first < count) {
+    // Short range: look the blocks up
+    for (size_t block = first; block <= last; block++) {
+      memcpy(key + FILE_KEY_SIZE, &block, sizeof(size_t));
+      BlockCacheEntry *entry = find_entry(cache, key);
+      if (entry) {
+        drop_entry(cache, entry);
+      }
+    }
+  } else {
+    BlockCacheEntry *entry, *tmp;
+    // NOLINTNEXTLINE(bugprone-casting-through-void)
+    HASH_ITER(hh, cache->entries, entry, tmp) {
+      size_t block = block_of(entry);
+      if (memcmp(entry->key, key, FILE_KEY_SIZE) == 0 && block >= first &&
+          block <= last) {
+        drop_entry(cache, entry);
+      }
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void block_cache_destroy(BlockCache *cache) {
+  if (!cache) {
+    return;
+  }
+  memory_budget_remove_shrinker(shrink_cache, cache);
+  BlockCacheEntry *entry, *tmp;
+  // NOLINTNEXTLINE(bugprone-casting-through-void)
+  HASH_ITER(hh, cache->entries, entry, tmp) { drop_entry(cache, entry); }
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
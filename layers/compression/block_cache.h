@@ -0,0 +1,98 @@
+#ifndef __BLOCK_CACHE_H__
+#define __BLOCK_CACHE_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include "../../shared/utils/memory_budget.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h> /* for dev_t, ino_t */
+
+/*
+ * Cache of decompressed blocks of the sparse_block mode (options.block_cache).
+ *
+ * Holds up to the configured number of blocks, keyed by (device, inode, block
+ * index) like the file mappings of the layer, and evicts the least recently
+ * used one. Only blocks stored compressed are cached: a hit saves the read of
+ * the compressed block and its decompression.
+ *
+ * Blocks are invalidated by the writes overlapping them, and whole files on
+ * ftruncate, O_TRUNC and when the mapping of the file is removed (unlink).
+ *
+ * The blocks are charged to the "compression" memory budget account: without
+ * room for a new block the least recently used one is reused, and the charges
+ * of other consumers may evict blocks (see memory_budget.h).
+ */
+#define BLOCK_CACHE_KEY_SIZE (sizeof(dev_t) + sizeof(ino_t) + sizeof(size_t))
+
+typedef struct {
+  unsigned char key[BLOCK_CACHE_KEY_SIZE];
+  size_t size; /* Logical size of the block, at most block_size */
+  UT_hash_handle hh;
+  uint8_t data[]; /* block_size bytes */
+} BlockCacheEntry;
+
+typedef struct {
+  pthread_mutex_t lock;
+  BlockCacheEntry *entries; /* Least recently used first */
+  size_t capacity;          /* Maximum number of cached blocks */
+  size_t block_size;
+  MemoryAccount *memory; /* Memory budget account charged for the blocks */
+} BlockCache;
+
+/**
+ * @brief Create a block cache
+ *
+ * @param capacity -> maximum number of cached blocks
+ * @param block_size -> size of a block
+ * @return BlockCache* -> cache, or NULL on failure
+ */
+BlockCache *block_cache_init(size_t capacity, size_t block_size);
+
+/**
+ * @brief Copy a cached block out of the cache
+ *
+ * @param cache -> block cache, NULL is always a miss
+ * @param device -> device id
+ * @param inode -> inode number
+ * @param block -> block index
+ * @param dst -> receives size bytes of the block
+ * @param size -> bytes to copy from the start of the block
+ * @return int -> 1 on a hit, 0 if the block is not cached or shorter than size
+ */
+int block_cache_get(BlockCache *cache, dev_t device, ino_t inode, size_t block,
+                    void *dst, size_t size);
+
+/**
+ * @brief Cache a decompressed block, replacing the cached copy if any
+ *
+ * @param cache -> block cache, NULL is ignored
+ * @param device -> device id
+ * @param inode -> inode number
+ * @param block -> block index
+ * @param data -> decompressed block
+ * @param size -> logical size of the block, at most block_size
+ */
+void block_cache_put(BlockCache *cache, dev_t device, ino_t inode, size_t block,
+                     const void *data, size_t size);
+
+/**
+ * @brief Drop the cached blocks first to last of a file
+ *
+ * @param cache -> block cache, NULL is ignored
+ * @param device -> device id
+ * @param inode -> inode number
+ * @param first -> first block index
+ * @param last -> last block index, SIZE_MAX for the rest of the file
+ */
+void block_cache_invalidate(BlockCache *cache, dev_t device, ino_t inode,
+                            size_t first, size_t last);
+
+/**
+ * @brief Free a block cache and its blocks
+ *
+ * @param cache -> block cache, NULL is ignored
+ */
+void block_cache_destroy(BlockCache *cache);
+
+#endif
@@ -0,0 +1,279 @@
+#include "compactor.h"
+
+#include "../../logdef.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Batches per second, the rate is spread over them
+#define BATCHES_PER_SECOND 10
+
+static int64_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Wait on the work condition until a monotonic deadline (mutex held)
+ */
+static void wait_until(Compactor *compactor, int64_t deadline_ms) {
+  struct timespec deadline = {.tv_sec = deadline_ms / 1000,
+                              .tv_nsec = (deadline_ms % 1000) * 1000000};
+  pthread_cond_timedwait(&compactor->work, &compactor->mutex, &deadline);
+}
+
+/**
+ * @brief Wait until the layer saw no I/O for idle_ms (mutex held)
+ *
+ * @return int -> 1 once idle, 0 if the compactor is stopping
+ */
+static int wait_idle(Compactor *compactor, int mid_file) {
+  int waited = 0;
+  while (!compactor->stopping) {
+    int64_t idle_at =
+        __atomic_load_n(&compactor->last_io_ms, __ATOMIC_RELAXED) +
+        compactor->idle_ms;
+    if (now_ms() >= idle_at) {
+      if (waited && mid_file) {
+        compactor->stats.yields++;
+      }
+      return 1;
+    }
+    waited = 1;
+    wait_until(compactor, idle_at);
+  }
+  return 0;
+}
+
+static void free_entry(CompactorEntry *entry) {
+  free(entry->path);
+  free(entry);
+}
+
+/**
+ * @brief Take the next entry to compact (mutex held)
+ */
+static CompactorEntry *pop_entry(Compactor *compactor) {
+  CompactorEntry *entry = compactor->head;
+  if (entry) {
+    compactor->head = entry->next;
+    if (!compactor->head) {
+      compactor->tail = NULL;
+    }
+    entry->next = NULL;
+  }
+  return entry;
+}
+
+/**
+ * @brief Compactor thread: compacts queued paths batch by batch until stopped
+ */
+static void *compactor_worker(void *arg) {
+  Compactor *compactor = arg;
+
+  pthread_mutex_lock(&compactor->mutex);
+  for (;;) {
+    while (!compactor->head && !compactor->stopping) {
+      pthread_cond_wait(&compactor->work, &compactor->mutex);
+    }
+    if (compactor->stopping) {
+      break; // pending compactions are dropped, they only reclaim space
+    }
+    CompactorEntry *entry = pop_entry(compactor);
+
+    size_t block = 0;
+    int res = 1;
+    while (res > 0 && wait_idle(compactor, block > 0)) {
+      int64_t batch_end = now_ms() + 1000 / BATCHES_PER_SECOND;
+      size_t first = block;
+      off_t reclaimed = 0;
+      pthread_mutex_unlock(&compactor->mutex);
+
+      // the entry is not freed while compacted: the path stays valid unlocked
+      res = compactor->compact(compactor->arg, entry->path, &block,
+                               compactor->batch_blocks, &reclaimed);
+
+      pthread_mutex_lock(&compactor->mutex);
+      compactor->stats.blocks += block - first;
+      if (reclaimed > 0) {
+        compactor->stats.reclaimed += (uint64_t)reclaimed;
+      }
+      while (res > 0 && !compactor->stopping && now_ms() < batch_end) {
+        wait_until(compactor, batch_end);
+      }
+    }
+
+    if (res == 0) {
+      compactor->stats.compacted++;
+    } else if (res < 0) {
+      compactor->stats.failed++;
+      DEBUG_MSG("[COMPRESSION_LAYER: COMPACTOR] Failed to compact %s",
+                entry->path);
+    }
+    HASH_DEL(compactor->pending, entry);
+    free_entry(entry);
+    compactor->stats.queue_depth--;
+  }
+  pthread_mutex_unlock(&compactor->mutex);
+  return NULL;
+}
+
+/**
+ * @brief Create a compactor and start its thread
+ *
+ * @param compact -> callback compacting a batch of blocks of a path
+ * @param arg     -> argument passed to the callback
+ * @param rate    -> blocks processed per second at most
+ * @param idle_ms -> time without I/O before compacting
+ * @return Compactor* -> compactor, or NULL on error
+ */
+Compactor *compactor_init(compactor_fn compact, void *arg, size_t rate,
+                          long idle_ms) {
+  if (!compact || rate == 0 || idle_ms < 0) {
+    return NULL;
+  }
+  Compactor *compactor = calloc(1, sizeof(Compactor));
+  if (!compactor) {
+    return NULL;
+  }
+  compactor->compact = compact;
+  compactor->arg = arg;
+  compactor->batch_blocks = rate / BATCHES_PER_SECOND;
+  if (compactor->batch_blocks == 0) {
+    compactor->batch_blocks = 1;
+  }
+  compactor->idle_ms = idle_ms;
+  compactor->last_io_ms = now_ms();
+
+  pthread_condattr_t attr;
+  if (pthread_mutex_init(&compactor->mutex, NULL) != 0) {
+    free(compactor);
+    return NULL;
+  }
+  if (pthread_condattr_init(&attr) != 0 ||
+      pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0 ||
+      pthread_cond_init(&compactor->work, &attr) != 0) {
+    pthread_mutex_destroy(&compactor->mutex);
+    free(compactor);
+    return NULL;
+  }
+  pthread_condattr_destroy(&attr);
+  if (pthread_create(&compactor->worker, NULL, compactor_worker, compactor) !=
+      0) {
+    pthread_cond_destroy(&compactor->work);
+    pthread_mutex_destroy(&compactor->mutex);
+    free(compactor);
+    return NULL;
+  }
+  return compactor;
+}
+
+/**
+ * @brief Stop the thread, after the batch in progress, and free the compactor
+ *
+ * @param compactor -> compactor to destroy (may be NULL)
+ */
+void compactor_destroy(Compactor *compactor) {
+  if (!compactor) {
+    return;
+  }
+  pthread_mutex_lock(&compactor->mutex);
+  compactor->stopping = 1;
+  pthread_cond_signal(&compactor->work);
+  pthread_mutex_unlock(&compactor->mutex);
+  pthread_join(compactor->worker, NULL);
+
+  CompactorEntry *entry, *tmp;
+  HASH_ITER(hh, compactor->pending, entry, tmp) {
+    HASH_DEL(compactor->pending, entry);
+    free_entry(entry);
+  }
+  pthread_cond_destroy(&compactor->work);
+  pthread_mutex_destroy(&compactor->mutex);
+  free(compactor);
+}
+
+/**
+ * @brief Schedule the compaction of a closed file
+ *
+ * @param compactor -> compactor
+ * @param path      -> path of the file
+ * @return int      -> 0 if the compaction is pending, -1 on error
+ */
+int compactor_enqueue(Compactor *compactor, const char *path) {
+  if (!compactor || !path) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&compactor->mutex);
+  if (compactor->stopping) {
+    pthread_mutex_unlock(&compactor->mutex);
+    return -1;
+  }
+  CompactorEntry *entry = NULL;
+  HASH_FIND(hh, compactor->pending, path, strlen(path), entry);
+  if (entry) {
+    compactor->stats.coalesced++;
+    pthread_mutex_unlock(&compactor->mutex);
+    return 0;
+  }
+
+  entry = calloc(1, sizeof(CompactorEntry));
+  if (entry) {
+    entry->path = strdup(path);
+  }
+  if (!entry || !entry->path) {
+    if (entry) {
+      free_entry(entry);
+    }
+    pthread_mutex_unlock(&compactor->mutex);
+    return -1;
+  }
+  HASH_ADD_KEYPTR(hh, compactor->pending, entry->path, strlen(entry->path),
+                  entry);
+  if (compactor->tail) {
+    compactor->tail->next = entry;
+  } else {
+    compactor->head = entry;
+  }
+  compactor->tail = entry;
+
+  compactor->stats.enqueued++;
+  compactor->stats.queue_depth++;
+  pthread_cond_signal(&compactor->work);
+  pthread_mutex_unlock(&compactor->mutex);
+  return 0;
+}
+
+/**
+ * @brief Record I/O on the layer, which postpones compaction by idle_ms
+ *
+ * Lock free, called on every read and write.
+ *
+ * @param compactor -> compactor (NULL: no-op)
+ */
+void compactor_note_io(Compactor *compactor) {
+  if (compactor) {
+    __atomic_store_n(&compactor->last_io_ms, now_ms(), __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * @brief Snapshot of the compaction metrics
+ *
+ * @param compactor -> compactor (NULL: all zero)
+ * @param stats     -> output
+ */
+void compactor_get_stats(Compactor *compactor, CompactorStats *stats) {
+  if (!stats) {
+    return;
+  }
+  if (!compactor) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  pthread_mutex_lock(&compactor->mutex);
+  *stats = compactor->stats;
+  pthread_mutex_unlock(&compactor->mutex);
+}
@@ -0,0 +1,81 @@
+#ifndef __COMPACTOR_H__
+#define __COMPACTOR_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * ============================================================================
+ * COMPACTOR - BACKGROUND SPACE RECLAMATION OF SPARSE_BLOCK FILES
+ * ============================================================================
+ *
+ * Closes of a file that wastes too much space hand its path to a background
+ * thread, which reclaims the space of the file in batches of blocks.
+ *
+ * - A file is compacted only once the layer saw no I/O for idle_ms, and the
+ *   compactor goes back to waiting whenever I/O resumes between two batches.
+ * - At most rate blocks per second are processed, in batches of a tenth of
+ *   the rate, so compaction never competes with a busy workload.
+ * - At most one compaction is pending per path, closes of a queued path are
+ *   coalesced.
+ * ============================================================================
+ */
+
+/**
+ * @brief Compaction callback, run by the compactor thread
+ *
+ * @param arg        -> argument given to compactor_init
+ * @param path       -> path of the file to compact
+ * @param next_block -> first block of the batch, receives the next one
+ * @param max_blocks -> blocks to process at most in this batch
+ * @param reclaimed  -> receives the bytes reclaimed by the batch
+ * @return int       -> 1 if blocks remain, 0 once the file is done, negative
+ * on error
+ */
+typedef int (*compactor_fn)(void *arg, const char *path, size_t *next_block,
+                            size_t max_blocks, off_t *reclaimed);
+
+typedef struct CompactorEntry {
+  char *path;                  // key
+  struct CompactorEntry *next; // next entry in compaction order
+  UT_hash_handle hh;
+} CompactorEntry;
+
+typedef struct {
+  size_t queue_depth;      // files queued or being compacted
+  size_t enqueued;         // closes that scheduled a compaction
+  size_t coalesced;        // closes of a file already queued
+  size_t compacted;        // files compacted to the end
+  size_t failed;           // compactions that returned an error
+  size_t blocks;           // blocks processed
+  size_t yields;           // batches postponed because the layer was busy
+  uint64_t reclaimed;      // bytes reclaimed
+} CompactorStats;
+
+typedef struct {
+  CompactorEntry *pending; // pending compactions by path
+  CompactorEntry *head;    // next entry to compact
+  CompactorEntry *tail;    // last entry to compact
+  compactor_fn compact;    // compaction callback
+  void *arg;               // compaction callback argument
+  size_t batch_blocks;     // blocks per batch
+  long idle_ms;            // I/O free time before compacting
+  int64_t last_io_ms;      // monotonic time of the last I/O (atomic)
+  CompactorStats stats;    // progress metrics
+  int stopping;            // set by destroy, worker exits
+  pthread_t worker;        // compactor thread
+  pthread_mutex_t mutex;   // protects all the fields above but last_io_ms
+  pthread_cond_t work;     // signalled when a file is queued or on stop
+} Compactor;
+
+Compactor *compactor_init(compactor_fn compact, void *arg, size_t rate,
+                          long idle_ms);
+void compactor_destroy(Compactor *compactor);
+int compactor_enqueue(Compactor *compactor, const char *path);
+void compactor_note_io(Compactor *compactor);
+void compactor_get_stats(Compactor *compactor, CompactorStats *stats);
+
+#endif // __COMPACTOR_H__
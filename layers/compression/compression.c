@@ -1,7 +1,14 @@
+#define _GNU_SOURCE
 #include "compression.h"
 #include "../../logdef.h"
 #include "../../shared/utils/compressor/compressor.h"
+#include "../../shared/utils/invalidation.h"
+#include "../../shared/utils/layer_iov.h"
+#include "../../shared/utils/numa_policy.h"
+#include "append_block.h"
 #include "compression_utils.h"
+#include "index_file.h"
+#include "seekable.h"
 #include "sparse_block.h"
 #include <errno.h>
 #include <fcntl.h>
@@ -24,10 +31,32 @@ static const LayerOps default_mode_ops = {
 static const LayerOps sparse_block_mode_ops = {
     .lpread = compression_sparse_block_pread,
     .lpwrite = compression_sparse_block_pwrite,
+    .lpread_digest = compression_sparse_block_pread_digest,
+    .lpwrite_digest = compression_sparse_block_pwrite_digest,
     .lftruncate = compression_sparse_block_ftruncate,
     .ltruncate = compression_sparse_block_truncate,
     .lfstat = compression_sparse_block_fstat,
     .llstat = compression_sparse_block_lstat,
+    .lcopy_file_range = compression_sparse_block_copy_file_range,
+};
+
+static const LayerOps seekable_mode_ops = {
+    .lpread = compression_seekable_pread,
+    .lpwrite = compression_seekable_pwrite,
+    .lftruncate = compression_seekable_ftruncate,
+    .ltruncate = compression_seekable_truncate,
+    .lfstat = compression_seekable_fstat,
+    .llstat = compression_seekable_lstat,
+};
+
+// Append blocks use the seekable layout, only writes and reads differ
+static const LayerOps append_block_mode_ops = {
+    .lpread = compression_append_block_pread,
+    .lpwrite = compression_append_block_pwrite,
+    .lftruncate = compression_append_block_ftruncate,
+    .ltruncate = compression_append_block_truncate,
+    .lfstat = compression_seekable_fstat,
+    .llstat = compression_seekable_lstat,
 };
 
 static inline void require_block_size_or_exit(const CompressionConfig *config) {
@@ -35,18 +64,51 @@ static inline void require_block_size_or_exit(const CompressionConfig *config) {
     ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_INIT] Block size is not set");
     exit(1);
   }
+  // Block entries keep the stored size in 31 bits
+  if ((uint32_t)config->block_size >= BLOCK_ENTRY_UNKNOWN) {
+    ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_INIT] Block size is too large");
+    exit(1);
+  }
 }
 
 static inline const LayerOps *ops_for_mode(compression_mode_t mode) {
   switch (mode) {
   case COMPRESSION_MODE_SPARSE_BLOCK:
     return &sparse_block_mode_ops;
+  case COMPRESSION_MODE_SEEKABLE:
+    return &seekable_mode_ops;
+  case COMPRESSION_MODE_APPEND_BLOCK:
+    return &append_block_mode_ops;
   case COMPRESSION_MODE_FILE:
   default:
     return &default_mode_ops;
   }
 }
 
+// Modes keeping a frame index (seek table) at the end of the file
+static inline int uses_frame_index(compression_mode_t mode) {
+  return mode == COMPRESSION_MODE_SEEKABLE ||
+         mode == COMPRESSION_MODE_APPEND_BLOCK;
+}
+
+// Modes writing their block index to storage on fsync, close and rename
+static inline int persists_index(const CompressionState *state) {
+  return uses_frame_index(state->mode) ||
+         (state->mode == COMPRESSION_MODE_SPARSE_BLOCK && state->index_file);
+}
+
+static int flush_frame_index(const char *path, dev_t device, ino_t inode,
+                             LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  if (state->mode == COMPRESSION_MODE_SPARSE_BLOCK) {
+    return index_file_flush(path, device, inode, l);
+  }
+  if (state->mode == COMPRESSION_MODE_APPEND_BLOCK) {
+    return append_block_flush(path, device, inode, l);
+  }
+  return seekable_flush_index(path, device, inode, l);
+}
+
 static int get_or_set_original_size(int fd, const char *path, LayerContext l,
                                     off_t *original_size);
 static int calculate_original_size_from_compressed_file(int fd,
@@ -77,12 +139,12 @@ LayerContext compression_init(LayerContext *next_layer,
     exit(1);
   }
 
-  // Initialize fd_to_inode array
-  for (int i = 0; i < MAX_FDS; i++) {
-    state->fd_to_inode[i].fd = INVALID_FD;
-    state->fd_to_inode[i].path = NULL;
-    state->fd_to_inode[i].device = 0;
-    state->fd_to_inode[i].inode = 0;
+  // Initialize fd_to_inode table
+  fd_table_init(&state->fd_to_inode, sizeof(FdToInode), fd_to_inode_clear);
+  if (group_commit_init(&state->fsyncs) != 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_INIT] Failed to initialize "
+              "the fsync group commit");
+    exit(1);
   }
 
   int res =
@@ -92,8 +154,46 @@ LayerContext compression_init(LayerContext *next_layer,
               "compressor");
     exit(1);
   }
+  if (config->dictionary) {
+    res = compressor_load_dictionary(&state->compressor, config->dictionary);
+    if (res == DICTIONARY_UNSUPPORTED_ERROR) {
+      ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_INIT] Dictionaries are only "
+                "supported with zstd");
+      exit(1);
+    }
+    if (res != 0) {
+      ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_INIT] Failed to load "
+                "dictionary %s",
+                config->dictionary);
+      exit(1);
+    }
+  }
+  // a whole file is one frame: large enough for several threads and a wide
+  // window
+  if (config->mode == COMPRESSION_MODE_FILE &&
+      (config->workers > 0 || config->long_distance ||
+       config->window_log > 0)) {
+    CompressorZstdParams params = {.workers = config->workers,
+                                   .long_distance = config->long_distance,
+                                   .window_log = config->window_log};
+    res = compressor_set_zstd_params(&state->compressor, &params);
+    if (res == ZSTD_PARAMS_UNSUPPORTED_ERROR) {
+      ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_INIT] workers, "
+                "long_distance and window_log are only supported with zstd "
+                "in file mode");
+      exit(1);
+    }
+    if (res != 0) {
+      ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_INIT] Invalid zstd workers "
+                "(%d) or window_log (%d)",
+                config->workers, config->window_log);
+      exit(1);
+    }
+  }
 
   state->lock_table = locking_init();
+  state->buffers = buffer_pool_shared();
+  state->metadata = metadata_service_cache();
   if (!state->lock_table) {
     free(state);
     ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_INIT] Failed to initialize lock "
@@ -119,6 +219,40 @@ LayerContext compression_init(LayerContext *next_layer,
     require_block_size_or_exit(config);
     state->block_size = (size_t)config->block_size;
     state->free_space = config->free_space;
+    state->index_file = config->index_file;
+    state->bare_blocks = config->bare_blocks;
+    state->adaptive = config->adaptive;
+    // the payload length of a bare block is 16 bits
+    if (state->bare_blocks && state->block_size > COMPRESSOR_BLOCK_MAX_SIZE) {
+      ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_INIT] bare_blocks requires "
+                "a block_size of at most %d bytes",
+                COMPRESSOR_BLOCK_MAX_SIZE);
+      exit(1);
+    }
+    if (config->workers > 1) {
+      // one queue per NUMA node, the blocks of a request stay on its node
+      int nodes = numa_policy_nodes();
+      state->pool =
+          thread_pool_init(nodes, (config->workers + nodes - 1) / nodes);
+      if (!state->pool) {
+        ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_INIT] Failed to start the "
+                  "thread pool");
+        exit(1);
+      }
+    }
+    if (config->block_cache > 0) {
+      state->block_cache =
+          block_cache_init((size_t)config->block_cache, state->block_size);
+      if (!state->block_cache) {
+        ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_INIT] Failed to allocate "
+                  "the block cache");
+        exit(1);
+      }
+    }
+  } else if (uses_frame_index(state->mode)) {
+    require_block_size_or_exit(config);
+    state->block_size = (size_t)config->block_size;
+    state->adaptive = config->adaptive;
   }
   *compression_ops = *ops_for_mode(state->mode);
   compression_ops->lopen = compression_open;
@@ -129,6 +263,8 @@ LayerContext compression_init(LayerContext *next_layer,
   compression_ops->lrename = compression_rename;
   compression_ops->lchmod = compression_chmod;
   compression_ops->lfsync = compression_fsync;
+  compression_ops->ldirect_alignment = compression_direct_alignment;
+  compression_ops->lreconfigure = compression_reconfigure;
 
   l.ops = compression_ops;
   // TODO: We need to be consistent with the way we handle the next layers
@@ -139,6 +275,24 @@ LayerContext compression_init(LayerContext *next_layer,
   l.next_layers = aux;
   l.nlayers = 1;
 
+  // Compaction punches the slack of the blocks, like free_space does on
+  // rewrites, so it is only started with free_space
+  if (state->free_space && config->compaction) {
+    state->compaction_threshold = config->compaction_threshold;
+    state->compaction_layer = malloc(sizeof(LayerContext));
+    if (state->compaction_layer) {
+      *state->compaction_layer = l;
+      state->compactor = compactor_init(
+          sparse_block_compact, state->compaction_layer,
+          (size_t)config->compaction_rate, config->compaction_idle_ms);
+    }
+    if (!state->compactor) {
+      ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_INIT] Failed to start the "
+                "compactor");
+      exit(1);
+    }
+  }
+
   return l;
 }
 
@@ -181,7 +335,7 @@ static ssize_t write_to_empty_file(int fd, char *path, const void *buffer,
   *new_size = (off_t)total_size;
 
   // File is empty, allocate buffer for new data
-  void *decompressed_data = calloc(1, total_size);
+  void *decompressed_data = buffer_pool_get_zeroed(state->buffers, total_size);
   if (!decompressed_data) {
     ERROR_MSG("[COMPRESSION_LAYER: WRITE_TO_EMPTY_FILE] Failed to allocate "
               "memory for decompressed data");
@@ -195,24 +349,24 @@ static ssize_t write_to_empty_file(int fd, char *path, const void *buffer,
   size_t max_compressed_size = state->compressor.get_compress_bound(
       total_size, state->compressor.level); // Use total_size
 
-  void *new_compressed_data = malloc(max_compressed_size);
+  void *new_compressed_data =
+      buffer_pool_get(state->buffers, max_compressed_size);
   if (!new_compressed_data) {
     ERROR_MSG("[COMPRESSION_LAYER: WRITE_TO_EMPTY_FILE] Failed to allocate "
               "memory for compressed data");
-    free(decompressed_data);
+    buffer_pool_put(state->buffers, decompressed_data);
     return INVALID_FD;
   }
 
   // Now compress safely
-  ssize_t new_compressed_size = state->compressor.compress_data(
-      decompressed_data, total_size, new_compressed_data,
-      max_compressed_size, // Use total_size
-      state->compressor.level);
+  ssize_t new_compressed_size = compressor_compress(
+      &state->compressor, decompressed_data, total_size, new_compressed_data,
+      max_compressed_size); // Use total_size
   if (new_compressed_size < 0) {
     ERROR_MSG(
         "[COMPRESSION_LAYER: WRITE_TO_EMPTY_FILE] Failed to compress data");
-    free(new_compressed_data);
-    free(decompressed_data);
+    buffer_pool_put(state->buffers, new_compressed_data);
+    buffer_pool_put(state->buffers, decompressed_data);
     return INVALID_FD;
   }
 
@@ -222,12 +376,12 @@ static ssize_t write_to_empty_file(int fd, char *path, const void *buffer,
   if (write_size < 0) {
     ERROR_MSG("[COMPRESSION_LAYER: WRITE_TO_EMPTY_FILE] Failed to write "
               "compressed data");
-    free(new_compressed_data);
-    free(decompressed_data);
+    buffer_pool_put(state->buffers, new_compressed_data);
+    buffer_pool_put(state->buffers, decompressed_data);
     return INVALID_FD;
   }
-  free(new_compressed_data);
-  free(decompressed_data);
+  buffer_pool_put(state->buffers, new_compressed_data);
+  buffer_pool_put(state->buffers, decompressed_data);
 
   return (ssize_t)nbyte;
 }
@@ -256,7 +410,8 @@ static int get_decompressed_data(int fd, const char *path,
     return -1;
   }
   off_t compressed_size = stbuf.st_size;
-  void *compressed_data = malloc((size_t)compressed_size);
+  void *compressed_data =
+      buffer_pool_get(state->buffers, (size_t)compressed_size);
   if (!compressed_data) {
     ERROR_MSG("[COMPRESSION_LAYER: GET_DECOMPRESSED_DATA] Failed to allocate "
               "memory for compressed "
@@ -269,28 +424,29 @@ static int get_decompressed_data(int fd, const char *path,
   if (read_size < 0) {
     ERROR_MSG("[COMPRESSION_LAYER: GET_DECOMPRESSED_DATA] Failed to read "
               "compressed data from file");
-    free(compressed_data);
+    buffer_pool_put(state->buffers, compressed_data);
     return -1;
   }
 
   if (original_size < 0 || original_size > SIZE_MAX) {
     ERROR_MSG("[COMPRESSION_LAYER: GET_DECOMPRESSED_DATA] File too large for "
               "decompression");
-    free(compressed_data);
+    buffer_pool_put(state->buffers, compressed_data);
     return -1;
   }
 
   size_t size_t_original_size = (size_t)original_size;
-  ssize_t decompressed_size = state->compressor.decompress_data(
-      compressed_data, compressed_size, decompressed_data,
-      &size_t_original_size);
+  ssize_t decompressed_size =
+      compressor_decompress(&state->compressor, compressed_data,
+                            compressed_size, decompressed_data,
+                            &size_t_original_size);
   if (decompressed_size < 0) {
     ERROR_MSG(
         "[COMPRESSION_LAYER: GET_DECOMPRESSED_DATA] Failed to decompress data");
-    free(compressed_data);
+    buffer_pool_put(state->buffers, compressed_data);
     return -1;
   }
-  free(compressed_data);
+  buffer_pool_put(state->buffers, compressed_data);
 
   return 0;
 }
@@ -331,7 +487,8 @@ static ssize_t write_to_existing_file(int fd, char *path, const void *buffer,
     return INVALID_FD;
   }
 
-  void *decompressed_data = malloc((size_t)original_size);
+  void *decompressed_data =
+      buffer_pool_get(state->buffers, (size_t)original_size);
   if (!decompressed_data) {
     ERROR_MSG("[COMPRESSION_LAYER: WRITE_TO_EXISTING_FILE] Failed to allocate "
               "memory for "
@@ -344,7 +501,7 @@ static ssize_t write_to_existing_file(int fd, char *path, const void *buffer,
   if (res != 0) {
     ERROR_MSG("[COMPRESSION_LAYER: WRITE_TO_EXISTING_FILE] Failed to get "
               "decompressed data");
-    free(decompressed_data);
+    buffer_pool_put(state->buffers, decompressed_data);
     return INVALID_FD;
   }
 
@@ -352,18 +509,19 @@ static ssize_t write_to_existing_file(int fd, char *path, const void *buffer,
   if (offset < 0 || (size_t)offset > (SIZE_MAX - nbyte)) {
     ERROR_MSG("[COMPRESSION_LAYER: WRITE_TO_EXISTING_FILE] File size too large "
               "for memory allocation");
-    free(decompressed_data);
+    buffer_pool_put(state->buffers, decompressed_data);
     return INVALID_FD;
   }
   size_t end_position = (size_t)offset + nbyte;
 
   if (end_position > (size_t)original_size) {
-    void *new_buf = realloc(decompressed_data, end_position);
+    void *new_buf =
+        buffer_pool_resize(state->buffers, decompressed_data, end_position);
     if (!new_buf) {
       ERROR_MSG("[COMPRESSION_LAYER: WRITE_TO_EXISTING_FILE] Failed to "
                 "reallocate memory for "
                 "decompressed data");
-      free(decompressed_data);
+      buffer_pool_put(state->buffers, decompressed_data);
       return INVALID_FD;
     }
     // Only zero-fill the gap if there is one
@@ -385,27 +543,29 @@ static ssize_t write_to_existing_file(int fd, char *path, const void *buffer,
   size_t max_compressed_size = state->compressor.get_compress_bound(
       size_t_new_size, state->compressor.level);
 
-  void *new_compressed_data = malloc(max_compressed_size);
+  void *new_compressed_data =
+      buffer_pool_get(state->buffers, max_compressed_size);
   if (!new_compressed_data) {
     ERROR_MSG("[COMPRESSION_LAYER: WRITE_TO_EXISTING_FILE] Failed to "
               "reallocate memory for compressed "
               "data");
-    free(decompressed_data);
+    buffer_pool_put(state->buffers, decompressed_data);
     return INVALID_FD;
   }
 
   // Now compress safely
-  ssize_t new_compressed_size = state->compressor.compress_data(
-      decompressed_data, size_t_new_size, new_compressed_data,
-      max_compressed_size, state->compressor.level);
+  ssize_t new_compressed_size =
+      compressor_compress(&state->compressor, decompressed_data,
+                          size_t_new_size, new_compressed_data,
+                          max_compressed_size);
   if (new_compressed_size < 0) {
     ERROR_MSG(
         "[COMPRESSION_LAYER: WRITE_TO_EXISTING_FILE] Failed to compress data");
-    free(new_compressed_data);
-    free(decompressed_data);
+    buffer_pool_put(state->buffers, new_compressed_data);
+    buffer_pool_put(state->buffers, decompressed_data);
     return INVALID_FD;
   }
-  free(decompressed_data);
+  buffer_pool_put(state->buffers, decompressed_data);
 
   // We truncate the file to 0 bytes
   // This is necessary to avoid the file being corrupted by the new data
@@ -416,7 +576,7 @@ static ssize_t write_to_existing_file(int fd, char *path, const void *buffer,
   if (res < 0) {
     ERROR_MSG(
         "[COMPRESSION_LAYER: WRITE_TO_EXISTING_FILE] Failed to truncate file");
-    free(new_compressed_data);
+    buffer_pool_put(state->buffers, new_compressed_data);
     return INVALID_FD;
   }
 
@@ -428,10 +588,10 @@ static ssize_t write_to_existing_file(int fd, char *path, const void *buffer,
   if (write_size < 0) {
     ERROR_MSG("[COMPRESSION_LAYER: WRITE_TO_EXISTING_FILE] Failed to write "
               "compressed data");
-    free(new_compressed_data);
+    buffer_pool_put(state->buffers, new_compressed_data);
     return INVALID_FD;
   }
-  free(new_compressed_data);
+  buffer_pool_put(state->buffers, new_compressed_data);
 
   return (ssize_t)nbyte;
 }
@@ -467,7 +627,8 @@ ssize_t compression_pwrite(int fd, const void *buffer, size_t nbyte,
 
   CompressionState *state = (CompressionState *)l.internal_state;
 
-  char *path = state->fd_to_inode[fd].path;
+  FdToInode *fd_entry = fd_to_inode_lookup(state, fd);
+  char *path = fd_entry ? fd_entry->path : NULL;
   if (!path) {
     error_msg_and_release_lock(
         "[COMPRESSION_LAYER: COMPRESSION_PWRITE] File path not found", NULL,
@@ -519,6 +680,8 @@ ssize_t compression_pwrite(int fd, const void *buffer, size_t nbyte,
                                state->lock_table, path);
     return INVALID_FD;
   }
+  metadata_cache_invalidate(state->metadata, fd_entry->device,
+                            fd_entry->inode);
 
   locking_release(state->lock_table, path);
 
@@ -555,7 +718,7 @@ ssize_t compression_pread(int fd, void *buffer, size_t nbyte, off_t offset,
 
   CompressionState *state = (CompressionState *)l.internal_state;
 
-  const char *path = state->fd_to_inode[fd].path;
+  const char *path = fd_to_inode_path(state, fd);
   if (!path) {
     error_msg_and_release_lock(
         "[COMPRESSION_LAYER: COMPRESSION_PREAD] File path not found", NULL,
@@ -601,7 +764,7 @@ ssize_t compression_pread(int fd, void *buffer, size_t nbyte, off_t offset,
   }
   off_t compressed_size = stbuf.st_size;
 
-  void *compressed_data = malloc(compressed_size);
+  void *compressed_data = buffer_pool_get(state->buffers, compressed_size);
   if (!compressed_data) {
     error_msg_and_release_lock("[COMPRESSION_LAYER: COMPRESSION_PREAD] Failed "
                                "to allocate memory for compressed data",
@@ -613,27 +776,29 @@ ssize_t compression_pread(int fd, void *buffer, size_t nbyte, off_t offset,
   ssize_t read_size = read_compressed_data(fd, path, l.next_layers,
                                            compressed_data, compressed_size);
   if (read_size < 0) {
-    free(compressed_data);
+    buffer_pool_put(state->buffers, compressed_data);
     error_msg_and_release_lock(
         "[COMPRESSION_LAYER: COMPRESSION_PREAD] Failed to read compressed data",
         state->lock_table, path);
     return INVALID_FD;
   }
 
-  void *decompressed_data = malloc(safe_original_size);
+  void *decompressed_data = buffer_pool_get(state->buffers, safe_original_size);
   if (!decompressed_data) {
     error_msg_and_release_lock("[COMPRESSION_LAYER: COMPRESSION_PREAD] Failed "
                                "to allocate memory for decompressed data",
                                state->lock_table, path);
-    free(compressed_data);
+    buffer_pool_put(state->buffers, compressed_data);
     return INVALID_FD;
   }
 
-  ssize_t decompressed_size = state->compressor.decompress_data(
-      compressed_data, compressed_size, decompressed_data, &safe_original_size);
+  ssize_t decompressed_size =
+      compressor_decompress(&state->compressor, compressed_data,
+                            compressed_size, decompressed_data,
+                            &safe_original_size);
   if (decompressed_size < 0) {
-    free(compressed_data);
-    free(decompressed_data);
+    buffer_pool_put(state->buffers, compressed_data);
+    buffer_pool_put(state->buffers, decompressed_data);
     error_msg_and_release_lock(
         "[COMPRESSION_LAYER: COMPRESSION_PREAD] Failed to decompress data",
         state->lock_table, path);
@@ -641,8 +806,8 @@ ssize_t compression_pread(int fd, void *buffer, size_t nbyte, off_t offset,
   }
 
   memcpy(buffer, (char *)decompressed_data + offset, bytes_to_read);
-  free(compressed_data);
-  free(decompressed_data);
+  buffer_pool_put(state->buffers, compressed_data);
+  buffer_pool_put(state->buffers, decompressed_data);
   locking_release(state->lock_table, path);
 
   // We should be safe to cast to ssize_t because we checked that nbyte is less
@@ -685,6 +850,12 @@ int compression_open(const char *pathname, int flags, mode_t mode,
     lock_acquired = 1; // Successfully acquired lock
   }
 
+  // compressed data never keeps the offsets and sizes of the requests:
+  // O_DIRECT only goes down when the next layer aligns the I/O itself
+  if ((flags & O_DIRECT) && layer_direct_alignment(*next) > 1) {
+    flags &= ~O_DIRECT;
+  }
+
   int file_fd = next->ops->lopen(pathname, flags, mode, *next);
 
   if (file_fd < 0) {
@@ -694,14 +865,14 @@ int compression_open(const char *pathname, int flags, mode_t mode,
     return file_fd;
   }
 
-  if (file_fd >= MAX_FDS) {
+  if (!fd_table_slot(&state->fd_to_inode, file_fd)) {
     next->ops->lclose(file_fd, *next);
     if (lock_acquired) {
       locking_release(state->lock_table, pathname);
     }
-    ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_OPEN] File descriptor %d "
-              "exceeds MAX_FDS (%d)",
-              file_fd, MAX_FDS);
+    ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_OPEN] No fd_to_inode entry "
+              "for file descriptor %d (limit %d)",
+              file_fd, FD_TABLE_MAX_FDS);
     return INVALID_FD;
   }
 
@@ -761,6 +932,33 @@ int compression_open(const char *pathname, int flags, mode_t mode,
     }
   }
 
+  // Seekable files keep their frame index at the end of the file, load it
+  // before the first access (creates the mapping of existing files)
+  if (uses_frame_index(state->mode)) {
+    if (!lock_acquired &&
+        locking_acquire_write(state->lock_table, pathname) != 0) {
+      ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_OPEN] Failed to acquire "
+                "write lock on file");
+      return INVALID_FD;
+    }
+    int loaded =
+        seekable_load_index(pathname, st_key.st_dev, st_key.st_ino, l);
+    if (!lock_acquired) {
+      locking_release(state->lock_table, pathname);
+    }
+    if (loaded != 0) {
+      if (lock_acquired) {
+        locking_release(state->lock_table, pathname);
+      }
+      fd_to_inode_remove(state, file_fd);
+      next->ops->lclose(file_fd, *next);
+      ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_OPEN] Failed to load the "
+                "seek table of %s",
+                pathname);
+      return INVALID_FD;
+    }
+  }
+
   // Handle O_TRUNC flag after any O_CREAT mapping creation
   if (lock_acquired) {
     CompressedFileMapping *file_mapping =
@@ -771,16 +969,48 @@ int compression_open(const char *pathname, int flags, mode_t mode,
                                  state->lock_table, pathname);
       return INVALID_FD;
     }
-    file_mapping->logical_eof = 0;
+    if (file_mapping->logical_eof != 0) {
+      file_mapping->logical_eof = 0;
+      layer_invalidate_attr(st_key.st_dev, st_key.st_ino);
+    }
+    block_cache_invalidate(state->block_cache, st_key.st_dev, st_key.st_ino,
+                           0, SIZE_MAX);
+    if (uses_frame_index(state->mode)) {
+      seekable_reset_index(file_mapping);
+    }
     if (shrink_block_index(file_mapping, 0) != 0) {
       error_msg_and_release_lock(
           "[COMPRESSION_LAYER: COMPRESSION_OPEN] Failed to shrink block index",
           state->lock_table, pathname);
       return INVALID_FD;
     }
+    if (state->mode == COMPRESSION_MODE_SPARSE_BLOCK) {
+      index_file_invalidate(pathname, file_mapping, l);
+    }
     locking_release(state->lock_table, pathname);
   }
 
+  // Rebuild block mapping from storage for sparse_block mode after
+  // crash/restart, from the index file when it is current. Only rebuild if
+  // the mapping doesn't already exist (creates it for the open counter)
+  if (state->mode == COMPRESSION_MODE_SPARSE_BLOCK && !lock_acquired &&
+      st_key.st_size > 0) {
+    if (locking_acquire_write(state->lock_table, pathname) != 0) {
+      ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_OPEN] Failed to acquire "
+                "write lock on file");
+      return INVALID_FD;
+    }
+    int loaded = sparse_block_load_index(file_fd, pathname, &st_key, l);
+    locking_release(state->lock_table, pathname);
+    if (loaded != 0) {
+      fd_to_inode_remove(state, file_fd);
+      next->ops->lclose(file_fd, *next);
+      ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_OPEN] Failed to rebuild "
+                "block mapping");
+      return INVALID_FD;
+    }
+  }
+
   // Increment the open counter for this file
   if (increment_open_counter(st_key.st_dev, st_key.st_ino, l) != 0) {
     ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_OPEN] Failed to increment open "
@@ -788,29 +1018,6 @@ int compression_open(const char *pathname, int flags, mode_t mode,
     return INVALID_FD;
   }
 
-  // Rebuild block mapping from storage for sparse_block mode after
-  // crash/restart Only rebuild if mapping doesn't already exist (i.e., after a
-  // crash/restart)
-  if (state->mode == COMPRESSION_MODE_SPARSE_BLOCK && !(flags & O_CREAT) &&
-      !(flags & O_TRUNC)) {
-    // Check if block mapping already exists (cheap check first)
-    CompressedFileMapping *existing_mapping =
-        get_compressed_file_mapping(st_key.st_dev, st_key.st_ino, state);
-    // Check if mapping doesn't exist or is empty, or if file has data
-    if ((!existing_mapping || existing_mapping->num_blocks == 0) &&
-        st_key.st_size > 0) {
-      // File has data, rebuild mapping from storage
-      DEBUG_MSG("[COMPRESSION_LAYER: COMPRESSION_OPEN] Rebuilding block "
-                "mapping for dev=%lu, ino=%lu",
-                (unsigned long)st_key.st_dev, (unsigned long)st_key.st_ino);
-      if (rebuild_block_mapping_from_storage(file_fd, st_key.st_dev,
-                                             st_key.st_ino, l) < 0) {
-        ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_OPEN] Failed to rebuild "
-                  "block mapping");
-        return INVALID_FD;
-      }
-    }
-  }
   return file_fd;
 }
 
@@ -863,6 +1070,25 @@ int compression_close(int fd, LayerContext l) {
     return INVALID_FD;
   }
 
+  // Persist the block index, an unlinked file has no path to write it to
+  int flushed = 0;
+  if (persists_index(state)) {
+    CompressedFileMapping *mapping =
+        get_compressed_file_mapping(device, inode, state);
+    if (mapping && !mapping->unlink_called) {
+      flushed = flush_frame_index(path_copy, device, inode, l);
+    }
+  }
+
+  // Last close of a sparse_block file: compact it if it wastes space
+  if (state->compactor) {
+    CompressedFileMapping *mapping =
+        get_compressed_file_mapping(device, inode, state);
+    if (mapping && !mapping->unlink_called && mapping->open_counter == 1) {
+      sparse_block_maybe_compact(fd, path_copy, mapping, l);
+    }
+  }
+
   fd_to_inode_remove(state, fd);
 
   int result = next->ops->lclose(fd, *next);
@@ -887,7 +1113,7 @@ int compression_close(int fd, LayerContext l) {
   locking_release(state->lock_table, path_copy);
   free(path_copy);
 
-  return result;
+  return flushed != 0 ? INVALID_FD : result;
 }
 
 void compression_destroy(LayerContext l) {
@@ -896,29 +1122,23 @@ void compression_destroy(LayerContext l) {
     return;
   }
 
+  // Stop the compactor first, it works on the file mappings
+  compactor_destroy(state->compactor);
+  free(state->compaction_layer);
+
   // Clean up all fd_to_inode entries
-  for (int i = 0; i < MAX_FDS; i++) {
-    if (state->fd_to_inode[i].path) {
-      free(state->fd_to_inode[i].path);
-      state->fd_to_inode[i].path = NULL;
-    }
+  for (int i = 0; i < fd_table_end(&state->fd_to_inode); i++) {
+    fd_to_inode_remove(state, i);
   }
+  fd_table_destroy(&state->fd_to_inode);
 
   // Clean up all file mappings (unified mapping)
-  CompressedFileMapping *entry, *tmp;
-  // NOLINTNEXTLINE(bugprone-casting-through-void)
-  HASH_ITER(hh, state->file_mapping, entry, tmp) {
-    // Free dynamically allocated arrays (sparse_block fields)
-    if (entry->sizes) {
-      free(entry->sizes);
-    }
-    if (entry->is_uncompressed) {
-      free(entry->is_uncompressed);
-    }
-    // NOLINTNEXTLINE(bugprone-casting-through-void)
-    HASH_DEL(state->file_mapping, entry);
-    free(entry);
-  }
+  destroy_compressed_file_mappings(state);
+
+  thread_pool_destroy(state->pool);
+  block_cache_destroy(state->block_cache);
+  compressor_destroy(&state->compressor);
+  group_commit_destroy(&state->fsyncs);
 
   if (state) {
     free(state);
@@ -960,7 +1180,7 @@ int compression_ftruncate(int fd, off_t length, LayerContext l) {
   }
 
   CompressionState *state = (CompressionState *)l.internal_state;
-  char *path = state->fd_to_inode[fd].path;
+  char *path = fd_to_inode_path(state, fd);
   if (!path) {
     ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_FTRUNCATE] File descriptor %d "
               "not found",
@@ -998,7 +1218,7 @@ int compression_fstat(int fd, struct stat *stbuf, LayerContext l) {
   }
 
   CompressionState *state = (CompressionState *)l.internal_state;
-  const char *path = state->fd_to_inode[fd].path;
+  const char *path = fd_to_inode_path(state, fd);
   if (!path) {
     ERROR_MSG(
         "[COMPRESSION_LAYER: COMPRESSION_FSTAT] File descriptor %d not found",
@@ -1064,8 +1284,9 @@ int compression_lstat(const char *pathname, struct stat *stbuf,
   // Now handle compressed files
   off_t original_size;
   // We will fist try to get the original size from the file_size_mapping hash
-  // table.
-  if (get_original_size_from_mapping(pathname, l, &original_size) != 0) {
+  // table, then from the metadata service, which needs no open.
+  if (get_original_size_from_mapping(pathname, l, &original_size) != 0 &&
+      metadata_cache_get_size(state->metadata, stbuf, &original_size) != 0) {
     // If the file is not found in the file_size_mapping hash table, we need to
     // open the file and calculate the original size from the compressed file.
     int fd = l.next_layers->ops->lopen(pathname, O_RDONLY, 0, *l.next_layers);
@@ -1129,6 +1350,11 @@ int compression_unlink(const char *pathname, LayerContext l) {
     locking_release(state->lock_table, pathname);
     return res;
   }
+  if (state->mode == COMPRESSION_MODE_SPARSE_BLOCK) {
+    index_file_unlink(pathname, l);
+  }
+  metadata_cache_invalidate(state->metadata, stbuf_before.st_dev,
+                            stbuf_before.st_ino);
 
   // Mark as unlinked and get the current open counter
   int open_count = 0;
@@ -1160,6 +1386,17 @@ int compression_unlink(const char *pathname, LayerContext l) {
   return res;
 }
 
+/**
+ * @brief Progress metrics of the sparse_block compactor
+ *
+ * @param l     -> LayerContext of the compression layer
+ * @param stats -> output, all zero when compaction is disabled
+ */
+void compression_compaction_stats(LayerContext l, CompactorStats *stats) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  compactor_get_stats(state ? state->compactor : NULL, stats);
+}
+
 int compression_rename(const char *from, const char *to, unsigned int flags,
                        LayerContext l) {
   CompressionState *state = (CompressionState *)l.internal_state;
@@ -1169,7 +1406,19 @@ int compression_rename(const char *from, const char *to, unsigned int flags,
               from);
     return INVALID_FD;
   }
+  // The block index is written through the path, flush it while it is valid
+  struct stat stbuf;
+  if (persists_index(state) &&
+      l.next_layers->ops->llstat(from, &stbuf, *l.next_layers) == 0 &&
+      S_ISREG(stbuf.st_mode) &&
+      flush_frame_index(from, stbuf.st_dev, stbuf.st_ino, l) != 0) {
+    locking_release(state->lock_table, from);
+    return INVALID_FD;
+  }
   int result = l.next_layers->ops->lrename(from, to, flags, *l.next_layers);
+  if (result == 0 && state->mode == COMPRESSION_MODE_SPARSE_BLOCK) {
+    index_file_rename(from, to, flags, l);
+  }
   locking_release(state->lock_table, from);
   return result;
 }
@@ -1187,15 +1436,92 @@ int compression_chmod(const char *path, mode_t mode, LayerContext l) {
   return result;
 }
 
+// The fsync leading a batch of fsyncs of a file
+typedef struct {
+  int fd;
+  FdToInode *entry; // of fd, or NULL
+  LayerContext l;
+} CompressionSync;
+
+/**
+ * @brief Store the index of a file and fsync it, for a batch of fsyncs
+ */
+static int compression_sync(void *arg, int isdatasync) {
+  CompressionSync *sync = arg;
+  LayerContext l = sync->l;
+  const LayerContext *next = l.next_layers;
+  CompressionState *state = (CompressionState *)l.internal_state;
+  FdToInode *entry = sync->entry;
+  if (persists_index(state) && entry) {
+    if (locking_acquire_write(state->lock_table, entry->path) != 0) {
+      return INVALID_FD;
+    }
+    int flushed =
+        flush_frame_index(entry->path, entry->device, entry->inode, l);
+    locking_release(state->lock_table, entry->path);
+    if (flushed != 0) {
+      return INVALID_FD;
+    }
+  }
+  if (next && next->ops && next->ops->lfsync) {
+    return next->ops->lfsync(sync->fd, isdatasync, *next);
+  }
+  return -ENOSYS;
+}
+
 int compression_fsync(int fd, int isdatasync, LayerContext l) {
   if (!is_valid_compression_fd(fd)) {
     return INVALID_FD;
   }
-  const LayerContext *next = l.next_layers;
-  if (next && next->ops && next->ops->lfsync) {
-    return next->ops->lfsync(fd, isdatasync, *next);
+  CompressionState *state = (CompressionState *)l.internal_state;
+  CompressionSync sync = {
+      .fd = fd, .entry = fd_to_inode_lookup(state, fd), .l = l};
+  if (!sync.entry) {
+    return compression_sync(&sync, isdatasync);
+  }
+  // the fsyncs of the file's fds share one index store and one fsync
+  uint64_t key[2] = {(uint64_t)sync.entry->device,
+                     (uint64_t)sync.entry->inode};
+  return group_commit_sync(&state->fsyncs, key, sizeof(key), isdatasync,
+                           compression_sync, &sync);
+}
+
+/**
+ * @brief O_DIRECT alignment of the compression layer
+ *
+ * None: compression_open drops O_DIRECT when the next layer needs aligned
+ * I/O, so requests of any size and offset are served.
+ *
+ * @param l -> layer context
+ * @return size_t -> 1
+ */
+size_t compression_direct_alignment(LayerContext l) { return 1; }
+
+/**
+ * @brief Take the level of a reloaded configuration, its only live tunable
+ *
+ * The blocks and frames already written decompress whatever level they were
+ * compressed at; the next writes and rewrites use the new one.
+ *
+ * @param params -> reloaded CompressionConfig of the layer
+ * @param apply  -> 0 to only check it
+ * @param error  -> why the level cannot change
+ * @param l      -> layer context
+ * @return int   -> 0, or -1 with a dictionary, digested at the first level
+ */
+int compression_reconfigure(const void *params, int apply, const char **error,
+                            LayerContext l) {
+  const CompressionConfig *config = (const CompressionConfig *)params;
+  CompressionState *state = (CompressionState *)l.internal_state;
+  if (state->compressor.dictionary) {
+    *error = "the level of a compression layer with a dictionary cannot "
+             "change, the dictionary is digested at it";
+    return -1;
   }
-  return -ENOSYS;
+  if (apply) {
+    (void)compressor_set_level(&state->compressor, config->level);
+  }
+  return 0;
 }
 
 /**
@@ -1259,6 +1585,9 @@ static int calculate_original_size_from_compressed_file(int fd,
     return -1;
   }
   off_t compressed_size = stbuf.st_size;
+  if (metadata_cache_get_size(state->metadata, &stbuf, original_size) == 0) {
+    return 0;
+  }
 
   // We get the maximum header size that a frame can have for the compressor
   // used.
@@ -1271,7 +1600,8 @@ static int calculate_original_size_from_compressed_file(int fd,
   // We only read the compressed data if the approximated compressed size is
   // greater than 0.
   if (approximated_compressed_size > 0) {
-    void *compressed_data = malloc(approximated_compressed_size);
+    void *compressed_data =
+        buffer_pool_get(state->buffers, approximated_compressed_size);
     if (!compressed_data) {
       ERROR_MSG("[COMPRESSION_LAYER: "
                 "COMPRESSION_CALCULATE_ORIGINAL_SIZE_FROM_COMPRESSED_FILE] "
@@ -1287,7 +1617,7 @@ static int calculate_original_size_from_compressed_file(int fd,
                 "COMPRESSION_CALCULATE_ORIGINAL_SIZE_FROM_COMPRESSED_FILE] "
                 "Failed to read compressed data from file %s",
                 path);
-      free(compressed_data);
+      buffer_pool_put(state->buffers, compressed_data);
       return -1;
     }
 
@@ -1301,14 +1631,15 @@ static int calculate_original_size_from_compressed_file(int fd,
                 "COMPRESSION_CALCULATE_ORIGINAL_SIZE_FROM_COMPRESSED_FILE] "
                 "Failed to get original size of file %s",
                 path);
-      free(compressed_data);
+      buffer_pool_put(state->buffers, compressed_data);
       return -1;
     }
-    free(compressed_data);
+    buffer_pool_put(state->buffers, compressed_data);
     *original_size = compressor_original_size;
   } else {
     *original_size = 0;
   }
+  metadata_cache_set_size(state->metadata, &stbuf, *original_size);
   return 0;
 }
 
@@ -1363,10 +1694,83 @@ static ssize_t read_compressed_data(int fd, const char *path,
   return read_size;
 }
 
+// Wraps the filler of readdir to skip the sparse_block index files and to
+// give the logical size of the files listed with attributes
+typedef struct {
+  void *buf;
+  int (*filler)(void *buf, const char *name, const struct stat *stbuf,
+                off_t off, unsigned int flags);
+  const char *path; // directory listed
+  int hide_index;   // index files are skipped
+  LayerContext l;   // compression layer
+} CompressionDirFill;
+
+/**
+ * @brief Replace the stored size of a listed file by its logical size
+ *
+ * The size comes from the mapping table when the layer knows the file,
+ * without any access to the storage; otherwise from the lstat of the mode,
+ * which builds the mapping.
+ *
+ * @param fill -> listing
+ * @param name -> entry name
+ * @param st -> attributes of the entry from the next layer, updated
+ * @return int -> 0 if successful, -1 if the logical size is unknown
+ */
+static int fill_logical_size(CompressionDirFill *fill, const char *name,
+                             struct stat *st) {
+  CompressionState *state = (CompressionState *)fill->l.internal_state;
+  size_t dir_len = strlen(fill->path);
+  char *pathname = malloc(dir_len + strlen(name) + 2);
+  if (!pathname) {
+    return -1;
+  }
+  (void)sprintf(pathname, "%s/%s", fill->path, name);
+
+  int found = 0;
+  if (locking_acquire_read(state->lock_table, pathname) == 0) {
+    CompressedFileMapping *mapping =
+        get_compressed_file_mapping(st->st_dev, st->st_ino, state);
+    if (mapping && (!uses_frame_index(state->mode) || mapping->index_loaded)) {
+      st->st_size = mapping->logical_eof;
+      found = 1;
+    }
+    locking_release(state->lock_table, pathname);
+  }
+  int res = found ? 0 : fill->l.ops->llstat(pathname, st, fill->l);
+  free(pathname);
+  return res == 0 ? 0 : -1;
+}
+
+static int compression_filler(void *buf, const char *name,
+                              const struct stat *stbuf, off_t off,
+                              unsigned int flags) {
+  CompressionDirFill *fill = (CompressionDirFill *)buf;
+  if (fill->hide_index && index_file_is_index(name)) {
+    return 0;
+  }
+  if (!(flags & LAYER_FILL_DIR_PLUS) || !S_ISREG(stbuf->st_mode)) {
+    return fill->filler(fill->buf, name, stbuf, off, flags);
+  }
+  struct stat st = *stbuf;
+  if (fill_logical_size(fill, name, &st) != 0) {
+    // the size below is not the one of the file, let the caller lstat it
+    memset(&st, 0, sizeof(st));
+    st.st_ino = stbuf->st_ino;
+    st.st_mode = stbuf->st_mode & S_IFMT;
+    flags &= ~LAYER_FILL_DIR_PLUS;
+  }
+  return fill->filler(fill->buf, name, &st, off, flags);
+}
+
 /**
  * @brief Read directory operation for compression layer
  *
- * Passes through the readdir request to the next layer.
+ * Passes through the readdir request to the next layer, hiding the index
+ * files of the sparse_block mode. With LAYER_READDIR_PLUS, the regular
+ * files get their logical size: from the mapping table for the files the
+ * layer knows, by a lookup per entry in memory, and through the lstat of the
+ * mode for the others.
  *
  * @param path Directory path to read
  * @param buf Buffer for directory entries
@@ -1390,14 +1794,22 @@ int compression_readdir(const char *path, void *buf,
     return -EINVAL;
   }
 
+  CompressionState *state = (CompressionState *)l.internal_state;
+  // Index files are hidden from the listing
+  int hide_index =
+      state->mode == COMPRESSION_MODE_SPARSE_BLOCK && state->index_file;
   // Pass through to the next layer
-  if (l.next_layers && l.next_layers->ops && l.next_layers->ops->lreaddir) {
-    return l.next_layers->ops->lreaddir(path, buf, filler, offset, fi, flags,
-                                        *l.next_layers);
+  if (!hide_index && !(flags & LAYER_READDIR_PLUS)) {
+    return layer_readdir(path, buf, filler, offset, fi, flags,
+                         *l.next_layers);
   }
-
-  ERROR_MSG("[COMPRESSION_READDIR] No next layer readdir available");
-  return -ENOSYS;
+  CompressionDirFill fill = {buf, filler, path, hide_index, l};
+  int res = layer_readdir(path, &fill, compression_filler, offset, fi, flags,
+                          *l.next_layers);
+  if (res == -ENOSYS) {
+    ERROR_MSG("[COMPRESSION_READDIR] No next layer readdir available");
+  }
+  return res;
 }
 
 /**
@@ -1461,7 +1873,7 @@ static int truncate_compression_file(int fd, const char *path, off_t length,
     // because the file is empty. And we don't need to get the decompressed data
     // from storage.
     if (safe_original_size == 0) {
-      decompressed_data = calloc(1, length);
+      decompressed_data = buffer_pool_get_zeroed(state->buffers, length);
       if (!decompressed_data) {
         error_msg_and_release_lock(
             "[COMPRESSION_LAYER: COMPRESSION_FTRUNCATE] Failed to allocate "
@@ -1470,7 +1882,7 @@ static int truncate_compression_file(int fd, const char *path, off_t length,
         return INVALID_FD;
       }
     } else {
-      decompressed_data = malloc(safe_original_size);
+      decompressed_data = buffer_pool_get(state->buffers, safe_original_size);
       if (!decompressed_data) {
         error_msg_and_release_lock(
             "[COMPRESSION_LAYER: COMPRESSION_FTRUNCATE] Failed to allocate "
@@ -1485,14 +1897,14 @@ static int truncate_compression_file(int fd, const char *path, off_t length,
         error_msg_and_release_lock("[COMPRESSION_LAYER: COMPRESSION_FTRUNCATE] "
                                    "Failed to get decompressed data",
                                    state->lock_table, path);
-        free(decompressed_data);
+        buffer_pool_put(state->buffers, decompressed_data);
         return INVALID_FD;
       }
 
       // Resize buffer to the new size
-      void *tmp = realloc(decompressed_data, length);
+      void *tmp = buffer_pool_resize(state->buffers, decompressed_data, length);
       if (!tmp) {
-        free(decompressed_data);
+        buffer_pool_put(state->buffers, decompressed_data);
         error_msg_and_release_lock("[COMPRESSION_LAYER: COMPRESSION_FTRUNCATE] "
                                    "Failed to realloc buffer",
                                    state->lock_table, path);
@@ -1511,27 +1923,28 @@ static int truncate_compression_file(int fd, const char *path, off_t length,
     size_t max_compressed_size =
         state->compressor.get_compress_bound(length, state->compressor.level);
 
-    void *new_compressed_data = malloc(max_compressed_size);
+    void *new_compressed_data =
+        buffer_pool_get(state->buffers, max_compressed_size);
     if (!new_compressed_data) {
       ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_FTRUNCATE] Failed to "
                 "reallocate memory for compressed "
                 "data");
-      free(decompressed_data);
+      buffer_pool_put(state->buffers, decompressed_data);
       return INVALID_FD;
     }
 
     // Now compress safely
-    ssize_t new_compressed_size = state->compressor.compress_data(
-        decompressed_data, length, new_compressed_data, max_compressed_size,
-        state->compressor.level);
+    ssize_t new_compressed_size =
+        compressor_compress(&state->compressor, decompressed_data, length,
+                            new_compressed_data, max_compressed_size);
     if (new_compressed_size < 0) {
       ERROR_MSG(
           "[COMPRESSION_LAYER: COMPRESSION_FTRUNCATE] Failed to compress data");
-      free(new_compressed_data);
-      free(decompressed_data);
+      buffer_pool_put(state->buffers, new_compressed_data);
+      buffer_pool_put(state->buffers, decompressed_data);
       return INVALID_FD;
     }
-    free(decompressed_data);
+    buffer_pool_put(state->buffers, decompressed_data);
 
     // We truncate the file to 0 bytes
     // This is necessary to avoid the file being corrupted by the new data
@@ -1553,10 +1966,10 @@ static int truncate_compression_file(int fd, const char *path, off_t length,
     if (write_size < 0) {
       ERROR_MSG("[COMPRESSION_LAYER: COMPRESSION_FTRUNCATE] Failed to write "
                 "compressed data");
-      free(new_compressed_data);
+      buffer_pool_put(state->buffers, new_compressed_data);
       return INVALID_FD;
     }
-    free(new_compressed_data);
+    buffer_pool_put(state->buffers, new_compressed_data);
   }
 
   struct stat stbuf;
@@ -1572,6 +1985,7 @@ static int truncate_compression_file(int fd, const char *path, off_t length,
                                state->lock_table, path);
     return INVALID_FD;
   }
+  metadata_cache_set_size(state->metadata, &stbuf, length);
   locking_release(state->lock_table, path);
 
   return 0;
@@ -4,10 +4,15 @@
 #define INVALID_FD -1 // Value to indicate an invalid fd
 
 #include "../../shared/types/layer_context.h"
-// Include uthash which is not a library, it's just a header file
-#include "../../lib/uthash/src/uthash.h"
+#include "../../shared/utils/buffer_pool.h"
+#include "../../shared/utils/fd_table.h"
+#include "../../shared/utils/group_commit.h"
 #include "../../shared/utils/locking.h"
+#include "../../shared/utils/metadata_service.h"
+#include "../../shared/utils/thread_pool.h"
 #include "../anti_tampering/anti_tampering.h"
+#include "block_cache.h"
+#include "compactor.h"
 #include "config.h"
 #include <stdint.h>
 #include <stdlib.h>
@@ -21,42 +26,224 @@ typedef struct {
   char *path; /* optional: owned by layer if set */
 } FdToInode;
 
+/**
+ * @brief Per-file state of the adaptive compression policy (see policy.h)
+ */
+typedef struct {
+  unsigned int raw_streak; /* Consecutive blocks stored raw */
+  unsigned int skipped;    /* Blocks stored raw without trying since the last
+                              compression attempt */
+  int level_drop;          /* zstd levels below the configured level */
+} CompressionPolicy;
+
+/*
+ * Entry of the block index: stored (physical) size of the block in the low 31
+ * bits, BLOCK_ENTRY_RAW if the block is stored uncompressed. A stored size of
+ * BLOCK_ENTRY_UNKNOWN marks a block not scanned yet.
+ *
+ * Entries are allocated in chunks of BLOCK_INDEX_CHUNK that never move, so
+ * growing the index of a large file does not copy it. A chunk whose entries
+ * are all the same, such as a run of holes, of blocks not scanned yet or of
+ * full blocks stored raw, is kept as that one entry (an extent) without an
+ * array: the index of a large file written sequentially with incompressible
+ * data takes 12 bytes per BLOCK_INDEX_CHUNK blocks.
+ */
+typedef uint32_t BlockEntry;
+#define BLOCK_ENTRY_RAW 0x80000000u
+#define BLOCK_ENTRY_SIZE_MASK 0x7fffffffu
+#define BLOCK_ENTRY_UNKNOWN BLOCK_ENTRY_SIZE_MASK
+#define BLOCK_INDEX_CHUNK 1024
+
+// Stored size of a block that was not scanned yet
+#define BLOCK_SIZE_UNKNOWN ((off_t)-1)
+
+// Allocation unit the allocated sums of the block index are rounded to
+#define BLOCK_INDEX_ALLOC_UNIT 4096
+
+/*
+ * Sums of the entries of a range of blocks. The block index keeps them per
+ * chunk in a Fenwick tree, so the sums of any range, and the update of a
+ * block, take O(log(blocks / BLOCK_INDEX_CHUNK)) plus the entries of the
+ * partial chunks at its ends, rather than a walk from block 0.
+ */
+typedef struct {
+  uint64_t stored;    /* Stored bytes of the blocks scanned */
+  uint64_t allocated; /* The same, each rounded up to BLOCK_INDEX_ALLOC_UNIT */
+  uint64_t unknown;   /* Blocks not scanned yet */
+} BlockIndexSum;
+
 /**
  * @brief Unified mapping for compressed file metadata
  *
  * This structure combines logical size tracking (used by all compression modes)
- * with block-level indexing (only used by COMPRESSION_MODE_SPARSE_BLOCK).
+ * with block-level indexing (used by COMPRESSION_MODE_SPARSE_BLOCK,
+ * COMPRESSION_MODE_SEEKABLE and COMPRESSION_MODE_APPEND_BLOCK, where a block
+ * is a frame).
  *
- * Fields marked as "sparse_block only" are ignored in other compression modes.
+ * Fields marked as "sparse_block only" or "seekable only" are ignored in other
+ * compression modes.
  */
-typedef struct {
+typedef struct CompressedFileMapping {
   // Common fields (used by all compression modes)
   dev_t device;
   ino_t inode;
-  unsigned char key[sizeof(dev_t) + sizeof(ino_t)];
   off_t logical_eof; /* Logical (uncompressed) end-of-file position */
   int open_counter;  /* Number of open file descriptors for this file */
   int unlink_called; /* 1 if unlink was called, 0 otherwise */
 
   // Sparse block mode fields (only used in COMPRESSION_MODE_SPARSE_BLOCK)
   // These fields are ignored/unused in other compression modes
-  size_t num_blocks; /* Number of blocks allocated */
-  size_t capacity; /* allocated capacity for sizes and is_uncompressed arrays */
-  off_t *sizes;    /* Compressed physical size of each block */
-  int *is_uncompressed; /* Per-block flag: 1 if stored uncompressed, 0 if
-                           compressed */
+  size_t num_blocks;   /* Number of blocks allocated */
+  size_t capacity;     /* Entries allocated, a multiple of BLOCK_INDEX_CHUNK */
+  BlockEntry **chunks; /* capacity / BLOCK_INDEX_CHUNK chunks of entries, NULL
+                          for a chunk whose entries all equal its uniform */
+  BlockEntry *uniform; /* Entry of each chunk without an array */
+  BlockIndexSum *sums; /* Fenwick tree of the sums of the chunks */
+  int index_file_current; /* 1 if the index file matches the stored blocks */
+
+  // Seekable mode fields (only used in COMPRESSION_MODE_SEEKABLE)
+  off_t *offsets;          /* Physical offset of each stored frame */
+  size_t offsets_capacity; /* allocated capacity of offsets */
+  off_t data_end;          /* End of the frame data, the seek table follows */
+  off_t garbage;           /* Bytes of superseded frames below data_end */
+  int index_loaded;        /* 1 once the seek table was read from storage */
+  int index_dirty; /* 1 if the seek table (or the sparse_block index file) in
+                      storage is older than the mapping */
+
+  // Append block mode fields (only used in COMPRESSION_MODE_APPEND_BLOCK)
+  // The seekable fields above hold the frames already stored
+  uint8_t *staging;     /* Tail frame being filled, block_size bytes */
+  size_t staging_frame; /* Index of the frame held in staging */
+  int staging_valid;    /* 1 if staging holds the tail frame */
+  int staging_dirty;    /* 1 if staging is newer than the stored frame */
 
-  UT_hash_handle hh;
+  // Adaptive policy (used by all block modes when enabled)
+  CompressionPolicy policy;
+
+  struct CompressedFileMapping *next_free; /* Next mapping of the pool */
 } CompressedFileMapping;
 
+int block_index_split_chunk(CompressedFileMapping *mapping, size_t chunk);
+void block_index_merge_chunk(CompressedFileMapping *mapping, size_t chunk);
+void block_index_account(CompressedFileMapping *mapping, size_t chunk,
+                         BlockEntry old_entry, BlockEntry new_entry);
+BlockIndexSum block_index_sum(const CompressedFileMapping *mapping,
+                              size_t first, size_t end);
+
+/**
+ * @brief Index entry of a block
+ */
+static inline BlockEntry block_entry(const CompressedFileMapping *mapping,
+                                     size_t idx) {
+  const BlockEntry *chunk = mapping->chunks[idx / BLOCK_INDEX_CHUNK];
+  return chunk ? chunk[idx % BLOCK_INDEX_CHUNK]
+               : mapping->uniform[idx / BLOCK_INDEX_CHUNK];
+}
+
+/**
+ * @brief Stored size of a block, BLOCK_SIZE_UNKNOWN if it was not scanned yet
+ */
+static inline off_t block_stored_size(const CompressedFileMapping *mapping,
+                                      size_t idx) {
+  BlockEntry entry = block_entry(mapping, idx);
+  uint32_t size = entry & BLOCK_ENTRY_SIZE_MASK;
+  return size == BLOCK_ENTRY_UNKNOWN ? BLOCK_SIZE_UNKNOWN : (off_t)size;
+}
+
+/**
+ * @brief 1 if a block is stored uncompressed, 0 otherwise
+ */
+static inline int block_is_raw(const CompressedFileMapping *mapping,
+                               size_t idx) {
+  return (block_entry(mapping, idx) & BLOCK_ENTRY_RAW) != 0;
+}
+
+/**
+ * @brief Index entry of a stored size (or BLOCK_SIZE_UNKNOWN) and raw flag
+ */
+static inline BlockEntry block_entry_encode(off_t stored_size, int raw) {
+  BlockEntry entry = stored_size == BLOCK_SIZE_UNKNOWN
+                         ? BLOCK_ENTRY_UNKNOWN
+                         : (BlockEntry)stored_size & BLOCK_ENTRY_SIZE_MASK;
+  return raw ? entry | BLOCK_ENTRY_RAW : entry;
+}
+
+/**
+ * @brief Set the stored size (or BLOCK_SIZE_UNKNOWN) and raw flag of a block
+ *
+ * Gives a uniform chunk its array when the entry differs, and setting the
+ * last entry of a chunk folds it back into one entry when they all match,
+ * so that sequential writes keep runs of equal blocks as extents. The sums
+ * of the chunk follow the change.
+ *
+ * @return int -> 0, or -1 if the array of the chunk could not be allocated
+ */
+static inline int block_set(CompressedFileMapping *mapping, size_t idx,
+                            off_t stored_size, int raw) {
+  BlockEntry entry = block_entry_encode(stored_size, raw);
+  BlockEntry old_entry = block_entry(mapping, idx);
+  size_t c = idx / BLOCK_INDEX_CHUNK;
+  if (old_entry != entry) {
+    if (!mapping->chunks[c] && block_index_split_chunk(mapping, c) != 0) {
+      return -1;
+    }
+    mapping->chunks[c][idx % BLOCK_INDEX_CHUNK] = entry;
+    block_index_account(mapping, c, old_entry, entry);
+  }
+  if (idx % BLOCK_INDEX_CHUNK == BLOCK_INDEX_CHUNK - 1) {
+    block_index_merge_chunk(mapping, c);
+  }
+  return 0;
+}
+
+// Mappings are allocated FILE_MAPPING_SLAB at a time and never move
+#define FILE_MAPPING_SLAB 32
+
+typedef struct FileMappingSlab {
+  struct FileMappingSlab *next;
+  CompressedFileMapping mappings[FILE_MAPPING_SLAB];
+} FileMappingSlab;
+
+typedef struct {
+  dev_t device;
+  ino_t inode;
+  CompressedFileMapping *mapping; /* NULL if the slot is empty */
+} FileMappingSlot;
+
+/**
+ * @brief Open addressing table of the file mappings, keyed by (device, inode)
+ *
+ * Linear probing over a power of two number of slots, kept at most half full.
+ * The keys live in the slots so a probe does not touch the mappings.
+ */
+typedef struct {
+  FileMappingSlot *slots;
+  size_t capacity; /* Number of slots, 0 before the first insert */
+  size_t count;    /* Number of mappings */
+  FileMappingSlab *slabs;
+  CompressedFileMapping *free_list; /* Removed mappings, ready for reuse */
+} FileMappingTable;
+
 typedef struct {
-  FdToInode fd_to_inode[MAX_FDS]; /* Array of fd mappings */
-  CompressedFileMapping *file_mapping;
+  FdTable fd_to_inode; /* FdToInode of each fd */
+  FileMappingTable file_mapping;
   Compressor compressor;
   LockTable *lock_table; // path-based reader-writer lock table
   compression_mode_t mode;
   size_t block_size; /* Global block size (same for all files) */
   int free_space;    // enable fallocate punch behavior in sparse_block mode
+                     // frame size of the seekable mode is block_size
+  int index_file;    // persist the sparse_block index next to each file
+  int bare_blocks;   // sparse_block blocks stored without frames
+  int adaptive;      // adaptive compression policy in the block modes
+  ThreadPool *pool;  // compresses the blocks of a sparse_block request, or NULL
+  BlockCache *block_cache; // decompressed sparse_block blocks, or NULL
+  Compactor *compactor;    // reclaims the slack of sparse_block files, or NULL
+  int compaction_threshold; // wasted percent that schedules a compaction
+  LayerContext *compaction_layer; // context handed to the compactor
+  BufferPool *buffers;            // scratch buffers (buffer_pool_shared())
+  MetadataCache *metadata; // original sizes shared by layers, or NULL
+  GroupCommit fsyncs;      // concurrent fsyncs of a file, by (device, inode)
 } CompressionState;
 
 LayerContext compression_init(LayerContext *next_layer,
@@ -82,8 +269,12 @@ int compression_readdir(const char *path, void *buf,
                         unsigned int flags, LayerContext l);
 int compression_rename(const char *from, const char *to, unsigned int flags,
                        LayerContext l);
+void compression_compaction_stats(LayerContext l, CompactorStats *stats);
 
 int compression_chmod(const char *path, mode_t mode, LayerContext l);
 int compression_fsync(int fd, int isdatasync, LayerContext l);
+size_t compression_direct_alignment(LayerContext l);
+int compression_reconfigure(const void *params, int apply, const char **error,
+                            LayerContext l);
 
 #endif
@@ -1,24 +1,128 @@
 #include "compression_utils.h"
 #include "../../logdef.h"
 #include "../../shared/utils/compressor/compressor.h"
+#include "../../shared/utils/invalidation.h"
 #include "compression.h"
+#include "policy.h"
+#include <fcntl.h>
 #include <limits.h>
 
-// Helper: build binary key from (device, inode)
-static inline size_t build_dev_ino_key(dev_t device, ino_t inode,
-                                       unsigned char *key_out) {
-  memcpy(key_out, &device, sizeof(dev_t));
-  memcpy(key_out + sizeof(dev_t), &inode, sizeof(ino_t));
-  return sizeof(dev_t) + sizeof(ino_t);
+#define FILE_MAPPING_MIN_SLOTS 64
+
+// Helper: hash of (device, inode), mixed so that consecutive inodes spread
+static inline size_t hash_file_key(dev_t device, ino_t inode) {
+  uint64_t h = (uint64_t)inode * 0x9e3779b97f4a7c15ULL ^ (uint64_t)device;
+  h ^= h >> 31;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 29;
+  return (size_t)h;
+}
+
+// Slot holding (device, inode), or the empty slot where it would go
+static FileMappingSlot *find_slot(const FileMappingTable *table, dev_t device,
+                                  ino_t inode) {
+  size_t mask = table->capacity - 1;
+  for (size_t i = hash_file_key(device, inode) & mask;; i = (i + 1) & mask) {
+    FileMappingSlot *slot = &table->slots[i];
+    if (!slot->mapping || (slot->device == device && slot->inode == inode)) {
+      return slot;
+    }
+  }
+}
+
+static int grow_slots(FileMappingTable *table) {
+  size_t capacity =
+      table->capacity ? table->capacity * 2 : FILE_MAPPING_MIN_SLOTS;
+  FileMappingSlot *old_slots = table->slots;
+  size_t old_capacity = table->capacity;
+  FileMappingSlot *slots = calloc(capacity, sizeof(FileMappingSlot));
+  if (!slots) {
+    return -1;
+  }
+  table->slots = slots;
+  table->capacity = capacity;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old_slots[i].mapping) {
+      *find_slot(table, old_slots[i].device, old_slots[i].inode) =
+          old_slots[i];
+    }
+  }
+  free(old_slots);
+  return 0;
+}
+
+// Take a zeroed mapping from the pool
+static CompressedFileMapping *pool_get(FileMappingTable *table) {
+  if (!table->free_list) {
+    FileMappingSlab *slab = calloc(1, sizeof(FileMappingSlab));
+    if (!slab) {
+      return NULL;
+    }
+    slab->next = table->slabs;
+    table->slabs = slab;
+    for (size_t i = FILE_MAPPING_SLAB; i > 0; i--) {
+      slab->mappings[i - 1].next_free = table->free_list;
+      table->free_list = &slab->mappings[i - 1];
+    }
+  }
+  CompressedFileMapping *mapping = table->free_list;
+  table->free_list = mapping->next_free;
+  memset(mapping, 0, sizeof(CompressedFileMapping));
+  return mapping;
+}
+
+// Empty a slot, shifting back the entries of its probe sequence that follow
+static void clear_slot(FileMappingTable *table, FileMappingSlot *slot) {
+  size_t mask = table->capacity - 1;
+  size_t hole = (size_t)(slot - table->slots);
+  for (size_t i = (hole + 1) & mask; table->slots[i].mapping;
+       i = (i + 1) & mask) {
+    size_t home =
+        hash_file_key(table->slots[i].device, table->slots[i].inode) & mask;
+    // Entries whose home is cyclically in (hole, i] stay where they are
+    int stays = hole <= i ? (hole < home && home <= i)
+                          : (hole < home || home <= i);
+    if (!stays) {
+      table->slots[hole] = table->slots[i];
+      hole = i;
+    }
+  }
+  table->slots[hole].mapping = NULL;
+}
+
+static void free_block_index(CompressedFileMapping *mapping) {
+  for (size_t c = 0; c < mapping->capacity / BLOCK_INDEX_CHUNK; c++) {
+    free(mapping->chunks[c]);
+  }
+  free(mapping->chunks);
+  free(mapping->uniform);
+  free(mapping->sums);
+  mapping->chunks = NULL;
+  mapping->uniform = NULL;
+  mapping->sums = NULL;
+  mapping->capacity = 0;
+  mapping->num_blocks = 0;
+}
+
+// Free the arrays of a mapping and give it back to the pool
+static void release_mapping(FileMappingTable *table,
+                            CompressedFileMapping *mapping) {
+  free_block_index(mapping);
+  free(mapping->offsets);
+  free(mapping->staging);
+  mapping->next_free = table->free_list;
+  table->free_list = mapping;
 }
 
 /**
- * @brief Check if a file descriptor is valid for the limit of MAX_FDS
+ * @brief Check if a file descriptor is valid for the limit of FD_TABLE_MAX_FDS
  *
  * @param fd -> file descriptor to check
  * @return int -> 1 if valid, 0 otherwise
  */
-int is_valid_compression_fd(int fd) { return (fd >= 0 && fd < MAX_FDS); }
+int is_valid_compression_fd(int fd) {
+  return (fd >= 0 && fd < FD_TABLE_MAX_FDS);
+}
 
 /**
  * @brief Validate the file descriptor, offset and number of bytes
@@ -69,6 +173,8 @@ void error_msg_and_release_lock(const char *msg, LockTable *lock_table,
  * @warning This function is not thread-safe. Caller must ensure proper locking
  *          before calling this function. The entry must already exist.
  *
+ * A change of the logical EOF is reported with layer_invalidate_attr().
+ *
  * @param device -> device id
  * @param inode -> inode number
  * @param logical_eof -> logical (uncompressed) end-of-file position
@@ -78,15 +184,16 @@ void error_msg_and_release_lock(const char *msg, LockTable *lock_table,
 int set_logical_eof_in_mapping(dev_t device, ino_t inode, off_t logical_eof,
                                LayerContext l) {
   CompressionState *state = (CompressionState *)l.internal_state;
-  CompressedFileMapping *entry = NULL;
-  unsigned char key[sizeof(dev_t) + sizeof(ino_t)];
-  size_t key_len = build_dev_ino_key(device, inode, key);
-  // NOLINTNEXTLINE(bugprone-casting-through-void)
-  HASH_FIND(hh, state->file_mapping, key, key_len, entry);
+  CompressedFileMapping *entry =
+      get_compressed_file_mapping(device, inode, state);
   if (!entry) {
     return -1;
   }
-  entry->logical_eof = logical_eof;
+  if (entry->logical_eof != logical_eof) {
+    entry->logical_eof = logical_eof;
+    // the size the frontend may have cached is stale
+    layer_invalidate_attr(device, inode);
+  }
   return 0;
 }
 
@@ -104,28 +211,22 @@ int set_logical_eof_in_mapping(dev_t device, ino_t inode, off_t logical_eof,
 int create_compressed_file_mapping(dev_t device, ino_t inode, off_t logical_eof,
                                    LayerContext l) {
   CompressionState *state = (CompressionState *)l.internal_state;
-  CompressedFileMapping *entry = NULL;
-  unsigned char key[sizeof(dev_t) + sizeof(ino_t)];
-  size_t key_len = build_dev_ino_key(device, inode, key);
-  // NOLINTNEXTLINE(bugprone-casting-through-void)
-  HASH_FIND(hh, state->file_mapping, key, key_len, entry);
-  if (entry)
-    return -1;
-  entry = calloc(1, sizeof(CompressedFileMapping));
+  FileMappingTable *table = &state->file_mapping;
+  if (get_compressed_file_mapping(device, inode, state))
+    return -1;
+  if ((table->count + 1) * 2 > table->capacity && grow_slots(table) != 0)
+    return -1;
+  CompressedFileMapping *entry = pool_get(table);
   if (!entry)
     return -1;
   entry->device = device;
   entry->inode = inode;
-  memcpy(entry->key, key, key_len);
   entry->logical_eof = logical_eof;
-  entry->open_counter = 0;
-  entry->unlink_called = 0;
-  entry->num_blocks = 0;
-  entry->capacity = 0;
-  entry->sizes = NULL;
-  entry->is_uncompressed = NULL;
-  // NOLINTNEXTLINE(bugprone-casting-through-void)
-  HASH_ADD(hh, state->file_mapping, key, key_len, entry);
+  FileMappingSlot *slot = find_slot(table, device, inode);
+  slot->device = device;
+  slot->inode = inode;
+  slot->mapping = entry;
+  table->count++;
   return 0;
 }
 
@@ -142,11 +243,8 @@ int create_compressed_file_mapping(dev_t device, ino_t inode, off_t logical_eof,
 int get_logical_eof_from_mapping(dev_t device, ino_t inode, LayerContext l,
                                  off_t *logical_eof) {
   CompressionState *state = (CompressionState *)l.internal_state;
-  CompressedFileMapping *entry = NULL;
-  unsigned char key[sizeof(dev_t) + sizeof(ino_t)];
-  size_t key_len = build_dev_ino_key(device, inode, key);
-  // NOLINTNEXTLINE(bugprone-casting-through-void)
-  HASH_FIND(hh, state->file_mapping, key, key_len, entry);
+  CompressedFileMapping *entry =
+      get_compressed_file_mapping(device, inode, state);
   if (!entry)
     return -1;
   *logical_eof = entry->logical_eof;
@@ -169,11 +267,8 @@ int get_logical_eof_from_mapping(dev_t device, ino_t inode, LayerContext l,
  */
 int increment_open_counter(dev_t device, ino_t inode, LayerContext l) {
   CompressionState *state = (CompressionState *)l.internal_state;
-  CompressedFileMapping *entry = NULL;
-  unsigned char key[sizeof(dev_t) + sizeof(ino_t)];
-  size_t key_len = build_dev_ino_key(device, inode, key);
-  // NOLINTNEXTLINE(bugprone-casting-through-void)
-  HASH_FIND(hh, state->file_mapping, key, key_len, entry);
+  CompressedFileMapping *entry =
+      get_compressed_file_mapping(device, inode, state);
   if (!entry)
     return -1;
 
@@ -198,11 +293,8 @@ int increment_open_counter(dev_t device, ino_t inode, LayerContext l) {
  */
 int decrement_open_counter(dev_t device, ino_t inode, LayerContext l) {
   CompressionState *state = (CompressionState *)l.internal_state;
-  CompressedFileMapping *entry = NULL;
-  unsigned char key[sizeof(dev_t) + sizeof(ino_t)];
-  size_t key_len = build_dev_ino_key(device, inode, key);
-  // NOLINTNEXTLINE(bugprone-casting-through-void)
-  HASH_FIND(hh, state->file_mapping, key, key_len, entry);
+  CompressedFileMapping *entry =
+      get_compressed_file_mapping(device, inode, state);
   if (!entry)
     return -1;
 
@@ -229,11 +321,8 @@ int decrement_open_counter(dev_t device, ino_t inode, LayerContext l) {
 int mark_as_unlinked(dev_t device, ino_t inode, int *open_counter,
                      LayerContext l) {
   CompressionState *state = (CompressionState *)l.internal_state;
-  CompressedFileMapping *entry = NULL;
-  unsigned char key[sizeof(dev_t) + sizeof(ino_t)];
-  size_t key_len = build_dev_ino_key(device, inode, key);
-  // NOLINTNEXTLINE(bugprone-casting-through-void)
-  HASH_FIND(hh, state->file_mapping, key, key_len, entry);
+  CompressedFileMapping *entry =
+      get_compressed_file_mapping(device, inode, state);
   if (!entry)
     return -1;
 
@@ -259,11 +348,8 @@ int mark_as_unlinked(dev_t device, ino_t inode, int *open_counter,
  */
 int should_cleanup_mapping(dev_t device, ino_t inode, LayerContext l) {
   CompressionState *state = (CompressionState *)l.internal_state;
-  CompressedFileMapping *entry = NULL;
-  unsigned char key[sizeof(dev_t) + sizeof(ino_t)];
-  size_t key_len = build_dev_ino_key(device, inode, key);
-  // NOLINTNEXTLINE(bugprone-casting-through-void)
-  HASH_FIND(hh, state->file_mapping, key, key_len, entry);
+  CompressedFileMapping *entry =
+      get_compressed_file_mapping(device, inode, state);
   if (!entry)
     return -1;
 
@@ -301,6 +387,9 @@ int get_original_size_from_mapping(const char *path, LayerContext l,
 /**
  * @brief Get the total compressed size of a range of blocks
  *
+ * Blocks not scanned yet count as 0. Takes the sums of the whole chunks of
+ * the range from the Fenwick tree of the index.
+ *
  * @param initial_block_index -> initial block index
  * @param last_block_index -> last block index
  * @param block_index -> block index mapping
@@ -309,11 +398,12 @@ int get_original_size_from_mapping(const char *path, LayerContext l,
 size_t get_total_compressed_size(off_t initial_block_index,
                                  off_t last_block_index,
                                  CompressedFileMapping *file_mapping) {
-  size_t total_compressed_size = 0;
-  for (off_t i = initial_block_index; i <= last_block_index; i++) {
-    total_compressed_size += file_mapping->sizes[i];
+  if (last_block_index < initial_block_index) {
+    return 0;
   }
-  return total_compressed_size;
+  return (size_t)block_index_sum(file_mapping, (size_t)initial_block_index,
+                                 (size_t)last_block_index + 1)
+      .stored;
 }
 
 /**
@@ -327,82 +417,251 @@ size_t get_total_compressed_size(off_t initial_block_index,
  */
 CompressedFileMapping *get_compressed_file_mapping(dev_t device, ino_t inode,
                                                    CompressionState *state) {
-  unsigned char key[sizeof(dev_t) + sizeof(ino_t)];
-  size_t key_len = build_dev_ino_key(device, inode, key);
-  CompressedFileMapping *entry = NULL;
-  // NOLINTNEXTLINE(bugprone-casting-through-void)
-  HASH_FIND(hh, state->file_mapping, key, key_len, entry);
-  return entry;
+  if (state->file_mapping.count == 0) {
+    return NULL;
+  }
+  return find_slot(&state->file_mapping, device, inode)->mapping;
+}
+
+// Sums of one block index entry
+static BlockIndexSum entry_sum(BlockEntry entry) {
+  BlockIndexSum sum = {0};
+  uint32_t size = entry & BLOCK_ENTRY_SIZE_MASK;
+  if (size == BLOCK_ENTRY_UNKNOWN) {
+    sum.unknown = 1;
+  } else {
+    sum.stored = size;
+    sum.allocated = ((uint64_t)size + BLOCK_INDEX_ALLOC_UNIT - 1) /
+                    BLOCK_INDEX_ALLOC_UNIT * BLOCK_INDEX_ALLOC_UNIT;
+  }
+  return sum;
+}
+
+// a += b * times, a -= b * times; the sums wrap like any uint64_t, so a
+// difference added later is exact
+static void sum_add(BlockIndexSum *a, BlockIndexSum b, uint64_t times) {
+  a->stored += b.stored * times;
+  a->allocated += b.allocated * times;
+  a->unknown += b.unknown * times;
+}
+
+static void sum_sub(BlockIndexSum *a, BlockIndexSum b, uint64_t times) {
+  a->stored -= b.stored * times;
+  a->allocated -= b.allocated * times;
+  a->unknown -= b.unknown * times;
+}
+
+// Add delta to the sums of a chunk. Node i (1-based) of the tree holds the
+// chunks (i - lowbit(i), i].
+static void fenwick_add(CompressedFileMapping *mapping, size_t chunk,
+                        BlockIndexSum delta) {
+  size_t n = mapping->capacity / BLOCK_INDEX_CHUNK;
+  for (size_t i = chunk + 1; i <= n; i += i & -i) {
+    sum_add(&mapping->sums[i - 1], delta, 1);
+  }
+}
+
+// Sums of the chunks [0, end)
+static BlockIndexSum fenwick_prefix(const CompressedFileMapping *mapping,
+                                    size_t end) {
+  BlockIndexSum sum = {0};
+  for (size_t i = end; i > 0; i -= i & -i) {
+    sum_add(&sum, mapping->sums[i - 1], 1);
+  }
+  return sum;
 }
 
 /**
- * @brief Ensure block index arrays have sufficient capacity
+ * @brief Account the change of one entry of a chunk in the sums of the index
  *
- * This function ensures that the block index arrays (offsets, sizes,
- * is_uncompressed) have at least the required capacity. If the current
- * capacity is insufficient, it reallocates the arrays and initializes
- * new entries as sparse (size 0).
+ * @param mapping -> block index mapping
+ * @param chunk -> chunk of the entry
+ * @param old_entry -> entry before the change
+ * @param new_entry -> entry after the change
+ */
+void block_index_account(CompressedFileMapping *mapping, size_t chunk,
+                         BlockEntry old_entry, BlockEntry new_entry) {
+  BlockIndexSum delta = entry_sum(new_entry);
+  sum_sub(&delta, entry_sum(old_entry), 1);
+  fenwick_add(mapping, chunk, delta);
+}
+
+/**
+ * @brief Sums of the blocks [first, end) of the index
  *
- * @param block_index -> block index mapping to expand
- * @param required_blocks -> minimum number of blocks needed
- * @return int -> 0 on success, -1 on error
+ * Whole chunks come from the Fenwick tree, the entries of the partial chunks
+ * at the ends of the range are added one by one (or as one extent).
+ *
+ * @param mapping -> block index mapping
+ * @param first -> first block
+ * @param end -> block past the last one, at most the capacity of the index
+ * @return BlockIndexSum -> sums of the range
  */
-int ensure_block_index_capacity(CompressedFileMapping *block_index,
-                                size_t required_blocks) {
-  if (required_blocks <= block_index->capacity) {
-    // Already have enough capacity allocated
-    // Just update num_blocks if needed
-    if (required_blocks > block_index->num_blocks) {
-      block_index->num_blocks = required_blocks;
+BlockIndexSum block_index_sum(const CompressedFileMapping *mapping,
+                              size_t first, size_t end) {
+  BlockIndexSum sum = {0};
+  if (first >= end) {
+    return sum;
+  }
+  size_t first_chunk = (first + BLOCK_INDEX_CHUNK - 1) / BLOCK_INDEX_CHUNK;
+  size_t end_chunk = end / BLOCK_INDEX_CHUNK;
+  if (first_chunk >= end_chunk) {
+    // within one chunk, or two partial ones
+    for (size_t idx = first; idx < end; idx++) {
+      sum_add(&sum, entry_sum(block_entry(mapping, idx)), 1);
     }
-    return 0;
+    return sum;
   }
+  sum = fenwick_prefix(mapping, end_chunk);
+  sum_sub(&sum, fenwick_prefix(mapping, first_chunk), 1);
+  for (size_t idx = first; idx < first_chunk * BLOCK_INDEX_CHUNK; idx++) {
+    sum_add(&sum, entry_sum(block_entry(mapping, idx)), 1);
+  }
+  for (size_t idx = end_chunk * BLOCK_INDEX_CHUNK; idx < end; idx++) {
+    sum_add(&sum, entry_sum(block_entry(mapping, idx)), 1);
+  }
+  return sum;
+}
 
-  size_t old_capacity = block_index->capacity;
-
-  // Expand block index arrays to accommodate the required blocks
-  off_t *new_sizes =
-      (off_t *)realloc(block_index->sizes, required_blocks * sizeof(off_t));
-  if (!new_sizes) {
+/**
+ * @brief Give a uniform chunk of the block index its array of entries
+ *
+ * @param mapping -> block index mapping
+ * @param chunk -> chunk without an array
+ * @return int -> 0 on success, -1 on error
+ */
+int block_index_split_chunk(CompressedFileMapping *mapping, size_t chunk) {
+  BlockEntry *entries = malloc(BLOCK_INDEX_CHUNK * sizeof(BlockEntry));
+  if (!entries) {
     return -1;
   }
-
-  int *new_is_uncompressed = NULL;
-  if (block_index->is_uncompressed) {
-    new_is_uncompressed = (int *)realloc(block_index->is_uncompressed,
-                                         required_blocks * sizeof(int));
-  } else {
-    new_is_uncompressed = (int *)calloc(required_blocks, sizeof(int));
+  for (size_t i = 0; i < BLOCK_INDEX_CHUNK; i++) {
+    entries[i] = mapping->uniform[chunk];
   }
+  mapping->chunks[chunk] = entries;
+  return 0;
+}
 
-  if (!new_is_uncompressed) {
-    // First realloc succeeded, need to restore or free appropriately
-    if (new_sizes != block_index->sizes) {
-      free(new_sizes);
+/**
+ * @brief Free the array of a chunk of the block index whose entries are all
+ * the same, keeping that entry as the uniform of the chunk
+ *
+ * @param mapping -> block index mapping
+ * @param chunk -> chunk to fold
+ */
+void block_index_merge_chunk(CompressedFileMapping *mapping, size_t chunk) {
+  BlockEntry *entries = mapping->chunks[chunk];
+  if (!entries) {
+    return;
+  }
+  for (size_t i = 1; i < BLOCK_INDEX_CHUNK; i++) {
+    if (entries[i] != entries[0]) {
+      return;
     }
-    return -1;
   }
+  mapping->uniform[chunk] = entries[0];
+  mapping->chunks[chunk] = NULL;
+  free(entries);
+}
 
-  block_index->sizes = new_sizes;
-  block_index->is_uncompressed = new_is_uncompressed;
-
-  // Initialize new blocks as sparse (size 0) from old capacity
-  for (size_t i = old_capacity; i < required_blocks; i++) {
-    new_sizes[i] = 0;
-    new_is_uncompressed[i] = 0;
+/**
+ * @brief Set count blocks from first to the same stored size and raw flag
+ *
+ * Whole chunks of the range become uniform without visiting their entries.
+ *
+ * @param mapping -> block index mapping, with the capacity for the range
+ * @param first -> first block
+ * @param count -> number of blocks
+ * @param stored_size -> stored size, or BLOCK_SIZE_UNKNOWN
+ * @param raw -> 1 if the blocks are stored uncompressed
+ * @return int -> 0 on success, -1 on error
+ */
+int block_index_fill(CompressedFileMapping *mapping, size_t first,
+                     size_t count, off_t stored_size, int raw) {
+  size_t idx = first;
+  size_t end = first + count;
+  while (idx < end) {
+    size_t c = idx / BLOCK_INDEX_CHUNK;
+    if (idx % BLOCK_INDEX_CHUNK == 0 && end - idx >= BLOCK_INDEX_CHUNK) {
+      BlockIndexSum delta = {0};
+      BlockEntry entry = block_entry_encode(stored_size, raw);
+      sum_add(&delta, entry_sum(entry), BLOCK_INDEX_CHUNK);
+      sum_sub(&delta, block_index_sum(mapping, idx, idx + BLOCK_INDEX_CHUNK),
+              1);
+      fenwick_add(mapping, c, delta);
+      free(mapping->chunks[c]);
+      mapping->chunks[c] = NULL;
+      mapping->uniform[c] = entry;
+      idx += BLOCK_INDEX_CHUNK;
+      continue;
+    }
+    if (block_set(mapping, idx, stored_size, raw) != 0) {
+      return -1;
+    }
+    idx++;
   }
+  return 0;
+}
 
-  block_index->num_blocks = required_blocks;
-  block_index->capacity = required_blocks;
+/**
+ * @brief Ensure the block index has sufficient capacity
+ *
+ * Adds chunks of BLOCK_INDEX_CHUNK entries until the index holds at least
+ * required_blocks entries. New chunks are uniformly sparse (size 0) and get
+ * an array when a block is set in them. Existing chunks are not moved, only
+ * the small arrays of chunk pointers, uniforms and sums are reallocated.
+ *
+ * @param block_index -> block index mapping to expand
+ * @param required_blocks -> minimum number of blocks needed
+ * @return int -> 0 on success, -1 on error
+ */
+int ensure_block_index_capacity(CompressedFileMapping *block_index,
+                                size_t required_blocks) {
+  if (required_blocks > block_index->capacity) {
+    size_t old_chunks = block_index->capacity / BLOCK_INDEX_CHUNK;
+    size_t new_chunks =
+        (required_blocks + BLOCK_INDEX_CHUNK - 1) / BLOCK_INDEX_CHUNK;
+    BlockEntry **chunks =
+        realloc(block_index->chunks, new_chunks * sizeof(BlockEntry *));
+    if (!chunks) {
+      return -1;
+    }
+    block_index->chunks = chunks;
+    BlockEntry *uniform =
+        realloc(block_index->uniform, new_chunks * sizeof(BlockEntry));
+    if (!uniform) {
+      return -1;
+    }
+    block_index->uniform = uniform;
+    BlockIndexSum *sums =
+        realloc(block_index->sums, new_chunks * sizeof(BlockIndexSum));
+    if (!sums) {
+      return -1;
+    }
+    block_index->sums = sums;
+    for (size_t c = old_chunks; c < new_chunks; c++) {
+      chunks[c] = NULL;
+      uniform[c] = 0;
+      // node c + 1 covers chunks (c + 1 - lowbit, c], all but the new one
+      // already in the tree
+      size_t node = c + 1;
+      sums[c] = fenwick_prefix(block_index, c);
+      sum_sub(&sums[c], fenwick_prefix(block_index, node - (node & -node)), 1);
+      block_index->capacity = node * BLOCK_INDEX_CHUNK;
+    }
+  }
 
+  if (required_blocks > block_index->num_blocks) {
+    block_index->num_blocks = required_blocks;
+  }
   return 0;
 }
 
 /**
  * @brief Remove a file's block index mapping and free all associated memory
  *
- * This function removes the CompressedFileMapping entry for the specified file
- * and frees all dynamically allocated arrays (sizes, is_uncompressed).
+ * This function removes the CompressedFileMapping entry for the specified file,
+ * frees its block index and returns the entry to the pool of the table.
  *
  * @param device -> device id
  * @param inode -> inode number
@@ -411,28 +670,43 @@ int ensure_block_index_capacity(CompressedFileMapping *block_index,
  */
 int remove_compressed_file_mapping(dev_t device, ino_t inode, LayerContext l) {
   CompressionState *state = (CompressionState *)l.internal_state;
-  CompressedFileMapping *entry =
-      get_compressed_file_mapping(device, inode, state);
-  if (!entry)
+  FileMappingTable *table = &state->file_mapping;
+  if (table->count == 0)
+    return -1;
+  FileMappingSlot *slot = find_slot(table, device, inode);
+  if (!slot->mapping)
     return -1;
 
-  // Free dynamically allocated arrays
-  if (entry->sizes) {
-    free(entry->sizes);
-  }
-  if (entry->is_uncompressed) {
-    free(entry->is_uncompressed);
-  }
-
-  // Remove from hash table
-  // NOLINTNEXTLINE(bugprone-casting-through-void)
-  HASH_DEL(state->file_mapping, entry);
+  // The inode may be reused by another file
+  block_cache_invalidate(state->block_cache, device, inode, 0, SIZE_MAX);
 
-  // Free the entry itself
-  free(entry);
+  release_mapping(table, slot->mapping);
+  clear_slot(table, slot);
+  table->count--;
   return 0;
 }
 
+/**
+ * @brief Free every file mapping, the table and its pool
+ *
+ * @param state -> compression state
+ */
+void destroy_compressed_file_mappings(CompressionState *state) {
+  FileMappingTable *table = &state->file_mapping;
+  for (size_t i = 0; i < table->capacity; i++) {
+    if (table->slots[i].mapping) {
+      release_mapping(table, table->slots[i].mapping);
+    }
+  }
+  free(table->slots);
+  while (table->slabs) {
+    FileMappingSlab *next = table->slabs->next;
+    free(table->slabs);
+    table->slabs = next;
+  }
+  memset(table, 0, sizeof(FileMappingTable));
+}
+
 int get_file_key_from_fd(int fd, LayerContext l, dev_t *device, ino_t *inode) {
   CompressionState *state = (CompressionState *)l.internal_state;
   if (!is_valid_compression_fd(fd)) {
@@ -464,8 +738,8 @@ int get_file_key_from_fd(int fd, LayerContext l, dev_t *device, ino_t *inode) {
  * @return FdToInode* Entry if found, NULL otherwise
  */
 FdToInode *fd_to_inode_lookup(CompressionState *state, int fd) {
-  FdToInode *entry = &state->fd_to_inode[fd];
-  if (entry->fd == INVALID_FD) {
+  FdToInode *entry = fd_table_get(&state->fd_to_inode, fd);
+  if (!entry || entry->fd == INVALID_FD) {
     DEBUG_MSG("[COMPRESSION_UTILS: FD_TO_INODE_LOOKUP] fd=%d, found=NO, "
               "entry=(nil) - slot empty",
               fd);
@@ -495,8 +769,14 @@ int fd_to_inode_insert(CompressionState *state, int fd, dev_t device,
     return -1;
   }
 
-  // Get direct access to array slot
-  FdToInode *entry = &state->fd_to_inode[fd];
+  // Get direct access to the table slot
+  FdToInode *entry = fd_table_slot(&state->fd_to_inode, fd);
+  if (!entry) {
+    ERROR_MSG("[COMPRESSION_UTILS: FD_TO_INODE_INSERT] No slot for file "
+              "descriptor %d",
+              fd);
+    return -1;
+  }
 
   // Duplicate path
   entry->path = strdup(path);
@@ -514,6 +794,31 @@ int fd_to_inode_insert(CompressionState *state, int fd, dev_t device,
   return 0;
 }
 
+/**
+ * @brief Path of the file open as fd
+ *
+ * @param state Compression state
+ * @param fd File descriptor to look up
+ * @return char* Path owned by the entry, NULL if fd is not open
+ */
+char *fd_to_inode_path(CompressionState *state, int fd) {
+  FdToInode *entry = fd_to_inode_lookup(state, fd);
+  return entry ? entry->path : NULL;
+}
+
+/**
+ * @brief Set an FdToInode entry to an empty slot (fd table entry initializer)
+ *
+ * @param entry FdToInode to clear
+ */
+void fd_to_inode_clear(void *entry) {
+  FdToInode *fd_entry = entry;
+  fd_entry->fd = INVALID_FD;
+  fd_entry->path = NULL;
+  fd_entry->device = 0;
+  fd_entry->inode = 0;
+}
+
 /**
  * @brief Remove an FdToInode entry by file descriptor
  *
@@ -536,10 +841,7 @@ int fd_to_inode_remove(CompressionState *state, int fd) {
   }
 
   // Clear the slot
-  entry->fd = INVALID_FD;
-  entry->path = NULL;
-  entry->device = 0;
-  entry->inode = 0;
+  fd_to_inode_clear(entry);
 
   DEBUG_MSG(
       "[COMPRESSION_UTILS: FD_TO_INODE_REMOVE] Removed fd=%d from slot=%d", fd,
@@ -548,6 +850,27 @@ int fd_to_inode_remove(CompressionState *state, int fd) {
   return 0;
 }
 
+/**
+ * @brief Decompress a bare block, which records neither its uncompressed size
+ * nor a checksum
+ *
+ * A block stored raw may begin like a bare block header; it does not decode.
+ *
+ * @return off_t -> uncompressed size, -1 if the block does not decode
+ */
+static off_t bare_block_decodes(CompressionState *state, const uint8_t *block,
+                                size_t stored_size, size_t block_size) {
+  uint8_t *out = (uint8_t *)malloc(block_size);
+  if (!out) {
+    return -1;
+  }
+  size_t out_size = block_size;
+  ssize_t res = compressor_decompress_block(&state->compressor, block,
+                                            stored_size, out, &out_size);
+  free(out);
+  return res < 0 ? -1 : (off_t)res;
+}
+
 /**
  * @brief Process a single block during rebuild: read, detect format, and set
  * metadata
@@ -590,25 +913,35 @@ static int process_block_for_rebuild(int fd, size_t block_idx,
 
   if (read_res == 0) {
     // Sparse block - no data
-    bim->sizes[block_idx] = 0;
-    bim->is_uncompressed[block_idx] = 0;
     free(block_buffer);
-    return 0;
+    return block_set(bim, block_idx, 0, 0);
   }
 
   // Need at least 4 bytes to detect format
   if ((size_t)read_res < 4) {
     // Too small, must be uncompressed
-    bim->sizes[block_idx] = read_res;
-    bim->is_uncompressed[block_idx] = 1;
     free(block_buffer);
+    if (block_set(bim, block_idx, read_res, 1) != 0) {
+      return -1;
+    }
     DEBUG_MSG("[COMPRESSION_UTILS: REBUILD_MAPPING] Block %zu: uncompressed, "
               "size=%zu",
               block_idx, read_res);
     return 0;
   }
 
-  if (state->compressor.detect_format(block_buffer, (size_t)read_res) == 0) {
+  size_t bare_size = 0;
+  int set_res;
+  if (compressor_detect_block(&state->compressor, block_buffer,
+                              (size_t)read_res, &bare_size) == 0 &&
+      bare_block_decodes(state, block_buffer, bare_size, block_size) >= 0) {
+    // Block is compressed, without a frame
+    set_res = block_set(bim, block_idx, (off_t)bare_size, 0);
+    DEBUG_MSG("[COMPRESSION_UTILS: REBUILD_MAPPING] Block %zu: bare, "
+              "size=%zu",
+              block_idx, bare_size);
+  } else if (state->compressor.detect_format(block_buffer, (size_t)read_res) ==
+             0) {
     // Block is compressed
     size_t compressed_size = 0;
     int res = state->compressor.get_compressed_size(
@@ -620,23 +953,21 @@ static int process_block_for_rebuild(int fd, size_t block_idx,
       return -1;
     }
 
-    bim->sizes[block_idx] = (off_t)compressed_size;
-    bim->is_uncompressed[block_idx] = 0;
+    set_res = block_set(bim, block_idx, (off_t)compressed_size, 0);
 
     DEBUG_MSG("[COMPRESSION_UTILS: REBUILD_MAPPING] Block %zu: compressed, "
               "size=%zu",
               block_idx, compressed_size);
   } else {
     // Block is uncompressed
-    bim->sizes[block_idx] = read_res;
-    bim->is_uncompressed[block_idx] = 1;
+    set_res = block_set(bim, block_idx, read_res, 1);
     DEBUG_MSG("[COMPRESSION_UTILS: REBUILD_MAPPING] Block %zu: uncompressed, "
               "size=%zu",
               block_idx, read_res);
   }
 
   free(block_buffer);
-  return 0;
+  return set_res;
 }
 
 /**
@@ -676,8 +1007,13 @@ static off_t get_compressed_block_logical_size(int fd, off_t phys_offset,
     return -1;
   }
 
+  size_t bare_size = 0;
   off_t uncompressed_size =
-      state->compressor.get_original_file_size(block_buffer, compressed_size);
+      compressor_detect_block(&state->compressor, block_buffer,
+                              compressed_size, &bare_size) == 0
+          ? bare_block_decodes(state, block_buffer, compressed_size, block_size)
+          : state->compressor.get_original_file_size(block_buffer,
+                                                     compressed_size);
   free(block_buffer);
 
   if (uncompressed_size < 0) {
@@ -690,14 +1026,15 @@ static off_t get_compressed_block_logical_size(int fd, off_t phys_offset,
 }
 
 /**
- * @brief Rebuild BlockIndexMapping by scanning stored blocks
+ * @brief Rebuild BlockIndexMapping from the stored blocks
  *
  * This function recovers block metadata after a crash by reading block
  * headers from storage. It reconstructs the BlockIndexMapping for a file by:
  * 1. Getting the physical file size
- * 2. Scanning each block position in the sparse layout
- * 3. Reading and parsing block headers
- * 4. Rebuilding the sizes, and is_uncompressed arrays
+ * 2. Marking every block of the sparse layout as BLOCK_SIZE_UNKNOWN
+ * 3. Reading and parsing the header of the last block for the logical EOF
+ *
+ * The other blocks are scanned on first access, see scan_block_range.
  *
  * @param fd File descriptor of the compressed file
  * @param device Device ID
@@ -761,17 +1098,13 @@ int rebuild_block_mapping_from_storage(int fd, dev_t device, ino_t inode,
     return 0;
   }
 
-  // Scan all blocks except the last one (which may be partial)
-  // Process blocks 0 to max_blocks-2 (all assumed to be full blocks)
+  // All blocks except the last one (which may be partial) are scanned lazily
   size_t last_block_idx = max_blocks - 1;
 
-  for (size_t block_idx = 0; block_idx < last_block_idx; block_idx++) {
-    off_t phys_offset = (off_t)(block_idx * block_size);
-
-    if (process_block_for_rebuild(fd, block_idx, phys_offset, block_size, bim,
-                                  l) < 0) {
-      return -1;
-    }
+  if (block_index_fill(bim, 0, last_block_idx, BLOCK_SIZE_UNKNOWN, 0) != 0) {
+    ERROR_MSG("[COMPRESSION_UTILS: REBUILD_MAPPING] Failed to allocate block "
+              "index arrays");
+    return -1;
   }
 
   // Handle the last block separately (may be partial)
@@ -782,8 +1115,9 @@ int rebuild_block_mapping_from_storage(int fd, dev_t device, ino_t inode,
   // Check if there's any data at this position
   if (physical_eof <= last_block_phys_offset) {
     // No data → sparse block
-    bim->sizes[last_block_idx] = 0;
-    bim->is_uncompressed[last_block_idx] = 0;
+    if (block_set(bim, last_block_idx, 0, 0) != 0) {
+      return -1;
+    }
     // logical_eof remains unchanged (no data in last block)
     logical_eof = physical_eof;
   } else {
@@ -794,9 +1128,10 @@ int rebuild_block_mapping_from_storage(int fd, dev_t device, ino_t inode,
     }
 
     // Calculate logical_eof based on block metadata
-    if (bim->is_uncompressed[last_block_idx]) {
-      // Uncompressed: logical size is stored in bim->sizes[last_block_idx]
-      logical_eof = last_block_logical_start + bim->sizes[last_block_idx];
+    if (block_is_raw(bim, last_block_idx)) {
+      // Uncompressed: the stored size is the logical size
+      logical_eof =
+          last_block_logical_start + block_stored_size(bim, last_block_idx);
 
       // Validate logical EOF matches physical EOF for uncompressed blocks
       if (logical_eof != physical_eof) {
@@ -807,7 +1142,7 @@ int rebuild_block_mapping_from_storage(int fd, dev_t device, ino_t inode,
       }
     } else {
       // Compressed: need to read block again to get uncompressed size
-      size_t compressed_size = (size_t)bim->sizes[last_block_idx];
+      size_t compressed_size = (size_t)block_stored_size(bim, last_block_idx);
       off_t uncompressed_size = get_compressed_block_logical_size(
           fd, last_block_phys_offset, compressed_size, block_size, l);
       if (uncompressed_size < 0) {
@@ -835,12 +1170,81 @@ int rebuild_block_mapping_from_storage(int fd, dev_t device, ino_t inode,
 }
 
 /**
- * @brief Shrink block index arrays and update
+ * @brief Scan the blocks of a range whose size is still BLOCK_SIZE_UNKNOWN
+ *
+ * Blocks past num_blocks are ignored. When fd is not readable, the blocks are
+ * read through a read-only descriptor opened on path.
+ *
+ * @warning Caller must hold the write lock of the file.
+ *
+ * @param fd File descriptor of the compressed file
+ * @param path Path of the file in the next layer, or NULL to skip the retry
+ * @param bim Block index mapping to update
+ * @param first First block of the range
+ * @param last Last block of the range (inclusive)
+ * @param l Layer context
+ * @return 0 on success, -1 on failure
+ */
+int scan_block_range(int fd, const char *path, CompressedFileMapping *bim,
+                     size_t first, size_t last, LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const LayerContext *next = l.next_layers;
+  size_t block_size = state->block_size;
+  int rfd = -1;
+
+  for (size_t idx = first; idx <= last && idx < bim->num_blocks; idx++) {
+    if (block_stored_size(bim, idx) != BLOCK_SIZE_UNKNOWN) {
+      continue;
+    }
+    off_t phys_offset = (off_t)(idx * block_size);
+    int res = process_block_for_rebuild(rfd >= 0 ? rfd : fd, idx, phys_offset,
+                                        block_size, bim, l);
+    if (res < 0 && rfd < 0 && path) {
+      rfd = next->ops->lopen(path, O_RDONLY, 0, *next);
+      if (rfd >= 0) {
+        res = process_block_for_rebuild(rfd, idx, phys_offset, block_size, bim,
+                                        l);
+      }
+    }
+    if (res < 0) {
+      if (rfd >= 0) {
+        next->ops->lclose(rfd, *next);
+      }
+      return -1;
+    }
+    // The index file gets the scanned block on its next flush
+    bim->index_dirty = 1;
+  }
+  if (rfd >= 0) {
+    next->ops->lclose(rfd, *next);
+  }
+  return 0;
+}
+
+/**
+ * @brief Check whether a range has blocks that were not scanned yet
+ *
+ * @param bim Block index mapping
+ * @param first First block of the range
+ * @param last Last block of the range (inclusive)
+ * @return 1 if a block of the range is BLOCK_SIZE_UNKNOWN, 0 otherwise
+ */
+int has_unscanned_blocks(const CompressedFileMapping *bim, size_t first,
+                         size_t last) {
+  for (size_t idx = first; idx <= last && idx < bim->num_blocks; idx++) {
+    if (block_stored_size(bim, idx) == BLOCK_SIZE_UNKNOWN) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Shrink the block index and update the number of blocks
  *
- * This function updates the number of blocks and the capacity of the block
- * index mapping. Only shrinks the is_uncompressed and sizes arrays if the new
- * size is less than 50% of current capacity to avoid frequent small
- * reallocations.
+ * Frees the chunks past the last one still needed and clears the entries
+ * past required_blocks in that chunk, so that they read as sparse if the
+ * file grows again.
  *
  * @param block_index Block index mapping to update
  * @param required_blocks Number of blocks actually needed
@@ -848,57 +1252,134 @@ int rebuild_block_mapping_from_storage(int fd, dev_t device, ino_t inode,
  */
 int shrink_block_index(CompressedFileMapping *block_index,
                        size_t required_blocks) {
-  size_t current_capacity = block_index->capacity;
-
-  // Only shrink if new size is less than 50% of current capacity
-  // This avoids frequent small reallocations while reclaiming memory for
-  // significant truncations
   if (required_blocks == 0) {
-    // Truncate to zero - always shrink
-    if (block_index->sizes) {
-      free(block_index->sizes);
-      block_index->sizes = NULL;
-    }
-    if (block_index->is_uncompressed) {
-      free(block_index->is_uncompressed);
-      block_index->is_uncompressed = NULL;
-    }
-    block_index->num_blocks = 0;
-    block_index->capacity = 0;
+    // Truncate to zero - always free the index
+    free_block_index(block_index);
+    return 0;
+  }
+  if (required_blocks >= block_index->capacity) {
+    block_index->num_blocks = required_blocks;
     return 0;
   }
 
-  if (required_blocks * 2 < current_capacity && current_capacity > 0) {
-    // Significant reduction - shrink arrays
-    off_t *new_sizes =
-        (off_t *)realloc(block_index->sizes, required_blocks * sizeof(off_t));
-    if (!new_sizes && required_blocks > 0) {
+  size_t kept_chunks =
+      (required_blocks + BLOCK_INDEX_CHUNK - 1) / BLOCK_INDEX_CHUNK;
+  size_t used = required_blocks % BLOCK_INDEX_CHUNK;
+  if (used != 0 &&
+      block_index_fill(block_index, required_blocks, BLOCK_INDEX_CHUNK - used,
+                       0, 0) != 0) {
+    return -1;
+  }
+  // the nodes of the kept chunks do not cover the chunks past them
+  for (size_t c = kept_chunks; c < block_index->capacity / BLOCK_INDEX_CHUNK;
+       c++) {
+    free(block_index->chunks[c]);
+    block_index->chunks[c] = NULL;
+  }
+  block_index->capacity = kept_chunks * BLOCK_INDEX_CHUNK;
+  block_index->num_blocks = required_blocks;
+  return 0;
+}
+
+/**
+ * @brief Compress data and decide whether to store it compressed or raw,
+ * without recording the decision in the policy
+ *
+ * Only reads the policy, so the blocks of one write can be compressed
+ * concurrently. Same buffers as compress_or_store_raw().
+ *
+ * @param out_tried -> receives 1 if the data was compressed, 0 if the policy
+ * stored it raw without trying
+ * @return int -> 0 on success, -1 on failure
+ */
+int compress_block(CompressionState *state, const CompressionPolicy *policy,
+                   const void *data, size_t data_size, void **out_buffer,
+                   size_t *out_size, int *out_is_uncompressed,
+                   int *out_tried) {
+  int level = state->compressor.level;
+  int tried = policy_should_compress(state, policy, data, data_size, &level);
+
+  uint8_t *compressed = NULL;
+  ssize_t comp_size = -1;
+  if (tried && state->bare_blocks && data_size > 0) {
+    // a bare block is only kept if smaller than the data, no bound needed
+    compressed = (uint8_t *)malloc(data_size);
+    if (!compressed) {
       return -1;
     }
-
-    int *new_is_uncompressed = NULL;
-    if (block_index->is_uncompressed) {
-      new_is_uncompressed = (int *)realloc(block_index->is_uncompressed,
-                                           required_blocks * sizeof(int));
-      if (!new_is_uncompressed && required_blocks > 0) {
-        // Realloc failed for is_uncompressed, but sizes succeeded
-        // Restore original sizes if it was reallocated
-        if (new_sizes != block_index->sizes) {
-          free(new_sizes);
-        }
-        return -1;
-      }
+    comp_size = compressor_compress_block(&state->compressor, data, data_size,
+                                          compressed, data_size - 1, level);
+    if (comp_size < 0) {
+      free(compressed);
+      return -1;
     }
+    if (comp_size == 0) {
+      comp_size = (ssize_t)data_size; // did not fit, stored raw
+    }
+  } else if (tried) {
+    size_t max_comp = state->compressor.get_compress_bound(data_size, level);
+    compressed = (uint8_t *)malloc(max_comp);
+    if (!compressed) {
+      return -1;
+    }
+    comp_size = level == state->compressor.level
+                    ? compressor_compress(&state->compressor, data, data_size,
+                                          compressed, max_comp)
+                    : state->compressor.compress_data(data, data_size,
+                                                      compressed, max_comp,
+                                                      level);
+    if (comp_size < 0) {
+      free(compressed);
+      return -1;
+    }
+  }
 
-    block_index->sizes = new_sizes;
-    block_index->is_uncompressed = new_is_uncompressed;
-    block_index->capacity = required_blocks;
-    block_index->num_blocks = required_blocks;
+  // If compression is not beneficial (compressed >= original), store
+  // uncompressed
+  if (!tried || (size_t)comp_size >= data_size) {
+    free(compressed);
+    // Allocate a copy of the original data
+    void *uncompressed_copy = malloc(data_size);
+    if (!uncompressed_copy) {
+      return -1;
+    }
+    memcpy(uncompressed_copy, data, data_size);
+    *out_buffer = uncompressed_copy;
+    *out_size = data_size;
+    *out_is_uncompressed = 1;
   } else {
-    // Just update num_blocks without reallocating
-    // Capacity remains the same
-    block_index->num_blocks = required_blocks;
+    *out_buffer = compressed;
+    *out_size = (size_t)comp_size;
+    *out_is_uncompressed = 0;
   }
+  *out_tried = tried;
+  return 0;
+}
 
+/**
+ * @brief Compress data and decide whether to store it compressed or raw
+ *
+ * Always returns a buffer ready to write in *out_buffer (caller must free).
+ * If compression is not beneficial, or the adaptive policy of the file skips
+ * it, returns a copy of the original data.
+ *
+ * @param state -> compression state
+ * @param policy -> adaptive policy of the file, NULL to always compress
+ * @param data -> data to compress
+ * @param data_size -> size of the data
+ * @param out_buffer -> receives the buffer to store
+ * @param out_size -> receives the size of the buffer to store
+ * @param out_is_uncompressed -> receives 1 if the data is stored raw
+ * @return int -> 0 on success, -1 on failure
+ */
+int compress_or_store_raw(CompressionState *state, CompressionPolicy *policy,
+                          const void *data, size_t data_size, void **out_buffer,
+                          size_t *out_size, int *out_is_uncompressed) {
+  int tried = 0;
+  if (compress_block(state, policy, data, data_size, out_buffer, out_size,
+                     out_is_uncompressed, &tried) != 0) {
+    return -1;
+  }
+  policy_record(state, policy, data_size, *out_size, tried);
   return 0;
 }
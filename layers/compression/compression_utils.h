@@ -30,11 +30,20 @@ size_t get_total_compressed_size(off_t initial_block_index,
                                  CompressedFileMapping *file_mapping);
 CompressedFileMapping *get_compressed_file_mapping(dev_t device, ino_t inode,
                                                    CompressionState *state);
+int block_index_fill(CompressedFileMapping *mapping, size_t first,
+                     size_t count, off_t stored_size, int raw);
 int ensure_block_index_capacity(CompressedFileMapping *block_index,
                                 size_t required_blocks);
 int shrink_block_index(CompressedFileMapping *block_index,
                        size_t required_blocks);
 int remove_compressed_file_mapping(dev_t device, ino_t inode, LayerContext l);
+void destroy_compressed_file_mappings(CompressionState *state);
+int compress_block(CompressionState *state, const CompressionPolicy *policy,
+                   const void *data, size_t data_size, void **out_buffer,
+                   size_t *out_size, int *out_is_uncompressed, int *out_tried);
+int compress_or_store_raw(CompressionState *state, CompressionPolicy *policy,
+                          const void *data, size_t data_size, void **out_buffer,
+                          size_t *out_size, int *out_is_uncompressed);
 
 // Helper to extract (device,inode) from fd via lower layer
 int get_file_key_from_fd(int fd, LayerContext l, dev_t *device, ino_t *inode);
@@ -44,6 +53,8 @@ FdToInode *fd_to_inode_lookup(CompressionState *state, int fd);
 int fd_to_inode_insert(CompressionState *state, int fd, dev_t device,
                        ino_t inode, const char *path);
 int fd_to_inode_remove(CompressionState *state, int fd);
+char *fd_to_inode_path(CompressionState *state, int fd);
+void fd_to_inode_clear(void *entry);
 
 // --- Backward-compat wrappers (to be removed after full migration) ---
 int set_original_size_in_file_size_mapping(const char *path,
@@ -54,4 +65,8 @@ int get_original_size_from_mapping(const char *path, LayerContext l,
 // Crash recovery: rebuild mappings from storage
 int rebuild_block_mapping_from_storage(int fd, dev_t device, ino_t inode,
                                        LayerContext l);
+int scan_block_range(int fd, const char *path, CompressedFileMapping *bim,
+                     size_t first, size_t last, LayerContext l);
+int has_unscanned_blocks(const CompressedFileMapping *bim, size_t first,
+                         size_t last);
 #endif
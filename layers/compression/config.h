@@ -8,6 +8,8 @@
 typedef enum {
   COMPRESSION_MODE_FILE,
   COMPRESSION_MODE_SPARSE_BLOCK,
+  COMPRESSION_MODE_SEEKABLE,
+  COMPRESSION_MODE_APPEND_BLOCK,
 } compression_mode_t;
 
 // Compression layer configuration structure
@@ -16,8 +18,21 @@ typedef struct {
   int level;
   char *next_layer;
   compression_mode_t mode; // file or block mode
-  int block_size;          // required for block mode (bytes)
+  int block_size; // required for block mode, frame size in seekable (bytes)
   int free_space; // option: enable fallocate punch (only for sparse_block)
+  int index_file; // option: persist the block index (only for sparse_block)
+  int bare_blocks; // option: blocks without frames (only for sparse_block)
+  char *dictionary; // optional: path of a trained dictionary (only for zstd)
+  int adaptive;     // option: adaptive compression policy (block modes)
+  int workers; // option: threads compressing one request (sparse_block), or
+               // one file (zstd file mode)
+  int long_distance; // option: long distance matching (only zstd file mode)
+  int window_log;    // option: log2 of the match window (zstd file mode)
+  int block_cache; // option: decompressed blocks cached (only sparse_block)
+  int compaction;  // option: background compaction (sparse_block, free_space)
+  int compaction_threshold; // option: wasted percent that schedules it
+  int compaction_rate;      // option: blocks compacted per second at most
+  int compaction_idle_ms;   // option: time without I/O before compacting
 } CompressionConfig;
 
 /**
@@ -62,14 +77,21 @@ static inline void compression_parse_params(toml_datum_t layer_table,
       config->mode = COMPRESSION_MODE_FILE;
     } else if (strcmp(mode.u.s, "sparse_block") == 0) {
       config->mode = COMPRESSION_MODE_SPARSE_BLOCK;
+    } else if (strcmp(mode.u.s, "seekable") == 0) {
+      config->mode = COMPRESSION_MODE_SEEKABLE;
+    } else if (strcmp(mode.u.s, "append_block") == 0) {
+      config->mode = COMPRESSION_MODE_APPEND_BLOCK;
     } else {
-      toml_error("Unsupported compression mode (use 'file' or "
-                 "'sparse_block')");
+      toml_error("Unsupported compression mode (use 'file', 'sparse_block', "
+                 "'seekable' or 'append_block')");
     }
   } else {
     toml_error("Invalid compression mode field");
   }
 
+  // Parse dictionary (optional)
+  config->dictionary = parse_string(toml_get(layer_table, "dictionary"));
+
   // Parse block_size (optional for file, recommended for block)
   config->block_size = 4096; // sensible default
   toml_datum_t block_size = toml_get(layer_table, "block_size");
@@ -77,15 +99,81 @@ static inline void compression_parse_params(toml_datum_t layer_table,
     config->block_size = (int)block_size.u.int64;
   }
 
-  // Parse options table (currently only free_space) valid for sparse_block
+  // Parse options table: adaptive is valid for the block modes, free_space,
+  // index_file, bare_blocks, workers, block_cache and compaction for
+  // sparse_block, and
+  // workers, long_distance and window_log for file mode
   config->free_space = 0; // default disabled
-  if (config->mode == COMPRESSION_MODE_SPARSE_BLOCK) {
-    toml_datum_t options = toml_get(layer_table, "options");
-    if (options.type == TOML_TABLE) {
-      toml_datum_t free_space = toml_get(options, "free_space");
-      if (free_space.type == TOML_BOOLEAN) {
-        config->free_space = free_space.u.boolean ? 1 : 0;
-      }
+  config->index_file = 0; // default disabled
+  config->bare_blocks = 0; // default frames
+  config->adaptive = 0;   // default disabled
+  config->workers = 0;    // default on the calling thread
+  config->long_distance = 0; // default disabled
+  config->window_log = 0;    // default from the level
+  config->block_cache = 0; // default disabled
+  config->compaction = 0;  // default disabled
+  config->compaction_threshold = 25;
+  config->compaction_rate = 4096;
+  config->compaction_idle_ms = 1000;
+  toml_datum_t options = toml_get(layer_table, "options");
+  if (config->mode != COMPRESSION_MODE_FILE && options.type == TOML_TABLE) {
+    toml_datum_t adaptive = toml_get(options, "adaptive");
+    if (adaptive.type == TOML_BOOLEAN) {
+      config->adaptive = adaptive.u.boolean ? 1 : 0;
+    }
+  }
+  if (config->mode == COMPRESSION_MODE_FILE && options.type == TOML_TABLE) {
+    toml_datum_t workers = toml_get(options, "workers");
+    if (workers.type == TOML_INT64 && workers.u.int64 > 0) {
+      config->workers = (int)workers.u.int64;
+    }
+    toml_datum_t long_distance = toml_get(options, "long_distance");
+    if (long_distance.type == TOML_BOOLEAN) {
+      config->long_distance = long_distance.u.boolean ? 1 : 0;
+    }
+    toml_datum_t window_log = toml_get(options, "window_log");
+    if (window_log.type == TOML_INT64 && window_log.u.int64 > 0) {
+      config->window_log = (int)window_log.u.int64;
+    }
+  }
+  if (config->mode == COMPRESSION_MODE_SPARSE_BLOCK &&
+      options.type == TOML_TABLE) {
+    toml_datum_t free_space = toml_get(options, "free_space");
+    if (free_space.type == TOML_BOOLEAN) {
+      config->free_space = free_space.u.boolean ? 1 : 0;
+    }
+    toml_datum_t index_file = toml_get(options, "index_file");
+    if (index_file.type == TOML_BOOLEAN) {
+      config->index_file = index_file.u.boolean ? 1 : 0;
+    }
+    toml_datum_t bare_blocks = toml_get(options, "bare_blocks");
+    if (bare_blocks.type == TOML_BOOLEAN) {
+      config->bare_blocks = bare_blocks.u.boolean ? 1 : 0;
+    }
+    toml_datum_t workers = toml_get(options, "workers");
+    if (workers.type == TOML_INT64 && workers.u.int64 > 0) {
+      config->workers = (int)workers.u.int64;
+    }
+    toml_datum_t block_cache = toml_get(options, "block_cache");
+    if (block_cache.type == TOML_INT64 && block_cache.u.int64 > 0) {
+      config->block_cache = (int)block_cache.u.int64;
+    }
+    toml_datum_t compaction = toml_get(options, "compaction");
+    if (compaction.type == TOML_BOOLEAN) {
+      config->compaction = compaction.u.boolean ? 1 : 0;
+    }
+    toml_datum_t threshold = toml_get(options, "compaction_threshold");
+    if (threshold.type == TOML_INT64 && threshold.u.int64 > 0 &&
+        threshold.u.int64 <= 100) {
+      config->compaction_threshold = (int)threshold.u.int64;
+    }
+    toml_datum_t rate = toml_get(options, "compaction_rate");
+    if (rate.type == TOML_INT64 && rate.u.int64 > 0) {
+      config->compaction_rate = (int)rate.u.int64;
+    }
+    toml_datum_t idle_ms = toml_get(options, "compaction_idle_ms");
+    if (idle_ms.type == TOML_INT64 && idle_ms.u.int64 >= 0) {
+      config->compaction_idle_ms = (int)idle_ms.u.int64;
     }
   }
 }
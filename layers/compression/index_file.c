@@ -0,0 +1,338 @@
+#define _GNU_SOURCE
+#include "index_file.h"
+#include "../../logdef.h"
+#include "compression_utils.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+#define CHECKSUM_OFFSET 56
+#define HEADER_CHECKSUM_OFFSET 64
+
+static void put_u64(uint8_t *dst, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    dst[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+static void put_u32(uint8_t *dst, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    dst[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+static uint64_t get_u64(const uint8_t *src) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--) {
+    value = (value << 8) | src[i];
+  }
+  return value;
+}
+
+static uint32_t get_u32(const uint8_t *src) {
+  uint32_t value = 0;
+  for (int i = 3; i >= 0; i--) {
+    value = (value << 8) | src[i];
+  }
+  return value;
+}
+
+// FNV-1a of the whole index file, with the checksum fields read as zero
+static uint64_t index_checksum(const uint8_t *data, size_t len) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (size_t i = 0; i < len; i++) {
+    int in_checksum = i >= CHECKSUM_OFFSET && i < INDEX_FILE_HEADER_SIZE;
+    uint8_t byte = in_checksum ? 0 : data[i];
+    hash = (hash ^ byte) * FNV_PRIME;
+  }
+  return hash;
+}
+
+// FNV-1a of the fields of the header, for readers of the header alone
+static uint64_t header_checksum(const uint8_t *data) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (size_t i = 0; i < CHECKSUM_OFFSET; i++) {
+    hash = (hash ^ data[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+static char *index_path(const char *path) {
+  size_t len = strlen(path);
+  char *res = malloc(len + sizeof(INDEX_FILE_SUFFIX));
+  if (!res) {
+    return NULL;
+  }
+  memcpy(res, path, len);
+  memcpy(res + len, INDEX_FILE_SUFFIX, sizeof(INDEX_FILE_SUFFIX));
+  return res;
+}
+
+int index_file_is_index(const char *name) {
+  size_t len = strlen(name);
+  size_t suffix_len = sizeof(INDEX_FILE_SUFFIX) - 1;
+  return len > suffix_len &&
+         strcmp(name + len - suffix_len, INDEX_FILE_SUFFIX) == 0;
+}
+
+// Read the whole index file, NULL if it does not exist or cannot be read
+static uint8_t *read_index(const char *ipath, size_t *len, LayerContext l) {
+  const LayerContext *next = l.next_layers;
+  int fd = next->ops->lopen(ipath, O_RDONLY, 0, *next);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  uint8_t *data = NULL;
+  if (next->ops->lfstat(fd, &st, *next) == 0 &&
+      st.st_size >= INDEX_FILE_HEADER_SIZE &&
+      (data = malloc((size_t)st.st_size)) &&
+      next->ops->lpread(fd, data, (size_t)st.st_size, 0, *next) !=
+          (ssize_t)st.st_size) {
+    free(data);
+    data = NULL;
+  }
+  next->ops->lclose(fd, *next);
+  *len = data ? (size_t)st.st_size : 0;
+  return data;
+}
+
+// Codec of the blocks the layer writes
+static uint32_t index_codec(const CompressionState *state) {
+  if (!state->bare_blocks) {
+    return INDEX_FILE_CODEC_FRAMES;
+  }
+  return state->compressor.algorithm == COMPRESSION_LZ4
+             ? INDEX_FILE_CODEC_BARE_LZ4
+             : INDEX_FILE_CODEC_BARE_ZSTD;
+}
+
+// Check the header against the file it describes
+static int header_matches(const uint8_t *data, const struct stat *st,
+                          const CompressionState *state) {
+  if (get_u32(data) != INDEX_FILE_MAGIC ||
+      get_u32(data + 4) != INDEX_FILE_VERSION ||
+      get_u32(data + 8) != (uint32_t)state->block_size ||
+      get_u32(data + 12) != index_codec(state) ||
+      get_u64(data + HEADER_CHECKSUM_OFFSET) != header_checksum(data)) {
+    return 0;
+  }
+  // A write that bypassed this layer leaves the index behind
+  return get_u64(data + 32) == (uint64_t)st->st_size &&
+         get_u64(data + 40) == (uint64_t)st->st_mtim.tv_sec &&
+         get_u64(data + 48) == (uint64_t)st->st_mtim.tv_nsec;
+}
+
+// Check the whole index file against the file it describes
+static int index_matches(const uint8_t *data, size_t len,
+                         const struct stat *st,
+                         const CompressionState *state) {
+  if (!header_matches(data, st, state)) {
+    return 0;
+  }
+  uint64_t num_blocks = get_u64(data + 16);
+  return num_blocks <=
+             (len - INDEX_FILE_HEADER_SIZE) / INDEX_FILE_ENTRY_SIZE &&
+         len == INDEX_FILE_HEADER_SIZE + num_blocks * INDEX_FILE_ENTRY_SIZE &&
+         get_u64(data + CHECKSUM_OFFSET) == index_checksum(data, len);
+}
+
+int index_file_load(const char *path, const struct stat *st, LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  char *ipath = index_path(path);
+  if (!ipath) {
+    return -1;
+  }
+  size_t len = 0;
+  uint8_t *data = read_index(ipath, &len, l);
+  free(ipath);
+  if (!data) {
+    return -1;
+  }
+  if (!index_matches(data, len, st, state)) {
+    DEBUG_MSG("[COMPRESSION_LAYER: INDEX_FILE_LOAD] Index file of %s is "
+              "stale or corrupt",
+              path);
+    free(data);
+    return -1;
+  }
+
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(st->st_dev, st->st_ino, state);
+  if (!mapping) {
+    if (create_compressed_file_mapping(st->st_dev, st->st_ino, 0, l) != 0) {
+      free(data);
+      return -1;
+    }
+    mapping = get_compressed_file_mapping(st->st_dev, st->st_ino, state);
+  }
+
+  size_t num_blocks = (size_t)get_u64(data + 16);
+  if (ensure_block_index_capacity(mapping, num_blocks) != 0) {
+    free(data);
+    return -1;
+  }
+  mapping->num_blocks = num_blocks;
+  for (size_t i = 0; i < num_blocks; i++) {
+    const uint8_t *entry =
+        data + INDEX_FILE_HEADER_SIZE + i * INDEX_FILE_ENTRY_SIZE;
+    uint32_t flags = get_u32(entry + 4);
+    if (block_set(mapping, i,
+                  (flags & INDEX_FILE_FLAG_UNKNOWN) ? BLOCK_SIZE_UNKNOWN
+                                                    : (off_t)get_u32(entry),
+                  (flags & INDEX_FILE_FLAG_RAW) != 0) != 0) {
+      free(data);
+      return -1;
+    }
+  }
+  mapping->logical_eof = (off_t)get_u64(data + 24);
+  mapping->index_file_current = 1;
+  mapping->index_dirty = 0;
+  free(data);
+
+  DEBUG_MSG("[COMPRESSION_LAYER: INDEX_FILE_LOAD] Loaded %zu blocks of %s",
+            num_blocks, path);
+  return 0;
+}
+
+int index_file_logical_size(const char *path, const struct stat *st,
+                            LayerContext l, off_t *size) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const LayerContext *next = l.next_layers;
+  char *ipath = index_path(path);
+  if (!ipath) {
+    return -1;
+  }
+  int fd = next->ops->lopen(ipath, O_RDONLY, 0, *next);
+  free(ipath);
+  if (fd < 0) {
+    return -1;
+  }
+  uint8_t header[INDEX_FILE_HEADER_SIZE];
+  ssize_t read_res =
+      next->ops->lpread(fd, header, INDEX_FILE_HEADER_SIZE, 0, *next);
+  next->ops->lclose(fd, *next);
+  if (read_res != INDEX_FILE_HEADER_SIZE ||
+      !header_matches(header, st, state)) {
+    return -1;
+  }
+  *size = (off_t)get_u64(header + 24);
+  return 0;
+}
+
+int index_file_flush(const char *path, dev_t device, ino_t inode,
+                     LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const LayerContext *next = l.next_layers;
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(device, inode, state);
+  if (!state->index_file || !mapping || !mapping->index_dirty) {
+    return 0;
+  }
+
+  // Stat after the last block write, the header records what it left
+  struct stat st;
+  if (next->ops->llstat(path, &st, *next) != 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: INDEX_FILE_FLUSH] Failed to stat file %s",
+              path);
+    return -1;
+  }
+
+  size_t len =
+      INDEX_FILE_HEADER_SIZE + mapping->num_blocks * INDEX_FILE_ENTRY_SIZE;
+  uint8_t *data = calloc(1, len);
+  char *ipath = index_path(path);
+  if (!data || !ipath) {
+    free(data);
+    free(ipath);
+    return -1;
+  }
+  put_u32(data, INDEX_FILE_MAGIC);
+  put_u32(data + 4, INDEX_FILE_VERSION);
+  put_u32(data + 8, (uint32_t)state->block_size);
+  put_u32(data + 12, index_codec(state));
+  put_u64(data + 16, mapping->num_blocks);
+  put_u64(data + 24, (uint64_t)mapping->logical_eof);
+  put_u64(data + 32, (uint64_t)st.st_size);
+  put_u64(data + 40, (uint64_t)st.st_mtim.tv_sec);
+  put_u64(data + 48, (uint64_t)st.st_mtim.tv_nsec);
+  for (size_t i = 0; i < mapping->num_blocks; i++) {
+    uint8_t *entry = data + INDEX_FILE_HEADER_SIZE + i * INDEX_FILE_ENTRY_SIZE;
+    uint32_t flags = block_is_raw(mapping, i) ? INDEX_FILE_FLAG_RAW : 0;
+    if (block_stored_size(mapping, i) == BLOCK_SIZE_UNKNOWN) {
+      flags = INDEX_FILE_FLAG_UNKNOWN;
+    } else {
+      put_u32(entry, (uint32_t)block_stored_size(mapping, i));
+    }
+    put_u32(entry + 4, flags);
+  }
+  put_u64(data + CHECKSUM_OFFSET, index_checksum(data, len));
+  put_u64(data + HEADER_CHECKSUM_OFFSET, header_checksum(data));
+
+  int fd = next->ops->lopen(ipath, O_WRONLY | O_CREAT | O_TRUNC, 0644, *next);
+  ssize_t written = -1;
+  if (fd >= 0) {
+    written = next->ops->lpwrite(fd, data, len, 0, *next);
+    next->ops->lclose(fd, *next);
+  }
+  free(data);
+  free(ipath);
+  if (written != (ssize_t)len) {
+    ERROR_MSG("[COMPRESSION_LAYER: INDEX_FILE_FLUSH] Failed to write the "
+              "index file of %s",
+              path);
+    return -1;
+  }
+  mapping->index_file_current = 1;
+  mapping->index_dirty = 0;
+  return 0;
+}
+
+void index_file_invalidate(const char *path, CompressedFileMapping *mapping,
+                           LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  mapping->index_dirty = 1;
+  if (state->index_file && mapping->index_file_current) {
+    index_file_unlink(path, l);
+    mapping->index_file_current = 0;
+  }
+}
+
+void index_file_unlink(const char *path, LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  char *ipath = state->index_file ? index_path(path) : NULL;
+  if (!ipath) {
+    return;
+  }
+  struct stat st;
+  if (l.next_layers->ops->llstat(ipath, &st, *l.next_layers) == 0) {
+    l.next_layers->ops->lunlink(ipath, *l.next_layers);
+  }
+  free(ipath);
+}
+
+void index_file_rename(const char *from, const char *to, unsigned int flags,
+                       LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  if (!state->index_file) {
+    return;
+  }
+  index_file_unlink(to, l);
+  // Both files were swapped, their blocks are scanned again on next open
+  if (flags & RENAME_EXCHANGE) {
+    index_file_unlink(from, l);
+    return;
+  }
+
+  char *ifrom = index_path(from);
+  char *ito = index_path(to);
+  struct stat st;
+  if (ifrom && ito &&
+      l.next_layers->ops->llstat(ifrom, &st, *l.next_layers) == 0) {
+    l.next_layers->ops->lrename(ifrom, ito, 0, *l.next_layers);
+  }
+  free(ifrom);
+  free(ito);
+}
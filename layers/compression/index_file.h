@@ -0,0 +1,128 @@
+#ifndef __INDEX_FILE_H__
+#define __INDEX_FILE_H__
+
+#include "compression.h"
+#include <sys/stat.h>
+
+/*
+ * Index file of the sparse_block mode: the block index of a file, stored next
+ * to it in the next layer so that opening the file does not scan its blocks.
+ *
+ *   [header][entry 0]...[entry n-1]
+ *
+ * header: u32 magic | u32 version | u32 block size | u32 block codec |
+ *         u64 number of blocks | u64 logical size | u64 physical size |
+ *         u64 mtime seconds | u64 mtime nanoseconds | u64 checksum |
+ *         u64 header checksum
+ * entry:  u32 stored size | u32 flags
+ *
+ * The checksum is FNV-1a over the header (checksums zeroed) and the entries,
+ * the header checksum FNV-1a over the fields before the checksums: an lstat
+ * reads the logical size from the header alone.
+ * The index is used only if the physical size and mtime of the file still
+ * match the header, and if it records the codec the layer writes: frames (0)
+ * or the bare blocks of an algorithm. Files written with the other codec are
+ * scanned instead, their blocks still read back. The first write after a
+ * flush removes the index file, so a crash never leaves a current looking
+ * index behind.
+ */
+#define INDEX_FILE_SUFFIX ".tgidx"
+#define INDEX_FILE_MAGIC 0x49424754 // "TGBI"
+#define INDEX_FILE_VERSION 2
+#define INDEX_FILE_HEADER_SIZE 72
+#define INDEX_FILE_ENTRY_SIZE 8
+#define INDEX_FILE_CODEC_FRAMES 0
+#define INDEX_FILE_CODEC_BARE_ZSTD 1
+#define INDEX_FILE_CODEC_BARE_LZ4 2
+#define INDEX_FILE_FLAG_RAW 0x1
+#define INDEX_FILE_FLAG_UNKNOWN 0x2 // block not scanned yet
+
+/**
+ * @brief Check whether a name is the index file of another file
+ *
+ * @param name -> file name or path
+ * @return int -> 1 if name ends with INDEX_FILE_SUFFIX, 0 otherwise
+ */
+int index_file_is_index(const char *name);
+
+/**
+ * @brief Load the index file of a file into its mapping
+ *
+ * Creates the mapping if needed.
+ *
+ * @warning Caller must hold the write lock of the file.
+ *
+ * @param path -> path of the file in the next layer
+ * @param st -> stat of the file in the next layer
+ * @param l -> layer context
+ * @return int -> 0 if loaded, -1 if the index file is missing, stale or corrupt
+ */
+int index_file_load(const char *path, const struct stat *st, LayerContext l);
+
+/**
+ * @brief Logical size of a file from the header of its index file
+ *
+ * Reads the header alone: no mapping is created and no block is read.
+ *
+ * @warning Caller must hold a lock of the file.
+ *
+ * @param path -> path of the file in the next layer
+ * @param st -> stat of the file in the next layer
+ * @param l -> layer context
+ * @param size -> receives the logical size
+ * @return int -> 0 if found, -1 if the index file is missing, stale or corrupt
+ */
+int index_file_logical_size(const char *path, const struct stat *st,
+                            LayerContext l, off_t *size);
+
+/**
+ * @brief Write the index file of a file if the mapping changed since the last
+ * flush
+ *
+ * @warning Caller must hold the write lock of the file.
+ *
+ * @param path -> path of the file in the next layer
+ * @param device -> device id
+ * @param inode -> inode number
+ * @param l -> layer context
+ * @return int -> 0 if successful, -1 otherwise
+ */
+int index_file_flush(const char *path, dev_t device, ino_t inode,
+                     LayerContext l);
+
+/**
+ * @brief Mark the mapping dirty before its blocks change, removing the index
+ * file if it was current
+ *
+ * @warning Caller must hold the write lock of the file.
+ *
+ * @param path -> path of the file in the next layer
+ * @param mapping -> file mapping
+ * @param l -> layer context
+ */
+void index_file_invalidate(const char *path, CompressedFileMapping *mapping,
+                           LayerContext l);
+
+/**
+ * @brief Remove the index file of a file, if any
+ *
+ * @param path -> path of the file in the next layer
+ * @param l -> layer context
+ */
+void index_file_unlink(const char *path, LayerContext l);
+
+/**
+ * @brief Move the index file of a file along with it
+ *
+ * An index file left at the destination is removed first. Exchanged files
+ * lose both index files.
+ *
+ * @param from -> old path of the file in the next layer
+ * @param to -> new path of the file in the next layer
+ * @param flags -> rename flags
+ * @param l -> layer context
+ */
+void index_file_rename(const char *from, const char *to, unsigned int flags,
+                       LayerContext l);
+
+#endif
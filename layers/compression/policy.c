@@ -0,0 +1,102 @@
+#include "policy.h"
+#include "../../logdef.h"
+#include <stdint.h>
+
+// Samples smaller than this say too little about the block
+#define MIN_SAMPLE_SIZE 128
+
+int policy_looks_incompressible(const void *data, size_t size) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  size_t chunk = POLICY_SAMPLE_CHUNK_SIZE;
+  size_t chunks = POLICY_SAMPLE_CHUNKS;
+  if (size < chunks * chunk) {
+    chunk = size;
+    chunks = 1;
+  }
+  if (chunk * chunks < MIN_SAMPLE_SIZE) {
+    return 0;
+  }
+
+  // Contiguous chunks, so that every byte position of a record is sampled
+  uint32_t counts[256] = {0};
+  size_t stride = size / chunks;
+  for (size_t c = 0; c < chunks; c++) {
+    const uint8_t *start = bytes + c * stride;
+    for (size_t i = 0; i < chunk; i++) {
+      counts[start[i]]++;
+    }
+  }
+
+  // Pairs of equal bytes in the sample, about n(n-1)/256 for random bytes. A
+  // collision rate under 1.25x the random one means the order-0 entropy is
+  // above ~7.7 bits per byte.
+  uint64_t n = chunk * chunks;
+  uint64_t pairs = 0;
+  for (int b = 0; b < 256; b++) {
+    if (counts[b] > 1) {
+      pairs += (uint64_t)counts[b] * (counts[b] - 1);
+    }
+  }
+  return pairs * 256 * 4 < 5 * n * (n - 1);
+}
+
+// The level of a file only moves with zstd and without a dictionary, the
+// dictionary was digested at the configured level
+static int adapts_level(const CompressionState *state) {
+  return state->compressor.algorithm == COMPRESSION_ZSTD &&
+         !state->compressor.dictionary &&
+         state->compressor.level > POLICY_MIN_LEVEL;
+}
+
+int policy_should_compress(const CompressionState *state,
+                           const CompressionPolicy *policy, const void *data,
+                           size_t size, int *level) {
+  *level = state->compressor.level;
+  if (!state->adaptive || !policy) {
+    return 1;
+  }
+  if (adapts_level(state)) {
+    *level -= policy->level_drop;
+  }
+
+  // Incompressible file: store raw until the next probe, which always
+  // compresses so that LZ matches in high entropy data are still found
+  if (policy->raw_streak >= POLICY_RAW_STREAK) {
+    return policy->skipped + 1 >= POLICY_PROBE_INTERVAL;
+  }
+  return !policy_looks_incompressible(data, size);
+}
+
+void policy_record(const CompressionState *state, CompressionPolicy *policy,
+                   size_t size, size_t stored_size, int tried) {
+  if (!state->adaptive || !policy) {
+    return;
+  }
+
+  int raw = stored_size >= size;
+  if (!tried) {
+    policy->skipped++;
+  } else {
+    policy->skipped = 0;
+  }
+  if (raw) {
+    policy->raw_streak++;
+    if (policy->raw_streak == POLICY_RAW_STREAK) {
+      DEBUG_MSG("[COMPRESSION_LAYER: POLICY] %u blocks stored raw, storing "
+                "the file raw between probes",
+                policy->raw_streak);
+    }
+  } else {
+    policy->raw_streak = 0;
+  }
+
+  if (!tried || !adapts_level(state)) {
+    return;
+  }
+  int max_drop = state->compressor.level - POLICY_MIN_LEVEL;
+  if (stored_size * 10 > size * 9 && policy->level_drop < max_drop) {
+    policy->level_drop++;
+  } else if (stored_size * 2 < size && policy->level_drop > 0) {
+    policy->level_drop--;
+  }
+}
@@ -0,0 +1,65 @@
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include "compression.h"
+
+/*
+ * Adaptive compression policy of the block modes (options.adaptive).
+ *
+ * Before a block is compressed, a sample of its bytes is checked: a block whose
+ * bytes look uniformly distributed (already compressed or encrypted data) is
+ * stored raw without trying. A file whose last POLICY_RAW_STREAK blocks were
+ * all stored raw is treated as incompressible, and its blocks are stored raw
+ * with a real compression probe every POLICY_PROBE_INTERVAL blocks.
+ *
+ * With zstd and no dictionary, the level of a file is lowered one step per
+ * block that saves less than 10%, down to POLICY_MIN_LEVEL, and raised back
+ * towards the configured level per block that saves more than half.
+ */
+#define POLICY_SAMPLE_CHUNKS 8
+#define POLICY_SAMPLE_CHUNK_SIZE 64
+#define POLICY_RAW_STREAK 8
+#define POLICY_PROBE_INTERVAL 16
+#define POLICY_MIN_LEVEL 1
+
+/**
+ * @brief Check whether a sample of a block looks incompressible
+ *
+ * Samples POLICY_SAMPLE_CHUNKS contiguous chunks spread over the block and
+ * compares the byte collision rate of the sample with the one of uniform
+ * random bytes.
+ *
+ * @param data -> block data
+ * @param size -> size of the block
+ * @return int -> 1 if the block looks incompressible, 0 otherwise
+ */
+int policy_looks_incompressible(const void *data, size_t size);
+
+/**
+ * @brief Decide whether to compress a block and at which level
+ *
+ * @param state -> compression state
+ * @param policy -> policy of the file, NULL to always compress
+ * @param data -> block data
+ * @param size -> size of the block
+ * @param level -> receives the compression level to use
+ * @return int -> 1 to compress the block, 0 to store it raw
+ */
+int policy_should_compress(const CompressionState *state,
+                           const CompressionPolicy *policy, const void *data,
+                           size_t size, int *level);
+
+/**
+ * @brief Record how a block was stored
+ *
+ * @param state -> compression state
+ * @param policy -> policy of the file, NULL is ignored
+ * @param size -> size of the block
+ * @param stored_size -> size of the stored block
+ * @param tried -> 1 if the block was compressed, 0 if it was stored raw
+ * without trying
+ */
+void policy_record(const CompressionState *state, CompressionPolicy *policy,
+                   size_t size, size_t stored_size, int tried);
+
+#endif
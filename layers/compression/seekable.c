@@ -0,0 +1,859 @@
+#include "seekable.h"
+#include "../../logdef.h"
+#include "../../shared/utils/invalidation.h"
+#include "compression_utils.h"
+#include <fcntl.h>
+#include <string.h>
+
+static void put_u64(uint8_t *dst, uint64_t value) {
+  memcpy(dst, &value, sizeof(value));
+}
+
+static void put_u32(uint8_t *dst, uint32_t value) {
+  memcpy(dst, &value, sizeof(value));
+}
+
+static uint64_t get_u64(const uint8_t *src) {
+  uint64_t value;
+  memcpy(&value, src, sizeof(value));
+  return value;
+}
+
+static uint32_t get_u32(const uint8_t *src) {
+  uint32_t value;
+  memcpy(&value, src, sizeof(value));
+  return value;
+}
+
+int seekable_reserve_frames(CompressedFileMapping *mapping, size_t n) {
+  if (ensure_block_index_capacity(mapping, n) != 0) {
+    return -1;
+  }
+  if (mapping->offsets_capacity >= mapping->capacity) {
+    return 0;
+  }
+  off_t *offsets =
+      realloc(mapping->offsets, mapping->capacity * sizeof(off_t));
+  if (!offsets) {
+    return -1;
+  }
+  memset(offsets + mapping->offsets_capacity, 0,
+         (mapping->capacity - mapping->offsets_capacity) * sizeof(off_t));
+  mapping->offsets = offsets;
+  mapping->offsets_capacity = mapping->capacity;
+  return 0;
+}
+
+// Logical length of a frame for a file of logical_eof bytes
+static size_t frame_length(off_t logical_eof, size_t idx, size_t frame_size) {
+  off_t start = (off_t)(idx * frame_size);
+  if (logical_eof <= start) {
+    return 0;
+  }
+  off_t left = logical_eof - start;
+  return left < (off_t)frame_size ? (size_t)left : frame_size;
+}
+
+static int is_zero(const uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (data[i] != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Read stored bytes, retrying with a read-only descriptor when fd was opened
+// write-only (path may be NULL to skip the retry)
+static ssize_t read_stored(int fd, const char *path, void *buffer,
+                           size_t nbyte, off_t offset, LayerContext l) {
+  const LayerContext *next = l.next_layers;
+  ssize_t res = next->ops->lpread(fd, buffer, nbyte, offset, *next);
+  if (res == (ssize_t)nbyte || !path) {
+    return res;
+  }
+  int rfd = next->ops->lopen(path, O_RDONLY, 0, *next);
+  if (rfd < 0) {
+    return res;
+  }
+  res = next->ops->lpread(rfd, buffer, nbyte, offset, *next);
+  next->ops->lclose(rfd, *next);
+  return res;
+}
+
+int seekable_decode_frame(int fd, const char *path,
+                          CompressedFileMapping *mapping, size_t idx,
+                          uint8_t *out, LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const size_t frame_size = state->block_size;
+  size_t stored = (size_t)block_stored_size(mapping, idx);
+  if (stored == 0) {
+    memset(out, 0, frame_size);
+    return 0;
+  }
+
+  uint8_t *cbuf = malloc(stored);
+  if (!cbuf) {
+    return -1;
+  }
+  if (read_stored(fd, path, cbuf, stored, mapping->offsets[idx], l) !=
+      (ssize_t)stored) {
+    free(cbuf);
+    return -1;
+  }
+
+  size_t produced = stored < frame_size ? stored : frame_size;
+  if (block_is_raw(mapping, idx)) {
+    memcpy(out, cbuf, produced);
+  } else {
+    size_t capacity = frame_size;
+    ssize_t res =
+        compressor_decompress(&state->compressor, cbuf, stored, out, &capacity);
+    if (res < 0 || (size_t)res > frame_size) {
+      free(cbuf);
+      return -1;
+    }
+    produced = (size_t)res;
+  }
+  free(cbuf);
+  memset(out + produced, 0, frame_size - produced);
+  return 0;
+}
+
+int seekable_store_frame(int fd, CompressedFileMapping *mapping, size_t idx,
+                         const uint8_t *data, size_t len, LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  off_t old_size = block_stored_size(mapping, idx);
+  mapping->index_dirty = 1;
+
+  if (is_zero(data, len)) {
+    mapping->garbage += old_size;
+    return block_set(mapping, idx, 0, 0);
+  }
+
+  void *stored = NULL;
+  size_t stored_size = 0;
+  int is_uncompressed = 0;
+  if (compress_or_store_raw(state, &mapping->policy, data, len, &stored,
+                            &stored_size, &is_uncompressed) < 0) {
+    return -1;
+  }
+
+  int in_place = old_size > 0 && (off_t)stored_size <= old_size;
+  off_t physical_offset = in_place ? mapping->offsets[idx] : mapping->data_end;
+  ssize_t res = l.next_layers->ops->lpwrite(fd, stored, stored_size,
+                                            physical_offset, *l.next_layers);
+  free(stored);
+  if (res != (ssize_t)stored_size) {
+    return -1;
+  }
+
+  if (in_place) {
+    mapping->garbage += old_size - (off_t)stored_size;
+  } else {
+    mapping->garbage += old_size;
+    mapping->data_end += (off_t)stored_size;
+  }
+  mapping->offsets[idx] = physical_offset;
+  return block_set(mapping, idx, (off_t)stored_size, is_uncompressed);
+}
+
+int seekable_write_frames(int fd, const char *path,
+                          CompressedFileMapping *mapping, const void *buffer,
+                          size_t nbyte, off_t offset, LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const size_t frame_size = state->block_size;
+  off_t end = offset + (off_t)nbyte;
+  off_t new_eof = end > mapping->logical_eof ? end : mapping->logical_eof;
+  size_t first = (size_t)(offset / (off_t)frame_size);
+  size_t last = (size_t)((end - 1) / (off_t)frame_size);
+
+  uint8_t *scratch = malloc(frame_size);
+  if (!scratch || seekable_reserve_frames(mapping, last + 1) != 0) {
+    free(scratch);
+    return -1;
+  }
+
+  // Only the frames overlapping the request are decoded and recompressed
+  for (size_t idx = first; idx <= last; idx++) {
+    off_t frame_start = (off_t)(idx * frame_size);
+    size_t len = frame_length(new_eof, idx, frame_size);
+    off_t lo = offset > frame_start ? offset : frame_start;
+    off_t hi = end < frame_start + (off_t)len ? end : frame_start + (off_t)len;
+
+    const uint8_t *data = scratch;
+    if (lo == frame_start && hi == frame_start + (off_t)len) {
+      data = (const uint8_t *)buffer + (frame_start - offset);
+    } else {
+      if (seekable_decode_frame(fd, path, mapping, idx, scratch, l) != 0) {
+        free(scratch);
+        return -1;
+      }
+      memcpy(scratch + (lo - frame_start),
+             (const uint8_t *)buffer + (lo - offset), (size_t)(hi - lo));
+    }
+
+    if (seekable_store_frame(fd, mapping, idx, data, len, l) != 0) {
+      free(scratch);
+      return -1;
+    }
+  }
+  free(scratch);
+
+  if (mapping->logical_eof != new_eof) {
+    mapping->logical_eof = new_eof;
+    layer_invalidate_attr(mapping->device, mapping->inode);
+  }
+  mapping->index_dirty = 1;
+  return 0;
+}
+
+int seekable_read_frames(int fd, const char *path,
+                         CompressedFileMapping *mapping, void *buffer,
+                         size_t nbyte, off_t offset, LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const size_t frame_size = state->block_size;
+  off_t end = offset + (off_t)nbyte;
+  size_t first = (size_t)(offset / (off_t)frame_size);
+  size_t last = (size_t)((end - 1) / (off_t)frame_size);
+
+  uint8_t *scratch = NULL;
+  int failed = 0;
+  for (size_t idx = first; idx <= last && !failed; idx++) {
+    off_t frame_start = (off_t)(idx * frame_size);
+    off_t frame_end = frame_start + (off_t)frame_size;
+    off_t lo = offset > frame_start ? offset : frame_start;
+    off_t hi = end < frame_end ? end : frame_end;
+    uint8_t *dst = (uint8_t *)buffer + (lo - offset);
+
+    if (idx >= mapping->num_blocks || block_stored_size(mapping, idx) == 0) {
+      memset(dst, 0, (size_t)(hi - lo));
+    } else if (hi - lo == (off_t)frame_size) {
+      // Whole frames are decoded straight into the caller buffer
+      failed = seekable_decode_frame(fd, path, mapping, idx, dst, l) != 0;
+    } else if (!scratch && !(scratch = malloc(frame_size))) {
+      failed = 1;
+    } else if (seekable_decode_frame(fd, path, mapping, idx, scratch, l) !=
+               0) {
+      failed = 1;
+    } else {
+      memcpy(dst, scratch + (lo - frame_start), (size_t)(hi - lo));
+    }
+  }
+  free(scratch);
+  return failed ? -1 : 0;
+}
+
+ssize_t compression_seekable_pwrite(int fd, const void *buffer, size_t nbyte,
+                                    off_t offset, LayerContext l) {
+  if (!validate_compression_fd_offset_and_nbyte(
+          fd, offset, nbyte, "COMPRESSION_LAYER: SEEKABLE_PWRITE")) {
+    return INVALID_FD;
+  }
+
+  CompressionState *state = (CompressionState *)l.internal_state;
+  FdToInode *entry = fd_to_inode_lookup(state, fd);
+  if (!entry) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SEEKABLE_PWRITE] File descriptor not found", NULL,
+        NULL);
+    return INVALID_FD;
+  }
+  const char *path = entry->path;
+
+  if (locking_acquire_write(state->lock_table, path) != 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SEEKABLE_PWRITE] Failed to acquire write lock",
+        NULL, NULL);
+    return INVALID_FD;
+  }
+
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(entry->device, entry->inode, state);
+  if (!mapping || !mapping->index_loaded) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SEEKABLE_PWRITE] Missing seek table",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+
+  if (nbyte > 0 && seekable_write_frames(fd, path, mapping, buffer, nbyte,
+                                         offset, l) != 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SEEKABLE_PWRITE] Failed to write frames",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+  locking_release(state->lock_table, path);
+  return (ssize_t)nbyte;
+}
+
+ssize_t compression_seekable_pread(int fd, void *buffer, size_t nbyte,
+                                   off_t offset, LayerContext l) {
+  if (!validate_compression_fd_offset_and_nbyte(
+          fd, offset, nbyte, "COMPRESSION_LAYER: SEEKABLE_PREAD")) {
+    return INVALID_FD;
+  }
+
+  if (nbyte == 0) {
+    return 0;
+  }
+
+  CompressionState *state = (CompressionState *)l.internal_state;
+  FdToInode *entry = fd_to_inode_lookup(state, fd);
+  if (!entry) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SEEKABLE_PREAD] File descriptor not found", NULL,
+        NULL);
+    return INVALID_FD;
+  }
+  const char *path = entry->path;
+
+  if (locking_acquire_read(state->lock_table, path) != 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SEEKABLE_PREAD] Failed to acquire read lock",
+        NULL, NULL);
+    return INVALID_FD;
+  }
+
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(entry->device, entry->inode, state);
+  if (!mapping || !mapping->index_loaded) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SEEKABLE_PREAD] Missing seek table",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+
+  off_t logical_eof = mapping->logical_eof;
+  if (offset >= logical_eof) {
+    locking_release(state->lock_table, path);
+    return 0;
+  }
+  size_t bytes_to_read = nbyte;
+  if (offset + (off_t)nbyte > logical_eof) {
+    bytes_to_read = (size_t)(logical_eof - offset);
+  }
+
+  if (seekable_read_frames(fd, path, mapping, buffer, bytes_to_read, offset,
+                           l) != 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SEEKABLE_PREAD] Failed to decode frame",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+  locking_release(state->lock_table, path);
+  return (ssize_t)bytes_to_read;
+}
+
+int seekable_truncate_frames(int fd, const char *path,
+                             CompressedFileMapping *mapping, off_t length,
+                             LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const size_t frame_size = state->block_size;
+  off_t logical_eof = mapping->logical_eof;
+
+  if (length == logical_eof) {
+    return 0;
+  }
+
+  if (length == 0) {
+    if (l.next_layers->ops->lftruncate(fd, 0, *l.next_layers) < 0) {
+      return -1;
+    }
+    seekable_reset_index(mapping);
+    layer_invalidate_attr(mapping->device, mapping->inode);
+    return 0;
+  }
+
+  size_t frames = (size_t)((length + (off_t)frame_size - 1) / frame_size);
+  mapping->index_dirty = 1;
+
+  // Extending only adds holes
+  if (length > logical_eof) {
+    if (seekable_reserve_frames(mapping, frames) != 0) {
+      return -1;
+    }
+    mapping->logical_eof = length;
+    layer_invalidate_attr(mapping->device, mapping->inode);
+    return 0;
+  }
+
+  // Entries past num_blocks may be reused later, clear them
+  if (frames < mapping->num_blocks) {
+    mapping->garbage += (off_t)get_total_compressed_size(
+        (off_t)frames, (off_t)mapping->num_blocks - 1, mapping);
+    if (block_index_fill(mapping, frames, mapping->num_blocks - frames, 0,
+                         0) != 0) {
+      return -1;
+    }
+  }
+
+  size_t last = frames - 1;
+  size_t keep = frame_length(length, last, frame_size);
+  if (last < mapping->num_blocks && block_stored_size(mapping, last) > 0 &&
+      keep < frame_length(logical_eof, last, frame_size)) {
+    uint8_t *scratch = malloc(frame_size);
+    if (!scratch) {
+      return -1;
+    }
+    if (seekable_decode_frame(fd, path, mapping, last, scratch, l) != 0 ||
+        seekable_store_frame(fd, mapping, last, scratch, keep, l) != 0) {
+      free(scratch);
+      return -1;
+    }
+    free(scratch);
+  }
+
+  if (frames < mapping->num_blocks &&
+      shrink_block_index(mapping, frames) != 0) {
+    return -1;
+  }
+  mapping->logical_eof = length;
+  layer_invalidate_attr(mapping->device, mapping->inode);
+  return 0;
+}
+
+typedef struct {
+  off_t offset;
+  size_t idx;
+} FrameRef;
+
+static int compare_frame_refs(const void *a, const void *b) {
+  off_t x = ((const FrameRef *)a)->offset;
+  off_t y = ((const FrameRef *)b)->offset;
+  return (x > y) - (x < y);
+}
+
+// Move the live frames down over the superseded ones, in physical order so a
+// frame never overwrites one that was not moved yet
+static int compact_frames(int fd, CompressedFileMapping *mapping,
+                          LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const LayerContext *next = l.next_layers;
+
+  size_t live = 0;
+  for (size_t idx = 0; idx < mapping->num_blocks; idx++) {
+    live += block_stored_size(mapping, idx) > 0;
+  }
+  FrameRef *refs = malloc((live ? live : 1) * sizeof(FrameRef));
+  uint8_t *buffer = malloc(state->block_size);
+  if (!refs || !buffer) {
+    free(refs);
+    free(buffer);
+    return -1;
+  }
+  size_t n = 0;
+  for (size_t idx = 0; idx < mapping->num_blocks; idx++) {
+    if (block_stored_size(mapping, idx) > 0) {
+      refs[n].offset = mapping->offsets[idx];
+      refs[n].idx = idx;
+      n++;
+    }
+  }
+  qsort(refs, n, sizeof(FrameRef), compare_frame_refs);
+
+  off_t cursor = 0;
+  int res = 0;
+  for (size_t i = 0; i < n && res == 0; i++) {
+    size_t idx = refs[i].idx;
+    size_t size = (size_t)block_stored_size(mapping, idx);
+    if (refs[i].offset != cursor) {
+      if (next->ops->lpread(fd, buffer, size, refs[i].offset, *next) !=
+              (ssize_t)size ||
+          next->ops->lpwrite(fd, buffer, size, cursor, *next) !=
+              (ssize_t)size) {
+        res = -1;
+        break;
+      }
+      mapping->offsets[idx] = cursor;
+    }
+    cursor += (off_t)size;
+  }
+  free(refs);
+  free(buffer);
+  if (res != 0) {
+    return -1;
+  }
+
+  DEBUG_MSG("[COMPRESSION_LAYER: SEEKABLE_COMPACT] Reclaimed %ld bytes",
+            (long)(mapping->data_end - cursor));
+  mapping->data_end = cursor;
+  mapping->garbage = 0;
+  return 0;
+}
+
+static int write_seek_table(int fd, CompressedFileMapping *mapping,
+                            LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const LayerContext *next = l.next_layers;
+
+  // An empty file has no table, it stays empty in storage
+  if (mapping->num_blocks == 0 && mapping->logical_eof == 0) {
+    return next->ops->lftruncate(fd, 0, *next) < 0 ? -1 : 0;
+  }
+
+  size_t table_size =
+      mapping->num_blocks * SEEKABLE_ENTRY_SIZE + SEEKABLE_FOOTER_SIZE;
+  uint8_t *table = malloc(table_size);
+  if (!table) {
+    return -1;
+  }
+  uint8_t *p = table;
+  for (size_t idx = 0; idx < mapping->num_blocks; idx++) {
+    put_u64(p, (uint64_t)mapping->offsets[idx]);
+    put_u32(p + 8, (uint32_t)block_stored_size(mapping, idx));
+    put_u32(p + 12, block_is_raw(mapping, idx) ? SEEKABLE_FLAG_RAW : 0);
+    p += SEEKABLE_ENTRY_SIZE;
+  }
+  put_u64(p, (uint64_t)mapping->logical_eof);
+  put_u64(p + 8, (uint64_t)mapping->num_blocks);
+  put_u32(p + 16, (uint32_t)state->block_size);
+  put_u32(p + 20, SEEKABLE_MAGIC);
+
+  ssize_t res =
+      next->ops->lpwrite(fd, table, table_size, mapping->data_end, *next);
+  free(table);
+  if (res != (ssize_t)table_size) {
+    return -1;
+  }
+  // Drop what was left of a longer table
+  if (next->ops->lftruncate(fd, mapping->data_end + (off_t)table_size,
+                            *next) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int seekable_flush_index(const char *path, dev_t device, ino_t inode,
+                         LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const LayerContext *next = l.next_layers;
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(device, inode, state);
+  if (!mapping || !mapping->index_dirty) {
+    return 0;
+  }
+
+  // The descriptors of the caller may not be readable or writable
+  int fd = next->ops->lopen(path, O_RDWR, 0, *next);
+  if (fd < 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_FLUSH] Failed to open file %s",
+              path);
+    return -1;
+  }
+
+  int res = 0;
+  if (mapping->garbage >= SEEKABLE_COMPACT_MIN_BYTES &&
+      mapping->garbage * 2 > mapping->data_end) {
+    res = compact_frames(fd, mapping, l);
+  }
+  if (res == 0) {
+    res = write_seek_table(fd, mapping, l);
+  }
+  next->ops->lclose(fd, *next);
+
+  if (res != 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_FLUSH] Failed to write the seek "
+              "table of %s",
+              path);
+    return -1;
+  }
+  mapping->index_dirty = 0;
+  return 0;
+}
+
+static int read_seek_table(int fd, CompressedFileMapping *mapping,
+                           off_t physical_size, LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const LayerContext *next = l.next_layers;
+
+  uint8_t footer[SEEKABLE_FOOTER_SIZE];
+  if (physical_size < SEEKABLE_FOOTER_SIZE ||
+      next->ops->lpread(fd, footer, SEEKABLE_FOOTER_SIZE,
+                        physical_size - SEEKABLE_FOOTER_SIZE,
+                        *next) != SEEKABLE_FOOTER_SIZE ||
+      get_u32(footer + 20) != SEEKABLE_MAGIC) {
+    ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_LOAD] File has no seek table");
+    return -1;
+  }
+  if (get_u32(footer + 16) != (uint32_t)state->block_size) {
+    ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_LOAD] File was written with a "
+              "frame size of %u bytes",
+              get_u32(footer + 16));
+    return -1;
+  }
+
+  uint64_t num_frames = get_u64(footer + 8);
+  off_t table_end = physical_size - SEEKABLE_FOOTER_SIZE;
+  if (num_frames > (uint64_t)table_end / SEEKABLE_ENTRY_SIZE) {
+    ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_LOAD] Corrupted seek table");
+    return -1;
+  }
+  size_t table_size = (size_t)num_frames * SEEKABLE_ENTRY_SIZE;
+  off_t data_end = table_end - (off_t)table_size;
+
+  uint8_t *table = malloc(table_size ? table_size : 1);
+  if (!table || seekable_reserve_frames(mapping, (size_t)num_frames) != 0) {
+    free(table);
+    return -1;
+  }
+  if (next->ops->lpread(fd, table, table_size, data_end, *next) !=
+      (ssize_t)table_size) {
+    free(table);
+    return -1;
+  }
+
+  off_t live = 0;
+  for (size_t idx = 0; idx < (size_t)num_frames; idx++) {
+    const uint8_t *p = table + idx * SEEKABLE_ENTRY_SIZE;
+    mapping->offsets[idx] = (off_t)get_u64(p);
+    off_t size = (off_t)get_u32(p + 8);
+    if (size > (off_t)state->block_size ||
+        mapping->offsets[idx] + size > data_end) {
+      free(table);
+      ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_LOAD] Frame %zu is out of "
+                "range",
+                idx);
+      return -1;
+    }
+    if (block_set(mapping, idx, size,
+                  (get_u32(p + 12) & SEEKABLE_FLAG_RAW) != 0) != 0) {
+      free(table);
+      return -1;
+    }
+    live += size;
+  }
+  free(table);
+
+  mapping->num_blocks = (size_t)num_frames;
+  mapping->logical_eof = (off_t)get_u64(footer);
+  mapping->data_end = data_end;
+  mapping->garbage = data_end - live;
+  return 0;
+}
+
+int seekable_load_index(const char *path, dev_t device, ino_t inode,
+                        LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const LayerContext *next = l.next_layers;
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(device, inode, state);
+  if (!mapping) {
+    if (create_compressed_file_mapping(device, inode, 0, l) != 0) {
+      return -1;
+    }
+    mapping = get_compressed_file_mapping(device, inode, state);
+  }
+  if (mapping->index_loaded) {
+    return 0;
+  }
+
+  int fd = next->ops->lopen(path, O_RDONLY, 0, *next);
+  if (fd < 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_LOAD] Failed to open file %s",
+              path);
+    return -1;
+  }
+  struct stat stbuf;
+  int res = next->ops->lfstat(fd, &stbuf, *next);
+  if (res == 0) {
+    seekable_reset_index(mapping);
+    if (stbuf.st_size > 0) {
+      mapping->index_loaded = 0;
+      res = read_seek_table(fd, mapping, stbuf.st_size, l);
+    }
+  }
+  next->ops->lclose(fd, *next);
+  if (res != 0) {
+    return -1;
+  }
+  mapping->index_loaded = 1;
+  return 0;
+}
+
+void seekable_reset_index(CompressedFileMapping *mapping) {
+  (void)shrink_block_index(mapping, 0);
+  mapping->logical_eof = 0;
+  mapping->data_end = 0;
+  mapping->garbage = 0;
+  mapping->index_loaded = 1;
+  mapping->index_dirty = 0;
+  mapping->staging_valid = 0;
+  mapping->staging_dirty = 0;
+}
+
+int compression_seekable_ftruncate(int fd, off_t length, LayerContext l) {
+  if (length < 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_FTRUNCATE] Invalid length");
+    return INVALID_FD;
+  }
+
+  CompressionState *state = (CompressionState *)l.internal_state;
+  FdToInode *entry = fd_to_inode_lookup(state, fd);
+  if (!entry) {
+    ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_FTRUNCATE] File descriptor %d "
+              "not found",
+              fd);
+    return INVALID_FD;
+  }
+  const char *path = entry->path;
+
+  if (locking_acquire_write(state->lock_table, path) != 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_FTRUNCATE] Failed to acquire "
+              "write lock on file %s",
+              path);
+    return INVALID_FD;
+  }
+
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(entry->device, entry->inode, state);
+  if (!mapping || !mapping->index_loaded) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SEEKABLE_FTRUNCATE] Missing seek table",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+
+  if (seekable_truncate_frames(fd, path, mapping, length, l) != 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SEEKABLE_FTRUNCATE] Failed to truncate frames",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+  locking_release(state->lock_table, path);
+  return 0;
+}
+
+int compression_seekable_truncate(const char *path, off_t length,
+                                  LayerContext l) {
+  if (!path || length < 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_TRUNCATE] Invalid arguments");
+    return INVALID_FD;
+  }
+
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const LayerContext *next = l.next_layers;
+  if (locking_acquire_write(state->lock_table, path) != 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_TRUNCATE] Failed to acquire "
+              "write lock on file %s",
+              path);
+    return INVALID_FD;
+  }
+
+  struct stat stbuf;
+  if (next->ops->llstat(path, &stbuf, *next) != 0 ||
+      seekable_load_index(path, stbuf.st_dev, stbuf.st_ino, l) != 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SEEKABLE_TRUNCATE] Failed to load seek table",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+
+  int fd = next->ops->lopen(path, O_RDWR, 0, *next);
+  if (fd < 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SEEKABLE_TRUNCATE] Failed to open file",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(stbuf.st_dev, stbuf.st_ino, state);
+  int res = seekable_truncate_frames(fd, path, mapping, length, l);
+  next->ops->lclose(fd, *next);
+
+  // No descriptor of ours will flush the table on close
+  if (res != 0 ||
+      seekable_flush_index(path, stbuf.st_dev, stbuf.st_ino, l) != 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SEEKABLE_TRUNCATE] Failed to truncate frames",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+  locking_release(state->lock_table, path);
+  return 0;
+}
+
+int compression_seekable_fstat(int fd, struct stat *stbuf, LayerContext l) {
+  if (!is_valid_compression_fd(fd)) {
+    ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_FSTAT] File descriptor %d is "
+              "not valid",
+              fd);
+    return INVALID_FD;
+  }
+  int res = l.next_layers->ops->lfstat(fd, stbuf, *l.next_layers);
+  if (res != 0 || !S_ISREG(stbuf->st_mode)) {
+    return res;
+  }
+
+  CompressionState *state = (CompressionState *)l.internal_state;
+  FdToInode *entry = fd_to_inode_lookup(state, fd);
+  if (!entry) {
+    ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_FSTAT] File descriptor %d not "
+              "found",
+              fd);
+    return INVALID_FD;
+  }
+  const char *path = entry->path;
+  if (locking_acquire_read(state->lock_table, path) != 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_FSTAT] Failed to acquire read "
+              "lock on file %s",
+              path);
+    return INVALID_FD;
+  }
+
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(stbuf->st_dev, stbuf->st_ino, state);
+  if (!mapping || !mapping->index_loaded) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SEEKABLE_FSTAT] Missing seek table",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+  stbuf->st_size = mapping->logical_eof;
+  locking_release(state->lock_table, path);
+  return res;
+}
+
+int compression_seekable_lstat(const char *pathname, struct stat *stbuf,
+                               LayerContext l) {
+  int res = l.next_layers->ops->llstat(pathname, stbuf, *l.next_layers);
+  if (res != 0 || !S_ISREG(stbuf->st_mode)) {
+    return res;
+  }
+
+  CompressionState *state = (CompressionState *)l.internal_state;
+  if (locking_acquire_read(state->lock_table, pathname) != 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_LSTAT] Failed to acquire read "
+              "lock on file %s",
+              pathname);
+    return INVALID_FD;
+  }
+
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(stbuf->st_dev, stbuf->st_ino, state);
+  if (mapping && mapping->index_loaded) {
+    stbuf->st_size = mapping->logical_eof;
+    locking_release(state->lock_table, pathname);
+    return res;
+  }
+  locking_release(state->lock_table, pathname);
+
+  // Loading the table modifies the mapping, upgrade to a write lock
+  if (locking_acquire_write(state->lock_table, pathname) != 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: SEEKABLE_LSTAT] Failed to acquire write "
+              "lock on file %s",
+              pathname);
+    return INVALID_FD;
+  }
+  if (seekable_load_index(pathname, stbuf->st_dev, stbuf->st_ino, l) != 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SEEKABLE_LSTAT] Failed to load seek table",
+        state->lock_table, pathname);
+    return INVALID_FD;
+  }
+  mapping = get_compressed_file_mapping(stbuf->st_dev, stbuf->st_ino, state);
+  stbuf->st_size = mapping->logical_eof;
+  locking_release(state->lock_table, pathname);
+  return res;
+}
@@ -0,0 +1,146 @@
+#ifndef __SEEKABLE_H__
+#define __SEEKABLE_H__
+
+#include "compression.h"
+
+/*
+ * Seekable layout: independently compressed frames of block_size logical
+ * bytes, followed by a seek table and a fixed size footer.
+ *
+ *   [frame][frame]...[entry 0]...[entry n-1][footer]
+ *
+ * entry:  u64 physical offset | u32 stored size | u32 flags
+ * footer: u64 logical size | u64 number of frames | u32 frame size | u32 magic
+ *
+ * A stored size of 0 is a hole that reads as zeros. Frames are rewritten in
+ * place when they still fit, appended after the last frame otherwise.
+ */
+#define SEEKABLE_MAGIC 0x4b534754 // "TGSK"
+#define SEEKABLE_ENTRY_SIZE 16
+#define SEEKABLE_FOOTER_SIZE 24
+#define SEEKABLE_FLAG_RAW 0x1
+// Superseded frames are reclaimed once they are half of the frame data
+#define SEEKABLE_COMPACT_MIN_BYTES (1 << 20)
+
+ssize_t compression_seekable_pwrite(int fd, const void *buffer, size_t nbyte,
+                                    off_t offset, LayerContext l);
+ssize_t compression_seekable_pread(int fd, void *buffer, size_t nbyte,
+                                   off_t offset, LayerContext l);
+int compression_seekable_ftruncate(int fd, off_t length, LayerContext l);
+int compression_seekable_truncate(const char *path, off_t length,
+                                  LayerContext l);
+int compression_seekable_fstat(int fd, struct stat *stbuf, LayerContext l);
+int compression_seekable_lstat(const char *pathname, struct stat *stbuf,
+                               LayerContext l);
+
+/*
+ * Frame level operations, shared with the append_block mode. The caller holds
+ * the lock of the file and its seek table is loaded.
+ */
+
+/**
+ * @brief Grow the block index and the frame offsets to hold n frames
+ *
+ * @param mapping -> file mapping
+ * @param n -> number of frames
+ * @return int -> 0 if successful, -1 otherwise
+ */
+int seekable_reserve_frames(CompressedFileMapping *mapping, size_t n);
+
+/**
+ * @brief Decode a frame, zero filling past its data
+ *
+ * @param fd -> file descriptor in the next layer
+ * @param path -> path to retry the read with when fd is write-only, or NULL
+ * @param mapping -> file mapping
+ * @param idx -> frame index
+ * @param out -> receives the frame, block_size bytes
+ * @param l -> layer context
+ * @return int -> 0 if successful, -1 otherwise
+ */
+int seekable_decode_frame(int fd, const char *path,
+                          CompressedFileMapping *mapping, size_t idx,
+                          uint8_t *out, LayerContext l);
+
+/**
+ * @brief Compress len bytes as a frame, in place if the new frame fits in the
+ * old one, after the last frame otherwise
+ *
+ * @param fd -> file descriptor in the next layer
+ * @param mapping -> file mapping
+ * @param idx -> frame index
+ * @param data -> logical content of the frame
+ * @param len -> logical length of the frame
+ * @param l -> layer context
+ * @return int -> 0 if successful, -1 otherwise
+ */
+int seekable_store_frame(int fd, CompressedFileMapping *mapping, size_t idx,
+                         const uint8_t *data, size_t len, LayerContext l);
+
+/**
+ * @brief Write a range, recompressing only the frames it overlaps
+ *
+ * @return int -> 0 if successful, -1 otherwise
+ */
+int seekable_write_frames(int fd, const char *path,
+                          CompressedFileMapping *mapping, const void *buffer,
+                          size_t nbyte, off_t offset, LayerContext l);
+
+/**
+ * @brief Read a range that ends at or before the logical EOF
+ *
+ * @return int -> 0 if successful, -1 otherwise
+ */
+int seekable_read_frames(int fd, const char *path,
+                         CompressedFileMapping *mapping, void *buffer,
+                         size_t nbyte, off_t offset, LayerContext l);
+
+/**
+ * @brief Drop the frames past length and re-encode the new last frame
+ *
+ * @return int -> 0 if successful, -1 otherwise
+ */
+int seekable_truncate_frames(int fd, const char *path,
+                             CompressedFileMapping *mapping, off_t length,
+                             LayerContext l);
+
+/**
+ * @brief Load the seek table of a file into its mapping
+ *
+ * Creates the mapping if needed. Does nothing if the table is already loaded.
+ *
+ * @warning Caller must hold the write lock of the file.
+ *
+ * @param path -> path of the file in the next layer
+ * @param device -> device id
+ * @param inode -> inode number
+ * @param l -> layer context
+ * @return int -> 0 if successful, -1 if the file is not in seekable format
+ */
+int seekable_load_index(const char *path, dev_t device, ino_t inode,
+                        LayerContext l);
+
+/**
+ * @brief Write the seek table of a file if it changed since the last flush
+ *
+ * Superseded frames are compacted first when they take too much space.
+ *
+ * @warning Caller must hold the write lock of the file.
+ *
+ * @param path -> path of the file in the next layer
+ * @param device -> device id
+ * @param inode -> inode number
+ * @param l -> layer context
+ * @return int -> 0 if successful, -1 otherwise
+ */
+int seekable_flush_index(const char *path, dev_t device, ino_t inode,
+                         LayerContext l);
+
+/**
+ * @brief Forget every frame of a file that was truncated to zero on open
+ *
+ * @param mapping -> file mapping
+ */
+void seekable_reset_index(CompressedFileMapping *mapping);
+
+#endif
@@ -1,24 +1,207 @@
 #define _GNU_SOURCE
 #include "sparse_block.h"
 #include "../../logdef.h"
+#include "../../shared/utils/layer_iov.h"
+#include "../../shared/utils/thread_pool.h"
+#include "../../shared/utils/zero.h"
+#include "block_cache.h"
+#include "compactor.h"
 #include "compression_utils.h"
+#include "index_file.h"
+#include "policy.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/falloc.h>
+#include <string.h>
 
-// Forward declaration of helper functions
-static int compress_or_store_raw(CompressionState *state, const void *data,
-                                 size_t data_size, void **out_buffer,
-                                 size_t *out_size, int *out_is_uncompressed);
+// Blocks of one request are compressed and decompressed on the pool of the
+// layer when it has one and the request spans several blocks
+static int runs_on_pool(const CompressionState *state, size_t njobs) {
+  return state->pool && njobs > 1;
+}
 
-ssize_t compression_sparse_block_pwrite(int fd, const void *buffer,
-                                        size_t nbyte, off_t offset,
-                                        LayerContext l) {
+// Run fn on every job of an array, jobs start with their ThreadPoolTask.
+// Jobs that cannot be queued run on the calling thread.
+static void run_on_pool(ThreadPool *pool, void *jobs, size_t job_size,
+                        size_t njobs, ThreadPoolFn fn) {
+  ThreadPoolBatch batch;
+  thread_pool_batch_init(&batch);
+  for (size_t i = 0; i < njobs; i++) {
+    void *job = (char *)jobs + i * job_size;
+    if (thread_pool_submit(pool, THREAD_POOL_LOCAL_QUEUE,
+                           (ThreadPoolTask *)job, &batch, fn, job) != 0) {
+      fn(job);
+    }
+  }
+  thread_pool_wait(pool, &batch);
+}
+
+// Hash the blocks of a buffer into digest->digests, starting at block first
+static int digest_blocks(const LayerDigest *digest, size_t first,
+                         const uint8_t *data, size_t len) {
+  uint8_t *out = (uint8_t *)digest->digests;
+  const size_t step = digest->block_size;
+  if (step == 0) {
+    return -1;
+  }
+  for (size_t done = 0; done < len; done += step, first++) {
+    size_t n = len - done < step ? len - done : step;
+    if (digest->hash_block(data + done, n, out + first * digest->digest_size,
+                           digest->arg) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Digests of a request are computed block by block, next to the compression
+// of each block, when they have the granularity of the layer's blocks.
+// Others are computed from the whole buffer.
+static int digests_per_block(const CompressionState *state,
+                             const LayerDigest *digest) {
+  return digest && digest->block_size == state->block_size;
+}
+
+// One block of a pwrite
+typedef struct {
+  ThreadPoolTask task;
+  CompressionState *state;
+  const CompressionPolicy *policy;
+  const LayerDigest *digest; // digest of the plaintext to compute, or NULL
+  size_t slot;               // block of the request, its digest
+  const void *data;
+  size_t size;
+  void *stored;
+  size_t stored_size;
+  int is_uncompressed;
+  int tried;
+  int may_be_hole; // stored as a hole if it is all zero
+  int hole;        // all zero, nothing to write
+  int result;
+} CompressJob;
+
+static void *compress_job(void *arg) {
+  CompressJob *job = arg;
+  if (job->digest && digest_blocks(job->digest, job->slot, job->data,
+                                   job->size) != 0) {
+    job->result = -1;
+    return NULL;
+  }
+  if (job->may_be_hole && mem_is_zero(job->data, job->size)) {
+    job->hole = 1;
+    job->result = 0;
+    return NULL;
+  }
+  job->result = compress_block(job->state, job->policy, job->data, job->size,
+                               &job->stored, &job->stored_size,
+                               &job->is_uncompressed, &job->tried);
+  return NULL;
+}
+
+static void free_compress_jobs(CompressJob *jobs, size_t njobs) {
+  for (size_t i = 0; i < njobs; i++) {
+    free(jobs[i].stored);
+  }
+  free(jobs);
+}
+
+// Compress the blocks of a pwrite. On the pool every block is decided with the
+// policy as it was before the write, and the outcomes are recorded in block
+// order afterwards.
+static int compress_blocks(CompressionState *state,
+                           CompressedFileMapping *mapping, CompressJob *jobs,
+                           size_t njobs) {
+  int parallel = runs_on_pool(state, njobs);
+  if (parallel) {
+    run_on_pool(state->pool, jobs, sizeof(CompressJob), njobs, compress_job);
+  }
+  for (size_t i = 0; i < njobs; i++) {
+    if (!parallel) {
+      compress_job(&jobs[i]);
+    }
+    if (jobs[i].result != 0) {
+      return -1;
+    }
+    if (!jobs[i].hole) {
+      policy_record(state, &mapping->policy, jobs[i].size,
+                    jobs[i].stored_size, jobs[i].tried);
+    }
+  }
+  return 0;
+}
+
+// One compressed block of a pread, already read from storage
+typedef struct {
+  ThreadPoolTask task;
+  const Compressor *compressor;
+  const LayerDigest *digest; // digest of the plaintext to compute, or NULL
+  size_t slot;               // block of the request, its digest
+  size_t block;
+  uint8_t *cbuf;
+  size_t cblock_len;
+  uint8_t *dst;
+  size_t out_size;
+  ssize_t result;
+} DecompressJob;
+
+static void *decompress_job(void *arg) {
+  DecompressJob *job = arg;
+  job->result = compressor_decompress_block(job->compressor, job->cbuf,
+                                            job->cblock_len, job->dst,
+                                            &job->out_size);
+  // hashed while the plaintext is still in cache
+  if (job->result >= 0 && job->digest &&
+      digest_blocks(job->digest, job->slot, job->dst, job->out_size) != 0) {
+    job->result = -1;
+  }
+  return NULL;
+}
+
+// A zero block of a pwrite is stored as a hole, which reads back as zeros
+// without the next layer, when it is a whole block, is not the last block of
+// the file (its payload gives the logical EOF to an index rebuilt from
+// storage), and the payload it replaces, if any, can be punched so that a
+// rebuilt index does not find it again.
+static int may_be_hole(const CompressionState *state,
+                       const CompressedFileMapping *mapping, size_t idx,
+                       size_t size, LayerContext l) {
+  if (size != state->block_size || idx + 1 >= mapping->num_blocks) {
+    return 0;
+  }
+  off_t old_stored_size = block_stored_size(mapping, idx);
+  return old_stored_size == 0 ||
+         (old_stored_size != BLOCK_SIZE_UNKNOWN && state->free_space &&
+          l.next_layers->ops->lfallocate != NULL);
+}
+
+// Write a zero block that could not be a hole as it is
+static int store_zeros_raw(int fd, CompressJob *job, off_t physical_offset,
+                           LayerContext l) {
+  if (l.next_layers->ops->lpwrite(fd, job->data, job->size, physical_offset,
+                                  *l.next_layers) != (ssize_t)job->size) {
+    return -1;
+  }
+  job->hole = 0;
+  job->stored_size = job->size;
+  job->is_uncompressed = 1;
+  return 0;
+}
+
+/**
+ * @brief pwrite of sparse_block mode, with the digests of the plaintext
+ *
+ * @param digest -> digests to compute (see LayerDigest), or NULL
+ */
+static ssize_t sparse_block_write(int fd, const void *buffer, size_t nbyte,
+                                  off_t offset, const LayerDigest *digest,
+                                  LayerContext l) {
   if (!validate_compression_fd_offset_and_nbyte(
           fd, offset, nbyte, "COMPRESSION_LAYER: SPARSE_BLOCK_PWRITE")) {
     return INVALID_FD;
   }
 
   CompressionState *state = (CompressionState *)l.internal_state;
+  compactor_note_io(state->compactor);
 
   // Lookup fd in hash table
   FdToInode *entry = fd_to_inode_lookup(state, fd);
@@ -74,6 +257,20 @@ ssize_t compression_sparse_block_pwrite(int fd, const void *buffer,
     return INVALID_FD;
   }
 
+  // Punching holes needs the stored size of the blocks being replaced
+  size_t first_block_index = (size_t)(offset / block_size);
+  if (state->free_space &&
+      scan_block_range(fd, path, block_index, first_block_index,
+                       first_block_index + num_blocks - 1, l) != 0) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SPARSE_BLOCK_PWRITE] Failed to scan blocks",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+  index_file_invalidate(path, block_index, l);
+  block_cache_invalidate(state->block_cache, device, inode, first_block_index,
+                         first_block_index + num_blocks - 1);
+
   // Get current logical EOF (logical size) if present
   off_t current_logical_eof = 0;
   if (get_logical_eof_from_mapping(device, inode, l, &current_logical_eof) !=
@@ -84,80 +281,133 @@ ssize_t compression_sparse_block_pwrite(int fd, const void *buffer,
     return INVALID_FD;
   }
 
-  // Compress and write each block
+  CompressJob *jobs = calloc(num_blocks, sizeof(CompressJob));
+  if (!jobs) {
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SPARSE_BLOCK_PWRITE] Failed to allocate jobs",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
   for (size_t i = 0; i < num_blocks; i++) {
-    size_t current_block_index = (size_t)(offset / block_size) + i;
-
-    size_t block_start = i * block_size;
-    const void *block_data = (const char *)buffer + block_start;
-
+    jobs[i].state = state;
+    jobs[i].policy = &block_index->policy;
+    jobs[i].data = (const char *)buffer + i * block_size;
     // Determine logical size for this block (last block might be partial)
-    size_t logical_size = block_size;
-    if (i == num_blocks - 1) {
-      logical_size = nbyte - i * block_size;
-    }
+    jobs[i].size = i == num_blocks - 1 ? nbyte - i * block_size : block_size;
+    jobs[i].digest = digests_per_block(state, digest) ? digest : NULL;
+    jobs[i].slot = i;
+    jobs[i].may_be_hole = may_be_hole(state, block_index,
+                                      first_block_index + i, jobs[i].size, l);
+  }
+  if (digest && !digests_per_block(state, digest) &&
+      digest_blocks(digest, 0, buffer, nbyte) != 0) {
+    free(jobs);
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SPARSE_BLOCK_PWRITE] Failed to hash blocks",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
+  if (compress_blocks(state, block_index, jobs, num_blocks) != 0) {
+    free_compress_jobs(jobs, num_blocks);
+    error_msg_and_release_lock(
+        "[COMPRESSION_LAYER: SPARSE_BLOCK_PWRITE] Failed to compress block",
+        state->lock_table, path);
+    return INVALID_FD;
+  }
 
-    // Use helper function to compress and decide storage format
-    void *data_to_store = NULL;
-    size_t store_size = 0;
-    int is_uncompressed = 0;
-    if (compress_or_store_raw(state, block_data, logical_size, &data_to_store,
-                              &store_size, &is_uncompressed) < 0) {
-      error_msg_and_release_lock(
-          "[COMPRESSION_LAYER: SPARSE_BLOCK_PWRITE] Failed to compress block",
-          state->lock_table, path);
-      return INVALID_FD;
+  // Write the blocks, a run whose slots are filled up to the next one in a
+  // single vectored write. Holes are not written.
+  struct iovec iov[LAYER_IOV_MAX];
+  for (size_t i = 0; i < num_blocks;) {
+    size_t run = 1;
+    while (i + run < num_blocks && run < LAYER_IOV_MAX && !jobs[i].hole &&
+           !jobs[i + run].hole && jobs[i + run - 1].stored_size == block_size) {
+      run++;
     }
 
-    off_t physical_offset = (off_t)(current_block_index * block_size);
-
-    ssize_t write_result = l.next_layers->ops->lpwrite(
-        fd, data_to_store, store_size, physical_offset, *l.next_layers);
+    off_t physical_offset = (off_t)((first_block_index + i) * block_size);
+    ssize_t write_result = 0; // a hole is a run of one, with nothing written
+    if (run == 1 && !jobs[i].hole) {
+      write_result =
+          l.next_layers->ops->lpwrite(fd, jobs[i].stored, jobs[i].stored_size,
+                                      physical_offset, *l.next_layers);
+    } else if (run > 1) {
+      for (size_t j = 0; j < run; j++) {
+        iov[j].iov_base = jobs[i + j].stored;
+        iov[j].iov_len = jobs[i + j].stored_size;
+      }
+      write_result = layer_pwritev(fd, iov, (int)run, physical_offset,
+                                   *l.next_layers);
+    }
 
     if (write_result < 0) {
-      free(data_to_store);
+      free_compress_jobs(jobs, num_blocks);
       error_msg_and_release_lock(
           "[COMPRESSION_LAYER: SPARSE_BLOCK_PWRITE] Failed to write to storage",
           state->lock_table, path);
       return INVALID_FD;
     }
 
-    // Punch a hole if the new stored size is smaller than the previously
-    // stored payload for this block. This reclaims trailing bytes in-place.
-    off_t old_stored_size = 0;
-    if (current_block_index < block_index->capacity) {
-      old_stored_size = block_index->sizes[current_block_index];
-    }
-
-    if (state->free_space && l.next_layers->ops->lfallocate != NULL &&
-        old_stored_size > (off_t)store_size) {
-      off_t punch_offset = physical_offset + (off_t)store_size;
-      off_t punch_len = old_stored_size - (off_t)store_size;
-      if (l.next_layers->ops->lfallocate(
-              fd, punch_offset, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-              punch_len, l) < 0) {
-        ERROR_MSG("[COMPRESSION_LAYER: SPARSE_BLOCK_PWRITE] "
-                  "Failed to punch trailing bytes");
+    for (size_t j = i; j < i + run; j++) {
+      size_t current_block_index = first_block_index + j;
+      size_t store_size = jobs[j].stored_size;
+      physical_offset = (off_t)(current_block_index * block_size);
+
+      // Punch a hole if the new stored size is smaller than the previously
+      // stored payload for this block. This reclaims trailing bytes in-place.
+      off_t old_stored_size = 0;
+      if (current_block_index < block_index->capacity) {
+        old_stored_size =
+            block_stored_size(block_index, current_block_index);
       }
-    }
 
-    // Update mapping after successful write
-    block_index->sizes[current_block_index] = (off_t)store_size;
-    block_index->is_uncompressed[current_block_index] = is_uncompressed;
+      if (state->free_space && l.next_layers->ops->lfallocate != NULL &&
+          old_stored_size > (off_t)store_size) {
+        off_t punch_offset = physical_offset + (off_t)store_size;
+        off_t punch_len = old_stored_size - (off_t)store_size;
+        if (l.next_layers->ops->lfallocate(
+                fd, punch_offset, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                punch_len, *l.next_layers) < 0) {
+          ERROR_MSG("[COMPRESSION_LAYER: SPARSE_BLOCK_PWRITE] "
+                    "Failed to punch trailing bytes");
+          // a hole would leave the old payload: the zeros go over it raw
+          if (jobs[j].hole &&
+              store_zeros_raw(fd, &jobs[j], physical_offset, l) != 0) {
+            free_compress_jobs(jobs, num_blocks);
+            error_msg_and_release_lock(
+                "[COMPRESSION_LAYER: SPARSE_BLOCK_PWRITE] Failed to write to "
+                "storage",
+                state->lock_table, path);
+            return INVALID_FD;
+          }
+          store_size = jobs[j].stored_size;
+        }
+      }
 
-    // Update num_blocks if necessary
-    if (current_block_index >= block_index->num_blocks) {
-      block_index->num_blocks = current_block_index + 1;
-    }
+      // Update mapping after successful write
+      if (block_set(block_index, current_block_index, (off_t)store_size,
+                    jobs[j].is_uncompressed) != 0) {
+        free_compress_jobs(jobs, num_blocks);
+        error_msg_and_release_lock("[COMPRESSION_LAYER: SPARSE_BLOCK_PWRITE] "
+                                   "Failed to update the block index",
+                                   state->lock_table, path);
+        return INVALID_FD;
+      }
 
-    DEBUG_MSG("[COMPRESSION_LAYER: SPARSE_BLOCK_PWRITE] Block %zu: "
-              "stored_size=%zu (is_uncompressed=%d, physical_offset=%ld)",
-              current_block_index, store_size,
-              block_index->is_uncompressed[current_block_index],
-              physical_offset);
+      // Update num_blocks if necessary
+      if (current_block_index >= block_index->num_blocks) {
+        block_index->num_blocks = current_block_index + 1;
+      }
 
-    free(data_to_store);
+      DEBUG_MSG("[COMPRESSION_LAYER: SPARSE_BLOCK_PWRITE] Block %zu: "
+                "stored_size=%zu (is_uncompressed=%d, physical_offset=%ld)",
+                current_block_index, store_size,
+                block_is_raw(block_index, current_block_index),
+                physical_offset);
+    }
+    i += run;
   }
+  free_compress_jobs(jobs, num_blocks);
 
   // Only extend the original size if this write goes beyond current EOF
   off_t candidate_new_eof = offset + (off_t)nbyte;
@@ -175,8 +425,27 @@ ssize_t compression_sparse_block_pwrite(int fd, const void *buffer,
   return (ssize_t)nbyte;
 }
 
-ssize_t compression_sparse_block_pread(int fd, void *buffer, size_t nbyte,
-                                       off_t offset, LayerContext l) {
+ssize_t compression_sparse_block_pwrite(int fd, const void *buffer,
+                                        size_t nbyte, off_t offset,
+                                        LayerContext l) {
+  return sparse_block_write(fd, buffer, nbyte, offset, NULL, l);
+}
+
+ssize_t compression_sparse_block_pwrite_digest(int fd, const void *buffer,
+                                               size_t nbyte, off_t offset,
+                                               const LayerDigest *digest,
+                                               LayerContext l) {
+  return sparse_block_write(fd, buffer, nbyte, offset, digest, l);
+}
+
+/**
+ * @brief pread of sparse_block mode, with the digests of the plaintext
+ *
+ * @param digest -> digests to compute (see LayerDigest), or NULL
+ */
+static ssize_t sparse_block_read(int fd, void *buffer, size_t nbyte,
+                                 off_t offset, const LayerDigest *digest,
+                                 LayerContext l) {
   if (!validate_compression_fd_offset_and_nbyte(
           fd, offset, nbyte, "COMPRESSION_LAYER: SPARSE_BLOCK_PREAD")) {
     return INVALID_FD;
@@ -187,6 +456,7 @@ ssize_t compression_sparse_block_pread(int fd, void *buffer, size_t nbyte,
   }
 
   CompressionState *state = (CompressionState *)l.internal_state;
+  compactor_note_io(state->compactor);
 
   // Lookup fd in hash table
   FdToInode *entry = fd_to_inode_lookup(state, fd);
@@ -216,6 +486,31 @@ ssize_t compression_sparse_block_pread(int fd, void *buffer, size_t nbyte,
     return INVALID_FD;
   }
 
+  // Blocks of a rebuilt index are scanned on first read, under the write lock
+  // since this updates the mapping
+  size_t first_block = (size_t)(offset / state->block_size);
+  size_t last_block = (size_t)((offset + nbyte - 1) / state->block_size);
+  CompressedFileMapping *scanned =
+      get_compressed_file_mapping(device, inode, state);
+  if (scanned && has_unscanned_blocks(scanned, first_block, last_block)) {
+    locking_release(state->lock_table, path);
+    if (locking_acquire_write(state->lock_table, path) != 0) {
+      error_msg_and_release_lock(
+          "[COMPRESSION_LAYER: SPARSE_BLOCK_PREAD] Failed to acquire "
+          "write lock on file",
+          NULL, NULL);
+      return INVALID_FD;
+    }
+    scanned = get_compressed_file_mapping(device, inode, state);
+    if (scanned &&
+        scan_block_range(fd, path, scanned, first_block, last_block, l) != 0) {
+      error_msg_and_release_lock(
+          "[COMPRESSION_LAYER: SPARSE_BLOCK_PREAD] Failed to scan blocks",
+          state->lock_table, path);
+      return INVALID_FD;
+    }
+  }
+
   size_t bytes_to_read = nbyte;
   off_t original_size;
   if (get_logical_eof_from_mapping(device, inode, l, &original_size) != 0) {
@@ -262,7 +557,18 @@ ssize_t compression_sparse_block_pread(int fd, void *buffer, size_t nbyte,
   // Aligned I/O: each block is stored at its logical start (idx * block_size)
   // Read each compressed block from its logical start, then decompress directly
   // into the caller buffer at the corresponding offset from the request base.
-  for (size_t i = 0; i < num_blocks; i++) {
+  DecompressJob *jobs = calloc(num_blocks, sizeof(DecompressJob));
+  if (!jobs) {
+    error_msg_and_release_lock("[COMPRESSION_LAYER: SPARSE_BLOCK_PREAD] "
+                               "Failed to allocate jobs",
+                               state->lock_table, path);
+    return INVALID_FD;
+  }
+  size_t njobs = 0;
+  const char *error = NULL;
+  const LayerDigest *block_digest =
+      digests_per_block(state, digest) ? digest : NULL;
+  for (size_t i = 0; i < num_blocks && !error; i++) {
     size_t idx = (size_t)initial_block_index + i;
 
     // Destination inside user buffer relative to request base (aligned)
@@ -270,109 +576,299 @@ ssize_t compression_sparse_block_pread(int fd, void *buffer, size_t nbyte,
     size_t out_size =
         (i == num_blocks - 1) ? (bytes_to_read - i * block_size) : block_size;
 
-    size_t cblock_len = (size_t)block_index->sizes[idx];
+    size_t cblock_len = (size_t)block_stored_size(block_index, idx);
     if (cblock_len == 0) {
       DEBUG_MSG("Sparse block - return zeros");
       memset(dst_decompressed, 0, out_size);
+      if (block_digest &&
+          digest_blocks(block_digest, i, dst_decompressed, out_size) != 0) {
+        error = "[COMPRESSION_LAYER: SPARSE_BLOCK_PREAD] Failed to hash block";
+      }
+      continue;
+    }
+
+    int is_raw = block_is_raw(block_index, idx);
+    if (!is_raw && block_cache_get(state->block_cache, device, inode, idx,
+                                   dst_decompressed, out_size)) {
+      if (block_digest &&
+          digest_blocks(block_digest, i, dst_decompressed, out_size) != 0) {
+        error = "[COMPRESSION_LAYER: SPARSE_BLOCK_PREAD] Failed to hash block";
+      }
       continue;
     }
 
     off_t phys_off = (off_t)(idx * block_size); // sparse layout: logical start
 
     // Read compressed block into a temporary buffer
-    uint8_t *cbuf = malloc(cblock_len);
+    uint8_t *cbuf = buffer_pool_get(state->buffers, cblock_len);
     if (!cbuf) {
-      error_msg_and_release_lock("[COMPRESSION_LAYER: SPARSE_BLOCK_PREAD] "
-                                 "Failed to allocate compressed buffer",
-                                 state->lock_table, path);
-      return INVALID_FD;
+      error = "[COMPRESSION_LAYER: SPARSE_BLOCK_PREAD] "
+              "Failed to allocate compressed buffer";
+      break;
     }
     ssize_t res = l.next_layers->ops->lpread(fd, cbuf, cblock_len, phys_off,
                                              *l.next_layers);
     if (res != (ssize_t)cblock_len) {
-      free(cbuf);
-      error_msg_and_release_lock(
-          "[COMPRESSION_LAYER: COMPRESSION_SPARSE_BLOCK_PREAD] short read",
-          state->lock_table, path);
-      return INVALID_FD;
+      buffer_pool_put(state->buffers, cbuf);
+      error = "[COMPRESSION_LAYER: COMPRESSION_SPARSE_BLOCK_PREAD] short read";
+      break;
     }
 
-    if (block_index->is_uncompressed &&
-        block_index->is_uncompressed[idx] == 1) {
+    if (is_raw) {
       // Uncompressed block: copy directly
       size_t to_copy = cblock_len < out_size ? cblock_len : out_size;
       memcpy(dst_decompressed, cbuf, to_copy);
-    } else {
-      // Compressed block: decompress into the caller buffer
-      if (state->compressor.decompress_data(cbuf, cblock_len, dst_decompressed,
-                                            &out_size) < 0) {
-        free(cbuf);
-        error_msg_and_release_lock(
-            "[COMPRESSION_LAYER: COMPRESSION_SPARSE_BLOCK_PREAD] Failed to "
-            "decompress data",
-            state->lock_table, path);
-        return INVALID_FD;
+      buffer_pool_put(state->buffers, cbuf);
+      if (block_digest &&
+          digest_blocks(block_digest, i, dst_decompressed, out_size) != 0) {
+        error = "[COMPRESSION_LAYER: SPARSE_BLOCK_PREAD] Failed to hash block";
       }
+      continue;
     }
 
-    free(cbuf);
+    // Compressed block: decompressed (and hashed) into the caller buffer below
+    DecompressJob *job = &jobs[njobs++];
+    job->compressor = &state->compressor;
+    job->digest = block_digest;
+    job->slot = i;
+    job->block = idx;
+    job->cbuf = cbuf;
+    job->cblock_len = cblock_len;
+    job->dst = dst_decompressed;
+    job->out_size = out_size;
+  }
+
+  if (!error) {
+    if (runs_on_pool(state, njobs)) {
+      run_on_pool(state->pool, jobs, sizeof(DecompressJob), njobs,
+                  decompress_job);
+    } else {
+      for (size_t i = 0; i < njobs; i++) {
+        decompress_job(&jobs[i]);
+      }
+    }
+    for (size_t i = 0; i < njobs && !error; i++) {
+      if (jobs[i].result < 0) {
+        error = "[COMPRESSION_LAYER: COMPRESSION_SPARSE_BLOCK_PREAD] Failed to "
+                "decompress data";
+      } else {
+        block_cache_put(state->block_cache, device, inode, jobs[i].block,
+                        jobs[i].dst, (size_t)jobs[i].result);
+      }
+    }
+  }
+  for (size_t i = 0; i < njobs; i++) {
+    buffer_pool_put(state->buffers, jobs[i].cbuf);
+  }
+  free(jobs);
+  if (!error && digest && !block_digest &&
+      digest_blocks(digest, 0, buffer, bytes_to_read) != 0) {
+    error = "[COMPRESSION_LAYER: SPARSE_BLOCK_PREAD] Failed to hash blocks";
+  }
+  if (error) {
+    error_msg_and_release_lock(error, state->lock_table, path);
+    return INVALID_FD;
   }
   locking_release(state->lock_table, path);
 
   return (ssize_t)bytes_to_read;
 }
 
-// perform physical truncate and report on failure
-static int physical_truncate(const LayerContext *next_layers, int fd,
-                             off_t size, LockTable *lock_table,
-                             const char *path, const char *errmsg) {
-  int res = next_layers->ops->lftruncate(fd, size, *next_layers);
-  if (res < 0) {
-    error_msg_and_release_lock(errmsg, lock_table, path);
-    return -1;
-  }
-  return 0;
+ssize_t compression_sparse_block_pread(int fd, void *buffer, size_t nbyte,
+                                       off_t offset, LayerContext l) {
+  return sparse_block_read(fd, buffer, nbyte, offset, NULL, l);
 }
 
-// Helper: compress data and decide whether to store compressed or uncompressed
-// Always returns a buffer ready to write in *out_buffer (caller must free).
-// If compression is not beneficial, returns a copy of the original data.
-// Returns size in *out_size and compression flag in *out_is_uncompressed.
-// Returns 0 on success, -1 on failure.
-static int compress_or_store_raw(CompressionState *state, const void *data,
-                                 size_t data_size, void **out_buffer,
-                                 size_t *out_size, int *out_is_uncompressed) {
-  size_t max_comp =
-      state->compressor.get_compress_bound(data_size, state->compressor.level);
-  uint8_t *compressed = (uint8_t *)malloc(max_comp);
-  if (!compressed) {
+ssize_t compression_sparse_block_pread_digest(int fd, void *buffer,
+                                              size_t nbyte, off_t offset,
+                                              const LayerDigest *digest,
+                                              LayerContext l) {
+  return sparse_block_read(fd, buffer, nbyte, offset, digest, l);
+}
+
+// Clones the blocks of [offset_in, offset_in + len) of the source, the write
+// locks of both files being held: the stored bytes are copied as they are by
+// the next layer, and the index entries follow
+static ssize_t clone_blocks(int fd_in, const char *src_path, off_t offset_in,
+                            int fd_out, const char *dst_path, off_t offset_out,
+                            size_t len, LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const size_t block_size = state->block_size;
+
+  dev_t src_device, dst_device;
+  ino_t src_inode, dst_inode;
+  if (get_file_key_from_fd(fd_in, l, &src_device, &src_inode) != 0 ||
+      get_file_key_from_fd(fd_out, l, &dst_device, &dst_inode) != 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: SPARSE_BLOCK_COPY_FILE_RANGE] Failed to "
+              "get file key");
+    errno = EIO;
+    return -1;
+  }
+  CompressedFileMapping *src =
+      get_compressed_file_mapping(src_device, src_inode, state);
+  CompressedFileMapping *dst =
+      get_compressed_file_mapping(dst_device, dst_inode, state);
+  off_t src_eof, dst_eof;
+  if (!src || !dst ||
+      get_logical_eof_from_mapping(src_device, src_inode, l, &src_eof) != 0 ||
+      get_logical_eof_from_mapping(dst_device, dst_inode, l, &dst_eof) != 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: SPARSE_BLOCK_COPY_FILE_RANGE] Missing "
+              "block index mapping");
+    errno = EIO;
     return -1;
   }
+  if (offset_in >= src_eof || len == 0) {
+    return 0;
+  }
+  if ((off_t)len > src_eof - offset_in) {
+    len = (size_t)(src_eof - offset_in);
+  }
 
-  ssize_t comp_size = state->compressor.compress_data(
-      data, data_size, compressed, max_comp, state->compressor.level);
-  if (comp_size < 0) {
-    free(compressed);
+  // Whole blocks only, the last one may end the source; the destination
+  // blocks must hold nothing yet, so that no stored bytes are left behind
+  size_t first = (size_t)(offset_in / block_size);
+  size_t count = (len + block_size - 1) / block_size;
+  size_t dst_first = (size_t)(offset_out / block_size);
+  if ((len % block_size != 0 && offset_in + (off_t)len != src_eof) ||
+      dst_eof % (off_t)block_size != 0 || offset_out < dst_eof) {
+    errno = EXDEV;
     return -1;
   }
+  if (has_unscanned_blocks(src, first, first + count - 1) &&
+      scan_block_range(fd_in, src_path, src, first, first + count - 1, l) !=
+          0) {
+    ERROR_MSG("[COMPRESSION_LAYER: SPARSE_BLOCK_COPY_FILE_RANGE] Failed to "
+              "scan blocks");
+    errno = EIO;
+    return -1;
+  }
+  // a trailing hole would leave the stored file shorter than its size
+  if (block_stored_size(src, first + count - 1) == 0) {
+    errno = EXDEV;
+    return -1;
+  }
+  if (ensure_block_index_capacity(dst, dst_first + count) != 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+  index_file_invalidate(dst_path, dst, l);
+  block_cache_invalidate(state->block_cache, dst_device, dst_inode, dst_first,
+                         dst_first + count - 1);
+
+  // A run of blocks whose slots are filled up to the next one is one range
+  // of the next layer, holes are skipped
+  for (size_t i = 0; i < count;) {
+    off_t stored = block_stored_size(src, first + i);
+    if (stored == 0) {
+      i++;
+      continue;
+    }
+    size_t run = 1;
+    size_t nbyte = (size_t)stored;
+    while (i + run < count && stored == (off_t)block_size) {
+      stored = block_stored_size(src, first + i + run);
+      if (stored == 0) {
+        break;
+      }
+      nbyte += (size_t)stored;
+      run++;
+    }
+    off_t from = (off_t)((first + i) * block_size);
+    off_t to = (off_t)((dst_first + i) * block_size);
+    for (size_t done = 0; done < nbyte;) {
+      ssize_t res = layer_copy_file_range(fd_in, from + (off_t)done, fd_out,
+                                          to + (off_t)done, nbyte - done, 0,
+                                          *l.next_layers);
+      if (res <= 0) {
+        ERROR_MSG("[COMPRESSION_LAYER: SPARSE_BLOCK_COPY_FILE_RANGE] Failed "
+                  "to copy blocks in storage");
+        errno = res == 0 ? EIO : errno;
+        return -1;
+      }
+      done += (size_t)res;
+    }
+    i += run;
+  }
 
-  // If compression is not beneficial (compressed >= original), store
-  // uncompressed
-  if ((size_t)comp_size >= data_size) {
-    free(compressed);
-    // Allocate a copy of the original data
-    void *uncompressed_copy = malloc(data_size);
-    if (!uncompressed_copy) {
+  for (size_t i = 0; i < count; i++) {
+    if (block_set(dst, dst_first + i, block_stored_size(src, first + i),
+                  block_is_raw(src, first + i)) != 0) {
+      ERROR_MSG("[COMPRESSION_LAYER: SPARSE_BLOCK_COPY_FILE_RANGE] Failed "
+                "to update the block index");
+      errno = ENOMEM;
       return -1;
     }
-    memcpy(uncompressed_copy, data, data_size);
-    *out_buffer = uncompressed_copy;
-    *out_size = data_size;
-    *out_is_uncompressed = 1;
-  } else {
-    *out_buffer = compressed;
-    *out_size = (size_t)comp_size;
-    *out_is_uncompressed = 0;
+  }
+  if (dst_first + count > dst->num_blocks) {
+    dst->num_blocks = dst_first + count;
+  }
+  if (set_logical_eof_in_mapping(dst_device, dst_inode,
+                                 offset_out + (off_t)len, l) != 0) {
+    ERROR_MSG("[COMPRESSION_LAYER: SPARSE_BLOCK_COPY_FILE_RANGE] Failed to "
+              "update original file size in mapping");
+    errno = EIO;
+    return -1;
+  }
+  return (ssize_t)len;
+}
+
+ssize_t compression_sparse_block_copy_file_range(int fd_in, off_t offset_in,
+                                                 int fd_out, off_t offset_out,
+                                                 size_t len,
+                                                 unsigned int flags,
+                                                 LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  FdToInode *in = fd_to_inode_lookup(state, fd_in);
+  FdToInode *out = fd_to_inode_lookup(state, fd_out);
+  // anything but whole blocks appended to another file is read and written
+  // by layer_copy_file_range
+  if (flags != 0 || !in || !out || strcmp(in->path, out->path) == 0 ||
+      offset_in < 0 || offset_out < 0 ||
+      offset_in % (off_t)state->block_size != 0 ||
+      offset_out % (off_t)state->block_size != 0) {
+    errno = EXDEV;
+    return -1;
+  }
+  compactor_note_io(state->compactor);
+
+  // both files are locked in the order of their paths
+  const char *src_path = in->path;
+  const char *dst_path = out->path;
+  const char *lock_first = strcmp(src_path, dst_path) < 0 ? src_path : dst_path;
+  const char *lock_second = lock_first == src_path ? dst_path : src_path;
+  if (locking_acquire_write(state->lock_table, lock_first) != 0) {
+    error_msg_and_release_lock("[COMPRESSION_LAYER: "
+                               "SPARSE_BLOCK_COPY_FILE_RANGE] Failed to "
+                               "acquire write lock",
+                               NULL, NULL);
+    errno = EIO;
+    return -1;
+  }
+  if (locking_acquire_write(state->lock_table, lock_second) != 0) {
+    error_msg_and_release_lock("[COMPRESSION_LAYER: "
+                               "SPARSE_BLOCK_COPY_FILE_RANGE] Failed to "
+                               "acquire write lock",
+                               state->lock_table, lock_first);
+    errno = EIO;
+    return -1;
+  }
+  ssize_t res = clone_blocks(fd_in, src_path, offset_in, fd_out, dst_path,
+                             offset_out, len, l);
+  int err = errno;
+  locking_release(state->lock_table, lock_second);
+  locking_release(state->lock_table, lock_first);
+  errno = err;
+  return res;
+}
+
+// perform physical truncate and report on failure
+static int physical_truncate(const LayerContext *next_layers, int fd,
+                             off_t size, LockTable *lock_table,
+                             const char *path, const char *errmsg) {
+  int res = next_layers->ops->lftruncate(fd, size, *next_layers);
+  if (res < 0) {
+    error_msg_and_release_lock(errmsg, lock_table, path);
+    return -1;
   }
   return 0;
 }
@@ -403,11 +899,17 @@ static int shrink_at_boundary(int fd, CompressedFileMapping *bim,
 
   if (keep_bytes == 0) {
     // Exact block boundary: keep the complete last block
-    phys_trunc = phys_off + (off_t)bim->sizes[last_block_index];
+    phys_trunc = phys_off + (off_t)block_stored_size(bim, last_block_index);
   } else {
     // Partial block: truncate within the block
     phys_trunc = phys_off + (off_t)keep_bytes;
-    bim->sizes[last_block_index] = (off_t)keep_bytes;
+    if (block_set(bim, (size_t)last_block_index, (off_t)keep_bytes,
+                  block_is_raw(bim, (size_t)last_block_index)) != 0) {
+      error_msg_and_release_lock("[COMPRESSION_LAYER: SPARSE_BLOCK_FTRUNCATE] "
+                                 "Failed to update the block index",
+                                 lock_table, path);
+      return -1;
+    }
   }
 
   if (physical_truncate(next_layers, fd, phys_trunc, lock_table, path,
@@ -452,7 +954,7 @@ static int shrink_compressed_partial(int fd, CompressedFileMapping *bim,
   const char *path = entry->path;
 
   off_t phys_off = last_block_index * (off_t)block_size;
-  off_t csize = bim->sizes[last_block_index];
+  off_t csize = block_stored_size(bim, last_block_index);
   if (csize <= 0) {
     error_msg_and_release_lock("[COMPRESSION_LAYER: SPARSE_BLOCK_FTRUNCATE] "
                                "Invalid compressed size for last block",
@@ -460,7 +962,7 @@ static int shrink_compressed_partial(int fd, CompressedFileMapping *bim,
     return -1;
   }
 
-  uint8_t *compressed_src = (uint8_t *)malloc((size_t)csize);
+  uint8_t *compressed_src = buffer_pool_get(state->buffers, (size_t)csize);
   if (!compressed_src) {
     error_msg_and_release_lock("[COMPRESSION_LAYER: SPARSE_BLOCK_FTRUNCATE] "
                                "Failed to allocate compressed buffer",
@@ -470,47 +972,48 @@ static int shrink_compressed_partial(int fd, CompressedFileMapping *bim,
   ssize_t read_result = next_layers->ops->lpread(
       fd, compressed_src, (size_t)csize, phys_off, *next_layers);
   if (read_result != (ssize_t)csize) {
-    free(compressed_src);
+    buffer_pool_put(state->buffers, compressed_src);
     error_msg_and_release_lock("[COMPRESSION_LAYER: SPARSE_BLOCK_FTRUNCATE] "
                                "Failed to read last compressed block",
                                lock_table, path);
     return -1;
   }
 
-  uint8_t *decompressed = (uint8_t *)malloc(block_size);
+  uint8_t *decompressed = buffer_pool_get(state->buffers, block_size);
   if (!decompressed) {
-    free(compressed_src);
+    buffer_pool_put(state->buffers, compressed_src);
     error_msg_and_release_lock("[COMPRESSION_LAYER: SPARSE_BLOCK_FTRUNCATE] "
                                "Failed to allocate decompress buffer",
                                lock_table, path);
     return -1;
   }
   size_t out_size = block_size;
-  ssize_t decompress_result = state->compressor.decompress_data(
-      compressed_src, (size_t)csize, decompressed, &out_size);
+  ssize_t decompress_result =
+      compressor_decompress_block(&state->compressor, compressed_src,
+                                  (size_t)csize, decompressed, &out_size);
   if (decompress_result < 0) {
-    free(decompressed);
-    free(compressed_src);
+    buffer_pool_put(state->buffers, decompressed);
+    buffer_pool_put(state->buffers, compressed_src);
     error_msg_and_release_lock(
         "[COMPRESSION_LAYER: SPARSE_BLOCK_FTRUNCATE] Decompression failed",
         lock_table, path);
     return -1;
   }
-  free(compressed_src);
+  buffer_pool_put(state->buffers, compressed_src);
 
   if (physical_truncate(next_layers, fd, phys_off, lock_table, path,
                         "[COMPRESSION_LAYER: SPARSE_BLOCK_FTRUNCATE] Failed "
                         "truncate before rewrite") < 0) {
-    free(decompressed);
+    buffer_pool_put(state->buffers, decompressed);
     return -1;
   }
 
   void *write_buf = NULL;
   size_t write_len = 0;
   int mark_uncompressed = 0;
-  if (compress_or_store_raw(state, decompressed, keep, &write_buf, &write_len,
-                            &mark_uncompressed) < 0) {
-    free(decompressed);
+  if (compress_or_store_raw(state, &bim->policy, decompressed, keep,
+                            &write_buf, &write_len, &mark_uncompressed) < 0) {
+    buffer_pool_put(state->buffers, decompressed);
     error_msg_and_release_lock(
         "[COMPRESSION_LAYER: SPARSE_BLOCK_FTRUNCATE] Recompression failed",
         lock_table, path);
@@ -521,7 +1024,7 @@ static int shrink_compressed_partial(int fd, CompressedFileMapping *bim,
                                          *next_layers);
   if (wr != (ssize_t)write_len) {
     free(write_buf);
-    free(decompressed);
+    buffer_pool_put(state->buffers, decompressed);
     error_msg_and_release_lock("[COMPRESSION_LAYER: SPARSE_BLOCK_FTRUNCATE] "
                                "Failed to write rewritten block",
                                lock_table, path);
@@ -539,18 +1042,16 @@ static int shrink_compressed_partial(int fd, CompressedFileMapping *bim,
     off_t punch_len = old_stored_size - (off_t)write_len;
     if (l.next_layers->ops->lfallocate(
             fd, punch_offset, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-            punch_len, l) < 0) {
+            punch_len, *l.next_layers) < 0) {
       ERROR_MSG("[COMPRESSION_LAYER: SPARSE_BLOCK_FTRUNCATE] "
                 "Failed to punch trailing bytes");
     }
   }
 
-  bim->sizes[last_block_index] = (off_t)write_len;
-  if (bim->is_uncompressed) {
-    bim->is_uncompressed[last_block_index] = mark_uncompressed ? 1 : 0;
-  }
   size_t new_num_blocks = (size_t)last_block_index + 1;
-  if (shrink_block_index(bim, new_num_blocks) < 0) {
+  if (block_set(bim, (size_t)last_block_index, (off_t)write_len,
+                mark_uncompressed) != 0 ||
+      shrink_block_index(bim, new_num_blocks) < 0) {
     error_msg_and_release_lock("[COMPRESSION_LAYER: SPARSE_BLOCK_FTRUNCATE] "
                                "Failed to shrink block index arrays",
                                lock_table, path);
@@ -559,7 +1060,7 @@ static int shrink_compressed_partial(int fd, CompressedFileMapping *bim,
   (void)set_logical_eof_in_mapping(device, inode, new_logical_size, l);
 
   free(write_buf);
-  free(decompressed);
+  buffer_pool_put(state->buffers, decompressed);
   return 0;
 }
 
@@ -629,6 +1130,13 @@ int compression_sparse_block_ftruncate(int fd, off_t length, LayerContext l) {
     return 0;
   }
 
+  CompressedFileMapping *changed =
+      get_compressed_file_mapping(device, inode, state);
+  if (changed) {
+    index_file_invalidate(path, changed, l);
+  }
+  block_cache_invalidate(state->block_cache, device, inode, 0, SIZE_MAX);
+
   // If the new size is 0, we truncate the file to 0 bytes.
   if (length == 0) {
     if (truncate_to_zero(next_layers, fd, state, path, device, inode, l) < 0) {
@@ -698,10 +1206,35 @@ int compression_sparse_block_ftruncate(int fd, off_t length, LayerContext l) {
     return INVALID_FD;
   }
 
+  // The new last block is trimmed in place, its stored size must be known
+  if (scan_block_range(fd, path, bim, (size_t)last_block_index,
+                       (size_t)last_block_index, l) != 0) {
+    error_msg_and_release_lock("[COMPRESSION_LAYER: COMPRESSION_FTRUNCATE] "
+                               "Failed to scan the last block",
+                               state->lock_table, path);
+    return INVALID_FD;
+  }
+
+  // A hole left as the last block is stored as raw zeros, which the truncate
+  // of the next layer fills in, so that the stored file still ends with the
+  // logical EOF
+  if ((size_t)last_block_index < bim->num_blocks &&
+      block_stored_size(bim, (size_t)last_block_index) == 0) {
+    if (block_set(bim, (size_t)last_block_index, 0, 1) != 0) {
+      error_msg_and_release_lock("[COMPRESSION_LAYER: COMPRESSION_FTRUNCATE] "
+                                 "Failed to update the block index",
+                                 state->lock_table, path);
+      return INVALID_FD;
+    }
+    if (bytes_to_keep == 0) {
+      bytes_to_keep = block_size;
+    }
+  }
+
   // Check if we can use simple truncation (exact boundary or uncompressed
   // partial)
-  int is_uncompressed = (bytes_to_keep > 0 && bim->is_uncompressed &&
-                         bim->is_uncompressed[last_block_index] == 1);
+  int is_uncompressed =
+      (bytes_to_keep > 0 && block_is_raw(bim, (size_t)last_block_index));
 
   if (bytes_to_keep == 0 || is_uncompressed) {
     // Either at exact block boundary, or partial block stored uncompressed
@@ -777,8 +1310,32 @@ int compression_sparse_block_fstat(int fd, struct stat *stbuf, LayerContext l) {
   return res;
 }
 
+int sparse_block_load_index(int fd, const char *pathname,
+                            const struct stat *st, LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(st->st_dev, st->st_ino, state);
+  if ((mapping && mapping->num_blocks > 0) || st->st_size == 0) {
+    return 0;
+  }
+  if (state->index_file && index_file_load(pathname, st, l) == 0) {
+    return 0;
+  }
+
+  if (rebuild_block_mapping_from_storage(fd, st->st_dev, st->st_ino, l) < 0) {
+    return -1;
+  }
+  // Write the rebuilt index on close, whatever blocks were scanned by then
+  mapping = get_compressed_file_mapping(st->st_dev, st->st_ino, state);
+  if (mapping) {
+    mapping->index_file_current = 0;
+    mapping->index_dirty = 1;
+  }
+  return 0;
+}
+
 static int rebuild_block_mapping_from_storage_with_pathname(
-    const char *pathname, dev_t device, ino_t inode, LayerContext l) {
+    const char *pathname, const struct stat *st, LayerContext l) {
   int fd = l.next_layers->ops->lopen(pathname, O_RDONLY, 0, *l.next_layers);
   if (fd < 0) {
     ERROR_MSG(
@@ -788,7 +1345,7 @@ static int rebuild_block_mapping_from_storage_with_pathname(
     return INVALID_FD;
   }
 
-  if (rebuild_block_mapping_from_storage(fd, device, inode, l) < 0) {
+  if (sparse_block_load_index(fd, pathname, st, l) < 0) {
     l.next_layers->ops->lclose(fd, *l.next_layers);
     ERROR_MSG(
         "[COMPRESSION_LAYER: REBUILD_BLOCK_MAPPING_FROM_STORAGE_WITH_PATHNAME] "
@@ -822,7 +1379,11 @@ int compression_sparse_block_lstat(const char *pathname, struct stat *stbuf,
     }
 
     off_t logical_eof = 0;
-    if (get_logical_eof_from_mapping(device, inode, l, &logical_eof) != 0) {
+    // a file the layer does not know yet is sized from its index header,
+    // without building its mapping
+    if (get_logical_eof_from_mapping(device, inode, l, &logical_eof) != 0 &&
+        !(state->index_file &&
+          index_file_logical_size(pathname, stbuf, l, &logical_eof) == 0)) {
       DEBUG_MSG("[COMPRESSION_LAYER: COMPRESSION_LSTAT] "
                 "Failed to get logical EOF of file from mapping table, we "
                 "will try to rebuild the mapping from storage");
@@ -841,8 +1402,8 @@ int compression_sparse_block_lstat(const char *pathname, struct stat *stbuf,
       // during the lock upgrade window)
       if (get_logical_eof_from_mapping(device, inode, l, &logical_eof) != 0) {
         // Still missing, rebuild now that we have exclusive access
-        if (rebuild_block_mapping_from_storage_with_pathname(pathname, device,
-                                                             inode, l) != 0) {
+        if (rebuild_block_mapping_from_storage_with_pathname(pathname, stbuf,
+                                                             l) != 0) {
           error_msg_and_release_lock(
               "[COMPRESSION_LAYER: COMPRESSION_LSTAT] Failed to rebuild block "
               "mapping from storage",
@@ -864,3 +1425,125 @@ int compression_sparse_block_lstat(const char *pathname, struct stat *stbuf,
   }
   return res;
 }
+
+// Bytes the next layer allocates to a block stored with stored_size bytes
+static off_t allocated_size(off_t stored_size, off_t alloc_unit) {
+  return (stored_size + alloc_unit - 1) / alloc_unit * alloc_unit;
+}
+
+void sparse_block_maybe_compact(int fd, const char *path,
+                                const CompressedFileMapping *mapping,
+                                LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  struct stat st;
+  if (!state->compactor ||
+      l.next_layers->ops->lfstat(fd, &st, *l.next_layers) != 0 ||
+      st.st_blocks == 0) {
+    return;
+  }
+
+  off_t alloc_unit = st.st_blksize > 0 ? st.st_blksize : 512;
+  off_t live = 0;
+  // Blocks not scanned yet count as full, they are skipped by compaction
+  if (alloc_unit == BLOCK_INDEX_ALLOC_UNIT) {
+    BlockIndexSum sum = block_index_sum(mapping, 0, mapping->num_blocks);
+    live = (off_t)sum.allocated +
+           (off_t)sum.unknown *
+               allocated_size((off_t)state->block_size, alloc_unit);
+  } else {
+    for (size_t i = 0; i < mapping->num_blocks; i++) {
+      off_t stored = block_stored_size(mapping, i);
+      live += allocated_size(stored == BLOCK_SIZE_UNKNOWN
+                                 ? (off_t)state->block_size
+                                 : stored,
+                             alloc_unit);
+    }
+  }
+  off_t allocated = (off_t)st.st_blocks * 512;
+  if (allocated > live &&
+      (allocated - live) * 100 >= allocated * state->compaction_threshold) {
+    DEBUG_MSG("[COMPRESSION_LAYER: SPARSE_BLOCK_COMPACT] %s wastes %ld of %ld "
+              "bytes, compaction scheduled",
+              path, allocated - live, allocated);
+    compactor_enqueue(state->compactor, path);
+  }
+}
+
+// Punch the slack of the blocks next_block to next_block + max_blocks
+static int punch_block_slack(int fd, const struct stat *st, const char *path,
+                             size_t *next_block, size_t max_blocks,
+                             LayerContext l) {
+  CompressionState *state = (CompressionState *)l.internal_state;
+  // The mapping is looked up again for every batch, the file may have been
+  // truncated, rewritten or unlinked in between
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(st->st_dev, st->st_ino, state);
+  if (!mapping || mapping->unlink_called) {
+    return 0;
+  }
+
+  size_t block_size = state->block_size;
+  size_t end = mapping->num_blocks;
+  if (*next_block > end) {
+    return 0;
+  }
+  if (end - *next_block > max_blocks) {
+    end = *next_block + max_blocks;
+  }
+  for (size_t i = *next_block; i < end; i++) {
+    off_t stored = block_stored_size(mapping, i);
+    off_t punch_offset = (off_t)(i * block_size) + stored;
+    off_t punch_end = (off_t)((i + 1) * block_size);
+    if (punch_end > st->st_size) {
+      punch_end = st->st_size;
+    }
+    if (stored == BLOCK_SIZE_UNKNOWN || punch_end <= punch_offset) {
+      continue;
+    }
+    if (l.next_layers->ops->lfallocate(
+            fd, punch_offset, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            punch_end - punch_offset, *l.next_layers) < 0) {
+      ERROR_MSG("[COMPRESSION_LAYER: SPARSE_BLOCK_COMPACT] Failed to punch "
+                "block %zu of %s",
+                i, path);
+      return -1;
+    }
+  }
+  *next_block = end;
+  return end < mapping->num_blocks ? 1 : 0;
+}
+
+int sparse_block_compact(void *arg, const char *path, size_t *next_block,
+                         size_t max_blocks, off_t *reclaimed) {
+  LayerContext l = *(LayerContext *)arg;
+  CompressionState *state = (CompressionState *)l.internal_state;
+  const LayerContext *next = l.next_layers;
+  *reclaimed = 0;
+  if (next->ops->lfallocate == NULL) {
+    return -1;
+  }
+
+  int fd = next->ops->lopen(path, O_RDWR, 0, *next);
+  if (fd < 0) {
+    return -1;
+  }
+  if (locking_acquire_write(state->lock_table, path) != 0) {
+    next->ops->lclose(fd, *next);
+    return -1;
+  }
+
+  int res = -1;
+  struct stat before;
+  struct stat after;
+  if (next->ops->lfstat(fd, &before, *next) == 0) {
+    res = punch_block_slack(fd, &before, path, next_block, max_blocks, l);
+  }
+  if (res >= 0 && next->ops->lfstat(fd, &after, *next) == 0 &&
+      after.st_blocks < before.st_blocks) {
+    *reclaimed = (off_t)(before.st_blocks - after.st_blocks) * 512;
+  }
+
+  locking_release(state->lock_table, path);
+  next->ops->lclose(fd, *next);
+  return res;
+}
@@ -8,6 +8,33 @@ ssize_t compression_sparse_block_pwrite(int fd, const void *buffer,
                                         LayerContext l);
 ssize_t compression_sparse_block_pread(int fd, void *buffer, size_t nbyte,
                                        off_t offset, LayerContext l);
+ssize_t compression_sparse_block_pwrite_digest(int fd, const void *buffer,
+                                               size_t nbyte, off_t offset,
+                                               const LayerDigest *digest,
+                                               LayerContext l);
+ssize_t compression_sparse_block_pread_digest(int fd, void *buffer,
+                                              size_t nbyte, off_t offset,
+                                              const LayerDigest *digest,
+                                              LayerContext l);
+
+/**
+ * @brief Copy of a range between two files by their stored blocks
+ *
+ * The compressed bytes of the blocks are copied as they are by the next
+ * layer (a reflink on a local file system that has them) and the index
+ * entries of the source are set on the destination, nothing is decompressed.
+ * Only for whole blocks, the last one possibly ending the source, appended at
+ * a block boundary at or past the end of another file.
+ *
+ * @return ssize_t -> number of copied bytes, -1 with errno (EXDEV for a copy
+ * to read and write instead)
+ */
+ssize_t compression_sparse_block_copy_file_range(int fd_in, off_t offset_in,
+                                                 int fd_out, off_t offset_out,
+                                                 size_t len,
+                                                 unsigned int flags,
+                                                 LayerContext l);
+
 int compression_sparse_block_ftruncate(int fd, off_t length, LayerContext l);
 int compression_sparse_block_truncate(const char *path, off_t length,
                                       LayerContext l);
@@ -15,4 +42,57 @@ int compression_sparse_block_fstat(int fd, struct stat *stbuf, LayerContext l);
 int compression_sparse_block_lstat(const char *pathname, struct stat *stbuf,
                                    LayerContext l);
 
+/**
+ * @brief Build the block index of a file on first access
+ *
+ * Loads the index file when it is current, otherwise rebuilds the index from
+ * storage, leaving the blocks to be scanned when they are first accessed.
+ * Does nothing if the file already has a block index.
+ *
+ * @warning Caller must hold the write lock of the file.
+ *
+ * @param fd -> readable file descriptor in the next layer
+ * @param pathname -> path of the file in the next layer
+ * @param st -> stat of the file in the next layer
+ * @param l -> layer context
+ * @return int -> 0 if successful, -1 otherwise
+ */
+int sparse_block_load_index(int fd, const char *pathname,
+                            const struct stat *st, LayerContext l);
+
+/**
+ * @brief Schedule the compaction of a file that wastes too much space
+ *
+ * Compares the space allocated to the file in the next layer with the stored
+ * size of its blocks, rounded to the allocation unit, and queues the file on
+ * the compactor when the wasted share reaches options.compaction_threshold.
+ *
+ * @warning Caller must hold the write lock of the file.
+ *
+ * @param fd -> file descriptor in the next layer
+ * @param path -> path of the file in the next layer
+ * @param mapping -> file mapping
+ * @param l -> layer context
+ */
+void sparse_block_maybe_compact(int fd, const char *path,
+                                const CompressedFileMapping *mapping,
+                                LayerContext l);
+
+/**
+ * @brief Compactor callback: punch the slack of a batch of blocks
+ *
+ * Every block stored with fewer than block_size bytes gets the rest of its
+ * slot punched, which is idempotent and moves no data: an interrupted
+ * compaction leaves a valid file. Blocks not scanned yet are skipped.
+ *
+ * @param arg -> LayerContext of the compression layer
+ * @param path -> path of the file in the next layer
+ * @param next_block -> first block of the batch, receives the next one
+ * @param max_blocks -> blocks to process at most
+ * @param reclaimed -> receives the bytes released by the next layer
+ * @return int -> 1 if blocks remain, 0 once done, -1 on error
+ */
+int sparse_block_compact(void *arg, const char *path, size_t *next_block,
+                         size_t max_blocks, off_t *reclaimed);
+
 #endif
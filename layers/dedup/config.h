@@ -0,0 +1,63 @@
+#ifndef __DEDUP_CONFIG_H__
+#define __DEDUP_CONFIG_H__
+
+#include "../../config/utils.h"
+#include "../../shared/utils/hasher/hasher.h"
+#include <strings.h>
+
+#define DEDUP_DEFAULT_BLOCK_SIZE 4096
+
+typedef struct {
+  char *next_layer;
+  char *block_store; // directory of the block store in the next layer
+  int block_size;
+  hash_algorithm_t algorithm; // of the digests of the blocks
+} DedupConfig;
+
+/**
+ * @brief Parse dedup layer parameters
+ *
+ */
+static inline void dedup_parse_params(toml_datum_t layer_table,
+                                      DedupConfig *config) {
+  toml_datum_t next_layer = toml_get(layer_table, "next");
+  if (next_layer.type == TOML_STRING) {
+    config->next_layer = parse_string(next_layer);
+  } else {
+    toml_error("Invalid next layer filed");
+  }
+
+  toml_datum_t block_store = toml_get(layer_table, "block_store");
+  if (block_store.type == TOML_STRING) {
+    config->block_store = parse_string(block_store);
+  } else {
+    toml_error("Dedup layer must have a 'block_store'");
+  }
+
+  config->block_size = DEDUP_DEFAULT_BLOCK_SIZE;
+  toml_datum_t block_size = toml_get(layer_table, "block_size");
+  if (block_size.type == TOML_INT64) {
+    if (block_size.u.int64 < 512 || block_size.u.int64 > (1L << 20)) {
+      toml_error("Dedup layer block_size must be in [512, 1 MiB]");
+    }
+    config->block_size = (int)block_size.u.int64;
+  }
+
+  // blake3-keyed is left out: its key belongs to anti_tampering
+  config->algorithm = HASH_SHA256;
+  toml_datum_t algorithm = toml_get(layer_table, "algorithm");
+  if (algorithm.type == TOML_STRING) {
+    if (strcasecmp(algorithm.u.str.ptr, "sha256") == 0) {
+      config->algorithm = HASH_SHA256;
+    } else if (strcasecmp(algorithm.u.str.ptr, "sha512") == 0) {
+      config->algorithm = HASH_SHA512;
+    } else if (strcasecmp(algorithm.u.str.ptr, "blake3") == 0) {
+      config->algorithm = HASH_BLAKE3;
+    } else {
+      toml_error("Dedup layer has unsupported algorithm (use 'sha256', "
+                 "'sha512' or 'blake3')");
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,1144 @@
+#define _GNU_SOURCE
+#include "dedup.h"
+#include "../../logdef.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// blocks of a request whose slots are kept on the stack, more are allocated
+#define DEDUP_STACK_BLOCKS 32
+// slots read at once when all the blocks of a map are released
+#define DEDUP_RELEASE_CHUNK 1024
+// index records read at once at init
+#define DEDUP_LOAD_CHUNK 4096
+
+static int next_pwrite_fully(LayerContext next, int fd, const void *buffer,
+                             size_t len, off_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = next.ops->lpwrite(fd, (const char *)buffer + done, len - done,
+                                  offset + done, next);
+    if (n <= 0) {
+      if (n == 0) {
+        errno = EIO;
+      }
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+// Bytes of the next layer, zeros past its end
+static ssize_t next_pread_zeroed(LayerContext next, int fd, void *buffer,
+                                 size_t len, off_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = next.ops->lpread(fd, (char *)buffer + done, len - done,
+                                 offset + done, next);
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      memset((char *)buffer + done, 0, len - done);
+      break;
+    }
+    done += n;
+  }
+  return (ssize_t)done;
+}
+
+static int all_zeros(const unsigned char *data, size_t len) {
+  return len == 0 || (data[0] == 0 && memcmp(data, data + 1, len - 1) == 0);
+}
+
+// Hash the blocks of a buffer into digest->digests, for a caller whose
+// blocks are not the ones of the layer
+static int digest_blocks(const LayerDigest *digest, const void *buffer,
+                         size_t len) {
+  const unsigned char *data = buffer;
+  unsigned char *out = digest->digests;
+  for (size_t done = 0, i = 0; done < len; done += digest->block_size, i++) {
+    size_t n = len - done < digest->block_size ? len - done
+                                                : digest->block_size;
+    if (digest->hash_block(data + done, n, out + i * digest->digest_size,
+                           digest->arg) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* ---- block store ---- */
+
+// Index records are written with state->store_mutex held
+static int index_write(DedupState *state, uint64_t slot) {
+  unsigned char record[sizeof(DedupIndexRecord) + HASHER_MAX_HASH_SIZE];
+  DedupSlot *s = &state->slots[slot];
+  DedupIndexRecord header = {.refs = s->refs, .len = s->len};
+  memcpy(record, &header, sizeof(header));
+  if (s->block) {
+    memcpy(record + sizeof(header), s->block->digest, state->digest_size);
+  } else {
+    memset(record + sizeof(header), 0, state->digest_size);
+  }
+  return next_pwrite_fully(state->next, state->index_fd, record,
+                           state->record_size,
+                           (off_t)(sizeof(DedupIndexHeader) +
+                                   slot * state->record_size));
+}
+
+static int slots_reserve(DedupState *state, uint64_t n) {
+  if (n <= state->slots_capacity) {
+    return 0;
+  }
+  uint64_t capacity = state->slots_capacity ? state->slots_capacity : 1024;
+  while (capacity < n) {
+    capacity *= 2;
+  }
+  DedupSlot *slots = realloc(state->slots, capacity * sizeof(DedupSlot));
+  if (!slots) {
+    return -1;
+  }
+  memset(slots + state->slots_capacity, 0,
+         (capacity - state->slots_capacity) * sizeof(DedupSlot));
+  state->slots = slots;
+  uint64_t *free_slots =
+      realloc(state->free_slots, capacity * sizeof(uint64_t));
+  if (!free_slots) {
+    return -1;
+  }
+  state->free_slots = free_slots;
+  state->slots_capacity = capacity;
+  return 0;
+}
+
+/**
+ * @brief Take a reference on the slot of a block, stored if it is new
+ *
+ * @param state     -> DedupState
+ * @param digest    -> digest of the block
+ * @param data      -> the block
+ * @param len       -> its length
+ * @param keep      -> slot + 1 the caller holds already (0: none): when it is
+ * the slot of the block, it is returned without a new reference
+ * @return int64_t  -> slot of the block, -1 on error
+ */
+static int64_t store_ref(DedupState *state, const unsigned char *digest,
+                         const void *data, size_t len, uint64_t keep) {
+  const size_t ds = state->digest_size;
+  pthread_mutex_lock(&state->store_mutex);
+  DedupBlock *block = NULL;
+  for (;;) {
+    HASH_FIND(hh, state->blocks, digest, ds, block);
+    if (!block || !state->slots[block->slot].pending) {
+      break;
+    }
+    // its data is not written yet; it may also fail and be gone after
+    pthread_cond_wait(&state->written, &state->store_mutex);
+  }
+
+  if (block) {
+    uint64_t slot = block->slot;
+    if (slot + 1 != keep) {
+      state->slots[slot].refs++;
+      if (index_write(state, slot) != 0) {
+        state->slots[slot].refs--;
+        pthread_mutex_unlock(&state->store_mutex);
+        return -1;
+      }
+    }
+    pthread_mutex_unlock(&state->store_mutex);
+    return (int64_t)slot;
+  }
+
+  uint64_t slot;
+  block = malloc(sizeof(DedupBlock) + ds);
+  if (!block || (state->nfree == 0 &&
+                 slots_reserve(state, state->nslots + 1) != 0)) {
+    pthread_mutex_unlock(&state->store_mutex);
+    free(block);
+    errno = ENOMEM;
+    return -1;
+  }
+  slot = state->nfree > 0 ? state->free_slots[--state->nfree]
+                          : state->nslots++;
+  memcpy(block->digest, digest, ds);
+  block->slot = slot;
+  HASH_ADD_KEYPTR(hh, state->blocks, block->digest, ds, block);
+  state->slots[slot] = (DedupSlot){
+      .refs = 1, .len = (uint32_t)len, .pending = true, .block = block};
+  pthread_mutex_unlock(&state->store_mutex);
+
+  int res = next_pwrite_fully(state->next, state->blocks_fd, data, len,
+                              (off_t)(slot * state->block_size));
+
+  pthread_mutex_lock(&state->store_mutex);
+  int err = errno;
+  if (res == 0) {
+    res = index_write(state, slot);
+    err = errno;
+  }
+  state->slots[slot].pending = false;
+  if (res != 0) {
+    HASH_DEL(state->blocks, block);
+    free(block);
+    state->slots[slot] = (DedupSlot){0};
+    state->free_slots[state->nfree++] = slot;
+  }
+  pthread_cond_broadcast(&state->written);
+  pthread_mutex_unlock(&state->store_mutex);
+  if (res != 0) {
+    errno = err;
+    return -1;
+  }
+  return (int64_t)slot;
+}
+
+// Drop a reference on a slot, freed with the last one
+static void store_unref(DedupState *state, uint64_t slot) {
+  pthread_mutex_lock(&state->store_mutex);
+  DedupSlot *s = &state->slots[slot];
+  if (--s->refs == 0) {
+    if (s->block) {
+      HASH_DEL(state->blocks, s->block);
+      free(s->block);
+      s->block = NULL;
+    }
+    s->len = 0;
+    state->free_slots[state->nfree++] = slot;
+  }
+  // a failed write leaks the slot after a restart, it is never lost
+  if (index_write(state, slot) != 0) {
+    WARN_MSG("[DEDUP] Failed to write the index record of slot %lu: %s",
+             (unsigned long)slot, strerror(errno));
+  }
+  pthread_mutex_unlock(&state->store_mutex);
+}
+
+static uint32_t slot_len(DedupState *state, uint64_t slot) {
+  pthread_mutex_lock(&state->store_mutex);
+  uint32_t len = state->slots[slot].len;
+  pthread_mutex_unlock(&state->store_mutex);
+  return len;
+}
+
+// The first len bytes of a block (slot + 1, 0 for a hole), zeros past it
+static int block_read(DedupState *state, uint64_t entry, void *buffer,
+                      size_t len) {
+  size_t stored = 0;
+  if (entry) {
+    stored = slot_len(state, entry - 1);
+    stored = stored < len ? stored : len;
+    if (next_pread_zeroed(state->next, state->blocks_fd, buffer, stored,
+                          (off_t)((entry - 1) * state->block_size)) < 0) {
+      return -1;
+    }
+  }
+  memset((char *)buffer + stored, 0, len - stored);
+  return 0;
+}
+
+/**
+ * @brief Hash a block and take a reference on its slot
+ *
+ * @param state -> DedupState
+ * @param data  -> the block
+ * @param len   -> its length
+ * @param keep  -> slot + 1 held already, see store_ref
+ * @param digest -> digest of the caller to hash with, or NULL
+ * @param out   -> receives the digest
+ * @return int64_t -> slot + 1, 0 for a block of zeros, -1 on error
+ */
+static int64_t block_store(DedupState *state, const unsigned char *data,
+                           size_t len, uint64_t keep,
+                           const LayerDigest *digest, unsigned char *out) {
+  if (all_zeros(data, len)) {
+    return 0;
+  }
+  int res = digest ? digest->hash_block(data, len, out, digest->arg)
+                   : state->hasher.hash_buffer_binary(data, len, out,
+                                                      state->digest_size);
+  if (res < 0) {
+    errno = EIO;
+    return -1;
+  }
+  int64_t slot = store_ref(state, out, data, len, keep);
+  return slot < 0 ? -1 : slot + 1;
+}
+
+/* ---- maps ---- */
+
+static off_t map_offset(uint64_t block) {
+  return (off_t)(sizeof(DedupMapHeader) + block * sizeof(uint64_t));
+}
+
+static int map_read(DedupState *state, int fd, uint64_t first, size_t n,
+                    uint64_t *slots) {
+  return next_pread_zeroed(state->next, fd, slots, n * sizeof(uint64_t),
+                           map_offset(first)) < 0
+             ? -1
+             : 0;
+}
+
+static int map_write(DedupState *state, int fd, uint64_t first, size_t n,
+                     const uint64_t *slots) {
+  return next_pwrite_fully(state->next, fd, slots, n * sizeof(uint64_t),
+                           map_offset(first));
+}
+
+static int map_write_size(DedupState *state, int fd, uint64_t size) {
+  return next_pwrite_fully(state->next, fd, &size, sizeof(size),
+                           (off_t)offsetof(DedupMapHeader, size));
+}
+
+/**
+ * @brief Read the header of a map
+ *
+ * @return int -> 1 with *size set, 0 for an empty file, -1 if it is not a
+ * map of this layer (errno EIO) or on error
+ */
+static int map_header(DedupState *state, int fd, uint64_t *size) {
+  DedupMapHeader header;
+  ssize_t n = next_pread_zeroed(state->next, fd, &header, sizeof(header), 0);
+  if (n == 0) {
+    *size = 0;
+    return 0;
+  }
+  if (n < 0) {
+    return -1;
+  }
+  if (n != sizeof(header) ||
+      memcmp(header.magic, DEDUP_MAP_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != DEDUP_VERSION ||
+      header.block_size != state->block_size) {
+    errno = EIO;
+    return -1;
+  }
+  *size = header.size;
+  return 1;
+}
+
+static uint64_t blocks_of(DedupState *state, uint64_t size) {
+  return (size + state->block_size - 1) / state->block_size;
+}
+
+// Drop the references of blocks [first, end) of a map
+static int map_release(DedupState *state, int fd, uint64_t first,
+                       uint64_t end) {
+  uint64_t slots[DEDUP_RELEASE_CHUNK];
+  while (first < end) {
+    size_t n = end - first < DEDUP_RELEASE_CHUNK ? (size_t)(end - first)
+                                                 : DEDUP_RELEASE_CHUNK;
+    if (map_read(state, fd, first, n, slots) != 0) {
+      return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (slots[i]) {
+        store_unref(state, slots[i] - 1);
+      }
+    }
+    first += n;
+  }
+  return 0;
+}
+
+// Drop all the references of the map of a removed file
+static void map_release_all(DedupState *state, int fd) {
+  uint64_t size;
+  int res = map_header(state, fd, &size);
+  if (res == 0 || (res < 0 && errno == EIO)) {
+    return; // empty, or not a map
+  }
+  if (res > 0 && map_release(state, fd, 0, blocks_of(state, size)) == 0) {
+    return;
+  }
+  WARN_MSG("[DEDUP] Failed to release the blocks of a removed file, they "
+           "stay in the block store");
+}
+
+/* ---- files ---- */
+
+static void free_file(DedupFile *file) {
+  pthread_rwlock_destroy(&file->lock);
+  free(file->path);
+  free(file);
+}
+
+static DedupFd *fd_entry(DedupState *state, int fd) {
+  DedupFd *entry = NULL;
+  pthread_mutex_lock(&state->files_mutex);
+  HASH_FIND(hh, state->fds, &fd, sizeof(int), entry);
+  pthread_mutex_unlock(&state->files_mutex);
+  return entry;
+}
+
+/**
+ * @brief Resize a file, its write lock held
+ *
+ * The blocks past the new end are released and a cut last block is stored
+ * again, so that growing the file later shows zeros there.
+ */
+static int file_resize(DedupState *state, DedupFile *file, int fd,
+                       uint64_t length) {
+  const size_t bs = state->block_size;
+  uint64_t keep = blocks_of(state, length);
+  uint64_t old_blocks = blocks_of(state, file->size);
+  uint64_t cut = 0, old_cut = 0; // slots + 1 of the cut last block
+  if (length < file->size && length % bs) {
+    if (map_read(state, fd, keep - 1, 1, &old_cut) != 0) {
+      return -1;
+    }
+    if (old_cut) {
+      unsigned char *block = malloc(bs);
+      unsigned char digest[HASHER_MAX_HASH_SIZE];
+      int64_t res = -1;
+      if (block && block_read(state, old_cut, block, length % bs) == 0) {
+        res = block_store(state, block, length % bs, old_cut, NULL, digest);
+      }
+      free(block);
+      if (res < 0 || map_write(state, fd, keep - 1, 1,
+                               &(uint64_t){(uint64_t)res}) != 0) {
+        if (res > 0 && (uint64_t)res != old_cut) {
+          store_unref(state, (uint64_t)res - 1);
+        }
+        return -1;
+      }
+      cut = (uint64_t)res;
+    }
+  }
+  if (keep < old_blocks) {
+    if (map_release(state, fd, keep, old_blocks) != 0 ||
+        state->next.ops->lftruncate(fd, map_offset(keep), state->next) != 0) {
+      return -1;
+    }
+  }
+  if (old_cut && old_cut != cut) {
+    store_unref(state, old_cut - 1);
+  }
+  if (map_write_size(state, fd, length) != 0) {
+    return -1;
+  }
+  file->size = length;
+  return 0;
+}
+
+/* ---- operations ---- */
+
+LayerContext dedup_init(LayerContext *next_layer, const DedupConfig *config) {
+  LayerContext layer_state;
+  layer_state.app_context = NULL;
+
+  DedupState *state = calloc(1, sizeof(DedupState));
+  if (!state) {
+    ERROR_MSG("[DEDUP] Failed to allocate memory for dedup state");
+    exit(1);
+  }
+  state->next = *next_layer;
+  state->block_size = (size_t)config->block_size;
+  if (hasher_init(&state->hasher, config->algorithm) != 0) {
+    ERROR_MSG("[DEDUP] Failed to initialize the hasher");
+    exit(1);
+  }
+  state->digest_size = state->hasher.get_hash_size();
+  state->record_size = sizeof(DedupIndexRecord) + state->digest_size;
+  pthread_mutex_init(&state->store_mutex, NULL);
+  pthread_cond_init(&state->written, NULL);
+  pthread_mutex_init(&state->files_mutex, NULL);
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", config->block_store,
+           DEDUP_BLOCKS_FILE);
+  state->blocks_fd =
+      state->next.ops->lopen(path, O_RDWR | O_CREAT, 0600, state->next);
+  snprintf(path, sizeof(path), "%s/%s", config->block_store,
+           DEDUP_INDEX_FILE);
+  state->index_fd =
+      state->next.ops->lopen(path, O_RDWR | O_CREAT, 0600, state->next);
+  if (state->blocks_fd < 0 || state->index_fd < 0) {
+    ERROR_MSG("[DEDUP] Failed to open the block store in %s: %s; [HINT] the "
+              "directory must exist in the next layer",
+              config->block_store, strerror(errno));
+    exit(1);
+  }
+
+  DedupIndexHeader header;
+  ssize_t n = next_pread_zeroed(state->next, state->index_fd, &header,
+                                sizeof(header), 0);
+  if (n == 0) {
+    memcpy(header.magic, DEDUP_INDEX_MAGIC, sizeof(header.magic));
+    header.version = DEDUP_VERSION;
+    header.block_size = (uint32_t)state->block_size;
+    header.digest_size = (uint32_t)state->digest_size;
+    if (next_pwrite_fully(state->next, state->index_fd, &header,
+                          sizeof(header), 0) != 0) {
+      ERROR_MSG("[DEDUP] Failed to write the index of %s: %s",
+                config->block_store, strerror(errno));
+      exit(1);
+    }
+  } else if (n != sizeof(header) ||
+             memcmp(header.magic, DEDUP_INDEX_MAGIC, sizeof(header.magic)) ||
+             header.version != DEDUP_VERSION) {
+    ERROR_MSG("[DEDUP] %s/%s is not a dedup index", config->block_store,
+              DEDUP_INDEX_FILE);
+    exit(1);
+  } else if (header.block_size != state->block_size ||
+             header.digest_size != state->digest_size) {
+    ERROR_MSG("[DEDUP] The block store of %s has %u byte blocks and %u byte "
+              "digests, the layer %zu and %zu",
+              config->block_store, header.block_size, header.digest_size,
+              state->block_size, state->digest_size);
+    exit(1);
+  }
+
+  // the index, a chunk of records at a time; a torn last record is dropped
+  unsigned char *records = malloc(DEDUP_LOAD_CHUNK * state->record_size);
+  if (!records) {
+    ERROR_MSG("[DEDUP] Failed to allocate memory for the index");
+    exit(1);
+  }
+  for (;;) {
+    ssize_t got = next_pread_zeroed(
+        state->next, state->index_fd, records,
+        DEDUP_LOAD_CHUNK * state->record_size,
+        (off_t)(sizeof(DedupIndexHeader) +
+                state->nslots * state->record_size));
+    if (got < 0) {
+      ERROR_MSG("[DEDUP] Failed to read the index of %s: %s",
+                config->block_store, strerror(errno));
+      exit(1);
+    }
+    size_t count = (size_t)got / state->record_size;
+    if (slots_reserve(state, state->nslots + count) != 0) {
+      ERROR_MSG("[DEDUP] Failed to allocate memory for the index");
+      exit(1);
+    }
+    for (size_t i = 0; i < count; i++) {
+      const unsigned char *record = records + i * state->record_size;
+      DedupIndexRecord rec;
+      memcpy(&rec, record, sizeof(rec));
+      uint64_t slot = state->nslots++;
+      if (rec.refs == 0) {
+        state->free_slots[state->nfree++] = slot;
+        continue;
+      }
+      DedupSlot *s = &state->slots[slot];
+      s->refs = rec.refs;
+      s->len = rec.len;
+      DedupBlock *block = NULL;
+      HASH_FIND(hh, state->blocks, record + sizeof(rec), state->digest_size,
+                block);
+      if (block) {
+        continue; // a second copy, used but not shared
+      }
+      block = malloc(sizeof(DedupBlock) + state->digest_size);
+      if (!block) {
+        ERROR_MSG("[DEDUP] Failed to allocate memory for the index");
+        exit(1);
+      }
+      memcpy(block->digest, record + sizeof(rec), state->digest_size);
+      block->slot = slot;
+      HASH_ADD_KEYPTR(hh, state->blocks, block->digest, state->digest_size,
+                      block);
+      s->block = block;
+    }
+    if (count < DEDUP_LOAD_CHUNK) {
+      break;
+    }
+  }
+  free(records);
+
+  layer_state.internal_state = state;
+
+  LayerOps *dedup_ops = calloc(1, sizeof(LayerOps));
+  dedup_ops->lpread = dedup_pread;
+  dedup_ops->lpwrite = dedup_pwrite;
+  dedup_ops->lpwrite_digest = dedup_pwrite_digest;
+  dedup_ops->lopen = dedup_open;
+  dedup_ops->lclose = dedup_close;
+  dedup_ops->lfsync = dedup_fsync;
+  dedup_ops->lftruncate = dedup_ftruncate;
+  dedup_ops->ltruncate = dedup_truncate;
+  dedup_ops->lfstat = dedup_fstat;
+  dedup_ops->llstat = dedup_lstat;
+  dedup_ops->lunlink = dedup_unlink;
+  dedup_ops->lrename = dedup_rename;
+  dedup_ops->ldestroy = dedup_destroy;
+
+  layer_state.ops = dedup_ops;
+
+  LayerContext *aux = malloc(sizeof(LayerContext));
+  memcpy(aux, next_layer, sizeof(LayerContext));
+  layer_state.next_layers = aux;
+  layer_state.nlayers = 1;
+
+  DEBUG_MSG("[DEDUP] Block store in %s: %lu slots, %lu free, %zu byte blocks",
+            config->block_store, (unsigned long)state->nslots,
+            (unsigned long)state->nfree, state->block_size);
+  return layer_state;
+}
+
+int dedup_open(const char *pathname, int flags, mode_t mode, LayerContext l) {
+  DedupState *state = (DedupState *)l.internal_state;
+  LayerContext next = state->next;
+
+  // the map is read and written whatever the fd is for, and O_TRUNC must
+  // release the blocks
+  bool writable = (flags & O_ACCMODE) != O_RDONLY;
+  int next_flags = (flags & ~(O_ACCMODE | O_TRUNC | O_APPEND | O_DIRECT)) |
+                   (writable ? O_RDWR : O_RDONLY);
+  int fd = next.ops->lopen(pathname, next_flags, mode, next);
+  if (fd < 0) {
+    return -1;
+  }
+
+  uint64_t size;
+  int res = map_header(state, fd, &size);
+  if (res < 0) {
+    int err = errno;
+    if (err == EIO) {
+      ERROR_MSG("[DEDUP_OPEN] %s is not a file of the dedup layer",
+                pathname);
+    }
+    next.ops->lclose(fd, next);
+    errno = err;
+    return -1;
+  }
+
+  DedupFd *entry = malloc(sizeof(DedupFd));
+  if (!entry) {
+    next.ops->lclose(fd, next);
+    errno = ENOMEM;
+    return -1;
+  }
+  pthread_mutex_lock(&state->files_mutex);
+  DedupFile *file = NULL;
+  HASH_FIND_STR(state->files, pathname, file);
+  if (!file) {
+    file = calloc(1, sizeof(DedupFile));
+    if (!file || !(file->path = strdup(pathname))) {
+      pthread_mutex_unlock(&state->files_mutex);
+      free(file);
+      free(entry);
+      next.ops->lclose(fd, next);
+      errno = ENOMEM;
+      return -1;
+    }
+    pthread_rwlock_init(&file->lock, NULL);
+    file->size = size; // the first fd reads it, later ones keep it
+    HASH_ADD_KEYPTR(hh, state->files, file->path, strlen(file->path), file);
+  }
+  file->refs++;
+  entry->fd = fd;
+  entry->file = file;
+  entry->writable = writable;
+  HASH_ADD(hh, state->fds, fd, sizeof(int), entry);
+  pthread_mutex_unlock(&state->files_mutex);
+
+  pthread_rwlock_wrlock(&file->lock);
+  res = 0;
+  if (writable && size == 0 && file->size == 0) {
+    DedupMapHeader header = {.version = DEDUP_VERSION,
+                             .block_size = (uint32_t)state->block_size};
+    memcpy(header.magic, DEDUP_MAP_MAGIC, sizeof(header.magic));
+    res = next_pwrite_fully(next, fd, &header, sizeof(header), 0);
+  }
+  if (res == 0 && writable && (flags & O_TRUNC) && file->size > 0) {
+    res = file_resize(state, file, fd, 0);
+  }
+  pthread_rwlock_unlock(&file->lock);
+  if (res != 0) {
+    int err = errno;
+    dedup_close(fd, l);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+int dedup_close(int fd, LayerContext l) {
+  DedupState *state = (DedupState *)l.internal_state;
+  LayerContext next = state->next;
+
+  DedupFile *last = NULL;
+  pthread_mutex_lock(&state->files_mutex);
+  DedupFd *entry = NULL;
+  HASH_FIND(hh, state->fds, &fd, sizeof(int), entry);
+  if (entry) {
+    HASH_DEL(state->fds, entry);
+    DedupFile *file = entry->file;
+    if (--file->refs == 0) {
+      if (!file->unlinked) {
+        HASH_DEL(state->files, file);
+      }
+      last = file;
+    }
+    free(entry);
+  }
+  pthread_mutex_unlock(&state->files_mutex);
+
+  if (last) {
+    if (last->unlinked) {
+      map_release_all(state, fd);
+    }
+    free_file(last);
+  }
+  return next.ops->lclose(fd, next);
+}
+
+static ssize_t dedup_write(int fd, const void *buffer, size_t nbyte,
+                           off_t offset, const LayerDigest *digest,
+                           LayerContext l) {
+  DedupState *state = (DedupState *)l.internal_state;
+  DedupFd *entry = fd_entry(state, fd);
+  if (!entry || !entry->writable) {
+    errno = EBADF;
+    return -1;
+  }
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (nbyte == 0) {
+    return 0;
+  }
+
+  const size_t bs = state->block_size;
+  const size_t ds = state->digest_size;
+  // the blocks of the caller are ours: each block is hashed once, the
+  // digest stored in its digests too
+  const bool shared = digest && digest->block_size == bs &&
+                      digest->digest_size == ds && offset % bs == 0;
+  if (digest && !shared && digest_blocks(digest, buffer, nbyte) != 0) {
+    errno = EIO;
+    return -1;
+  }
+
+  const uint64_t first = (uint64_t)offset / bs;
+  const size_t n = (size_t)(((uint64_t)offset + nbyte - 1) / bs - first + 1);
+  uint64_t stack[2 * DEDUP_STACK_BLOCKS];
+  uint64_t *old = n <= DEDUP_STACK_BLOCKS ? stack
+                                          : malloc(2 * n * sizeof(uint64_t));
+  unsigned char *merged = NULL;
+  if (!old) {
+    errno = ENOMEM;
+    return -1;
+  }
+  uint64_t *new = old + n;
+
+  DedupFile *file = entry->file;
+  pthread_rwlock_wrlock(&file->lock);
+  const uint64_t size = file->size;
+  size_t done = 0; // blocks with a reference in new
+  int err = 0;
+  if (map_read(state, fd, first, n, old) != 0) {
+    err = errno;
+    goto fail;
+  }
+
+  for (; done < n; done++) {
+    const uint64_t start = (first + done) * bs;
+    const size_t lo = done == 0 ? (size_t)((uint64_t)offset - start) : 0;
+    const uint64_t end = (uint64_t)offset + nbyte - start;
+    const size_t hi = end < bs ? (size_t)end : bs;
+    const size_t old_len =
+        size > start ? (size - start < bs ? (size_t)(size - start) : bs) : 0;
+    const unsigned char *src =
+        (const unsigned char *)buffer + (start + lo - (uint64_t)offset);
+    const unsigned char *data = src;
+    size_t len = hi;
+    if (lo > 0 || hi < old_len) {
+      // partly written: the rest of the block is its old content
+      len = hi > old_len ? hi : old_len;
+      if (!merged && !(merged = malloc(bs))) {
+        err = ENOMEM;
+        goto fail;
+      }
+      if (block_read(state, old[done], merged, len) != 0) {
+        err = errno;
+        goto fail;
+      }
+      memcpy(merged + lo, src, hi - lo);
+      data = merged;
+    }
+
+    unsigned char block_digest[HASHER_MAX_HASH_SIZE];
+    int64_t slot = block_store(state, data, len, old[done],
+                               shared ? digest : NULL, block_digest);
+    if (slot < 0) {
+      err = errno;
+      goto fail;
+    }
+    new[done] = (uint64_t)slot;
+    if (shared) {
+      unsigned char *out = (unsigned char *)digest->digests + done * ds;
+      if (data == src && slot > 0) {
+        memcpy(out, block_digest, ds);
+      } else if (digest->hash_block(src, hi, out, digest->arg) < 0) {
+        done++;
+        err = EIO;
+        goto fail;
+      }
+    }
+  }
+
+  if (map_write(state, fd, first, n, new) != 0) {
+    err = errno;
+    goto fail;
+  }
+  if ((uint64_t)offset + nbyte > size) {
+    if (map_write_size(state, fd, (uint64_t)offset + nbyte) != 0) {
+      err = errno;
+      goto fail; // the map points to the new slots, leaked if they go
+    }
+    file->size = (uint64_t)offset + nbyte;
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (old[i] && old[i] != new[i]) {
+      store_unref(state, old[i] - 1);
+    }
+  }
+  pthread_rwlock_unlock(&file->lock);
+  free(merged);
+  if (old != stack) {
+    free(old);
+  }
+  return (ssize_t)nbyte;
+
+fail:
+  for (size_t i = 0; i < done; i++) {
+    if (new[i] && new[i] != old[i]) {
+      store_unref(state, new[i] - 1);
+    }
+  }
+  pthread_rwlock_unlock(&file->lock);
+  free(merged);
+  if (old != stack) {
+    free(old);
+  }
+  errno = err;
+  return -1;
+}
+
+ssize_t dedup_pwrite(int fd, const void *buffer, size_t nbyte, off_t offset,
+                     LayerContext l) {
+  return dedup_write(fd, buffer, nbyte, offset, NULL, l);
+}
+
+ssize_t dedup_pwrite_digest(int fd, const void *buffer, size_t nbyte,
+                            off_t offset, const LayerDigest *digest,
+                            LayerContext l) {
+  return dedup_write(fd, buffer, nbyte, offset, digest, l);
+}
+
+ssize_t dedup_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                    LayerContext l) {
+  DedupState *state = (DedupState *)l.internal_state;
+  DedupFd *entry = fd_entry(state, fd);
+  if (!entry) {
+    errno = EBADF;
+    return -1;
+  }
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  DedupFile *file = entry->file;
+  pthread_rwlock_rdlock(&file->lock);
+  if ((uint64_t)offset >= file->size || nbyte == 0) {
+    pthread_rwlock_unlock(&file->lock);
+    return 0;
+  }
+  if ((uint64_t)offset + nbyte > file->size) {
+    nbyte = (size_t)(file->size - (uint64_t)offset);
+  }
+
+  const size_t bs = state->block_size;
+  const uint64_t first = (uint64_t)offset / bs;
+  const size_t n = (size_t)(((uint64_t)offset + nbyte - 1) / bs - first + 1);
+  uint64_t stack[2 * DEDUP_STACK_BLOCKS];
+  uint64_t *slots = n <= DEDUP_STACK_BLOCKS
+                        ? stack
+                        : malloc(2 * n * sizeof(uint64_t));
+  if (!slots) {
+    pthread_rwlock_unlock(&file->lock);
+    errno = ENOMEM;
+    return -1;
+  }
+  uint64_t *lens = slots + n;
+  if (map_read(state, fd, first, n, slots) != 0) {
+    int err = errno;
+    pthread_rwlock_unlock(&file->lock);
+    if (slots != stack) {
+      free(slots);
+    }
+    errno = err;
+    return -1;
+  }
+  pthread_mutex_lock(&state->store_mutex);
+  for (size_t i = 0; i < n; i++) {
+    lens[i] = slots[i] ? state->slots[slots[i] - 1].len : 0;
+  }
+  pthread_mutex_unlock(&state->store_mutex);
+
+  // runs of whole blocks in consecutive slots are read at once
+  unsigned char *out = buffer;
+  int res = 0;
+  for (size_t i = 0; i < n && res == 0; i++) {
+    const uint64_t start = (first + i) * bs;
+    const size_t lo = i == 0 ? (size_t)((uint64_t)offset - start) : 0;
+    if (!slots[i]) {
+      uint64_t end = (uint64_t)offset + nbyte - start;
+      size_t hi = end < bs ? (size_t)end : bs;
+      memset(out, 0, hi - lo);
+      out += hi - lo;
+      continue;
+    }
+    size_t j = i;
+    while (j + 1 < n && slots[j + 1] == slots[j] + 1 && lens[j] == bs) {
+      j++;
+    }
+    uint64_t end = (uint64_t)offset + nbyte - (first + j) * bs;
+    size_t hi = end < bs ? (size_t)end : bs;
+    size_t want = (j - i) * bs + hi - lo;
+    size_t last_stored = lens[j] < hi ? lens[j] : hi;
+    size_t stored = (j - i) * bs + last_stored;
+    stored = stored > lo ? stored - lo : 0;
+    if (stored > 0 &&
+        next_pread_zeroed(state->next, state->blocks_fd, out, stored,
+                          (off_t)((slots[i] - 1) * bs + lo)) < 0) {
+      res = -1;
+    }
+    memset(out + stored, 0, want - stored);
+    out += want;
+    i = j;
+  }
+  int err = errno;
+  pthread_rwlock_unlock(&file->lock);
+  if (slots != stack) {
+    free(slots);
+  }
+  if (res != 0) {
+    errno = err;
+    return -1;
+  }
+  return (ssize_t)nbyte;
+}
+
+int dedup_fsync(int fd, int isdatasync, LayerContext l) {
+  DedupState *state = (DedupState *)l.internal_state;
+  LayerContext next = state->next;
+  if (!next.ops->lfsync) {
+    return 0;
+  }
+  // the slots first, the map that points to them last
+  if (next.ops->lfsync(state->blocks_fd, isdatasync, next) != 0 ||
+      next.ops->lfsync(state->index_fd, isdatasync, next) != 0) {
+    return -1;
+  }
+  return next.ops->lfsync(fd, isdatasync, next);
+}
+
+int dedup_ftruncate(int fd, off_t length, LayerContext l) {
+  DedupState *state = (DedupState *)l.internal_state;
+  DedupFd *entry = fd_entry(state, fd);
+  if (!entry) {
+    errno = EBADF;
+    return -1;
+  }
+  if (!entry->writable || length < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  pthread_rwlock_wrlock(&entry->file->lock);
+  int res = file_resize(state, entry->file, fd, (uint64_t)length);
+  pthread_rwlock_unlock(&entry->file->lock);
+  return res;
+}
+
+int dedup_truncate(const char *path, off_t length, LayerContext l) {
+  int fd = dedup_open(path, O_WRONLY, 0, l);
+  if (fd < 0) {
+    return -1;
+  }
+  int res = dedup_ftruncate(fd, length, l);
+  int err = errno;
+  dedup_close(fd, l);
+  errno = err;
+  return res;
+}
+
+int dedup_fstat(int fd, struct stat *stbuf, LayerContext l) {
+  DedupState *state = (DedupState *)l.internal_state;
+  LayerContext next = state->next;
+  DedupFd *entry = fd_entry(state, fd);
+  if (!entry) {
+    errno = EBADF;
+    return -1;
+  }
+  if (next.ops->lfstat(fd, stbuf, next) != 0) {
+    return -1;
+  }
+  pthread_rwlock_rdlock(&entry->file->lock);
+  stbuf->st_size = (off_t)entry->file->size;
+  pthread_rwlock_unlock(&entry->file->lock);
+  return 0;
+}
+
+int dedup_lstat(const char *pathname, struct stat *stbuf, LayerContext l) {
+  DedupState *state = (DedupState *)l.internal_state;
+  LayerContext next = state->next;
+  if (next.ops->llstat(pathname, stbuf, next) != 0) {
+    return -1;
+  }
+  if (!S_ISREG(stbuf->st_mode)) {
+    return 0;
+  }
+
+  // open: the size of the file, with the writes in progress
+  pthread_mutex_lock(&state->files_mutex);
+  DedupFile *file = NULL;
+  HASH_FIND_STR(state->files, pathname, file);
+  if (file) {
+    pthread_rwlock_rdlock(&file->lock);
+    stbuf->st_size = (off_t)file->size;
+    pthread_rwlock_unlock(&file->lock);
+  }
+  pthread_mutex_unlock(&state->files_mutex);
+  if (file) {
+    return 0;
+  }
+
+  // not open: the size is in the header of the map
+  int fd = next.ops->lopen(pathname, O_RDONLY, 0, next);
+  uint64_t size;
+  if (fd >= 0 && map_header(state, fd, &size) >= 0) {
+    stbuf->st_size = (off_t)size;
+  }
+  if (fd >= 0) {
+    next.ops->lclose(fd, next);
+  }
+  return 0;
+}
+
+int dedup_unlink(const char *pathname, LayerContext l) {
+  DedupState *state = (DedupState *)l.internal_state;
+  LayerContext next = state->next;
+
+  // An open file keeps its blocks until its last close; otherwise its map is
+  // opened before it goes, to release them
+  pthread_mutex_lock(&state->files_mutex);
+  DedupFile *file = NULL;
+  HASH_FIND_STR(state->files, pathname, file);
+  int fd = -1;
+  if (!file) {
+    fd = next.ops->lopen(pathname, O_RDONLY, 0, next);
+  }
+  int res = next.ops->lunlink(pathname, next);
+  int err = errno;
+  if (res == 0 && file) {
+    HASH_DEL(state->files, file);
+    file->unlinked = true;
+  } else if (res == 0 && fd >= 0) {
+    map_release_all(state, fd);
+  }
+  pthread_mutex_unlock(&state->files_mutex);
+  if (fd >= 0) {
+    next.ops->lclose(fd, next);
+  }
+  errno = err;
+  return res;
+}
+
+int dedup_rename(const char *from, const char *to, unsigned int flags,
+                 LayerContext l) {
+  DedupState *state = (DedupState *)l.internal_state;
+  LayerContext next = state->next;
+  if (!next.ops->lrename) {
+    errno = ENOSYS;
+    return -1;
+  }
+  if (strcmp(from, to) == 0) {
+    return next.ops->lrename(from, to, flags, next);
+  }
+
+  // a replaced target is removed, as with unlink
+  pthread_mutex_lock(&state->files_mutex);
+  DedupFile *source = NULL, *target = NULL;
+  HASH_FIND_STR(state->files, from, source);
+  HASH_FIND_STR(state->files, to, target);
+  int fd = -1;
+  if (!target && !(flags & RENAME_NOREPLACE)) {
+    fd = next.ops->lopen(to, O_RDONLY, 0, next);
+  }
+  char *path = source ? strdup(to) : NULL;
+  int res = -1, err = ENOMEM;
+  if (!source || path) {
+    res = next.ops->lrename(from, to, flags, next);
+    err = errno;
+  }
+  if (res == 0) {
+    if (target) {
+      HASH_DEL(state->files, target);
+      target->unlinked = true;
+    } else if (fd >= 0) {
+      map_release_all(state, fd);
+    }
+    if (source) {
+      HASH_DEL(state->files, source);
+      pthread_rwlock_wrlock(&source->lock);
+      free(source->path);
+      source->path = path;
+      pthread_rwlock_unlock(&source->lock);
+      HASH_ADD_KEYPTR(hh, state->files, source->path, strlen(source->path),
+                      source);
+      path = NULL;
+    }
+  }
+  pthread_mutex_unlock(&state->files_mutex);
+  free(path);
+  if (fd >= 0) {
+    next.ops->lclose(fd, next);
+  }
+  errno = err;
+  return res;
+}
+
+void dedup_destroy(LayerContext l) {
+  DedupState *state = (DedupState *)l.internal_state;
+  if (state) {
+    LayerContext next = state->next;
+    // fds left open: closed as by dedup_close
+    DedupFd *entry, *tmp_entry;
+    HASH_ITER(hh, state->fds, entry, tmp_entry) { dedup_close(entry->fd, l); }
+    next.ops->lclose(state->blocks_fd, next);
+    next.ops->lclose(state->index_fd, next);
+
+    DedupBlock *block, *tmp_block;
+    HASH_ITER(hh, state->blocks, block, tmp_block) {
+      HASH_DEL(state->blocks, block);
+      free(block);
+    }
+    free(state->slots);
+    free(state->free_slots);
+    pthread_mutex_destroy(&state->store_mutex);
+    pthread_cond_destroy(&state->written);
+    pthread_mutex_destroy(&state->files_mutex);
+    free(state);
+  }
+
+  if (l.ops) {
+    free(l.ops);
+  }
+
+  if (l.next_layers) {
+    free(l.next_layers);
+  }
+}
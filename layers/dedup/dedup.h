@@ -0,0 +1,152 @@
+#ifndef __DEDUP_H__
+#define __DEDUP_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include "../../shared/types/layer_context.h"
+#include "../../shared/utils/hasher/hasher.h"
+#include "config.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * ============================================================================
+ * DEDUP - CONTENT-ADDRESSED BLOCKS SHARED BY THE FILES OF A LAYER
+ * ============================================================================
+ *
+ * VM images and backups are full of blocks they share with each other. The
+ * dedup layer stores each distinct block once, in a block store of the next
+ * layer, and every file as a map from its blocks to the slots of the store.
+ *
+ * - the block store is two files of the block_store directory: "blocks", a
+ *   slot of block_size bytes per block, and "index", a record per slot with
+ *   its reference count, the length of its block and its digest. At init the
+ *   index is read into a table from digest to slot; free slots (no
+ *   reference) are reused before the store grows
+ * - a file is a map at its path in the next layer: a header with its size,
+ *   then a slot number per block, 0 for a hole. Blocks of zeros are holes,
+ *   they are never stored
+ * - a write hashes every block it changes. A block whose digest is in the
+ *   table takes a reference on its slot, one write of the index record; a
+ *   new one is written to a free slot. The slots of the map are written,
+ *   then the references of the blocks they replace dropped: a crash can
+ *   leak a slot, never free one that is used
+ * - block-mode anti_tampering above hashes the same blocks: through
+ *   lpwrite_digest, a block that is written whole is hashed once, for both
+ *   layers. Reads are not digested, anti_tampering hashes what it reads, as
+ *   the digests of the index are what it must not trust
+ * - a rwlock per file serializes its writes, truncates and reads; a mutex
+ *   protects the table and the index, the data of a new block is written
+ *   outside of it
+ * ============================================================================
+ */
+
+#define DEDUP_MAP_MAGIC "TGDM"
+#define DEDUP_INDEX_MAGIC "TGDI"
+#define DEDUP_VERSION 1
+#define DEDUP_BLOCKS_FILE "blocks"
+#define DEDUP_INDEX_FILE "index"
+
+/**
+ * @brief Start of the map of a file, a uint64_t slot + 1 per block follows
+ */
+typedef struct {
+  char magic[4]; // DEDUP_MAP_MAGIC
+  uint32_t version;
+  uint32_t block_size;
+  uint32_t reserved;
+  uint64_t size; // of the file
+} DedupMapHeader;
+
+/**
+ * @brief Start of the index, a DedupIndexRecord per slot follows
+ */
+typedef struct {
+  char magic[4]; // DEDUP_INDEX_MAGIC
+  uint32_t version;
+  uint32_t block_size;
+  uint32_t digest_size;
+} DedupIndexHeader;
+
+/**
+ * @brief Record of a slot in the index, followed by digest_size bytes of
+ * digest
+ */
+typedef struct {
+  uint32_t refs; // 0: free slot
+  uint32_t len;  // of the block, the slot is zeros past it
+} DedupIndexRecord;
+
+typedef struct DedupBlock {
+  uint64_t slot;
+  UT_hash_handle hh;
+  unsigned char digest[]; // key, digest_size bytes
+} DedupBlock;
+
+typedef struct {
+  uint32_t refs;
+  uint32_t len;
+  bool pending;      // its data is being written by the writer that made it
+  DedupBlock *block; // NULL for a free slot
+} DedupSlot;
+
+typedef struct DedupFile {
+  char *path; // key, in the next layer
+  int refs;   // open fds (state->files_mutex)
+  bool unlinked; // out of the table, its blocks dropped on its last close
+  pthread_rwlock_t lock; // the map and size
+  uint64_t size;
+  UT_hash_handle hh;
+} DedupFile;
+
+typedef struct {
+  int fd; // key, from the next layer
+  DedupFile *file;
+  bool writable;
+  UT_hash_handle hh;
+} DedupFd;
+
+typedef struct {
+  LayerContext next;
+  size_t block_size;
+  Hasher hasher;
+  size_t digest_size;
+  size_t record_size; // of a record of the index, with its digest
+  int blocks_fd;      // in the next layer
+  int index_fd;       // in the next layer
+
+  pthread_mutex_t store_mutex; // the fields below
+  pthread_cond_t written;      // broadcast when a pending slot is written
+  DedupBlock *blocks;          // by digest
+  DedupSlot *slots;
+  uint64_t nslots;
+  uint64_t slots_capacity;
+  uint64_t *free_slots; // stack
+  uint64_t nfree;
+
+  pthread_mutex_t files_mutex; // the fields below and the refs of files
+  DedupFile *files;            // by path
+  DedupFd *fds;                // by fd
+} DedupState;
+
+LayerContext dedup_init(LayerContext *next_layer, const DedupConfig *config);
+ssize_t dedup_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                    LayerContext l);
+ssize_t dedup_pwrite(int fd, const void *buffer, size_t nbyte, off_t offset,
+                     LayerContext l);
+ssize_t dedup_pwrite_digest(int fd, const void *buffer, size_t nbyte,
+                            off_t offset, const LayerDigest *digest,
+                            LayerContext l);
+int dedup_open(const char *pathname, int flags, mode_t mode, LayerContext l);
+int dedup_close(int fd, LayerContext l);
+int dedup_fsync(int fd, int isdatasync, LayerContext l);
+int dedup_ftruncate(int fd, off_t length, LayerContext l);
+int dedup_truncate(const char *path, off_t length, LayerContext l);
+int dedup_fstat(int fd, struct stat *stbuf, LayerContext l);
+int dedup_lstat(const char *pathname, struct stat *stbuf, LayerContext l);
+int dedup_unlink(const char *pathname, LayerContext l);
+int dedup_rename(const char *from, const char *to, unsigned int flags,
+                 LayerContext l);
+void dedup_destroy(LayerContext l);
+
+#endif
@@ -0,0 +1,174 @@
+#include "attr_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static inline int timespec_before(const struct timespec *a,
+                                  const struct timespec *b) {
+  return a->tv_sec < b->tv_sec ||
+         (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void free_entry(AttrCacheEntry *entry) {
+  free(entry->path);
+  free(entry);
+}
+
+/**
+ * @brief Create an attribute cache
+ *
+ * @param max_entries  -> maximum number of cached paths (must be > 0)
+ * @param ttl_ms       -> lifetime of an entry in milliseconds (must be > 0)
+ * @return AttrCache*  -> cache, or NULL on error
+ */
+AttrCache *attr_cache_init(size_t max_entries, long ttl_ms) {
+  if (max_entries == 0 || ttl_ms <= 0) {
+    return NULL;
+  }
+  AttrCache *cache = calloc(1, sizeof(AttrCache));
+  if (!cache) {
+    return NULL;
+  }
+  cache->max_entries = max_entries;
+  cache->ttl_ms = ttl_ms;
+  if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+    free(cache);
+    return NULL;
+  }
+  return cache;
+}
+
+/**
+ * @brief Destroy an attribute cache and all its entries
+ *
+ * @param cache -> cache to destroy (may be NULL)
+ */
+void attr_cache_destroy(AttrCache *cache) {
+  if (!cache) {
+    return;
+  }
+  AttrCacheEntry *entry, *tmp;
+  HASH_ITER(hh, cache->entries, entry, tmp) {
+    HASH_DEL(cache->entries, entry);
+    free_entry(entry);
+  }
+  pthread_mutex_destroy(&cache->mutex);
+  free(cache);
+}
+
+/**
+ * @brief Look up the cached attributes of a path
+ *
+ * @param cache -> cache (NULL: always a miss)
+ * @param path  -> file path
+ * @param stbuf -> filled with the cached attributes on a hit
+ * @return int  -> 1 on a hit, 0 if the path is not cached or expired
+ */
+int attr_cache_lookup(AttrCache *cache, const char *path, struct stat *stbuf) {
+  if (!cache || !path) {
+    return 0;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&cache->mutex);
+  AttrCacheEntry *entry = NULL;
+  HASH_FIND(hh, cache->entries, path, strlen(path), entry);
+
+  int hit = 0;
+  if (entry) {
+    HASH_DEL(cache->entries, entry);
+    if (!timespec_before(&now, &entry->expires)) {
+      free_entry(entry);
+      cache->n_entries--;
+    } else {
+      // move to the most recently used position
+      HASH_ADD_KEYPTR(hh, cache->entries, entry->path, strlen(entry->path),
+                      entry);
+      *stbuf = entry->stbuf;
+      hit = 1;
+    }
+  }
+
+  if (hit) {
+    cache->hits++;
+  } else {
+    cache->misses++;
+  }
+  pthread_mutex_unlock(&cache->mutex);
+  return hit;
+}
+
+/**
+ * @brief Cache the attributes of a path for ttl_ms
+ *
+ * @param cache -> cache (NULL: no-op)
+ * @param path  -> file path
+ * @param stbuf -> attributes returned by the layers
+ */
+void attr_cache_insert(AttrCache *cache, const char *path,
+                       const struct stat *stbuf) {
+  if (!cache || !path || !stbuf) {
+    return;
+  }
+
+  pthread_mutex_lock(&cache->mutex);
+  AttrCacheEntry *entry = NULL;
+  HASH_FIND(hh, cache->entries, path, strlen(path), entry);
+  if (entry) {
+    HASH_DEL(cache->entries, entry);
+  } else {
+    entry = calloc(1, sizeof(AttrCacheEntry));
+    if (entry) {
+      entry->path = strdup(path);
+    }
+    if (!entry || !entry->path) {
+      free(entry);
+      pthread_mutex_unlock(&cache->mutex);
+      return;
+    }
+
+    // evict the least recently used entry
+    if (cache->n_entries >= cache->max_entries && cache->entries) {
+      AttrCacheEntry *oldest = cache->entries;
+      HASH_DEL(cache->entries, oldest);
+      free_entry(oldest);
+      cache->n_entries--;
+    }
+    cache->n_entries++;
+  }
+
+  entry->stbuf = *stbuf;
+  clock_gettime(CLOCK_MONOTONIC, &entry->expires);
+  entry->expires.tv_sec += cache->ttl_ms / 1000;
+  entry->expires.tv_nsec += (cache->ttl_ms % 1000) * 1000000L;
+  if (entry->expires.tv_nsec >= 1000000000L) {
+    entry->expires.tv_sec++;
+    entry->expires.tv_nsec -= 1000000000L;
+  }
+  HASH_ADD_KEYPTR(hh, cache->entries, entry->path, strlen(entry->path),
+                  entry);
+  pthread_mutex_unlock(&cache->mutex);
+}
+
+/**
+ * @brief Forget a path (on write, truncate or unlink)
+ *
+ * @param cache -> cache (NULL: no-op)
+ * @param path  -> file path
+ */
+void attr_cache_invalidate(AttrCache *cache, const char *path) {
+  if (!cache || !path) {
+    return;
+  }
+  pthread_mutex_lock(&cache->mutex);
+  AttrCacheEntry *entry = NULL;
+  HASH_FIND(hh, cache->entries, path, strlen(path), entry);
+  if (entry) {
+    HASH_DEL(cache->entries, entry);
+    free_entry(entry);
+    cache->n_entries--;
+  }
+  pthread_mutex_unlock(&cache->mutex);
+}
@@ -0,0 +1,49 @@
+#ifndef __ATTR_CACHE_H__
+#define __ATTR_CACHE_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * ============================================================================
+ * ATTRIBUTE CACHE - SERVE REPEATED FSTAT/LSTAT FROM MEMORY
+ * ============================================================================
+ *
+ * Remembers, per path, the stat result of the last fstat or lstat for at most
+ * ttl_ms milliseconds. The demultiplexer invalidates a path whenever it
+ * writes, truncates or unlinks it; changes made underneath the demultiplexer
+ * are only seen once the entry expires.
+ *
+ * Entries are kept in LRU order (uthash insertion order, refreshed on hit) and
+ * the least recently used one is evicted once max_entries is reached.
+ * ============================================================================
+ */
+
+typedef struct AttrCacheEntry {
+  char *path;              // key
+  struct stat stbuf;       // cached attributes
+  struct timespec expires; // monotonic expiry time
+  UT_hash_handle hh;
+} AttrCacheEntry;
+
+typedef struct AttrCache {
+  AttrCacheEntry *entries; // LRU ordered, oldest first
+  size_t n_entries;        // current number of entries
+  size_t max_entries;      // LRU bound
+  long ttl_ms;             // entry lifetime in milliseconds
+  size_t hits;             // lookups served from the cache
+  size_t misses;           // lookups that went to the layers
+  pthread_mutex_t mutex;   // protects all the fields above
+} AttrCache;
+
+AttrCache *attr_cache_init(size_t max_entries, long ttl_ms);
+void attr_cache_destroy(AttrCache *cache);
+int attr_cache_lookup(AttrCache *cache, const char *path, struct stat *stbuf);
+void attr_cache_insert(AttrCache *cache, const char *path,
+                       const struct stat *stbuf);
+void attr_cache_invalidate(AttrCache *cache, const char *path);
+
+#endif // __ATTR_CACHE_H__
@@ -2,6 +2,27 @@
 #define __DEMULTIPLEXER_CONFIG_H__
 
 #include "../../config/utils.h"
+#include <stdbool.h>
+#include <string.h>
+
+#define DEMULTIPLEXER_DEFAULT_ATTR_CACHE_TTL_MS 1000
+#define DEMULTIPLEXER_DEFAULT_STRIPE_SIZE ((size_t)64 * 1024)
+
+// How reads are served by the next layers
+typedef enum {
+  DEMULTIPLEXER_READ_ALL,           // read every layer (default)
+  DEMULTIPLEXER_READ_PREFERRED,     // read one layer, the next ones on failure
+  DEMULTIPLEXER_READ_FASTEST,       // as preferred, lowest EWMA latency first
+  DEMULTIPLEXER_READ_HEDGED,        // also read a second layer past the p95
+  DEMULTIPLEXER_READ_FIRST_SUCCESS, // read all layers, first success wins
+} DemultiplexerReadPolicy;
+
+// How a file is laid out on the next layers
+typedef enum {
+  DEMULTIPLEXER_LAYOUT_REPLICATED, // every layer holds the file (default)
+  DEMULTIPLEXER_LAYOUT_STRIPED,    // stripe units spread round-robin
+  DEMULTIPLEXER_LAYOUT_ERASURE,    // data units striped, plus parity units
+} DemultiplexerLayout;
 
 // Demultiplexer layer configuration structure
 typedef struct {
@@ -13,6 +34,19 @@ typedef struct {
   int n_passthrough_writes;
   char **enforced_layers;
   int n_enforced_layers;
+  DemultiplexerReadPolicy read_policy;
+  bool verify_replicas; // Compare the layers' data, by digest when they can
+  int write_quorum; // Layers acknowledging a write, 0 for the enforced ones
+  bool has_metadata_layer;   // fstat/lstat are served by metadata_layer
+  int metadata_layer;        // Index in layers of the metadata layer
+  bool metadata_check;       // Still fan out metadata ops to compare them
+  size_t attr_cache_entries; // Attribute cache size, 0 disables it
+  long attr_cache_ttl_ms;    // Attribute cache entry lifetime
+  DemultiplexerLayout layout;
+  size_t stripe_size; // Bytes of a stripe unit in the striped and erasure
+                      // layouts
+  int data_layers;    // Layers holding data in the erasure layout, the
+                      // others hold parity
 } DemultiplexerConfig;
 
 /**
@@ -29,9 +63,130 @@ static inline void demultiplexer_parse_params(toml_datum_t layer_table,
 
   config->layers = parse_string_array(layers, &config->n_layers);
 
+  config->read_policy = DEMULTIPLEXER_READ_ALL;
+  config->verify_replicas = false;
+  config->write_quorum = 0;
+  config->has_metadata_layer = false;
+  config->metadata_layer = 0;
+  config->metadata_check = false;
+  config->attr_cache_entries = 0;
+  config->attr_cache_ttl_ms = DEMULTIPLEXER_DEFAULT_ATTR_CACHE_TTL_MS;
+  config->layout = DEMULTIPLEXER_LAYOUT_REPLICATED;
+  config->stripe_size = DEMULTIPLEXER_DEFAULT_STRIPE_SIZE;
+  config->data_layers = 0;
+
   // Parse optional settings from options table
   toml_datum_t options_table = toml_get(layer_table, "options");
   if (options_table.type == TOML_TABLE) {
+    // Parse optional read_policy string
+    toml_datum_t read_policy = toml_get(options_table, "read_policy");
+    if (read_policy.type == TOML_STRING) {
+      if (strcmp(read_policy.u.str.ptr, "all") == 0) {
+        config->read_policy = DEMULTIPLEXER_READ_ALL;
+      } else if (strcmp(read_policy.u.str.ptr, "preferred") == 0) {
+        config->read_policy = DEMULTIPLEXER_READ_PREFERRED;
+      } else if (strcmp(read_policy.u.str.ptr, "fastest") == 0) {
+        config->read_policy = DEMULTIPLEXER_READ_FASTEST;
+      } else if (strcmp(read_policy.u.str.ptr, "hedged") == 0) {
+        config->read_policy = DEMULTIPLEXER_READ_HEDGED;
+      } else if (strcmp(read_policy.u.str.ptr, "first_success") == 0) {
+        config->read_policy = DEMULTIPLEXER_READ_FIRST_SUCCESS;
+      } else {
+        toml_error("Invalid demultiplexer read_policy; use: all, preferred, "
+                   "fastest, hedged, first_success");
+      }
+    }
+
+    toml_datum_t verify_replicas = toml_get(options_table, "verify_replicas");
+    if (verify_replicas.type == TOML_BOOLEAN) {
+      config->verify_replicas = verify_replicas.u.boolean;
+    }
+
+    // Parse optional write_quorum, checked against the layers by init
+    toml_datum_t write_quorum = toml_get(options_table, "write_quorum");
+    if (write_quorum.type == TOML_INT64) {
+      if (write_quorum.u.int64 < 0 || write_quorum.u.int64 > config->n_layers) {
+        toml_error("Demultiplexer write_quorum must be between 0 and the "
+                   "number of layers");
+      }
+      config->write_quorum = (int)write_quorum.u.int64;
+    }
+
+    // Parse optional metadata_layer, one of the layers
+    toml_datum_t metadata_layer = toml_get(options_table, "metadata_layer");
+    if (metadata_layer.type == TOML_STRING) {
+      for (int i = 0; i < config->n_layers; i++) {
+        if (strcmp(config->layers[i], metadata_layer.u.str.ptr) == 0) {
+          config->has_metadata_layer = true;
+          config->metadata_layer = i;
+          break;
+        }
+      }
+      if (!config->has_metadata_layer) {
+        toml_error("Demultiplexer metadata_layer must be one of its layers");
+      }
+    }
+
+    toml_datum_t metadata_check = toml_get(options_table, "metadata_check");
+    if (metadata_check.type == TOML_BOOLEAN) {
+      config->metadata_check = metadata_check.u.boolean;
+    }
+
+    // Parse optional attribute cache, disabled by default
+    toml_datum_t attr_cache_entries =
+        toml_get(options_table, "attr_cache_entries");
+    if (attr_cache_entries.type == TOML_INT64) {
+      if (attr_cache_entries.u.int64 < 0) {
+        toml_error("Demultiplexer attr_cache_entries must not be negative");
+      }
+      config->attr_cache_entries = (size_t)attr_cache_entries.u.int64;
+    }
+
+    toml_datum_t attr_cache_ttl_ms =
+        toml_get(options_table, "attr_cache_ttl_ms");
+    if (attr_cache_ttl_ms.type == TOML_INT64) {
+      if (attr_cache_ttl_ms.u.int64 <= 0) {
+        toml_error("Demultiplexer attr_cache_ttl_ms must be positive");
+      }
+      config->attr_cache_ttl_ms = (long)attr_cache_ttl_ms.u.int64;
+    }
+
+    // Parse optional layout, checked against the other options by init
+    toml_datum_t layout = toml_get(options_table, "layout");
+    if (layout.type == TOML_STRING) {
+      if (strcmp(layout.u.str.ptr, "replicated") == 0) {
+        config->layout = DEMULTIPLEXER_LAYOUT_REPLICATED;
+      } else if (strcmp(layout.u.str.ptr, "striped") == 0) {
+        config->layout = DEMULTIPLEXER_LAYOUT_STRIPED;
+      } else if (strcmp(layout.u.str.ptr, "erasure") == 0) {
+        config->layout = DEMULTIPLEXER_LAYOUT_ERASURE;
+      } else {
+        toml_error("Invalid demultiplexer layout; use: replicated, striped, "
+                   "erasure");
+      }
+    }
+
+    toml_datum_t data_layers = toml_get(options_table, "data_layers");
+    if (data_layers.type == TOML_INT64) {
+      if (data_layers.u.int64 < 1 || data_layers.u.int64 >= config->n_layers) {
+        toml_error("Demultiplexer data_layers must leave at least one of the "
+                   "layers for parity");
+      }
+      config->data_layers = (int)data_layers.u.int64;
+    }
+    if (config->layout == DEMULTIPLEXER_LAYOUT_ERASURE &&
+        config->data_layers == 0) {
+      toml_error("The erasure layout of a demultiplexer needs data_layers");
+    }
+
+    toml_datum_t stripe_size = toml_get(options_table, "stripe_size");
+    if (stripe_size.type == TOML_INT64) {
+      if (stripe_size.u.int64 <= 0) {
+        toml_error("Demultiplexer stripe_size must be positive");
+      }
+      config->stripe_size = (size_t)stripe_size.u.int64;
+    }
+
     // Parse optional passthrough_reads array
     toml_datum_t passthrough_reads =
         toml_get(options_table, "passthrough_reads");
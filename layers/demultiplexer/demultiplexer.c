@@ -1,25 +1,63 @@
 #include "demultiplexer.h"
 #include "../../logdef.h"
+#include "../../shared/utils/layer_async.h"
 #include "../../shared/utils/parallel.h"
 #include "enforcement.h"
+#include "erasure.h"
 #include "passthrough_ops.h"
+#include "read_policy.h"
+#include "replication.h"
+#include "striping.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+/**
+ * @brief Set a DemultiplexerFd to a closed fd (fd table entry initializer)
+ */
+static void init_demultiplexer_fd(void *entry) {
+  DemultiplexerFd *master = entry;
+  memset(master, 0, sizeof(*master));
+  for (int i = 0; i < MAX_LAYERS; i++) {
+    master->layer_fds[i] = INVALID_FD;
+  }
+}
+
+/**
+ * @brief State of a master fd
+ *
+ * @param state -> demultiplexer state
+ * @param fd    -> master fd
+ * @return DemultiplexerFd* -> state of fd, NULL if fd was never open
+ */
+DemultiplexerFd *demultiplexer_fd(DemultiplexerState *state, int fd) {
+  return fd_table_get(&state->fds, fd);
+}
+
 /**
  * @brief Init Demultiplexer Layer
  *
  * @param l             -> array of LayerContext (next layers in the three)
  * @param nlayers       -> number of next layers
+ * @param config        -> read policy, write quorum, metadata and layout
+ * settings, NULL for the defaults (layer names and passthrough arrays are not
+ * used)
  * @return LayerContext -> demultiplexer layer
  */
 LayerContext demultiplexer_init(LayerContext *l, int nlayers,
                                 int *passthrough_reads, int *passthrough_writes,
-                                int *enforced_layers) {
+                                int *enforced_layers,
+                                const DemultiplexerConfig *config) {
+  DemultiplexerReadPolicy read_policy =
+      config ? config->read_policy : DEMULTIPLEXER_READ_ALL;
+  int write_quorum = config ? config->write_quorum : 0;
+  DemultiplexerLayout layout =
+      config ? config->layout : DEMULTIPLEXER_LAYOUT_REPLICATED;
+
   LayerContext new_layer;
   new_layer.app_context = NULL;
 
@@ -29,11 +67,7 @@ LayerContext demultiplexer_init(LayerContext *l, int nlayers,
     exit(1);
   }
 
-  for (int i = 0; i < MAX_FDS; i++) {
-    for (int j = 0; j < MAX_LAYERS; j++) {
-      state->layer_fds[i][j] = INVALID_FD;
-    }
-  }
+  fd_table_init(&state->fds, sizeof(DemultiplexerFd), init_demultiplexer_fd);
 
   state->options = malloc(sizeof(DemultiplexerOptions) * nlayers);
   if (!state->options) {
@@ -55,13 +89,105 @@ LayerContext demultiplexer_init(LayerContext *l, int nlayers,
     state->options[0].enforced = true;
   }
 
+  int n_write_layers = 0;
+  for (int i = 0; i < nlayers; i++) {
+    state->options[i].passthrough_read = passthrough_reads[i] == 1;
+    state->options[i].passthrough_write = passthrough_writes[i] == 1;
+    if (!state->options[i].passthrough_write) {
+      n_write_layers++;
+    }
+  }
+
   validate_passthrough_ops(passthrough_reads, passthrough_writes, nlayers);
 
+  if (write_quorum < 0 || write_quorum > n_write_layers) {
+    ERROR_MSG("[DEMULTIPLEXER_INIT] Write quorum %d is above the %d layers "
+              "storing writes",
+              write_quorum, n_write_layers);
+    exit(1);
+  }
+
+  state->metadata_layer = -1;
+  state->metadata_check = false;
+  state->attr_cache = NULL;
+  if (config && config->has_metadata_layer) {
+    if (config->metadata_layer < 0 || config->metadata_layer >= nlayers) {
+      ERROR_MSG("[DEMULTIPLEXER_INIT] Metadata layer %d is not a next layer",
+                config->metadata_layer);
+      exit(1);
+    }
+    state->metadata_layer = config->metadata_layer;
+    state->metadata_check = config->metadata_check;
+  }
+
+  // a striped file is only whole with every layer: each one is enforced,
+  // reads and writes reach all of them for their part of the file. An
+  // erasure coded file spreads the same way, over its data and parity layers
+  state->layout = layout;
+  state->stripe_size = 0;
+  state->data_layers = 0;
+  if (layout != DEMULTIPLEXER_LAYOUT_REPLICATED) {
+    const char *name =
+        layout == DEMULTIPLEXER_LAYOUT_STRIPED ? "striped" : "erasure";
+    if (config->stripe_size == 0) {
+      ERROR_MSG("[DEMULTIPLEXER_INIT] The %s layout needs a stripe size",
+                name);
+      exit(1);
+    }
+    if (read_policy != DEMULTIPLEXER_READ_ALL || write_quorum != 0 ||
+        state->metadata_layer >= 0) {
+      ERROR_MSG("[DEMULTIPLEXER_INIT] The %s layout reads and writes "
+                "every layer: it takes no read_policy, write_quorum nor "
+                "metadata_layer",
+                name);
+      exit(1);
+    }
+    for (int i = 0; i < nlayers; i++) {
+      if (passthrough_reads[i] == 1 || passthrough_writes[i] == 1) {
+        ERROR_MSG("[DEMULTIPLEXER_INIT] Layer %d of a %s layout cannot "
+                  "have passthrough operations",
+                  i, name);
+        exit(1);
+      }
+      state->options[i].enforced = true;
+    }
+    state->stripe_size = config->stripe_size;
+  }
+  if (layout == DEMULTIPLEXER_LAYOUT_ERASURE) {
+    state->data_layers = config->data_layers;
+    if (reed_solomon_init(&state->erasure_code, config->data_layers,
+                          nlayers - config->data_layers) != 0) {
+      ERROR_MSG("[DEMULTIPLEXER_INIT] The erasure layout needs between 1 and "
+                "%d data layers",
+                nlayers - 1);
+      exit(1);
+    }
+    for (int i = 0; i < DEMULTIPLEXER_ERASURE_LOCKS; i++) {
+      pthread_rwlock_init(&state->erasure_locks[i], NULL);
+    }
+  }
+
+  // replicas are compared on the reads of the all policy, which reach every
+  // layer holding the whole file
+  state->verify_replicas = config && config->verify_replicas;
+  if (state->verify_replicas && (read_policy != DEMULTIPLEXER_READ_ALL ||
+                                 layout != DEMULTIPLEXER_LAYOUT_REPLICATED)) {
+    ERROR_MSG("[DEMULTIPLEXER_INIT] verify_replicas needs read_policy = "
+              "\"all\" and the replicated layout");
+    exit(1);
+  }
+
+  if (nlayers > PARALLEL_MAX_TASKS) {
+    ERROR_MSG("[DEMULTIPLEXER_INIT] At most %d layers are supported",
+              PARALLEL_MAX_TASKS);
+    exit(1);
+  }
+
   new_layer.internal_state = state;
   new_layer.next_layers = l;
   new_layer.nlayers = nlayers;
 
-  LayerOps *ops = malloc(sizeof(LayerOps));
+  LayerOps *ops = calloc(1, sizeof(LayerOps));
   if (!ops) {
     ERROR_MSG("Failed to allocate demultiplexer operations\n");
     free(state);
@@ -69,12 +195,15 @@ LayerContext demultiplexer_init(LayerContext *l, int nlayers,
   }
   ops->lpread = demultiplexer_pread;
   ops->lpwrite = demultiplexer_pwrite;
+  ops->lpreadv = demultiplexer_preadv;
+  ops->lpwritev = demultiplexer_pwritev;
   ops->lopen = demultiplexer_open;
   ops->lclose = demultiplexer_close;
   ops->lftruncate = demultiplexer_ftruncate;
   ops->lfstat = demultiplexer_fstat;
   ops->llstat = demultiplexer_lstat;
   ops->lunlink = demultiplexer_unlink;
+  ops->lreconfigure = demultiplexer_reconfigure;
 
   // Set passthrough operations for the next layers
   for (int i = 0; i < nlayers; i++) {
@@ -86,6 +215,7 @@ LayerContext demultiplexer_init(LayerContext *l, int nlayers,
         exit(1);
       }
       l[i].ops->lpread = passthrough_pread;
+      l[i].ops->lpreadv = passthrough_preadv;
     }
     if (passthrough_writes[i] == 1) {
       if (enforced_layers[i] == 1) {
@@ -93,9 +223,53 @@ LayerContext demultiplexer_init(LayerContext *l, int nlayers,
         exit(1);
       }
       l[i].ops->lpwrite = passthrough_pwrite;
+      l[i].ops->lpwritev = passthrough_pwritev;
+    }
+  }
+
+  // enforced layers are read first, then the others in configuration order
+  state->read_policy = read_policy;
+  state->n_read_layers = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < nlayers; i++) {
+      if (!state->options[i].passthrough_read &&
+          state->options[i].enforced == (pass == 0)) {
+        state->read_order[state->n_read_layers++] = i;
+      }
     }
   }
 
+  memset(state->latency, 0, sizeof(state->latency));
+  state->hedged_reads = 0;
+  state->metadata_mismatches = 0;
+  state->replica_mismatches = 0;
+  pthread_mutex_init(&state->read_mutex, NULL);
+  pthread_cond_init(&state->reads_done, NULL);
+  replication_init(state, nlayers, write_quorum);
+
+  if (config && config->attr_cache_entries > 0) {
+    state->attr_cache =
+        attr_cache_init(config->attr_cache_entries, config->attr_cache_ttl_ms);
+    if (!state->attr_cache) {
+      ERROR_MSG("[DEMULTIPLEXER_INIT] Failed to allocate the attribute cache");
+      exit(1);
+    }
+  }
+
+  state->scratch = buffer_pool_init(DEMULTIPLEXER_SCRATCH_BUFFERS,
+                                    DEMULTIPLEXER_SCRATCH_MAX_SIZE, 0);
+  if (!state->scratch) {
+    ERROR_MSG("[DEMULTIPLEXER_INIT] Failed to allocate the read buffer pool");
+    exit(1);
+  }
+
+  // started last so that invalid configurations exit without workers running
+  state->pool = thread_pool_init(nlayers, DEMULTIPLEXER_WORKERS_PER_LAYER);
+  if (!state->pool) {
+    ERROR_MSG("[DEMULTIPLEXER_INIT] Failed to start the thread pool");
+    exit(1);
+  }
+
   new_layer.ops = ops;
 
   return new_layer;
@@ -109,112 +283,190 @@ LayerContext demultiplexer_init(LayerContext *l, int nlayers,
  * @param nbyte    -> number of bytes to read
  * @param offset   -> offset value
  * @param l        -> Context for the demultiplexer layer
- * @return ssize_t -> number of read bytes from layer 0
+ * @return ssize_t -> number of read bytes, see the read policy
  */
 ssize_t demultiplexer_pread(int fd, void *buff, size_t nbyte, off_t offset,
                             LayerContext l) {
   DemultiplexerState *state = (DemultiplexerState *)l.internal_state;
 
-  if (fd < 0 || fd >= MAX_FDS) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  if (!master) {
     return -1;
   }
 
   int nlayers = l.nlayers;
   int layer_fds[nlayers];
   for (int i = 0; i < nlayers; i++) {
-    layer_fds[i] = state->layer_fds[fd][i];
+    layer_fds[i] = master->layer_fds[i];
   }
 
-  // Execute parallel reads and get all results
-  ssize_t results[nlayers];
-  int active_threads = 0;
-  void **thread_buffers = NULL;
-  pthread_t *threads =
-      execute_parallel_reads(l.next_layers, nlayers, layer_fds, buff, nbyte,
-                             offset, results, &active_threads, &thread_buffers);
-  if (threads == NULL) {
-    ERROR_MSG("[DEMULTIPLEXER_PREAD] Failed to allocate threads for parallel "
-              "reads");
+  struct iovec iov = {.iov_base = buff, .iov_len = nbyte};
+  if (state->layout == DEMULTIPLEXER_LAYOUT_STRIPED) {
+    return striped_preadv(state, layer_fds, &iov, 1, offset, l);
+  }
+  if (state->layout == DEMULTIPLEXER_LAYOUT_ERASURE) {
+    return erasure_preadv(state, fd, &iov, 1, offset, l);
+  }
+  return read_with_policy(state, fd, layer_fds, buff, nbyte, offset, l);
+}
+
+/**
+ * @brief pwrite demultiplexed across the next layers
+ *
+ * @param fd       -> file descriptor (from first layer)
+ * @param buff     -> buffer to write
+ * @param nbyte    -> number of bytes to write
+ * @param offset   -> offset value
+ * @param l        -> context of the demultiplexer layer
+ * @return ssize_t -> number of written bytes in the first enforced layer, or
+ * in the first layer that applied it with a write quorum
+ */
+ssize_t demultiplexer_pwrite(int fd, const void *buff, size_t nbyte,
+                             off_t offset, LayerContext l) {
+  struct iovec iov = {.iov_base = (void *)buff, .iov_len = nbyte};
+  return demultiplexer_pwritev(fd, &iov, 1, offset, l);
+}
+
+/**
+ * @brief preadv demultiplexed across the next layers
+ *
+ * The preferred and fastest policies hand the buffers to the layer they
+ * read from; the other policies read into a scratch buffer and scatter it.
+ *
+ * @param fd       -> file descriptor (from first layer)
+ * @param iov      -> buffers to read into
+ * @param iovcnt   -> number of buffers
+ * @param offset   -> offset value
+ * @param l        -> Context for the demultiplexer layer
+ * @return ssize_t -> number of read bytes, see the read policy
+ */
+ssize_t demultiplexer_preadv(int fd, const struct iovec *iov, int iovcnt,
+                             off_t offset, LayerContext l) {
+  DemultiplexerState *state = (DemultiplexerState *)l.internal_state;
+
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  if (!master) {
     return -1;
   }
 
-  wait_for_all_threads(threads, active_threads, nlayers, state);
-  free(threads);
+  int nlayers = l.nlayers;
+  int layer_fds[nlayers];
+  for (int i = 0; i < nlayers; i++) {
+    layer_fds[i] = master->layer_fds[i];
+  }
 
-  // Determine which layer's result to use and copy its data
-  ssize_t final_result =
-      get_enforced_layers_ssize_result(results, nlayers, state);
+  if (state->layout == DEMULTIPLEXER_LAYOUT_STRIPED) {
+    return striped_preadv(state, layer_fds, iov, iovcnt, offset, l);
+  }
+  if (state->layout == DEMULTIPLEXER_LAYOUT_ERASURE) {
+    return erasure_preadv(state, fd, iov, iovcnt, offset, l);
+  }
+  return readv_with_policy(state, fd, layer_fds, iov, iovcnt, offset, l);
+}
 
-  // Find the first enforced layer that succeeded to copy its data
-  int chosen_layer = -1;
-  if (final_result > 0) {
-    for (int i = 0; i < nlayers; i++) {
-      if (state->options[i].enforced && results[i] > 0) {
-        chosen_layer = i;
-        break;
-      }
+/**
+ * @brief Fan a single buffer pwrite out through the async ops of the layers
+ *
+ * Only taken when every next layer submits asynchronously itself, so no pool
+ * worker blocks for the duration of a write.
+ *
+ * @return int     -> 0 and results set, -1 if the write could not be queued
+ * on every layer (the queued ones are waited for)
+ */
+static int pwrite_pipelined(LayerContext l, int *layer_fds, const void *buffer,
+                            size_t nbyte, off_t offset, ssize_t *results) {
+  for (int i = 0; i < l.nlayers; i++) {
+    if (!layer_has_native_async(l.next_layers[i])) {
+      return -1;
     }
   }
 
-  // Validate buffer access before memcpy to prevent buffer overflow
-  if (chosen_layer >= 0 && thread_buffers && thread_buffers[chosen_layer] &&
-      final_result > 0 && final_result <= nbyte) {
-    memcpy(buff, thread_buffers[chosen_layer], final_result);
-  } else {
-    final_result = -1; // Indicate failure
+  LayerCompletionQueue cq;
+  LayerCompletion completions[l.nlayers];
+  layer_cq_init(&cq);
+  int queued = 0;
+  for (; queued < l.nlayers; queued++) {
+    if (layer_cq_pwrite(&cq, &completions[queued], layer_fds[queued], buffer,
+                        nbyte, offset, l.next_layers[queued]) != 0) {
+      break;
+    }
   }
+  layer_cq_wait(&cq);
 
-  // Clean up all thread buffers - now safe since all threads have completed
-  if (thread_buffers) {
-    for (int i = 0; i < nlayers; i++) {
-      if (thread_buffers[i]) {
-        free(thread_buffers[i]);
-        thread_buffers[i] = NULL;
-      }
+  for (int i = 0; i < queued; i++) {
+    results[i] = completions[i].res;
+  }
+  if (queued < l.nlayers) {
+    // the queued layers already applied it, write the rest synchronously
+    for (int i = queued; i < l.nlayers; i++) {
+      results[i] = l.next_layers[i].ops->lpwrite(layer_fds[i], buffer, nbyte,
+                                                 offset, l.next_layers[i]);
     }
-    free((void *)thread_buffers);
   }
-
-  return final_result;
+  return 0;
 }
 
 /**
- * @brief pwrite demultiplexed across the next layers
+ * @brief pwritev demultiplexed across the next layers
+ *
+ * Every layer is handed the caller's buffers; with a write quorum they are
+ * gathered once into the replay logs.
  *
  * @param fd       -> file descriptor (from first layer)
- * @param buff     -> buffer to write
- * @param nbyte    -> number of bytes to write
+ * @param iov      -> buffers to write
+ * @param iovcnt   -> number of buffers
  * @param offset   -> offset value
  * @param l        -> context of the demultiplexer layer
- * @return ssize_t -> number of written bytes in the first layer (index 0)
+ * @return ssize_t -> number of written bytes in the first enforced layer, or
+ * in the first layer that applied it with a write quorum
  */
-ssize_t demultiplexer_pwrite(int fd, const void *buff, size_t nbyte,
-                             off_t offset, LayerContext l) {
+ssize_t demultiplexer_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                              off_t offset, LayerContext l) {
   DemultiplexerState *state = (DemultiplexerState *)l.internal_state;
 
-  if (fd < 0 || fd >= MAX_FDS) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  if (!master) {
     return -1;
   }
+  if (state->write_quorum > 0) {
+    ssize_t res = replicate_write(state, fd, iov, iovcnt, offset, l);
+    attr_cache_invalidate(state->attr_cache, master->path);
+    return res;
+  }
   int nlayers = l.nlayers;
 
   int layer_fds[nlayers];
   for (int i = 0; i < nlayers; i++) {
-    layer_fds[i] = state->layer_fds[fd][i];
+    layer_fds[i] = master->layer_fds[i];
+  }
+
+  if (state->layout != DEMULTIPLEXER_LAYOUT_REPLICATED) {
+    ssize_t res =
+        state->layout == DEMULTIPLEXER_LAYOUT_STRIPED
+            ? striped_pwritev(state, layer_fds, iov, iovcnt, offset, l)
+            : erasure_pwritev(state, fd, iov, iovcnt, offset, l);
+    attr_cache_invalidate(state->attr_cache, master->path);
+    return res;
   }
 
   ssize_t results[nlayers];
+  if (iovcnt == 1 && pwrite_pipelined(l, layer_fds, iov[0].iov_base,
+                                      iov[0].iov_len, offset, results) == 0) {
+    attr_cache_invalidate(state->attr_cache, master->path);
+    return get_enforced_layers_ssize_result(results, nlayers, state);
+  }
+
   int active_threads = 0;
-  pthread_t *threads =
-      execute_parallel_writes(l.next_layers, nlayers, layer_fds, buff, nbyte,
-                              offset, results, &active_threads);
-  if (threads == NULL) {
-    ERROR_MSG("[DEMULTIPLEXER_PWRITE] Failed to allocate threads for parallel "
-              "writes");
+  ParallelBatch batch;
+  if (execute_parallel_writevs(state->pool, &batch, l.next_layers, nlayers,
+                               layer_fds, iov, iovcnt, offset, results,
+                               &active_threads) != 0) {
+    ERROR_MSG("[DEMULTIPLEXER_PWRITE] Failed to start parallel writes");
     return -1;
   }
 
-  wait_for_all_threads(threads, active_threads, nlayers, state);
-  free(threads);
+  wait_for_all_threads(&batch, active_threads, nlayers, state);
+  attr_cache_invalidate(state->attr_cache, master->path);
 
   return get_enforced_layers_ssize_result(results, nlayers, state);
 }
@@ -234,25 +486,60 @@ int demultiplexer_open(const char *pathname, int flags, mode_t mode,
   int nlayers = l.nlayers;
   int results[nlayers];
   int active_threads = 0;
-  pthread_t *threads = execute_parallel_opens(
-      l.next_layers, nlayers, pathname, flags, mode, results, &active_threads);
-  if (threads == NULL) {
-    ERROR_MSG("[DEMULTIPLEXER_OPEN] Failed to allocate threads for parallel "
-              "opens");
+  ParallelBatch batch;
+  if (execute_parallel_opens(state->pool, &batch, l.next_layers, nlayers,
+                             pathname, flags, mode, results,
+                             &active_threads) != 0) {
+    ERROR_MSG("[DEMULTIPLEXER_OPEN] Failed to start parallel opens");
     return -1;
   }
-  wait_for_all_threads(threads, active_threads, nlayers, state);
-  free(threads);
+  wait_for_all_threads(&batch, active_threads, nlayers, state);
 
   // the returned fd is the one from the first layer
   // as the open waits for all layers to complete,
   // there is no need to check for enforced layers
   int master_fd = results[0];
+  if (state->layout == DEMULTIPLEXER_LAYOUT_ERASURE) {
+    // any data_layers of the layers hold the file, and the first opened
+    // one names it
+    master_fd = erasure_open_result(state, results, nlayers);
+    if (master_fd < 0) {
+      for (int i = 0; i < nlayers; i++) {
+        if (results[i] >= 0) {
+          l.next_layers[i].ops->lclose(results[i], l.next_layers[i]);
+        }
+      }
+      return -1;
+    }
+  }
 
-  if (master_fd >= 0) {
+  DemultiplexerFd *master =
+      master_fd >= 0 ? fd_table_slot(&state->fds, master_fd) : NULL;
+  if (master_fd >= 0 && !master) {
+    ERROR_MSG("[DEMULTIPLEXER_OPEN] No fd table slot for fd %d", master_fd);
     for (int i = 0; i < nlayers; i++) {
-      state->layer_fds[master_fd][i] = results[i];
+      if (results[i] >= 0) {
+        l.next_layers[i].ops->lclose(results[i], l.next_layers[i]);
+      }
     }
+    errno = EMFILE;
+    return -1;
+  }
+  if (master) {
+    for (int i = 0; i < nlayers; i++) {
+      master->layer_fds[i] = results[i];
+    }
+    track_replicated_file(state, pathname, flags, master_fd, l);
+  }
+  if (flags & (O_CREAT | O_TRUNC)) {
+    attr_cache_invalidate(state->attr_cache, pathname);
+  }
+  if (master && state->layout == DEMULTIPLEXER_LAYOUT_ERASURE &&
+      erasure_open_file(state, master_fd, flags, l) != 0) {
+    int error = errno;
+    demultiplexer_close(master_fd, l);
+    errno = error;
+    return -1;
   }
 
   return master_fd;
@@ -268,29 +555,37 @@ int demultiplexer_open(const char *pathname, int flags, mode_t mode,
 int demultiplexer_close(int fd, LayerContext l) {
   DemultiplexerState *state = (DemultiplexerState *)l.internal_state;
 
-  if (fd < 0 || fd >= MAX_FDS) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  if (!master) {
     return -1;
   }
 
+  // reads that lost a hedged or first_success race may still use the fds,
+  // and the replay logs may still hold writes for them
+  wait_for_inflight_reads(state, fd);
+  wait_for_replication(state, fd, l.nlayers);
+  forget_replicated_file(state, fd, l.nlayers);
+
   int nlayers = l.nlayers;
   int layer_fds[nlayers];
   for (int i = 0; i < nlayers; i++) {
-    layer_fds[i] = state->layer_fds[fd][i];
-    state->layer_fds[fd][i] = INVALID_FD; // Clear the mapping
+    layer_fds[i] = master->layer_fds[i];
+    master->layer_fds[i] = INVALID_FD; // Clear the mapping
   }
 
   int results[nlayers];
   int active_threads = 0;
-  pthread_t *threads = execute_parallel_closes(
-      l.next_layers, nlayers, layer_fds, results, &active_threads);
-  if (threads == NULL) {
-    ERROR_MSG("[DEMULTIPLEXER_CLOSE] Failed to allocate threads for parallel "
-              "closes");
+  ParallelBatch batch;
+  if (execute_parallel_closes(state->pool, &batch, l.next_layers, nlayers,
+                              layer_fds, results, &active_threads) != 0) {
+    ERROR_MSG("[DEMULTIPLEXER_CLOSE] Failed to start parallel closes");
     return -1;
   }
-  wait_for_all_threads(threads, active_threads, nlayers, state);
-  free(threads);
+  wait_for_all_threads(&batch, active_threads, nlayers, state);
 
+  if (state->layout == DEMULTIPLEXER_LAYOUT_ERASURE) {
+    return erasure_int_result(state, results, nlayers);
+  }
   return results[0];
 }
 
@@ -305,66 +600,94 @@ int demultiplexer_close(int fd, LayerContext l) {
 int demultiplexer_ftruncate(int fd, off_t length, LayerContext l) {
   DemultiplexerState *state = (DemultiplexerState *)l.internal_state;
 
-  if (fd < 0 || fd >= MAX_FDS) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  if (!master) {
     return -1;
   }
   int nlayers = l.nlayers;
 
+  // keep the order of the queued writes
+  wait_for_replication(state, fd, nlayers);
+
   int layer_fds[nlayers];
   for (int i = 0; i < nlayers; i++) {
-    layer_fds[i] = state->layer_fds[fd][i];
+    layer_fds[i] = master->layer_fds[i];
+  }
+
+  if (state->layout != DEMULTIPLEXER_LAYOUT_REPLICATED) {
+    int res = state->layout == DEMULTIPLEXER_LAYOUT_STRIPED
+                  ? striped_ftruncate(state, layer_fds, length, l)
+                  : erasure_ftruncate(state, fd, length, l);
+    attr_cache_invalidate(state->attr_cache, master->path);
+    return res;
   }
 
   int results[nlayers];
   int active_threads = 0;
-  pthread_t *threads = execute_parallel_ftruncates(
-      l.next_layers, nlayers, layer_fds, length, results, &active_threads);
-  wait_for_all_threads(threads, active_threads, nlayers, state);
-  free(threads);
+  ParallelBatch batch;
+  if (execute_parallel_ftruncates(state->pool, &batch, l.next_layers, nlayers,
+                                  layer_fds, length, results,
+                                  &active_threads) != 0) {
+    return -1;
+  }
+  wait_for_all_threads(&batch, active_threads, nlayers, state);
+  attr_cache_invalidate(state->attr_cache, master->path);
 
   return get_enforced_layers_int_result(results, nlayers, state);
 }
 
 /**
- * @brief fstat demultiplexed across the next layers
+ * @brief Pick the result of a fstat/lstat fan-out and free its buffers
  *
- * @param fd       -> file descriptor (master FD)
- * @param stbuf    -> pointer to the stat structure
- * @param l        -> LayerContext for current layer
- * @return int     -> result from the first layer (index 0), gets copied to the
- * original buffer
+ * The metadata layer's answer is used when there is one, otherwise the first
+ * enforced layer that succeeded, with the size of the whole file in the
+ * striped and erasure layouts; with metadata checks, the enforced layers
+ * that disagree with the metadata layer on the type or size are reported.
+ * An erasure coded file only needs data_layers of the layers to succeed.
+ *
+ * @param state         -> demultiplexer state
+ * @param path          -> path of the file, NULL if unknown
+ * @param nlayers       -> number of next layers
+ * @param results       -> result of each layer
+ * @param thread_errnos -> errno of each layer
+ * @param thread_stbufs -> stat buffer of each layer, freed here
+ * @param stbuf         -> filled with the attributes of the chosen layer
+ * @return int          -> 0 on success, -1 with errno set on failure
  */
-int demultiplexer_fstat(int fd, struct stat *stbuf, LayerContext l) {
-  DemultiplexerState *state = (DemultiplexerState *)l.internal_state;
-
-  if (fd < 0 || fd >= MAX_FDS) {
-    return -1;
-  }
-
-  int nlayers = l.nlayers;
-  int layer_fds[nlayers];
-  for (int i = 0; i < nlayers; i++) {
-    layer_fds[i] = state->layer_fds[fd][i];
-  }
-
-  int results[nlayers];
-  int thread_errnos[nlayers];
-  int active_threads = 0;
-  struct stat **thread_stbufs = NULL;
-  pthread_t *threads =
-      execute_parallel_fstats(l.next_layers, nlayers, layer_fds, stbuf, results,
-                              &active_threads, thread_errnos, &thread_stbufs);
-  wait_for_all_threads(threads, active_threads, nlayers, state);
-
-  int final_result = get_enforced_layers_int_result(results, nlayers, state);
-
-  // Find the first enforced layer that succeeded and copy its stat data
+static int pick_stat_result(DemultiplexerState *state, const char *path,
+                            int nlayers, int *results, int *thread_errnos,
+                            struct stat **thread_stbufs, struct stat *stbuf) {
+  int final_result;
   int chosen_layer = -1;
-  if (final_result == 0) {
-    for (int i = 0; i < nlayers; i++) {
-      if (state->options[i].enforced && results[i] == 0) {
-        chosen_layer = i;
-        break;
+  int metadata_layer = state->metadata_layer;
+
+  if (metadata_layer >= 0) {
+    final_result = results[metadata_layer];
+    if (final_result == 0) {
+      chosen_layer = metadata_layer;
+    } else {
+      errno = thread_errnos[metadata_layer];
+    }
+  } else {
+    final_result =
+        state->layout == DEMULTIPLEXER_LAYOUT_ERASURE
+            ? erasure_int_result(state, results, nlayers)
+            : get_enforced_layers_int_result(results, nlayers, state);
+
+    // Find the first enforced layer that succeeded
+    if (final_result == 0) {
+      for (int i = 0; i < nlayers; i++) {
+        if (state->options[i].enforced && results[i] == 0) {
+          chosen_layer = i;
+          break;
+        }
+      }
+    } else {
+      for (int i = 0; i < nlayers; i++) {
+        if (state->options[i].enforced && results[i] < 0) {
+          errno = thread_errnos[i];
+          break;
+        }
       }
     }
   }
@@ -372,6 +695,28 @@ int demultiplexer_fstat(int fd, struct stat *stbuf, LayerContext l) {
   // Copy stat data from the chosen layer to the original buffer
   if (chosen_layer >= 0 && thread_stbufs && thread_stbufs[chosen_layer]) {
     memcpy(stbuf, thread_stbufs[chosen_layer], sizeof(struct stat));
+    if (state->layout == DEMULTIPLEXER_LAYOUT_STRIPED) {
+      striped_stat(state, nlayers, thread_stbufs, stbuf);
+    } else if (state->layout == DEMULTIPLEXER_LAYOUT_ERASURE) {
+      erasure_stat(state, path, nlayers, results, thread_stbufs, stbuf);
+    }
+
+    for (int i = 0; metadata_layer >= 0 && i < nlayers; i++) {
+      if (i == chosen_layer || !state->options[i].enforced ||
+          results[i] != 0 || !thread_stbufs[i]) {
+        continue;
+      }
+      if ((thread_stbufs[i]->st_mode & S_IFMT) != (stbuf->st_mode & S_IFMT) ||
+          thread_stbufs[i]->st_size != stbuf->st_size) {
+        WARN_MSG("[DEMULTIPLEXER_STAT] Layer %d disagrees with metadata "
+                 "layer %d (size %ld, expected %ld)",
+                 i, chosen_layer, (long)thread_stbufs[i]->st_size,
+                 (long)stbuf->st_size);
+        pthread_mutex_lock(&state->read_mutex);
+        state->metadata_mismatches++;
+        pthread_mutex_unlock(&state->read_mutex);
+      }
+    }
   }
 
   // Clean up thread stat buffers
@@ -384,78 +729,121 @@ int demultiplexer_fstat(int fd, struct stat *stbuf, LayerContext l) {
     free((void *)thread_stbufs);
   }
 
-  if (final_result < 0) {
-    for (int i = 0; i < nlayers; i++) {
-      if (state->options[i].enforced && results[i] < 0) {
-        errno = thread_errnos[i];
-        break;
-      }
-    }
-  }
-
   return final_result;
 }
 
 /**
- * @brief lstat demultiplexed across the next layers
+ * @brief fstat demultiplexed across the next layers
  *
- * @param path     -> path of the file to stat
+ * With a metadata layer (and no metadata checks), only that layer is asked.
+ * Results are cached by path when the attribute cache is enabled.
+ *
+ * @param fd       -> file descriptor (master FD)
  * @param stbuf    -> pointer to the stat structure
  * @param l        -> LayerContext for current layer
- * @return int     -> result from the first layer (index 0), gets copied to the
- * original buffer
+ * @return int     -> result from the metadata layer, or from the first
+ * enforced layer, gets copied to the original buffer
  */
-int demultiplexer_lstat(const char *path, struct stat *stbuf, LayerContext l) {
+int demultiplexer_fstat(int fd, struct stat *stbuf, LayerContext l) {
   DemultiplexerState *state = (DemultiplexerState *)l.internal_state;
 
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  if (!master) {
+    return -1;
+  }
+
   int nlayers = l.nlayers;
 
-  int results[nlayers];
-  int thread_errnos[nlayers];
-  int active_threads = 0;
-  struct stat **thread_stbufs = NULL;
-  pthread_t *threads =
-      execute_parallel_lstats(l.next_layers, nlayers, path, stbuf, results,
-                              &active_threads, thread_errnos, &thread_stbufs);
-  wait_for_all_threads(threads, active_threads, nlayers, state);
+  // the size must include the acknowledged writes
+  wait_for_replication(state, fd, nlayers);
 
-  int final_result = get_enforced_layers_int_result(results, nlayers, state);
+  const char *path = master->path;
+  if (attr_cache_lookup(state->attr_cache, path, stbuf)) {
+    return 0;
+  }
 
-  // Find the first enforced layer that succeeded and copy its stat data
-  int chosen_layer = -1;
-  if (final_result == 0) {
+  int final_result;
+  int metadata_layer = state->metadata_layer;
+  if (metadata_layer >= 0 && !state->metadata_check) {
+    LayerContext *layer = &l.next_layers[metadata_layer];
+    final_result = layer->ops->lfstat(master->layer_fds[metadata_layer],
+                                      stbuf, *layer);
+  } else {
+    int layer_fds[nlayers];
     for (int i = 0; i < nlayers; i++) {
-      if (state->options[i].enforced && results[i] == 0) {
-        chosen_layer = i;
-        break;
-      }
+      layer_fds[i] = master->layer_fds[i];
+    }
+
+    int results[nlayers];
+    int thread_errnos[nlayers];
+    int active_threads = 0;
+    struct stat **thread_stbufs = NULL;
+    ParallelBatch batch;
+    if (execute_parallel_fstats(state->pool, &batch, l.next_layers, nlayers,
+                                layer_fds, stbuf, results, &active_threads,
+                                thread_errnos, &thread_stbufs) != 0) {
+      return -1;
     }
+    wait_for_all_threads(&batch, active_threads, nlayers, state);
+
+    final_result = pick_stat_result(state, path, nlayers, results,
+                                    thread_errnos, thread_stbufs, stbuf);
   }
 
-  // Copy stat data from the chosen layer to the original buffer
-  if (chosen_layer >= 0 && thread_stbufs && thread_stbufs[chosen_layer]) {
-    memcpy(stbuf, thread_stbufs[chosen_layer], sizeof(struct stat));
+  if (final_result == 0 && state->layout == DEMULTIPLEXER_LAYOUT_ERASURE) {
+    stbuf->st_size = erasure_file_size(state, fd);
   }
+  if (final_result == 0) {
+    attr_cache_insert(state->attr_cache, path, stbuf);
+  }
+  return final_result;
+}
 
-  // Clean up thread stat buffers
-  if (thread_stbufs) {
-    for (int i = 0; i < nlayers; i++) {
-      if (thread_stbufs[i]) {
-        free(thread_stbufs[i]);
-      }
-    }
-    free((void *)thread_stbufs);
+/**
+ * @brief lstat demultiplexed across the next layers
+ *
+ * With a metadata layer (and no metadata checks), only that layer is asked.
+ * Results are cached by path when the attribute cache is enabled.
+ *
+ * @param path     -> path of the file to stat
+ * @param stbuf    -> pointer to the stat structure
+ * @param l        -> LayerContext for current layer
+ * @return int     -> result from the metadata layer, or from the first
+ * enforced layer, gets copied to the original buffer
+ */
+int demultiplexer_lstat(const char *path, struct stat *stbuf, LayerContext l) {
+  DemultiplexerState *state = (DemultiplexerState *)l.internal_state;
+
+  if (attr_cache_lookup(state->attr_cache, path, stbuf)) {
+    return 0;
   }
 
-  if (final_result < 0) {
-    for (int i = 0; i < nlayers; i++) {
-      if (state->options[i].enforced && results[i] < 0) {
-        errno = thread_errnos[i];
-        break;
-      }
+  int nlayers = l.nlayers;
+  int final_result;
+  int metadata_layer = state->metadata_layer;
+  if (metadata_layer >= 0 && !state->metadata_check) {
+    LayerContext *layer = &l.next_layers[metadata_layer];
+    final_result = layer->ops->llstat(path, stbuf, *layer);
+  } else {
+    int results[nlayers];
+    int thread_errnos[nlayers];
+    int active_threads = 0;
+    struct stat **thread_stbufs = NULL;
+    ParallelBatch batch;
+    if (execute_parallel_lstats(state->pool, &batch, l.next_layers, nlayers,
+                                path, stbuf, results, &active_threads,
+                                thread_errnos, &thread_stbufs) != 0) {
+      return -1;
     }
+    wait_for_all_threads(&batch, active_threads, nlayers, state);
+
+    final_result = pick_stat_result(state, path, nlayers, results,
+                                    thread_errnos, thread_stbufs, stbuf);
   }
 
+  if (final_result == 0) {
+    attr_cache_insert(state->attr_cache, path, stbuf);
+  }
   return final_result;
 }
 
@@ -472,14 +860,56 @@ int demultiplexer_unlink(const char *pathname, LayerContext l) {
 
   int results[nlayers];
   int active_threads = 0;
-  pthread_t *threads = execute_parallel_unlinks(
-      l.next_layers, nlayers, pathname, results, &active_threads);
-  wait_for_all_threads(threads, active_threads, nlayers, state);
-  free(threads);
+  ParallelBatch batch;
+  if (execute_parallel_unlinks(state->pool, &batch, l.next_layers, nlayers,
+                               pathname, results, &active_threads) != 0) {
+    return -1;
+  }
+  wait_for_all_threads(&batch, active_threads, nlayers, state);
+  attr_cache_invalidate(state->attr_cache, pathname);
 
+  if (state->layout == DEMULTIPLEXER_LAYOUT_ERASURE) {
+    return erasure_int_result(state, results, nlayers);
+  }
   return get_enforced_layers_int_result(results, nlayers, state);
 }
 
+/**
+ * @brief Take the read policy and verify_replicas of a reloaded configuration
+ *
+ * The reads in flight finish with the policy they started with.
+ *
+ * @param params -> reloaded DemultiplexerConfig of the layer
+ * @param apply  -> 0 to only check them
+ * @param error  -> why they cannot be taken
+ * @param l      -> LayerContext for current layer
+ * @return int   -> 0, or -1 if init would reject them too
+ */
+int demultiplexer_reconfigure(const void *params, int apply,
+                              const char **error, LayerContext l) {
+  const DemultiplexerConfig *config = (const DemultiplexerConfig *)params;
+  DemultiplexerState *state = (DemultiplexerState *)l.internal_state;
+  if (state->layout != DEMULTIPLEXER_LAYOUT_REPLICATED &&
+      config->read_policy != DEMULTIPLEXER_READ_ALL) {
+    *error = "the striped and erasure layouts take no read_policy";
+    return -1;
+  }
+  if (config->verify_replicas &&
+      (config->read_policy != DEMULTIPLEXER_READ_ALL ||
+       state->layout != DEMULTIPLEXER_LAYOUT_REPLICATED)) {
+    *error = "verify_replicas needs read_policy = \"all\" and the "
+             "replicated layout";
+    return -1;
+  }
+  if (apply) {
+    __atomic_store_n(&state->verify_replicas, config->verify_replicas,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&state->read_policy, config->read_policy,
+                     __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
 /**
  * @brief function to destroy the layer
  *
@@ -488,6 +918,19 @@ int demultiplexer_unlink(const char *pathname, LayerContext l) {
 void demultiplexer_destroy(LayerContext l) {
   DemultiplexerState *state = (DemultiplexerState *)l.internal_state;
   if (state) {
+    thread_pool_destroy(state->pool); // runs the reads still in flight
+    buffer_pool_destroy(state->scratch);
+    replication_destroy(state, l.nlayers);
+    fd_table_destroy(&state->fds);
+    attr_cache_destroy(state->attr_cache);
+    pthread_cond_destroy(&state->reads_done);
+    pthread_mutex_destroy(&state->read_mutex);
+    for (int i = 0; state->layout == DEMULTIPLEXER_LAYOUT_ERASURE &&
+                    i < DEMULTIPLEXER_ERASURE_LOCKS;
+         i++) {
+      pthread_rwlock_destroy(&state->erasure_locks[i]);
+    }
+    free(state->options);
     free(state);
   }
 
@@ -3,32 +3,147 @@
 
 #include "../../config/utils.h"
 #include "../../shared/types/layer_context.h"
+#include "../../shared/utils/buffer_pool.h"
+#include "../../shared/utils/fd_table.h"
+#include "../../shared/utils/reed_solomon.h"
+#include "../../shared/utils/thread_pool.h"
+#include "attr_cache.h"
+#include "config.h"
+#include <pthread.h>
 #include <stdlib.h>
 #include <unistd.h>
 
-#define MAX_FDS 10000 // TODO: This number should be dynamic and configurable
 #define MAX_LAYERS 10 // Maximum number of layers supported
 #define INVALID_FD -1 // Value to indicate an invalid fd
+#define DEMULTIPLEXER_WORKERS_PER_LAYER 2 // Pool workers homed on each layer
+#define DEMULTIPLEXER_SCRATCH_BUFFERS 32  // Read scratch buffers kept for reuse
+#define DEMULTIPLEXER_SCRATCH_MAX_SIZE                                         \
+  ((size_t)4 * 1024 * 1024) // Larger read scratch buffers are not kept
+#define DEMULTIPLEXER_LATENCY_SAMPLES 64 // Recent reads kept per layer for p95
+#define DEMULTIPLEXER_HEDGE_MIN_SAMPLES 16 // Samples needed to trust the p95
+#define DEMULTIPLEXER_HEDGE_DEFAULT_DELAY_NS                                   \
+  (10L * 1000 * 1000) // Hedge delay of a layer without enough samples
+#define DEMULTIPLEXER_HEDGE_MIN_DELAY_NS                                       \
+  (100L * 1000) // Hedge delay floor, keeps fast layers from always hedging
+#define DEMULTIPLEXER_REPLAY_MAX_ENTRIES 1024 // Writes queued per layer
+#define DEMULTIPLEXER_REPLAY_MAX_BYTES                                         \
+  ((size_t)64 * 1024 * 1024) // Bytes queued per layer
+#define DEMULTIPLEXER_REPAIR_CHUNK_SIZE                                        \
+  ((size_t)1024 * 1024) // Copy size when repairing a lagging layer
+#define DEMULTIPLEXER_ERASURE_LOCKS 16 // Locks the erasure layout's fds share
+#define DEMULTIPLEXER_ERASURE_PASS_SIZE                                        \
+  ((size_t)4 * 1024 * 1024) // Data of the stripe rows coded at once
 
 typedef struct {
   bool enforced;
+  bool passthrough_read;  // Layer does not serve reads
+  bool passthrough_write; // Layer does not store writes
 } DemultiplexerOptions;
 
-// Structure to store FD mappings - master fd to layer fds
+// Read latency of one next layer
+typedef struct {
+  long ewma_ns;                                // 0 until the first read
+  long samples[DEMULTIPLEXER_LATENCY_SAMPLES]; // Ring of recent latencies
+  size_t n_samples;                            // Reads recorded so far
+} DemultiplexerLatency;
+
+struct DemultiplexerState;
+struct ReplayEntry;
+
+// Files that missed writes on a layer, repaired when next opened
+typedef struct DemultiplexerStalePath {
+  char *path;
+  struct DemultiplexerStalePath *next;
+} DemultiplexerStalePath;
+
+// Replay log of one next layer in write quorum mode
+typedef struct {
+  struct DemultiplexerState *state; // State the log belongs to
+  int layer;                        // Next layer the log feeds
+  struct ReplayEntry *head;         // Oldest queued write
+  struct ReplayEntry *tail;         // Newest queued write
+  size_t entries;                   // Queued writes, counting the one applied
+  size_t bytes;                     // Bytes of the queued writes
+  int draining;                     // A drain task is queued or running
+  ThreadPoolTask drain;             // Task applying the log
+  size_t applied;                   // Writes applied
+  size_t failed;                    // Writes the layer failed
+  size_t dropped;                   // Writes not queued, the log being full
+  DemultiplexerStalePath *stale;    // Files to repair on this layer
+  size_t n_stale;                   // Entries of stale
+} DemultiplexerReplica;
+
+// Replication lag of one next layer, see demultiplexer_replica_lag
+typedef struct {
+  size_t entries; // Writes queued and not applied yet
+  size_t bytes;   // Bytes of those writes
+  size_t applied; // Writes applied
+  size_t failed;  // Writes the layer failed
+  size_t dropped; // Writes not queued, the log being full
+  size_t stale;   // Files waiting for a repair on reopen
+} DemultiplexerReplicaLag;
+
+// State of a master fd, see DemultiplexerState.fds
 typedef struct {
-  int layer_fds[MAX_FDS][MAX_LAYERS]; // Maps master fd -> array of layer fds
+  int layer_fds[MAX_LAYERS];     // Fd of each layer, INVALID_FD when closed
+  int inflight_reads;            // Reads still running after their pread
+                                 // returned (hedged, first_success)
+  int replay_behind[MAX_LAYERS]; // Queued writes per layer
+  bool replay_stale[MAX_LAYERS]; // Layer missed writes of the fd
+  char *path;                    // Path of the open fd
+  bool shard_lost[MAX_LAYERS];   // Layer failed for the fd, erasure layout
+  off_t erasure_size;            // Logical size, erasure layout
+} DemultiplexerFd;
+
+// Structure to store FD mappings - master fd to layer fds
+typedef struct DemultiplexerState {
+  FdTable fds; // DemultiplexerFd of each master fd
   DemultiplexerOptions *options;
+  ThreadPool *pool; // Runs the per-layer tasks, one queue per next layer
+  DemultiplexerReadPolicy read_policy;
+  bool verify_replicas;       // Compare the layers of read_policy = all
+  int read_order[MAX_LAYERS]; // Layers serving reads, enforced ones first
+  int n_read_layers;          // Number of entries in read_order
+  BufferPool *scratch; // Scratch buffers of reads not done in place
+  DemultiplexerLatency latency[MAX_LAYERS]; // Per-layer read latency
+  size_t hedged_reads;         // Hedged reads that issued a second layer
+  size_t metadata_mismatches;  // Checked fstat/lstat the layers disagreed on
+  size_t replica_mismatches;   // Verified reads a layer disagreed on
+  pthread_mutex_t read_mutex;  // Protects latency, the fds' inflight_reads
+                               // and the counters above
+  pthread_cond_t reads_done;   // Broadcast when an inflight read finishes
+  int write_quorum; // Acknowledgements a write waits for, 0 for every
+                    // enforced layer (no replay logs)
+  DemultiplexerReplica replicas[MAX_LAYERS]; // Replay log of each layer
+  pthread_mutex_t replica_mutex;   // Protects the replication fields, and
+                                   // the fds' replay_behind and replay_stale
+  pthread_cond_t replica_progress; // Broadcast when a layer applies a write
+  int metadata_layer;    // Layer serving fstat/lstat, -1 to fan them out
+  bool metadata_check;   // Fan out to compare with the metadata layer
+  AttrCache *attr_cache; // fstat/lstat results by path, or NULL
+  DemultiplexerLayout layout;
+  size_t stripe_size;       // Stripe unit of the striped and erasure layouts
+  int data_layers;          // Layers holding data in the erasure layout
+  ReedSolomon erasure_code; // Parity of the erasure layout
+  pthread_rwlock_t erasure_locks[DEMULTIPLEXER_ERASURE_LOCKS]; // Serialize
+                            // writes of an fd with its I/O, by fd
 } DemultiplexerState;
 
 LayerContext demultiplexer_init(LayerContext *l, int nlayers,
                                 int *passthrough_reads, int *passthrough_writes,
-                                int *enforced_layers);
+                                int *enforced_layers,
+                                const DemultiplexerConfig *config);
+DemultiplexerFd *demultiplexer_fd(DemultiplexerState *state, int fd);
 void validate_passthrough_ops(int *passthrough_reads, int *passthrough_writes,
                               int n_layers);
 ssize_t demultiplexer_pread(int fd, void *buff, size_t nbyte, off_t offset,
                             LayerContext l);
 ssize_t demultiplexer_pwrite(int fd, const void *buff, size_t nbyte,
                              off_t offset, LayerContext l);
+ssize_t demultiplexer_preadv(int fd, const struct iovec *iov, int iovcnt,
+                             off_t offset, LayerContext l);
+ssize_t demultiplexer_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                              off_t offset, LayerContext l);
 int demultiplexer_open(const char *pathname, int flags, mode_t mode,
                        LayerContext l);
 int demultiplexer_close(int fd, LayerContext l);
@@ -37,5 +152,9 @@ int demultiplexer_ftruncate(int fd, off_t length, LayerContext l);
 int demultiplexer_fstat(int fd, struct stat *stbuf, LayerContext l);
 int demultiplexer_lstat(const char *path, struct stat *stbuf, LayerContext l);
 int demultiplexer_unlink(const char *pathname, LayerContext l);
+int demultiplexer_reconfigure(const void *params, int apply,
+                              const char **error, LayerContext l);
+int demultiplexer_replica_lag(LayerContext l, int layer,
+                              DemultiplexerReplicaLag *lag);
 
 #endif
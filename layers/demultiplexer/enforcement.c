@@ -3,18 +3,16 @@
 #include <pthread.h>
 
 /**
- * @brief Wait for all threads to complete before any cleanup
+ * @brief Wait for all layer tasks to complete before any cleanup
  *
- * @param threads       -> array of threads
- * @param active_threads -> number of active threads
+ * @param batch         -> batch of the fan-out
+ * @param active_threads -> number of queued tasks
  * @param nlayers       -> number of layers
  * @param state         -> demultiplexer state containing options
  */
-void wait_for_all_threads(pthread_t *threads, int active_threads, int nlayers,
+void wait_for_all_threads(ParallelBatch *batch, int active_threads, int nlayers,
                           DemultiplexerState *state) {
-  for (int i = 0; i < active_threads && i < nlayers; i++) {
-    pthread_join(threads[i], NULL);
-  }
+  parallel_batch_wait(batch);
 }
 
 /**
@@ -2,18 +2,19 @@
 #define __enforcement_H__
 
 #include "../../shared/types/layer_context.h"
+#include "../../shared/utils/parallel.h"
 #include "demultiplexer.h"
 #include <pthread.h>
 
 /**
- * @brief Wait for all threads to complete before any cleanup
+ * @brief Wait for all layer tasks to complete before any cleanup
  *
- * @param threads       -> array of threads
- * @param active_threads -> number of active threads
+ * @param batch         -> batch of the fan-out
+ * @param active_threads -> number of queued tasks
  * @param nlayers       -> number of layers
  * @param state         -> demultiplexer state containing options
  */
-void wait_for_all_threads(pthread_t *threads, int active_threads, int nlayers,
+void wait_for_all_threads(ParallelBatch *batch, int active_threads, int nlayers,
                           DemultiplexerState *state);
 
 /**
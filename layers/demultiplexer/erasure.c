@@ -0,0 +1,813 @@
+#include "erasure.h"
+#include "../../logdef.h"
+#include "../../shared/utils/layer_iov.h"
+#include "replication.h"
+#include "striping.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * ============================================================================
+ * DEMULTIPLEXER ERASURE CODED LAYOUT
+ * ============================================================================
+ *
+ * With layout = "erasure", the first k = data_layers layers hold the file
+ * striped as in the striped layout, and the m other layers hold parity. A
+ * row is the k stripe units of the same offset r * stripe_size of the data
+ * layers; parity layer p holds, at that offset, unit p of the Reed-Solomon
+ * parity of the row. Any k layers give the file back: a read that finds a
+ * data layer failed rebuilds the rows it touches from the others.
+ *
+ * Writes rewrite the parity of the rows they touch, reading the rest of the
+ * first and last rows when only part of them is written. A parity layer's
+ * file is kept as long as the logical file: a parity byte past it only codes
+ * bytes past the end, which are zero.
+ *
+ * A layer that fails is left out of the I/O of the fd until the file is
+ * reopened; if it missed a write, the file is recorded stale on it as in
+ * write quorum mode, and the next writable open rebuilds its shard. Writes
+ * of an fd and its other I/O are serialized by one of the erasure locks.
+ * ============================================================================
+ */
+
+static pthread_rwlock_t *erasure_lock(DemultiplexerState *state, int fd) {
+  return &state->erasure_locks[fd % DEMULTIPLEXER_ERASURE_LOCKS];
+}
+
+// Whether a layer serves the I/O of fd
+static bool shard_usable(DemultiplexerFd *master, int layer) {
+  return master->layer_fds[layer] != INVALID_FD &&
+         !__atomic_load_n(&master->shard_lost[layer], __ATOMIC_RELAXED);
+}
+
+static int usable_shards(DemultiplexerFd *master, int nlayers) {
+  int usable = 0;
+  for (int i = 0; i < nlayers; i++) {
+    usable += shard_usable(master, i);
+  }
+  return usable;
+}
+
+/**
+ * @brief Leave a layer out of the I/O of fd until the file is reopened
+ *
+ * @param missed_writes -> the layer missed a write: the file is stale on it,
+ * assumes the erasure lock of fd is held for writing
+ */
+static void lose_shard(DemultiplexerState *state, DemultiplexerFd *master,
+                       int fd, int layer, bool missed_writes) {
+  if (!__atomic_exchange_n(&master->shard_lost[layer], true,
+                           __ATOMIC_RELAXED)) {
+    WARN_MSG("[DEMULTIPLEXER_ERASURE] Layer %d failed for %s, its shard is "
+             "rebuilt from the other layers",
+             layer, master->path ? master->path : "an open file");
+  }
+  if (missed_writes && !master->replay_stale[layer]) {
+    set_layer_stale(state, fd, layer, true);
+  }
+}
+
+// Rows coded at once, bounded by the pass size and the slices of a job
+static size_t rows_per_pass(DemultiplexerState *state) {
+  size_t row = (size_t)state->data_layers * state->stripe_size;
+  size_t rows = DEMULTIPLEXER_ERASURE_PASS_SIZE / row;
+  if (rows < 1) {
+    rows = 1;
+  }
+  if (rows > LAYER_IOV_MAX) {
+    rows = LAYER_IOV_MAX;
+  }
+  return rows;
+}
+
+/**
+ * @brief Compute the parity of rows
+ *
+ * @param data   -> nrows rows, in logical order
+ * @param parity -> parity units, those of parity layer p from p * nrows
+ * units on
+ */
+static void encode_rows(DemultiplexerState *state, const uint8_t *data,
+                        uint8_t *parity, size_t nrows) {
+  int k = state->data_layers;
+  int m = state->erasure_code.parity_shards;
+  size_t unit = state->stripe_size;
+  const uint8_t *data_units[MAX_LAYERS];
+  uint8_t *parity_units[MAX_LAYERS];
+  for (size_t r = 0; r < nrows; r++) {
+    for (int i = 0; i < k; i++) {
+      data_units[i] = data + (r * k + i) * unit;
+    }
+    for (int p = 0; p < m; p++) {
+      parity_units[p] = parity + (p * nrows + r) * unit;
+    }
+    reed_solomon_encode(&state->erasure_code, data_units, parity_units, unit);
+  }
+}
+
+/**
+ * @brief Read rows of fd from data_layers of the usable layers, rebuilding
+ * the units of the data layers left out
+ *
+ * @param first  -> first row
+ * @param nrows  -> number of rows
+ * @param data   -> filled with the rows, in logical order
+ * @param parity -> scratch for the parity units, as in encode_rows
+ * @return int   -> 0 on success, -1 if fewer than data_layers layers can
+ * serve the rows
+ */
+static int read_rows(DemultiplexerState *state, DemultiplexerFd *master,
+                     int fd, off_t first, size_t nrows, uint8_t *data,
+                     uint8_t *parity, LayerContext l) {
+  int n = l.nlayers;
+  int k = state->data_layers;
+  size_t unit = state->stripe_size;
+  struct iovec *iov = malloc(sizeof(struct iovec) * (k * nrows + (n - k)));
+  if (!iov) {
+    ERROR_MSG("[DEMULTIPLEXER_ERASURE] Failed to allocate the row buffers");
+    errno = ENOMEM;
+    return -1;
+  }
+
+  // a layer failing is left out and the rows read again from the others
+  bool chosen[MAX_LAYERS];
+  for (;;) {
+    int n_chosen = 0;
+    for (int i = 0; i < n; i++) {
+      chosen[i] = n_chosen < k && shard_usable(master, i);
+      n_chosen += chosen[i];
+    }
+    if (n_chosen < k) {
+      free(iov);
+      errno = EIO;
+      return -1;
+    }
+
+    StripeJob jobs[n];
+    struct iovec *next = iov;
+    for (int i = 0; i < n; i++) {
+      memset(&jobs[i], 0, sizeof(StripeJob));
+      if (!chosen[i]) {
+        continue;
+      }
+      jobs[i].op = STRIPE_READ;
+      jobs[i].layer = &l.next_layers[i];
+      jobs[i].layer_fd = master->layer_fds[i];
+      jobs[i].offset = first * (off_t)unit;
+      jobs[i].iov = next;
+      if (i < k) {
+        for (size_t r = 0; r < nrows; r++) {
+          next[r].iov_base = data + (r * k + i) * unit;
+          next[r].iov_len = unit;
+        }
+        jobs[i].iovcnt = (int)nrows;
+      } else {
+        next[0].iov_base = parity + (i - k) * nrows * unit;
+        next[0].iov_len = nrows * unit;
+        jobs[i].iovcnt = 1;
+      }
+      jobs[i].nbyte = nrows * unit;
+      next += jobs[i].iovcnt;
+    }
+    stripe_run_jobs(state, jobs, chosen, n);
+
+    bool failed = false;
+    for (int i = 0; i < n; i++) {
+      if (!chosen[i]) {
+        continue;
+      }
+      if (jobs[i].result < 0) {
+        lose_shard(state, master, fd, i, false);
+        failed = true;
+      } else if ((size_t)jobs[i].result < jobs[i].nbyte) {
+        stripe_zero_unread(&jobs[i]); // past the end of the shard
+      }
+    }
+    if (!failed) {
+      break;
+    }
+  }
+
+  uint8_t *shards[MAX_LAYERS];
+  for (size_t r = 0; r < nrows; r++) {
+    for (int i = 0; i < n; i++) {
+      shards[i] = i < k ? data + (r * k + i) * unit
+                        : parity + ((i - k) * nrows + r) * unit;
+    }
+    reed_solomon_reconstruct(&state->erasure_code, shards, chosen, unit);
+  }
+  free(iov);
+  return 0;
+}
+
+// Copy len bytes between buf and the buffers, skip bytes into them
+static void iov_copy(const struct iovec *iov, int iovcnt, size_t skip,
+                     uint8_t *buf, size_t len, bool into_iov) {
+  for (int i = 0; i < iovcnt && len > 0; i++) {
+    if (skip >= iov[i].iov_len) {
+      skip -= iov[i].iov_len;
+      continue;
+    }
+    size_t n = iov[i].iov_len - skip;
+    if (n > len) {
+      n = len;
+    }
+    char *base = (char *)iov[i].iov_base + skip;
+    if (into_iov) {
+      memcpy(base, buf, n);
+    } else {
+      memcpy(buf, base, n);
+    }
+    buf += n;
+    len -= n;
+    skip = 0;
+  }
+}
+
+/**
+ * @brief Run update jobs on the usable layers that have one
+ *
+ * A layer that cannot take its job, or fails it, missed the update.
+ *
+ * @param jobs   -> one job per layer, but for their layer_fd
+ * @param wanted -> whether each layer has a job
+ */
+static void run_updates(DemultiplexerState *state, DemultiplexerFd *master,
+                        int fd, StripeJob *jobs, const bool *wanted,
+                        int nlayers) {
+  bool active[nlayers];
+  for (int i = 0; i < nlayers; i++) {
+    active[i] = wanted[i] && shard_usable(master, i);
+    if (wanted[i] && !active[i]) {
+      lose_shard(state, master, fd, i, true);
+    }
+    jobs[i].layer_fd = master->layer_fds[i];
+  }
+  stripe_run_jobs(state, jobs, active, nlayers);
+
+  for (int i = 0; i < nlayers; i++) {
+    if (active[i] && (jobs[i].result < 0 || (jobs[i].op == STRIPE_WRITE &&
+                                             (size_t)jobs[i].result <
+                                                 jobs[i].nbyte))) {
+      lose_shard(state, master, fd, i, true);
+    }
+  }
+}
+
+// Truncate job of every parity layer
+static void parity_truncates(DemultiplexerState *state, StripeJob *jobs,
+                             bool *wanted, off_t length, LayerContext l) {
+  for (int i = 0; i < l.nlayers; i++) {
+    memset(&jobs[i], 0, sizeof(StripeJob));
+    jobs[i].op = STRIPE_TRUNCATE;
+    jobs[i].layer = &l.next_layers[i];
+    jobs[i].offset = length;
+    wanted[i] = i >= state->data_layers;
+  }
+}
+
+/**
+ * @brief Rebuild the shard of fd on a layer from the usable layers
+ *
+ * @param target -> stale layer, left out of the I/O of fd
+ * @return int   -> 0 on success, -1 on error
+ */
+static int repair_shard(DemultiplexerState *state, DemultiplexerFd *master,
+                        int fd, int target, LayerContext l) {
+  int k = state->data_layers;
+  int m = l.nlayers - k;
+  size_t unit = state->stripe_size;
+  size_t row_size = (size_t)k * unit;
+  off_t size = master->erasure_size;
+  off_t share = target < k ? stripe_layer_length(unit, k, target, size) : size;
+  LayerContext *layer = &l.next_layers[target];
+  int target_fd = master->layer_fds[target];
+  if (layer->ops->lftruncate(target_fd, 0, *layer) != 0) {
+    return -1;
+  }
+
+  size_t rows = rows_per_pass(state);
+  uint8_t *data = malloc(rows * row_size);
+  uint8_t *parity = malloc(rows * m * unit);
+  struct iovec *iov = malloc(sizeof(struct iovec) * rows);
+  int res = data && parity && iov ? 0 : -1;
+
+  off_t total = (size + (off_t)row_size - 1) / (off_t)row_size;
+  for (off_t row = 0; res == 0 && row < total; row += (off_t)rows) {
+    size_t nrows = (size_t)(total - row) < rows ? (size_t)(total - row) : rows;
+    if (read_rows(state, master, fd, row, nrows, data, parity, l) != 0) {
+      res = -1;
+      break;
+    }
+
+    StripeJob job;
+    memset(&job, 0, sizeof(StripeJob));
+    job.op = STRIPE_WRITE;
+    job.layer = layer;
+    job.layer_fd = target_fd;
+    job.offset = row * (off_t)unit;
+    job.iov = iov;
+    if (target < k) {
+      for (size_t r = 0; r < nrows; r++) {
+        off_t local = (row + (off_t)r) * (off_t)unit;
+        if (local >= share) {
+          break;
+        }
+        size_t len = share - local < (off_t)unit ? (size_t)(share - local)
+                                                 : unit;
+        iov[job.iovcnt].iov_base = data + (r * k + target) * unit;
+        iov[job.iovcnt].iov_len = len;
+        job.iovcnt++;
+        job.nbyte += len;
+      }
+    } else {
+      encode_rows(state, data, parity, nrows);
+      off_t left = share - job.offset;
+      iov[0].iov_base = parity + (target - k) * nrows * unit;
+      iov[0].iov_len = left < (off_t)(nrows * unit) ? (size_t)left
+                                                    : nrows * unit;
+      job.iovcnt = 1;
+      job.nbyte = iov[0].iov_len;
+    }
+    stripe_run_job(&job);
+    if (job.result < 0 || (size_t)job.result < job.nbyte) {
+      res = -1;
+    }
+  }
+  if (res == 0) {
+    res = layer->ops->lftruncate(target_fd, share, *layer);
+  }
+
+  free(data);
+  free(parity);
+  free(iov);
+  return res;
+}
+
+int erasure_open_result(DemultiplexerState *state, const int *results,
+                        int nlayers) {
+  int opened = 0;
+  int first = -1;
+  for (int i = 0; i < nlayers; i++) {
+    if (results[i] >= 0) {
+      opened++;
+      if (first < 0) {
+        first = results[i];
+      }
+    }
+  }
+  if (opened < state->data_layers) {
+    if (opened > 0) {
+      errno = EIO;
+    }
+    return -1;
+  }
+  return first;
+}
+
+int erasure_open_file(DemultiplexerState *state, int fd, int flags,
+                      LayerContext l) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  int n = l.nlayers;
+  int k = state->data_layers;
+  bool writable = (flags & O_ACCMODE) != O_RDONLY;
+  bool stale[MAX_LAYERS];
+  stale_layers(state, master->path, n, stale);
+
+  pthread_rwlock_t *lock = erasure_lock(state, fd);
+  pthread_rwlock_wrlock(lock);
+  for (int i = 0; i < n; i++) {
+    master->shard_lost[i] = false;
+    if (master->layer_fds[i] == INVALID_FD) {
+      master->shard_lost[i] = true;
+      if (writable) {
+        set_layer_stale(state, fd, i, true);
+      }
+    } else if (stale[i] && (flags & O_TRUNC)) {
+      // truncated on every layer, nothing left to rebuild
+      set_layer_stale(state, fd, i, false);
+      stale[i] = false;
+    } else if (stale[i]) {
+      master->shard_lost[i] = true;
+    }
+  }
+
+  // the file ends at the furthest byte an up to date layer holds
+  off_t size = 0;
+  for (int i = 0; i < n; i++) {
+    if (!shard_usable(master, i)) {
+      continue;
+    }
+    struct stat st;
+    LayerContext *layer = &l.next_layers[i];
+    if (layer->ops->lfstat(master->layer_fds[i], &st, *layer) != 0) {
+      lose_shard(state, master, fd, i, false);
+      continue;
+    }
+    off_t end = i < k ? stripe_logical_size(state->stripe_size, k, i,
+                                            st.st_size)
+                      : st.st_size;
+    if (end > size) {
+      size = end;
+    }
+  }
+  if (usable_shards(master, n) < k) {
+    pthread_rwlock_unlock(lock);
+    ERROR_MSG("[DEMULTIPLEXER_OPEN] Fewer than %d layers hold %s", k,
+              master->path ? master->path : "the file");
+    errno = EIO;
+    return -1;
+  }
+  master->erasure_size = size;
+
+  for (int i = 0; writable && i < n; i++) {
+    if (!stale[i] || master->layer_fds[i] == INVALID_FD) {
+      continue;
+    }
+    if (repair_shard(state, master, fd, i, l) == 0) {
+      master->shard_lost[i] = false;
+      set_layer_stale(state, fd, i, false);
+      INFO_MSG("[DEMULTIPLEXER_OPEN] Rebuilt the shard of %s on layer %d",
+               master->path, i);
+    } else {
+      WARN_MSG("[DEMULTIPLEXER_OPEN] Failed to rebuild the shard of %s on "
+               "layer %d",
+               master->path, i);
+    }
+  }
+  pthread_rwlock_unlock(lock);
+  return 0;
+}
+
+/**
+ * @brief Read the bytes of rows a data layer left out, from the parity
+ *
+ * @return int -> 0 on success, -1 on error
+ */
+static int read_degraded(DemultiplexerState *state, DemultiplexerFd *master,
+                         int fd, const struct iovec *iov, int iovcnt,
+                         off_t offset, size_t nbyte, LayerContext l) {
+  int k = state->data_layers;
+  int m = l.nlayers - k;
+  size_t row_size = (size_t)k * state->stripe_size;
+  size_t rows = rows_per_pass(state);
+  uint8_t *data = malloc(rows * row_size);
+  uint8_t *parity = malloc(rows * m * state->stripe_size);
+  if (!data || !parity) {
+    free(data);
+    free(parity);
+    ERROR_MSG("[DEMULTIPLEXER_ERASURE] Failed to allocate the row buffers");
+    errno = ENOMEM;
+    return -1;
+  }
+
+  off_t pos = offset;
+  off_t end = offset + (off_t)nbyte;
+  while (pos < end) {
+    off_t first = pos / (off_t)row_size;
+    off_t last = (end - 1) / (off_t)row_size;
+    if (last - first >= (off_t)rows) {
+      last = first + (off_t)rows - 1;
+    }
+    if (read_rows(state, master, fd, first, (size_t)(last - first + 1), data,
+                  parity, l) != 0) {
+      free(data);
+      free(parity);
+      return -1;
+    }
+    off_t pass_end = (last + 1) * (off_t)row_size;
+    if (pass_end > end) {
+      pass_end = end;
+    }
+    iov_copy(iov, iovcnt, (size_t)(pos - offset),
+             data + (pos - first * (off_t)row_size), (size_t)(pass_end - pos),
+             true);
+    pos = pass_end;
+  }
+  free(data);
+  free(parity);
+  return 0;
+}
+
+ssize_t erasure_preadv(DemultiplexerState *state, int fd,
+                       const struct iovec *iov, int iovcnt, off_t offset,
+                       LayerContext l) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  int k = state->data_layers;
+  pthread_rwlock_t *lock = erasure_lock(state, fd);
+  pthread_rwlock_rdlock(lock);
+
+  off_t size = master->erasure_size;
+  size_t nbyte = iov_length(iov, iovcnt);
+  if (offset >= size || nbyte == 0) {
+    pthread_rwlock_unlock(lock);
+    return 0;
+  }
+  if ((off_t)nbyte > size - offset) {
+    nbyte = (size_t)(size - offset);
+  }
+
+  // the buffers up to the end of the file
+  struct iovec clipped[iovcnt];
+  int n_clipped = 0;
+  for (size_t left = nbyte; left > 0; n_clipped++) {
+    clipped[n_clipped] = iov[n_clipped];
+    if (clipped[n_clipped].iov_len > left) {
+      clipped[n_clipped].iov_len = left;
+    }
+    left -= clipped[n_clipped].iov_len;
+  }
+
+  StripeJob jobs[k];
+  struct iovec *slices = stripe_split_request(state, jobs, STRIPE_READ, k,
+                                              clipped, n_clipped, offset, l);
+  if (!slices) {
+    pthread_rwlock_unlock(lock);
+    ERROR_MSG("[DEMULTIPLEXER_ERASURE] Failed to allocate the slices");
+    errno = ENOMEM;
+    return -1;
+  }
+  bool active[k];
+  bool degraded = false;
+  for (int i = 0; i < k; i++) {
+    jobs[i].layer_fd = master->layer_fds[i];
+    active[i] = jobs[i].nbyte > 0;
+    degraded |= active[i] && !shard_usable(master, i);
+  }
+  if (!degraded) {
+    stripe_run_jobs(state, jobs, active, k);
+    for (int i = 0; i < k; i++) {
+      if (active[i] && jobs[i].result < 0) {
+        lose_shard(state, master, fd, i, false);
+        degraded = true;
+      } else if (active[i] && (size_t)jobs[i].result < jobs[i].nbyte) {
+        stripe_zero_unread(&jobs[i]);
+      }
+    }
+  }
+  free(slices);
+
+  int res = 0;
+  if (degraded) {
+    res = read_degraded(state, master, fd, clipped, n_clipped, offset, nbyte,
+                        l);
+  }
+  pthread_rwlock_unlock(lock);
+  return res == 0 ? (ssize_t)nbyte : -1;
+}
+
+ssize_t erasure_pwritev(DemultiplexerState *state, int fd,
+                        const struct iovec *iov, int iovcnt, off_t offset,
+                        LayerContext l) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  int n = l.nlayers;
+  int k = state->data_layers;
+  int m = n - k;
+  size_t unit = state->stripe_size;
+  size_t row_size = (size_t)k * unit;
+  size_t nbyte = iov_length(iov, iovcnt);
+  if (nbyte == 0) {
+    return 0;
+  }
+
+  size_t rows = rows_per_pass(state);
+  uint8_t *data = malloc(rows * row_size);
+  uint8_t *parity = malloc(rows * m * unit);
+  if (!data || !parity) {
+    free(data);
+    free(parity);
+    ERROR_MSG("[DEMULTIPLEXER_ERASURE] Failed to allocate the row buffers");
+    errno = ENOMEM;
+    return -1;
+  }
+
+  pthread_rwlock_t *lock = erasure_lock(state, fd);
+  pthread_rwlock_wrlock(lock);
+  off_t size = master->erasure_size;
+  off_t end = offset + (off_t)nbyte;
+  ssize_t res = (ssize_t)nbyte;
+  StripeJob jobs[n];
+  bool wanted[n];
+  for (off_t pos = offset; pos < end;) {
+    if (usable_shards(master, n) < k) {
+      errno = EIO;
+      res = -1;
+      break;
+    }
+    off_t first = pos / (off_t)row_size;
+    off_t last = (end - 1) / (off_t)row_size;
+    if (last - first >= (off_t)rows) {
+      last = first + (off_t)rows - 1;
+    }
+    size_t nrows = (size_t)(last - first + 1);
+    off_t base = first * (off_t)row_size;
+    off_t pass_end = (last + 1) * (off_t)row_size;
+    if (pass_end > end) {
+      pass_end = end;
+    }
+
+    // the rows written in part keep the rest of their bytes
+    memset(data, 0, nrows * row_size);
+    off_t edges[2] = {first, last};
+    for (int e = 0; res >= 0 && e < (last > first ? 2 : 1); e++) {
+      off_t start = edges[e] * (off_t)row_size;
+      if (start < size && (pos > start || pass_end < start + (off_t)row_size) &&
+          read_rows(state, master, fd, edges[e], 1,
+                    data + (edges[e] - first) * row_size, parity, l) != 0) {
+        res = -1;
+      }
+    }
+    if (res < 0) {
+      break;
+    }
+    iov_copy(iov, iovcnt, (size_t)(pos - offset), data + (pos - base),
+             (size_t)(pass_end - pos), false);
+    encode_rows(state, data, parity, nrows);
+
+    // the data layers write the bytes of the request, the parity layers
+    // the parity of its rows
+    struct iovec span = {.iov_base = data + (pos - base),
+                         .iov_len = (size_t)(pass_end - pos)};
+    struct iovec *slices =
+        stripe_split_request(state, jobs, STRIPE_WRITE, k, &span, 1, pos, l);
+    if (!slices) {
+      ERROR_MSG("[DEMULTIPLEXER_ERASURE] Failed to allocate the slices");
+      errno = ENOMEM;
+      res = -1;
+      break;
+    }
+    struct iovec parity_iov[m];
+    for (int i = 0; i < n; i++) {
+      if (i < k) {
+        wanted[i] = jobs[i].nbyte > 0;
+        continue;
+      }
+      memset(&jobs[i], 0, sizeof(StripeJob));
+      parity_iov[i - k].iov_base = parity + (i - k) * nrows * unit;
+      parity_iov[i - k].iov_len = nrows * unit;
+      jobs[i].op = STRIPE_WRITE;
+      jobs[i].layer = &l.next_layers[i];
+      jobs[i].iov = &parity_iov[i - k];
+      jobs[i].iovcnt = 1;
+      jobs[i].nbyte = nrows * unit;
+      jobs[i].offset = first * (off_t)unit;
+      wanted[i] = true;
+    }
+    run_updates(state, master, fd, jobs, wanted, n);
+    free(slices);
+    pos = pass_end;
+  }
+
+  if (res >= 0) {
+    // the parity files end with the logical file
+    off_t new_size = end > size ? end : size;
+    off_t parity_end = ((end - 1) / (off_t)row_size + 1) * (off_t)unit;
+    if (parity_end < size) {
+      parity_end = size;
+    }
+    if (parity_end != new_size) {
+      parity_truncates(state, jobs, wanted, new_size, l);
+      run_updates(state, master, fd, jobs, wanted, n);
+    }
+    if (usable_shards(master, n) < k) {
+      errno = EIO;
+      res = -1;
+    } else {
+      master->erasure_size = new_size;
+    }
+  }
+  pthread_rwlock_unlock(lock);
+  free(data);
+  free(parity);
+  return res;
+}
+
+int erasure_ftruncate(DemultiplexerState *state, int fd, off_t length,
+                      LayerContext l) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  int n = l.nlayers;
+  int k = state->data_layers;
+  int m = n - k;
+  size_t unit = state->stripe_size;
+  size_t row_size = (size_t)k * unit;
+
+  pthread_rwlock_t *lock = erasure_lock(state, fd);
+  pthread_rwlock_wrlock(lock);
+  bool shrink = length < master->erasure_size;
+  off_t row = length / (off_t)row_size;
+  size_t tail = (size_t)(length % (off_t)row_size);
+
+  // the parity of the row cut in two no longer codes its removed bytes
+  uint8_t *data = NULL;
+  uint8_t *parity = NULL;
+  if (shrink && tail > 0) {
+    data = malloc(row_size);
+    parity = malloc(m * unit);
+    if (!data || !parity ||
+        read_rows(state, master, fd, row, 1, data, parity, l) != 0) {
+      if (!data || !parity) {
+        ERROR_MSG("[DEMULTIPLEXER_ERASURE] Failed to allocate the row");
+        errno = ENOMEM;
+      }
+      pthread_rwlock_unlock(lock);
+      free(data);
+      free(parity);
+      return -1;
+    }
+    memset(data + tail, 0, row_size - tail);
+    encode_rows(state, data, parity, 1);
+  }
+
+  // data layers to their share; when shrinking, parity layers to the rows
+  // kept, then the new parity of the last row and the logical length
+  StripeJob jobs[n];
+  bool wanted[n];
+  parity_truncates(state, jobs, wanted, shrink ? row * (off_t)unit : length,
+                   l);
+  for (int i = 0; i < k; i++) {
+    jobs[i].offset = stripe_layer_length(unit, k, i, length);
+    wanted[i] = true;
+  }
+  run_updates(state, master, fd, jobs, wanted, n);
+  if (shrink) {
+    if (parity) {
+      struct iovec parity_iov[m];
+      for (int i = k; i < n; i++) {
+        parity_iov[i - k].iov_base = parity + (i - k) * unit;
+        parity_iov[i - k].iov_len = unit;
+        jobs[i].op = STRIPE_WRITE;
+        jobs[i].iov = &parity_iov[i - k];
+        jobs[i].iovcnt = 1;
+        jobs[i].nbyte = unit;
+        jobs[i].offset = row * (off_t)unit;
+      }
+      for (int i = 0; i < k; i++) {
+        wanted[i] = false;
+      }
+      run_updates(state, master, fd, jobs, wanted, n);
+    }
+    parity_truncates(state, jobs, wanted, length, l);
+    run_updates(state, master, fd, jobs, wanted, n);
+  }
+
+  int res = 0;
+  if (usable_shards(master, n) < k) {
+    errno = EIO;
+    res = -1;
+  } else {
+    master->erasure_size = length;
+  }
+  pthread_rwlock_unlock(lock);
+  free(data);
+  free(parity);
+  return res;
+}
+
+off_t erasure_file_size(DemultiplexerState *state, int fd) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  pthread_rwlock_t *lock = erasure_lock(state, fd);
+  pthread_rwlock_rdlock(lock);
+  off_t size = master->erasure_size;
+  pthread_rwlock_unlock(lock);
+  return size;
+}
+
+int erasure_int_result(DemultiplexerState *state, const int *results,
+                       int nlayers) {
+  int succeeded = 0;
+  for (int i = 0; i < nlayers; i++) {
+    succeeded += results[i] >= 0;
+  }
+  return succeeded >= state->data_layers ? 0 : -1;
+}
+
+void erasure_stat(DemultiplexerState *state, const char *path, int nlayers,
+                  const int *results, struct stat *const *stbufs,
+                  struct stat *stbuf) {
+  int k = state->data_layers;
+  bool stale[MAX_LAYERS];
+  stale_layers(state, path, nlayers, stale);
+
+  off_t size = 0;
+  blkcnt_t blocks = 0;
+  for (int i = 0; i < nlayers; i++) {
+    if (results[i] != 0 || !stbufs[i]) {
+      continue;
+    }
+    blocks += stbufs[i]->st_blocks;
+    if (stale[i]) {
+      continue;
+    }
+    off_t end = i < k ? stripe_logical_size(state->stripe_size, k, i,
+                                            stbufs[i]->st_size)
+                      : stbufs[i]->st_size;
+    if (end > size) {
+      size = end;
+    }
+  }
+  stbuf->st_size = size;
+  stbuf->st_blocks = blocks;
+}
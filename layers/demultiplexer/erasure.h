@@ -0,0 +1,120 @@
+#ifndef __ERASURE_H__
+#define __ERASURE_H__
+
+#include "../../shared/types/layer_context.h"
+#include "demultiplexer.h"
+#include <sys/stat.h>
+
+/**
+ * @brief Master fd of an erasure coded open
+ *
+ * @param state         -> demultiplexer state
+ * @param results       -> fd returned by each layer
+ * @param nlayers       -> number of next layers
+ * @return int          -> fd of the first layer that opened the file, -1 if
+ * fewer than data_layers did
+ */
+int erasure_open_result(DemultiplexerState *state, const int *results,
+                        int nlayers);
+
+/**
+ * @brief Find the size of an opened file and rebuild its stale shards
+ *
+ * The layers that failed to open, or that missed writes, are left out of the
+ * I/O of fd; a writable open rebuilds the shards of the stale ones that
+ * opened from the other layers.
+ *
+ * @param state         -> demultiplexer state
+ * @param fd            -> master file descriptor, its path recorded
+ * @param flags         -> flags of the open
+ * @param l             -> context of the demultiplexer layer
+ * @return int          -> 0 on success, -1 if fewer than data_layers layers
+ * hold the file
+ */
+int erasure_open_file(DemultiplexerState *state, int fd, int flags,
+                      LayerContext l);
+
+/**
+ * @brief Read an erasure coded file
+ *
+ * The data layers read their stripe units at once; the rows with units of a
+ * failed layer are rebuilt from the parity.
+ *
+ * @param state         -> demultiplexer state
+ * @param fd            -> master file descriptor
+ * @param iov           -> buffers to read into
+ * @param iovcnt        -> number of buffers
+ * @param offset        -> logical offset
+ * @param l             -> context of the demultiplexer layer
+ * @return ssize_t      -> number of read bytes, up to the end of the file, -1
+ * if fewer than data_layers layers can serve the read
+ */
+ssize_t erasure_preadv(DemultiplexerState *state, int fd,
+                       const struct iovec *iov, int iovcnt, off_t offset,
+                       LayerContext l);
+
+/**
+ * @brief Write an erasure coded file and the parity of the rows written
+ *
+ * @param state         -> demultiplexer state
+ * @param fd            -> master file descriptor
+ * @param iov           -> buffers to write
+ * @param iovcnt        -> number of buffers
+ * @param offset        -> logical offset
+ * @param l             -> context of the demultiplexer layer
+ * @return ssize_t      -> number of written bytes, -1 if fewer than
+ * data_layers layers took the write
+ */
+ssize_t erasure_pwritev(DemultiplexerState *state, int fd,
+                        const struct iovec *iov, int iovcnt, off_t offset,
+                        LayerContext l);
+
+/**
+ * @brief Truncate an erasure coded file and its parity
+ *
+ * @param state         -> demultiplexer state
+ * @param fd            -> master file descriptor
+ * @param length        -> logical length
+ * @param l             -> context of the demultiplexer layer
+ * @return int          -> 0 on success, -1 if fewer than data_layers layers
+ * took the truncate
+ */
+int erasure_ftruncate(DemultiplexerState *state, int fd, off_t length,
+                      LayerContext l);
+
+/**
+ * @brief Logical size of an open erasure coded file
+ *
+ * @param state         -> demultiplexer state
+ * @param fd            -> master file descriptor
+ * @return off_t        -> size, including the writes of fd
+ */
+off_t erasure_file_size(DemultiplexerState *state, int fd);
+
+/**
+ * @brief Result of a fan-out that needs data_layers of the layers
+ *
+ * @param state         -> demultiplexer state
+ * @param results       -> result of each layer
+ * @param nlayers       -> number of next layers
+ * @return int          -> 0 if at least data_layers layers succeeded, -1
+ */
+int erasure_int_result(DemultiplexerState *state, const int *results,
+                       int nlayers);
+
+/**
+ * @brief Turn the stats of the layers' shards into the stat of the file
+ *
+ * @param state         -> demultiplexer state
+ * @param path          -> path of the file, its stale layers are ignored
+ * @param nlayers       -> number of next layers
+ * @param results       -> result of each layer's stat
+ * @param stbufs        -> stat of each layer's shard
+ * @param stbuf         -> stat of a layer, its size and blocks set to the
+ * file's
+ */
+void erasure_stat(DemultiplexerState *state, const char *path, int nlayers,
+                  const int *results, struct stat *const *stbufs,
+                  struct stat *stbuf);
+
+#endif // __ERASURE_H__
@@ -1,6 +1,7 @@
 #include "passthrough_ops.h"
 #include "../../logdef.h"
 #include "../../shared/types/layer_context.h"
+#include "../../shared/utils/layer_iov.h"
 
 /**
  * @brief Passthrough implementation of pread operation
@@ -52,3 +53,15 @@ ssize_t passthrough_pwrite(int fd, const void *buff, size_t nbyte, off_t offset,
   // The demultiplexer will handle the actual operation distribution
   return (ssize_t)nbyte;
 }
+
+ssize_t passthrough_preadv(int fd, const struct iovec *iov, int iovcnt,
+                           off_t offset, LayerContext l) {
+  DEBUG_MSG("Passthrough readv\n");
+  return (ssize_t)iov_length(iov, iovcnt);
+}
+
+ssize_t passthrough_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                            off_t offset, LayerContext l) {
+  DEBUG_MSG("Passthrough writev\n");
+  return (ssize_t)iov_length(iov, iovcnt);
+}
@@ -45,6 +45,38 @@ ssize_t passthrough_pread(int fd, void *buff, size_t nbyte, off_t offset,
 ssize_t passthrough_pwrite(int fd, const void *buff, size_t nbyte, off_t offset,
                            LayerContext l);
 
+/**
+ * @brief Passthrough implementation of preadv operation
+ *
+ * As passthrough_pread, for scatter/gather reads.
+ *
+ * @param fd File descriptor to read from
+ * @param iov Buffers to store the read data
+ * @param iovcnt Number of buffers
+ * @param offset Offset in the file to start reading from
+ * @param l Layer context containing information about the current and next
+ * layers
+ * @return Number of bytes of the buffers
+ */
+ssize_t passthrough_preadv(int fd, const struct iovec *iov, int iovcnt,
+                           off_t offset, LayerContext l);
+
+/**
+ * @brief Passthrough implementation of pwritev operation
+ *
+ * As passthrough_pwrite, for scatter/gather writes.
+ *
+ * @param fd File descriptor to write to
+ * @param iov Buffers containing the data to write
+ * @param iovcnt Number of buffers
+ * @param offset Offset in the file to start writing to
+ * @param l Layer context containing information about the current and next
+ * layers
+ * @return Number of bytes of the buffers
+ */
+ssize_t passthrough_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                            off_t offset, LayerContext l);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,572 @@
+#include "read_policy.h"
+#include "../../logdef.h"
+#include "../../shared/utils/layer_iov.h"
+#include "../../shared/utils/parallel.h"
+#include "enforcement.h"
+#include "replica_check.h"
+#include "replication.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * ============================================================================
+ * DEMULTIPLEXER READ POLICIES
+ * ============================================================================
+ *
+ * all:           every layer is read in parallel, the first layer in read
+ *                order into the caller's buffer and the others into scratch
+ *                buffers; an enforced layer failing fails the read
+ * preferred:     the layers are read one at a time in read order, straight
+ *                into the caller's buffer, until one succeeds
+ * fastest:       as preferred, in increasing order of EWMA read latency
+ * hedged:        the fastest layer is read; when it has not answered within
+ *                its p95 latency, the next fastest is read too and the first
+ *                success wins
+ * first_success: every layer is read at once and the first success wins
+ *
+ * Hedged and first_success reads run in scratch buffers (the losers may
+ * still be writing when the read returns) and copy the winner's data. The
+ * losers are not cancelled: they finish on the thread pool, release their
+ * scratch buffers and count down inflight_reads, which close waits for.
+ *
+ * With verify_replicas, the all policy also checks that the layers agree,
+ * by their stored digests where they have some (see replica_check.c).
+ *
+ * In write quorum mode, the layers lagging behind the acknowledged writes of
+ * the file are left out of its reads, whatever the policy.
+ *
+ * Every timed read updates the layer's latency: an EWMA (weight 1/8) used to
+ * rank layers, and a ring of recent samples for the p95. A failed read
+ * doubles the layer's EWMA instead, so failing layers sink in the ranking.
+ * ============================================================================
+ */
+
+#define LATENCY_EWMA_SHIFT 3            // EWMA weight of a new sample: 1/8
+#define LATENCY_MAX_NS (1000L * 1000 * 1000) // Cap of a penalized EWMA
+
+static long elapsed_ns(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000000L +
+         (now.tv_nsec - start->tv_nsec);
+}
+
+static void record_latency(DemultiplexerState *state, int layer, long ns,
+                           int failed) {
+  if (ns < 1) {
+    ns = 1; // keep 0 for layers without reads
+  }
+
+  pthread_mutex_lock(&state->read_mutex);
+  DemultiplexerLatency *latency = &state->latency[layer];
+  if (failed) {
+    long penalized = (latency->ewma_ns > ns ? latency->ewma_ns : ns) * 2;
+    latency->ewma_ns = penalized < LATENCY_MAX_NS ? penalized : LATENCY_MAX_NS;
+  } else {
+    if (latency->ewma_ns == 0) {
+      latency->ewma_ns = ns;
+    } else {
+      latency->ewma_ns += (ns - latency->ewma_ns) >> LATENCY_EWMA_SHIFT;
+    }
+    latency->samples[latency->n_samples % DEMULTIPLEXER_LATENCY_SAMPLES] = ns;
+    latency->n_samples++;
+  }
+  pthread_mutex_unlock(&state->read_mutex);
+}
+
+static int compare_long(const void *a, const void *b) {
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+// p95 of the recent latencies of layer, bounded below
+static long hedge_delay_ns(DemultiplexerState *state, int layer) {
+  long samples[DEMULTIPLEXER_LATENCY_SAMPLES];
+  size_t n;
+
+  pthread_mutex_lock(&state->read_mutex);
+  DemultiplexerLatency *latency = &state->latency[layer];
+  n = latency->n_samples < DEMULTIPLEXER_LATENCY_SAMPLES
+          ? latency->n_samples
+          : DEMULTIPLEXER_LATENCY_SAMPLES;
+  memcpy(samples, latency->samples, n * sizeof(long));
+  pthread_mutex_unlock(&state->read_mutex);
+
+  if (n < DEMULTIPLEXER_HEDGE_MIN_SAMPLES) {
+    return DEMULTIPLEXER_HEDGE_DEFAULT_DELAY_NS;
+  }
+  qsort(samples, n, sizeof(long), compare_long);
+  long p95 = samples[(n * 95 + 99) / 100 - 1];
+  if (p95 < DEMULTIPLEXER_HEDGE_MIN_DELAY_NS) {
+    return DEMULTIPLEXER_HEDGE_MIN_DELAY_NS;
+  }
+  return p95;
+}
+
+// Read order sorted by EWMA latency, layers without reads first
+static void fastest_order(DemultiplexerState *state, int *order) {
+  pthread_mutex_lock(&state->read_mutex);
+  for (int k = 0; k < state->n_read_layers; k++) {
+    int layer = state->read_order[k];
+    long ewma = state->latency[layer].ewma_ns;
+    int j = k;
+    // insertion sort, stable so ties keep the read order
+    while (j > 0 && state->latency[order[j - 1]].ewma_ns > ewma) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = layer;
+  }
+  pthread_mutex_unlock(&state->read_mutex);
+}
+
+/**
+ * @brief Read from the layers in the given order until one succeeds
+ *
+ * Each layer reads straight into the caller's buffers; a later layer is only
+ * tried when the previous ones failed.
+ *
+ * @param state    -> demultiplexer state
+ * @param order    -> layers to try, n_read_layers entries
+ * @param layer_fds -> file descriptors of the next layers
+ * @param iov      -> buffers to read into
+ * @param iovcnt   -> number of buffers
+ * @param offset   -> offset value
+ * @param l        -> Context for the demultiplexer layer
+ * @return ssize_t -> number of read bytes, -1 if every layer failed
+ */
+static ssize_t read_in_order(DemultiplexerState *state, const int *order,
+                             int *layer_fds, const struct iovec *iov,
+                             int iovcnt, off_t offset, LayerContext l) {
+  for (int k = 0; k < state->n_read_layers; k++) {
+    int i = order[k];
+    if (layer_fds[i] == INVALID_FD) {
+      continue;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ssize_t res =
+        layer_preadv(layer_fds[i], iov, iovcnt, offset, l.next_layers[i]);
+    record_latency(state, i, elapsed_ns(&start), res < 0);
+    if (res >= 0) {
+      return res;
+    }
+    WARN_MSG("[DEMULTIPLEXER_PREAD] Layer %d failed to read, trying the next "
+             "layer",
+             i);
+  }
+  return -1;
+}
+
+// Result of a read of every layer: the primary's, unless an enforced one
+// failed
+static ssize_t all_layers_result(DemultiplexerState *state,
+                                 const bool *lagging, ssize_t *results,
+                                 int primary, size_t nbyte, int nlayers) {
+  // what passthrough_pread would have returned, lagging layers being
+  // counted as passthrough for this read
+  for (int i = 0; i < nlayers; i++) {
+    if (state->options[i].passthrough_read || lagging[i]) {
+      results[i] = (ssize_t)nbyte;
+    }
+  }
+
+  if (get_enforced_layers_ssize_result(results, nlayers, state) < 0) {
+    return -1;
+  }
+  return results[primary] < 0 ? -1 : results[primary];
+}
+
+/**
+ * @brief Read from every layer in parallel
+ *
+ * The first layer in read order (the first enforced one that serves reads)
+ * reads straight into the caller's buffer, the others into scratch buffers
+ * from the state's pool. Layers with passthrough reads and lagging layers
+ * are not called. With verify_replicas, replica_checked_read does the reads.
+ *
+ * @param state    -> demultiplexer state
+ * @param lagging  -> layers lagging behind the writes of the file
+ * @param layer_fds -> file descriptors of the next layers
+ * @param buff     -> buffer to read into
+ * @param nbyte    -> number of bytes to read
+ * @param offset   -> offset value
+ * @param l        -> Context for the demultiplexer layer
+ * @return ssize_t -> number of read bytes from the first layer in read
+ * order, -1 if an enforced layer failed
+ */
+static ssize_t read_all_layers(DemultiplexerState *state, const bool *lagging,
+                               int *layer_fds, void *buff, size_t nbyte,
+                               off_t offset, LayerContext l) {
+  int nlayers = l.nlayers;
+  int primary = -1;
+  for (int k = 0; k < state->n_read_layers && primary < 0; k++) {
+    if (!lagging[state->read_order[k]]) {
+      primary = state->read_order[k];
+    }
+  }
+  if (primary < 0) {
+    ERROR_MSG("[DEMULTIPLEXER_PREAD] Every layer lags behind the writes");
+    errno = EAGAIN;
+    return -1;
+  }
+
+  ssize_t results[nlayers];
+  if (state->verify_replicas) {
+    if (replica_checked_read(state, primary, lagging, layer_fds, buff, nbyte,
+                             offset, l, results) != 0) {
+      return -1;
+    }
+    return all_layers_result(state, lagging, results, primary, nbyte,
+                             nlayers);
+  }
+
+  void *buffers[nlayers];
+  for (int i = 0; i < nlayers; i++) {
+    buffers[i] = NULL;
+  }
+  buffers[primary] = buff;
+  for (int k = 0; k < state->n_read_layers; k++) {
+    int i = state->read_order[k];
+    if (i == primary || lagging[i]) {
+      continue;
+    }
+    buffers[i] = buffer_pool_get(state->scratch, nbyte);
+    if (!buffers[i]) {
+      ERROR_MSG("[DEMULTIPLEXER_PREAD] Failed to allocate a read buffer for "
+                "layer %d",
+                i);
+    }
+  }
+
+  int active_threads = 0;
+  ParallelBatch batch;
+  int res = execute_parallel_reads(state->pool, &batch, l.next_layers, nlayers,
+                                   layer_fds, buffers, nbyte, offset, results,
+                                   &active_threads);
+  if (res == 0) {
+    wait_for_all_threads(&batch, active_threads, nlayers, state);
+  }
+
+  for (int i = 0; i < nlayers; i++) {
+    if (i != primary) {
+      buffer_pool_put(state->scratch, buffers[i]);
+    }
+  }
+  if (res != 0) {
+    ERROR_MSG("[DEMULTIPLEXER_PREAD] Failed to start parallel reads");
+    return -1;
+  }
+  return all_layers_result(state, lagging, results, primary, nbyte, nlayers);
+}
+
+typedef struct ReadRace ReadRace;
+
+typedef struct {
+  ThreadPoolTask task;
+  ReadRace *race;
+  int layer;
+  struct timespec start;
+} ReadRaceTask;
+
+// A read issued to several layers, shared by the caller and its tasks
+struct ReadRace {
+  DemultiplexerState *state;
+  LayerContext *layers;
+  int layer_fds[MAX_LAYERS];
+  int fd; // master fd, counted in inflight_reads
+  size_t nbyte;
+  off_t offset;
+  void *buffers[MAX_LAYERS]; // scratch buffer of each issued layer
+  ssize_t results[MAX_LAYERS];
+  ReadRaceTask tasks[MAX_LAYERS];
+  int issued;   // layers issued
+  int finished; // issued layers that answered
+  int winner;   // first layer that succeeded, -1 while none
+  int error;    // errno of the last failure
+  int refs;     // caller and unfinished tasks
+  pthread_mutex_t mutex;
+  pthread_cond_t answered; // broadcast on every answer
+};
+
+static void race_release(ReadRace *race) {
+  pthread_mutex_lock(&race->mutex);
+  int last = --race->refs == 0;
+  pthread_mutex_unlock(&race->mutex);
+  if (!last) {
+    return;
+  }
+
+  DemultiplexerState *state = race->state;
+  for (int i = 0; i < MAX_LAYERS; i++) {
+    buffer_pool_put(state->scratch, race->buffers[i]);
+  }
+  pthread_mutex_lock(&state->read_mutex);
+  demultiplexer_fd(state, race->fd)->inflight_reads--;
+  pthread_cond_broadcast(&state->reads_done);
+  pthread_mutex_unlock(&state->read_mutex);
+
+  pthread_cond_destroy(&race->answered);
+  pthread_mutex_destroy(&race->mutex);
+  free(race);
+}
+
+static void *race_read_worker(void *arg) {
+  ReadRaceTask *task = (ReadRaceTask *)arg;
+  ReadRace *race = task->race;
+  int i = task->layer;
+
+  ssize_t res = race->layers[i].ops->lpread(race->layer_fds[i],
+                                            race->buffers[i], race->nbyte,
+                                            race->offset, race->layers[i]);
+  int error = errno;
+  record_latency(race->state, i, elapsed_ns(&task->start), res < 0);
+
+  pthread_mutex_lock(&race->mutex);
+  race->results[i] = res;
+  race->finished++;
+  if (res >= 0 && race->winner < 0) {
+    race->winner = i;
+  } else if (res < 0) {
+    race->error = error;
+  }
+  pthread_cond_broadcast(&race->answered);
+  pthread_mutex_unlock(&race->mutex);
+
+  race_release(race);
+  return NULL;
+}
+
+// Issue the read of layer, assumes the race mutex is held
+static void race_issue(ReadRace *race, int layer) {
+  ReadRaceTask *task = &race->tasks[layer];
+  race->issued++;
+
+  race->buffers[layer] = buffer_pool_get(race->state->scratch, race->nbyte);
+  if (!race->buffers[layer]) {
+    ERROR_MSG("[DEMULTIPLEXER_PREAD] Failed to allocate a read buffer for "
+              "layer %d",
+              layer);
+    race->results[layer] = -1;
+    race->error = ENOMEM;
+    race->finished++;
+    return;
+  }
+
+  task->race = race;
+  task->layer = layer;
+  clock_gettime(CLOCK_MONOTONIC, &task->start);
+  race->refs++;
+  if (thread_pool_submit(race->state->pool, layer, &task->task, NULL,
+                         race_read_worker, task) != 0) {
+    race->refs--;
+    race->results[layer] = -1;
+    race->error = EIO;
+    race->finished++;
+  }
+}
+
+/**
+ * @brief Read from several layers at once, the first success wins
+ *
+ * @param state    -> demultiplexer state
+ * @param fd       -> master file descriptor
+ * @param order    -> layers in the order they are issued
+ * @param layer_fds -> file descriptors of the next layers
+ * @param buff     -> buffer to read into
+ * @param nbyte    -> number of bytes to read
+ * @param offset   -> offset value
+ * @param l        -> Context for the demultiplexer layer
+ * @param hedged   -> issue one layer and hedge with a second one after its
+ * p95 latency, instead of issuing every layer at once
+ * @return ssize_t -> number of read bytes, -1 if every layer failed
+ */
+static ssize_t read_race(DemultiplexerState *state, int fd, const int *order,
+                         int *layer_fds, void *buff, size_t nbyte,
+                         off_t offset, LayerContext l, int hedged) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  int candidates[MAX_LAYERS];
+  int n_candidates = 0;
+  for (int k = 0; k < state->n_read_layers; k++) {
+    if (layer_fds[order[k]] != INVALID_FD) {
+      candidates[n_candidates++] = order[k];
+    }
+  }
+  if (n_candidates == 0) {
+    return -1;
+  }
+
+  ReadRace *race = calloc(1, sizeof(ReadRace));
+  if (!race) {
+    ERROR_MSG("[DEMULTIPLEXER_PREAD] Failed to allocate a read");
+    return -1;
+  }
+  race->state = state;
+  race->layers = l.next_layers;
+  memcpy(race->layer_fds, layer_fds, l.nlayers * sizeof(int));
+  race->fd = fd;
+  race->nbyte = nbyte;
+  race->offset = offset;
+  race->winner = -1;
+  race->refs = 1;
+  pthread_mutex_init(&race->mutex, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&race->answered, &attr);
+  pthread_condattr_destroy(&attr);
+
+  pthread_mutex_lock(&state->read_mutex);
+  master->inflight_reads++;
+  pthread_mutex_unlock(&state->read_mutex);
+
+  struct timespec hedge_at;
+  int can_hedge = hedged && n_candidates > 1;
+  if (can_hedge) {
+    long delay = hedge_delay_ns(state, candidates[0]);
+    clock_gettime(CLOCK_MONOTONIC, &hedge_at);
+    hedge_at.tv_sec += delay / 1000000000L;
+    hedge_at.tv_nsec += delay % 1000000000L;
+    if (hedge_at.tv_nsec >= 1000000000L) {
+      hedge_at.tv_sec++;
+      hedge_at.tv_nsec -= 1000000000L;
+    }
+  }
+
+  pthread_mutex_lock(&race->mutex);
+  int next = 0;
+  do {
+    race_issue(race, candidates[next++]);
+  } while (!hedged && next < n_candidates);
+
+  while (race->winner < 0) {
+    if (race->finished == race->issued) {
+      // every issued layer failed: fall back to the next one
+      if (next == n_candidates) {
+        break;
+      }
+      race_issue(race, candidates[next++]);
+      can_hedge = 0;
+      continue;
+    }
+    if (can_hedge) {
+      if (pthread_cond_timedwait(&race->answered, &race->mutex, &hedge_at) ==
+              ETIMEDOUT &&
+          race->winner < 0 && race->finished < race->issued) {
+        race_issue(race, candidates[next++]);
+        can_hedge = 0;
+        pthread_mutex_lock(&state->read_mutex);
+        state->hedged_reads++;
+        pthread_mutex_unlock(&state->read_mutex);
+      }
+      continue;
+    }
+    pthread_cond_wait(&race->answered, &race->mutex);
+  }
+
+  ssize_t res = -1;
+  if (race->winner >= 0) {
+    res = race->results[race->winner];
+    if ((size_t)res > nbyte) {
+      res = (ssize_t)nbyte;
+    }
+    memcpy(buff, race->buffers[race->winner], res);
+  } else {
+    errno = race->error;
+  }
+  pthread_mutex_unlock(&race->mutex);
+
+  race_release(race);
+  return res;
+}
+
+// Leave the layers lagging behind the writes of fd out of its reads
+static void readable_fds(DemultiplexerState *state, int fd, int *layer_fds,
+                         int *fds, bool *lagging, int nlayers) {
+  lagging_layers(state, fd, nlayers, lagging);
+  for (int i = 0; i < nlayers; i++) {
+    fds[i] = lagging[i] ? INVALID_FD : layer_fds[i];
+  }
+}
+
+ssize_t read_with_policy(DemultiplexerState *state, int fd, int *layer_fds,
+                         void *buff, size_t nbyte, off_t offset,
+                         LayerContext l) {
+  int order[MAX_LAYERS];
+  struct iovec iov = {.iov_base = buff, .iov_len = nbyte};
+
+  bool lagging[MAX_LAYERS];
+  int fds[MAX_LAYERS];
+  readable_fds(state, fd, layer_fds, fds, lagging, l.nlayers);
+  layer_fds = fds;
+
+  switch (state->read_policy) {
+  case DEMULTIPLEXER_READ_PREFERRED:
+    return read_in_order(state, state->read_order, layer_fds, &iov, 1, offset,
+                         l);
+  case DEMULTIPLEXER_READ_FASTEST:
+    fastest_order(state, order);
+    return read_in_order(state, order, layer_fds, &iov, 1, offset, l);
+  case DEMULTIPLEXER_READ_HEDGED:
+    fastest_order(state, order);
+    return read_race(state, fd, order, layer_fds, buff, nbyte, offset, l, 1);
+  case DEMULTIPLEXER_READ_FIRST_SUCCESS:
+    return read_race(state, fd, state->read_order, layer_fds, buff, nbyte,
+                     offset, l, 0);
+  case DEMULTIPLEXER_READ_ALL:
+  default:
+    return read_all_layers(state, lagging, layer_fds, buff, nbyte, offset,
+                           l);
+  }
+}
+
+ssize_t readv_with_policy(DemultiplexerState *state, int fd, int *layer_fds,
+                          const struct iovec *iov, int iovcnt, off_t offset,
+                          LayerContext l) {
+  if (state->read_policy == DEMULTIPLEXER_READ_PREFERRED ||
+      state->read_policy == DEMULTIPLEXER_READ_FASTEST) {
+    bool lagging[MAX_LAYERS];
+    int fds[MAX_LAYERS];
+    readable_fds(state, fd, layer_fds, fds, lagging, l.nlayers);
+    int order[MAX_LAYERS];
+    const int *read_order = state->read_order;
+    if (state->read_policy == DEMULTIPLEXER_READ_FASTEST) {
+      fastest_order(state, order);
+      read_order = order;
+    }
+    return read_in_order(state, read_order, fds, iov, iovcnt, offset, l);
+  }
+
+  if (iovcnt == 1) {
+    return read_with_policy(state, fd, layer_fds, iov[0].iov_base,
+                            iov[0].iov_len, offset, l);
+  }
+
+  // the other policies read several layers into flat buffers
+  size_t nbyte = iov_length(iov, iovcnt);
+  void *bounce = buffer_pool_get(state->scratch, nbyte);
+  if (!bounce) {
+    errno = ENOMEM;
+    return -1;
+  }
+  ssize_t res =
+      read_with_policy(state, fd, layer_fds, bounce, nbyte, offset, l);
+  if (res > 0) {
+    iov_scatter(iov, iovcnt, bounce, (size_t)res);
+  }
+  buffer_pool_put(state->scratch, bounce);
+  return res;
+}
+
+void wait_for_inflight_reads(DemultiplexerState *state, int fd) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  pthread_mutex_lock(&state->read_mutex);
+  while (master->inflight_reads > 0) {
+    pthread_cond_wait(&state->reads_done, &state->read_mutex);
+  }
+  pthread_mutex_unlock(&state->read_mutex);
+}
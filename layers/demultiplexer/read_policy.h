@@ -0,0 +1,53 @@
+#ifndef __READ_POLICY_H__
+#define __READ_POLICY_H__
+
+#include "../../shared/types/layer_context.h"
+#include "demultiplexer.h"
+
+/**
+ * @brief Read from the next layers as the state's read policy says
+ *
+ * @param state         -> demultiplexer state
+ * @param fd            -> master file descriptor
+ * @param layer_fds     -> file descriptors of the next layers
+ * @param buff          -> buffer to read into
+ * @param nbyte         -> number of bytes to read
+ * @param offset        -> offset value
+ * @param l             -> context of the demultiplexer layer
+ * @return ssize_t      -> number of read bytes, -1 on failure
+ */
+ssize_t read_with_policy(DemultiplexerState *state, int fd, int *layer_fds,
+                         void *buff, size_t nbyte, off_t offset,
+                         LayerContext l);
+
+/**
+ * @brief read_with_policy, but into several buffers
+ *
+ * The preferred and fastest policies read straight into iov, the others read
+ * into a scratch buffer that is then scattered over iov.
+ *
+ * @param state         -> demultiplexer state
+ * @param fd            -> master file descriptor
+ * @param layer_fds     -> file descriptors of the next layers
+ * @param iov           -> buffers to read into
+ * @param iovcnt        -> number of buffers
+ * @param offset        -> offset value
+ * @param l             -> context of the demultiplexer layer
+ * @return ssize_t      -> number of read bytes, -1 on failure
+ */
+ssize_t readv_with_policy(DemultiplexerState *state, int fd, int *layer_fds,
+                          const struct iovec *iov, int iovcnt, off_t offset,
+                          LayerContext l);
+
+/**
+ * @brief Wait for the reads of fd that outlived their pread to finish
+ *
+ * Hedged and first_success reads return on the first successful layer and
+ * leave the others running; they must be done before the fd is closed.
+ *
+ * @param state         -> demultiplexer state
+ * @param fd            -> master file descriptor
+ */
+void wait_for_inflight_reads(DemultiplexerState *state, int fd);
+
+#endif // __READ_POLICY_H__
@@ -0,0 +1,248 @@
+#include "replica_check.h"
+#include "../../logdef.h"
+#include "../../shared/utils/layer_iov.h"
+#include "../../shared/utils/parallel.h"
+#include "enforcement.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * ============================================================================
+ * DEMULTIPLEXER REPLICA CHECKS
+ * ============================================================================
+ *
+ * With verify_replicas, the reads of the all policy check that the layers
+ * hold the same data. Comparing data means reading it from every layer;
+ * a layer that keeps a digest per block (the block anti-tampering layer)
+ * can return the stored digests of the range instead, a few bytes per
+ * block. When the primary and another layer both do, and use the same
+ * digest format, they are compared by digest and that layer's data is not
+ * read. The other layers, and those whose digests cannot be fetched or
+ * compared, are read into scratch buffers and compared with the primary's.
+ *
+ * Stored digests describe what each layer was written, not what it reads
+ * back: the anti-tampering layer of each replica checks its own data
+ * against them.
+ * ============================================================================
+ */
+
+#define REPLICA_DIGEST_GUESS_BLOCK 4096 // Smallest block the first try fits
+#define REPLICA_DIGEST_GUESS_SIZE 64    // Largest digest the first try fits
+
+// The stored digests of the range on one layer
+typedef struct {
+  ThreadPoolTask task;
+  LayerContext *layer;
+  int layer_fd;
+  size_t nbyte;
+  off_t offset;
+  LayerStoredDigests digests;
+  ssize_t count; // Digests returned, -1 on failure
+} DigestJob;
+
+static size_t range_blocks(size_t block_size, size_t nbyte, off_t offset) {
+  if (nbyte == 0) {
+    return 0;
+  }
+  size_t first = (size_t)offset / block_size;
+  size_t last = ((size_t)offset + nbyte - 1) / block_size;
+  return last - first + 1;
+}
+
+static void *digest_worker(void *arg) {
+  DigestJob *job = arg;
+  LayerStoredDigests *digests = &job->digests;
+
+  digests->capacity =
+      (range_blocks(REPLICA_DIGEST_GUESS_BLOCK, job->nbyte, job->offset) + 1) *
+      REPLICA_DIGEST_GUESS_SIZE;
+  digests->digests = malloc(digests->capacity);
+  if (!digests->digests) {
+    job->count = -1;
+    return NULL;
+  }
+  job->count = layer_getdigest(job->layer_fd, job->offset, job->nbyte,
+                               digests, *job->layer);
+
+  // too small a guess: the layer said its format, size the buffer for it
+  if (job->count < 0 && errno == ERANGE && digests->block_size > 0) {
+    size_t capacity =
+        range_blocks(digests->block_size, job->nbyte, job->offset) *
+        digests->digest_size;
+    void *resized = realloc(digests->digests, capacity);
+    if (!resized) {
+      job->count = -1;
+      return NULL;
+    }
+    digests->digests = resized;
+    digests->capacity = capacity;
+    job->count = layer_getdigest(job->layer_fd, job->offset, job->nbyte,
+                                 digests, *job->layer);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Whether two layers' digests of the same range agree
+ *
+ * @return int -> 1 if they agree, 0 if they differ, -1 if they cannot be
+ * compared (a failure, or digests of another format)
+ */
+static int digests_agree(const DigestJob *a, const DigestJob *b) {
+  if (a->count < 0 || b->count < 0 ||
+      a->digests.algorithm != b->digests.algorithm ||
+      a->digests.block_size != b->digests.block_size ||
+      a->digests.digest_size != b->digests.digest_size ||
+      a->digests.first_block != b->digests.first_block) {
+    return -1;
+  }
+  if (a->count != b->count) {
+    return 0; // one layer holds blocks the other does not
+  }
+  return memcmp(a->digests.digests, b->digests.digests,
+                (size_t)a->count * a->digests.digest_size) == 0;
+}
+
+static void replica_mismatch(DemultiplexerState *state, int layer,
+                             int primary, size_t nbyte, off_t offset) {
+  WARN_MSG("[DEMULTIPLEXER_PREAD] Layer %d disagrees with layer %d on %zu "
+           "bytes at offset %lld",
+           layer, primary, nbyte, (long long)offset);
+  pthread_mutex_lock(&state->read_mutex);
+  state->replica_mismatches++;
+  pthread_mutex_unlock(&state->read_mutex);
+}
+
+// Compare a layer's data with the primary's
+static void compare_data(DemultiplexerState *state, int layer, int primary,
+                         const void *data, ssize_t res, const void *buff,
+                         ssize_t primary_res, off_t offset) {
+  if (res < 0 || primary_res < 0) {
+    return; // failures are the enforcement's business
+  }
+  if (res != primary_res || memcmp(data, buff, (size_t)res) != 0) {
+    replica_mismatch(state, layer, primary, (size_t)primary_res, offset);
+  }
+}
+
+int replica_checked_read(DemultiplexerState *state, int primary,
+                         const bool *lagging, int *layer_fds, void *buff,
+                         size_t nbyte, off_t offset, LayerContext l,
+                         ssize_t *results) {
+  int nlayers = l.nlayers;
+
+  // a layer is checked by digest when the primary can be too
+  bool by_digest[nlayers];
+  bool primary_digests = l.next_layers[primary].ops->lgetdigest != NULL;
+  bool any_digests = false;
+  void *buffers[nlayers];
+  for (int i = 0; i < nlayers; i++) {
+    by_digest[i] = false;
+    buffers[i] = NULL;
+  }
+  buffers[primary] = buff;
+  for (int k = 0; k < state->n_read_layers; k++) {
+    int i = state->read_order[k];
+    if (i == primary || lagging[i]) {
+      continue;
+    }
+    if (primary_digests && l.next_layers[i].ops->lgetdigest) {
+      by_digest[i] = true;
+      any_digests = true;
+      continue;
+    }
+    buffers[i] = buffer_pool_get(state->scratch, nbyte);
+    if (!buffers[i]) {
+      ERROR_MSG("[DEMULTIPLEXER_PREAD] Failed to allocate a read buffer for "
+                "layer %d",
+                i);
+    }
+  }
+
+  // the digests are fetched alongside the data reads, on the same queues
+  DigestJob jobs[nlayers];
+  ThreadPoolBatch digest_batch;
+  thread_pool_batch_init(&digest_batch);
+  for (int i = 0; i < nlayers; i++) {
+    if (!by_digest[i] && !(i == primary && any_digests)) {
+      continue;
+    }
+    memset(&jobs[i], 0, sizeof(DigestJob));
+    jobs[i].layer = &l.next_layers[i];
+    jobs[i].layer_fd = layer_fds[i];
+    jobs[i].nbyte = nbyte;
+    jobs[i].offset = offset;
+    if (thread_pool_submit(state->pool, i, &jobs[i].task, &digest_batch,
+                           digest_worker, &jobs[i]) != 0) {
+      digest_worker(&jobs[i]);
+    }
+  }
+
+  int active_threads = 0;
+  ParallelBatch batch;
+  int res = execute_parallel_reads(state->pool, &batch, l.next_layers, nlayers,
+                                   layer_fds, buffers, nbyte, offset, results,
+                                   &active_threads);
+  if (res == 0) {
+    wait_for_all_threads(&batch, active_threads, nlayers, state);
+  }
+  thread_pool_wait(state->pool, &digest_batch);
+
+  if (res == 0) {
+    for (int i = 0; i < nlayers; i++) {
+      if (i != primary && buffers[i]) {
+        compare_data(state, i, primary, buffers[i], results[i], buff,
+                     results[primary], offset);
+      }
+    }
+  }
+  for (int i = 0; i < nlayers; i++) {
+    if (i != primary) {
+      buffer_pool_put(state->scratch, buffers[i]);
+    }
+  }
+
+  // a layer whose digests did not settle it is read after all
+  void *scratch = NULL;
+  for (int i = 0; i < nlayers && res == 0; i++) {
+    if (!by_digest[i]) {
+      continue;
+    }
+    int agree = digests_agree(&jobs[i], &jobs[primary]);
+    if (agree >= 0 && results[primary] >= 0) {
+      if (!agree) {
+        replica_mismatch(state, i, primary, (size_t)results[primary], offset);
+      }
+      results[i] = results[primary];
+      continue;
+    }
+    if (!scratch) {
+      scratch = buffer_pool_get(state->scratch, nbyte);
+    }
+    if (!scratch) {
+      ERROR_MSG("[DEMULTIPLEXER_PREAD] Failed to allocate a read buffer for "
+                "layer %d",
+                i);
+      results[i] = -1;
+      continue;
+    }
+    results[i] = l.next_layers[i].ops->lpread(layer_fds[i], scratch, nbyte,
+                                              offset, l.next_layers[i]);
+    compare_data(state, i, primary, scratch, results[i], buff,
+                 results[primary], offset);
+  }
+  buffer_pool_put(state->scratch, scratch);
+
+  for (int i = 0; i < nlayers; i++) {
+    if (by_digest[i] || (i == primary && any_digests)) {
+      free(jobs[i].digests.digests);
+    }
+  }
+  if (res != 0) {
+    ERROR_MSG("[DEMULTIPLEXER_PREAD] Failed to start parallel reads");
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef __REPLICA_CHECK_H__
+#define __REPLICA_CHECK_H__
+
+#include "../../shared/types/layer_context.h"
+#include "demultiplexer.h"
+
+/**
+ * @brief Read from every layer and check that the replicas agree
+ *
+ * The primary reads into buff. A layer that, like the primary, returns the
+ * stored digests of the range is compared by digest and its data is not
+ * read; the others read into scratch buffers that are compared to buff. A
+ * layer that disagrees is logged and counted in replica_mismatches, and the
+ * read still returns the primary's data.
+ *
+ * @param state    -> demultiplexer state
+ * @param primary  -> layer reading into buff
+ * @param lagging  -> layers lagging behind the writes of the file
+ * @param layer_fds -> file descriptors of the next layers
+ * @param buff     -> buffer to read into
+ * @param nbyte    -> number of bytes to read
+ * @param offset   -> offset value
+ * @param l        -> Context for the demultiplexer layer
+ * @param results  -> result of each layer, a layer checked by digest
+ * getting the primary's
+ * @return int     -> 0 once the layers answered, -1 if the reads could not
+ * be started
+ */
+int replica_checked_read(DemultiplexerState *state, int primary,
+                         const bool *lagging, int *layer_fds, void *buff,
+                         size_t nbyte, off_t offset, LayerContext l,
+                         ssize_t *results);
+
+#endif // __REPLICA_CHECK_H__
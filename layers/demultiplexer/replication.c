@@ -0,0 +1,482 @@
+#include "replication.h"
+#include "../../logdef.h"
+#include "../../shared/utils/layer_iov.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * ============================================================================
+ * DEMULTIPLEXER WRITE QUORUM REPLICATION
+ * ============================================================================
+ *
+ * With write_quorum = W, a pwrite copies its data once and queues it on the
+ * replay log of every layer storing writes. One drain task per layer applies
+ * its log in order on the thread pool, so a layer never sees writes out of
+ * order, and pwrite returns as soon as W layers applied the write. The
+ * other layers catch up in the background.
+ *
+ * A layer is lagging for a file while it has queued writes of the file;
+ * reads skip lagging layers, and close, ftruncate and fstat wait for the
+ * file's logs to drain first. A layer missing a write for good (its log was
+ * full or its write failed) is stale for the file: it gets no more writes
+ * nor reads of it, and the file is queued for repair on that layer. The next
+ * open of the file copies it from a layer that is not stale.
+ *
+ * All the replication state is protected by replica_mutex, and
+ * replica_progress is broadcast whenever a layer applies a write.
+ * ============================================================================
+ */
+
+typedef struct ReplayWrite ReplayWrite;
+
+typedef struct ReplayEntry {
+  ReplayWrite *write;
+  struct ReplayEntry *next;
+} ReplayEntry;
+
+// One pwrite, shared by the logs it is queued on
+struct ReplayWrite {
+  LayerContext *layers;
+  int layer_fds[MAX_LAYERS];
+  int fd; // master fd
+  void *data;
+  size_t nbyte;
+  off_t offset;
+  int queued;     // layers the write is queued on
+  int acks;       // layers that applied it
+  int failures;   // layers that failed it
+  ssize_t result; // result of the first layer that applied it
+  int error;      // errno of the last failure
+  int refs;       // caller and queued entries
+  ReplayEntry entries[MAX_LAYERS];
+};
+
+// Release a reference, assumes the replica mutex is held
+static void release_write(DemultiplexerState *state, ReplayWrite *write) {
+  if (--write->refs == 0) {
+    buffer_pool_put(state->scratch, write->data);
+    free(write);
+  }
+}
+
+static int is_stale(DemultiplexerReplica *replica, const char *path) {
+  for (DemultiplexerStalePath *stale = replica->stale; stale;
+       stale = stale->next) {
+    if (strcmp(stale->path, path) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void clear_stale(DemultiplexerReplica *replica, const char *path) {
+  DemultiplexerStalePath **link = &replica->stale;
+  while (*link) {
+    if (strcmp((*link)->path, path) == 0) {
+      DemultiplexerStalePath *stale = *link;
+      *link = stale->next;
+      free(stale->path);
+      free(stale);
+      replica->n_stale--;
+      return;
+    }
+    link = &(*link)->next;
+  }
+}
+
+// Layer missed a write of fd for good, assumes the replica mutex is held
+static void mark_stale(DemultiplexerState *state, int fd, int layer) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  master->replay_stale[layer] = true;
+
+  DemultiplexerReplica *replica = &state->replicas[layer];
+  const char *path = master->path;
+  if (!path || is_stale(replica, path)) {
+    return;
+  }
+  DemultiplexerStalePath *stale = malloc(sizeof(DemultiplexerStalePath));
+  if (stale) {
+    stale->path = strdup(path);
+  }
+  if (!stale || !stale->path) {
+    free(stale);
+    ERROR_MSG("[DEMULTIPLEXER_REPLICATION] Failed to record %s as stale on "
+              "layer %d",
+              path, layer);
+    return;
+  }
+  stale->next = replica->stale;
+  replica->stale = stale;
+  replica->n_stale++;
+  WARN_MSG("[DEMULTIPLEXER_REPLICATION] Layer %d missed writes of %s, it is "
+           "repaired on the next open",
+           layer, path);
+}
+
+static void *drain_replica(void *arg) {
+  DemultiplexerReplica *replica = (DemultiplexerReplica *)arg;
+  DemultiplexerState *state = replica->state;
+  int i = replica->layer;
+
+  pthread_mutex_lock(&state->replica_mutex);
+  while (replica->head) {
+    // stays queued, and counted as lag, until applied
+    ReplayEntry *entry = replica->head;
+    ReplayWrite *write = entry->write;
+    pthread_mutex_unlock(&state->replica_mutex);
+
+    ssize_t res = write->layers[i].ops->lpwrite(
+        write->layer_fds[i], write->data, write->nbyte, write->offset,
+        write->layers[i]);
+    int error = errno;
+
+    pthread_mutex_lock(&state->replica_mutex);
+    replica->head = entry->next;
+    if (!replica->head) {
+      replica->tail = NULL;
+    }
+    replica->entries--;
+    replica->bytes -= write->nbyte;
+    demultiplexer_fd(state, write->fd)->replay_behind[i]--;
+    if (res >= 0) {
+      replica->applied++;
+      if (write->acks++ == 0) {
+        write->result = res;
+      }
+    } else {
+      replica->failed++;
+      write->failures++;
+      write->error = error;
+      mark_stale(state, write->fd, i);
+    }
+    release_write(state, write);
+    pthread_cond_broadcast(&state->replica_progress);
+  }
+  replica->draining = 0;
+  pthread_mutex_unlock(&state->replica_mutex);
+
+  return NULL;
+}
+
+void replication_init(DemultiplexerState *state, int nlayers,
+                      int write_quorum) {
+  state->write_quorum = write_quorum;
+  memset(state->replicas, 0, sizeof(state->replicas));
+  for (int i = 0; i < nlayers; i++) {
+    state->replicas[i].state = state;
+    state->replicas[i].layer = i;
+  }
+  pthread_mutex_init(&state->replica_mutex, NULL);
+  pthread_cond_init(&state->replica_progress, NULL);
+}
+
+void replication_destroy(DemultiplexerState *state, int nlayers) {
+  for (int i = 0; i < nlayers; i++) {
+    DemultiplexerStalePath *stale = state->replicas[i].stale;
+    while (stale) {
+      DemultiplexerStalePath *next = stale->next;
+      free(stale->path);
+      free(stale);
+      stale = next;
+    }
+  }
+  for (int i = 0; i < fd_table_end(&state->fds); i++) {
+    DemultiplexerFd *master = demultiplexer_fd(state, i);
+    if (master) {
+      free(master->path);
+      master->path = NULL;
+    }
+  }
+  pthread_cond_destroy(&state->replica_progress);
+  pthread_mutex_destroy(&state->replica_mutex);
+}
+
+ssize_t replicate_write(DemultiplexerState *state, int fd,
+                        const struct iovec *iov, int iovcnt, off_t offset,
+                        LayerContext l) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  size_t nbyte = iov_length(iov, iovcnt);
+  ReplayWrite *write = calloc(1, sizeof(ReplayWrite));
+  void *data = buffer_pool_get(state->scratch, nbyte);
+  if (!write || !data) {
+    ERROR_MSG("[DEMULTIPLEXER_PWRITE] Failed to allocate a replicated write");
+    free(write);
+    buffer_pool_put(state->scratch, data);
+    errno = ENOMEM;
+    return -1;
+  }
+  iov_gather(iov, iovcnt, data);
+  write->layers = l.next_layers;
+  write->fd = fd;
+  write->data = data;
+  write->nbyte = nbyte;
+  write->offset = offset;
+  write->refs = 1;
+
+  pthread_mutex_lock(&state->replica_mutex);
+  for (int i = 0; i < l.nlayers; i++) {
+    write->layer_fds[i] = master->layer_fds[i];
+    if (state->options[i].passthrough_write ||
+        write->layer_fds[i] == INVALID_FD || master->replay_stale[i]) {
+      continue; // stale layers are repaired on the next open
+    }
+
+    DemultiplexerReplica *replica = &state->replicas[i];
+    if (replica->entries >= DEMULTIPLEXER_REPLAY_MAX_ENTRIES ||
+        replica->bytes + nbyte > DEMULTIPLEXER_REPLAY_MAX_BYTES) {
+      replica->dropped++;
+      mark_stale(state, fd, i);
+      continue;
+    }
+
+    ReplayEntry *entry = &write->entries[i];
+    entry->write = write;
+    entry->next = NULL;
+    if (replica->tail) {
+      replica->tail->next = entry;
+    } else {
+      replica->head = entry;
+    }
+    replica->tail = entry;
+    replica->entries++;
+    replica->bytes += nbyte;
+    master->replay_behind[i]++;
+    write->queued++;
+    write->refs++;
+
+    if (!replica->draining) {
+      replica->draining = 1;
+      if (thread_pool_submit(state->pool, i, &replica->drain, NULL,
+                             drain_replica, replica) != 0) {
+        ERROR_MSG("[DEMULTIPLEXER_PWRITE] Failed to start the replay of "
+                  "layer %d",
+                  i);
+        replica->draining = 0;
+      }
+    }
+  }
+
+  // wait while the quorum is neither reached nor out of reach
+  int quorum = state->write_quorum;
+  while (write->acks < quorum && write->queued - write->failures >= quorum) {
+    pthread_cond_wait(&state->replica_progress, &state->replica_mutex);
+  }
+  ssize_t res = write->result;
+  if (write->acks < quorum) {
+    ERROR_MSG("[DEMULTIPLEXER_PWRITE] Write quorum of %d not reached, %d "
+              "layers applied the write",
+              quorum, write->acks);
+    res = -1;
+    errno = write->error ? write->error : EIO;
+  }
+  release_write(state, write);
+  pthread_mutex_unlock(&state->replica_mutex);
+
+  return res;
+}
+
+void wait_for_replication(DemultiplexerState *state, int fd, int nlayers) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  if (state->write_quorum == 0) {
+    return;
+  }
+  pthread_mutex_lock(&state->replica_mutex);
+  for (int i = 0; i < nlayers; i++) {
+    while (master->replay_behind[i] > 0) {
+      pthread_cond_wait(&state->replica_progress, &state->replica_mutex);
+    }
+  }
+  pthread_mutex_unlock(&state->replica_mutex);
+}
+
+void lagging_layers(DemultiplexerState *state, int fd, int nlayers,
+                    bool *lagging) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  if (state->write_quorum == 0) {
+    for (int i = 0; i < nlayers; i++) {
+      lagging[i] = false;
+    }
+    return;
+  }
+  pthread_mutex_lock(&state->replica_mutex);
+  for (int i = 0; i < nlayers; i++) {
+    lagging[i] = master->replay_behind[i] > 0 || master->replay_stale[i];
+  }
+  pthread_mutex_unlock(&state->replica_mutex);
+}
+
+void stale_layers(DemultiplexerState *state, const char *path, int nlayers,
+                  bool *stale) {
+  pthread_mutex_lock(&state->replica_mutex);
+  for (int i = 0; i < nlayers; i++) {
+    stale[i] = path && is_stale(&state->replicas[i], path);
+  }
+  pthread_mutex_unlock(&state->replica_mutex);
+}
+
+void set_layer_stale(DemultiplexerState *state, int fd, int layer,
+                     bool stale) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  pthread_mutex_lock(&state->replica_mutex);
+  if (stale) {
+    mark_stale(state, fd, layer);
+  } else {
+    master->replay_stale[layer] = false;
+    if (master->path) {
+      clear_stale(&state->replicas[layer], master->path);
+    }
+  }
+  pthread_mutex_unlock(&state->replica_mutex);
+}
+
+/**
+ * @brief Copy the content of fd from the source layer to a stale layer
+ *
+ * @param state    -> demultiplexer state
+ * @param fd       -> master file descriptor
+ * @param source   -> layer to copy from
+ * @param target   -> stale layer
+ * @param l        -> context of the demultiplexer layer
+ * @return int     -> 0 on success, -1 on failure
+ */
+static int repair_layer(DemultiplexerState *state, int fd, int source,
+                        int target, LayerContext l) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  LayerContext *from = &l.next_layers[source];
+  LayerContext *to = &l.next_layers[target];
+  int from_fd = master->layer_fds[source];
+  int to_fd = master->layer_fds[target];
+
+  struct stat stbuf;
+  if (from->ops->lfstat(from_fd, &stbuf, *from) != 0) {
+    return -1;
+  }
+
+  void *chunk =
+      buffer_pool_get(state->scratch, DEMULTIPLEXER_REPAIR_CHUNK_SIZE);
+  if (!chunk) {
+    return -1;
+  }
+  int res = 0;
+  off_t offset = 0;
+  while (offset < stbuf.st_size) {
+    ssize_t n = from->ops->lpread(from_fd, chunk,
+                                  DEMULTIPLEXER_REPAIR_CHUNK_SIZE, offset,
+                                  *from);
+    if (n <= 0) {
+      res = n < 0 ? -1 : 0; // a shorter file than fstat said
+      break;
+    }
+    if (to->ops->lpwrite(to_fd, chunk, n, offset, *to) != n) {
+      res = -1;
+      break;
+    }
+    offset += n;
+  }
+  buffer_pool_put(state->scratch, chunk);
+
+  if (res == 0 && to->ops->lftruncate(to_fd, offset, *to) != 0) {
+    res = -1;
+  }
+  return res;
+}
+
+void track_replicated_file(DemultiplexerState *state, const char *pathname,
+                           int flags, int fd, LayerContext l) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  char *path = strdup(pathname);
+  if (!path) {
+    ERROR_MSG("[DEMULTIPLEXER_OPEN] Failed to record the path of %s",
+              pathname);
+  }
+
+  int stale[MAX_LAYERS];
+  int source = -1;
+  pthread_mutex_lock(&state->replica_mutex);
+  free(master->path);
+  master->path = path;
+  if (state->write_quorum == 0) {
+    pthread_mutex_unlock(&state->replica_mutex);
+    return;
+  }
+  for (int i = 0; i < l.nlayers; i++) {
+    master->replay_stale[i] = false;
+    stale[i] = is_stale(&state->replicas[i], pathname);
+    if (stale[i] && (flags & O_TRUNC)) {
+      // truncated on every layer, nothing left to repair
+      clear_stale(&state->replicas[i], pathname);
+      stale[i] = 0;
+    }
+    if (!stale[i] && source < 0 && !state->options[i].passthrough_write &&
+        master->layer_fds[i] != INVALID_FD) {
+      source = i;
+    }
+  }
+  pthread_mutex_unlock(&state->replica_mutex);
+
+  for (int i = 0; i < l.nlayers; i++) {
+    if (!stale[i]) {
+      continue;
+    }
+    int res = -1;
+    if (source >= 0 && master->layer_fds[i] != INVALID_FD) {
+      res = repair_layer(state, fd, source, i, l);
+    }
+
+    pthread_mutex_lock(&state->replica_mutex);
+    if (res == 0) {
+      clear_stale(&state->replicas[i], pathname);
+      INFO_MSG("[DEMULTIPLEXER_OPEN] Repaired %s on layer %d from layer %d",
+               pathname, i, source);
+    } else {
+      // keep it out of reads and writes until a later open repairs it
+      master->replay_stale[i] = true;
+      WARN_MSG("[DEMULTIPLEXER_OPEN] Failed to repair %s on layer %d",
+               pathname, i);
+    }
+    pthread_mutex_unlock(&state->replica_mutex);
+  }
+}
+
+void forget_replicated_file(DemultiplexerState *state, int fd, int nlayers) {
+  DemultiplexerFd *master = demultiplexer_fd(state, fd);
+  pthread_mutex_lock(&state->replica_mutex);
+  for (int i = 0; i < nlayers; i++) {
+    master->replay_stale[i] = false;
+  }
+  free(master->path);
+  master->path = NULL;
+  pthread_mutex_unlock(&state->replica_mutex);
+}
+
+/**
+ * @brief Replication lag of a next layer in write quorum mode
+ *
+ * @param l        -> context of the demultiplexer layer
+ * @param layer    -> index of the next layer
+ * @param lag      -> filled with the lag of the layer
+ * @return int     -> 0 on success, -1 if layer is not a next layer
+ */
+int demultiplexer_replica_lag(LayerContext l, int layer,
+                              DemultiplexerReplicaLag *lag) {
+  DemultiplexerState *state = (DemultiplexerState *)l.internal_state;
+  if (layer < 0 || layer >= l.nlayers || !lag) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&state->replica_mutex);
+  DemultiplexerReplica *replica = &state->replicas[layer];
+  lag->entries = replica->entries;
+  lag->bytes = replica->bytes;
+  lag->applied = replica->applied;
+  lag->failed = replica->failed;
+  lag->dropped = replica->dropped;
+  lag->stale = replica->n_stale;
+  pthread_mutex_unlock(&state->replica_mutex);
+
+  return 0;
+}
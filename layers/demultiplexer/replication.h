@@ -0,0 +1,112 @@
+#ifndef __REPLICATION_H__
+#define __REPLICATION_H__
+
+#include "../../shared/types/layer_context.h"
+#include "demultiplexer.h"
+
+/**
+ * @brief Initialize the replay logs and the replication state
+ *
+ * @param state         -> demultiplexer state
+ * @param nlayers       -> number of next layers
+ * @param write_quorum  -> acknowledgements a write waits for, 0 to write the
+ * layers synchronously
+ */
+void replication_init(DemultiplexerState *state, int nlayers,
+                      int write_quorum);
+
+/**
+ * @brief Free the replication state, once the replay logs are drained
+ *
+ * @param state         -> demultiplexer state
+ * @param nlayers       -> number of next layers
+ */
+void replication_destroy(DemultiplexerState *state, int nlayers);
+
+/**
+ * @brief Write through the replay logs and wait for the write quorum
+ *
+ * The write is queued on the log of every layer storing writes; it returns
+ * once write_quorum layers applied it, the others apply it in the background.
+ *
+ * @param state         -> demultiplexer state
+ * @param fd            -> master file descriptor
+ * @param iov           -> buffers to write, copied into the replay logs
+ * @param iovcnt        -> number of buffers
+ * @param offset        -> offset value
+ * @param l             -> context of the demultiplexer layer
+ * @return ssize_t      -> number of written bytes of the first layer that
+ * applied the write, -1 if the quorum cannot be reached
+ */
+ssize_t replicate_write(DemultiplexerState *state, int fd,
+                        const struct iovec *iov, int iovcnt, off_t offset,
+                        LayerContext l);
+
+/**
+ * @brief Wait until every layer applied the queued writes of fd
+ *
+ * @param state         -> demultiplexer state
+ * @param fd            -> master file descriptor
+ * @param nlayers       -> number of next layers
+ */
+void wait_for_replication(DemultiplexerState *state, int fd, int nlayers);
+
+/**
+ * @brief Find the layers that miss acknowledged writes of fd
+ *
+ * @param state         -> demultiplexer state
+ * @param fd            -> master file descriptor
+ * @param nlayers       -> number of next layers
+ * @param lagging       -> set to whether each layer has queued or lost
+ * writes of fd
+ */
+void lagging_layers(DemultiplexerState *state, int fd, int nlayers,
+                    bool *lagging);
+
+/**
+ * @brief Find the layers a file missed writes on
+ *
+ * @param state         -> demultiplexer state
+ * @param path          -> path of the file, NULL for none
+ * @param nlayers       -> number of next layers
+ * @param stale         -> set to whether each layer is stale for the file
+ */
+void stale_layers(DemultiplexerState *state, const char *path, int nlayers,
+                  bool *stale);
+
+/**
+ * @brief Record that a layer missed writes of an open file, or that it was
+ * repaired
+ *
+ * @param state         -> demultiplexer state
+ * @param fd            -> master file descriptor
+ * @param layer         -> next layer
+ * @param stale         -> true if the layer missed writes, false once it
+ * holds the file again
+ */
+void set_layer_stale(DemultiplexerState *state, int fd, int layer,
+                     bool stale);
+
+/**
+ * @brief Record the path of an opened file and, in write quorum mode, repair
+ * the layers it is stale on
+ *
+ * @param state         -> demultiplexer state
+ * @param pathname      -> path of the opened file
+ * @param flags         -> flags of the open
+ * @param fd            -> master file descriptor
+ * @param l             -> context of the demultiplexer layer
+ */
+void track_replicated_file(DemultiplexerState *state, const char *pathname,
+                           int flags, int fd, LayerContext l);
+
+/**
+ * @brief Forget the replication state of a closed file
+ *
+ * @param state         -> demultiplexer state
+ * @param fd            -> master file descriptor
+ * @param nlayers       -> number of next layers
+ */
+void forget_replicated_file(DemultiplexerState *state, int fd, int nlayers);
+
+#endif // __REPLICATION_H__
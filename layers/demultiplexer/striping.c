@@ -0,0 +1,338 @@
+#include "striping.h"
+#include "../../logdef.h"
+#include "../../shared/utils/layer_iov.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * ============================================================================
+ * DEMULTIPLEXER STRIPED LAYOUT
+ * ============================================================================
+ *
+ * With layout = "striped", a file is cut in stripe units of stripe_size
+ * bytes and unit k is stored on layer k % N, at offset (k / N) * stripe_size
+ * of the layer's file. Each layer holds a contiguous part of every request,
+ * so a request costs one preadv/pwritev per layer, over slices of the
+ * caller's buffers, and the layers run in parallel on their pool queues.
+ *
+ * There is no redundancy: every layer is enforced and any failure fails the
+ * request. A layer's file is as long as its last unit, so a read past the
+ * end of some layers' files still returns the data of the others, the holes
+ * in between reading as zeros, and fstat reports the logical size.
+ * ============================================================================
+ */
+
+// Position in the caller's buffers
+typedef struct {
+  const struct iovec *iov;
+  int index;
+  size_t skip; // Bytes of iov[index] already taken
+} IovCursor;
+
+off_t stripe_logical_offset(size_t stripe_size, int nlayers, int layer,
+                            off_t local) {
+  off_t unit = local / (off_t)stripe_size;
+  return (unit * nlayers + layer) * (off_t)stripe_size +
+         local % (off_t)stripe_size;
+}
+
+// Append the next len bytes of the caller's buffers to the slices of job
+static void take_slices(IovCursor *cursor, StripeJob *job, size_t len) {
+  while (len > 0) {
+    const struct iovec *src = &cursor->iov[cursor->index];
+    size_t n = src->iov_len - cursor->skip;
+    if (n > len) {
+      n = len;
+    }
+    if (n > 0) {
+      job->iov[job->iovcnt].iov_base = (char *)src->iov_base + cursor->skip;
+      job->iov[job->iovcnt].iov_len = n;
+      job->iovcnt++;
+      job->nbyte += n;
+      cursor->skip += n;
+      len -= n;
+    }
+    if (cursor->skip == src->iov_len) {
+      cursor->index++;
+      cursor->skip = 0;
+    }
+  }
+}
+
+off_t stripe_layer_length(size_t stripe_size, int nlayers, int layer,
+                          off_t length) {
+  off_t unit_size = (off_t)stripe_size;
+  off_t units = length / unit_size;        // complete units
+  off_t rest = length % unit_size;         // bytes of the last unit
+  int last_layer = (int)(units % nlayers); // layer of the last unit
+  return units / nlayers * unit_size + (layer < last_layer ? unit_size : 0) +
+         (layer == last_layer ? rest : 0);
+}
+
+off_t stripe_logical_size(size_t stripe_size, int nlayers, int layer,
+                          off_t local_size) {
+  if (local_size <= 0) {
+    return 0;
+  }
+  return stripe_logical_offset(stripe_size, nlayers, layer, local_size - 1) +
+         1;
+}
+
+struct iovec *stripe_split_request(DemultiplexerState *state, StripeJob *jobs,
+                                   StripeOp op, int nlayers,
+                                   const struct iovec *iov, int iovcnt,
+                                   off_t offset, LayerContext l) {
+  size_t stripe_size = state->stripe_size;
+  off_t end = offset + (off_t)iov_length(iov, iovcnt);
+
+  // a job gets a slice per unit, and one more per buffer boundary
+  off_t first_unit = offset / (off_t)stripe_size;
+  size_t units = 0;
+  if (end > offset) {
+    units = (size_t)((end - 1) / (off_t)stripe_size - first_unit + 1);
+  }
+  size_t capacity = units / nlayers + 1 + (size_t)iovcnt;
+  struct iovec *slices = malloc(sizeof(struct iovec) * capacity * nlayers);
+  if (!slices) {
+    return NULL;
+  }
+
+  for (int i = 0; i < nlayers; i++) {
+    memset(&jobs[i], 0, sizeof(StripeJob));
+    jobs[i].op = op;
+    jobs[i].layer = &l.next_layers[i];
+    jobs[i].iov = slices + capacity * i;
+  }
+
+  IovCursor cursor = {.iov = iov, .index = 0, .skip = 0};
+  off_t pos = offset;
+  while (pos < end) {
+    off_t unit = pos / (off_t)stripe_size;
+    off_t within = pos % (off_t)stripe_size;
+    size_t len = stripe_size - (size_t)within;
+    if ((off_t)len > end - pos) {
+      len = (size_t)(end - pos);
+    }
+    StripeJob *job = &jobs[unit % nlayers];
+    if (job->nbyte == 0) {
+      job->offset = (unit / nlayers) * (off_t)stripe_size + within;
+    }
+    take_slices(&cursor, job, len);
+    pos += (off_t)len;
+  }
+  return slices;
+}
+
+void *stripe_run_job(void *arg) {
+  StripeJob *job = arg;
+  LayerContext layer = *job->layer;
+
+  if (job->op == STRIPE_TRUNCATE) {
+    job->result = layer.ops->lftruncate(job->layer_fd, job->offset, layer);
+    job->error = job->result < 0 ? errno : 0;
+    return NULL;
+  }
+
+  size_t done = 0;
+  for (int i = 0; i < job->iovcnt;) {
+    int n = job->iovcnt - i;
+    if (n > LAYER_IOV_MAX) {
+      n = LAYER_IOV_MAX;
+    }
+    size_t len = iov_length(job->iov + i, n);
+    off_t offset = job->offset + (off_t)done;
+    ssize_t res =
+        job->op == STRIPE_WRITE
+            ? layer_pwritev(job->layer_fd, job->iov + i, n, offset, layer)
+            : layer_preadv(job->layer_fd, job->iov + i, n, offset, layer);
+    if (res < 0) {
+      job->result = -1;
+      job->error = errno;
+      return NULL;
+    }
+    done += (size_t)res;
+    if ((size_t)res < len) {
+      break;
+    }
+    i += n;
+  }
+  job->result = (ssize_t)done;
+  return NULL;
+}
+
+void stripe_run_jobs(DemultiplexerState *state, StripeJob *jobs,
+                     const bool *active, int nlayers) {
+  int n_active = 0;
+  int last = -1;
+  for (int i = 0; i < nlayers; i++) {
+    if (active[i]) {
+      n_active++;
+      last = i;
+    }
+  }
+  if (n_active == 1) {
+    stripe_run_job(&jobs[last]);
+    return;
+  }
+
+  ThreadPoolBatch batch;
+  thread_pool_batch_init(&batch);
+  for (int i = 0; i < nlayers; i++) {
+    if (active[i] && thread_pool_submit(state->pool, i, &jobs[i].task, &batch,
+                                        stripe_run_job, &jobs[i]) != 0) {
+      stripe_run_job(&jobs[i]);
+    }
+  }
+  thread_pool_wait(state->pool, &batch);
+}
+
+void stripe_zero_unread(const StripeJob *job) {
+  size_t skip = job->result > 0 ? (size_t)job->result : 0;
+  for (int i = 0; i < job->iovcnt; i++) {
+    size_t len = job->iov[i].iov_len;
+    if (skip >= len) {
+      skip -= len;
+      continue;
+    }
+    memset((char *)job->iov[i].iov_base + skip, 0, len - skip);
+    skip = 0;
+  }
+}
+
+ssize_t striped_preadv(DemultiplexerState *state, const int *layer_fds,
+                       const struct iovec *iov, int iovcnt, off_t offset,
+                       LayerContext l) {
+  int nlayers = l.nlayers;
+  StripeJob jobs[nlayers];
+  struct iovec *slices = stripe_split_request(state, jobs, STRIPE_READ,
+                                              nlayers, iov, iovcnt, offset, l);
+  if (!slices) {
+    ERROR_MSG("[DEMULTIPLEXER_STRIPED_READ] Failed to allocate the slices");
+    errno = ENOMEM;
+    return -1;
+  }
+
+  bool active[nlayers];
+  for (int i = 0; i < nlayers; i++) {
+    jobs[i].layer_fd = layer_fds[i];
+    active[i] = jobs[i].nbyte > 0;
+  }
+  stripe_run_jobs(state, jobs, active, nlayers);
+
+  // the file ends at the last byte a layer returned
+  off_t end = offset;
+  for (int i = 0; i < nlayers; i++) {
+    if (!active[i]) {
+      continue;
+    }
+    if (jobs[i].result < 0) {
+      free(slices);
+      errno = jobs[i].error;
+      return -1;
+    }
+    if (jobs[i].result > 0) {
+      off_t layer_end = stripe_logical_size(state->stripe_size, nlayers, i,
+                                            jobs[i].offset + jobs[i].result);
+      if (layer_end > end) {
+        end = layer_end;
+      }
+    }
+  }
+  for (int i = 0; i < nlayers; i++) {
+    if (active[i] && (size_t)jobs[i].result < jobs[i].nbyte) {
+      stripe_zero_unread(&jobs[i]);
+    }
+  }
+
+  free(slices);
+  return (ssize_t)(end - offset);
+}
+
+ssize_t striped_pwritev(DemultiplexerState *state, const int *layer_fds,
+                        const struct iovec *iov, int iovcnt, off_t offset,
+                        LayerContext l) {
+  int nlayers = l.nlayers;
+  StripeJob jobs[nlayers];
+  struct iovec *slices = stripe_split_request(state, jobs, STRIPE_WRITE,
+                                              nlayers, iov, iovcnt, offset, l);
+  if (!slices) {
+    ERROR_MSG("[DEMULTIPLEXER_STRIPED_WRITE] Failed to allocate the slices");
+    errno = ENOMEM;
+    return -1;
+  }
+
+  bool active[nlayers];
+  for (int i = 0; i < nlayers; i++) {
+    jobs[i].layer_fd = layer_fds[i];
+    active[i] = jobs[i].nbyte > 0;
+  }
+  stripe_run_jobs(state, jobs, active, nlayers);
+
+  // the write is complete up to the first byte a layer did not write
+  off_t end = offset + (off_t)iov_length(iov, iovcnt);
+  for (int i = 0; i < nlayers; i++) {
+    if (!active[i]) {
+      continue;
+    }
+    if (jobs[i].result < 0) {
+      free(slices);
+      errno = jobs[i].error;
+      return -1;
+    }
+    if ((size_t)jobs[i].result < jobs[i].nbyte) {
+      off_t missing = stripe_logical_offset(state->stripe_size, nlayers, i,
+                                            jobs[i].offset + jobs[i].result);
+      if (missing < end) {
+        end = missing;
+      }
+    }
+  }
+
+  free(slices);
+  return (ssize_t)(end - offset);
+}
+
+int striped_ftruncate(DemultiplexerState *state, const int *layer_fds,
+                      off_t length, LayerContext l) {
+  int nlayers = l.nlayers;
+  StripeJob jobs[nlayers];
+  bool active[nlayers];
+  for (int i = 0; i < nlayers; i++) {
+    memset(&jobs[i], 0, sizeof(StripeJob));
+    jobs[i].op = STRIPE_TRUNCATE;
+    jobs[i].layer = &l.next_layers[i];
+    jobs[i].layer_fd = layer_fds[i];
+    jobs[i].offset =
+        stripe_layer_length(state->stripe_size, nlayers, i, length);
+    active[i] = true;
+  }
+  stripe_run_jobs(state, jobs, active, nlayers);
+
+  for (int i = 0; i < nlayers; i++) {
+    if (jobs[i].result < 0) {
+      errno = jobs[i].error;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void striped_stat(DemultiplexerState *state, int nlayers,
+                  struct stat *const *stbufs, struct stat *stbuf) {
+  off_t size = 0;
+  blkcnt_t blocks = 0;
+  for (int i = 0; i < nlayers; i++) {
+    if (!stbufs[i]) {
+      continue;
+    }
+    blocks += stbufs[i]->st_blocks;
+    off_t end = stripe_logical_size(state->stripe_size, nlayers, i,
+                                    stbufs[i]->st_size);
+    if (end > size) {
+      size = end;
+    }
+  }
+  stbuf->st_size = size;
+  stbuf->st_blocks = blocks;
+}
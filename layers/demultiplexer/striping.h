@@ -0,0 +1,167 @@
+#ifndef __STRIPING_H__
+#define __STRIPING_H__
+
+#include "../../shared/types/layer_context.h"
+#include "demultiplexer.h"
+#include <sys/stat.h>
+
+typedef enum {
+  STRIPE_READ,
+  STRIPE_WRITE,
+  STRIPE_TRUNCATE,
+} StripeOp;
+
+// The I/O of one layer for a request
+typedef struct {
+  ThreadPoolTask task;
+  StripeOp op;
+  LayerContext *layer;
+  int layer_fd;
+  struct iovec *iov; // Slices of the caller's buffers, in layer order
+  int iovcnt;
+  size_t nbyte;   // Bytes of iov
+  off_t offset;   // Offset in the layer, or length of a truncate
+  ssize_t result; // Bytes transferred, or result of the truncate
+  int error;      // errno of a failure
+} StripeJob;
+
+/**
+ * @brief Logical offset of a byte of a layer's file
+ *
+ * @param stripe_size -> bytes of a stripe unit
+ * @param nlayers     -> number of layers the file is striped over
+ * @param layer       -> layer of the byte
+ * @param local       -> offset of the byte in the layer's file
+ * @return off_t      -> offset of the byte in the striped file
+ */
+off_t stripe_logical_offset(size_t stripe_size, int nlayers, int layer,
+                            off_t local);
+
+/**
+ * @brief Logical size a layer's file accounts for
+ *
+ * @param stripe_size -> bytes of a stripe unit
+ * @param nlayers     -> number of layers the file is striped over
+ * @param layer       -> layer of the file
+ * @param local_size  -> size of the layer's file
+ * @return off_t      -> end of the layer's last byte in the striped file
+ */
+off_t stripe_logical_size(size_t stripe_size, int nlayers, int layer,
+                          off_t local_size);
+
+/**
+ * @brief Length of a layer's file for a striped file of length bytes
+ *
+ * @param stripe_size -> bytes of a stripe unit
+ * @param nlayers     -> number of layers the file is striped over
+ * @param layer       -> layer of the file
+ * @param length      -> length of the striped file
+ * @return off_t      -> length of the layer's share
+ */
+off_t stripe_layer_length(size_t stripe_size, int nlayers, int layer,
+                          off_t length);
+
+/**
+ * @brief Split a request in the jobs of the first nlayers next layers
+ *
+ * @param state   -> demultiplexer state
+ * @param jobs    -> one job per layer, set up here but for their layer_fd
+ * @param op      -> STRIPE_READ or STRIPE_WRITE
+ * @param nlayers -> number of layers the file is striped over
+ * @param iov     -> caller's buffers
+ * @param iovcnt  -> number of buffers
+ * @param offset  -> logical offset
+ * @param l       -> context of the demultiplexer layer
+ * @return struct iovec* -> storage of the slices, to free once the jobs
+ * completed, NULL on allocation failure
+ */
+struct iovec *stripe_split_request(DemultiplexerState *state, StripeJob *jobs,
+                                   StripeOp op, int nlayers,
+                                   const struct iovec *iov, int iovcnt,
+                                   off_t offset, LayerContext l);
+
+/**
+ * @brief Run the I/O of one job, in chunks of at most LAYER_IOV_MAX buffers
+ *
+ * @param arg    -> the StripeJob
+ * @return void* -> NULL, the result is left in the job
+ */
+void *stripe_run_job(void *arg);
+
+/**
+ * @brief Run the active jobs in parallel, job i on the pool queue of layer i
+ *
+ * A single job runs on the calling thread.
+ *
+ * @param state   -> demultiplexer state
+ * @param jobs    -> one job per layer
+ * @param active  -> whether each job has work
+ * @param nlayers -> number of jobs
+ */
+void stripe_run_jobs(DemultiplexerState *state, StripeJob *jobs,
+                     const bool *active, int nlayers);
+
+/**
+ * @brief Zero the slices of a read job past the bytes it read
+ *
+ * @param job -> completed read job
+ */
+void stripe_zero_unread(const StripeJob *job);
+
+/**
+ * @brief Read a striped file, every layer reading its stripe units at once
+ *
+ * @param state         -> demultiplexer state
+ * @param layer_fds     -> fd of each next layer
+ * @param iov           -> buffers to read into
+ * @param iovcnt        -> number of buffers
+ * @param offset        -> logical offset
+ * @param l             -> context of the demultiplexer layer
+ * @return ssize_t      -> number of read bytes, up to the last byte any layer
+ * returned (the holes before it read as zeros), -1 if a layer failed
+ */
+ssize_t striped_preadv(DemultiplexerState *state, const int *layer_fds,
+                       const struct iovec *iov, int iovcnt, off_t offset,
+                       LayerContext l);
+
+/**
+ * @brief Write a striped file, every layer writing its stripe units at once
+ *
+ * @param state         -> demultiplexer state
+ * @param layer_fds     -> fd of each next layer
+ * @param iov           -> buffers to write
+ * @param iovcnt        -> number of buffers
+ * @param offset        -> logical offset
+ * @param l             -> context of the demultiplexer layer
+ * @return ssize_t      -> number of written bytes, up to the first stripe unit
+ * a layer wrote short, -1 if a layer failed
+ */
+ssize_t striped_pwritev(DemultiplexerState *state, const int *layer_fds,
+                        const struct iovec *iov, int iovcnt, off_t offset,
+                        LayerContext l);
+
+/**
+ * @brief Truncate every layer to its share of a striped file
+ *
+ * @param state         -> demultiplexer state
+ * @param layer_fds     -> fd of each next layer
+ * @param length        -> logical length
+ * @param l             -> context of the demultiplexer layer
+ * @return int          -> 0 on success, -1 if a layer failed
+ */
+int striped_ftruncate(DemultiplexerState *state, const int *layer_fds,
+                      off_t length, LayerContext l);
+
+/**
+ * @brief Turn the stats of the layers' stripes into the stat of the file
+ *
+ * @param state         -> demultiplexer state
+ * @param nlayers       -> number of next layers
+ * @param stbufs        -> stat of each layer's stripe
+ * @param stbuf         -> stat of a layer, its size and blocks set to the
+ * file's
+ */
+void striped_stat(DemultiplexerState *state, int nlayers,
+                  struct stat *const *stbufs, struct stat *stbuf);
+
+#endif // __STRIPING_H__
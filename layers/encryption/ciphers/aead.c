@@ -0,0 +1,188 @@
+#include "aead.h"
+#include <limits.h>
+#include <openssl/err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct AeadThreadContext {
+  EVP_CIPHER_CTX *encrypt;
+  EVP_CIPHER_CTX *decrypt;
+  AeadKey *key;
+  struct AeadThreadContext *next;
+};
+
+static void thread_context_free(AeadThreadContext *ctx) {
+  EVP_CIPHER_CTX_free(ctx->encrypt);
+  EVP_CIPHER_CTX_free(ctx->decrypt);
+  free(ctx);
+}
+
+// pthread key destructor: a thread exits, drop its contexts from the key
+static void thread_context_release(void *arg) {
+  AeadThreadContext *ctx = arg;
+  AeadKey *key = ctx->key;
+  pthread_mutex_lock(&key->mutex);
+  AeadThreadContext **link = &key->threads;
+  while (*link && *link != ctx) {
+    link = &(*link)->next;
+  }
+  if (*link) {
+    *link = ctx->next;
+  }
+  pthread_mutex_unlock(&key->mutex);
+  thread_context_free(ctx);
+}
+
+static EVP_CIPHER_CTX *keyed_template(aead_cipher_t cipher,
+                                      const unsigned char *key, int encrypt) {
+  const EVP_CIPHER *evp_cipher = cipher == AEAD_AES_256_GCM
+                                     ? EVP_aes_256_gcm()
+                                     : EVP_chacha20_poly1305();
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  if (!ctx) {
+    return NULL;
+  }
+  if (1 != EVP_CipherInit_ex(ctx, evp_cipher, NULL, NULL, NULL, encrypt) ||
+      1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_IVLEN, AEAD_NONCE_SIZE,
+                               NULL) ||
+      1 != EVP_CipherInit_ex(ctx, NULL, NULL, key, NULL, encrypt)) {
+    ERR_print_errors_fp(stderr);
+    EVP_CIPHER_CTX_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+AeadKey *aead_key_init(aead_cipher_t cipher, const unsigned char *key) {
+  AeadKey *aead_key = calloc(1, sizeof(AeadKey));
+  if (!aead_key) {
+    return NULL;
+  }
+  aead_key->encrypt_template = keyed_template(cipher, key, 1);
+  aead_key->decrypt_template = keyed_template(cipher, key, 0);
+  if (!aead_key->encrypt_template || !aead_key->decrypt_template ||
+      pthread_mutex_init(&aead_key->mutex, NULL) != 0) {
+    EVP_CIPHER_CTX_free(aead_key->encrypt_template);
+    EVP_CIPHER_CTX_free(aead_key->decrypt_template);
+    free(aead_key);
+    return NULL;
+  }
+  if (pthread_key_create(&aead_key->thread_key, thread_context_release) !=
+      0) {
+    pthread_mutex_destroy(&aead_key->mutex);
+    EVP_CIPHER_CTX_free(aead_key->encrypt_template);
+    EVP_CIPHER_CTX_free(aead_key->decrypt_template);
+    free(aead_key);
+    return NULL;
+  }
+  return aead_key;
+}
+
+void aead_key_free(AeadKey *key) {
+  if (!key) {
+    return;
+  }
+  // No destructor runs once the pthread key is deleted
+  pthread_key_delete(key->thread_key);
+  AeadThreadContext *ctx = key->threads;
+  while (ctx) {
+    AeadThreadContext *next = ctx->next;
+    thread_context_free(ctx);
+    ctx = next;
+  }
+  pthread_mutex_destroy(&key->mutex);
+  EVP_CIPHER_CTX_free(key->encrypt_template);
+  EVP_CIPHER_CTX_free(key->decrypt_template);
+  free(key);
+}
+
+/**
+ * @brief Get the calling thread's keyed context, copying the template on
+ * first use
+ */
+static EVP_CIPHER_CTX *thread_context_get(AeadKey *key, int encrypt) {
+  AeadThreadContext *ctx = pthread_getspecific(key->thread_key);
+  if (!ctx) {
+    ctx = calloc(1, sizeof(AeadThreadContext));
+    if (!ctx) {
+      return NULL;
+    }
+    ctx->key = key;
+    if (pthread_setspecific(key->thread_key, ctx) != 0) {
+      free(ctx);
+      return NULL;
+    }
+    pthread_mutex_lock(&key->mutex);
+    ctx->next = key->threads;
+    key->threads = ctx;
+    pthread_mutex_unlock(&key->mutex);
+  }
+
+  EVP_CIPHER_CTX **slot = encrypt ? &ctx->encrypt : &ctx->decrypt;
+  if (!*slot) {
+    EVP_CIPHER_CTX *copy = EVP_CIPHER_CTX_new();
+    if (!copy ||
+        1 != EVP_CIPHER_CTX_copy(copy, encrypt ? key->encrypt_template
+                                               : key->decrypt_template)) {
+      ERR_print_errors_fp(stderr);
+      EVP_CIPHER_CTX_free(copy);
+      return NULL;
+    }
+    *slot = copy;
+  }
+  return *slot;
+}
+
+static int aead_crypt(AeadKey *key, const unsigned char *nonce,
+                      const unsigned char *aad, size_t aad_len,
+                      const unsigned char *in, size_t len, unsigned char *out,
+                      unsigned char *tag, int encrypt) {
+  if (len > INT_MAX || aad_len > INT_MAX) {
+    ERROR_MSG("[ENCRYPTION_LAYER] AEAD block of %zu bytes is too large", len);
+    return -1;
+  }
+  EVP_CIPHER_CTX *ctx = thread_context_get(key, encrypt);
+  if (!ctx) {
+    return -1;
+  }
+
+  // Only the nonce is set, the key of the context is kept
+  int out_len = 0;
+  if (1 != EVP_CipherInit_ex(ctx, NULL, NULL, NULL, nonce, -1) ||
+      (aad_len > 0 &&
+       1 != EVP_CipherUpdate(ctx, NULL, &out_len, aad, (int)aad_len)) ||
+      (len > 0 && 1 != EVP_CipherUpdate(ctx, out, &out_len, in, (int)len))) {
+    ERR_print_errors_fp(stderr);
+    return -1;
+  }
+  if (!encrypt && 1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG,
+                                           AEAD_TAG_SIZE, tag)) {
+    ERR_print_errors_fp(stderr);
+    return -1;
+  }
+  // Decryption fails here when the tag does not match
+  if (1 != EVP_CipherFinal_ex(ctx, out + len, &out_len)) {
+    return -1;
+  }
+  if (encrypt && 1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG,
+                                          AEAD_TAG_SIZE, tag)) {
+    ERR_print_errors_fp(stderr);
+    return -1;
+  }
+  return 0;
+}
+
+int aead_seal(AeadKey *key, const unsigned char *nonce,
+              const unsigned char *aad, size_t aad_len,
+              const unsigned char *in, size_t len, unsigned char *out,
+              unsigned char *tag) {
+  return aead_crypt(key, nonce, aad, aad_len, in, len, out, tag, 1);
+}
+
+int aead_open(AeadKey *key, const unsigned char *nonce,
+              const unsigned char *aad, size_t aad_len,
+              const unsigned char *in, size_t len, unsigned char *out,
+              const unsigned char *tag) {
+  return aead_crypt(key, nonce, aad, aad_len, in, len, out,
+                    (unsigned char *)tag, 0);
+}
@@ -0,0 +1,83 @@
+#ifndef __AEAD_H__
+#define __AEAD_H__
+
+#include "../../../logdef.h"
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AEAD_KEY_SIZE 32   // 256 bit keys for both ciphers
+#define AEAD_NONCE_SIZE 12 // 96 bit nonces
+#define AEAD_TAG_SIZE 16   // 128 bit tags
+
+typedef enum {
+  AEAD_CHACHA20_POLY1305,
+  AEAD_AES_256_GCM,
+} aead_cipher_t;
+
+/**
+ * @brief Pre-keyed AEAD contexts of an encryption key
+ *
+ * Same scheme as AesXtsKey: the key is set once in template contexts, each
+ * thread copies them on first use and a block only sets its nonce.
+ */
+typedef struct AeadThreadContext AeadThreadContext;
+
+typedef struct {
+  EVP_CIPHER_CTX *encrypt_template;
+  EVP_CIPHER_CTX *decrypt_template;
+  pthread_key_t thread_key;   // AeadThreadContext of the calling thread
+  pthread_mutex_t mutex;      // protects threads
+  AeadThreadContext *threads; // contexts of all threads, freed with the key
+} AeadKey;
+
+/**
+ * @brief Expand an encryption key into pre-keyed contexts
+ *
+ * @param cipher -> AEAD algorithm
+ * @param key    -> AEAD_KEY_SIZE bytes
+ * @return AeadKey* -> keyed contexts, or NULL on error
+ */
+AeadKey *aead_key_init(aead_cipher_t cipher, const unsigned char *key);
+
+/**
+ * @brief Free the contexts of a key, of every thread that used it
+ *
+ * @warning No thread may use the key anymore.
+ *
+ * @param key -> key to free (may be NULL)
+ */
+void aead_key_free(AeadKey *key);
+
+/**
+ * @brief Encrypt a block and compute its tag
+ *
+ * in and out may be the same buffer.
+ *
+ * @param key     -> keyed contexts
+ * @param nonce   -> AEAD_NONCE_SIZE bytes, never reused with the key
+ * @param aad     -> additional data authenticated with the block
+ * @param aad_len -> bytes of additional data
+ * @param in      -> block to encrypt
+ * @param len     -> bytes of the block
+ * @param out     -> receives len encrypted bytes
+ * @param tag     -> receives AEAD_TAG_SIZE bytes
+ * @return int    -> 0 on success, -1 on error
+ */
+int aead_seal(AeadKey *key, const unsigned char *nonce,
+              const unsigned char *aad, size_t aad_len,
+              const unsigned char *in, size_t len, unsigned char *out,
+              unsigned char *tag);
+
+/**
+ * @brief Decrypt a block and check its tag, see aead_seal
+ *
+ * @return int -> 0 if the block is authentic, -1 otherwise
+ */
+int aead_open(AeadKey *key, const unsigned char *nonce,
+              const unsigned char *aad, size_t aad_len,
+              const unsigned char *in, size_t len, unsigned char *out,
+              const unsigned char *tag);
+
+#endif
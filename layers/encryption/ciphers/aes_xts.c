@@ -1,9 +1,11 @@
 #include "aes_xts.h"
 #include <assert.h>
+#include <limits.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/types.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 // XTS does not support streaming (EncryptUpdate once per EncryptInit)
@@ -79,3 +81,172 @@ int aes_xts_decrypt(const unsigned char *key, const unsigned char *iv,
                     unsigned char *data) {
   return aes_xts_crypt(key, iv, encrypted_data, encrypted_data_len, data, 0);
 }
+
+struct AesXtsThreadContext {
+  EVP_CIPHER_CTX *encrypt;
+  EVP_CIPHER_CTX *decrypt;
+  AesXtsKey *key;
+  struct AesXtsThreadContext *next;
+};
+
+static void thread_context_free(AesXtsThreadContext *ctx) {
+  EVP_CIPHER_CTX_free(ctx->encrypt);
+  EVP_CIPHER_CTX_free(ctx->decrypt);
+  free(ctx);
+}
+
+// pthread key destructor: a thread exits, drop its contexts from the key
+static void thread_context_release(void *arg) {
+  AesXtsThreadContext *ctx = arg;
+  AesXtsKey *key = ctx->key;
+  pthread_mutex_lock(&key->mutex);
+  AesXtsThreadContext **link = &key->threads;
+  while (*link && *link != ctx) {
+    link = &(*link)->next;
+  }
+  if (*link) {
+    *link = ctx->next;
+  }
+  pthread_mutex_unlock(&key->mutex);
+  thread_context_free(ctx);
+}
+
+static EVP_CIPHER_CTX *keyed_template(const unsigned char *key, int encrypt) {
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  if (!ctx) {
+    return NULL;
+  }
+  if (1 != EVP_CipherInit_ex(ctx, EVP_aes_256_xts(), NULL, key, NULL,
+                             encrypt)) {
+    ERR_print_errors_fp(stderr);
+    EVP_CIPHER_CTX_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+AesXtsKey *aes_xts_key_init(const unsigned char *key) {
+  AesXtsKey *xts_key = calloc(1, sizeof(AesXtsKey));
+  if (!xts_key) {
+    return NULL;
+  }
+  xts_key->encrypt_template = keyed_template(key, 1);
+  xts_key->decrypt_template = keyed_template(key, 0);
+  if (!xts_key->encrypt_template || !xts_key->decrypt_template ||
+      pthread_mutex_init(&xts_key->mutex, NULL) != 0) {
+    EVP_CIPHER_CTX_free(xts_key->encrypt_template);
+    EVP_CIPHER_CTX_free(xts_key->decrypt_template);
+    free(xts_key);
+    return NULL;
+  }
+  if (pthread_key_create(&xts_key->thread_key, thread_context_release) != 0) {
+    pthread_mutex_destroy(&xts_key->mutex);
+    EVP_CIPHER_CTX_free(xts_key->encrypt_template);
+    EVP_CIPHER_CTX_free(xts_key->decrypt_template);
+    free(xts_key);
+    return NULL;
+  }
+  return xts_key;
+}
+
+void aes_xts_key_free(AesXtsKey *key) {
+  if (!key) {
+    return;
+  }
+  // No destructor runs once the pthread key is deleted
+  pthread_key_delete(key->thread_key);
+  AesXtsThreadContext *ctx = key->threads;
+  while (ctx) {
+    AesXtsThreadContext *next = ctx->next;
+    thread_context_free(ctx);
+    ctx = next;
+  }
+  pthread_mutex_destroy(&key->mutex);
+  EVP_CIPHER_CTX_free(key->encrypt_template);
+  EVP_CIPHER_CTX_free(key->decrypt_template);
+  free(key);
+}
+
+/**
+ * @brief Get the calling thread's keyed context, copying the template on
+ * first use
+ */
+static EVP_CIPHER_CTX *thread_context_get(AesXtsKey *key, int encrypt) {
+  AesXtsThreadContext *ctx = pthread_getspecific(key->thread_key);
+  if (!ctx) {
+    ctx = calloc(1, sizeof(AesXtsThreadContext));
+    if (!ctx) {
+      return NULL;
+    }
+    ctx->key = key;
+    if (pthread_setspecific(key->thread_key, ctx) != 0) {
+      free(ctx);
+      return NULL;
+    }
+    pthread_mutex_lock(&key->mutex);
+    ctx->next = key->threads;
+    key->threads = ctx;
+    pthread_mutex_unlock(&key->mutex);
+  }
+
+  EVP_CIPHER_CTX **slot = encrypt ? &ctx->encrypt : &ctx->decrypt;
+  if (!*slot) {
+    EVP_CIPHER_CTX *copy = EVP_CIPHER_CTX_new();
+    if (!copy ||
+        1 != EVP_CIPHER_CTX_copy(copy, encrypt ? key->encrypt_template
+                                               : key->decrypt_template)) {
+      ERR_print_errors_fp(stderr);
+      EVP_CIPHER_CTX_free(copy);
+      return NULL;
+    }
+    *slot = copy;
+  }
+  return *slot;
+}
+
+static int aes_xts_crypt_sectors(AesXtsKey *key, uint64_t first_sector,
+                                 size_t sector_size, const unsigned char *in,
+                                 size_t len, unsigned char *out, int encrypt) {
+  if (sector_size < 16 || sector_size > INT_MAX) {
+    ERROR_MSG("[ENCRYPTION_LAYER] Invalid sector size %zu", sector_size);
+    return -1;
+  }
+  EVP_CIPHER_CTX *ctx = thread_context_get(key, encrypt);
+  if (!ctx) {
+    return -1;
+  }
+
+  uint64_t sector = first_sector;
+  for (size_t done = 0; done < len; done += sector_size, sector++) {
+    int in_len = (int)(len - done < sector_size ? len - done : sector_size);
+    if (in_len < 16) {
+      ERROR_MSG("[ENCRYPTION_LAYER] Every block must have at least 16 bytes. "
+                "Got %d bytes.",
+                in_len);
+      return -1;
+    }
+    unsigned char iv[AES_XTS_IV_SIZE] = {0};
+    memcpy(iv, &sector, sizeof(uint64_t));
+
+    // Only the tweak is set, the key schedule of the context is kept
+    int out_len = 0;
+    if (1 != EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1) ||
+        1 != EVP_CipherUpdate(ctx, out + done, &out_len, in + done, in_len)) {
+      ERR_print_errors_fp(stderr);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int aes_xts_encrypt_sectors(AesXtsKey *key, uint64_t first_sector,
+                            size_t sector_size, const unsigned char *in,
+                            size_t len, unsigned char *out) {
+  return aes_xts_crypt_sectors(key, first_sector, sector_size, in, len, out, 1);
+}
+
+int aes_xts_decrypt_sectors(AesXtsKey *key, uint64_t first_sector,
+                            size_t sector_size, const unsigned char *in,
+                            size_t len, unsigned char *out) {
+  return aes_xts_crypt_sectors(key, first_sector, sector_size, in, len, out, 0);
+}
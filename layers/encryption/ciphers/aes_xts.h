@@ -2,7 +2,30 @@
 #define __AES_XTS_H__
 
 #include "../../../logdef.h"
+#include <openssl/evp.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#define AES_XTS_KEY_SIZE 64 // 2 * 32 byte keys
+#define AES_XTS_IV_SIZE 16  // AES block size
+
+/**
+ * @brief Pre-keyed AES-256-XTS contexts of an encryption key
+ *
+ * The key schedule is expanded once, into template contexts, and every thread
+ * gets its own copy of them on first use. A request then only resets the
+ * tweak of each sector, the contexts stay keyed across calls.
+ */
+typedef struct AesXtsThreadContext AesXtsThreadContext;
+
+typedef struct {
+  EVP_CIPHER_CTX *encrypt_template;
+  EVP_CIPHER_CTX *decrypt_template;
+  pthread_key_t thread_key;     // AesXtsThreadContext of the calling thread
+  pthread_mutex_t mutex;        // protects threads
+  AesXtsThreadContext *threads; // contexts of all threads, freed with the key
+} AesXtsKey;
 
 int aes_xts_encrypt(const unsigned char *key, const unsigned char *iv,
                     const unsigned char *data, int data_len,
@@ -12,4 +35,47 @@ int aes_xts_decrypt(const unsigned char *key, const unsigned char *iv,
                     const unsigned char *encrypted_data, int encrypted_data_len,
                     unsigned char *data);
 
+/**
+ * @brief Expand an encryption key into pre-keyed contexts
+ *
+ * @param key -> AES_XTS_KEY_SIZE bytes
+ * @return AesXtsKey* -> keyed contexts, or NULL on error
+ */
+AesXtsKey *aes_xts_key_init(const unsigned char *key);
+
+/**
+ * @brief Free the contexts of a key, of every thread that used it
+ *
+ * @warning No thread may use the key anymore.
+ *
+ * @param key -> key to free (may be NULL)
+ */
+void aes_xts_key_free(AesXtsKey *key);
+
+/**
+ * @brief Encrypt consecutive sectors in one call
+ *
+ * Sector i of the buffer is encrypted with the tweak first_sector + i; the
+ * last sector may be shorter than sector_size but not than 16 bytes.
+ * in and out may be the same buffer.
+ *
+ * @param key          -> keyed contexts
+ * @param first_sector -> sector number of the start of the buffer
+ * @param sector_size  -> bytes per sector
+ * @param in           -> data to encrypt
+ * @param len          -> bytes to encrypt
+ * @param out          -> receives len encrypted bytes
+ * @return int         -> 0 on success, -1 on error
+ */
+int aes_xts_encrypt_sectors(AesXtsKey *key, uint64_t first_sector,
+                            size_t sector_size, const unsigned char *in,
+                            size_t len, unsigned char *out);
+
+/**
+ * @brief Decrypt consecutive sectors in one call, see aes_xts_encrypt_sectors
+ */
+int aes_xts_decrypt_sectors(AesXtsKey *key, uint64_t first_sector,
+                            size_t sector_size, const unsigned char *in,
+                            size_t len, unsigned char *out);
+
 #endif
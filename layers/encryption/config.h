@@ -2,14 +2,28 @@
 #define __ENCRYPTION_CONFIG_H__
 
 #include "../../config/utils.h"
+#include "ciphers/aead.h"
+#include <strings.h>
+
+typedef enum {
+  ENCRYPTION_MODE_XTS,  // AES-256-XTS, confidentiality only
+  ENCRYPTION_MODE_AEAD, // authenticated blocks, tags in a sidecar tag file
+} encryption_mode_t;
+
+#define ENCRYPTION_DEFAULT_KEY_TTL 3600      // one hour
+#define ENCRYPTION_DEFAULT_KEY_WAIT_MS 30000 // 30 seconds
 
 typedef struct {
   int block_size;
+  encryption_mode_t mode;
+  aead_cipher_t cipher; // aead mode only
   char *next_layer;
   char *encryption_key;
   char *api_key;
   char *vault_addr;
   char *secret_path;
+  long key_ttl;     // seconds a Vault key is cached when it has no lease
+  long key_wait_ms; // time I/O waits for the first fetch of a Vault key
 } EncryptionConfig;
 
 /**
@@ -36,6 +50,34 @@ static inline void encryption_parse_params(toml_datum_t layer_table,
     toml_error("Invalid block_size field");
   }
 
+  // Parse mode (optional, defaults to xts)
+  config->mode = ENCRYPTION_MODE_XTS;
+  toml_datum_t mode = toml_get(layer_table, "mode");
+  if (mode.type == TOML_STRING) {
+    if (strcasecmp(mode.u.str.ptr, "xts") == 0) {
+      config->mode = ENCRYPTION_MODE_XTS;
+    } else if (strcasecmp(mode.u.str.ptr, "aead") == 0) {
+      config->mode = ENCRYPTION_MODE_AEAD;
+    } else {
+      toml_error("Encryption layer has unsupported mode (use 'xts' or "
+                 "'aead')");
+    }
+  }
+
+  // Parse cipher (optional, aead mode only)
+  config->cipher = AEAD_CHACHA20_POLY1305;
+  toml_datum_t cipher = toml_get(layer_table, "cipher");
+  if (cipher.type == TOML_STRING) {
+    if (strcasecmp(cipher.u.str.ptr, "chacha20-poly1305") == 0) {
+      config->cipher = AEAD_CHACHA20_POLY1305;
+    } else if (strcasecmp(cipher.u.str.ptr, "aes-256-gcm") == 0) {
+      config->cipher = AEAD_AES_256_GCM;
+    } else {
+      toml_error("Encryption layer has unsupported cipher (use "
+                 "'chacha20-poly1305' or 'aes-256-gcm')");
+    }
+  }
+
   // Initialize optional fields
   config->api_key = NULL;
   config->vault_addr = NULL;
@@ -60,6 +102,25 @@ static inline void encryption_parse_params(toml_datum_t layer_table,
     config->secret_path = parse_string(secret_path);
   }
 
+  // Vault key cache (optional)
+  config->key_ttl = ENCRYPTION_DEFAULT_KEY_TTL;
+  toml_datum_t key_ttl = toml_get(layer_table, "key_ttl");
+  if (key_ttl.type == TOML_INT64) {
+    if (key_ttl.u.int64 <= 0) {
+      toml_error("Encryption layer key_ttl must be positive");
+    }
+    config->key_ttl = (long)key_ttl.u.int64;
+  }
+
+  config->key_wait_ms = ENCRYPTION_DEFAULT_KEY_WAIT_MS;
+  toml_datum_t key_wait_ms = toml_get(layer_table, "key_wait_ms");
+  if (key_wait_ms.type == TOML_INT64) {
+    if (key_wait_ms.u.int64 < 0) {
+      toml_error("Encryption layer key_wait_ms must not be negative");
+    }
+    config->key_wait_ms = (long)key_wait_ms.u.int64;
+  }
+
   // Check for encryption key (optional - either this or api_key must be
   // provided)
   toml_datum_t encryption_key = toml_get(layer_table, "encryption_key");
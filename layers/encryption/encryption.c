@@ -1,7 +1,13 @@
+#define _GNU_SOURCE
 #include "encryption.h"
 #include "../../logdef.h"
+#include "../../shared/utils/layer_iov.h"
 #include "ciphers/aes_xts.h"
 #include <curl/curl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -67,9 +73,23 @@ static char *extract_key_from_json(const char *json) {
   return key;
 }
 
-// Fetch encryption key from Vault server
+// Lease of the secret in the JSON response, 0 if it has none
+static long extract_lease_from_json(const char *json) {
+  const char *lease = strstr(json, "\"lease_duration\":");
+  if (!lease) {
+    return 0;
+  }
+  long seconds = strtol(lease + strlen("\"lease_duration\":"), NULL, 10);
+  return seconds > 0 ? seconds : 0;
+}
+
+static void curl_init_once(void) { curl_global_init(CURL_GLOBAL_DEFAULT); }
+
+// Fetch encryption key from Vault server, run by the key cache refresh thread
 static char *fetch_key_from_vault(const char *vault_addr, const char *api_key,
-                                  const char *secret_path) {
+                                  const char *secret_path,
+                                  long *lease_seconds) {
+  static pthread_once_t curl_once = PTHREAD_ONCE_INIT;
   CURL *curl;
   CURLcode res;
   struct MemoryStruct chunk;
@@ -78,13 +98,14 @@ static char *fetch_key_from_vault(const char *vault_addr, const char *api_key,
   chunk.memory = malloc(1);
   chunk.size = 0;
 
-  curl_global_init(CURL_GLOBAL_DEFAULT);
+  // curl_global_init is not thread safe, and the refresh threads of several
+  // secrets may fetch at the same time
+  pthread_once(&curl_once, curl_init_once);
   curl = curl_easy_init();
 
   if (!curl) {
     ERROR_MSG("[ENCRYPTION] Failed to initialize curl");
     free(chunk.memory);
-    curl_global_cleanup();
     return NULL;
   }
 
@@ -127,6 +148,7 @@ static char *fetch_key_from_vault(const char *vault_addr, const char *api_key,
       DEBUG_MSG(
           "[ENCRYPTION] Successfully retrieved encryption key from Vault");
       encryption_key = extract_key_from_json(chunk.memory);
+      *lease_seconds = extract_lease_from_json(chunk.memory);
     } else {
       ERROR_MSG("[ENCRYPTION] HTTP request failed with code: %ld", http_code);
       ERROR_MSG("[ENCRYPTION] Response: %s", chunk.memory);
@@ -136,12 +158,65 @@ static char *fetch_key_from_vault(const char *vault_addr, const char *api_key,
   // Cleanup
   curl_slist_free_all(headers);
   curl_easy_cleanup(curl);
+  // the response holds the key
+  OPENSSL_cleanse(chunk.memory, chunk.size);
   free(chunk.memory);
-  curl_global_cleanup();
 
   return encryption_key;
 }
 
+// Expand a key into the cipher contexts of the mode
+static int setup_ciphers(EncryptionState *state, const char *key) {
+  if (state->mode == ENCRYPTION_MODE_AEAD) {
+    // The AEAD key is the SHA-256 of the whole key
+    unsigned char raw_key[AEAD_KEY_SIZE];
+    if (1 == EVP_Digest(key, strlen(key), raw_key, NULL, EVP_sha256(), NULL)) {
+      state->aead_key = aead_key_init(state->cipher, raw_key);
+    }
+    OPENSSL_cleanse(raw_key, sizeof(raw_key));
+    return state->aead_key ? 0 : -1;
+  }
+  // The cipher uses the first AES_XTS_KEY_SIZE bytes of the key, zero padded
+  unsigned char raw_key[AES_XTS_KEY_SIZE] = {0};
+  size_t key_len = strlen(key);
+  memcpy(raw_key, key, key_len < AES_XTS_KEY_SIZE ? key_len : AES_XTS_KEY_SIZE);
+  state->xts_key = aes_xts_key_init(raw_key);
+  OPENSSL_cleanse(raw_key, sizeof(raw_key));
+  return state->xts_key ? 0 : -1;
+}
+
+/**
+ * @brief Set up the ciphers on first use of a layer keyed from Vault
+ *
+ * Waits up to key_wait_ms for the key cache to fetch the key.
+ *
+ * @return int -> 0 once the ciphers are ready, -1 with errno EIO otherwise
+ */
+static int ensure_ciphers(EncryptionState *state) {
+  if (__atomic_load_n(&state->keyed, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  pthread_mutex_lock(&state->key_mutex);
+  if (!state->keyed) {
+    char key[KEY_CACHE_MAX_KEY_SIZE];
+    if (key_cache_get(state->vault_key, state->key_wait_ms, key,
+                      sizeof(key)) < 0) {
+      ERROR_MSG("[ENCRYPTION] No encryption key from Vault yet");
+    } else if (setup_ciphers(state, key) != 0) {
+      ERROR_MSG("[ENCRYPTION] Failed to set up the cipher contexts");
+    } else {
+      __atomic_store_n(&state->keyed, 1, __ATOMIC_RELEASE);
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+  }
+  int res = state->keyed ? 0 : -1;
+  pthread_mutex_unlock(&state->key_mutex);
+  if (res != 0) {
+    errno = EIO;
+  }
+  return res;
+}
+
 LayerContext encryption_init(LayerContext *next_layer,
                              const EncryptionConfig *config) {
   LayerContext layer_state;
@@ -154,51 +229,66 @@ LayerContext encryption_init(LayerContext *next_layer,
   }
 
   state->block_size = config->block_size;
-
-  // Determine the encryption key source
-  char *key_to_use = NULL;
-  int should_free_key = 0;
+  state->key = NULL;
+  state->mode = config->mode;
+  state->cipher = config->cipher;
+  state->xts_key = NULL;
+  state->aead_key = NULL;
+  fd_table_init(&state->tag_fds, sizeof(int), NULL);
+  state->vault_key = NULL;
+  state->key_wait_ms = config->key_wait_ms;
+  state->keyed = 0;
+  pthread_mutex_init(&state->key_mutex, NULL);
+  // aligned, so ciphertext of aligned requests can go to O_DIRECT files
+  state->buffers = buffer_pool_shared();
 
   if (config->api_key) {
-    // Fetch the key from Vault
+    // The key is fetched from Vault in the background, shared with the
+    // layers using the same secret, and set up on first use
+    long ttl =
+        config->key_ttl > 0 ? config->key_ttl : ENCRYPTION_DEFAULT_KEY_TTL;
     DEBUG_MSG("[ENCRYPTION] Fetching encryption key from Vault using API key");
-    key_to_use = fetch_key_from_vault(config->vault_addr, config->api_key,
-                                      config->secret_path);
-    if (!key_to_use) {
-      ERROR_MSG("[ENCRYPTION] Failed to fetch encryption key from Vault. "
+    state->vault_key = key_cache_acquire(config->vault_addr, config->api_key,
+                                         config->secret_path, ttl * 1000,
+                                         fetch_key_from_vault);
+    if (!state->vault_key) {
+      ERROR_MSG("[ENCRYPTION] Failed to set up the Vault key cache. "
                 "Initialization failed.");
       free(state);
       exit(1);
     }
-    should_free_key = 1;
   } else if (config->encryption_key) {
     // Use the provided key directly
-    key_to_use = config->encryption_key;
+    state->key = (const unsigned char *)strdup(config->encryption_key);
+    if (!state->key) {
+      ERROR_MSG("[ENCRYPTION] Failed to allocate memory for encryption key");
+      free(state);
+      exit(1);
+    }
+    if (setup_ciphers(state, (const char *)state->key) != 0) {
+      ERROR_MSG("[ENCRYPTION] Failed to set up the cipher contexts");
+      free((void *)state->key);
+      free(state);
+      exit(1);
+    }
+    state->keyed = 1;
   } else {
     ERROR_MSG("[ENCRYPTION] No encryption key or API key provided");
     free(state);
     exit(1);
   }
 
-  state->key = (const unsigned char *)strdup(key_to_use);
-
-  // Free the fetched key if we allocated it
-  if (should_free_key) {
-    free(key_to_use);
-  }
-
-  if (!state->key) {
-    ERROR_MSG("[ENCRYPTION] Failed to allocate memory for encryption key");
-    free(state);
-    exit(1);
-  }
-
   layer_state.internal_state = state;
 
   // LayerOps definition
-  LayerOps *encryption_ops = malloc(sizeof(LayerOps));
+  LayerOps *encryption_ops = calloc(1, sizeof(LayerOps));
   encryption_ops->lpread = encryption_pread;
   encryption_ops->lpwrite = encryption_pwrite;
+  // AEAD blocks carry their own tags, no digests are offered to upper layers
+  if (state->mode == ENCRYPTION_MODE_XTS) {
+    encryption_ops->lpread_digest = encryption_pread_digest;
+    encryption_ops->lpwrite_digest = encryption_pwrite_digest;
+  }
   encryption_ops->lopen = encryption_open;
   encryption_ops->lclose = encryption_close;
   encryption_ops->lfsync = encryption_fsync;
@@ -220,135 +310,492 @@ LayerContext encryption_init(LayerContext *next_layer,
   return layer_state;
 }
 
-ssize_t encryption_pread(int fd, void *buffer, size_t nbyte, off_t offset,
-                         LayerContext l) {
+// Sector number of an offset: the tweak of a block is its position in the
+// file, the layer below block_align always sees aligned offsets
+static uint64_t first_sector(const EncryptionState *state, off_t offset) {
+  return (uint64_t)offset / (uint64_t)state->block_size;
+}
+
+// Hash the blocks of a buffer into digest->digests, starting at block first
+static int digest_blocks(const LayerDigest *digest, size_t first,
+                         const unsigned char *data, size_t len) {
+  unsigned char *out = (unsigned char *)digest->digests;
+  const size_t step = digest->block_size;
+  for (size_t done = 0; done < len; done += step, first++) {
+    size_t n = len - done < step ? len - done : step;
+    if (digest->hash_block(data + done, n, out + first * digest->digest_size,
+                           digest->arg) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Encrypt or decrypt a request, hashing its plaintext on the way
+ *
+ * With a digest whose blocks are whole sectors, each digest block is hashed
+ * right before it is encrypted, or right after it is decrypted, while it is
+ * still in cache. Other digest block sizes are hashed in a second pass.
+ */
+static int crypt_request(EncryptionState *state, off_t offset,
+                         const unsigned char *in, size_t len,
+                         unsigned char *out, int encrypt,
+                         const LayerDigest *digest) {
+  int (*crypt)(AesXtsKey *, uint64_t, size_t, const unsigned char *, size_t,
+               unsigned char *) =
+      encrypt ? aes_xts_encrypt_sectors : aes_xts_decrypt_sectors;
+  const size_t sector_size = (size_t)state->block_size;
+  const uint64_t sector = first_sector(state, offset);
+  if (digest && digest->block_size == 0) {
+    return -1;
+  }
+
+  if (!digest || digest->block_size % sector_size != 0) {
+    if (digest && encrypt && digest_blocks(digest, 0, in, len) != 0) {
+      return -1;
+    }
+    if (crypt(state->xts_key, sector, sector_size, in, len, out) != 0) {
+      return -1;
+    }
+    return digest && !encrypt ? digest_blocks(digest, 0, out, len) : 0;
+  }
+
+  const size_t step = digest->block_size;
+  const uint64_t sectors_per_step = step / sector_size;
+  size_t block = 0;
+  for (size_t done = 0; done < len; done += step, block++) {
+    size_t n = len - done < step ? len - done : step;
+    if (encrypt && digest_blocks(digest, block, in + done, n) != 0) {
+      return -1;
+    }
+    if (crypt(state->xts_key, sector + block * sectors_per_step, sector_size,
+              in + done, n, out + done) != 0) {
+      return -1;
+    }
+    if (!encrypt && digest_blocks(digest, block, out + done, n) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static ssize_t encryption_read(int fd, void *buffer, size_t nbyte,
+                               off_t offset, const LayerDigest *digest,
+                               LayerContext l) {
+  EncryptionState *state = (EncryptionState *)l.internal_state;
+  if (ensure_ciphers(state) != 0) {
+    return -1;
+  }
+
+  // ciphertext has the same size as the plaintext: read it into the caller
+  // buffer and decrypt it in place
+  ssize_t res =
+      l.next_layers->ops->lpread(fd, buffer, nbyte, offset, *l.next_layers);
+  if (res <= 0) {
+    return res;
+  }
+
+  if (crypt_request(state, offset, buffer, (size_t)res, buffer, 0, digest) !=
+      0) {
+    return -1;
+  }
+  return res;
+}
+
+static ssize_t encryption_write(int fd, const void *buffer, size_t nbyte,
+                                off_t offset, const LayerDigest *digest,
+                                LayerContext l) {
   ssize_t res;
   EncryptionState *state = (EncryptionState *)l.internal_state;
+  if (ensure_ciphers(state) != 0) {
+    return -1;
+  }
 
-  void *encrypted_buffer = malloc(nbyte);
+  // allocate space for encrypted data
+  void *encrypted_buffer = buffer_pool_get(state->buffers, nbyte);
   if (!encrypted_buffer) {
     return -1;
   }
 
-  // issue a read to the next layer to get the encrypted content -> ciphertext
-  // has the same size as the original text
-  res = l.next_layers->ops->lpread(fd, encrypted_buffer, nbyte, offset,
-                                   *l.next_layers);
+  if (crypt_request(state, offset, buffer, nbyte, encrypted_buffer, 1,
+                    digest) != 0) {
+    buffer_pool_put(state->buffers, encrypted_buffer);
+    return -1;
+  }
 
-  if (res <= 0) {
-    free(encrypted_buffer);
-    return res;
+  res = l.next_layers->ops->lpwrite(fd, encrypted_buffer, nbyte, offset,
+                                    *l.next_layers);
+
+  buffer_pool_put(state->buffers, encrypted_buffer);
+  return res;
+}
+
+static void put_u32(unsigned char *dst, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    dst[i] = (unsigned char)(value >> (8 * i));
   }
+}
+
+static uint32_t get_u32(const unsigned char *src) {
+  uint32_t value = 0;
+  for (int i = 3; i >= 0; i--) {
+    value = (value << 8) | src[i];
+  }
+  return value;
+}
 
-  // compute the number of blocks to decrypt based on actual bytes read
-  size_t whole_blocks = res / state->block_size;
-  size_t last_block = res % state->block_size; // int to match cipher types
+// Additional data of a block: its index, little endian
+static void block_aad(uint64_t block, unsigned char *aad) {
+  for (int i = 0; i < 8; i++) {
+    aad[i] = (unsigned char)(block >> (8 * i));
+  }
+}
 
-  // block decryption
-  unsigned char *encrypted_ptr = (unsigned char *)encrypted_buffer;
-  unsigned char *decrypted_ptr = (unsigned char *)buffer;
-  uint64_t block_counter = 0;
+static char *tag_path(const char *path) {
+  size_t len = strlen(path);
+  char *res = malloc(len + sizeof(ENCRYPTION_TAG_SUFFIX));
+  if (!res) {
+    return NULL;
+  }
+  memcpy(res, path, len);
+  memcpy(res + len, ENCRYPTION_TAG_SUFFIX, sizeof(ENCRYPTION_TAG_SUFFIX));
+  return res;
+}
 
-  for (size_t i = 0; i < whole_blocks; i++) {
-    unsigned char iv[16] = {0};
-    memcpy(iv, &block_counter, sizeof(uint64_t));
-    block_counter++;
+static int is_tag_file(const char *name) {
+  size_t len = strlen(name);
+  size_t suffix_len = sizeof(ENCRYPTION_TAG_SUFFIX) - 1;
+  return len > suffix_len &&
+         strcmp(name + len - suffix_len, ENCRYPTION_TAG_SUFFIX) == 0;
+}
 
-    int out_len = aes_xts_decrypt(state->key, iv, encrypted_ptr,
-                                  state->block_size, decrypted_ptr);
-    if (out_len < 0) {
-      free(encrypted_buffer);
-      return -1;
+static int tag_fd_of(const EncryptionState *state, int fd) {
+  const int *tag_fd = fd_table_get(&state->tag_fds, fd);
+  if (!tag_fd || *tag_fd == 0) {
+    ERROR_MSG("[ENCRYPTION] No tag file for fd %d", fd);
+    errno = EBADF;
+    return -1;
+  }
+  return *tag_fd - 1;
+}
+
+// Check that the bytes of a block past its authenticated length are zeros:
+// blocks never written, or the end of a short block the file grew past
+static int is_zero(const unsigned char *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (data[i] != 0) {
+      return 0;
     }
-    decrypted_ptr += state->block_size;
-    encrypted_ptr += state->block_size;
   }
+  return 1;
+}
 
-  // decrypt last partial block if any
-  if (last_block > 0) {
-    unsigned char iv[16] = {0};
-    memcpy(iv, &block_counter, sizeof(uint64_t));
+/**
+ * @brief Encrypt and write whole blocks, then their records in the tag file
+ *
+ * The request must start on a block boundary, as it does below block_align;
+ * only its last block may be short.
+ */
+static ssize_t aead_write(int fd, const void *buffer, size_t nbyte,
+                          off_t offset, LayerContext l) {
+  EncryptionState *state = (EncryptionState *)l.internal_state;
+  const size_t bs = (size_t)state->block_size;
+  if (offset < 0 || (uint64_t)offset % bs != 0) {
+    ERROR_MSG("[ENCRYPTION] aead mode needs block aligned writes, got offset "
+              "%lld",
+              (long long)offset);
+    errno = EINVAL;
+    return -1;
+  }
+  int tag_fd = tag_fd_of(state, fd);
+  if (tag_fd < 0) {
+    return -1;
+  }
+  if (nbyte == 0) {
+    return 0;
+  }
 
-    int out_len = aes_xts_decrypt(state->key, iv, encrypted_ptr,
-                                  (int)last_block, decrypted_ptr);
-    if (out_len < 0) {
-      free(encrypted_buffer);
+  const uint64_t first = (uint64_t)offset / bs;
+  const size_t nblocks = (nbyte + bs - 1) / bs;
+  unsigned char *encrypted = buffer_pool_get(state->buffers, nbyte);
+  unsigned char *records = malloc(nblocks * ENCRYPTION_TAG_RECORD_SIZE);
+  if (!encrypted || !records) {
+    buffer_pool_put(state->buffers, encrypted);
+    free(records);
+    return -1;
+  }
+
+  const unsigned char *in = buffer;
+  for (size_t i = 0; i < nblocks; i++) {
+    size_t n = nbyte - i * bs < bs ? nbyte - i * bs : bs;
+    unsigned char *record = records + i * ENCRYPTION_TAG_RECORD_SIZE;
+    unsigned char aad[8];
+    block_aad(first + i, aad);
+    // a fresh random nonce per block write
+    if (1 != RAND_bytes(record, AEAD_NONCE_SIZE)) {
+      buffer_pool_put(state->buffers, encrypted);
+      free(records);
+      return -1;
+    }
+    put_u32(record + AEAD_NONCE_SIZE, (uint32_t)n);
+    if (aead_seal(state->aead_key, record, aad, sizeof(aad), in + i * bs, n,
+                  encrypted + i * bs, record + AEAD_NONCE_SIZE + 4) != 0) {
+      buffer_pool_put(state->buffers, encrypted);
+      free(records);
       return -1;
     }
   }
 
-  free(encrypted_buffer);
+  const LayerContext *next = l.next_layers;
+  ssize_t res = next->ops->lpwrite(fd, encrypted, nbyte, offset, *next);
+  const size_t records_len = nblocks * ENCRYPTION_TAG_RECORD_SIZE;
+  // The data goes first: a crash in between fails the next read of the
+  // blocks, it never passes stale data as authentic
+  if (res == (ssize_t)nbyte &&
+      next->ops->lpwrite(tag_fd, records, records_len,
+                         (off_t)(first * ENCRYPTION_TAG_RECORD_SIZE),
+                         *next) != (ssize_t)records_len) {
+    ERROR_MSG("[ENCRYPTION] Failed to write the tags of fd %d", fd);
+    res = -1;
+  } else if (res >= 0 && res != (ssize_t)nbyte) {
+    ERROR_MSG("[ENCRYPTION] Short write of fd %d, tags not written", fd);
+    res = -1;
+  }
+  buffer_pool_put(state->buffers, encrypted);
+  free(records);
   return res;
 }
 
-ssize_t encryption_pwrite(int fd, const void *buffer, size_t nbyte,
-                          off_t offset, LayerContext l) {
-  ssize_t res;
-  EncryptionState *state = (EncryptionState *)l.internal_state;
+/**
+ * @brief Check and decrypt the blocks of a read, in place
+ *
+ * @return int -> 0 if all blocks are authentic, -1 otherwise
+ */
+static int aead_open_blocks(EncryptionState *state, uint64_t first,
+                            unsigned char *data, size_t len,
+                            const unsigned char *records) {
+  const size_t bs = (size_t)state->block_size;
+  for (size_t i = 0; i * bs < len; i++) {
+    size_t n = len - i * bs < bs ? len - i * bs : bs;
+    unsigned char *block = data + i * bs;
+    const unsigned char *record = records + i * ENCRYPTION_TAG_RECORD_SIZE;
+    size_t sealed = get_u32(record + AEAD_NONCE_SIZE);
+    unsigned char aad[8];
+    block_aad(first + i, aad);
+    // A block longer than its record was truncated or rewritten
+    if (sealed > n || !is_zero(block + sealed, n - sealed)) {
+      return -1;
+    }
+    if (sealed > 0 &&
+        aead_open(state->aead_key, record, aad, sizeof(aad), block, sealed,
+                  block, record + AEAD_NONCE_SIZE + 4) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
 
-  // allocate space for encrypted data
-  void *encrypted_buffer = malloc(nbyte);
-  if (!encrypted_buffer) {
+/**
+ * @brief Read whole blocks and their records, one read each, and return the
+ * requested bytes once every block checked out
+ */
+static ssize_t aead_read(int fd, void *buffer, size_t nbyte, off_t offset,
+                         LayerContext l) {
+  EncryptionState *state = (EncryptionState *)l.internal_state;
+  const size_t bs = (size_t)state->block_size;
+  int tag_fd = tag_fd_of(state, fd);
+  if (tag_fd < 0 || offset < 0) {
     return -1;
   }
+  if (nbyte == 0) {
+    return 0;
+  }
 
-  size_t whole_blocks = nbyte / state->block_size;
-  size_t last_block = nbyte % state->block_size;
+  // Blocks are authenticated whole: the blocks inside the request are read
+  // and opened in the caller buffer, only a partial first or last block goes
+  // through a bounce block
+  const uint64_t first = (uint64_t)offset / bs;
+  const size_t head = (size_t)((uint64_t)offset % bs);
+  const size_t span = (head + nbyte + bs - 1) / bs * bs;
+  size_t lead = head == 0 ? 0 : bs - head; // caller bytes of the first block
+  if (lead > nbyte) {
+    lead = nbyte;
+  }
+  const size_t whole = (nbyte - lead) / bs * bs; // caller bytes of the others
+  const size_t tail = nbyte - lead - whole;      // caller bytes of the last
+
+  unsigned char *bounce =
+      head != 0 || tail != 0 ? buffer_pool_get(state->buffers, 2 * bs) : NULL;
+  unsigned char *records = calloc(span / bs, ENCRYPTION_TAG_RECORD_SIZE);
+  if ((!bounce && (head != 0 || tail != 0)) || !records) {
+    buffer_pool_put(state->buffers, bounce);
+    free(records);
+    return -1;
+  }
+  struct iovec iov[3];
+  int iovcnt = 0;
+  if (head != 0) {
+    iov[iovcnt++] = (struct iovec){.iov_base = bounce, .iov_len = bs};
+  }
+  if (whole > 0) {
+    iov[iovcnt++] = (struct iovec){.iov_base = (unsigned char *)buffer + lead,
+                                   .iov_len = whole};
+  }
+  if (tail != 0) {
+    iov[iovcnt++] = (struct iovec){.iov_base = bounce + bs, .iov_len = bs};
+  }
 
-  // block encryption
-  unsigned char *decrypted_ptr = (unsigned char *)buffer;
-  unsigned char *encrypted_ptr = (unsigned char *)encrypted_buffer;
-  uint64_t block_counter = 0;
+  const LayerContext *next = l.next_layers;
+  ssize_t res = layer_preadv(fd, iov, iovcnt, (off_t)(first * bs), *next);
+  if (res > 0) {
+    // Records past the end of the tag file stay zero: blocks never written
+    size_t records_len =
+        ((size_t)res + bs - 1) / bs * ENCRYPTION_TAG_RECORD_SIZE;
+    if (next->ops->lpread(tag_fd, records, records_len,
+                          (off_t)(first * ENCRYPTION_TAG_RECORD_SIZE),
+                          *next) < 0) {
+      res = -1;
+    }
+    size_t done = 0; // bytes of the buffers before iov[i]
+    for (int i = 0; res > 0 && i < iovcnt && done < (size_t)res; i++) {
+      size_t len = (size_t)res - done;
+      if (len > iov[i].iov_len) {
+        len = iov[i].iov_len;
+      }
+      const unsigned char *block_records =
+          records + done / bs * ENCRYPTION_TAG_RECORD_SIZE;
+      if (aead_open_blocks(state, first + done / bs, iov[i].iov_base, len,
+                           block_records) != 0) {
+        ERROR_MSG("[ENCRYPTION] Authentication failed reading fd %d at "
+                  "offset %lld",
+                  fd, (long long)offset);
+        errno = EIO;
+        res = -1;
+      }
+      done += len;
+    }
+  }
 
-  for (size_t i = 0; i < whole_blocks; i++) {
-    unsigned char iv[16] = {0};
-    memcpy(iv, &block_counter, sizeof(uint64_t));
-    block_counter++;
+  if (res > 0) {
+    res = (size_t)res > head ? (ssize_t)((size_t)res - head) : 0;
+    if ((size_t)res > nbyte) {
+      res = (ssize_t)nbyte;
+    }
+    // the edges the caller asked for, as far as the file goes
+    if (head != 0) {
+      memcpy(buffer, bounce + head, (size_t)res < lead ? (size_t)res : lead);
+    }
+    if (tail != 0 && (size_t)res > lead + whole) {
+      memcpy((unsigned char *)buffer + lead + whole, bounce + bs,
+             (size_t)res - lead - whole);
+    }
+  }
+  buffer_pool_put(state->buffers, bounce);
+  free(records);
+  return res;
+}
 
-    int out_len = aes_xts_encrypt(state->key, iv, decrypted_ptr,
-                                  state->block_size, encrypted_ptr);
-    if (out_len < 0) {
-      free(encrypted_buffer);
+ssize_t encryption_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                         LayerContext l) {
+  EncryptionState *state = (EncryptionState *)l.internal_state;
+  if (state->mode == ENCRYPTION_MODE_AEAD) {
+    if (ensure_ciphers(state) != 0) {
       return -1;
     }
-    decrypted_ptr += state->block_size;
-    encrypted_ptr += state->block_size;
+    return aead_read(fd, buffer, nbyte, offset, l);
   }
+  return encryption_read(fd, buffer, nbyte, offset, NULL, l);
+}
 
-  // encrypt last partial block if any
-  if (last_block > 0) {
-    unsigned char iv[16] = {0};
-    memcpy(iv, &block_counter, sizeof(uint64_t));
-
-    int out_len = aes_xts_encrypt(state->key, iv, decrypted_ptr,
-                                  (int)last_block, encrypted_ptr);
-    if (out_len < 0) {
-      free(encrypted_buffer);
+ssize_t encryption_pwrite(int fd, const void *buffer, size_t nbyte,
+                          off_t offset, LayerContext l) {
+  EncryptionState *state = (EncryptionState *)l.internal_state;
+  if (state->mode == ENCRYPTION_MODE_AEAD) {
+    if (ensure_ciphers(state) != 0) {
       return -1;
     }
+    return aead_write(fd, buffer, nbyte, offset, l);
   }
+  return encryption_write(fd, buffer, nbyte, offset, NULL, l);
+}
 
-  res = l.next_layers->ops->lpwrite(fd, encrypted_buffer, nbyte, offset,
-                                    *l.next_layers);
+ssize_t encryption_pread_digest(int fd, void *buffer, size_t nbyte,
+                                off_t offset, const LayerDigest *digest,
+                                LayerContext l) {
+  return encryption_read(fd, buffer, nbyte, offset, digest, l);
+}
 
-  free(encrypted_buffer);
-  return res;
+ssize_t encryption_pwrite_digest(int fd, const void *buffer, size_t nbyte,
+                                 off_t offset, const LayerDigest *digest,
+                                 LayerContext l) {
+  return encryption_write(fd, buffer, nbyte, offset, digest, l);
+}
+
+// Open the tag file of a data file opened in aead mode, see
+// ENCRYPTION_TAG_SUFFIX
+static int open_tag_file(EncryptionState *state, int fd, const char *pathname,
+                         int flags, mode_t mode, LayerContext l) {
+  int *slot = fd_table_slot(&state->tag_fds, fd);
+  if (!slot) {
+    ERROR_MSG("[ENCRYPTION] No tag file slot for fd %d", fd);
+    return -1;
+  }
+  char *tpath = tag_path(pathname);
+  if (!tpath) {
+    return -1;
+  }
+  // Writes read no tags, but the tag file is always readable so that the fd
+  // reads back what it wrote
+  int tag_flags = (flags & O_ACCMODE) == O_RDONLY ? O_RDONLY : O_RDWR | O_CREAT;
+  tag_flags |= flags & O_TRUNC;
+  int tag_fd = l.next_layers->ops->lopen(tpath, tag_flags, mode | 0600,
+                                         *l.next_layers);
+  if (tag_fd < 0) {
+    ERROR_MSG("[ENCRYPTION] Failed to open the tag file %s", tpath);
+  } else {
+    *slot = tag_fd + 1;
+  }
+  free(tpath);
+  return tag_fd;
 }
 
 int encryption_open(const char *pathname, int flags, mode_t mode,
                     LayerContext l) {
-  l.next_layers->app_context = l.app_context;
-  return l.next_layers->ops->lopen(pathname, flags, mode, *l.next_layers);
+  EncryptionState *state = (EncryptionState *)l.internal_state;
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  int fd = next_layer.ops->lopen(pathname, flags, mode, next_layer);
+  if (fd < 0 || state->mode != ENCRYPTION_MODE_AEAD) {
+    return fd;
+  }
+  if (open_tag_file(state, fd, pathname, flags, mode, l) < 0) {
+    next_layer.ops->lclose(fd, next_layer);
+    return -1;
+  }
+  return fd;
 }
 
 int encryption_close(int fd, LayerContext l) {
-  l.next_layers->app_context = l.app_context;
-  return l.next_layers->ops->lclose(fd, *l.next_layers);
+  EncryptionState *state = (EncryptionState *)l.internal_state;
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  int *tag_fd = fd_table_get(&state->tag_fds, fd);
+  if (state->mode == ENCRYPTION_MODE_AEAD && tag_fd && *tag_fd != 0) {
+    next_layer.ops->lclose(*tag_fd - 1, next_layer);
+    *tag_fd = 0;
+  }
+  return next_layer.ops->lclose(fd, next_layer);
 }
 
 void encryption_destroy(LayerContext l) {
   EncryptionState *state = (EncryptionState *)l.internal_state;
   if (state) {
+    key_cache_release(state->vault_key);
+    pthread_mutex_destroy(&state->key_mutex);
+    aes_xts_key_free(state->xts_key);
+    aead_key_free(state->aead_key);
+    fd_table_destroy(&state->tag_fds);
     free((void *)state->key);
     free(state);
   }
@@ -373,18 +820,53 @@ int encryption_truncate(const char *path, off_t length, LayerContext l) {
 }
 
 int encryption_fstat(int fd, struct stat *stbuf, LayerContext l) {
-  l.next_layers->app_context = l.app_context;
-  return l.next_layers->ops->lfstat(fd, stbuf, *l.next_layers);
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  return next_layer.ops->lfstat(fd, stbuf, next_layer);
 }
 
 int encryption_lstat(const char *pathname, struct stat *stbuf, LayerContext l) {
-  l.next_layers->app_context = l.app_context;
-  return l.next_layers->ops->llstat(pathname, stbuf, *l.next_layers);
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  return next_layer.ops->llstat(pathname, stbuf, next_layer);
+}
+
+// Remove the tag file of a path, if any
+static void unlink_tag_file(const char *pathname, LayerContext l) {
+  char *tpath = tag_path(pathname);
+  struct stat st;
+  if (tpath && l.next_layers->ops->llstat(tpath, &st, *l.next_layers) == 0) {
+    l.next_layers->ops->lunlink(tpath, *l.next_layers);
+  }
+  free(tpath);
 }
 
 int encryption_unlink(const char *pathname, LayerContext l) {
-  l.next_layers->app_context = l.app_context;
-  return l.next_layers->ops->lunlink(pathname, *l.next_layers);
+  EncryptionState *state = (EncryptionState *)l.internal_state;
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  int res = next_layer.ops->lunlink(pathname, next_layer);
+  if (res == 0 && state->mode == ENCRYPTION_MODE_AEAD) {
+    unlink_tag_file(pathname, l);
+  }
+  return res;
+}
+
+// Wraps the filler of readdir to skip the tag files of the aead mode
+typedef struct {
+  void *buf;
+  int (*filler)(void *buf, const char *name, const struct stat *stbuf,
+                off_t off, unsigned int flags);
+} HideTagFiles;
+
+static int hide_tag_filler(void *buf, const char *name,
+                           const struct stat *stbuf, off_t off,
+                           unsigned int flags) {
+  HideTagFiles *hide = (HideTagFiles *)buf;
+  if (is_tag_file(name)) {
+    return 0;
+  }
+  return hide->filler(hide->buf, name, stbuf, off, flags);
 }
 
 int encryption_readdir(const char *path, void *buf,
@@ -393,23 +875,61 @@ int encryption_readdir(const char *path, void *buf,
                                      unsigned int flags),
                        off_t offset, struct fuse_file_info *fi,
                        unsigned int flags, LayerContext l) {
-  l.next_layers->app_context = l.app_context;
-  return l.next_layers->ops->lreaddir(path, buf, filler, offset, fi, flags,
-                                      *l.next_layers);
+  EncryptionState *state = (EncryptionState *)l.internal_state;
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  if (state->mode == ENCRYPTION_MODE_AEAD) {
+    // Tag files are hidden from the listing
+    HideTagFiles hide = {buf, filler};
+    return next_layer.ops->lreaddir(path, &hide, hide_tag_filler, offset,
+                                    fi, flags, next_layer);
+  }
+  return next_layer.ops->lreaddir(path, buf, filler, offset, fi, flags,
+                                  next_layer);
 }
 
 int encryption_rename(const char *from, const char *to, unsigned int flags,
                       LayerContext l) {
-  l.next_layers->app_context = l.app_context;
-  return l.next_layers->ops->lrename(from, to, flags, *l.next_layers);
+  EncryptionState *state = (EncryptionState *)l.internal_state;
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  int res = next_layer.ops->lrename(from, to, flags, next_layer);
+  if (res != 0 || state->mode != ENCRYPTION_MODE_AEAD) {
+    return res;
+  }
+
+  // The tags follow the data, exchanged files exchange their tag files
+  char *tfrom = tag_path(from);
+  char *tto = tag_path(to);
+  struct stat st;
+  if (tfrom && tto) {
+    if (next_layer.ops->llstat(tfrom, &st, next_layer) == 0) {
+      next_layer.ops->lrename(tfrom, tto, flags, next_layer);
+    } else if (!(flags & RENAME_EXCHANGE)) {
+      unlink_tag_file(to, l);
+    }
+  }
+  free(tfrom);
+  free(tto);
+  return res;
 }
 
 int encryption_chmod(const char *path, mode_t mode, LayerContext l) {
-  l.next_layers->app_context = l.app_context;
-  return l.next_layers->ops->lchmod(path, mode, *l.next_layers);
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  return next_layer.ops->lchmod(path, mode, next_layer);
 }
 
 int encryption_fsync(int fd, int isdatasync, LayerContext l) {
-  l.next_layers->app_context = l.app_context;
-  return l.next_layers->ops->lfsync(fd, isdatasync, *l.next_layers);
+  EncryptionState *state = (EncryptionState *)l.internal_state;
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  int res = next_layer.ops->lfsync(fd, isdatasync, next_layer);
+  if (res == 0 && state->mode == ENCRYPTION_MODE_AEAD) {
+    int tag_fd = tag_fd_of(state, fd);
+    res = tag_fd < 0 ? -1
+                     : next_layer.ops->lfsync(tag_fd, isdatasync,
+                                              next_layer);
+  }
+  return res;
 }
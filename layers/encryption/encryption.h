@@ -2,12 +2,43 @@
 #define __ENCRYPTION_H__
 
 #include "../../shared/types/layer_context.h"
+#include "../../shared/utils/buffer_pool.h"
+#include "../../shared/utils/fd_table.h"
+#include "ciphers/aead.h"
+#include "ciphers/aes_xts.h"
 #include "config.h"
+#include "key_cache.h"
+
+/*
+ * Tag file of the aead mode: the tags of a file, stored next to it in the
+ * next layer with ENCRYPTION_TAG_SUFFIX appended to its path.
+ *
+ *   [record 0]...[record n-1]
+ *
+ * record: nonce (12 bytes) | u32 block length | tag (16 bytes)
+ *
+ * Record i describes block i of the file. The tag authenticates the
+ * ciphertext of the block and its index, so blocks cannot be moved within the
+ * file. A block without a record (length 0) was never written and reads as
+ * zeros.
+ */
+#define ENCRYPTION_TAG_SUFFIX ".tgtag"
+#define ENCRYPTION_TAG_RECORD_SIZE 32
 
 // state struct --- TODO :: check if more state is necessary
 typedef struct {
   int block_size;
-  const unsigned char *key;
+  const unsigned char *key;  // configured key, NULL when fetched from Vault
+  encryption_mode_t mode;
+  aead_cipher_t cipher;      // aead mode cipher
+  AesXtsKey *xts_key;        // pre-keyed cipher contexts of key, xts mode
+  AeadKey *aead_key;         // pre-keyed cipher contexts of key, aead mode
+  FdTable tag_fds;           // tag file fd + 1 of each data fd, 0: none
+  KeyCacheEntry *vault_key;  // shared Vault key, NULL with encryption_key
+  long key_wait_ms;          // I/O wait for the first Vault fetch
+  int keyed;                 // cipher contexts are set up (atomic)
+  pthread_mutex_t key_mutex; // serializes the setup of the contexts
+  BufferPool *buffers;       // ciphertext buffers (buffer_pool_shared())
 } EncryptionState;
 
 LayerContext encryption_init(LayerContext *next_layer,
@@ -16,6 +47,12 @@ ssize_t encryption_pread(int fd, void *buffer, size_t nbyte, off_t offset,
                          LayerContext l);
 ssize_t encryption_pwrite(int fd, const void *buffer, size_t nbyte,
                           off_t offset, LayerContext l);
+ssize_t encryption_pread_digest(int fd, void *buffer, size_t nbyte,
+                                off_t offset, const LayerDigest *digest,
+                                LayerContext l);
+ssize_t encryption_pwrite_digest(int fd, const void *buffer, size_t nbyte,
+                                 off_t offset, const LayerDigest *digest,
+                                 LayerContext l);
 int encryption_open(const char *pathname, int flags, mode_t mode,
                     LayerContext l);
 int encryption_close(int fd, LayerContext l);
@@ -0,0 +1,300 @@
+#include "key_cache.h"
+
+#include "../../logdef.h"
+#include <openssl/crypto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RETRY_MIN_MS 1000  // first retry of a failed fetch
+#define RETRY_MAX_MS 60000 // retries back off up to this
+
+static KeyCacheEntry *registry = NULL; // entries by id
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Wait on the entry condition until a monotonic deadline (mutex held)
+ */
+static void wait_until(KeyCacheEntry *entry, int64_t deadline_ms) {
+  struct timespec deadline = {.tv_sec = deadline_ms / 1000,
+                              .tv_nsec = (deadline_ms % 1000) * 1000000};
+  pthread_cond_timedwait(&entry->cond, &entry->mutex, &deadline);
+}
+
+static size_t key_page_size(void) {
+  long page = sysconf(_SC_PAGESIZE);
+  size_t size = page > 0 ? (size_t)page : 4096;
+  return size < KEY_CACHE_MAX_KEY_SIZE ? KEY_CACHE_MAX_KEY_SIZE : size;
+}
+
+// A page for the key, kept out of swap and of core dumps when allowed
+static char *key_page_alloc(void) {
+  void *page = mmap(NULL, key_page_size(), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED) {
+    return NULL;
+  }
+  if (mlock(page, key_page_size()) != 0) {
+    WARN_MSG("[ENCRYPTION: KEY_CACHE] Could not lock the key page in memory");
+  }
+#ifdef MADV_DONTDUMP
+  madvise(page, key_page_size(), MADV_DONTDUMP);
+#endif
+  return page;
+}
+
+static void key_page_free(char *page) {
+  if (page) {
+    OPENSSL_cleanse(page, key_page_size());
+    munlock(page, key_page_size());
+    munmap(page, key_page_size());
+  }
+}
+
+static void wipe_key(KeyCacheEntry *entry) {
+  OPENSSL_cleanse(entry->key, entry->key_len);
+  entry->key_len = 0;
+}
+
+/**
+ * @brief Store a fetched key and its lease (mutex held)
+ */
+static void store_key(KeyCacheEntry *entry, const char *key, long lease_ms) {
+  size_t len = strlen(key);
+  if (len != entry->key_len || memcmp(entry->key, key, len) != 0) {
+    if (entry->stats.version > 0) {
+      entry->stats.rotations++;
+      INFO_MSG("[ENCRYPTION: KEY_CACHE] Key of %s changed",
+               entry->secret_path);
+    }
+    entry->stats.version++;
+    wipe_key(entry);
+    memcpy(entry->key, key, len + 1);
+    entry->key_len = len;
+  }
+  entry->expires_ms = now_ms() + lease_ms;
+  entry->stats.fetches++;
+  pthread_cond_broadcast(&entry->cond);
+}
+
+/**
+ * @brief Refresh thread: fetches the key, then again before each expiry
+ */
+static void *key_refresher(void *arg) {
+  KeyCacheEntry *entry = arg;
+  long backoff_ms = RETRY_MIN_MS;
+
+  pthread_mutex_lock(&entry->mutex);
+  while (!entry->stopping) {
+    pthread_mutex_unlock(&entry->mutex);
+    long lease_seconds = 0;
+    char *key = entry->fetch(entry->vault_addr, entry->api_key,
+                             entry->secret_path, &lease_seconds);
+    pthread_mutex_lock(&entry->mutex);
+
+    int64_t next_ms;
+    if (key && strlen(key) > 0 && strlen(key) < KEY_CACHE_MAX_KEY_SIZE) {
+      long lease_ms = lease_seconds > 0 ? lease_seconds * 1000 : entry->ttl_ms;
+      store_key(entry, key, lease_ms);
+      next_ms = now_ms() + lease_ms * 2 / 3;
+      backoff_ms = RETRY_MIN_MS;
+    } else {
+      entry->stats.failures++;
+      ERROR_MSG("[ENCRYPTION: KEY_CACHE] Failed to fetch the key of %s, "
+                "retrying in %ld ms",
+                entry->secret_path, backoff_ms);
+      next_ms = now_ms() + backoff_ms;
+      backoff_ms =
+          backoff_ms * 2 > RETRY_MAX_MS ? RETRY_MAX_MS : backoff_ms * 2;
+    }
+    if (key) {
+      OPENSSL_cleanse(key, strlen(key));
+      free(key);
+    }
+
+    while (!entry->stopping && now_ms() < next_ms) {
+      int64_t deadline = next_ms;
+      if (entry->key_len > 0 && entry->expires_ms < deadline) {
+        deadline = entry->expires_ms;
+      }
+      wait_until(entry, deadline);
+      if (entry->key_len > 0 && now_ms() >= entry->expires_ms) {
+        ERROR_MSG("[ENCRYPTION: KEY_CACHE] Lease of the key of %s expired",
+                  entry->secret_path);
+        wipe_key(entry);
+        entry->stats.expired++;
+      }
+    }
+  }
+  pthread_mutex_unlock(&entry->mutex);
+  return NULL;
+}
+
+static void entry_free(KeyCacheEntry *entry) {
+  key_page_free(entry->key);
+  // the id and api_key hold the token
+  if (entry->id) {
+    OPENSSL_cleanse(entry->id, strlen(entry->id));
+  }
+  free(entry->id);
+  free(entry->vault_addr);
+  if (entry->api_key) {
+    OPENSSL_cleanse(entry->api_key, strlen(entry->api_key));
+  }
+  free(entry->api_key);
+  free(entry->secret_path);
+  free(entry);
+}
+
+static char *entry_id(const char *vault_addr, const char *api_key,
+                      const char *secret_path) {
+  size_t len = strlen(vault_addr) + strlen(api_key) + strlen(secret_path) + 3;
+  char *id = malloc(len);
+  if (id) {
+    (void)snprintf(id, len, "%s\n%s\n%s", vault_addr, secret_path, api_key);
+  }
+  return id;
+}
+
+/**
+ * @brief Create an entry and start its refresh thread
+ */
+static KeyCacheEntry *entry_create(char *id, const char *vault_addr,
+                                   const char *api_key,
+                                   const char *secret_path, long ttl_ms,
+                                   key_fetch_fn fetch) {
+  KeyCacheEntry *entry = calloc(1, sizeof(KeyCacheEntry));
+  if (!entry) {
+    free(id);
+    return NULL;
+  }
+  entry->id = id;
+  entry->vault_addr = strdup(vault_addr);
+  entry->api_key = strdup(api_key);
+  entry->secret_path = strdup(secret_path);
+  entry->key = key_page_alloc();
+  entry->fetch = fetch;
+  entry->ttl_ms = ttl_ms;
+  entry->refs = 1;
+  if (!entry->vault_addr || !entry->api_key || !entry->secret_path ||
+      !entry->key) {
+    entry_free(entry);
+    return NULL;
+  }
+
+  pthread_condattr_t attr;
+  if (pthread_mutex_init(&entry->mutex, NULL) != 0) {
+    entry_free(entry);
+    return NULL;
+  }
+  if (pthread_condattr_init(&attr) != 0 ||
+      pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0 ||
+      pthread_cond_init(&entry->cond, &attr) != 0) {
+    pthread_mutex_destroy(&entry->mutex);
+    entry_free(entry);
+    return NULL;
+  }
+  pthread_condattr_destroy(&attr);
+  if (pthread_create(&entry->refresher, NULL, key_refresher, entry) != 0) {
+    pthread_cond_destroy(&entry->cond);
+    pthread_mutex_destroy(&entry->mutex);
+    entry_free(entry);
+    return NULL;
+  }
+  return entry;
+}
+
+KeyCacheEntry *key_cache_acquire(const char *vault_addr, const char *api_key,
+                                 const char *secret_path, long ttl_ms,
+                                 key_fetch_fn fetch) {
+  if (!vault_addr || !api_key || !secret_path || !fetch || ttl_ms <= 0) {
+    return NULL;
+  }
+  char *id = entry_id(vault_addr, api_key, secret_path);
+  if (!id) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&registry_mutex);
+  KeyCacheEntry *entry = NULL;
+  HASH_FIND_STR(registry, id, entry);
+  if (entry) {
+    entry->refs++;
+    free(id);
+  } else {
+    entry = entry_create(id, vault_addr, api_key, secret_path, ttl_ms, fetch);
+    if (entry) {
+      HASH_ADD_KEYPTR(hh, registry, entry->id, strlen(entry->id), entry);
+    }
+  }
+  pthread_mutex_unlock(&registry_mutex);
+  return entry;
+}
+
+void key_cache_release(KeyCacheEntry *entry) {
+  if (!entry) {
+    return;
+  }
+  pthread_mutex_lock(&registry_mutex);
+  int last = --entry->refs == 0;
+  if (last) {
+    HASH_DEL(registry, entry);
+  }
+  pthread_mutex_unlock(&registry_mutex);
+  if (!last) {
+    return;
+  }
+
+  // A fetch in progress is waited for, its key is discarded
+  pthread_mutex_lock(&entry->mutex);
+  entry->stopping = 1;
+  pthread_cond_broadcast(&entry->cond);
+  pthread_mutex_unlock(&entry->mutex);
+  pthread_join(entry->refresher, NULL);
+
+  pthread_cond_destroy(&entry->cond);
+  pthread_mutex_destroy(&entry->mutex);
+  entry_free(entry);
+}
+
+int key_cache_get(KeyCacheEntry *entry, long timeout_ms, char *out,
+                  size_t out_size) {
+  if (!entry || !out) {
+    return -1;
+  }
+  int64_t deadline = now_ms() + (timeout_ms > 0 ? timeout_ms : 0);
+
+  pthread_mutex_lock(&entry->mutex);
+  while (entry->key_len == 0 && now_ms() < deadline) {
+    wait_until(entry, deadline);
+  }
+  int res = -1;
+  if (entry->key_len > 0 && entry->key_len < out_size) {
+    memcpy(out, entry->key, entry->key_len + 1);
+    res = (int)entry->key_len;
+  }
+  pthread_mutex_unlock(&entry->mutex);
+  return res;
+}
+
+void key_cache_get_stats(KeyCacheEntry *entry, KeyCacheStats *stats) {
+  if (!stats) {
+    return;
+  }
+  if (!entry) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  pthread_mutex_lock(&entry->mutex);
+  *stats = entry->stats;
+  pthread_mutex_unlock(&entry->mutex);
+}
@@ -0,0 +1,114 @@
+#ifndef __KEY_CACHE_H__
+#define __KEY_CACHE_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * ============================================================================
+ * KEY CACHE - SHARED, BACKGROUND REFRESHED VAULT KEYS
+ * ============================================================================
+ *
+ * Keys fetched from Vault are cached process wide, one entry per Vault
+ * address, secret path and token, and shared by every encryption layer that
+ * uses them.
+ *
+ * - The first acquire of an entry starts its refresh thread and returns at
+ *   once: the fetch runs in the background and the layers wait for the key
+ *   only on first use.
+ * - The key lives in a page locked in memory (mlock), excluded from core
+ *   dumps, and wiped when the entry is freed or its lease expires.
+ * - The thread fetches the key again after two thirds of its lease, and
+ *   retries with a backoff on failure. An expired key is wiped and waiters
+ *   block until a fetch succeeds again.
+ * ============================================================================
+ */
+
+#define KEY_CACHE_MAX_KEY_SIZE 1024 // key bytes at most, NUL included
+
+/**
+ * @brief Fetch callback, run by the refresh thread
+ *
+ * @param vault_addr    -> Vault server address
+ * @param api_key       -> Vault token
+ * @param secret_path   -> path of the secret
+ * @param lease_seconds -> receives the lease of the secret, 0 if it has none
+ * @return char*        -> key (malloc'd, wiped and freed by the cache), or
+ * NULL on error
+ */
+typedef char *(*key_fetch_fn)(const char *vault_addr, const char *api_key,
+                              const char *secret_path, long *lease_seconds);
+
+typedef struct {
+  size_t fetches;   // successful fetches
+  size_t failures;  // failed fetches
+  size_t rotations; // fetches that returned another key
+  size_t expired;   // leases that ran out before a refresh
+  uint64_t version; // incremented on every key change, 0: no key yet
+} KeyCacheStats;
+
+typedef struct KeyCacheEntry {
+  char *id;              // key: address, path and token
+  char *vault_addr;      // Vault server address
+  char *api_key;         // Vault token
+  char *secret_path;     // path of the secret
+  key_fetch_fn fetch;    // fetch callback
+  long ttl_ms;           // lease used when Vault gives none
+  int refs;              // layers using the entry (registry mutex)
+  char *key;             // mlock'd page holding the key
+  size_t key_len;        // key bytes, 0: no valid key
+  int64_t expires_ms;    // monotonic expiry of the key
+  KeyCacheStats stats;   // refresh metrics
+  int stopping;          // set on last release, thread exits
+  pthread_t refresher;   // refresh thread
+  pthread_mutex_t mutex; // protects the fields above but refs
+  pthread_cond_t cond;   // signalled on key changes and on stop
+  UT_hash_handle hh;
+} KeyCacheEntry;
+
+/**
+ * @brief Get the shared entry of a secret, creating it on first use
+ *
+ * Never blocks on Vault: a new entry fetches its key in the background.
+ *
+ * @param vault_addr  -> Vault server address
+ * @param api_key     -> Vault token
+ * @param secret_path -> path of the secret
+ * @param ttl_ms      -> lease of the key when Vault gives none (> 0)
+ * @param fetch       -> fetch callback, used by a new entry
+ * @return KeyCacheEntry* -> referenced entry, or NULL on error
+ */
+KeyCacheEntry *key_cache_acquire(const char *vault_addr, const char *api_key,
+                                 const char *secret_path, long ttl_ms,
+                                 key_fetch_fn fetch);
+
+/**
+ * @brief Drop a reference, the last one stops the thread and wipes the key
+ *
+ * @param entry -> entry (may be NULL)
+ */
+void key_cache_release(KeyCacheEntry *entry);
+
+/**
+ * @brief Copy the key out of the cache, waiting for a fetch if needed
+ *
+ * @param entry      -> entry
+ * @param timeout_ms -> time to wait for a valid key at most
+ * @param out        -> receives the key, NUL terminated; wipe it after use
+ * @param out_size   -> size of out
+ * @return int       -> key length, or -1 on timeout or if out is too small
+ */
+int key_cache_get(KeyCacheEntry *entry, long timeout_ms, char *out,
+                  size_t out_size);
+
+/**
+ * @brief Snapshot of the refresh metrics
+ *
+ * @param entry -> entry (NULL: all zero)
+ * @param stats -> output
+ */
+void key_cache_get_stats(KeyCacheEntry *entry, KeyCacheStats *stats);
+
+#endif // __KEY_CACHE_H__
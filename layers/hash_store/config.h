@@ -0,0 +1,36 @@
+#ifndef __HASH_STORE_CONFIG_H__
+#define __HASH_STORE_CONFIG_H__
+
+#include "../../config/utils.h"
+
+#define HASH_STORE_DEFAULT_INITIAL_SIZE (1L << 20) // 1 MiB
+
+typedef struct {
+  char *path;        // the store file
+  long initial_size; // of a new store, it doubles as it fills up
+} HashStoreConfig;
+
+/**
+ * @brief Parse hash store layer parameters
+ *
+ */
+static inline void hash_store_parse_params(toml_datum_t layer_table,
+                                           HashStoreConfig *config) {
+  toml_datum_t path = toml_get(layer_table, "path");
+  if (path.type == TOML_STRING) {
+    config->path = parse_string(path);
+  } else {
+    toml_error("Hash store layer must have a 'path'");
+  }
+
+  config->initial_size = HASH_STORE_DEFAULT_INITIAL_SIZE;
+  toml_datum_t initial_size = toml_get(layer_table, "initial_size");
+  if (initial_size.type == TOML_INT64) {
+    if (initial_size.u.int64 < 4096) {
+      toml_error("Hash store layer initial_size must be at least 4096");
+    }
+    config->initial_size = (long)initial_size.u.int64;
+  }
+}
+
+#endif
@@ -0,0 +1,725 @@
+#define _GNU_SOURCE
+#include "hash_store.h"
+#include "logdef.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HASH_STORE_STATE(l) ((HashStoreState *)(l).internal_state)
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+static HashStoreHeader *store_header(HashStoreState *state) {
+  return (HashStoreHeader *)state->map;
+}
+
+static HashStoreRecord *record_at(HashStoreState *state, uint64_t offset) {
+  return (HashStoreRecord *)(state->map + offset);
+}
+
+static uint64_t record_bytes(const HashStoreRecord *rec) {
+  return sizeof(HashStoreRecord) + ALIGN8(rec->key_len) + rec->capacity;
+}
+
+static unsigned char *record_value(HashStoreRecord *rec) {
+  return (unsigned char *)(rec + 1) + ALIGN8(rec->key_len);
+}
+
+static void record_kill(HashStoreState *state, uint64_t offset) {
+  HashStoreRecord *rec = record_at(state, offset);
+  if (rec->flags & HASH_STORE_DEAD) {
+    return;
+  }
+  rec->flags |= HASH_STORE_DEAD;
+  state->live_bytes -= record_bytes(rec);
+  state->dead_bytes += record_bytes(rec);
+}
+
+static void entry_unref(HashStoreEntry *entry) {
+  if (--entry->refs > 0) {
+    return;
+  }
+  free(entry->key);
+  free(entry);
+}
+
+// Grow the file and the mapping to hold size bytes, exclusive lock held
+static int store_reserve(HashStoreState *state, uint64_t size) {
+  if (size <= state->map_size) {
+    return 0;
+  }
+  size_t map_size = state->map_size;
+  while (map_size < size) {
+    map_size *= 2;
+  }
+  if (ftruncate(state->fd, (off_t)map_size) != 0) {
+    return -1;
+  }
+  void *map = mremap(state->map, state->map_size, map_size, MREMAP_MAYMOVE);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  state->map = map;
+  state->map_size = map_size;
+  return 0;
+}
+
+/**
+ * @brief Append a record with an empty value, exclusive lock held
+ *
+ * @param state    -> the store
+ * @param key      -> key of the record
+ * @param capacity -> value bytes of the record, a multiple of 8
+ * @param flags    -> flags of the record
+ * @return int64_t -> offset of the record, -1 with errno set on failure
+ */
+static int64_t record_append(HashStoreState *state, const char *key,
+                             uint32_t capacity, uint16_t flags) {
+  size_t key_len = strlen(key);
+  uint64_t offset = store_header(state)->tail;
+  uint64_t bytes = sizeof(HashStoreRecord) + ALIGN8(key_len) + capacity;
+  if (store_reserve(state, offset + bytes) != 0) {
+    errno = ENOSPC;
+    return -1;
+  }
+  HashStoreRecord *rec = record_at(state, offset);
+  memset(rec, 0, bytes);
+  rec->key_len = (uint16_t)key_len;
+  rec->flags = flags;
+  rec->capacity = capacity;
+  memcpy(rec + 1, key, key_len);
+  // the record is complete before the tail covers it
+  rec->magic = HASH_STORE_RECORD_MAGIC;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  store_header(state)->tail = offset + bytes;
+  if (flags & HASH_STORE_DEAD) {
+    state->dead_bytes += bytes;
+  } else {
+    state->live_bytes += bytes;
+  }
+  return (int64_t)offset;
+}
+
+static uint32_t capacity_for(uint64_t size) {
+  uint64_t capacity = HASH_STORE_MIN_CAPACITY;
+  while (capacity < size) {
+    capacity *= 2;
+  }
+  return capacity > UINT32_MAX ? 0 : (uint32_t)capacity;
+}
+
+/**
+ * @brief Move a record to one of at least size bytes of value, exclusive lock
+ * held
+ *
+ * @param state -> the store
+ * @param entry -> entry of the record
+ * @param key   -> key of the new record
+ * @param size  -> value bytes needed
+ * @return int  -> 0 on success, -1 with errno set on failure
+ */
+static int entry_move(HashStoreState *state, HashStoreEntry *entry,
+                      const char *key, uint64_t size) {
+  uint32_t capacity = capacity_for(size);
+  if (capacity == 0) {
+    errno = EFBIG;
+    return -1;
+  }
+  // an unlinked entry keeps its data, but not past a restart
+  int64_t offset = record_append(state, key, capacity,
+                                 entry->linked ? 0 : HASH_STORE_DEAD);
+  if (offset < 0) {
+    return -1;
+  }
+  HashStoreRecord *old = record_at(state, entry->offset);
+  HashStoreRecord *rec = record_at(state, (uint64_t)offset);
+  memcpy(record_value(rec), record_value(old), old->size);
+  rec->size = old->size;
+  record_kill(state, entry->offset);
+  entry->offset = (uint64_t)offset;
+  return 0;
+}
+
+// Make room for size bytes of value, zeroing the bytes past the old end
+static int entry_resize(HashStoreState *state, HashStoreEntry *entry,
+                        uint64_t size) {
+  HashStoreRecord *rec = record_at(state, entry->offset);
+  if (size > rec->capacity) {
+    if (entry_move(state, entry, entry->key, size) != 0) {
+      return -1;
+    }
+    rec = record_at(state, entry->offset);
+  }
+  if (size > rec->size) {
+    memset(record_value(rec) + rec->size, 0, size - rec->size);
+  }
+  rec->size = (uint32_t)size;
+  return 0;
+}
+
+static HashStoreEntry *fd_entry(HashStoreState *state, int fd) {
+  HashStoreEntry **slot = fd_table_get(&state->fds, fd);
+  return slot ? *slot : NULL;
+}
+
+static HashStoreEntry *entry_create(HashStoreState *state, const char *key,
+                                    uint64_t offset) {
+  HashStoreEntry *entry = calloc(1, sizeof(HashStoreEntry));
+  if (!entry) {
+    return NULL;
+  }
+  entry->key = strdup(key);
+  if (!entry->key) {
+    free(entry);
+    return NULL;
+  }
+  entry->offset = offset;
+  entry->refs = 1;
+  entry->linked = 1;
+  entry->ino = ++state->next_ino;
+  HASH_ADD_KEYPTR(hh, state->index, entry->key, strlen(entry->key), entry);
+  return entry;
+}
+
+static void entry_unlink(HashStoreState *state, HashStoreEntry *entry) {
+  record_kill(state, entry->offset);
+  HASH_DEL(state->index, entry);
+  entry->linked = 0;
+  entry_unref(entry);
+}
+
+static void entry_stat(HashStoreState *state, HashStoreEntry *entry,
+                       struct stat *stbuf) {
+  HashStoreRecord *rec = record_at(state, entry->offset);
+  memset(stbuf, 0, sizeof(*stbuf));
+  stbuf->st_ino = entry->ino;
+  stbuf->st_mode = S_IFREG | 0644;
+  stbuf->st_nlink = entry->linked ? 1 : 0;
+  stbuf->st_uid = getuid();
+  stbuf->st_gid = getgid();
+  stbuf->st_size = (off_t)rec->size;
+  stbuf->st_blksize = 4096;
+  stbuf->st_blocks = (blkcnt_t)((rec->capacity + 511) / 512);
+}
+
+static ssize_t hash_store_pread(int fd, void *buffer, size_t nbyte,
+                                off_t offset, LayerContext l) {
+  HashStoreState *state = HASH_STORE_STATE(l);
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  pthread_rwlock_rdlock(&state->lock);
+  HashStoreEntry *entry = fd_entry(state, fd);
+  if (!entry) {
+    pthread_rwlock_unlock(&state->lock);
+    errno = EBADF;
+    return -1;
+  }
+  HashStoreRecord *rec = record_at(state, entry->offset);
+  size_t n = 0;
+  if ((uint64_t)offset < rec->size) {
+    n = rec->size - (size_t)offset;
+    n = n < nbyte ? n : nbyte;
+    memcpy(buffer, record_value(rec) + offset, n);
+  }
+  pthread_rwlock_unlock(&state->lock);
+  return (ssize_t)n;
+}
+
+static ssize_t hash_store_pwrite(int fd, const void *buffer, size_t nbyte,
+                                 off_t offset, LayerContext l) {
+  HashStoreState *state = HASH_STORE_STATE(l);
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  pthread_rwlock_wrlock(&state->lock);
+  HashStoreEntry *entry = fd_entry(state, fd);
+  if (!entry) {
+    pthread_rwlock_unlock(&state->lock);
+    errno = EBADF;
+    return -1;
+  }
+  uint64_t end = (uint64_t)offset + nbyte;
+  HashStoreRecord *rec = record_at(state, entry->offset);
+  if (end > rec->size) {
+    if (entry_resize(state, entry, end) != 0) {
+      pthread_rwlock_unlock(&state->lock);
+      return -1;
+    }
+    rec = record_at(state, entry->offset);
+  }
+  memcpy(record_value(rec) + offset, buffer, nbyte);
+  pthread_rwlock_unlock(&state->lock);
+  return (ssize_t)nbyte;
+}
+
+static int hash_store_open(const char *pathname, int flags, mode_t mode,
+                           LayerContext l) {
+  HashStoreState *state = HASH_STORE_STATE(l);
+  if (strlen(pathname) > UINT16_MAX) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  pthread_rwlock_wrlock(&state->lock);
+  HashStoreEntry *entry = NULL;
+  HASH_FIND_STR(state->index, pathname, entry);
+  int err = 0;
+  if (entry && (flags & O_CREAT) && (flags & O_EXCL)) {
+    err = EEXIST;
+  } else if (!entry && !(flags & O_CREAT)) {
+    err = ENOENT;
+  }
+
+  int fd = 0;
+  HashStoreEntry **slot = err ? NULL : fd_table_slot(&state->fds, fd);
+  while (slot && *slot) {
+    slot = fd_table_slot(&state->fds, ++fd);
+  }
+  if (!err && !slot) {
+    err = EMFILE;
+  }
+  if (!err && !entry) {
+    int64_t offset =
+        record_append(state, pathname, HASH_STORE_MIN_CAPACITY, 0);
+    if (offset < 0 || !(entry = entry_create(state, pathname, offset))) {
+      if (offset >= 0) {
+        record_kill(state, (uint64_t)offset);
+      }
+      err = offset < 0 ? errno : ENOMEM;
+    }
+  }
+  if (err) {
+    pthread_rwlock_unlock(&state->lock);
+    errno = err;
+    return -1;
+  }
+
+  if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY) {
+    record_at(state, entry->offset)->size = 0;
+  }
+  entry->refs++;
+  *slot = entry;
+  pthread_rwlock_unlock(&state->lock);
+  return fd;
+}
+
+static int hash_store_close(int fd, LayerContext l) {
+  HashStoreState *state = HASH_STORE_STATE(l);
+  pthread_rwlock_wrlock(&state->lock);
+  HashStoreEntry *entry = fd_entry(state, fd);
+  if (!entry) {
+    pthread_rwlock_unlock(&state->lock);
+    errno = EBADF;
+    return -1;
+  }
+  *(HashStoreEntry **)fd_table_get(&state->fds, fd) = NULL;
+  entry_unref(entry);
+  pthread_rwlock_unlock(&state->lock);
+  return 0;
+}
+
+static int hash_store_ftruncate(int fd, off_t length, LayerContext l) {
+  HashStoreState *state = HASH_STORE_STATE(l);
+  if (length < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  pthread_rwlock_wrlock(&state->lock);
+  HashStoreEntry *entry = fd_entry(state, fd);
+  int res = -1;
+  if (entry) {
+    res = entry_resize(state, entry, (uint64_t)length);
+  } else {
+    errno = EBADF;
+  }
+  pthread_rwlock_unlock(&state->lock);
+  return res;
+}
+
+static int hash_store_truncate(const char *path, off_t length,
+                               LayerContext l) {
+  HashStoreState *state = HASH_STORE_STATE(l);
+  if (length < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  pthread_rwlock_wrlock(&state->lock);
+  HashStoreEntry *entry = NULL;
+  HASH_FIND_STR(state->index, path, entry);
+  int res = -1;
+  if (entry) {
+    res = entry_resize(state, entry, (uint64_t)length);
+  } else {
+    errno = ENOENT;
+  }
+  pthread_rwlock_unlock(&state->lock);
+  return res;
+}
+
+static int hash_store_fstat(int fd, struct stat *stbuf, LayerContext l) {
+  HashStoreState *state = HASH_STORE_STATE(l);
+  pthread_rwlock_rdlock(&state->lock);
+  HashStoreEntry *entry = fd_entry(state, fd);
+  if (!entry) {
+    pthread_rwlock_unlock(&state->lock);
+    errno = EBADF;
+    return -1;
+  }
+  entry_stat(state, entry, stbuf);
+  pthread_rwlock_unlock(&state->lock);
+  return 0;
+}
+
+static int hash_store_lstat(const char *path, struct stat *stbuf,
+                            LayerContext l) {
+  HashStoreState *state = HASH_STORE_STATE(l);
+  pthread_rwlock_rdlock(&state->lock);
+  HashStoreEntry *entry = NULL;
+  HASH_FIND_STR(state->index, path, entry);
+  if (!entry) {
+    pthread_rwlock_unlock(&state->lock);
+    errno = ENOENT;
+    return -1;
+  }
+  entry_stat(state, entry, stbuf);
+  pthread_rwlock_unlock(&state->lock);
+  return 0;
+}
+
+static int hash_store_unlink(const char *path, LayerContext l) {
+  HashStoreState *state = HASH_STORE_STATE(l);
+  pthread_rwlock_wrlock(&state->lock);
+  HashStoreEntry *entry = NULL;
+  HASH_FIND_STR(state->index, path, entry);
+  if (!entry) {
+    pthread_rwlock_unlock(&state->lock);
+    errno = ENOENT;
+    return -1;
+  }
+  entry_unlink(state, entry);
+  pthread_rwlock_unlock(&state->lock);
+  return 0;
+}
+
+static int hash_store_rename(const char *from, const char *to,
+                             unsigned int flags, LayerContext l) {
+  HashStoreState *state = HASH_STORE_STATE(l);
+  if (flags & ~RENAME_NOREPLACE) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (strlen(to) > UINT16_MAX) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  pthread_rwlock_wrlock(&state->lock);
+  HashStoreEntry *entry = NULL, *target = NULL;
+  HASH_FIND_STR(state->index, from, entry);
+  HASH_FIND_STR(state->index, to, target);
+  int err = 0;
+  char *key = NULL;
+  if (!entry) {
+    err = ENOENT;
+  } else if (target == entry) {
+    err = 0;
+  } else if (target && (flags & RENAME_NOREPLACE)) {
+    err = EEXIST;
+  } else if (!(key = strdup(to))) {
+    err = ENOMEM;
+  } else {
+    // the record of the new key goes in before the old ones die
+    HashStoreRecord *rec = record_at(state, entry->offset);
+    if (entry_move(state, entry, to, rec->size) != 0) {
+      err = errno;
+      free(key);
+    } else {
+      if (target) {
+        entry_unlink(state, target);
+      }
+      HASH_DEL(state->index, entry);
+      free(entry->key);
+      entry->key = key;
+      HASH_ADD_KEYPTR(hh, state->index, entry->key, strlen(entry->key),
+                      entry);
+    }
+  }
+  pthread_rwlock_unlock(&state->lock);
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+static int store_sync(void *arg, int isdatasync) {
+  (void)isdatasync;
+  HashStoreState *state = arg;
+  pthread_rwlock_rdlock(&state->lock);
+  int res = msync(state->map, state->map_size, MS_SYNC);
+  pthread_rwlock_unlock(&state->lock);
+  return res;
+}
+
+// every fd lives in the one store file: concurrent fsyncs share one msync
+static int hash_store_fsync(int fd, int isdatasync, LayerContext l) {
+  HashStoreState *state = HASH_STORE_STATE(l);
+  pthread_rwlock_rdlock(&state->lock);
+  int open = fd_entry(state, fd) != NULL;
+  pthread_rwlock_unlock(&state->lock);
+  if (!open) {
+    errno = EBADF;
+    return -1;
+  }
+  return group_commit_sync(&state->fsyncs, "", 0, isdatasync, store_sync,
+                           state);
+}
+
+static void hash_store_destroy(LayerContext l) {
+  HashStoreState *state = HASH_STORE_STATE(l);
+  msync(state->map, state->map_size, MS_SYNC);
+  munmap(state->map, state->map_size);
+  close(state->fd);
+  for (int fd = 0; fd < fd_table_end(&state->fds); fd++) {
+    HashStoreEntry *open_entry = fd_entry(state, fd);
+    if (open_entry) {
+      entry_unref(open_entry);
+    }
+  }
+  fd_table_destroy(&state->fds);
+  HashStoreEntry *entry, *tmp;
+  HASH_ITER(hh, state->index, entry, tmp) {
+    HASH_DEL(state->index, entry);
+    entry_unref(entry);
+  }
+  pthread_rwlock_destroy(&state->lock);
+  group_commit_destroy(&state->fsyncs);
+  free(state->path);
+  free(state);
+  free(l.ops);
+}
+
+static int store_map(HashStoreState *state, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return -1;
+  }
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  state->fd = fd;
+  state->map = map;
+  state->map_size = (size_t)st.st_size;
+  return 0;
+}
+
+/**
+ * @brief Index the live records of the store
+ *
+ * A record past the end of the file or without its magic ends the store:
+ * the tail is moved back to it.
+ *
+ * @param state -> the store, mapped, with an empty index
+ * @return int  -> 0 on success, -1 if out of memory
+ */
+static int store_replay(HashStoreState *state) {
+  HashStoreHeader *header = store_header(state);
+  uint64_t offset = sizeof(HashStoreHeader);
+  uint64_t tail = header->tail < state->map_size ? header->tail
+                                                 : state->map_size;
+  char key[UINT16_MAX + 1];
+  while (offset + sizeof(HashStoreRecord) <= tail) {
+    HashStoreRecord *rec = record_at(state, offset);
+    uint64_t bytes = record_bytes(rec);
+    if (rec->magic != HASH_STORE_RECORD_MAGIC || rec->capacity % 8 ||
+        rec->size > rec->capacity || offset + bytes > tail) {
+      WARN_MSG("[HASH_STORE] %s: bad record at %lu, the store ends there",
+               state->path, (unsigned long)offset);
+      break;
+    }
+    if (rec->flags & HASH_STORE_DEAD) {
+      state->dead_bytes += bytes;
+      offset += bytes;
+      continue;
+    }
+    state->live_bytes += bytes;
+    memcpy(key, rec + 1, rec->key_len);
+    key[rec->key_len] = '\0';
+    HashStoreEntry *entry = NULL;
+    HASH_FIND_STR(state->index, key, entry);
+    if (entry) {
+      // a move cut short by a crash: the later record wins
+      record_kill(state, entry->offset);
+      entry->offset = offset;
+    } else if (!entry_create(state, key, offset)) {
+      return -1;
+    }
+    offset += bytes;
+  }
+  header->tail = offset;
+  return 0;
+}
+
+/**
+ * @brief Rewrite the store with its live records only
+ *
+ * @param state -> the store, replayed, with no open fd
+ * @return int  -> 0 on success, -1 with errno set on failure (the store is
+ * left as it was)
+ */
+static int store_compact(HashStoreState *state) {
+  size_t path_len = strlen(state->path) + sizeof(".compact");
+  char *tmp_path = malloc(path_len);
+  if (!tmp_path) {
+    return -1;
+  }
+  (void)snprintf(tmp_path, path_len, "%s.compact", state->path);
+  size_t size = state->map_size;
+  while (size / 2 >= sizeof(HashStoreHeader) + state->live_bytes &&
+         size / 2 >= HASH_STORE_COMPACT_MIN) {
+    size /= 2;
+  }
+  int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  unsigned char *map = MAP_FAILED;
+  if (fd >= 0 && ftruncate(fd, (off_t)size) == 0) {
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (map == MAP_FAILED) {
+    goto fail;
+  }
+
+  uint64_t offset = sizeof(HashStoreHeader);
+  HashStoreEntry *entry, *tmp;
+  HASH_ITER(hh, state->index, entry, tmp) {
+    HashStoreRecord *rec = record_at(state, entry->offset);
+    uint64_t bytes = record_bytes(rec);
+    memcpy(map + offset, rec, bytes);
+    entry->offset = offset;
+    offset += bytes;
+  }
+  memcpy(map, state->map, sizeof(HashStoreHeader));
+  ((HashStoreHeader *)map)->tail = offset;
+  if (msync(map, size, MS_SYNC) != 0 || fsync(fd) != 0 ||
+      rename(tmp_path, state->path) != 0) {
+    munmap(map, size);
+    goto fail;
+  }
+
+  munmap(state->map, state->map_size);
+  close(state->fd);
+  state->fd = fd;
+  state->map = map;
+  state->map_size = size;
+  state->dead_bytes = 0;
+  free(tmp_path);
+  return 0;
+
+fail: {
+  int err = errno;
+  if (fd >= 0) {
+    close(fd);
+    unlink(tmp_path);
+  }
+  free(tmp_path);
+  // the offsets of the entries are the ones of the old store again
+  HashStoreEntry *e, *t;
+  HASH_ITER(hh, state->index, e, t) {
+    HASH_DEL(state->index, e);
+    entry_unref(e);
+  }
+  state->live_bytes = 0;
+  state->dead_bytes = 0;
+  store_replay(state);
+  errno = err;
+  return -1;
+}
+}
+
+LayerContext hash_store_init(const HashStoreConfig *config) {
+  LayerContext l = {0};
+  HashStoreState *state = calloc(1, sizeof(HashStoreState));
+  LayerOps *ops = calloc(1, sizeof(LayerOps));
+  if (!state || !ops || !(state->path = strdup(config->path))) {
+    ERROR_MSG("[HASH_STORE] Failed to allocate memory for the layer");
+    exit(1);
+  }
+  pthread_rwlock_init(&state->lock, NULL);
+  if (group_commit_init(&state->fsyncs) != 0) {
+    ERROR_MSG("[HASH_STORE] Failed to initialize the fsync group commit");
+    exit(1);
+  }
+  fd_table_init(&state->fds, sizeof(HashStoreEntry *), NULL);
+
+  int fd = open(config->path, O_RDWR | O_CREAT, 0600);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    ERROR_MSG("[HASH_STORE] Failed to open %s: %s", config->path,
+              strerror(errno));
+    exit(1);
+  }
+  int created = st.st_size == 0;
+  if (created && ftruncate(fd, config->initial_size) != 0) {
+    ERROR_MSG("[HASH_STORE] Failed to size %s: %s", config->path,
+              strerror(errno));
+    exit(1);
+  }
+  if (!created && (size_t)st.st_size < sizeof(HashStoreHeader)) {
+    ERROR_MSG("[HASH_STORE] %s is not a hash store", config->path);
+    exit(1);
+  }
+  if (store_map(state, fd) != 0) {
+    ERROR_MSG("[HASH_STORE] Failed to map %s: %s", config->path,
+              strerror(errno));
+    exit(1);
+  }
+
+  HashStoreHeader *header = store_header(state);
+  if (created) {
+    memcpy(header->magic, HASH_STORE_MAGIC, sizeof(header->magic));
+    header->version = HASH_STORE_VERSION;
+    header->tail = sizeof(HashStoreHeader);
+  } else if (memcmp(header->magic, HASH_STORE_MAGIC, sizeof(header->magic)) ||
+             header->version != HASH_STORE_VERSION) {
+    ERROR_MSG("[HASH_STORE] %s is not a hash store", config->path);
+    exit(1);
+  }
+  if (store_replay(state) != 0) {
+    ERROR_MSG("[HASH_STORE] Failed to allocate memory for the index");
+    exit(1);
+  }
+  if (state->dead_bytes > state->live_bytes &&
+      state->dead_bytes >= HASH_STORE_COMPACT_MIN) {
+    uint64_t dead = state->dead_bytes;
+    if (store_compact(state) == 0) {
+      INFO_MSG("[HASH_STORE] %s: compacted, %lu dead bytes dropped",
+               config->path, (unsigned long)dead);
+    } else {
+      WARN_MSG("[HASH_STORE] %s: compaction failed: %s", config->path,
+               strerror(errno));
+    }
+  }
+
+  ops->lpread = hash_store_pread;
+  ops->lpwrite = hash_store_pwrite;
+  ops->lopen = hash_store_open;
+  ops->lclose = hash_store_close;
+  ops->lftruncate = hash_store_ftruncate;
+  ops->ltruncate = hash_store_truncate;
+  ops->lfstat = hash_store_fstat;
+  ops->llstat = hash_store_lstat;
+  ops->lunlink = hash_store_unlink;
+  ops->lrename = hash_store_rename;
+  ops->lfsync = hash_store_fsync;
+  ops->ldestroy = hash_store_destroy;
+
+  l.ops = ops;
+  l.internal_state = state;
+  return l;
+}
@@ -0,0 +1,101 @@
+#ifndef __HASH_STORE_H__
+#define __HASH_STORE_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include "../../shared/types/layer_context.h"
+#include "../../shared/utils/fd_table.h"
+#include "../../shared/utils/group_commit.h"
+#include "config.h"
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * ============================================================================
+ * HASH STORE - SMALL FILES AS RECORDS OF ONE MEMORY-MAPPED FILE
+ * ============================================================================
+ *
+ * On a local layer, every hash object of anti_tampering is a file of its
+ * own: an inode and an open, a read and a close per verification. The hash
+ * store keeps all of them as records of one file, mapped in memory, with an
+ * in-memory index from path to record: as the hash_layer of anti_tampering,
+ * opening, reading and writing a hash object is a lookup and a memcpy, with
+ * no system call.
+ *
+ * - a record is a header, the key (the path) and capacity bytes of value;
+ *   a write within the capacity updates the value in place, a larger one
+ *   appends a copy of the record with a capacity of the next power of two
+ *   and marks the old one dead, as do an unlink and a rename
+ * - the header of the store holds the end of the last record; records are
+ *   appended past it and it moves once they are written, and the file and
+ *   the mapping double when they are full
+ * - at init the records are replayed in order, the last live record of a
+ *   key wins; when more than half of the store is dead it is rewritten with
+ *   the live records only
+ * - fsync syncs the mapping (msync), there is no other sync: after a crash
+ *   the store has the writes the kernel got to write back, a value torn by
+ *   the crash is then reported as a mismatch by anti_tampering
+ * - one rwlock: reads take it shared, everything else exclusive
+ * ============================================================================
+ */
+
+#define HASH_STORE_MAGIC "TGHS"
+#define HASH_STORE_VERSION 1
+#define HASH_STORE_RECORD_MAGIC 0x52485354 // "TSHR"
+#define HASH_STORE_DEAD 0x1                // record flag: superseded
+#define HASH_STORE_MIN_CAPACITY 64         // a hex SHA-256 digest
+// dead bytes below which the store is never compacted
+#define HASH_STORE_COMPACT_MIN (1 << 20)
+
+/**
+ * @brief Start of the store, the records follow
+ */
+typedef struct {
+  char magic[4];    // HASH_STORE_MAGIC
+  uint32_t version; // HASH_STORE_VERSION
+  uint64_t tail;    // end of the last record
+} HashStoreHeader;
+
+/**
+ * @brief Header of a record, followed by key_len bytes of key padded to 8,
+ * then capacity bytes of value
+ */
+typedef struct {
+  uint32_t magic; // HASH_STORE_RECORD_MAGIC
+  uint16_t key_len;
+  uint16_t flags;    // HASH_STORE_DEAD
+  uint32_t capacity; // multiple of 8
+  uint32_t size;     // of the value
+} HashStoreRecord;
+
+typedef struct HashStoreEntry {
+  char *key;
+  uint64_t offset; // of the live record in the store
+  int refs;        // open fds, plus one while linked
+  int linked;      // in the index
+  ino_t ino;
+  UT_hash_handle hh;
+} HashStoreEntry;
+
+typedef struct {
+  char *path;
+  int fd;
+  unsigned char *map;
+  size_t map_size; // of the file and of the mapping
+  uint64_t live_bytes;
+  uint64_t dead_bytes;
+  ino_t next_ino;
+  HashStoreEntry *index; // by key
+  FdTable fds;           // HashStoreEntry * of each fd, NULL when closed
+  pthread_rwlock_t lock; // everything above
+  GroupCommit fsyncs;    // concurrent fsyncs, all of the store
+} HashStoreState;
+
+/**
+ * @brief Create a hash store layer over a store file, created if missing
+ *
+ * @param config        -> path and initial size of the store
+ * @return LayerContext -> the layer
+ */
+LayerContext hash_store_init(const HashStoreConfig *config);
+
+#endif // __HASH_STORE_H__
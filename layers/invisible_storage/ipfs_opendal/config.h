@@ -3,10 +3,18 @@
 
 #include "../../../config/utils.h"
 
+#define IPFS_DEFAULT_CACHE_SIZE (256L * 1024 * 1024)     // 256 MiB
+#define IPFS_DEFAULT_CACHE_MAX_OBJECT (16L * 1024 * 1024) // 16 MiB
+
 // IPFS OpenDAL layer configuration structure
 typedef struct {
   char *api_endpoint;
   char *root;
+
+  // local object cache (ipfs_cache.h), enabled by cache_dir
+  char *cache_dir;
+  long cache_size;       // bytes of objects kept
+  long cache_max_object; // larger objects are not cached
 } IpfsOpendalConfig;
 
 /**
@@ -26,6 +34,32 @@ static inline void ipfs_opendal_parse_params(toml_datum_t layer_table,
 
   config->api_endpoint = parse_string(api_endpoint);
   config->root = parse_string(root);
+
+  // Local object cache (optional)
+  config->cache_dir = NULL;
+  config->cache_size = IPFS_DEFAULT_CACHE_SIZE;
+  config->cache_max_object = IPFS_DEFAULT_CACHE_MAX_OBJECT;
+  toml_datum_t cache_dir = toml_get(layer_table, "cache_dir");
+  if (cache_dir.type == TOML_STRING) {
+    config->cache_dir = parse_string(cache_dir);
+  }
+  toml_datum_t cache_size = toml_get(layer_table, "cache_size");
+  if (cache_size.type == TOML_INT64) {
+    if (cache_size.u.int64 <= 0) {
+      toml_error("IPFS OpenDAL layer cache_size must be positive");
+    }
+    config->cache_size = (long)cache_size.u.int64;
+  }
+  toml_datum_t cache_max_object = toml_get(layer_table, "cache_max_object");
+  if (cache_max_object.type == TOML_INT64) {
+    if (cache_max_object.u.int64 <= 0) {
+      toml_error("IPFS OpenDAL layer cache_max_object must be positive");
+    }
+    config->cache_max_object = (long)cache_max_object.u.int64;
+  }
+  if (config->cache_max_object > config->cache_size) {
+    config->cache_max_object = config->cache_size;
+  }
 }
 
 #endif // __IPFS_OPENDAL_CONFIG_H__
@@ -0,0 +1,713 @@
+#define _GNU_SOURCE
+#include "ipfs_cache.h"
+#include "../../../logdef.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+// bytes of the object read from IPFS at once while filling the cache
+#define IPFS_CACHE_FILL_CHUNK (1024 * 1024)
+
+static uint64_t path_key(const char *path) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (const unsigned char *c = (const unsigned char *)path; *c; c++) {
+    hash = (hash ^ *c) * FNV_PRIME;
+  }
+  return hash;
+}
+
+static size_t data_offset(size_t path_len) {
+  return sizeof(IpfsCacheHeader) + path_len;
+}
+
+static int write_fully(int fd, const void *buffer, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = write(fd, (const char *)buffer + done, len - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    done += (size_t)n;
+  }
+  return 0;
+}
+
+static ssize_t pread_fully(int fd, void *buffer, size_t len, off_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, (char *)buffer + done, len - done, offset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    done += (size_t)n;
+  }
+  return (ssize_t)done;
+}
+
+static char *cache_file(const IpfsCacheState *state, uint64_t key,
+                        const char *suffix) {
+  char *path = NULL;
+  if (asprintf(&path, "%s/%016" PRIx64 "%s", state->dir, key, suffix) < 0) {
+    return NULL;
+  }
+  return path;
+}
+
+static bool same_time(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* ---- index and LRU list, under the state mutex ---- */
+
+static void lru_remove(IpfsCacheState *state, IpfsCacheEntry *e) {
+  if (e->newer) {
+    e->newer->older = e->older;
+  } else {
+    state->newest = e->older;
+  }
+  if (e->older) {
+    e->older->newer = e->newer;
+  } else {
+    state->oldest = e->newer;
+  }
+  e->newer = e->older = NULL;
+}
+
+static void lru_push(IpfsCacheState *state, IpfsCacheEntry *e) {
+  e->older = state->newest;
+  e->newer = NULL;
+  if (state->newest) {
+    state->newest->newer = e;
+  } else {
+    state->oldest = e;
+  }
+  state->newest = e;
+}
+
+static void insert_entry(IpfsCacheState *state, IpfsCacheEntry *e) {
+  HASH_ADD(hh, state->entries, key, sizeof(uint64_t), e);
+  lru_push(state, e);
+  state->used += e->size;
+}
+
+// Forget e, and delete its cache file when remove_file
+static void drop_entry(IpfsCacheState *state, IpfsCacheEntry *e,
+                       bool remove_file) {
+  HASH_DEL(state->entries, e);
+  lru_remove(state, e);
+  state->used -= e->size;
+  if (remove_file) {
+    char *file = cache_file(state, e->key, IPFS_CACHE_SUFFIX);
+    if (file) {
+      unlink(file); // fds reading it keep the unlinked copy
+      free(file);
+    }
+  }
+  free(e->path);
+  free(e);
+}
+
+static void evict(IpfsCacheState *state) {
+  while (state->used > state->capacity && state->oldest) {
+    DEBUG_MSG("[IPFS_CACHE] Evicting %s (%zu bytes)", state->oldest->path,
+              state->oldest->size);
+    drop_entry(state, state->oldest, true);
+  }
+}
+
+// The object of path changed: drop its copy and stop the reads of its fds
+static void invalidate_path(IpfsCacheState *state, const char *path) {
+  uint64_t key = path_key(path);
+  IpfsCacheEntry *e = NULL;
+  HASH_FIND(hh, state->entries, &key, sizeof(uint64_t), e);
+  if (e && strcmp(e->path, path) == 0) {
+    drop_entry(state, e, true);
+  }
+  IpfsCacheFd *rec, *tmp;
+  HASH_ITER(hh, state->fds, rec, tmp) {
+    if (rec->cacheable && strcmp(rec->path, path) == 0) {
+      rec->cacheable = false;
+    }
+  }
+  state->generation++;
+}
+
+static void invalidate_fd(IpfsCacheState *state, int fd) {
+  pthread_mutex_lock(&state->mutex);
+  IpfsCacheFd *rec = NULL;
+  HASH_FIND(hh, state->fds, &fd, sizeof(int), rec);
+  if (rec) {
+    invalidate_path(state, rec->path);
+  }
+  pthread_mutex_unlock(&state->mutex);
+}
+
+static void invalidate(IpfsCacheState *state, const char *path) {
+  pthread_mutex_lock(&state->mutex);
+  invalidate_path(state, path);
+  pthread_mutex_unlock(&state->mutex);
+}
+
+/* ---- cache files ---- */
+
+// Open the cache file of e, -1 if it is gone or does not match e
+static int open_entry(const IpfsCacheState *state, const IpfsCacheEntry *e) {
+  char *file = cache_file(state, e->key, IPFS_CACHE_SUFFIX);
+  if (!file) {
+    return -1;
+  }
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  free(file);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (size_t)st.st_size != data_offset(strlen(e->path)) + e->size) {
+    close(fd);
+    return -1;
+  }
+  futimens(fd, NULL); // the order of the next instance
+  return fd;
+}
+
+/**
+ * @brief Copy the object of rec from IPFS to a new cache file
+ *
+ * @param tmp_path -> set to the path of the file, to rename once complete
+ * @return int     -> the file, open for reading, or -1 if the object could
+ * not be read whole
+ */
+static int fetch_object(IpfsCacheState *state, const IpfsCacheFd *rec,
+                        uint64_t key, char **tmp_path) {
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d%s", rec->fd, IPFS_CACHE_TMP_SUFFIX);
+  *tmp_path = cache_file(state, key, suffix);
+  if (!*tmp_path) {
+    return -1;
+  }
+  int fd = open(*tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    WARN_MSG("[IPFS_CACHE] Failed to create %s: %s", *tmp_path,
+             strerror(errno));
+    free(*tmp_path);
+    *tmp_path = NULL;
+    return -1;
+  }
+
+  size_t path_len = strlen(rec->path);
+  IpfsCacheHeader header = {.magic = IPFS_CACHE_MAGIC,
+                            .path_len = (uint32_t)path_len,
+                            .size = rec->size,
+                            .mtime_sec = rec->mtime.tv_sec,
+                            .mtime_nsec = rec->mtime.tv_nsec};
+  char *chunk = malloc(IPFS_CACHE_FILL_CHUNK);
+  bool ok = chunk && write_fully(fd, &header, sizeof(header)) == 0 &&
+            write_fully(fd, rec->path, path_len) == 0;
+  size_t done = 0;
+  while (ok && done < rec->size) {
+    size_t len = rec->size - done < IPFS_CACHE_FILL_CHUNK
+                     ? rec->size - done
+                     : IPFS_CACHE_FILL_CHUNK;
+    ssize_t n = state->next.ops->lpread(rec->fd, chunk, len, (off_t)done,
+                                        state->next);
+    if (n <= 0 || write_fully(fd, chunk, (size_t)n) != 0) {
+      ok = false; // the object shrank, or IPFS failed
+      break;
+    }
+    done += (size_t)n;
+  }
+  free(chunk);
+  if (!ok) {
+    close(fd);
+    unlink(*tmp_path);
+    free(*tmp_path);
+    *tmp_path = NULL;
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * @brief Give rec a cache file: the copy of its object, or a new one
+ *
+ * @return int -> 0 once rec->cache_fd is set, -1 to read from IPFS
+ */
+static int fill(IpfsCacheState *state, IpfsCacheFd *rec) {
+  uint64_t key = path_key(rec->path);
+
+  pthread_mutex_lock(&state->mutex);
+  if (rec->cache_fd >= 0) {
+    pthread_mutex_unlock(&state->mutex);
+    return 0;
+  }
+  IpfsCacheEntry *e = NULL;
+  HASH_FIND(hh, state->entries, &key, sizeof(uint64_t), e);
+  if (e && strcmp(e->path, rec->path) == 0 && e->size == rec->size &&
+      same_time(&e->mtime, &rec->mtime)) {
+    int fd = open_entry(state, e);
+    if (fd >= 0) {
+      lru_remove(state, e);
+      lru_push(state, e);
+      rec->cache_fd = fd;
+      state->hits++;
+      pthread_mutex_unlock(&state->mutex);
+      return 0;
+    }
+  }
+  if (e && strcmp(e->path, rec->path) == 0) {
+    drop_entry(state, e, true); // stale
+  }
+  uint64_t generation = state->generation;
+  state->misses++;
+  pthread_mutex_unlock(&state->mutex);
+
+  char *tmp_path = NULL;
+  int fd = fetch_object(state, rec, key, &tmp_path);
+  if (fd < 0) {
+    pthread_mutex_lock(&state->mutex);
+    rec->cacheable = false; // not copied again at every read
+    pthread_mutex_unlock(&state->mutex);
+    return -1;
+  }
+
+  // Published unless the object changed while it was copied
+  int ret = -1;
+  pthread_mutex_lock(&state->mutex);
+  IpfsCacheEntry *added = NULL;
+  char *file = cache_file(state, key, IPFS_CACHE_SUFFIX);
+  if (rec->cacheable && rec->cache_fd < 0 &&
+      generation == state->generation && file &&
+      (added = calloc(1, sizeof(IpfsCacheEntry))) &&
+      (added->path = strdup(rec->path)) && rename(tmp_path, file) == 0) {
+    IpfsCacheEntry *older = NULL;
+    HASH_FIND(hh, state->entries, &key, sizeof(uint64_t), older);
+    if (older) {
+      drop_entry(state, older, false); // its file was just replaced
+    }
+    added->key = key;
+    added->size = rec->size;
+    added->mtime = rec->mtime;
+    insert_entry(state, added);
+    evict(state);
+    rec->cache_fd = fd;
+    ret = 0;
+  } else {
+    if (added) {
+      free(added->path);
+      free(added);
+    }
+    unlink(tmp_path);
+  }
+  pthread_mutex_unlock(&state->mutex);
+  if (ret != 0) {
+    close(fd);
+  }
+  free(file);
+  free(tmp_path);
+  return ret;
+}
+
+/* ---- layer ---- */
+
+ssize_t ipfs_cache_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                         LayerContext l) {
+  IpfsCacheState *state = (IpfsCacheState *)l.internal_state;
+
+  pthread_mutex_lock(&state->mutex);
+  IpfsCacheFd *rec = NULL;
+  HASH_FIND(hh, state->fds, &fd, sizeof(int), rec);
+  bool cacheable = rec && rec->cacheable && offset >= 0;
+  pthread_mutex_unlock(&state->mutex);
+
+  if (cacheable && fill(state, rec) == 0) {
+    pthread_mutex_lock(&state->mutex);
+    int cache_fd = rec->cacheable ? rec->cache_fd : -1;
+    pthread_mutex_unlock(&state->mutex);
+    if (cache_fd >= 0) {
+      if ((size_t)offset >= rec->size) {
+        return 0;
+      }
+      size_t left = rec->size - (size_t)offset;
+      size_t len = nbyte < left ? nbyte : left;
+      off_t at = (off_t)(data_offset(strlen(rec->path)) + offset);
+      ssize_t n = pread_fully(cache_fd, buffer, len, at);
+      if (n >= 0) {
+        return n;
+      }
+      WARN_MSG("[IPFS_CACHE] Failed to read the copy of %s: %s", rec->path,
+               strerror(errno));
+    }
+  }
+  return state->next.ops->lpread(fd, buffer, nbyte, offset, state->next);
+}
+
+ssize_t ipfs_cache_pwrite(int fd, const void *buffer, size_t nbyte,
+                          off_t offset, LayerContext l) {
+  IpfsCacheState *state = (IpfsCacheState *)l.internal_state;
+  invalidate_fd(state, fd);
+  return state->next.ops->lpwrite(fd, buffer, nbyte, offset, state->next);
+}
+
+int ipfs_cache_open(const char *pathname, int flags, mode_t mode,
+                    LayerContext l) {
+  IpfsCacheState *state = (IpfsCacheState *)l.internal_state;
+  bool write = (flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC);
+  if (write) {
+    invalidate(state, pathname);
+  }
+  int fd = state->next.ops->lopen(pathname, flags, mode, state->next);
+  if (fd < 0) {
+    return fd;
+  }
+
+  IpfsCacheFd *rec = calloc(1, sizeof(IpfsCacheFd));
+  if (!rec || !(rec->path = strdup(pathname))) {
+    ERROR_MSG("[IPFS_CACHE] Failed to allocate memory for fd %d", fd);
+    free(rec);
+    return fd; // read from IPFS
+  }
+  rec->fd = fd;
+  rec->cache_fd = -1;
+  struct stat st;
+  if (!write && state->next.ops->lfstat(fd, &st, state->next) == 0 &&
+      S_ISREG(st.st_mode) && st.st_size > 0 &&
+      (size_t)st.st_size <= state->max_object) {
+    rec->cacheable = true;
+    rec->size = (size_t)st.st_size;
+    rec->mtime = st.st_mtim;
+  }
+
+  pthread_mutex_lock(&state->mutex);
+  IpfsCacheFd *stale = NULL;
+  HASH_FIND(hh, state->fds, &fd, sizeof(int), stale);
+  if (stale) {
+    HASH_DEL(state->fds, stale);
+    if (stale->cache_fd >= 0) {
+      close(stale->cache_fd);
+    }
+    free(stale->path);
+    free(stale);
+  }
+  HASH_ADD(hh, state->fds, fd, sizeof(int), rec);
+  pthread_mutex_unlock(&state->mutex);
+  return fd;
+}
+
+int ipfs_cache_close(int fd, LayerContext l) {
+  IpfsCacheState *state = (IpfsCacheState *)l.internal_state;
+  pthread_mutex_lock(&state->mutex);
+  IpfsCacheFd *rec = NULL;
+  HASH_FIND(hh, state->fds, &fd, sizeof(int), rec);
+  if (rec) {
+    HASH_DEL(state->fds, rec);
+  }
+  pthread_mutex_unlock(&state->mutex);
+  if (rec) {
+    if (rec->cache_fd >= 0) {
+      close(rec->cache_fd);
+    }
+    free(rec->path);
+    free(rec);
+  }
+  return state->next.ops->lclose(fd, state->next);
+}
+
+static int ipfs_cache_ftruncate(int fd, off_t length, LayerContext l) {
+  IpfsCacheState *state = (IpfsCacheState *)l.internal_state;
+  invalidate_fd(state, fd);
+  return state->next.ops->lftruncate(fd, length, state->next);
+}
+
+static int ipfs_cache_truncate(const char *path, off_t length,
+                               LayerContext l) {
+  IpfsCacheState *state = (IpfsCacheState *)l.internal_state;
+  invalidate(state, path);
+  return state->next.ops->ltruncate(path, length, state->next);
+}
+
+static int ipfs_cache_unlink(const char *path, LayerContext l) {
+  IpfsCacheState *state = (IpfsCacheState *)l.internal_state;
+  invalidate(state, path);
+  return state->next.ops->lunlink(path, state->next);
+}
+
+static int ipfs_cache_rename(const char *from, const char *to,
+                             unsigned int flags, LayerContext l) {
+  IpfsCacheState *state = (IpfsCacheState *)l.internal_state;
+  pthread_mutex_lock(&state->mutex);
+  invalidate_path(state, from);
+  invalidate_path(state, to);
+  pthread_mutex_unlock(&state->mutex);
+  return state->next.ops->lrename(from, to, flags, state->next);
+}
+
+static int ipfs_cache_fallocate(int fd, off_t offset, int mode, off_t length,
+                                LayerContext l) {
+  IpfsCacheState *state = (IpfsCacheState *)l.internal_state;
+  invalidate_fd(state, fd);
+  return state->next.ops->lfallocate(fd, offset, mode, length, state->next);
+}
+
+/* ---- operations going to the bindings as they are ---- */
+
+static int ipfs_cache_fstat(int fd, struct stat *stbuf, LayerContext l) {
+  return l.next_layers->ops->lfstat(fd, stbuf, *l.next_layers);
+}
+
+static int ipfs_cache_lstat(const char *path, struct stat *stbuf,
+                            LayerContext l) {
+  return l.next_layers->ops->llstat(path, stbuf, *l.next_layers);
+}
+
+static int ipfs_cache_readdir(const char *path, void *buf,
+                              int (*filler)(void *buf, const char *name,
+                                            const struct stat *stbuf,
+                                            off_t off, unsigned int flags),
+                              off_t offset, struct fuse_file_info *fi,
+                              unsigned int flags, LayerContext l) {
+  return l.next_layers->ops->lreaddir(path, buf, filler, offset, fi, flags,
+                                      *l.next_layers);
+}
+
+static int ipfs_cache_chmod(const char *path, mode_t mode, LayerContext l) {
+  return l.next_layers->ops->lchmod(path, mode, *l.next_layers);
+}
+
+static int ipfs_cache_fsync(int fd, int isdatasync, LayerContext l) {
+  return l.next_layers->ops->lfsync(fd, isdatasync, *l.next_layers);
+}
+
+/* ---- previous instances ---- */
+
+typedef struct {
+  IpfsCacheEntry *entry;
+  struct timespec used; // mtime of the cache file, touched by the hits
+} IpfsCacheLoaded;
+
+static int by_last_use(const void *a, const void *b) {
+  const struct timespec *x = &((const IpfsCacheLoaded *)a)->used;
+  const struct timespec *y = &((const IpfsCacheLoaded *)b)->used;
+  if (x->tv_sec != y->tv_sec) {
+    return x->tv_sec < y->tv_sec ? -1 : 1;
+  }
+  return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+// Read the header of a cache file, NULL if it is not a complete copy
+static IpfsCacheEntry *load_entry(const IpfsCacheState *state, int fd,
+                                  uint64_t key, struct stat *st) {
+  IpfsCacheHeader header;
+  if (fstat(fd, st) != 0 ||
+      pread_fully(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != IPFS_CACHE_MAGIC || header.path_len == 0 ||
+      header.path_len >= PATH_MAX || header.size == 0 ||
+      header.size > state->max_object ||
+      (uint64_t)st->st_size != data_offset(header.path_len) + header.size) {
+    return NULL;
+  }
+  IpfsCacheEntry *e = calloc(1, sizeof(IpfsCacheEntry));
+  char *path = malloc(header.path_len + 1);
+  if (!e || !path ||
+      pread_fully(fd, path, header.path_len, sizeof(header)) !=
+          (ssize_t)header.path_len) {
+    free(e);
+    free(path);
+    return NULL;
+  }
+  path[header.path_len] = '\0';
+  if (strlen(path) != header.path_len || path_key(path) != key) {
+    free(e);
+    free(path);
+    return NULL;
+  }
+  e->key = key;
+  e->path = path;
+  e->size = (size_t)header.size;
+  e->mtime.tv_sec = (time_t)header.mtime_sec;
+  e->mtime.tv_nsec = (long)header.mtime_nsec;
+  return e;
+}
+
+// Index the cache files left in the directory, least recently read first
+static void load_cache_dir(IpfsCacheState *state) {
+  DIR *dir = opendir(state->dir);
+  if (!dir) {
+    return;
+  }
+  IpfsCacheLoaded *loaded = NULL;
+  size_t nloaded = 0, cap = 0;
+  size_t suffix = strlen(IPFS_CACHE_SUFFIX);
+  size_t tmp_suffix = strlen(IPFS_CACHE_TMP_SUFFIX);
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    const char *name = entry->d_name;
+    size_t len = strlen(name);
+    char *path = NULL;
+    if (asprintf(&path, "%s/%s", state->dir, name) < 0) {
+      break;
+    }
+    if (len > tmp_suffix &&
+        strcmp(name + len - tmp_suffix, IPFS_CACHE_TMP_SUFFIX) == 0) {
+      unlink(path); // a copy that did not complete
+      free(path);
+      continue;
+    }
+    char *end;
+    uint64_t key = strtoull(name, &end, 16);
+    if (len <= suffix || end != name + len - suffix ||
+        strcmp(end, IPFS_CACHE_SUFFIX) != 0) {
+      free(path);
+      continue;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    IpfsCacheEntry *e = fd >= 0 ? load_entry(state, fd, key, &st) : NULL;
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (e && nloaded == cap) {
+      cap = cap ? cap * 2 : 64;
+      IpfsCacheLoaded *grown = realloc(loaded, cap * sizeof(*loaded));
+      if (!grown) {
+        free(e->path);
+        free(e);
+        e = NULL;
+      } else {
+        loaded = grown;
+      }
+    }
+    if (!e) {
+      unlink(path);
+      free(path);
+      continue;
+    }
+    loaded[nloaded].entry = e;
+    loaded[nloaded].used = st.st_mtim;
+    nloaded++;
+    free(path);
+  }
+  closedir(dir);
+
+  if (nloaded > 0) {
+    qsort(loaded, nloaded, sizeof(*loaded), by_last_use);
+  }
+  for (size_t i = 0; i < nloaded; i++) {
+    insert_entry(state, loaded[i].entry);
+  }
+  free(loaded);
+  evict(state);
+  if (nloaded > 0) {
+    DEBUG_MSG("[IPFS_CACHE] Loaded %u objects (%zu bytes) from %s",
+              HASH_COUNT(state->entries), state->used, state->dir);
+  }
+}
+
+LayerContext ipfs_cache_init(LayerContext *next_layer,
+                             const IpfsOpendalConfig *config) {
+  LayerContext layer_state;
+  layer_state.app_context = NULL;
+
+  IpfsCacheState *state = calloc(1, sizeof(IpfsCacheState));
+  if (!state) {
+    ERROR_MSG("[IPFS_CACHE] Failed to allocate memory for the state");
+    exit(1);
+  }
+  state->next = *next_layer;
+  state->dir = strdup(config->cache_dir);
+  state->capacity = (size_t)config->cache_size;
+  state->max_object = (size_t)config->cache_max_object;
+  pthread_mutex_init(&state->mutex, NULL);
+  if (!state->dir) {
+    ERROR_MSG("[IPFS_CACHE] Failed to allocate memory for the cache dir");
+    exit(1);
+  }
+  if (mkdir(state->dir, 0700) != 0 && errno != EEXIST) {
+    ERROR_MSG("[IPFS_CACHE] Failed to create cache dir %s: %s", state->dir,
+              strerror(errno));
+    exit(1);
+  }
+  load_cache_dir(state);
+  layer_state.internal_state = state;
+
+  // the optional operations stay NULL when the bindings leave them NULL
+  const LayerOps *next = next_layer->ops;
+  LayerOps *ops = calloc(1, sizeof(LayerOps));
+  ops->lpread = ipfs_cache_pread;
+  ops->lpwrite = ipfs_cache_pwrite;
+  ops->lopen = ipfs_cache_open;
+  ops->lclose = ipfs_cache_close;
+  ops->lftruncate = ipfs_cache_ftruncate;
+  ops->ltruncate = ipfs_cache_truncate;
+  ops->lfstat = ipfs_cache_fstat;
+  ops->llstat = ipfs_cache_lstat;
+  ops->lunlink = ipfs_cache_unlink;
+  ops->lreaddir = next->lreaddir ? ipfs_cache_readdir : NULL;
+  ops->lrename = next->lrename ? ipfs_cache_rename : NULL;
+  ops->lchmod = next->lchmod ? ipfs_cache_chmod : NULL;
+  ops->lfsync = next->lfsync ? ipfs_cache_fsync : NULL;
+  ops->lfallocate = next->lfallocate ? ipfs_cache_fallocate : NULL;
+  ops->ldestroy = ipfs_cache_destroy;
+  layer_state.ops = ops;
+
+  LayerContext *aux = malloc(sizeof(LayerContext));
+  memcpy(aux, next_layer, sizeof(LayerContext));
+  layer_state.next_layers = aux;
+  layer_state.nlayers = 1;
+
+  DEBUG_MSG("[IPFS_CACHE] %zu bytes in %s, objects of up to %zu bytes",
+            state->capacity, state->dir, state->max_object);
+  return layer_state;
+}
+
+void ipfs_cache_destroy(LayerContext l) {
+  IpfsCacheState *state = (IpfsCacheState *)l.internal_state;
+  if (state) {
+    DEBUG_MSG("[IPFS_CACHE] %lu hits, %lu misses", state->hits,
+              state->misses);
+    IpfsCacheFd *rec, *next_rec;
+    HASH_ITER(hh, state->fds, rec, next_rec) {
+      HASH_DEL(state->fds, rec);
+      if (rec->cache_fd >= 0) {
+        close(rec->cache_fd);
+      }
+      free(rec->path);
+      free(rec);
+    }
+    // the cache files stay for the next instance
+    while (state->oldest) {
+      drop_entry(state, state->oldest, false);
+    }
+    pthread_mutex_destroy(&state->mutex);
+    free(state->dir);
+    free(state);
+  }
+  if (l.next_layers) {
+    if (l.next_layers->ops->ldestroy) {
+      l.next_layers->ops->ldestroy(*l.next_layers);
+    }
+    free(l.next_layers);
+  }
+  if (l.ops) {
+    free(l.ops);
+  }
+}
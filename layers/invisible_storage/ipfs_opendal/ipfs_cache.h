@@ -0,0 +1,111 @@
+#ifndef __IPFS_CACHE_H__
+#define __IPFS_CACHE_H__
+
+#include "../../../lib/uthash/src/uthash.h"
+#include "../../../shared/types/layer_context.h"
+#include "config.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * ============================================================================
+ * IPFS CACHE - LOCAL COPIES OF THE OBJECTS READ FROM IPFS
+ * ============================================================================
+ *
+ * Every pread of the ipfs_opendal layer resolves the path of the object and
+ * fetches its blocks from the IPFS node, even when the same object was read a
+ * moment ago. With cache_dir set the builder puts this layer in front of it:
+ *
+ * - the first read of an object opened read-only copies the whole object, at
+ *   most cache_max_object bytes, to a file of cache_dir; the reads of every
+ *   fd opened on it then come from that file
+ * - objects are handled least recently read first out, cache_size bytes of
+ *   them at most
+ * - a copy records the path, size and modification time of the object, and
+ *   is only used by an open whose fstat of the object gives the same ones
+ * - a write open, pwrite, truncate, fallocate, unlink or rename of a path
+ *   drops its copy, and the fds opened on it read from IPFS again
+ *
+ * The cache files survive the layer: the next instance on the same cache_dir
+ * reads them back at init, the most recently read ones kept. The other
+ * operations go to the ipfs_opendal layer as they are.
+ *
+ * The CID of an object is not visible above the bindings, so the copies are
+ * keyed by path, and the size and modification time given by the bindings
+ * tell whether the path still names the same object.
+ * ============================================================================
+ */
+
+#define IPFS_CACHE_MAGIC 0x3145484341435049ULL // "IPCACHE1"
+#define IPFS_CACHE_SUFFIX ".obj"
+#define IPFS_CACHE_TMP_SUFFIX ".tmp"
+
+// Start of a cache file, followed by the path and the object bytes
+typedef struct {
+  uint64_t magic;
+  uint32_t path_len;
+  uint32_t reserved;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} IpfsCacheHeader;
+
+// A cached object, in the index and in the LRU list
+typedef struct IpfsCacheEntry {
+  uint64_t key; // FNV-1a of the path, names the cache file
+  char *path;
+  size_t size;
+  struct timespec mtime;
+  struct IpfsCacheEntry *newer;
+  struct IpfsCacheEntry *older;
+  UT_hash_handle hh;
+} IpfsCacheEntry;
+
+// An fd opened through the layer
+typedef struct {
+  int fd;
+  char *path;
+  bool cacheable; // opened read-only on an object that fits, not written
+  size_t size;    // of the object at open
+  struct timespec mtime;
+  int cache_fd; // the cache file, -1 until the first read
+  UT_hash_handle hh;
+} IpfsCacheFd;
+
+typedef struct {
+  LayerContext next;
+  char *dir;
+  size_t capacity;   // cache_size
+  size_t max_object; // cache_max_object
+  pthread_mutex_t mutex;
+  IpfsCacheEntry *entries; // by key
+  IpfsCacheEntry *newest;
+  IpfsCacheEntry *oldest;
+  size_t used; // object bytes of the entries
+  IpfsCacheFd *fds;
+  uint64_t generation; // bumped by every invalidation
+  unsigned long hits;
+  unsigned long misses;
+} IpfsCacheState;
+
+/**
+ * @brief Wrap the ipfs_opendal layer next_layer in a local object cache
+ *
+ * @param next_layer    -> the ipfs_opendal layer, destroyed with the wrapper
+ * @param config        -> its configuration, with cache_dir set
+ * @return LayerContext -> the layer to use instead of next_layer
+ */
+LayerContext ipfs_cache_init(LayerContext *next_layer,
+                             const IpfsOpendalConfig *config);
+ssize_t ipfs_cache_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                         LayerContext l);
+ssize_t ipfs_cache_pwrite(int fd, const void *buffer, size_t nbyte,
+                          off_t offset, LayerContext l);
+int ipfs_cache_open(const char *pathname, int flags, mode_t mode,
+                    LayerContext l);
+int ipfs_cache_close(int fd, LayerContext l);
+void ipfs_cache_destroy(LayerContext l);
+
+#endif // __IPFS_CACHE_H__
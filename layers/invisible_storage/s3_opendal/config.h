@@ -3,6 +3,10 @@
 
 #include "../../../config/utils.h"
 
+#define S3_DEFAULT_CONNECTIONS 1 // one stream, requests go to the bindings
+#define S3_DEFAULT_PART_SIZE (8L * 1024 * 1024)
+#define S3_DEFAULT_RANGE_SIZE (8L * 1024 * 1024)
+
 // S3 OpenDAL layer configuration structure
 typedef struct {
   char *endpoint;
@@ -11,8 +15,36 @@ typedef struct {
   char *bucket;
   char *region;
   char *root;
+
+  // parallel transfers (s3_parallel.h), with connections > 1
+  int connections;          // concurrent requests of the layer instance
+  long part_size;           // bytes of an upload part
+  int upload_concurrency;   // parts of one pwrite in flight
+  long range_size;          // bytes of a ranged read
+  int download_concurrency; // ranges of one pread in flight
 } S3OpendalConfig;
 
+#define S3_MAX_CONNECTIONS 1024
+#define S3_MAX_TRANSFER_SIZE (1L << 30)
+
+// Optional integer key in [1, max], value when missing
+static inline long s3_opendal_positive(toml_datum_t layer_table,
+                                       const char *key, long value,
+                                       long max) {
+  toml_datum_t datum = toml_get(layer_table, key);
+  if (datum.type == TOML_INT64) {
+    if (datum.u.int64 <= 0 || datum.u.int64 > max) {
+      char buf[128];
+      (void)snprintf(buf, sizeof(buf),
+                     "S3 OpenDAL layer %s must be between 1 and %ld", key,
+                     max);
+      toml_error(buf);
+    }
+    value = (long)datum.u.int64;
+  }
+  return value;
+}
+
 /**
  * @brief Parse S3 OpenDAL layer parameters
  */
@@ -51,6 +83,20 @@ static inline void s3_opendal_parse_params(toml_datum_t layer_table,
   config->bucket = parse_string(bucket);
   config->region = parse_string(region);
   config->root = parse_string(root);
+
+  // Parallel transfers (optional)
+  config->connections = (int)s3_opendal_positive(
+      layer_table, "connections", S3_DEFAULT_CONNECTIONS, S3_MAX_CONNECTIONS);
+  config->part_size = s3_opendal_positive(
+      layer_table, "part_size", S3_DEFAULT_PART_SIZE, S3_MAX_TRANSFER_SIZE);
+  config->range_size = s3_opendal_positive(
+      layer_table, "range_size", S3_DEFAULT_RANGE_SIZE, S3_MAX_TRANSFER_SIZE);
+  config->upload_concurrency =
+      (int)s3_opendal_positive(layer_table, "upload_concurrency",
+                               config->connections, S3_MAX_CONNECTIONS);
+  config->download_concurrency =
+      (int)s3_opendal_positive(layer_table, "download_concurrency",
+                               config->connections, S3_MAX_CONNECTIONS);
 }
 
 #endif // __S3_OPENDAL_CONFIG_H__
@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include "s3_parallel.h"
+#include "../../../logdef.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A request split in pieces of piece bytes, the last one may be shorter
+typedef struct {
+  LayerContext next;
+  int fd;
+  char *buffer;
+  size_t nbyte;
+  off_t offset;
+  size_t piece;
+  size_t npieces;
+  size_t stride; // jobs of the request, job j moves pieces j, j + stride...
+  bool write;
+  ssize_t *moved; // bytes moved of each piece, -errno on failure
+} S3Transfer;
+
+typedef struct {
+  ThreadPoolTask task;
+  S3Transfer *transfer;
+  size_t first;
+} S3TransferJob;
+
+static size_t piece_length(const S3Transfer *t, size_t i) {
+  size_t start = i * t->piece;
+  return t->nbyte - start < t->piece ? t->nbyte - start : t->piece;
+}
+
+// Move a piece fully: a short read is the end of the object
+static ssize_t move_piece(const S3Transfer *t, size_t i) {
+  size_t start = i * t->piece;
+  size_t len = piece_length(t, i);
+  size_t done = 0;
+  while (done < len) {
+    char *at = t->buffer + start + done;
+    off_t offset = t->offset + (off_t)(start + done);
+    ssize_t n = t->write ? t->next.ops->lpwrite(t->fd, at, len - done,
+                                                offset, t->next)
+                         : t->next.ops->lpread(t->fd, at, len - done, offset,
+                                               t->next);
+    if (n < 0) {
+      return errno ? -errno : -EIO;
+    }
+    if (n == 0) {
+      if (t->write) {
+        return -EIO;
+      }
+      break;
+    }
+    done += (size_t)n;
+  }
+  return (ssize_t)done;
+}
+
+static void *transfer_job(void *arg) {
+  S3TransferJob *job = arg;
+  S3Transfer *t = job->transfer;
+  for (size_t i = job->first; i < t->npieces; i += t->stride) {
+    t->moved[i] = move_piece(t, i);
+    // past the end of the object, the next pieces read nothing
+    if (!t->write && t->moved[i] >= 0 &&
+        (size_t)t->moved[i] < piece_length(t, i)) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Run the pieces of t on the pool, concurrency of them at once
+ *
+ * @return ssize_t -> bytes moved before the first failed or short piece, -1
+ * with errno set if the first piece failed
+ */
+static ssize_t run_transfer(S3ParallelState *state, S3Transfer *t,
+                            int concurrency) {
+  t->npieces = (t->nbyte + t->piece - 1) / t->piece;
+  t->stride = t->npieces < (size_t)concurrency ? t->npieces
+                                               : (size_t)concurrency;
+  t->moved = malloc(t->npieces * sizeof(ssize_t));
+  S3TransferJob *jobs = malloc(t->stride * sizeof(S3TransferJob));
+  if (!t->moved || !jobs) {
+    free(t->moved);
+    free(jobs);
+    errno = ENOMEM;
+    return -1;
+  }
+  for (size_t i = 0; i < t->npieces; i++) {
+    t->moved[i] = 0;
+  }
+
+  ThreadPoolBatch batch;
+  thread_pool_batch_init(&batch);
+  for (size_t j = 0; j < t->stride; j++) {
+    jobs[j].transfer = t;
+    jobs[j].first = j;
+    if (thread_pool_submit(state->pool, 0, &jobs[j].task, &batch,
+                           transfer_job, &jobs[j]) != 0) {
+      transfer_job(&jobs[j]);
+    }
+  }
+  thread_pool_wait(state->pool, &batch);
+
+  ssize_t total = 0;
+  int err = 0;
+  for (size_t i = 0; i < t->npieces; i++) {
+    if (t->moved[i] < 0) {
+      err = (int)-t->moved[i];
+      break;
+    }
+    total += t->moved[i];
+    if ((size_t)t->moved[i] < piece_length(t, i)) {
+      break;
+    }
+  }
+  free(t->moved);
+  free(jobs);
+  if (total == 0 && err) {
+    errno = err;
+    return -1;
+  }
+  return total;
+}
+
+ssize_t s3_parallel_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                          LayerContext l) {
+  S3ParallelState *state = (S3ParallelState *)l.internal_state;
+  if (nbyte <= state->range_size || state->download_concurrency < 2) {
+    return state->next.ops->lpread(fd, buffer, nbyte, offset, state->next);
+  }
+  S3Transfer t = {.next = state->next,
+                  .fd = fd,
+                  .buffer = buffer,
+                  .nbyte = nbyte,
+                  .offset = offset,
+                  .piece = state->range_size,
+                  .write = false};
+  return run_transfer(state, &t, state->download_concurrency);
+}
+
+ssize_t s3_parallel_pwrite(int fd, const void *buffer, size_t nbyte,
+                           off_t offset, LayerContext l) {
+  S3ParallelState *state = (S3ParallelState *)l.internal_state;
+  if (nbyte <= state->part_size || state->upload_concurrency < 2) {
+    return state->next.ops->lpwrite(fd, buffer, nbyte, offset, state->next);
+  }
+  S3Transfer t = {.next = state->next,
+                  .fd = fd,
+                  .buffer = (char *)buffer,
+                  .nbyte = nbyte,
+                  .offset = offset,
+                  .piece = state->part_size,
+                  .write = true};
+  return run_transfer(state, &t, state->upload_concurrency);
+}
+
+/* ---- operations going to the bindings as they are ---- */
+
+static int s3_parallel_open(const char *pathname, int flags, mode_t mode,
+                            LayerContext l) {
+  return l.next_layers->ops->lopen(pathname, flags, mode, *l.next_layers);
+}
+
+static int s3_parallel_close(int fd, LayerContext l) {
+  return l.next_layers->ops->lclose(fd, *l.next_layers);
+}
+
+static int s3_parallel_ftruncate(int fd, off_t length, LayerContext l) {
+  return l.next_layers->ops->lftruncate(fd, length, *l.next_layers);
+}
+
+static int s3_parallel_truncate(const char *path, off_t length,
+                                LayerContext l) {
+  return l.next_layers->ops->ltruncate(path, length, *l.next_layers);
+}
+
+static int s3_parallel_fstat(int fd, struct stat *stbuf, LayerContext l) {
+  return l.next_layers->ops->lfstat(fd, stbuf, *l.next_layers);
+}
+
+static int s3_parallel_lstat(const char *path, struct stat *stbuf,
+                             LayerContext l) {
+  return l.next_layers->ops->llstat(path, stbuf, *l.next_layers);
+}
+
+static int s3_parallel_unlink(const char *path, LayerContext l) {
+  return l.next_layers->ops->lunlink(path, *l.next_layers);
+}
+
+static int s3_parallel_readdir(const char *path, void *buf,
+                               int (*filler)(void *buf, const char *name,
+                                             const struct stat *stbuf,
+                                             off_t off, unsigned int flags),
+                               off_t offset, struct fuse_file_info *fi,
+                               unsigned int flags, LayerContext l) {
+  return l.next_layers->ops->lreaddir(path, buf, filler, offset, fi, flags,
+                                      *l.next_layers);
+}
+
+static int s3_parallel_rename(const char *from, const char *to,
+                              unsigned int flags, LayerContext l) {
+  return l.next_layers->ops->lrename(from, to, flags, *l.next_layers);
+}
+
+static int s3_parallel_chmod(const char *path, mode_t mode, LayerContext l) {
+  return l.next_layers->ops->lchmod(path, mode, *l.next_layers);
+}
+
+static int s3_parallel_fsync(int fd, int isdatasync, LayerContext l) {
+  return l.next_layers->ops->lfsync(fd, isdatasync, *l.next_layers);
+}
+
+static int s3_parallel_fallocate(int fd, off_t offset, int mode, off_t length,
+                                 LayerContext l) {
+  return l.next_layers->ops->lfallocate(fd, offset, mode, length,
+                                        *l.next_layers);
+}
+
+LayerContext s3_parallel_init(LayerContext *next_layer,
+                              const S3OpendalConfig *config) {
+  LayerContext layer_state;
+  layer_state.app_context = NULL;
+
+  S3ParallelState *state = calloc(1, sizeof(S3ParallelState));
+  if (!state) {
+    ERROR_MSG("[S3_PARALLEL] Failed to allocate memory for the state");
+    exit(1);
+  }
+  state->next = *next_layer;
+  state->part_size = (size_t)config->part_size;
+  state->range_size = (size_t)config->range_size;
+  state->upload_concurrency = config->upload_concurrency;
+  state->download_concurrency = config->download_concurrency;
+  state->pool = thread_pool_init(1, config->connections);
+  if (!state->pool) {
+    ERROR_MSG("[S3_PARALLEL] Failed to start %d transfer workers",
+              config->connections);
+    exit(1);
+  }
+  layer_state.internal_state = state;
+
+  // the optional operations stay NULL when the bindings leave them NULL
+  const LayerOps *next = next_layer->ops;
+  LayerOps *ops = calloc(1, sizeof(LayerOps));
+  ops->lpread = s3_parallel_pread;
+  ops->lpwrite = s3_parallel_pwrite;
+  ops->lopen = s3_parallel_open;
+  ops->lclose = s3_parallel_close;
+  ops->lftruncate = s3_parallel_ftruncate;
+  ops->ltruncate = s3_parallel_truncate;
+  ops->lfstat = s3_parallel_fstat;
+  ops->llstat = s3_parallel_lstat;
+  ops->lunlink = s3_parallel_unlink;
+  ops->lreaddir = next->lreaddir ? s3_parallel_readdir : NULL;
+  ops->lrename = next->lrename ? s3_parallel_rename : NULL;
+  ops->lchmod = next->lchmod ? s3_parallel_chmod : NULL;
+  ops->lfsync = next->lfsync ? s3_parallel_fsync : NULL;
+  ops->lfallocate = next->lfallocate ? s3_parallel_fallocate : NULL;
+  ops->ldestroy = s3_parallel_destroy;
+  layer_state.ops = ops;
+
+  LayerContext *aux = malloc(sizeof(LayerContext));
+  memcpy(aux, next_layer, sizeof(LayerContext));
+  layer_state.next_layers = aux;
+  layer_state.nlayers = 1;
+
+  DEBUG_MSG("[S3_PARALLEL] %d connections, parts of %zu bytes (%d in "
+            "flight), ranges of %zu bytes (%d in flight)",
+            config->connections, state->part_size, state->upload_concurrency,
+            state->range_size, state->download_concurrency);
+  return layer_state;
+}
+
+void s3_parallel_destroy(LayerContext l) {
+  S3ParallelState *state = (S3ParallelState *)l.internal_state;
+  if (state) {
+    thread_pool_destroy(state->pool);
+    free(state);
+  }
+  if (l.next_layers) {
+    if (l.next_layers->ops->ldestroy) {
+      l.next_layers->ops->ldestroy(*l.next_layers);
+    }
+    free(l.next_layers);
+  }
+  if (l.ops) {
+    free(l.ops);
+  }
+}
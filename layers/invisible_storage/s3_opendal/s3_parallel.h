@@ -0,0 +1,57 @@
+#ifndef __S3_PARALLEL_H__
+#define __S3_PARALLEL_H__
+
+#include "../../../shared/types/layer_context.h"
+#include "../../../shared/utils/thread_pool.h"
+#include "config.h"
+
+/*
+ * ============================================================================
+ * S3 PARALLEL TRANSFERS - MULTIPART WRITES AND RANGED READS
+ * ============================================================================
+ *
+ * The s3_opendal layer of the invisible storage bindings moves each pread and
+ * pwrite as a single request, on a single stream. With connections > 1 the
+ * builder puts this layer in front of it, and splits the large requests:
+ *
+ * - a pwrite longer than part_size goes as part_size parts, up to
+ *   upload_concurrency of them in flight
+ * - a pread longer than range_size goes as range_size ranged reads, up to
+ *   download_concurrency of them in flight
+ * - the parts run on a pool of connections workers owned by the layer
+ *   instance (and on the calling thread, which helps while it waits), so an
+ *   instance has at most connections + its callers requests in flight and
+ *   two instances do not compete for the same workers
+ *
+ * The parts of a request go to the same fd at distinct offsets, a pwrite
+ * succeeds when all of its parts did and a pread returns the bytes read
+ * before the first short range. The other operations go to the bindings as
+ * they are.
+ * ============================================================================
+ */
+
+typedef struct {
+  LayerContext next;
+  ThreadPool *pool; // connections workers
+  size_t part_size;
+  size_t range_size;
+  int upload_concurrency;
+  int download_concurrency;
+} S3ParallelState;
+
+/**
+ * @brief Wrap the s3_opendal layer next_layer in parallel transfers
+ *
+ * @param next_layer    -> the s3_opendal layer, destroyed with the wrapper
+ * @param config        -> its configuration, with connections > 1
+ * @return LayerContext -> the layer to use instead of next_layer
+ */
+LayerContext s3_parallel_init(LayerContext *next_layer,
+                              const S3OpendalConfig *config);
+ssize_t s3_parallel_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                          LayerContext l);
+ssize_t s3_parallel_pwrite(int fd, const void *buffer, size_t nbyte,
+                           off_t offset, LayerContext l);
+void s3_parallel_destroy(LayerContext l);
+
+#endif // __S3_PARALLEL_H__
@@ -2,18 +2,106 @@
 #define __LOCAL_CONFIG_H__
 
 #include "../../config/utils.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define LOCAL_URING_DEFAULT_ENTRIES 256
+#define LOCAL_URING_DEFAULT_SQPOLL_IDLE_MS 1000
+#define LOCAL_URING_DEFAULT_FIXED_BUFFER_SIZE (64 * 1024)
+
+// Local layer modes
+typedef enum {
+  LOCAL_MODE_SYNC,  // pread/pwrite system calls
+  LOCAL_MODE_URING, // submitted through an io_uring
+} LocalMode;
 
 // Local layer configuration structure
 typedef struct {
-  char *placeholder; // placeholder for now
+  LocalMode mode;
+  int uring_entries;               // ring size (submission queue entries)
+  bool uring_sqpoll;               // kernel thread polls the submission queue
+  int uring_sqpoll_idle_ms;        // idle time before that thread sleeps
+  int uring_registered_files;      // size of the fixed file table, 0: none
+  int uring_fixed_buffers;         // number of registered buffers, 0: none
+  size_t uring_fixed_buffer_size;  // size of each registered buffer
 } LocalConfig;
 
+static inline long local_parse_positive(toml_datum_t datum, long fallback,
+                                        const char *msg) {
+  if (datum.type == TOML_UNKNOWN) {
+    return fallback;
+  }
+  if (datum.type != TOML_INT64 || datum.u.int64 < 0) {
+    toml_error(msg);
+  }
+  return (long)datum.u.int64;
+}
+
 /**
  * @brief Parse local layer parameters
  */
 static inline void local_parse_params(toml_datum_t layer_table,
                                       LocalConfig *config) {
-  config->placeholder = NULL;
+  config->mode = LOCAL_MODE_SYNC;
+  config->uring_entries = LOCAL_URING_DEFAULT_ENTRIES;
+  config->uring_sqpoll = false;
+  config->uring_sqpoll_idle_ms = LOCAL_URING_DEFAULT_SQPOLL_IDLE_MS;
+  config->uring_registered_files = 0;
+  config->uring_fixed_buffers = 0;
+  config->uring_fixed_buffer_size = LOCAL_URING_DEFAULT_FIXED_BUFFER_SIZE;
+
+  toml_datum_t mode = toml_get(layer_table, "mode");
+  if (mode.type == TOML_STRING) {
+    if (strcmp(mode.u.s, "sync") == 0) {
+      config->mode = LOCAL_MODE_SYNC;
+    } else if (strcmp(mode.u.s, "uring") == 0) {
+      config->mode = LOCAL_MODE_URING;
+    } else {
+      toml_error("Unsupported local mode (use 'sync' or 'uring')");
+    }
+  } else if (mode.type != TOML_UNKNOWN) {
+    toml_error("Invalid local mode field");
+  }
+
+  if (config->mode != LOCAL_MODE_URING) {
+    return;
+  }
+
+  toml_datum_t options = toml_get(layer_table, "options");
+  if (options.type != TOML_TABLE) {
+    return;
+  }
+
+  config->uring_entries = (int)local_parse_positive(
+      toml_get(options, "entries"), LOCAL_URING_DEFAULT_ENTRIES,
+      "Local uring 'entries' must be a positive integer");
+  if (config->uring_entries == 0) {
+    toml_error("Local uring 'entries' must be a positive integer");
+  }
+
+  toml_datum_t sqpoll = toml_get(options, "sqpoll");
+  if (sqpoll.type == TOML_BOOLEAN) {
+    config->uring_sqpoll = sqpoll.u.boolean;
+  } else if (sqpoll.type != TOML_UNKNOWN) {
+    toml_error("Local uring 'sqpoll' must be a boolean");
+  }
+
+  config->uring_sqpoll_idle_ms = (int)local_parse_positive(
+      toml_get(options, "sqpoll_idle_ms"), LOCAL_URING_DEFAULT_SQPOLL_IDLE_MS,
+      "Local uring 'sqpoll_idle_ms' must be a non-negative integer");
+  config->uring_registered_files = (int)local_parse_positive(
+      toml_get(options, "registered_files"), 0,
+      "Local uring 'registered_files' must be a non-negative integer");
+  config->uring_fixed_buffers = (int)local_parse_positive(
+      toml_get(options, "fixed_buffers"), 0,
+      "Local uring 'fixed_buffers' must be a non-negative integer");
+  config->uring_fixed_buffer_size = (size_t)local_parse_positive(
+      toml_get(options, "fixed_buffer_size"),
+      LOCAL_URING_DEFAULT_FIXED_BUFFER_SIZE,
+      "Local uring 'fixed_buffer_size' must be a positive integer");
+  if (config->uring_fixed_buffer_size == 0) {
+    toml_error("Local uring 'fixed_buffer_size' must be a positive integer");
+  }
 }
 
 #endif // __LOCAL_CONFIG_H__
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -19,6 +20,16 @@
  * - writes and reads locally
  */
 
+void local_load_libc_ops(LibCOps *lib_c_ops) {
+  void *handle = dlopen("libc.so.6", RTLD_LAZY);
+  lib_c_ops->open = dlsym(handle, "open");
+  lib_c_ops->close = dlsym(handle, "close");
+  lib_c_ops->pread = dlsym(handle, "pread");
+  lib_c_ops->pwrite = dlsym(handle, "pwrite");
+  lib_c_ops->preadv2 = dlsym(handle, "preadv2");
+  lib_c_ops->pwritev2 = dlsym(handle, "pwritev2");
+}
+
 // terminal layer does not need arguments, there is no next layer
 LayerContext local_init() {
   // Create local layer state
@@ -27,19 +38,17 @@ LayerContext local_init() {
   // At the moment this layer does not have neither internal state or app
   // context
   LibCOps *lib_c_ops = malloc(sizeof(LibCOps));
-  void *handle = dlopen("libc.so.6", RTLD_LAZY);
-  lib_c_ops->open = dlsym(handle, "open");
-  lib_c_ops->close = dlsym(handle, "close");
-  lib_c_ops->pread = dlsym(handle, "pread");
-  lib_c_ops->pwrite = dlsym(handle, "pwrite");
+  local_load_libc_ops(lib_c_ops);
   layer_state.internal_state = (void *)lib_c_ops;
   layer_state.app_context = NULL;
 
   // Create LayerOps structure
-  LayerOps *local_ops = malloc(sizeof(LayerOps));
+  LayerOps *local_ops = calloc(1, sizeof(LayerOps));
   local_ops->ldestroy = local_destroy;
   local_ops->lpread = local_pread;
   local_ops->lpwrite = local_pwrite;
+  local_ops->lpreadv = local_preadv;
+  local_ops->lpwritev = local_pwritev;
   local_ops->lopen = local_open;
   local_ops->lclose = local_close;
   local_ops->lfsync = local_fsync;
@@ -51,7 +60,11 @@ LayerContext local_init() {
   local_ops->lreaddir = local_readdir;
   local_ops->lrename = local_rename;
   local_ops->lchmod = local_chmod;
+  local_ops->lmkdir = local_mkdir;
   local_ops->lfallocate = local_fallocate;
+  local_ops->lcopy_file_range = local_copy_file_range;
+  local_ops->ldirect_alignment = local_direct_alignment;
+  local_ops->lbacking_fd = local_backing_fd;
 
   layer_state.ops = local_ops;
 
@@ -91,6 +104,22 @@ ssize_t local_pread(int fd, void *buffer, size_t nbyte, off_t offset,
   return res;
 }
 
+ssize_t local_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                     LayerContext l) {
+
+  LibCOps *lib_ops = (LibCOps *)l.internal_state;
+  // calls local preadv2, flags as plain preadv
+  return lib_ops->preadv2(fd, iov, iovcnt, offset, 0);
+}
+
+ssize_t local_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                      off_t offset, LayerContext l) {
+
+  LibCOps *lib_ops = (LibCOps *)l.internal_state;
+  // calls local pwritev2, flags as plain pwritev
+  return lib_ops->pwritev2(fd, iov, iovcnt, offset, 0);
+}
+
 int local_open(const char *pathname, int flags, mode_t mode, LayerContext l) {
   LibCOps *lib_ops = (LibCOps *)l.internal_state;
   int fd;
@@ -151,7 +180,6 @@ int local_readdir(const char *path, void *buf,
 
   (void)offset;
   (void)fi;
-  (void)flags;
   (void)l;
 
   dp = opendir(path);
@@ -161,11 +189,18 @@ int local_readdir(const char *path, void *buf,
 
   while ((de = readdir(dp)) != NULL) {
     struct stat st;
-    memset(&st, 0, sizeof(st));
-    st.st_ino = de->d_ino;
-    st.st_mode = de->d_type << 12;
+    unsigned int fill_flags = 0;
+    // relative to the open directory, the path isn't resolved again
+    if ((flags & LAYER_READDIR_PLUS) &&
+        fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+      fill_flags = LAYER_FILL_DIR_PLUS;
+    } else {
+      memset(&st, 0, sizeof(st));
+      st.st_ino = de->d_ino;
+      st.st_mode = de->d_type << 12;
+    }
 
-    if (filler(buf, de->d_name, &st, 0, 0)) {
+    if (filler(buf, de->d_name, &st, 0, fill_flags)) {
       break;
     }
   }
@@ -186,6 +221,11 @@ int local_chmod(const char *path, mode_t mode, LayerContext l) {
   return res;
 }
 
+int local_mkdir(const char *path, mode_t mode, LayerContext l) {
+  (void)l;
+  return mkdir(path, mode);
+}
+
 int local_fsync(int fd, int isdatasync, LayerContext l) {
   if (isdatasync) {
     return fdatasync(fd);
@@ -198,3 +238,32 @@ int local_fallocate(int fd, off_t offset, int mode, off_t length,
   int res = fallocate(fd, mode, offset, length);
   return res;
 }
+
+ssize_t local_copy_file_range(int fd_in, off_t offset_in, int fd_out,
+                              off_t offset_out, size_t len, unsigned int flags,
+                              LayerContext l) {
+  // a reflink shares the extents, nothing is copied; only for ranges aligned
+  // to the blocks of the file system, the kernel cutting them at the end of
+  // the source
+  struct stat st;
+  if (flags == 0 && fstat(fd_in, &st) == 0 && offset_in < st.st_size) {
+    size_t clone_len = (off_t)len < st.st_size - offset_in
+                           ? len
+                           : (size_t)(st.st_size - offset_in);
+    struct file_clone_range clone = {.src_fd = fd_in,
+                                     .src_offset = (__u64)offset_in,
+                                     .src_length = (__u64)clone_len,
+                                     .dest_offset = (__u64)offset_out};
+    if (ioctl(fd_out, FICLONERANGE, &clone) == 0) {
+      return (ssize_t)clone_len;
+    }
+  }
+  // the kernel clones too when it can, and copies in place otherwise
+  loff_t off_in = offset_in;
+  loff_t off_out = offset_out;
+  return copy_file_range(fd_in, &off_in, fd_out, &off_out, len, flags);
+}
+
+size_t local_direct_alignment(LayerContext l) { return LOCAL_DIRECT_ALIGNMENT; }
+
+int local_backing_fd(int fd, LayerContext l) { return fd; }
@@ -5,19 +5,46 @@
 #include "config.h"
 #include <sys/stat.h>
 
+// Alignment of O_DIRECT I/O: the logical block size of 4Kn drives, a multiple
+// of the 512 bytes of the others
+#define LOCAL_DIRECT_ALIGNMENT 4096
+
 typedef struct {
   int (*open)(const char *pathname, int flags, ...);
   int (*close)(int fd);
   ssize_t (*pread)(int fd, void *buf, size_t count, off_t offset);
   ssize_t (*pwrite)(int fd, const void *buf, size_t count, off_t offset);
+  ssize_t (*preadv2)(int fd, const struct iovec *iov, int iovcnt,
+                     off_t offset, int flags);
+  ssize_t (*pwritev2)(int fd, const struct iovec *iov, int iovcnt,
+                      off_t offset, int flags);
 } LibCOps;
 
+/**
+ * @brief Resolve the libc calls the local layer forwards to
+ *
+ * @param lib_c_ops     -> table to fill
+ */
+void local_load_libc_ops(LibCOps *lib_c_ops);
+
 LayerContext local_init();
 void local_destroy(LayerContext l);
 ssize_t local_pread(int fd, void *buffer, size_t nbyte, off_t offset,
                     LayerContext l);
 ssize_t local_pwrite(int fd, const void *buffer, size_t nbyte, off_t offset,
                      LayerContext l);
+ssize_t local_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                     LayerContext l);
+ssize_t local_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                      off_t offset, LayerContext l);
+
+/**
+ * @brief open for the local layer
+ *
+ * The flags go to open as they are: with O_DIRECT, the I/O of the fd skips
+ * the host page cache and must be aligned to LOCAL_DIRECT_ALIGNMENT, else it
+ * fails with EINVAL.
+ */
 int local_open(const char *pathname, int flags, mode_t mode, LayerContext l);
 int local_close(int fd, LayerContext l);
 int local_ftruncate(int fd, off_t length, LayerContext l);
@@ -36,6 +63,21 @@ int local_rename(const char *from, const char *to, unsigned int flags,
 int local_fallocate(int fd, off_t offset, int mode, off_t length,
                     LayerContext l);
 int local_chmod(const char *path, mode_t mode, LayerContext l);
+int local_mkdir(const char *path, mode_t mode, LayerContext l);
 int local_fsync(int fd, int isdatasync, LayerContext l);
 
+/**
+ * @brief Copy of a range between local fds, a reflink when the file system
+ * can share the extents, else copy_file_range(2)
+ */
+ssize_t local_copy_file_range(int fd_in, off_t offset_in, int fd_out,
+                              off_t offset_out, size_t len, unsigned int flags,
+                              LayerContext l);
+size_t local_direct_alignment(LayerContext l);
+
+/**
+ * @brief Backing file of a local fd, the fd itself
+ */
+int local_backing_fd(int fd, LayerContext l);
+
 #endif
@@ -0,0 +1,676 @@
+#define _GNU_SOURCE
+#include "local_uring.h"
+#include "logdef.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * Local layer on an io_uring
+ * - reads and writes locally like the local layer, through a ring shared
+ *   with the kernel instead of one system call per request
+ * - synchronous ops submit a request and wait for its completion, the
+ *   asynchronous ops return once the request is queued
+ * - a completion thread reaps the completion queue and runs the callbacks
+ * - liburing is not a dependency, the ring is driven with the raw syscalls
+ */
+
+// largest transfer of a single read or write, as clamped by the kernel
+#define URING_MAX_RW_COUNT 0x7ffff000
+
+// user_data of the request that stops the completion thread
+#define URING_STOP_USER_DATA 0
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool done;
+  ssize_t res;
+  LocalUringRequest request;
+} SyncWait;
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                      flags, NULL, 0);
+}
+
+static int uring_register(int ring_fd, unsigned opcode, void *arg,
+                          unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static void unmap_rings(LocalUringState *state) {
+  if (state->sqes != NULL && state->sqes != MAP_FAILED) {
+    munmap(state->sqes, state->sqes_size);
+  }
+  if (state->cq_ptr != NULL && state->cq_ptr != MAP_FAILED &&
+      state->cq_ptr != state->sq_ptr) {
+    munmap(state->cq_ptr, state->cq_ring_size);
+  }
+  if (state->sq_ptr != NULL && state->sq_ptr != MAP_FAILED) {
+    munmap(state->sq_ptr, state->sq_ring_size);
+  }
+  state->sqes = NULL;
+  state->sq_ptr = NULL;
+  state->cq_ptr = NULL;
+}
+
+static int map_rings(LocalUringState *state, struct io_uring_params *p) {
+  state->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+  state->cq_ring_size =
+      p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = (p->features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap && state->cq_ring_size > state->sq_ring_size) {
+    state->sq_ring_size = state->cq_ring_size;
+  }
+
+  state->sq_ptr = mmap(NULL, state->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, state->ring_fd,
+                       IORING_OFF_SQ_RING);
+  if (state->sq_ptr == MAP_FAILED) {
+    return -1;
+  }
+  if (single_mmap) {
+    state->cq_ptr = state->sq_ptr;
+  } else {
+    state->cq_ptr = mmap(NULL, state->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, state->ring_fd,
+                         IORING_OFF_CQ_RING);
+    if (state->cq_ptr == MAP_FAILED) {
+      return -1;
+    }
+  }
+  state->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+  state->sqes = mmap(NULL, state->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, state->ring_fd,
+                     IORING_OFF_SQES);
+  if (state->sqes == MAP_FAILED) {
+    return -1;
+  }
+
+  char *sq = state->sq_ptr;
+  state->sq_head = (unsigned *)(sq + p->sq_off.head);
+  state->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+  state->sq_ring_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+  state->sq_flags = (unsigned *)(sq + p->sq_off.flags);
+  state->sq_array = (unsigned *)(sq + p->sq_off.array);
+
+  char *cq = state->cq_ptr;
+  state->cq_head = (unsigned *)(cq + p->cq_off.head);
+  state->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+  state->cq_ring_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+  state->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+  state->sq_entries = p->sq_entries;
+  return 0;
+}
+
+/**
+ * @brief Create the ring, with a submission polling thread if asked and
+ * allowed
+ */
+static int open_ring(LocalUringState *state, LocalConfig *config) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  if (config->uring_sqpoll) {
+    p.flags |= IORING_SETUP_SQPOLL;
+    p.sq_thread_idle = (unsigned)config->uring_sqpoll_idle_ms;
+  }
+
+  state->ring_fd = uring_setup((unsigned)config->uring_entries, &p);
+  if (state->ring_fd < 0 && config->uring_sqpoll) {
+    WARN_MSG("[LOCAL_URING] SQPOLL unavailable (%s), polling disabled",
+             strerror(errno));
+    memset(&p, 0, sizeof(p));
+    state->ring_fd = uring_setup((unsigned)config->uring_entries, &p);
+  }
+  if (state->ring_fd < 0) {
+    return -1;
+  }
+  state->sqpoll = (p.flags & IORING_SETUP_SQPOLL) != 0;
+
+  if (map_rings(state, &p) != 0) {
+    int err = errno;
+    unmap_rings(state);
+    close(state->ring_fd);
+    state->ring_fd = -1;
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+static void register_files(LocalUringState *state, int n_files) {
+  if (n_files <= 0) {
+    return;
+  }
+  int *fds = malloc(n_files * sizeof(int));
+  state->file_registered = calloc(n_files, sizeof(bool));
+  if (fds == NULL || state->file_registered == NULL) {
+    free(fds);
+    free(state->file_registered);
+    state->file_registered = NULL;
+    return;
+  }
+  // sparse table, slots are filled as files are opened
+  for (int i = 0; i < n_files; i++) {
+    fds[i] = -1;
+  }
+  if (uring_register(state->ring_fd, IORING_REGISTER_FILES, fds,
+                     (unsigned)n_files) < 0) {
+    WARN_MSG("[LOCAL_URING] Failed to register files (%s)", strerror(errno));
+    free(state->file_registered);
+    state->file_registered = NULL;
+  } else {
+    state->n_files = n_files;
+  }
+  free(fds);
+}
+
+static void register_buffers(LocalUringState *state, int n_buffers,
+                             size_t buffer_size) {
+  if (n_buffers <= 0) {
+    return;
+  }
+  void *arena = NULL;
+  if (posix_memalign(&arena, (size_t)sysconf(_SC_PAGESIZE),
+                     n_buffers * buffer_size) != 0) {
+    WARN_MSG("[LOCAL_URING] Failed to allocate the registered buffers");
+    return;
+  }
+  struct iovec *iov = malloc(n_buffers * sizeof(struct iovec));
+  state->buffer_used = calloc(n_buffers, sizeof(bool));
+  if (iov == NULL || state->buffer_used == NULL) {
+    free(iov);
+    free(state->buffer_used);
+    state->buffer_used = NULL;
+    free(arena);
+    return;
+  }
+  for (int i = 0; i < n_buffers; i++) {
+    iov[i].iov_base = (char *)arena + i * buffer_size;
+    iov[i].iov_len = buffer_size;
+  }
+  if (uring_register(state->ring_fd, IORING_REGISTER_BUFFERS, iov,
+                     (unsigned)n_buffers) < 0) {
+    WARN_MSG("[LOCAL_URING] Failed to register buffers (%s)",
+             strerror(errno));
+    free(state->buffer_used);
+    state->buffer_used = NULL;
+    free(arena);
+  } else {
+    state->arena = arena;
+    state->n_buffers = n_buffers;
+    state->buffer_size = buffer_size;
+  }
+  free(iov);
+}
+
+/**
+ * @brief Use the registered slot of fd if it has one
+ */
+static void set_sqe_file(LocalUringState *state, struct io_uring_sqe *sqe,
+                         int fd) {
+  sqe->fd = fd;
+  if (fd >= 0 && fd < state->n_files && state->file_registered[fd]) {
+    sqe->flags |= IOSQE_FIXED_FILE;
+  }
+}
+
+/**
+ * @brief Registered buffer holding [buffer, buffer + nbyte), -1 if none
+ */
+static int fixed_buffer_index(LocalUringState *state, const void *buffer,
+                              size_t nbyte) {
+  if (state->arena == NULL) {
+    return -1;
+  }
+  const char *p = buffer;
+  const char *end = state->arena + state->n_buffers * state->buffer_size;
+  if (p < state->arena || p >= end) {
+    return -1;
+  }
+  size_t index = (size_t)(p - state->arena) / state->buffer_size;
+  const char *limit = state->arena + (index + 1) * state->buffer_size;
+  if (nbyte > (size_t)(limit - p)) {
+    return -1;
+  }
+  return (int)index;
+}
+
+/**
+ * @brief Queue sqe on the ring, the completion of request will be reaped by
+ * the completion thread
+ *
+ * @return int          -> 0 if submitted, -1 with errno set otherwise
+ */
+static int submit_sqe(LocalUringState *state, const struct io_uring_sqe *sqe,
+                      LocalUringRequest *request) {
+  pthread_mutex_lock(&state->lock);
+  // every inflight request holds at most one slot of each ring
+  while (state->inflight >= state->sq_entries) {
+    pthread_cond_wait(&state->slots, &state->lock);
+  }
+
+  unsigned tail = *state->sq_tail;
+  unsigned index = tail & *state->sq_ring_mask;
+  state->sqes[index] = *sqe;
+  state->sqes[index].user_data = (uint64_t)(uintptr_t)request;
+  state->sq_array[index] = index;
+  __atomic_store_n(state->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  if (state->sqpoll) {
+    // the poller may have gone idle, it has to see the new tail first
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(state->sq_flags, __ATOMIC_RELAXED) &
+        IORING_SQ_NEED_WAKEUP) {
+      uring_enter(state->ring_fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+    }
+  } else {
+    int res;
+    do {
+      res = uring_enter(state->ring_fd, 1, 0, 0);
+    } while (res < 0 && errno == EINTR);
+    if (res < 1) {
+      // the kernel did not consume the entry, take it back
+      int err = res < 0 ? errno : EAGAIN;
+      __atomic_store_n(state->sq_tail, tail, __ATOMIC_RELEASE);
+      pthread_mutex_unlock(&state->lock);
+      errno = err;
+      return -1;
+    }
+  }
+  state->inflight++;
+  pthread_mutex_unlock(&state->lock);
+  return 0;
+}
+
+static void *completion_loop(void *arg) {
+  LocalUringState *state = arg;
+
+  while (1) {
+    unsigned head = *state->cq_head;
+    unsigned tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      if (uring_enter(state->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+          errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        ERROR_MSG("[LOCAL_URING] Failed to wait for completions (%s)",
+                  strerror(errno));
+        return NULL;
+      }
+      continue;
+    }
+
+    struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_ring_mask];
+    uint64_t user_data = cqe->user_data;
+    int res = cqe->res;
+    __atomic_store_n(state->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    if (user_data == URING_STOP_USER_DATA) {
+      return NULL;
+    }
+
+    // the request may not outlive its callback
+    LocalUringRequest *request = (LocalUringRequest *)(uintptr_t)user_data;
+    bool owned = request->owned;
+    request->callback(res, request->ctx);
+    if (owned) {
+      free(request);
+    }
+
+    pthread_mutex_lock(&state->lock);
+    state->inflight--;
+    pthread_cond_broadcast(&state->slots);
+    pthread_mutex_unlock(&state->lock);
+  }
+}
+
+static void sync_complete(ssize_t res, void *ctx) {
+  SyncWait *wait = ctx;
+  pthread_mutex_lock(&wait->mutex);
+  wait->res = res;
+  wait->done = true;
+  pthread_cond_signal(&wait->cond);
+  pthread_mutex_unlock(&wait->mutex);
+}
+
+/**
+ * @brief Submit sqe and wait for its completion
+ *
+ * @return ssize_t      -> result of the request, -1 with errno set on failure
+ */
+static ssize_t submit_and_wait(LocalUringState *state,
+                               const struct io_uring_sqe *sqe) {
+  SyncWait wait;
+  pthread_mutex_init(&wait.mutex, NULL);
+  pthread_cond_init(&wait.cond, NULL);
+  wait.done = false;
+  wait.res = 0;
+  wait.request.callback = sync_complete;
+  wait.request.ctx = &wait;
+  wait.request.owned = false;
+
+  ssize_t res = -1;
+  if (submit_sqe(state, sqe, &wait.request) == 0) {
+    pthread_mutex_lock(&wait.mutex);
+    while (!wait.done) {
+      pthread_cond_wait(&wait.cond, &wait.mutex);
+    }
+    pthread_mutex_unlock(&wait.mutex);
+    res = wait.res;
+    if (res < 0) {
+      errno = (int)-res;
+      res = -1;
+    }
+  }
+
+  pthread_cond_destroy(&wait.cond);
+  pthread_mutex_destroy(&wait.mutex);
+  return res;
+}
+
+static void prep_rw(LocalUringState *state, struct io_uring_sqe *sqe,
+                    int fd, const void *buffer, size_t nbyte, off_t offset,
+                    bool write) {
+  memset(sqe, 0, sizeof(*sqe));
+  if (nbyte > URING_MAX_RW_COUNT) {
+    nbyte = URING_MAX_RW_COUNT;
+  }
+  int index = fixed_buffer_index(state, buffer, nbyte);
+  if (index >= 0) {
+    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->buf_index = (uint16_t)index;
+  } else {
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+  }
+  set_sqe_file(state, sqe, fd);
+  sqe->addr = (uint64_t)(uintptr_t)buffer;
+  sqe->len = (uint32_t)nbyte;
+  sqe->off = (uint64_t)offset;
+}
+
+static void prep_rwv(LocalUringState *state, struct io_uring_sqe *sqe,
+                     int fd, const struct iovec *iov, int iovcnt,
+                     off_t offset, bool write) {
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+  set_sqe_file(state, sqe, fd);
+  sqe->addr = (uint64_t)(uintptr_t)iov;
+  sqe->len = (uint32_t)iovcnt;
+  sqe->off = (uint64_t)offset;
+}
+
+/**
+ * @brief Point the registered slot of fd at the file, or clear it
+ */
+static void update_file_slot(LocalUringState *state, int fd, bool opened) {
+  if (fd < 0 || fd >= state->n_files) {
+    return;
+  }
+  pthread_mutex_lock(&state->lock);
+  int value = opened ? fd : -1;
+  struct io_uring_files_update update;
+  memset(&update, 0, sizeof(update));
+  update.offset = (unsigned)fd;
+  update.fds = (uint64_t)(uintptr_t)&value;
+  if (uring_register(state->ring_fd, IORING_REGISTER_FILES_UPDATE, &update,
+                     1) == 1) {
+    state->file_registered[fd] = opened;
+  } else {
+    state->file_registered[fd] = false;
+  }
+  pthread_mutex_unlock(&state->lock);
+}
+
+LayerContext local_uring_init(LocalConfig *config) {
+  LayerContext layer_state;
+
+  LocalUringState *state = calloc(1, sizeof(LocalUringState));
+  local_load_libc_ops(&state->libc);
+  pthread_mutex_init(&state->lock, NULL);
+  pthread_cond_init(&state->slots, NULL);
+  state->ring_fd = -1;
+
+  if (open_ring(state, config) != 0) {
+    WARN_MSG("[LOCAL_URING] io_uring unavailable (%s), using system calls",
+             strerror(errno));
+  } else if (pthread_create(&state->completer, NULL, completion_loop,
+                            state) != 0) {
+    WARN_MSG("[LOCAL_URING] Failed to start the completion thread, using "
+             "system calls");
+    unmap_rings(state);
+    close(state->ring_fd);
+    state->ring_fd = -1;
+  } else {
+    register_files(state, config->uring_registered_files);
+    register_buffers(state, config->uring_fixed_buffers,
+                     config->uring_fixed_buffer_size);
+  }
+
+  layer_state.internal_state = state;
+  layer_state.app_context = NULL;
+
+  LayerOps *local_ops = calloc(1, sizeof(LayerOps));
+  local_ops->ldestroy = local_uring_destroy;
+  local_ops->lftruncate = local_ftruncate;
+  local_ops->ltruncate = local_truncate;
+  local_ops->lfstat = local_fstat;
+  local_ops->llstat = local_lstat;
+  local_ops->lunlink = local_unlink;
+  local_ops->lreaddir = local_readdir;
+  local_ops->lrename = local_rename;
+  local_ops->lchmod = local_chmod;
+  local_ops->lmkdir = local_mkdir;
+  local_ops->lfallocate = local_fallocate;
+  local_ops->lcopy_file_range = local_copy_file_range;
+  local_ops->ldirect_alignment = local_direct_alignment;
+  local_ops->lbacking_fd = local_backing_fd;
+  if (state->ring_fd >= 0) {
+    local_ops->lpread = local_uring_pread;
+    local_ops->lpwrite = local_uring_pwrite;
+    local_ops->lpreadv = local_uring_preadv;
+    local_ops->lpwritev = local_uring_pwritev;
+    local_ops->lopen = local_uring_open;
+    local_ops->lclose = local_uring_close;
+    local_ops->lfsync = local_uring_fsync;
+    local_ops->lpread_async = local_uring_pread_async;
+    local_ops->lpwrite_async = local_uring_pwrite_async;
+  } else {
+    local_ops->lpread = local_pread;
+    local_ops->lpwrite = local_pwrite;
+    local_ops->lpreadv = local_preadv;
+    local_ops->lpwritev = local_pwritev;
+    local_ops->lopen = local_open;
+    local_ops->lclose = local_close;
+    local_ops->lfsync = local_fsync;
+    // the async ops stay NULL, layer_p*_async() adapts the sync ones
+  }
+
+  layer_state.ops = local_ops;
+
+  // Terminal layer, there are no next layers
+  layer_state.next_layers = NULL;
+
+  if (DEBUG_ENABLED()) {
+    DEBUG_MSG("[LOCAL_URING] Init ring_fd=%d sqpoll=%d files=%d buffers=%d",
+              state->ring_fd, state->sqpoll, state->n_files,
+              state->n_buffers);
+  }
+
+  return layer_state;
+}
+
+void local_uring_destroy(LayerContext l) {
+  LocalUringState *state = (LocalUringState *)l.internal_state;
+
+  if (DEBUG_ENABLED()) {
+    DEBUG_MSG("[LOCAL_URING] Destroy called");
+  }
+
+  if (state->ring_fd >= 0) {
+    // let the submitted requests complete before stopping the thread
+    pthread_mutex_lock(&state->lock);
+    while (state->inflight > 0) {
+      pthread_cond_wait(&state->slots, &state->lock);
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    struct io_uring_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_NOP;
+    if (submit_sqe(state, &sqe, NULL) == 0) {
+      pthread_join(state->completer, NULL);
+    } else {
+      ERROR_MSG("[LOCAL_URING] Failed to stop the completion thread");
+      pthread_detach(state->completer);
+    }
+
+    unmap_rings(state);
+    close(state->ring_fd);
+  }
+
+  free(state->file_registered);
+  free(state->buffer_used);
+  free(state->arena);
+  pthread_cond_destroy(&state->slots);
+  pthread_mutex_destroy(&state->lock);
+  free(state);
+  free(l.ops);
+}
+
+ssize_t local_uring_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                          LayerContext l) {
+  LocalUringState *state = (LocalUringState *)l.internal_state;
+  struct io_uring_sqe sqe;
+  prep_rw(state, &sqe, fd, buffer, nbyte, offset, false);
+  return submit_and_wait(state, &sqe);
+}
+
+ssize_t local_uring_pwrite(int fd, const void *buffer, size_t nbyte,
+                           off_t offset, LayerContext l) {
+  LocalUringState *state = (LocalUringState *)l.internal_state;
+  struct io_uring_sqe sqe;
+  prep_rw(state, &sqe, fd, buffer, nbyte, offset, true);
+  return submit_and_wait(state, &sqe);
+}
+
+ssize_t local_uring_preadv(int fd, const struct iovec *iov, int iovcnt,
+                           off_t offset, LayerContext l) {
+  LocalUringState *state = (LocalUringState *)l.internal_state;
+  struct io_uring_sqe sqe;
+  prep_rwv(state, &sqe, fd, iov, iovcnt, offset, false);
+  return submit_and_wait(state, &sqe);
+}
+
+ssize_t local_uring_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                            off_t offset, LayerContext l) {
+  LocalUringState *state = (LocalUringState *)l.internal_state;
+  struct io_uring_sqe sqe;
+  prep_rwv(state, &sqe, fd, iov, iovcnt, offset, true);
+  return submit_and_wait(state, &sqe);
+}
+
+int local_uring_open(const char *pathname, int flags, mode_t mode,
+                     LayerContext l) {
+  LocalUringState *state = (LocalUringState *)l.internal_state;
+  int fd = local_open(pathname, flags, mode, l);
+  if (fd >= 0) {
+    update_file_slot(state, fd, true);
+  }
+  return fd;
+}
+
+int local_uring_close(int fd, LayerContext l) {
+  LocalUringState *state = (LocalUringState *)l.internal_state;
+  // the slot holds a reference to the file, release it before the number
+  // can be reused
+  if (fd >= 0 && fd < state->n_files && state->file_registered[fd]) {
+    update_file_slot(state, fd, false);
+  }
+  return local_close(fd, l);
+}
+
+int local_uring_fsync(int fd, int isdatasync, LayerContext l) {
+  LocalUringState *state = (LocalUringState *)l.internal_state;
+  struct io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_FSYNC;
+  set_sqe_file(state, &sqe, fd);
+  if (isdatasync) {
+    sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+  }
+  return (int)submit_and_wait(state, &sqe);
+}
+
+static int submit_async(int fd, const void *buffer, size_t nbyte,
+                        off_t offset, bool write, LayerIoCallback callback,
+                        void *ctx, LayerContext l) {
+  LocalUringState *state = (LocalUringState *)l.internal_state;
+
+  LocalUringRequest *request = malloc(sizeof(LocalUringRequest));
+  if (request == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  request->callback = callback;
+  request->ctx = ctx;
+  request->owned = true;
+
+  struct io_uring_sqe sqe;
+  prep_rw(state, &sqe, fd, buffer, nbyte, offset, write);
+  if (submit_sqe(state, &sqe, request) != 0) {
+    free(request);
+    return -1;
+  }
+  return 0;
+}
+
+int local_uring_pread_async(int fd, void *buffer, size_t nbyte, off_t offset,
+                            LayerIoCallback callback, void *ctx,
+                            LayerContext l) {
+  return submit_async(fd, buffer, nbyte, offset, false, callback, ctx, l);
+}
+
+int local_uring_pwrite_async(int fd, const void *buffer, size_t nbyte,
+                             off_t offset, LayerIoCallback callback,
+                             void *ctx, LayerContext l) {
+  return submit_async(fd, buffer, nbyte, offset, true, callback, ctx, l);
+}
+
+void *local_uring_buffer_get(LayerContext l) {
+  LocalUringState *state = (LocalUringState *)l.internal_state;
+  void *buffer = NULL;
+  pthread_mutex_lock(&state->lock);
+  for (int i = 0; i < state->n_buffers; i++) {
+    if (!state->buffer_used[i]) {
+      state->buffer_used[i] = true;
+      buffer = state->arena + i * state->buffer_size;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&state->lock);
+  return buffer;
+}
+
+void local_uring_buffer_put(LayerContext l, void *buffer) {
+  LocalUringState *state = (LocalUringState *)l.internal_state;
+  int index = fixed_buffer_index(state, buffer, 0);
+  if (index < 0) {
+    return;
+  }
+  pthread_mutex_lock(&state->lock);
+  state->buffer_used[index] = false;
+  pthread_mutex_unlock(&state->lock);
+}
@@ -0,0 +1,138 @@
+#ifndef __LOCAL_URING_H__
+#define __LOCAL_URING_H__
+
+#include "../../shared/types/layer_context.h"
+#include "config.h"
+#include "local.h"
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+typedef struct {
+  LayerIoCallback callback;
+  void *ctx;
+  bool owned; // allocated on submission, freed once completed
+} LocalUringRequest;
+
+typedef struct {
+  LibCOps libc; // first member, so the sync local_* ops work on this state
+
+  int ring_fd; // -1 when io_uring is unavailable, requests run synchronously
+  bool sqpoll;
+  unsigned sq_entries;
+
+  // submission queue ring
+  void *sq_ptr;
+  size_t sq_ring_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_ring_mask;
+  unsigned *sq_flags;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  // completion queue ring
+  void *cq_ptr;
+  size_t cq_ring_size;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_ring_mask;
+  struct io_uring_cqe *cqes;
+
+  pthread_mutex_t lock;
+  pthread_cond_t slots; // signaled when a request completes
+  unsigned inflight;    // never above sq_entries, so the rings cannot overflow
+  pthread_t completer;
+
+  // registered files, a file descriptor uses the slot of its own number
+  int n_files;
+  bool *file_registered;
+
+  // registered buffers, carved from a single arena
+  char *arena;
+  size_t buffer_size;
+  int n_buffers;
+  bool *buffer_used;
+} LocalUringState;
+
+/**
+ * @brief Initialize the local layer on top of an io_uring
+ *
+ * Falls back to the synchronous system calls when the ring cannot be set up.
+ *
+ * @param config        -> local layer configuration (uring_* fields)
+ * @return LayerContext -> context of the local layer
+ */
+LayerContext local_uring_init(LocalConfig *config);
+void local_uring_destroy(LayerContext l);
+ssize_t local_uring_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                          LayerContext l);
+ssize_t local_uring_pwrite(int fd, const void *buffer, size_t nbyte,
+                           off_t offset, LayerContext l);
+ssize_t local_uring_preadv(int fd, const struct iovec *iov, int iovcnt,
+                           off_t offset, LayerContext l);
+ssize_t local_uring_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                            off_t offset, LayerContext l);
+int local_uring_open(const char *pathname, int flags, mode_t mode,
+                     LayerContext l);
+int local_uring_close(int fd, LayerContext l);
+int local_uring_fsync(int fd, int isdatasync, LayerContext l);
+
+/**
+ * @brief Submit a read without waiting for it (lpread_async)
+ *
+ * The buffer must stay valid until the callback, which runs on the
+ * completion thread and must not block.
+ *
+ * @param fd            -> file descriptor
+ * @param buffer        -> buffer to read into
+ * @param nbyte         -> number of bytes to read
+ * @param offset        -> offset value
+ * @param callback      -> called with the result once the read completes
+ * @param ctx           -> passed to the callback
+ * @param l             -> context of the local layer
+ * @return int          -> 0 if submitted, -1 with errno set otherwise
+ */
+int local_uring_pread_async(int fd, void *buffer, size_t nbyte, off_t offset,
+                            LayerIoCallback callback, void *ctx,
+                            LayerContext l);
+
+/**
+ * @brief Submit a write without waiting for it (lpwrite_async)
+ *
+ * The buffer must stay valid until the callback, which runs on the
+ * completion thread and must not block.
+ *
+ * @param fd            -> file descriptor
+ * @param buffer        -> buffer to write
+ * @param nbyte         -> number of bytes to write
+ * @param offset        -> offset value
+ * @param callback      -> called with the result once the write completes
+ * @param ctx           -> passed to the callback
+ * @param l             -> context of the local layer
+ * @return int          -> 0 if submitted, -1 with errno set otherwise
+ */
+int local_uring_pwrite_async(int fd, const void *buffer, size_t nbyte,
+                             off_t offset, LayerIoCallback callback,
+                             void *ctx, LayerContext l);
+
+/**
+ * @brief Take a registered buffer, reads and writes within it skip the page
+ * pinning of every request
+ *
+ * @param l             -> context of the local layer
+ * @return void*        -> buffer of uring_fixed_buffer_size bytes, NULL if
+ * none is free
+ */
+void *local_uring_buffer_get(LayerContext l);
+
+/**
+ * @brief Give back a buffer taken with local_uring_buffer_get
+ *
+ * @param l             -> context of the local layer
+ * @param buffer        -> registered buffer
+ */
+void local_uring_buffer_put(LayerContext l, void *buffer);
+
+#endif
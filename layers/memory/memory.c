@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#include "memory.h"
+#include "logdef.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MEMORY_STATE(l) ((MemoryState *)(l).internal_state)
+
+static void file_touch(MemoryFile *file) {
+  clock_gettime(CLOCK_REALTIME_COARSE, &file->st.st_mtim);
+  file->st.st_ctim = file->st.st_mtim;
+}
+
+// Drop a reference to a file, the caller holds the mutex of the layer
+static void file_unref(MemoryFile *file) {
+  if (--file->refs > 0) {
+    return;
+  }
+  pthread_rwlock_destroy(&file->lock);
+  free(file->data);
+  free(file);
+}
+
+static MemoryFile *file_create(MemoryState *state, const char *path,
+                               mode_t mode) {
+  MemoryFile *file = calloc(1, sizeof(MemoryFile));
+  if (!file) {
+    return NULL;
+  }
+  file->path = strdup(path);
+  if (!file->path) {
+    free(file);
+    return NULL;
+  }
+  pthread_rwlock_init(&file->lock, NULL);
+  file->st.st_ino = ++state->next_ino;
+  file->st.st_mode = S_IFREG | (mode & 07777);
+  file->st.st_uid = getuid();
+  file->st.st_gid = getgid();
+  file->st.st_blksize = 4096;
+  file_touch(file);
+  file->st.st_atim = file->st.st_mtim;
+  file->refs = 1;
+  HASH_ADD_KEYPTR(hh, state->files, file->path, strlen(file->path), file);
+  return file;
+}
+
+static void file_unlink(MemoryState *state, MemoryFile *file) {
+  HASH_DEL(state->files, file);
+  free(file->path);
+  file->path = NULL;
+  file_unref(file);
+}
+
+static MemoryFile *fd_file(MemoryState *state, int fd) {
+  MemoryFile **slot = fd_table_get(&state->fds, fd);
+  return slot ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : NULL;
+}
+
+// Resize a file, the caller holds its write lock
+static int file_resize(MemoryFile *file, size_t size) {
+  if (size > file->capacity) {
+    size_t capacity = file->capacity ? file->capacity : 4096;
+    while (capacity < size) {
+      capacity *= 2;
+    }
+    unsigned char *data = realloc(file->data, capacity);
+    if (!data) {
+      errno = ENOSPC;
+      return -1;
+    }
+    file->data = data;
+    file->capacity = capacity;
+  }
+  if (size > file->size) {
+    memset(file->data + file->size, 0, size - file->size);
+  }
+  file->size = size;
+  file_touch(file);
+  return 0;
+}
+
+static void file_stat(MemoryFile *file, struct stat *stbuf) {
+  pthread_rwlock_rdlock(&file->lock);
+  *stbuf = file->st;
+  stbuf->st_size = (off_t)file->size;
+  stbuf->st_blocks = (blkcnt_t)((file->size + 511) / 512);
+  pthread_rwlock_unlock(&file->lock);
+  stbuf->st_nlink = file->path ? 1 : 0;
+}
+
+static ssize_t memory_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                            LayerContext l) {
+  MemoryFile *file = fd_file(MEMORY_STATE(l), fd);
+  if (!file) {
+    errno = EBADF;
+    return -1;
+  }
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  pthread_rwlock_rdlock(&file->lock);
+  size_t n = 0;
+  if ((size_t)offset < file->size) {
+    n = file->size - (size_t)offset;
+    n = n < nbyte ? n : nbyte;
+    memcpy(buffer, file->data + offset, n);
+  }
+  pthread_rwlock_unlock(&file->lock);
+  return (ssize_t)n;
+}
+
+static ssize_t memory_pwrite(int fd, const void *buffer, size_t nbyte,
+                             off_t offset, LayerContext l) {
+  MemoryFile *file = fd_file(MEMORY_STATE(l), fd);
+  if (!file) {
+    errno = EBADF;
+    return -1;
+  }
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  size_t end = (size_t)offset + nbyte;
+  pthread_rwlock_wrlock(&file->lock);
+  if (end > file->size) {
+    if (file_resize(file, end) != 0) { // touches the file
+      pthread_rwlock_unlock(&file->lock);
+      return -1;
+    }
+  } else {
+    file_touch(file);
+  }
+  memcpy(file->data + offset, buffer, nbyte);
+  pthread_rwlock_unlock(&file->lock);
+  return (ssize_t)nbyte;
+}
+
+static int memory_open(const char *pathname, int flags, mode_t mode,
+                       LayerContext l) {
+  MemoryState *state = MEMORY_STATE(l);
+  pthread_mutex_lock(&state->mutex);
+  MemoryFile *file = NULL;
+  HASH_FIND_STR(state->files, pathname, file);
+  if (file && (flags & O_CREAT) && (flags & O_EXCL)) {
+    pthread_mutex_unlock(&state->mutex);
+    errno = EEXIST;
+    return -1;
+  }
+  if (!file) {
+    if (!(flags & O_CREAT)) {
+      pthread_mutex_unlock(&state->mutex);
+      errno = ENOENT;
+      return -1;
+    }
+    file = file_create(state, pathname, mode);
+    if (!file) {
+      pthread_mutex_unlock(&state->mutex);
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+
+  int fd = 0;
+  MemoryFile **slot = fd_table_slot(&state->fds, fd);
+  while (slot && *slot) {
+    slot = fd_table_slot(&state->fds, ++fd);
+  }
+  if (!slot) {
+    pthread_mutex_unlock(&state->mutex);
+    errno = EMFILE;
+    return -1;
+  }
+  if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY) {
+    pthread_rwlock_wrlock(&file->lock);
+    file_resize(file, 0);
+    pthread_rwlock_unlock(&file->lock);
+  }
+  file->refs++;
+  __atomic_store_n(slot, file, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&state->mutex);
+  return fd;
+}
+
+static int memory_close(int fd, LayerContext l) {
+  MemoryState *state = MEMORY_STATE(l);
+  pthread_mutex_lock(&state->mutex);
+  MemoryFile *file = fd_file(state, fd);
+  if (!file) {
+    pthread_mutex_unlock(&state->mutex);
+    errno = EBADF;
+    return -1;
+  }
+  __atomic_store_n((MemoryFile **)fd_table_get(&state->fds, fd), NULL,
+                   __ATOMIC_RELEASE);
+  file_unref(file);
+  pthread_mutex_unlock(&state->mutex);
+  return 0;
+}
+
+static int memory_ftruncate(int fd, off_t length, LayerContext l) {
+  MemoryFile *file = fd_file(MEMORY_STATE(l), fd);
+  if (!file) {
+    errno = EBADF;
+    return -1;
+  }
+  if (length < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  pthread_rwlock_wrlock(&file->lock);
+  int res = file_resize(file, (size_t)length);
+  pthread_rwlock_unlock(&file->lock);
+  return res;
+}
+
+static int memory_truncate(const char *path, off_t length, LayerContext l) {
+  MemoryState *state = MEMORY_STATE(l);
+  if (length < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  pthread_mutex_lock(&state->mutex);
+  MemoryFile *file = NULL;
+  HASH_FIND_STR(state->files, path, file);
+  int res = -1;
+  if (file) {
+    pthread_rwlock_wrlock(&file->lock);
+    res = file_resize(file, (size_t)length);
+    pthread_rwlock_unlock(&file->lock);
+  } else {
+    errno = ENOENT;
+  }
+  pthread_mutex_unlock(&state->mutex);
+  return res;
+}
+
+static int memory_fstat(int fd, struct stat *stbuf, LayerContext l) {
+  MemoryFile *file = fd_file(MEMORY_STATE(l), fd);
+  if (!file) {
+    errno = EBADF;
+    return -1;
+  }
+  file_stat(file, stbuf);
+  return 0;
+}
+
+static int memory_lstat(const char *path, struct stat *stbuf,
+                        LayerContext l) {
+  MemoryState *state = MEMORY_STATE(l);
+  pthread_mutex_lock(&state->mutex);
+  MemoryFile *file = NULL;
+  HASH_FIND_STR(state->files, path, file);
+  if (!file) {
+    pthread_mutex_unlock(&state->mutex);
+    errno = ENOENT;
+    return -1;
+  }
+  file_stat(file, stbuf);
+  pthread_mutex_unlock(&state->mutex);
+  return 0;
+}
+
+static int memory_unlink(const char *path, LayerContext l) {
+  MemoryState *state = MEMORY_STATE(l);
+  pthread_mutex_lock(&state->mutex);
+  MemoryFile *file = NULL;
+  HASH_FIND_STR(state->files, path, file);
+  if (!file) {
+    pthread_mutex_unlock(&state->mutex);
+    errno = ENOENT;
+    return -1;
+  }
+  file_unlink(state, file);
+  pthread_mutex_unlock(&state->mutex);
+  return 0;
+}
+
+static int memory_rename(const char *from, const char *to, unsigned int flags,
+                         LayerContext l) {
+  MemoryState *state = MEMORY_STATE(l);
+  if (flags & ~RENAME_NOREPLACE) {
+    errno = EINVAL;
+    return -1;
+  }
+  pthread_mutex_lock(&state->mutex);
+  MemoryFile *file = NULL, *target = NULL;
+  HASH_FIND_STR(state->files, from, file);
+  HASH_FIND_STR(state->files, to, target);
+  int err = 0;
+  char *path = NULL;
+  if (!file) {
+    err = ENOENT;
+  } else if (target == file) {
+    err = 0;
+  } else if (target && (flags & RENAME_NOREPLACE)) {
+    err = EEXIST;
+  } else if (!(path = strdup(to))) {
+    err = ENOMEM;
+  } else {
+    if (target) {
+      file_unlink(state, target);
+    }
+    HASH_DEL(state->files, file);
+    free(file->path);
+    file->path = path;
+    HASH_ADD_KEYPTR(hh, state->files, file->path, strlen(file->path), file);
+  }
+  pthread_mutex_unlock(&state->mutex);
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+static int memory_fsync(int fd, int isdatasync, LayerContext l) {
+  if (!fd_file(MEMORY_STATE(l), fd)) {
+    errno = EBADF;
+    return -1;
+  }
+  return 0;
+}
+
+static void memory_destroy(LayerContext l) {
+  MemoryState *state = MEMORY_STATE(l);
+  for (int fd = 0; fd < fd_table_end(&state->fds); fd++) {
+    MemoryFile *open_file = fd_file(state, fd);
+    if (open_file) {
+      file_unref(open_file);
+    }
+  }
+  fd_table_destroy(&state->fds);
+  MemoryFile *file, *tmp;
+  HASH_ITER(hh, state->files, file, tmp) { file_unlink(state, file); }
+  pthread_mutex_destroy(&state->mutex);
+  free(state);
+  free(l.ops);
+}
+
+LayerContext memory_init() {
+  LayerContext l = {0};
+  MemoryState *state = calloc(1, sizeof(MemoryState));
+  LayerOps *ops = calloc(1, sizeof(LayerOps));
+  if (!state || !ops) {
+    ERROR_MSG("[MEMORY] Failed to allocate memory for the layer");
+    free(state);
+    free(ops);
+    return l;
+  }
+  pthread_mutex_init(&state->mutex, NULL);
+  fd_table_init(&state->fds, sizeof(MemoryFile *), NULL);
+
+  ops->lpread = memory_pread;
+  ops->lpwrite = memory_pwrite;
+  ops->lopen = memory_open;
+  ops->lclose = memory_close;
+  ops->lftruncate = memory_ftruncate;
+  ops->ltruncate = memory_truncate;
+  ops->lfstat = memory_fstat;
+  ops->llstat = memory_lstat;
+  ops->lunlink = memory_unlink;
+  ops->lrename = memory_rename;
+  ops->lfsync = memory_fsync;
+  ops->ldestroy = memory_destroy;
+
+  l.ops = ops;
+  l.internal_state = state;
+  return l;
+}
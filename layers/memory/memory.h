@@ -0,0 +1,56 @@
+#ifndef __MEMORY_H__
+#define __MEMORY_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include "../../shared/types/layer_context.h"
+#include "../../shared/utils/fd_table.h"
+#include <pthread.h>
+#include <sys/stat.h>
+
+/*
+ * ============================================================================
+ * MEMORY - TERMINAL LAYER THAT KEEPS THE FILES IN RAM
+ * ============================================================================
+ *
+ * A backend with no device behind it, for benchmarks and tests of the layers
+ * above: the cost of a stack over a memory layer is the CPU cost of its
+ * layers and a memcpy.
+ *
+ * - every memory layer has its own namespace of flat paths, gone when it is
+ *   destroyed; nothing is written to disk
+ * - open, close, pread, pwrite, ftruncate, truncate, fstat, lstat, unlink,
+ *   rename and fsync (a no-op); file descriptors are indexes of the fd table
+ *   of the layer, the lowest free one on open
+ * - a file is a contiguous buffer grown by doubling; reads and writes of a
+ *   file take its rwlock, the namespace and the fd table one mutex of the
+ *   layer
+ * - an unlinked file lives as long as a descriptor of it is open
+ * ============================================================================
+ */
+
+typedef struct MemoryFile {
+  char *path; // NULL once unlinked
+  unsigned char *data;
+  size_t size;
+  size_t capacity;
+  pthread_rwlock_t lock; // data, size, capacity and the times
+  struct stat st;        // everything but st_size, st_blocks and st_nlink
+  int refs;              // open fds, plus one while linked
+  UT_hash_handle hh;     // of MemoryState.files, by path
+} MemoryFile;
+
+typedef struct {
+  pthread_mutex_t mutex; // files, fds and next_ino
+  MemoryFile *files;
+  FdTable fds; // MemoryFile * of each fd, NULL when closed (atomic)
+  ino_t next_ino;
+} MemoryState;
+
+/**
+ * @brief Create an empty memory layer
+ *
+ * @return LayerContext -> the layer, with NULL ops on failure
+ */
+LayerContext memory_init();
+
+#endif // __MEMORY_H__
@@ -0,0 +1,171 @@
+#ifndef __QOS_CONFIG_H__
+#define __QOS_CONFIG_H__
+
+#include "../../config/utils.h"
+
+#define QOS_MAX_CLASSES 16          // classes of a layer, the default included
+#define QOS_DEFAULT_CLASS "default" // class of the requests no class matches
+#define QOS_DEFAULT_MAX_INFLIGHT 32 // requests in the next layer at once
+#define QOS_DEFAULT_WINDOW_MS 200   // period of the p99 controller
+#define QOS_DEFAULT_BURST_MS 100    // tokens a bucket holds, in ms of rate
+#define QOS_MAX_WEIGHT 1000
+
+typedef struct {
+  char *name;
+  int weight;          // share of the next layer among the busy classes
+  char *path_prefix;   // match: paths under it, or NULL
+  long uid;            // match: requests of that uid, -1 for any
+  char *cgroup;        // match: processes under that cgroup (v2), or NULL
+  long bytes_per_sec;  // rate limit of the bytes read and written, 0: none
+  long iops;           // rate limit of the requests, 0: none
+  long burst_ms;       // buckets hold burst_ms of their rate
+  long p99_us;         // target of the priority class, 0 for the others
+} QosClassConfig;
+
+typedef struct {
+  char *next_layer;
+  QosClassConfig *classes; // in match order, the default one last
+  int nclasses;
+  int max_inflight; // requests handed to the next layer at once
+  long window_ms;   // period over which the priority p99 is measured
+} QosConfig;
+
+static inline long qos_parse_positive(toml_datum_t table, const char *key,
+                                      long fallback, const char *error) {
+  toml_datum_t value = toml_get(table, key);
+  if (value.type == TOML_UNKNOWN) {
+    return fallback;
+  }
+  if (value.type != TOML_INT64 || value.u.int64 < 0) {
+    toml_error(error);
+  }
+  return (long)value.u.int64;
+}
+
+static inline void qos_parse_class(toml_datum_t table, QosClassConfig *cls) {
+  if (table.type != TOML_TABLE) {
+    toml_error("QoS classes must be tables");
+  }
+  toml_datum_t name = toml_get(table, "name");
+  if (name.type != TOML_STRING) {
+    toml_error("QoS class must have a 'name'");
+  }
+  cls->name = parse_string(name);
+  cls->weight = (int)qos_parse_positive(table, "weight", 1,
+                                        "QoS class weight must be positive");
+  if (cls->weight < 1 || cls->weight > QOS_MAX_WEIGHT) {
+    toml_error("QoS class weight must be in [1, 1000]");
+  }
+  cls->path_prefix = parse_string(toml_get(table, "path_prefix"));
+  cls->uid = -1;
+  toml_datum_t uid = toml_get(table, "uid");
+  if (uid.type != TOML_UNKNOWN) {
+    if (uid.type != TOML_INT64 || uid.u.int64 < 0) {
+      toml_error("QoS class uid must be a non-negative integer");
+    }
+    cls->uid = (long)uid.u.int64;
+  }
+  cls->cgroup = parse_string(toml_get(table, "cgroup"));
+  cls->bytes_per_sec = qos_parse_positive(
+      table, "bytes_per_sec", 0, "QoS class bytes_per_sec must be positive");
+  cls->iops =
+      qos_parse_positive(table, "iops", 0, "QoS class iops must be positive");
+  cls->burst_ms = qos_parse_positive(table, "burst_ms", QOS_DEFAULT_BURST_MS,
+                                     "QoS class burst_ms must be positive");
+  if (cls->burst_ms == 0) {
+    toml_error("QoS class burst_ms must be positive");
+  }
+
+  // p99_ms may be fractional: 0.5 is 500 us
+  cls->p99_us = 0;
+  toml_datum_t p99 = toml_get(table, "p99_ms");
+  if (p99.type == TOML_INT64 && p99.u.int64 > 0) {
+    cls->p99_us = (long)p99.u.int64 * 1000;
+  } else if (p99.type == TOML_FP64 && p99.u.fp64 > 0) {
+    cls->p99_us = (long)(p99.u.fp64 * 1000.0);
+  } else if (p99.type != TOML_UNKNOWN) {
+    toml_error("QoS class p99_ms must be positive");
+  }
+}
+
+/**
+ * @brief Parse qos layer parameters
+ *
+ * The classes are an array of tables, matched in order; the requests none
+ * of them match go to the class named "default", added if missing.
+ */
+static inline void qos_parse_params(toml_datum_t layer_table,
+                                    QosConfig *config) {
+  toml_datum_t next_layer = toml_get(layer_table, "next");
+  if (next_layer.type == TOML_STRING) {
+    config->next_layer = parse_string(next_layer);
+  } else {
+    toml_error("Invalid next layer filed");
+  }
+
+  config->max_inflight = (int)qos_parse_positive(
+      layer_table, "max_inflight", QOS_DEFAULT_MAX_INFLIGHT,
+      "QoS layer max_inflight must be positive");
+  if (config->max_inflight == 0) {
+    toml_error("QoS layer max_inflight must be positive");
+  }
+  config->window_ms =
+      qos_parse_positive(layer_table, "window_ms", QOS_DEFAULT_WINDOW_MS,
+                         "QoS layer window_ms must be positive");
+  if (config->window_ms == 0) {
+    toml_error("QoS layer window_ms must be positive");
+  }
+
+  toml_datum_t classes = toml_get(layer_table, "classes");
+  int n = classes.type == TOML_ARRAY ? classes.u.arr.size : 0;
+  if (classes.type != TOML_ARRAY && classes.type != TOML_UNKNOWN) {
+    toml_error("QoS layer classes must be an array of tables");
+  }
+  if (n >= QOS_MAX_CLASSES) {
+    toml_error("QoS layer has too many classes (at most 15 and the default)");
+  }
+  config->classes = calloc((size_t)n + 1, sizeof(QosClassConfig));
+  if (!config->classes) {
+    toml_error("Failed to allocate memory for the QoS classes");
+  }
+
+  // the default class is matched last, wherever it is listed
+  QosClassConfig fallback = {.name = NULL};
+  int priority = 0;
+  for (int i = 0; i < n; i++) {
+    QosClassConfig cls;
+    qos_parse_class(classes.u.arr.elem[i], &cls);
+    priority += cls.p99_us > 0;
+    for (int j = 0; j < config->nclasses; j++) {
+      if (strcmp(config->classes[j].name, cls.name) == 0) {
+        toml_error("QoS class names must be unique");
+      }
+    }
+    if (strcmp(cls.name, QOS_DEFAULT_CLASS) == 0) {
+      if (fallback.name) {
+        toml_error("QoS class names must be unique");
+      }
+      if (cls.path_prefix || cls.uid >= 0 || cls.cgroup) {
+        toml_error("QoS default class takes no match");
+      }
+      fallback = cls;
+      continue;
+    }
+    if (!cls.path_prefix && cls.uid < 0 && !cls.cgroup) {
+      toml_error("QoS class must match a path_prefix, a uid or a cgroup");
+    }
+    config->classes[config->nclasses++] = cls;
+  }
+  if (priority > 1) {
+    toml_error("QoS layer takes one class with a p99_ms");
+  }
+  if (!fallback.name) {
+    fallback.name = strdup(QOS_DEFAULT_CLASS);
+    fallback.weight = 1;
+    fallback.uid = -1;
+    fallback.burst_ms = QOS_DEFAULT_BURST_MS;
+  }
+  config->classes[config->nclasses++] = fallback;
+}
+
+#endif
@@ -0,0 +1,571 @@
+#define _GNU_SOURCE
+#include "qos.h"
+#include "../../logdef.h"
+#include "../../shared/utils/layer_iov.h"
+#include "../../shared/utils/metrics.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Caller of the requests of this thread, the process itself if not set
+static __thread bool caller_set;
+static __thread uid_t caller_uid;
+static __thread pid_t caller_pid;
+
+void qos_set_caller(uid_t uid, pid_t pid) {
+  caller_set = true;
+  caller_uid = uid;
+  caller_pid = pid;
+}
+
+/* ---- classification ---- */
+
+// Whether path is prefix or under it, by whole components
+static bool path_under(const char *path, const char *prefix) {
+  size_t len = strlen(prefix);
+  while (len > 1 && prefix[len - 1] == '/') {
+    len--;
+  }
+  if (len == 1 && prefix[0] == '/') {
+    return path[0] == '/';
+  }
+  return strncmp(path, prefix, len) == 0 &&
+         (path[len] == '\0' || path[len] == '/');
+}
+
+// cgroup (v2) of a process, from its "0::" line
+static bool read_cgroup(pid_t pid, char *cgroup, size_t size) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/cgroup", (int)pid);
+  FILE *file = fopen(path, "re");
+  if (!file) {
+    return false;
+  }
+  char line[PATH_MAX + 8];
+  bool found = false;
+  while (!found && fgets(line, sizeof(line), file)) {
+    if (strncmp(line, "0::", 3) == 0) {
+      line[strcspn(line, "\n")] = '\0';
+      snprintf(cgroup, size, "%s", line + 3);
+      found = true;
+    }
+  }
+  fclose(file);
+  return found;
+}
+
+static int classify(const QosState *state, const char *pathname) {
+  uid_t uid = caller_set ? caller_uid : geteuid();
+  pid_t pid = caller_set ? caller_pid : getpid();
+  char cgroup[PATH_MAX];
+  int cgroup_read = 0; // 1: in cgroup, -1: unknown
+  for (int c = 0; c < state->nclasses - 1; c++) {
+    const QosClassConfig *config = &state->classes[c].config;
+    if (config->path_prefix && !path_under(pathname, config->path_prefix)) {
+      continue;
+    }
+    if (config->uid >= 0 && (uid_t)config->uid != uid) {
+      continue;
+    }
+    if (config->cgroup) {
+      if (!cgroup_read) {
+        cgroup_read = read_cgroup(pid, cgroup, sizeof(cgroup)) ? 1 : -1;
+      }
+      if (cgroup_read < 0 || !path_under(cgroup, config->cgroup)) {
+        continue;
+      }
+    }
+    return c;
+  }
+  return state->nclasses - 1;
+}
+
+static int fd_class(QosState *state, int fd) {
+  const int *entry = fd_table_get(&state->fds, fd);
+  return entry && *entry ? *entry - 1 : state->nclasses - 1;
+}
+
+/* ---- token buckets ---- */
+
+static void refill(QosClass *cls, uint64_t now) {
+  double elapsed = (double)(now - cls->refill_ns) / 1e9;
+  cls->refill_ns = now;
+  if (cls->config.bytes_per_sec) {
+    cls->byte_tokens += elapsed * (double)cls->config.bytes_per_sec;
+    if (cls->byte_tokens > cls->byte_capacity) {
+      cls->byte_tokens = cls->byte_capacity;
+    }
+  }
+  if (cls->config.iops) {
+    cls->op_tokens += elapsed * (double)cls->config.iops;
+    if (cls->op_tokens > cls->op_capacity) {
+      cls->op_tokens = cls->op_capacity;
+    }
+  }
+}
+
+/**
+ * @brief Wait for the tokens of a request of nbyte bytes, then take them
+ */
+static void throttle(QosState *state, QosClass *cls, size_t nbyte) {
+  const QosClassConfig *config = &cls->config;
+  if (!config->bytes_per_sec && !config->iops) {
+    return;
+  }
+  double bytes = (double)nbyte;
+  double need = bytes < cls->byte_capacity ? bytes : cls->byte_capacity;
+  uint64_t start = 0;
+
+  pthread_mutex_lock(&state->mutex);
+  for (;;) {
+    uint64_t now = metrics_now();
+    refill(cls, now);
+    double wait = 0; // seconds
+    if (config->bytes_per_sec && cls->byte_tokens < need) {
+      wait = (need - cls->byte_tokens) / (double)config->bytes_per_sec;
+    }
+    if (config->iops && cls->op_tokens < 1) {
+      double op_wait = (1 - cls->op_tokens) / (double)config->iops;
+      wait = op_wait > wait ? op_wait : wait;
+    }
+    if (wait <= 0) {
+      break;
+    }
+    if (!start) {
+      start = now;
+      cls->stats.throttled++;
+    }
+    pthread_mutex_unlock(&state->mutex);
+    uint64_t ns = (uint64_t)(wait * 1e9) + 1;
+    struct timespec delay = {.tv_sec = (time_t)(ns / 1000000000ULL),
+                             .tv_nsec = (long)(ns % 1000000000ULL)};
+    nanosleep(&delay, NULL);
+    pthread_mutex_lock(&state->mutex);
+  }
+  if (config->bytes_per_sec) {
+    cls->byte_tokens -= bytes;
+  }
+  if (config->iops) {
+    cls->op_tokens -= 1;
+  }
+  if (start) {
+    cls->stats.throttle_ns += metrics_now() - start;
+  }
+  pthread_mutex_unlock(&state->mutex);
+}
+
+/* ---- fair queuing ---- */
+
+static bool eligible(const QosState *state, int c) {
+  if (state->inflight >= state->max_inflight) {
+    return false;
+  }
+  return state->priority < 0 || c == state->priority ||
+         state->other_inflight < state->other_limit;
+}
+
+static void start_locked(QosState *state, int c, uint64_t start) {
+  if (start > state->vtime) {
+    state->vtime = start;
+  }
+  state->inflight++;
+  if (c != state->priority) {
+    state->other_inflight++;
+  }
+}
+
+// Dispatch the eligible requests, smallest start tag first
+static void dispatch_locked(QosState *state) {
+  for (;;) {
+    int best = -1;
+    for (int c = 0; c < state->nclasses; c++) {
+      const QosRequest *head = state->classes[c].head;
+      if (head && eligible(state, c) &&
+          (best < 0 || head->start < state->classes[best].head->start)) {
+        best = c;
+      }
+    }
+    if (best < 0) {
+      return;
+    }
+    QosClass *cls = &state->classes[best];
+    QosRequest *request = cls->head;
+    cls->head = request->next;
+    if (!cls->head) {
+      cls->tail = NULL;
+    }
+    start_locked(state, best, request->start);
+    request->dispatched = true;
+    pthread_cond_signal(&request->cond);
+  }
+}
+
+static int compare_samples(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Move the limit of the non-priority classes once a window is over
+ */
+static void control_locked(QosState *state, uint64_t now) {
+  if (state->priority < 0 || now - state->window_start_ns < state->window_ns) {
+    return;
+  }
+  if (state->nsamples >= QOS_MIN_SAMPLES) {
+    size_t n = state->nsamples < QOS_WINDOW_SAMPLES ? state->nsamples
+                                                    : QOS_WINDOW_SAMPLES;
+    // the window is over, its samples can be sorted in place
+    qsort(state->samples, n, sizeof(uint64_t), compare_samples);
+    state->p99_ns = state->samples[(n * 99 + 99) / 100 - 1];
+    uint64_t target =
+        (uint64_t)state->classes[state->priority].config.p99_us * 1000;
+    if (state->p99_ns > target) {
+      state->other_limit = state->other_limit > 1 ? state->other_limit / 2 : 1;
+    } else if (state->other_limit < state->max_inflight) {
+      state->other_limit++;
+    }
+  } else if (state->nsamples == 0) {
+    // the priority class is idle
+    state->other_limit = state->max_inflight;
+  }
+  state->nsamples = 0;
+  state->window_start_ns = now;
+}
+
+/**
+ * @brief Schedule a request of class c: wait for its tokens and its dispatch
+ *
+ * @return uint64_t -> time it was queued, for qos_end()
+ */
+static uint64_t qos_begin(QosState *state, int c, size_t nbyte) {
+  QosClass *cls = &state->classes[c];
+  throttle(state, cls, nbyte);
+
+  pthread_mutex_lock(&state->mutex);
+  uint64_t now = metrics_now();
+  uint64_t start =
+      state->vtime > cls->last_finish ? state->vtime : cls->last_finish;
+  cls->last_finish = start + ((uint64_t)nbyte + QOS_OP_COST) *
+                                 QOS_MAX_WEIGHT / (uint64_t)cls->config.weight;
+  cls->stats.ops++;
+  cls->stats.bytes += nbyte;
+
+  // queued requests are all ineligible, or they would have been dispatched
+  if (!cls->head && eligible(state, c)) {
+    start_locked(state, c, start);
+  } else {
+    QosRequest request = {.start = start};
+    pthread_cond_init(&request.cond, NULL);
+    if (cls->tail) {
+      cls->tail->next = &request;
+    } else {
+      cls->head = &request;
+    }
+    cls->tail = &request;
+    cls->stats.queued++;
+    while (!request.dispatched) {
+      pthread_cond_wait(&request.cond, &state->mutex);
+    }
+    pthread_cond_destroy(&request.cond);
+    cls->stats.queue_ns += metrics_now() - now;
+  }
+  pthread_mutex_unlock(&state->mutex);
+  return now;
+}
+
+// End of a request of qos_begin(), errno is kept
+static void qos_end(QosState *state, int c, uint64_t queued_ns) {
+  int saved_errno = errno;
+  uint64_t now = metrics_now();
+  pthread_mutex_lock(&state->mutex);
+  state->inflight--;
+  if (c == state->priority) {
+    state->samples[state->nsamples++ % QOS_WINDOW_SAMPLES] = now - queued_ns;
+  } else {
+    state->other_inflight--;
+  }
+  control_locked(state, now);
+  dispatch_locked(state);
+  pthread_mutex_unlock(&state->mutex);
+  errno = saved_errno;
+}
+
+/* ---- scheduled operations ---- */
+
+ssize_t qos_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                  LayerContext l) {
+  QosState *state = (QosState *)l.internal_state;
+  int c = fd_class(state, fd);
+  uint64_t queued = qos_begin(state, c, nbyte);
+  ssize_t res = state->next.ops->lpread(fd, buffer, nbyte, offset, state->next);
+  qos_end(state, c, queued);
+  return res;
+}
+
+ssize_t qos_pwrite(int fd, const void *buffer, size_t nbyte, off_t offset,
+                   LayerContext l) {
+  QosState *state = (QosState *)l.internal_state;
+  int c = fd_class(state, fd);
+  uint64_t queued = qos_begin(state, c, nbyte);
+  ssize_t res =
+      state->next.ops->lpwrite(fd, buffer, nbyte, offset, state->next);
+  qos_end(state, c, queued);
+  return res;
+}
+
+ssize_t qos_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                   LayerContext l) {
+  QosState *state = (QosState *)l.internal_state;
+  int c = fd_class(state, fd);
+  uint64_t queued = qos_begin(state, c, iov_length(iov, iovcnt));
+  ssize_t res = layer_preadv(fd, iov, iovcnt, offset, state->next);
+  qos_end(state, c, queued);
+  return res;
+}
+
+ssize_t qos_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                    off_t offset, LayerContext l) {
+  QosState *state = (QosState *)l.internal_state;
+  int c = fd_class(state, fd);
+  uint64_t queued = qos_begin(state, c, iov_length(iov, iovcnt));
+  ssize_t res = layer_pwritev(fd, iov, iovcnt, offset, state->next);
+  qos_end(state, c, queued);
+  return res;
+}
+
+int qos_fsync(int fd, int isdatasync, LayerContext l) {
+  QosState *state = (QosState *)l.internal_state;
+  int c = fd_class(state, fd);
+  uint64_t queued = qos_begin(state, c, 0);
+  int res = state->next.ops->lfsync(fd, isdatasync, state->next);
+  qos_end(state, c, queued);
+  return res;
+}
+
+int qos_ftruncate(int fd, off_t length, LayerContext l) {
+  QosState *state = (QosState *)l.internal_state;
+  int c = fd_class(state, fd);
+  uint64_t queued = qos_begin(state, c, 0);
+  int res = state->next.ops->lftruncate(fd, length, state->next);
+  qos_end(state, c, queued);
+  return res;
+}
+
+int qos_fallocate(int fd, off_t offset, int mode, off_t length,
+                  LayerContext l) {
+  QosState *state = (QosState *)l.internal_state;
+  int c = fd_class(state, fd);
+  uint64_t queued = qos_begin(state, c, 0);
+  int res =
+      state->next.ops->lfallocate(fd, offset, mode, length, state->next);
+  qos_end(state, c, queued);
+  return res;
+}
+
+int qos_open(const char *pathname, int flags, mode_t mode, LayerContext l) {
+  QosState *state = (QosState *)l.internal_state;
+  int fd = state->next.ops->lopen(pathname, flags, mode, state->next);
+  if (fd < 0) {
+    return fd;
+  }
+  // fds the table cannot hold are of the default class
+  int *entry = fd_table_slot(&state->fds, fd);
+  if (entry) {
+    *entry = classify(state, pathname) + 1;
+  }
+  return fd;
+}
+
+int qos_close(int fd, LayerContext l) {
+  QosState *state = (QosState *)l.internal_state;
+  int *entry = fd_table_get(&state->fds, fd);
+  if (entry) {
+    *entry = 0;
+  }
+  return state->next.ops->lclose(fd, state->next);
+}
+
+/* ---- operations going to the next layer as they are ---- */
+
+static int qos_truncate(const char *path, off_t length, LayerContext l) {
+  return l.next_layers->ops->ltruncate(path, length, *l.next_layers);
+}
+
+static int qos_fstat(int fd, struct stat *stbuf, LayerContext l) {
+  return l.next_layers->ops->lfstat(fd, stbuf, *l.next_layers);
+}
+
+static int qos_lstat(const char *path, struct stat *stbuf, LayerContext l) {
+  return l.next_layers->ops->llstat(path, stbuf, *l.next_layers);
+}
+
+static int qos_unlink(const char *path, LayerContext l) {
+  return l.next_layers->ops->lunlink(path, *l.next_layers);
+}
+
+static int qos_readdir(const char *path, void *buf,
+                       int (*filler)(void *buf, const char *name,
+                                     const struct stat *stbuf, off_t off,
+                                     unsigned int flags),
+                       off_t offset, struct fuse_file_info *fi,
+                       unsigned int flags, LayerContext l) {
+  return l.next_layers->ops->lreaddir(path, buf, filler, offset, fi, flags,
+                                      *l.next_layers);
+}
+
+static int qos_rename(const char *from, const char *to, unsigned int flags,
+                      LayerContext l) {
+  return l.next_layers->ops->lrename(from, to, flags, *l.next_layers);
+}
+
+static int qos_chmod(const char *path, mode_t mode, LayerContext l) {
+  return l.next_layers->ops->lchmod(path, mode, *l.next_layers);
+}
+
+static ssize_t qos_getdigest(int fd, off_t offset, size_t nbyte,
+                             LayerStoredDigests *digests, LayerContext l) {
+  return l.next_layers->ops->lgetdigest(fd, offset, nbyte, digests,
+                                        *l.next_layers);
+}
+
+static char *copy_string(const char *string) {
+  if (!string) {
+    return NULL;
+  }
+  char *copy = strdup(string);
+  if (!copy) {
+    ERROR_MSG("[QOS_LAYER_INIT] Failed to allocate memory for the classes");
+    exit(1);
+  }
+  return copy;
+}
+
+LayerContext qos_init(LayerContext *next_layer, const QosConfig *config) {
+  LayerContext layer_state;
+  layer_state.app_context = NULL;
+
+  QosState *state = calloc(1, sizeof(QosState));
+  if (!state) {
+    ERROR_MSG("[QOS_LAYER_INIT] Failed to allocate memory for the state");
+    exit(1);
+  }
+  state->next = *next_layer;
+  state->nclasses = config->nclasses;
+  state->priority = -1;
+  state->max_inflight = config->max_inflight;
+  state->other_limit = config->max_inflight;
+  state->window_ns = (uint64_t)config->window_ms * 1000000ULL;
+  uint64_t now = metrics_now();
+  state->window_start_ns = now;
+
+  for (int c = 0; c < config->nclasses; c++) {
+    QosClass *cls = &state->classes[c];
+    cls->config = config->classes[c];
+    cls->config.name = copy_string(config->classes[c].name);
+    cls->config.path_prefix = copy_string(config->classes[c].path_prefix);
+    cls->config.cgroup = copy_string(config->classes[c].cgroup);
+    if (cls->config.p99_us > 0) {
+      state->priority = c;
+    }
+
+    // a bucket holds at least a request
+    double burst = (double)cls->config.burst_ms / 1000.0;
+    cls->byte_capacity = (double)cls->config.bytes_per_sec * burst;
+    cls->op_capacity = (double)cls->config.iops * burst;
+    if (cls->op_capacity < 1) {
+      cls->op_capacity = 1;
+    }
+    cls->byte_tokens = cls->byte_capacity;
+    cls->op_tokens = cls->op_capacity;
+    cls->refill_ns = now;
+  }
+
+  if (pthread_mutex_init(&state->mutex, NULL) != 0) {
+    ERROR_MSG("[QOS_LAYER_INIT] Failed to initialize the mutex");
+    exit(1);
+  }
+  fd_table_init(&state->fds, sizeof(int), NULL);
+  layer_state.internal_state = state;
+
+  // no lbacking_fd: reads from a backing file would not be scheduled
+  const LayerOps *next = next_layer->ops;
+  LayerOps *ops = calloc(1, sizeof(LayerOps));
+  if (!ops) {
+    ERROR_MSG("[QOS_LAYER_INIT] Failed to allocate memory for the ops");
+    exit(1);
+  }
+  ops->lpread = qos_pread;
+  ops->lpwrite = qos_pwrite;
+  ops->lpreadv = qos_preadv;
+  ops->lpwritev = qos_pwritev;
+  ops->lopen = qos_open;
+  ops->lclose = qos_close;
+  ops->lftruncate = qos_ftruncate;
+  ops->ltruncate = qos_truncate;
+  ops->lfstat = qos_fstat;
+  ops->llstat = qos_lstat;
+  ops->lunlink = qos_unlink;
+  ops->lreaddir = next->lreaddir ? qos_readdir : NULL;
+  ops->lrename = next->lrename ? qos_rename : NULL;
+  ops->lchmod = next->lchmod ? qos_chmod : NULL;
+  ops->lfsync = next->lfsync ? qos_fsync : NULL;
+  ops->lfallocate = next->lfallocate ? qos_fallocate : NULL;
+  ops->lgetdigest = next->lgetdigest ? qos_getdigest : NULL;
+  ops->ldestroy = qos_destroy;
+  layer_state.ops = ops;
+
+  LayerContext *aux = malloc(sizeof(LayerContext));
+  if (!aux) {
+    ERROR_MSG("[QOS_LAYER_INIT] Failed to allocate memory for next layers");
+    exit(1);
+  }
+  memcpy(aux, next_layer, sizeof(LayerContext));
+  layer_state.next_layers = aux;
+  layer_state.nlayers = 1;
+
+  DEBUG_MSG("[QOS_LAYER_INIT] %d classes, %d requests in flight",
+            state->nclasses, state->max_inflight);
+  return layer_state;
+}
+
+void qos_get_stats(LayerContext l, QosStats *stats) {
+  QosState *state = (QosState *)l.internal_state;
+  memset(stats, 0, sizeof(QosStats));
+  pthread_mutex_lock(&state->mutex);
+  stats->nclasses = state->nclasses;
+  for (int c = 0; c < state->nclasses; c++) {
+    stats->names[c] = state->classes[c].config.name;
+    stats->classes[c] = state->classes[c].stats;
+  }
+  stats->other_limit = state->other_limit;
+  stats->p99_ns = state->p99_ns;
+  pthread_mutex_unlock(&state->mutex);
+}
+
+void qos_destroy(LayerContext l) {
+  QosState *state = (QosState *)l.internal_state;
+  if (state) {
+    for (int c = 0; c < state->nclasses; c++) {
+      free(state->classes[c].config.name);
+      free(state->classes[c].config.path_prefix);
+      free(state->classes[c].config.cgroup);
+    }
+    fd_table_destroy(&state->fds);
+    pthread_mutex_destroy(&state->mutex);
+    free(state);
+  }
+
+  if (l.ops) {
+    free(l.ops);
+  }
+
+  if (l.next_layers) {
+    free(l.next_layers);
+  }
+}
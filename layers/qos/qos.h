@@ -0,0 +1,150 @@
+#ifndef __QOS_H__
+#define __QOS_H__
+
+#include "../../shared/types/layer_context.h"
+#include "../../shared/utils/fd_table.h"
+#include "config.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * ============================================================================
+ * QOS - I/O SCHEDULING OF THE TENANTS SHARING A LAYER
+ * ============================================================================
+ *
+ * Without scheduling, the tenant issuing the most requests (a batch job
+ * scanning its files) takes the next layer from the others. The qos layer
+ * sorts the requests of its fds into classes and decides when each of them
+ * reaches the next layer:
+ *
+ * - Classes: an fd takes, at open, the first class whose path_prefix, uid
+ *   and cgroup (v2, from /proc/<pid>/cgroup) all match its path and caller,
+ *   the "default" class when none does. Prefixes match whole components. The
+ *   caller is the process itself unless the frontend sets it for the thread
+ *   (qos_set_caller(), a FUSE frontend with the uid and pid of the request)
+ * - Rate limits: per class, a token bucket of bytes_per_sec and one of iops,
+ *   each holding burst_ms of its rate. A request waits, outside any lock,
+ *   for the tokens of min(its bytes, the bucket) and takes all of its bytes,
+ *   so a request larger than the bucket leaves it in debt
+ * - Fair queuing: at most max_inflight requests are in the next layer. The
+ *   others wait in the FIFO of their class and are dispatched in order of
+ *   their start tags (start-time fair queuing): a request costs its bytes
+ *   and QOS_OP_COST, divided by the weight of its class, so busy classes
+ *   share the next layer by weight and an idle class banks nothing
+ * - Latency target: one class may set p99_ms. Its latency, from queuing to
+ *   completion, is sampled over windows of window_ms; when a window's p99 is
+ *   above the target, the other classes are held to half as many requests
+ *   in the next layer, when it is not they get one more, up to
+ *   max_inflight, and they get them all back after a window without any
+ *   request of the class (as the io.latency controller of cgroups does)
+ *
+ * pread, pwrite, preadv, pwritev, fsync, ftruncate and fallocate are
+ * scheduled, the other operations go to the next layer as they are.
+ * ============================================================================
+ */
+
+#define QOS_OP_COST 4096        // bytes a request costs on top of its own
+#define QOS_MIN_SAMPLES 20      // latencies a window needs to move the limit
+#define QOS_WINDOW_SAMPLES 1024 // latencies kept of a window, the last ones
+
+typedef struct {
+  unsigned long long ops;         // requests scheduled
+  unsigned long long bytes;       // asked to read or write
+  unsigned long long throttled;   // requests that waited for their tokens
+  unsigned long long throttle_ns; // time waited for tokens
+  unsigned long long queued;      // requests that waited for a dispatch
+  unsigned long long queue_ns;    // time waited in the queue
+} QosClassStats;
+
+typedef struct {
+  int nclasses;
+  const char *names[QOS_MAX_CLASSES]; // of the layer, valid while it lives
+  QosClassStats classes[QOS_MAX_CLASSES];
+  int other_limit;           // requests the non-priority classes may have
+                             // in the next layer
+  unsigned long long p99_ns; // of the priority class in the last window
+                             // with enough samples, 0 if none
+} QosStats;
+
+// A request waiting for its dispatch, on the stack of its thread
+typedef struct QosRequest {
+  uint64_t start; // virtual start tag
+  bool dispatched;
+  pthread_cond_t cond;
+  struct QosRequest *next;
+} QosRequest;
+
+typedef struct {
+  QosClassConfig config; // strings owned by the state
+
+  // token buckets, refilled at their rate since refill_ns
+  double byte_tokens;
+  double byte_capacity;
+  double op_tokens;
+  double op_capacity;
+  uint64_t refill_ns;
+
+  uint64_t last_finish; // virtual finish tag of the last request queued
+  QosRequest *head;     // FIFO of the requests to dispatch
+  QosRequest *tail;
+  QosClassStats stats;
+} QosClass;
+
+typedef struct {
+  LayerContext next;
+  QosClass classes[QOS_MAX_CLASSES]; // the default one last
+  int nclasses;
+  int priority; // class with a p99 target, -1 if none
+  int max_inflight;
+  uint64_t window_ns;
+  FdTable fds; // class + 1 of each fd of the next layer, 0: the default
+
+  pthread_mutex_t mutex; // the classes and the fields below
+  uint64_t vtime;        // start tag of the last request dispatched
+  int inflight;          // requests in the next layer
+  int other_inflight;    // of them, not of the priority class
+  int other_limit;
+  uint64_t window_start_ns;
+  uint64_t samples[QOS_WINDOW_SAMPLES]; // latencies of the priority class
+  size_t nsamples;                      // in the window, past the array too
+  uint64_t p99_ns;
+} QosState;
+
+LayerContext qos_init(LayerContext *next_layer, const QosConfig *config);
+
+/**
+ * @brief Set the caller the classes match the next opens of this thread
+ * against, instead of the process itself
+ *
+ * @param uid -> user of the request
+ * @param pid -> process of the request, for its cgroup
+ */
+void qos_set_caller(uid_t uid, pid_t pid);
+
+/**
+ * @brief Snapshot of the counters of a qos layer
+ *
+ * @param l     -> qos layer
+ * @param stats -> output
+ */
+void qos_get_stats(LayerContext l, QosStats *stats);
+
+ssize_t qos_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                  LayerContext l);
+ssize_t qos_pwrite(int fd, const void *buffer, size_t nbyte, off_t offset,
+                   LayerContext l);
+ssize_t qos_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                   LayerContext l);
+ssize_t qos_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                    off_t offset, LayerContext l);
+int qos_open(const char *pathname, int flags, mode_t mode, LayerContext l);
+int qos_close(int fd, LayerContext l);
+int qos_fsync(int fd, int isdatasync, LayerContext l);
+int qos_ftruncate(int fd, off_t length, LayerContext l);
+int qos_fallocate(int fd, off_t offset, int mode, off_t length,
+                  LayerContext l);
+void qos_destroy(LayerContext l);
+
+#endif
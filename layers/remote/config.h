@@ -2,18 +2,118 @@
 #define __REMOTE_CONFIG_H__
 
 #include "../../config/utils.h"
+#include "protocol.h"
+#include "shm.h"
+
+#define REMOTE_DEFAULT_MAX_INFLIGHT 64
+#define REMOTE_DEFAULT_CONNECTIONS 4
+#define REMOTE_DEFAULT_KEEPALIVE_IDLE 60     // seconds
+#define REMOTE_DEFAULT_KEEPALIVE_INTERVAL 10 // seconds
+#define REMOTE_DEFAULT_KEEPALIVE_COUNT 6
+#define REMOTE_DEFAULT_RECONNECT_MIN_MS 100
+#define REMOTE_DEFAULT_RECONNECT_MAX_MS 10000
+
+// How the connections reach the storserver
+typedef enum {
+  REMOTE_TRANSPORT_TCP, // TCP connections to host:port
+  REMOTE_TRANSPORT_SHM, // shared-memory rings, server on the same host
+} RemoteTransport;
 
 // Remote layer configuration structure
 typedef struct {
-  char *placeholder; // placeholder for now
+  RemoteTransport transport;
+  char *host;       // storserver address or name, NULL: REMOTE_DEFAULT_HOST
+  int port;         // storserver port
+  char *shm_path;   // unix socket of the server, NULL: REMOTE_DEFAULT_SHM_PATH
+  int shm_ring_size; // bytes of each ring of a shared-memory connection
+  int max_inflight; // requests sent on a connection before a reply is awaited
+  int connections;  // connections of the pool, threads stick to one of them
+  int keepalive_idle;     // idle seconds before probing, 0: no keepalive
+  int keepalive_interval; // seconds between probes
+  int keepalive_count;    // unanswered probes before the connection is lost
+  int reconnect_min_ms;   // first delay between reconnection attempts
+  int reconnect_max_ms;   // the delay doubles up to this one
 } RemoteConfig;
 
+static inline int remote_parse_int(toml_datum_t layer_table, const char *key,
+                                   int fallback, long min, long max) {
+  toml_datum_t datum = toml_get(layer_table, key);
+  if (datum.type == TOML_UNKNOWN) {
+    return fallback;
+  }
+  if (datum.type != TOML_INT64 || datum.u.int64 < min ||
+      datum.u.int64 > max) {
+    char buf[128];
+    (void)snprintf(buf, sizeof(buf),
+                   "Remote layer '%s' must be an integer between %ld and %ld",
+                   key, min, max);
+    toml_error(buf);
+  }
+  return (int)datum.u.int64;
+}
+
 /**
  * @brief Parse remote layer parameters
  */
 static inline void remote_parse_params(toml_datum_t layer_table,
                                        RemoteConfig *config) {
-  config->placeholder = NULL;
+  config->transport = REMOTE_TRANSPORT_TCP;
+  toml_datum_t transport = toml_get(layer_table, "transport");
+  if (transport.type == TOML_STRING) {
+    if (strcmp(transport.u.s, "shm") == 0) {
+      config->transport = REMOTE_TRANSPORT_SHM;
+    } else if (strcmp(transport.u.s, "tcp") != 0) {
+      toml_error("Remote layer 'transport' must be \"tcp\" or \"shm\"");
+    }
+  } else if (transport.type != TOML_UNKNOWN) {
+    toml_error("Remote layer 'transport' must be a string");
+  }
+
+  config->host = NULL;
+  toml_datum_t host = toml_get(layer_table, "host");
+  if (host.type == TOML_STRING) {
+    config->host = parse_string(host);
+  } else if (host.type != TOML_UNKNOWN) {
+    toml_error("Remote layer 'host' must be a string");
+  }
+
+  config->port =
+      remote_parse_int(layer_table, "port", REMOTE_DEFAULT_PORT, 1, 65535);
+
+  config->shm_path = NULL;
+  toml_datum_t shm_path = toml_get(layer_table, "shm_path");
+  if (shm_path.type == TOML_STRING) {
+    config->shm_path = parse_string(shm_path);
+  } else if (shm_path.type != TOML_UNKNOWN) {
+    toml_error("Remote layer 'shm_path' must be a string");
+  }
+  config->shm_ring_size =
+      remote_parse_int(layer_table, "shm_ring_size", REMOTE_DEFAULT_SHM_RING,
+                       REMOTE_SHM_MIN_RING, REMOTE_SHM_MAX_RING);
+  if (!remote_shm_ring_size_valid((uint64_t)config->shm_ring_size)) {
+    toml_error("Remote layer 'shm_ring_size' must be a power of two");
+  }
+  config->max_inflight = remote_parse_int(
+      layer_table, "max_inflight", REMOTE_DEFAULT_MAX_INFLIGHT, 1, 65536);
+  config->connections = remote_parse_int(
+      layer_table, "connections", REMOTE_DEFAULT_CONNECTIONS, 1, 256);
+  config->keepalive_idle = remote_parse_int(
+      layer_table, "keepalive_idle", REMOTE_DEFAULT_KEEPALIVE_IDLE, 0, 86400);
+  config->keepalive_interval =
+      remote_parse_int(layer_table, "keepalive_interval",
+                       REMOTE_DEFAULT_KEEPALIVE_INTERVAL, 1, 3600);
+  config->keepalive_count = remote_parse_int(
+      layer_table, "keepalive_count", REMOTE_DEFAULT_KEEPALIVE_COUNT, 1, 127);
+  config->reconnect_min_ms =
+      remote_parse_int(layer_table, "reconnect_min_ms",
+                       REMOTE_DEFAULT_RECONNECT_MIN_MS, 1, 3600000);
+  config->reconnect_max_ms =
+      remote_parse_int(layer_table, "reconnect_max_ms",
+                       REMOTE_DEFAULT_RECONNECT_MAX_MS, 1, 3600000);
+  if (config->reconnect_max_ms < config->reconnect_min_ms) {
+    toml_error("Remote layer 'reconnect_max_ms' must not be below "
+               "'reconnect_min_ms'");
+  }
 }
 
 #endif // __REMOTE_CONFIG_H__
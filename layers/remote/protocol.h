@@ -0,0 +1,190 @@
+#ifndef __REMOTE_PROTOCOL_H__
+#define __REMOTE_PROTOCOL_H__
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * ============================================================================
+ * REMOTE PROTOCOL - WIRE FORMAT OF THE REMOTE LAYER AND THE STORSERVER
+ * ============================================================================
+ *
+ * Every request and every reply is a frame: a fixed RemoteHeader followed by
+ * header.length payload bytes. Integers are big-endian on the wire.
+ *
+ * - header.id is chosen by the client and echoed in the reply, so a client
+ *   may send many requests before reading any reply and match them as they
+ *   come back; the server answers the requests of a connection in order
+ * - files are named by path only on OPEN, LSTAT, TRUNCATE and UNLINK (the
+ *   payload); the other ops take the handle the OPEN reply returned
+ * - handles belong to a session, which a client may share between several
+ *   connections: the first request of a connection is a HELLO with the
+ *   (random, non-zero) id of the session to join, created if the server does
+ *   not know it; a connection sending no HELLO gets a session of its own.
+ *   The server keeps a session, and its open files, for a while after its
+ *   last connection is gone, so a client reconnecting in time finds its
+ *   handles back
+ * - header.arg of a reply is the result of the op, or -errno on failure
+ *
+ * Request fields per op (unused ones are 0):
+ *
+ *   op         handle  offset          arg           payload
+ *   HELLO      -       -               session id    -
+ *   OPEN       -       mode            open flags    path
+ *   CLOSE      handle  -               -             -
+ *   READ       handle  file offset     bytes         -
+ *   WRITE      handle  file offset     -             data
+ *   FSTAT      handle  -               -             -
+ *   LSTAT      -       -               -             path
+ *   FTRUNCATE  handle  length          -             -
+ *   TRUNCATE   -       length          -             path
+ *   UNLINK     -       -               -             path
+ *   FSYNC      handle  -               datasync      -
+ *
+ * The HELLO reply has arg 1 if the session was created, 0 if it existed (a
+ * client expecting its session to exist has lost its handles when it gets 1).
+ * Replies of READ carry the data read (arg bytes), replies of FSTAT and
+ * LSTAT a RemoteStat when arg is 0; other replies have no payload.
+ * Open flags are sent as they are: client and server share Linux's values.
+ * ============================================================================
+ */
+
+#define REMOTE_MAGIC 0x5447 // "TG"
+#define REMOTE_VERSION 1
+#define REMOTE_DEFAULT_HOST "127.0.0.1"
+#define REMOTE_DEFAULT_PORT 5000
+
+// largest payload of a frame, larger transfers are split by the client
+#define REMOTE_MAX_PAYLOAD (4 * 1024 * 1024)
+// largest path of OPEN, LSTAT, TRUNCATE and UNLINK, terminator excluded
+#define REMOTE_MAX_PATH 4095
+
+typedef enum {
+  REMOTE_OP_HELLO = 0,
+  REMOTE_OP_OPEN,
+  REMOTE_OP_CLOSE,
+  REMOTE_OP_READ,
+  REMOTE_OP_WRITE,
+  REMOTE_OP_FSTAT,
+  REMOTE_OP_LSTAT,
+  REMOTE_OP_FTRUNCATE,
+  REMOTE_OP_TRUNCATE,
+  REMOTE_OP_UNLINK,
+  REMOTE_OP_FSYNC,
+} RemoteOp;
+
+/**
+ * @brief Frame header, as laid out on the wire (40 bytes, no padding)
+ */
+typedef struct {
+  uint32_t length; // payload bytes following the header
+  uint16_t magic;  // REMOTE_MAGIC
+  uint8_t version; // REMOTE_VERSION
+  uint8_t op;      // RemoteOp, the same in the reply
+  uint64_t id;     // request id, echoed in the reply
+  uint32_t handle; // file handle of the ops on an open file
+  uint32_t reserved;
+  uint64_t offset; // file offset, truncate length or open mode
+  int64_t arg;     // request: op argument, reply: result or -errno
+} RemoteHeader;
+
+_Static_assert(sizeof(RemoteHeader) == 40, "RemoteHeader has padding");
+
+/**
+ * @brief File attributes of the FSTAT and LSTAT replies (big-endian)
+ */
+typedef struct {
+  uint64_t ino;
+  uint64_t size;
+  uint64_t blocks;
+  int64_t atime_sec;
+  int64_t mtime_sec;
+  int64_t ctime_sec;
+  uint32_t atime_nsec;
+  uint32_t mtime_nsec;
+  uint32_t ctime_nsec;
+  uint32_t mode;
+  uint32_t nlink;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t blksize;
+} RemoteStat;
+
+_Static_assert(sizeof(RemoteStat) == 80, "RemoteStat has padding");
+
+/**
+ * @brief Fill a header in wire byte order
+ */
+static inline void remote_header_encode(RemoteHeader *h, uint8_t op,
+                                        uint64_t id, uint32_t handle,
+                                        uint64_t offset, int64_t arg,
+                                        uint32_t length) {
+  h->length = htobe32(length);
+  h->magic = htobe16(REMOTE_MAGIC);
+  h->version = REMOTE_VERSION;
+  h->op = op;
+  h->id = htobe64(id);
+  h->handle = htobe32(handle);
+  h->reserved = 0;
+  h->offset = htobe64(offset);
+  h->arg = (int64_t)htobe64((uint64_t)arg);
+}
+
+/**
+ * @brief Convert a received header to host byte order
+ *
+ * @return int -> 0 if it is a header of this protocol version with a payload
+ * of at most max_length bytes, -1 otherwise
+ */
+static inline int remote_header_decode(RemoteHeader *h, uint32_t max_length) {
+  h->length = be32toh(h->length);
+  h->magic = be16toh(h->magic);
+  h->id = be64toh(h->id);
+  h->handle = be32toh(h->handle);
+  h->offset = be64toh(h->offset);
+  h->arg = (int64_t)be64toh((uint64_t)h->arg);
+  if (h->magic != REMOTE_MAGIC || h->version != REMOTE_VERSION ||
+      h->length > max_length) {
+    return -1;
+  }
+  return 0;
+}
+
+static inline void remote_stat_encode(RemoteStat *rs, const struct stat *st) {
+  rs->ino = htobe64((uint64_t)st->st_ino);
+  rs->size = htobe64((uint64_t)st->st_size);
+  rs->blocks = htobe64((uint64_t)st->st_blocks);
+  rs->atime_sec = (int64_t)htobe64((uint64_t)st->st_atim.tv_sec);
+  rs->mtime_sec = (int64_t)htobe64((uint64_t)st->st_mtim.tv_sec);
+  rs->ctime_sec = (int64_t)htobe64((uint64_t)st->st_ctim.tv_sec);
+  rs->atime_nsec = htobe32((uint32_t)st->st_atim.tv_nsec);
+  rs->mtime_nsec = htobe32((uint32_t)st->st_mtim.tv_nsec);
+  rs->ctime_nsec = htobe32((uint32_t)st->st_ctim.tv_nsec);
+  rs->mode = htobe32((uint32_t)st->st_mode);
+  rs->nlink = htobe32((uint32_t)st->st_nlink);
+  rs->uid = htobe32((uint32_t)st->st_uid);
+  rs->gid = htobe32((uint32_t)st->st_gid);
+  rs->blksize = htobe32((uint32_t)st->st_blksize);
+}
+
+static inline void remote_stat_decode(const RemoteStat *rs, struct stat *st) {
+  memset(st, 0, sizeof(*st));
+  st->st_ino = (ino_t)be64toh(rs->ino);
+  st->st_size = (off_t)be64toh(rs->size);
+  st->st_blocks = (blkcnt_t)be64toh(rs->blocks);
+  st->st_atim.tv_sec = (time_t)be64toh((uint64_t)rs->atime_sec);
+  st->st_mtim.tv_sec = (time_t)be64toh((uint64_t)rs->mtime_sec);
+  st->st_ctim.tv_sec = (time_t)be64toh((uint64_t)rs->ctime_sec);
+  st->st_atim.tv_nsec = (long)be32toh(rs->atime_nsec);
+  st->st_mtim.tv_nsec = (long)be32toh(rs->mtime_nsec);
+  st->st_ctim.tv_nsec = (long)be32toh(rs->ctime_nsec);
+  st->st_mode = (mode_t)be32toh(rs->mode);
+  st->st_nlink = (nlink_t)be32toh(rs->nlink);
+  st->st_uid = (uid_t)be32toh(rs->uid);
+  st->st_gid = (gid_t)be32toh(rs->gid);
+  st->st_blksize = (blksize_t)be32toh(rs->blksize);
+}
+
+#endif // __REMOTE_PROTOCOL_H__
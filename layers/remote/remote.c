@@ -1,202 +1,743 @@
+#define _GNU_SOURCE
 #include "remote.h"
+#include "../../shared/utils/fiber.h"
+#include "../../shared/utils/layer_iov.h"
+#include "logdef.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
 #include <unistd.h>
 
 /**
- * @brief Dummy server connection
- *
- * @return int -> socket file descriptor
+ * Remote layer
+ * - forwards the ops to a storserver over a pool of connections, framed
+ *   with the protocol of protocol.h; all of them join the same server
+ *   session, so a handle opened on one is valid on the others
+ * - connections are TCP, or shared-memory rings for a server on the same
+ *   host (transport.h)
+ * - a request is sent whole with a single call, the header and the caller's
+ *   buffers gathered without copying them into a frame
+ * - requests are registered by id before being sent and a receiver thread
+ *   per connection reads the replies into the caller's buffers, so any
+ *   number of threads (and the asynchronous ops) keep up to max_inflight
+ *   requests in flight on each connection; the synchronous ops called from
+ *   a task of a fiber loop (fiber.h) park the task until their reply instead
+ *   of blocking its thread
+ * - a thread sticks to a connection of the pool, it moves to the others
+ *   while its own is down, and reconnects it with an exponential backoff
+ * - transfers above REMOTE_MAX_PAYLOAD are split in frames sent back to back
  */
-int connect_server() {
 
-  int client_fd;
-  struct sockaddr_in serv_addr;
+// gather entries of a frame kept on the stack, larger ones are allocated
+#define REMOTE_STACK_IOV 8
+
+// connection of the pool a thread sends on first, assigned round robin
+static __thread int thread_slot = -1;
+static int next_slot;
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Place a reply payload in the buffers of its request
+ *
+ * @return int -> 0 on success, -1 with errno set if the connection failed
+ */
+static int recv_payload(RemoteLink *link, RemoteRequest *request,
+                        size_t length) {
+  for (int i = 0; request && i < request->reply_cnt && length > 0; i++) {
+    size_t n = request->reply[i].iov_len;
+    if (n > length) {
+      n = length;
+    }
+    if (remote_link_recv(link, request->reply[i].iov_base, n) != 0) {
+      return -1;
+    }
+    request->received += n;
+    length -= n;
+  }
+  // what does not fit is not for us
+  return remote_link_recv(link, NULL, length);
+}
 
-  // Creating socket file descriptor
-  // https://man7.org/linux/man-pages/man2/socket.2.html
-  client_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (client_fd < 0) {
-    printf("\n Socket creation error \n");
+/**
+ * @brief Join the session of the layer, before any other request
+ *
+ * @return int -> 0 on success, -1 with errno set otherwise
+ */
+static int hello(RemoteState *state, RemoteLink *link, bool first) {
+  RemoteHeader header;
+  remote_header_encode(&header, REMOTE_OP_HELLO, 0, 0, 0,
+                       (int64_t)state->session, 0);
+  struct iovec iov = {&header, sizeof(header)};
+  if (remote_link_send(link, &iov, 1) != 0 ||
+      remote_link_recv(link, &header, sizeof(header)) != 0) {
     return -1;
   }
+  if (remote_header_decode(&header, 0) != 0 ||
+      header.op != REMOTE_OP_HELLO || header.arg < 0) {
+    errno = header.arg < 0 ? (int)-header.arg : EPROTO;
+    return -1;
+  }
+  if (header.arg == 1 && !first) {
+    WARN_MSG("[REMOTE] The server lost the session, the files opened "
+             "before are closed");
+  }
+  return 0;
+}
 
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_port = htons(PORT);
+static void complete(RemoteConn *conn, RemoteRequest *request, ssize_t res) {
+  // the request may not outlive its callback
+  request->callback(res, request->ctx);
 
-  // Convert IPv4 and IPv6 addresses from text to binary form
-  if (inet_pton(AF_INET, IP, &serv_addr.sin_addr) <= 0) {
-    printf("\nInvalid address/ Address not supported \n");
-    return -1;
+  pthread_mutex_lock(&conn->lock);
+  conn->inflight--;
+  pthread_cond_broadcast(&conn->slots);
+  pthread_mutex_unlock(&conn->lock);
+}
+
+/**
+ * @brief Mark the connection lost and fail the requests waiting for a reply
+ */
+static void fail_pending(RemoteConn *conn, int error) {
+  pthread_mutex_lock(&conn->lock);
+  conn->connected = false;
+  if (conn->error == 0) {
+    conn->error = error;
+  }
+  error = conn->error;
+  // the first attempt to reconnect is not delayed
+  conn->retry_at_ms = now_ms();
+  RemoteRequest *pending = conn->pending;
+  conn->pending = NULL;
+  pthread_cond_broadcast(&conn->slots);
+  pthread_mutex_unlock(&conn->lock);
+
+  RemoteRequest *request, *tmp;
+  HASH_ITER(hh, pending, request, tmp) {
+    HASH_DELETE(hh, pending, request);
+    complete(conn, request, -error);
+  }
+}
+
+static void *receive_loop(void *arg) {
+  RemoteConn *conn = arg;
+  RemoteLink *link = conn->link;
+
+  while (1) {
+    RemoteHeader header;
+    if (remote_link_recv(link, &header, sizeof(header)) != 0) {
+      break;
+    }
+    if (remote_header_decode(&header, REMOTE_MAX_PAYLOAD) != 0) {
+      ERROR_MSG("[REMOTE] Invalid reply header, dropping the connection");
+      errno = EPROTO;
+      break;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    RemoteRequest *request;
+    HASH_FIND(hh, conn->pending, &header.id, sizeof(header.id), request);
+    if (request) {
+      HASH_DEL(conn->pending, request);
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    if (!request) {
+      ERROR_MSG("[REMOTE] Reply to unknown request %llu",
+                (unsigned long long)header.id);
+    }
+    if (recv_payload(link, request, header.length) != 0) {
+      if (request) {
+        complete(conn, request, -errno);
+      }
+      break;
+    }
+    if (!request) {
+      continue;
+    }
+
+    ssize_t res = (ssize_t)header.arg;
+    if (header.op == REMOTE_OP_READ && res >= 0 &&
+        (size_t)res != request->received) {
+      res = -EPROTO;
+    }
+    complete(conn, request, res);
+  }
+
+  fail_pending(conn, errno ? errno : ECONNRESET);
+  return NULL;
+}
+
+/**
+ * @brief Connect conn, called with its connect_lock held while it is down
+ *
+ * @return int -> 0 on success, -1 with errno set otherwise
+ */
+static int conn_connect(RemoteConn *conn, bool first) {
+  RemoteState *state = conn->state;
+
+  // the receiver of the lost connection has failed its requests
+  if (conn->receiving) {
+    pthread_join(conn->receiver, NULL);
+    conn->receiving = false;
+  }
+
+  RemoteLink *link = remote_link_open(&state->config, state->host);
+  if (link && hello(state, link, first) != 0) {
+    int error = errno;
+    ERROR_MSG("[REMOTE] Failed to join the session (%s)", strerror(error));
+    remote_link_close(link);
+    link = NULL;
+    errno = error;
   }
 
-  // connect to server
-  if (connect(client_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) <
-      0) {
-    printf("\nConnection Failed \n");
+  pthread_mutex_lock(&conn->send_lock);
+  pthread_mutex_lock(&conn->lock);
+  if (!link) {
+    conn->error = errno;
+    conn->retry_at_ms = now_ms() + conn->backoff_ms;
+    conn->backoff_ms = conn->backoff_ms * 2 < state->config.reconnect_max_ms
+                           ? conn->backoff_ms * 2
+                           : state->config.reconnect_max_ms;
+    int error = conn->error;
+    pthread_mutex_unlock(&conn->lock);
+    pthread_mutex_unlock(&conn->send_lock);
+    errno = error;
     return -1;
   }
+  if (conn->link) {
+    remote_link_close(conn->link);
+  }
+  conn->link = link;
+  conn->generation++;
+  conn->connected = true;
+  conn->error = 0;
+  conn->backoff_ms = state->config.reconnect_min_ms;
+  pthread_mutex_unlock(&conn->lock);
+  pthread_mutex_unlock(&conn->send_lock);
+
+  if (pthread_create(&conn->receiver, NULL, receive_loop, conn) != 0) {
+    ERROR_MSG("[REMOTE] Failed to start a receiver thread");
+    remote_link_shutdown(link);
+    fail_pending(conn, EAGAIN);
+    errno = EAGAIN;
+    return -1;
+  }
+  conn->receiving = true;
+  return 0;
+}
 
-  return client_fd;
+/**
+ * @brief Whether requests can be sent on conn, reconnecting it if allowed
+ */
+static bool conn_ready(RemoteConn *conn, bool may_connect) {
+  pthread_mutex_lock(&conn->lock);
+  bool connected = conn->connected;
+  long long retry_at_ms = conn->retry_at_ms;
+  pthread_mutex_unlock(&conn->lock);
+  if (connected || !may_connect || now_ms() < retry_at_ms) {
+    return connected;
+  }
+
+  pthread_mutex_lock(&conn->connect_lock);
+  // another thread may have reconnected it meanwhile, or just failed to
+  pthread_mutex_lock(&conn->lock);
+  connected = conn->connected;
+  retry_at_ms = conn->retry_at_ms;
+  pthread_mutex_unlock(&conn->lock);
+  if (!connected && now_ms() >= retry_at_ms) {
+    connected = conn_connect(conn, false) == 0;
+  }
+  pthread_mutex_unlock(&conn->connect_lock);
+  return connected;
 }
 
 /**
- * @brief Close dummy sserver connection
+ * @brief Register request on conn and send its frame
  *
- * @param client_fd
+ * @return int -> 0 if registered, 1 if conn is down, -1 with errno set
+ * otherwise
  */
-void close_server(int client_fd) {
+static int submit_on(RemoteConn *conn, RemoteRequest *request,
+                     struct iovec *iov, int iovcnt, RemoteHeader *header,
+                     uint8_t op, uint32_t handle, uint64_t offset,
+                     int64_t arg, size_t length) {
+  RemoteState *state = conn->state;
+
+  pthread_mutex_lock(&conn->lock);
+  while (conn->connected && conn->inflight >= state->config.max_inflight) {
+    pthread_cond_wait(&conn->slots, &conn->lock);
+  }
+  if (!conn->connected) {
+    pthread_mutex_unlock(&conn->lock);
+    return 1;
+  }
+  request->id = __atomic_fetch_add(&state->next_id, 1, __ATOMIC_RELAXED);
+  request->received = 0;
+  HASH_ADD(hh, conn->pending, id, sizeof(request->id), request);
+  conn->inflight++;
+  RemoteLink *link = conn->link;
+  unsigned generation = conn->generation;
+  pthread_mutex_unlock(&conn->lock);
+
+  // the reply may complete the request as soon as the frame is out
+  remote_header_encode(header, op, request->id, handle, offset, arg,
+                       (uint32_t)length);
+
+  // the link is only replaced under send_lock, once the pending requests
+  // of the old one are failed: a frame sent to the new one would run an op
+  // whose caller was told it failed
+  pthread_mutex_lock(&conn->send_lock);
+  int res = 0;
+  int error = 0;
+  if (conn->generation == generation) {
+    res = remote_link_send(link, iov, iovcnt);
+    error = errno;
+    if (res != 0) {
+      // a partial frame desynchronizes the stream, the receiver fails the
+      // pending requests, this one included, once the link is shut down
+      pthread_mutex_lock(&conn->lock);
+      if (conn->error == 0) {
+        conn->error = error;
+      }
+      pthread_mutex_unlock(&conn->lock);
+      remote_link_shutdown(link);
+    }
+  }
+  pthread_mutex_unlock(&conn->send_lock);
 
-  // closing the connected socket
-  close(client_fd);
+  if (res != 0) {
+    ERROR_MSG("[REMOTE] Failed to send a request (%s)", strerror(error));
+  }
+  return 0;
 }
 
 /**
- * @brief Remote pwrite, sends the operation to be performed in a dummy server
+ * @brief Register request and send its frame, on the connection of the
+ * calling thread or on another one while that one is down
  *
- * @param fd       -> file descriptor
- * @param buffer   -> buffer to write
- * @param size     -> number of bytes to write
- * @param offset   -> offset value
- * @param l        -> remote layer context
- * @return ssize_t -> number of written bytes in the dummy server
- */
-ssize_t remote_pwrite(int fd, const void *buffer, size_t size, off_t offset,
-                      LayerContext l) {
+ * Once registered, the callback of the request runs exactly once, with the
+ * error of the connection if sending fails.
+ *
+ * @param payload       -> payload of the frame
+ * @param payload_cnt   -> entries of payload, below IOV_MAX
+ * @return int          -> 0 if registered, -1 with errno set otherwise
+ */
+static int submit(RemoteState *state, RemoteRequest *request, uint8_t op,
+                  uint32_t handle, uint64_t offset, int64_t arg,
+                  const struct iovec *payload, int payload_cnt) {
+  size_t length = iov_length(payload, payload_cnt);
+  if (length > REMOTE_MAX_PAYLOAD || payload_cnt >= IOV_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
 
-  /**
-   * Both internal state and application context might need to be changed
-   */
-  char *path = l.app_context;
-  int *client_fd = l.internal_state;
+  struct iovec stack_iov[REMOTE_STACK_IOV];
+  struct iovec *iov = stack_iov;
+  if (payload_cnt + 1 > REMOTE_STACK_IOV) {
+    iov = malloc(sizeof(struct iovec) * (size_t)(payload_cnt + 1));
+    if (!iov) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+
+  if (thread_slot < 0) {
+    thread_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED);
+  }
+  int first = thread_slot % state->nconns;
+
+  int res = 1;
+  int error = ENOTCONN;
+  for (int i = 0; i < state->nconns && res == 1; i++) {
+    RemoteConn *conn = &state->conns[(first + i) % state->nconns];
+    // only the connection of the thread is reconnected by it
+    if (conn_ready(conn, i == 0)) {
+      // sending consumes iov, rebuild it for each attempt
+      RemoteHeader header;
+      iov[0].iov_base = &header;
+      iov[0].iov_len = sizeof(header);
+      if (payload_cnt > 0) {
+        memcpy(iov + 1, payload, sizeof(struct iovec) * (size_t)payload_cnt);
+      }
+      res = submit_on(conn, request, iov, payload_cnt + 1, &header, op,
+                      handle, offset, arg, length);
+    }
+    if (res == 1 && i == 0) {
+      pthread_mutex_lock(&conn->lock);
+      error = conn->error ? conn->error : ENOTCONN;
+      pthread_mutex_unlock(&conn->lock);
+    }
+  }
+
+  if (iov != stack_iov) {
+    free(iov);
+  }
+  if (res == 1) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
 
-  MSG m;
-  m.op = WRITE;
-  strcpy(m.path, path);
-  memcpy(m.buffer, buffer, size);
-  m.offset = offset;
-  m.size = size;
+// a task of a fiber loop waiting for its reply lets the loop run the others
+typedef struct {
+  FiberEvent event;
+  ssize_t res;
+} SyncWait;
 
-  write(*client_fd, &m, sizeof(m));
-  printf("[ Client ]: WRITE Message sent path: %s\n", m.path);
+static void sync_wait_init(SyncWait *wait) {
+  fiber_event_init(&wait->event);
+  wait->res = 0;
+}
 
-  read(*client_fd, &m, sizeof(m));
-  printf("[ Client ]: Received Msg from WRITE: %s\n", m.buffer);
+static void sync_wait_abort(SyncWait *wait) {
+  pthread_cond_destroy(&wait->event.cond);
+  pthread_mutex_destroy(&wait->event.mutex);
+}
 
-  return m.res;
+static void sync_complete(ssize_t res, void *ctx) {
+  SyncWait *wait = ctx;
+  wait->res = res;
+  fiber_event_signal(&wait->event);
 }
 
 /**
- * @brief Remote pread, sends the operation to be performed in a dummy server
+ * @brief Wait for the completion of a request, then release wait
  *
- * @param fd       -> file descriptor
- * @param buffer   -> buffer to read to
- * @param size     -> number of bytes to read
- * @param offset   -> offset values
- * @param l        -> context of the remote layer
- * @return ssize_t -> number of read bytes in the dummy server
- */
-ssize_t remote_pread(int fd, void *buffer, size_t size, off_t offset,
-                     LayerContext l) {
+ * @return ssize_t -> result of the request, -1 with errno set on failure
+ */
+static ssize_t sync_wait(SyncWait *wait) {
+  fiber_event_wait(&wait->event);
+  if (wait->res < 0) {
+    errno = (int)-wait->res;
+    return -1;
+  }
+  return wait->res;
+}
+
+/**
+ * @brief Run an op that transfers no file data and wait for its reply
+ *
+ * @param payload       -> request payload, NULL if none
+ * @param reply         -> buffer of the reply payload, NULL if none
+ * @param received      -> set to the reply payload bytes, may be NULL
+ * @return ssize_t      -> result of the op, -1 with errno set on failure
+ */
+static ssize_t call(RemoteState *state, uint8_t op, uint32_t handle,
+                    uint64_t offset, int64_t arg, const char *payload,
+                    void *reply, size_t reply_size, size_t *received) {
+  struct iovec payload_iov = {(void *)payload, payload ? strlen(payload) : 0};
+  struct iovec reply_iov = {reply, reply_size};
+
+  if (payload && payload_iov.iov_len > REMOTE_MAX_PATH) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  SyncWait wait;
+  sync_wait_init(&wait);
+  RemoteRequest request;
+  memset(&request, 0, sizeof(request));
+  request.reply = &reply_iov;
+  request.reply_cnt = reply ? 1 : 0;
+  request.callback = sync_complete;
+  request.ctx = &wait;
+
+  if (submit(state, &request, op, handle, offset, arg, &payload_iov,
+             payload ? 1 : 0) != 0) {
+    int error = errno;
+    sync_wait_abort(&wait);
+    errno = error;
+    return -1;
+  }
+  ssize_t res = sync_wait(&wait);
+  if (received) {
+    *received = request.received;
+  }
+  return res;
+}
+
+struct remote_transfer;
+
+/**
+ * @brief One frame of a read or write
+ */
+typedef struct {
+  RemoteRequest request;
+  struct remote_transfer *transfer;
+  size_t length; // bytes of the frame
   ssize_t res;
+} RemoteFrame;
+
+/**
+ * @brief Frames of one read or write, answered in any order
+ */
+typedef struct remote_transfer {
+  LayerIoCallback callback;
+  void *ctx;
+  int nframes;
+  int pending; // frames not answered, plus one while they are being sent
+  RemoteFrame *frames;
+  struct iovec *slices; // iovcnt entries per frame
+} RemoteTransfer;
+
+static void transfer_release(RemoteTransfer *transfer) {
+  if (__atomic_sub_fetch(&transfer->pending, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
 
-  /**
-   * Both internal state and application context might need to be changed
-   */
+  // bytes transferred up to the first short or failed frame
+  ssize_t res = 0;
+  for (int i = 0; i < transfer->nframes; i++) {
+    RemoteFrame *frame = &transfer->frames[i];
+    if (frame->res < 0) {
+      if (i == 0) {
+        res = frame->res;
+      }
+      break;
+    }
+    res += frame->res;
+    if ((size_t)frame->res < frame->length) {
+      break;
+    }
+  }
 
-  char *path = l.app_context;
-  int *client_fd = l.internal_state;
+  LayerIoCallback callback = transfer->callback;
+  void *ctx = transfer->ctx;
+  free(transfer);
+  callback(res, ctx);
+}
 
-  // Initialize MSG
-  MSG m;
-  m.op = READ;
-  m.offset = offset;
-  m.size = size;
-  strncpy(m.path, path, PSIZE);
+static void frame_complete(ssize_t res, void *ctx) {
+  RemoteFrame *frame = ctx;
+  frame->res = res;
+  transfer_release(frame->transfer);
+}
 
-  // Send MSG
-  res = write(*client_fd, &m, sizeof(m));
-  if (res < 0) {
-    perror("write"); // check error if write returns -1
-    return res;
+/**
+ * @brief Point out at len bytes of iov, skip bytes in
+ *
+ * @return int -> entries of out
+ */
+static int iov_slice(const struct iovec *iov, int iovcnt, size_t skip,
+                     size_t len, struct iovec *out) {
+  int n = 0;
+  for (int i = 0; i < iovcnt && len > 0; i++) {
+    if (skip >= iov[i].iov_len) {
+      skip -= iov[i].iov_len;
+      continue;
+    }
+    size_t take = iov[i].iov_len - skip;
+    if (take > len) {
+      take = len;
+    }
+    out[n].iov_base = (char *)iov[i].iov_base + skip;
+    out[n].iov_len = take;
+    n++;
+    len -= take;
+    skip = 0;
   }
+  return n;
+}
 
-  // Receive read result
-  res = read(*client_fd, &m, sizeof(m));
-  if (res < 0) {
-    perror("read"); // check error if read returns -1
-    return res;
+/**
+ * @brief Send the frames of a read into iov or a write of iov
+ *
+ * iov is only used during the call, the buffers it points to must stay valid
+ * until the callback, which gets the bytes transferred or -errno.
+ *
+ * @return int -> 0 if the callback will run, -1 with errno set otherwise
+ */
+static int transfer_async(RemoteState *state, bool write, int fd,
+                          const struct iovec *iov, int iovcnt, off_t offset,
+                          LayerIoCallback callback, void *ctx) {
+  if (fd < 0 || iovcnt < 0 || iovcnt >= IOV_MAX) {
+    errno = fd < 0 ? EBADF : EINVAL;
+    return -1;
+  }
+  size_t total = iov_length(iov, iovcnt);
+  int nframes = total == 0 ? 1
+                           : (int)((total + REMOTE_MAX_PAYLOAD - 1) /
+                                   REMOTE_MAX_PAYLOAD);
+  size_t slots = (size_t)(iovcnt ? iovcnt : 1);
+
+  RemoteTransfer *transfer =
+      malloc(sizeof(RemoteTransfer) +
+             (size_t)nframes * (sizeof(RemoteFrame) +
+                                slots * sizeof(struct iovec)));
+  if (!transfer) {
+    errno = ENOMEM;
+    return -1;
   }
+  transfer->frames = (RemoteFrame *)(transfer + 1);
+  transfer->slices = (struct iovec *)(transfer->frames + nframes);
+  transfer->callback = callback;
+  transfer->ctx = ctx;
+  transfer->nframes = nframes;
+  transfer->pending = nframes + 1;
+
+  for (int i = 0; i < nframes; i++) {
+    size_t skip = (size_t)i * REMOTE_MAX_PAYLOAD;
+    size_t len = total - skip < REMOTE_MAX_PAYLOAD ? total - skip
+                                                   : REMOTE_MAX_PAYLOAD;
+    struct iovec *slice = transfer->slices + (size_t)i * slots;
+    int n = iov_slice(iov, iovcnt, skip, len, slice);
+    RemoteFrame *frame = &transfer->frames[i];
+    memset(frame, 0, sizeof(*frame));
+    frame->transfer = transfer;
+    frame->length = len;
+    RemoteRequest *request = &frame->request;
+    request->callback = frame_complete;
+    request->ctx = frame;
+
+    int res;
+    if (write) {
+      request->reply_cnt = 0;
+      res = submit(state, request, REMOTE_OP_WRITE, (uint32_t)fd,
+                   (uint64_t)(offset + (off_t)skip), 0, slice, n);
+    } else {
+      request->reply = slice;
+      request->reply_cnt = n;
+      res = submit(state, request, REMOTE_OP_READ, (uint32_t)fd,
+                   (uint64_t)(offset + (off_t)skip), (int64_t)len, NULL, 0);
+    }
+    if (res != 0) {
+      if (i == 0) {
+        int error = errno;
+        free(transfer);
+        errno = error;
+        return -1;
+      }
+      // the frames sent complete the transfer, short of the others
+      for (int j = i; j < nframes; j++) {
+        transfer->frames[j].res = -errno;
+      }
+      __atomic_sub_fetch(&transfer->pending, nframes - i, __ATOMIC_ACQ_REL);
+      break;
+    }
+  }
+  transfer_release(transfer);
+  return 0;
+}
 
-  // copy read result to buffer
-  memcpy(buffer, m.buffer, m.size);
+static ssize_t transfer(RemoteState *state, bool write, int fd,
+                        const struct iovec *iov, int iovcnt, off_t offset) {
+  SyncWait wait;
+  sync_wait_init(&wait);
+  if (transfer_async(state, write, fd, iov, iovcnt, offset, sync_complete,
+                     &wait) != 0) {
+    int error = errno;
+    sync_wait_abort(&wait);
+    errno = error;
+    return -1;
+  }
+  return sync_wait(&wait);
+}
 
-  // return number of read bytes
-  return m.res;
+ssize_t remote_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                     LayerContext l) {
+  struct iovec iov = {buffer, nbyte};
+  return transfer(l.internal_state, false, fd, &iov, 1, offset);
 }
 
-int remote_open(const char *pathname, int flags, mode_t mode, LayerContext l) {
-  int res;
+ssize_t remote_pwrite(int fd, const void *buffer, size_t nbytes, off_t offset,
+                      LayerContext l) {
+  struct iovec iov = {(void *)buffer, nbytes};
+  return transfer(l.internal_state, true, fd, &iov, 1, offset);
+}
 
-  /**
-   * Both internal state and application context might need to be changed
-   */
+ssize_t remote_preadv(int fd, const struct iovec *iov, int iovcnt,
+                      off_t offset, LayerContext l) {
+  return transfer(l.internal_state, false, fd, iov, iovcnt, offset);
+}
 
-  int *client_fd = l.internal_state;
+ssize_t remote_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                       off_t offset, LayerContext l) {
+  return transfer(l.internal_state, true, fd, iov, iovcnt, offset);
+}
 
-  // Initialize MSG
-  MSG m;
-  m.op = OPEN;
-  strcpy(m.path, pathname);
-  m.mode = mode;
-  m.flags = flags;
+int remote_pread_async(int fd, void *buffer, size_t nbyte, off_t offset,
+                       LayerIoCallback callback, void *ctx, LayerContext l) {
+  struct iovec iov = {buffer, nbyte};
+  return transfer_async(l.internal_state, false, fd, &iov, 1, offset,
+                        callback, ctx);
+}
 
-  // Send MSG
-  res = (int)write(*client_fd, &m, sizeof(m));
-  if (res < 0) {
-    perror("write"); // check error if write returns -1
-    return res;
-  }
+int remote_pwrite_async(int fd, const void *buffer, size_t nbyte,
+                        off_t offset, LayerIoCallback callback, void *ctx,
+                        LayerContext l) {
+  struct iovec iov = {(void *)buffer, nbyte};
+  return transfer_async(l.internal_state, true, fd, &iov, 1, offset,
+                        callback, ctx);
+}
 
-  // Receive read result
-  res = (int)read(*client_fd, &m, sizeof(m));
-  if (res < 0) {
-    perror("read"); // check error if read returns -1
-    return res;
+int remote_open(const char *pathname, int flags, mode_t mode,
+                LayerContext l) {
+  ssize_t res = call(l.internal_state, REMOTE_OP_OPEN, 0, (uint64_t)mode,
+                     flags, pathname, NULL, 0, NULL);
+  if (res > INT_MAX) {
+    errno = EMFILE;
+    return -1;
   }
-
-  // return number of read bytes
-  return (int)m.res;
+  return (int)res;
 }
 
 int remote_close(int fd, LayerContext l) {
-  int res;
-
-  /**
-   * Both internal state and application context might need to be changed
-   */
+  return (int)call(l.internal_state, REMOTE_OP_CLOSE, (uint32_t)fd, 0, 0,
+                   NULL, NULL, 0, NULL);
+}
 
-  int *client_fd = l.internal_state;
+int remote_ftruncate(int fd, off_t length, LayerContext l) {
+  return (int)call(l.internal_state, REMOTE_OP_FTRUNCATE, (uint32_t)fd,
+                   (uint64_t)length, 0, NULL, NULL, 0, NULL);
+}
 
-  // Initialize MSG
-  MSG m;
-  m.op = CLOSE;
-  m.fd = fd;
+int remote_truncate(const char *path, off_t length, LayerContext l) {
+  return (int)call(l.internal_state, REMOTE_OP_TRUNCATE, 0, (uint64_t)length,
+                   0, path, NULL, 0, NULL);
+}
 
-  // Send MSG
-  res = (int)write(*client_fd, &m, sizeof(m));
-  if (res < 0) {
-    perror("write"); // check error if write returns -1
-    return res;
+static int stat_call(RemoteState *state, uint8_t op, uint32_t handle,
+                     const char *path, struct stat *stbuf) {
+  RemoteStat rs;
+  size_t received;
+  if (call(state, op, handle, 0, 0, path, &rs, sizeof(rs), &received) < 0) {
+    return -1;
   }
-
-  // Receive read result
-  res = (int)read(*client_fd, &m, sizeof(m));
-  if (res < 0) {
-    perror("read"); // check error if read returns -1
-    return res;
+  if (received != sizeof(rs)) {
+    errno = EPROTO;
+    return -1;
   }
+  remote_stat_decode(&rs, stbuf);
+  return 0;
+}
+
+int remote_fstat(int fd, struct stat *stbuf, LayerContext l) {
+  return stat_call(l.internal_state, REMOTE_OP_FSTAT, (uint32_t)fd, NULL,
+                   stbuf);
+}
+
+int remote_lstat(const char *path, struct stat *stbuf, LayerContext l) {
+  return stat_call(l.internal_state, REMOTE_OP_LSTAT, 0, path, stbuf);
+}
 
-  // return number of read bytes
-  return (int)m.res;
+int remote_unlink(const char *path, LayerContext l) {
+  return (int)call(l.internal_state, REMOTE_OP_UNLINK, 0, 0, 0, path, NULL, 0,
+                   NULL);
+}
+
+int remote_fsync(int fd, int isdatasync, LayerContext l) {
+  return (int)call(l.internal_state, REMOTE_OP_FSYNC, (uint32_t)fd, 0,
+                   isdatasync ? 1 : 0, NULL, NULL, 0, NULL);
 }
 
 /**
@@ -210,24 +751,120 @@ int remote_close(int fd, LayerContext l) {
  *
  * @return LayerContext
  */
-LayerContext remote_init() {
+LayerContext remote_init(const RemoteConfig *config) {
+  RemoteState *state = calloc(1, sizeof(RemoteState));
+  if (config) {
+    state->config = *config;
+  } else {
+    state->config.port = REMOTE_DEFAULT_PORT;
+    state->config.max_inflight = REMOTE_DEFAULT_MAX_INFLIGHT;
+    state->config.connections = REMOTE_DEFAULT_CONNECTIONS;
+    state->config.keepalive_idle = REMOTE_DEFAULT_KEEPALIVE_IDLE;
+    state->config.keepalive_interval = REMOTE_DEFAULT_KEEPALIVE_INTERVAL;
+    state->config.keepalive_count = REMOTE_DEFAULT_KEEPALIVE_COUNT;
+    state->config.reconnect_min_ms = REMOTE_DEFAULT_RECONNECT_MIN_MS;
+    state->config.reconnect_max_ms = REMOTE_DEFAULT_RECONNECT_MAX_MS;
+    state->config.shm_ring_size = REMOTE_DEFAULT_SHM_RING;
+  }
+  state->host = strdup(state->config.host ? state->config.host
+                                          : REMOTE_DEFAULT_HOST);
+  state->config.host = NULL;
+  state->config.shm_path = strdup(state->config.shm_path
+                                      ? state->config.shm_path
+                                      : REMOTE_DEFAULT_SHM_PATH);
+  state->port = state->config.port;
+  state->next_id = 1;
+
+  // a random session id, which no other client is going to pick
+  while (state->session == 0) {
+    if (getrandom(&state->session, sizeof(state->session), 0) !=
+        sizeof(state->session)) {
+      state->session = ((uint64_t)now_ms() << 20) ^ (uint64_t)getpid();
+    }
+  }
+
+  state->nconns = state->config.connections > 0 ? state->config.connections
+                                                : REMOTE_DEFAULT_CONNECTIONS;
+  state->conns = calloc((size_t)state->nconns, sizeof(RemoteConn));
+  int connected = 0;
+  for (int i = 0; i < state->nconns; i++) {
+    RemoteConn *conn = &state->conns[i];
+    conn->state = state;
+    pthread_mutex_init(&conn->connect_lock, NULL);
+    pthread_mutex_init(&conn->send_lock, NULL);
+    pthread_mutex_init(&conn->lock, NULL);
+    pthread_cond_init(&conn->slots, NULL);
+    conn->backoff_ms = state->config.reconnect_min_ms;
+    // the first connection creates the session, the others join it
+    if (conn_connect(conn, connected == 0) == 0) {
+      connected++;
+    }
+  }
 
   // memory allocation for the operations struct
-  LayerOps *ops = malloc(sizeof(LayerOps));
+  LayerOps *ops = calloc(1, sizeof(LayerOps));
   ops->lpread = remote_pread;
   ops->lpwrite = remote_pwrite;
-  ops->lopen = remote_open;   // TODO
-  ops->lclose = remote_close; // TODO
+  ops->lpreadv = remote_preadv;
+  ops->lpwritev = remote_pwritev;
+  ops->lpread_async = remote_pread_async;
+  ops->lpwrite_async = remote_pwrite_async;
+  ops->lopen = remote_open;
+  ops->lclose = remote_close;
+  ops->lftruncate = remote_ftruncate;
+  ops->ltruncate = remote_truncate;
+  ops->lfstat = remote_fstat;
+  ops->llstat = remote_lstat;
+  ops->lunlink = remote_unlink;
+  ops->lfsync = remote_fsync;
+  ops->ldestroy = remote_destroy;
 
   // declaration of a new layer context
   LayerContext new_layer;
   new_layer.ops = ops;          // layer exported operations
   new_layer.next_layers = NULL; // there are no next layers
-
-  int *socket_fd = malloc(sizeof(int)); // socket file descriptor
-  *socket_fd = connect_server();        // connect to server
-  new_layer.internal_state = socket_fd; // socket file descriptor is kept in the
-                                        // internal state of the layer.
+  new_layer.nlayers = 0;
+  new_layer.app_context = NULL;
+  new_layer.internal_state = state;
+
+  if (DEBUG_ENABLED()) {
+    if (state->config.transport == REMOTE_TRANSPORT_SHM) {
+      DEBUG_MSG("[REMOTE] Init shm %s ring=%d connections=%d/%d "
+                "max_inflight=%d",
+                state->config.shm_path, state->config.shm_ring_size, connected,
+                state->nconns, state->config.max_inflight);
+    } else {
+      DEBUG_MSG("[REMOTE] Init %s:%d connections=%d/%d max_inflight=%d",
+                state->host, state->port, connected, state->nconns,
+                state->config.max_inflight);
+    }
+  }
 
   return new_layer;
 }
+
+void remote_destroy(LayerContext l) {
+  RemoteState *state = l.internal_state;
+
+  for (int i = 0; i < state->nconns; i++) {
+    RemoteConn *conn = &state->conns[i];
+    if (conn->receiving) {
+      // the receiver fails whatever is still pending and exits
+      remote_link_shutdown(conn->link);
+      pthread_join(conn->receiver, NULL);
+    }
+    if (conn->link) {
+      remote_link_close(conn->link);
+    }
+    pthread_cond_destroy(&conn->slots);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_mutex_destroy(&conn->send_lock);
+    pthread_mutex_destroy(&conn->connect_lock);
+  }
+
+  free(state->conns);
+  free(state->host);
+  free(state->config.shm_path);
+  free(state);
+  free(l.ops);
+}
@@ -1,49 +1,140 @@
 #ifndef __REMOTE_H__
 #define __REMOTE_H__
 
+#include "../../lib/uthash/src/uthash.h"
 #include "../../shared/types/layer_context.h"
 #include "config.h"
-#include <arpa/inet.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/socket.h>
+#include "protocol.h"
+#include "transport.h"
+#include <pthread.h>
+#include <stdbool.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
-#define PORT 5000
-#define LISTEN_BACKLOG 50
-#define BSIZE 4096
-#define PSIZE 512
-#define PORT 5000
-#define IP "127.0.0.1"
-
-#define READ 0
-#define WRITE 1
-#define STAT 2
-#define OPEN 3
-#define UNLINK 4
-#define CLOSE 5
-
-typedef struct msg {
-  int op;
-  char path[PSIZE];
-  char buffer[BSIZE];
-  int flags;
-  off_t offset;
-  size_t size;
-  ssize_t res;
-  int fd;
-  mode_t mode;
-  struct stat st;
-} MSG;
-
-LayerContext remote_init();
+/**
+ * @brief A request waiting for its reply
+ */
+typedef struct {
+  uint64_t id;                // key of the pending table, echoed by the reply
+  const struct iovec *reply;  // where the reply payload goes
+  int reply_cnt;              // entries of reply
+  size_t received;            // payload bytes placed in reply
+  LayerIoCallback callback;   // runs on the receiver thread with the result
+  void *ctx;
+  UT_hash_handle hh;
+} RemoteRequest;
+
+typedef struct remote_state RemoteState;
+
+/**
+ * @brief A connection of the pool
+ */
+typedef struct {
+  RemoteState *state;
+  pthread_mutex_t connect_lock; // held while reconnecting
+  pthread_mutex_t send_lock;    // a frame is sent whole
+
+  pthread_mutex_t lock;         // protects everything below
+  pthread_cond_t slots;         // signaled when a request completes
+  RemoteLink *link;             // NULL before the first connection
+  unsigned generation;          // bumped each time link is replaced
+  RemoteRequest *pending;       // requests sent and not answered, by id
+  int inflight;                 // never above max_inflight
+  bool connected;               // false until connected, once lost
+  bool receiving;               // receiver started and not joined
+  int error;                    // errno the pending requests fail with
+  long long retry_at_ms;        // no reconnection attempt before
+  int backoff_ms;               // delay after the next failed attempt
+  pthread_t receiver;
+} RemoteConn;
+
+struct remote_state {
+  char *host;
+  int port;
+  RemoteConfig config;
+  uint64_t session; // joined by every connection, 0 before the first HELLO
+  uint64_t next_id;
+  int nconns;
+  RemoteConn *conns;
+};
+
+/**
+ * @brief Initialize the remote layer, connected to a storserver
+ *
+ * The connections are TCP, or shared-memory rings with transport "shm". The
+ * layer keeps a pool of connections to a single server session, so the
+ * handles it gives out are valid on all of them. Each thread sends its
+ * requests on a connection of its own while that one is up, on the others
+ * otherwise. A lost connection fails the requests waiting for its replies
+ * and is reconnected by the next request of its threads, after a delay that
+ * doubles with each failed attempt. While the connection of a thread is
+ * down and none of the others is up, its ops fail with the error of its
+ * last connection attempt.
+ *
+ * @param config        -> remote layer configuration, NULL for the defaults
+ * @return LayerContext -> context of the remote layer
+ */
+LayerContext remote_init(const RemoteConfig *config);
+void remote_destroy(LayerContext l);
 ssize_t remote_pread(int fd, void *buffer, size_t nbyte, off_t offset,
                      LayerContext l);
 ssize_t remote_pwrite(int fd, const void *buffer, size_t nbytes, off_t offset,
                       LayerContext l);
+ssize_t remote_preadv(int fd, const struct iovec *iov, int iovcnt,
+                      off_t offset, LayerContext l);
+ssize_t remote_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                       off_t offset, LayerContext l);
 
+/**
+ * @brief open for the remote layer
+ *
+ * @return int -> handle of the file on the server, used as the fd of the
+ * other ops, -1 with errno set on failure
+ */
 int remote_open(const char *pathname, int flags, mode_t mode, LayerContext l);
 int remote_close(int fd, LayerContext l);
+int remote_ftruncate(int fd, off_t length, LayerContext l);
+int remote_truncate(const char *path, off_t length, LayerContext l);
+int remote_fstat(int fd, struct stat *stbuf, LayerContext l);
+int remote_lstat(const char *path, struct stat *stbuf, LayerContext l);
+int remote_unlink(const char *path, LayerContext l);
+int remote_fsync(int fd, int isdatasync, LayerContext l);
+
+/**
+ * @brief Send a read without waiting for it (lpread_async)
+ *
+ * The buffer must stay valid until the callback, which runs on the receiver
+ * thread and must not block.
+ *
+ * @param fd            -> file handle
+ * @param buffer        -> buffer to read into
+ * @param nbyte         -> number of bytes to read
+ * @param offset        -> offset value
+ * @param callback      -> called with the result once the reply arrives
+ * @param ctx           -> passed to the callback
+ * @param l             -> context of the remote layer
+ * @return int          -> 0 if sent, -1 with errno set otherwise
+ */
+int remote_pread_async(int fd, void *buffer, size_t nbyte, off_t offset,
+                       LayerIoCallback callback, void *ctx, LayerContext l);
+
+/**
+ * @brief Send a write without waiting for it (lpwrite_async)
+ *
+ * The buffer is sent before the call returns, the callback runs on the
+ * receiver thread and must not block.
+ *
+ * @param fd            -> file handle
+ * @param buffer        -> buffer to write
+ * @param nbyte         -> number of bytes to write
+ * @param offset        -> offset value
+ * @param callback      -> called with the result once the reply arrives
+ * @param ctx           -> passed to the callback
+ * @param l             -> context of the remote layer
+ * @return int          -> 0 if sent, -1 with errno set otherwise
+ */
+int remote_pwrite_async(int fd, const void *buffer, size_t nbyte,
+                        off_t offset, LayerIoCallback callback, void *ctx,
+                        LayerContext l);
 
 #endif // __REMOTE_H__
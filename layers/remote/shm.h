@@ -0,0 +1,217 @@
+#ifndef __REMOTE_SHM_H__
+#define __REMOTE_SHM_H__
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * ============================================================================
+ * SHARED-MEMORY TRANSPORT OF THE REMOTE LAYER AND THE STORSERVER
+ * ============================================================================
+ *
+ * For a storserver on the same host, the frames of protocol.h go through two
+ * byte rings in shared memory instead of a TCP connection: the requests ring
+ * (client to server) and the replies ring (server to client). Frames are
+ * unchanged, a ring is a byte stream with one producer and one consumer.
+ *
+ * - the client creates a memfd holding a RemoteShm followed by the data of
+ *   the two rings, seals its size, and passes it to the server over a unix
+ *   socket (SCM_RIGHTS); the server maps it and answers with one byte
+ * - the unix socket stays open for the life of the connection: its hangup
+ *   tells a side that the other one is gone
+ * - head and tail count the bytes produced and consumed since the start,
+ *   modulo 2^32; each side keeps its own counter privately and only
+ *   publishes it, and checks the counter of the peer before trusting it
+ * - a side about to wait sets its sleeping flag, then checks the ring again;
+ *   a side moving its counter then clears the flag of the peer, and wakes it
+ *   if it was set. The client waits on a futex on the counter of the server,
+ *   the server waits in epoll, and is woken by a byte on the unix socket
+ * ============================================================================
+ */
+
+#define REMOTE_SHM_MAGIC 0x54475348 // "TGSH"
+#define REMOTE_DEFAULT_SHM_PATH "/tmp/storserver.sock"
+// capacity of each ring, a power of two
+#define REMOTE_DEFAULT_SHM_RING (4 * 1024 * 1024)
+#define REMOTE_SHM_MIN_RING 4096
+#define REMOTE_SHM_MAX_RING (1 << 30)
+
+typedef enum { REMOTE_RING_REQUESTS, REMOTE_RING_REPLIES } RemoteRingId;
+
+/**
+ * @brief Counters and flags of a ring, those of each side on their own
+ * cache line
+ */
+typedef struct {
+  _Alignas(64) uint32_t head;   // bytes produced
+  uint32_t consumer_sleeping;   // the consumer waits for head to move
+  _Alignas(64) uint32_t tail;   // bytes consumed
+  uint32_t producer_sleeping;   // the producer waits for tail to move
+} RemoteRing;
+
+/**
+ * @brief Start of the shared memory, followed by the data of the rings
+ */
+typedef struct {
+  uint32_t magic;     // REMOTE_SHM_MAGIC
+  uint32_t ring_size; // data bytes of each ring
+  uint32_t closed;    // set by the side shutting the connection down
+  RemoteRing rings[2];
+} RemoteShm;
+
+/**
+ * @brief The end of a ring one side uses, with its private counter
+ */
+typedef struct {
+  RemoteRing *ring;
+  char *data;
+  uint32_t size;
+  uint32_t pos;  // head when producing, tail when consuming
+  bool producer;
+} RemoteRingEnd;
+
+static inline size_t remote_shm_size(uint32_t ring_size) {
+  return sizeof(RemoteShm) + 2 * (size_t)ring_size;
+}
+
+static inline bool remote_shm_ring_size_valid(uint64_t ring_size) {
+  return ring_size >= REMOTE_SHM_MIN_RING && ring_size <= REMOTE_SHM_MAX_RING &&
+         (ring_size & (ring_size - 1)) == 0;
+}
+
+/**
+ * @brief Attach end to a ring of shm, as its producer or its consumer
+ *
+ * @param ring_size     -> checked value of shm->ring_size, which the peer
+ * may change at any time
+ */
+static inline void remote_ring_end_init(RemoteRingEnd *end, RemoteShm *shm,
+                                        uint32_t ring_size, RemoteRingId id,
+                                        bool producer) {
+  end->ring = &shm->rings[id];
+  end->data = (char *)(shm + 1) + (size_t)id * ring_size;
+  end->size = ring_size;
+  end->pos = producer ? end->ring->head : end->ring->tail;
+  end->producer = producer;
+}
+
+/**
+ * @brief Bytes the end may move: readable for the consumer, room for the
+ * producer
+ *
+ * @return int64_t -> bytes, -1 if the peer published an impossible counter
+ */
+static inline int64_t remote_ring_ready(const RemoteRingEnd *end) {
+  uint32_t peer = __atomic_load_n(end->producer ? &end->ring->tail
+                                                : &end->ring->head,
+                                  __ATOMIC_ACQUIRE);
+  uint32_t used = end->producer ? end->pos - peer : peer - end->pos;
+  if (used > end->size) {
+    return -1;
+  }
+  return end->producer ? end->size - used : used;
+}
+
+/**
+ * @brief Copy up to n bytes into or out of the ring, without waiting
+ *
+ * @param buffer        -> bytes to produce, or where the consumed ones go
+ * (NULL to discard them)
+ * @return int64_t      -> bytes moved, -1 if the ring is corrupted
+ */
+static inline int64_t remote_ring_move(RemoteRingEnd *end, void *buffer,
+                                       size_t n) {
+  int64_t ready = remote_ring_ready(end);
+  if (ready <= 0) {
+    return ready;
+  }
+  if (n > (uint64_t)ready) {
+    n = (size_t)ready;
+  }
+  size_t off = end->pos & (end->size - 1);
+  size_t first = n < end->size - off ? n : end->size - off;
+  if (end->producer) {
+    memcpy(end->data + off, buffer, first);
+    memcpy(end->data, (char *)buffer + first, n - first);
+  } else if (buffer) {
+    memcpy(buffer, end->data + off, first);
+    memcpy((char *)buffer + first, end->data, n - first);
+  }
+  end->pos += (uint32_t)n;
+  __atomic_store_n(end->producer ? &end->ring->head : &end->ring->tail,
+                   end->pos, __ATOMIC_RELEASE);
+  return (int64_t)n;
+}
+
+/**
+ * @brief Announce that the end is going to wait, unless the ring is ready
+ *
+ * @param peer          -> set to the counter of the peer checked, the value
+ * to wait on
+ * @return bool         -> true if the end may wait, false if the ring became
+ * ready (or corrupted) meanwhile
+ */
+static inline bool remote_ring_sleep(RemoteRingEnd *end, uint32_t *peer) {
+  uint32_t *flag = end->producer ? &end->ring->producer_sleeping
+                                 : &end->ring->consumer_sleeping;
+  __atomic_store_n(flag, 1, __ATOMIC_SEQ_CST);
+  *peer = __atomic_load_n(end->producer ? &end->ring->tail : &end->ring->head,
+                          __ATOMIC_SEQ_CST);
+  if (remote_ring_ready(end) != 0) {
+    __atomic_store_n(flag, 0, __ATOMIC_RELAXED);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief After moving the counter of end, whether the peer waits for it
+ *
+ * Clears the flag of the peer: the caller wakes it when true is returned.
+ */
+static inline bool remote_ring_wake_peer(RemoteRingEnd *end) {
+  uint32_t *flag = end->producer ? &end->ring->consumer_sleeping
+                                 : &end->ring->producer_sleeping;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_load_n(flag, __ATOMIC_RELAXED) &&
+         __atomic_exchange_n(flag, 0, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Counter of the ring the peer of end moves, to wait on
+ */
+static inline uint32_t *remote_ring_peer_word(RemoteRingEnd *end) {
+  return end->producer ? &end->ring->tail : &end->ring->head;
+}
+
+/**
+ * @brief Counter of the ring end moves, the one its peer waits on
+ */
+static inline uint32_t *remote_ring_word(RemoteRingEnd *end) {
+  return end->producer ? &end->ring->head : &end->ring->tail;
+}
+
+/**
+ * @brief Wait until *word is no longer value, or timeout_ms
+ *
+ * The memory is shared with another process, the futex is not private.
+ */
+static inline void remote_futex_wait(uint32_t *word, uint32_t value,
+                                     int timeout_ms) {
+  struct timespec timeout = {timeout_ms / 1000,
+                             (long)(timeout_ms % 1000) * 1000000};
+  (void)syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static inline void remote_futex_wake(uint32_t *word) {
+  (void)syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+#endif // __REMOTE_SHM_H__
@@ -0,0 +1,371 @@
+#define _GNU_SOURCE
+#include "transport.h"
+#include "logdef.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * Transports of the remote layer
+ * - TCP: a connection to host:port
+ * - shared memory: the rings of shm.h, in a memfd passed to a server on the
+ *   same host over its unix socket; frames are copied once into the ring
+ *   and once out of it, without a system call while both sides keep busy
+ */
+
+// a waiting side that sees no progress for this long checks its peer
+#define REMOTE_SHM_POLL_MS 1000
+
+static void set_socket_options(int sock, const RemoteConfig *config) {
+  // requests are small frames sent back to back, do not hold them back
+  (void)setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+  if (config->keepalive_idle <= 0) {
+    return;
+  }
+  // notice a dead server (or path) on an idle connection
+  (void)setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &(int){1}, sizeof(int));
+  (void)setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &config->keepalive_idle,
+                   sizeof(int));
+  (void)setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL,
+                   &config->keepalive_interval, sizeof(int));
+  (void)setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &config->keepalive_count,
+                   sizeof(int));
+}
+
+static int connect_tcp(const RemoteConfig *config, const char *host) {
+  char service[16];
+  (void)snprintf(service, sizeof(service), "%d", config->port);
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *addrs;
+  int res = getaddrinfo(host, service, &hints, &addrs);
+  if (res != 0) {
+    ERROR_MSG("[REMOTE] Failed to resolve %s (%s)", host, gai_strerror(res));
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+
+  int sock = -1;
+  int error = ECONNREFUSED;
+  for (struct addrinfo *a = addrs; a; a = a->ai_next) {
+    sock = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC,
+                  a->ai_protocol);
+    if (sock < 0) {
+      error = errno;
+      continue;
+    }
+    if (connect(sock, a->ai_addr, a->ai_addrlen) == 0) {
+      break;
+    }
+    error = errno;
+    close(sock);
+    sock = -1;
+  }
+  freeaddrinfo(addrs);
+
+  if (sock < 0) {
+    ERROR_MSG("[REMOTE] Failed to connect to %s:%d (%s)", host, config->port,
+              strerror(error));
+    errno = error;
+    return -1;
+  }
+  set_socket_options(sock, config);
+  return sock;
+}
+
+/**
+ * @brief Hand a new shared memory to the server of the unix socket sock
+ *
+ * @return int -> 0 on success, -1 with errno set otherwise
+ */
+static int attach_shm(RemoteLink *link, const RemoteConfig *config) {
+  uint32_t ring_size = (uint32_t)config->shm_ring_size;
+  link->shm_size = remote_shm_size(ring_size);
+
+  // sealed, so that the server may map it without fearing SIGBUS
+  int memfd = memfd_create("remote-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memfd < 0) {
+    return -1;
+  }
+  if (ftruncate(memfd, (off_t)link->shm_size) < 0 ||
+      fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) <
+          0) {
+    int error = errno;
+    close(memfd);
+    errno = error;
+    return -1;
+  }
+  void *shm = mmap(NULL, link->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   memfd, 0);
+  if (shm == MAP_FAILED) {
+    int error = errno;
+    close(memfd);
+    errno = error;
+    return -1;
+  }
+  link->shm = shm;
+  link->shm->magic = REMOTE_SHM_MAGIC;
+  link->shm->ring_size = ring_size;
+  remote_ring_end_init(&link->requests, link->shm, ring_size,
+                       REMOTE_RING_REQUESTS, true);
+  remote_ring_end_init(&link->replies, link->shm, ring_size,
+                       REMOTE_RING_REPLIES, false);
+
+  char byte = 0;
+  struct iovec iov = {&byte, 1};
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+  ssize_t n = sendmsg(link->sock, &msg, MSG_NOSIGNAL);
+  int error = errno;
+  close(memfd);
+  if (n != 1) {
+    errno = error;
+    return -1;
+  }
+  // the server answers once it has mapped the rings, or hangs up
+  n = recv(link->sock, &byte, 1, 0);
+  if (n != 1) {
+    errno = n == 0 ? ECONNREFUSED : errno;
+    return -1;
+  }
+  return 0;
+}
+
+static int connect_shm(RemoteLink *link, const RemoteConfig *config) {
+  const char *path =
+      config->shm_path ? config->shm_path : REMOTE_DEFAULT_SHM_PATH;
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    ERROR_MSG("[REMOTE] Socket path %s is too long", path);
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  link->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (link->sock < 0 ||
+      connect(link->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      attach_shm(link, config) != 0) {
+    ERROR_MSG("[REMOTE] Failed to attach to %s (%s)", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+RemoteLink *remote_link_open(const RemoteConfig *config, const char *host) {
+  RemoteLink *link = calloc(1, sizeof(RemoteLink));
+  if (!link) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  link->transport = config->transport;
+  link->sock = -1;
+
+  int res;
+  if (link->transport == REMOTE_TRANSPORT_SHM) {
+    res = connect_shm(link, config);
+  } else {
+    link->sock = connect_tcp(config, host);
+    res = link->sock < 0 ? -1 : 0;
+  }
+  if (res != 0) {
+    int error = errno;
+    remote_link_close(link);
+    errno = error;
+    return NULL;
+  }
+  return link;
+}
+
+static int send_fully(int sock, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t)iovcnt;
+    ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= (ssize_t)iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= (size_t)n;
+    }
+  }
+  return 0;
+}
+
+static int recv_fully(int sock, void *buffer, size_t size) {
+  char scratch[4096];
+  char *p = buffer;
+  while (size > 0) {
+    size_t chunk = size;
+    if (!buffer && chunk > sizeof(scratch)) {
+      chunk = sizeof(scratch);
+    }
+    ssize_t n = recv(sock, buffer ? p : scratch, chunk, 0);
+    if (n == 0) {
+      errno = ECONNRESET;
+      return -1;
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (buffer) {
+      p += n;
+    }
+    size -= (size_t)n;
+  }
+  return 0;
+}
+
+/**
+ * @brief Wake the server if it waits for what end just moved
+ */
+static void shm_wake_server(RemoteLink *link, RemoteRingEnd *end) {
+  if (remote_ring_wake_peer(end)) {
+    // a full socket already holds a wake-up, losing this one is fine
+    (void)send(link->sock, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+  }
+}
+
+/**
+ * @brief Wait for the server to move the other end of end's ring
+ *
+ * @return int -> 0 once it may have, -1 with errno set if the connection is
+ * gone
+ */
+static int shm_wait(RemoteLink *link, RemoteRingEnd *end) {
+  uint32_t peer;
+  if (!__atomic_load_n(&link->shm->closed, __ATOMIC_ACQUIRE) &&
+      remote_ring_sleep(end, &peer)) {
+    remote_futex_wait(remote_ring_peer_word(end), peer, REMOTE_SHM_POLL_MS);
+    // no news may mean that the server is gone
+    if (remote_ring_ready(end) == 0) {
+      struct pollfd p = {.fd = link->sock, .events = POLLRDHUP};
+      if (poll(&p, 1, 0) > 0 && (p.revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+        __atomic_store_n(&link->shm->closed, 1, __ATOMIC_RELEASE);
+      }
+    }
+  }
+  if (__atomic_load_n(&link->shm->closed, __ATOMIC_ACQUIRE)) {
+    errno = ECONNRESET;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Move size bytes through end, waiting for the server as needed
+ *
+ * @return int -> 0 on success, -1 with errno set otherwise
+ */
+static int shm_transfer(RemoteLink *link, RemoteRingEnd *end, char *buffer,
+                        size_t size) {
+  while (size > 0) {
+    int64_t n = remote_ring_move(end, buffer, size);
+    if (n < 0) {
+      ERROR_MSG("[REMOTE] Corrupted shared-memory ring, dropping it");
+      remote_link_shutdown(link);
+      errno = EPROTO;
+      return -1;
+    }
+    if (n == 0) {
+      // let the server move what is there before waiting for it
+      shm_wake_server(link, end);
+      if (shm_wait(link, end) != 0) {
+        return -1;
+      }
+      continue;
+    }
+    if (buffer) {
+      buffer += n;
+    }
+    size -= (size_t)n;
+  }
+  return 0;
+}
+
+int remote_link_send(RemoteLink *link, struct iovec *iov, int iovcnt) {
+  if (link->transport != REMOTE_TRANSPORT_SHM) {
+    return send_fully(link->sock, iov, iovcnt);
+  }
+  for (int i = 0; i < iovcnt; i++) {
+    if (shm_transfer(link, &link->requests, iov[i].iov_base,
+                     iov[i].iov_len) != 0) {
+      return -1;
+    }
+  }
+  // one wake-up per frame, not per piece of it
+  shm_wake_server(link, &link->requests);
+  return 0;
+}
+
+int remote_link_recv(RemoteLink *link, void *buffer, size_t size) {
+  if (link->transport != REMOTE_TRANSPORT_SHM) {
+    return recv_fully(link->sock, buffer, size);
+  }
+  int res = shm_transfer(link, &link->replies, buffer, size);
+  shm_wake_server(link, &link->replies);
+  return res;
+}
+
+void remote_link_shutdown(RemoteLink *link) {
+  if (link->shm) {
+    __atomic_store_n(&link->shm->closed, 1, __ATOMIC_RELEASE);
+    remote_futex_wake(remote_ring_peer_word(&link->requests));
+    remote_futex_wake(remote_ring_peer_word(&link->replies));
+  }
+  shutdown(link->sock, SHUT_RDWR);
+}
+
+void remote_link_close(RemoteLink *link) {
+  if (link->shm) {
+    munmap(link->shm, link->shm_size);
+  }
+  if (link->sock >= 0) {
+    close(link->sock);
+  }
+  free(link);
+}
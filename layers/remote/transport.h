@@ -0,0 +1,54 @@
+#ifndef __REMOTE_TRANSPORT_H__
+#define __REMOTE_TRANSPORT_H__
+
+#include "config.h"
+#include "shm.h"
+#include <stddef.h>
+#include <sys/uio.h>
+
+/**
+ * @brief A connection to the storserver, carrying frames as a byte stream
+ *
+ * send is called by one thread at a time, and so is recv (the receiver of
+ * the connection); shutdown may run concurrently with both.
+ */
+typedef struct {
+  RemoteTransport transport;
+  int sock; // TCP connection, or unix socket of the shared memory
+  RemoteShm *shm;
+  size_t shm_size;
+  RemoteRingEnd requests; // produced by the senders
+  RemoteRingEnd replies;  // consumed by the receiver
+} RemoteLink;
+
+/**
+ * @brief Connect to the storserver with the transport of config
+ *
+ * @param host          -> server address of a TCP connection
+ * @return RemoteLink*  -> the connection, NULL with errno set on failure
+ */
+RemoteLink *remote_link_open(const RemoteConfig *config, const char *host);
+
+/**
+ * @brief Send all of iov, which is consumed
+ *
+ * @return int -> 0 on success, -1 with errno set otherwise
+ */
+int remote_link_send(RemoteLink *link, struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Receive exactly size bytes, NULL buffer to discard them
+ *
+ * @return int -> 0 on success, -1 with errno set otherwise (ECONNRESET when
+ * the server closed the connection)
+ */
+int remote_link_recv(RemoteLink *link, void *buffer, size_t size);
+
+/**
+ * @brief Make the pending and later send and recv of link fail
+ */
+void remote_link_shutdown(RemoteLink *link);
+
+void remote_link_close(RemoteLink *link);
+
+#endif // __REMOTE_TRANSPORT_H__
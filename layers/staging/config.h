@@ -0,0 +1,66 @@
+#ifndef __STAGING_CONFIG_H__
+#define __STAGING_CONFIG_H__
+
+#include "../../config/utils.h"
+
+#define STAGING_DEFAULT_MAX_STAGED (64L * 1024 * 1024) // 64 MiB per file
+#define STAGING_DEFAULT_PART_SIZE (8L * 1024 * 1024)   // 8 MiB per write
+#define STAGING_DEFAULT_UPLOAD_THREADS 2
+
+typedef struct {
+  char *next_layer;
+  char *journal_dir; // local directory of the journals
+  long max_staged;   // staged bytes of a file that start its upload early
+  long part_size;    // largest write of an upload to the next layer
+  int upload_threads;
+} StagingConfig;
+
+/**
+ * @brief Parse staging layer parameters
+ *
+ */
+static inline void staging_parse_params(toml_datum_t layer_table,
+                                        StagingConfig *config) {
+  toml_datum_t next_layer = toml_get(layer_table, "next");
+  if (next_layer.type == TOML_STRING) {
+    config->next_layer = parse_string(next_layer);
+  } else {
+    toml_error("Invalid next layer filed");
+  }
+
+  toml_datum_t journal_dir = toml_get(layer_table, "journal_dir");
+  if (journal_dir.type == TOML_STRING) {
+    config->journal_dir = parse_string(journal_dir);
+  } else {
+    toml_error("Staging layer must have a 'journal_dir'");
+  }
+
+  config->max_staged = STAGING_DEFAULT_MAX_STAGED;
+  toml_datum_t max_staged = toml_get(layer_table, "max_staged");
+  if (max_staged.type == TOML_INT64) {
+    if (max_staged.u.int64 <= 0) {
+      toml_error("Staging layer max_staged must be positive");
+    }
+    config->max_staged = (long)max_staged.u.int64;
+  }
+
+  config->part_size = STAGING_DEFAULT_PART_SIZE;
+  toml_datum_t part_size = toml_get(layer_table, "part_size");
+  if (part_size.type == TOML_INT64) {
+    if (part_size.u.int64 <= 0 || part_size.u.int64 > (1L << 30)) {
+      toml_error("Staging layer part_size must be in (0, 1 GiB]");
+    }
+    config->part_size = (long)part_size.u.int64;
+  }
+
+  config->upload_threads = STAGING_DEFAULT_UPLOAD_THREADS;
+  toml_datum_t upload_threads = toml_get(layer_table, "upload_threads");
+  if (upload_threads.type == TOML_INT64) {
+    if (upload_threads.u.int64 <= 0) {
+      toml_error("Staging layer upload_threads must be positive");
+    }
+    config->upload_threads = (int)upload_threads.u.int64;
+  }
+}
+
+#endif
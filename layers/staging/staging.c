@@ -0,0 +1,1223 @@
+#define _GNU_SOURCE
+#include "staging.h"
+#include "../../logdef.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+// extents copied on the stack by a read, more are allocated
+#define STAGING_READ_EXTENTS 16
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ bytes[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+static uint64_t record_checksum_start(uint64_t offset, uint32_t length) {
+  uint64_t hash = fnv1a(FNV_OFFSET_BASIS, &offset, sizeof(offset));
+  return fnv1a(hash, &length, sizeof(length));
+}
+
+static int pread_fully(int fd, void *buffer, size_t len, off_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, (char *)buffer + done, len - done, offset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n == 0) {
+        errno = EIO;
+      }
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+static int next_pwrite_fully(LayerContext next, int fd, const void *buffer,
+                             size_t len, off_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = next.ops->lpwrite(fd, (const char *)buffer + done, len - done,
+                                  offset + done, next);
+    if (n <= 0) {
+      if (n == 0) {
+        errno = EIO;
+      }
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+// Bytes of the next layer, zeros past its end (holes of the staged file)
+static int next_pread_zeroed(LayerContext next, int fd, char *buffer,
+                             size_t len, off_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = next.ops->lpread(fd, buffer + done, len - done, offset + done,
+                                 next);
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      memset(buffer + done, 0, len - done);
+      break;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+/* ---- extents ---- */
+
+// First extent of file ending after offset
+static size_t extent_after(const StagedFile *file, off_t offset) {
+  size_t lo = 0, hi = file->nextents;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const StagedExtent *e = &file->extents[mid];
+    if (e->offset + (off_t)e->length <= offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Stage [offset, offset + length) at journal, over the older extents
+static int insert_extent(StagedFile *file, off_t offset, size_t length,
+                         off_t journal) {
+  off_t end = offset + (off_t)length;
+  size_t first = extent_after(file, offset);
+  size_t last = first; // extents [first, last) overlap the new one
+  while (last < file->nextents && file->extents[last].offset < end) {
+    last++;
+  }
+
+  StagedExtent pieces[3];
+  size_t npieces = 0;
+  if (first < last && file->extents[first].offset < offset) {
+    StagedExtent left = file->extents[first];
+    left.length = (size_t)(offset - left.offset);
+    pieces[npieces++] = left;
+  }
+  pieces[npieces++] = (StagedExtent){offset, length, journal};
+  if (first < last) {
+    const StagedExtent *e = &file->extents[last - 1];
+    off_t e_end = e->offset + (off_t)e->length;
+    if (e_end > end) {
+      pieces[npieces++] = (StagedExtent){end, (size_t)(e_end - end),
+                                         e->journal + (end - e->offset)};
+    }
+  }
+
+  size_t count = file->nextents - (last - first) + npieces;
+  if (count > file->capacity) {
+    size_t capacity = file->capacity ? file->capacity * 2 : 16;
+    while (capacity < count) {
+      capacity *= 2;
+    }
+    StagedExtent *extents =
+        realloc(file->extents, capacity * sizeof(StagedExtent));
+    if (!extents) {
+      errno = ENOMEM;
+      return -1;
+    }
+    file->extents = extents;
+    file->capacity = capacity;
+  }
+
+  for (size_t i = first; i < last; i++) {
+    file->staged -= file->extents[i].length;
+  }
+  memmove(&file->extents[first + npieces], &file->extents[last],
+          (file->nextents - last) * sizeof(StagedExtent));
+  memcpy(&file->extents[first], pieces, npieces * sizeof(StagedExtent));
+  file->nextents = count;
+  for (size_t i = 0; i < npieces; i++) {
+    file->staged += pieces[i].length;
+  }
+  if (end > file->size) {
+    file->size = end;
+  }
+  return 0;
+}
+
+// Drop the extents an upload wrote: those lying in a sent extent with the
+// same journal bytes (the journal is only appended to)
+static void drop_sent(StagedFile *file, const StagedExtent *sent,
+                      size_t nsent) {
+  size_t kept = 0, j = 0;
+  file->staged = 0;
+  for (size_t i = 0; i < file->nextents; i++) {
+    StagedExtent e = file->extents[i];
+    while (j < nsent && sent[j].offset + (off_t)sent[j].length <= e.offset) {
+      j++;
+    }
+    bool uploaded =
+        j < nsent && sent[j].offset <= e.offset &&
+        e.offset + (off_t)e.length <=
+            sent[j].offset + (off_t)sent[j].length &&
+        e.journal - e.offset == sent[j].journal - sent[j].offset;
+    if (!uploaded) {
+      file->extents[kept++] = e;
+      file->staged += e.length;
+    }
+  }
+  file->nextents = kept;
+}
+
+/* ---- journals ---- */
+
+static char *journal_path(const StagingState *state, uint64_t id) {
+  char *path = NULL;
+  if (asprintf(&path, "%s/%016" PRIx64 "%s", state->journal_dir, id,
+               STAGING_JOURNAL_SUFFIX) < 0) {
+    return NULL;
+  }
+  return path;
+}
+
+// Create the journal of file, file->mutex held
+static int open_journal(StagingState *state, StagedFile *file) {
+  size_t path_len = strlen(file->path);
+  StagingJournalHeader header = {STAGING_JOURNAL_MAGIC,
+                                 STAGING_JOURNAL_VERSION, (uint32_t)file->mode,
+                                 (uint32_t)path_len};
+  struct iovec iov[2] = {{&header, sizeof(header)},
+                         {file->path, path_len}};
+  size_t total = sizeof(header) + path_len;
+
+  for (;;) {
+    uint64_t id = __atomic_fetch_add(&state->next_journal, 1,
+                                     __ATOMIC_RELAXED);
+    char *path = journal_path(state, id);
+    if (!path) {
+      errno = ENOMEM;
+      return -1;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+      int err = errno;
+      free(path);
+      if (err == EEXIST) {
+        continue;
+      }
+      errno = err;
+      return -1;
+    }
+    if (pwritev(fd, iov, 2, 0) != (ssize_t)total) {
+      int err = errno ? errno : EIO;
+      close(fd);
+      unlink(path);
+      free(path);
+      errno = err;
+      return -1;
+    }
+    file->journal_fd = fd;
+    file->journal_path = path;
+    file->journal_end = (off_t)total;
+    file->journal_synced = false;
+    return 0;
+  }
+}
+
+// file->mutex held, remove deletes the journal
+static void close_journal(StagedFile *file, bool remove) {
+  if (file->journal_fd < 0) {
+    return;
+  }
+  close(file->journal_fd);
+  if (remove) {
+    unlink(file->journal_path);
+  }
+  free(file->journal_path);
+  file->journal_fd = -1;
+  file->journal_path = NULL;
+  file->journal_end = 0;
+}
+
+// Make the journal and its directory entry durable, file->mutex held
+static int sync_journal(StagingState *state, StagedFile *file) {
+  if (fdatasync(file->journal_fd) != 0) {
+    return -1;
+  }
+  if (!file->journal_synced) {
+    int dir = open(state->journal_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir < 0) {
+      return -1;
+    }
+    int ret = fsync(dir);
+    close(dir);
+    if (ret != 0) {
+      return -1;
+    }
+    file->journal_synced = true;
+  }
+  return 0;
+}
+
+/* ---- files ---- */
+
+static StagedFile *new_file(StagingState *state, const char *path,
+                            mode_t mode) {
+  StagedFile *file = calloc(1, sizeof(StagedFile));
+  if (!file) {
+    return NULL;
+  }
+  file->path = strdup(path);
+  if (!file->path) {
+    free(file);
+    return NULL;
+  }
+  file->mode = mode & 07777;
+  file->state = state;
+  file->journal_fd = -1;
+  pthread_mutex_init(&file->mutex, NULL);
+  pthread_cond_init(&file->idle, NULL);
+  return file;
+}
+
+static void free_file(StagedFile *file) {
+  pthread_mutex_destroy(&file->mutex);
+  pthread_cond_destroy(&file->idle);
+  free(file->journal_path);
+  free(file->extents);
+  free(file->path);
+  free(file);
+}
+
+// Free file once nothing uses it and it has nothing staged, state->mutex
+// held. Staged writes of an unlinked file are dropped
+static void release_file(StagingState *state, StagedFile *file) {
+  pthread_mutex_lock(&file->mutex);
+  bool unused = file->refs == 0 && !file->uploading && file->io == 0 &&
+                (file->nextents == 0 || file->unlinked);
+  if (unused) {
+    close_journal(file, true);
+  }
+  pthread_mutex_unlock(&file->mutex);
+  if (!unused) {
+    return;
+  }
+  if (!file->unlinked) {
+    HASH_DEL(state->files, file);
+  }
+  free_file(file);
+}
+
+// Take the file of path, NULL if it is not staged, state->mutex held
+static StagedFile *hold_path(StagingState *state, const char *path) {
+  StagedFile *file = NULL;
+  HASH_FIND_STR(state->files, path, file);
+  if (file) {
+    file->refs++;
+  }
+  return file;
+}
+
+static void unhold(StagingState *state, StagedFile *file) {
+  if (!file) {
+    return;
+  }
+  pthread_mutex_lock(&state->mutex);
+  file->refs--;
+  release_file(state, file);
+  pthread_mutex_unlock(&state->mutex);
+}
+
+static StagedFile *fd_file(StagingState *state, int fd) {
+  StagedFd *entry = NULL;
+  pthread_mutex_lock(&state->mutex);
+  HASH_FIND(hh, state->fds, &fd, sizeof(int), entry);
+  pthread_mutex_unlock(&state->mutex);
+  return entry ? entry->file : NULL;
+}
+
+/* ---- uploads ---- */
+
+/**
+ * @brief Write the staged extents of file to the next layer
+ *
+ * file->uploading is set by the caller. sent receives the extents written,
+ * to be given to upload_done.
+ */
+static int upload_file(StagingState *state, StagedFile *file,
+                       StagedExtent **sent, size_t *nsent) {
+  LayerContext next = state->next;
+  *sent = NULL;
+  *nsent = 0;
+
+  pthread_mutex_lock(&file->mutex);
+  size_t n = file->nextents;
+  StagedExtent *extents = n ? malloc(n * sizeof(StagedExtent)) : NULL;
+  if (extents) {
+    memcpy(extents, file->extents, n * sizeof(StagedExtent));
+  }
+  char *path = strdup(file->path);
+  mode_t mode = file->mode;
+  int journal = file->journal_fd; // kept while extents are staged
+  pthread_mutex_unlock(&file->mutex);
+
+  if (n == 0) {
+    free(path);
+    return 0;
+  }
+  char *part = malloc(state->part_size);
+  if (!extents || !path || !part) {
+    free(extents);
+    free(path);
+    free(part);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  int ret = -1;
+  int fd = next.ops->lopen(path, O_WRONLY | O_CREAT, mode, next);
+  if (fd < 0) {
+    goto out;
+  }
+
+  // Contiguous extents are merged into parts of up to part_size bytes
+  size_t fill = 0;
+  off_t part_offset = 0;
+  for (size_t i = 0; i < n; i++) {
+    const StagedExtent *e = &extents[i];
+    size_t done = 0;
+    while (done < e->length) {
+      off_t at = e->offset + (off_t)done;
+      if (fill > 0 &&
+          (part_offset + (off_t)fill != at || fill == state->part_size)) {
+        if (next_pwrite_fully(next, fd, part, fill, part_offset) != 0) {
+          goto close;
+        }
+        fill = 0;
+      }
+      if (fill == 0) {
+        part_offset = at;
+      }
+      size_t chunk = e->length - done;
+      if (chunk > state->part_size - fill) {
+        chunk = state->part_size - fill;
+      }
+      if (pread_fully(journal, part + fill, chunk, e->journal + done) != 0) {
+        goto close;
+      }
+      fill += chunk;
+      done += chunk;
+    }
+  }
+  if (fill > 0 && next_pwrite_fully(next, fd, part, fill, part_offset) != 0) {
+    goto close;
+  }
+  if (next.ops->lfsync && next.ops->lfsync(fd, 0, next) != 0) {
+    goto close;
+  }
+  ret = 0;
+
+close:
+  if (next.ops->lclose(fd, next) != 0 && ret == 0) {
+    ret = -1;
+  }
+out:
+  if (ret != 0) {
+    int err = errno;
+    ERROR_MSG("[STAGING] Failed to upload %s: %s, its writes stay staged",
+              path, strerror(err));
+    free(extents);
+    extents = NULL;
+    n = 0;
+    errno = err;
+  }
+  *sent = extents;
+  *nsent = n;
+  free(part);
+  free(path);
+  return ret;
+}
+
+static void schedule_upload(StagingState *state, StagedFile *file);
+
+// End the upload of file, state->mutex held
+static void upload_done(StagingState *state, StagedFile *file,
+                        const StagedExtent *sent, size_t nsent) {
+  pthread_mutex_lock(&file->mutex);
+  drop_sent(file, sent, nsent);
+  if (file->nextents == 0 && file->io == 0) {
+    // the next writes go to a new journal
+    close_journal(file, true);
+  }
+  file->uploading = false;
+  bool again = file->again && !state->stopping;
+  file->again = false;
+  pthread_cond_broadcast(&file->idle);
+  pthread_mutex_unlock(&file->mutex);
+
+  if (again) {
+    schedule_upload(state, file);
+  }
+  release_file(state, file);
+}
+
+static void *upload_task(void *arg) {
+  StagedFile *file = arg;
+  StagingState *state = file->state;
+  StagedExtent *sent;
+  size_t nsent;
+  upload_file(state, file, &sent, &nsent);
+  pthread_mutex_lock(&state->mutex);
+  upload_done(state, file, sent, nsent);
+  pthread_mutex_unlock(&state->mutex);
+  free(sent);
+  return NULL;
+}
+
+// Queue the upload of file, or another one after the running one
+static void schedule_upload(StagingState *state, StagedFile *file) {
+  pthread_mutex_lock(&file->mutex);
+  if (file->uploading) {
+    file->again = true;
+  } else if (file->nextents > 0 && !file->unlinked && state->pool) {
+    file->uploading = true;
+    if (thread_pool_submit(state->pool, 0, &file->task, NULL, upload_task,
+                           file) != 0) {
+      ERROR_MSG("[STAGING] Failed to queue the upload of %s", file->path);
+      file->uploading = false;
+    }
+  }
+  pthread_mutex_unlock(&file->mutex);
+}
+
+// Upload file now, after the one running, the caller holds file
+static int flush_file(StagingState *state, StagedFile *file) {
+  pthread_mutex_lock(&file->mutex);
+  while (file->uploading) {
+    pthread_cond_wait(&file->idle, &file->mutex);
+  }
+  if (file->nextents == 0 || file->unlinked) {
+    pthread_mutex_unlock(&file->mutex);
+    return 0;
+  }
+  file->uploading = true;
+  pthread_mutex_unlock(&file->mutex);
+
+  StagedExtent *sent;
+  size_t nsent;
+  int ret = upload_file(state, file, &sent, &nsent);
+  int err = errno;
+  pthread_mutex_lock(&state->mutex);
+  upload_done(state, file, sent, nsent);
+  pthread_mutex_unlock(&state->mutex);
+  free(sent);
+  if (ret != 0) {
+    errno = err ? err : EIO;
+  }
+  return ret;
+}
+
+// Drop the staged writes of file, after the running upload
+static void discard_file(StagedFile *file) {
+  pthread_mutex_lock(&file->mutex);
+  while (file->uploading) {
+    pthread_cond_wait(&file->idle, &file->mutex);
+  }
+  file->nextents = 0;
+  file->staged = 0;
+  file->size = 0;
+  if (file->io == 0) {
+    close_journal(file, true);
+  }
+  pthread_mutex_unlock(&file->mutex);
+}
+
+/* ---- recovery ---- */
+
+// Replay the records of a journal into file, up to the first torn one
+static int replay_journal(StagedFile *file, int fd, off_t start) {
+  off_t pos = start;
+  char chunk[64 * 1024];
+  for (;;) {
+    StagingRecord record;
+    if (pread(fd, &record, sizeof(record), pos) != sizeof(record) ||
+        record.magic != STAGING_RECORD_MAGIC || record.length == 0 ||
+        record.length > STAGING_MAX_RECORD ||
+        record.offset > (uint64_t)(INT64_MAX - record.length)) {
+      break;
+    }
+    off_t data = pos + (off_t)sizeof(record);
+    uint64_t hash = record_checksum_start(record.offset, record.length);
+    size_t done = 0;
+    while (done < record.length) {
+      size_t len = record.length - done;
+      if (len > sizeof(chunk)) {
+        len = sizeof(chunk);
+      }
+      if (pread(fd, chunk, len, data + (off_t)done) != (ssize_t)len) {
+        break;
+      }
+      hash = fnv1a(hash, chunk, len);
+      done += len;
+    }
+    if (done < record.length || hash != record.checksum) {
+      break;
+    }
+    if (insert_extent(file, (off_t)record.offset, record.length, data) != 0) {
+      return -1;
+    }
+    pos = data + (off_t)record.length;
+  }
+  // the torn tail goes, new records follow the last whole one
+  if (ftruncate(fd, pos) != 0) {
+    return -1;
+  }
+  file->journal_end = pos;
+  return 0;
+}
+
+// Load the journal at path (named by id), NULL if it holds nothing
+static StagedFile *load_journal(StagingState *state, char *path) {
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  StagingJournalHeader header;
+  char name[PATH_MAX];
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != STAGING_JOURNAL_MAGIC ||
+      header.version != STAGING_JOURNAL_VERSION || header.path_len == 0 ||
+      header.path_len >= sizeof(name) ||
+      pread(fd, name, header.path_len, sizeof(header)) !=
+          (ssize_t)header.path_len) {
+    WARN_MSG("[STAGING] Ignoring %s, not a journal", path);
+    close(fd);
+    return NULL;
+  }
+  name[header.path_len] = '\0';
+
+  StagedFile *file = new_file(state, name, header.mode);
+  if (!file) {
+    close(fd);
+    return NULL;
+  }
+  file->journal_fd = fd;
+  file->journal_path = path;
+  file->journal_synced = true;
+  if (replay_journal(file, fd, sizeof(header) + header.path_len) != 0) {
+    ERROR_MSG("[STAGING] Failed to replay %s: %s", path, strerror(errno));
+    file->journal_path = NULL;
+    close(fd);
+    free_file(file);
+    return NULL;
+  }
+  return file;
+}
+
+// Replay the journals of a previous run and queue their uploads
+static void recover_journals(StagingState *state) {
+  DIR *dir = opendir(state->journal_dir);
+  if (!dir) {
+    return;
+  }
+  size_t suffix = strlen(STAGING_JOURNAL_SUFFIX);
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    size_t len = strlen(entry->d_name);
+    if (len <= suffix ||
+        strcmp(entry->d_name + len - suffix, STAGING_JOURNAL_SUFFIX) != 0) {
+      continue;
+    }
+    char *end;
+    uint64_t id = strtoull(entry->d_name, &end, 16);
+    if (end != entry->d_name + len - suffix) {
+      continue;
+    }
+    if (id >= state->next_journal) {
+      state->next_journal = id + 1;
+    }
+    char *path = journal_path(state, id);
+    if (!path) {
+      break;
+    }
+    StagedFile *file = load_journal(state, path);
+    if (!file) {
+      free(path);
+      continue;
+    }
+    if (file->nextents == 0) {
+      close_journal(file, true);
+      free_file(file);
+      continue;
+    }
+
+    // A file renamed before its journal was uploaded may have two: the
+    // first one found is uploaded before the other is loaded
+    StagedFile *older = NULL;
+    HASH_FIND_STR(state->files, file->path, older);
+    if (older) {
+      older->refs++;
+      pthread_mutex_unlock(&state->mutex);
+      flush_file(state, older);
+      pthread_mutex_lock(&state->mutex);
+      older->refs--;
+      pthread_mutex_lock(&older->mutex);
+      older->unlinked = true; // dropped even if its upload failed
+      pthread_mutex_unlock(&older->mutex);
+      HASH_DEL(state->files, older);
+      release_file(state, older);
+    }
+    HASH_ADD_KEYPTR(hh, state->files, file->path, strlen(file->path), file);
+    DEBUG_MSG("[STAGING] Recovered %zu staged bytes of %s", file->staged,
+              file->path);
+  }
+  closedir(dir);
+
+  StagedFile *file, *tmp;
+  HASH_ITER(hh, state->files, file, tmp) {
+    schedule_upload(state, file);
+  }
+}
+
+/* ---- layer ---- */
+
+LayerContext staging_init(LayerContext *next_layer,
+                          const StagingConfig *config) {
+  LayerContext layer_state;
+  layer_state.app_context = NULL;
+
+  StagingState *state = calloc(1, sizeof(StagingState));
+  if (!state) {
+    ERROR_MSG("[STAGING] Failed to allocate memory for staging state");
+    exit(1);
+  }
+  state->next = *next_layer;
+  state->journal_dir = strdup(config->journal_dir);
+  state->max_staged = (size_t)config->max_staged;
+  state->part_size = (size_t)config->part_size;
+  pthread_mutex_init(&state->mutex, NULL);
+  if (!state->journal_dir) {
+    ERROR_MSG("[STAGING] Failed to allocate memory for the journal dir");
+    exit(1);
+  }
+  if (mkdir(state->journal_dir, 0700) != 0 && errno != EEXIST) {
+    ERROR_MSG("[STAGING] Failed to create journal dir %s: %s",
+              state->journal_dir, strerror(errno));
+    exit(1);
+  }
+  state->pool = thread_pool_init(1, config->upload_threads);
+  if (!state->pool) {
+    ERROR_MSG("[STAGING] Failed to start the upload workers");
+    exit(1);
+  }
+
+  pthread_mutex_lock(&state->mutex);
+  recover_journals(state);
+  pthread_mutex_unlock(&state->mutex);
+
+  layer_state.internal_state = state;
+
+  LayerOps *staging_ops = calloc(1, sizeof(LayerOps));
+  staging_ops->lpread = staging_pread;
+  staging_ops->lpwrite = staging_pwrite;
+  staging_ops->lopen = staging_open;
+  staging_ops->lclose = staging_close;
+  staging_ops->lfsync = staging_fsync;
+  staging_ops->lftruncate = staging_ftruncate;
+  staging_ops->ltruncate = staging_truncate;
+  staging_ops->lfstat = staging_fstat;
+  staging_ops->llstat = staging_lstat;
+  staging_ops->lunlink = staging_unlink;
+  staging_ops->lrename = staging_rename;
+  staging_ops->lchmod = staging_chmod;
+  staging_ops->ldestroy = staging_destroy;
+
+  layer_state.ops = staging_ops;
+
+  LayerContext *aux = malloc(sizeof(LayerContext));
+  memcpy(aux, next_layer, sizeof(LayerContext));
+  layer_state.next_layers = aux;
+  layer_state.nlayers = 1;
+
+  DEBUG_MSG("[STAGING] Journals in %s, upload after %zu bytes in parts of "
+            "%zu bytes",
+            state->journal_dir, state->max_staged, state->part_size);
+  return layer_state;
+}
+
+int staging_open(const char *pathname, int flags, mode_t mode,
+                 LayerContext l) {
+  StagingState *state = (StagingState *)l.internal_state;
+  LayerContext *next = l.next_layers;
+
+  pthread_mutex_lock(&state->mutex);
+  StagedFile *file = hold_path(state, pathname);
+  if (!file) {
+    file = new_file(state, pathname, mode);
+    if (!file) {
+      pthread_mutex_unlock(&state->mutex);
+      errno = ENOMEM;
+      return -1;
+    }
+    file->refs = 1;
+    HASH_ADD_KEYPTR(hh, state->files, file->path, strlen(file->path), file);
+  }
+  pthread_mutex_unlock(&state->mutex);
+
+  // an upload finishing after the truncate would bring the old bytes back
+  if (flags & O_TRUNC) {
+    discard_file(file);
+  }
+
+  int fd = next->ops->lopen(pathname, flags, mode, *next);
+  if (fd < 0) {
+    int err = errno;
+    unhold(state, file);
+    errno = err;
+    return -1;
+  }
+
+  struct stat st;
+  if (next->ops->lfstat(fd, &st, *next) == 0) {
+    pthread_mutex_lock(&file->mutex);
+    if (st.st_size > file->size) {
+      file->size = st.st_size;
+    }
+    pthread_mutex_unlock(&file->mutex);
+  }
+
+  StagedFd *entry = malloc(sizeof(StagedFd));
+  if (!entry) {
+    next->ops->lclose(fd, *next);
+    unhold(state, file);
+    errno = ENOMEM;
+    return -1;
+  }
+  entry->fd = fd;
+  entry->file = file; // takes the hold
+  pthread_mutex_lock(&state->mutex);
+  HASH_ADD(hh, state->fds, fd, sizeof(int), entry);
+  pthread_mutex_unlock(&state->mutex);
+  return fd;
+}
+
+int staging_close(int fd, LayerContext l) {
+  StagingState *state = (StagingState *)l.internal_state;
+  LayerContext *next = l.next_layers;
+
+  pthread_mutex_lock(&state->mutex);
+  StagedFd *entry = NULL;
+  HASH_FIND(hh, state->fds, &fd, sizeof(int), entry);
+  if (entry) {
+    HASH_DEL(state->fds, entry);
+    StagedFile *file = entry->file;
+    file->refs--;
+    schedule_upload(state, file);
+    release_file(state, file);
+    free(entry);
+  }
+  pthread_mutex_unlock(&state->mutex);
+
+  return next->ops->lclose(fd, *next);
+}
+
+ssize_t staging_pwrite(int fd, const void *buffer, size_t nbyte, off_t offset,
+                       LayerContext l) {
+  StagingState *state = (StagingState *)l.internal_state;
+  LayerContext *next = l.next_layers;
+
+  StagedFile *file = fd_file(state, fd);
+  if (!file) {
+    return next->ops->lpwrite(fd, buffer, nbyte, offset, *next);
+  }
+  if (nbyte == 0) {
+    return 0;
+  }
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (nbyte > STAGING_MAX_RECORD) {
+    nbyte = STAGING_MAX_RECORD;
+  }
+
+  pthread_mutex_lock(&file->mutex);
+  if (file->journal_fd < 0 && open_journal(state, file) != 0) {
+    int err = errno;
+    pthread_mutex_unlock(&file->mutex);
+    ERROR_MSG("[STAGING] Failed to create a journal for %s: %s", file->path,
+              strerror(err));
+    errno = err;
+    return -1;
+  }
+  int journal = file->journal_fd;
+  off_t at = file->journal_end;
+  size_t total = sizeof(StagingRecord) + nbyte;
+  file->journal_end += (off_t)total;
+  file->io++;
+  pthread_mutex_unlock(&file->mutex);
+
+  StagingRecord record = {STAGING_RECORD_MAGIC, (uint32_t)nbyte,
+                          (uint64_t)offset, 0};
+  record.checksum = fnv1a(record_checksum_start(record.offset, record.length),
+                          buffer, nbyte);
+  struct iovec iov[2] = {{&record, sizeof(record)},
+                         {(void *)buffer, nbyte}};
+  ssize_t written = pwritev(journal, iov, 2, at);
+  // a short append is torn: replay stops there, and so does this write
+  int ret = written == (ssize_t)total ? 0 : -1;
+  int err = written < 0 ? errno : ENOSPC;
+
+  pthread_mutex_lock(&file->mutex);
+  file->io--;
+  if (ret == 0) {
+    ret = insert_extent(file, offset, nbyte, at + (off_t)sizeof(record));
+    err = errno;
+  } else if (file->journal_end == at + (off_t)total) {
+    file->journal_end = at;
+  }
+  bool full = ret == 0 && file->staged >= state->max_staged;
+  pthread_mutex_unlock(&file->mutex);
+
+  if (ret != 0) {
+    ERROR_MSG("[STAGING] Failed to stage a write of %s: %s", file->path,
+              strerror(err));
+    errno = err;
+    return -1;
+  }
+  if (full) {
+    schedule_upload(state, file);
+  }
+  return (ssize_t)nbyte;
+}
+
+ssize_t staging_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                      LayerContext l) {
+  StagingState *state = (StagingState *)l.internal_state;
+  LayerContext *next = l.next_layers;
+
+  StagedFile *file = fd_file(state, fd);
+  if (!file) {
+    return next->ops->lpread(fd, buffer, nbyte, offset, *next);
+  }
+
+  pthread_mutex_lock(&file->mutex);
+  if (file->nextents == 0) {
+    pthread_mutex_unlock(&file->mutex);
+    return next->ops->lpread(fd, buffer, nbyte, offset, *next);
+  }
+  if (offset >= file->size) {
+    pthread_mutex_unlock(&file->mutex);
+    return 0;
+  }
+  if ((off_t)nbyte > file->size - offset) {
+    nbyte = (size_t)(file->size - offset);
+  }
+  off_t end = offset + (off_t)nbyte;
+
+  // Copy the extents of the range, the journal stays while io is held
+  size_t first = extent_after(file, offset);
+  size_t count = 0;
+  while (first + count < file->nextents &&
+         file->extents[first + count].offset < end) {
+    count++;
+  }
+  StagedExtent local[STAGING_READ_EXTENTS];
+  StagedExtent *extents = local;
+  if (count > STAGING_READ_EXTENTS) {
+    extents = malloc(count * sizeof(StagedExtent));
+    if (!extents) {
+      pthread_mutex_unlock(&file->mutex);
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  memcpy(extents, &file->extents[first], count * sizeof(StagedExtent));
+  int journal = file->journal_fd;
+  file->io++;
+  pthread_mutex_unlock(&file->mutex);
+
+  int ret = 0;
+  off_t pos = offset;
+  for (size_t i = 0; i <= count && ret == 0; i++) {
+    off_t from = i < count ? extents[i].offset : end;
+    if (from < offset) {
+      from = offset;
+    }
+    if (from > pos) {
+      ret = next_pread_zeroed(*next, fd, (char *)buffer + (pos - offset),
+                              (size_t)(from - pos), pos);
+      pos = from;
+    }
+    if (i == count || ret != 0) {
+      break;
+    }
+    off_t to = extents[i].offset + (off_t)extents[i].length;
+    if (to > end) {
+      to = end;
+    }
+    ret = pread_fully(journal, (char *)buffer + (pos - offset),
+                      (size_t)(to - pos),
+                      extents[i].journal + (pos - extents[i].offset));
+    pos = to;
+  }
+  int err = errno;
+
+  pthread_mutex_lock(&file->mutex);
+  file->io--;
+  pthread_mutex_unlock(&file->mutex);
+  if (extents != local) {
+    free(extents);
+  }
+  if (ret != 0) {
+    errno = err;
+    return -1;
+  }
+  return (ssize_t)nbyte;
+}
+
+int staging_fsync(int fd, int isdatasync, LayerContext l) {
+  StagingState *state = (StagingState *)l.internal_state;
+  LayerContext *next = l.next_layers;
+
+  StagedFile *file = fd_file(state, fd);
+  if (!file) {
+    return next->ops->lfsync ? next->ops->lfsync(fd, isdatasync, *next) : 0;
+  }
+
+  // the journal makes the writes durable, the upload follows
+  pthread_mutex_lock(&file->mutex);
+  int ret = file->journal_fd >= 0 ? sync_journal(state, file) : 0;
+  pthread_mutex_unlock(&file->mutex);
+  if (ret != 0) {
+    ERROR_MSG("[STAGING] Failed to sync the journal of %s: %s", file->path,
+              strerror(errno));
+    return -1;
+  }
+  schedule_upload(state, file);
+  return 0;
+}
+
+int staging_ftruncate(int fd, off_t length, LayerContext l) {
+  StagingState *state = (StagingState *)l.internal_state;
+  LayerContext *next = l.next_layers;
+
+  StagedFile *file = fd_file(state, fd);
+  if (file && flush_file(state, file) != 0) {
+    return -1;
+  }
+  int ret = next->ops->lftruncate(fd, length, *next);
+  if (ret == 0 && file) {
+    pthread_mutex_lock(&file->mutex);
+    file->size = length;
+    pthread_mutex_unlock(&file->mutex);
+  }
+  return ret;
+}
+
+int staging_truncate(const char *path, off_t length, LayerContext l) {
+  StagingState *state = (StagingState *)l.internal_state;
+  LayerContext *next = l.next_layers;
+
+  pthread_mutex_lock(&state->mutex);
+  StagedFile *file = hold_path(state, path);
+  pthread_mutex_unlock(&state->mutex);
+  if (file && flush_file(state, file) != 0) {
+    int err = errno;
+    unhold(state, file);
+    errno = err;
+    return -1;
+  }
+  int ret = next->ops->ltruncate(path, length, *next);
+  if (ret == 0 && file) {
+    pthread_mutex_lock(&file->mutex);
+    file->size = length;
+    pthread_mutex_unlock(&file->mutex);
+  }
+  unhold(state, file);
+  return ret;
+}
+
+// Size of st with the staged writes of file
+static void staged_size(StagedFile *file, struct stat *stbuf) {
+  pthread_mutex_lock(&file->mutex);
+  if ((file->nextents > 0 || file->uploading) &&
+      file->size > stbuf->st_size) {
+    stbuf->st_size = file->size;
+  }
+  pthread_mutex_unlock(&file->mutex);
+}
+
+int staging_fstat(int fd, struct stat *stbuf, LayerContext l) {
+  StagingState *state = (StagingState *)l.internal_state;
+  LayerContext *next = l.next_layers;
+
+  int ret = next->ops->lfstat(fd, stbuf, *next);
+  StagedFile *file = fd_file(state, fd);
+  if (ret == 0 && file) {
+    staged_size(file, stbuf);
+  }
+  return ret;
+}
+
+int staging_lstat(const char *pathname, struct stat *stbuf, LayerContext l) {
+  StagingState *state = (StagingState *)l.internal_state;
+  LayerContext *next = l.next_layers;
+
+  int ret = next->ops->llstat(pathname, stbuf, *next);
+  if (ret == 0) {
+    pthread_mutex_lock(&state->mutex);
+    StagedFile *file = hold_path(state, pathname);
+    pthread_mutex_unlock(&state->mutex);
+    if (file) {
+      staged_size(file, stbuf);
+      unhold(state, file);
+    }
+  }
+  return ret;
+}
+
+int staging_unlink(const char *pathname, LayerContext l) {
+  StagingState *state = (StagingState *)l.internal_state;
+  LayerContext *next = l.next_layers;
+
+  // Open fds keep the file, out of the table: a new file of the same path
+  // starts from nothing
+  pthread_mutex_lock(&state->mutex);
+  StagedFile *file = hold_path(state, pathname);
+  if (file) {
+    HASH_DEL(state->files, file);
+    file->unlinked = true;
+  }
+  pthread_mutex_unlock(&state->mutex);
+  if (file) {
+    discard_file(file);
+    unhold(state, file);
+  }
+  return next->ops->lunlink(pathname, *next);
+}
+
+int staging_rename(const char *from, const char *to, unsigned int flags,
+                   LayerContext l) {
+  StagingState *state = (StagingState *)l.internal_state;
+  LayerContext *next = l.next_layers;
+  if (!next->ops->lrename) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  // journals name the path they upload to, both files go up first
+  pthread_mutex_lock(&state->mutex);
+  StagedFile *source = hold_path(state, from);
+  StagedFile *target = hold_path(state, to);
+  pthread_mutex_unlock(&state->mutex);
+
+  int ret = 0;
+  if ((source && flush_file(state, source) != 0) ||
+      (target && flush_file(state, target) != 0)) {
+    ret = -1;
+  }
+  if (ret == 0) {
+    ret = next->ops->lrename(from, to, flags, *next);
+  }
+  int err = errno;
+
+  if (ret == 0 && source) {
+    char *path = strdup(to);
+    pthread_mutex_lock(&state->mutex);
+    if (target) {
+      HASH_DEL(state->files, target);
+      target->unlinked = true;
+    }
+    if (path) {
+      HASH_DEL(state->files, source);
+      pthread_mutex_lock(&source->mutex);
+      free(source->path);
+      source->path = path;
+      pthread_mutex_unlock(&source->mutex);
+      HASH_ADD_KEYPTR(hh, state->files, source->path, strlen(source->path),
+                      source);
+    }
+    pthread_mutex_unlock(&state->mutex);
+  } else if (ret == 0 && target) {
+    pthread_mutex_lock(&state->mutex);
+    HASH_DEL(state->files, target);
+    target->unlinked = true;
+    pthread_mutex_unlock(&state->mutex);
+  }
+  unhold(state, source);
+  unhold(state, target);
+  errno = err;
+  return ret;
+}
+
+int staging_chmod(const char *path, mode_t mode, LayerContext l) {
+  LayerContext *next = l.next_layers;
+  if (!next->ops->lchmod) {
+    errno = ENOSYS;
+    return -1;
+  }
+  return next->ops->lchmod(path, mode, *next);
+}
+
+void staging_destroy(LayerContext l) {
+  StagingState *state = (StagingState *)l.internal_state;
+  if (state) {
+    pthread_mutex_lock(&state->mutex);
+    state->stopping = true;
+    pthread_mutex_unlock(&state->mutex);
+    // runs the queued uploads, which are not queued again
+    thread_pool_destroy(state->pool);
+    state->pool = NULL;
+
+    // Last try for what is still staged, a failure keeps the journal
+    StagedFile *file, *tmp;
+    HASH_ITER(hh, state->files, file, tmp) {
+      file->refs++;
+      flush_file(state, file);
+      file->refs--;
+    }
+    // fds left open: the unlinked files are only reachable through them
+    StagedFd *entry, *next_entry;
+    HASH_ITER(hh, state->fds, entry, next_entry) {
+      HASH_DEL(state->fds, entry);
+      if (entry->file->unlinked && --entry->file->refs == 0) {
+        close_journal(entry->file, true);
+        free_file(entry->file);
+      }
+      free(entry);
+    }
+    HASH_ITER(hh, state->files, file, tmp) {
+      HASH_DEL(state->files, file);
+      close_journal(file, file->nextents == 0);
+      free_file(file);
+    }
+    pthread_mutex_destroy(&state->mutex);
+    free(state->journal_dir);
+    free(state);
+  }
+
+  if (l.ops) {
+    free(l.ops);
+  }
+
+  if (l.next_layers) {
+    free(l.next_layers);
+  }
+}
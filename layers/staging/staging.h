@@ -0,0 +1,139 @@
+#ifndef __STAGING_H__
+#define __STAGING_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include "../../shared/types/layer_context.h"
+#include "../../shared/utils/thread_pool.h"
+#include "config.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * ============================================================================
+ * STAGING - LOCAL WRITE-AHEAD JOURNAL IN FRONT OF A SLOW DATA LAYER
+ * ============================================================================
+ *
+ * Object stores (the OpenDAL S3 and IPFS layers) turn every pwrite into a
+ * remote operation. The staging layer absorbs the pwrites of a file in a local
+ * journal instead, and uploads them to the next layer later, merged into runs
+ * of up to part_size bytes.
+ *
+ * - a pwrite appends a record (offset, length, checksum, data) to the journal
+ *   of its file and returns; the staged extents of a file map its offsets to
+ *   the journal, the newest write of a byte wins
+ * - reads take the staged bytes from the journal and the others from the next
+ *   layer, fstat and lstat give the size with the staged writes
+ * - close, fsync (which syncs the journal first) and max_staged staged bytes
+ *   start the upload of a file on a worker; the extents it wrote are dropped
+ *   once it is done, and the journal deleted when none is left. A failed
+ *   upload keeps them staged, the next close or fsync tries again
+ * - truncates and renames upload the file first, an unlink drops its staged
+ *   writes
+ * - at init, the journals left in journal_dir are replayed up to their first
+ *   torn record and uploaded
+ * ============================================================================
+ */
+
+#define STAGING_JOURNAL_MAGIC 0x4a534754 // "TGSJ"
+#define STAGING_RECORD_MAGIC 0x52534754  // "TGSR"
+#define STAGING_JOURNAL_VERSION 1
+#define STAGING_JOURNAL_SUFFIX ".journal"
+// largest record, longer pwrites are staged partially
+#define STAGING_MAX_RECORD (1U << 30)
+
+/**
+ * @brief Start of a journal, followed by path_len bytes of path
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t mode; // of the file, to create it when uploading
+  uint32_t path_len;
+} StagingJournalHeader;
+
+/**
+ * @brief Header of a staged pwrite, followed by its length bytes
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t length;
+  uint64_t offset;
+  uint64_t checksum; // FNV-1a of offset, length and the data
+} StagingRecord;
+
+/**
+ * @brief Bytes of a file whose content is in the journal
+ */
+typedef struct {
+  off_t offset;  // in the file
+  size_t length;
+  off_t journal; // of the first byte in the journal
+} StagedExtent;
+
+struct staging_state;
+
+typedef struct StagedFile {
+  char *path; // key, in the next layer
+  mode_t mode;
+  struct staging_state *state;
+  int refs;      // open fds and operations holding the file (state->mutex)
+  bool unlinked; // out of the table, its writes are dropped (state->mutex)
+
+  pthread_mutex_t mutex; // protects the fields below
+  pthread_cond_t idle;   // broadcast when an upload ends
+  int journal_fd;        // -1 until the first staged write
+  char *journal_path;
+  off_t journal_end;       // where the next record goes
+  bool journal_synced;     // the directory entry of the journal is durable
+  StagedExtent *extents;   // sorted by offset, not overlapping
+  size_t nextents;
+  size_t capacity;
+  off_t size;     // of the file, with the staged writes
+  size_t staged;  // bytes of the extents
+  int io;         // reads and appends of the journal in progress
+  bool uploading; // an upload runs or is queued
+  bool again;     // upload once more when it ends
+  ThreadPoolTask task;
+  UT_hash_handle hh;
+} StagedFile;
+
+typedef struct {
+  int fd; // key, from the next layer
+  StagedFile *file;
+  UT_hash_handle hh;
+} StagedFd;
+
+typedef struct staging_state {
+  LayerContext next;
+  char *journal_dir;
+  size_t max_staged;
+  size_t part_size;
+  ThreadPool *pool;      // uploads
+  pthread_mutex_t mutex; // protects the fields below and the refs of files
+  StagedFile *files;     // by path
+  StagedFd *fds;         // by fd
+  uint64_t next_journal; // name of the next journal
+  bool stopping;         // set by destroy, uploads are not queued again
+} StagingState;
+
+LayerContext staging_init(LayerContext *next_layer,
+                          const StagingConfig *config);
+ssize_t staging_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                      LayerContext l);
+ssize_t staging_pwrite(int fd, const void *buffer, size_t nbyte, off_t offset,
+                       LayerContext l);
+int staging_open(const char *pathname, int flags, mode_t mode, LayerContext l);
+int staging_close(int fd, LayerContext l);
+int staging_fsync(int fd, int isdatasync, LayerContext l);
+int staging_ftruncate(int fd, off_t length, LayerContext l);
+int staging_truncate(const char *path, off_t length, LayerContext l);
+int staging_fstat(int fd, struct stat *stbuf, LayerContext l);
+int staging_lstat(const char *pathname, struct stat *stbuf, LayerContext l);
+int staging_unlink(const char *pathname, LayerContext l);
+int staging_rename(const char *from, const char *to, unsigned int flags,
+                   LayerContext l);
+int staging_chmod(const char *path, mode_t mode, LayerContext l);
+void staging_destroy(LayerContext l);
+
+#endif
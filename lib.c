@@ -1,11 +1,25 @@
 #include "lib.h"
+#include "config/reload.h"
 #include "shared/types/layer_context.h"
+#include "shared/utils/layer_iov.h"
+#include "shared/utils/metadata_service.h"
+#include "shared/utils/metrics.h"
+#ifdef STATIC_PIPELINE
+#include "config/static_layers.h"
+#endif
 #include <dlfcn.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 LayerContext libinit(const char *config_path) {
+#ifdef STATIC_PIPELINE
+  // The configuration the pipeline was built for
+  if (!config_path) {
+    return load_config_toml_string(static_pipeline_config);
+  }
+#endif
   // Use default path if NULL is provided
   const char *path = config_path ? config_path : "./config.toml";
   char *filepath = strdup(path);
@@ -18,7 +32,11 @@ LayerContext libinit(const char *config_path) {
   return root;
 }
 
-void libdestroy(LayerContext lroot) { lroot.ops->ldestroy(lroot); }
+void libdestroy(LayerContext lroot) {
+  metrics_stop();
+  reload_forget(lroot);
+  lroot.ops->ldestroy(lroot);
+}
 
 ssize_t libpread(int fd, void *buffer, size_t nbyte, off_t offset,
                  LayerContext lroot) {
@@ -37,6 +55,18 @@ ssize_t libpwrite(int fd, const void *buffer, size_t nbyte, off_t offset,
   return res;
 }
 
+ssize_t libpreadv(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                  LayerContext lroot) {
+  // native preadv of the root layer, or its pread
+  return layer_preadv(fd, iov, iovcnt, offset, lroot);
+}
+
+ssize_t libpwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                   LayerContext lroot) {
+  // native pwritev of the root layer, or its pwrite
+  return layer_pwritev(fd, iov, iovcnt, offset, lroot);
+}
+
 int libopen(const char *pathname, int flags, mode_t mode, LayerContext lroot) {
   int fd;
   fd = lroot.ops->lopen(pathname, flags, mode, lroot);
@@ -53,12 +83,28 @@ int libftruncate(int fd, off_t length, LayerContext lroot) {
   return lroot.ops->lftruncate(fd, length, lroot);
 }
 
+int libfstat(int fd, struct stat *stbuf, LayerContext lroot) {
+  return lroot.ops->lfstat(fd, stbuf, lroot);
+}
+
 int libfsync(int fd, int isdatasync, LayerContext lroot) {
   int res;
+  // a root layer without fsync has nothing of its own to flush
+  if (!lroot.ops->lfsync) {
+    return 0;
+  }
   res = lroot.ops->lfsync(fd, isdatasync, lroot);
   return res;
 }
 
+ssize_t libcopy_file_range(int fd_in, off_t offset_in, int fd_out,
+                           off_t offset_out, size_t len, unsigned int flags,
+                           LayerContext lroot) {
+  // native copy of the root layer, or its reads and writes
+  return layer_copy_file_range(fd_in, offset_in, fd_out, offset_out, len,
+                               flags, lroot);
+}
+
 int liblstat(const char *path, struct stat *stbuf, LayerContext lroot) {
   int res;
   res = lroot.ops->llstat(path, stbuf, lroot);
@@ -72,7 +118,7 @@ int libreaddir(const char *path, void *buf,
                off_t offset, struct fuse_file_info *fi, unsigned int flags,
                LayerContext lroot) {
   int res;
-  res = lroot.ops->lreaddir(path, buf, filler, offset, fi, flags, lroot);
+  res = layer_readdir(path, buf, filler, offset, fi, flags, lroot);
   return res;
 }
 
@@ -94,3 +140,89 @@ int libunlink(const char *path, LayerContext lroot) {
   res = lroot.ops->lunlink(path, lroot);
   return res;
 }
+
+int libreload(const char *config_path, char *error, size_t error_size) {
+  return reload_config_toml(config_path ? config_path : "./config.toml",
+                            error, error_size);
+}
+
+int libreload_on_sighup(const char *config_path) {
+  return reload_on_sighup(config_path ? config_path : "./config.toml");
+}
+
+int libbacking_fd(int fd, LayerContext lroot) {
+  return layer_backing_fd(fd, lroot);
+}
+
+#define LIBVERIFY_BATCH_THREADS 8 // threads of a batch without a service pool
+
+typedef struct {
+  const char *const *paths;
+  int *results;
+  size_t n;
+  size_t next; // next file to verify, atomic
+  LayerContext lroot;
+} VerifyBatchJob;
+
+static void *verify_batch_worker(void *arg) {
+  VerifyBatchJob *job = arg;
+  for (;;) {
+    const size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+    if (i >= job->n) {
+      break;
+    }
+    job->results[i] = layer_verify(job->paths[i], job->lroot);
+  }
+  return NULL;
+}
+
+int libverify_batch(const char *const paths[], size_t n, int results[],
+                    LayerContext lroot) {
+  if ((!paths || !results) && n > 0) {
+    return -1;
+  }
+  VerifyBatchJob job = {
+      .paths = paths, .results = results, .n = n, .next = 0, .lroot = lroot};
+
+  // no more threads than files; the calling thread is one of the workers
+  ThreadPool *pool = metadata_service_pool();
+  size_t n_workers = pool ? (size_t)pool->nworkers + 1
+                          : LIBVERIFY_BATCH_THREADS;
+  if (n_workers > n) {
+    n_workers = n;
+  }
+  if (n_workers < 2) {
+    verify_batch_worker(&job);
+    return 0;
+  }
+
+  if (pool) {
+    ThreadPoolTask *tasks = malloc((n_workers - 1) * sizeof(ThreadPoolTask));
+    ThreadPoolBatch batch;
+    thread_pool_batch_init(&batch);
+    for (size_t i = 0; tasks && i < n_workers - 1; i++) {
+      if (thread_pool_submit(pool, THREAD_POOL_LOCAL_QUEUE, &tasks[i], &batch,
+                             verify_batch_worker, &job) != 0) {
+        break; // the tasks already queued (and this thread) do the work
+      }
+    }
+    verify_batch_worker(&job);
+    thread_pool_wait(pool, &batch);
+    free(tasks);
+    return 0;
+  }
+
+  pthread_t threads[LIBVERIFY_BATCH_THREADS - 1];
+  size_t started = 0;
+  for (; started < n_workers - 1; started++) {
+    if (pthread_create(&threads[started], NULL, verify_batch_worker, &job) !=
+        0) {
+      break; // the threads already started (and this one) do the work
+    }
+  }
+  verify_batch_worker(&job);
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  return 0;
+}
@@ -15,10 +15,20 @@ ssize_t libpread(int fd, void *buffer, size_t nbyte, off_t offset,
                  LayerContext lroot);
 ssize_t libpwrite(int fd, const void *buffer, size_t nbyte, off_t offset,
                   LayerContext lroot);
+ssize_t libpreadv(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                  LayerContext lroot);
+ssize_t libpwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                   LayerContext lroot);
 int libopen(const char *pathname, int flags, mode_t mode, LayerContext lroot);
 int libclose(int fd, LayerContext lroot);
 int libfsync(int fd, int isdatasync, LayerContext lroot);
+// Copy of a range between two fds of the stack, cloned by the layers that
+// can (see lcopy_file_range in LayerOps), read and written otherwise
+ssize_t libcopy_file_range(int fd_in, off_t offset_in, int fd_out,
+                           off_t offset_out, size_t len, unsigned int flags,
+                           LayerContext lroot);
 int libftruncate(int fd, off_t length, LayerContext lroot);
+int libfstat(int fd, struct stat *stbuf, LayerContext lroot);
 int liblstat(const char *path, struct stat *stbuf, LayerContext lroot);
 int libreaddir(const char *path, void *buf,
                int (*filler)(void *buf, const char *name,
@@ -30,5 +40,20 @@ int librename(const char *from, const char *to, unsigned int flags,
               LayerContext lroot);
 int libchmod(const char *path, mode_t mode, LayerContext lroot);
 int libunlink(const char *path, LayerContext lroot);
+// Local file that reads of fd can go to directly, -1 if the stack transforms
+// or checks the data on reads (see lbacking_fd in LayerOps)
+int libbacking_fd(int fd, LayerContext lroot);
+// Integrity check of each of n files at rest, concurrently: results[i] is the
+// LayerVerifyResult of paths[i] (see lverify in LayerOps). 0, or -1 on
+// invalid arguments
+int libverify_batch(const char *const paths[], size_t n, int results[],
+                    LayerContext lroot);
+// Applies the live tunables of a configuration file to the tree of the last
+// libinit (see config/reload.h). 0, or -1 with nothing changed and why in
+// error
+int libreload(const char *config_path, char *error, size_t error_size);
+// Reloads the configuration file on every SIGHUP, replacing the handler set
+// before. Call it once, after any fork. 0, or -1 on failure
+int libreload_on_sighup(const char *config_path);
 
 #endif
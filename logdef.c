@@ -7,14 +7,20 @@
 #include <assert.h>
 #include <errno.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+// every function is defined, for the code built with any TG_LOG_LEVEL
+#undef TG_LOG_LEVEL
 #include "logdef.h"
 
 struct zlog_category_s *CATEGORY;
@@ -241,10 +247,659 @@ static screen_func_t screen = DROP_MSG;
 static info_func_t info = DROP_MSG;
 static warn_func_t warn = DROP_MSG;
 
+/* ==== ASYNCHRONOUS LOGGING ==== */
+
+#define LOG_RECORD_ARGS 16     // arguments a record holds, with * widths
+#define LOG_RECORD_STRINGS 112 // bytes of the %s strings a record holds
+#define LOG_SPEC_MAX 32        // longest conversion specification replayed
+#define LOG_LINE_MAX 2048      // longest message the drainer writes
+
+typedef enum {
+  LOG_ARG_PERCENT, // %%, no argument
+  LOG_ARG_INT,
+  LOG_ARG_UINT,
+  LOG_ARG_LONG,
+  LOG_ARG_ULONG,
+  LOG_ARG_LLONG,
+  LOG_ARG_ULLONG,
+  LOG_ARG_INTMAX,
+  LOG_ARG_UINTMAX,
+  LOG_ARG_SSIZE,
+  LOG_ARG_SIZE,
+  LOG_ARG_PTRDIFF,
+  LOG_ARG_DOUBLE,
+  LOG_ARG_POINTER,
+  LOG_ARG_STRING,     // offset of the copy in the strings of the record
+  LOG_ARG_UNSUPPORTED // formatted on the caller
+} LogArg;
+
+typedef struct {
+  LogArg type;
+  int stars;          // * width and precision arguments before the value
+  int precision_star; // the precision is the last star argument
+  int precision;      // precision given in the format, -1 if none
+} LogSpec;
+
+typedef union {
+  long long i;
+  unsigned long long u;
+  double d;
+  const void *p;
+} LogValue;
+
+typedef struct {
+  const char *format; // NULL: text holds the formatted message
+  LogMode level;
+  unsigned nargs;
+  union {
+    struct {
+      LogValue args[LOG_RECORD_ARGS];
+      char strings[LOG_RECORD_STRINGS];
+    };
+    char text[LOG_RECORD_ARGS * sizeof(LogValue) + LOG_RECORD_STRINGS];
+  };
+} LogRecord;
+
+typedef struct LogRing {
+  size_t head; // next record the thread writes, stored with release
+  char pad_head[64 - sizeof(size_t)];
+  size_t tail; // next record the drainer reads, stored with release
+  char pad_tail[64 - sizeof(size_t)];
+  size_t mask;            // records - 1
+  int orphaned;           // the thread exited, freed once drained
+  struct LogRing *next;   // in the list of rings
+  LogRecord records[];
+} LogRing;
+
+static LogOptions log_options;
+static LogRing *log_rings; // every ring, guarded by log_drain_mutex
+static pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_drainer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_drainer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t log_drainer;
+static int log_drainer_running; // guarded by log_drainer_mutex
+static pthread_key_t log_ring_key;
+static pthread_once_t log_ring_once = PTHREAD_ONCE_INIT;
+static __thread LogRing *log_thread_ring;
+static unsigned long long log_logged;
+static unsigned long long log_dropped;
+static unsigned long long log_suppressed;
+
+/**
+ * Parses the conversion specification at format, which starts with '%'
+ * @param format Start of the specification
+ * @param spec Filled with the argument the specification takes
+ * @returns The character after the specification
+ */
+static const char *log_parse_spec(const char *format, LogSpec *spec) {
+  const char *p = format + 1;
+  spec->stars = 0;
+  spec->precision_star = 0;
+  spec->precision = -1;
+  if (*p == '%') {
+    spec->type = LOG_ARG_PERCENT;
+    return p + 1;
+  }
+  while (*p && strchr("-+ #0'", *p)) {
+    p++;
+  }
+  if (*p == '*') {
+    spec->stars++;
+    p++;
+  } else {
+    while (*p >= '0' && *p <= '9') {
+      p++;
+    }
+  }
+  if (*p == '.') {
+    p++;
+    if (*p == '*') {
+      spec->stars++;
+      spec->precision_star = 1;
+      p++;
+    } else {
+      spec->precision = 0;
+      while (*p >= '0' && *p <= '9') {
+        spec->precision = spec->precision * 10 + (*p++ - '0');
+      }
+    }
+  }
+
+  char length = 0; // h, H (hh), l, q (ll), j, z, t or L
+  if (*p == 'h' || *p == 'l') {
+    length = *p++;
+    if (*p == length) {
+      length = length == 'h' ? 'H' : 'q';
+      p++;
+    }
+  } else if (*p && strchr("jztL", *p)) {
+    length = *p++;
+  }
+
+  char conversion = *p;
+  if (conversion) {
+    p++;
+  }
+  spec->type = LOG_ARG_UNSUPPORTED;
+  switch (conversion) {
+  case 'd':
+  case 'i':
+    spec->type = length == 'l'   ? LOG_ARG_LONG
+                 : length == 'q' ? LOG_ARG_LLONG
+                 : length == 'j' ? LOG_ARG_INTMAX
+                 : length == 'z' ? LOG_ARG_SSIZE
+                 : length == 't' ? LOG_ARG_PTRDIFF
+                 : length == 'L' ? LOG_ARG_UNSUPPORTED
+                                 : LOG_ARG_INT;
+    break;
+  case 'u':
+  case 'o':
+  case 'x':
+  case 'X':
+    spec->type = length == 'l'   ? LOG_ARG_ULONG
+                 : length == 'q' ? LOG_ARG_ULLONG
+                 : length == 'j' ? LOG_ARG_UINTMAX
+                 : length == 'z' ? LOG_ARG_SIZE
+                 : length == 't' ? LOG_ARG_PTRDIFF
+                 : length == 'L' ? LOG_ARG_UNSUPPORTED
+                                 : LOG_ARG_UINT;
+    break;
+  case 'c':
+    spec->type = length == 0 ? LOG_ARG_INT : LOG_ARG_UNSUPPORTED;
+    break;
+  case 'f':
+  case 'F':
+  case 'e':
+  case 'E':
+  case 'g':
+  case 'G':
+  case 'a':
+  case 'A':
+    spec->type =
+        length == 0 || length == 'l' ? LOG_ARG_DOUBLE : LOG_ARG_UNSUPPORTED;
+    break;
+  case 'p':
+    spec->type = LOG_ARG_POINTER;
+    break;
+  case 's':
+    spec->type = length == 0 ? LOG_ARG_STRING : LOG_ARG_UNSUPPORTED;
+    break;
+  default: // %n, positional arguments, wide strings
+    break;
+  }
+  if (p - format >= LOG_SPEC_MAX) {
+    spec->type = LOG_ARG_UNSUPPORTED;
+  }
+  return p;
+}
+
+/**
+ * Copies the arguments of format into a record
+ * @param record Record to fill, format and level are set by the caller
+ * @param format Format of the message
+ * @param args Arguments of the format
+ * @returns 0 on success, -1 if the record can't hold them
+ */
+static int log_capture(LogRecord *record, const char *format, va_list args) {
+  unsigned nargs = 0;
+  size_t strings = 0;
+  for (const char *p = strchr(format, '%'); p; p = strchr(p, '%')) {
+    LogSpec spec;
+    p = log_parse_spec(p, &spec);
+    if (spec.type == LOG_ARG_PERCENT) {
+      continue;
+    }
+    if (spec.type == LOG_ARG_UNSUPPORTED ||
+        nargs + spec.stars + 1 > LOG_RECORD_ARGS) {
+      return -1;
+    }
+    for (int s = 0; s < spec.stars; s++) {
+      record->args[nargs++].i = va_arg(args, int);
+    }
+    LogValue *value = &record->args[nargs++];
+    switch (spec.type) {
+    case LOG_ARG_INT:
+      value->i = va_arg(args, int);
+      break;
+    case LOG_ARG_UINT:
+      value->u = va_arg(args, unsigned int);
+      break;
+    case LOG_ARG_LONG:
+      value->i = va_arg(args, long);
+      break;
+    case LOG_ARG_ULONG:
+      value->u = va_arg(args, unsigned long);
+      break;
+    case LOG_ARG_LLONG:
+      value->i = va_arg(args, long long);
+      break;
+    case LOG_ARG_ULLONG:
+      value->u = va_arg(args, unsigned long long);
+      break;
+    case LOG_ARG_INTMAX:
+      value->i = va_arg(args, intmax_t);
+      break;
+    case LOG_ARG_UINTMAX:
+      value->u = va_arg(args, uintmax_t);
+      break;
+    case LOG_ARG_SSIZE:
+      value->i = va_arg(args, ssize_t);
+      break;
+    case LOG_ARG_SIZE:
+      value->u = va_arg(args, size_t);
+      break;
+    case LOG_ARG_PTRDIFF:
+      value->i = va_arg(args, ptrdiff_t);
+      break;
+    case LOG_ARG_DOUBLE:
+      value->d = va_arg(args, double);
+      break;
+    case LOG_ARG_POINTER:
+      value->p = va_arg(args, void *);
+      break;
+    case LOG_ARG_STRING: {
+      const char *s = va_arg(args, const char *);
+      if (!s) {
+        value->i = -1;
+        break;
+      }
+      int precision = spec.precision_star ? (int)record->args[nargs - 2].i
+                                          : spec.precision;
+      size_t room = LOG_RECORD_STRINGS - strings;
+      size_t n = strnlen(s, precision >= 0 && (size_t)precision < room
+                                ? (size_t)precision
+                                : room);
+      if (n == room) {
+        return -1;
+      }
+      memcpy(record->strings + strings, s, n);
+      record->strings[strings + n] = '\0';
+      value->i = (long long)strings;
+      strings += n + 1;
+      break;
+    }
+    default:
+      return -1;
+    }
+  }
+  record->nargs = nargs;
+  return 0;
+}
+
+#define LOG_PUT(value)                                                         \
+  (spec.stars == 0   ? snprintf(out + len, size - len, conversion, value)     \
+   : spec.stars == 1 ? snprintf(out + len, size - len, conversion, stars[0],  \
+                                value)                                         \
+                     : snprintf(out + len, size - len, conversion, stars[0],  \
+                                stars[1], value))
+
+/**
+ * Formats a record
+ * @param record Record to format
+ * @param out Buffer of the message
+ * @param size Size of out, the message is truncated to it
+ */
+static void log_render(const LogRecord *record, char *out, size_t size) {
+  if (!record->format) {
+    (void)snprintf(out, size, "%s", record->text);
+    return;
+  }
+  size_t len = 0;
+  unsigned arg = 0;
+  const char *p = record->format;
+  while (*p && len + 1 < size) {
+    if (*p != '%') {
+      out[len++] = *p++;
+      continue;
+    }
+    LogSpec spec;
+    const char *start = p;
+    p = log_parse_spec(p, &spec);
+    if (spec.type == LOG_ARG_PERCENT) {
+      out[len++] = '%';
+      continue;
+    }
+    char conversion[LOG_SPEC_MAX];
+    memcpy(conversion, start, p - start);
+    conversion[p - start] = '\0';
+    int stars[2] = {0, 0};
+    for (int s = 0; s < spec.stars; s++) {
+      stars[s] = (int)record->args[arg++].i;
+    }
+    LogValue value = record->args[arg++];
+    int n = 0;
+    switch (spec.type) {
+    case LOG_ARG_INT:
+      n = LOG_PUT((int)value.i);
+      break;
+    case LOG_ARG_UINT:
+      n = LOG_PUT((unsigned int)value.u);
+      break;
+    case LOG_ARG_LONG:
+      n = LOG_PUT((long)value.i);
+      break;
+    case LOG_ARG_ULONG:
+      n = LOG_PUT((unsigned long)value.u);
+      break;
+    case LOG_ARG_LLONG:
+      n = LOG_PUT(value.i);
+      break;
+    case LOG_ARG_ULLONG:
+      n = LOG_PUT(value.u);
+      break;
+    case LOG_ARG_INTMAX:
+      n = LOG_PUT((intmax_t)value.i);
+      break;
+    case LOG_ARG_UINTMAX:
+      n = LOG_PUT((uintmax_t)value.u);
+      break;
+    case LOG_ARG_SSIZE:
+      n = LOG_PUT((ssize_t)value.i);
+      break;
+    case LOG_ARG_SIZE:
+      n = LOG_PUT((size_t)value.u);
+      break;
+    case LOG_ARG_PTRDIFF:
+      n = LOG_PUT((ptrdiff_t)value.i);
+      break;
+    case LOG_ARG_DOUBLE:
+      n = LOG_PUT(value.d);
+      break;
+    case LOG_ARG_POINTER:
+      n = LOG_PUT(value.p);
+      break;
+    case LOG_ARG_STRING:
+      n = LOG_PUT(value.i < 0 ? "(null)" : record->strings + value.i);
+      break;
+    default:
+      break;
+    }
+    if (n > 0) {
+      len += (size_t)n < size - len ? (size_t)n : size - len - 1;
+    }
+  }
+  out[len] = '\0';
+}
+
+/**
+ * Writes a drained message with zlog
+ * @param level Level of the message
+ * @param format "%s", the message follows
+ */
+static void log_zlog_write(LogMode level, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  assert(CATEGORY != NULL);
+  switch (level) {
+  case LOG_DEBUG:
+    vzlog_debug(CATEGORY, format, args);
+    break;
+  case LOG_INFO:
+    vzlog_info(CATEGORY, format, args);
+    break;
+  default:
+    vzlog_warn(CATEGORY, format, args);
+    break;
+  }
+  va_end(args);
+}
+
+/**
+ * Writes the records waiting in every ring, frees the rings of the threads
+ * that exited, with log_drain_mutex held
+ */
+static void log_drain_locked() {
+  char line[LOG_LINE_MAX];
+  LogRing **link = &log_rings;
+  while (*link) {
+    LogRing *ring = *link;
+    // once orphaned, the thread wrote its last record
+    int orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+    size_t first = ring->tail;
+    size_t tail = first;
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    for (; tail != head; tail++) {
+      const LogRecord *record = &ring->records[tail & ring->mask];
+      log_render(record, line, sizeof(line));
+      if (log_options.sink) {
+        log_options.sink(record->level, line);
+      } else {
+        log_zlog_write(record->level, "%s", line);
+      }
+      __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_add_fetch(&log_logged, tail - first, __ATOMIC_RELAXED);
+    if (orphaned) {
+      *link = ring->next;
+      free(ring);
+    } else {
+      link = &ring->next;
+    }
+  }
+}
+
+/**
+ * Marks the ring of an exiting thread for the drainer to free
+ * @param ring Ring of the thread
+ */
+static void log_ring_orphan(void *ring) {
+  log_thread_ring = NULL; // a later message of the thread gets a new ring
+  __atomic_store_n(&((LogRing *)ring)->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static void log_ring_key_create() {
+  (void)pthread_key_create(&log_ring_key, log_ring_orphan);
+}
+
+/**
+ * The ring of the calling thread, created on its first message
+ * @returns The ring, NULL if it could not be allocated
+ */
+static LogRing *log_thread_ring_get() {
+  if (log_thread_ring) {
+    return log_thread_ring;
+  }
+  size_t records = LOG_DEFAULT_RING_RECORDS;
+  if (log_options.ring_records) {
+    // rounded up to a power of two, for the mask
+    for (records = 1; records < log_options.ring_records; records <<= 1) {
+    }
+  }
+  LogRing *ring = calloc(1, sizeof(LogRing) + records * sizeof(LogRecord));
+  if (!ring) {
+    return NULL;
+  }
+  ring->mask = records - 1;
+  (void)pthread_once(&log_ring_once, log_ring_key_create);
+  (void)pthread_setspecific(log_ring_key, ring);
+  pthread_mutex_lock(&log_drain_mutex);
+  ring->next = log_rings;
+  log_rings = ring;
+  pthread_mutex_unlock(&log_drain_mutex);
+  log_thread_ring = ring;
+  return ring;
+}
+
+/**
+ * Queues a message on the ring of the calling thread
+ * @param level Level of the message
+ * @param format Format of the message
+ * @param args A list of arguments accompanying the format
+ */
+static void log_enqueue(LogMode level, const char *format, va_list args) {
+  LogRing *ring = log_thread_ring_get();
+  if (!ring) {
+    __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  size_t head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask) {
+    __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  LogRecord *record = &ring->records[head & ring->mask];
+  record->level = level;
+  record->format = format;
+  va_list copy;
+  va_copy(copy, args);
+  if (log_capture(record, format, copy) != 0) {
+    record->format = NULL;
+    (void)vsnprintf(record->text, sizeof(record->text), format, args);
+  }
+  va_end(copy);
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void ASYNC_DEBUG_MSG(const char *format, va_list args) {
+  log_enqueue(LOG_DEBUG, format, args);
+}
+
+static void ASYNC_INFO_MSG(const char *format, va_list args) {
+  log_enqueue(LOG_INFO, format, args);
+}
+
+static void ASYNC_WARN_MSG(const char *format, va_list args) {
+  log_enqueue(LOG_WARN, format, args);
+}
+
+static void ASYNC_ERROR_MSG(const char *format, va_list args) {
+  LOG_FLUSH();
+  ACTIVE_ERROR_MSG(format, args);
+}
+
+/**
+ * The drainer thread, writes the records every LOG_DRAIN_INTERVAL_MS until
+ * log_drainer_running is cleared
+ */
+static void *log_drainer_loop(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&log_drainer_mutex);
+  while (log_drainer_running) {
+    pthread_mutex_unlock(&log_drainer_mutex);
+    LOG_FLUSH();
+    pthread_mutex_lock(&log_drainer_mutex);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += LOG_DRAIN_INTERVAL_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    if (log_drainer_running) {
+      (void)pthread_cond_timedwait(&log_drainer_cond, &log_drainer_mutex,
+                                   &deadline);
+    }
+  }
+  pthread_mutex_unlock(&log_drainer_mutex);
+  return NULL;
+}
+
+/**
+ * Stops the drainer and writes the records left
+ */
+static void log_drainer_stop() {
+  pthread_mutex_lock(&log_drainer_mutex);
+  int running = log_drainer_running;
+  log_drainer_running = 0;
+  pthread_cond_signal(&log_drainer_cond);
+  pthread_mutex_unlock(&log_drainer_mutex);
+  if (running) {
+    pthread_join(log_drainer, NULL);
+  }
+  LOG_FLUSH();
+}
+
+static void log_drainer_start() {
+  static int registered;
+  pthread_mutex_lock(&log_drainer_mutex);
+  if (!log_drainer_running) {
+    log_drainer_running =
+        pthread_create(&log_drainer, NULL, log_drainer_loop, NULL) == 0;
+    if (!log_drainer_running) {
+      (void)fprintf(stderr, "[logdef::LOG_CONFIGURE] Could not start the log "
+                            "drainer, records are written on LOG_FLUSH\n");
+    }
+  }
+  if (!registered) {
+    // the records queued before exit are written to the logs
+    registered = atexit(log_drainer_stop) == 0;
+  }
+  pthread_mutex_unlock(&log_drainer_mutex);
+}
+
+/**
+ * Switches the enabled debug, info, warn and error messages to the rings or
+ * back to zlog, as log_options.async says
+ */
+static void log_apply_options() {
+  if (log_options.async) {
+    debug = debug == ACTIVE_DEBUG_MSG ? ASYNC_DEBUG_MSG : debug;
+    info = info == ACTIVE_INFO_MSG ? ASYNC_INFO_MSG : info;
+    warn = warn == ACTIVE_WARN_MSG ? ASYNC_WARN_MSG : warn;
+    error = error == ACTIVE_ERROR_MSG ? ASYNC_ERROR_MSG : error;
+    if (debug == ASYNC_DEBUG_MSG || info == ASYNC_INFO_MSG ||
+        warn == ASYNC_WARN_MSG) {
+      log_drainer_start();
+    }
+  } else {
+    debug = debug == ASYNC_DEBUG_MSG ? ACTIVE_DEBUG_MSG : debug;
+    info = info == ASYNC_INFO_MSG ? ACTIVE_INFO_MSG : info;
+    warn = warn == ASYNC_WARN_MSG ? ACTIVE_WARN_MSG : warn;
+    error = error == ASYNC_ERROR_MSG ? ACTIVE_ERROR_MSG : error;
+    log_drainer_stop();
+  }
+}
+
+void LOG_CONFIGURE(const LogOptions *options) {
+  pthread_mutex_lock(&log_drain_mutex);
+  log_options = *options;
+  pthread_mutex_unlock(&log_drain_mutex);
+  log_apply_options();
+}
+
+void LOG_FLUSH(void) {
+  pthread_mutex_lock(&log_drain_mutex);
+  log_drain_locked();
+  pthread_mutex_unlock(&log_drain_mutex);
+}
+
+void LOG_STATS(LogStats *stats) {
+  stats->logged = __atomic_load_n(&log_logged, __ATOMIC_RELAXED);
+  stats->dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+  stats->suppressed = __atomic_load_n(&log_suppressed, __ATOMIC_RELAXED);
+}
+
+int LOG_RATE_ALLOW(LogRateLimit *limit) {
+  unsigned rate = log_options.rate_limit;
+  if (!rate) {
+    return 1;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  long window = __atomic_load_n(&limit->window, __ATOMIC_RELAXED);
+  // the first caller of a second restarts the count, the others racing it
+  // may count in either window
+  if (window != now.tv_sec &&
+      __atomic_compare_exchange_n(&limit->window, &window, now.tv_sec, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&limit->count, 0, __ATOMIC_RELAXED);
+  }
+  if (__atomic_add_fetch(&limit->count, 1, __ATOMIC_RELAXED) <= rate) {
+    return 1;
+  }
+  __atomic_add_fetch(&log_suppressed, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
 /**
  * Initialize zlog infrastructure (for modes that need file logging)
  */
 static void init_zlog() {
+  // a reloaded configuration calls LOG_INIT again
+  static int zlog_ready = 0;
+  if (zlog_ready) {
+    return;
+  }
   char *zlog_config_path = LOCAL_ZLOGCONFIG_PATH;
 
   if (!zlog_config_path && file_exists(DEFAULT_ZLOGCONFIG_PATH)) {
@@ -275,6 +930,7 @@ static void init_zlog() {
                   "from zlog.conf\n");
     exit(EXIT_FAILURE);
   }
+  zlog_ready = 1;
 }
 
 /**
@@ -364,12 +1020,14 @@ void LOG_INIT(LogMode mode) {
                   (int)mode);
     break;
   }
+  log_apply_options();
 }
 
 /**
  * Tears down the logging infrastructure
  */
 void LOG_EXIT(LogMode mode) {
+  log_drainer_stop();
   if (mode) {
     zlog_fini();
   }
@@ -7,11 +7,110 @@
 #define __LOGDEF_H__
 
 #include "shared/enums/log_mode.h"
+#include <stddef.h>
 
 #define LOCAL_ZLOGCONFIG_PATH "zlog.conf"
 #define DEFAULT_ZLOGCONFIG_PATH "/etc/modular-lib/zlog.conf"
+
+/*
+ * ============================================================================
+ * ASYNCHRONOUS LOGGING
+ * ============================================================================
+ *
+ * By default every enabled message is formatted and written by zlog on the
+ * calling thread. With LogOptions.async, DEBUG_MSG, INFO_MSG and WARN_MSG only
+ * copy the format pointer and the arguments into a ring of the calling
+ * thread, which has a single producer and takes no lock; a background thread
+ * formats and writes the records every LOG_DRAIN_INTERVAL_MS.
+ *
+ * - The format must be a string literal (or otherwise outlive the drain):
+ *   only its pointer is kept. The strings given for %s are copied.
+ * - Formats the record can't hold the arguments of (%n, positional or long
+ *   double arguments, too many or too long strings) are formatted on the
+ *   caller, into the record.
+ * - A message logged while the ring of its thread is full is dropped and
+ *   counted, the caller never waits for the drain.
+ * - ERROR_MSG and SCREEN_MSG stay synchronous, ERROR_MSG drains the rings
+ *   first so an error follows the messages logged before it.
+ * - zlog stamps the records when they are drained, up to the drain interval
+ *   after they were logged.
+ *
+ * The *_MSG_RATELIMITED macros are for the messages of hot paths (a cache hit,
+ * a block read): each call site logs at most LogOptions.rate_limit messages a
+ * second and counts the others as suppressed.
+ * ============================================================================
+ */
+
+#define LOG_DRAIN_INTERVAL_MS 10
+#define LOG_DEFAULT_RING_RECORDS 1024
+
+typedef struct {
+  int async;           // defer debug, info and warn messages to the drainer
+  size_t ring_records; // records of each thread's ring, 0 for the default
+  unsigned rate_limit; // messages a second of each rate limited call site,
+                       // 0 for no limit
+  // where the drained messages go instead of zlog, NULL for zlog
+  void (*sink)(LogMode level, const char *message);
+} LogOptions;
+
+typedef struct {
+  unsigned long long logged;     // records written by the drainer
+  unsigned long long dropped;    // records lost to a full ring
+  unsigned long long suppressed; // messages over their rate limit
+} LogStats;
+
+// The rate limit window of one call site, zero initialized
+typedef struct {
+  long window;    // second the count is for
+  unsigned count; // messages of the call site in that second
+} LogRateLimit;
+
+/**
+ * Configures asynchronous logging and rate limiting, before or after LOG_INIT
+ * @param options Options to use, copied
+ */
+void LOG_CONFIGURE(const LogOptions *options);
+
+/**
+ * Writes the records waiting in the rings, returns once they are written
+ */
+void LOG_FLUSH(void);
+
 /**
- * Initializes the logging facilities
+ * Reads the counters of the asynchronous logging and rate limiting
+ * @param stats Filled with the counters
+ */
+void LOG_STATS(LogStats *stats);
+
+/**
+ * Counts one message of a rate limited call site
+ * @param limit Window of the call site
+ * @returns 1 if the message may be logged, 0 if it is over the limit
+ */
+int LOG_RATE_ALLOW(LogRateLimit *limit);
+
+#define LOG_RATELIMITED(enabled, log, ...)                                     \
+  do {                                                                         \
+    static LogRateLimit log_rate_limit_;                                       \
+    if (enabled() && LOG_RATE_ALLOW(&log_rate_limit_)) {                       \
+      log(__VA_ARGS__);                                                        \
+    }                                                                          \
+  } while (0)
+
+// Logs a debug message, at most LogOptions.rate_limit a second
+#define DEBUG_MSG_RATELIMITED(...)                                             \
+  LOG_RATELIMITED(DEBUG_ENABLED, DEBUG_MSG, __VA_ARGS__)
+
+// Logs an info message, at most LogOptions.rate_limit a second
+#define INFO_MSG_RATELIMITED(...)                                              \
+  LOG_RATELIMITED(INFO_ENABLED, INFO_MSG, __VA_ARGS__)
+
+// Logs a warning message, at most LogOptions.rate_limit a second
+#define WARN_MSG_RATELIMITED(...)                                              \
+  LOG_RATELIMITED(WARN_ENABLED, WARN_MSG, __VA_ARGS__)
+
+/**
+ * Initializes the logging facilities, or changes their mode once initialized
  */
 void LOG_INIT(LogMode mode);
 
@@ -75,4 +174,66 @@ void INFO_MSG(const char *format, ...);
  */
 void WARN_MSG(const char *format, ...);
 
+/*
+ * ============================================================================
+ * COMPILE-TIME LOG LEVEL
+ * ============================================================================
+ *
+ * The log mode is chosen at runtime, so a disabled message still evaluates
+ * its arguments and makes an indirect call to DROP_MSG. Code compiled with
+ * TG_LOG_LEVEL (make TG_LOG_LEVEL=WARN) drops the messages of the levels
+ * above it entirely: their *_MSG calls compile to nothing, their arguments
+ * aren't evaluated (they are still type checked), and their *_ENABLED() are
+ * the constant 0, so the blocks they guard go too. The levels kept still
+ * follow the log mode given to LOG_INIT.
+ *
+ * Without TG_LOG_LEVEL every level is kept. logdef.c defines every function
+ * whatever the level, for the code built with another one.
+ * ============================================================================
+ */
+
+#define TG_LOG_LEVEL_DISABLED 0 // LOG_DISABLED
+#define TG_LOG_LEVEL_SCREEN 1   // LOG_SCREEN
+#define TG_LOG_LEVEL_ERROR 2    // LOG_ERROR
+#define TG_LOG_LEVEL_WARN 3     // LOG_WARN
+#define TG_LOG_LEVEL_INFO 4     // LOG_INFO
+#define TG_LOG_LEVEL_DEBUG 5    // LOG_DEBUG
+
+#ifndef TG_LOG_LEVEL
+#define TG_LOG_LEVEL TG_LOG_LEVEL_DEBUG
+#endif
+
+// A message of a level compiled out, never called
+#define LOG_COMPILED_OUT(log, ...)                                             \
+  do {                                                                         \
+    if (0) {                                                                   \
+      (log)(__VA_ARGS__);                                                      \
+    }                                                                          \
+  } while (0)
+
+#if TG_LOG_LEVEL < TG_LOG_LEVEL_DEBUG
+#define DEBUG_MSG(...) LOG_COMPILED_OUT(DEBUG_MSG, __VA_ARGS__)
+#define DEBUG_ENABLED() 0
+#endif
+
+#if TG_LOG_LEVEL < TG_LOG_LEVEL_INFO
+#define INFO_MSG(...) LOG_COMPILED_OUT(INFO_MSG, __VA_ARGS__)
+#define INFO_ENABLED() 0
+#endif
+
+#if TG_LOG_LEVEL < TG_LOG_LEVEL_WARN
+#define WARN_MSG(...) LOG_COMPILED_OUT(WARN_MSG, __VA_ARGS__)
+#define WARN_ENABLED() 0
+#endif
+
+#if TG_LOG_LEVEL < TG_LOG_LEVEL_ERROR
+#define ERROR_MSG(...) LOG_COMPILED_OUT(ERROR_MSG, __VA_ARGS__)
+#define ERROR_ENABLED() 0
+#endif
+
+#if TG_LOG_LEVEL < TG_LOG_LEVEL_SCREEN
+#define SCREEN_MSG(...) LOG_COMPILED_OUT(SCREEN_MSG, __VA_ARGS__)
+#define SCREEN_ENABLED() 0
+#endif
+
 #endif /*__LOGDEF_H__*/
@@ -0,0 +1,91 @@
+"""
+Anti-Tampering Hash Fan-Out Migration
+Moves the hash files of a local hashes_storage directory between the flat
+layout, <prefix>/<hash>.hash, and the fan-out layout of the hash_fanout
+option, <prefix>/ab/cd/<hash>.hash, with the chunk lists of merkle mode
+"""
+
+import os
+import re
+import sys
+
+MAX_FANOUT = 4  # ANTI_TAMPERING_MAX_HASH_FANOUT of layers/anti_tampering
+# <hex of the file path>.hash, and .hash.chunks in merkle mode
+HASH_FILE = re.compile(r"^([0-9a-f]{8,})\.hash(\.chunks)?$")
+
+
+def hash_files(prefix, max_depth):
+    """Yield the path and name of the hash files up to max_depth levels down,
+    skipping the manifests and anything else that is not a hash file"""
+    for root, dirs, files in os.walk(prefix):
+        depth = (0 if root == prefix else
+                 os.path.relpath(root, prefix).count(os.sep) + 1)
+        if depth >= max_depth:
+            dirs[:] = []
+        for name in files:
+            if HASH_FILE.match(name):
+                yield os.path.join(root, name), name
+
+
+def target_path(prefix, name, fanout):
+    """Path of a hash file name in the layout of fanout levels"""
+    digest = HASH_FILE.match(name).group(1)
+    levels = [digest[2 * i:2 * i + 2] for i in range(fanout)]
+    return os.path.join(prefix, *levels, name)
+
+
+def remove_empty_dirs(prefix):
+    """Remove the fan-out directories the migration emptied"""
+    for root, _dirs, _files in os.walk(prefix, topdown=False):
+        if root != prefix:
+            try:
+                os.rmdir(root)
+            except OSError:
+                pass  # not empty
+
+
+def migrate(prefix, fanout, dry_run=False):
+    """Move every hash file to its path with fanout levels, and return the
+    number moved and the number already in place. A migration that stopped
+    halfway can be run again."""
+    moved = in_place = 0
+    for path, name in list(hash_files(prefix, MAX_FANOUT)):
+        target = target_path(prefix, name, fanout)
+        if path == target:
+            in_place += 1
+            continue
+        if os.path.exists(target):
+            raise ValueError(f"{path}: {target} exists already")
+        if not dry_run:
+            os.makedirs(os.path.dirname(target), mode=0o755, exist_ok=True)
+            # same file system: an atomic rename, the hash is never missing
+            os.rename(path, target)
+        moved += 1
+    if not dry_run:
+        remove_empty_dirs(prefix)
+    return moved, in_place
+
+
+def main():
+    args = [a for a in sys.argv[1:] if a != "--dry-run"]
+    if len(args) != 2 or not args[1].isdigit() or int(args[1]) > MAX_FANOUT:
+        print("Usage: python3 migrate_hash_fanout.py [--dry-run] "
+              f"HASHES_STORAGE FANOUT(0-{MAX_FANOUT})")
+        print("Example: python3 migrate_hash_fanout.py /var/lib/tg/hashes 2")
+        sys.exit(1)
+    prefix, fanout = args[0], int(args[1])
+    if not os.path.isdir(prefix):
+        print(f"{prefix}: not a directory")
+        sys.exit(1)
+    try:
+        moved, in_place = migrate(prefix, fanout, "--dry-run" in sys.argv)
+    except (OSError, ValueError) as e:
+        print(f"Migration stopped: {e}")
+        sys.exit(1)
+    verb = "would be moved" if "--dry-run" in sys.argv else "moved"
+    print(f"✅ {moved} hash files {verb} to hash_fanout = {fanout}, "
+          f"{in_place} already in place")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,517 @@
+"""
+Benchmark Matrix Runner
+Runs every workload of a matrix file on every layer stack of it, mounted
+with the low-level FUSE frontend, and writes one CSV and one JSON with the
+throughput, latency percentiles, CPU per operation and memory of each run
+"""
+
+import csv
+import json
+import math
+import os
+import re
+import shlex
+import shutil
+import signal
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+import tomllib
+from pathlib import Path
+
+ROOT = Path(__file__).resolve().parents[2]
+CLK_TCK = os.sysconf("SC_CLK_TCK")
+
+# Columns of results.csv, one row per measured run
+COLUMNS = ["stack", "workload", "type", "repetition", "duration_s", "ops",
+           "throughput_ops_s", "bandwidth_mib_s", "lat_avg_us", "lat_p50_us",
+           "lat_p99_us", "lat_p999_us", "cpu_us_per_op", "cpu_util",
+           "rss_peak_mib", "rss_end_mib"]
+# Columns averaged over the repetitions in the summary of results.json
+METRICS = COLUMNS[4:]
+
+RUNNER_DEFAULTS = {
+    "repeats": 3,
+    "warmup": 1,
+    "interval": 5,
+    "lowlevel": "bin/examples/fuse/lowlevel",
+    "fuse_options": ["-omax_threads=16", "-oclone_fd"],
+    "mount_point": "/tmp/tg_matrix/mount_point",
+    "backend": "/tmp/tg_matrix/backend_data",
+    "lib_data": "/tmp/tg_matrix/lib_data",
+    "output": "matrix_results",
+    "mount_timeout": 30,
+}
+
+
+def fail(message):
+    print(f"Error: {message}", file=sys.stderr)
+    sys.exit(1)
+
+
+def log(message):
+    print(f"[{time.strftime('%H:%M:%S')}] {message}", flush=True)
+
+
+def command(value):
+    """Command of a binary option, given as a string or a list"""
+    return shlex.split(value) if isinstance(value, str) else list(value)
+
+
+def load_matrix(path):
+    """Read a matrix file, resolving the paths it gives relative to it"""
+    with open(path, "rb") as f:
+        matrix = tomllib.load(f)
+    base = path.parent
+    given = matrix.get("runner", {})
+    runner = {**RUNNER_DEFAULTS, **given}
+    # the default binary is the one make examples/fuse/build links
+    runner["lowlevel"] = ((base if "lowlevel" in given else ROOT) /
+                          runner["lowlevel"]).resolve()
+    runner["output"] = Path(runner["output"]).resolve()
+    for key in ("mount_point", "backend", "lib_data"):
+        runner[key] = Path(runner[key]).resolve()
+    if runner["repeats"] < 1 or runner["warmup"] < 0:
+        fail("runner.repeats must be > 0 and runner.warmup >= 0")
+    if runner["mount_point"] == runner["backend"]:
+        fail("runner.mount_point and runner.backend must differ")
+
+    stacks = matrix.get("stack", [])
+    workloads = matrix.get("workload", [])
+    if not stacks or not workloads:
+        fail(f"{path}: needs at least one [[stack]] and one [[workload]]")
+    for stack in stacks:
+        if "name" not in stack or "config" not in stack:
+            fail("each [[stack]] needs a name and a config")
+        stack["config"] = (base / stack["config"]).resolve()
+        if not stack["config"].is_file():
+            fail(f"config of stack {stack['name']} not found: "
+                 f"{stack['config']}")
+    for workload in workloads:
+        if "name" not in workload or workload.get("type") not in WORKLOADS:
+            fail("each [[workload]] needs a name and a type among "
+                 f"{', '.join(WORKLOADS)}")
+        if workload["type"] == "filebench":
+            workload["file"] = (base / workload["file"]).resolve()
+            if not workload["file"].is_file():
+                fail(f"workload file not found: {workload['file']}")
+        if workload["type"] == "pgbench" and "postgres_bin" not in workload:
+            fail(f"pgbench workload {workload['name']} needs postgres_bin")
+    names = [s["name"] for s in stacks] + [w["name"] for w in workloads]
+    if any(not re.fullmatch(r"[A-Za-z0-9_.-]+", n) for n in names):
+        fail("stack and workload names may only hold letters, digits, "
+             "'_', '.' and '-'")
+    return runner, stacks, workloads
+
+
+def clean_dir(path):
+    """Empty a directory the runner owns, refusing obviously shared ones"""
+    path = Path(path).resolve()
+    if path in (Path("/"), Path("/tmp"), Path("/home"), Path("/root"),
+                Path.home(), ROOT) or len(path.parts) < 3:
+        fail(f"refusing to clean {path}")
+    shutil.rmtree(path, ignore_errors=True)
+    path.mkdir(parents=True)
+
+
+# ---------------------------------------------------------------------------
+# Daemon of a stack
+# ---------------------------------------------------------------------------
+
+def proc_cpu_seconds(pid):
+    """User and system time of a process so far"""
+    with open(f"/proc/{pid}/stat") as f:
+        fields = f.read().rsplit(")", 1)[1].split()
+    # utime and stime are the 14th and 15th fields, after "pid (comm)"
+    return (int(fields[11]) + int(fields[12])) / CLK_TCK
+
+
+def proc_memory_mib(pid):
+    """Peak and current resident memory of a process"""
+    values = {}
+    with open(f"/proc/{pid}/status") as f:
+        for line in f:
+            key, _, value = line.partition(":")
+            if key in ("VmHWM", "VmRSS"):
+                values[key] = int(value.split()[0]) / 1024
+    return values.get("VmHWM"), values.get("VmRSS")
+
+
+def reset_peak_rss(pid):
+    """Restart the VmHWM of a process from its current RSS (Linux 4.0+)"""
+    try:
+        with open(f"/proc/{pid}/clear_refs", "w") as f:
+            f.write("5")
+    except OSError:
+        pass  # the peak then covers the runs before too
+
+
+class Daemon:
+    """Low-level FUSE frontend serving a stack on the mount point"""
+
+    def __init__(self, runner, stack, log_path):
+        self.runner = runner
+        self.mount_point = runner["mount_point"]
+        clean_dir(runner["backend"])
+        self.mount_point.mkdir(parents=True, exist_ok=True)
+        if os.path.ismount(self.mount_point):
+            fail(f"{self.mount_point} is already mounted")
+        cmd = [str(runner["lowlevel"]), str(self.mount_point),
+               "--config", str(stack["config"]),
+               f"-osource={runner['backend']}",
+               *runner["fuse_options"], *stack.get("fuse_options", []), "-f"]
+        env = dict(os.environ)
+        env["LD_LIBRARY_PATH"] = ":".join(
+            filter(None, [str(ROOT / "build" / "lib"),
+                          env.get("LD_LIBRARY_PATH")]))
+        self.log = open(log_path, "w")
+        # from the root, as the Makefile runs it, for relative paths in
+        # the configs
+        self.proc = subprocess.Popen(cmd, cwd=ROOT, env=env, stdout=self.log,
+                                     stderr=subprocess.STDOUT)
+        deadline = time.monotonic() + runner["mount_timeout"]
+        while not os.path.ismount(self.mount_point):
+            if self.proc.poll() is not None or time.monotonic() > deadline:
+                self.stop()
+                fail(f"stack {stack['name']} did not mount, see {log_path}")
+            time.sleep(0.1)
+
+    @property
+    def pid(self):
+        return self.proc.pid
+
+    def stop(self):
+        if os.path.ismount(self.mount_point):
+            subprocess.run(["fusermount3", "-u", "-z", str(self.mount_point)],
+                           check=False)
+        if self.proc.poll() is None:
+            self.proc.send_signal(signal.SIGTERM)
+            try:
+                self.proc.wait(timeout=60)
+            except subprocess.TimeoutExpired:
+                self.proc.kill()
+                self.proc.wait()
+        self.log.close()
+
+
+# ---------------------------------------------------------------------------
+# Workloads: prepare once per stack, run, parse the output
+# ---------------------------------------------------------------------------
+
+def run_logged(cmd, log_path, cwd=None):
+    """Run a command with its output in log_path, returning its output and
+    resource usage"""
+    with open(log_path, "w") as out:
+        proc = subprocess.Popen(cmd, cwd=cwd, stdout=out,
+                                stderr=subprocess.STDOUT)
+        _, status, usage = os.wait4(proc.pid, 0)
+        proc.returncode = os.waitstatus_to_exitcode(status)
+    output = Path(log_path).read_text(errors="replace")
+    if proc.returncode != 0:
+        raise RuntimeError(f"{shlex.join(cmd)} exited with {proc.returncode}, "
+                           f"see {log_path}")
+    return output, usage
+
+
+class Filebench:
+    """Filebench .f file, with its $dir on the mount"""
+
+    IO_SUMMARY = re.compile(
+        r"IO Summary:\s*(\d+)\s*ops\s*([0-9.]+)\s*ops/s\s*\d+/\d+\s*rd/wr"
+        r"\s*([0-9.]+)mb/s\s*([0-9.]+)ms/op")
+
+    def __init__(self, workload, work_dir, log_dir, stack, runner):
+        self.cmd = command(workload.get("filebench", "filebench"))
+        self.work_dir = work_dir
+        variables = {"dir": str(work_dir), **workload.get("vars", {})}
+        text = workload["file"].read_text()
+        for name, value in variables.items():
+            text, n = re.subn(rf"^(\s*set\s+\${re.escape(name)}\s*=).*$",
+                              lambda m, v=value: f"{m.group(1)}{v}", text,
+                              flags=re.MULTILINE)
+            if n == 0:
+                text = f"set ${name}={value}\n" + text
+        self.file = log_dir / workload["file"].name
+        self.file.write_text(text)
+
+    def run(self, log_path):
+        # each run starts from a new fileset, as filebench_repeats.sh does
+        clean_dir(self.work_dir)
+        output, usage = run_logged([*self.cmd, "-f", str(self.file)],
+                                   log_path)
+        match = self.IO_SUMMARY.search(output)
+        if not match:
+            raise RuntimeError(f"no IO Summary in {log_path}")
+        ops, ops_s, mb_s, ms_op = match.groups()
+        return {"ops": int(ops), "throughput_ops_s": float(ops_s),
+                "bandwidth_mib_s": float(mb_s),
+                "lat_avg_us": float(ms_op) * 1000}, usage
+
+    def finish(self):
+        pass
+
+
+class IoBench:
+    """io_bench load on a file of the mount, or on the stack loaded in
+    process with ioengine = "lib\""""
+
+    def __init__(self, workload, work_dir, log_dir, stack, runner):
+        self.cmd = command(workload.get(
+            "io_bench", str(ROOT / "scripts" / "compression" / "io_bench")))
+        args = list(workload.get("args", []))
+        self.in_process = workload.get("ioengine", "posix") == "lib"
+        if self.in_process:
+            args += ["--ioengine=lib",
+                     f"--lib={ROOT / 'build' / 'lib' / 'libmodular.so'}",
+                     f"--config={stack['config']}"]
+            # the stack is loaded in process, not reached through the mount
+            work_dir = runner["lib_data"] / workload["name"]
+        self.args = args
+        self.work_dir = work_dir
+        clean_dir(work_dir)
+
+    def run(self, log_path):
+        output, usage = run_logged(
+            [*self.cmd, "load", *self.args, str(self.work_dir / "io_bench")],
+            log_path, cwd=ROOT)
+        values = {}
+        for line in output.splitlines():
+            key, sep, value = line.partition(":")
+            if sep and key.isupper() and key != "LOAD":
+                values[key] = float(value)
+        dirs = [d for d in ("READ", "WRITE") if f"{d}_OPS" in values]
+        if not dirs:
+            raise RuntimeError(f"no READ_OPS nor WRITE_OPS in {log_path}")
+        ops = sum(values[f"{d}_OPS"] for d in dirs)
+        result = {
+            "ops": int(ops),
+            "throughput_ops_s": sum(values[f"{d}_IOPS"] for d in dirs),
+            "bandwidth_mib_s": sum(values[f"{d}_BW_MIBS"] for d in dirs),
+            "lat_avg_us": sum(values[f"{d}_LAT_AVG_US"] * values[f"{d}_OPS"]
+                              for d in dirs) / ops if ops else None,
+        }
+        # the worse of the two directions
+        for p in ("P50", "P99", "P999"):
+            got = [values[f"{d}_LAT_{p}_US"] for d in dirs
+                   if f"{d}_LAT_{p}_US" in values]
+            result[f"lat_{p.lower()}_us"] = max(got) if got else None
+        return result, usage
+
+    def finish(self):
+        pass
+
+
+class Pgbench:
+    """pgbench on a cluster whose data directory is on the mount"""
+
+    TPS = re.compile(r"^tps = ([0-9.]+)", re.MULTILINE)
+    TRANSACTIONS = re.compile(r"actually processed: (\d+)")
+    LATENCY = re.compile(r"latency average = ([0-9.]+) ms")
+
+    def __init__(self, workload, work_dir, log_dir, stack, runner):
+        bin_dir = Path(workload["postgres_bin"])
+        self.pgbench = command(workload.get("pgbench", str(bin_dir /
+                                                           "pgbench")))
+        self.pg_ctl = str(bin_dir / "pg_ctl")
+        self.data_dir = work_dir / "pgdata"
+        # sockets don't belong on the mount, and their paths are short
+        self.socket_dir = Path(tempfile.mkdtemp(prefix="tg_pg"))
+        port = str(workload.get("port", 5433))
+        self.conn = ["-h", str(self.socket_dir), "-p", port]
+        self.args = ["-c", str(workload.get("clients", 10)),
+                     "-j", str(workload.get("jobs", 2)),
+                     "-T", str(workload.get("duration", 60))]
+        if workload.get("read_only", True):
+            self.args.append("-S")
+        self.args += workload.get("args", [])
+        self.db = workload.get("database", "postgres")
+
+        clean_dir(work_dir)
+        run_logged([str(bin_dir / "initdb"), "-D", str(self.data_dir),
+                    "-A", "trust"], log_dir / "initdb.log")
+        run_logged([self.pg_ctl, "-D", str(self.data_dir), "-w",
+                    "-l", str(log_dir / "postgres.log"),
+                    "-o", f"-p {port} -k {self.socket_dir} "
+                          "-c listen_addresses=''", "start"],
+                   log_dir / "pg_ctl_start.log")
+        run_logged([*self.pgbench, *self.conn, "-i",
+                    "-s", str(workload.get("scale", 50)), self.db],
+                   log_dir / "pgbench_init.log")
+
+    def run(self, log_path):
+        prefix = self.socket_dir / "txn"
+        for old in self.socket_dir.glob("txn.*"):
+            old.unlink()
+        output, usage = run_logged(
+            [*self.pgbench, *self.conn, *self.args, "-l",
+             f"--log-prefix={prefix}", self.db], log_path)
+        tps = self.TPS.search(output)
+        txns = self.TRANSACTIONS.search(output)
+        if not tps or not txns:
+            raise RuntimeError(f"no tps in {log_path}")
+        result = {"ops": int(txns.group(1)),
+                  "throughput_ops_s": float(tps.group(1))}
+        latency = self.LATENCY.search(output)
+        if latency:
+            result["lat_avg_us"] = float(latency.group(1)) * 1000
+        # per-transaction logs: client, transaction, latency (us), ...
+        latencies = []
+        for path in self.socket_dir.glob("txn.*"):
+            with open(path) as f:
+                latencies += [int(line.split()[2]) for line in f]
+            path.unlink()
+        latencies.sort()
+        for name, q in (("p50", 0.50), ("p99", 0.99), ("p999", 0.999)):
+            result[f"lat_{name}_us"] = percentile(latencies, q)
+        return result, usage
+
+    def finish(self):
+        subprocess.run([self.pg_ctl, "-D", str(self.data_dir), "-m", "fast",
+                        "-w", "stop"], stdout=subprocess.DEVNULL, check=False)
+        shutil.rmtree(self.socket_dir, ignore_errors=True)
+
+
+WORKLOADS = {"filebench": Filebench, "io_bench": IoBench, "pgbench": Pgbench}
+
+
+def percentile(values, q):
+    """Nearest-rank percentile of sorted values"""
+    if not values:
+        return None
+    return float(values[min(len(values) - 1,
+                            max(0, math.ceil(q * len(values)) - 1))])
+
+
+# ---------------------------------------------------------------------------
+# Matrix
+# ---------------------------------------------------------------------------
+
+def measure(bench, daemon, log_path):
+    """One run of a workload, with the CPU and memory of the stack"""
+    reset_peak_rss(daemon.pid)
+    cpu_before = proc_cpu_seconds(daemon.pid)
+    start = time.monotonic()
+    result, usage = bench.run(log_path)
+    duration = time.monotonic() - start
+    if getattr(bench, "in_process", False):
+        # the stack ran in the benchmark process itself
+        cpu = usage.ru_utime + usage.ru_stime
+        peak, end = usage.ru_maxrss / 1024, None
+    else:
+        cpu = proc_cpu_seconds(daemon.pid) - cpu_before
+        peak, end = proc_memory_mib(daemon.pid)
+    ops = result.get("ops") or 0
+    result.update({
+        "duration_s": duration,
+        "cpu_us_per_op": cpu * 1e6 / ops if ops else None,
+        "cpu_util": cpu / duration if duration > 0 else None,
+        "rss_peak_mib": peak,
+        "rss_end_mib": end,
+    })
+    return result
+
+
+def summarize(rows):
+    """Mean and standard deviation of each metric per stack and workload"""
+    groups = {}
+    for row in rows:
+        groups.setdefault((row["stack"], row["workload"]), []).append(row)
+    summary = []
+    for (stack, workload), runs in groups.items():
+        entry = {"stack": stack, "workload": workload,
+                 "type": runs[0]["type"], "repetitions": len(runs)}
+        for metric in METRICS:
+            values = [r[metric] for r in runs if r.get(metric) is not None]
+            entry[metric] = statistics.fmean(values) if values else None
+            entry[f"{metric}_stdev"] = (statistics.stdev(values)
+                                        if len(values) > 1 else None)
+        summary.append(entry)
+    return summary
+
+
+def write_results(runner, rows):
+    output = runner["output"]
+    with open(output / "results.csv", "w", newline="") as f:
+        writer = csv.DictWriter(f, fieldnames=COLUMNS, extrasaction="ignore")
+        writer.writeheader()
+        for row in rows:
+            writer.writerow({k: "" if row.get(k) is None else row[k]
+                             for k in COLUMNS})
+    with open(output / "results.json", "w") as f:
+        json.dump({"runner": {k: str(v) if isinstance(v, Path) else v
+                              for k, v in runner.items()},
+                   "runs": rows, "summary": summarize(rows)}, f, indent=2)
+
+
+def run_matrix(runner, stacks, workloads):
+    output = runner["output"]
+    output.mkdir(parents=True, exist_ok=True)
+    rows = []
+    failures = 0
+    for stack in stacks:
+        log_dir = output / "logs" / stack["name"]
+        log_dir.mkdir(parents=True, exist_ok=True)
+        log(f"Mounting stack {stack['name']} ({stack['config']})")
+        daemon = Daemon(runner, stack, log_dir / "daemon.log")
+        try:
+            for workload in workloads:
+                name = workload["name"]
+                work_dir = runner["mount_point"] / name
+                wl_dir = log_dir / name
+                wl_dir.mkdir(exist_ok=True)
+                try:
+                    bench = WORKLOADS[workload["type"]](workload, work_dir,
+                                                        wl_dir, stack, runner)
+                except (RuntimeError, OSError) as e:
+                    log(f"  {name}: setup failed: {e}")
+                    failures += 1
+                    continue
+                runs = ([("warmup", i) for i in range(1, runner["warmup"] + 1)]
+                        + [("run", i) for i in range(1, runner["repeats"] + 1)])
+                try:
+                    for kind, i in runs:
+                        log_path = wl_dir / f"{kind}_{i:03d}.log"
+                        try:
+                            result = measure(bench, daemon, log_path)
+                        except (RuntimeError, OSError) as e:
+                            log(f"  {name} {kind} {i}: {e}")
+                            failures += 1
+                            continue
+                        if kind == "run":
+                            rows.append({"stack": stack["name"],
+                                         "workload": name,
+                                         "type": workload["type"],
+                                         "repetition": i, **result})
+                            log(f"  {name} run {i}/{runner['repeats']}: "
+                                f"{result['throughput_ops_s']:.1f} ops/s")
+                        else:
+                            log(f"  {name} warm-up {i} done")
+                        time.sleep(runner["interval"])
+                finally:
+                    bench.finish()
+                    shutil.rmtree(bench.work_dir, ignore_errors=True)
+                # written as they come, so that an interrupted matrix keeps
+                # the runs done
+                write_results(runner, rows)
+        finally:
+            daemon.stop()
+    write_results(runner, rows)
+    log(f"Results in {output / 'results.csv'} and {output / 'results.json'}")
+    return failures
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("Usage: python3 matrix_bench.py <matrix.toml>")
+        print("Example: python3 matrix_bench.py matrix.example.toml")
+        sys.exit(1)
+    runner, stacks, workloads = load_matrix(Path(sys.argv[1]).resolve())
+    if not runner["lowlevel"].is_file():
+        fail(f"{runner['lowlevel']} not found, run make examples/fuse/build")
+    sys.exit(1 if run_matrix(runner, stacks, workloads) else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,96 @@
+"""
+Benchmark Trace Conversion
+Converts the trace files of benchmark layers in trace mode to the Chrome
+trace format, which chrome://tracing and https://ui.perfetto.dev open
+"""
+
+import json
+import struct
+import sys
+
+MAGIC = b"TGTRACE\0"
+VERSION = 1
+# BenchmarkTraceHeader and BenchmarkTraceRecord of layers/benchmark/benchmark.h
+HEADER = struct.Struct("=8sIIQQII64s")
+RECORD = struct.Struct("=QQQqQqiIH6x")
+# BenchmarkTraceOp
+OPS = ["pread", "pwrite", "open", "close", "ftruncate", "fstat", "lstat",
+       "unlink"]
+
+
+def read_trace(path):
+    """Read the header and the records of a trace file"""
+    with open(path, "rb") as f:
+        data = f.read()
+    if len(data) < HEADER.size:
+        raise ValueError(f"{path}: too short for a trace")
+    (magic, version, record_size, records, lost, sample, pid,
+     layer) = HEADER.unpack_from(data)
+    if magic != MAGIC or version != VERSION or record_size != RECORD.size:
+        raise ValueError(f"{path}: not a version {VERSION} benchmark trace")
+    if len(data) < HEADER.size + records * RECORD.size:
+        raise ValueError(f"{path}: truncated")
+    header = {
+        "layer": layer.split(b"\0", 1)[0].decode(errors="replace"),
+        "records": records,
+        "lost": lost,
+        "sample": sample,
+        "pid": pid,
+    }
+    return header, RECORD.iter_unpack(
+        data[HEADER.size:HEADER.size + records * RECORD.size])
+
+
+def convert(paths):
+    """Build the Chrome trace of the files, one process track per layer"""
+    events = []
+    for track, path in enumerate(paths, start=1):
+        header, records = read_trace(path)
+        name = header["layer"]
+        if header["sample"] > 1:
+            name += f" (1/{header['sample']} sampled)"
+        events.append({"name": "process_name", "ph": "M", "pid": track,
+                       "args": {"name": name}})
+        events.append({"name": "process_sort_index", "ph": "M", "pid": track,
+                       "args": {"sort_index": track}})
+        for (_seq, start_ns, dur_ns, offset, size, result, fd, tid,
+             op) in records:
+            args = {"fd": fd, "result": result}
+            if offset >= 0:
+                args["offset"] = offset
+            if size:
+                args["size"] = size
+            events.append({
+                "name": OPS[op] if op < len(OPS) else f"op{op}",
+                "cat": header["layer"],
+                "ph": "X",
+                "ts": start_ns / 1000.0,
+                "dur": dur_ns / 1000.0,
+                "pid": track,
+                "tid": tid,
+                "args": args,
+            })
+        if header["lost"]:
+            print(f"{path}: {header['lost']} calls overwritten before the "
+                  f"dump", file=sys.stderr)
+    return {"traceEvents": events, "displayTimeUnit": "ns"}
+
+
+def main():
+    if len(sys.argv) < 3:
+        print("Usage: python3 trace_to_chrome.py OUTPUT.json TRACE...")
+        print("Example: python3 trace_to_chrome.py trace.json top.tgtrace "
+              "storage.tgtrace")
+        sys.exit(1)
+    try:
+        trace = convert(sys.argv[2:])
+    except (OSError, ValueError) as e:
+        print(f"Invalid trace: {e}")
+        sys.exit(1)
+    with open(sys.argv[1], "w") as f:
+        json.dump(trace, f)
+    print(f"✅ {len(trace['traceEvents'])} events written to {sys.argv[1]}")
+
+
+if __name__ == "__main__":
+    main()
@@ -320,7 +320,7 @@ IO_BENCH_BIN="$PROJECT_ROOT/scripts/compression/io_bench"
 compile_io_bench() {
     log "Compiling io_bench helper..."
     cd "$PROJECT_ROOT"
-    gcc -O2 -o "$IO_BENCH_BIN" "scripts/compression/io_bench.c" || error "Failed to compile io_bench.c"
+    gcc -O2 -pthread -o "$IO_BENCH_BIN" "scripts/compression/io_bench.c" -ldl -lrt || error "Failed to compile io_bench.c"
     if [ ! -x "$IO_BENCH_BIN" ]; then
         error "io_bench binary not found after compile: $IO_BENCH_BIN"
     fi
@@ -1,18 +1,67 @@
 #define _GNU_SOURCE
+#include "../../shared/types/layer_context.h"
+#include <aio.h>
+#include <ctype.h>
+#include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
 #define BUF_SIZE (1 << 18) // 256 KiB
 
+/*
+ * ============================================================================
+ * IO_BENCH - FILE COPY TIMINGS AND A LOAD GENERATOR
+ * ============================================================================
+ *
+ * write, read and full time a streaming copy of one file, for
+ * compression_benchmark.sh (WRITE_TIME_SEC and READ_TIME_SEC lines).
+ *
+ * load is a small fio: threads (--numjobs) issue reads and writes of one
+ * file each for --runtime seconds, and the IOPS, bandwidth and latency
+ * percentiles of each direction are printed as KEY:VALUE lines. The options
+ * have the names and meaning of their fio counterparts, so that
+ *
+ *   io_bench load --rw=randrw --rwmixread=70 --bs=4k --iodepth=8 \
+ *                 --numjobs=4 --size=1g --runtime=30 /mnt/tg/f
+ *   fio --name=f --filename=/mnt/tg/f --rw=randrw --rwmixread=70 --bs=4k \
+ *       --iodepth=8 --numjobs=4 --size=1g --runtime=30 --time_based \
+ *       --ioengine=posixaio
+ *
+ * run the same workload. The engine is either
+ *
+ * - posix: pread/pwrite of the path, a file of a FUSE mount of the library
+ *   (examples/fuse) or of any file system, or of the library under the
+ *   LD_PRELOAD wrapper; with an iodepth above 1, POSIX AIO keeps that many
+ *   requests in flight per thread, as fio's posixaio engine does
+ * - lib: libpread/libpwrite of the stack of --config, with libmodular.so
+ *   loaded at run time (--lib) so that io_bench still builds on its own; with
+ *   an iodepth above 1, layer_pread_async/layer_pwrite_async
+ *
+ * Latencies are from submission to completion, of the operations completed
+ * after --ramp_time, kept in log-linear buckets (16 per power of two, so a
+ * percentile is within 1/16 of the true value).
+ * ============================================================================
+ */
+
+#define HIST_SUB 16     // buckets per power of two
+#define HIST_BUCKETS 1024
+#define MAX_BSSPLIT 16
+#define LAYOUT_CHUNK (1 << 20)
+
 static double timespec_diff_sec(struct timespec a, struct timespec b) {
   return (double)(b.tv_sec - a.tv_sec) + (double)(b.tv_nsec - a.tv_nsec) / 1e9;
 }
 
-static void kill(const char *msg) {
+static void die(const char *msg) {
   perror(msg);
   exit(1);
 }
@@ -20,24 +69,24 @@ static void kill(const char *msg) {
 static void do_write_only(const char *src, const char *dst, double *write_sec) {
   int in_fd = open(src, O_RDONLY);
   if (in_fd < 0)
-    kill("open src");
+    die("open src");
 
   int out_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
   if (out_fd < 0)
-    kill("open dst");
+    die("open dst");
 
   char *buf = malloc(BUF_SIZE);
   if (!buf)
-    kill("malloc");
+    die("malloc");
 
   struct timespec t1, t2;
   if (clock_gettime(CLOCK_MONOTONIC, &t1) != 0)
-    kill("clock_gettime");
+    die("clock_gettime");
 
   for (;;) {
     ssize_t r = read(in_fd, buf, BUF_SIZE);
     if (r < 0)
-      kill("read");
+      die("read");
     if (r == 0)
       break;
     char *p = buf;
@@ -45,17 +94,17 @@ static void do_write_only(const char *src, const char *dst, double *write_sec) {
     while (left > 0) {
       ssize_t w = write(out_fd, p, left);
       if (w < 0)
-        kill("write");
+        die("write");
       left -= w;
       p += w;
     }
   }
 
   if (fsync(out_fd) != 0)
-    kill("fsync");
+    die("fsync");
 
   if (clock_gettime(CLOCK_MONOTONIC, &t2) != 0)
-    kill("clock_gettime");
+    die("clock_gettime");
 
   if (write_sec)
     *write_sec = timespec_diff_sec(t1, t2);
@@ -68,26 +117,26 @@ static void do_write_only(const char *src, const char *dst, double *write_sec) {
 static void do_read_only(const char *path, double *read_sec) {
   int fd = open(path, O_RDONLY);
   if (fd < 0)
-    kill("open read");
+    die("open read");
 
   char *buf = malloc(BUF_SIZE);
   if (!buf)
-    kill("malloc");
+    die("malloc");
 
   struct timespec t1, t2;
   if (clock_gettime(CLOCK_MONOTONIC, &t1) != 0)
-    kill("clock_gettime");
+    die("clock_gettime");
 
   for (;;) {
     ssize_t r = read(fd, buf, BUF_SIZE);
     if (r < 0)
-      kill("read");
+      die("read");
     if (r == 0)
       break;
   }
 
   if (clock_gettime(CLOCK_MONOTONIC, &t2) != 0)
-    kill("clock_gettime");
+    die("clock_gettime");
 
   if (read_sec)
     *read_sec = timespec_diff_sec(t1, t2);
@@ -96,6 +145,667 @@ static void do_read_only(const char *path, double *read_sec) {
   close(fd);
 }
 
+/* ==== load ==== */
+
+typedef struct {
+  size_t bs;
+  int pct;
+} BsSplit;
+
+typedef struct {
+  int reads, writes;    // directions of --rw
+  int rwmixread;        // % of reads of a mixed workload
+  int percentage_random;
+  BsSplit bssplit[MAX_BSSPLIT];
+  int nbssplit;
+  size_t max_bs;
+  int numjobs;
+  int iodepth;
+  off_t size;           // of the file of each job
+  double runtime;
+  double ramp_time;
+  int compress_pct;     // % of zeros in the written buffers
+  int direct;
+  unsigned long seed;
+  const char *engine;
+  const char *lib;
+  const char *config;
+  const char *path;
+} LoadOptions;
+
+typedef struct {
+  uint64_t ops;
+  uint64_t bytes;
+  uint64_t lat_sum;     // ns
+  uint64_t lat_max;     // ns
+  uint64_t hist[HIST_BUCKETS];
+} DirStats;
+
+typedef struct Job Job;
+
+typedef struct {
+  Job *job;
+  unsigned char *buf;
+  size_t len;
+  off_t off;
+  int write;
+  uint64_t start;
+  ssize_t res;
+  struct aiocb cb;      // posix engine
+} Slot;
+
+struct Job {
+  int index;
+  int fd;
+  uint64_t rng;
+  off_t cursor;         // of sequential operations
+  Slot *slots;
+  int inflight;
+  // completions of the lib engine, from the callbacks
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int *done;
+  int ndone;
+  DirStats stats[2];    // reads, writes
+  pthread_t thread;
+};
+
+static LoadOptions opt;
+static pthread_barrier_t start_barrier;
+static uint64_t measure_start, measure_end;
+
+// lib engine, resolved from --lib
+static LayerContext lroot;
+static LayerContext (*lib_init)(const char *config_path);
+static void (*lib_destroy)(LayerContext lroot);
+static int (*lib_open)(const char *pathname, int flags, mode_t mode,
+                       LayerContext lroot);
+static int (*lib_close)(int fd, LayerContext lroot);
+static int (*lib_fstat)(int fd, struct stat *stbuf, LayerContext lroot);
+static ssize_t (*lib_pread)(int fd, void *buffer, size_t nbyte, off_t offset,
+                            LayerContext lroot);
+static ssize_t (*lib_pwrite)(int fd, const void *buffer, size_t nbyte,
+                             off_t offset, LayerContext lroot);
+static int (*lib_pread_async)(int fd, void *buffer, size_t nbyte, off_t offset,
+                              LayerIoCallback callback, void *ctx,
+                              LayerContext l);
+static int (*lib_pwrite_async)(int fd, const void *buffer, size_t nbyte,
+                               off_t offset, LayerIoCallback callback,
+                               void *ctx, LayerContext l);
+static int use_lib;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t rng_next(uint64_t *state) {
+  // xorshift64*
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1Dull;
+}
+
+static int hist_index(uint64_t v) {
+  if (v < 2 * HIST_SUB)
+    return (int)v;
+  int msb = 63 - __builtin_clzll(v);
+  return (msb - 3) * HIST_SUB + (int)((v >> (msb - 4)) & (HIST_SUB - 1));
+}
+
+// Middle of bucket i
+static uint64_t hist_value(int i) {
+  if (i < 2 * HIST_SUB)
+    return (uint64_t)i;
+  int shift = i / HIST_SUB - 1;
+  uint64_t lo = (uint64_t)(HIST_SUB + i % HIST_SUB) << shift;
+  return lo + ((1ull << shift) >> 1);
+}
+
+static uint64_t hist_percentile(const DirStats *s, double p) {
+  uint64_t rank = (uint64_t)(p * (double)s->ops + 0.999999);
+  if (rank == 0)
+    rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += s->hist[i];
+    if (seen >= rank)
+      return hist_value(i) < s->lat_max ? hist_value(i) : s->lat_max;
+  }
+  return s->lat_max;
+}
+
+static long long parse_size(const char *s) {
+  char *end;
+  long long v = strtoll(s, &end, 10);
+  const char *units = "kmgt";
+  const char *unit = *end ? strchr(units, tolower((unsigned char)*end)) : NULL;
+  if (unit) {
+    v <<= 10 * (unit - units + 1);
+    end++;
+  }
+  if (end == s || (*end && strcasecmp(end, "b") && strcasecmp(end, "ib")) ||
+      v <= 0) {
+    (void)fprintf(stderr, "invalid size: %s\n", s);
+    exit(1);
+  }
+  return v;
+}
+
+// fio's bssplit: SIZE/PCT:SIZE/PCT..., the sizes without a percentage share
+// what is left of 100
+static void parse_bssplit(const char *s) {
+  char *copy = strdup(s), *save = NULL;
+  int left = 100, unset = 0;
+  opt.nbssplit = 0;
+  for (char *t = strtok_r(copy, ":", &save); t;
+       t = strtok_r(NULL, ":", &save)) {
+    if (opt.nbssplit == MAX_BSSPLIT) {
+      (void)fprintf(stderr, "at most %d block sizes\n", MAX_BSSPLIT);
+      exit(1);
+    }
+    BsSplit *b = &opt.bssplit[opt.nbssplit++];
+    char *slash = strchr(t, '/');
+    b->pct = -1;
+    if (slash) {
+      *slash = '\0';
+      b->pct = atoi(slash + 1);
+      left -= b->pct;
+    } else {
+      unset++;
+    }
+    b->bs = (size_t)parse_size(t);
+  }
+  for (int i = 0; i < opt.nbssplit; i++)
+    if (opt.bssplit[i].pct < 0)
+      opt.bssplit[i].pct = left / unset;
+  free(copy);
+}
+
+static size_t pick_bs(Job *job) {
+  if (opt.nbssplit == 1)
+    return opt.bssplit[0].bs;
+  int r = (int)(rng_next(&job->rng) % 100), sum = 0;
+  for (int i = 0; i < opt.nbssplit; i++) {
+    sum += opt.bssplit[i].pct;
+    if (r < sum)
+      return opt.bssplit[i].bs;
+  }
+  return opt.bssplit[opt.nbssplit - 1].bs;
+}
+
+// The next operation of a job in slot
+static void next_op(Job *job, Slot *slot) {
+  if (opt.reads && opt.writes)
+    slot->write = (int)(rng_next(&job->rng) % 100) >= opt.rwmixread;
+  else
+    slot->write = opt.writes;
+  slot->len = pick_bs(job);
+  if ((int)(rng_next(&job->rng) % 100) < opt.percentage_random) {
+    uint64_t nblocks = (uint64_t)opt.size / slot->len;
+    slot->off = (off_t)((rng_next(&job->rng) % nblocks) * slot->len);
+  } else {
+    if (job->cursor + (off_t)slot->len > opt.size)
+      job->cursor = 0;
+    slot->off = job->cursor;
+    job->cursor += (off_t)slot->len;
+  }
+}
+
+static void fill_buffer(unsigned char *buf, size_t size, uint64_t *rng) {
+  // every 512 bytes, compress_pct % of zeros after random bytes
+  size_t random = 512 - 512 * (size_t)opt.compress_pct / 100;
+  for (size_t i = 0; i < size; i += 8) {
+    uint64_t x = rng_next(rng);
+    memcpy(buf + i, &x, size - i < 8 ? size - i : 8);
+  }
+  for (size_t i = 0; i < size; i += 512)
+    memset(buf + i + random, 0, 512 - random);
+}
+
+static void record(Job *job, Slot *slot, uint64_t end) {
+  if (slot->res < 0 || (slot->write && (size_t)slot->res != slot->len)) {
+    errno = slot->res < 0 ? (int)-slot->res : EIO;
+    die(slot->write ? "pwrite" : "pread");
+  }
+  if (end < measure_start || end > measure_end)
+    return;
+  DirStats *s = &job->stats[slot->write];
+  uint64_t lat = end - slot->start;
+  s->ops++;
+  s->bytes += (uint64_t)slot->res;
+  s->lat_sum += lat;
+  if (lat > s->lat_max)
+    s->lat_max = lat;
+  s->hist[hist_index(lat)]++;
+}
+
+static ssize_t sync_io(Job *job, Slot *slot) {
+  ssize_t res;
+  if (use_lib)
+    res = slot->write ? lib_pwrite(job->fd, slot->buf, slot->len, slot->off,
+                                   lroot)
+                      : lib_pread(job->fd, slot->buf, slot->len, slot->off,
+                                  lroot);
+  else
+    res = slot->write ? pwrite(job->fd, slot->buf, slot->len, slot->off)
+                      : pread(job->fd, slot->buf, slot->len, slot->off);
+  return res < 0 ? -errno : res;
+}
+
+static void lib_done(ssize_t res, void *ctx) {
+  Slot *slot = ctx;
+  Job *job = slot->job;
+  slot->res = res;
+  pthread_mutex_lock(&job->mutex);
+  job->done[job->ndone++] = (int)(slot - job->slots);
+  pthread_cond_signal(&job->cond);
+  pthread_mutex_unlock(&job->mutex);
+}
+
+static void submit(Job *job, Slot *slot) {
+  next_op(job, slot);
+  slot->start = now_ns();
+  int res;
+  if (use_lib) {
+    res = slot->write ? lib_pwrite_async(job->fd, slot->buf, slot->len,
+                                         slot->off, lib_done, slot, lroot)
+                      : lib_pread_async(job->fd, slot->buf, slot->len,
+                                        slot->off, lib_done, slot, lroot);
+  } else {
+    memset(&slot->cb, 0, sizeof(slot->cb));
+    slot->cb.aio_fildes = job->fd;
+    slot->cb.aio_buf = slot->buf;
+    slot->cb.aio_nbytes = slot->len;
+    slot->cb.aio_offset = slot->off;
+    slot->cb.aio_sigevent.sigev_notify = SIGEV_NONE;
+    res = slot->write ? aio_write(&slot->cb) : aio_read(&slot->cb);
+  }
+  if (res != 0)
+    die(slot->write ? "submit write" : "submit read");
+  job->inflight++;
+}
+
+// Wait for completions, their slots go to done; returns how many
+static int reap(Job *job, int *done) {
+  int n = 0;
+  if (use_lib) {
+    pthread_mutex_lock(&job->mutex);
+    while (job->ndone == 0)
+      pthread_cond_wait(&job->cond, &job->mutex);
+    n = job->ndone;
+    memcpy(done, job->done, sizeof(int) * (size_t)n);
+    job->ndone = 0;
+    pthread_mutex_unlock(&job->mutex);
+  } else {
+    const struct aiocb *list[opt.iodepth];
+    int nlist = 0;
+    for (int i = 0; i < opt.iodepth; i++)
+      if (job->slots[i].start)
+        list[nlist++] = &job->slots[i].cb;
+    while (n == 0) {
+      if (aio_suspend(list, nlist, NULL) != 0 && errno != EINTR)
+        die("aio_suspend");
+      for (int i = 0; i < opt.iodepth; i++) {
+        Slot *slot = &job->slots[i];
+        if (!slot->start)
+          continue;
+        int err = aio_error(&slot->cb);
+        if (err == EINPROGRESS)
+          continue;
+        slot->res = aio_return(&slot->cb);
+        if (slot->res < 0)
+          slot->res = -err;
+        done[n++] = i;
+      }
+    }
+  }
+  job->inflight -= n;
+  return n;
+}
+
+static int job_open(const char *path, int flags) {
+  if (use_lib)
+    return lib_open(path, flags, 0644, lroot);
+  return open(path, flags | (opt.direct ? O_DIRECT : 0), 0644);
+}
+
+// Write the file of a job up to --size if it is smaller, before the clock
+static void job_layout(Job *job, unsigned char *buf) {
+  struct stat st;
+  int res = use_lib ? lib_fstat(job->fd, &st, lroot) : fstat(job->fd, &st);
+  if (res != 0)
+    die("fstat");
+  for (off_t off = st.st_size; off < opt.size; off += LAYOUT_CHUNK) {
+    size_t n = opt.size - off < LAYOUT_CHUNK ? (size_t)(opt.size - off)
+                                             : LAYOUT_CHUNK;
+    ssize_t w = use_lib ? lib_pwrite(job->fd, buf, n, off, lroot)
+                        : pwrite(job->fd, buf, n, off);
+    if (w != (ssize_t)n)
+      die("layout");
+  }
+}
+
+static void *job_run(void *arg) {
+  Job *job = arg;
+  char path[4096];
+  if (opt.numjobs > 1)
+    snprintf(path, sizeof(path), "%s.%d", opt.path, job->index);
+  else
+    snprintf(path, sizeof(path), "%s", opt.path);
+  job->fd = job_open(path, O_RDWR | O_CREAT);
+  if (job->fd < 0)
+    die(path);
+
+  size_t bufsize = opt.max_bs > LAYOUT_CHUNK ? opt.max_bs : LAYOUT_CHUNK;
+  unsigned char *layout;
+  if (posix_memalign((void **)&layout, 4096, bufsize) != 0)
+    die("posix_memalign");
+  fill_buffer(layout, bufsize, &job->rng);
+  if (opt.reads)
+    job_layout(job, layout);
+
+  job->slots = calloc((size_t)opt.iodepth, sizeof(Slot));
+  job->done = calloc((size_t)opt.iodepth, sizeof(int));
+  for (int i = 0; i < opt.iodepth; i++) {
+    job->slots[i].job = job;
+    if (posix_memalign((void **)&job->slots[i].buf, 4096, opt.max_bs) != 0)
+      die("posix_memalign");
+    memcpy(job->slots[i].buf, layout, opt.max_bs);
+  }
+  free(layout);
+
+  pthread_barrier_wait(&start_barrier); // laid out
+  pthread_barrier_wait(&start_barrier); // measure_start and measure_end set
+  if (opt.iodepth == 1) {
+    Slot *slot = &job->slots[0];
+    uint64_t t;
+    while ((t = now_ns()) < measure_end) {
+      next_op(job, slot);
+      slot->start = t;
+      slot->res = sync_io(job, slot);
+      record(job, slot, now_ns());
+    }
+  } else {
+    int done[opt.iodepth];
+    for (int i = 0; i < opt.iodepth; i++)
+      submit(job, &job->slots[i]);
+    while (job->inflight > 0) {
+      int n = reap(job, done);
+      uint64_t t = now_ns();
+      for (int i = 0; i < n; i++) {
+        Slot *slot = &job->slots[done[i]];
+        record(job, slot, t);
+        slot->start = 0;
+        if (t < measure_end)
+          submit(job, slot);
+      }
+    }
+  }
+
+  if (use_lib)
+    lib_close(job->fd, lroot);
+  else
+    close(job->fd);
+  for (int i = 0; i < opt.iodepth; i++)
+    free(job->slots[i].buf);
+  free(job->slots);
+  free(job->done);
+  return NULL;
+}
+
+static void *lib_symbol(void *handle, const char *name) {
+  void *sym = dlsym(handle, name);
+  if (!sym) {
+    (void)fprintf(stderr, "%s: %s\n", opt.lib, dlerror());
+    exit(1);
+  }
+  return sym;
+}
+
+static void lib_load(void) {
+  void *handle = dlopen(opt.lib, RTLD_NOW | RTLD_GLOBAL);
+  if (!handle) {
+    (void)fprintf(stderr, "%s\n", dlerror());
+    exit(1);
+  }
+  *(void **)&lib_init = lib_symbol(handle, "libinit");
+  *(void **)&lib_destroy = lib_symbol(handle, "libdestroy");
+  *(void **)&lib_open = lib_symbol(handle, "libopen");
+  *(void **)&lib_close = lib_symbol(handle, "libclose");
+  *(void **)&lib_fstat = lib_symbol(handle, "libfstat");
+  *(void **)&lib_pread = lib_symbol(handle, "libpread");
+  *(void **)&lib_pwrite = lib_symbol(handle, "libpwrite");
+  *(void **)&lib_pread_async = lib_symbol(handle, "layer_pread_async");
+  *(void **)&lib_pwrite_async = lib_symbol(handle, "layer_pwrite_async");
+  lroot = lib_init(opt.config);
+  if (!lroot.ops) {
+    (void)fprintf(stderr, "failed to load %s\n", opt.config);
+    exit(1);
+  }
+}
+
+static void print_stats(const char *dir, const DirStats *s, double seconds) {
+  double avg = s->ops ? (double)s->lat_sum / (double)s->ops : 0.0;
+  printf("%s_OPS:%llu\n", dir, (unsigned long long)s->ops);
+  printf("%s_IOPS:%.1f\n", dir, (double)s->ops / seconds);
+  printf("%s_BW_MIBS:%.3f\n", dir, (double)s->bytes / seconds / 1048576.0);
+  printf("%s_LAT_AVG_US:%.3f\n", dir, avg / 1e3);
+  if (s->ops) {
+    printf("%s_LAT_P50_US:%.3f\n", dir, hist_percentile(s, 0.50) / 1e3);
+    printf("%s_LAT_P99_US:%.3f\n", dir, hist_percentile(s, 0.99) / 1e3);
+    printf("%s_LAT_P999_US:%.3f\n", dir, hist_percentile(s, 0.999) / 1e3);
+  }
+  printf("%s_LAT_MAX_US:%.3f\n", dir, (double)s->lat_max / 1e3);
+}
+
+static void load_usage(const char *prog) {
+  (void)fprintf(stderr,
+      "Usage: %s load [options] <path>\n"
+      "  --rw=read|write|randread|randwrite|rw|randrw   (read)\n"
+      "  --rwmixread=PCT        reads of rw and randrw   (50)\n"
+      "  --percentage_random=PCT random offsets (0, 100 for rand*)\n"
+      "  --bs=SIZE              block size               (4k)\n"
+      "  --bssplit=SIZE/PCT:... mix of block sizes\n"
+      "  --iodepth=N            in flight per job        (1)\n"
+      "  --numjobs=N            threads, one file each   (1)\n"
+      "  --size=SIZE            of the file of each job  (256m)\n"
+      "  --runtime=SEC          measured time            (10)\n"
+      "  --ramp_time=SEC        before the measurement   (0)\n"
+      "  --buffer_compress_percentage=PCT zeros in writes (0)\n"
+      "  --direct               O_DIRECT (posix engine)\n"
+      "  --randseed=N           seed of the offsets      (1)\n"
+      "  --ioengine=posix|lib   system calls or the library (posix)\n"
+      "  --lib=PATH             libmodular.so of the lib engine\n"
+      "                         (build/lib/libmodular.so)\n"
+      "  --config=FILE          stack of the lib engine  (./config.toml)\n",
+      prog);
+  exit(1);
+}
+
+static int do_load(int argc, char **argv) {
+  static const struct option longopts[] = {
+      {"rw", required_argument, NULL, 'w'},
+      {"rwmixread", required_argument, NULL, 'm'},
+      {"percentage_random", required_argument, NULL, 'p'},
+      {"bs", required_argument, NULL, 'b'},
+      {"bssplit", required_argument, NULL, 'B'},
+      {"iodepth", required_argument, NULL, 'q'},
+      {"numjobs", required_argument, NULL, 'j'},
+      {"size", required_argument, NULL, 's'},
+      {"runtime", required_argument, NULL, 't'},
+      {"ramp_time", required_argument, NULL, 'r'},
+      {"buffer_compress_percentage", required_argument, NULL, 'c'},
+      {"direct", no_argument, NULL, 'd'},
+      {"randseed", required_argument, NULL, 'S'},
+      {"ioengine", required_argument, NULL, 'e'},
+      {"lib", required_argument, NULL, 'l'},
+      {"config", required_argument, NULL, 'C'},
+      {NULL, 0, NULL, 0}};
+  const char *rw = "read";
+  const char *bs = "4k";
+  opt.rwmixread = 50;
+  opt.percentage_random = -1;
+  opt.bssplit[0].bs = 4096;
+  opt.bssplit[0].pct = 100;
+  opt.nbssplit = 1;
+  opt.numjobs = 1;
+  opt.iodepth = 1;
+  opt.size = 256 << 20;
+  opt.runtime = 10;
+  opt.seed = 1;
+  opt.engine = "posix";
+  opt.lib = "build/lib/libmodular.so";
+  opt.config = "./config.toml";
+
+  int c;
+  optind = 2; // after the mode
+  while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+    switch (c) {
+    case 'w':
+      rw = optarg;
+      break;
+    case 'm':
+      opt.rwmixread = atoi(optarg);
+      break;
+    case 'p':
+      opt.percentage_random = atoi(optarg);
+      break;
+    case 'b':
+      bs = optarg;
+      opt.bssplit[0].bs = (size_t)parse_size(optarg);
+      opt.bssplit[0].pct = 100;
+      opt.nbssplit = 1;
+      break;
+    case 'B':
+      bs = optarg;
+      parse_bssplit(optarg);
+      break;
+    case 'q':
+      opt.iodepth = atoi(optarg);
+      break;
+    case 'j':
+      opt.numjobs = atoi(optarg);
+      break;
+    case 's':
+      opt.size = (off_t)parse_size(optarg);
+      break;
+    case 't':
+      opt.runtime = atof(optarg);
+      break;
+    case 'r':
+      opt.ramp_time = atof(optarg);
+      break;
+    case 'c':
+      opt.compress_pct = atoi(optarg);
+      break;
+    case 'd':
+      opt.direct = 1;
+      break;
+    case 'S':
+      opt.seed = strtoul(optarg, NULL, 10);
+      break;
+    case 'e':
+      opt.engine = optarg;
+      break;
+    case 'l':
+      opt.lib = optarg;
+      break;
+    case 'C':
+      opt.config = optarg;
+      break;
+    default:
+      load_usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1)
+    load_usage(argv[0]);
+  opt.path = argv[optind];
+
+  int random = strncmp(rw, "rand", 4) == 0;
+  const char *kind = random ? rw + 4 : rw;
+  if (strcmp(kind, "read") == 0)
+    opt.reads = 1;
+  else if (strcmp(kind, "write") == 0)
+    opt.writes = 1;
+  else if (strcmp(kind, "rw") == 0 || strcmp(kind, "readwrite") == 0)
+    opt.reads = opt.writes = 1;
+  else
+    load_usage(argv[0]);
+  if (opt.percentage_random < 0)
+    opt.percentage_random = random ? 100 : 0;
+  for (int i = 0; i < opt.nbssplit; i++)
+    if (opt.bssplit[i].bs > opt.max_bs)
+      opt.max_bs = opt.bssplit[i].bs;
+  if (strcmp(opt.engine, "lib") == 0)
+    use_lib = 1;
+  else if (strcmp(opt.engine, "posix") != 0)
+    load_usage(argv[0]);
+  if (opt.numjobs < 1 || opt.iodepth < 1 || opt.runtime <= 0 ||
+      opt.rwmixread < 0 || opt.rwmixread > 100 ||
+      opt.compress_pct < 0 || opt.compress_pct > 100 ||
+      (off_t)opt.max_bs > opt.size) {
+    (void)fprintf(stderr, "invalid options\n");
+    return 1;
+  }
+  if (use_lib)
+    lib_load();
+
+  Job *jobs = calloc((size_t)opt.numjobs, sizeof(Job));
+  pthread_barrier_init(&start_barrier, NULL, (unsigned)opt.numjobs + 1);
+  for (int i = 0; i < opt.numjobs; i++) {
+    jobs[i].index = i;
+    jobs[i].rng = (opt.seed + (uint64_t)i) * 0x9E3779B97F4A7C15ull | 1;
+    pthread_mutex_init(&jobs[i].mutex, NULL);
+    pthread_cond_init(&jobs[i].cond, NULL);
+    if (pthread_create(&jobs[i].thread, NULL, job_run, &jobs[i]) != 0)
+      die("pthread_create");
+  }
+  // the clock starts once every job laid its file out, the second wait
+  // publishes it to the jobs
+  pthread_barrier_wait(&start_barrier);
+  measure_start = now_ns() + (uint64_t)(opt.ramp_time * 1e9);
+  measure_end = measure_start + (uint64_t)(opt.runtime * 1e9);
+  pthread_barrier_wait(&start_barrier);
+  for (int i = 0; i < opt.numjobs; i++)
+    pthread_join(jobs[i].thread, NULL);
+
+  DirStats total[2];
+  memset(total, 0, sizeof(total));
+  for (int i = 0; i < opt.numjobs; i++) {
+    for (int d = 0; d < 2; d++) {
+      DirStats *s = &jobs[i].stats[d];
+      total[d].ops += s->ops;
+      total[d].bytes += s->bytes;
+      total[d].lat_sum += s->lat_sum;
+      if (s->lat_max > total[d].lat_max)
+        total[d].lat_max = s->lat_max;
+      for (int b = 0; b < HIST_BUCKETS; b++)
+        total[d].hist[b] += s->hist[b];
+    }
+    pthread_mutex_destroy(&jobs[i].mutex);
+    pthread_cond_destroy(&jobs[i].cond);
+  }
+  pthread_barrier_destroy(&start_barrier);
+  free(jobs);
+  if (use_lib)
+    lib_destroy(lroot);
+
+  printf("LOAD:rw=%s rwmixread=%d percentage_random=%d bs=%s numjobs=%d "
+         "iodepth=%d size=%lld runtime=%g ioengine=%s\n",
+         rw, opt.rwmixread, opt.percentage_random, bs, opt.numjobs,
+         opt.iodepth, (long long)opt.size, opt.runtime, opt.engine);
+  if (opt.reads)
+    print_stats("READ", &total[0], opt.runtime);
+  if (opt.writes)
+    print_stats("WRITE", &total[1], opt.runtime);
+  return 0;
+}
+
 int main(int argc, char **argv) {
   if (argc < 2) {
     (void)fprintf(stderr, "Usage: %s <mode> ...\n", argv[0]);
@@ -103,6 +813,7 @@ int main(int argc, char **argv) {
     (void)fprintf(stderr, "  write <src> <dst>\n");
     (void)fprintf(stderr, "  read <dst>\n");
     (void)fprintf(stderr, "  full <src> <dst>\n");
+    (void)fprintf(stderr, "  load [options] <path>\n");
     return 1;
   }
 
@@ -137,6 +848,8 @@ int main(int argc, char **argv) {
     printf("WRITE_TIME_SEC:%.9f\n", w);
     printf("READ_TIME_SEC:%.9f\n", r);
     return 0;
+  } else if (strcmp(mode, "load") == 0) {
+    return do_load(argc, argv);
   } else {
     (void)fprintf(stderr, "Unknown mode: %s\n", mode);
     return 1;
@@ -1,6 +1,8 @@
 """
 Compression Benchmark Visualization
-Generates scatter plots showing compression ratio vs speed trade-offs
+Generates scatter plots showing compression ratio vs speed trade-offs, or
+latency vs throughput trade-offs for the results.csv of
+scripts/benchmark/matrix_bench.py
 """
 
 import pandas as pd
@@ -11,14 +13,18 @@ import sys
 import os
 from pathlib import Path
 
+COMPRESSION_COLUMNS = ['File', 'Config', 'Compression_Ratio', 'Write_Time_s', 'Read_Time_s']
+MATRIX_COLUMNS = ['stack', 'workload', 'throughput_ops_s', 'lat_p99_us', 'cpu_us_per_op', 'rss_peak_mib']
+
 def load_results(csv_path):
-    """Load benchmark results from CSV"""
+    """Load benchmark results from CSV, returning them and their kind"""
     try:
         df = pd.read_csv(csv_path)
-        required_columns = ['File', 'Config', 'Compression_Ratio', 'Write_Time_s', 'Read_Time_s']
-        if not all(col in df.columns for col in required_columns):
-            raise ValueError("Missing required columns")
-        return df
+        if all(col in df.columns for col in COMPRESSION_COLUMNS):
+            return df, 'compression'
+        if all(col in df.columns for col in MATRIX_COLUMNS):
+            return df, 'matrix'
+        raise ValueError("Missing required columns")
     except Exception as e:
         print(f"Invalid CSV format: {e}")
         sys.exit(1)
@@ -173,10 +179,84 @@ def create_summary_plot(df, metric, output_dir):
     
     print(f"Created: {output_file}")
 
+def create_matrix_scatter_plot(df, workload, output_dir):
+    """Create scatter plot for p99 latency vs throughput of each stack"""
+    runs = df[df['workload'] == workload]
+    stats = runs.groupby('stack', sort=False)[['throughput_ops_s', 'lat_p99_us']].agg(['mean', 'std'])
+
+    plt.figure(figsize=(10, 6))
+    colors = plt.cm.tab10(np.linspace(0, 1, max(len(stats), 1)))
+    for color, (stack, row) in zip(colors, stats.iterrows()):
+        # the standard deviation over the repetitions as error bars
+        plt.errorbar(row[('throughput_ops_s', 'mean')], row[('lat_p99_us', 'mean')],
+                     xerr=row[('throughput_ops_s', 'std')], yerr=row[('lat_p99_us', 'std')],
+                     fmt='o', color=color, markersize=8, markeredgecolor='black',
+                     capsize=3, label=stack)
+        plt.annotate(stack, (row[('throughput_ops_s', 'mean')], row[('lat_p99_us', 'mean')]),
+                     xytext=(5, 5), textcoords='offset points', fontsize=8, alpha=0.7)
+
+    plt.xlabel('Throughput (ops/s)')
+    plt.ylabel('p99 Latency (us)')
+    plt.title(f'{workload} - p99 Latency vs Throughput')
+    plt.grid(True, alpha=0.3)
+    plt.legend(bbox_to_anchor=(1.05, 1), loc='upper left')
+    plt.tight_layout()
+
+    output_file = output_dir / f'{workload}_latency_vs_throughput.png'
+    plt.savefig(output_file, dpi=300, bbox_inches='tight')
+    plt.close()
+
+    print(f"Created: {output_file}")
+
+def create_matrix_summary_plot(df, metric, label, output_dir):
+    """Create grouped bar plot of a metric, one group per workload"""
+    means = df.pivot_table(index='workload', columns='stack', values=metric,
+                           aggfunc='mean', sort=False)
+    stds = df.pivot_table(index='workload', columns='stack', values=metric,
+                          aggfunc='std', sort=False)
+    if means.dropna(how='all').empty:
+        print(f"No data found for metric: {metric}")
+        return
+
+    ax = means.plot.bar(yerr=stds, figsize=(14, 8), capsize=3,
+                        edgecolor='black', linewidth=0.5, rot=0)
+    ax.set_xlabel('Workload')
+    ax.set_ylabel(label)
+    ax.set_title(f'All Workloads - {label}')
+    ax.grid(True, axis='y', alpha=0.3)
+    ax.legend(bbox_to_anchor=(1.02, 1), loc='upper left', title='Stacks')
+    plt.tight_layout()
+
+    output_file = output_dir / f'all_workloads_{metric}.png'
+    plt.savefig(output_file, dpi=300, bbox_inches='tight')
+    plt.close()
+
+    print(f"Created: {output_file}")
+
+def create_matrix_plots(df, output_dir):
+    """Create the plots of a matrix_bench.py results.csv"""
+    workloads = df['workload'].unique()
+    print(f"Creating plots for {len(workloads)} workloads...")
+
+    for workload in workloads:
+        print(f"\nProcessing {workload}:")
+        create_matrix_scatter_plot(df, workload, output_dir)
+
+    print(f"\nCreating summary plots:")
+    summaries = [('throughput_ops_s', 'Throughput (ops/s)'),
+                 ('lat_p99_us', 'p99 Latency (us)'),
+                 ('cpu_us_per_op', 'CPU per Operation (us)'),
+                 ('rss_peak_mib', 'Peak RSS (MiB)')]
+    for metric, label in summaries:
+        create_matrix_summary_plot(df, metric, label, output_dir)
+
+    print(f"\n✅ All plots saved to: {output_dir}")
+
 def main():
     if len(sys.argv) != 2:
         print("Usage: python3 plot_results.py <csv_file>")
         print("Example: python3 plot_results.py benchmark_results.csv")
+        print("         python3 plot_results.py matrix_results/results.csv")
         sys.exit(1)
     
     csv_path = Path(sys.argv[1]).resolve()
@@ -185,11 +265,15 @@ def main():
         sys.exit(1)
     
     # Load data
-    df = load_results(csv_path)
+    df, kind = load_results(csv_path)
     
     # Create output directory
     output_dir = csv_path.parent / 'plots'
     output_dir.mkdir(exist_ok=True)
+
+    if kind == 'matrix':
+        create_matrix_plots(df, output_dir)
+        return
     
     # Get unique files
     files = df['File'].unique()
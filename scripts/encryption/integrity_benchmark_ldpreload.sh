@@ -0,0 +1,155 @@
+#!/bin/bash
+
+# Compares the aead mode of the encryption layer with encryption (xts) under
+# a block mode anti_tampering layer, both below block_align.
+
+# Check if fio is installed
+if ! command -v fio &>/dev/null; then
+    echo "fio not found"
+    echo "You can install it from the official repository (https://github.com/axboe/fio) or using your package manager (e.g., sudo apt install fio)"
+    echo ""
+    exit 1
+else
+    echo "fio detected. Proceeding with the benchmark..."
+    echo ""
+fi
+
+# Defaults
+cipher="chacha20-poly1305"
+size="500M"
+duration=60
+block_size="4096"
+key="7da46e98f9643f34e8a4c68079816ec1ca9bbf4c68a3e50f842808848df50119"
+showHelp=no
+
+OPTIONS=$(getopt -o h --long cipher:,size:,duration:,block_size:,help -- "$@")
+eval set -- "$OPTIONS"
+
+while true; do
+    case "$1" in
+    --cipher)
+        cipher=$2
+        shift 2
+        ;;
+    --size)
+        size=$2
+        shift 2
+        ;;
+    --duration)
+        duration=$2
+        shift 2
+        ;;
+    --block_size)
+        block_size=$2
+        shift 2
+        ;;
+    -h | --help)
+        showHelp=yes
+        shift
+        ;;
+    --)
+        shift
+        break
+        ;;
+    *)
+        echo "Invalid option $1"
+        exit 1
+        ;;
+    esac
+done
+
+if [ "$showHelp" = "yes" ]; then
+    cat <<EOT
+Use: $0 [options]
+
+Options:
+  --cipher CIPHER        AEAD cipher (chacha20-poly1305, aes-256-gcm)
+  --size SIZE            File size (e.g., 1G, 500M, 100K)
+  --duration SEC         Execution time in seconds for each test
+  --block_size SIZE      Block size in bytes (e.g., 4096, 65536)
+  -h, --help             Show this help message
+Example:
+  $0 --cipher=aes-256-gcm --size=1G --duration=60 --block_size=4096
+EOT
+    exit 0
+fi
+
+cd ../..
+make build >/dev/null
+cd examples/ld_preload
+gcc -fPIC -shared $(pkg-config --cflags --libs glib-2.0) \
+    -I../../ lib_wrapper.c \
+    -L../../build/lib -lmodular \
+    -Wl,-rpath,'$ORIGIN/../../build/lib' \
+    -o lib_wrapper.so
+cd ../../
+echo ""
+echo "Build finished"
+
+run_fio() {
+    rm -rf fio_integrity_testfile fio_integrity_testfile.tgtag hashes
+    mkdir -p hashes
+    LD_PRELOAD=./examples/ld_preload/lib_wrapper.so fio --name=prepare \
+        --filename=fio_integrity_testfile --size=$size --rw=write --bs=1M \
+        --ioengine=psync --fdatasync=1 --refill_buffers=1 --fallocate=none
+    for rw in randread randwrite; do
+        echo ""
+        echo "Running $rw with $1"
+        echo ""
+        LD_PRELOAD=./examples/ld_preload/lib_wrapper.so fio --name=$rw \
+            --ioengine=psync --direct=0 --rw=$rw --bs=$block_size \
+            --numjobs=1 --size=$size --runtime=$duration --time_based \
+            --filename=fio_integrity_testfile
+    done
+}
+
+echo "root = \"layer_1\"
+log_mode = \"disabled\"
+
+[layer_1]
+type = \"block_align\"
+block_size = $block_size
+next = \"layer_2\"
+
+[layer_2]
+type = \"encryption\"
+block_size = $block_size
+mode = \"aead\"
+cipher = \"$cipher\"
+encryption_key = \"$key\"
+next = \"local\"
+
+[local]
+type = \"local\"" >"config.toml"
+
+run_fio "encryption in aead mode ($cipher)"
+
+echo "root = \"layer_1\"
+log_mode = \"disabled\"
+
+[layer_1]
+type = \"block_align\"
+block_size = $block_size
+next = \"layer_2\"
+
+[layer_2]
+type = \"anti_tampering\"
+mode = \"block\"
+block_size = $block_size
+algorithm = \"sha256\"
+hashes_storage = \"$(pwd)/hashes\"
+data_layer = \"layer_3\"
+hash_layer = \"local\"
+
+[layer_3]
+type = \"encryption\"
+block_size = $block_size
+encryption_key = \"$key\"
+next = \"local\"
+
+[local]
+type = \"local\"" >"config.toml"
+
+run_fio "encryption (xts) and block anti_tampering"
+
+rm -rf fio_integrity_testfile fio_integrity_testfile.tgtag hashes
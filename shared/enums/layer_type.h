@@ -25,6 +25,8 @@
   "anti_tampering_init" /**< Init function name for anti-tampering layer */
 #define LAYER_LOCAL_INIT                                                       \
   "local_init" /**< Init function name for local storage layer */
+#define LAYER_LOCAL_URING_INIT                                                 \
+  "local_uring_init" /**< Init function name for io_uring local layer */
 #define LAYER_REMOTE_INIT                                                      \
   "remote_init" /**< Init function name for remote storage layer */
 #define LAYER_COMPRESSION_INIT                                                 \
@@ -45,6 +47,16 @@
   "read_cache_init" /**< Init function name for cache read layer */
 #define LAYER_ENCRYPTION_INIT                                                  \
   "encryption_init" /**< Init function name for encryption layer */
+#define LAYER_STAGING_INIT                                                     \
+  "staging_init" /**< Init function name for staging layer */
+#define LAYER_MEMORY_INIT                                                      \
+  "memory_init" /**< Init function name for in-memory storage layer */
+#define LAYER_HASH_STORE_INIT                                                  \
+  "hash_store_init" /**< Init function name for hash store layer */
+#define LAYER_DEDUP_INIT                                                       \
+  "dedup_init" /**< Init function name for deduplication layer */
+#define LAYER_QOS_INIT                                                         \
+  "qos_init" /**< Init function name for I/O scheduling layer */
 /** @} */
 
 /**
@@ -66,7 +78,12 @@ typedef enum {
   LAYER_SOLANA,         /**< Solana layer */
   LAYER_BENCHMARK,      /**< Benchmark layer */
   LAYER_READ_CACHE,     /**< Read Cache Layer */
-  LAYER_ENCRYPTION      /**< Encryption Layer */
+  LAYER_ENCRYPTION,     /**< Encryption Layer */
+  LAYER_STAGING,        /**< Staging Layer */
+  LAYER_MEMORY,         /**< In-memory storage layer */
+  LAYER_HASH_STORE,     /**< Memory-mapped hash store layer */
+  LAYER_DEDUP,          /**< Content-addressed deduplication layer */
+  LAYER_QOS             /**< Per-class I/O scheduling layer */
 } LayerType;
 
 #endif /* LAYER_TYPE_H */
@@ -3,6 +3,7 @@
 
 #include <sys/stat.h>  /* for struct stat */
 #include <sys/types.h> /* for ssize_t, size_t, off_t, mode_t */
+#include <sys/uio.h>   /* for struct iovec */
 
 struct fuse_file_info;
 
@@ -17,6 +18,76 @@ struct fuse_file_info;
 /* Forward declaration */
 struct layer_ops;
 
+/**
+ * @brief Completion callback of an asynchronous layer operation
+ *
+ * @param res Number of bytes transferred, or -errno on failure
+ * @param ctx Context given on submission
+ */
+typedef void (*LayerIoCallback)(ssize_t res, void *ctx);
+
+/*
+ * Flags of lreaddir and of its filler, with the values of FUSE_READDIR_PLUS
+ * and FUSE_FILL_DIR_PLUS so that FUSE frontends can hand theirs over as is
+ */
+#define LAYER_READDIR_PLUS 1  // readdir flag: fill the attributes of entries
+#define LAYER_FILL_DIR_PLUS 2 // filler flag: stbuf has all the attributes
+
+/*
+ * Results of lverify
+ */
+typedef enum {
+  LAYER_VERIFY_FAILED = -1,    // the file or its hash could not be read
+  LAYER_VERIFY_OK = 0,         // the file matches its stored hash
+  LAYER_VERIFY_MISMATCH = 1,   // it does not
+  LAYER_VERIFY_UNPROTECTED = 2 // no stored hash, or a stale one (being written)
+} LayerVerifyResult;
+
+/**
+ * @brief Digests computed by a digesting pread or pwrite
+ *
+ * The layer hashes the plaintext of every block_size block of the request,
+ * counted from the start of the buffer (the last one may be partial), with
+ * hash_block and stores the digest of block i at digests + i * digest_size.
+ *
+ * @param block_size  Digest granularity in bytes
+ * @param digest_size Size of one digest in bytes
+ * @param hash_block  Hashes size bytes of data into digest, returns the
+ * number of bytes written to digest or -1 on error
+ * @param arg         Passed to hash_block
+ * @param digests     Receives one digest per block
+ */
+typedef struct {
+  size_t block_size;
+  size_t digest_size;
+  int (*hash_block)(const void *data, size_t size, void *digest, void *arg);
+  void *arg;
+  void *digests;
+} LayerDigest;
+
+/**
+ * @brief Stored digests returned by lgetdigest
+ *
+ * The layer fills the fields but digests: digests of different algorithms
+ * or block sizes do not compare.
+ *
+ * @param algorithm   Hash algorithm of the digests (hash_algorithm_t)
+ * @param block_size  Bytes of data a digest covers
+ * @param digest_size Size of one digest in bytes
+ * @param first_block Block of the first digest
+ * @param digests     Receives one digest per block, the one of block
+ * first_block + i at digests + i * digest_size
+ * @param capacity    Bytes of digests
+ */
+typedef struct {
+  int algorithm;
+  size_t block_size;
+  size_t digest_size;
+  size_t first_block;
+  void *digests;
+  size_t capacity;
+} LayerStoredDigests;
+
 /**
  * @struct layer_context
  * @brief Structure to manage Layer context and state
@@ -57,6 +128,64 @@ typedef struct layer_ops {
   int (*lunlink)(const char *path, LayerContext l);
 
   // Non supported by every layer
+  // Scatter/gather pread and pwrite; call them through layer_preadv() and
+  // layer_pwritev() (shared/utils/layer_iov.h), which fall back to
+  // lpread/lpwrite when a layer leaves them NULL
+  ssize_t (*lpreadv)(int fd, const struct iovec *iov, int iovcnt,
+                     off_t offset, LayerContext l);
+  ssize_t (*lpwritev)(int fd, const struct iovec *iov, int iovcnt,
+                      off_t offset, LayerContext l);
+  // Asynchronous pread and pwrite: return 0 once queued (the callback runs
+  // later, possibly on another thread) or -1 with errno if nothing was
+  // queued; call them through layer_pread_async() and layer_pwrite_async()
+  // (shared/utils/layer_async.h), which run lpread/lpwrite on a worker pool
+  // when a layer leaves them NULL
+  int (*lpread_async)(int fd, void *buffer, size_t nbyte, off_t offset,
+                      LayerIoCallback callback, void *ctx, LayerContext l);
+  int (*lpwrite_async)(int fd, const void *buffer, size_t nbyte,
+                       off_t offset, LayerIoCallback callback, void *ctx,
+                       LayerContext l);
+  // Digesting pread and pwrite: like lpread and lpwrite, and hash the
+  // plaintext of every block in the same pass that transforms it (see
+  // LayerDigest). A layer sets them to advertise that its output comes with
+  // the digests; callers hash the buffer themselves when they are NULL
+  ssize_t (*lpread_digest)(int fd, void *buffer, size_t nbyte, off_t offset,
+                           const LayerDigest *digest, LayerContext l);
+  ssize_t (*lpwrite_digest)(int fd, const void *buffer, size_t nbyte,
+                            off_t offset, const LayerDigest *digest,
+                            LayerContext l);
+  // Alignment in bytes that the buffers, offsets and lengths of the I/O on
+  // an fd opened with O_DIRECT must have, 1 if the layer takes any I/O; call
+  // it through layer_direct_alignment() (shared/utils/layer_iov.h), which
+  // gives the one of the first next layer when a layer leaves it NULL
+  size_t (*ldirect_alignment)(LayerContext l);
+  // Backing file of fd: a descriptor of a local file whose bytes are, as they
+  // are, the ones reads of fd return, so that they can be read from it
+  // directly (e.g. by the kernel, with FUSE passthrough). -1 when the layer
+  // transforms or checks the data on each read; call it through
+  // layer_backing_fd(), which gives -1 when a layer leaves it NULL
+  int (*lbacking_fd)(int fd, LayerContext l);
+  // Integrity check of a file at rest, without opening it for the caller: a
+  // LayerVerifyResult. Call it through layer_verify()
+  // (shared/utils/layer_iov.h), which asks the first next layer when a layer
+  // leaves it NULL
+  int (*lverify)(const char *path, LayerContext l);
+  // Stored digests of the blocks of fd that [offset, offset + nbyte)
+  // overlaps, without reading the data (e.g. the block hashes of
+  // anti-tampering): the number of digests, fewer past the last stored
+  // block, or -1 with errno (ERANGE when capacity is too small, the other
+  // fields being set). Call it through layer_getdigest()
+  // (shared/utils/layer_iov.h), which fails with ENOTSUP when a layer leaves
+  // it NULL
+  ssize_t (*lgetdigest)(int fd, off_t offset, size_t nbyte,
+                        LayerStoredDigests *digests, LayerContext l);
+  // Directory listing, an entry per filler call (the whole directory in one
+  // call, with off 0). With LAYER_READDIR_PLUS in flags, the layer fills the
+  // entries it can with the attributes llstat would give for them and
+  // LAYER_FILL_DIR_PLUS in the filler flags, so callers skip the lstat of
+  // each entry; otherwise only st_ino and the type in st_mode are set. Call
+  // it through layer_readdir() (shared/utils/layer_iov.h), which lists the
+  // first next layer, without attributes, when a layer leaves it NULL
   int (*lreaddir)(const char *path, void *buf,
                   int (*filler)(void *buf, const char *name,
                                 const struct stat *stbuf, off_t off,
@@ -66,10 +195,50 @@ typedef struct layer_ops {
   int (*lrename)(const char *from, const char *to, unsigned int flags,
                  LayerContext l);
   int (*lchmod)(const char *path, mode_t mode, LayerContext l);
+  // Directory creation, as mkdir(2). NULL (or ENOSYS) when the layer has no
+  // directories to create, its paths being keys (e.g. object stores)
+  int (*lmkdir)(const char *path, mode_t mode, LayerContext l);
   int (*lfsync)(int fd, int isdatasync, LayerContext l);
   int (*lfallocate)(int fd, off_t offset, int mode, off_t length,
                     LayerContext l);
+  // Copy of a range between two fds of the layer, as copy_file_range(2),
+  // without the data going through the caller: the layer clones what it
+  // stores (reflinks, block index entries, hash records) when it can. The
+  // number of bytes copied, or -1 with errno; EXDEV when the layer can't do
+  // it for these fds and ranges. Call it through layer_copy_file_range()
+  // (shared/utils/layer_iov.h), which copies through lpread/lpwrite when a
+  // layer leaves it NULL or can't do the copy
+  ssize_t (*lcopy_file_range)(int fd_in, off_t offset_in, int fd_out,
+                              off_t offset_out, size_t len, unsigned int flags,
+                              LayerContext l);
+  // Live change of the tunables of the layer, on a reload of its
+  // configuration (config/reload.h): params are the parameters of its type
+  // (its member of LayerParams), parsed from a configuration that only
+  // differs from the one the layer was built with in the tunables of the
+  // type. With apply 0, only checks them; with apply 1, it must not fail on
+  // parameters a check accepted. 0, or -1 with *error set to a static
+  // description of why they cannot be taken, the layer being left as it is.
+  // NULL when the layer has nothing to change live
+  int (*lreconfigure)(const void *params, int apply, const char **error,
+                      LayerContext l);
   void (*ldestroy)(LayerContext l);
 } LayerOps;
 
+/**
+ * @brief Copy of a layer carrying the app_context of the current call
+ *
+ * Layers call the layers below through such a copy, on their stack, rather
+ * than by setting app_context in their shared state: concurrent calls would
+ * race on it, and bounce the cache line it sits on.
+ *
+ * @param layer -> layer to call
+ * @param app_context -> app_context of the current call
+ * @return LayerContext -> layer with app_context
+ */
+static inline LayerContext layer_with_app_context(LayerContext layer,
+                                                  void *app_context) {
+  layer.app_context = app_context;
+  return layer;
+}
+
 #endif /* LAYER_CONTEXT_H */
@@ -2,10 +2,12 @@
 #define SERVICES_CONTEXT_H
 #include <stddef.h>
 
-// cache_size_bytes its not being used currently
+// See shared/utils/metadata_service.h
 typedef struct metadata_service {
-  size_t num_background_threads;
-  size_t cache_size_bytes;
+  size_t num_background_threads; // workers of the shared background pool
+  size_t cache_size_bytes;       // bound of the shared metadata cache
+  int numa;                      // spread workers and buffers over nodes
+  unsigned long numa_node_mask;  // nodes to use (bit n: node n), 0 for all
 } MetadataService;
 
 typedef union service_union {
@@ -0,0 +1,372 @@
+#include "buffer_pool.h"
+#include "../../logdef.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static BufferPool *shared_pool = NULL;
+static pthread_once_t shared_pool_once = PTHREAD_ONCE_INIT;
+static int shared_pool_flags = 0;
+
+static inline BufferPoolHeader *header_of(const void *buffer) {
+  return (BufferPoolHeader *)buffer - 1;
+}
+
+static inline size_t round_up(size_t size, size_t unit) {
+  return (size + unit - 1) / unit * unit;
+}
+
+/**
+ * @brief Size class of a request, -1 if buffers of that size aren't cached
+ */
+static int size_class(const BufferPool *pool, size_t size) {
+  if (pool->max_buffer_size != 0 && size > pool->max_buffer_size) {
+    return -1;
+  }
+  size_t capacity = BUFFER_POOL_MIN_SIZE;
+  for (int c = 0; c < BUFFER_POOL_CLASSES; c++, capacity <<= 1) {
+    if (size <= capacity) {
+      return c;
+    }
+  }
+  return -1;
+}
+
+static void release(BufferPoolHeader *header) {
+  if (header->mapped) {
+    munmap(header->base, header->length);
+  } else {
+    free(header->base);
+  }
+}
+
+static void release_list(BufferPoolHeader *header) {
+  while (header) {
+    BufferPoolHeader *next = header->next;
+    release(header);
+    header = next;
+  }
+}
+
+/**
+ * @brief Map length bytes on hugepages, or on regular pages advised to become
+ * transparent hugepages
+ */
+static void *map_hugepages(BufferPool *pool, size_t length) {
+  void *base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (base != MAP_FAILED) {
+    __atomic_add_fetch(&pool->hugepage_buffers, 1, __ATOMIC_RELAXED);
+    return base;
+  }
+  base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+  (void)madvise(base, length, MADV_HUGEPAGE);
+  __atomic_add_fetch(&pool->hugepage_fallbacks, 1, __ATOMIC_RELAXED);
+  return base;
+}
+
+/**
+ * @brief Allocate a buffer of a size class, or of size bytes if uncached, on
+ * a NUMA node
+ */
+static BufferPoolHeader *allocate(BufferPool *pool, int c, size_t size,
+                                  int node) {
+  size_t capacity = c >= 0 ? (size_t)BUFFER_POOL_MIN_SIZE << c
+                           : round_up(size, BUFFER_POOL_ALIGNMENT);
+  if (capacity < size ||
+      capacity > SIZE_MAX - BUFFER_POOL_HUGEPAGE_SIZE - BUFFER_POOL_ALIGNMENT) {
+    return NULL;
+  }
+  // the header takes the end of the alignment unit in front of the buffer
+  size_t length = BUFFER_POOL_ALIGNMENT + capacity;
+  void *base = NULL;
+  int mapped = 0;
+  if ((pool->flags & BUFFER_POOL_HUGEPAGES) &&
+      capacity >= BUFFER_POOL_HUGEPAGE_SIZE) {
+    length = round_up(length, BUFFER_POOL_HUGEPAGE_SIZE);
+    base = map_hugepages(pool, length);
+    mapped = 1;
+    if (base) {
+      // before the header write faults the first page in
+      (void)numa_policy_bind_memory(base, length, node);
+    }
+  } else if (posix_memalign(&base, BUFFER_POOL_ALIGNMENT, length) != 0) {
+    base = NULL;
+  }
+  if (!base) {
+    return NULL;
+  }
+
+  BufferPoolHeader *header = header_of((char *)base + BUFFER_POOL_ALIGNMENT);
+  header->next = NULL;
+  header->base = base;
+  header->length = length;
+  header->capacity = length - BUFFER_POOL_ALIGNMENT;
+  header->size_class = c;
+  header->mapped = mapped;
+  header->node = node;
+  return header;
+}
+
+/**
+ * @brief Give the buffers of a thread cache back to its pool (thread exit)
+ */
+static void thread_cache_release(void *arg) {
+  BufferPoolThreadCache *cache = arg;
+  BufferPool *pool = cache->pool;
+  BufferPoolHeader *dropped = NULL;
+
+  pthread_mutex_lock(&pool->mutex);
+  for (int c = 0; c < BUFFER_POOL_THREAD_CLASSES; c++) {
+    while (cache->lists[c]) {
+      BufferPoolHeader *header = cache->lists[c];
+      cache->lists[c] = header->next;
+      int node = header->node;
+      if (pool->counts[node][c] < pool->max_buffers) {
+        header->next = pool->lists[node][c];
+        pool->lists[node][c] = header;
+        pool->counts[node][c]++;
+      } else {
+        header->next = dropped;
+        dropped = header;
+      }
+    }
+  }
+  if (cache->prev) {
+    cache->prev->next = cache->next;
+  } else {
+    pool->threads = cache->next;
+  }
+  if (cache->next) {
+    cache->next->prev = cache->prev;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  release_list(dropped);
+  free(cache);
+}
+
+/**
+ * @brief Cache of the calling thread, created on first use
+ *
+ * @return BufferPoolThreadCache* -> cache, or NULL if it couldn't be created
+ */
+static BufferPoolThreadCache *thread_cache(BufferPool *pool) {
+  BufferPoolThreadCache *cache = pthread_getspecific(pool->thread_key);
+  if (cache) {
+    return cache;
+  }
+  cache = calloc(1, sizeof(BufferPoolThreadCache));
+  if (!cache) {
+    return NULL;
+  }
+  cache->pool = pool;
+  if (pthread_setspecific(pool->thread_key, cache) != 0) {
+    free(cache);
+    return NULL;
+  }
+  pthread_mutex_lock(&pool->mutex);
+  cache->next = pool->threads;
+  if (pool->threads) {
+    pool->threads->prev = cache;
+  }
+  pool->threads = cache;
+  pthread_mutex_unlock(&pool->mutex);
+  return cache;
+}
+
+BufferPool *buffer_pool_init(size_t max_buffers, size_t max_buffer_size,
+                             int flags) {
+  BufferPool *pool = calloc(1, sizeof(BufferPool));
+  if (!pool) {
+    return NULL;
+  }
+  pool->max_buffers = max_buffers;
+  pool->max_buffer_size = max_buffer_size;
+  pool->flags = flags;
+  if (pthread_key_create(&pool->thread_key, thread_cache_release) != 0) {
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->mutex, NULL);
+  return pool;
+}
+
+void buffer_pool_destroy(BufferPool *pool) {
+  if (!pool) {
+    return;
+  }
+  // no thread exit hands its cache back once the key is gone
+  pthread_key_delete(pool->thread_key);
+  BufferPoolThreadCache *cache = pool->threads;
+  while (cache) {
+    BufferPoolThreadCache *next = cache->next;
+    for (int c = 0; c < BUFFER_POOL_THREAD_CLASSES; c++) {
+      release_list(cache->lists[c]);
+    }
+    free(cache);
+    cache = next;
+  }
+  for (int n = 0; n < NUMA_POLICY_MAX_NODES; n++) {
+    for (int c = 0; c < BUFFER_POOL_CLASSES; c++) {
+      release_list(pool->lists[n][c]);
+    }
+  }
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool);
+}
+
+void *buffer_pool_get(BufferPool *pool, size_t size) {
+  BufferPoolHeader *header = NULL;
+  int c = size_class(pool, size);
+  int node = numa_policy_local();
+
+  if (c >= 0) {
+    BufferPoolThreadCache *cache =
+        c < BUFFER_POOL_THREAD_CLASSES ? thread_cache(pool) : NULL;
+    if (cache && cache->lists[c]) {
+      header = cache->lists[c];
+      cache->lists[c] = header->next;
+      cache->counts[c]--;
+      __atomic_add_fetch(&pool->thread_hits, 1, __ATOMIC_RELAXED);
+    } else {
+      pthread_mutex_lock(&pool->mutex);
+      header = pool->lists[node][c];
+      if (header) {
+        pool->lists[node][c] = header->next;
+        pool->counts[node][c]--;
+      }
+      pthread_mutex_unlock(&pool->mutex);
+    }
+  }
+
+  if (header) {
+    __atomic_add_fetch(&pool->hits, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_add_fetch(&pool->misses, 1, __ATOMIC_RELAXED);
+    header = allocate(pool, c, size, node);
+    if (!header) {
+      return NULL;
+    }
+  }
+  return header + 1;
+}
+
+void *buffer_pool_get_zeroed(BufferPool *pool, size_t size) {
+  void *buffer = buffer_pool_get(pool, size);
+  if (buffer) {
+    memset(buffer, 0, size);
+  }
+  return buffer;
+}
+
+void *buffer_pool_resize(BufferPool *pool, void *buffer, size_t size) {
+  if (!buffer) {
+    return buffer_pool_get(pool, size);
+  }
+  size_t capacity = header_of(buffer)->capacity;
+  if (size <= capacity) {
+    return buffer;
+  }
+  void *grown = buffer_pool_get(pool, size);
+  if (!grown) {
+    return NULL;
+  }
+  memcpy(grown, buffer, capacity);
+  buffer_pool_put(pool, buffer);
+  return grown;
+}
+
+void buffer_pool_put(BufferPool *pool, void *buffer) {
+  if (!buffer) {
+    return;
+  }
+  BufferPoolHeader *header = header_of(buffer);
+  int c = header->size_class;
+  if (c < 0) {
+    release(header);
+    return;
+  }
+
+  // a buffer of another node goes back to that node's cache
+  int node = header->node;
+  BufferPoolThreadCache *cache =
+      c < BUFFER_POOL_THREAD_CLASSES && node == numa_policy_local()
+          ? thread_cache(pool)
+          : NULL;
+  if (cache && cache->counts[c] < BUFFER_POOL_THREAD_BUFFERS) {
+    header->next = cache->lists[c];
+    cache->lists[c] = header;
+    cache->counts[c]++;
+    return;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  int keep = pool->counts[node][c] < pool->max_buffers;
+  if (keep) {
+    header->next = pool->lists[node][c];
+    pool->lists[node][c] = header;
+    pool->counts[node][c]++;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (!keep) {
+    release(header);
+  }
+}
+
+size_t buffer_pool_capacity(const void *buffer) {
+  return header_of(buffer)->capacity;
+}
+
+void buffer_pool_get_stats(BufferPool *pool, BufferPoolStats *stats) {
+  if (!stats) {
+    return;
+  }
+  memset(stats, 0, sizeof(*stats));
+  if (!pool) {
+    return;
+  }
+  stats->hits = __atomic_load_n(&pool->hits, __ATOMIC_RELAXED);
+  stats->thread_hits = __atomic_load_n(&pool->thread_hits, __ATOMIC_RELAXED);
+  stats->misses = __atomic_load_n(&pool->misses, __ATOMIC_RELAXED);
+  stats->hugepage_buffers =
+      __atomic_load_n(&pool->hugepage_buffers, __ATOMIC_RELAXED);
+  stats->hugepage_fallbacks =
+      __atomic_load_n(&pool->hugepage_fallbacks, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&pool->mutex);
+  for (int n = 0; n < NUMA_POLICY_MAX_NODES; n++) {
+    for (int c = 0; c < BUFFER_POOL_CLASSES; c++) {
+      stats->cached += pool->counts[n][c];
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+static void create_shared_pool(void) {
+  shared_pool = buffer_pool_init(BUFFER_POOL_SHARED_BUFFERS,
+                                 BUFFER_POOL_SHARED_MAX_SIZE,
+                                 shared_pool_flags);
+}
+
+int buffer_pool_configure_shared(int flags) {
+  if (__atomic_load_n(&shared_pool, __ATOMIC_ACQUIRE)) {
+    return -1;
+  }
+  shared_pool_flags = flags;
+  return 0;
+}
+
+BufferPool *buffer_pool_shared(void) {
+  pthread_once(&shared_pool_once, create_shared_pool);
+  if (!shared_pool) {
+    ERROR_MSG("[BUFFER_POOL] Failed to create the shared buffer pool");
+    exit(1);
+  }
+  return shared_pool;
+}
@@ -0,0 +1,197 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include "numa_policy.h"
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * ============================================================================
+ * BUFFER POOL - REUSABLE SCRATCH BUFFERS
+ * ============================================================================
+ *
+ * Thread-safe cache of heap buffers for per-operation scratch space, so hot
+ * paths stop paying a malloc/free (and the page faults of a fresh large
+ * allocation) on every call.
+ *
+ * - Buffers are BUFFER_POOL_ALIGNMENT aligned and their capacity is a
+ *   multiple of it, so they can be used for O_DIRECT I/O.
+ * - Sizes are rounded up to a power of two size class, from
+ *   BUFFER_POOL_MIN_SIZE up to BUFFER_POOL_CLASSES classes. Each class has
+ *   its own cache of at most max_buffers buffers; larger buffers, and
+ *   buffers above max_buffer_size, are freed on put.
+ * - Every thread keeps up to BUFFER_POOL_THREAD_BUFFERS buffers of each of
+ *   the first BUFFER_POOL_THREAD_CLASSES classes of its own, so get/put pairs
+ *   of a thread don't take the pool mutex. They go back to the pool when the
+ *   thread exits.
+ * - With BUFFER_POOL_HUGEPAGES, buffers of BUFFER_POOL_HUGEPAGE_SIZE or more
+ *   are mapped on hugepages (MAP_HUGETLB, else transparent hugepages), which
+ *   saves TLB misses on large blocks. They take whole hugepages.
+ * - With NUMA placement (numa_policy.h), a buffer belongs to the node of the
+ *   thread that allocated it and the pool keeps one cache per node: gets are
+ *   served from the caller's node, and puts return a buffer to its own node
+ *   (bypassing the thread cache of a thread on another node).
+ *
+ * buffer_pool_shared() is the pool of the layers' hot paths, created on first
+ * use and kept for the lifetime of the process.
+ * ============================================================================
+ */
+
+#define BUFFER_POOL_ALIGNMENT 4096 // alignment of the buffers, for O_DIRECT
+#define BUFFER_POOL_MIN_SIZE 4096  // capacity of the smallest size class
+#define BUFFER_POOL_CLASSES 16     // size classes, up to 128 MiB
+#define BUFFER_POOL_THREAD_BUFFERS 4 // buffers per class cached by a thread
+#define BUFFER_POOL_THREAD_CLASSES 9 // classes cached by threads, up to 1 MiB
+#define BUFFER_POOL_HUGEPAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+#define BUFFER_POOL_SHARED_BUFFERS 64 // per class, in buffer_pool_shared()
+#define BUFFER_POOL_SHARED_MAX_SIZE                                            \
+  ((size_t)16 * 1024 * 1024) // largest buffer buffer_pool_shared() caches
+
+// buffer_pool_init flags
+#define BUFFER_POOL_HUGEPAGES 0x1 // map large buffers on hugepages
+
+// Header stored right before each buffer, in the alignment unit in front of it
+typedef struct BufferPoolHeader {
+  struct BufferPoolHeader *next; // Next cached buffer
+  void *base;                    // Start of the allocation
+  size_t length;                 // Bytes of the allocation
+  size_t capacity;               // Usable bytes of the buffer
+  int size_class;                // Size class, -1 if never cached
+  int mapped;                    // Allocated with mmap instead of malloc
+  int node;                      // NUMA node index of the allocation
+} BufferPoolHeader;
+
+// Buffers a thread keeps for itself, one per thread using the pool
+typedef struct BufferPoolThreadCache {
+  struct BufferPool *pool;                             // Pool of the buffers
+  BufferPoolHeader *lists[BUFFER_POOL_THREAD_CLASSES]; // Cached per class
+  unsigned counts[BUFFER_POOL_THREAD_CLASSES];         // Entries of lists
+  struct BufferPoolThreadCache *prev, *next;           // Caches of the pool
+} BufferPoolThreadCache;
+
+typedef struct {
+  size_t hits;               // Gets served from a cache
+  size_t thread_hits;        // Gets served from the thread's own cache
+  size_t misses;             // Gets that allocated
+  size_t hugepage_buffers;   // Buffers allocated on hugepages
+  size_t hugepage_fallbacks; // Hugepage buffers that got regular pages
+  size_t cached;             // Buffers in the pool (not counting threads')
+} BufferPoolStats;
+
+typedef struct BufferPool {
+  // Cached buffers per NUMA node and class
+  BufferPoolHeader *lists[NUMA_POLICY_MAX_NODES][BUFFER_POOL_CLASSES];
+  size_t counts[NUMA_POLICY_MAX_NODES][BUFFER_POOL_CLASSES]; // Of lists
+  size_t max_buffers;             // Cached buffers kept at most, per class
+  size_t max_buffer_size;         // Larger buffers are not cached, 0: no limit
+  int flags;                      // BUFFER_POOL_* flags
+  size_t hits;                    // Gets served from a cache
+  size_t thread_hits;             // Gets served from the thread's own cache
+  size_t misses;                  // Gets that allocated
+  size_t hugepage_buffers;        // Buffers allocated on hugepages
+  size_t hugepage_fallbacks;      // Hugepage buffers that got regular pages
+  BufferPoolThreadCache *threads; // Caches of the threads using the pool
+  pthread_key_t thread_key;       // BufferPoolThreadCache of calling thread
+  pthread_mutex_t mutex;          // Protects lists, counts and threads
+} BufferPool;
+
+/**
+ * @brief Create a buffer pool
+ *
+ * @param max_buffers -> cached buffers kept at most, per size class (and per
+ * NUMA node)
+ * @param max_buffer_size -> size above which buffers are freed on put, 0 for
+ * no limit
+ * @param flags -> BUFFER_POOL_* flags
+ * @return BufferPool* -> pool, or NULL on failure
+ */
+BufferPool *buffer_pool_init(size_t max_buffers, size_t max_buffer_size,
+                             int flags);
+
+/**
+ * @brief Free the pool and its cached buffers, including the threads' ones
+ *
+ * Buffers still handed out must not be put back afterwards, and no other
+ * thread may be using the pool.
+ *
+ * @param pool -> pool to destroy
+ */
+void buffer_pool_destroy(BufferPool *pool);
+
+/**
+ * @brief Get a buffer of at least size bytes, with undefined contents
+ *
+ * @param pool -> pool to use
+ * @param size -> bytes needed
+ * @return void* -> BUFFER_POOL_ALIGNMENT aligned buffer, or NULL on failure
+ */
+void *buffer_pool_get(BufferPool *pool, size_t size);
+
+/**
+ * @brief Get a zero-filled buffer of at least size bytes
+ *
+ * @param pool -> pool to use
+ * @param size -> bytes needed, the ones zeroed
+ * @return void* -> BUFFER_POOL_ALIGNMENT aligned buffer, or NULL on failure
+ */
+void *buffer_pool_get_zeroed(BufferPool *pool, size_t size);
+
+/**
+ * @brief Grow a buffer, as realloc
+ *
+ * The first size bytes are kept. On failure, the buffer is left as it was.
+ *
+ * @param pool -> pool the buffer came from
+ * @param buffer -> buffer to grow, NULL to get a new one
+ * @param size -> bytes needed
+ * @return void* -> buffer, possibly moved, or NULL on failure
+ */
+void *buffer_pool_resize(BufferPool *pool, void *buffer, size_t size);
+
+/**
+ * @brief Return a buffer obtained from buffer_pool_get to the pool
+ *
+ * @param pool -> pool the buffer came from
+ * @param buffer -> buffer to return, NULL is ignored
+ */
+void buffer_pool_put(BufferPool *pool, void *buffer);
+
+/**
+ * @brief Usable bytes of a buffer, at least the size asked for
+ *
+ * @param buffer -> buffer obtained from a buffer pool
+ * @return size_t -> capacity
+ */
+size_t buffer_pool_capacity(const void *buffer);
+
+/**
+ * @brief Snapshot of the pool counters
+ *
+ * @param pool -> pool
+ * @param stats -> output
+ */
+void buffer_pool_get_stats(BufferPool *pool, BufferPoolStats *stats);
+
+/**
+ * @brief Set the flags of buffer_pool_shared()
+ *
+ * Only effective before the first buffer_pool_shared() call.
+ *
+ * @param flags -> BUFFER_POOL_* flags
+ * @return int -> 0 on success, -1 if the shared pool already exists
+ */
+int buffer_pool_configure_shared(int flags);
+
+/**
+ * @brief Process-wide pool of the layers' scratch buffers
+ *
+ * Caches BUFFER_POOL_SHARED_BUFFERS buffers per class, of up to
+ * BUFFER_POOL_SHARED_MAX_SIZE bytes. If it can't be created, the process
+ * exits.
+ *
+ * @return BufferPool* -> shared pool
+ */
+BufferPool *buffer_pool_shared(void);
+
+#endif // BUFFER_POOL_H
@@ -1,8 +1,15 @@
 #include "compressor.h"
+#include "../../../lib/lz4/lib/lz4.h"
 #include "../../../lib/lz4/lib/lz4frame.h"
+#include "../../../lib/lz4/lib/lz4hc.h"
+// ZSTD_c_format and ZSTD_d_format, for the frames of the bare blocks
+#define ZSTD_STATIC_LINKING_ONLY
 #include "../../../lib/zstd/lib/zstd.h"
+#include "../../../lib/zstd/lib/zstd_errors.h"
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -35,10 +42,178 @@ static off_t get_max_off_t(void) {
   return max_off_t_value;
 }
 
+// Trained dictionary, digested once and shared read-only by all threads
+struct CompressorDictionary {
+  ZSTD_CDict *cdict;
+  ZSTD_DDict *ddict;
+};
+
+// Contexts of a thread, created on first use and reused by every call
+typedef struct {
+  ZSTD_CCtx *zstd_cctx;
+  ZSTD_DCtx *zstd_dctx;
+  LZ4F_cctx *lz4_cctx;
+  LZ4F_dctx *lz4_dctx;
+  ZSTD_CCtx *zstd_block_cctx; // Set up once for the frames of bare blocks
+  ZSTD_DCtx *zstd_block_dctx;
+  void *lz4_state; // LZ4_compress_fast_extState() state
+  void *lz4hc_state;
+} CompressorContext;
+
+static pthread_key_t context_key;
+static pthread_once_t context_key_once = PTHREAD_ONCE_INIT;
+
+static void context_free(void *arg) {
+  CompressorContext *ctx = arg;
+  if (!ctx) {
+    return;
+  }
+  ZSTD_freeCCtx(ctx->zstd_cctx);
+  ZSTD_freeDCtx(ctx->zstd_dctx);
+  if (ctx->lz4_cctx) {
+    LZ4F_freeCompressionContext(ctx->lz4_cctx);
+  }
+  if (ctx->lz4_dctx) {
+    LZ4F_freeDecompressionContext(ctx->lz4_dctx);
+  }
+  ZSTD_freeCCtx(ctx->zstd_block_cctx);
+  ZSTD_freeDCtx(ctx->zstd_block_dctx);
+  free(ctx->lz4_state);
+  free(ctx->lz4hc_state);
+  free(ctx);
+}
+
+static void context_key_create(void) {
+  (void)pthread_key_create(&context_key, context_free);
+}
+
+/**
+ * @brief Get the calling thread's context, creating it on first use
+ */
+static CompressorContext *context_get(void) {
+  (void)pthread_once(&context_key_once, context_key_create);
+
+  CompressorContext *ctx = pthread_getspecific(context_key);
+  if (ctx) {
+    return ctx;
+  }
+
+  ctx = calloc(1, sizeof(CompressorContext));
+  if (!ctx) {
+    return NULL;
+  }
+  if (pthread_setspecific(context_key, ctx) != 0) {
+    free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+static ZSTD_CCtx *zstd_cctx_get(void) {
+  CompressorContext *ctx = context_get();
+  if (!ctx) {
+    return NULL;
+  }
+  if (!ctx->zstd_cctx) {
+    ctx->zstd_cctx = ZSTD_createCCtx();
+  }
+  return ctx->zstd_cctx;
+}
+
+static ZSTD_DCtx *zstd_dctx_get(void) {
+  CompressorContext *ctx = context_get();
+  if (!ctx) {
+    return NULL;
+  }
+  if (!ctx->zstd_dctx) {
+    ctx->zstd_dctx = ZSTD_createDCtx();
+  }
+  return ctx->zstd_dctx;
+}
+
+static LZ4F_cctx *lz4_cctx_get(void) {
+  CompressorContext *ctx = context_get();
+  if (!ctx) {
+    return NULL;
+  }
+  if (!ctx->lz4_cctx &&
+      LZ4F_isError(
+          LZ4F_createCompressionContext(&ctx->lz4_cctx, LZ4F_VERSION))) {
+    ctx->lz4_cctx = NULL;
+  }
+  return ctx->lz4_cctx;
+}
+
+// The context may be left mid-frame by a previous call, it is reset first
+static LZ4F_dctx *lz4_dctx_get(void) {
+  CompressorContext *ctx = context_get();
+  if (!ctx) {
+    return NULL;
+  }
+  if (!ctx->lz4_dctx) {
+    if (LZ4F_isError(
+            LZ4F_createDecompressionContext(&ctx->lz4_dctx, LZ4F_VERSION))) {
+      ctx->lz4_dctx = NULL;
+    }
+    return ctx->lz4_dctx;
+  }
+  LZ4F_resetDecompressionContext(ctx->lz4_dctx);
+  return ctx->lz4_dctx;
+}
+
+// The frames of ZSTD bare blocks carry no magic number, checksum or
+// dictionary id, set once on the thread's own pair of contexts
+static ZSTD_CCtx *zstd_block_cctx_get(void) {
+  CompressorContext *ctx = context_get();
+  if (!ctx) {
+    return NULL;
+  }
+  if (!ctx->zstd_block_cctx && (ctx->zstd_block_cctx = ZSTD_createCCtx())) {
+    ZSTD_CCtx *cctx = ctx->zstd_block_cctx;
+    if (ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_format,
+                                            ZSTD_f_zstd1_magicless)) ||
+        ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_dictIDFlag, 0))) {
+      ZSTD_freeCCtx(cctx);
+      ctx->zstd_block_cctx = NULL;
+    }
+  }
+  return ctx->zstd_block_cctx;
+}
+
+static ZSTD_DCtx *zstd_block_dctx_get(void) {
+  CompressorContext *ctx = context_get();
+  if (!ctx) {
+    return NULL;
+  }
+  if (!ctx->zstd_block_dctx && (ctx->zstd_block_dctx = ZSTD_createDCtx()) &&
+      ZSTD_isError(ZSTD_DCtx_setParameter(ctx->zstd_block_dctx, ZSTD_d_format,
+                                          ZSTD_f_zstd1_magicless))) {
+    ZSTD_freeDCtx(ctx->zstd_block_dctx);
+    ctx->zstd_block_dctx = NULL;
+  }
+  return ctx->zstd_block_dctx;
+}
+
+static void *lz4_state_get(int hc) {
+  CompressorContext *ctx = context_get();
+  if (!ctx) {
+    return NULL;
+  }
+  void **state = hc ? &ctx->lz4hc_state : &ctx->lz4_state;
+  if (!*state) {
+    *state = malloc((size_t)(hc ? LZ4_sizeofStateHC() : LZ4_sizeofState()));
+  }
+  return *state;
+}
+
 // LZ4 compression implementation
+// The block size is explicit and blocks are flushed on every update, so the
+// frame written through the reused context fits LZ4F_compressFrameBound().
 static LZ4F_preferences_t lz4_build_preferences(int level, size_t file_size) {
-  LZ4F_preferences_t prefs = {.frameInfo = {.contentSize = file_size},
-                              .compressionLevel = level};
+  LZ4F_preferences_t prefs = {
+      .frameInfo = {.blockSizeID = LZ4F_max64KB, .contentSize = file_size},
+      .compressionLevel = level,
+      .autoFlush = 1};
   return prefs;
 }
 
@@ -52,14 +227,31 @@ static ssize_t convert_to_ssize_t(size_t size) {
 ssize_t lz4_compress_data(const void *file_buffer, size_t file_size,
                           void *compressed_buffer,
                           size_t compressed_buffer_size, int level) {
+  LZ4F_cctx *cctx = lz4_cctx_get();
+  if (!cctx) {
+    return -1;
+  }
   LZ4F_preferences_t prefs = lz4_build_preferences(level, file_size);
 
-  size_t result = LZ4F_compressFrame(compressed_buffer, compressed_buffer_size,
-                                     file_buffer, file_size, &prefs);
-  if (!LZ4F_isError(result)) {
-    return convert_to_ssize_t(result);
+  char *dst = compressed_buffer;
+  size_t written =
+      LZ4F_compressBegin(cctx, dst, compressed_buffer_size, &prefs);
+  if (LZ4F_isError(written)) {
+    return -1;
   }
-  return -1;
+  size_t result =
+      LZ4F_compressUpdate(cctx, dst + written, compressed_buffer_size - written,
+                          file_buffer, file_size, NULL);
+  if (LZ4F_isError(result)) {
+    return -1;
+  }
+  written += result;
+  result = LZ4F_compressEnd(cctx, dst + written,
+                            compressed_buffer_size - written, NULL);
+  if (LZ4F_isError(result)) {
+    return -1;
+  }
+  return convert_to_ssize_t(written + result);
 }
 
 // Frame decompression data in LZ4 is done by calling LZ4F_decompress()
@@ -69,9 +261,8 @@ ssize_t lz4_compress_data(const void *file_buffer, size_t file_size,
 ssize_t lz4_decompress_data(const void *compressed_buffer,
                             size_t compressed_size, void *decompressed_buffer,
                             size_t *decompressed_capacity) {
-  LZ4F_dctx *dctx;
-  LZ4F_errorCode_t err = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
-  if (LZ4F_isError(err))
+  LZ4F_dctx *dctx = lz4_dctx_get();
+  if (!dctx)
     return -1;
 
   size_t src_offset = 0;
@@ -86,7 +277,6 @@ ssize_t lz4_decompress_data(const void *compressed_buffer,
         (const char *)compressed_buffer + src_offset, &src_size, NULL);
 
     if (LZ4F_isError(ret)) {
-      LZ4F_freeDecompressionContext(dctx);
       return -1;
     }
 
@@ -97,8 +287,6 @@ ssize_t lz4_decompress_data(const void *compressed_buffer,
       break;
   }
 
-  LZ4F_freeDecompressionContext(dctx);
-
   *decompressed_capacity = dst_offset;
   return (ssize_t)dst_offset;
 }
@@ -111,9 +299,8 @@ static size_t lz4_get_compress_bound(size_t file_size, int level) {
 static off_t lz4_get_original_file_size(const void *compressed_buffer,
                                         size_t compressed_size) {
   size_t compressed_size_copy = compressed_size;
-  LZ4F_dctx *dctx;
-  LZ4F_errorCode_t error = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
-  if (LZ4F_isError(error)) {
+  LZ4F_dctx *dctx = lz4_dctx_get();
+  if (!dctx) {
     return LZ4F_CREATE_DECOMPRESSION_CONTEXT_ERROR;
   }
 
@@ -121,7 +308,6 @@ static off_t lz4_get_original_file_size(const void *compressed_buffer,
   size_t header_size = LZ4F_getFrameInfo(dctx, &frame_info, compressed_buffer,
                                          &compressed_size_copy);
 
-  LZ4F_freeDecompressionContext(dctx);
   if (LZ4F_isError(header_size)) {
     return LZ4F_FRAME_INFO_ERROR;
   }
@@ -160,9 +346,8 @@ static int lz4_decompress_and_track_consumed(const void *compressed_buffer,
                                              void *decompressed_buffer,
                                              size_t *decompressed_capacity,
                                              size_t *consumed_out) {
-  LZ4F_dctx *dctx;
-  LZ4F_errorCode_t err = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
-  if (LZ4F_isError(err))
+  LZ4F_dctx *dctx = lz4_dctx_get();
+  if (!dctx)
     return -1;
 
   size_t src_offset = 0;
@@ -177,7 +362,6 @@ static int lz4_decompress_and_track_consumed(const void *compressed_buffer,
         (const char *)compressed_buffer + src_offset, &src_size, NULL);
 
     if (LZ4F_isError(ret)) {
-      LZ4F_freeDecompressionContext(dctx);
       return -1;
     }
 
@@ -186,7 +370,6 @@ static int lz4_decompress_and_track_consumed(const void *compressed_buffer,
 
     if (ret == 0) {
       // Frame complete
-      LZ4F_freeDecompressionContext(dctx);
       *decompressed_capacity = dst_offset;
       *consumed_out = src_offset;
       return 0;
@@ -195,13 +378,11 @@ static int lz4_decompress_and_track_consumed(const void *compressed_buffer,
     // If no input was consumed but we haven't reached the end, might be
     // corrupted
     if (src_size == 0 && src_offset < max_size) {
-      LZ4F_freeDecompressionContext(dctx);
       return -1;
     }
   }
 
   // Reached max_size or buffer limit without completing frame
-  LZ4F_freeDecompressionContext(dctx);
   return -1;
 }
 
@@ -251,8 +432,13 @@ static int lz4_get_compressed_size(const void *compressed_buffer,
 static ssize_t zstd_compress_data(const void *file_buffer, size_t file_size,
                                   void *compressed_buffer,
                                   size_t compressed_buffer_size, int level) {
-  size_t result = ZSTD_compress(compressed_buffer, compressed_buffer_size,
-                                file_buffer, file_size, level);
+  ZSTD_CCtx *cctx = zstd_cctx_get();
+  if (!cctx) {
+    return -1;
+  }
+  size_t result = ZSTD_compressCCtx(cctx, compressed_buffer,
+                                    compressed_buffer_size, file_buffer,
+                                    file_size, level);
   if (!ZSTD_isError(result)) {
     return convert_to_ssize_t(result);
   }
@@ -262,8 +448,12 @@ static ssize_t zstd_compress_data(const void *file_buffer, size_t file_size,
 static ssize_t zstd_decompress_data(const void *compressed_buffer,
                                     size_t compressed_size, void *real_buffer,
                                     size_t *real_size) {
-  size_t result = ZSTD_decompress(real_buffer, *real_size, compressed_buffer,
-                                  compressed_size);
+  ZSTD_DCtx *dctx = zstd_dctx_get();
+  if (!dctx) {
+    return -1;
+  }
+  size_t result = ZSTD_decompressDCtx(dctx, real_buffer, *real_size,
+                                      compressed_buffer, compressed_size);
   if (!ZSTD_isError(result)) {
     return convert_to_ssize_t(result);
   }
@@ -352,9 +542,8 @@ static int lz4_detect_format(const void *data, size_t data_size) {
     return -1; // Not LZ4F format
   }
 
-  LZ4F_dctx *dctx;
-  LZ4F_errorCode_t error = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
-  if (LZ4F_isError(error)) {
+  LZ4F_dctx *dctx = lz4_dctx_get();
+  if (!dctx) {
     // Failed to create context, but magic number matches - assume LZ4F
     return 0;
   }
@@ -363,8 +552,6 @@ static int lz4_detect_format(const void *data, size_t data_size) {
   size_t src_size = data_size;
   size_t result = LZ4F_getFrameInfo(dctx, &frame_info, data, &src_size);
 
-  LZ4F_freeDecompressionContext(dctx);
-
   // If LZ4F_getFrameInfo() succeeds, it's a valid LZ4F frame
   if (!LZ4F_isError(result)) {
     return 0; // Valid LZ4F frame confirmed
@@ -413,6 +600,8 @@ static int compressor_init_lz4(Compressor *compressor, int level) {
   compressor->get_max_header_size = lz4_get_max_header_size;
   compressor->get_compressed_size = lz4_get_compressed_size;
   compressor->detect_format = lz4_detect_format;
+  compressor->dictionary = NULL;
+  memset(&compressor->zstd, 0, sizeof(compressor->zstd));
 
   return 0;
 }
@@ -444,6 +633,8 @@ static int compressor_init_zstd(Compressor *compressor, int level) {
   compressor->get_max_header_size = zstd_get_max_header_size;
   compressor->get_compressed_size = zstd_get_compressed_size;
   compressor->detect_format = zstd_detect_format;
+  compressor->dictionary = NULL;
+  memset(&compressor->zstd, 0, sizeof(compressor->zstd));
 
   return 0;
 }
@@ -465,3 +656,408 @@ int compressor_init(Compressor *compressor, compression_algorithm_t algorithm,
     return -1; // Invalid algorithm
   }
 }
+
+// Read a whole file, NULL if it is missing, empty or cannot be read
+static void *read_dictionary_file(const char *path, size_t *size) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return NULL;
+  }
+  void *data = NULL;
+  long len = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+  if (len > 0 && fseek(file, 0, SEEK_SET) == 0 &&
+      (data = malloc((size_t)len)) &&
+      fread(data, 1, (size_t)len, file) != (size_t)len) {
+    free(data);
+    data = NULL;
+  }
+  fclose(file);
+  *size = data ? (size_t)len : 0;
+  return data;
+}
+
+int compressor_load_dictionary(Compressor *compressor, const char *path) {
+  if (!compressor || !path || compressor->dictionary) {
+    return -1;
+  }
+  if (compressor->algorithm != COMPRESSION_ZSTD) {
+    return DICTIONARY_UNSUPPORTED_ERROR;
+  }
+
+  size_t size = 0;
+  void *data = read_dictionary_file(path, &size);
+  if (!data) {
+    return -1;
+  }
+  CompressorDictionary *dictionary = calloc(1, sizeof(CompressorDictionary));
+  if (dictionary) {
+    // Both digests copy the content, the buffer is not kept
+    dictionary->cdict = ZSTD_createCDict(data, size, compressor->level);
+    dictionary->ddict = ZSTD_createDDict(data, size);
+  }
+  free(data);
+  if (!dictionary || !dictionary->cdict || !dictionary->ddict) {
+    if (dictionary) {
+      ZSTD_freeCDict(dictionary->cdict);
+      ZSTD_freeDDict(dictionary->ddict);
+      free(dictionary);
+    }
+    return -1;
+  }
+  compressor->dictionary = dictionary;
+  return 0;
+}
+
+// Whether value is within the bounds of param in this build of the library
+static int zstd_param_in_bounds(ZSTD_cParameter param, int value) {
+  ZSTD_bounds bounds = ZSTD_cParam_getBounds(param);
+  return !ZSTD_isError(bounds.error) && value >= bounds.lowerBound &&
+         value <= bounds.upperBound;
+}
+
+int compressor_set_zstd_params(Compressor *compressor,
+                               const CompressorZstdParams *params) {
+  if (!compressor || !params) {
+    return -1;
+  }
+  if (compressor->algorithm != COMPRESSION_ZSTD) {
+    return ZSTD_PARAMS_UNSUPPORTED_ERROR;
+  }
+  if (params->workers < 0 || params->window_log < 0 ||
+      (params->workers > 0 &&
+       !zstd_param_in_bounds(ZSTD_c_nbWorkers, params->workers)) ||
+      (params->window_log > 0 &&
+       !zstd_param_in_bounds(ZSTD_c_windowLog, params->window_log))) {
+    return -1;
+  }
+  compressor->zstd = *params;
+  compressor->zstd.long_distance = params->long_distance ? 1 : 0;
+  return 0;
+}
+
+int compressor_set_level(Compressor *compressor, int level) {
+  if (!compressor || compressor->dictionary) {
+    return -1;
+  }
+  if (compressor->algorithm == COMPRESSION_ZSTD) {
+    if (level < ZSTD_minCLevel()) {
+      level = ZSTD_minCLevel();
+    }
+    if (level > ZSTD_maxCLevel()) {
+      level = ZSTD_maxCLevel();
+    }
+  }
+  // compressions in progress read it once or twice, either value is valid
+  __atomic_store_n(&compressor->level, level, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/**
+ * @brief Compress one frame with the advanced API and the ZSTD settings
+ *
+ * The thread's context is handed back with its parameters reset, so the
+ * other calls sharing it compress as before.
+ */
+static ssize_t zstd_compress_with_params(const Compressor *compressor,
+                                         const void *file_buffer,
+                                         size_t file_size,
+                                         void *compressed_buffer,
+                                         size_t compressed_buffer_size) {
+  ZSTD_CCtx *cctx = zstd_cctx_get();
+  if (!cctx) {
+    return -1;
+  }
+  const CompressorZstdParams *params = &compressor->zstd;
+  size_t err = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                                      compressor->level);
+  if (!ZSTD_isError(err) && params->workers > 0) {
+    err = ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, params->workers);
+  }
+  if (!ZSTD_isError(err) && params->long_distance) {
+    err = ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+  }
+  if (!ZSTD_isError(err) && params->window_log > 0) {
+    err = ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, params->window_log);
+  }
+  if (!ZSTD_isError(err) && compressor->dictionary) {
+    err = ZSTD_CCtx_refCDict(cctx, compressor->dictionary->cdict);
+  }
+  size_t result = ZSTD_isError(err)
+                      ? err
+                      : ZSTD_compress2(cctx, compressed_buffer,
+                                       compressed_buffer_size, file_buffer,
+                                       file_size);
+  ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+  if (!ZSTD_isError(result)) {
+    return convert_to_ssize_t(result);
+  }
+  return -1;
+}
+
+ssize_t compressor_compress(const Compressor *compressor,
+                            const void *file_buffer, size_t file_size,
+                            void *compressed_buffer,
+                            size_t compressed_buffer_size) {
+  const CompressorZstdParams *params = &compressor->zstd;
+  if (compressor->algorithm == COMPRESSION_ZSTD &&
+      (params->workers > 0 || params->long_distance ||
+       params->window_log > 0)) {
+    return zstd_compress_with_params(compressor, file_buffer, file_size,
+                                     compressed_buffer,
+                                     compressed_buffer_size);
+  }
+  if (!compressor->dictionary) {
+    return compressor->compress_data(file_buffer, file_size, compressed_buffer,
+                                     compressed_buffer_size, compressor->level);
+  }
+  ZSTD_CCtx *cctx = zstd_cctx_get();
+  if (!cctx) {
+    return -1;
+  }
+  size_t result = ZSTD_compress_usingCDict(
+      cctx, compressed_buffer, compressed_buffer_size, file_buffer, file_size,
+      compressor->dictionary->cdict);
+  if (!ZSTD_isError(result)) {
+    return convert_to_ssize_t(result);
+  }
+  return -1;
+}
+
+ssize_t compressor_decompress(const Compressor *compressor,
+                              const void *compressed_buffer,
+                              size_t compressed_size, void *real_buffer,
+                              size_t *real_size) {
+  if (!compressor->dictionary) {
+    return compressor->decompress_data(compressed_buffer, compressed_size,
+                                       real_buffer, real_size);
+  }
+  ZSTD_DCtx *dctx = zstd_dctx_get();
+  if (!dctx) {
+    return -1;
+  }
+  size_t result =
+      ZSTD_decompress_usingDDict(dctx, real_buffer, *real_size,
+                                 compressed_buffer, compressed_size,
+                                 compressor->dictionary->ddict);
+  if (!ZSTD_isError(result)) {
+    return convert_to_ssize_t(result);
+  }
+  return -1;
+}
+
+/*
+ * Bare blocks, little endian:
+ *   LZ4:  [u16 tag][u16 payload length][LZ4 block]
+ *   ZSTD: [u16 tag][ZSTD frame without magic number]
+ * The frame delimits itself and carries the content size. The tags differ
+ * from the first bytes of the LZ4 and ZSTD frame magic numbers.
+ */
+#define BLOCK_TAG_LZ4 0xB44C
+#define BLOCK_TAG_ZSTD 0xB45A
+#define BLOCK_TAG_SIZE 2
+
+static uint16_t block_tag(const Compressor *compressor) {
+  return compressor->algorithm == COMPRESSION_LZ4 ? BLOCK_TAG_LZ4
+                                                  : BLOCK_TAG_ZSTD;
+}
+
+static size_t block_header_size(const Compressor *compressor) {
+  return compressor->algorithm == COMPRESSION_LZ4
+             ? COMPRESSOR_BLOCK_HEADER_SIZE
+             : BLOCK_TAG_SIZE;
+}
+
+/**
+ * @brief Size of a ZSTD frame without magic number, walking its block headers
+ *
+ * @return int -> 0 if a whole frame fits in size, -1 otherwise
+ */
+static int zstd_bare_frame_size(const uint8_t *src, size_t size,
+                                size_t *frame_size) {
+  ZSTD_frameHeader header;
+  if (ZSTD_getFrameHeader_advanced(&header, src, size,
+                                   ZSTD_f_zstd1_magicless) != 0 ||
+      header.frameType != ZSTD_frame || header.checksumFlag) {
+    return -1;
+  }
+  size_t pos = header.headerSize;
+  for (;;) {
+    if (pos + 3 > size) {
+      return -1;
+    }
+    uint32_t block = (uint32_t)src[pos] | (uint32_t)src[pos + 1] << 8 |
+                     (uint32_t)src[pos + 2] << 16;
+    uint32_t type = (block >> 1) & 3; // raw, RLE, compressed or reserved
+    if (type == 3) {
+      return -1;
+    }
+    pos += 3 + (type == 1 ? 1 : (size_t)(block >> 3));
+    if (pos > size) {
+      return -1;
+    }
+    if (block & 1) { // last block
+      break;
+    }
+  }
+  *frame_size = pos;
+  return 0;
+}
+
+static int has_block_tag(const Compressor *compressor, const uint8_t *data,
+                         size_t data_size) {
+  return data_size >= COMPRESSOR_BLOCK_HEADER_SIZE &&
+         (uint16_t)(data[0] | data[1] << 8) == block_tag(compressor);
+}
+
+// Levels as LZ4F takes them: HC from LZ4HC_CLEVEL_MIN, negative levels
+// accelerate the fast mode
+static ssize_t lz4_compress_bare(const void *src, size_t src_size, void *dst,
+                                 size_t capacity, int level) {
+  int hc = level >= LZ4HC_CLEVEL_MIN;
+  void *state = lz4_state_get(hc);
+  if (!state) {
+    return -1;
+  }
+  if (hc) {
+    return LZ4_compress_HC_extStateHC(state, src, dst, (int)src_size,
+                                      (int)capacity, level);
+  }
+  return LZ4_compress_fast_extState(state, src, dst, (int)src_size,
+                                    (int)capacity, level < 0 ? -level + 1 : 1);
+}
+
+static ssize_t zstd_compress_bare(const Compressor *compressor,
+                                  const void *src, size_t src_size, void *dst,
+                                  size_t capacity, int level) {
+  ZSTD_CCtx *cctx = zstd_block_cctx_get();
+  if (!cctx) {
+    return -1;
+  }
+  size_t err = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+  if (!ZSTD_isError(err)) {
+    err = ZSTD_CCtx_refCDict(
+        cctx, compressor->dictionary ? compressor->dictionary->cdict : NULL);
+  }
+  size_t result = ZSTD_isError(err)
+                      ? err
+                      : ZSTD_compress2(cctx, dst, capacity, src, src_size);
+  if (!ZSTD_isError(result)) {
+    return convert_to_ssize_t(result);
+  }
+  // a frame left half written keeps the parameters locked until a reset
+  ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+  return ZSTD_getErrorCode(result) == ZSTD_error_dstSize_tooSmall ? 0 : -1;
+}
+
+ssize_t compressor_compress_block(const Compressor *compressor,
+                                  const void *file_buffer, size_t file_size,
+                                  void *compressed_buffer,
+                                  size_t compressed_buffer_size, int level) {
+  if (!compressor || file_size > COMPRESSOR_BLOCK_MAX_SIZE) {
+    return -1;
+  }
+  size_t header_size = block_header_size(compressor);
+  if (compressed_buffer_size <= header_size) {
+    return 0;
+  }
+  size_t capacity = compressed_buffer_size - header_size;
+  uint8_t *dst = compressed_buffer;
+  ssize_t payload;
+  if (compressor->algorithm == COMPRESSION_LZ4) {
+    if (capacity > UINT16_MAX) {
+      capacity = UINT16_MAX;
+    }
+    payload = lz4_compress_bare(file_buffer, file_size, dst + header_size,
+                                capacity, level);
+  } else {
+    payload = zstd_compress_bare(compressor, file_buffer, file_size,
+                                 dst + header_size, capacity, level);
+  }
+  if (payload <= 0) {
+    return payload;
+  }
+  uint16_t tag = block_tag(compressor);
+  dst[0] = (uint8_t)(tag & 0xff);
+  dst[1] = (uint8_t)(tag >> 8);
+  if (compressor->algorithm == COMPRESSION_LZ4) {
+    dst[2] = (uint8_t)(payload & 0xff);
+    dst[3] = (uint8_t)(payload >> 8);
+  }
+  return (ssize_t)header_size + payload;
+}
+
+ssize_t compressor_decompress_block(const Compressor *compressor,
+                                    const void *compressed_buffer,
+                                    size_t compressed_size, void *real_buffer,
+                                    size_t *real_size) {
+  const uint8_t *src = compressed_buffer;
+  if (!has_block_tag(compressor, src, compressed_size)) {
+    return compressor_decompress(compressor, compressed_buffer,
+                                 compressed_size, real_buffer, real_size);
+  }
+  size_t stored = 0;
+  if (compressor_detect_block(compressor, src, compressed_size, &stored) != 0 ||
+      stored != compressed_size) {
+    return -1;
+  }
+  const uint8_t *payload = src + block_header_size(compressor);
+  size_t payload_size = stored - block_header_size(compressor);
+
+  if (compressor->algorithm == COMPRESSION_LZ4) {
+    int capacity = *real_size > INT_MAX ? INT_MAX : (int)*real_size;
+    int result = LZ4_decompress_safe((const char *)payload, real_buffer,
+                                     (int)payload_size, capacity);
+    if (result < 0) {
+      return -1;
+    }
+    *real_size = (size_t)result;
+    return result;
+  }
+
+  ZSTD_DCtx *dctx = zstd_block_dctx_get();
+  if (!dctx) {
+    return -1;
+  }
+  size_t result = ZSTD_DCtx_refDDict(
+      dctx, compressor->dictionary ? compressor->dictionary->ddict : NULL);
+  if (!ZSTD_isError(result)) {
+    result = ZSTD_decompressDCtx(dctx, real_buffer, *real_size, payload,
+                                 payload_size);
+  }
+  if (ZSTD_isError(result)) {
+    return -1;
+  }
+  *real_size = result;
+  return convert_to_ssize_t(result);
+}
+
+int compressor_detect_block(const Compressor *compressor, const void *data,
+                            size_t data_size, size_t *block_size_out) {
+  const uint8_t *header = data;
+  if (!compressor || !data || !has_block_tag(compressor, header, data_size)) {
+    return -1;
+  }
+  size_t payload = 0;
+  if (compressor->algorithm == COMPRESSION_LZ4) {
+    payload = (size_t)(header[2] | header[3] << 8);
+  } else if (zstd_bare_frame_size(header + BLOCK_TAG_SIZE,
+                                  data_size - BLOCK_TAG_SIZE, &payload) != 0) {
+    return -1;
+  }
+  size_t header_size = block_header_size(compressor);
+  if (payload == 0 || header_size + payload > data_size) {
+    return -1;
+  }
+  *block_size_out = header_size + payload;
+  return 0;
+}
+
+void compressor_destroy(Compressor *compressor) {
+  if (!compressor || !compressor->dictionary) {
+    return;
+  }
+  ZSTD_freeCDict(compressor->dictionary->cdict);
+  ZSTD_freeDDict(compressor->dictionary->ddict);
+  free(compressor->dictionary);
+  compressor->dictionary = NULL;
+}
@@ -6,6 +6,7 @@
 #include <sys/types.h>
 
 typedef struct Compressor Compressor;
+typedef struct CompressorDictionary CompressorDictionary;
 
 // Compression algorithm types
 typedef enum { COMPRESSION_ZSTD, COMPRESSION_LZ4 } compression_algorithm_t;
@@ -14,6 +15,24 @@ typedef enum { COMPRESSION_ZSTD, COMPRESSION_LZ4 } compression_algorithm_t;
 #define LZ4F_CREATE_DECOMPRESSION_CONTEXT_ERROR -3
 #define LZ4F_FRAME_INFO_ERROR -4
 #define ZSTD_GET_FRAME_CONTENT_SIZE_ERROR -5
+#define DICTIONARY_UNSUPPORTED_ERROR -6
+#define ZSTD_PARAMS_UNSUPPORTED_ERROR -7
+
+// Bare blocks: see compressor_compress_block()
+#define COMPRESSOR_BLOCK_HEADER_SIZE 4 // Largest header, LZ4's
+#define COMPRESSOR_BLOCK_MAX_SIZE 65536
+
+/**
+ * @brief ZSTD settings of frames compressed through compressor_compress()
+ *
+ * All 0 leaves them to the level. They pay off on large inputs, like the
+ * whole files of the compression layer's file mode.
+ */
+typedef struct {
+  int workers;       // Threads compressing one frame (ZSTD_c_nbWorkers)
+  int long_distance; // Long distance matching, finds repeats far apart
+  int window_log;    // log2 of the match window (ZSTD_c_windowLog)
+} CompressorZstdParams;
 
 /**
  * @brief Compressor structure for handling different compression algorithms
@@ -23,6 +42,9 @@ typedef enum { COMPRESSION_ZSTD, COMPRESSION_LZ4 } compression_algorithm_t;
  * allows switching between compression methods at runtime without changing the
  * calling code.
  *
+ * The functions keep one compression and one decompression context per thread
+ * and reuse them across calls, so a Compressor can be shared between threads.
+ *
  * @example
  * ```c
  * Compressor compressor;
@@ -167,6 +189,21 @@ typedef struct Compressor {
    *       For uncompressed data or unknown formats, returns -1.
    */
   int (*detect_format)(const void *data, size_t data_size);
+
+  /**
+   * @brief Trained dictionary, NULL if none is loaded
+   *
+   * The function pointers above never use it. Frames compressed with a
+   * dictionary go through compressor_compress() and compressor_decompress().
+   */
+  CompressorDictionary *dictionary;
+
+  /**
+   * @brief ZSTD frame settings, set by compressor_set_zstd_params()
+   *
+   * Like the dictionary, only compressor_compress() applies them.
+   */
+  CompressorZstdParams zstd;
 } Compressor;
 
 /**
@@ -184,4 +221,133 @@ typedef struct Compressor {
 int compressor_init(Compressor *compressor, compression_algorithm_t algorithm,
                     int level);
 
+/**
+ * @brief Load a trained dictionary from a file
+ *
+ * The file is a dictionary produced by `zstd --train` (raw content is also
+ * accepted). It is digested once at the compressor level and shared by all
+ * threads.
+ *
+ * @param compressor Initialized compressor, without a dictionary
+ * @param path Path of the dictionary file
+ * @return 0 on success, DICTIONARY_UNSUPPORTED_ERROR for LZ4, -1 on error
+ *
+ * @note Only ZSTD supports dictionaries. The LZ4 frame dictionary API is not
+ * exported by the shared liblz4.
+ */
+int compressor_load_dictionary(Compressor *compressor, const char *path);
+
+/**
+ * @brief Set the multi-threading and window of the ZSTD frames
+ *
+ * The frames stay regular ZSTD frames, carrying their content size, and
+ * decompress on one thread like any other.
+ *
+ * @param compressor Initialized compressor
+ * @param params Settings, checked against the bounds of the library
+ * @return 0 on success, ZSTD_PARAMS_UNSUPPORTED_ERROR for LZ4, -1 for values
+ * out of bounds (workers with a library built without multi-threading)
+ */
+int compressor_set_zstd_params(Compressor *compressor,
+                               const CompressorZstdParams *params);
+
+/**
+ * @brief Change the level of the next compressions, while others run
+ *
+ * The frames and blocks compressed at any level decompress the same way, so
+ * the data already written stays readable. ZSTD levels are clamped to the
+ * bounds of the library, as by compressor_init().
+ *
+ * @param compressor Initialized compressor
+ * @param level New compression level
+ * @return 0 on success, -1 with a dictionary (digested at the old level)
+ */
+int compressor_set_level(Compressor *compressor, int level);
+
+/**
+ * @brief Compress data, with the dictionary if one is loaded
+ *
+ * Same contract as compress_data, at compressor->level, with the ZSTD
+ * settings of compressor_set_zstd_params().
+ */
+ssize_t compressor_compress(const Compressor *compressor,
+                            const void *file_buffer, size_t file_size,
+                            void *compressed_buffer,
+                            size_t compressed_buffer_size);
+
+/**
+ * @brief Decompress data, with the dictionary if one is loaded
+ *
+ * Same contract as decompress_data.
+ */
+ssize_t compressor_decompress(const Compressor *compressor,
+                              const void *compressed_buffer,
+                              size_t compressed_size, void *real_buffer,
+                              size_t *real_size);
+
+/**
+ * @brief Compress a block without a frame around it
+ *
+ * A bare block starts with a 2 byte tag of the algorithm. With LZ4, the tag
+ * and the length of the payload precede an LZ4 block (LZ4 HC from level 3),
+ * 4 bytes where a frame costs 23; nothing records the uncompressed size, the
+ * caller keeps it or decompresses to learn it. With ZSTD, the tag precedes a
+ * frame without magic number, checksum and dictionary id, which delimits
+ * itself: 8 bytes where a frame costs 10.
+ *
+ * @param compressor Initialized compressor, its dictionary is used if loaded
+ * @param file_buffer Data to compress, at most COMPRESSOR_BLOCK_MAX_SIZE bytes
+ * @param file_size Size of the data in bytes
+ * @param compressed_buffer Output buffer
+ * @param compressed_buffer_size Size of the output buffer, the block is not
+ * worth storing compressed beyond it
+ * @param level Compression level to use
+ * @return Size of the bare block, 0 if it does not fit in the output buffer,
+ * -1 on error
+ */
+ssize_t compressor_compress_block(const Compressor *compressor,
+                                  const void *file_buffer, size_t file_size,
+                                  void *compressed_buffer,
+                                  size_t compressed_buffer_size, int level);
+
+/**
+ * @brief Decompress a bare block, or a frame
+ *
+ * Data that does not start with the bare block tag of the algorithm goes to
+ * compressor_decompress(), so blocks written either way read back.
+ *
+ * @param compressor Initialized compressor
+ * @param compressed_buffer Bare block or frame
+ * @param compressed_size Exact size of the bare block or frame
+ * @param real_buffer Output buffer
+ * @param real_size Size of the output buffer, on return the size of the data
+ * @return Number of bytes written to real_buffer, or -1 on error
+ */
+ssize_t compressor_decompress_block(const Compressor *compressor,
+                                    const void *compressed_buffer,
+                                    size_t compressed_size, void *real_buffer,
+                                    size_t *real_size);
+
+/**
+ * @brief Detect a bare block of this compressor's algorithm
+ *
+ * Only the header is checked: a block stored uncompressed can start with the
+ * same 4 bytes, decompressing it tells them apart.
+ *
+ * @param compressor Initialized compressor
+ * @param data Buffer to check
+ * @param data_size Size of the data buffer
+ * @param block_size_out Output: size of the bare block, header included
+ * @return 0 if the header is a bare block fitting in data, -1 otherwise
+ */
+int compressor_detect_block(const Compressor *compressor, const void *data,
+                            size_t data_size, size_t *block_size_out);
+
+/**
+ * @brief Release the dictionary of a compressor, if any
+ *
+ * @param compressor Pointer to the compressor
+ */
+void compressor_destroy(Compressor *compressor);
+
 #endif
@@ -0,0 +1,174 @@
+#include "cpu.h"
+#include "../../logdef.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#define CPU_NAME_SIZE 32 // names of the overrides, terminator included
+
+static const struct {
+  const char *name;
+  unsigned flag;
+} feature_names[] = {
+    {"avx2", CPU_AVX2}, {"avx512", CPU_AVX512}, {"sha", CPU_SHA},
+    {"vaes", CPU_VAES}, {"neon", CPU_NEON},
+};
+#define N_FEATURES (sizeof(feature_names) / sizeof(feature_names[0]))
+
+typedef struct {
+  char kernel[CPU_NAME_SIZE];
+  char impl[CPU_NAME_SIZE];
+} Override;
+
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+static unsigned detected = 0;
+
+// Guards the configuration and the choices of the kernels
+static pthread_mutex_t cpu_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned disabled_features = 0;
+static Override overrides[CPU_MAX_OVERRIDES];
+static int n_overrides = 0;
+// bumped by each change of the configuration, read without the mutex
+static unsigned generation = 1;
+
+static void detect(void) {
+#if defined(__x86_64__) && defined(__GNUC__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    detected |= CPU_AVX2;
+  }
+  if (__builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("avx512bw") &&
+      __builtin_cpu_supports("avx512vl")) {
+    detected |= CPU_AVX512;
+  }
+  if (__builtin_cpu_supports("sha")) {
+    detected |= CPU_SHA;
+  }
+  if (__builtin_cpu_supports("vaes") &&
+      __builtin_cpu_supports("vpclmulqdq")) {
+    detected |= CPU_VAES;
+  }
+#elif defined(__aarch64__) && defined(__linux__)
+  unsigned long hwcap = getauxval(AT_HWCAP);
+  if (hwcap & HWCAP_ASIMD) {
+    detected |= CPU_NEON;
+  }
+  if (hwcap & HWCAP_SHA2) {
+    detected |= CPU_SHA;
+  }
+#endif
+}
+
+unsigned cpu_detected(void) {
+  pthread_once(&detect_once, detect);
+  return detected;
+}
+
+unsigned cpu_features(void) {
+  unsigned features = cpu_detected();
+  return features & ~__atomic_load_n(&disabled_features, __ATOMIC_RELAXED);
+}
+
+int cpu_has(unsigned features) {
+  return (cpu_features() & features) == features;
+}
+
+unsigned cpu_feature(const char *name) {
+  for (size_t i = 0; name && i < N_FEATURES; i++) {
+    if (strcmp(feature_names[i].name, name) == 0) {
+      return feature_names[i].flag;
+    }
+  }
+  return 0;
+}
+
+void cpu_feature_names(unsigned features, char *buf, size_t size) {
+  size_t len = 0;
+  buf[0] = '\0';
+  for (size_t i = 0; i < N_FEATURES; i++) {
+    if ((features & feature_names[i].flag) && len < size) {
+      len += (size_t)snprintf(buf + len, size - len, "%s%s", len ? " " : "",
+                              feature_names[i].name);
+    }
+  }
+  if (len == 0) {
+    (void)snprintf(buf, size, "none");
+  }
+}
+
+void cpu_configure(unsigned disabled) {
+  pthread_mutex_lock(&cpu_mutex);
+  __atomic_store_n(&disabled_features, disabled, __ATOMIC_RELAXED);
+  n_overrides = 0;
+  __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&cpu_mutex);
+}
+
+int cpu_kernel_override(const char *kernel, const char *impl) {
+  if (!kernel || !impl || strlen(kernel) >= CPU_NAME_SIZE ||
+      strlen(impl) >= CPU_NAME_SIZE) {
+    return -1;
+  }
+  pthread_mutex_lock(&cpu_mutex);
+  int res = -1;
+  if (n_overrides < CPU_MAX_OVERRIDES) {
+    strcpy(overrides[n_overrides].kernel, kernel);
+    strcpy(overrides[n_overrides].impl, impl);
+    n_overrides++;
+    __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+    res = 0;
+  }
+  pthread_mutex_unlock(&cpu_mutex);
+  return res;
+}
+
+/**
+ * @brief Choose the implementation of a kernel (cpu_mutex held)
+ */
+static const CpuKernelImpl *choose(const CpuKernel *kernel) {
+  const unsigned features = cpu_features();
+  for (int i = 0; i < n_overrides; i++) {
+    if (strcmp(overrides[i].kernel, kernel->name) != 0) {
+      continue;
+    }
+    // an implementation may be listed for several feature sets
+    for (size_t j = 0; j < kernel->n_impls; j++) {
+      const CpuKernelImpl *impl = &kernel->impls[j];
+      if (strcmp(impl->name, overrides[i].impl) == 0 &&
+          (impl->features & features) == impl->features) {
+        return impl;
+      }
+    }
+    WARN_MSG("[CPU] %s of %s can't run on this host, using the fastest one",
+             overrides[i].impl, kernel->name);
+  }
+  for (size_t j = 0; j < kernel->n_impls; j++) {
+    if ((kernel->impls[j].features & features) == kernel->impls[j].features) {
+      return &kernel->impls[j];
+    }
+  }
+  return &kernel->impls[kernel->n_impls - 1];
+}
+
+const CpuKernelImpl *cpu_kernel_select(CpuKernel *kernel) {
+  unsigned current = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&kernel->generation, __ATOMIC_ACQUIRE) == current) {
+    return __atomic_load_n(&kernel->selected, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_lock(&cpu_mutex);
+  const CpuKernelImpl *impl = choose(kernel);
+  if (impl != kernel->selected) {
+    DEBUG_MSG("[CPU] %s kernel: %s", kernel->name, impl->name);
+  }
+  __atomic_store_n(&kernel->selected, impl, __ATOMIC_RELAXED);
+  __atomic_store_n(&kernel->generation, generation, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&cpu_mutex);
+  return impl;
+}
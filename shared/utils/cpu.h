@@ -0,0 +1,118 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stddef.h>
+
+/*
+ * ============================================================================
+ * CPU - RUNTIME SELECTION OF THE KERNELS OF THE HOST
+ * ============================================================================
+ *
+ * The library is built for a generic target, so its SIMD kernels are
+ * compiled with target attributes and chosen at runtime. A kernel lists its
+ * implementations in a CpuKernel, fastest first, each with the CPU_* features
+ * it needs; cpu_kernel_select returns the first one the host runs, and caches
+ * it in the CpuKernel until the configuration changes.
+ *
+ * - The features are detected once, on first use (libinit logs them).
+ * - The `cpu_disable` key removes features, as if the host lacked them, and
+ *   `cpu_kernels` names the implementation of some kernels: both for A/B
+ *   benchmarks of the same binary. An implementation the host can't run is
+ *   never selected, whatever the configuration says.
+ * - OpenSSL (EVP hashes, AES) dispatches on its own, through the
+ *   OPENSSL_ia32cap / OPENSSL_armcap environment variables.
+ * ============================================================================
+ */
+
+#define CPU_AVX2 (1U << 0)   // x86 AVX2
+#define CPU_AVX512 (1U << 1) // x86 AVX-512 F, BW and VL
+#define CPU_SHA (1U << 2)    // x86 SHA-NI, ARMv8 SHA-256 instructions
+#define CPU_VAES (1U << 3)   // x86 VAES and VPCLMULQDQ
+#define CPU_NEON (1U << 4)   // ARM Advanced SIMD
+
+#define CPU_MAX_OVERRIDES 16 // kernels of cpu_kernels at most
+
+typedef void (*CpuKernelFn)(void);
+
+typedef struct {
+  const char *name;  // e.g. "avx2", "generic"
+  unsigned features; // CPU_* flags it needs, 0 for any host
+  CpuKernelFn fn;    // cast back to its type by the kernel, may be NULL
+} CpuKernelImpl;
+
+typedef struct {
+  const char *name;              // kernel, as named in cpu_kernels
+  const CpuKernelImpl *impls;    // fastest first, the last needs nothing
+  size_t n_impls;                // entries of impls
+  const CpuKernelImpl *selected; // choice of generation
+  unsigned generation;           // configuration it was made for, 0: none
+} CpuKernel;
+
+#define CPU_KERNEL_INIT(kernel_name, kernel_impls)                            \
+  {(kernel_name), (kernel_impls),                                             \
+   sizeof(kernel_impls) / sizeof((kernel_impls)[0]), NULL, 0}
+
+/**
+ * @brief Features of the host, before cpu_disable
+ */
+unsigned cpu_detected(void);
+
+/**
+ * @brief Features the kernels may use: detected and not disabled
+ */
+unsigned cpu_features(void);
+
+/**
+ * @brief Check that the kernels may use all of some features
+ *
+ * @param features -> CPU_* flags
+ * @return int     -> 1 if they all may, 0 otherwise
+ */
+int cpu_has(unsigned features);
+
+/**
+ * @brief Flag of a feature name: avx2, avx512, sha, vaes or neon
+ *
+ * @param name     -> feature name
+ * @return unsigned -> its CPU_* flag, 0 if unknown
+ */
+unsigned cpu_feature(const char *name);
+
+/**
+ * @brief Write the names of features, space separated
+ *
+ * @param features -> CPU_* flags
+ * @param buf      -> output, "none" without any
+ * @param size     -> bytes of buf
+ */
+void cpu_feature_names(unsigned features, char *buf, size_t size);
+
+/**
+ * @brief Set the disabled features, clearing the kernel overrides
+ *
+ * Every kernel is selected again on its next call.
+ *
+ * @param disabled -> CPU_* flags the kernels must not use
+ */
+void cpu_configure(unsigned disabled);
+
+/**
+ * @brief Name the implementation of a kernel, until the next cpu_configure
+ *
+ * @param kernel -> kernel name
+ * @param impl   -> implementation name
+ * @return int   -> 0 on success, -1 if the names are too long or the
+ * overrides are all taken
+ */
+int cpu_kernel_override(const char *kernel, const char *impl);
+
+/**
+ * @brief Implementation of a kernel for the host and the configuration
+ *
+ * @param kernel -> kernel, its choice is cached in it
+ * @return const CpuKernelImpl* -> the override if the host runs it, else
+ * the first implementation it runs
+ */
+const CpuKernelImpl *cpu_kernel_select(CpuKernel *kernel);
+
+#endif // CPU_H
@@ -0,0 +1,80 @@
+#include "fd_table.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Allocate a page and set its entries
+ */
+static void *page_new(const FdTable *table) {
+  char *page = malloc(table->entry_size * FD_TABLE_PAGE_ENTRIES);
+  if (!page) {
+    return NULL;
+  }
+  if (!table->init_entry) {
+    memset(page, 0, table->entry_size * FD_TABLE_PAGE_ENTRIES);
+    return page;
+  }
+  for (size_t i = 0; i < FD_TABLE_PAGE_ENTRIES; i++) {
+    table->init_entry(page + i * table->entry_size);
+  }
+  return page;
+}
+
+void fd_table_init(FdTable *table, size_t entry_size,
+                   void (*init_entry)(void *entry)) {
+  memset(table->pages, 0, sizeof(table->pages));
+  table->entry_size = entry_size;
+  table->init_entry = init_entry;
+  table->end = 0;
+}
+
+void fd_table_destroy(FdTable *table) {
+  for (size_t i = 0; i < FD_TABLE_PAGES; i++) {
+    free(table->pages[i]);
+    table->pages[i] = NULL;
+  }
+  table->end = 0;
+}
+
+void *fd_table_get(const FdTable *table, int fd) {
+  if (fd < 0 || fd >= FD_TABLE_MAX_FDS) {
+    return NULL;
+  }
+  char *page = __atomic_load_n(&table->pages[fd >> FD_TABLE_PAGE_SHIFT],
+                               __ATOMIC_ACQUIRE);
+  if (!page) {
+    return NULL;
+  }
+  return page + (size_t)(fd & (FD_TABLE_PAGE_ENTRIES - 1)) * table->entry_size;
+}
+
+void *fd_table_slot(FdTable *table, int fd) {
+  void *entry = fd_table_get(table, fd);
+  if (entry || fd < 0 || fd >= FD_TABLE_MAX_FDS) {
+    return entry;
+  }
+
+  void *page = page_new(table);
+  if (!page) {
+    return NULL;
+  }
+  void *expected = NULL;
+  if (!__atomic_compare_exchange_n(&table->pages[fd >> FD_TABLE_PAGE_SHIFT],
+                                   &expected, page, 0, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE)) {
+    free(page); // grown by another thread meanwhile
+    return fd_table_get(table, fd);
+  }
+
+  int end = ((fd >> FD_TABLE_PAGE_SHIFT) + 1) * FD_TABLE_PAGE_ENTRIES;
+  int current = __atomic_load_n(&table->end, __ATOMIC_RELAXED);
+  while (current < end &&
+         !__atomic_compare_exchange_n(&table->end, &current, end, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+  return fd_table_get(table, fd);
+}
+
+int fd_table_end(const FdTable *table) {
+  return __atomic_load_n(&table->end, __ATOMIC_ACQUIRE);
+}
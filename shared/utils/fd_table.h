@@ -0,0 +1,86 @@
+#ifndef FD_TABLE_H
+#define FD_TABLE_H
+
+#include <stddef.h>
+
+/*
+ * ============================================================================
+ * FD TABLE - PER-FD STATE OF A LAYER, GROWN ON DEMAND
+ * ============================================================================
+ *
+ * Array of fixed-size entries indexed by file descriptor, for the per-fd state
+ * of the layers (the fd of the layer below, or one they number themselves).
+ *
+ * - Entries live in pages of FD_TABLE_PAGE_ENTRIES contiguous entries. A page
+ *   is allocated, and its entries set by init_entry (zeroed without one),
+ *   the first time one of its fds gets a slot, so a layer with a few open
+ *   files holds a single page and fds up to FD_TABLE_MAX_FDS are served.
+ * - Pages are published with a compare-and-swap and freed by
+ *   fd_table_destroy() only: lookups take no lock, and an entry pointer stays
+ *   valid for the lifetime of the table. Concurrent access to the entries
+ *   themselves is up to the layer, as with a plain array.
+ * ============================================================================
+ */
+
+#define FD_TABLE_PAGE_SHIFT 10 // log2 of FD_TABLE_PAGE_ENTRIES
+#define FD_TABLE_PAGE_ENTRIES (1 << FD_TABLE_PAGE_SHIFT)
+#define FD_TABLE_PAGES 4096 // pages of a table
+#define FD_TABLE_MAX_FDS (FD_TABLE_PAGES * FD_TABLE_PAGE_ENTRIES)
+
+typedef struct {
+  void *pages[FD_TABLE_PAGES]; // pages, NULL until grown (atomic)
+  size_t entry_size;           // bytes of an entry
+  void (*init_entry)(void *);  // sets the entries of a new page, or NULL
+  int end;                     // fds below it may have an entry (atomic)
+} FdTable;
+
+/**
+ * @brief Initialize an empty table
+ *
+ * @param table -> table to initialize
+ * @param entry_size -> bytes of an entry
+ * @param init_entry -> sets an unused entry, or NULL to zero it; called for
+ * every entry of a new page, and for pages lost to a concurrent growth that
+ * are freed right away, so it must not allocate
+ */
+void fd_table_init(FdTable *table, size_t entry_size,
+                   void (*init_entry)(void *entry));
+
+/**
+ * @brief Free the pages of a table
+ *
+ * The entries are not visited: free what they own first (see fd_table_end()).
+ *
+ * @param table -> table to free
+ */
+void fd_table_destroy(FdTable *table);
+
+/**
+ * @brief Entry of an fd, without growing the table
+ *
+ * @param table -> table
+ * @param fd -> file descriptor
+ * @return void* -> entry, NULL if fd is negative or beyond the grown pages
+ */
+void *fd_table_get(const FdTable *table, int fd);
+
+/**
+ * @brief Entry of an fd, growing the table to hold it
+ *
+ * @param table -> table
+ * @param fd -> file descriptor
+ * @return void* -> entry, NULL if fd is negative, at least FD_TABLE_MAX_FDS
+ * or on allocation failure
+ */
+void *fd_table_slot(FdTable *table, int fd);
+
+/**
+ * @brief Bound of the fds with an entry, to visit them all
+ *
+ * @param table -> table
+ * @return int -> every fd with an entry is below it (fd_table_get() may still
+ * return NULL for the fds of pages never grown)
+ */
+int fd_table_end(const FdTable *table);
+
+#endif // FD_TABLE_H
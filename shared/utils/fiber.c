@@ -0,0 +1,282 @@
+#define _GNU_SOURCE
+#include "fiber.h"
+#include "../../logdef.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// task running on this thread, NULL outside of the tasks
+static __thread Fiber *current_fiber = NULL;
+
+/**
+ * @brief Map a stack with a guard page below it
+ *
+ * @return Fiber* -> task with its stack, NULL on error (errno set)
+ */
+static Fiber *fiber_alloc(FiberLoop *loop) {
+  Fiber *fiber = calloc(1, sizeof(Fiber));
+  if (!fiber) {
+    return NULL;
+  }
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  fiber->stack = mmap(NULL, loop->stack_size + page, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (fiber->stack == MAP_FAILED) {
+    int error = errno;
+    free(fiber);
+    errno = error;
+    return NULL;
+  }
+  // an overflow faults instead of writing over the memory below
+  (void)mprotect(fiber->stack, page, PROT_NONE);
+  fiber->loop = loop;
+  return fiber;
+}
+
+static void fiber_free(Fiber *fiber) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  munmap(fiber->stack, fiber->loop->stack_size + page);
+  free(fiber);
+}
+
+/**
+ * @brief Append a task to the ready queue and wake the loop (mutex held)
+ */
+static void push_ready(FiberLoop *loop, Fiber *fiber) {
+  fiber->state = FIBER_READY;
+  fiber->next = NULL;
+  if (loop->ready_tail) {
+    loop->ready_tail->next = fiber;
+  } else {
+    loop->ready_head = fiber;
+  }
+  loop->ready_tail = fiber;
+  pthread_cond_signal(&loop->wake);
+}
+
+static void fiber_entry(void) {
+  Fiber *fiber = current_fiber;
+  fiber->fn(fiber->arg);
+  fiber->state = FIBER_DONE;
+  // returning resumes uc_link, the scheduler
+}
+
+/**
+ * @brief Park the running task until fiber_wake
+ */
+static void fiber_park(Fiber *fiber) {
+  FiberLoop *loop = fiber->loop;
+  pthread_mutex_lock(&loop->mutex);
+  fiber->state = FIBER_PARKING;
+  loop->stats.parks++;
+  pthread_mutex_unlock(&loop->mutex);
+  swapcontext(&fiber->context, &loop->scheduler);
+}
+
+/**
+ * @brief Queue a parked task again, from any thread
+ */
+static void fiber_wake(Fiber *fiber) {
+  FiberLoop *loop = fiber->loop;
+  pthread_mutex_lock(&loop->mutex);
+  if (fiber->state == FIBER_PARKED) {
+    push_ready(loop, fiber);
+  } else {
+    // not switched back to the loop yet: it is queued once it has
+    fiber->wake_pending = 1;
+  }
+  pthread_mutex_unlock(&loop->mutex);
+}
+
+/**
+ * @brief Loop thread: runs the ready tasks until stopped and idle
+ */
+static void *fiber_loop_run(void *arg) {
+  FiberLoop *loop = arg;
+
+  pthread_mutex_lock(&loop->mutex);
+  for (;;) {
+    while (!loop->ready_head && !(loop->stopping && loop->stats.tasks == 0)) {
+      pthread_cond_wait(&loop->wake, &loop->mutex);
+    }
+    Fiber *fiber = loop->ready_head;
+    if (!fiber) {
+      break; // stopping and no task left
+    }
+    loop->ready_head = fiber->next;
+    if (!loop->ready_head) {
+      loop->ready_tail = NULL;
+    }
+    fiber->state = FIBER_RUNNING;
+    pthread_mutex_unlock(&loop->mutex);
+
+    current_fiber = fiber;
+    swapcontext(&loop->scheduler, &fiber->context);
+    current_fiber = NULL;
+
+    pthread_mutex_lock(&loop->mutex);
+    if (fiber->state == FIBER_DONE) {
+      loop->stats.tasks--;
+      if (loop->n_spares < FIBER_SPARE_STACKS) {
+        fiber->next = loop->spares;
+        loop->spares = fiber;
+        loop->n_spares++;
+      } else {
+        fiber_free(fiber);
+      }
+    } else if (fiber->wake_pending) {
+      fiber->wake_pending = 0;
+      push_ready(loop, fiber);
+    } else {
+      fiber->state = FIBER_PARKED;
+    }
+  }
+  pthread_mutex_unlock(&loop->mutex);
+  return NULL;
+}
+
+FiberLoop *fiber_loop_init(size_t stack_size, size_t max_tasks) {
+  FiberLoop *loop = calloc(1, sizeof(FiberLoop));
+  if (!loop) {
+    return NULL;
+  }
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  stack_size = stack_size > 0 ? stack_size : FIBER_STACK_SIZE;
+  loop->stack_size = (stack_size + page - 1) / page * page;
+  loop->max_tasks = max_tasks > 0 ? max_tasks : FIBER_MAX_TASKS;
+
+  if (pthread_mutex_init(&loop->mutex, NULL) != 0) {
+    free(loop);
+    return NULL;
+  }
+  if (pthread_cond_init(&loop->wake, NULL) != 0) {
+    pthread_mutex_destroy(&loop->mutex);
+    free(loop);
+    return NULL;
+  }
+  if (pthread_create(&loop->thread, NULL, fiber_loop_run, loop) != 0) {
+    ERROR_MSG("[FIBER] Failed to start the loop thread");
+    pthread_cond_destroy(&loop->wake);
+    pthread_mutex_destroy(&loop->mutex);
+    free(loop);
+    return NULL;
+  }
+  return loop;
+}
+
+void fiber_loop_destroy(FiberLoop *loop) {
+  if (!loop) {
+    return;
+  }
+  pthread_mutex_lock(&loop->mutex);
+  loop->stopping = 1;
+  pthread_cond_signal(&loop->wake);
+  pthread_mutex_unlock(&loop->mutex);
+  pthread_join(loop->thread, NULL);
+
+  while (loop->spares) {
+    Fiber *next = loop->spares->next;
+    fiber_free(loop->spares);
+    loop->spares = next;
+  }
+  pthread_cond_destroy(&loop->wake);
+  pthread_mutex_destroy(&loop->mutex);
+  free(loop);
+}
+
+int fiber_loop_submit(FiberLoop *loop, FiberFn fn, void *arg) {
+  pthread_mutex_lock(&loop->mutex);
+  if (loop->stopping || loop->stats.tasks >= loop->max_tasks) {
+    loop->stats.rejected++;
+    pthread_mutex_unlock(&loop->mutex);
+    errno = loop->stopping ? ESHUTDOWN : EAGAIN;
+    return -1;
+  }
+  Fiber *fiber = loop->spares;
+  if (fiber) {
+    loop->spares = fiber->next;
+    loop->n_spares--;
+  }
+  loop->stats.tasks++;
+  pthread_mutex_unlock(&loop->mutex);
+
+  if (!fiber) {
+    fiber = fiber_alloc(loop);
+  }
+  if (!fiber || getcontext(&fiber->context) != 0) {
+    int error = fiber ? errno : ENOMEM;
+    if (fiber) {
+      fiber_free(fiber);
+    }
+    pthread_mutex_lock(&loop->mutex);
+    loop->stats.tasks--;
+    loop->stats.rejected++;
+    pthread_cond_signal(&loop->wake); // the loop may be waiting to stop
+    pthread_mutex_unlock(&loop->mutex);
+    errno = error;
+    return -1;
+  }
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  fiber->context.uc_stack.ss_sp = (char *)fiber->stack + page;
+  fiber->context.uc_stack.ss_size = loop->stack_size;
+  fiber->context.uc_link = &loop->scheduler;
+  makecontext(&fiber->context, fiber_entry, 0);
+  fiber->fn = fn;
+  fiber->arg = arg;
+  fiber->wake_pending = 0;
+
+  pthread_mutex_lock(&loop->mutex);
+  loop->stats.submitted++;
+  if (loop->stats.tasks > loop->stats.max_tasks) {
+    loop->stats.max_tasks = loop->stats.tasks;
+  }
+  push_ready(loop, fiber);
+  pthread_mutex_unlock(&loop->mutex);
+  return 0;
+}
+
+void fiber_loop_get_stats(FiberLoop *loop, FiberLoopStats *stats) {
+  pthread_mutex_lock(&loop->mutex);
+  *stats = loop->stats;
+  pthread_mutex_unlock(&loop->mutex);
+}
+
+Fiber *fiber_self(void) { return current_fiber; }
+
+void fiber_event_init(FiberEvent *event) {
+  pthread_mutex_init(&event->mutex, NULL);
+  pthread_cond_init(&event->cond, NULL);
+  event->waiter = NULL;
+  event->done = 0;
+}
+
+void fiber_event_signal(FiberEvent *event) {
+  pthread_mutex_lock(&event->mutex);
+  event->done = 1;
+  if (event->waiter) {
+    fiber_wake(event->waiter);
+  } else {
+    pthread_cond_signal(&event->cond);
+  }
+  pthread_mutex_unlock(&event->mutex);
+}
+
+void fiber_event_wait(FiberEvent *event) {
+  Fiber *self = current_fiber;
+  pthread_mutex_lock(&event->mutex);
+  if (self && !event->done) {
+    event->waiter = self;
+    pthread_mutex_unlock(&event->mutex);
+    fiber_park(self);
+    // the signaller may still hold the mutex
+    pthread_mutex_lock(&event->mutex);
+  }
+  while (!event->done) {
+    pthread_cond_wait(&event->cond, &event->mutex);
+  }
+  pthread_mutex_unlock(&event->mutex);
+  pthread_cond_destroy(&event->cond);
+  pthread_mutex_destroy(&event->mutex);
+}
@@ -0,0 +1,158 @@
+#ifndef FIBER_H
+#define FIBER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <ucontext.h>
+
+#define FIBER_STACK_SIZE (256 * 1024) // default stack of a task
+#define FIBER_MAX_TASKS 4096          // default tasks of a loop at most
+#define FIBER_SPARE_STACKS 64         // stacks of finished tasks kept
+
+/*
+ * ============================================================================
+ * FIBER - LIGHTWEIGHT TASKS ON AN EVENT LOOP THREAD
+ * ============================================================================
+ *
+ * A FiberLoop is one thread running tasks, each on a stack of its own
+ * (ucontext). A task runs until it returns or waits on a FiberEvent: then the
+ * loop switches to the next ready task instead of blocking, and the task is
+ * resumed on the loop thread once the event is signalled, from any thread.
+ * One loop thread thus keeps as many requests outstanding as it has tasks,
+ * each costing the pages its stack touched rather than a thread.
+ *
+ * - FiberEvent is also waited on by plain threads, on a condition: code that
+ *   waits for a completion with it (the remote layer does) parks the task it
+ *   runs on, and blocks the thread otherwise.
+ * - Anything else that blocks (a syscall, a mutex, a layer without such
+ *   completions) blocks the loop thread and every task of the loop: run
+ *   several loops for stacks that have some.
+ * - Tasks are resumed on the thread of their loop only, so thread-local
+ *   state (errno, the connection a thread sticks to) stays consistent.
+ * - Stacks are mmapped with a guard page below them, and those of finished
+ *   tasks are reused, FIBER_SPARE_STACKS at most.
+ * ============================================================================
+ */
+
+typedef void (*FiberFn)(void *arg);
+
+typedef enum {
+  FIBER_READY,   // queued to run
+  FIBER_RUNNING, // on the loop thread
+  FIBER_PARKING, // switching back to the loop to wait
+  FIBER_PARKED,  // waiting for fiber_wake
+  FIBER_DONE,    // returned, its stack is free
+} FiberState;
+
+typedef struct Fiber {
+  ucontext_t context;     // registers and stack of the task
+  void *stack;            // mapping of the stack, guard page included
+  FiberFn fn;             // function of the task
+  void *arg;              // argument of fn
+  struct FiberLoop *loop; // loop it runs on
+  FiberState state;       // protected by the loop mutex
+  int wake_pending;       // woken before it parked
+  struct Fiber *next;     // next task of the ready queue or the spares
+} Fiber;
+
+typedef struct {
+  size_t tasks;     // tasks submitted and not returned
+  size_t max_tasks; // highest tasks seen
+  size_t submitted; // tasks accepted
+  size_t rejected;  // submissions over max_tasks or failed
+  size_t parks;     // waits that switched back to the loop
+} FiberLoopStats;
+
+typedef struct FiberLoop {
+  Fiber *ready_head;     // next task to run
+  Fiber *ready_tail;     // last task to run
+  Fiber *spares;         // finished tasks, with their stack
+  size_t n_spares;       // entries of spares
+  size_t stack_size;     // bytes of each stack
+  size_t max_tasks;      // tasks alive at most
+  FiberLoopStats stats;  // counters
+  int stopping;          // set by destroy, the loop exits once idle
+  ucontext_t scheduler;  // context of the loop, tasks switch back to it
+  pthread_t thread;      // loop thread
+  pthread_mutex_t mutex; // protects the fields above and the task states
+  pthread_cond_t wake;   // signalled when a task is ready or on stop
+} FiberLoop;
+
+/**
+ * @brief Completion a task or a thread waits for
+ */
+typedef struct {
+  pthread_mutex_t mutex; // protects the fields below
+  pthread_cond_t cond;   // signalled for a waiting thread
+  Fiber *waiter;         // task waiting, NULL if none or a thread
+  int done;              // set by fiber_event_signal
+} FiberEvent;
+
+/**
+ * @brief Start a loop thread
+ *
+ * @param stack_size -> bytes of the stack of each task, 0 for
+ * FIBER_STACK_SIZE
+ * @param max_tasks  -> tasks alive at most, 0 for FIBER_MAX_TASKS
+ * @return FiberLoop* -> loop, or NULL on error
+ */
+FiberLoop *fiber_loop_init(size_t stack_size, size_t max_tasks);
+
+/**
+ * @brief Wait until every task returned, then stop the loop and free it
+ *
+ * Parked tasks keep the loop alive until their event is signalled.
+ *
+ * @param loop -> loop to destroy (may be NULL)
+ */
+void fiber_loop_destroy(FiberLoop *loop);
+
+/**
+ * @brief Run fn(arg) as a task of the loop
+ *
+ * @param loop -> loop to run it on
+ * @param fn   -> function of the task
+ * @param arg  -> its argument
+ * @return int -> 0 if queued, -1 with errno set if the loop already has
+ * max_tasks (EAGAIN), is stopping (ESHUTDOWN) or has no memory left: the
+ * caller runs fn itself
+ */
+int fiber_loop_submit(FiberLoop *loop, FiberFn fn, void *arg);
+
+/**
+ * @brief Copy the counters of a loop
+ */
+void fiber_loop_get_stats(FiberLoop *loop, FiberLoopStats *stats);
+
+/**
+ * @brief Task running on the calling thread
+ *
+ * @return Fiber* -> the task, NULL on a plain thread
+ */
+Fiber *fiber_self(void);
+
+/**
+ * @brief Initialize an event not signalled yet
+ */
+void fiber_event_init(FiberEvent *event);
+
+/**
+ * @brief Signal an event, resuming its waiter
+ *
+ * The event may be freed by the waiter as soon as this returns.
+ *
+ * @param event -> event to signal, once
+ */
+void fiber_event_signal(FiberEvent *event);
+
+/**
+ * @brief Wait for an event, then destroy it
+ *
+ * Parks the calling task until the event is signalled, or blocks the
+ * calling thread if it is not a task.
+ *
+ * @param event -> event to wait for, by one waiter
+ */
+void fiber_event_wait(FiberEvent *event);
+
+#endif // FIBER_H
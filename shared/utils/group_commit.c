@@ -0,0 +1,122 @@
+#include "group_commit.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+int group_commit_init(GroupCommit *gc) {
+  memset(gc, 0, sizeof(GroupCommit));
+  if (pthread_mutex_init(&gc->mutex, NULL) != 0) {
+    return -1;
+  }
+  if (pthread_cond_init(&gc->done, NULL) != 0) {
+    pthread_mutex_destroy(&gc->mutex);
+    return -1;
+  }
+  return 0;
+}
+
+void group_commit_destroy(GroupCommit *gc) {
+  GroupCommitEntry *entry, *tmp;
+  HASH_ITER(hh, gc->entries, entry, tmp) {
+    HASH_DEL(gc->entries, entry);
+    free(entry->open);
+    free(entry);
+  }
+  pthread_cond_destroy(&gc->done);
+  pthread_mutex_destroy(&gc->mutex);
+}
+
+/**
+ * @brief Open batch of a key, created with its entry if needed. Called with
+ * the mutex held.
+ *
+ * @return GroupCommitBatch* -> batch, NULL on allocation failure
+ */
+static GroupCommitBatch *open_batch(GroupCommit *gc, const void *key,
+                                    size_t key_len, GroupCommitEntry **out) {
+  GroupCommitEntry *entry;
+  HASH_FIND(hh, gc->entries, key, key_len, entry);
+  if (!entry) {
+    entry = calloc(1, sizeof(GroupCommitEntry) + key_len);
+    if (!entry) {
+      return NULL;
+    }
+    entry->key_len = key_len;
+    memcpy(entry->key, key, key_len);
+    HASH_ADD(hh, gc->entries, key, key_len, entry);
+  }
+  if (!entry->open) {
+    entry->open = calloc(1, sizeof(GroupCommitBatch));
+    if (!entry->open) {
+      if (!entry->running) {
+        HASH_DEL(gc->entries, entry);
+        free(entry);
+      }
+      return NULL;
+    }
+    entry->open->datasync = 1;
+  }
+  *out = entry;
+  return entry->open;
+}
+
+int group_commit_sync(GroupCommit *gc, const void *key, size_t key_len,
+                      int isdatasync, group_commit_fn fn, void *arg) {
+  pthread_mutex_lock(&gc->mutex);
+  gc->calls++;
+  GroupCommitEntry *entry = NULL;
+  GroupCommitBatch *batch = open_batch(gc, key, key_len, &entry);
+  if (!batch) {
+    gc->syncs++;
+    pthread_mutex_unlock(&gc->mutex);
+    return fn(arg, isdatasync);
+  }
+  batch->waiters++;
+  if (!isdatasync) {
+    batch->datasync = 0;
+  }
+
+  // the entry lives while its open batch, or a sync, is not done
+  while (!batch->done && entry->running) {
+    pthread_cond_wait(&gc->done, &gc->mutex);
+  }
+  if (!batch->done) {
+    // lead the batch: later fsyncs start the next one
+    entry->running = 1;
+    entry->open = NULL;
+    gc->syncs++;
+    pthread_mutex_unlock(&gc->mutex);
+
+    int result = fn(arg, batch->datasync);
+    int error = result != 0 ? errno : 0;
+
+    pthread_mutex_lock(&gc->mutex);
+    batch->result = result;
+    batch->error = error;
+    batch->done = 1;
+    entry->running = 0;
+    if (!entry->open) {
+      HASH_DEL(gc->entries, entry);
+      free(entry);
+    }
+    pthread_cond_broadcast(&gc->done);
+  }
+
+  int result = batch->result;
+  int error = batch->error;
+  if (--batch->waiters == 0) {
+    free(batch);
+  }
+  pthread_mutex_unlock(&gc->mutex);
+  if (result != 0) {
+    errno = error;
+  }
+  return result;
+}
+
+void group_commit_get_stats(GroupCommit *gc, GroupCommitStats *stats) {
+  pthread_mutex_lock(&gc->mutex);
+  stats->calls = gc->calls;
+  stats->syncs = gc->syncs;
+  pthread_mutex_unlock(&gc->mutex);
+}
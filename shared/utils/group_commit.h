@@ -0,0 +1,111 @@
+#ifndef __GROUP_COMMIT_H__
+#define __GROUP_COMMIT_H__
+
+#include "../../lib/uthash/src/uthash.h"
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * ============================================================================
+ * GROUP COMMIT - COALESCED FSYNCS
+ * ============================================================================
+ *
+ * Databases have many threads fsync the same files at once, and each fsync
+ * of a layer that publishes metadata (anti-tampering hashes, compression
+ * indexes) costs a full sync of the data and of that metadata. Concurrent
+ * syncs of the same key (a file, a store) are turned into one:
+ *
+ * - An fsync joins the open batch of its key. If no sync of the key is
+ *   running, it leads: it takes the batch and runs the sync once for all of
+ *   its fsyncs, outside the mutex.
+ * - The fsyncs arriving while a sync runs cannot be covered by it (their
+ *   writes may be newer than what it syncs), they form the next batch, led
+ *   by one of them as soon as the running sync ends.
+ * - Every fsync of a batch returns its result and errno. A batch is an
+ *   fdatasync only if all of its fsyncs are.
+ *
+ * Keys are byte strings, copied; a key is dropped once it has no batch.
+ * ============================================================================
+ */
+
+/**
+ * @brief Sync of a batch, run by its leader
+ *
+ * @param arg        -> argument of the leading fsync
+ * @param isdatasync -> every fsync of the batch is an fdatasync
+ * @return int       -> 0 on success, -1 with errno set on error
+ */
+typedef int (*group_commit_fn)(void *arg, int isdatasync);
+
+// fsyncs served by one sync
+typedef struct GroupCommitBatch {
+  int datasync; // every fsync of the batch is an fdatasync
+  int done;     // the sync ran, result and error are set
+  int result;   // of the sync
+  int error;    // errno of the sync
+  int waiters;  // fsyncs of the batch not returned yet
+} GroupCommitBatch;
+
+typedef struct GroupCommitEntry {
+  GroupCommitBatch *open; // batch the next fsyncs join, NULL if none
+  int running;            // a leader is syncing the key
+  UT_hash_handle hh;      // by key
+  size_t key_len;
+  unsigned char key[];
+} GroupCommitEntry;
+
+typedef struct {
+  size_t calls; // fsyncs asked for
+  size_t syncs; // syncs run to serve them
+} GroupCommitStats;
+
+typedef struct {
+  GroupCommitEntry *entries; // keys with a batch
+  size_t calls;              // fsyncs asked for
+  size_t syncs;              // syncs run to serve them
+  pthread_mutex_t mutex;     // protects the fields above and the batches
+  pthread_cond_t done;       // signaled when a sync ends
+} GroupCommit;
+
+/**
+ * @brief Initialize a group commit
+ *
+ * @param gc   -> group commit
+ * @return int -> 0 on success, -1 on error
+ */
+int group_commit_init(GroupCommit *gc);
+
+/**
+ * @brief Destroy a group commit, no fsync may be in progress
+ *
+ * @param gc -> group commit
+ */
+void group_commit_destroy(GroupCommit *gc);
+
+/**
+ * @brief fsync through the group commit of a key
+ *
+ * Waits for the running sync of the key, if any, then joins the next batch;
+ * fn runs for the batch with the arg of whichever fsync leads it. If the
+ * batch cannot be allocated, fn runs for this fsync alone.
+ *
+ * @param gc         -> group commit
+ * @param key        -> what is synced (a file)
+ * @param key_len    -> bytes of key
+ * @param isdatasync -> fdatasync instead of fsync
+ * @param fn         -> sync of the key
+ * @param arg        -> argument of fn if this fsync leads
+ * @return int       -> result of the batch's sync, errno set as it left it
+ */
+int group_commit_sync(GroupCommit *gc, const void *key, size_t key_len,
+                      int isdatasync, group_commit_fn fn, void *arg);
+
+/**
+ * @brief Snapshot of the counters
+ *
+ * @param gc    -> group commit
+ * @param stats -> output
+ */
+void group_commit_get_stats(GroupCommit *gc, GroupCommitStats *stats);
+
+#endif // __GROUP_COMMIT_H__
@@ -0,0 +1,280 @@
+#include "blake3.h"
+#include <string.h>
+
+#define CHUNK_START (1u << 0)
+#define CHUNK_END (1u << 1)
+#define PARENT (1u << 2)
+#define ROOT (1u << 3)
+#define KEYED_HASH (1u << 4)
+
+static const uint32_t blake3_iv[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372,
+                                      0xA54FF53A, 0x510E527F, 0x9B05688C,
+                                      0x1F83D9AB, 0x5BE0CD19};
+
+static const uint8_t msg_permutation[16] = {2, 6,  3,  10, 7, 0,  4,  13,
+                                            1, 11, 12, 5,  9, 14, 15, 8};
+
+static inline uint32_t rotr32(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t load32_le(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+static inline void store32_le(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+static inline void g(uint32_t *s, int a, int b, int c, int d, uint32_t mx,
+                     uint32_t my) {
+  s[a] = s[a] + s[b] + mx;
+  s[d] = rotr32(s[d] ^ s[a], 16);
+  s[c] = s[c] + s[d];
+  s[b] = rotr32(s[b] ^ s[c], 12);
+  s[a] = s[a] + s[b] + my;
+  s[d] = rotr32(s[d] ^ s[a], 8);
+  s[c] = s[c] + s[d];
+  s[b] = rotr32(s[b] ^ s[c], 7);
+}
+
+static void round_fn(uint32_t s[16], const uint32_t m[16]) {
+  // columns
+  g(s, 0, 4, 8, 12, m[0], m[1]);
+  g(s, 1, 5, 9, 13, m[2], m[3]);
+  g(s, 2, 6, 10, 14, m[4], m[5]);
+  g(s, 3, 7, 11, 15, m[6], m[7]);
+  // diagonals
+  g(s, 0, 5, 10, 15, m[8], m[9]);
+  g(s, 1, 6, 11, 12, m[10], m[11]);
+  g(s, 2, 7, 8, 13, m[12], m[13]);
+  g(s, 3, 4, 9, 14, m[14], m[15]);
+}
+
+/**
+ * @brief BLAKE3 compression function, returns the full 16-word state
+ */
+static void compress(const uint32_t cv[8], const uint32_t block_words[16],
+                     uint64_t counter, uint32_t block_len, uint32_t flags,
+                     uint32_t out[16]) {
+  uint32_t s[16] = {cv[0],
+                    cv[1],
+                    cv[2],
+                    cv[3],
+                    cv[4],
+                    cv[5],
+                    cv[6],
+                    cv[7],
+                    blake3_iv[0],
+                    blake3_iv[1],
+                    blake3_iv[2],
+                    blake3_iv[3],
+                    (uint32_t)counter,
+                    (uint32_t)(counter >> 32),
+                    block_len,
+                    flags};
+  uint32_t m[16];
+  memcpy(m, block_words, sizeof(m));
+
+  for (int r = 0; r < 7; r++) {
+    round_fn(s, m);
+    if (r < 6) {
+      uint32_t permuted[16];
+      for (int i = 0; i < 16; i++) {
+        permuted[i] = m[msg_permutation[i]];
+      }
+      memcpy(m, permuted, sizeof(m));
+    }
+  }
+
+  for (int i = 0; i < 8; i++) {
+    out[i] = s[i] ^ s[i + 8];
+    out[i + 8] = s[i + 8] ^ cv[i];
+  }
+}
+
+static void words_from_block(const uint8_t block[BLAKE3_BLOCK_LEN],
+                             uint32_t words[16]) {
+  for (int i = 0; i < 16; i++) {
+    words[i] = load32_le(block + (4 * i));
+  }
+}
+
+// Inputs of the last compression of a node, kept until we know if it is root
+typedef struct {
+  uint32_t input_cv[8];
+  uint32_t block_words[16];
+  uint64_t counter;
+  uint32_t block_len;
+  uint32_t flags;
+} Output;
+
+static void output_chaining_value(const Output *o, uint32_t cv[8]) {
+  uint32_t out[16];
+  compress(o->input_cv, o->block_words, o->counter, o->block_len, o->flags,
+           out);
+  memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+static void output_root_bytes(const Output *o, uint8_t out[BLAKE3_OUT_LEN]) {
+  uint32_t words[16];
+  // the root counter is the output block counter: 0 for a 32-byte digest
+  compress(o->input_cv, o->block_words, 0, o->block_len, o->flags | ROOT,
+           words);
+  for (int i = 0; i < 8; i++) {
+    store32_le(out + (4 * i), words[i]);
+  }
+}
+
+static void parent_output(const uint32_t left[8], const uint32_t right[8],
+                          const uint32_t key[8], uint32_t flags, Output *o) {
+  memcpy(o->input_cv, key, 8 * sizeof(uint32_t));
+  memcpy(o->block_words, left, 8 * sizeof(uint32_t));
+  memcpy(o->block_words + 8, right, 8 * sizeof(uint32_t));
+  o->counter = 0;
+  o->block_len = BLAKE3_BLOCK_LEN;
+  o->flags = PARENT | flags;
+}
+
+static void chunk_init(Blake3ChunkState *c, const uint32_t key[8],
+                       uint64_t chunk_counter, uint32_t flags) {
+  memcpy(c->cv, key, sizeof(c->cv));
+  c->chunk_counter = chunk_counter;
+  memset(c->block, 0, sizeof(c->block));
+  c->block_len = 0;
+  c->blocks_compressed = 0;
+  c->flags = flags;
+}
+
+static inline size_t chunk_len(const Blake3ChunkState *c) {
+  return ((size_t)c->blocks_compressed * BLAKE3_BLOCK_LEN) + c->block_len;
+}
+
+static inline uint32_t chunk_start_flag(const Blake3ChunkState *c) {
+  return c->blocks_compressed == 0 ? CHUNK_START : 0;
+}
+
+static void chunk_update(Blake3ChunkState *c, const uint8_t *input,
+                         size_t input_len) {
+  while (input_len > 0) {
+    // the last block of a chunk is only compressed in chunk_output
+    if (c->block_len == BLAKE3_BLOCK_LEN) {
+      uint32_t words[16];
+      uint32_t out[16];
+      words_from_block(c->block, words);
+      compress(c->cv, words, c->chunk_counter, BLAKE3_BLOCK_LEN,
+               c->flags | chunk_start_flag(c), out);
+      memcpy(c->cv, out, sizeof(c->cv));
+      c->blocks_compressed++;
+      memset(c->block, 0, sizeof(c->block));
+      c->block_len = 0;
+    }
+
+    size_t take = BLAKE3_BLOCK_LEN - c->block_len;
+    if (take > input_len) {
+      take = input_len;
+    }
+    memcpy(c->block + c->block_len, input, take);
+    c->block_len += (uint8_t)take;
+    input += take;
+    input_len -= take;
+  }
+}
+
+static void chunk_output(const Blake3ChunkState *c, Output *o) {
+  memcpy(o->input_cv, c->cv, sizeof(o->input_cv));
+  words_from_block(c->block, o->block_words);
+  o->counter = c->chunk_counter;
+  o->block_len = c->block_len;
+  o->flags = c->flags | chunk_start_flag(c) | CHUNK_END;
+}
+
+static void init_with(Blake3State *state, const uint32_t key[8],
+                      uint32_t flags) {
+  memcpy(state->key, key, sizeof(state->key));
+  chunk_init(&state->chunk, key, 0, flags);
+  state->cv_stack_len = 0;
+  state->flags = flags;
+}
+
+/**
+ * @brief Initialize a BLAKE3 state for the regular hash
+ */
+void blake3_init(Blake3State *state) { init_with(state, blake3_iv, 0); }
+
+/**
+ * @brief Initialize a BLAKE3 state for the keyed hash
+ */
+void blake3_init_keyed(Blake3State *state, const uint8_t key[BLAKE3_KEY_LEN]) {
+  uint32_t key_words[8];
+  for (int i = 0; i < 8; i++) {
+    key_words[i] = load32_le(key + (4 * i));
+  }
+  init_with(state, key_words, KEYED_HASH);
+}
+
+/**
+ * @brief Merge a completed chunk into the tree: every trailing zero bit of the
+ * chunk count completes one more subtree
+ */
+static void add_chunk_chaining_value(Blake3State *state, uint32_t cv[8],
+                                     uint64_t total_chunks) {
+  while ((total_chunks & 1) == 0) {
+    Output parent;
+    state->cv_stack_len--;
+    parent_output(state->cv_stack[state->cv_stack_len], cv, state->key,
+                  state->flags, &parent);
+    output_chaining_value(&parent, cv);
+    total_chunks >>= 1;
+  }
+  memcpy(state->cv_stack[state->cv_stack_len], cv, 8 * sizeof(uint32_t));
+  state->cv_stack_len++;
+}
+
+/**
+ * @brief Absorb input
+ */
+void blake3_update(Blake3State *state, const void *input, size_t input_len) {
+  const uint8_t *in = input;
+  while (input_len > 0) {
+    // a full chunk is only finished once more input arrives
+    if (chunk_len(&state->chunk) == BLAKE3_CHUNK_LEN) {
+      Output o;
+      uint32_t cv[8];
+      chunk_output(&state->chunk, &o);
+      output_chaining_value(&o, cv);
+      const uint64_t total_chunks = state->chunk.chunk_counter + 1;
+      add_chunk_chaining_value(state, cv, total_chunks);
+      chunk_init(&state->chunk, state->key, total_chunks, state->flags);
+    }
+
+    size_t take = BLAKE3_CHUNK_LEN - chunk_len(&state->chunk);
+    if (take > input_len) {
+      take = input_len;
+    }
+    chunk_update(&state->chunk, in, take);
+    in += take;
+    input_len -= take;
+  }
+}
+
+/**
+ * @brief Write the BLAKE3_OUT_LEN bytes digest of the input absorbed so far
+ */
+void blake3_final(const Blake3State *state, uint8_t out[BLAKE3_OUT_LEN]) {
+  Output o;
+  chunk_output(&state->chunk, &o);
+  size_t remaining = state->cv_stack_len;
+  while (remaining > 0) {
+    remaining--;
+    uint32_t right[8];
+    output_chaining_value(&o, right);
+    parent_output(state->cv_stack[remaining], right, state->key, state->flags,
+                  &o);
+  }
+  output_root_bytes(&o, out);
+}
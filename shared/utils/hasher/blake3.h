@@ -0,0 +1,74 @@
+#ifndef __BLAKE3_H__
+#define __BLAKE3_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * ============================================================================
+ * BLAKE3 (portable implementation)
+ * ============================================================================
+ *
+ * Incremental BLAKE3 with 32-byte output, in the regular and keyed modes.
+ * Follows the reference implementation of the BLAKE3 specification: 1 KiB
+ * chunks, 7-round compression function and a binary tree of chaining values
+ * merged as chunks complete.
+ * ============================================================================
+ */
+
+#define BLAKE3_KEY_LEN 32
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54 // log2 of the maximum number of chunks (2^64 B)
+
+typedef struct {
+  uint32_t cv[8];                   // chaining value of the current chunk
+  uint64_t chunk_counter;           // index of the current chunk
+  uint8_t block[BLAKE3_BLOCK_LEN];  // pending input of the current block
+  uint8_t block_len;                // bytes in block
+  uint8_t blocks_compressed;        // blocks of the chunk already compressed
+  uint32_t flags;                   // mode flags (keyed hash)
+} Blake3ChunkState;
+
+typedef struct {
+  uint32_t key[8];                          // IV, or the key in keyed mode
+  Blake3ChunkState chunk;                   // chunk being filled
+  uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];   // chaining values of subtrees
+  uint8_t cv_stack_len;                     // entries in cv_stack
+  uint32_t flags;                           // mode flags (keyed hash)
+} Blake3State;
+
+/**
+ * @brief Initialize a BLAKE3 state for the regular hash
+ *
+ * @param state State to initialize
+ */
+void blake3_init(Blake3State *state);
+
+/**
+ * @brief Initialize a BLAKE3 state for the keyed hash
+ *
+ * @param state State to initialize
+ * @param key BLAKE3_KEY_LEN bytes key
+ */
+void blake3_init_keyed(Blake3State *state, const uint8_t key[BLAKE3_KEY_LEN]);
+
+/**
+ * @brief Absorb input
+ *
+ * @param state Initialized state
+ * @param input Input bytes
+ * @param input_len Number of input bytes
+ */
+void blake3_update(Blake3State *state, const void *input, size_t input_len);
+
+/**
+ * @brief Write the BLAKE3_OUT_LEN bytes digest of the input absorbed so far
+ *
+ * @param state State (not modified, more input can still be added)
+ * @param out Output buffer of at least BLAKE3_OUT_LEN bytes
+ */
+void blake3_final(const Blake3State *state, uint8_t out[BLAKE3_OUT_LEN]);
+
+#endif /* __BLAKE3_H__ */
@@ -0,0 +1,335 @@
+#include "blake3_hasher.h"
+#include "../conversion.h"
+#include "hasher_context.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLAKE3_HASH_CHUNK_SIZE 65536 // multiple of BLAKE3_CHUNK_LEN
+
+static uint8_t keyed_hash_key[BLAKE3_KEY_LEN];
+static int keyed_hash_key_set = 0;
+static pthread_mutex_t keyed_hash_key_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void state_init(Blake3State *state, int keyed) {
+  if (keyed) {
+    blake3_init_keyed(state, keyed_hash_key);
+  } else {
+    blake3_init(state);
+  }
+}
+
+static int digest_file(int fd, LayerContext layer, int keyed,
+                       uint8_t out[BLAKE3_OUT_LEN]) {
+  if (fd < 0 || !layer.ops || !layer.ops->lpread) {
+    return -1;
+  }
+
+  unsigned char *read_buffer =
+      hasher_context_read_buffer(hasher_context_get(), BLAKE3_HASH_CHUNK_SIZE);
+  if (read_buffer == NULL) {
+    return -1;
+  }
+
+  Blake3State state;
+  state_init(&state, keyed);
+
+  HasherFileReader reader;
+  hasher_file_reader_open(&reader, fd, layer, 1);
+  ssize_t bytes_read;
+  off_t offset = 0;
+  while ((bytes_read = hasher_file_read(&reader, read_buffer,
+                                        BLAKE3_HASH_CHUNK_SIZE, offset)) > 0) {
+    blake3_update(&state, read_buffer, (size_t)bytes_read);
+    offset += bytes_read;
+  }
+  hasher_file_reader_close(&reader);
+
+  if (bytes_read < 0) {
+    // Error during read
+    return -1;
+  }
+
+  blake3_final(&state, out);
+  return 0;
+}
+
+static void digest_buffer(const void *data_buffer, size_t data_size,
+                          int keyed, uint8_t out[BLAKE3_OUT_LEN]) {
+  Blake3State state;
+  state_init(&state, keyed);
+  blake3_update(&state, data_buffer, data_size);
+  blake3_final(&state, out);
+}
+
+static char *to_hex(const uint8_t hash[BLAKE3_OUT_LEN]) {
+  char *hex_hash_str = malloc(blake3_get_hex_size());
+  if (hex_hash_str == NULL) {
+    return NULL;
+  }
+  bytes_to_hex(hash, BLAKE3_OUT_LEN, hex_hash_str);
+  return hex_hash_str;
+}
+
+static int to_hex_into(const uint8_t hash[BLAKE3_OUT_LEN], char *hex,
+                       size_t hex_size) {
+  if (!hex || hex_size < blake3_get_hex_size()) {
+    return -1;
+  }
+  bytes_to_hex(hash, BLAKE3_OUT_LEN, hex);
+  return BLAKE3_OUT_LEN * 2;
+}
+
+static int file_hex_into(int fd, LayerContext layer, char *hex,
+                         size_t hex_size, int keyed) {
+  uint8_t hash[BLAKE3_OUT_LEN];
+  if (digest_file(fd, layer, keyed, hash) != 0) {
+    return -1;
+  }
+  return to_hex_into(hash, hex, hex_size);
+}
+
+static int buffer_hex_into(const void *data_buffer, size_t data_size,
+                           char *hex, size_t hex_size, int keyed) {
+  if (!data_buffer) {
+    return -1;
+  }
+  uint8_t hash[BLAKE3_OUT_LEN];
+  digest_buffer(data_buffer, data_size, keyed, hash);
+  return to_hex_into(hash, hex, hex_size);
+}
+
+static char *file_hex(int fd, LayerContext layer, int keyed) {
+  uint8_t hash[BLAKE3_OUT_LEN];
+  if (digest_file(fd, layer, keyed, hash) != 0) {
+    return NULL;
+  }
+  return to_hex(hash);
+}
+
+static char *buffer_hex(const void *data_buffer, size_t data_size, int keyed) {
+  if (!data_buffer) {
+    return NULL;
+  }
+  uint8_t hash[BLAKE3_OUT_LEN];
+  digest_buffer(data_buffer, data_size, keyed, hash);
+  return to_hex(hash);
+}
+
+static int file_binary(int fd, LayerContext layer, void *hash_buffer,
+                       size_t hash_buffer_size, int keyed) {
+  if (!hash_buffer || hash_buffer_size < BLAKE3_OUT_LEN) {
+    return -1;
+  }
+  if (digest_file(fd, layer, keyed, hash_buffer) != 0) {
+    return -1;
+  }
+  return BLAKE3_OUT_LEN;
+}
+
+static int buffer_binary(const void *data_buffer, size_t data_size, void *out,
+                         size_t out_size, int keyed) {
+  if (!data_buffer || !out || out_size < BLAKE3_OUT_LEN) {
+    return -1;
+  }
+  digest_buffer(data_buffer, data_size, keyed, out);
+  return BLAKE3_OUT_LEN;
+}
+
+static int blocks_binary(const void *const *buffers, const size_t *sizes,
+                         size_t n, void *hash_buffer, size_t hash_buffer_size,
+                         int keyed) {
+  if (!buffers || !sizes || !hash_buffer ||
+      hash_buffer_size / BLAKE3_OUT_LEN < n) {
+    return -1;
+  }
+
+  uint8_t *out = hash_buffer;
+  for (size_t i = 0; i < n; i++) {
+    if (!buffers[i]) {
+      return -1;
+    }
+    digest_buffer(buffers[i], sizes[i], keyed, out + (i * BLAKE3_OUT_LEN));
+  }
+  return (int)n;
+}
+
+/**
+ * @brief BLAKE3 hash file and return hex string
+ */
+char *blake3_hash_file_hex(int fd, LayerContext layer) {
+  return file_hex(fd, layer, 0);
+}
+
+/**
+ * @brief BLAKE3 hash buffer and return hex string
+ */
+char *blake3_hash_buffer_hex(const void *data_buffer, size_t data_size) {
+  return buffer_hex(data_buffer, data_size, 0);
+}
+
+/**
+ * @brief BLAKE3 hash file into a caller provided hex buffer
+ */
+int blake3_hash_file_hex_into(int fd, LayerContext layer, char *hex,
+                              size_t hex_size) {
+  return file_hex_into(fd, layer, hex, hex_size, 0);
+}
+
+/**
+ * @brief BLAKE3 hash buffer into a caller provided hex buffer
+ */
+int blake3_hash_buffer_hex_into(const void *data_buffer, size_t data_size,
+                                char *hex, size_t hex_size) {
+  return buffer_hex_into(data_buffer, data_size, hex, hex_size, 0);
+}
+
+/**
+ * @brief BLAKE3 hash file and return binary hash
+ */
+int blake3_hash_file_binary(int fd, LayerContext layer, void *hash_buffer,
+                            size_t hash_buffer_size) {
+  return file_binary(fd, layer, hash_buffer, hash_buffer_size, 0);
+}
+
+/**
+ * @brief BLAKE3 hash buffer and return binary hash
+ */
+int blake3_hash_buffer_binary(const void *data_buffer, size_t data_size,
+                              void *hash_buffer, size_t hash_buffer_size) {
+  return buffer_binary(data_buffer, data_size, hash_buffer, hash_buffer_size,
+                       0);
+}
+
+/**
+ * @brief BLAKE3 hash of many buffers
+ */
+int blake3_hash_blocks_binary(const void *const *buffers, const size_t *sizes,
+                              size_t n, void *hash_buffer,
+                              size_t hash_buffer_size) {
+  return blocks_binary(buffers, sizes, n, hash_buffer, hash_buffer_size, 0);
+}
+
+static char *blake3_keyed_hash_file_hex(int fd, LayerContext layer) {
+  return file_hex(fd, layer, 1);
+}
+
+static char *blake3_keyed_hash_buffer_hex(const void *data_buffer,
+                                          size_t data_size) {
+  return buffer_hex(data_buffer, data_size, 1);
+}
+
+static int blake3_keyed_hash_file_hex_into(int fd, LayerContext layer,
+                                           char *hex, size_t hex_size) {
+  return file_hex_into(fd, layer, hex, hex_size, 1);
+}
+
+static int blake3_keyed_hash_buffer_hex_into(const void *data_buffer,
+                                             size_t data_size, char *hex,
+                                             size_t hex_size) {
+  return buffer_hex_into(data_buffer, data_size, hex, hex_size, 1);
+}
+
+static int blake3_keyed_hash_file_binary(int fd, LayerContext layer,
+                                         void *hash_buffer,
+                                         size_t hash_buffer_size) {
+  return file_binary(fd, layer, hash_buffer, hash_buffer_size, 1);
+}
+
+static int blake3_keyed_hash_buffer_binary(const void *data_buffer,
+                                           size_t data_size, void *hash_buffer,
+                                           size_t hash_buffer_size) {
+  return buffer_binary(data_buffer, data_size, hash_buffer, hash_buffer_size,
+                       1);
+}
+
+static int blake3_keyed_hash_blocks_binary(const void *const *buffers,
+                                           const size_t *sizes, size_t n,
+                                           void *hash_buffer,
+                                           size_t hash_buffer_size) {
+  return blocks_binary(buffers, sizes, n, hash_buffer, hash_buffer_size, 1);
+}
+
+/**
+ * @brief Get BLAKE3 binary hash size
+ */
+size_t blake3_get_hash_size(void) { return BLAKE3_OUT_LEN; }
+
+/**
+ * @brief Get BLAKE3 hex string size
+ */
+size_t blake3_get_hex_size(void) {
+  return BLAKE3_OUT_LEN * 2 + 1; // 32 bytes * 2 characters + 1 null terminator
+}
+
+/**
+ * @brief Initialize BLAKE3 hasher
+ */
+int blake3_hasher_init(Hasher *hasher) {
+  if (!hasher) {
+    return -1;
+  }
+
+  hasher->algorithm = HASH_BLAKE3;
+  hasher->hash_file_hex = blake3_hash_file_hex;
+  hasher->hash_buffer_hex = blake3_hash_buffer_hex;
+  hasher->hash_file_hex_into = blake3_hash_file_hex_into;
+  hasher->hash_buffer_hex_into = blake3_hash_buffer_hex_into;
+  hasher->hash_file_binary = blake3_hash_file_binary;
+  hasher->hash_buffer_binary = blake3_hash_buffer_binary;
+  hasher->hash_blocks_binary = blake3_hash_blocks_binary;
+  hasher->get_hash_size = blake3_get_hash_size;
+  hasher->get_hex_size = blake3_get_hex_size;
+
+  return 0;
+}
+
+/**
+ * @brief Set the process-wide key of the keyed BLAKE3 hasher
+ */
+int blake3_hasher_set_key(const uint8_t key[BLAKE3_KEY_LEN]) {
+  if (!key) {
+    return -1;
+  }
+
+  int res = 0;
+  pthread_mutex_lock(&keyed_hash_key_mutex);
+  if (!keyed_hash_key_set) {
+    memcpy(keyed_hash_key, key, BLAKE3_KEY_LEN);
+    keyed_hash_key_set = 1;
+  } else if (memcmp(keyed_hash_key, key, BLAKE3_KEY_LEN) != 0) {
+    res = -1;
+  }
+  pthread_mutex_unlock(&keyed_hash_key_mutex);
+  return res;
+}
+
+/**
+ * @brief Initialize keyed BLAKE3 hasher (MAC with the process-wide key)
+ */
+int blake3_keyed_hasher_init(Hasher *hasher) {
+  if (!hasher) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&keyed_hash_key_mutex);
+  int key_set = keyed_hash_key_set;
+  pthread_mutex_unlock(&keyed_hash_key_mutex);
+  if (!key_set) {
+    return -1;
+  }
+
+  hasher->algorithm = HASH_BLAKE3_KEYED;
+  hasher->hash_file_hex = blake3_keyed_hash_file_hex;
+  hasher->hash_buffer_hex = blake3_keyed_hash_buffer_hex;
+  hasher->hash_file_hex_into = blake3_keyed_hash_file_hex_into;
+  hasher->hash_buffer_hex_into = blake3_keyed_hash_buffer_hex_into;
+  hasher->hash_file_binary = blake3_keyed_hash_file_binary;
+  hasher->hash_buffer_binary = blake3_keyed_hash_buffer_binary;
+  hasher->hash_blocks_binary = blake3_keyed_hash_blocks_binary;
+  hasher->get_hash_size = blake3_get_hash_size;
+  hasher->get_hex_size = blake3_get_hex_size;
+
+  return 0;
+}
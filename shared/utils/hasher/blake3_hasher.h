@@ -0,0 +1,132 @@
+#ifndef __BLAKE3_HASHER_H__
+#define __BLAKE3_HASHER_H__
+
+#include "blake3.h"
+#include "hasher.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief BLAKE3 hash file and return hex string
+ *
+ * @param fd File descriptor to read from
+ * @param layer LayerContext to use for reading data
+ * @return char* Hex string of the hash (must be freed by caller), or NULL on
+ * error
+ */
+char *blake3_hash_file_hex(int fd, LayerContext layer);
+
+/**
+ * @brief BLAKE3 hash buffer and return hex string
+ *
+ * @param data_buffer Pointer to the input data to hash
+ * @param data_size Size of the input data in bytes
+ * @return char* Hex string of the hash (must be freed by caller), or NULL on
+ * error
+ */
+char *blake3_hash_buffer_hex(const void *data_buffer, size_t data_size);
+
+/**
+ * @brief BLAKE3 hash file into a caller provided hex buffer
+ *
+ * @param fd File descriptor to read from
+ * @param layer LayerContext to use for reading data
+ * @param hex Output buffer for the null-terminated hex string
+ * @param hex_size Size of the output buffer
+ * @return int Number of hex characters written, or -1 on error
+ */
+int blake3_hash_file_hex_into(int fd, LayerContext layer, char *hex,
+                              size_t hex_size);
+
+/**
+ * @brief BLAKE3 hash buffer into a caller provided hex buffer
+ *
+ * @param data_buffer Pointer to the input data to hash
+ * @param data_size Size of the input data in bytes
+ * @param hex Output buffer for the null-terminated hex string
+ * @param hex_size Size of the output buffer
+ * @return int Number of hex characters written, or -1 on error
+ */
+int blake3_hash_buffer_hex_into(const void *data_buffer, size_t data_size,
+                                char *hex, size_t hex_size);
+
+/**
+ * @brief BLAKE3 hash file and return binary hash
+ *
+ * @param fd File descriptor to read from
+ * @param layer LayerContext to use for reading data
+ * @param hash_buffer Output buffer for binary hash
+ * @param hash_buffer_size Size of the output buffer
+ * @return int Number of bytes written to hash_buffer, or -1 on error
+ */
+int blake3_hash_file_binary(int fd, LayerContext layer, void *hash_buffer,
+                            size_t hash_buffer_size);
+
+/**
+ * @brief BLAKE3 hash buffer and return binary hash
+ *
+ * @param data_buffer Pointer to the input data to hash
+ * @param data_size Size of the input data in bytes
+ * @param hash_buffer Output buffer for binary hash
+ * @param hash_buffer_size Size of the output buffer
+ * @return int Number of bytes written to hash_buffer, or -1 on error
+ */
+int blake3_hash_buffer_binary(const void *data_buffer, size_t data_size,
+                              void *hash_buffer, size_t hash_buffer_size);
+
+/**
+ * @brief BLAKE3 hash of many buffers
+ *
+ * @param buffers Array of n input buffers
+ * @param sizes Array of n buffer sizes in bytes
+ * @param n Number of buffers
+ * @param hash_buffer Output buffer: n binary hashes, back to back
+ * @param hash_buffer_size Size of the output buffer
+ * @return int Number of hashes written to hash_buffer, or -1 on error
+ */
+int blake3_hash_blocks_binary(const void *const *buffers, const size_t *sizes,
+                              size_t n, void *hash_buffer,
+                              size_t hash_buffer_size);
+
+/**
+ * @brief Get BLAKE3 binary hash size
+ *
+ * @return size_t Size of BLAKE3 hash in bytes (32)
+ */
+size_t blake3_get_hash_size(void);
+
+/**
+ * @brief Get BLAKE3 hex string size
+ *
+ * @return size_t Size of BLAKE3 hex string including null terminator (65)
+ */
+size_t blake3_get_hex_size(void);
+
+/**
+ * @brief Initialize BLAKE3 hasher
+ *
+ * @param hasher Pointer to the hasher to initialize
+ * @return 0 on success, -1 on error
+ */
+int blake3_hasher_init(Hasher *hasher);
+
+/**
+ * @brief Set the process-wide key of the keyed BLAKE3 hasher
+ *
+ * Hasher callbacks carry no state, so every HASH_BLAKE3_KEYED hasher of the
+ * process uses the same key. Setting the same key again is a no-op.
+ *
+ * @param key BLAKE3_KEY_LEN bytes key
+ * @return 0 on success, -1 if a different key is already set
+ */
+int blake3_hasher_set_key(const uint8_t key[BLAKE3_KEY_LEN]);
+
+/**
+ * @brief Initialize keyed BLAKE3 hasher (MAC with the process-wide key)
+ *
+ * @param hasher Pointer to the hasher to initialize
+ * @return 0 on success, -1 on error or if no key was set
+ */
+int blake3_keyed_hasher_init(Hasher *hasher);
+
+#endif /* __BLAKE3_HASHER_H__ */
@@ -0,0 +1,206 @@
+#include "chunk_hasher.h"
+#include "hasher_context.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Work shared by all threads hashing the chunks of one file
+typedef struct {
+  const Hasher *hasher;
+  HasherFileReader reader;
+  off_t file_size;
+  size_t chunk_size;
+  size_t n_chunks;
+  uint8_t *leaves;
+  size_t digest_size;
+  size_t next_chunk; // next chunk to hash, protected by mutex
+  int failed;        // set when any chunk fails, protected by mutex
+  uint8_t zero_digest[HASHER_MAX_HASH_SIZE]; // of a whole hole chunk
+  int has_zero_digest;                         // protected by mutex
+  pthread_mutex_t mutex;
+} ChunkHashJob;
+
+/**
+ * @brief Number of chunks of a file
+ */
+size_t chunk_hasher_count(off_t file_size, size_t chunk_size) {
+  if (file_size <= 0 || chunk_size == 0) {
+    return 0;
+  }
+  return (((size_t)file_size - 1) / chunk_size) + 1;
+}
+
+/**
+ * @brief Read and hash one chunk into its leaf
+ */
+static int hash_chunk(ChunkHashJob *job, size_t idx, uint8_t *buffer) {
+  const off_t chunk_off = (off_t)(idx * job->chunk_size);
+  size_t len = job->chunk_size;
+  if (chunk_off + (off_t)len > job->file_size) {
+    len = (size_t)(job->file_size - chunk_off);
+  }
+  uint8_t *leaf = job->leaves + (idx * job->digest_size);
+
+  // the whole chunks in a hole all have the digest of the first one
+  const int zero_chunk =
+      len == job->chunk_size &&
+      hasher_file_zeroes(&job->reader, chunk_off, (off_t)len) == (off_t)len;
+  if (zero_chunk) {
+    pthread_mutex_lock(&job->mutex);
+    const int known = job->has_zero_digest;
+    if (known) {
+      memcpy(leaf, job->zero_digest, job->digest_size);
+    }
+    pthread_mutex_unlock(&job->mutex);
+    if (known) {
+      return 0;
+    }
+    memset(buffer, 0, len);
+  }
+
+  size_t done = zero_chunk ? len : 0;
+  while (done < len) {
+    ssize_t r = hasher_file_read(&job->reader, buffer + done, len - done,
+                                 chunk_off + (off_t)done);
+    if (r < 0) {
+      return -1;
+    }
+    if (r == 0) {
+      // file shrank behind our back: hash what is there
+      len = done;
+      break;
+    }
+    done += (size_t)r;
+  }
+
+  if (job->hasher->hash_buffer_binary(buffer, len, leaf, job->digest_size) <
+      0) {
+    return -1;
+  }
+  if (zero_chunk) {
+    pthread_mutex_lock(&job->mutex);
+    memcpy(job->zero_digest, leaf, job->digest_size);
+    job->has_zero_digest = 1;
+    pthread_mutex_unlock(&job->mutex);
+  }
+  return 0;
+}
+
+/**
+ * @brief Take chunks from the job until none is left or one failed
+ */
+static void *chunk_hash_worker(void *arg) {
+  ChunkHashJob *job = arg;
+
+  uint8_t *buffer = malloc(job->chunk_size);
+  if (!buffer) {
+    pthread_mutex_lock(&job->mutex);
+    job->failed = 1;
+    pthread_mutex_unlock(&job->mutex);
+    return NULL;
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&job->mutex);
+    const size_t idx = job->next_chunk;
+    const int stop = job->failed || idx >= job->n_chunks;
+    if (!stop) {
+      job->next_chunk++;
+    }
+    pthread_mutex_unlock(&job->mutex);
+    if (stop) {
+      break;
+    }
+
+    if (hash_chunk(job, idx, buffer) != 0) {
+      pthread_mutex_lock(&job->mutex);
+      job->failed = 1;
+      pthread_mutex_unlock(&job->mutex);
+      break;
+    }
+  }
+
+  free(buffer);
+  return NULL;
+}
+
+/**
+ * @brief Hash every chunk of a file, in parallel
+ */
+int chunk_hasher_hash_file(const Hasher *hasher, int fd, LayerContext layer,
+                           off_t file_size, size_t chunk_size,
+                           size_t n_threads, ThreadPool *pool,
+                           uint8_t *leaves, size_t leaves_size) {
+  if (!hasher || !hasher->hash_buffer_binary || !hasher->get_hash_size ||
+      fd < 0 || !layer.ops || !layer.ops->lpread || chunk_size == 0 ||
+      file_size < 0) {
+    return -1;
+  }
+
+  ChunkHashJob job = {
+      .hasher = hasher,
+      .file_size = file_size,
+      .chunk_size = chunk_size,
+      .n_chunks = chunk_hasher_count(file_size, chunk_size),
+      .leaves = leaves,
+      .digest_size = hasher->get_hash_size(),
+      .next_chunk = 0,
+      .failed = 0,
+  };
+  if (job.n_chunks == 0) {
+    return 0;
+  }
+  if (!leaves || leaves_size / job.digest_size < job.n_chunks) {
+    return -1;
+  }
+  // the chunks are taken in order: the workers read the file sequentially
+  hasher_file_reader_open(&job.reader, fd, layer, 1);
+  pthread_mutex_init(&job.mutex, NULL);
+
+  // no more threads than chunks; the calling thread is one of the workers
+  size_t n_workers = n_threads > 1 ? n_threads : 1;
+  if (n_workers > job.n_chunks) {
+    n_workers = job.n_chunks;
+  }
+
+  if (pool && n_workers > 1) {
+    ThreadPoolTask *tasks = malloc((n_workers - 1) * sizeof(ThreadPoolTask));
+    ThreadPoolBatch batch;
+    thread_pool_batch_init(&batch);
+    for (size_t i = 0; tasks && i < n_workers - 1; i++) {
+      if (thread_pool_submit(pool, THREAD_POOL_LOCAL_QUEUE, &tasks[i], &batch,
+                             chunk_hash_worker, &job) != 0) {
+        break; // the tasks already queued (and this thread) do the work
+      }
+    }
+    chunk_hash_worker(&job);
+    thread_pool_wait(pool, &batch);
+    free(tasks);
+    pthread_mutex_destroy(&job.mutex);
+    hasher_file_reader_close(&job.reader);
+    return job.failed ? -1 : 0;
+  }
+
+  pthread_t *threads = NULL;
+  size_t started = 0;
+  if (n_workers > 1) {
+    threads = malloc((n_workers - 1) * sizeof(pthread_t));
+    for (; threads && started < n_workers - 1; started++) {
+      if (pthread_create(&threads[started], NULL, chunk_hash_worker, &job) !=
+          0) {
+        break; // the threads already started (and this one) do the work
+      }
+    }
+  }
+
+  chunk_hash_worker(&job);
+
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&job.mutex);
+  hasher_file_reader_close(&job.reader);
+
+  return job.failed ? -1 : 0;
+}
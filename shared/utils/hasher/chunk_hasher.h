@@ -0,0 +1,59 @@
+#ifndef __CHUNK_HASHER_H__
+#define __CHUNK_HASHER_H__
+
+#include "../thread_pool.h"
+#include "hasher.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * ============================================================================
+ * PARALLEL CHUNKED FILE HASHING
+ * ============================================================================
+ *
+ * Splits a file into fixed-size chunks and computes one digest per chunk,
+ * with the chunks read and hashed concurrently by worker threads: threads
+ * started for the file, or the workers of a long-lived pool.
+ * The digests are the leaves of a tree hash (see merkle_tree.h), so the file
+ * digest does not depend on the number of workers.
+ *
+ * Workers call lpread on the same fd concurrently at different offsets: the
+ * layer must support concurrent positional reads (e.g. the local layer).
+ * ============================================================================
+ */
+
+/**
+ * @brief Number of chunks of a file
+ *
+ * @param file_size File size in bytes
+ * @param chunk_size Chunk size in bytes
+ * @return size_t Number of chunks (0 for an empty file)
+ */
+size_t chunk_hasher_count(off_t file_size, size_t chunk_size);
+
+/**
+ * @brief Hash every chunk of a file, in parallel
+ *
+ * @param hasher Hasher to use (must be thread-safe, as all Hasher
+ * implementations are)
+ * @param fd File descriptor to read from
+ * @param layer LayerContext to use for reading data
+ * @param file_size Size of the file in bytes
+ * @param chunk_size Chunk size in bytes
+ * @param n_threads Number of threads hashing chunks, including the caller;
+ * 0 or 1 hashes sequentially in the calling thread
+ * @param pool Pool whose workers hash chunks along with the caller (tasks
+ * the workers don't pick up run on the caller), NULL to start n_threads - 1
+ * threads for the file
+ * @param leaves Output: one binary digest per chunk, back to back
+ * @param leaves_size Size of leaves, at least
+ * chunk_hasher_count(file_size, chunk_size) * get_hash_size() bytes
+ * @return int 0 on success, -1 on error
+ */
+int chunk_hasher_hash_file(const Hasher *hasher, int fd, LayerContext layer,
+                           off_t file_size, size_t chunk_size,
+                           size_t n_threads, ThreadPool *pool,
+                           uint8_t *leaves, size_t leaves_size);
+
+#endif /* __CHUNK_HASHER_H__ */
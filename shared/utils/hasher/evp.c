@@ -1,191 +1,195 @@
 #include "evp.h"
 #include "../conversion.h"
+#include "hasher_context.h"
 #include <openssl/evp.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 /**
- * @brief Generic EVP hash file and return hex string
+ * @brief Digest a file with the calling thread's EVP context and read buffer
+ *
+ * @return int Digest length in bytes, or -1 on error
  */
-char *evp_hash_file_hex(int fd, LayerContext layer, const EVP_MD *evp_md,
-                        size_t hash_size, size_t chunk_size) {
+static int digest_file(int fd, LayerContext layer, const EVP_MD *evp_md,
+                       unsigned char hash[EVP_MAX_MD_SIZE], size_t chunk_size) {
   if (fd < 0 || !layer.ops || !layer.ops->lpread || !evp_md) {
-    return NULL;
-  }
-
-  unsigned char hash[EVP_MAX_MD_SIZE];
-  unsigned int hash_len;
-  char *hex_hash_str;
-
-  EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
-  if (mdctx == NULL) {
-    return NULL;
+    return -1;
   }
 
-  if (EVP_DigestInit_ex(mdctx, evp_md, NULL) != 1) {
-    EVP_MD_CTX_free(mdctx);
-    return NULL;
+  HasherContext *ctx = hasher_context_get();
+  unsigned char *read_buffer = hasher_context_read_buffer(ctx, chunk_size);
+  if (!read_buffer) {
+    return -1;
   }
 
-  char *read_buffer = malloc(chunk_size);
-  if (read_buffer == NULL) {
-    EVP_MD_CTX_free(mdctx);
-    return NULL;
+  if (EVP_DigestInit_ex(ctx->mdctx, evp_md, NULL) != 1) {
+    return -1;
   }
 
+  HasherFileReader reader;
+  hasher_file_reader_open(&reader, fd, layer, 1);
   ssize_t bytes_read;
   off_t offset = 0;
-  while ((bytes_read = layer.ops->lpread(fd, read_buffer, chunk_size, offset,
-                                         layer)) > 0) {
-    if (EVP_DigestUpdate(mdctx, read_buffer, bytes_read) != 1) {
-      free(read_buffer);
-      EVP_MD_CTX_free(mdctx);
-      return NULL;
+  while ((bytes_read = hasher_file_read(&reader, read_buffer, chunk_size,
+                                        offset)) > 0) {
+    if (EVP_DigestUpdate(ctx->mdctx, read_buffer, bytes_read) != 1) {
+      bytes_read = -1;
+      break;
     }
     offset += bytes_read;
   }
-
-  free(read_buffer);
+  hasher_file_reader_close(&reader);
 
   if (bytes_read < 0) {
     // Error during read
-    EVP_MD_CTX_free(mdctx);
-    return NULL;
-  }
-
-  if (EVP_DigestFinal_ex(mdctx, hash, &hash_len) != 1) {
-    EVP_MD_CTX_free(mdctx);
-    return NULL;
+    return -1;
   }
 
-  EVP_MD_CTX_free(mdctx);
-
-  // Calculate hex string size (hash_size * 2 + 1 for null terminator)
-  size_t hex_size = hash_size * 2 + 1;
-  hex_hash_str = malloc(hex_size);
-  if (hex_hash_str == NULL) {
-    return NULL;
+  unsigned int hash_len;
+  if (EVP_DigestFinal_ex(ctx->mdctx, hash, &hash_len) != 1) {
+    return -1;
   }
-
-  bytes_to_hex(hash, hash_len, hex_hash_str);
-  return hex_hash_str;
+  return (int)hash_len;
 }
 
 /**
- * @brief Generic EVP hash buffer and return hex string
+ * @brief Digest a buffer with the calling thread's EVP context
+ *
+ * @return int Digest length in bytes, or -1 on error
  */
-char *evp_hash_buffer_hex(const void *data_buffer, size_t data_size,
-                          const EVP_MD *evp_md, size_t hash_size) {
+static int digest_buffer(const void *data_buffer, size_t data_size,
+                         const EVP_MD *evp_md,
+                         unsigned char hash[EVP_MAX_MD_SIZE]) {
   if (!data_buffer || !evp_md) {
-    return NULL;
-  }
-
-  unsigned char hash[EVP_MAX_MD_SIZE];
-  unsigned int hash_len;
-  char *hex_hash_str;
-
-  EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
-  if (mdctx == NULL) {
-    return NULL;
+    return -1;
   }
 
-  if (EVP_DigestInit_ex(mdctx, evp_md, NULL) != 1) {
-    EVP_MD_CTX_free(mdctx);
-    return NULL;
+  HasherContext *ctx = hasher_context_get();
+  if (!ctx) {
+    return -1;
   }
 
-  if (EVP_DigestUpdate(mdctx, data_buffer, data_size) != 1) {
-    EVP_MD_CTX_free(mdctx);
-    return NULL;
+  unsigned int hash_len;
+  if (EVP_DigestInit_ex(ctx->mdctx, evp_md, NULL) != 1 ||
+      EVP_DigestUpdate(ctx->mdctx, data_buffer, data_size) != 1 ||
+      EVP_DigestFinal_ex(ctx->mdctx, hash, &hash_len) != 1) {
+    return -1;
   }
+  return (int)hash_len;
+}
 
-  if (EVP_DigestFinal_ex(mdctx, hash, &hash_len) != 1) {
-    EVP_MD_CTX_free(mdctx);
-    return NULL;
+/**
+ * @brief Write a digest as hex into a caller buffer
+ *
+ * @return int Number of hex characters written (without the null terminator),
+ * or -1 if the digest has an unexpected size or does not fit
+ */
+static int digest_to_hex(const unsigned char *hash, int hash_len,
+                         size_t hash_size, char *hex, size_t hex_size) {
+  // Defensive check: ensure OpenSSL returned expected hash size
+  if (hash_len < 0 || (size_t)hash_len != hash_size ||
+      hex_size < (hash_size * 2) + 1) {
+    return -1;
   }
+  bytes_to_hex(hash, hash_size, hex);
+  return (int)(hash_size * 2);
+}
 
-  EVP_MD_CTX_free(mdctx);
-
+/**
+ * @brief Allocate a hex string of a digest
+ */
+static char *digest_to_hex_alloc(const unsigned char *hash, int hash_len,
+                                 size_t hash_size) {
   // Calculate hex string size (hash_size * 2 + 1 for null terminator)
   size_t hex_size = hash_size * 2 + 1;
-  hex_hash_str = malloc(hex_size);
+  char *hex_hash_str = malloc(hex_size);
   if (hex_hash_str == NULL) {
     return NULL;
   }
-
-  bytes_to_hex(hash, hash_len, hex_hash_str);
+  if (digest_to_hex(hash, hash_len, hash_size, hex_hash_str, hex_size) < 0) {
+    free(hex_hash_str);
+    return NULL;
+  }
   return hex_hash_str;
 }
 
 /**
- * @brief Generic EVP hash file and return binary hash
+ * @brief Copy a digest into a caller buffer
  */
-int evp_hash_file_binary(int fd, LayerContext layer, const EVP_MD *evp_md,
-                         void *hash_buffer, size_t hash_buffer_size,
-                         size_t expected_hash_size, size_t chunk_size) {
-  if (fd < 0 || !layer.ops || !layer.ops->lpread || !hash_buffer || !evp_md) {
-    return -1;
+static int digest_to_binary(const unsigned char *hash, int hash_len,
+                            void *hash_buffer, size_t expected_hash_size) {
+  // Defensive check: ensure OpenSSL returned expected hash size
+  if (hash_len < 0 || (size_t)hash_len != expected_hash_size) {
+    return -1; // Unexpected hash length - indicates bug or corruption
   }
 
-  if (hash_buffer_size < expected_hash_size) {
-    return -1;
-  }
+  // Copy hash to output buffer
+  memcpy(hash_buffer, hash, hash_len);
+  return hash_len;
+}
 
+/**
+ * @brief Generic EVP hash file and return hex string
+ */
+char *evp_hash_file_hex(int fd, LayerContext layer, const EVP_MD *evp_md,
+                        size_t hash_size, size_t chunk_size) {
   unsigned char hash[EVP_MAX_MD_SIZE];
-  unsigned int hash_len;
-
-  EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
-  if (mdctx == NULL) {
-    return -1;
-  }
+  int hash_len = digest_file(fd, layer, evp_md, hash, chunk_size);
+  return digest_to_hex_alloc(hash, hash_len, hash_size);
+}
 
-  if (EVP_DigestInit_ex(mdctx, evp_md, NULL) != 1) {
-    EVP_MD_CTX_free(mdctx);
-    return -1;
-  }
+/**
+ * @brief Generic EVP hash buffer and return hex string
+ */
+char *evp_hash_buffer_hex(const void *data_buffer, size_t data_size,
+                          const EVP_MD *evp_md, size_t hash_size) {
+  unsigned char hash[EVP_MAX_MD_SIZE];
+  int hash_len = digest_buffer(data_buffer, data_size, evp_md, hash);
+  return digest_to_hex_alloc(hash, hash_len, hash_size);
+}
 
-  char *read_buffer = malloc(chunk_size);
-  if (read_buffer == NULL) {
-    EVP_MD_CTX_free(mdctx);
+/**
+ * @brief Generic EVP hash file into a caller provided hex buffer
+ */
+int evp_hash_file_hex_into(int fd, LayerContext layer, const EVP_MD *evp_md,
+                           char *hex, size_t hex_size, size_t hash_size,
+                           size_t chunk_size) {
+  if (!hex) {
     return -1;
   }
+  unsigned char hash[EVP_MAX_MD_SIZE];
+  int hash_len = digest_file(fd, layer, evp_md, hash, chunk_size);
+  return digest_to_hex(hash, hash_len, hash_size, hex, hex_size);
+}
 
-  ssize_t bytes_read;
-  off_t offset = 0;
-  while ((bytes_read = layer.ops->lpread(fd, read_buffer, chunk_size, offset,
-                                         layer)) > 0) {
-    if (EVP_DigestUpdate(mdctx, read_buffer, bytes_read) != 1) {
-      free(read_buffer);
-      EVP_MD_CTX_free(mdctx);
-      return -1;
-    }
-    offset += bytes_read;
-  }
-
-  free(read_buffer);
-
-  if (bytes_read < 0) {
-    // Error during read
-    EVP_MD_CTX_free(mdctx);
+/**
+ * @brief Generic EVP hash buffer into a caller provided hex buffer
+ */
+int evp_hash_buffer_hex_into(const void *data_buffer, size_t data_size,
+                             const EVP_MD *evp_md, char *hex, size_t hex_size,
+                             size_t hash_size) {
+  if (!hex) {
     return -1;
   }
+  unsigned char hash[EVP_MAX_MD_SIZE];
+  int hash_len = digest_buffer(data_buffer, data_size, evp_md, hash);
+  return digest_to_hex(hash, hash_len, hash_size, hex, hex_size);
+}
 
-  if (EVP_DigestFinal_ex(mdctx, hash, &hash_len) != 1) {
-    EVP_MD_CTX_free(mdctx);
+/**
+ * @brief Generic EVP hash file and return binary hash
+ */
+int evp_hash_file_binary(int fd, LayerContext layer, const EVP_MD *evp_md,
+                         void *hash_buffer, size_t hash_buffer_size,
+                         size_t expected_hash_size, size_t chunk_size) {
+  if (!hash_buffer || hash_buffer_size < expected_hash_size) {
     return -1;
   }
 
-  EVP_MD_CTX_free(mdctx);
-
-  // Defensive check: ensure OpenSSL returned expected hash size
-  if (hash_len != expected_hash_size) {
-    return -1; // Unexpected hash length - indicates bug or corruption
-  }
-
-  // Copy hash to output buffer
-  memcpy(hash_buffer, hash, hash_len);
-  return (int)hash_len;
+  unsigned char hash[EVP_MAX_MD_SIZE];
+  int hash_len = digest_file(fd, layer, evp_md, hash, chunk_size);
+  return digest_to_binary(hash, hash_len, hash_buffer, expected_hash_size);
 }
 
 /**
@@ -194,45 +198,45 @@ int evp_hash_file_binary(int fd, LayerContext layer, const EVP_MD *evp_md,
 int evp_hash_buffer_binary(const void *data_buffer, size_t data_size,
                            const EVP_MD *evp_md, void *hash_buffer,
                            size_t hash_buffer_size, size_t expected_hash_size) {
-  if (!data_buffer || !hash_buffer || !evp_md) {
-    return -1;
-  }
-
-  if (hash_buffer_size < expected_hash_size) {
+  if (!hash_buffer || hash_buffer_size < expected_hash_size) {
     return -1;
   }
 
   unsigned char hash[EVP_MAX_MD_SIZE];
-  unsigned int hash_len;
-
-  EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
-  if (mdctx == NULL) {
-    return -1;
-  }
+  int hash_len = digest_buffer(data_buffer, data_size, evp_md, hash);
+  return digest_to_binary(hash, hash_len, hash_buffer, expected_hash_size);
+}
 
-  if (EVP_DigestInit_ex(mdctx, evp_md, NULL) != 1) {
-    EVP_MD_CTX_free(mdctx);
+/**
+ * @brief Generic EVP hash of many buffers, reusing one digest context
+ */
+int evp_hash_blocks_binary(const void *const *buffers, const size_t *sizes,
+                           size_t n, const EVP_MD *evp_md, void *hash_buffer,
+                           size_t hash_buffer_size, size_t expected_hash_size) {
+  if (!buffers || !sizes || !hash_buffer || !evp_md) {
     return -1;
   }
 
-  if (EVP_DigestUpdate(mdctx, data_buffer, data_size) != 1) {
-    EVP_MD_CTX_free(mdctx);
+  if (hash_buffer_size < n * expected_hash_size) {
     return -1;
   }
 
-  if (EVP_DigestFinal_ex(mdctx, hash, &hash_len) != 1) {
-    EVP_MD_CTX_free(mdctx);
+  HasherContext *ctx = hasher_context_get();
+  if (!ctx) {
     return -1;
   }
 
-  EVP_MD_CTX_free(mdctx);
-
-  // Defensive check: ensure OpenSSL returned expected hash size
-  if (hash_len != expected_hash_size) {
-    return -1; // Unexpected hash length - indicates bug or corruption
+  unsigned char *out = hash_buffer;
+  for (size_t i = 0; i < n; i++) {
+    unsigned int hash_len;
+    if (!buffers[i] || EVP_DigestInit_ex(ctx->mdctx, evp_md, NULL) != 1 ||
+        EVP_DigestUpdate(ctx->mdctx, buffers[i], sizes[i]) != 1 ||
+        EVP_DigestFinal_ex(ctx->mdctx, out + (i * expected_hash_size),
+                           &hash_len) != 1 ||
+        hash_len != expected_hash_size) {
+      return -1;
+    }
   }
 
-  // Copy hash to output buffer
-  memcpy(hash_buffer, hash, hash_len);
-  return (int)hash_len;
+  return (int)n;
 }
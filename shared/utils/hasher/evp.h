@@ -34,6 +34,39 @@ char *evp_hash_file_hex(int fd, LayerContext layer, const EVP_MD *evp_md,
 char *evp_hash_buffer_hex(const void *data_buffer, size_t data_size,
                           const EVP_MD *evp_md, size_t hash_size);
 
+/**
+ * @brief Generic EVP hash file into a caller provided hex buffer
+ *
+ * @param fd File descriptor to read from
+ * @param layer LayerContext to use for reading data
+ * @param evp_md EVP message digest to use (e.g., EVP_sha256(), EVP_sha512())
+ * @param hex Output buffer for the null-terminated hex string
+ * @param hex_size Size of the output buffer, at least hash_size * 2 + 1
+ * @param hash_size Expected hash size in bytes
+ * @param chunk_size Chunk size for reading file data
+ * @return int Number of hex characters written (without the null terminator),
+ * or -1 on error
+ */
+int evp_hash_file_hex_into(int fd, LayerContext layer, const EVP_MD *evp_md,
+                           char *hex, size_t hex_size, size_t hash_size,
+                           size_t chunk_size);
+
+/**
+ * @brief Generic EVP hash buffer into a caller provided hex buffer
+ *
+ * @param data_buffer Pointer to the input data to hash
+ * @param data_size Size of the input data in bytes
+ * @param evp_md EVP message digest to use (e.g., EVP_sha256(), EVP_sha512())
+ * @param hex Output buffer for the null-terminated hex string
+ * @param hex_size Size of the output buffer, at least hash_size * 2 + 1
+ * @param hash_size Expected hash size in bytes
+ * @return int Number of hex characters written (without the null terminator),
+ * or -1 on error
+ */
+int evp_hash_buffer_hex_into(const void *data_buffer, size_t data_size,
+                             const EVP_MD *evp_md, char *hex, size_t hex_size,
+                             size_t hash_size);
+
 /**
  * @brief Generic EVP hash file and return binary hash
  *
@@ -65,4 +98,20 @@ int evp_hash_buffer_binary(const void *data_buffer, size_t data_size,
                            const EVP_MD *evp_md, void *hash_buffer,
                            size_t hash_buffer_size, size_t expected_hash_size);
 
+/**
+ * @brief Generic EVP hash of many buffers, reusing one digest context
+ *
+ * @param buffers Array of n input buffers
+ * @param sizes Array of n buffer sizes in bytes
+ * @param n Number of buffers
+ * @param evp_md EVP message digest to use (e.g., EVP_sha256(), EVP_sha512())
+ * @param hash_buffer Output buffer: n binary hashes, back to back
+ * @param hash_buffer_size Size of the output buffer
+ * @param expected_hash_size Expected hash size in bytes
+ * @return int Number of hashes written to hash_buffer, or -1 on error
+ */
+int evp_hash_blocks_binary(const void *const *buffers, const size_t *sizes,
+                           size_t n, const EVP_MD *evp_md, void *hash_buffer,
+                           size_t hash_buffer_size, size_t expected_hash_size);
+
 #endif
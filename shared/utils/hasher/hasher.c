@@ -1,4 +1,5 @@
 #include "hasher.h"
+#include "blake3_hasher.h"
 #include "sha256_hasher.h"
 #include "sha512_hasher.h"
 
@@ -21,6 +22,12 @@ int hasher_init(Hasher *hasher, hash_algorithm_t algorithm) {
   case HASH_SHA512:
     return sha512_hasher_init(hasher);
 
+  case HASH_BLAKE3:
+    return blake3_hasher_init(hasher);
+
+  case HASH_BLAKE3_KEYED:
+    return blake3_keyed_hasher_init(hasher);
+
   default:
     return -1; // Invalid algorithm
   }
@@ -7,13 +7,22 @@
 #include <sys/types.h>
 
 // Hash algorithm types
-typedef enum { HASH_SHA256, HASH_SHA512 } hash_algorithm_t;
+typedef enum {
+  HASH_SHA256,
+  HASH_SHA512,
+  HASH_BLAKE3,
+  HASH_BLAKE3_KEYED, // BLAKE3 keyed mode, key set with blake3_hasher_set_key
+} hash_algorithm_t;
+
+// Largest binary digest and hex string of all algorithms, for stack buffers
+#define HASHER_MAX_HASH_SIZE 64
+#define HASHER_MAX_HEX_SIZE ((HASHER_MAX_HASH_SIZE * 2) + 1)
 
 /**
  * @brief Hasher structure for handling different hash algorithms
  *
  * This structure provides a unified interface for different hash
- * algorithms (SHA256 and SHA512) through function pointers. It
+ * algorithms (SHA256, SHA512 and BLAKE3) through function pointers. It
  * allows switching between hash methods at runtime without changing the
  * calling code.
  *
@@ -66,6 +75,38 @@ typedef struct Hasher {
    */
   char *(*hash_buffer_hex)(const void *data_buffer, size_t data_size);
 
+  /**
+   * @brief Function pointer for hashing a file into a caller provided hex
+   * buffer, without allocating
+   *
+   * @param fd File descriptor to read from
+   * @param layer LayerContext to use for reading data
+   * @param hex Output buffer for the null-terminated hex string
+   * @param hex_size Size of the output buffer
+   * @return int Number of hex characters written (without the null
+   * terminator), or -1 on error
+   *
+   * @note The output buffer must be at least get_hex_size() bytes
+   */
+  int (*hash_file_hex_into)(int fd, LayerContext layer, char *hex,
+                            size_t hex_size);
+
+  /**
+   * @brief Function pointer for hashing a buffer into a caller provided hex
+   * buffer, without allocating
+   *
+   * @param data_buffer Pointer to the input data to hash
+   * @param data_size Size of the input data in bytes
+   * @param hex Output buffer for the null-terminated hex string
+   * @param hex_size Size of the output buffer
+   * @return int Number of hex characters written (without the null
+   * terminator), or -1 on error
+   *
+   * @note The output buffer must be at least get_hex_size() bytes
+   */
+  int (*hash_buffer_hex_into)(const void *data_buffer, size_t data_size,
+                              char *hex, size_t hex_size);
+
   /**
    * @brief Function pointer for hashing a file and returning binary hash
    *
@@ -94,6 +135,23 @@ typedef struct Hasher {
   int (*hash_buffer_binary)(const void *data_buffer, size_t data_size,
                             void *hash_buffer, size_t hash_buffer_size);
 
+  /**
+   * @brief Function pointer for hashing many independent buffers at once
+   *
+   * @param buffers Array of n input buffers
+   * @param sizes Array of n buffer sizes in bytes
+   * @param n Number of buffers
+   * @param hash_buffer Output buffer: n binary hashes, back to back
+   * @param hash_buffer_size Size of the output buffer
+   * @return int Number of hashes written to hash_buffer, or -1 on error
+   *
+   * @note The output buffer must be at least n * get_hash_size() bytes
+   * @note Implementations may hash several buffers in parallel SIMD lanes
+   */
+  int (*hash_blocks_binary)(const void *const *buffers, const size_t *sizes,
+                            size_t n, void *hash_buffer,
+                            size_t hash_buffer_size);
+
   /**
    * @brief Function pointer for getting the size of the binary hash
    *
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include "hasher_context.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static pthread_key_t context_key;
+static pthread_once_t context_key_once = PTHREAD_ONCE_INIT;
+
+static void context_free(void *arg) {
+  HasherContext *ctx = arg;
+  if (!ctx) {
+    return;
+  }
+  EVP_MD_CTX_free(ctx->mdctx);
+  free(ctx->read_buffer);
+  free(ctx->scratch);
+  free(ctx);
+}
+
+static void context_key_create(void) {
+  (void)pthread_key_create(&context_key, context_free);
+}
+
+/**
+ * @brief Grow a buffer to at least size bytes, keeping it on failure
+ */
+static unsigned char *grow(unsigned char **buffer, size_t *allocated,
+                           size_t size) {
+  if (*buffer && *allocated >= size) {
+    return *buffer;
+  }
+  unsigned char *grown = realloc(*buffer, size > 0 ? size : 1);
+  if (!grown) {
+    return NULL;
+  }
+  *buffer = grown;
+  *allocated = size;
+  return grown;
+}
+
+/**
+ * @brief Get the calling thread's hasher context, creating it on first use
+ */
+HasherContext *hasher_context_get(void) {
+  (void)pthread_once(&context_key_once, context_key_create);
+
+  HasherContext *ctx = pthread_getspecific(context_key);
+  if (ctx) {
+    return ctx;
+  }
+
+  ctx = calloc(1, sizeof(HasherContext));
+  if (!ctx) {
+    return NULL;
+  }
+  ctx->mdctx = EVP_MD_CTX_new();
+  if (!ctx->mdctx || pthread_setspecific(context_key, ctx) != 0) {
+    context_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+/**
+ * @brief Get the read buffer of a context, growing it to at least size bytes
+ */
+unsigned char *hasher_context_read_buffer(HasherContext *ctx, size_t size) {
+  if (!ctx) {
+    return NULL;
+  }
+  return grow(&ctx->read_buffer, &ctx->read_buffer_size, size);
+}
+
+/**
+ * @brief Get the scratch area of a context, growing it to at least size bytes
+ */
+unsigned char *hasher_context_scratch(HasherContext *ctx, size_t size) {
+  if (!ctx) {
+    return NULL;
+  }
+  return grow(&ctx->scratch, &ctx->scratch_size, size);
+}
+
+/**
+ * @brief Free the calling thread's hasher context now instead of at exit
+ */
+void hasher_context_release(void) {
+  (void)pthread_once(&context_key_once, context_key_create);
+
+  HasherContext *ctx = pthread_getspecific(context_key);
+  if (ctx) {
+    (void)pthread_setspecific(context_key, NULL);
+    context_free(ctx);
+  }
+}
+
+/**
+ * @brief Start reading a file to hash it
+ */
+void hasher_file_reader_open(HasherFileReader *reader, int fd,
+                             LayerContext layer, int sequential) {
+  reader->fd = fd;
+  reader->layer = layer;
+  // as layer_backing_fd(), without the layer_iov dependency
+  reader->backing_fd = layer.ops && layer.ops->lbacking_fd
+                           ? layer.ops->lbacking_fd(fd, layer)
+                           : -1;
+  reader->sparse_size = -1;
+  reader->saved_pos = -1;
+  if (reader->backing_fd < 0) {
+    return;
+  }
+  if (sequential) {
+    (void)posix_fadvise(reader->backing_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  // fewer allocated blocks than bytes: the file has holes worth seeking
+  struct stat stbuf;
+  if (fstat(reader->backing_fd, &stbuf) == 0 &&
+      (off_t)stbuf.st_blocks * 512 < stbuf.st_size) {
+    reader->saved_pos = lseek(reader->backing_fd, 0, SEEK_CUR);
+    if (reader->saved_pos >= 0) {
+      reader->sparse_size = stbuf.st_size;
+    }
+  }
+}
+
+/**
+ * @brief pread of the file of a reader
+ */
+ssize_t hasher_file_read(const HasherFileReader *reader, void *buffer,
+                         size_t size, off_t offset) {
+  if (reader->backing_fd < 0) {
+    return reader->layer.ops->lpread(reader->fd, buffer, size, offset,
+                                     reader->layer);
+  }
+  off_t zeroes = hasher_file_zeroes(reader, offset, (off_t)size);
+  if (zeroes > 0) {
+    memset(buffer, 0, (size_t)zeroes);
+    return (ssize_t)zeroes;
+  }
+  ssize_t res;
+  do {
+    res = pread(reader->backing_fd, buffer, size, offset);
+  } while (res < 0 && errno == EINTR);
+  return res;
+}
+
+/**
+ * @brief Length of the hole of the file of a reader at an offset
+ */
+off_t hasher_file_zeroes(const HasherFileReader *reader, off_t offset,
+                         off_t len) {
+  if (reader->sparse_size < 0 || offset >= reader->sparse_size || len <= 0) {
+    return 0;
+  }
+  off_t data = lseek(reader->backing_fd, offset, SEEK_DATA);
+  if (data < 0) {
+    // ENXIO: a hole up to the end of the file; otherwise holes are unknown
+    if (errno != ENXIO) {
+      return 0;
+    }
+    data = reader->sparse_size;
+  }
+  return data - offset < len ? data - offset : len;
+}
+
+/**
+ * @brief Stop reading a file, restoring the default readahead of its backing
+ * file
+ */
+void hasher_file_reader_close(HasherFileReader *reader) {
+  if (reader->saved_pos >= 0) {
+    (void)lseek(reader->backing_fd, reader->saved_pos, SEEK_SET);
+  }
+  if (reader->backing_fd >= 0) {
+    // the hint belongs to the open file, which its owner reads afterwards
+    (void)posix_fadvise(reader->backing_fd, 0, 0, POSIX_FADV_NORMAL);
+  }
+  reader->backing_fd = -1;
+}
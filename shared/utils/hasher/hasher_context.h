@@ -0,0 +1,124 @@
+#ifndef __HASHER_CONTEXT_H__
+#define __HASHER_CONTEXT_H__
+
+#include "../../types/layer_context.h"
+#include <openssl/evp.h>
+#include <stddef.h>
+
+/*
+ * ============================================================================
+ * THREAD-LOCAL HASHER CONTEXT
+ * ============================================================================
+ *
+ * Per-thread resources reused by every hash call of that thread: an EVP
+ * digest context, the read buffer of file hashing and a scratch area for
+ * digest outputs. They are allocated on first use, grow on demand and are
+ * freed when the thread exits, so steady-state hashing does not touch the
+ * allocator or rebuild the EVP context.
+ *
+ * The resources of a context must not be held across another call that may
+ * use the same resource (e.g. the read buffer is only valid until the next
+ * file hash of the thread).
+ *
+ * File hashes read through a HasherFileReader: when the layer of the fd has
+ * a backing file (lbacking_fd, e.g. the local layer), the file is read from
+ * it directly with a sequential readahead hint instead of through the layer.
+ * The file is read, not mapped: a file truncated behind the layer's back
+ * while mapped would kill the process with SIGBUS on the next page touched.
+ * The holes of a sparse backing file are found with SEEK_DATA and hashed as
+ * zeroes without being read (hasher_file_zeroes()).
+ * ============================================================================
+ */
+
+typedef struct HasherContext {
+  EVP_MD_CTX *mdctx;          // reusable EVP digest context
+  unsigned char *read_buffer; // file hashing read buffer
+  size_t read_buffer_size;    // allocated bytes of read_buffer
+  unsigned char *scratch;     // digest output scratch area
+  size_t scratch_size;        // allocated bytes of scratch
+} HasherContext;
+
+typedef struct {
+  int fd;             // fd of the layer
+  LayerContext layer; // layer of fd
+  int backing_fd;     // backing file of fd, or -1 to read through the layer
+  off_t sparse_size;  // size of a sparse backing file, or -1: no holes
+  off_t saved_pos;    // file position of backing_fd, moved by SEEK_DATA
+} HasherFileReader;
+
+/**
+ * @brief Get the calling thread's hasher context, creating it on first use
+ *
+ * @return HasherContext* Context of the thread, or NULL on allocation failure
+ */
+HasherContext *hasher_context_get(void);
+
+/**
+ * @brief Get the read buffer of a context, growing it to at least size bytes
+ *
+ * @param ctx Context of the calling thread
+ * @param size Minimum size in bytes
+ * @return unsigned char* Read buffer, or NULL on allocation failure
+ */
+unsigned char *hasher_context_read_buffer(HasherContext *ctx, size_t size);
+
+/**
+ * @brief Get the scratch area of a context, growing it to at least size bytes
+ *
+ * @param ctx Context of the calling thread
+ * @param size Minimum size in bytes
+ * @return unsigned char* Scratch area, or NULL on allocation failure
+ */
+unsigned char *hasher_context_scratch(HasherContext *ctx, size_t size);
+
+/**
+ * @brief Free the calling thread's hasher context now instead of at exit
+ */
+void hasher_context_release(void);
+
+/**
+ * @brief Start reading a file to hash it
+ *
+ * @param reader Receives the reader
+ * @param fd File descriptor of the layer
+ * @param layer Layer of fd
+ * @param sequential Whether the file is read from start to end, which raises
+ * the readahead of a backing file
+ */
+void hasher_file_reader_open(HasherFileReader *reader, int fd,
+                             LayerContext layer, int sequential);
+
+/**
+ * @brief pread of the file of a reader; the holes of its backing file are
+ * zeroed in buffer instead of being read
+ *
+ * @param reader Reader of the file
+ * @param buffer Receives the data
+ * @param size Maximum number of bytes to read
+ * @param offset Offset in the file
+ * @return ssize_t Bytes read, 0 at the end of the file, or -1 on error
+ */
+ssize_t hasher_file_read(const HasherFileReader *reader, void *buffer,
+                         size_t size, off_t offset);
+
+/**
+ * @brief Length of the hole of the file of a reader at an offset
+ *
+ * @param reader Reader of the file
+ * @param offset Offset in the file
+ * @param len Bytes wanted from offset
+ * @return off_t Bytes from offset, at most len, that are a hole and read as
+ * zeroes; 0 when offset is in data or holes are unknown for the file
+ */
+off_t hasher_file_zeroes(const HasherFileReader *reader, off_t offset,
+                         off_t len);
+
+/**
+ * @brief Stop reading a file, restoring the default readahead of its backing
+ * file
+ *
+ * @param reader Reader of the file
+ */
+void hasher_file_reader_close(HasherFileReader *reader);
+
+#endif /* __HASHER_CONTEXT_H__ */
@@ -0,0 +1,390 @@
+#include "merkle_tree.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MERKLE_MAX_DIGEST_SIZE 64
+#define MERKLE_NODE_PREFIX 0x01 // domain separation for internal nodes
+
+/**
+ * @brief Initialize an empty Merkle tree
+ *
+ * @param tree   -> tree to initialize
+ * @param hasher -> hasher used for the internal nodes (must outlive the tree)
+ * @return int   -> 0 on success, -1 on error
+ */
+int merkle_tree_init(MerkleTree *tree, const Hasher *hasher) {
+  if (!tree || !hasher || !hasher->get_hash_size ||
+      !hasher->hash_buffer_binary) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(tree, 0, sizeof(MerkleTree));
+  tree->hasher = hasher;
+  tree->digest_size = hasher->get_hash_size();
+  if (tree->digest_size == 0 || tree->digest_size > MERKLE_MAX_DIGEST_SIZE) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+static void free_levels(MerkleTree *tree) {
+  for (size_t i = 0; i < tree->n_levels; i++) {
+    free(tree->levels[i]);
+  }
+  free((void *)tree->levels);
+  free(tree->level_counts);
+  tree->levels = NULL;
+  tree->level_counts = NULL;
+  tree->n_levels = 0;
+}
+
+/**
+ * @brief Free all memory held by the tree
+ *
+ * @param tree -> tree to free
+ */
+void merkle_tree_free(MerkleTree *tree) {
+  if (!tree) {
+    return;
+  }
+  free_levels(tree);
+  free(tree->dirty);
+  tree->dirty = NULL;
+  tree->n_leaves = 0;
+  tree->dirty_count = 0;
+}
+
+/**
+ * @brief Resize the tree to n_leaves leaves
+ *
+ * Existing leaf digests are kept. Newly added leaves are zeroed and, together
+ * with the new last leaf, flagged dirty so the caller rehashes them and the
+ * right-most path is recomputed on the next commit.
+ *
+ * @param tree     -> tree to resize
+ * @param n_leaves -> new number of leaves
+ * @return int     -> 0 on success, -1 on error (the tree is emptied)
+ */
+int merkle_tree_resize(MerkleTree *tree, size_t n_leaves) {
+  if (!tree) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (n_leaves == tree->n_leaves) {
+    return 0;
+  }
+
+  const size_t old_leaves = tree->n_leaves;
+  if (n_leaves == 0) {
+    merkle_tree_free(tree);
+    return 0;
+  }
+
+  size_t n_levels = 1;
+  for (size_t count = n_leaves; count > 1; count = (count + 1) / 2) {
+    n_levels++;
+  }
+
+  // Levels above the new root are no longer needed
+  for (size_t lvl = n_levels; lvl < tree->n_levels; lvl++) {
+    free(tree->levels[lvl]);
+    tree->levels[lvl] = NULL;
+  }
+
+  uint8_t **levels = realloc((void *)tree->levels, n_levels * sizeof(uint8_t *));
+  if (!levels) {
+    merkle_tree_free(tree);
+    errno = ENOMEM;
+    return -1;
+  }
+  for (size_t lvl = tree->n_levels; lvl < n_levels; lvl++) {
+    levels[lvl] = NULL;
+  }
+  tree->levels = levels;
+  tree->n_levels = n_levels;
+
+  size_t *level_counts = realloc(tree->level_counts, n_levels * sizeof(size_t));
+  uint8_t *dirty = realloc(tree->dirty, n_leaves);
+  if (level_counts) {
+    tree->level_counts = level_counts;
+  }
+  if (dirty) {
+    tree->dirty = dirty;
+  }
+  if (!level_counts || !dirty) {
+    merkle_tree_free(tree);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  // realloc keeps the nodes of unchanged subtrees valid, only the right-most
+  // path and the new nodes are recomputed on commit
+  size_t count = n_leaves;
+  for (size_t lvl = 0; lvl < n_levels; lvl++) {
+    uint8_t *nodes = realloc(levels[lvl], count * tree->digest_size);
+    if (!nodes) {
+      merkle_tree_free(tree);
+      errno = ENOMEM;
+      return -1;
+    }
+    levels[lvl] = nodes;
+    level_counts[lvl] = count;
+    count = (count + 1) / 2;
+  }
+  tree->n_leaves = n_leaves;
+
+  if (n_leaves > old_leaves) {
+    memset(levels[0] + (old_leaves * tree->digest_size), 0,
+           (n_leaves - old_leaves) * tree->digest_size);
+    memset(dirty + old_leaves, 1, n_leaves - old_leaves);
+  }
+
+  tree->dirty_count = 0;
+  for (size_t i = 0; i < n_leaves; i++) {
+    tree->dirty_count += dirty[i];
+  }
+  merkle_tree_mark_dirty(tree, n_leaves - 1, n_leaves - 1);
+  return 0;
+}
+
+/**
+ * @brief Flag the leaves [first, last] as dirty (clamped to the tree size)
+ *
+ * @param tree  -> tree
+ * @param first -> first leaf index
+ * @param last  -> last leaf index (inclusive)
+ */
+void merkle_tree_mark_dirty(MerkleTree *tree, size_t first, size_t last) {
+  if (!tree || tree->n_leaves == 0 || first > last) {
+    return;
+  }
+  if (last >= tree->n_leaves) {
+    last = tree->n_leaves - 1;
+  }
+  for (size_t i = first; i <= last; i++) {
+    if (!tree->dirty[i]) {
+      tree->dirty[i] = 1;
+      tree->dirty_count++;
+    }
+  }
+}
+
+/**
+ * @brief Check whether a leaf is flagged dirty
+ *
+ * @param tree -> tree
+ * @param idx  -> leaf index
+ * @return int -> 1 if dirty, 0 otherwise
+ */
+int merkle_tree_is_dirty(const MerkleTree *tree, size_t idx) {
+  return tree && idx < tree->n_leaves && tree->dirty[idx];
+}
+
+/**
+ * @brief Get a pointer to a leaf digest (digest_size bytes, writable)
+ *
+ * @param tree      -> tree
+ * @param idx       -> leaf index
+ * @return uint8_t* -> leaf digest, or NULL if idx is out of range
+ */
+uint8_t *merkle_tree_leaf(MerkleTree *tree, size_t idx) {
+  if (!tree || idx >= tree->n_leaves) {
+    return NULL;
+  }
+  return tree->levels[0] + (idx * tree->digest_size);
+}
+
+/**
+ * @brief Recompute the internal nodes above dirty leaves and clear the flags
+ *
+ * Only the paths from dirty leaves to the root are rehashed, so a commit after
+ * k modified leaves costs O(k log n) node hashes.
+ *
+ * @param tree -> tree
+ * @return int -> 0 on success, -1 on error (dirty flags are kept)
+ */
+int merkle_tree_commit(MerkleTree *tree) {
+  if (!tree) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (tree->dirty_count == 0 || tree->n_levels < 2) {
+    if (tree->n_leaves > 0) {
+      memset(tree->dirty, 0, tree->n_leaves);
+    }
+    tree->dirty_count = 0;
+    return 0;
+  }
+
+  const size_t ds = tree->digest_size;
+  uint8_t *flags = malloc(tree->n_leaves);
+  if (!flags) {
+    errno = ENOMEM;
+    return -1;
+  }
+  memcpy(flags, tree->dirty, tree->n_leaves);
+
+  uint8_t node_input[1 + (2 * MERKLE_MAX_DIGEST_SIZE)];
+  node_input[0] = MERKLE_NODE_PREFIX;
+
+  for (size_t lvl = 1; lvl < tree->n_levels; lvl++) {
+    const size_t children = tree->level_counts[lvl - 1];
+    const uint8_t *child = tree->levels[lvl - 1];
+    uint8_t *parent = tree->levels[lvl];
+
+    // flags[] is folded in place: parent i only reads children 2i and 2i+1
+    for (size_t i = 0; i < tree->level_counts[lvl]; i++) {
+      const size_t left = 2 * i;
+      const size_t right = left + 1;
+      const int has_right = right < children;
+      const int is_dirty = flags[left] || (has_right && flags[right]);
+      flags[i] = (uint8_t)is_dirty;
+      if (!is_dirty) {
+        continue;
+      }
+
+      if (!has_right) {
+        memcpy(parent + (i * ds), child + (left * ds), ds);
+        continue;
+      }
+
+      memcpy(node_input + 1, child + (left * ds), ds);
+      memcpy(node_input + 1 + ds, child + (right * ds), ds);
+      if (tree->hasher->hash_buffer_binary(node_input, 1 + (2 * ds),
+                                           parent + (i * ds), ds) < 0) {
+        free(flags);
+        errno = EIO;
+        return -1;
+      }
+    }
+  }
+
+  free(flags);
+  memset(tree->dirty, 0, tree->n_leaves);
+  tree->dirty_count = 0;
+  return 0;
+}
+
+/**
+ * @brief Copy the root digest of the last commit into out
+ *
+ * The root of an empty tree is the hash of the empty input.
+ *
+ * @param tree     -> tree
+ * @param out      -> output buffer
+ * @param out_size -> size of the output buffer (>= digest_size)
+ * @return int     -> number of bytes written, or -1 on error
+ */
+int merkle_tree_root(const MerkleTree *tree, void *out, size_t out_size) {
+  if (!tree || !out || out_size < tree->digest_size) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (tree->n_leaves == 0) {
+    static const uint8_t empty = 0;
+    return tree->hasher->hash_buffer_binary(&empty, 0, out, out_size);
+  }
+  memcpy(out, tree->levels[tree->n_levels - 1], tree->digest_size);
+  return (int)tree->digest_size;
+}
+
+/**
+ * @brief Number of levels above the leaves of a tree of n_leaves leaves
+ *
+ * @param n_leaves -> number of leaves
+ * @return size_t  -> digests in an inclusion proof of the tree
+ */
+size_t merkle_proof_depth(size_t n_leaves) {
+  size_t depth = 0;
+  for (size_t count = n_leaves; count > 1; count = (count + 1) / 2) {
+    depth++;
+  }
+  return depth;
+}
+
+/**
+ * @brief Copy the inclusion proof of a leaf of the last commit into out
+ *
+ * @param tree     -> committed tree
+ * @param idx      -> leaf index
+ * @param out      -> output buffer
+ * @param out_size -> size of the output buffer (>= depth * digest_size)
+ * @return int     -> number of bytes written, or -1 on error
+ */
+int merkle_tree_proof(const MerkleTree *tree, size_t idx, void *out,
+                      size_t out_size) {
+  if (!tree || idx >= tree->n_leaves || !out) {
+    errno = EINVAL;
+    return -1;
+  }
+  const size_t ds = tree->digest_size;
+  const size_t depth = tree->n_levels - 1;
+  if (out_size < depth * ds) {
+    errno = EINVAL;
+    return -1;
+  }
+  uint8_t *proof = out;
+  for (size_t lvl = 0; lvl < depth; lvl++) {
+    const size_t sibling = idx ^ 1;
+    if (sibling < tree->level_counts[lvl]) {
+      memcpy(proof + (lvl * ds), tree->levels[lvl] + (sibling * ds), ds);
+    } else {
+      memset(proof + (lvl * ds), 0, ds);
+    }
+    idx /= 2;
+  }
+  return (int)(depth * ds);
+}
+
+/**
+ * @brief Check that a leaf at idx of a tree of n_leaves leaves has root
+ *
+ * @param hasher   -> hasher of the internal nodes
+ * @param leaf     -> leaf digest
+ * @param idx      -> leaf index
+ * @param n_leaves -> number of leaves of the tree
+ * @param proof    -> merkle_proof_depth(n_leaves) digests of merkle_tree_proof
+ * @param root     -> expected root digest
+ * @return int     -> 1 if the proof leads to root, 0 if not, -1 on error
+ */
+int merkle_proof_verify(const Hasher *hasher, const void *leaf, size_t idx,
+                        size_t n_leaves, const void *proof,
+                        const void *root) {
+  if (!hasher || !leaf || !root || idx >= n_leaves ||
+      (!proof && n_leaves > 1)) {
+    errno = EINVAL;
+    return -1;
+  }
+  const size_t ds = hasher->get_hash_size();
+  if (ds == 0 || ds > MERKLE_MAX_DIGEST_SIZE) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  uint8_t node[MERKLE_MAX_DIGEST_SIZE];
+  uint8_t node_input[1 + (2 * MERKLE_MAX_DIGEST_SIZE)];
+  node_input[0] = MERKLE_NODE_PREFIX;
+  memcpy(node, leaf, ds);
+  const uint8_t *siblings = proof;
+  size_t count = n_leaves;
+  for (size_t lvl = 0; count > 1; lvl++) {
+    const size_t sibling = idx ^ 1;
+    if (sibling < count) {
+      const uint8_t *left = idx & 1 ? siblings + (lvl * ds) : node;
+      const uint8_t *right = idx & 1 ? node : siblings + (lvl * ds);
+      memcpy(node_input + 1, left, ds);
+      memcpy(node_input + 1 + ds, right, ds);
+      if (hasher->hash_buffer_binary(node_input, 1 + (2 * ds), node, ds) <
+          0) {
+        errno = EIO;
+        return -1;
+      }
+    }
+    idx /= 2;
+    count = (count + 1) / 2;
+  }
+  return memcmp(node, root, ds) == 0;
+}
@@ -0,0 +1,58 @@
+#ifndef __MERKLE_TREE_H__
+#define __MERKLE_TREE_H__
+
+#include "hasher.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * ============================================================================
+ * MERKLE TREE - INCREMENTAL ROOT OVER PER-CHUNK DIGESTS
+ * ============================================================================
+ *
+ * Binary hash tree kept fully in memory. Level 0 holds one digest per data
+ * chunk (filled by the caller), every upper level holds
+ * H(0x01 || left || right). A node without a right sibling is promoted
+ * unchanged, so a tree with a single leaf has that leaf as its root (the root
+ * of a one-chunk file is the plain hash of the file).
+ *
+ * Leaves are flagged dirty when they change; merkle_tree_commit() only
+ * recomputes the internal nodes on the paths from dirty leaves to the root.
+ *
+ * The inclusion proof of a leaf holds one digest per level below the root:
+ * the sibling of the node on the path from the leaf, or zeroes where that
+ * node has none and is promoted. Which levels those are only depends on the
+ * leaf index and the number of leaves, so proofs have a fixed size.
+ * ============================================================================
+ */
+
+typedef struct {
+  size_t digest_size;    // size of one node digest (hasher->get_hash_size())
+  size_t n_leaves;       // number of leaves (data chunks)
+  size_t n_levels;       // number of allocated levels (0 when empty)
+  size_t *level_counts;  // node count per level
+  uint8_t **levels;      // levels[0] = leaves, levels[n_levels - 1] = root
+  uint8_t *dirty;        // one flag per leaf, set until the next commit
+  size_t dirty_count;    // number of leaves currently flagged dirty
+  const Hasher *hasher;  // hasher used for internal nodes
+} MerkleTree;
+
+int merkle_tree_init(MerkleTree *tree, const Hasher *hasher);
+void merkle_tree_free(MerkleTree *tree);
+
+int merkle_tree_resize(MerkleTree *tree, size_t n_leaves);
+void merkle_tree_mark_dirty(MerkleTree *tree, size_t first, size_t last);
+int merkle_tree_is_dirty(const MerkleTree *tree, size_t idx);
+
+uint8_t *merkle_tree_leaf(MerkleTree *tree, size_t idx);
+int merkle_tree_commit(MerkleTree *tree);
+int merkle_tree_root(const MerkleTree *tree, void *out, size_t out_size);
+
+size_t merkle_proof_depth(size_t n_leaves);
+int merkle_tree_proof(const MerkleTree *tree, size_t idx, void *out,
+                      size_t out_size);
+int merkle_proof_verify(const Hasher *hasher, const void *leaf, size_t idx,
+                        size_t n_leaves, const void *proof,
+                        const void *root);
+
+#endif // __MERKLE_TREE_H__
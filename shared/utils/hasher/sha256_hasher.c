@@ -1,5 +1,6 @@
 #include "sha256_hasher.h"
 #include "evp.h"
+#include "sha256_mb.h"
 #include <openssl/evp.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,6 +24,24 @@ char *sha256_hash_buffer_hex(const void *data_buffer, size_t data_size) {
                              sha256_get_hash_size());
 }
 
+/**
+ * @brief SHA256 hash file into a caller provided hex buffer
+ */
+int sha256_hash_file_hex_into(int fd, LayerContext layer, char *hex,
+                             size_t hex_size) {
+  return evp_hash_file_hex_into(fd, layer, EVP_sha256(), hex, hex_size,
+                                sha256_get_hash_size(), SHA256_HASH_CHUNK_SIZE);
+}
+
+/**
+ * @brief SHA256 hash buffer into a caller provided hex buffer
+ */
+int sha256_hash_buffer_hex_into(const void *data_buffer, size_t data_size,
+                               char *hex, size_t hex_size) {
+  return evp_hash_buffer_hex_into(data_buffer, data_size, EVP_sha256(), hex,
+                                  hex_size, sha256_get_hash_size());
+}
+
 /**
  * @brief SHA256 hash file and return binary hash
  */
@@ -43,6 +62,74 @@ int sha256_hash_buffer_binary(const void *data_buffer, size_t data_size,
                                 sha256_get_hash_size());
 }
 
+/**
+ * @brief Check if n buffers starting at buffers[0] all have the same size
+ */
+static int same_sizes(const size_t *sizes, size_t n) {
+  for (size_t i = 1; i < n; i++) {
+    if (sizes[i] != sizes[0]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief SHA256 hash of many buffers
+ *
+ * Groups of SHA256_MB_LANES consecutive buffers of the same size go through
+ * the multi-buffer kernel when it is preferred on this CPU, everything else
+ * through OpenSSL with a single reused context.
+ */
+int sha256_hash_blocks_binary(const void *const *buffers, const size_t *sizes,
+                              size_t n, void *hash_buffer,
+                              size_t hash_buffer_size) {
+  if (!buffers || !sizes || !hash_buffer ||
+      hash_buffer_size < n * SHA256_HASH_SIZE) {
+    return -1;
+  }
+
+  if (!sha256_mb_preferred()) {
+    return evp_hash_blocks_binary(buffers, sizes, n, EVP_sha256(),
+                                  hash_buffer, hash_buffer_size,
+                                  SHA256_HASH_SIZE);
+  }
+
+  uint8_t *out = hash_buffer;
+  size_t i = 0;
+  size_t scalar_start = 0;
+  while (i < n) {
+    if (i + SHA256_MB_LANES <= n && same_sizes(sizes + i, SHA256_MB_LANES)) {
+      // flush the pending scalar run first
+      if (scalar_start < i &&
+          evp_hash_blocks_binary(buffers + scalar_start, sizes + scalar_start,
+                                 i - scalar_start, EVP_sha256(),
+                                 out + (scalar_start * SHA256_HASH_SIZE),
+                                 (i - scalar_start) * SHA256_HASH_SIZE,
+                                 SHA256_HASH_SIZE) < 0) {
+        return -1;
+      }
+      if (sha256_mb_hash_lanes(buffers + i, sizes[i],
+                               out + (i * SHA256_HASH_SIZE)) != 0) {
+        return -1;
+      }
+      i += SHA256_MB_LANES;
+      scalar_start = i;
+    } else {
+      i++;
+    }
+  }
+  if (scalar_start < n &&
+      evp_hash_blocks_binary(buffers + scalar_start, sizes + scalar_start,
+                             n - scalar_start, EVP_sha256(),
+                             out + (scalar_start * SHA256_HASH_SIZE),
+                             (n - scalar_start) * SHA256_HASH_SIZE,
+                             SHA256_HASH_SIZE) < 0) {
+    return -1;
+  }
+  return (int)n;
+}
+
 /**
  * @brief Get SHA256 binary hash size
  */
@@ -67,8 +154,11 @@ int sha256_hasher_init(Hasher *hasher) {
   hasher->algorithm = HASH_SHA256;
   hasher->hash_file_hex = sha256_hash_file_hex;
   hasher->hash_buffer_hex = sha256_hash_buffer_hex;
+  hasher->hash_file_hex_into = sha256_hash_file_hex_into;
+  hasher->hash_buffer_hex_into = sha256_hash_buffer_hex_into;
   hasher->hash_file_binary = sha256_hash_file_binary;
   hasher->hash_buffer_binary = sha256_hash_buffer_binary;
+  hasher->hash_blocks_binary = sha256_hash_blocks_binary;
   hasher->get_hash_size = sha256_get_hash_size;
   hasher->get_hex_size = sha256_get_hex_size;
 
@@ -0,0 +1,242 @@
+#include "sha256_mb.h"
+#include "../cpu.h"
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SHA256_MB_X86 1
+#include <immintrin.h>
+#endif
+
+#ifdef SHA256_MB_X86
+
+#define SHA256_BLOCK_SIZE 64
+#define MB_TARGET __attribute__((target("avx2")))
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const uint32_t sha256_h0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                      0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                      0x1f83d9ab, 0x5be0cd19};
+
+#define ROTR(x, n)                                                             \
+  _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+/**
+ * @brief Load 32 bytes of every lane at offset off as 8 big-endian words,
+ * transposed so that w[i] holds word i of all lanes
+ */
+MB_TARGET static void load_words(__m256i w[8], const uint8_t *const p[8],
+                                 size_t off) {
+  const __m256i bswap = _mm256_setr_epi8(
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5,
+      4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+  __m256i r[8];
+  for (int i = 0; i < 8; i++) {
+    r[i] = _mm256_loadu_si256((const __m256i *)(p[i] + off));
+  }
+
+  __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+  __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+  __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+  __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+  __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+  __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+  __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+  __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+  __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+  __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+  __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+  __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+  __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+  __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+  __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+  __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+  w[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+  w[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+  w[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+  w[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+  w[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+  w[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+  w[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+  w[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+
+  for (int i = 0; i < 8; i++) {
+    w[i] = _mm256_shuffle_epi8(w[i], bswap);
+  }
+}
+
+/**
+ * @brief Compress one 64-byte block of every lane into the state
+ */
+MB_TARGET static void compress(__m256i state[8], const uint8_t *const p[8],
+                               size_t off) {
+  __m256i w[64];
+  load_words(w, p, off);
+  load_words(w + 8, p, off + 32);
+
+  for (int t = 16; t < 64; t++) {
+    __m256i s0 = _mm256_xor_si256(
+        _mm256_xor_si256(ROTR(w[t - 15], 7), ROTR(w[t - 15], 18)),
+        _mm256_srli_epi32(w[t - 15], 3));
+    __m256i s1 = _mm256_xor_si256(
+        _mm256_xor_si256(ROTR(w[t - 2], 17), ROTR(w[t - 2], 19)),
+        _mm256_srli_epi32(w[t - 2], 10));
+    w[t] = _mm256_add_epi32(_mm256_add_epi32(w[t - 16], s0),
+                            _mm256_add_epi32(w[t - 7], s1));
+  }
+
+  __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+  __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+
+  for (int t = 0; t < 64; t++) {
+    __m256i s1 =
+        _mm256_xor_si256(_mm256_xor_si256(ROTR(e, 6), ROTR(e, 11)), ROTR(e, 25));
+    __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f),
+                                  _mm256_andnot_si256(e, g));
+    __m256i t1 = _mm256_add_epi32(
+        _mm256_add_epi32(_mm256_add_epi32(h, s1), ch),
+        _mm256_add_epi32(_mm256_set1_epi32((int)sha256_k[t]), w[t]));
+    __m256i s0 =
+        _mm256_xor_si256(_mm256_xor_si256(ROTR(a, 2), ROTR(a, 13)), ROTR(a, 22));
+    __m256i maj = _mm256_xor_si256(
+        _mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, c)),
+        _mm256_and_si256(b, c));
+    __m256i t2 = _mm256_add_epi32(s0, maj);
+
+    h = g;
+    g = f;
+    f = e;
+    e = _mm256_add_epi32(d, t1);
+    d = c;
+    c = b;
+    b = a;
+    a = _mm256_add_epi32(t1, t2);
+  }
+
+  state[0] = _mm256_add_epi32(state[0], a);
+  state[1] = _mm256_add_epi32(state[1], b);
+  state[2] = _mm256_add_epi32(state[2], c);
+  state[3] = _mm256_add_epi32(state[3], d);
+  state[4] = _mm256_add_epi32(state[4], e);
+  state[5] = _mm256_add_epi32(state[5], f);
+  state[6] = _mm256_add_epi32(state[6], g);
+  state[7] = _mm256_add_epi32(state[7], h);
+}
+
+MB_TARGET static void hash_lanes_avx2(const uint8_t *const data[8], size_t size,
+                                      uint8_t *out) {
+  __m256i state[8];
+  for (int i = 0; i < 8; i++) {
+    state[i] = _mm256_set1_epi32((int)sha256_h0[i]);
+  }
+
+  // full blocks straight from the messages
+  const size_t full_blocks = size / SHA256_BLOCK_SIZE;
+  for (size_t blk = 0; blk < full_blocks; blk++) {
+    compress(state, data, blk * SHA256_BLOCK_SIZE);
+  }
+
+  // tail, padding and bit length: one or two blocks, same layout for all lanes
+  const size_t tail = size % SHA256_BLOCK_SIZE;
+  const size_t pad_blocks = tail + 9 <= SHA256_BLOCK_SIZE ? 1 : 2;
+  const uint64_t bit_len = (uint64_t)size * 8;
+  uint8_t pad[8][2 * SHA256_BLOCK_SIZE];
+  const uint8_t *pad_ptrs[8];
+  for (int lane = 0; lane < 8; lane++) {
+    uint8_t *buf = pad[lane];
+    memset(buf, 0, sizeof(pad[lane]));
+    memcpy(buf, data[lane] + (full_blocks * SHA256_BLOCK_SIZE), tail);
+    buf[tail] = 0x80;
+    uint8_t *len_at = buf + (pad_blocks * SHA256_BLOCK_SIZE) - 8;
+    for (int i = 0; i < 8; i++) {
+      len_at[i] = (uint8_t)(bit_len >> (56 - (8 * i)));
+    }
+    pad_ptrs[lane] = buf;
+  }
+  for (size_t blk = 0; blk < pad_blocks; blk++) {
+    compress(state, pad_ptrs, blk * SHA256_BLOCK_SIZE);
+  }
+
+  // state[word] holds that word of every lane
+  uint32_t words[8][8];
+  for (int i = 0; i < 8; i++) {
+    _mm256_storeu_si256((__m256i *)words[i], state[i]);
+  }
+  for (int lane = 0; lane < 8; lane++) {
+    uint8_t *digest = out + (lane * SHA256_MB_DIGEST_SIZE);
+    for (int i = 0; i < 8; i++) {
+      digest[(4 * i) + 0] = (uint8_t)(words[i][lane] >> 24);
+      digest[(4 * i) + 1] = (uint8_t)(words[i][lane] >> 16);
+      digest[(4 * i) + 2] = (uint8_t)(words[i][lane] >> 8);
+      digest[(4 * i) + 3] = (uint8_t)words[i][lane];
+    }
+  }
+}
+
+#endif // SHA256_MB_X86
+
+// OpenSSL's single buffer code is faster with the SHA extensions
+static const CpuKernelImpl sha256_impls[] = {
+    {"openssl", CPU_SHA, NULL},
+#ifdef SHA256_MB_X86
+    {"multi_buffer", CPU_AVX2, (CpuKernelFn)hash_lanes_avx2},
+#endif
+    {"openssl", 0, NULL},
+};
+static CpuKernel sha256_kernel = CPU_KERNEL_INIT("sha256", sha256_impls);
+
+/**
+ * @brief Check if the multi-buffer kernel can run on this CPU (AVX2)
+ */
+int sha256_mb_available(void) {
+#ifdef SHA256_MB_X86
+  return cpu_has(CPU_AVX2);
+#else
+  return 0;
+#endif
+}
+
+/**
+ * @brief Check if the multi-buffer kernel should be preferred over OpenSSL
+ */
+int sha256_mb_preferred(void) {
+  return cpu_kernel_select(&sha256_kernel)->fn != NULL;
+}
+
+/**
+ * @brief Hash SHA256_MB_LANES messages of the same length
+ */
+int sha256_mb_hash_lanes(const void *const data[SHA256_MB_LANES], size_t size,
+                         uint8_t *out) {
+#ifdef SHA256_MB_X86
+  if (!data || !out || !sha256_mb_available()) {
+    return -1;
+  }
+  for (int lane = 0; lane < SHA256_MB_LANES; lane++) {
+    if (!data[lane]) {
+      return -1;
+    }
+  }
+  hash_lanes_avx2((const uint8_t *const *)data, size, out);
+  return 0;
+#else
+  (void)data;
+  (void)size;
+  (void)out;
+  return -1;
+#endif
+}
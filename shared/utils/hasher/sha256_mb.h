@@ -0,0 +1,53 @@
+#ifndef __SHA256_MB_H__
+#define __SHA256_MB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * ============================================================================
+ * MULTI-BUFFER SHA-256
+ * ============================================================================
+ *
+ * Hashes SHA256_MB_LANES independent messages of the same length at once, one
+ * message per 32-bit lane of an AVX2 register. Used by the SHA256 hasher's
+ * hash_blocks_binary on CPUs without the SHA extensions, where OpenSSL falls
+ * back to a scalar/SSSE3 implementation that processes one block at a time.
+ * On CPUs with SHA-NI (x86) or the ARMv8 crypto extensions OpenSSL's single
+ * buffer code is faster and this kernel is not used (see cpu.h).
+ * ============================================================================
+ */
+
+#define SHA256_MB_LANES 8
+#define SHA256_MB_DIGEST_SIZE 32
+
+/**
+ * @brief Check if the multi-buffer kernel can run on this CPU (AVX2)
+ *
+ * @return int 1 if available, 0 otherwise
+ */
+int sha256_mb_available(void);
+
+/**
+ * @brief Check if the multi-buffer kernel should be preferred over OpenSSL
+ *
+ * The "sha256" kernel of cpu.h: preferred on CPUs with AVX2 and without SHA
+ * instructions, or as named by cpu_kernels ("multi_buffer" or "openssl").
+ *
+ * @return int 1 if preferred, 0 otherwise
+ */
+int sha256_mb_preferred(void);
+
+/**
+ * @brief Hash SHA256_MB_LANES messages of the same length
+ *
+ * @param data Pointers to the SHA256_MB_LANES messages
+ * @param size Length of every message in bytes
+ * @param out Output: SHA256_MB_LANES digests of SHA256_MB_DIGEST_SIZE bytes,
+ * back to back
+ * @return int 0 on success, -1 if the kernel is not available
+ */
+int sha256_mb_hash_lanes(const void *const data[SHA256_MB_LANES], size_t size,
+                         uint8_t *out);
+
+#endif /* __SHA256_MB_H__ */
@@ -23,6 +23,24 @@ char *sha512_hash_buffer_hex(const void *data_buffer, size_t data_size) {
                              sha512_get_hash_size());
 }
 
+/**
+ * @brief SHA512 hash file into a caller provided hex buffer
+ */
+int sha512_hash_file_hex_into(int fd, LayerContext layer, char *hex,
+                             size_t hex_size) {
+  return evp_hash_file_hex_into(fd, layer, EVP_sha512(), hex, hex_size,
+                                sha512_get_hash_size(), SHA512_HASH_CHUNK_SIZE);
+}
+
+/**
+ * @brief SHA512 hash buffer into a caller provided hex buffer
+ */
+int sha512_hash_buffer_hex_into(const void *data_buffer, size_t data_size,
+                               char *hex, size_t hex_size) {
+  return evp_hash_buffer_hex_into(data_buffer, data_size, EVP_sha512(), hex,
+                                  hex_size, sha512_get_hash_size());
+}
+
 /**
  * @brief SHA512 hash file and return binary hash
  */
@@ -43,6 +61,16 @@ int sha512_hash_buffer_binary(const void *data_buffer, size_t data_size,
                                 sha512_get_hash_size());
 }
 
+/**
+ * @brief SHA512 hash of many buffers
+ */
+int sha512_hash_blocks_binary(const void *const *buffers, const size_t *sizes,
+                              size_t n, void *hash_buffer,
+                              size_t hash_buffer_size) {
+  return evp_hash_blocks_binary(buffers, sizes, n, EVP_sha512(), hash_buffer,
+                                hash_buffer_size, sha512_get_hash_size());
+}
+
 /**
  * @brief Get SHA512 binary hash size
  */
@@ -67,8 +95,11 @@ int sha512_hasher_init(Hasher *hasher) {
   hasher->algorithm = HASH_SHA512;
   hasher->hash_file_hex = sha512_hash_file_hex;
   hasher->hash_buffer_hex = sha512_hash_buffer_hex;
+  hasher->hash_file_hex_into = sha512_hash_file_hex_into;
+  hasher->hash_buffer_hex_into = sha512_hash_buffer_hex_into;
   hasher->hash_file_binary = sha512_hash_file_binary;
   hasher->hash_buffer_binary = sha512_hash_buffer_binary;
+  hasher->hash_blocks_binary = sha512_hash_blocks_binary;
   hasher->get_hash_size = sha512_get_hash_size;
   hasher->get_hex_size = sha512_get_hex_size;
 
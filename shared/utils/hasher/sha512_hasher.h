@@ -25,6 +25,30 @@ char *sha512_hash_file_hex(int fd, LayerContext layer);
  */
 char *sha512_hash_buffer_hex(const void *data_buffer, size_t data_size);
 
+/**
+ * @brief SHA512 hash file into a caller provided hex buffer
+ *
+ * @param fd File descriptor to read from
+ * @param layer LayerContext to use for reading data
+ * @param hex Output buffer for the null-terminated hex string
+ * @param hex_size Size of the output buffer
+ * @return int Number of hex characters written, or -1 on error
+ */
+int sha512_hash_file_hex_into(int fd, LayerContext layer, char *hex,
+                             size_t hex_size);
+
+/**
+ * @brief SHA512 hash buffer into a caller provided hex buffer
+ *
+ * @param data_buffer Pointer to the input data to hash
+ * @param data_size Size of the input data in bytes
+ * @param hex Output buffer for the null-terminated hex string
+ * @param hex_size Size of the output buffer
+ * @return int Number of hex characters written, or -1 on error
+ */
+int sha512_hash_buffer_hex_into(const void *data_buffer, size_t data_size,
+                               char *hex, size_t hex_size);
+
 /**
  * @brief SHA512 hash file and return binary hash
  *
@@ -49,6 +73,20 @@ int sha512_hash_file_binary(int fd, LayerContext layer, void *hash_buffer,
 int sha512_hash_buffer_binary(const void *data_buffer, size_t data_size,
                               void *hash_buffer, size_t hash_buffer_size);
 
+/**
+ * @brief SHA512 hash of many buffers
+ *
+ * @param buffers Array of n input buffers
+ * @param sizes Array of n buffer sizes in bytes
+ * @param n Number of buffers
+ * @param hash_buffer Output buffer: n binary hashes, back to back
+ * @param hash_buffer_size Size of the output buffer
+ * @return int Number of hashes written to hash_buffer, or -1 on error
+ */
+int sha512_hash_blocks_binary(const void *const *buffers, const size_t *sizes,
+                              size_t n, void *hash_buffer,
+                              size_t hash_buffer_size);
+
 /**
  * @brief Get SHA512 binary hash size
  *
@@ -0,0 +1,19 @@
+#include "invalidation.h"
+#include <stddef.h>
+
+static LayerInvalidateHook invalidate_hook = NULL;
+static void *invalidate_ctx = NULL;
+
+void layer_invalidate_hook_set(LayerInvalidateHook hook, void *ctx) {
+  // the context is published before the hook that reads it
+  __atomic_store_n(&invalidate_ctx, ctx, __ATOMIC_RELAXED);
+  __atomic_store_n(&invalidate_hook, hook, __ATOMIC_RELEASE);
+}
+
+void layer_invalidate_attr(dev_t device, ino_t inode) {
+  LayerInvalidateHook hook =
+      __atomic_load_n(&invalidate_hook, __ATOMIC_ACQUIRE);
+  if (hook) {
+    hook(device, inode, __atomic_load_n(&invalidate_ctx, __ATOMIC_RELAXED));
+  }
+}
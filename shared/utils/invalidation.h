@@ -0,0 +1,41 @@
+#ifndef INVALIDATION_H
+#define INVALIDATION_H
+
+#include <sys/types.h>
+
+/*
+ * ============================================================================
+ * INVALIDATION - TELL THE FRONTEND CACHED ATTRIBUTES ARE STALE
+ * ============================================================================
+ *
+ * A frontend that caches attributes (e.g. the FUSE frontend with attribute
+ * timeouts) only sees the changes made through it. Layers whose logical
+ * attributes change on their own, such as the logical size of a compressed
+ * file, report it with layer_invalidate_attr(), keyed by the device and
+ * inode of the file in the layer below.
+ *
+ * The frontend installs one process-wide hook before any I/O. It may be
+ * called with layer locks held and from any thread, so it must not call
+ * back into the layers, and it should only queue the invalidation.
+ * ============================================================================
+ */
+
+typedef void (*LayerInvalidateHook)(dev_t device, ino_t inode, void *ctx);
+
+/**
+ * @brief Install the process-wide invalidation hook
+ *
+ * @param hook -> called for each invalidation, NULL to remove it
+ * @param ctx  -> passed to hook
+ */
+void layer_invalidate_hook_set(LayerInvalidateHook hook, void *ctx);
+
+/**
+ * @brief Report that the cached attributes of a file are stale
+ *
+ * @param device -> device of the file in the layer below
+ * @param inode  -> inode of the file in the layer below
+ */
+void layer_invalidate_attr(dev_t device, ino_t inode);
+
+#endif // INVALIDATION_H
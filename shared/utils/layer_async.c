@@ -0,0 +1,174 @@
+#include "layer_async.h"
+#include "thread_pool.h"
+#include <errno.h>
+#include <stdlib.h>
+
+// A blocking op run on the adapter pool, freed by the worker once done
+typedef struct {
+  ThreadPoolTask task;
+  int fd;
+  void *buffer;
+  size_t nbyte;
+  off_t offset;
+  bool write;
+  LayerIoCallback callback;
+  void *ctx;
+  LayerContext l;
+} AsyncOp;
+
+static ThreadPool *adapter_pool = NULL;
+static pthread_once_t adapter_pool_once = PTHREAD_ONCE_INIT;
+
+// The pool lives as long as the process: detached tasks may still be
+// queued when the last layer is destroyed
+static void start_adapter_pool(void) {
+  adapter_pool = thread_pool_init(1, LAYER_ASYNC_WORKERS);
+}
+
+static ssize_t run_sync(int fd, void *buffer, size_t nbyte, off_t offset,
+                        bool write, LayerContext l) {
+  ssize_t res = write ? l.ops->lpwrite(fd, buffer, nbyte, offset, l)
+                      : l.ops->lpread(fd, buffer, nbyte, offset, l);
+  // errno may be stale on a -1 reported by a layer
+  if (res < 0) {
+    return errno != 0 ? -errno : -EIO;
+  }
+  return res;
+}
+
+static void *async_op_worker(void *arg) {
+  AsyncOp *op = (AsyncOp *)arg;
+  errno = 0;
+  ssize_t res =
+      run_sync(op->fd, op->buffer, op->nbyte, op->offset, op->write, op->l);
+  op->callback(res, op->ctx);
+  free(op);
+  return NULL;
+}
+
+static int submit_adapted(int fd, void *buffer, size_t nbyte, off_t offset,
+                          bool write, LayerIoCallback callback, void *ctx,
+                          LayerContext l) {
+  pthread_once(&adapter_pool_once, start_adapter_pool);
+
+  AsyncOp *op = adapter_pool ? malloc(sizeof(AsyncOp)) : NULL;
+  if (op) {
+    op->fd = fd;
+    op->buffer = buffer;
+    op->nbyte = nbyte;
+    op->offset = offset;
+    op->write = write;
+    op->callback = callback;
+    op->ctx = ctx;
+    op->l = l;
+    if (thread_pool_submit(adapter_pool, 0, &op->task, NULL, async_op_worker,
+                           op) == 0) {
+      return 0;
+    }
+    free(op);
+  }
+
+  // no worker to hand it to, complete inline
+  errno = 0;
+  callback(run_sync(fd, buffer, nbyte, offset, write, l), ctx);
+  return 0;
+}
+
+bool layer_has_native_async(LayerContext l) {
+  return l.ops->lpread_async != NULL && l.ops->lpwrite_async != NULL;
+}
+
+int layer_pread_async(int fd, void *buffer, size_t nbyte, off_t offset,
+                      LayerIoCallback callback, void *ctx, LayerContext l) {
+  if (l.ops->lpread_async) {
+    return l.ops->lpread_async(fd, buffer, nbyte, offset, callback, ctx, l);
+  }
+  return submit_adapted(fd, buffer, nbyte, offset, false, callback, ctx, l);
+}
+
+int layer_pwrite_async(int fd, const void *buffer, size_t nbyte, off_t offset,
+                       LayerIoCallback callback, void *ctx, LayerContext l) {
+  if (l.ops->lpwrite_async) {
+    return l.ops->lpwrite_async(fd, buffer, nbyte, offset, callback, ctx, l);
+  }
+  // the adapter only hands the buffer back to lpwrite
+  return submit_adapted(fd, (void *)buffer, nbyte, offset, true, callback,
+                        ctx, l);
+}
+
+void layer_cq_init(LayerCompletionQueue *cq) {
+  pthread_mutex_init(&cq->mutex, NULL);
+  pthread_cond_init(&cq->done, NULL);
+  cq->pending = 0;
+}
+
+static void cq_complete(ssize_t res, void *ctx) {
+  LayerCompletion *completion = (LayerCompletion *)ctx;
+  LayerCompletionQueue *cq = completion->cq;
+  if (res < 0) {
+    completion->res = -1;
+    completion->err = (int)-res;
+  } else {
+    completion->res = res;
+    completion->err = 0;
+  }
+
+  // the completion and the queue may be released once pending reaches zero
+  pthread_mutex_lock(&cq->mutex);
+  if (--cq->pending == 0) {
+    pthread_cond_broadcast(&cq->done);
+  }
+  pthread_mutex_unlock(&cq->mutex);
+}
+
+// Count the operation before submitting, it may complete inline
+static void cq_add(LayerCompletionQueue *cq, LayerCompletion *completion) {
+  completion->cq = cq;
+  completion->res = -1;
+  completion->err = 0;
+  pthread_mutex_lock(&cq->mutex);
+  cq->pending++;
+  pthread_mutex_unlock(&cq->mutex);
+}
+
+static void cq_cancel(LayerCompletionQueue *cq, LayerCompletion *completion) {
+  completion->err = errno;
+  pthread_mutex_lock(&cq->mutex);
+  cq->pending--;
+  pthread_mutex_unlock(&cq->mutex);
+}
+
+int layer_cq_pread(LayerCompletionQueue *cq, LayerCompletion *completion,
+                   int fd, void *buffer, size_t nbyte, off_t offset,
+                   LayerContext l) {
+  cq_add(cq, completion);
+  if (layer_pread_async(fd, buffer, nbyte, offset, cq_complete, completion,
+                        l) != 0) {
+    cq_cancel(cq, completion);
+    return -1;
+  }
+  return 0;
+}
+
+int layer_cq_pwrite(LayerCompletionQueue *cq, LayerCompletion *completion,
+                    int fd, const void *buffer, size_t nbyte, off_t offset,
+                    LayerContext l) {
+  cq_add(cq, completion);
+  if (layer_pwrite_async(fd, buffer, nbyte, offset, cq_complete, completion,
+                         l) != 0) {
+    cq_cancel(cq, completion);
+    return -1;
+  }
+  return 0;
+}
+
+void layer_cq_wait(LayerCompletionQueue *cq) {
+  pthread_mutex_lock(&cq->mutex);
+  while (cq->pending > 0) {
+    pthread_cond_wait(&cq->done, &cq->mutex);
+  }
+  pthread_mutex_unlock(&cq->mutex);
+
+  pthread_cond_destroy(&cq->done);
+  pthread_mutex_destroy(&cq->mutex);
+}
@@ -0,0 +1,127 @@
+#ifndef LAYER_ASYNC_H
+#define LAYER_ASYNC_H
+
+#include "../types/layer_context.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define LAYER_ASYNC_WORKERS 4 // Workers running the ops of synchronous layers
+
+/*
+ * ============================================================================
+ * LAYER ASYNC - ASYNCHRONOUS I/O ACROSS LAYERS
+ * ============================================================================
+ *
+ * lpread_async and lpwrite_async are optional in LayerOps. layer_pread_async()
+ * and layer_pwrite_async() call them when the layer has them; otherwise the
+ * blocking lpread/lpwrite runs as a detached task of a process-wide thread
+ * pool, started on first use, and the callback runs on that worker. If the
+ * pool cannot take the task the op runs inline and the callback runs before
+ * the submission returns.
+ *
+ * A LayerCompletionQueue collects the completions of a group of operations
+ * so a caller can fan requests out to several layers and wait for all of
+ * them, without a thread per operation when the layers are asynchronous.
+ * Queue and completion storage belongs to the caller (typically its stack).
+ * ============================================================================
+ */
+
+/**
+ * @brief Completion counter of a group of asynchronous operations
+ */
+typedef struct {
+  pthread_mutex_t mutex; // Protects pending
+  pthread_cond_t done;   // Broadcast when pending reaches zero
+  int pending;           // Submitted operations that have not completed
+} LayerCompletionQueue;
+
+/**
+ * @brief Result of one operation of a completion queue
+ */
+typedef struct {
+  LayerCompletionQueue *cq; // Queue notified on completion
+  ssize_t res;              // Bytes transferred, -1 on failure
+  int err;                  // errno of a failed operation
+} LayerCompletion;
+
+/**
+ * @brief Whether a layer implements the asynchronous ops itself
+ *
+ * @param l       -> layer to check
+ * @return bool   -> true if both lpread_async and lpwrite_async are set
+ */
+bool layer_has_native_async(LayerContext l);
+
+/**
+ * @brief Asynchronous pread on a layer, native or through lpread
+ *
+ * The buffer must stay valid until the callback runs.
+ *
+ * @param fd       -> file descriptor of the layer
+ * @param buffer   -> buffer to read into
+ * @param nbyte    -> number of bytes to read
+ * @param offset   -> offset value
+ * @param callback -> called once with the result
+ * @param ctx      -> passed to the callback
+ * @param l        -> layer to read from
+ * @return int     -> 0 if queued, -1 with errno set if the callback will not
+ * run
+ */
+int layer_pread_async(int fd, void *buffer, size_t nbyte, off_t offset,
+                      LayerIoCallback callback, void *ctx, LayerContext l);
+
+/**
+ * @brief Asynchronous pwrite on a layer, native or through lpwrite
+ *
+ * The buffer must stay valid until the callback runs.
+ *
+ * @param fd       -> file descriptor of the layer
+ * @param buffer   -> buffer to write
+ * @param nbyte    -> number of bytes to write
+ * @param offset   -> offset value
+ * @param callback -> called once with the result
+ * @param ctx      -> passed to the callback
+ * @param l        -> layer to write to
+ * @return int     -> 0 if queued, -1 with errno set if the callback will not
+ * run
+ */
+int layer_pwrite_async(int fd, const void *buffer, size_t nbyte, off_t offset,
+                       LayerIoCallback callback, void *ctx, LayerContext l);
+
+/**
+ * @brief Initialize an empty completion queue
+ */
+void layer_cq_init(LayerCompletionQueue *cq);
+
+/**
+ * @brief Queue an asynchronous pread whose result is stored in completion
+ *
+ * @param cq         -> queue the operation belongs to
+ * @param completion -> result storage, valid until layer_cq_wait() returns
+ * @return int       -> 0 if queued, -1 with errno set otherwise
+ */
+int layer_cq_pread(LayerCompletionQueue *cq, LayerCompletion *completion,
+                   int fd, void *buffer, size_t nbyte, off_t offset,
+                   LayerContext l);
+
+/**
+ * @brief Queue an asynchronous pwrite whose result is stored in completion
+ *
+ * @param cq         -> queue the operation belongs to
+ * @param completion -> result storage, valid until layer_cq_wait() returns
+ * @return int       -> 0 if queued, -1 with errno set otherwise
+ */
+int layer_cq_pwrite(LayerCompletionQueue *cq, LayerCompletion *completion,
+                    int fd, const void *buffer, size_t nbyte, off_t offset,
+                    LayerContext l);
+
+/**
+ * @brief Wait until every operation of cq completed, then destroy cq
+ *
+ * @param cq -> queue to wait for
+ */
+void layer_cq_wait(LayerCompletionQueue *cq);
+
+#endif // LAYER_ASYNC_H
@@ -0,0 +1,198 @@
+#include "layer_iov.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LAYER_COPY_CHUNK (1024 * 1024) // bounce buffer of a fallback copy
+
+size_t iov_length(const struct iovec *iov, int iovcnt) {
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+  return total;
+}
+
+void iov_scatter(const struct iovec *iov, int iovcnt, const void *src,
+                 size_t nbyte) {
+  const char *p = src;
+  for (int i = 0; i < iovcnt && nbyte > 0; i++) {
+    size_t n = iov[i].iov_len < nbyte ? iov[i].iov_len : nbyte;
+    memcpy(iov[i].iov_base, p, n);
+    p += n;
+    nbyte -= n;
+  }
+}
+
+void iov_gather(const struct iovec *iov, int iovcnt, void *dst) {
+  char *p = dst;
+  for (int i = 0; i < iovcnt; i++) {
+    memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    p += iov[i].iov_len;
+  }
+}
+
+ssize_t layer_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                     LayerContext l) {
+  if (iovcnt < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (l.ops->lpreadv) {
+    return l.ops->lpreadv(fd, iov, iovcnt, offset, l);
+  }
+  if (iovcnt == 0) {
+    return 0;
+  }
+  if (iovcnt == 1) {
+    return l.ops->lpread(fd, iov[0].iov_base, iov[0].iov_len, offset, l);
+  }
+
+  size_t total = iov_length(iov, iovcnt);
+  char *bounce = malloc(total ? total : 1);
+  if (!bounce) {
+    errno = ENOMEM;
+    return -1;
+  }
+  ssize_t res = l.ops->lpread(fd, bounce, total, offset, l);
+  if (res > 0) {
+    iov_scatter(iov, iovcnt, bounce, (size_t)res);
+  }
+  free(bounce);
+  return res;
+}
+
+ssize_t layer_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                      off_t offset, LayerContext l) {
+  if (iovcnt < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (l.ops->lpwritev) {
+    return l.ops->lpwritev(fd, iov, iovcnt, offset, l);
+  }
+  if (iovcnt == 0) {
+    return 0;
+  }
+  if (iovcnt == 1) {
+    return l.ops->lpwrite(fd, iov[0].iov_base, iov[0].iov_len, offset, l);
+  }
+
+  size_t total = iov_length(iov, iovcnt);
+  char *bounce = malloc(total ? total : 1);
+  if (!bounce) {
+    errno = ENOMEM;
+    return -1;
+  }
+  iov_gather(iov, iovcnt, bounce);
+  ssize_t res = l.ops->lpwrite(fd, bounce, total, offset, l);
+  free(bounce);
+  return res;
+}
+
+size_t layer_direct_alignment(LayerContext l) {
+  if (l.ops->ldirect_alignment) {
+    return l.ops->ldirect_alignment(l);
+  }
+  if (!l.next_layers) {
+    return 1;
+  }
+  return layer_direct_alignment(l.next_layers[0]);
+}
+
+int layer_backing_fd(int fd, LayerContext l) {
+  return l.ops->lbacking_fd ? l.ops->lbacking_fd(fd, l) : -1;
+}
+
+int layer_verify(const char *path, LayerContext l) {
+  if (l.ops->lverify) {
+    return l.ops->lverify(path, l);
+  }
+  if (!l.next_layers || l.nlayers < 1) {
+    return LAYER_VERIFY_UNPROTECTED;
+  }
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  return layer_verify(path, next_layer);
+}
+
+ssize_t layer_getdigest(int fd, off_t offset, size_t nbyte,
+                        LayerStoredDigests *digests, LayerContext l) {
+  if (!l.ops->lgetdigest) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  return l.ops->lgetdigest(fd, offset, nbyte, digests, l);
+}
+
+ssize_t layer_copy_file_range(int fd_in, off_t offset_in, int fd_out,
+                              off_t offset_out, size_t len,
+                              unsigned int flags, LayerContext l) {
+  if (l.ops->lcopy_file_range) {
+    ssize_t res = l.ops->lcopy_file_range(fd_in, offset_in, fd_out, offset_out,
+                                          len, flags, l);
+    if (res != -1 || (errno != EXDEV && errno != ENOSYS &&
+                      errno != EOPNOTSUPP && errno != EINVAL)) {
+      return res;
+    }
+  }
+  if (flags != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (len == 0) {
+    return 0;
+  }
+
+  size_t chunk = len < LAYER_COPY_CHUNK ? len : LAYER_COPY_CHUNK;
+  char *bounce = malloc(chunk);
+  if (!bounce) {
+    errno = ENOMEM;
+    return -1;
+  }
+  size_t copied = 0;
+  while (copied < len) {
+    size_t n = len - copied < chunk ? len - copied : chunk;
+    ssize_t got = l.ops->lpread(fd_in, bounce, n, offset_in + copied, l);
+    if (got <= 0) {
+      if (got == -1 && copied == 0) {
+        free(bounce);
+        return -1;
+      }
+      break; // end of fd_in, or an error after some bytes were copied
+    }
+    ssize_t put = l.ops->lpwrite(fd_out, bounce, (size_t)got,
+                                 offset_out + copied, l);
+    if (put <= 0) {
+      if (put == -1 && copied == 0) {
+        free(bounce);
+        return -1;
+      }
+      break;
+    }
+    copied += (size_t)put;
+    if (put < got) {
+      break;
+    }
+  }
+  free(bounce);
+  return (ssize_t)copied;
+}
+
+int layer_readdir(const char *path, void *buf,
+                  int (*filler)(void *buf, const char *name,
+                                const struct stat *stbuf, off_t off,
+                                unsigned int flags),
+                  off_t offset, struct fuse_file_info *fi, unsigned int flags,
+                  LayerContext l) {
+  if (l.ops->lreaddir) {
+    return l.ops->lreaddir(path, buf, filler, offset, fi, flags, l);
+  }
+  if (!l.next_layers) {
+    return -ENOSYS;
+  }
+  LayerContext next_layer =
+      layer_with_app_context(l.next_layers[0], l.app_context);
+  return layer_readdir(path, buf, filler, offset, fi,
+                       flags & ~LAYER_READDIR_PLUS, next_layer);
+}
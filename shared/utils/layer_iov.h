@@ -0,0 +1,173 @@
+#ifndef LAYER_IOV_H
+#define LAYER_IOV_H
+
+#include "../types/layer_context.h"
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define LAYER_IOV_MAX 1024 // Most buffers of one preadv/pwritev (UIO_MAXIOV)
+
+/*
+ * ============================================================================
+ * LAYER IOV - SCATTER/GATHER I/O ACROSS LAYERS
+ * ============================================================================
+ *
+ * lpreadv and lpwritev are optional in LayerOps. layer_preadv() and
+ * layer_pwritev() call them when the layer has them, and otherwise fall back
+ * to lpread/lpwrite: directly for a single iovec, through one bounce buffer
+ * for several, so the layer still sees a single call.
+ *
+ * ldirect_alignment is optional too: a layer that leaves it NULL hands its
+ * I/O down as it got it, so layer_direct_alignment() asks the layer below.
+ * lbacking_fd is not inherited that way: a layer without it may transform
+ * the data, so layer_backing_fd() reports no backing file. lreaddir is
+ * inherited for the names only: layer_readdir() lists the layer below
+ * without LAYER_READDIR_PLUS, as the layer may change the attributes.
+ * lverify is inherited: a layer without it has no hashes of its own, the
+ * ones below check the file, and a stack without any reports the file as
+ * unprotected. lgetdigest is not inherited, like lbacking_fd: the digests a
+ * layer below stores are of data the layer may transform. lcopy_file_range
+ * is not inherited either, the layer may transform the data: when a layer
+ * leaves it NULL, or can't do a copy (EXDEV, ENOSYS, EOPNOTSUPP or EINVAL),
+ * layer_copy_file_range() reads and writes the range through the layer.
+ * ============================================================================
+ */
+
+/**
+ * @brief Total number of bytes described by an iovec array
+ *
+ * @param iov     -> iovec array
+ * @param iovcnt  -> number of entries
+ * @return size_t -> sum of the iov_len
+ */
+size_t iov_length(const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Copy bytes into an iovec array
+ *
+ * @param iov     -> destination iovec array
+ * @param iovcnt  -> number of entries
+ * @param src     -> bytes to copy
+ * @param nbyte   -> number of bytes, at most iov_length(iov, iovcnt)
+ */
+void iov_scatter(const struct iovec *iov, int iovcnt, const void *src,
+                 size_t nbyte);
+
+/**
+ * @brief Copy an iovec array into a contiguous buffer
+ *
+ * @param iov     -> source iovec array
+ * @param iovcnt  -> number of entries
+ * @param dst     -> buffer of at least iov_length(iov, iovcnt) bytes
+ */
+void iov_gather(const struct iovec *iov, int iovcnt, void *dst);
+
+/**
+ * @brief preadv on a layer, native or through lpread
+ *
+ * @param fd       -> file descriptor of the layer
+ * @param iov      -> buffers to read into, filled in order
+ * @param iovcnt   -> number of buffers
+ * @param offset   -> offset value
+ * @param l        -> layer to read from
+ * @return ssize_t -> number of read bytes, -1 on error
+ */
+ssize_t layer_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+                     LayerContext l);
+
+/**
+ * @brief pwritev on a layer, native or through lpwrite
+ *
+ * @param fd       -> file descriptor of the layer
+ * @param iov      -> buffers to write, in order
+ * @param iovcnt   -> number of buffers
+ * @param offset   -> offset value
+ * @param l        -> layer to write to
+ * @return ssize_t -> number of written bytes, -1 on error
+ */
+ssize_t layer_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                      off_t offset, LayerContext l);
+
+/**
+ * @brief Alignment O_DIRECT I/O on a layer must have
+ *
+ * @param l       -> layer
+ * @return size_t -> alignment of the buffers, offsets and lengths in bytes, 1
+ * if there is none (also for a terminal layer without ldirect_alignment)
+ */
+size_t layer_direct_alignment(LayerContext l);
+
+/**
+ * @brief Local file that reads of an fd of a layer can go to directly
+ *
+ * @param fd   -> file descriptor of the layer
+ * @param l    -> layer
+ * @return int -> descriptor of the backing file, owned by the layer below
+ * and valid until fd is closed, or -1 if there is none
+ */
+int layer_backing_fd(int fd, LayerContext l);
+
+/**
+ * @brief Integrity check of a file on a layer, native or by the first next
+ * layer
+ *
+ * @param path Path of the file
+ * @param l Layer
+ * @return int LayerVerifyResult, LAYER_VERIFY_UNPROTECTED when no layer of
+ * the stack checks files
+ */
+int layer_verify(const char *path, LayerContext l);
+
+/**
+ * @brief Stored digests of the blocks of a range of an fd of a layer
+ *
+ * @param fd       -> file descriptor of the layer
+ * @param offset   -> offset value
+ * @param nbyte    -> number of bytes of the range
+ * @param digests  -> filled with the digests and their format
+ * @param l        -> layer
+ * @return ssize_t -> number of digests, -1 with errno on error (ENOTSUP if
+ * the layer keeps no digests)
+ */
+ssize_t layer_getdigest(int fd, off_t offset, size_t nbyte,
+                        LayerStoredDigests *digests, LayerContext l);
+
+/**
+ * @brief copy_file_range on a layer, native or through lpread/lpwrite
+ *
+ * @param fd_in      -> file descriptor of the layer to copy from
+ * @param offset_in  -> offset value in fd_in
+ * @param fd_out     -> file descriptor of the layer to copy to
+ * @param offset_out -> offset value in fd_out
+ * @param len        -> number of bytes to copy
+ * @param flags      -> flags of copy_file_range(2), 0
+ * @param l          -> layer
+ * @return ssize_t   -> number of copied bytes, fewer at the end of fd_in, -1
+ * on error
+ */
+ssize_t layer_copy_file_range(int fd_in, off_t offset_in, int fd_out,
+                              off_t offset_out, size_t len,
+                              unsigned int flags, LayerContext l);
+
+/**
+ * @brief readdir on a layer, native or through the first next layer
+ *
+ * @param path   -> directory path
+ * @param buf    -> passed to filler
+ * @param filler -> called with each entry, stops the listing when non-zero
+ * @param offset -> offset value
+ * @param fi     -> FUSE file info, may be NULL
+ * @param flags  -> LAYER_READDIR_PLUS to get the attributes of the entries
+ * @param l      -> layer
+ * @return int   -> 0 on success, -errno on error (-ENOSYS if no layer of
+ * the stack lists directories)
+ */
+int layer_readdir(const char *path, void *buf,
+                  int (*filler)(void *buf, const char *name,
+                                const struct stat *stbuf, off_t off,
+                                unsigned int flags),
+                  off_t offset, struct fuse_file_info *fi, unsigned int flags,
+                  LayerContext l);
+
+#endif // LAYER_IOV_H
@@ -0,0 +1,241 @@
+#include "lazy_layer.h"
+#include "layer_async.h"
+#include "layer_iov.h"
+#include <errno.h>
+#include <stdlib.h>
+
+/**
+ * @brief The built layer of a lazy layer, built by the first caller
+ */
+static LayerContext *lazy_target(LayerContext l) {
+  LazyLayerState *state = (LazyLayerState *)l.internal_state;
+  if (!__atomic_load_n(&state->built, __ATOMIC_ACQUIRE)) {
+    pthread_mutex_lock(&state->mutex);
+    if (!state->built) {
+      state->layer = state->build(state->arg);
+      if (state->release) {
+        state->release(state->arg);
+      }
+      state->arg = NULL;
+      __atomic_store_n(&state->built, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&state->mutex);
+  }
+  return &state->layer;
+}
+
+static ssize_t lazy_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                          LayerContext l) {
+  LayerContext *next = lazy_target(l);
+  return next->ops->lpread(fd, buffer, nbyte, offset, *next);
+}
+
+static ssize_t lazy_pwrite(int fd, const void *buffer, size_t nbyte,
+                           off_t offset, LayerContext l) {
+  LayerContext *next = lazy_target(l);
+  return next->ops->lpwrite(fd, buffer, nbyte, offset, *next);
+}
+
+static int lazy_open(const char *pathname, int flags, mode_t mode,
+                     LayerContext l) {
+  LayerContext *next = lazy_target(l);
+  return next->ops->lopen(pathname, flags, mode, *next);
+}
+
+static int lazy_close(int fd, LayerContext l) {
+  LayerContext *next = lazy_target(l);
+  return next->ops->lclose(fd, *next);
+}
+
+static int lazy_ftruncate(int fd, off_t length, LayerContext l) {
+  LayerContext *next = lazy_target(l);
+  if (!next->ops->lftruncate) {
+    errno = ENOSYS;
+    return -1;
+  }
+  return next->ops->lftruncate(fd, length, *next);
+}
+
+static int lazy_truncate(const char *path, off_t length, LayerContext l) {
+  LayerContext *next = lazy_target(l);
+  if (!next->ops->ltruncate) {
+    errno = ENOSYS;
+    return -1;
+  }
+  return next->ops->ltruncate(path, length, *next);
+}
+
+static int lazy_fstat(int fd, struct stat *stbuf, LayerContext l) {
+  LayerContext *next = lazy_target(l);
+  return next->ops->lfstat(fd, stbuf, *next);
+}
+
+static int lazy_lstat(const char *path, struct stat *stbuf, LayerContext l) {
+  LayerContext *next = lazy_target(l);
+  return next->ops->llstat(path, stbuf, *next);
+}
+
+static int lazy_unlink(const char *path, LayerContext l) {
+  LayerContext *next = lazy_target(l);
+  return next->ops->lunlink(path, *next);
+}
+
+static ssize_t lazy_preadv(int fd, const struct iovec *iov, int iovcnt,
+                           off_t offset, LayerContext l) {
+  return layer_preadv(fd, iov, iovcnt, offset, *lazy_target(l));
+}
+
+static ssize_t lazy_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                            off_t offset, LayerContext l) {
+  return layer_pwritev(fd, iov, iovcnt, offset, *lazy_target(l));
+}
+
+static int lazy_pread_async(int fd, void *buffer, size_t nbyte, off_t offset,
+                            LayerIoCallback callback, void *ctx,
+                            LayerContext l) {
+  return layer_pread_async(fd, buffer, nbyte, offset, callback, ctx,
+                           *lazy_target(l));
+}
+
+static int lazy_pwrite_async(int fd, const void *buffer, size_t nbyte,
+                             off_t offset, LayerIoCallback callback,
+                             void *ctx, LayerContext l) {
+  return layer_pwrite_async(fd, buffer, nbyte, offset, callback, ctx,
+                            *lazy_target(l));
+}
+
+static size_t lazy_direct_alignment(LayerContext l) {
+  return layer_direct_alignment(*lazy_target(l));
+}
+
+static int lazy_backing_fd(int fd, LayerContext l) {
+  return layer_backing_fd(fd, *lazy_target(l));
+}
+
+static int lazy_verify(const char *path, LayerContext l) {
+  return layer_verify(path, *lazy_target(l));
+}
+
+static int lazy_readdir(const char *path, void *buf,
+                        int (*filler)(void *buf, const char *name,
+                                      const struct stat *stbuf, off_t off,
+                                      unsigned int flags),
+                        off_t offset, struct fuse_file_info *fi,
+                        unsigned int flags, LayerContext l) {
+  return layer_readdir(path, buf, filler, offset, fi, flags, *lazy_target(l));
+}
+
+static int lazy_rename(const char *from, const char *to, unsigned int flags,
+                       LayerContext l) {
+  LayerContext *next = lazy_target(l);
+  if (!next->ops->lrename) {
+    errno = ENOSYS;
+    return -1;
+  }
+  return next->ops->lrename(from, to, flags, *next);
+}
+
+static int lazy_chmod(const char *path, mode_t mode, LayerContext l) {
+  LayerContext *next = lazy_target(l);
+  if (!next->ops->lchmod) {
+    errno = ENOSYS;
+    return -1;
+  }
+  return next->ops->lchmod(path, mode, *next);
+}
+
+static int lazy_mkdir(const char *path, mode_t mode, LayerContext l) {
+  LayerContext *next = lazy_target(l);
+  if (!next->ops->lmkdir) {
+    errno = ENOSYS;
+    return -1;
+  }
+  return next->ops->lmkdir(path, mode, *next);
+}
+
+static int lazy_fsync(int fd, int isdatasync, LayerContext l) {
+  LayerContext *next = lazy_target(l);
+  if (!next->ops->lfsync) {
+    return 0;
+  }
+  return next->ops->lfsync(fd, isdatasync, *next);
+}
+
+static int lazy_fallocate(int fd, off_t offset, int mode, off_t length,
+                          LayerContext l) {
+  LayerContext *next = lazy_target(l);
+  if (!next->ops->lfallocate) {
+    errno = ENOSYS;
+    return -1;
+  }
+  return next->ops->lfallocate(fd, offset, mode, length, *next);
+}
+
+static ssize_t lazy_copy_file_range(int fd_in, off_t offset_in, int fd_out,
+                                    off_t offset_out, size_t len,
+                                    unsigned int flags, LayerContext l) {
+  return layer_copy_file_range(fd_in, offset_in, fd_out, offset_out, len,
+                               flags, *lazy_target(l));
+}
+
+static void lazy_destroy(LayerContext l) {
+  LazyLayerState *state = (LazyLayerState *)l.internal_state;
+  if (state->built) {
+    if (state->layer.ops->ldestroy) {
+      state->layer.ops->ldestroy(state->layer);
+    }
+  } else if (state->release) {
+    state->release(state->arg);
+  }
+  pthread_mutex_destroy(&state->mutex);
+  free(state);
+}
+
+static const LayerOps lazy_ops = {
+    .lpread = lazy_pread,
+    .lpwrite = lazy_pwrite,
+    .lopen = lazy_open,
+    .lclose = lazy_close,
+    .lftruncate = lazy_ftruncate,
+    .ltruncate = lazy_truncate,
+    .lfstat = lazy_fstat,
+    .llstat = lazy_lstat,
+    .lunlink = lazy_unlink,
+    .lpreadv = lazy_preadv,
+    .lpwritev = lazy_pwritev,
+    .lpread_async = lazy_pread_async,
+    .lpwrite_async = lazy_pwrite_async,
+    .ldirect_alignment = lazy_direct_alignment,
+    .lbacking_fd = lazy_backing_fd,
+    .lverify = lazy_verify,
+    .lreaddir = lazy_readdir,
+    .lrename = lazy_rename,
+    .lchmod = lazy_chmod,
+    .lmkdir = lazy_mkdir,
+    .lfsync = lazy_fsync,
+    .lfallocate = lazy_fallocate,
+    .lcopy_file_range = lazy_copy_file_range,
+    .ldestroy = lazy_destroy,
+};
+
+LayerContext lazy_layer_init(LazyLayerBuild build, void (*release)(void *),
+                             void *arg) {
+  LayerContext l = {0};
+  LazyLayerState *state = calloc(1, sizeof(LazyLayerState));
+  if (!state) {
+    return l;
+  }
+  state->build = build;
+  state->release = release;
+  state->arg = arg;
+  pthread_mutex_init(&state->mutex, NULL);
+  state->ops = lazy_ops;
+  l.ops = &state->ops;
+  l.internal_state = state;
+  return l;
+}
+
+bool lazy_layer_built(LayerContext l) {
+  LazyLayerState *state = (LazyLayerState *)l.internal_state;
+  return __atomic_load_n(&state->built, __ATOMIC_ACQUIRE) != 0;
+}
@@ -0,0 +1,70 @@
+#ifndef LAZY_LAYER_H
+#define LAZY_LAYER_H
+
+#include "../types/layer_context.h"
+#include <pthread.h>
+#include <stdbool.h>
+
+/*
+ * ============================================================================
+ * LAZY LAYER - A LAYER BUILT ON ITS FIRST OPERATION
+ * ============================================================================
+ *
+ * Some layers are slow to start (key fetches, CacheLib pools, S3/IPFS
+ * clients) and are only reached by some operations, if any: a backup backend
+ * of a demultiplexer, the anchor layer of a rarely flushed manifest. A lazy
+ * layer stands in for such a layer in the tree. It has every operation of
+ * LayerOps; the first one to run, on any thread, calls build and the others
+ * wait for it, then every operation goes to the built layer.
+ *
+ * The operations the built layer leaves NULL behave as the callers of a
+ * NULL operation would make them: lpreadv, lpwritev, the asynchronous ops,
+ * ldirect_alignment, lbacking_fd and lreaddir go through their layer_iov.h /
+ * layer_async.h helpers, lfsync succeeds, and ltruncate, lftruncate,
+ * lrename, lchmod, lmkdir and lfallocate fail with ENOSYS. The digesting ops
+ * are not advertised, so the callers hash the buffers themselves.
+ *
+ * Destroying a lazy layer destroys the built layer, if any, and releases arg
+ * either way.
+ * ============================================================================
+ */
+
+/**
+ * @brief Builds the layer a lazy layer stands for
+ *
+ * @param arg           -> arg given to lazy_layer_init
+ * @return LayerContext -> the built layer
+ */
+typedef LayerContext (*LazyLayerBuild)(void *arg);
+
+typedef struct {
+  LazyLayerBuild build;
+  void (*release)(void *arg); // frees arg once it is not needed, may be NULL
+  void *arg;
+  pthread_mutex_t mutex; // serializes the build
+  int built;             // layer is set, read with acquire
+  LayerContext layer;    // the built layer
+  LayerOps ops;          // of this instance, layers above may change them
+} LazyLayerState;
+
+/**
+ * @brief Create a lazy layer
+ *
+ * @param build         -> called once, on the first operation
+ * @param release       -> called with arg after the build, or on destroy if
+ * the layer was never built; may be NULL
+ * @param arg           -> passed to build and release
+ * @return LayerContext -> the lazy layer
+ */
+LayerContext lazy_layer_init(LazyLayerBuild build, void (*release)(void *),
+                             void *arg);
+
+/**
+ * @brief Whether the layer a lazy layer stands for was built
+ *
+ * @param l     -> lazy layer
+ * @return bool -> true once the first operation ran
+ */
+bool lazy_layer_built(LayerContext l);
+
+#endif // LAZY_LAYER_H
@@ -1,4 +1,5 @@
 #include "locking.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -8,58 +9,88 @@
  * ============================================================================
  *
  * This implementation provides a thread-safe hash table of reader-writer locks
- * indexed by file paths. Each file path gets its own pthread_rwlock_t for
- * efficient reader-writer synchronization.
+ * indexed by file paths. Each file path gets its own list of held byte ranges
+ * and a condition variable that waiters sleep on until the ranges they
+ * overlap are released.
  *
  * ARCHITECTURE:
- * - Hash table with chaining for collision resolution
+ * - Hash table with chaining for collision resolution, split into
+ *   LOCK_TABLE_SHARDS shards that each have their own mutex
  * - Reference counting for automatic cleanup of unused lock entries
- * - Table-level mutex for hash table structure protection
- * - Individual rwlocks for each file path
+ * - Unused entries are pooled per shard (condition variable and path buffer
+ *   kept) instead of being freed and allocated again on the next lookup;
+ *   range records are recycled the same way
+ * - Held ranges are a plain list: it holds at most one range per thread
+ *   using the path, so a scan is cheaper than maintaining an interval tree
  *
  * THREAD SAFETY:
  * - All operations are thread-safe
  * - Lock acquisition/release is atomic
- * - Hash table modifications are protected by table_mutex
- * - Individual file operations use their own rwlocks
+ * - Shards and their entries are protected by the shard mutex, which waiters
+ *   release while sleeping on the entry condition variable
  * ============================================================================
  */
 
 /**
- * @brief Simple hash function for file paths
+ * @brief Hash function for file paths
  *
- * Uses djb2 algorithm for good distribution of hash values.
+ * Mixes the path 8 bytes at a time with a multiply-xorshift round and
+ * finishes with the murmur3 64-bit finalizer, so both the low bits (bucket)
+ * and the shard bits are well distributed.
  *
  * @param str -> string to hash
+ * @param len -> length of str
  * @return size_t -> hash value
  */
-static size_t hash_string(const char *str) {
-  size_t hash = 5381;
-  int c;
-
-  while ((c = (unsigned char)*str++)) {
-    hash = ((hash << 5) + hash) + c; // hash * 33 + c
+static size_t hash_string(const char *str, size_t len) {
+  uint64_t hash = 0x9e3779b97f4a7c15ULL ^ (uint64_t)len;
+  size_t i = 0;
+
+  for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, str + i, sizeof(word));
+    hash = (hash ^ word) * 0x9ddfea08eb382d69ULL;
+    hash ^= hash >> 47;
   }
+  uint64_t tail = 0;
+  memcpy(&tail, str + i, len - i);
+  hash ^= tail;
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+
+  return (size_t)hash;
+}
+
+static inline LockShard *shard_for(LockTable *lock_table, size_t hash) {
+  return &lock_table->shards[hash & (LOCK_TABLE_SHARDS - 1)];
+}
 
-  return hash % LOCK_TABLE_SIZE;
+static inline size_t bucket_for(size_t hash) {
+  return (hash / LOCK_TABLE_SHARDS) & (LOCK_SHARD_SIZE - 1);
 }
 
 /**
  * @brief Find an existing lock entry for the given file path
  *
- * This function assumes the table_mutex is already held by the caller.
+ * This function assumes the shard mutex is already held by the caller.
  *
- * @param lock_table -> lock table to search
+ * @param shard -> shard of the file path
  * @param file_path -> file path to find
+ * @param len -> length of file_path
+ * @param hash -> hash of file_path
  * @return LockEntry* -> pointer to entry if found, NULL otherwise
  */
-static LockEntry *find_lock_entry(LockTable *lock_table,
-                                  const char *file_path) {
-  size_t hash = hash_string(file_path);
-  LockEntry *entry = lock_table->table[hash];
+static LockEntry *find_lock_entry(LockShard *shard, const char *file_path,
+                                  size_t len, size_t hash) {
+  LockEntry *entry = shard->buckets[bucket_for(hash)];
 
   while (entry) {
-    if (strcmp(entry->file_path, file_path) == 0) {
+    if (entry->hash == hash && entry->path_len == len &&
+        memcmp(entry->file_path, file_path, len) == 0) {
       return entry;
     }
     entry = entry->next;
@@ -68,46 +99,81 @@ static LockEntry *find_lock_entry(LockTable *lock_table,
   return NULL;
 }
 
+/**
+ * @brief Free a lock entry that is in no chain and no pool
+ */
+static void free_lock_entry(LockEntry *entry) {
+  LockRange *range = entry->ranges;
+  while (range) {
+    LockRange *next = range->next;
+    free(range);
+    range = next;
+  }
+  pthread_cond_destroy(&entry->released);
+  free(entry->file_path);
+  free(entry);
+}
+
 /**
  * @brief Create a new lock entry for the given file path
  *
- * This function assumes the table_mutex is already held by the caller.
+ * Reuses a pooled entry when the shard has one. This function assumes the
+ * shard mutex is already held by the caller.
  *
- * @param lock_table -> lock table to add to
+ * @param shard -> shard to add to
  * @param file_path -> file path for the new entry
+ * @param len -> length of file_path
+ * @param hash -> hash of file_path
  * @return LockEntry* -> pointer to new entry if successful, NULL on failure
  */
-static LockEntry *create_lock_entry(LockTable *lock_table,
-                                    const char *file_path) {
-  size_t hash = hash_string(file_path);
-
-  // Allocate new entry
-  LockEntry *entry = malloc(sizeof(LockEntry));
-  if (!entry) {
-    return NULL;
-  }
+static LockEntry *create_lock_entry(LockShard *shard, const char *file_path,
+                                    size_t len, size_t hash) {
+  LockEntry *entry = shard->pool;
+  if (entry) {
+    // Pooled entry: the condition variable is initialized, no range is held
+    if (entry->path_capacity < len + 1) {
+      char *grown = realloc(entry->file_path, len + 1);
+      if (!grown) {
+        return NULL;
+      }
+      entry->file_path = grown;
+      entry->path_capacity = len + 1;
+    }
+    shard->pool = entry->next;
+    shard->pool_size--;
+  } else {
+    // Allocate new entry
+    entry = malloc(sizeof(LockEntry));
+    if (!entry) {
+      return NULL;
+    }
 
-  // Allocate and copy file path
-  entry->file_path = strdup(file_path);
-  if (!entry->file_path) {
-    free(entry);
-    return NULL;
-  }
+    entry->file_path = malloc(len + 1);
+    if (!entry->file_path) {
+      free(entry);
+      return NULL;
+    }
+    entry->path_capacity = len + 1;
 
-  // Initialize the reader-writer lock
-  if (pthread_rwlock_init(&entry->rwlock, NULL) != 0) {
-    free(entry->file_path);
-    free(entry);
-    return NULL;
+    // Initialize the release condition variable
+    if (pthread_cond_init(&entry->released, NULL) != 0) {
+      free(entry->file_path);
+      free(entry);
+      return NULL;
+    }
   }
 
-  // Initialize other fields
+  // Copy file path and initialize other fields
+  memcpy(entry->file_path, file_path, len + 1);
+  entry->path_len = len;
+  entry->hash = hash;
+  entry->ranges = NULL;
   entry->ref_count = 0;
-  entry->next = NULL;
 
   // Add to hash table (at head of chain)
-  entry->next = lock_table->table[hash];
-  lock_table->table[hash] = entry;
+  size_t bucket = bucket_for(hash);
+  entry->next = shard->buckets[bucket];
+  shard->buckets[bucket] = entry;
 
   return entry;
 }
@@ -115,34 +181,31 @@ static LockEntry *create_lock_entry(LockTable *lock_table,
 /**
  * @brief Remove a lock entry from the hash table
  *
- * This function assumes the table_mutex is already held by the caller
- * and that the entry's ref_count is 0.
+ * The entry goes back to the shard pool, or is freed when the pool is full.
+ * This function assumes the shard mutex is already held by the caller and
+ * that the entry's ref_count is 0.
  *
- * @param lock_table -> lock table to remove from
- * @param file_path -> file path of entry to remove
+ * @param shard -> shard to remove from
+ * @param entry -> entry to remove
  */
-static void remove_lock_entry(LockTable *lock_table, const char *file_path) {
-  size_t hash = hash_string(file_path);
-  LockEntry *entry = lock_table->table[hash];
-  LockEntry *prev = NULL;
+static void remove_lock_entry(LockShard *shard, LockEntry *entry) {
+  LockEntry **link = &shard->buckets[bucket_for(entry->hash)];
 
-  while (entry) {
-    if (strcmp(entry->file_path, file_path) == 0) {
+  while (*link) {
+    if (*link == entry) {
       // Remove from chain
-      if (prev) {
-        prev->next = entry->next;
+      *link = entry->next;
+
+      if (shard->pool_size < LOCK_POOL_SIZE) {
+        entry->next = shard->pool;
+        shard->pool = entry;
+        shard->pool_size++;
       } else {
-        lock_table->table[hash] = entry->next;
+        free_lock_entry(entry);
       }
-
-      // Cleanup entry
-      pthread_rwlock_destroy(&entry->rwlock);
-      free(entry->file_path);
-      free(entry);
       return;
     }
-    prev = entry;
-    entry = entry->next;
+    link = &(*link)->next;
   }
 }
 
@@ -157,15 +220,25 @@ LockTable *locking_init(void) {
     return NULL;
   }
 
-  // Initialize hash table to all NULL
-  for (int i = 0; i < LOCK_TABLE_SIZE; i++) {
-    lock_table->table[i] = NULL;
-  }
+  for (int i = 0; i < LOCK_TABLE_SHARDS; i++) {
+    LockShard *shard = &lock_table->shards[i];
 
-  // Initialize table mutex
-  if (pthread_mutex_init(&lock_table->table_mutex, NULL) != 0) {
-    free(lock_table);
-    return NULL;
+    // Initialize hash table to all NULL
+    for (int j = 0; j < LOCK_SHARD_SIZE; j++) {
+      shard->buckets[j] = NULL;
+    }
+    shard->pool = NULL;
+    shard->pool_size = 0;
+    shard->free_ranges = NULL;
+
+    // Initialize shard mutex
+    if (pthread_mutex_init(&shard->mutex, NULL) != 0) {
+      while (--i >= 0) {
+        pthread_mutex_destroy(&lock_table->shards[i].mutex);
+      }
+      free(lock_table);
+      return NULL;
+    }
   }
 
   return lock_table;
@@ -181,127 +254,266 @@ void locking_destroy(LockTable *lock_table) {
     return;
   }
 
-  // Lock table mutex to prevent concurrent access during cleanup
-  pthread_mutex_lock(&lock_table->table_mutex);
+  for (int i = 0; i < LOCK_TABLE_SHARDS; i++) {
+    LockShard *shard = &lock_table->shards[i];
+
+    // Lock shard mutex to prevent concurrent access during cleanup
+    pthread_mutex_lock(&shard->mutex);
 
-  // Free all entries in the hash table
-  for (int i = 0; i < LOCK_TABLE_SIZE; i++) {
-    LockEntry *entry = lock_table->table[i];
+    // Free all entries in the hash chains and in the pool
+    for (int j = 0; j < LOCK_SHARD_SIZE; j++) {
+      LockEntry *entry = shard->buckets[j];
+      while (entry) {
+        LockEntry *next = entry->next;
+        free_lock_entry(entry);
+        entry = next;
+      }
+    }
+    LockEntry *entry = shard->pool;
     while (entry) {
       LockEntry *next = entry->next;
-
-      // Destroy the rwlock and free memory
-      pthread_rwlock_destroy(&entry->rwlock);
-      free(entry->file_path);
-      free(entry);
-
+      free_lock_entry(entry);
       entry = next;
     }
-  }
+    LockRange *range = shard->free_ranges;
+    while (range) {
+      LockRange *next = range->next;
+      free(range);
+      range = next;
+    }
 
-  pthread_mutex_unlock(&lock_table->table_mutex);
+    pthread_mutex_unlock(&shard->mutex);
 
-  // Destroy table mutex
-  pthread_mutex_destroy(&lock_table->table_mutex);
+    // Destroy shard mutex
+    pthread_mutex_destroy(&shard->mutex);
+  }
 
   // Free the table itself
   free(lock_table);
 }
 
 /**
- * @brief Acquire a read lock for the specified file path
+ * @brief Convert an offset and length to a [start, end) range
  *
- * Multiple threads can hold read locks simultaneously for the same path.
- * Read locks will block if a write lock is currently held.
+ * @return int -> 0 on success, -1 for a negative offset
+ */
+static int range_bounds(off_t offset, size_t len, off_t *start, off_t *end) {
+  if (offset < 0) {
+    return -1;
+  }
+  *start = offset;
+  if (len == 0 || len > (size_t)(LOCK_RANGE_END - offset)) {
+    *end = LOCK_RANGE_END;
+  } else {
+    *end = offset + (off_t)len;
+  }
+  return 0;
+}
+
+/**
+ * @brief Check whether a held range prevents locking [start, end)
+ *
+ * Like pthread_rwlock_t, a thread that holds an overlapping write range gets
+ * an error instead of deadlocking on itself.
+ *
+ * This function assumes the shard mutex is already held by the caller.
+ *
+ * @return int -> 0 if free, 1 if the caller must wait, -1 if the conflict is
+ * a write range of the calling thread
+ */
+static int range_conflicts(const LockEntry *entry, off_t start, off_t end,
+                           int write) {
+  int conflict = 0;
+  for (const LockRange *range = entry->ranges; range; range = range->next) {
+    if (range->start < end && start < range->end && (write || range->write)) {
+      if (range->write && pthread_equal(range->owner, pthread_self())) {
+        return -1;
+      }
+      conflict = 1;
+    }
+  }
+  return conflict;
+}
+
+/**
+ * @brief Hash a file path for the _key variants of the lock functions
+ *
+ * @param key -> receives the key
+ * @param file_path -> file path, referenced by the key
+ */
+void locking_key_init(LockKey *key, const char *file_path) {
+  key->file_path = file_path;
+  key->path_len = file_path ? strlen(file_path) : 0;
+  key->hash = file_path ? hash_string(file_path, key->path_len) : 0;
+}
+
+/**
+ * @brief Take a reference on the entry of a path and lock one of its ranges
  *
  * @param lock_table -> lock table to use
- * @param file_path -> file path to lock
+ * @param key -> file path to lock, with its hash
+ * @param start -> first byte of the range
+ * @param end -> first byte after the range
+ * @param write -> 1 for a write lock, 0 for a read lock
  * @return int -> 0 on success, -1 on failure
  */
-int locking_acquire_read(LockTable *lock_table, const char *file_path) {
-  if (!lock_table || !file_path) {
+static int acquire_lock(LockTable *lock_table, const LockKey *key, off_t start,
+                        off_t end, int write) {
+  if (!lock_table || !key || !key->file_path) {
     return -1;
   }
 
-  pthread_mutex_lock(&lock_table->table_mutex);
+  const char *file_path = key->file_path;
+  const size_t len = key->path_len;
+  const size_t hash = key->hash;
+  LockShard *shard = shard_for(lock_table, hash);
+
+  pthread_mutex_lock(&shard->mutex);
 
   // Find or create lock entry
-  LockEntry *entry = find_lock_entry(lock_table, file_path);
+  LockEntry *entry = find_lock_entry(shard, file_path, len, hash);
   if (!entry) {
-    entry = create_lock_entry(lock_table, file_path);
+    entry = create_lock_entry(shard, file_path, len, hash);
     if (!entry) {
-      pthread_mutex_unlock(&lock_table->table_mutex);
+      pthread_mutex_unlock(&shard->mutex);
       return -1;
     }
   }
 
-  // Increment reference count
+  // Increment reference count: the entry stays in the table while we wait
   entry->ref_count++;
 
-  pthread_mutex_unlock(&lock_table->table_mutex);
+  LockRange *range = shard->free_ranges;
+  if (range) {
+    shard->free_ranges = range->next;
+  } else {
+    range = malloc(sizeof(LockRange));
+  }
+
+  int conflict;
+  while (range && (conflict = range_conflicts(entry, start, end, write)) != 0) {
+    if (conflict < 0 ||
+        pthread_cond_wait(&entry->released, &shard->mutex) != 0) {
+      range->next = shard->free_ranges;
+      shard->free_ranges = range;
+      range = NULL;
+    }
+  }
 
-  // Acquire read lock
-  if (pthread_rwlock_rdlock(&entry->rwlock) != 0) {
+  if (!range) {
     // If lock acquisition fails, decrement ref count
-    pthread_mutex_lock(&lock_table->table_mutex);
     entry->ref_count--;
     if (entry->ref_count == 0) {
-      remove_lock_entry(lock_table, file_path);
+      remove_lock_entry(shard, entry);
     }
-    pthread_mutex_unlock(&lock_table->table_mutex);
+    pthread_mutex_unlock(&shard->mutex);
     return -1;
   }
 
+  range->start = start;
+  range->end = end;
+  range->write = write;
+  range->owner = pthread_self();
+  range->next = entry->ranges;
+  entry->ranges = range;
+
+  pthread_mutex_unlock(&shard->mutex);
+
   return 0;
 }
 
 /**
- * @brief Acquire a write lock for the specified file path
- *
- * Write locks are exclusive - only one thread can hold a write lock
- * for a path, and it will block all other read and write attempts.
+ * @brief Release one range of a path and drop its reference on the entry
  *
  * @param lock_table -> lock table to use
- * @param file_path -> file path to lock
+ * @param key -> file path to unlock, with its hash
+ * @param start -> first byte of the range
+ * @param end -> first byte after the range
  * @return int -> 0 on success, -1 on failure
  */
-int locking_acquire_write(LockTable *lock_table, const char *file_path) {
-  if (!lock_table || !file_path) {
+static int release_lock(LockTable *lock_table, const LockKey *key, off_t start,
+                        off_t end) {
+  if (!lock_table || !key || !key->file_path) {
     return -1;
   }
 
-  pthread_mutex_lock(&lock_table->table_mutex);
+  const char *file_path = key->file_path;
+  const size_t len = key->path_len;
+  const size_t hash = key->hash;
+  LockShard *shard = shard_for(lock_table, hash);
 
-  // Find or create lock entry
-  LockEntry *entry = find_lock_entry(lock_table, file_path);
+  pthread_mutex_lock(&shard->mutex);
+
+  // Find the lock entry
+  LockEntry *entry = find_lock_entry(shard, file_path, len, hash);
   if (!entry) {
-    entry = create_lock_entry(lock_table, file_path);
-    if (!entry) {
-      pthread_mutex_unlock(&lock_table->table_mutex);
-      return -1;
-    }
+    pthread_mutex_unlock(&shard->mutex);
+    return -1; // Entry not found
   }
 
-  // Increment reference count
-  entry->ref_count++;
+  // Find the range (overlapping ranges held at once are all read ranges, so
+  // any matching one will do)
+  LockRange **link = &entry->ranges;
+  while (*link && ((*link)->start != start || (*link)->end != end)) {
+    link = &(*link)->next;
+  }
+  LockRange *range = *link;
+  if (!range) {
+    pthread_mutex_unlock(&shard->mutex);
+    return -1; // Range not held
+  }
+  *link = range->next;
+  range->next = shard->free_ranges;
+  shard->free_ranges = range;
 
-  pthread_mutex_unlock(&lock_table->table_mutex);
+  // Decrement reference count and potentially remove entry
+  entry->ref_count--;
 
-  // Acquire write lock
-  if (pthread_rwlock_wrlock(&entry->rwlock) != 0) {
-    // If lock acquisition fails, decrement ref count
-    pthread_mutex_lock(&lock_table->table_mutex);
-    entry->ref_count--;
-    if (entry->ref_count == 0) {
-      remove_lock_entry(lock_table, file_path);
-    }
-    pthread_mutex_unlock(&lock_table->table_mutex);
-    return -1;
+  if (entry->ref_count == 0) {
+    // If no more references, return the entry to the pool
+    remove_lock_entry(shard, entry);
+  } else {
+    // Wake the waiters: some may no longer conflict
+    pthread_cond_broadcast(&entry->released);
   }
 
+  pthread_mutex_unlock(&shard->mutex);
+
   return 0;
 }
 
+/**
+ * @brief Acquire a read lock for the specified file path
+ *
+ * Multiple threads can hold read locks simultaneously for the same path.
+ * Read locks will block if a write lock is currently held.
+ *
+ * @param lock_table -> lock table to use
+ * @param file_path -> file path to lock
+ * @return int -> 0 on success, -1 on failure
+ */
+int locking_acquire_read(LockTable *lock_table, const char *file_path) {
+  LockKey key;
+  locking_key_init(&key, file_path);
+  return locking_acquire_read_key(lock_table, &key);
+}
+
+/**
+ * @brief Acquire a write lock for the specified file path
+ *
+ * Write locks are exclusive - only one thread can hold a write lock
+ * for a path, and it will block all other read and write attempts.
+ *
+ * @param lock_table -> lock table to use
+ * @param file_path -> file path to lock
+ * @return int -> 0 on success, -1 on failure
+ */
+int locking_acquire_write(LockTable *lock_table, const char *file_path) {
+  LockKey key;
+  locking_key_init(&key, file_path);
+  return locking_acquire_write_key(lock_table, &key);
+}
+
 /**
  * @brief Release a lock for the specified file path
  *
@@ -313,36 +525,100 @@ int locking_acquire_write(LockTable *lock_table, const char *file_path) {
  * @return int -> 0 on success, -1 on failure
  */
 int locking_release(LockTable *lock_table, const char *file_path) {
-  if (!lock_table || !file_path) {
-    return -1;
-  }
+  LockKey key;
+  locking_key_init(&key, file_path);
+  return locking_release_key(lock_table, &key);
+}
 
-  pthread_mutex_lock(&lock_table->table_mutex);
+/**
+ * @brief Acquire a read lock on a byte range of the specified file path
+ *
+ * Blocks while a write lock overlapping the range is held, including a
+ * whole-file write lock.
+ *
+ * @param lock_table -> lock table to use
+ * @param file_path -> file path to lock
+ * @param offset -> first byte of the range
+ * @param len -> length of the range, 0 for up to the end of the file
+ * @return int -> 0 on success, -1 on failure
+ */
+int locking_acquire_range_read(LockTable *lock_table, const char *file_path,
+                               off_t offset, size_t len) {
+  LockKey key;
+  locking_key_init(&key, file_path);
+  return locking_acquire_range_read_key(lock_table, &key, offset, len);
+}
 
-  // Find the lock entry
-  LockEntry *entry = find_lock_entry(lock_table, file_path);
-  if (!entry) {
-    pthread_mutex_unlock(&lock_table->table_mutex);
-    return -1; // Entry not found
-  }
+/**
+ * @brief Acquire a write lock on a byte range of the specified file path
+ *
+ * Blocks while any lock overlapping the range is held, including any
+ * whole-file lock.
+ *
+ * @param lock_table -> lock table to use
+ * @param file_path -> file path to lock
+ * @param offset -> first byte of the range
+ * @param len -> length of the range, 0 for up to the end of the file
+ * @return int -> 0 on success, -1 on failure
+ */
+int locking_acquire_range_write(LockTable *lock_table, const char *file_path,
+                                off_t offset, size_t len) {
+  LockKey key;
+  locking_key_init(&key, file_path);
+  return locking_acquire_range_write_key(lock_table, &key, offset, len);
+}
 
-  pthread_mutex_unlock(&lock_table->table_mutex);
+/**
+ * @brief Release a range lock, with the offset and len it was acquired with
+ *
+ * @param lock_table -> lock table to use
+ * @param file_path -> file path to unlock
+ * @param offset -> first byte of the range
+ * @param len -> length of the range, 0 for up to the end of the file
+ * @return int -> 0 on success, -1 if no such range is held
+ */
+int locking_release_range(LockTable *lock_table, const char *file_path,
+                          off_t offset, size_t len) {
+  LockKey key;
+  locking_key_init(&key, file_path);
+  return locking_release_range_key(lock_table, &key, offset, len);
+}
 
-  // Release the rwlock (works for both read and write locks)
-  if (pthread_rwlock_unlock(&entry->rwlock) != 0) {
-    return -1;
-  }
+int locking_acquire_read_key(LockTable *lock_table, const LockKey *key) {
+  return acquire_lock(lock_table, key, 0, LOCK_RANGE_END, 0);
+}
 
-  // Decrement reference count and potentially remove entry
-  pthread_mutex_lock(&lock_table->table_mutex);
-  entry->ref_count--;
+int locking_acquire_write_key(LockTable *lock_table, const LockKey *key) {
+  return acquire_lock(lock_table, key, 0, LOCK_RANGE_END, 1);
+}
 
-  // If no more references, remove the entry to save memory
-  if (entry->ref_count == 0) {
-    remove_lock_entry(lock_table, file_path);
+int locking_release_key(LockTable *lock_table, const LockKey *key) {
+  return release_lock(lock_table, key, 0, LOCK_RANGE_END);
+}
+
+int locking_acquire_range_read_key(LockTable *lock_table, const LockKey *key,
+                                   off_t offset, size_t len) {
+  off_t start, end;
+  if (range_bounds(offset, len, &start, &end) != 0) {
+    return -1;
   }
+  return acquire_lock(lock_table, key, start, end, 0);
+}
 
-  pthread_mutex_unlock(&lock_table->table_mutex);
+int locking_acquire_range_write_key(LockTable *lock_table, const LockKey *key,
+                                    off_t offset, size_t len) {
+  off_t start, end;
+  if (range_bounds(offset, len, &start, &end) != 0) {
+    return -1;
+  }
+  return acquire_lock(lock_table, key, start, end, 1);
+}
 
-  return 0;
+int locking_release_range_key(LockTable *lock_table, const LockKey *key,
+                              off_t offset, size_t len) {
+  off_t start, end;
+  if (range_bounds(offset, len, &start, &end) != 0) {
+    return -1;
+  }
+  return release_lock(lock_table, key, start, end);
 }
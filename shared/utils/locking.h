@@ -3,6 +3,7 @@
 
 #include <pthread.h>
 #include <stddef.h>
+#include <sys/types.h>
 
 /*
  * ============================================================================
@@ -14,10 +15,10 @@
  * locking system without relying on file descriptor-based locking mechanisms.
  *
  * KEY FEATURES:
- * - Reader-writer locks using pthread_rwlock_t
+ * - Reader-writer locks on a whole file or on a byte range of it
  * - File path-based resource identification
  * - Hash table for efficient lock lookup
- * - Thread-safe lock table management
+ * - Thread-safe lock table management, sharded to avoid a global mutex
  * - Independent locking system per layer instance
  *
  * USAGE:
@@ -25,9 +26,19 @@
  * 2. Acquire read lock: locking_acquire_read(path)
  * 3. Acquire write lock: locking_acquire_write(path)
  * 4. Release lock: locking_release(path)
- * 5. Cleanup: locking_destroy()
+ * 5. Byte ranges: locking_acquire_range_{read,write}(path, off, len) and
+ *    locking_release_range(path, off, len)
+ * 6. Cleanup: locking_destroy()
  *
- * LOCK COMPATIBILITY (pthread_rwlock_t):
+ * Callers that lock the same path many times (e.g. once per read of an open
+ * file) can hash it once with locking_key_init() and use the _key variants,
+ * which skip the strlen and the hash of the path on every call.
+ *
+ * A whole-file lock is the range [0, end of file): it conflicts with every
+ * range lock of the path, while range locks on disjoint ranges never
+ * conflict, so writers of different blocks of a file run concurrently.
+ *
+ * LOCK COMPATIBILITY (overlapping ranges):
  * ┌─────────────────┬─────────────┬─────────────────┐
  * │ Held Lock \     │ READ LOCK   │ WRITE LOCK      │
  * │ Requested Lock  │             │                 │
@@ -41,23 +52,71 @@
  */
 
 #define LOCK_TABLE_SIZE 16384 // Hash table size (should be power of 2)
+#define LOCK_TABLE_SHARDS 64  // Independently locked shards (power of 2)
+#define LOCK_POOL_SIZE 32     // Unused entries kept per shard for reuse
+
+// Buckets per shard
+#define LOCK_SHARD_SIZE (LOCK_TABLE_SIZE / LOCK_TABLE_SHARDS)
+
+// Largest off_t: end of the range of whole-file locks and of len 0 ranges
+#define LOCK_RANGE_END                                                         \
+  ((off_t)(((unsigned long long)1 << (sizeof(off_t) * 8 - 1)) - 1))
+
+/**
+ * @brief A byte range held by one lock owner, [start, end)
+ */
+typedef struct LockRange {
+  off_t start;            // First byte of the range
+  off_t end;              // First byte after the range
+  int write;              // Write (exclusive) or read (shared) range
+  pthread_t owner;        // Thread that acquired the range
+  struct LockRange *next; // Next range of the entry or in the free list
+} LockRange;
 
 /**
  * @brief Lock entry for a specific file path
  */
 typedef struct LockEntry {
   char *file_path;         // File path (key)
-  pthread_rwlock_t rwlock; // Reader-writer lock
-  int ref_count;           // Reference count for cleanup
-  struct LockEntry *next;  // Next entry in hash chain
+  size_t path_len;         // Length of file_path
+  size_t path_capacity;    // Allocated size of file_path, kept when pooled
+  size_t hash;             // Full hash of file_path, compared before the path
+  LockRange *ranges;       // Held ranges
+  pthread_cond_t released; // Broadcast when a range is released
+  int ref_count;           // Holders and waiters, for cleanup
+  struct LockEntry *next;  // Next entry in hash chain or in the pool
 } LockEntry;
 
+/**
+ * @brief One shard of the lock table: a slice of the buckets and its mutex
+ */
+typedef struct {
+  pthread_mutex_t mutex;               // Protects the shard and its entries
+  LockEntry *buckets[LOCK_SHARD_SIZE]; // Hash chains of this shard
+  LockEntry *pool;                     // Unused entries, cond initialized
+  size_t pool_size;                    // Number of entries in pool
+  LockRange *free_ranges;              // Unused range records
+} LockShard;
+
+/**
+ * @brief A file path with its length and hash, computed once
+ *
+ * The key points to the path: it must outlive the key.
+ */
+typedef struct {
+  const char *file_path; // File path to lock
+  size_t path_len;       // Length of file_path
+  size_t hash;           // Hash of file_path in the lock table
+} LockKey;
+
 /**
  * @brief Lock table structure for managing file path locks
+ *
+ * Paths are spread over LOCK_TABLE_SHARDS shards by hash, so threads working
+ * on different paths rarely contend for the same shard mutex.
  */
 typedef struct {
-  LockEntry *table[LOCK_TABLE_SIZE]; // Hash table of lock entries
-  pthread_mutex_t table_mutex;       // Mutex for table modifications
+  LockShard shards[LOCK_TABLE_SHARDS]; // Shards of the hash table
 } LockTable;
 
 /**
@@ -74,6 +133,14 @@ LockTable *locking_init(void);
  */
 void locking_destroy(LockTable *lock_table);
 
+/**
+ * @brief Hash a file path for the _key variants of the lock functions
+ *
+ * @param key -> receives the key
+ * @param file_path -> file path, referenced by the key
+ */
+void locking_key_init(LockKey *key, const char *file_path);
+
 /**
  * @brief Acquire a read lock for the specified file path
  *
@@ -110,4 +177,79 @@ int locking_acquire_write(LockTable *lock_table, const char *file_path);
  */
 int locking_release(LockTable *lock_table, const char *file_path);
 
+/**
+ * @brief Acquire a read lock on a byte range of the specified file path
+ *
+ * Blocks while a write lock overlapping the range is held, including a
+ * whole-file write lock.
+ *
+ * @param lock_table -> lock table to use
+ * @param file_path -> file path to lock
+ * @param offset -> first byte of the range
+ * @param len -> length of the range, 0 for up to the end of the file
+ * @return int -> 0 on success, -1 on failure
+ */
+int locking_acquire_range_read(LockTable *lock_table, const char *file_path,
+                               off_t offset, size_t len);
+
+/**
+ * @brief Acquire a write lock on a byte range of the specified file path
+ *
+ * Blocks while any lock overlapping the range is held, including any
+ * whole-file lock.
+ *
+ * @param lock_table -> lock table to use
+ * @param file_path -> file path to lock
+ * @param offset -> first byte of the range
+ * @param len -> length of the range, 0 for up to the end of the file
+ * @return int -> 0 on success, -1 on failure
+ */
+int locking_acquire_range_write(LockTable *lock_table, const char *file_path,
+                                off_t offset, size_t len);
+
+/**
+ * @brief Release a range lock, with the offset and len it was acquired with
+ *
+ * @param lock_table -> lock table to use
+ * @param file_path -> file path to unlock
+ * @param offset -> first byte of the range
+ * @param len -> length of the range, 0 for up to the end of the file
+ * @return int -> 0 on success, -1 if no such range is held
+ */
+int locking_release_range(LockTable *lock_table, const char *file_path,
+                          off_t offset, size_t len);
+
+/**
+ * @brief locking_acquire_read() on a path hashed by locking_key_init()
+ */
+int locking_acquire_read_key(LockTable *lock_table, const LockKey *key);
+
+/**
+ * @brief locking_acquire_write() on a path hashed by locking_key_init()
+ */
+int locking_acquire_write_key(LockTable *lock_table, const LockKey *key);
+
+/**
+ * @brief locking_release() on a path hashed by locking_key_init()
+ */
+int locking_release_key(LockTable *lock_table, const LockKey *key);
+
+/**
+ * @brief locking_acquire_range_read() on a path hashed by locking_key_init()
+ */
+int locking_acquire_range_read_key(LockTable *lock_table, const LockKey *key,
+                                   off_t offset, size_t len);
+
+/**
+ * @brief locking_acquire_range_write() on a path hashed by locking_key_init()
+ */
+int locking_acquire_range_write_key(LockTable *lock_table, const LockKey *key,
+                                    off_t offset, size_t len);
+
+/**
+ * @brief locking_release_range() on a path hashed by locking_key_init()
+ */
+int locking_release_range_key(LockTable *lock_table, const LockKey *key,
+                              off_t offset, size_t len);
+
 #endif // LOCKING_H
@@ -0,0 +1,289 @@
+#include "memory_budget.h"
+#include "../../logdef.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+  MemoryAccount *account; // account the cache charges
+  memory_shrink_fn shrink;
+  void *arg;
+} Shrinker;
+
+// Guards the limit, the accounts and their counters
+static pthread_mutex_t budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t budget_room = PTHREAD_COND_INITIALIZER;
+static size_t budget_limit = 0;   // 0: no process limit
+static size_t budget_charged = 0; // sum of the accounts charged
+static MemoryAccount accounts[MEMORY_BUDGET_MAX_ACCOUNTS];
+static int n_accounts = 0;
+
+// Held for reading while the shrinkers run, for writing to change them
+static pthread_rwlock_t shrinkers_lock = PTHREAD_RWLOCK_INITIALIZER;
+static Shrinker shrinkers[MEMORY_BUDGET_MAX_SHRINKERS];
+static int n_shrinkers = 0;
+
+/**
+ * @brief Account of a name, created if needed (budget_mutex held)
+ */
+static MemoryAccount *find_account(const char *name) {
+  if (strlen(name) >= MEMORY_BUDGET_NAME_SIZE) {
+    return NULL;
+  }
+  for (int i = 0; i < n_accounts; i++) {
+    if (strcmp(accounts[i].name, name) == 0) {
+      return &accounts[i];
+    }
+  }
+  if (n_accounts == MEMORY_BUDGET_MAX_ACCOUNTS) {
+    return NULL;
+  }
+  MemoryAccount *account = &accounts[n_accounts++];
+  memset(account, 0, sizeof(*account));
+  strcpy(account->name, name);
+  return account;
+}
+
+/**
+ * @brief Bytes a charge is missing (budget_mutex held)
+ *
+ * @param own_only -> set if only the account itself is over: its budget
+ * @return size_t  -> 0 if the charge fits
+ */
+static size_t missing_bytes(const MemoryAccount *account, size_t bytes,
+                            int *own_only) {
+  size_t over_budget = 0;
+  size_t over_limit = 0;
+  const size_t budget = account->stats.budget;
+  if (budget > 0 && account->stats.charged + bytes > budget) {
+    over_budget = account->stats.charged + bytes - budget;
+  }
+  if (budget_limit > 0 && budget_charged + bytes > budget_limit) {
+    over_limit = budget_charged + bytes - budget_limit;
+  }
+  *own_only = over_limit == 0;
+  return over_budget > over_limit ? over_budget : over_limit;
+}
+
+static void charge_locked(MemoryAccount *account, size_t bytes) {
+  account->stats.charged += bytes;
+  budget_charged += bytes;
+  if (account->stats.charged > account->stats.peak) {
+    account->stats.peak = account->stats.charged;
+  }
+}
+
+/**
+ * @brief Run the shrinkers for a charge, its own account first (budget_mutex
+ * not held)
+ *
+ * @return size_t -> bytes released
+ */
+static size_t reclaim(MemoryAccount *account, size_t missing, int own_only) {
+  size_t released = 0;
+  size_t by_account[MEMORY_BUDGET_MAX_SHRINKERS] = {0};
+  MemoryAccount *owners[MEMORY_BUDGET_MAX_SHRINKERS];
+  int n = 0;
+
+  pthread_rwlock_rdlock(&shrinkers_lock);
+  for (int pass = 0; pass < 2 && released < missing; pass++) {
+    for (int i = 0; i < n_shrinkers && released < missing; i++) {
+      const Shrinker *shrinker = &shrinkers[i];
+      int own = shrinker->account == account;
+      if (pass == 0 ? !own : own || own_only) {
+        continue;
+      }
+      size_t got = shrinker->shrink(shrinker->arg, missing - released);
+      released += got;
+      owners[n] = shrinker->account;
+      by_account[n++] = got;
+    }
+  }
+  pthread_rwlock_unlock(&shrinkers_lock);
+
+  if (released > 0) {
+    pthread_mutex_lock(&budget_mutex);
+    for (int i = 0; i < n; i++) {
+      owners[i]->stats.reclaimed += by_account[i];
+    }
+    pthread_mutex_unlock(&budget_mutex);
+  }
+  return released;
+}
+
+void memory_budget_configure(size_t limit) {
+  pthread_mutex_lock(&budget_mutex);
+  budget_limit = limit;
+  pthread_cond_broadcast(&budget_room);
+  pthread_mutex_unlock(&budget_mutex);
+}
+
+int memory_budget_set(const char *name, size_t budget) {
+  if (!name) {
+    return -1;
+  }
+  pthread_mutex_lock(&budget_mutex);
+  MemoryAccount *account = find_account(name);
+  if (account) {
+    account->stats.budget = budget;
+    pthread_cond_broadcast(&budget_room);
+  }
+  pthread_mutex_unlock(&budget_mutex);
+  return account ? 0 : -1;
+}
+
+MemoryAccount *memory_budget_account(const char *name) {
+  if (!name) {
+    return NULL;
+  }
+  pthread_mutex_lock(&budget_mutex);
+  MemoryAccount *account = find_account(name);
+  pthread_mutex_unlock(&budget_mutex);
+  if (!account) {
+    WARN_MSG("[MEMORY_BUDGET] No account for %s, its memory is not counted",
+             name);
+  }
+  return account;
+}
+
+int memory_budget_try_charge(MemoryAccount *account, size_t bytes) {
+  if (!account || bytes == 0) {
+    return 0;
+  }
+  int own_only;
+  pthread_mutex_lock(&budget_mutex);
+  size_t missing = missing_bytes(account, bytes, &own_only);
+  if (missing > 0) {
+    pthread_mutex_unlock(&budget_mutex);
+    reclaim(account, missing, own_only);
+    pthread_mutex_lock(&budget_mutex);
+    if (missing_bytes(account, bytes, &own_only) > 0) {
+      account->stats.denied++;
+      pthread_mutex_unlock(&budget_mutex);
+      return -1;
+    }
+  }
+  charge_locked(account, bytes);
+  pthread_mutex_unlock(&budget_mutex);
+  return 0;
+}
+
+void memory_budget_charge(MemoryAccount *account, size_t bytes) {
+  if (!account || bytes == 0) {
+    return;
+  }
+  int own_only;
+  int waited = 0;
+  pthread_mutex_lock(&budget_mutex);
+  size_t missing;
+  while ((missing = missing_bytes(account, bytes, &own_only)) > 0 &&
+         account->stats.charged > 0) {
+    pthread_mutex_unlock(&budget_mutex);
+    size_t released = reclaim(account, missing, own_only);
+    pthread_mutex_lock(&budget_mutex);
+    if (released > 0 || missing_bytes(account, bytes, &own_only) == 0 ||
+        account->stats.charged == 0) {
+      continue;
+    }
+    if (!waited) {
+      account->stats.waits++;
+      waited = 1;
+    }
+    // released memory wakes the charge, the timeout retries the shrinkers
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)MEMORY_BUDGET_WAIT_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&budget_room, &budget_mutex, &deadline);
+  }
+  charge_locked(account, bytes);
+  pthread_mutex_unlock(&budget_mutex);
+}
+
+void memory_budget_release(MemoryAccount *account, size_t bytes) {
+  if (!account || bytes == 0) {
+    return;
+  }
+  pthread_mutex_lock(&budget_mutex);
+  if (bytes > account->stats.charged) {
+    bytes = account->stats.charged;
+  }
+  account->stats.charged -= bytes;
+  budget_charged -= bytes;
+  pthread_cond_broadcast(&budget_room);
+  pthread_mutex_unlock(&budget_mutex);
+}
+
+int memory_budget_add_shrinker(MemoryAccount *account, memory_shrink_fn shrink,
+                               void *arg) {
+  if (!account || !shrink) {
+    return 0;
+  }
+  int res = -1;
+  pthread_rwlock_wrlock(&shrinkers_lock);
+  if (n_shrinkers < MEMORY_BUDGET_MAX_SHRINKERS) {
+    shrinkers[n_shrinkers].account = account;
+    shrinkers[n_shrinkers].shrink = shrink;
+    shrinkers[n_shrinkers].arg = arg;
+    n_shrinkers++;
+    res = 0;
+  }
+  pthread_rwlock_unlock(&shrinkers_lock);
+  if (res != 0) {
+    WARN_MSG("[MEMORY_BUDGET] Too many shrinkers, a cache of %s will not "
+             "shrink",
+             account->name);
+  }
+  return res;
+}
+
+void memory_budget_remove_shrinker(memory_shrink_fn shrink, void *arg) {
+  pthread_rwlock_wrlock(&shrinkers_lock);
+  for (int i = 0; i < n_shrinkers; i++) {
+    if (shrinkers[i].shrink == shrink && shrinkers[i].arg == arg) {
+      shrinkers[i] = shrinkers[--n_shrinkers];
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&shrinkers_lock);
+}
+
+size_t memory_budget_headroom(MemoryAccount *account) {
+  if (!account) {
+    return SIZE_MAX;
+  }
+  size_t headroom = SIZE_MAX;
+  pthread_mutex_lock(&budget_mutex);
+  const size_t budget = account->stats.budget;
+  if (budget > 0) {
+    headroom = budget > account->stats.charged
+                   ? budget - account->stats.charged
+                   : 0;
+  }
+  if (budget_limit > 0) {
+    size_t left =
+        budget_limit > budget_charged ? budget_limit - budget_charged : 0;
+    headroom = left < headroom ? left : headroom;
+  }
+  pthread_mutex_unlock(&budget_mutex);
+  return headroom;
+}
+
+void memory_budget_get_stats(MemoryAccount *account, MemoryBudgetStats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (!account) {
+    return;
+  }
+  pthread_mutex_lock(&budget_mutex);
+  *stats = account->stats;
+  pthread_mutex_unlock(&budget_mutex);
+}
+
+size_t memory_budget_charged(void) {
+  pthread_mutex_lock(&budget_mutex);
+  size_t charged = budget_charged;
+  pthread_mutex_unlock(&budget_mutex);
+  return charged;
+}
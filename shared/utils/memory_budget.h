@@ -0,0 +1,156 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <stddef.h>
+
+/*
+ * ============================================================================
+ * MEMORY BUDGET - PROCESS-WIDE ACCOUNTING OF THE CACHES AND QUEUES
+ * ============================================================================
+ *
+ * The layers size their caches and queues independently, so a load spike
+ * can grow all of them at once. The memory budget keeps one account per
+ * consumer (a cache or queue kind, shared by its layers) and checks every
+ * allocation they charge against the account budget and the process limit,
+ * both configured by the `memory_limit_mb` and `memory_budgets` keys.
+ *
+ * - Caches charge with memory_budget_try_charge and do without the entry
+ *   when it fails: they reuse one of theirs, or don't cache.
+ * - Queues charge with memory_budget_charge, which blocks the producer until
+ *   the consumer released enough: the writers slow down to the pace of the
+ *   queue instead of growing it.
+ * - Before failing or blocking, a charge asks the shrinkers of the caches to
+ *   give memory back, least recently used first: its own account when it is
+ *   over its budget, every account (its own first) when the process is over
+ *   its limit. Shrinkers run without the budget lock held, and must not
+ *   block on a lock their charges may be made under (try it).
+ * - An account with nothing charged is never refused a blocking charge, so a
+ *   queue always makes progress, one entry at a time.
+ *
+ * Without a limit nor budgets, charges only count: every charge succeeds.
+ * ============================================================================
+ */
+
+#define MEMORY_BUDGET_MAX_ACCOUNTS 16  // accounts of the process at most
+#define MEMORY_BUDGET_MAX_SHRINKERS 64 // shrinkers of the process at most
+#define MEMORY_BUDGET_NAME_SIZE 32     // account names, terminator included
+#define MEMORY_BUDGET_WAIT_MS 100      // blocked charges retry the shrinkers
+
+/**
+ * @brief Shrinker of a cache: release up to bytes of its entries
+ *
+ * @param arg    -> argument given to memory_budget_add_shrinker
+ * @param bytes  -> bytes the charge is missing
+ * @return size_t -> bytes released (memory_budget_release called for them)
+ */
+typedef size_t (*memory_shrink_fn)(void *arg, size_t bytes);
+
+typedef struct {
+  size_t budget;    // bytes the account may charge, 0: only the limit
+  size_t charged;   // bytes charged now
+  size_t peak;      // highest charged seen
+  size_t denied;    // try charges refused
+  size_t waits;     // blocking charges that had to wait
+  size_t reclaimed; // bytes its shrinkers released
+} MemoryBudgetStats;
+
+typedef struct MemoryAccount {
+  char name[MEMORY_BUDGET_NAME_SIZE]; // consumer, e.g. "read_cache"
+  MemoryBudgetStats stats;            // budget and counters
+} MemoryAccount;
+
+/**
+ * @brief Set the bytes all the accounts together may charge
+ *
+ * @param limit -> process limit, 0 for none
+ */
+void memory_budget_configure(size_t limit);
+
+/**
+ * @brief Set the budget of an account, creating it if needed
+ *
+ * @param name   -> account name
+ * @param budget -> bytes it may charge, 0 for only the process limit
+ * @return int   -> 0 on success, -1 if the name is too long or the accounts
+ * are all taken
+ */
+int memory_budget_set(const char *name, size_t budget);
+
+/**
+ * @brief Account of a consumer, created on its first use
+ *
+ * Accounts live as long as the process.
+ *
+ * @param name -> account name
+ * @return MemoryAccount* -> account, NULL if it can't be created (the
+ * functions below then charge nothing and never refuse)
+ */
+MemoryAccount *memory_budget_account(const char *name);
+
+/**
+ * @brief Charge bytes if the budget and the limit have room for them
+ *
+ * @param account -> account to charge (NULL: always succeeds)
+ * @param bytes   -> bytes about to be allocated
+ * @return int    -> 0 if charged, -1 if not even the shrinkers made room
+ */
+int memory_budget_try_charge(MemoryAccount *account, size_t bytes);
+
+/**
+ * @brief Charge bytes, waiting for room if there is none
+ *
+ * @param account -> account to charge (NULL: returns at once)
+ * @param bytes   -> bytes about to be allocated
+ */
+void memory_budget_charge(MemoryAccount *account, size_t bytes);
+
+/**
+ * @brief Give back bytes charged before, waking the blocked charges
+ *
+ * @param account -> account charged (NULL: nothing to do)
+ * @param bytes   -> bytes freed
+ */
+void memory_budget_release(MemoryAccount *account, size_t bytes);
+
+/**
+ * @brief Let the charges of the process shrink a cache of an account
+ *
+ * @param account -> account the cache charges (NULL: nothing to do)
+ * @param shrink  -> shrinker of the cache
+ * @param arg     -> argument passed to shrink
+ * @return int    -> 0 on success, -1 if the shrinkers are all taken
+ */
+int memory_budget_add_shrinker(MemoryAccount *account, memory_shrink_fn shrink,
+                               void *arg);
+
+/**
+ * @brief Remove a shrinker, once no charge is running it
+ *
+ * @param shrink -> shrinker given to memory_budget_add_shrinker
+ * @param arg    -> its argument
+ */
+void memory_budget_remove_shrinker(memory_shrink_fn shrink, void *arg);
+
+/**
+ * @brief Bytes an account could charge now, before any shrinking
+ *
+ * @param account -> account (NULL: no bound)
+ * @return size_t -> room left in its budget and the limit, SIZE_MAX without
+ * either
+ */
+size_t memory_budget_headroom(MemoryAccount *account);
+
+/**
+ * @brief Copy the budget and counters of an account
+ *
+ * @param account -> account (NULL: all zero)
+ * @param stats   -> filled with them
+ */
+void memory_budget_get_stats(MemoryAccount *account, MemoryBudgetStats *stats);
+
+/**
+ * @brief Bytes charged by all the accounts together
+ */
+size_t memory_budget_charged(void);
+
+#endif // MEMORY_BUDGET_H
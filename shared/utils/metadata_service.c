@@ -0,0 +1,359 @@
+#include "metadata_service.h"
+#include "../../logdef.h"
+#include "numa_policy.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Key of the uthash tables: the first bytes of an entry
+typedef struct {
+  dev_t device;
+  ino_t inode;
+} MetadataKey;
+
+static MetadataService service_config = {0};
+static MetadataCache *service_cache = NULL;
+static ThreadPool *service_pool = NULL;
+static int service_started = 0; // the cache or the pool was created
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static inline int timespec_equal(const struct timespec *a,
+                                 const struct timespec *b) {
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/**
+ * @brief Check if a stat result carries enough information to be a watermark
+ *
+ * Layers that do not report timestamps would make every watermark equal.
+ */
+static inline int has_watermark(const struct stat *stbuf) {
+  return stbuf->st_mtim.tv_sec != 0 || stbuf->st_mtim.tv_nsec != 0 ||
+         stbuf->st_ctim.tv_sec != 0 || stbuf->st_ctim.tv_nsec != 0;
+}
+
+static MetadataShard *shard_of(MetadataCache *cache, dev_t device,
+                               ino_t inode) {
+  uint64_t h = ((uint64_t)inode ^ ((uint64_t)device << 32)) *
+               0x9E3779B97F4A7C15ULL;
+  return &cache->shards[h >> 60];
+}
+
+static void free_entry(MetadataShard *shard, MetadataEntry *entry) {
+  HASH_DEL(shard->entries, entry);
+  shard->bytes -= entry->bytes;
+  free(entry->tag);
+  free(entry);
+}
+
+/**
+ * @brief Entry of a file, moved to the most recently used position
+ *
+ * Called with the shard mutex held.
+ *
+ * @return MetadataEntry* -> entry, NULL if there is none
+ */
+static MetadataEntry *find_entry(MetadataShard *shard, dev_t device,
+                                 ino_t inode) {
+  MetadataKey key = {.device = device, .inode = inode};
+  MetadataEntry *entry = NULL;
+  HASH_FIND(hh, shard->entries, &key, sizeof(key), entry);
+  if (entry) {
+    HASH_DEL(shard->entries, entry);
+    HASH_ADD(hh, shard->entries, device, sizeof(key), entry);
+  }
+  return entry;
+}
+
+/**
+ * @brief Drop the least recently used entries until extra bytes fit
+ *
+ * Called with the shard mutex held. keep is not evicted.
+ */
+static void make_room(MetadataCache *cache, MetadataShard *shard,
+                      size_t extra, const MetadataEntry *keep) {
+  MetadataEntry *entry, *tmp;
+  HASH_ITER(hh, shard->entries, entry, tmp) {
+    if (shard->bytes + extra <= cache->shard_bytes) {
+      return;
+    }
+    if (entry != keep) {
+      free_entry(shard, entry);
+      __atomic_add_fetch(&cache->evictions, 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/**
+ * @brief Entry of a file, created (evicting for it) if there is none
+ *
+ * Called with the shard mutex held.
+ *
+ * @return MetadataEntry* -> entry, NULL on allocation failure
+ */
+static MetadataEntry *get_entry(MetadataCache *cache, MetadataShard *shard,
+                                dev_t device, ino_t inode) {
+  MetadataEntry *entry = find_entry(shard, device, inode);
+  if (entry) {
+    return entry;
+  }
+  make_room(cache, shard, sizeof(MetadataEntry), NULL);
+  entry = calloc(1, sizeof(MetadataEntry));
+  if (!entry) {
+    return NULL;
+  }
+  entry->device = device;
+  entry->inode = inode;
+  entry->bytes = sizeof(MetadataEntry);
+  shard->bytes += entry->bytes;
+  HASH_ADD(hh, shard->entries, device, sizeof(MetadataKey), entry);
+  return entry;
+}
+
+MetadataCache *metadata_cache_init(size_t max_bytes) {
+  size_t shard_bytes = max_bytes / METADATA_CACHE_SHARDS;
+  if (shard_bytes < sizeof(MetadataEntry)) {
+    return NULL;
+  }
+  MetadataCache *cache = calloc(1, sizeof(MetadataCache));
+  if (!cache) {
+    return NULL;
+  }
+  cache->shard_bytes = shard_bytes;
+  for (int i = 0; i < METADATA_CACHE_SHARDS; i++) {
+    pthread_mutex_init(&cache->shards[i].mutex, NULL);
+  }
+  return cache;
+}
+
+int metadata_cache_resize(MetadataCache *cache, size_t max_bytes) {
+  size_t shard_bytes = max_bytes / METADATA_CACHE_SHARDS;
+  if (!cache || shard_bytes < sizeof(MetadataEntry)) {
+    return -1;
+  }
+  __atomic_store_n(&cache->shard_bytes, shard_bytes, __ATOMIC_RELAXED);
+  for (int i = 0; i < METADATA_CACHE_SHARDS; i++) {
+    MetadataShard *shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->mutex);
+    make_room(cache, shard, 0, NULL);
+    pthread_mutex_unlock(&shard->mutex);
+  }
+  return 0;
+}
+
+void metadata_cache_destroy(MetadataCache *cache) {
+  if (!cache) {
+    return;
+  }
+  for (int i = 0; i < METADATA_CACHE_SHARDS; i++) {
+    MetadataShard *shard = &cache->shards[i];
+    MetadataEntry *entry, *tmp;
+    HASH_ITER(hh, shard->entries, entry, tmp) {
+      free_entry(shard, entry);
+    }
+    pthread_mutex_destroy(&shard->mutex);
+  }
+  free(cache);
+}
+
+int metadata_cache_get_size(MetadataCache *cache, const struct stat *stbuf,
+                            off_t *size) {
+  if (!cache || !stbuf || !size || !has_watermark(stbuf)) {
+    return -1;
+  }
+  MetadataShard *shard = shard_of(cache, stbuf->st_dev, stbuf->st_ino);
+  int hit = 0;
+  pthread_mutex_lock(&shard->mutex);
+  MetadataEntry *entry = find_entry(shard, stbuf->st_dev, stbuf->st_ino);
+  if (entry && entry->has_size) {
+    if (entry->size_mark == stbuf->st_size &&
+        timespec_equal(&entry->size_mtime, &stbuf->st_mtim) &&
+        timespec_equal(&entry->size_ctime, &stbuf->st_ctim)) {
+      *size = entry->size;
+      hit = 1;
+    } else {
+      entry->has_size = 0;
+    }
+  }
+  pthread_mutex_unlock(&shard->mutex);
+  __atomic_add_fetch(hit ? &cache->hits : &cache->misses, 1,
+                     __ATOMIC_RELAXED);
+  return hit ? 0 : -1;
+}
+
+void metadata_cache_set_size(MetadataCache *cache, const struct stat *stbuf,
+                             off_t size) {
+  if (!cache || !stbuf || !has_watermark(stbuf)) {
+    return;
+  }
+  MetadataShard *shard = shard_of(cache, stbuf->st_dev, stbuf->st_ino);
+  pthread_mutex_lock(&shard->mutex);
+  MetadataEntry *entry =
+      get_entry(cache, shard, stbuf->st_dev, stbuf->st_ino);
+  if (entry) {
+    entry->has_size = 1;
+    entry->size = size;
+    entry->size_mark = stbuf->st_size;
+    entry->size_mtime = stbuf->st_mtim;
+    entry->size_ctime = stbuf->st_ctim;
+  }
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+int metadata_cache_is_verified(MetadataCache *cache, const struct stat *stbuf,
+                               const char *tag, time_t ttl) {
+  if (!cache || !stbuf || !tag || !has_watermark(stbuf)) {
+    return 0;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  MetadataShard *shard = shard_of(cache, stbuf->st_dev, stbuf->st_ino);
+  int hit = 0;
+  pthread_mutex_lock(&shard->mutex);
+  MetadataEntry *entry = find_entry(shard, stbuf->st_dev, stbuf->st_ino);
+  if (entry && entry->tag) {
+    int expired = ttl > 0 && now.tv_sec - entry->verified_at.tv_sec >= ttl;
+    int same = entry->verified_mark == stbuf->st_size &&
+               timespec_equal(&entry->verified_mtime, &stbuf->st_mtim) &&
+               timespec_equal(&entry->verified_ctime, &stbuf->st_ctim);
+    if (!same) {
+      // the file changed: the verification is worthless whatever the tag
+      entry->bytes -= strlen(entry->tag) + 1;
+      shard->bytes -= strlen(entry->tag) + 1;
+      free(entry->tag);
+      entry->tag = NULL;
+    } else if (!expired && strcmp(entry->tag, tag) == 0) {
+      hit = 1;
+    }
+  }
+  pthread_mutex_unlock(&shard->mutex);
+  __atomic_add_fetch(hit ? &cache->hits : &cache->misses, 1,
+                     __ATOMIC_RELAXED);
+  return hit;
+}
+
+void metadata_cache_set_verified(MetadataCache *cache,
+                                 const struct stat *stbuf, const char *tag) {
+  if (!cache || !stbuf || !tag || !has_watermark(stbuf)) {
+    return;
+  }
+  size_t tag_bytes = strlen(tag) + 1;
+  if (sizeof(MetadataEntry) + tag_bytes > cache->shard_bytes) {
+    return;
+  }
+  char *copy = strdup(tag);
+  if (!copy) {
+    return;
+  }
+
+  MetadataShard *shard = shard_of(cache, stbuf->st_dev, stbuf->st_ino);
+  pthread_mutex_lock(&shard->mutex);
+  MetadataEntry *entry =
+      get_entry(cache, shard, stbuf->st_dev, stbuf->st_ino);
+  if (!entry) {
+    pthread_mutex_unlock(&shard->mutex);
+    free(copy);
+    return;
+  }
+  if (entry->tag) {
+    entry->bytes -= strlen(entry->tag) + 1;
+    shard->bytes -= strlen(entry->tag) + 1;
+    free(entry->tag);
+  }
+  make_room(cache, shard, tag_bytes, entry);
+  entry->tag = copy;
+  entry->bytes += tag_bytes;
+  shard->bytes += tag_bytes;
+  entry->verified_mark = stbuf->st_size;
+  entry->verified_mtime = stbuf->st_mtim;
+  entry->verified_ctime = stbuf->st_ctim;
+  clock_gettime(CLOCK_MONOTONIC, &entry->verified_at);
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+void metadata_cache_invalidate(MetadataCache *cache, dev_t device,
+                               ino_t inode) {
+  if (!cache) {
+    return;
+  }
+  MetadataShard *shard = shard_of(cache, device, inode);
+  pthread_mutex_lock(&shard->mutex);
+  MetadataKey key = {.device = device, .inode = inode};
+  MetadataEntry *entry = NULL;
+  HASH_FIND(hh, shard->entries, &key, sizeof(key), entry);
+  if (entry) {
+    free_entry(shard, entry);
+  }
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+void metadata_cache_get_stats(MetadataCache *cache, MetadataCacheStats *stats) {
+  if (!stats) {
+    return;
+  }
+  memset(stats, 0, sizeof(*stats));
+  if (!cache) {
+    return;
+  }
+  stats->hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+  stats->misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+  stats->evictions = __atomic_load_n(&cache->evictions, __ATOMIC_RELAXED);
+  for (int i = 0; i < METADATA_CACHE_SHARDS; i++) {
+    MetadataShard *shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->mutex);
+    stats->entries += HASH_COUNT(shard->entries);
+    stats->bytes += shard->bytes;
+    pthread_mutex_unlock(&shard->mutex);
+  }
+}
+
+static void create_service_cache(void) {
+  __atomic_store_n(&service_started, 1, __ATOMIC_RELEASE);
+  if (service_config.cache_size_bytes == 0) {
+    return;
+  }
+  service_cache = metadata_cache_init(service_config.cache_size_bytes);
+  if (!service_cache) {
+    ERROR_MSG("[METADATA_SERVICE] Failed to create a cache of %zu bytes "
+              "(at least %zu)",
+              service_config.cache_size_bytes,
+              sizeof(MetadataEntry) * METADATA_CACHE_SHARDS);
+  }
+}
+
+static void create_service_pool(void) {
+  __atomic_store_n(&service_started, 1, __ATOMIC_RELEASE);
+  if (service_config.num_background_threads == 0) {
+    return;
+  }
+  // one queue per NUMA node, so THREAD_POOL_LOCAL_QUEUE tasks stay on the
+  // submitter's node; the threads are rounded up to a multiple of the nodes
+  int nodes = numa_policy_nodes();
+  int per_node =
+      (int)((service_config.num_background_threads + nodes - 1) / nodes);
+  service_pool = thread_pool_init(nodes, per_node);
+  if (!service_pool) {
+    ERROR_MSG("[METADATA_SERVICE] Failed to start %zu background threads",
+              service_config.num_background_threads);
+  }
+}
+
+int metadata_service_configure(const MetadataService *service) {
+  if (!service || __atomic_load_n(&service_started, __ATOMIC_ACQUIRE)) {
+    return -1;
+  }
+  service_config = *service;
+  return 0;
+}
+
+MetadataCache *metadata_service_cache(void) {
+  pthread_once(&cache_once, create_service_cache);
+  return service_cache;
+}
+
+ThreadPool *metadata_service_pool(void) {
+  pthread_once(&pool_once, create_service_pool);
+  return service_pool;
+}
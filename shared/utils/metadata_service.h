@@ -0,0 +1,204 @@
+#ifndef METADATA_SERVICE_H
+#define METADATA_SERVICE_H
+
+#include "../../lib/uthash/src/uthash.h"
+#include "../types/services_context.h"
+#include "thread_pool.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * ============================================================================
+ * METADATA SERVICE - FILE METADATA SHARED BY THE LAYERS OF A PROCESS
+ * ============================================================================
+ *
+ * The metadata service of the configuration (`[services]`, type "metadata")
+ * is a cache of what the layers learn about a file, keyed by its device and
+ * inode, and a pool of background threads for the layers' parallel work.
+ *
+ * - Each entry remembers a logical size (e.g. the uncompressed size of a
+ *   compressed file) and a verification state (the file matched the stored
+ *   hash named by a tag), each with the watermark of the file it was taken
+ *   at: size, mtime and ctime from the stat of the layer below. A lookup
+ *   with a different watermark misses and drops the value, so a file
+ *   modified through any layer, or behind their backs, is never served a
+ *   stale value. Layers also invalidate the files they write, for timestamps
+ *   too coarse to tell two writes apart.
+ * - Being keyed by inode, an entry is shared by all the layers, and by all
+ *   the paths, that reach the same file.
+ * - The cache is bounded by bytes: entries (with their tag) are counted at
+ *   their allocated size and the least recently used ones of a shard are
+ *   evicted once the shard holds its share of max_bytes.
+ *
+ * metadata_service_cache() and metadata_service_pool() are the cache and the
+ * pool of the configured service, created on first use and kept for the
+ * lifetime of the process; both are NULL when the service does not ask for
+ * them, and the layers then work as before.
+ * ============================================================================
+ */
+
+#define METADATA_CACHE_SHARDS 16 // independently locked parts of the cache
+
+// One file of the cache
+typedef struct MetadataEntry {
+  dev_t device; // key, with inode
+  ino_t inode;
+  // logical size, valid while the file has its watermark
+  int has_size;
+  off_t size;
+  off_t size_mark;                // st_size
+  struct timespec size_mtime;     // st_mtim
+  struct timespec size_ctime;     // st_ctim
+  // verification, valid while the file has its watermark
+  char *tag;                      // stored hash the file matched, or NULL
+  off_t verified_mark;            // st_size
+  struct timespec verified_mtime; // st_mtim
+  struct timespec verified_ctime; // st_ctim
+  struct timespec verified_at;    // monotonic time of the verification
+  size_t bytes;                   // bytes counted against the bound
+  UT_hash_handle hh;
+} MetadataEntry;
+
+typedef struct {
+  MetadataEntry *entries; // LRU ordered, oldest first
+  size_t bytes;           // bytes of the entries
+  pthread_mutex_t mutex;  // protects the fields above
+} MetadataShard;
+
+typedef struct {
+  size_t hits;      // lookups answered from the cache
+  size_t misses;    // lookups without a valid value
+  size_t evictions; // entries dropped for space
+  size_t entries;   // entries in the cache
+  size_t bytes;     // bytes of the entries
+} MetadataCacheStats;
+
+typedef struct MetadataCache {
+  MetadataShard shards[METADATA_CACHE_SHARDS];
+  size_t shard_bytes; // bound of a shard: max_bytes / METADATA_CACHE_SHARDS
+  size_t hits;        // atomic
+  size_t misses;      // atomic
+  size_t evictions;   // atomic
+} MetadataCache;
+
+/**
+ * @brief Create a cache of at most max_bytes
+ *
+ * @param max_bytes -> bound of the cache, at least one entry per shard
+ * @return MetadataCache* -> cache, or NULL if max_bytes is too small or on
+ * failure
+ */
+MetadataCache *metadata_cache_init(size_t max_bytes);
+
+/**
+ * @brief Change the bound of a cache, evicting what no longer fits
+ *
+ * @param cache     -> cache
+ * @param max_bytes -> new bound, at least one entry per shard
+ * @return int      -> 0, or -1 if max_bytes is too small
+ */
+int metadata_cache_resize(MetadataCache *cache, size_t max_bytes);
+
+/**
+ * @brief Free a cache and its entries
+ *
+ * @param cache -> cache (may be NULL)
+ */
+void metadata_cache_destroy(MetadataCache *cache);
+
+/**
+ * @brief Logical size of a file
+ *
+ * @param cache -> cache (NULL: always a miss)
+ * @param stbuf -> current stat of the file in the layer below
+ * @param size -> receives the logical size on a hit
+ * @return int -> 0 on a hit, -1 on a miss
+ */
+int metadata_cache_get_size(MetadataCache *cache, const struct stat *stbuf,
+                            off_t *size);
+
+/**
+ * @brief Record the logical size of a file
+ *
+ * @param cache -> cache (NULL: no-op)
+ * @param stbuf -> stat of the file in the layer below the size was read from
+ * @param size -> logical size
+ */
+void metadata_cache_set_size(MetadataCache *cache, const struct stat *stbuf,
+                             off_t size);
+
+/**
+ * @brief Check whether a file matched the stored hash of tag
+ *
+ * @param cache -> cache (NULL: always a miss)
+ * @param stbuf -> current stat of the file
+ * @param tag -> stored hash the caller verifies against (e.g. its path)
+ * @param ttl -> lifetime of the verification in seconds, 0 for no expiry
+ * @return int -> 1 if it did with the same watermark and not longer than ttl
+ * ago, 0 otherwise
+ */
+int metadata_cache_is_verified(MetadataCache *cache, const struct stat *stbuf,
+                               const char *tag, time_t ttl);
+
+/**
+ * @brief Record that a file matched the stored hash of tag
+ *
+ * @param cache -> cache (NULL: no-op)
+ * @param stbuf -> stat of the file taken with the content that was hashed
+ * @param tag -> stored hash the file matched
+ */
+void metadata_cache_set_verified(MetadataCache *cache,
+                                 const struct stat *stbuf, const char *tag);
+
+/**
+ * @brief Forget a file (on write, truncate or unlink)
+ *
+ * @param cache -> cache (NULL: no-op)
+ * @param device -> st_dev of the file
+ * @param inode -> st_ino of the file
+ */
+void metadata_cache_invalidate(MetadataCache *cache, dev_t device,
+                               ino_t inode);
+
+/**
+ * @brief Counters and size of a cache
+ *
+ * @param cache -> cache (NULL: all zero)
+ * @param stats -> receives the counters
+ */
+void metadata_cache_get_stats(MetadataCache *cache, MetadataCacheStats *stats);
+
+/**
+ * @brief Set the service metadata_service_cache() and metadata_service_pool()
+ * create
+ *
+ * Call it before the layers are built: once the cache or the pool exists the
+ * configuration is left unchanged.
+ *
+ * @param service -> service of the configuration
+ * @return int -> 0 on success, -1 if the cache or the pool already exists
+ */
+int metadata_service_configure(const MetadataService *service);
+
+/**
+ * @brief Cache of the configured service
+ *
+ * @return MetadataCache* -> cache, NULL without a configured cache_size
+ */
+MetadataCache *metadata_service_cache(void);
+
+/**
+ * @brief Background pool of the configured service
+ *
+ * The pool has one queue and num_background_threads workers. Tasks are
+ * submitted in batches and waited for with thread_pool_wait(), which runs
+ * the still-queued ones on the waiting thread: a batch completes even when
+ * every worker is busy with the work of another layer.
+ *
+ * @return ThreadPool* -> pool, NULL without configured background threads
+ */
+ThreadPool *metadata_service_pool(void);
+
+#endif // METADATA_SERVICE_H
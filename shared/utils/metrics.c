@@ -0,0 +1,522 @@
+#include "metrics.h"
+#include "../../logdef.h"
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define METRICS_SUB_COUNT (1ULL << METRICS_SUB_BITS)
+#define METRICS_LE_MIN 10 // first exported bucket bound, 2^10 ns (1 us)
+#define METRICS_LE_MAX 34 // last exported bucket bound, 2^34 ns (17 s)
+
+typedef struct {
+  unsigned long long count;
+  unsigned long long errors;
+  unsigned long long bytes;
+  unsigned long long sum_ns;
+  unsigned long long buckets[METRICS_BUCKETS];
+} MetricsHistogram;
+
+typedef struct {
+  MetricsHistogram ops[METRICS_N_OPS];
+} __attribute__((aligned(64))) MetricsShard;
+
+struct MetricsSet {
+  char *layer;
+  struct MetricsSet *next; // in metrics_sets
+  MetricsShard shards[METRICS_SHARDS];
+};
+
+typedef struct MetricsCounter {
+  char *name;
+  char *help;
+  unsigned long long value;
+  struct MetricsCounter *next;
+} MetricsCounter;
+
+static const char *const metrics_op_names[METRICS_N_OPS] = {
+    [METRICS_OP_PREAD] = "pread",
+    [METRICS_OP_PWRITE] = "pwrite",
+    [METRICS_OP_PREADV] = "preadv",
+    [METRICS_OP_PWRITEV] = "pwritev",
+    [METRICS_OP_COPY_FILE_RANGE] = "copy_file_range",
+    [METRICS_OP_OPEN] = "open",
+    [METRICS_OP_CLOSE] = "close",
+    [METRICS_OP_FTRUNCATE] = "ftruncate",
+    [METRICS_OP_TRUNCATE] = "truncate",
+    [METRICS_OP_FSTAT] = "fstat",
+    [METRICS_OP_LSTAT] = "lstat",
+    [METRICS_OP_UNLINK] = "unlink",
+    [METRICS_OP_READDIR] = "readdir",
+    [METRICS_OP_RENAME] = "rename",
+    [METRICS_OP_CHMOD] = "chmod",
+    [METRICS_OP_MKDIR] = "mkdir",
+    [METRICS_OP_FSYNC] = "fsync",
+    [METRICS_OP_FALLOCATE] = "fallocate",
+};
+
+// Guards metrics_sets and metrics_counters
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static MetricsSet *metrics_sets;
+static MetricsCounter *metrics_counters;
+static unsigned metrics_next_shard;
+static __thread int metrics_shard = -1;
+
+static pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t server_thread;
+static int server_fd = -1;
+static int server_stop;
+static char *server_unix_path; // Unix socket to remove on stop
+
+/**
+ * @brief Bucket of a latency
+ */
+static size_t metrics_bucket(uint64_t ns) {
+  if (ns < METRICS_SUB_COUNT) {
+    return (size_t)ns;
+  }
+  int msb = 63 - __builtin_clzll(ns);
+  if (msb >= METRICS_MAX_BITS) {
+    return METRICS_BUCKETS - 1;
+  }
+  int shift = msb - METRICS_SUB_BITS;
+  return ((size_t)(shift + 1) << METRICS_SUB_BITS) +
+         (size_t)((ns >> shift) & (METRICS_SUB_COUNT - 1));
+}
+
+/**
+ * @brief Largest latency of a bucket
+ */
+static unsigned long long metrics_bucket_max(size_t bucket) {
+  if (bucket < METRICS_SUB_COUNT) {
+    return bucket;
+  }
+  int shift = (int)(bucket >> METRICS_SUB_BITS) - 1;
+  unsigned long long low =
+      (METRICS_SUB_COUNT | (bucket & (METRICS_SUB_COUNT - 1))) << shift;
+  return low + (1ULL << shift) - 1;
+}
+
+MetricsSet *metrics_register(const char *layer) {
+  MetricsSet *set = calloc(1, sizeof(MetricsSet));
+  if (!set) {
+    return NULL;
+  }
+  set->layer = strdup(layer);
+  if (!set->layer) {
+    free(set);
+    return NULL;
+  }
+  pthread_mutex_lock(&metrics_mutex);
+  set->next = metrics_sets;
+  metrics_sets = set;
+  pthread_mutex_unlock(&metrics_mutex);
+  return set;
+}
+
+void metrics_unregister(MetricsSet *set) {
+  if (!set) {
+    return;
+  }
+  pthread_mutex_lock(&metrics_mutex);
+  for (MetricsSet **link = &metrics_sets; *link; link = &(*link)->next) {
+    if (*link == set) {
+      *link = set->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&metrics_mutex);
+  free(set->layer);
+  free(set);
+}
+
+void metrics_record(MetricsSet *set, MetricsOp op, uint64_t start_ns,
+                    ssize_t result) {
+  if (metrics_shard < 0) {
+    metrics_shard = (int)(__atomic_fetch_add(&metrics_next_shard, 1,
+                                             __ATOMIC_RELAXED) %
+                          METRICS_SHARDS);
+  }
+  MetricsHistogram *h = &set->shards[metrics_shard].ops[op];
+  uint64_t ns = metrics_now() - start_ns;
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->buckets[metrics_bucket(ns)], 1, __ATOMIC_RELAXED);
+  if (result < 0) {
+    __atomic_fetch_add(&h->errors, 1, __ATOMIC_RELAXED);
+  } else if (op <= METRICS_OP_COPY_FILE_RANGE && result > 0) {
+    __atomic_fetch_add(&h->bytes, (unsigned long long)result,
+                       __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * @brief Add the shards of an operation up into h
+ */
+static void metrics_merge(MetricsSet *set, MetricsOp op, MetricsHistogram *h) {
+  memset(h, 0, sizeof(*h));
+  for (int s = 0; s < METRICS_SHARDS; s++) {
+    const MetricsHistogram *shard = &set->shards[s].ops[op];
+    h->count += __atomic_load_n(&shard->count, __ATOMIC_RELAXED);
+    h->errors += __atomic_load_n(&shard->errors, __ATOMIC_RELAXED);
+    h->bytes += __atomic_load_n(&shard->bytes, __ATOMIC_RELAXED);
+    h->sum_ns += __atomic_load_n(&shard->sum_ns, __ATOMIC_RELAXED);
+    for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+      h->buckets[b] += __atomic_load_n(&shard->buckets[b], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+void metrics_summary(MetricsSet *set, MetricsOp op, MetricsSummary *summary) {
+  MetricsHistogram h;
+  metrics_merge(set, op, &h);
+  memset(summary, 0, sizeof(*summary));
+  summary->count = h.count;
+  summary->errors = h.errors;
+  summary->bytes = h.bytes;
+  summary->sum_ns = h.sum_ns;
+
+  // the buckets may have been counted a little apart from count
+  unsigned long long total = 0;
+  for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+    total += h.buckets[b];
+  }
+  const double quantiles[3] = {0.50, 0.90, 0.99};
+  unsigned long long *values[3] = {&summary->p50_ns, &summary->p90_ns,
+                                   &summary->p99_ns};
+  unsigned long long seen = 0;
+  int q = 0;
+  for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+    if (!h.buckets[b]) {
+      continue;
+    }
+    seen += h.buckets[b];
+    while (q < 3 && seen >= (unsigned long long)(quantiles[q] * total)) {
+      *values[q++] = metrics_bucket_max(b);
+    }
+    summary->max_ns = metrics_bucket_max(b);
+  }
+}
+
+void metrics_count(const char *name, const char *help, unsigned long long n) {
+  pthread_mutex_lock(&metrics_mutex);
+  MetricsCounter *counter = metrics_counters;
+  while (counter && strcmp(counter->name, name) != 0) {
+    counter = counter->next;
+  }
+  if (!counter) {
+    counter = calloc(1, sizeof(MetricsCounter));
+    if (counter) {
+      counter->name = strdup(name);
+      counter->help = strdup(help);
+      if (!counter->name || !counter->help) {
+        free(counter->name);
+        free(counter->help);
+        free(counter);
+        counter = NULL;
+      }
+    }
+    if (!counter) {
+      pthread_mutex_unlock(&metrics_mutex);
+      return;
+    }
+    counter->next = metrics_counters;
+    metrics_counters = counter;
+  }
+  counter->value += n;
+  pthread_mutex_unlock(&metrics_mutex);
+}
+
+/**
+ * @brief Write a label value, escaped
+ */
+static void metrics_put_label(FILE *out, const char *value) {
+  for (; *value; value++) {
+    if (*value == '\\' || *value == '"') {
+      fputc('\\', out);
+      fputc(*value, out);
+    } else if (*value == '\n') {
+      fputs("\\n", out);
+    } else {
+      fputc(*value, out);
+    }
+  }
+}
+
+/**
+ * @brief Write the histogram of an operation of a layer
+ */
+static void metrics_put_histogram(FILE *out, const MetricsSet *set,
+                                  MetricsOp op, const MetricsHistogram *h) {
+  unsigned long long cumulative = 0;
+  size_t b = 0;
+  for (int bits = METRICS_LE_MIN; bits <= METRICS_LE_MAX; bits++) {
+    // the buckets end on the powers of two, so each bound is exact
+    for (; b < METRICS_BUCKETS && metrics_bucket_max(b) < (1ULL << bits);
+         b++) {
+      cumulative += h->buckets[b];
+    }
+    fputs("tg_layer_latency_seconds_bucket{layer=\"", out);
+    metrics_put_label(out, set->layer);
+    fprintf(out, "\",op=\"%s\",le=\"%.9g\"} %llu\n", metrics_op_names[op],
+            (double)(1ULL << bits) / 1e9, cumulative);
+  }
+  fputs("tg_layer_latency_seconds_bucket{layer=\"", out);
+  metrics_put_label(out, set->layer);
+  fprintf(out, "\",op=\"%s\",le=\"+Inf\"} %llu\n", metrics_op_names[op],
+          h->count);
+  fputs("tg_layer_latency_seconds_sum{layer=\"", out);
+  metrics_put_label(out, set->layer);
+  fprintf(out, "\",op=\"%s\"} %.9f\n", metrics_op_names[op],
+          (double)h->sum_ns / 1e9);
+  fputs("tg_layer_latency_seconds_count{layer=\"", out);
+  metrics_put_label(out, set->layer);
+  fprintf(out, "\",op=\"%s\"} %llu\n", metrics_op_names[op], h->count);
+}
+
+/**
+ * @brief Write one counter of every operation that ran
+ */
+static void metrics_put_counter(FILE *out, const char *name, const char *help,
+                                MetricsHistogram *merged, size_t field) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+  int i = 0;
+  for (MetricsSet *set = metrics_sets; set; set = set->next) {
+    for (int op = 0; op < METRICS_N_OPS; op++, i++) {
+      const MetricsHistogram *h = &merged[i];
+      if (!h->count) {
+        continue;
+      }
+      fprintf(out, "%s{layer=\"", name);
+      metrics_put_label(out, set->layer);
+      fprintf(out, "\",op=\"%s\"} %llu\n", metrics_op_names[op],
+              *(const unsigned long long *)((const char *)h + field));
+    }
+  }
+}
+
+char *metrics_render(size_t *len) {
+  char *text = NULL;
+  FILE *out = open_memstream(&text, len);
+  if (!out) {
+    return NULL;
+  }
+  pthread_mutex_lock(&metrics_mutex);
+  int n_sets = 0;
+  for (MetricsSet *set = metrics_sets; set; set = set->next) {
+    n_sets++;
+  }
+  MetricsHistogram *merged =
+      malloc((size_t)(n_sets ? n_sets : 1) * METRICS_N_OPS *
+             sizeof(MetricsHistogram));
+  if (!merged) {
+    pthread_mutex_unlock(&metrics_mutex);
+    fclose(out);
+    free(text);
+    return NULL;
+  }
+  int i = 0;
+  for (MetricsSet *set = metrics_sets; set; set = set->next) {
+    for (int op = 0; op < METRICS_N_OPS; op++) {
+      metrics_merge(set, (MetricsOp)op, &merged[i++]);
+    }
+  }
+
+  metrics_put_counter(out, "tg_layer_operations_total",
+                      "Operations of a layer", merged,
+                      offsetof(MetricsHistogram, count));
+  metrics_put_counter(out, "tg_layer_errors_total",
+                      "Operations of a layer that failed", merged,
+                      offsetof(MetricsHistogram, errors));
+  metrics_put_counter(out, "tg_layer_bytes_total",
+                      "Bytes read or written by a layer", merged,
+                      offsetof(MetricsHistogram, bytes));
+  fputs("# HELP tg_layer_latency_seconds Latency of the operations of a "
+        "layer\n# TYPE tg_layer_latency_seconds histogram\n",
+        out);
+  i = 0;
+  for (MetricsSet *set = metrics_sets; set; set = set->next) {
+    for (int op = 0; op < METRICS_N_OPS; op++, i++) {
+      if (merged[i].count) {
+        metrics_put_histogram(out, set, (MetricsOp)op, &merged[i]);
+      }
+    }
+  }
+  for (MetricsCounter *c = metrics_counters; c; c = c->next) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", c->name,
+            c->help, c->name, c->name, c->value);
+  }
+  pthread_mutex_unlock(&metrics_mutex);
+  free(merged);
+  if (fclose(out) != 0) {
+    free(text);
+    return NULL;
+  }
+  return text;
+}
+
+/**
+ * @brief Answer one request with the metrics
+ */
+static void metrics_answer(int fd) {
+  // the request itself doesn't matter, every path gets the metrics
+  char request[1024];
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  if (poll(&pfd, 1, 1000) > 0) {
+    (void)read(fd, request, sizeof(request));
+  }
+  size_t len = 0;
+  char *body = metrics_render(&len);
+  if (!body) {
+    const char *error = "HTTP/1.0 500 Internal Server Error\r\n"
+                        "Content-Length: 0\r\n\r\n";
+    (void)write(fd, error, strlen(error));
+    return;
+  }
+  char header[256];
+  int n = snprintf(header, sizeof(header),
+                   "HTTP/1.0 200 OK\r\n"
+                   "Content-Type: text/plain; version=0.0.4\r\n"
+                   "Content-Length: %zu\r\n\r\n",
+                   len);
+  if (write(fd, header, (size_t)n) == n) {
+    for (size_t off = 0; off < len;) {
+      ssize_t w = write(fd, body + off, len - off);
+      if (w <= 0) {
+        break;
+      }
+      off += (size_t)w;
+    }
+  }
+  free(body);
+}
+
+static void *metrics_server_loop(void *arg) {
+  (void)arg;
+  struct pollfd pfd = {.fd = server_fd, .events = POLLIN};
+  while (!__atomic_load_n(&server_stop, __ATOMIC_ACQUIRE)) {
+    if (poll(&pfd, 1, 100) <= 0) {
+      continue;
+    }
+    int client = accept(server_fd, NULL, NULL);
+    if (client < 0) {
+      continue;
+    }
+    metrics_answer(client);
+    close(client);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Listening socket of an address
+ */
+static int metrics_listen(const char *address) {
+  int fd = -1;
+  if (strncmp(address, "unix:", 5) == 0) {
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+    const char *path = address + 5;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    strcpy(sun.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    (void)unlink(path); // left by a previous run
+    if (fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+      goto fail;
+    }
+    server_unix_path = strdup(path);
+  } else if (strncmp(address, "tcp:", 4) == 0) {
+    char host[256];
+    const char *port = strrchr(address + 4, ':');
+    if (!port || (size_t)(port - address - 4) >= sizeof(host)) {
+      errno = EINVAL;
+      return -1;
+    }
+    memcpy(host, address + 4, port - address - 4);
+    host[port - address - 4] = '\0';
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM,
+                             .ai_flags = AI_PASSIVE};
+    struct addrinfo *info = NULL;
+    if (getaddrinfo(host[0] ? host : NULL, port + 1, &hints, &info) != 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    fd = socket(info->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if (fd >= 0) {
+      (void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    int rc = fd < 0 ? -1 : bind(fd, info->ai_addr, info->ai_addrlen);
+    freeaddrinfo(info);
+    if (rc != 0) {
+      goto fail;
+    }
+  } else {
+    errno = EINVAL;
+    return -1;
+  }
+  if (listen(fd, 16) == 0) {
+    return fd;
+  }
+fail:;
+  int saved = errno;
+  if (fd >= 0) {
+    close(fd);
+  }
+  errno = saved;
+  return -1;
+}
+
+int metrics_serve(const char *address) {
+  pthread_mutex_lock(&server_mutex);
+  if (server_fd >= 0) {
+    pthread_mutex_unlock(&server_mutex);
+    errno = EBUSY;
+    return -1;
+  }
+  server_fd = metrics_listen(address);
+  if (server_fd < 0) {
+    int saved = errno;
+    pthread_mutex_unlock(&server_mutex);
+    ERROR_MSG("[METRICS_SERVE] Could not listen on %s: %s", address,
+              strerror(saved));
+    errno = saved;
+    return -1;
+  }
+  server_stop = 0;
+  int rc = pthread_create(&server_thread, NULL, metrics_server_loop, NULL);
+  if (rc != 0) {
+    close(server_fd);
+    server_fd = -1;
+    pthread_mutex_unlock(&server_mutex);
+    errno = rc;
+    return -1;
+  }
+  pthread_mutex_unlock(&server_mutex);
+  INFO_MSG("[METRICS_SERVE] Serving the metrics on %s", address);
+  return 0;
+}
+
+void metrics_stop(void) {
+  pthread_mutex_lock(&server_mutex);
+  if (server_fd >= 0) {
+    __atomic_store_n(&server_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(server_thread, NULL);
+    close(server_fd);
+    server_fd = -1;
+    if (server_unix_path) {
+      (void)unlink(server_unix_path);
+      free(server_unix_path);
+      server_unix_path = NULL;
+    }
+  }
+  pthread_mutex_unlock(&server_mutex);
+}
@@ -0,0 +1,162 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * ============================================================================
+ * METRICS - PER-LAYER OPERATION COUNTERS AND LATENCY HISTOGRAMS
+ * ============================================================================
+ *
+ * A MetricsSet holds, for each operation of one layer, the number of calls,
+ * of failed calls, the bytes transferred and a histogram of the latencies.
+ * The metrics layer (metrics_layer.h) records them around the operations of
+ * the layer it wraps; the builder puts one above every layer of the tree
+ * when the configuration sets metrics.
+ *
+ * Recording takes no lock: each thread updates one of METRICS_SHARDS copies
+ * of the set, picked on its first record, with relaxed atomic adds, so
+ * threads only share the cache lines of a copy when there are more of them
+ * than shards. The exporter adds the copies up when it renders.
+ *
+ * The histograms are HDR-style: the latency in ns falls in one of
+ * 2^METRICS_SUB_BITS linear buckets of its power of two, which bounds the
+ * error of a percentile to 1/2^METRICS_SUB_BITS (12.5%) of its value, from
+ * 1 ns to 2^METRICS_MAX_BITS ns (18 minutes, the longer ones are counted in
+ * the last bucket).
+ *
+ * metrics_serve exports every set, and the counters of metrics_count, in the
+ * Prometheus text format over HTTP, on a TCP port or a Unix socket:
+ *
+ *   curl http://127.0.0.1:9464/metrics
+ *   curl --unix-socket /run/tg/metrics.sock http://localhost/metrics
+ * ============================================================================
+ */
+
+#define METRICS_SHARDS 16
+#define METRICS_SUB_BITS 3
+#define METRICS_MAX_BITS 40
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) \
+                         << METRICS_SUB_BITS)
+
+// The operations timed, the data ones (whose bytes are counted) first
+typedef enum {
+  METRICS_OP_PREAD,
+  METRICS_OP_PWRITE,
+  METRICS_OP_PREADV,
+  METRICS_OP_PWRITEV,
+  METRICS_OP_COPY_FILE_RANGE,
+  METRICS_OP_OPEN,
+  METRICS_OP_CLOSE,
+  METRICS_OP_FTRUNCATE,
+  METRICS_OP_TRUNCATE,
+  METRICS_OP_FSTAT,
+  METRICS_OP_LSTAT,
+  METRICS_OP_UNLINK,
+  METRICS_OP_READDIR,
+  METRICS_OP_RENAME,
+  METRICS_OP_CHMOD,
+  METRICS_OP_MKDIR,
+  METRICS_OP_FSYNC,
+  METRICS_OP_FALLOCATE,
+  METRICS_N_OPS
+} MetricsOp;
+
+typedef struct MetricsSet MetricsSet;
+
+typedef struct {
+  unsigned long long count;  // calls
+  unsigned long long errors; // calls that failed
+  unsigned long long bytes;  // read or written by the data operations
+  unsigned long long sum_ns; // total latency
+  unsigned long long p50_ns; // percentiles, the upper bound of their bucket
+  unsigned long long p90_ns;
+  unsigned long long p99_ns;
+  unsigned long long max_ns; // upper bound of the last bucket counted
+} MetricsSummary;
+
+/**
+ * @brief Current time for metrics_record
+ *
+ * @return uint64_t -> monotonic time in ns
+ */
+static inline uint64_t metrics_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Create the metrics of a layer, exported until unregistered
+ *
+ * @param layer         -> name of the layer in the metrics, copied
+ * @return MetricsSet*  -> the set, NULL on allocation failure
+ */
+MetricsSet *metrics_register(const char *layer);
+
+/**
+ * @brief Stop exporting the metrics of a layer and free them
+ *
+ * @param set -> set of metrics_register, may be NULL
+ */
+void metrics_unregister(MetricsSet *set);
+
+/**
+ * @brief Count an operation
+ *
+ * @param set      -> metrics of the layer
+ * @param op       -> operation
+ * @param start_ns -> metrics_now() before the operation
+ * @param result   -> its result, negative on failure, the bytes transferred
+ * for the data operations
+ */
+void metrics_record(MetricsSet *set, MetricsOp op, uint64_t start_ns,
+                    ssize_t result);
+
+/**
+ * @brief Add the shards of an operation up
+ *
+ * @param set     -> metrics of the layer
+ * @param op      -> operation
+ * @param summary -> filled with its counters and percentiles
+ */
+void metrics_summary(MetricsSet *set, MetricsOp op, MetricsSummary *summary);
+
+/**
+ * @brief Add to a named counter, created on its first use
+ *
+ * The counters are for rare events (a hash mismatch), each call looks the
+ * name up under a lock.
+ *
+ * @param name -> Prometheus name of the counter, e.g. tg_..._total
+ * @param help -> its description
+ * @param n    -> amount added
+ */
+void metrics_count(const char *name, const char *help, unsigned long long n);
+
+/**
+ * @brief Render every set and counter in the Prometheus text format
+ *
+ * @param len    -> set to the length of the text
+ * @return char* -> the text, to free, NULL on allocation failure
+ */
+char *metrics_render(size_t *len);
+
+/**
+ * @brief Serve metrics_render over HTTP on a thread
+ *
+ * @param address -> "tcp:HOST:PORT" or "unix:PATH"
+ * @return int    -> 0 on success, -1 with errno if it could not listen or
+ * already serves
+ */
+int metrics_serve(const char *address);
+
+/**
+ * @brief Stop serving the metrics, removes the Unix socket
+ */
+void metrics_stop(void);
+
+#endif // METRICS_H
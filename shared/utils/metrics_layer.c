@@ -0,0 +1,305 @@
+#include "metrics_layer.h"
+#include "layer_async.h"
+#include "layer_iov.h"
+#include <errno.h>
+#include <stdlib.h>
+
+#define METRICS_NEXT(l) (&((MetricsLayerState *)(l).internal_state)->next)
+#define METRICS_SET(l) (((MetricsLayerState *)(l).internal_state)->metrics)
+
+static ssize_t metrics_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                             LayerContext l) {
+  LayerContext *next = METRICS_NEXT(l);
+  uint64_t start = metrics_now();
+  ssize_t res = next->ops->lpread(fd, buffer, nbyte, offset, *next);
+  metrics_record(METRICS_SET(l), METRICS_OP_PREAD, start, res);
+  return res;
+}
+
+static ssize_t metrics_pwrite(int fd, const void *buffer, size_t nbyte,
+                              off_t offset, LayerContext l) {
+  LayerContext *next = METRICS_NEXT(l);
+  uint64_t start = metrics_now();
+  ssize_t res = next->ops->lpwrite(fd, buffer, nbyte, offset, *next);
+  metrics_record(METRICS_SET(l), METRICS_OP_PWRITE, start, res);
+  return res;
+}
+
+static int metrics_open(const char *pathname, int flags, mode_t mode,
+                        LayerContext l) {
+  LayerContext *next = METRICS_NEXT(l);
+  uint64_t start = metrics_now();
+  int res = next->ops->lopen(pathname, flags, mode, *next);
+  metrics_record(METRICS_SET(l), METRICS_OP_OPEN, start, res);
+  return res;
+}
+
+static int metrics_close(int fd, LayerContext l) {
+  LayerContext *next = METRICS_NEXT(l);
+  uint64_t start = metrics_now();
+  int res = next->ops->lclose(fd, *next);
+  metrics_record(METRICS_SET(l), METRICS_OP_CLOSE, start, res);
+  return res;
+}
+
+static int metrics_ftruncate(int fd, off_t length, LayerContext l) {
+  LayerContext *next = METRICS_NEXT(l);
+  if (!next->ops->lftruncate) {
+    errno = ENOSYS;
+    return -1;
+  }
+  uint64_t start = metrics_now();
+  int res = next->ops->lftruncate(fd, length, *next);
+  metrics_record(METRICS_SET(l), METRICS_OP_FTRUNCATE, start, res);
+  return res;
+}
+
+static int metrics_truncate(const char *path, off_t length, LayerContext l) {
+  LayerContext *next = METRICS_NEXT(l);
+  if (!next->ops->ltruncate) {
+    errno = ENOSYS;
+    return -1;
+  }
+  uint64_t start = metrics_now();
+  int res = next->ops->ltruncate(path, length, *next);
+  metrics_record(METRICS_SET(l), METRICS_OP_TRUNCATE, start, res);
+  return res;
+}
+
+static int metrics_fstat(int fd, struct stat *stbuf, LayerContext l) {
+  LayerContext *next = METRICS_NEXT(l);
+  uint64_t start = metrics_now();
+  int res = next->ops->lfstat(fd, stbuf, *next);
+  metrics_record(METRICS_SET(l), METRICS_OP_FSTAT, start, res);
+  return res;
+}
+
+static int metrics_lstat(const char *path, struct stat *stbuf,
+                         LayerContext l) {
+  LayerContext *next = METRICS_NEXT(l);
+  uint64_t start = metrics_now();
+  int res = next->ops->llstat(path, stbuf, *next);
+  metrics_record(METRICS_SET(l), METRICS_OP_LSTAT, start, res);
+  return res;
+}
+
+static int metrics_unlink(const char *path, LayerContext l) {
+  LayerContext *next = METRICS_NEXT(l);
+  uint64_t start = metrics_now();
+  int res = next->ops->lunlink(path, *next);
+  metrics_record(METRICS_SET(l), METRICS_OP_UNLINK, start, res);
+  return res;
+}
+
+static ssize_t metrics_preadv(int fd, const struct iovec *iov, int iovcnt,
+                              off_t offset, LayerContext l) {
+  uint64_t start = metrics_now();
+  ssize_t res = layer_preadv(fd, iov, iovcnt, offset, *METRICS_NEXT(l));
+  metrics_record(METRICS_SET(l), METRICS_OP_PREADV, start, res);
+  return res;
+}
+
+static ssize_t metrics_pwritev(int fd, const struct iovec *iov, int iovcnt,
+                               off_t offset, LayerContext l) {
+  uint64_t start = metrics_now();
+  ssize_t res = layer_pwritev(fd, iov, iovcnt, offset, *METRICS_NEXT(l));
+  metrics_record(METRICS_SET(l), METRICS_OP_PWRITEV, start, res);
+  return res;
+}
+
+static int metrics_pread_async(int fd, void *buffer, size_t nbyte,
+                               off_t offset, LayerIoCallback callback,
+                               void *ctx, LayerContext l) {
+  return layer_pread_async(fd, buffer, nbyte, offset, callback, ctx,
+                           *METRICS_NEXT(l));
+}
+
+static int metrics_pwrite_async(int fd, const void *buffer, size_t nbyte,
+                                off_t offset, LayerIoCallback callback,
+                                void *ctx, LayerContext l) {
+  return layer_pwrite_async(fd, buffer, nbyte, offset, callback, ctx,
+                            *METRICS_NEXT(l));
+}
+
+static ssize_t metrics_pread_digest(int fd, void *buffer, size_t nbyte,
+                                    off_t offset, const LayerDigest *digest,
+                                    LayerContext l) {
+  LayerContext *next = METRICS_NEXT(l);
+  uint64_t start = metrics_now();
+  ssize_t res =
+      next->ops->lpread_digest(fd, buffer, nbyte, offset, digest, *next);
+  metrics_record(METRICS_SET(l), METRICS_OP_PREAD, start, res);
+  return res;
+}
+
+static ssize_t metrics_pwrite_digest(int fd, const void *buffer, size_t nbyte,
+                                     off_t offset, const LayerDigest *digest,
+                                     LayerContext l) {
+  LayerContext *next = METRICS_NEXT(l);
+  uint64_t start = metrics_now();
+  ssize_t res =
+      next->ops->lpwrite_digest(fd, buffer, nbyte, offset, digest, *next);
+  metrics_record(METRICS_SET(l), METRICS_OP_PWRITE, start, res);
+  return res;
+}
+
+static size_t metrics_direct_alignment(LayerContext l) {
+  return layer_direct_alignment(*METRICS_NEXT(l));
+}
+
+static int metrics_backing_fd(int fd, LayerContext l) {
+  return layer_backing_fd(fd, *METRICS_NEXT(l));
+}
+
+static int metrics_verify(const char *path, LayerContext l) {
+  return layer_verify(path, *METRICS_NEXT(l));
+}
+
+static int metrics_readdir(const char *path, void *buf,
+                           int (*filler)(void *buf, const char *name,
+                                         const struct stat *stbuf, off_t off,
+                                         unsigned int flags),
+                           off_t offset, struct fuse_file_info *fi,
+                           unsigned int flags, LayerContext l) {
+  uint64_t start = metrics_now();
+  int res = layer_readdir(path, buf, filler, offset, fi, flags,
+                          *METRICS_NEXT(l));
+  metrics_record(METRICS_SET(l), METRICS_OP_READDIR, start, res);
+  return res;
+}
+
+static int metrics_rename(const char *from, const char *to,
+                          unsigned int flags, LayerContext l) {
+  LayerContext *next = METRICS_NEXT(l);
+  if (!next->ops->lrename) {
+    errno = ENOSYS;
+    return -1;
+  }
+  uint64_t start = metrics_now();
+  int res = next->ops->lrename(from, to, flags, *next);
+  metrics_record(METRICS_SET(l), METRICS_OP_RENAME, start, res);
+  return res;
+}
+
+static int metrics_chmod(const char *path, mode_t mode, LayerContext l) {
+  LayerContext *next = METRICS_NEXT(l);
+  if (!next->ops->lchmod) {
+    errno = ENOSYS;
+    return -1;
+  }
+  uint64_t start = metrics_now();
+  int res = next->ops->lchmod(path, mode, *next);
+  metrics_record(METRICS_SET(l), METRICS_OP_CHMOD, start, res);
+  return res;
+}
+
+static int metrics_mkdir(const char *path, mode_t mode, LayerContext l) {
+  LayerContext *next = METRICS_NEXT(l);
+  if (!next->ops->lmkdir) {
+    errno = ENOSYS;
+    return -1;
+  }
+  uint64_t start = metrics_now();
+  int res = next->ops->lmkdir(path, mode, *next);
+  metrics_record(METRICS_SET(l), METRICS_OP_MKDIR, start, res);
+  return res;
+}
+
+static int metrics_fsync(int fd, int isdatasync, LayerContext l) {
+  LayerContext *next = METRICS_NEXT(l);
+  if (!next->ops->lfsync) {
+    return 0;
+  }
+  uint64_t start = metrics_now();
+  int res = next->ops->lfsync(fd, isdatasync, *next);
+  metrics_record(METRICS_SET(l), METRICS_OP_FSYNC, start, res);
+  return res;
+}
+
+static int metrics_fallocate(int fd, off_t offset, int mode, off_t length,
+                             LayerContext l) {
+  LayerContext *next = METRICS_NEXT(l);
+  if (!next->ops->lfallocate) {
+    errno = ENOSYS;
+    return -1;
+  }
+  uint64_t start = metrics_now();
+  int res = next->ops->lfallocate(fd, offset, mode, length, *next);
+  metrics_record(METRICS_SET(l), METRICS_OP_FALLOCATE, start, res);
+  return res;
+}
+
+static ssize_t metrics_copy_file_range(int fd_in, off_t offset_in, int fd_out,
+                                       off_t offset_out, size_t len,
+                                       unsigned int flags, LayerContext l) {
+  uint64_t start = metrics_now();
+  ssize_t res = layer_copy_file_range(fd_in, offset_in, fd_out, offset_out,
+                                      len, flags, *METRICS_NEXT(l));
+  metrics_record(METRICS_SET(l), METRICS_OP_COPY_FILE_RANGE, start, res);
+  return res;
+}
+
+static void metrics_destroy(LayerContext l) {
+  MetricsLayerState *state = (MetricsLayerState *)l.internal_state;
+  if (state->next.ops->ldestroy) {
+    state->next.ops->ldestroy(state->next);
+  }
+  metrics_unregister(state->metrics);
+  free(state);
+}
+
+static const LayerOps metrics_ops = {
+    .lpread = metrics_pread,
+    .lpwrite = metrics_pwrite,
+    .lopen = metrics_open,
+    .lclose = metrics_close,
+    .lftruncate = metrics_ftruncate,
+    .ltruncate = metrics_truncate,
+    .lfstat = metrics_fstat,
+    .llstat = metrics_lstat,
+    .lunlink = metrics_unlink,
+    .lpreadv = metrics_preadv,
+    .lpwritev = metrics_pwritev,
+    .lpread_async = metrics_pread_async,
+    .lpwrite_async = metrics_pwrite_async,
+    .lpread_digest = metrics_pread_digest,
+    .lpwrite_digest = metrics_pwrite_digest,
+    .ldirect_alignment = metrics_direct_alignment,
+    .lbacking_fd = metrics_backing_fd,
+    .lverify = metrics_verify,
+    .lreaddir = metrics_readdir,
+    .lrename = metrics_rename,
+    .lchmod = metrics_chmod,
+    .lmkdir = metrics_mkdir,
+    .lfsync = metrics_fsync,
+    .lfallocate = metrics_fallocate,
+    .lcopy_file_range = metrics_copy_file_range,
+    .ldestroy = metrics_destroy,
+};
+
+LayerContext metrics_layer_init(const LayerContext *next, const char *name) {
+  LayerContext l = {0};
+  MetricsLayerState *state = calloc(1, sizeof(MetricsLayerState));
+  if (!state) {
+    return l;
+  }
+  state->metrics = metrics_register(name);
+  if (!state->metrics) {
+    free(state);
+    return l;
+  }
+  state->next = *next;
+  state->ops = metrics_ops;
+  // advertise digests only if the wrapped layer computes them
+  if (!next->ops->lpread_digest) {
+    state->ops.lpread_digest = NULL;
+  }
+  if (!next->ops->lpwrite_digest) {
+    state->ops.lpwrite_digest = NULL;
+  }
+  l.ops = &state->ops;
+  l.internal_state = state;
+  return l;
+}
+
+MetricsSet *metrics_layer_metrics(LayerContext l) { return METRICS_SET(l); }
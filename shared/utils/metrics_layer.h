@@ -0,0 +1,51 @@
+#ifndef METRICS_LAYER_H
+#define METRICS_LAYER_H
+
+#include "../types/layer_context.h"
+#include "metrics.h"
+
+/*
+ * ============================================================================
+ * METRICS LAYER - COUNTS AND TIMES THE OPERATIONS OF THE LAYER BELOW
+ * ============================================================================
+ *
+ * A metrics layer has every operation of LayerOps and forwards each one to
+ * the layer it wraps. The operations of MetricsOp are timed and recorded in
+ * the MetricsSet of the layer, the digesting pread and pwrite as lpread and
+ * lpwrite; the asynchronous I/O, ldirect_alignment and lbacking_fd are only
+ * forwarded. The time recorded is the one of the wrapped layer with
+ * everything below it.
+ *
+ * The operations the wrapped layer leaves NULL behave as in a lazy layer
+ * (lazy_layer.h), except the digesting ones, which are NULL like in the
+ * wrapped layer.
+ *
+ * Destroying a metrics layer destroys the wrapped layer and unregisters its
+ * metrics.
+ * ============================================================================
+ */
+
+typedef struct {
+  LayerContext next; // the wrapped layer
+  MetricsSet *metrics;
+  LayerOps ops; // of this instance, layers above may change them
+} MetricsLayerState;
+
+/**
+ * @brief Wrap a layer in a metrics layer
+ *
+ * @param next          -> layer to wrap, copied
+ * @param name          -> name of the layer in the metrics
+ * @return LayerContext -> the metrics layer, with NULL ops on failure
+ */
+LayerContext metrics_layer_init(const LayerContext *next, const char *name);
+
+/**
+ * @brief Metrics of a metrics layer
+ *
+ * @param l            -> metrics layer
+ * @return MetricsSet* -> its metrics
+ */
+MetricsSet *metrics_layer_metrics(LayerContext l);
+
+#endif // METRICS_LAYER_H
@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include "numa_policy.h"
+#include "../../logdef.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define NUMA_SYSFS "/sys/devices/system/node"
+#define NUMA_MAX_NODE_ID 1024 // kernel node ids handled, as CPU_SETSIZE
+#define NUMA_MASK_WORDS (NUMA_MAX_NODE_ID / (8 * sizeof(unsigned long)))
+#define NUMA_MPOL_PREFERRED 1 // MPOL_PREFERRED of <numaif.h>
+
+typedef struct {
+  int id;         // kernel node id
+  cpu_set_t cpus; // CPUs of the node
+} NumaNode;
+
+// set once by numa_policy_configure, before any pool reads it
+static NumaNode nodes[NUMA_POLICY_MAX_NODES];
+static int n_nodes = 0;                // nodes of the set, 0: placement off
+static short cpu_node[CPU_SETSIZE];    // node index of a CPU, -1 outside
+static unsigned next_steer = 0;        // node of the next steered thread
+static __thread int steered_node = -1; // node of a steered thread
+
+/**
+ * @brief Read the first line of a sysfs file
+ */
+static int read_line(const char *path, char *buf, size_t size) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return -1;
+  }
+  char *line = fgets(buf, (int)size, file);
+  fclose(file);
+  if (!line) {
+    return -1;
+  }
+  buf[strcspn(buf, "\n")] = '\0';
+  return 0;
+}
+
+/**
+ * @brief Parse a kernel list format ("0-3,8,10-11") into a set
+ */
+static int parse_list(const char *list, cpu_set_t *set) {
+  CPU_ZERO(set);
+  const char *p = list;
+  while (*p) {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p) {
+      return -1;
+    }
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p) {
+        return -1;
+      }
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE) {
+      return -1;
+    }
+    for (long i = first; i <= last; i++) {
+      CPU_SET(i, set);
+    }
+    p = *end == ',' ? end + 1 : end;
+    if (*end != ',' && *end != '\0') {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void node_mask_of(int node, unsigned long *mask) {
+  const size_t bits = 8 * sizeof(unsigned long);
+  memset(mask, 0, NUMA_MASK_WORDS * sizeof(unsigned long));
+  mask[nodes[node].id / bits] |= 1UL << (nodes[node].id % bits);
+}
+
+int numa_policy_configure(unsigned long node_mask) {
+  char buf[4096];
+  cpu_set_t online;
+  if (read_line(NUMA_SYSFS "/online", buf, sizeof(buf)) != 0 ||
+      parse_list(buf, &online) != 0) {
+    WARN_MSG("[NUMA_POLICY] Can't read the NUMA topology, placement is off");
+    return -1;
+  }
+
+  NumaNode found[NUMA_POLICY_MAX_NODES];
+  int n = 0;
+  for (int id = 0; id < NUMA_MAX_NODE_ID; id++) {
+    if (!CPU_ISSET(id, &online) ||
+        (node_mask != 0 &&
+         (id >= (int)(8 * sizeof(node_mask)) || !(node_mask & (1UL << id))))) {
+      continue;
+    }
+    if (n == NUMA_POLICY_MAX_NODES) {
+      WARN_MSG("[NUMA_POLICY] Only the first %d nodes are used",
+               NUMA_POLICY_MAX_NODES);
+      break;
+    }
+    char path[128];
+    (void)snprintf(path, sizeof(path), NUMA_SYSFS "/node%d/cpulist", id);
+    if (read_line(path, buf, sizeof(buf)) != 0 ||
+        parse_list(buf, &found[n].cpus) != 0 ||
+        CPU_COUNT(&found[n].cpus) == 0) {
+      continue; // memory-only node, nothing to run there
+    }
+    found[n].id = id;
+    n++;
+  }
+  if (n == 0) {
+    WARN_MSG("[NUMA_POLICY] No online node with CPUs selected, placement is "
+             "off");
+    return -1;
+  }
+
+  memcpy(nodes, found, n * sizeof(NumaNode));
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    cpu_node[cpu] = -1;
+    for (int i = 0; i < n; i++) {
+      if (CPU_ISSET(cpu, &nodes[i].cpus)) {
+        cpu_node[cpu] = (short)i;
+      }
+    }
+  }
+  n_nodes = n;
+  DEBUG_MSG("[NUMA_POLICY] Spreading workers and buffers over %d nodes", n);
+  return n;
+}
+
+int numa_policy_nodes(void) { return n_nodes > 0 ? n_nodes : 1; }
+
+int numa_policy_local(void) {
+  if (n_nodes == 0) {
+    return 0;
+  }
+  int cpu = sched_getcpu();
+  if (cpu < 0 || cpu >= CPU_SETSIZE || cpu_node[cpu] < 0) {
+    return 0;
+  }
+  return cpu_node[cpu];
+}
+
+int numa_policy_bind_thread(int node) {
+  if (n_nodes == 0) {
+    return 0;
+  }
+  node = node < 0 ? 0 : node % n_nodes;
+  if (sched_setaffinity(0, sizeof(cpu_set_t), &nodes[node].cpus) != 0) {
+    ERROR_MSG("[NUMA_POLICY] Failed to pin a thread to node %d: %s",
+              nodes[node].id, strerror(errno));
+    return -1;
+  }
+  unsigned long mask[NUMA_MASK_WORDS];
+  node_mask_of(node, mask);
+  if (syscall(SYS_set_mempolicy, NUMA_MPOL_PREFERRED, mask,
+              NUMA_MAX_NODE_ID) != 0) {
+    ERROR_MSG("[NUMA_POLICY] Failed to prefer the memory of node %d: %s",
+              nodes[node].id, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int numa_policy_steer_thread(void) {
+  if (n_nodes == 0) {
+    return 0;
+  }
+  if (steered_node < 0) {
+    int node =
+        (int)(__atomic_fetch_add(&next_steer, 1, __ATOMIC_RELAXED) % n_nodes);
+    (void)numa_policy_bind_thread(node);
+    steered_node = node; // not retried on error, the thread just isn't pinned
+  }
+  return steered_node;
+}
+
+int numa_policy_bind_memory(void *addr, size_t length, int node) {
+  if (n_nodes == 0) {
+    return 0;
+  }
+  node = node < 0 ? 0 : node % n_nodes;
+  unsigned long mask[NUMA_MASK_WORDS];
+  node_mask_of(node, mask);
+  if (syscall(SYS_mbind, addr, length, NUMA_MPOL_PREFERRED, mask,
+              NUMA_MAX_NODE_ID, 0) != 0) {
+    return -1;
+  }
+  return 0;
+}
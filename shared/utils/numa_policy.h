@@ -0,0 +1,84 @@
+#ifndef NUMA_POLICY_H
+#define NUMA_POLICY_H
+
+#include <stddef.h>
+
+/*
+ * ============================================================================
+ * NUMA POLICY - NODE PLACEMENT OF THE WORKERS AND BUFFERS OF THE PROCESS
+ * ============================================================================
+ *
+ * Process-wide set of the NUMA nodes the shared worker pools and the shared
+ * buffer pool are spread over, configured by the `numa` keys of the
+ * `[services]` table.
+ *
+ * - Nodes are numbered by their index in the set, from 0 to
+ *   numa_policy_nodes() - 1; the kernel node ids are only needed to pin.
+ * - A pinned thread runs on the CPUs of its node only and prefers its memory
+ *   for the pages it touches first (MPOL_PREFERRED), so what it allocates
+ *   stays node-local while the node has free memory.
+ * - Without a configuration, or on a single node machine, there is a single
+ *   node, index 0, and pinning does nothing: callers don't need to tell the
+ *   two cases apart.
+ *
+ * The topology is read from sysfs and the policies set with the raw system
+ * calls, so libnuma is not needed.
+ * ============================================================================
+ */
+
+#define NUMA_POLICY_MAX_NODES 8 // nodes of the set at most
+
+/**
+ * @brief Spread the workers and buffers over NUMA nodes
+ *
+ * Only effective before the first pool is created. Nodes of node_mask that
+ * are not online, or have no CPU, are left out.
+ *
+ * @param node_mask -> bit n set to use node n, 0 for every online node
+ * @return int -> nodes of the set, -1 if the topology can't be read (the
+ * process then works on a single node)
+ */
+int numa_policy_configure(unsigned long node_mask);
+
+/**
+ * @brief Nodes of the set, 1 when NUMA placement is off
+ */
+int numa_policy_nodes(void);
+
+/**
+ * @brief Index of the node of the CPU the calling thread runs on
+ *
+ * @return int -> node index, 0 when NUMA placement is off or the CPU belongs
+ * to a node outside the set
+ */
+int numa_policy_local(void);
+
+/**
+ * @brief Pin the calling thread to a node of the set
+ *
+ * @param node -> node index, taken modulo numa_policy_nodes()
+ * @return int -> 0 on success (placement off included), -1 on error
+ */
+int numa_policy_bind_thread(int node);
+
+/**
+ * @brief Pin the calling thread to the next node, round robin, once
+ *
+ * For threads the process does not start itself (the FUSE loop): the first
+ * call of a thread pins it, the next ones return the same node.
+ *
+ * @return int -> node index of the thread
+ */
+int numa_policy_steer_thread(void);
+
+/**
+ * @brief Place the pages of a mapping on a node of the set
+ *
+ * @param addr -> page aligned start of the mapping, not touched yet
+ * @param length -> bytes of the mapping
+ * @param node -> node index
+ * @return int -> 0 on success (placement off included), -1 on error
+ */
+int numa_policy_bind_memory(void *addr, size_t length, int node);
+
+#endif // NUMA_POLICY_H
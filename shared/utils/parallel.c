@@ -1,6 +1,7 @@
 #include "parallel.h"
 #include "../../logdef.h"
 #include "../../shared/types/layer_context.h"
+#include "layer_iov.h"
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,15 +26,19 @@ static void init_int_results_array(int *results, int nlayers) {
 void *parallel_write_worker(void *arg) {
   WriteThreadParams *params = (WriteThreadParams *)arg;
 
-  *params->result_ptr = params->layer_context->ops->lpwrite(
-      params->layer_fd, params->buffer, params->nbyte, params->offset,
-      *params->layer_context);
+  if (params->iov) {
+    *params->result_ptr =
+        layer_pwritev(params->layer_fd, params->iov, params->iovcnt,
+                      params->offset, *params->layer_context);
+  } else {
+    *params->result_ptr = params->layer_context->ops->lpwrite(
+        params->layer_fd, params->buffer, params->nbyte, params->offset,
+        *params->layer_context);
+  }
 
   DEBUG_MSG("layer %d wrote %ld bytes", params->layer_index,
             *params->result_ptr);
 
-  free(params);
-
   return NULL;
 }
 
@@ -42,14 +47,9 @@ void *parallel_read_worker(void *arg) {
   ReadThreadParams *params = (ReadThreadParams *)arg;
 
   *params->result_ptr = params->layer_context->ops->lpread(
-      params->layer_fd, params->thread_buffer, params->nbyte, params->offset,
+      params->layer_fd, params->buffer, params->nbyte, params->offset,
       *params->layer_context);
 
-  if (params->thread_buffers_array) {
-    params->thread_buffers_array[params->layer_index] = params->thread_buffer;
-  }
-
-  free(params);
   return NULL;
 }
 
@@ -68,7 +68,6 @@ void *parallel_fstat_worker(void *arg) {
   DEBUG_MSG("layer %d fstat with result %d", params->layer_index,
             *params->result_ptr);
 
-  free(params);
   return NULL;
 }
 
@@ -92,7 +91,6 @@ void *parallel_lstat_worker(void *arg) {
 
   // Don't free thread_stbuf here - demultiplexer will clean it up after
   // deciding which layer's data to use
-  free(params);
   return NULL;
 }
 
@@ -106,8 +104,6 @@ void *parallel_open_worker(void *arg) {
   DEBUG_MSG("layer %d opened with fd %d", params->layer_index,
             *params->result_ptr);
 
-  free(params);
-
   return NULL;
 }
 
@@ -121,8 +117,6 @@ void *parallel_close_worker(void *arg) {
   DEBUG_MSG("layer %d closed with result %d", params->layer_index,
             *params->result_ptr);
 
-  free(params);
-
   return NULL;
 }
 
@@ -141,8 +135,6 @@ void *parallel_ftruncate_worker(void *arg) {
               *params->result_ptr);
   }
 
-  free(params);
-
   return NULL;
 }
 
@@ -161,40 +153,79 @@ void *parallel_unlink_worker(void *arg) {
               *params->result_ptr);
   }
 
-  free(params);
   return NULL;
 }
 
-// Auxiliary function to create a write thread
-static int create_write_thread(pthread_t *thread, int layer_index, int layer_fd,
-                               LayerContext *layer_context, const void *buffer,
-                               size_t nbyte, off_t offset,
-                               ssize_t *result_ptr) {
-  // Allocate parameter structure on heap
-  WriteThreadParams *params = malloc(sizeof(WriteThreadParams));
-  if (!params) {
+// Prepare batch for a fan-out to nlayers layers
+static int start_batch(ThreadPool *pool, ParallelBatch *batch, int nlayers,
+                       int *active_threads) {
+  *active_threads = 0;
+  if (!pool || !batch || nlayers <= 0 || nlayers > PARALLEL_MAX_TASKS ||
+      nlayers > pool->nqueues) {
+    ERROR_MSG("[PARALLEL_START_BATCH] Cannot fan out to %d layers", nlayers);
     return -1;
   }
+  batch->pool = pool;
+  thread_pool_batch_init(&batch->batch);
+  return 0;
+}
+
+// Queue the task of a layer, whose params are already set, on its own queue
+static int submit_task(ParallelBatch *batch, int layer_index, ThreadPoolFn fn) {
+  ParallelTask *task = &batch->tasks[layer_index];
+  return thread_pool_submit(batch->pool, layer_index, &task->task,
+                            &batch->batch, fn, &task->params);
+}
+
+void parallel_batch_wait(ParallelBatch *batch) {
+  thread_pool_wait(batch->pool, &batch->batch);
+}
+
+// Auxiliary function to queue a write task
+static int create_write_task(ParallelBatch *batch, int layer_index,
+                             int layer_fd, LayerContext *layer_context,
+                             const void *buffer, size_t nbyte, off_t offset,
+                             ssize_t *result_ptr) {
+  WriteThreadParams *params = &batch->tasks[layer_index].params.write;
 
   params->layer_index = layer_index;
   params->layer_fd = layer_fd;
   params->buffer = buffer;
   params->nbyte = nbyte;
+  params->iov = NULL;
+  params->iovcnt = 0;
   params->offset = offset;
   params->result_ptr = result_ptr;
   params->layer_context = layer_context;
 
-  return pthread_create(thread, NULL, parallel_write_worker, (void *)params);
+  return submit_task(batch, layer_index, parallel_write_worker);
 }
 
-// Auxiliary function to create an open thread
-static int create_open_thread(pthread_t *thread, int layer_index,
-                              const char *pathname, int flags, mode_t mode,
-                              LayerContext *layer_context, int *result_ptr) {
-  OpenThreadParams *params = malloc(sizeof(OpenThreadParams));
-  if (!params) {
-    return -1;
-  }
+// Auxiliary function to queue a pwritev task
+static int create_writev_task(ParallelBatch *batch, int layer_index,
+                              int layer_fd, LayerContext *layer_context,
+                              const struct iovec *iov, int iovcnt,
+                              off_t offset, ssize_t *result_ptr) {
+  WriteThreadParams *params = &batch->tasks[layer_index].params.write;
+
+  params->layer_index = layer_index;
+  params->layer_fd = layer_fd;
+  params->buffer = NULL;
+  params->nbyte = 0;
+  params->iov = iov;
+  params->iovcnt = iovcnt;
+  params->offset = offset;
+  params->result_ptr = result_ptr;
+  params->layer_context = layer_context;
+
+  return submit_task(batch, layer_index, parallel_write_worker);
+}
+
+// Auxiliary function to queue an open task
+static int create_open_task(ParallelBatch *batch, int layer_index,
+                            const char *pathname, int flags, mode_t mode,
+                            LayerContext *layer_context, int *result_ptr) {
+  OpenThreadParams *params = &batch->tasks[layer_index].params.open;
 
   params->layer_index = layer_index;
   params->pathname = pathname;
@@ -203,92 +234,54 @@ static int create_open_thread(pthread_t *thread, int layer_index,
   params->result_ptr = result_ptr;
   params->layer_context = layer_context;
 
-  return pthread_create(thread, NULL, parallel_open_worker, (void *)params);
+  return submit_task(batch, layer_index, parallel_open_worker);
 }
 
-// Auxiliary function to create a close thread
-static int create_close_thread(pthread_t *thread, int layer_index, int layer_fd,
-                               LayerContext *layer_context, int *result_ptr) {
-  CloseThreadParams *params = malloc(sizeof(CloseThreadParams));
-  if (!params) {
-    return -1;
-  }
+// Auxiliary function to queue a close task
+static int create_close_task(ParallelBatch *batch, int layer_index,
+                             int layer_fd, LayerContext *layer_context,
+                             int *result_ptr) {
+  CloseThreadParams *params = &batch->tasks[layer_index].params.close;
 
   params->layer_index = layer_index;
   params->layer_fd = layer_fd;
   params->result_ptr = result_ptr;
   params->layer_context = layer_context;
 
-  return pthread_create(thread, NULL, parallel_close_worker, (void *)params);
+  return submit_task(batch, layer_index, parallel_close_worker);
 }
 
-// Auxiliary function to create a read thread
-static int create_read_thread(pthread_t *thread, int layer_index, int layer_fd,
-                              LayerContext *layer_context, void *buffer,
-                              size_t nbyte, off_t offset, ssize_t *result_ptr,
-                              void **thread_buffers_array) {
-  ReadThreadParams *params = malloc(sizeof(ReadThreadParams));
-  if (!params) {
-    ERROR_MSG("Failed to allocate ReadThreadParams for layer %d\n",
-              layer_index);
-    return -1;
-  }
-
-  void *thread_buffer = malloc(nbyte);
-  if (!thread_buffer) {
-    ERROR_MSG("Failed to allocate thread buffer for layer %d\n", layer_index);
-    free(params);
-    return -1;
-  }
+// Auxiliary function to queue a read task
+static int create_read_task(ParallelBatch *batch, int layer_index,
+                            int layer_fd, LayerContext *layer_context,
+                            void *buffer, size_t nbyte, off_t offset,
+                            ssize_t *result_ptr) {
+  ReadThreadParams *params = &batch->tasks[layer_index].params.read;
 
   params->layer_index = layer_index;
   params->layer_fd = layer_fd;
   params->result_ptr = result_ptr;
   params->layer_context = layer_context;
-  params->thread_buffer = thread_buffer;
-  params->original_buffer = buffer;
+  params->buffer = buffer;
   params->nbyte = nbyte;
   params->offset = offset;
-  params->thread_buffers_array = thread_buffers_array;
-
-  int result =
-      pthread_create(thread, NULL, parallel_read_worker, (void *)params);
-  if (result != 0) {
-    ERROR_MSG("Failed to create read thread for layer %d: %s\n", layer_index,
-              strerror(result));
-    free(thread_buffer);
-    free(params);
-    return -1;
-  }
 
-  return 0;
+  return submit_task(batch, layer_index, parallel_read_worker);
 }
 
-// Auxiliary function to create a fstat thread
-static int create_fstat_thread(pthread_t *thread, int layer_index, int layer_fd,
-                               LayerContext *layer_context, struct stat *stbuf,
-                               int *result_ptr, int *errno_ptr,
-                               struct stat **stbuf_array) {
-  FstatThreadParams *params = malloc(sizeof(FstatThreadParams));
-  if (!params) {
-    ERROR_MSG("Failed to allocate FstatThreadParams for layer %d\n",
-              layer_index);
-    return -1;
-  }
+// Auxiliary function to queue a fstat task
+static int create_fstat_task(ParallelBatch *batch, int layer_index,
+                             int layer_fd, LayerContext *layer_context,
+                             struct stat *stbuf, int *result_ptr,
+                             int *errno_ptr, struct stat **stbuf_array) {
+  FstatThreadParams *params = &batch->tasks[layer_index].params.fstat;
 
   void *thread_stbuf = malloc(sizeof(struct stat));
   if (!thread_stbuf) {
     ERROR_MSG("Failed to allocate thread stbuf for layer %d\n", layer_index);
-    free(params);
     return -1;
   }
 
-  // Store the thread-specific buffer in the array so demultiplexer can access
-  // it
-  if (stbuf_array) {
-    stbuf_array[layer_index] = (struct stat *)thread_stbuf;
-  }
-
   params->layer_index = layer_index;
   params->layer_fd = layer_fd;
   params->result_ptr = result_ptr;
@@ -297,45 +290,35 @@ static int create_fstat_thread(pthread_t *thread, int layer_index, int layer_fd,
   params->thread_stbuf = thread_stbuf;
   params->original_stbuf = stbuf;
 
-  int result =
-      pthread_create(thread, NULL, parallel_fstat_worker, (void *)params);
-  if (result != 0) {
-    ERROR_MSG("Failed to create fstat thread for layer %d: %s\n", layer_index,
-              strerror(result));
+  if (submit_task(batch, layer_index, parallel_fstat_worker) != 0) {
+    ERROR_MSG("Failed to queue fstat task for layer %d\n", layer_index);
     free(thread_stbuf);
-    free(params);
     return -1;
   }
 
+  // Store the thread-specific buffer in the array so demultiplexer can access
+  // it
+  if (stbuf_array) {
+    stbuf_array[layer_index] = (struct stat *)thread_stbuf;
+  }
+
   return 0;
 }
 
-// Auxiliary function to create a lstat thread
-static int create_lstat_thread(pthread_t *thread, int layer_index,
-                               const char *path, LayerContext *layer_context,
-                               struct stat *stbuf, int *result_ptr,
-                               int *errno_ptr, struct stat **stbuf_array) {
-  LstatThreadParams *params = malloc(sizeof(LstatThreadParams));
-  if (!params) {
-    ERROR_MSG("Failed to allocate LstatThreadParams for layer %d\n",
-              layer_index);
-    return -1;
-  }
+// Auxiliary function to queue a lstat task
+static int create_lstat_task(ParallelBatch *batch, int layer_index,
+                             const char *path, LayerContext *layer_context,
+                             struct stat *stbuf, int *result_ptr,
+                             int *errno_ptr, struct stat **stbuf_array) {
+  LstatThreadParams *params = &batch->tasks[layer_index].params.lstat;
 
   void *thread_stbuf = malloc(sizeof(struct stat));
   if (!thread_stbuf) {
     ERROR_MSG("Failed to allocate thread stbuf for lstat thread for layer %d\n",
               layer_index);
-    free(params);
     return -1;
   }
 
-  // Store the thread-specific buffer in the array so demultiplexer can access
-  // it
-  if (stbuf_array) {
-    stbuf_array[layer_index] = (struct stat *)thread_stbuf;
-  }
-
   params->layer_index = layer_index;
   params->path = path;
   params->result_ptr = result_ptr;
@@ -344,27 +327,26 @@ static int create_lstat_thread(pthread_t *thread, int layer_index,
   params->thread_stbuf = thread_stbuf;
   params->original_stbuf = stbuf;
 
-  int result =
-      pthread_create(thread, NULL, parallel_lstat_worker, (void *)params);
-  if (result != 0) {
-    ERROR_MSG("Failed to create lstat thread for layer %d: %s\n", layer_index,
-              strerror(result));
+  if (submit_task(batch, layer_index, parallel_lstat_worker) != 0) {
+    ERROR_MSG("Failed to queue lstat task for layer %d\n", layer_index);
     free(thread_stbuf);
-    free(params);
     return -1;
   }
 
+  // Store the thread-specific buffer in the array so demultiplexer can access
+  // it
+  if (stbuf_array) {
+    stbuf_array[layer_index] = (struct stat *)thread_stbuf;
+  }
+
   return 0;
 }
 
-// Auxiliary function to create a ftruncate thread
-static int create_ftruncate_thread(pthread_t *thread, int layer_index,
-                                   int layer_fd, LayerContext *layer_context,
-                                   int *result_ptr, off_t length) {
-  FtruncateThreadParams *params = malloc(sizeof(FtruncateThreadParams));
-  if (!params) {
-    return -1;
-  }
+// Auxiliary function to queue a ftruncate task
+static int create_ftruncate_task(ParallelBatch *batch, int layer_index,
+                                 int layer_fd, LayerContext *layer_context,
+                                 int *result_ptr, off_t length) {
+  FtruncateThreadParams *params = &batch->tasks[layer_index].params.ftruncate;
 
   params->layer_index = layer_index;
   params->layer_fd = layer_fd;
@@ -372,181 +354,176 @@ static int create_ftruncate_thread(pthread_t *thread, int layer_index,
   params->layer_context = layer_context;
   params->length = length;
 
-  return pthread_create(thread, NULL, parallel_ftruncate_worker,
-                        (void *)params);
+  return submit_task(batch, layer_index, parallel_ftruncate_worker);
 }
 
-// Auxiliary function to create a unlink thread
-static int create_unlink_thread(pthread_t *thread, int layer_index,
-                                const char *pathname,
-                                LayerContext *layer_context, int *result_ptr) {
-  UnlinkThreadParams *params = malloc(sizeof(UnlinkThreadParams));
-  if (!params) {
-    return -1;
-  }
+// Auxiliary function to queue a unlink task
+static int create_unlink_task(ParallelBatch *batch, int layer_index,
+                              const char *pathname,
+                              LayerContext *layer_context, int *result_ptr) {
+  UnlinkThreadParams *params = &batch->tasks[layer_index].params.unlink;
 
   params->layer_index = layer_index;
   params->pathname = pathname;
   params->result_ptr = result_ptr;
   params->layer_context = layer_context;
 
-  return pthread_create(thread, NULL, parallel_unlink_worker, (void *)params);
+  return submit_task(batch, layer_index, parallel_unlink_worker);
 }
 
 // Execute parallel write operations across multiple layers
-pthread_t *execute_parallel_writes(LayerContext *layers, int nlayers,
-                                   int *layer_fds, const void *buffer,
-                                   size_t nbyte, off_t offset, ssize_t *results,
-                                   int *active_threads) {
-  pthread_t *threads = malloc(nlayers * sizeof(pthread_t));
-  if (!threads) {
-    *active_threads = 0;
-    return NULL;
+int execute_parallel_writes(ThreadPool *pool, ParallelBatch *batch,
+                            LayerContext *layers, int nlayers, int *layer_fds,
+                            const void *buffer, size_t nbyte, off_t offset,
+                            ssize_t *results, int *active_threads) {
+  if (start_batch(pool, batch, nlayers, active_threads) != 0) {
+    return -1;
   }
 
-  *active_threads = 0;
-
   init_results_array(results, nlayers);
 
   for (int i = 0; i < nlayers; i++) {
-    if (create_write_thread(&threads[*active_threads], i, layer_fds[i],
-                            &layers[i], buffer, nbyte, offset,
-                            &results[i]) != 0) {
+    if (create_write_task(batch, i, layer_fds[i], &layers[i], buffer, nbyte,
+                          offset, &results[i]) != 0) {
       ERROR_MSG("Failed to create write thread for layer %d\n", i);
       continue;
     }
     (*active_threads)++;
   }
 
-  return threads;
+  return 0;
 }
 
-// Execute parallel open operations across multiple layers
-pthread_t *execute_parallel_opens(LayerContext *layers, int nlayers,
-                                  const char *pathname, int flags, mode_t mode,
-                                  int *results, int *active_threads) {
-  pthread_t *threads = malloc(nlayers * sizeof(pthread_t));
-  if (!threads) {
-    *active_threads = 0;
-    return NULL;
+// Execute parallel pwritev operations across multiple layers
+int execute_parallel_writevs(ThreadPool *pool, ParallelBatch *batch,
+                             LayerContext *layers, int nlayers, int *layer_fds,
+                             const struct iovec *iov, int iovcnt, off_t offset,
+                             ssize_t *results, int *active_threads) {
+  if (start_batch(pool, batch, nlayers, active_threads) != 0) {
+    return -1;
   }
 
-  *active_threads = 0;
+  init_results_array(results, nlayers);
+
+  for (int i = 0; i < nlayers; i++) {
+    if (create_writev_task(batch, i, layer_fds[i], &layers[i], iov, iovcnt,
+                           offset, &results[i]) != 0) {
+      ERROR_MSG("Failed to create writev thread for layer %d\n", i);
+      continue;
+    }
+    (*active_threads)++;
+  }
+
+  return 0;
+}
+
+// Execute parallel open operations across multiple layers
+int execute_parallel_opens(ThreadPool *pool, ParallelBatch *batch,
+                           LayerContext *layers, int nlayers,
+                           const char *pathname, int flags, mode_t mode,
+                           int *results, int *active_threads) {
+  if (start_batch(pool, batch, nlayers, active_threads) != 0) {
+    return -1;
+  }
 
   init_int_results_array(results, nlayers);
 
   for (int i = 0; i < nlayers; i++) {
-    if (create_open_thread(&threads[*active_threads], i, pathname, flags, mode,
-                           &layers[i], &results[i]) != 0) {
+    if (create_open_task(batch, i, pathname, flags, mode, &layers[i],
+                         &results[i]) != 0) {
       ERROR_MSG("Failed to create open thread for layer %d\n", i);
       continue;
     }
     (*active_threads)++;
   }
 
-  return threads;
+  return 0;
 }
 
 // Execute parallel close operations across multiple layers
-pthread_t *execute_parallel_closes(LayerContext *layers, int nlayers,
-                                   int *layer_fds, int *results,
-                                   int *active_threads) {
-  pthread_t *threads = malloc(nlayers * sizeof(pthread_t));
-  if (!threads) {
-    *active_threads = 0;
-    return NULL;
+int execute_parallel_closes(ThreadPool *pool, ParallelBatch *batch,
+                            LayerContext *layers, int nlayers, int *layer_fds,
+                            int *results, int *active_threads) {
+  if (start_batch(pool, batch, nlayers, active_threads) != 0) {
+    return -1;
   }
 
-  *active_threads = 0;
-
   init_int_results_array(results, nlayers);
 
   for (int i = 0; i < nlayers; i++) {
-    if (create_close_thread(&threads[*active_threads], i, layer_fds[i],
-                            &layers[i], &results[i]) != 0) {
+    if (create_close_task(batch, i, layer_fds[i], &layers[i], &results[i]) !=
+        0) {
       ERROR_MSG("Failed to create close thread for layer %d\n", i);
       continue;
     }
     (*active_threads)++;
   }
 
-  return threads;
+  return 0;
 }
 
 /**
  * @brief Execute parallel read operations across multiple layers
  *
- * This function creates a thread for each layer and waits for all threads to
- * complete. The thread buffers are stored in the thread_buffers array.
+ * This function queues a task for each layer that has a buffer: layer i
+ * reads straight into buffers[i], which the caller provides (for instance
+ * its own buffer for one layer and scratch space for the others). Layers
+ * with a NULL buffer are skipped and keep a -1 result.
  *
- * The caller must wait for intended threads to complete and copy the data from
- * the thread buffers to the buffer array.
+ * The caller must wait for the batch to complete before using the buffers.
  *
+ * @param pool The thread pool to run the reads on
+ * @param batch The batch to wait for
  * @param layers The array of layer contexts
  * @param nlayers The number of layers
  * @param layer_fds The array of layer file descriptors
- * @param buffer The buffer to write the read data to
+ * @param buffers The per-layer buffers to read into, of nbyte bytes each
  * @param nbyte The number of bytes to read
  * @param offset The offset to read from
  * @param results The array of results
- * @param active_threads The number of active threads
- * @param thread_buffers The array of thread buffers
- * @return The array of threads
+ * @param active_threads The number of queued tasks
+ * @return 0 on success, -1 if nothing was queued
  */
-pthread_t *execute_parallel_reads(LayerContext *layers, int nlayers,
-                                  int *layer_fds, void *buffer, size_t nbyte,
-                                  off_t offset, ssize_t *results,
-                                  int *active_threads, void ***thread_buffers) {
-  pthread_t *threads = malloc(nlayers * sizeof(pthread_t));
-  if (!threads) {
-    *active_threads = 0;
-    return NULL;
+int execute_parallel_reads(ThreadPool *pool, ParallelBatch *batch,
+                           LayerContext *layers, int nlayers, int *layer_fds,
+                           void **buffers, size_t nbyte, off_t offset,
+                           ssize_t *results, int *active_threads) {
+  if (start_batch(pool, batch, nlayers, active_threads) != 0) {
+    return -1;
   }
 
-  *active_threads = 0;
-
   init_results_array(results, nlayers);
 
-  void **buffers_array = (void **)calloc(nlayers, sizeof(void *));
-  if (!buffers_array) {
-    free(threads);
-    *active_threads = 0;
-    return NULL;
-  }
-
-  *thread_buffers = buffers_array;
-
   for (int i = 0; i < nlayers; i++) {
-    if (create_read_thread(&threads[*active_threads], i, layer_fds[i],
-                           &layers[i], buffer, nbyte, offset, &results[i],
-                           buffers_array) != 0) {
+    if (!buffers[i]) {
+      continue;
+    }
+    if (create_read_task(batch, i, layer_fds[i], &layers[i], buffers[i], nbyte,
+                         offset, &results[i]) != 0) {
       ERROR_MSG("Failed to create read thread for layer %d\n", i);
       continue;
     }
     (*active_threads)++;
   }
 
-  return threads;
+  return 0;
 }
 
-pthread_t *execute_parallel_fstats(LayerContext *layers, int nlayers,
-                                   int *layer_fds, struct stat *stbuf,
-                                   int *results, int *active_threads,
-                                   int *thread_errnos,
-                                   struct stat ***thread_stbufs) {
-  pthread_t *threads = malloc(nlayers * sizeof(pthread_t));
-  if (!threads) {
-    *active_threads = 0;
-    return NULL;
+int execute_parallel_fstats(ThreadPool *pool, ParallelBatch *batch,
+                            LayerContext *layers, int nlayers, int *layer_fds,
+                            struct stat *stbuf, int *results,
+                            int *active_threads, int *thread_errnos,
+                            struct stat ***thread_stbufs) {
+  if (start_batch(pool, batch, nlayers, active_threads) != 0) {
+    return -1;
   }
 
   // Allocate array of pointers to thread stat buffers
   struct stat **stbuf_array =
       (struct stat **)malloc(nlayers * sizeof(struct stat *));
   if (!stbuf_array) {
-    free(threads);
-    *active_threads = 0;
-    return NULL;
+    parallel_batch_wait(batch);
+    return -1;
   }
 
   // Initialize all pointers to NULL
@@ -554,7 +531,6 @@ pthread_t *execute_parallel_fstats(LayerContext *layers, int nlayers,
     stbuf_array[i] = NULL;
   }
 
-  *active_threads = 0;
   *thread_stbufs = stbuf_array;
 
   init_int_results_array(results, nlayers);
@@ -568,37 +544,33 @@ pthread_t *execute_parallel_fstats(LayerContext *layers, int nlayers,
         thread_errnos[i] = ENOSYS;
       continue;
     }
-    if (create_fstat_thread(&threads[*active_threads], i, layer_fds[i],
-                            &layers[i], stbuf, &results[i],
-                            thread_errnos ? &thread_errnos[i] : NULL,
-                            stbuf_array) != 0) {
+    if (create_fstat_task(batch, i, layer_fds[i], &layers[i], stbuf,
+                          &results[i], thread_errnos ? &thread_errnos[i] : NULL,
+                          stbuf_array) != 0) {
       ERROR_MSG("Failed to create fstat thread for layer %d\n", i);
       continue;
     }
     (*active_threads)++;
   }
 
-  return threads;
+  return 0;
 }
 
-pthread_t *execute_parallel_lstats(LayerContext *layers, int nlayers,
-                                   const char *path, struct stat *stbuf,
-                                   int *results, int *active_threads,
-                                   int *thread_errnos,
-                                   struct stat ***thread_stbufs) {
-  pthread_t *threads = malloc(nlayers * sizeof(pthread_t));
-  if (!threads) {
-    *active_threads = 0;
-    return NULL;
+int execute_parallel_lstats(ThreadPool *pool, ParallelBatch *batch,
+                            LayerContext *layers, int nlayers,
+                            const char *path, struct stat *stbuf, int *results,
+                            int *active_threads, int *thread_errnos,
+                            struct stat ***thread_stbufs) {
+  if (start_batch(pool, batch, nlayers, active_threads) != 0) {
+    return -1;
   }
 
   // Allocate array of pointers to thread stat buffers
   struct stat **stbuf_array =
       (struct stat **)malloc(nlayers * sizeof(struct stat *));
   if (!stbuf_array) {
-    free(threads);
-    *active_threads = 0;
-    return NULL;
+    parallel_batch_wait(batch);
+    return -1;
   }
 
   // Initialize all pointers to NULL
@@ -606,7 +578,6 @@ pthread_t *execute_parallel_lstats(LayerContext *layers, int nlayers,
     stbuf_array[i] = NULL;
   }
 
-  *active_threads = 0;
   *thread_stbufs = stbuf_array;
 
   init_int_results_array(results, nlayers);
@@ -620,34 +591,31 @@ pthread_t *execute_parallel_lstats(LayerContext *layers, int nlayers,
         thread_errnos[i] = ENOSYS;
       continue;
     }
-    if (create_lstat_thread(
-            &threads[*active_threads], i, path, &layers[i], stbuf, &results[i],
-            thread_errnos ? &thread_errnos[i] : NULL, stbuf_array) != 0) {
+    if (create_lstat_task(batch, i, path, &layers[i], stbuf, &results[i],
+                          thread_errnos ? &thread_errnos[i] : NULL,
+                          stbuf_array) != 0) {
       ERROR_MSG("Failed to create lstat thread for layer %d\n", i);
       continue;
     }
     (*active_threads)++;
   }
 
-  return threads;
+  return 0;
 }
 
-pthread_t *execute_parallel_ftruncates(LayerContext *layers, int nlayers,
-                                       int *layer_fds, off_t length,
-                                       int *results, int *active_threads) {
-  pthread_t *threads = malloc(nlayers * sizeof(pthread_t));
-  if (!threads) {
-    *active_threads = 0;
-    return NULL;
+int execute_parallel_ftruncates(ThreadPool *pool, ParallelBatch *batch,
+                                LayerContext *layers, int nlayers,
+                                int *layer_fds, off_t length, int *results,
+                                int *active_threads) {
+  if (start_batch(pool, batch, nlayers, active_threads) != 0) {
+    return -1;
   }
 
-  *active_threads = 0;
-
   init_int_results_array(results, nlayers);
 
   for (int i = 0; i < nlayers; i++) {
-    if (create_ftruncate_thread(&threads[*active_threads], i, layer_fds[i],
-                                &layers[i], &results[i], length) != 0) {
+    if (create_ftruncate_task(batch, i, layer_fds[i], &layers[i], &results[i],
+                              length) != 0) {
       ERROR_MSG("[PARALLEL_EXECUTE_PARALLEL_FTRUNCATE] Failed to create "
                 "ftruncate thread for layer %d\n",
                 i);
@@ -656,20 +624,17 @@ pthread_t *execute_parallel_ftruncates(LayerContext *layers, int nlayers,
     (*active_threads)++;
   }
 
-  return threads;
+  return 0;
 }
 
-pthread_t *execute_parallel_unlinks(LayerContext *layers, int nlayers,
-                                    const char *pathname, int *results,
-                                    int *active_threads) {
-  pthread_t *threads = malloc(nlayers * sizeof(pthread_t));
-  if (!threads) {
-    *active_threads = 0;
-    return NULL;
+int execute_parallel_unlinks(ThreadPool *pool, ParallelBatch *batch,
+                             LayerContext *layers, int nlayers,
+                             const char *pathname, int *results,
+                             int *active_threads) {
+  if (start_batch(pool, batch, nlayers, active_threads) != 0) {
+    return -1;
   }
 
-  *active_threads = 0;
-
   init_int_results_array(results, nlayers);
 
   for (int i = 0; i < nlayers; i++) {
@@ -680,13 +645,12 @@ pthread_t *execute_parallel_unlinks(LayerContext *layers, int nlayers,
       results[i] = -1;
       continue;
     }
-    if (create_unlink_thread(&threads[*active_threads], i, pathname, &layers[i],
-                             &results[i]) != 0) {
+    if (create_unlink_task(batch, i, pathname, &layers[i], &results[i]) != 0) {
       ERROR_MSG("Failed to create unlink thread for layer %d\n", i);
       continue;
     }
     (*active_threads)++;
   }
 
-  return threads;
+  return 0;
 }
@@ -1,9 +1,13 @@
 #ifndef PARALLEL_H
 #define PARALLEL_H
 
+#include "thread_pool.h"
 #include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+#define PARALLEL_MAX_TASKS 10 // Most layers a single fan-out can target
 
 // Forward declarations
 typedef struct layer_context LayerContext;
@@ -16,6 +20,8 @@ typedef struct {
   LayerContext *layer_context;
   const void *buffer;
   size_t nbyte;
+  const struct iovec *iov; // Buffers of a pwritev, NULL for a pwrite
+  int iovcnt;
   off_t offset;
 } WriteThreadParams;
 
@@ -25,11 +31,9 @@ typedef struct {
   int layer_fd;
   ssize_t *result_ptr;
   LayerContext *layer_context;
-  void *thread_buffer;   // Each thread gets its own buffer
-  void *original_buffer; // Pointer to the original buffer to copy to
+  void *buffer; // Buffer this layer reads into, owned by the caller
   size_t nbyte;
   off_t offset;
-  void **thread_buffers_array; // Array to store all thread buffer pointers
 } ReadThreadParams;
 
 // Structure to hold thread parameters for fstat operations
@@ -89,6 +93,35 @@ typedef struct {
   LayerContext *layer_context;
 } UnlinkThreadParams;
 
+// One per-layer task of a fan-out: pool task and the parameters it runs with
+typedef struct {
+  ThreadPoolTask task;
+  union {
+    WriteThreadParams write;
+    ReadThreadParams read;
+    FstatThreadParams fstat;
+    LstatThreadParams lstat;
+    OpenThreadParams open;
+    CloseThreadParams close;
+    FtruncateThreadParams ftruncate;
+    UnlinkThreadParams unlink;
+  } params;
+} ParallelTask;
+
+/**
+ * @brief A fan-out of one operation to up to PARALLEL_MAX_TASKS layers
+ *
+ * Owned by the caller (typically on its stack). Task i runs on queue i of the
+ * pool, so each layer keeps its own queue. Every successful
+ * execute_parallel_* call must be followed by parallel_batch_wait() before
+ * the batch, the results or the arguments go out of scope.
+ */
+typedef struct {
+  ThreadPool *pool;
+  ThreadPoolBatch batch;
+  ParallelTask tasks[PARALLEL_MAX_TASKS];
+} ParallelBatch;
+
 // Function declarations
 void *parallel_write_worker(void *arg);
 void *parallel_read_worker(void *arg);
@@ -97,35 +130,51 @@ void *parallel_close_worker(void *arg);
 void *parallel_ftruncate_worker(void *arg);
 void *parallel_unlink_worker(void *arg);
 
-pthread_t *execute_parallel_writes(LayerContext *layers, int nlayers,
-                                   int *layer_fds, const void *buffer,
-                                   size_t nbyte, off_t offset, ssize_t *results,
-                                   int *active_threads);
-pthread_t *execute_parallel_reads(LayerContext *layers, int nlayers,
-                                  int *layer_fds, void *buffer, size_t nbyte,
-                                  off_t offset, ssize_t *results,
-                                  int *active_threads, void ***thread_buffers);
-pthread_t *execute_parallel_opens(LayerContext *layers, int nlayers,
-                                  const char *pathname, int flags, mode_t mode,
-                                  int *results, int *active_threads);
-pthread_t *execute_parallel_closes(LayerContext *layers, int nlayers,
-                                   int *layer_fds, int *results,
-                                   int *active_threads);
-pthread_t *execute_parallel_ftruncates(LayerContext *layers, int nlayers,
-                                       int *layer_fds, off_t length,
-                                       int *results, int *active_threads);
-pthread_t *execute_parallel_fstats(LayerContext *layers, int nlayers,
-                                   int *layer_fds, struct stat *stbuf,
-                                   int *results, int *active_threads,
-                                   int *thread_errnos,
-                                   struct stat ***thread_stbufs);
-pthread_t *execute_parallel_lstats(LayerContext *layers, int nlayers,
-                                   const char *path, struct stat *stbuf,
-                                   int *results, int *active_threads,
-                                   int *thread_errnos,
-                                   struct stat ***thread_stbufs);
-pthread_t *execute_parallel_unlinks(LayerContext *layers, int nlayers,
-                                    const char *pathname, int *results,
-                                    int *active_threads);
+/**
+ * @brief Wait for every task of a batch started by execute_parallel_*
+ *
+ * @param batch -> batch to wait for
+ */
+void parallel_batch_wait(ParallelBatch *batch);
+
+// The execute_parallel_* functions queue one task per layer on pool (which
+// needs at least nlayers queues) and return 0, or -1 if nothing was queued.
+int execute_parallel_writes(ThreadPool *pool, ParallelBatch *batch,
+                            LayerContext *layers, int nlayers, int *layer_fds,
+                            const void *buffer, size_t nbyte, off_t offset,
+                            ssize_t *results, int *active_threads);
+int execute_parallel_writevs(ThreadPool *pool, ParallelBatch *batch,
+                             LayerContext *layers, int nlayers, int *layer_fds,
+                             const struct iovec *iov, int iovcnt, off_t offset,
+                             ssize_t *results, int *active_threads);
+int execute_parallel_reads(ThreadPool *pool, ParallelBatch *batch,
+                           LayerContext *layers, int nlayers, int *layer_fds,
+                           void **buffers, size_t nbyte, off_t offset,
+                           ssize_t *results, int *active_threads);
+int execute_parallel_opens(ThreadPool *pool, ParallelBatch *batch,
+                           LayerContext *layers, int nlayers,
+                           const char *pathname, int flags, mode_t mode,
+                           int *results, int *active_threads);
+int execute_parallel_closes(ThreadPool *pool, ParallelBatch *batch,
+                            LayerContext *layers, int nlayers, int *layer_fds,
+                            int *results, int *active_threads);
+int execute_parallel_ftruncates(ThreadPool *pool, ParallelBatch *batch,
+                                LayerContext *layers, int nlayers,
+                                int *layer_fds, off_t length, int *results,
+                                int *active_threads);
+int execute_parallel_fstats(ThreadPool *pool, ParallelBatch *batch,
+                            LayerContext *layers, int nlayers, int *layer_fds,
+                            struct stat *stbuf, int *results,
+                            int *active_threads, int *thread_errnos,
+                            struct stat ***thread_stbufs);
+int execute_parallel_lstats(ThreadPool *pool, ParallelBatch *batch,
+                            LayerContext *layers, int nlayers,
+                            const char *path, struct stat *stbuf, int *results,
+                            int *active_threads, int *thread_errnos,
+                            struct stat ***thread_stbufs);
+int execute_parallel_unlinks(ThreadPool *pool, ParallelBatch *batch,
+                             LayerContext *layers, int nlayers,
+                             const char *pathname, int *results,
+                             int *active_threads);
 
 #endif // PARALLEL_H
@@ -0,0 +1,237 @@
+#include "reed_solomon.h"
+#include "cpu.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define REED_SOLOMON_X86 1
+#include <immintrin.h>
+#endif
+
+#define GF_POLYNOMIAL 0x11d // x^8 + x^4 + x^3 + x^2 + 1, generator 2
+
+static uint8_t gf_exp[512]; // doubled, so a sum of two logs needs no modulo
+static uint8_t gf_log[256];
+static pthread_once_t gf_tables_once = PTHREAD_ONCE_INIT;
+
+static void build_gf_tables(void) {
+  unsigned int x = 1;
+  for (int i = 0; i < 255; i++) {
+    gf_exp[i] = (uint8_t)x;
+    gf_log[x] = (uint8_t)i;
+    x <<= 1;
+    if (x & 0x100) {
+      x ^= GF_POLYNOMIAL;
+    }
+  }
+  for (int i = 255; i < 512; i++) {
+    gf_exp[i] = gf_exp[i - 255];
+  }
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+  if (a == 0 || b == 0) {
+    return 0;
+  }
+  return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a) { return gf_exp[255 - gf_log[a]]; }
+
+// dst ^= c * src for the multiple of the vector size of len, given the
+// products of c by the low and high nibbles, returns the bytes done
+typedef size_t (*mul_add_fn)(const uint8_t *low, const uint8_t *high,
+                             const uint8_t *src, uint8_t *dst, size_t len);
+
+#ifdef REED_SOLOMON_X86
+// dst ^= c * src for the multiple of 32 bytes of len, returns the bytes done
+__attribute__((target("avx2"))) static size_t
+mul_add_region_avx2(const uint8_t *low, const uint8_t *high,
+                    const uint8_t *src, uint8_t *dst, size_t len) {
+  __m256i low_table =
+      _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)low));
+  __m256i high_table =
+      _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)high));
+  __m256i mask = _mm256_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i lo = _mm256_and_si256(x, mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi64(x, 4), mask);
+    __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low_table, lo),
+                                       _mm256_shuffle_epi8(high_table, hi));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, product));
+  }
+  return i;
+}
+#endif
+
+static size_t mul_add_region_generic(const uint8_t *low, const uint8_t *high,
+                                     const uint8_t *src, uint8_t *dst,
+                                     size_t len) {
+  (void)low;
+  (void)high;
+  (void)src;
+  (void)dst;
+  (void)len;
+  return 0; // all of it left to the scalar loop
+}
+
+static const CpuKernelImpl mul_add_impls[] = {
+#ifdef REED_SOLOMON_X86
+    {"avx2", CPU_AVX2, (CpuKernelFn)mul_add_region_avx2},
+#endif
+    {"generic", 0, (CpuKernelFn)mul_add_region_generic},
+};
+static CpuKernel mul_add_kernel =
+    CPU_KERNEL_INIT("reed_solomon", mul_add_impls);
+
+/**
+ * @brief dst ^= c * src over len bytes
+ */
+static void mul_add_region(uint8_t c, const uint8_t *src, uint8_t *dst,
+                           size_t len) {
+  if (c == 0) {
+    return;
+  }
+  uint8_t low[16];
+  uint8_t high[16];
+  for (int x = 0; x < 16; x++) {
+    low[x] = gf_mul(c, (uint8_t)x);
+    high[x] = gf_mul(c, (uint8_t)(x << 4));
+  }
+
+  mul_add_fn vector = (mul_add_fn)cpu_kernel_select(&mul_add_kernel)->fn;
+  size_t i = vector(low, high, src, dst, len);
+  for (; i < len; i++) {
+    dst[i] ^= low[src[i] & 0x0f] ^ high[src[i] >> 4];
+  }
+}
+
+int reed_solomon_init(ReedSolomon *rs, int data_shards, int parity_shards) {
+  if (!rs || data_shards < 1 || parity_shards < 1 ||
+      data_shards + parity_shards > REED_SOLOMON_MAX_SHARDS) {
+    return -1;
+  }
+  pthread_once(&gf_tables_once, build_gf_tables);
+
+  memset(rs, 0, sizeof(*rs));
+  rs->data_shards = data_shards;
+  rs->parity_shards = parity_shards;
+  for (int i = 0; i < parity_shards; i++) {
+    for (int j = 0; j < data_shards; j++) {
+      rs->parity_matrix[i][j] = gf_inv((uint8_t)((data_shards + i) ^ j));
+    }
+  }
+  return 0;
+}
+
+void reed_solomon_encode(const ReedSolomon *rs, const uint8_t *const *data,
+                         uint8_t *const *parity, size_t len) {
+  for (int i = 0; i < rs->parity_shards; i++) {
+    memset(parity[i], 0, len);
+    for (int j = 0; j < rs->data_shards; j++) {
+      mul_add_region(rs->parity_matrix[i][j], data[j], parity[i], len);
+    }
+  }
+}
+
+/**
+ * @brief Invert a k x k matrix in place by Gauss-Jordan elimination
+ *
+ * @return int -> 0 on success, -1 if the matrix is singular
+ */
+static int invert_matrix(uint8_t matrix[][REED_SOLOMON_MAX_SHARDS], int k) {
+  uint8_t inverse[REED_SOLOMON_MAX_SHARDS][REED_SOLOMON_MAX_SHARDS];
+  memset(inverse, 0, sizeof(inverse));
+  for (int i = 0; i < k; i++) {
+    inverse[i][i] = 1;
+  }
+
+  for (int col = 0; col < k; col++) {
+    int pivot = col;
+    while (pivot < k && matrix[pivot][col] == 0) {
+      pivot++;
+    }
+    if (pivot == k) {
+      return -1;
+    }
+    if (pivot != col) {
+      for (int j = 0; j < k; j++) {
+        uint8_t t = matrix[col][j];
+        matrix[col][j] = matrix[pivot][j];
+        matrix[pivot][j] = t;
+        t = inverse[col][j];
+        inverse[col][j] = inverse[pivot][j];
+        inverse[pivot][j] = t;
+      }
+    }
+    uint8_t scale = gf_inv(matrix[col][col]);
+    for (int j = 0; j < k; j++) {
+      matrix[col][j] = gf_mul(matrix[col][j], scale);
+      inverse[col][j] = gf_mul(inverse[col][j], scale);
+    }
+    for (int row = 0; row < k; row++) {
+      uint8_t factor = matrix[row][col];
+      if (row == col || factor == 0) {
+        continue;
+      }
+      for (int j = 0; j < k; j++) {
+        matrix[row][j] ^= gf_mul(factor, matrix[col][j]);
+        inverse[row][j] ^= gf_mul(factor, inverse[col][j]);
+      }
+    }
+  }
+
+  for (int i = 0; i < k; i++) {
+    memcpy(matrix[i], inverse[i], (size_t)k);
+  }
+  return 0;
+}
+
+int reed_solomon_reconstruct(const ReedSolomon *rs, uint8_t *const *shards,
+                             const bool *present, size_t len) {
+  int k = rs->data_shards;
+  int total = k + rs->parity_shards;
+
+  // the rows of the first k present shards in the generator matrix
+  int used[REED_SOLOMON_MAX_SHARDS];
+  int n_used = 0;
+  for (int i = 0; i < total && n_used < k; i++) {
+    if (present[i]) {
+      used[n_used++] = i;
+    }
+  }
+  if (n_used < k) {
+    return -1;
+  }
+  if (used[k - 1] == k - 1) {
+    return 0; // every data shard is present
+  }
+
+  uint8_t decode[REED_SOLOMON_MAX_SHARDS][REED_SOLOMON_MAX_SHARDS];
+  memset(decode, 0, sizeof(decode));
+  for (int r = 0; r < k; r++) {
+    if (used[r] < k) {
+      decode[r][used[r]] = 1;
+    } else {
+      memcpy(decode[r], rs->parity_matrix[used[r] - k], (size_t)k);
+    }
+  }
+  if (invert_matrix(decode, k) != 0) {
+    return -1;
+  }
+
+  // data[d] = sum over the used shards of decode[d][r] * shard[used[r]]
+  for (int d = 0; d < k; d++) {
+    if (present[d]) {
+      continue;
+    }
+    memset(shards[d], 0, len);
+    for (int r = 0; r < k; r++) {
+      mul_add_region(decode[d][r], shards[used[r]], shards[d], len);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef REED_SOLOMON_H
+#define REED_SOLOMON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * ============================================================================
+ * REED-SOLOMON ERASURE CODE OVER GF(2^8)
+ * ============================================================================
+ *
+ * k data shards are extended with m parity shards of the same length; any k
+ * of the k + m shards give the data back. The code is systematic: parity
+ * shard i is the sum over the data shards j of C[i][j] * data[j], with C the
+ * Cauchy matrix 1 / ((k + i) ^ j), whose square submatrices (and those of
+ * the identity stacked on it) are all invertible.
+ *
+ * Shards are multiplied by a constant with the split nibble tables of ISA-L:
+ * c * x is c * (x & 0xf) ^ c * (x & 0xf0), two 16 entry lookups, done 32
+ * bytes at a time with vpshufb on CPUs with AVX2 (checked at run time), a
+ * byte at a time otherwise.
+ * ============================================================================
+ */
+
+#define REED_SOLOMON_MAX_SHARDS 32 // Most data plus parity shards of a code
+
+typedef struct {
+  int data_shards;   // k
+  int parity_shards; // m
+  uint8_t parity_matrix[REED_SOLOMON_MAX_SHARDS]
+                       [REED_SOLOMON_MAX_SHARDS]; // C, m rows of k
+} ReedSolomon;
+
+/**
+ * @brief Set up a code of data_shards + parity_shards shards
+ *
+ * @param rs            -> code to set up
+ * @param data_shards   -> k, at least 1
+ * @param parity_shards -> m, at least 1, with k + m at most
+ * REED_SOLOMON_MAX_SHARDS
+ * @return int          -> 0 on success, -1 for invalid shard counts
+ */
+int reed_solomon_init(ReedSolomon *rs, int data_shards, int parity_shards);
+
+/**
+ * @brief Compute the parity shards of the data shards
+ *
+ * @param rs     -> code
+ * @param data   -> k data shards of len bytes
+ * @param parity -> m parity shards of len bytes, overwritten
+ * @param len    -> bytes of a shard
+ */
+void reed_solomon_encode(const ReedSolomon *rs, const uint8_t *const *data,
+                         uint8_t *const *parity, size_t len);
+
+/**
+ * @brief Rebuild the missing data shards from any k present shards
+ *
+ * @param rs      -> code
+ * @param shards  -> k data shards then m parity shards of len bytes; the
+ * missing data shards are overwritten, the parity shards are left as is
+ * @param present -> whether each of the k + m shards holds valid data
+ * @param len     -> bytes of a shard
+ * @return int    -> 0 on success, -1 with fewer than k present shards
+ */
+int reed_solomon_reconstruct(const ReedSolomon *rs, uint8_t *const *shards,
+                             const bool *present, size_t len);
+
+#endif // REED_SOLOMON_H
@@ -0,0 +1,245 @@
+#include "thread_pool.h"
+#include "../../logdef.h"
+#include "numa_policy.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * ============================================================================
+ * THREAD POOL IMPLEMENTATION
+ * ============================================================================
+ *
+ * All queues share the pool mutex and a single condition variable: a queue
+ * operation is a couple of pointer updates, far cheaper than the I/O the
+ * tasks do, and a single wake condition lets any sleeping worker pick up a
+ * task of any queue (which is what stealing needs). The per-queue FIFOs keep
+ * each target's tasks in submission order and let workers prefer their home.
+ * ============================================================================
+ */
+
+static void queue_push(ThreadPoolQueue *queue, ThreadPoolTask *task) {
+  task->next = NULL;
+  if (queue->tail) {
+    queue->tail->next = task;
+  } else {
+    queue->head = task;
+  }
+  queue->tail = task;
+}
+
+static ThreadPoolTask *queue_pop(ThreadPoolQueue *queue) {
+  ThreadPoolTask *task = queue->head;
+  if (task) {
+    queue->head = task->next;
+    if (!queue->head) {
+      queue->tail = NULL;
+    }
+  }
+  return task;
+}
+
+// Unlink the first queued task of batch, assumes the pool mutex is held
+static ThreadPoolTask *take_batch_task(ThreadPool *pool,
+                                       ThreadPoolBatch *batch) {
+  for (int i = 0; i < pool->nqueues; i++) {
+    ThreadPoolQueue *queue = &pool->queues[i];
+    ThreadPoolTask *prev = NULL;
+    for (ThreadPoolTask *task = queue->head; task; task = task->next) {
+      if (task->batch != batch) {
+        prev = task;
+        continue;
+      }
+      if (prev) {
+        prev->next = task->next;
+      } else {
+        queue->head = task->next;
+      }
+      if (queue->tail == task) {
+        queue->tail = prev;
+      }
+      pool->queued--;
+      return task;
+    }
+  }
+  return NULL;
+}
+
+// Run a dequeued task and count it as finished in its batch
+static void run_task(ThreadPoolTask *task) {
+  ThreadPoolBatch *batch = task->batch;
+  task->fn(task->arg);
+  if (!batch) {
+    return; // detached, fn may have freed the task
+  }
+
+  // the task and the batch may be released as soon as pending reaches zero
+  pthread_mutex_lock(&batch->mutex);
+  if (--batch->pending == 0) {
+    pthread_cond_broadcast(&batch->done);
+  }
+  pthread_mutex_unlock(&batch->mutex);
+}
+
+static void *thread_pool_worker(void *arg) {
+  ThreadPoolWorker *worker = (ThreadPoolWorker *)arg;
+  ThreadPool *pool = worker->pool;
+
+  // the worker's allocations then stay on its node too
+  (void)numa_policy_bind_thread(worker->node);
+
+  pthread_mutex_lock(&pool->mutex);
+  while (1) {
+    while (!pool->stopping && pool->queued == 0) {
+      pthread_cond_wait(&pool->wake, &pool->mutex);
+    }
+    if (pool->queued == 0) {
+      break; // stopping and drained
+    }
+
+    ThreadPoolTask *task = queue_pop(&pool->queues[worker->home]);
+    for (int i = 1; !task && i < pool->nqueues; i++) {
+      task = queue_pop(&pool->queues[(worker->home + i) % pool->nqueues]);
+      if (task) {
+        pool->stolen++;
+      }
+    }
+    pool->queued--;
+    pthread_mutex_unlock(&pool->mutex);
+
+    run_task(task);
+
+    pthread_mutex_lock(&pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+ThreadPool *thread_pool_init(int nqueues, int workers_per_queue) {
+  if (nqueues <= 0 || workers_per_queue <= 0) {
+    return NULL;
+  }
+
+  ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+  if (!pool) {
+    return NULL;
+  }
+
+  int nworkers = nqueues * workers_per_queue;
+  pool->queues = calloc(nqueues, sizeof(ThreadPoolQueue));
+  pool->workers = calloc(nworkers, sizeof(ThreadPoolWorker));
+  pool->threads = calloc(nworkers, sizeof(pthread_t));
+  if (!pool->queues || !pool->workers || !pool->threads) {
+    free(pool->queues);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+    return NULL;
+  }
+  pool->nqueues = nqueues;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+
+  for (int i = 0; i < nworkers; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].home = i % nqueues;
+    pool->workers[i].node = i % numa_policy_nodes();
+    int res = pthread_create(&pool->threads[i], NULL, thread_pool_worker,
+                             &pool->workers[i]);
+    if (res != 0) {
+      ERROR_MSG("[THREAD_POOL_INIT] Failed to start worker %d: %s", i,
+                strerror(res));
+      thread_pool_destroy(pool);
+      return NULL;
+    }
+    pool->nworkers++;
+  }
+
+  return pool;
+}
+
+void thread_pool_destroy(ThreadPool *pool) {
+  if (!pool) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (int i = 0; i < pool->nworkers; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  // only when init failed before starting any worker
+  ThreadPoolTask *task;
+  for (int i = 0; i < pool->nqueues; i++) {
+    while ((task = queue_pop(&pool->queues[i])) != NULL) {
+      run_task(task);
+    }
+  }
+
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool->queues);
+  free(pool->workers);
+  free(pool->threads);
+  free(pool);
+}
+
+void thread_pool_batch_init(ThreadPoolBatch *batch) {
+  pthread_mutex_init(&batch->mutex, NULL);
+  pthread_cond_init(&batch->done, NULL);
+  batch->pending = 0;
+}
+
+int thread_pool_submit(ThreadPool *pool, int queue, ThreadPoolTask *task,
+                       ThreadPoolBatch *batch, ThreadPoolFn fn, void *arg) {
+  if (pool && queue == THREAD_POOL_LOCAL_QUEUE) {
+    queue = numa_policy_local() % pool->nqueues;
+  }
+  if (!pool || !task || !fn || queue < 0 || queue >= pool->nqueues) {
+    return -1;
+  }
+
+  task->fn = fn;
+  task->arg = arg;
+  task->batch = batch;
+
+  if (batch) {
+    pthread_mutex_lock(&batch->mutex);
+    batch->pending++;
+    pthread_mutex_unlock(&batch->mutex);
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  queue_push(&pool->queues[queue], task);
+  pool->queued++;
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->mutex);
+
+  return 0;
+}
+
+void thread_pool_wait(ThreadPool *pool, ThreadPoolBatch *batch) {
+  // run what no worker has picked up yet rather than sleeping on it
+  pthread_mutex_lock(&pool->mutex);
+  ThreadPoolTask *task;
+  while ((task = take_batch_task(pool, batch)) != NULL) {
+    pool->helped++;
+    pthread_mutex_unlock(&pool->mutex);
+    run_task(task);
+    pthread_mutex_lock(&pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  pthread_mutex_lock(&batch->mutex);
+  while (batch->pending > 0) {
+    pthread_cond_wait(&batch->done, &batch->mutex);
+  }
+  pthread_mutex_unlock(&batch->mutex);
+
+  pthread_cond_destroy(&batch->done);
+  pthread_mutex_destroy(&batch->mutex);
+}
@@ -0,0 +1,131 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * ============================================================================
+ * THREAD POOL - LONG-LIVED WORKERS WITH PER-QUEUE AFFINITY
+ * ============================================================================
+ *
+ * A fixed set of workers started once and reused for every task, so fanning
+ * an operation out to N layers costs N queue insertions instead of N
+ * pthread_create calls.
+ *
+ * The pool has one FIFO queue per target (the demultiplexer uses one per next
+ * layer) and workers_per_queue workers homed on each queue. A worker runs the
+ * tasks of its home queue first and steals the oldest task of another queue
+ * when its own is empty, so a slow layer's backlog is drained by the workers
+ * of idle layers.
+ *
+ * Tasks are grouped in batches: the submitter waits for a batch with
+ * thread_pool_wait(), which runs the batch's still-queued tasks on the
+ * calling thread instead of sleeping. A batch therefore always completes,
+ * even when every worker is blocked.
+ *
+ * Task and batch storage belongs to the caller (typically its stack), so
+ * submitting allocates nothing. A task submitted without a batch is detached:
+ * nobody waits for it, and its function may free the task storage.
+ *
+ * With NUMA placement (numa_policy.h), worker i is pinned to node
+ * i % numa_policy_nodes(), so the workers of every pool are spread over the
+ * nodes; a pool with one queue per node has the workers of queue n on node
+ * n, and THREAD_POOL_LOCAL_QUEUE submits to the queue of the caller's node.
+ * ============================================================================
+ */
+
+// thread_pool_submit queue: the queue of the caller's NUMA node
+#define THREAD_POOL_LOCAL_QUEUE (-1)
+
+typedef void *(*ThreadPoolFn)(void *arg);
+
+/**
+ * @brief Completion counter of a group of tasks
+ */
+typedef struct {
+  pthread_mutex_t mutex; // Protects pending
+  pthread_cond_t done;   // Broadcast when pending reaches zero
+  int pending;           // Submitted tasks that have not finished
+} ThreadPoolBatch;
+
+/**
+ * @brief One unit of work, embedded in caller-owned storage
+ */
+typedef struct ThreadPoolTask {
+  ThreadPoolFn fn;             // Function to run
+  void *arg;                   // Argument of fn
+  ThreadPoolBatch *batch;      // Batch notified when fn returns, or NULL
+  struct ThreadPoolTask *next; // Next task of the queue
+} ThreadPoolTask;
+
+typedef struct {
+  ThreadPoolTask *head; // Oldest task
+  ThreadPoolTask *tail; // Newest task
+} ThreadPoolQueue;
+
+typedef struct {
+  struct ThreadPool *pool;
+  int home; // Queue served first
+  int node; // NUMA node index the worker is pinned to
+} ThreadPoolWorker;
+
+typedef struct ThreadPool {
+  ThreadPoolQueue *queues;   // One FIFO per target
+  int nqueues;               // Number of queues
+  ThreadPoolWorker *workers; // Worker arguments
+  pthread_t *threads;        // Worker threads
+  int nworkers;              // Number of started workers
+  size_t queued;             // Tasks in all queues
+  size_t stolen;             // Tasks run by a worker of another queue
+  size_t helped;             // Tasks run by a waiting submitter
+  int stopping;              // Set by destroy, workers exit once idle
+  pthread_mutex_t mutex;     // Protects the fields above
+  pthread_cond_t wake;       // Signalled when a task is queued or on stop
+} ThreadPool;
+
+/**
+ * @brief Start a pool of nqueues queues with workers_per_queue workers each
+ *
+ * @param nqueues -> number of queues
+ * @param workers_per_queue -> workers homed on each queue
+ * @return ThreadPool* -> pool, or NULL on failure
+ */
+ThreadPool *thread_pool_init(int nqueues, int workers_per_queue);
+
+/**
+ * @brief Run the queued tasks, stop the workers and free the pool
+ *
+ * @param pool -> pool to destroy
+ */
+void thread_pool_destroy(ThreadPool *pool);
+
+/**
+ * @brief Initialize an empty batch
+ */
+void thread_pool_batch_init(ThreadPoolBatch *batch);
+
+/**
+ * @brief Queue fn(arg) on queue as part of batch
+ *
+ * @param pool -> pool to use
+ * @param queue -> queue index, in [0, nqueues), or THREAD_POOL_LOCAL_QUEUE
+ * @param task -> task storage, must stay valid until the batch completes (or
+ * until fn returns for a detached task)
+ * @param batch -> batch the task belongs to, NULL for a detached task
+ * @param fn -> function to run
+ * @param arg -> argument of fn
+ * @return int -> 0 on success, -1 on failure
+ */
+int thread_pool_submit(ThreadPool *pool, int queue, ThreadPoolTask *task,
+                       ThreadPoolBatch *batch, ThreadPoolFn fn, void *arg);
+
+/**
+ * @brief Wait until every task of batch has finished, then destroy batch
+ *
+ * @param pool -> pool the tasks were submitted to
+ * @param batch -> batch to wait for
+ */
+void thread_pool_wait(ThreadPool *pool, ThreadPoolBatch *batch);
+
+#endif // THREAD_POOL_H
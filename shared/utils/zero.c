@@ -0,0 +1,107 @@
+#include "zero.h"
+#include "cpu.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define ZERO_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define ZERO_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define ZERO_HEAD 16 // bytes checked before the kernel
+
+// 1 if the len bytes of data are zero
+typedef int (*is_zero_fn)(const uint8_t *data, size_t len);
+
+static int is_zero_generic(const uint8_t *data, size_t len) {
+  size_t i = 0;
+  uint64_t acc = 0;
+  for (; i + 4 * sizeof(uint64_t) <= len; i += 4 * sizeof(uint64_t)) {
+    uint64_t w[4];
+    memcpy(w, data + i, sizeof(w));
+    if (w[0] | w[1] | w[2] | w[3]) {
+      return 0;
+    }
+  }
+  for (; i < len; i++) {
+    acc |= data[i];
+  }
+  return acc == 0;
+}
+
+#ifdef ZERO_X86
+__attribute__((target("avx512f"))) static int
+is_zero_avx512(const uint8_t *data, size_t len) {
+  size_t i = 0;
+  for (; i + 256 <= len; i += 256) {
+    __m512i a = _mm512_loadu_si512((const void *)(data + i));
+    __m512i b = _mm512_loadu_si512((const void *)(data + i + 64));
+    __m512i c = _mm512_loadu_si512((const void *)(data + i + 128));
+    __m512i d = _mm512_loadu_si512((const void *)(data + i + 192));
+    __m512i x = _mm512_or_si512(_mm512_or_si512(a, b), _mm512_or_si512(c, d));
+    if (_mm512_test_epi64_mask(x, x) != 0) {
+      return 0;
+    }
+  }
+  return is_zero_generic(data + i, len - i);
+}
+
+__attribute__((target("avx2"))) static int
+is_zero_avx2(const uint8_t *data, size_t len) {
+  size_t i = 0;
+  for (; i + 128 <= len; i += 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(data + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i *)(data + i + 64));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(data + i + 96));
+    __m256i x = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+    if (!_mm256_testz_si256(x, x)) {
+      return 0;
+    }
+  }
+  return is_zero_generic(data + i, len - i);
+}
+#endif
+
+#ifdef ZERO_NEON
+static int is_zero_neon(const uint8_t *data, size_t len) {
+  size_t i = 0;
+  for (; i + 128 <= len; i += 128) {
+    uint8x16x4_t a = vld1q_u8_x4(data + i);
+    uint8x16x4_t b = vld1q_u8_x4(data + i + 64);
+    uint8x16_t x = vorrq_u8(vorrq_u8(vorrq_u8(a.val[0], a.val[1]),
+                                     vorrq_u8(a.val[2], a.val[3])),
+                            vorrq_u8(vorrq_u8(b.val[0], b.val[1]),
+                                     vorrq_u8(b.val[2], b.val[3])));
+    if (vmaxvq_u8(x) != 0) {
+      return 0;
+    }
+  }
+  return is_zero_generic(data + i, len - i);
+}
+#endif
+
+static const CpuKernelImpl is_zero_impls[] = {
+#ifdef ZERO_X86
+    {"avx512", CPU_AVX512, (CpuKernelFn)is_zero_avx512},
+    {"avx2", CPU_AVX2, (CpuKernelFn)is_zero_avx2},
+#endif
+#ifdef ZERO_NEON
+    {"neon", CPU_NEON, (CpuKernelFn)is_zero_neon},
+#endif
+    {"generic", 0, (CpuKernelFn)is_zero_generic},
+};
+static CpuKernel is_zero_kernel = CPU_KERNEL_INIT("zero", is_zero_impls);
+
+int mem_is_zero(const void *data, size_t len) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  size_t head = len < ZERO_HEAD ? len : ZERO_HEAD;
+  if (!is_zero_generic(bytes, head)) {
+    return 0;
+  }
+  is_zero_fn check = (is_zero_fn)cpu_kernel_select(&is_zero_kernel)->fn;
+  return check(bytes + head, len - head);
+}
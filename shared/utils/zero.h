@@ -0,0 +1,29 @@
+#ifndef ZERO_H
+#define ZERO_H
+
+#include <stddef.h>
+
+/*
+ * ============================================================================
+ * ZERO - DETECTION OF ALL-ZERO BUFFERS
+ * ============================================================================
+ *
+ * Sparse and freshly extended files are mostly zeros, which layers store as
+ * holes instead of processing them. The check runs on every block written,
+ * so it is a CPU kernel ("zero" in cpu_kernels): 256 bytes an iteration with
+ * AVX-512, 128 with AVX2 or NEON, a word at a time otherwise. The first
+ * bytes are checked alone, as a buffer with data rarely starts with many
+ * zeros.
+ * ============================================================================
+ */
+
+/**
+ * @brief Check whether a buffer holds only zeros
+ *
+ * @param data -> buffer, may be unaligned
+ * @param len  -> bytes of data
+ * @return int -> 1 if they are all zero (or len is 0), 0 otherwise
+ */
+int mem_is_zero(const void *data, size_t len);
+
+#endif // ZERO_H
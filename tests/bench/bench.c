@@ -0,0 +1,565 @@
+#include "bench.h"
+#include <pthread.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define BENCH_MAX_ITERATIONS 1000000000ULL
+#define BENCH_DEFAULT_MIN_TIME 0.5
+#define BENCH_MAX_CONTEXT 16
+
+typedef struct {
+  int64_t arg[BENCH_MAX_ARGS];
+  int nargs;
+  char *label; // in the name in place of arg[0], or NULL
+} BenchArgs;
+
+struct BenchFamily {
+  char *name;
+  BenchFn fn;
+  BenchArgs *args;
+  size_t nargs;
+  int *threads; // NULL: one thread, without a threads: suffix
+  size_t nthreads;
+  BenchFamily *next;
+};
+
+// One run of an instance, shared by its threads
+struct BenchRun {
+  pthread_barrier_t barrier;
+  struct timespec start; // wall clock, of thread 0
+  struct timespec end;
+  uint64_t cycles_start; // of thread 0 too
+  uint64_t cycles_end;
+  char reason[128]; // of bench_skip
+};
+
+typedef struct {
+  char name[256];
+  int family_index;
+  int instance_index;
+  int threads;
+  uint64_t iterations;
+  double real_ns; // per iteration
+  double cpu_ns;  // per iteration, average of the threads
+  double bytes_per_second;
+  double items_per_second;
+  double cycles; // per iteration, 0 without a cycle counter
+  int skipped;
+  char reason[128];
+} BenchResult;
+
+static BenchFamily *families;
+static BenchFamily **families_tail = &families;
+
+BenchFamily *bench_register(const char *name, BenchFn fn) {
+  BenchFamily *family = calloc(1, sizeof(BenchFamily));
+  family->name = strdup(name);
+  family->fn = fn;
+  *families_tail = family;
+  families_tail = &family->next;
+  return family;
+}
+
+static BenchFamily *add_args(BenchFamily *family, int nargs, int64_t arg0,
+                             int64_t arg1) {
+  family->args =
+      realloc(family->args, (family->nargs + 1) * sizeof(BenchArgs));
+  BenchArgs *args = &family->args[family->nargs++];
+  args->arg[0] = arg0;
+  args->arg[1] = arg1;
+  args->nargs = nargs;
+  args->label = NULL;
+  return family;
+}
+
+BenchFamily *bench_arg(BenchFamily *family, int64_t arg) {
+  return add_args(family, 1, arg, 0);
+}
+
+BenchFamily *bench_args(BenchFamily *family, int64_t arg0, int64_t arg1) {
+  return add_args(family, 2, arg0, arg1);
+}
+
+BenchFamily *bench_args_label(BenchFamily *family, const char *label,
+                              int64_t arg0, int64_t arg1) {
+  add_args(family, 2, arg0, arg1);
+  family->args[family->nargs - 1].label = strdup(label);
+  return family;
+}
+
+BenchFamily *bench_threads(BenchFamily *family, int threads) {
+  family->threads =
+      realloc(family->threads, (family->nthreads + 1) * sizeof(int));
+  family->threads[family->nthreads++] = threads;
+  return family;
+}
+
+// Time stamp counter: cycles at the nominal frequency of the CPU, whatever
+// its current one, 0 where there is none
+static uint64_t cycles_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static double elapsed(const struct timespec *a, const struct timespec *b) {
+  return (double)(b->tv_sec - a->tv_sec) +
+         (double)(b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+void bench_start_timing(BenchState *state) {
+  state->started = 1;
+  pthread_barrier_wait(&state->run->barrier);
+  if (state->thread_index == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &state->run->start);
+    state->run->cycles_start = cycles_now();
+  }
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &state->cpu_start);
+}
+
+void bench_stop_timing(BenchState *state) {
+  struct timespec cpu_end;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+  state->cpu_seconds = elapsed(&state->cpu_start, &cpu_end);
+  pthread_barrier_wait(&state->run->barrier);
+  if (state->thread_index == 0) {
+    state->run->cycles_end = cycles_now();
+    clock_gettime(CLOCK_MONOTONIC, &state->run->end);
+  }
+}
+
+void bench_skip(BenchState *state, const char *reason) {
+  state->skipped = 1;
+  if (state->thread_index == 0) {
+    snprintf(state->run->reason, sizeof(state->run->reason), "%s", reason);
+  }
+}
+
+typedef struct {
+  BenchFn fn;
+  BenchState state;
+  pthread_t thread;
+} BenchThread;
+
+static void *bench_thread(void *arg) {
+  BenchThread *t = (BenchThread *)arg;
+  t->fn(&t->state);
+  return NULL;
+}
+
+// Run an instance once, with iterations per thread
+static void run_once(BenchFamily *family, const BenchArgs *args, int threads,
+                     uint64_t iterations, BenchResult *result,
+                     double *wall_seconds) {
+  BenchRun run = {0};
+  pthread_barrier_init(&run.barrier, NULL, (unsigned)threads);
+  BenchThread *t = calloc((size_t)threads, sizeof(BenchThread));
+  for (int i = 0; i < threads; i++) {
+    t[i].fn = family->fn;
+    if (args) {
+      memcpy(t[i].state.arg, args->arg, sizeof(args->arg));
+    }
+    t[i].state.thread_index = i;
+    t[i].state.threads = threads;
+    t[i].state.iterations = iterations;
+    t[i].state.left = iterations;
+    t[i].state.run = &run;
+  }
+  for (int i = 1; i < threads; i++) {
+    pthread_create(&t[i].thread, NULL, bench_thread, &t[i]);
+  }
+  bench_thread(&t[0]);
+  for (int i = 1; i < threads; i++) {
+    pthread_join(t[i].thread, NULL);
+  }
+  pthread_barrier_destroy(&run.barrier);
+
+  uint64_t bytes = 0, items = 0;
+  double cpu = 0;
+  result->skipped = t[0].state.skipped;
+  for (int i = 0; i < threads; i++) {
+    bytes += t[i].state.bytes_processed;
+    items += t[i].state.items_processed;
+    cpu += t[i].state.cpu_seconds;
+  }
+  free(t);
+
+  result->threads = threads;
+  result->iterations = iterations;
+  if (result->skipped) {
+    snprintf(result->reason, sizeof(result->reason), "%s", run.reason);
+    *wall_seconds = 0;
+    return;
+  }
+  double wall = elapsed(&run.start, &run.end);
+  *wall_seconds = wall;
+  result->real_ns = wall * 1e9 / (double)iterations;
+  result->cpu_ns = cpu / threads * 1e9 / (double)iterations;
+  result->bytes_per_second = wall > 0 ? (double)bytes / wall : 0;
+  result->items_per_second = wall > 0 ? (double)items / wall : 0;
+  result->cycles =
+      (double)(run.cycles_end - run.cycles_start) / (double)iterations;
+}
+
+// Run an instance with more iterations until a run lasts min_time
+static void run_instance(BenchFamily *family, const BenchArgs *args,
+                         int threads, double min_time, BenchResult *result) {
+  uint64_t iterations = 1;
+  for (;;) {
+    double wall;
+    run_once(family, args, threads, iterations, result, &wall);
+    if (result->skipped || wall >= min_time ||
+        iterations >= BENCH_MAX_ITERATIONS) {
+      return;
+    }
+    // as Google Benchmark: aim 40% past min_time, up to 10 times more
+    double multiplier = 10;
+    if (wall / min_time > 0.1) {
+      multiplier = min_time * 1.4 / wall;
+    }
+    uint64_t next = (uint64_t)((double)iterations * multiplier);
+    iterations = next > iterations ? next : iterations + 1;
+    if (iterations > BENCH_MAX_ITERATIONS) {
+      iterations = BENCH_MAX_ITERATIONS;
+    }
+  }
+}
+
+static void instance_name(char *name, size_t size, const BenchFamily *family,
+                          const BenchArgs *args, int threads) {
+  int len = snprintf(name, size, "%s", family->name);
+  for (int i = 0; args && i < args->nargs; i++) {
+    if (i == 0 && args->label) {
+      len += snprintf(name + len, size - (size_t)len, "/%s", args->label);
+    } else {
+      len += snprintf(name + len, size - (size_t)len, "/%ld",
+                      (long)args->arg[i]);
+    }
+  }
+  if (family->threads) {
+    snprintf(name + len, size - (size_t)len, "/threads:%d", threads);
+  }
+}
+
+/* ========================================================================== */
+/* Reporters                                                                  */
+/* ========================================================================== */
+
+typedef enum { FORMAT_CONSOLE, FORMAT_JSON } BenchFormat;
+
+typedef struct {
+  const char *executable;
+  const char *keys[BENCH_MAX_CONTEXT]; // of --benchmark_context
+  const char *values[BENCH_MAX_CONTEXT];
+  int ncontext;
+  char date[64];
+} BenchContext;
+
+static void json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(out, "\\%c", *s);
+    } else if ((unsigned char)*s < 0x20) {
+      fprintf(out, "\\u%04x", (unsigned char)*s);
+    } else {
+      fputc(*s, out);
+    }
+  }
+  fputc('"', out);
+}
+
+// A rate with binary prefixes, as Google Benchmark prints counters
+static void human_rate(char *buf, size_t size, double v) {
+  const char *prefixes[] = {"", "Ki", "Mi", "Gi", "Ti"};
+  int i = 0;
+  while (v >= 1024 && i < 4) {
+    v /= 1024;
+    i++;
+  }
+  snprintf(buf, size, "%.4g%s/s", v, prefixes[i]);
+}
+
+static void console_rule(FILE *out) {
+  for (int i = 0; i < 92; i++) {
+    fputc('-', out);
+  }
+  fputc('\n', out);
+}
+
+static void console_header(FILE *out, const BenchContext *context) {
+  fprintf(out, "%s\nRun on (%ld X CPU s)\n", context->date,
+          sysconf(_SC_NPROCESSORS_ONLN));
+  for (int i = 0; i < context->ncontext; i++) {
+    fprintf(out, "%s: %s\n", context->keys[i], context->values[i]);
+  }
+  console_rule(out);
+  fprintf(out, "%-48s %13s %15s %12s\n", "Benchmark", "Time", "CPU",
+          "Iterations");
+  console_rule(out);
+}
+
+static void console_result(FILE *out, const BenchResult *r) {
+  if (r->skipped) {
+    fprintf(out, "%-48s SKIPPED: '%s'\n", r->name, r->reason);
+    return;
+  }
+  fprintf(out, "%-48s %10.0f ns %12.0f ns %12lu", r->name, r->real_ns,
+          r->cpu_ns, (unsigned long)r->iterations);
+  char rate[32];
+  if (r->bytes_per_second > 0) {
+    human_rate(rate, sizeof(rate), r->bytes_per_second);
+    fprintf(out, " bytes_per_second=%s", rate);
+  }
+  if (r->items_per_second > 0) {
+    human_rate(rate, sizeof(rate), r->items_per_second);
+    fprintf(out, " items_per_second=%s", rate);
+  }
+  if (r->bytes_per_second > 0 && r->cycles > 0) {
+    fprintf(out, " bytes_per_cycle=%.4g",
+            r->bytes_per_second * r->real_ns / 1e9 / r->cycles);
+  }
+  fputc('\n', out);
+  fflush(out);
+}
+
+static void json_report(FILE *out, const BenchContext *context,
+                        const BenchResult *results, size_t n) {
+  char host[256] = "";
+  gethostname(host, sizeof(host) - 1);
+  double load[3] = {0};
+  getloadavg(load, 3);
+
+  fprintf(out, "{\n  \"context\": {\n    \"date\": ");
+  json_string(out, context->date);
+  fprintf(out, ",\n    \"host_name\": ");
+  json_string(out, host);
+  fprintf(out, ",\n    \"executable\": ");
+  json_string(out, context->executable);
+  fprintf(out,
+          ",\n    \"num_cpus\": %ld,\n"
+          "    \"load_avg\": [%g, %g, %g],\n"
+          "    \"library_build_type\": \"release\"",
+          sysconf(_SC_NPROCESSORS_ONLN), load[0], load[1], load[2]);
+  for (int i = 0; i < context->ncontext; i++) {
+    fprintf(out, ",\n    ");
+    json_string(out, context->keys[i]);
+    fprintf(out, ": ");
+    json_string(out, context->values[i]);
+  }
+  fprintf(out, "\n  },\n  \"benchmarks\": [");
+
+  const char *sep = "\n";
+  for (size_t i = 0; i < n; i++) {
+    const BenchResult *r = &results[i];
+    fprintf(out, "%s    {\n      \"name\": ", sep);
+    json_string(out, r->name);
+    fprintf(out,
+            ",\n      \"family_index\": %d,\n"
+            "      \"per_family_instance_index\": %d,\n"
+            "      \"run_name\": ",
+            r->family_index, r->instance_index);
+    json_string(out, r->name);
+    fprintf(out,
+            ",\n      \"run_type\": \"iteration\",\n"
+            "      \"repetitions\": 1,\n"
+            "      \"repetition_index\": 0,\n"
+            "      \"threads\": %d,\n"
+            "      \"iterations\": %lu,\n",
+            r->threads, (unsigned long)r->iterations);
+    if (r->skipped) {
+      fprintf(out, "      \"error_occurred\": true,\n"
+                   "      \"error_message\": ");
+      json_string(out, r->reason);
+      fprintf(out, ",\n");
+    }
+    fprintf(out,
+            "      \"real_time\": %.6e,\n"
+            "      \"cpu_time\": %.6e,\n"
+            "      \"time_unit\": \"ns\"",
+            r->real_ns, r->cpu_ns);
+    if (r->bytes_per_second > 0) {
+      fprintf(out, ",\n      \"bytes_per_second\": %.6e",
+              r->bytes_per_second);
+    }
+    if (r->items_per_second > 0) {
+      fprintf(out, ",\n      \"items_per_second\": %.6e",
+              r->items_per_second);
+    }
+    if (r->cycles > 0) {
+      fprintf(out, ",\n      \"cycles_per_iteration\": %.6e", r->cycles);
+    }
+    if (r->bytes_per_second > 0 && r->cycles > 0) {
+      fprintf(out, ",\n      \"bytes_per_cycle\": %.6e",
+              r->bytes_per_second * r->real_ns / 1e9 / r->cycles);
+    }
+    fprintf(out, "\n    }");
+    sep = ",\n";
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
+
+/* ========================================================================== */
+/* Command line                                                               */
+/* ========================================================================== */
+
+static int parse_format(const char *s, BenchFormat *format) {
+  if (strcmp(s, "console") == 0) {
+    *format = FORMAT_CONSOLE;
+  } else if (strcmp(s, "json") == 0) {
+    *format = FORMAT_JSON;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [--benchmark_filter=REGEX] "
+          "[--benchmark_min_time=SECONDS[s]]\n"
+          "       [--benchmark_format=console|json] [--benchmark_out=FILE]\n"
+          "       [--benchmark_out_format=console|json] "
+          "[--benchmark_context=KEY=VALUE]\n"
+          "       [--benchmark_list_tests]\n",
+          argv0);
+}
+
+int bench_main(int argc, char **argv) {
+  const char *filter = NULL;
+  const char *out_path = NULL;
+  double min_time = BENCH_DEFAULT_MIN_TIME;
+  BenchFormat format = FORMAT_CONSOLE;
+  BenchFormat out_format = FORMAT_JSON;
+  int list = 0;
+  BenchContext context = {.executable = argv[0]};
+
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i];
+    char *eq = strchr(a, '=');
+    const char *v = eq ? eq + 1 : "";
+    if (strncmp(a, "--benchmark_filter=", 19) == 0) {
+      filter = v;
+    } else if (strncmp(a, "--benchmark_min_time=", 21) == 0) {
+      char *end;
+      min_time = strtod(v, &end);
+      if (end == v || (*end && strcmp(end, "s") != 0) || min_time <= 0) {
+        fprintf(stderr, "invalid --benchmark_min_time: %s\n", v);
+        return 1;
+      }
+    } else if (strncmp(a, "--benchmark_format=", 19) == 0) {
+      if (parse_format(v, &format) != 0) {
+        fprintf(stderr, "invalid --benchmark_format: %s\n", v);
+        return 1;
+      }
+    } else if (strncmp(a, "--benchmark_out=", 16) == 0) {
+      out_path = v;
+    } else if (strncmp(a, "--benchmark_out_format=", 23) == 0) {
+      if (parse_format(v, &out_format) != 0) {
+        fprintf(stderr, "invalid --benchmark_out_format: %s\n", v);
+        return 1;
+      }
+    } else if (strncmp(a, "--benchmark_context=", 20) == 0) {
+      char *kv = strchr(v, '=');
+      if (!kv || context.ncontext == BENCH_MAX_CONTEXT) {
+        fprintf(stderr, "invalid --benchmark_context: %s\n", v);
+        return 1;
+      }
+      *kv = '\0';
+      context.keys[context.ncontext] = v;
+      context.values[context.ncontext++] = kv + 1;
+    } else if (strcmp(a, "--benchmark_list_tests") == 0) {
+      list = 1;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  regex_t re;
+  int use_filter = filter && *filter && strcmp(filter, "all") != 0;
+  if (use_filter && regcomp(&re, filter, REG_EXTENDED | REG_NOSUB) != 0) {
+    fprintf(stderr, "invalid --benchmark_filter: %s\n", filter);
+    return 1;
+  }
+
+  time_t now = time(NULL);
+  strftime(context.date, sizeof(context.date), "%Y-%m-%dT%H:%M:%S%z",
+           localtime(&now));
+
+  FILE *out = NULL;
+  if (out_path && !list) {
+    out = fopen(out_path, "w");
+    if (!out) {
+      perror(out_path);
+      return 1;
+    }
+  }
+  if (!list && format == FORMAT_CONSOLE) {
+    console_header(stdout, &context);
+  }
+  if (out && out_format == FORMAT_CONSOLE) {
+    console_header(out, &context);
+  }
+
+  BenchResult *results = NULL;
+  size_t n = 0;
+  int family_index = 0;
+  for (BenchFamily *f = families; f; f = f->next) {
+    size_t nargs = f->nargs ? f->nargs : 1;
+    size_t nthreads = f->threads ? f->nthreads : 1;
+    int instance_index = 0;
+    for (size_t a = 0; a < nargs; a++) {
+      for (size_t t = 0; t < nthreads; t++) {
+        const BenchArgs *args = f->nargs ? &f->args[a] : NULL;
+        int threads = f->threads ? f->threads[t] : 1;
+        BenchResult r = {0};
+        instance_name(r.name, sizeof(r.name), f, args, threads);
+        if (use_filter && regexec(&re, r.name, 0, NULL, 0) != 0) {
+          continue;
+        }
+        if (list) {
+          printf("%s\n", r.name);
+          continue;
+        }
+        r.family_index = family_index;
+        r.instance_index = instance_index++;
+        run_instance(f, args, threads, min_time, &r);
+        if (format == FORMAT_CONSOLE) {
+          console_result(stdout, &r);
+        }
+        if (out && out_format == FORMAT_CONSOLE) {
+          console_result(out, &r);
+        }
+        results = realloc(results, (n + 1) * sizeof(BenchResult));
+        results[n++] = r;
+      }
+    }
+    if (instance_index > 0) {
+      family_index++;
+    }
+  }
+
+  if (format == FORMAT_JSON && !list) {
+    json_report(stdout, &context, results, n);
+  }
+  if (out) {
+    if (out_format == FORMAT_JSON) {
+      json_report(out, &context, results, n);
+    }
+    fclose(out);
+  }
+  if (use_filter) {
+    regfree(&re);
+  }
+  free(results);
+  return 0;
+}
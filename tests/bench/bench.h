@@ -0,0 +1,171 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * ============================================================================
+ * MICROBENCHMARK HARNESS
+ * ============================================================================
+ *
+ * A small C counterpart of Google Benchmark. A benchmark is a function that
+ * does its setup, then repeats the measured code in a
+ *
+ *   while (bench_keep_running(state)) { ... }
+ *
+ * loop and reports the bytes or items it processed. bench_register() adds a
+ * family of benchmarks; each argument tuple (bench_arg, bench_args) and
+ * thread count (bench_threads) of the family is an instance named
+ * "family/arg0/arg1/threads:N".
+ *
+ * Each instance is run with more and more iterations until a run lasts at
+ * least the minimum time, and that run is reported, on the console or as
+ * Google Benchmark JSON (--benchmark_format=json, --benchmark_out=FILE) so
+ * the results of two commits can be compared with its tools/compare.py.
+ *
+ * With several threads, every thread calls the function with the same
+ * state->arg and its own thread_index. The loops of all threads start and
+ * end together: what thread 0 sets up before its loop is ready for the
+ * others, and it may tear it down after its loop. The time reported is the
+ * wall time of the run divided by the iterations of one thread.
+ *
+ * On x86 the time stamp counter is read around the loop as well: the results
+ * then have cycles_per_iteration and bytes_per_cycle counters, in cycles at
+ * the nominal frequency of the CPU.
+ * ============================================================================
+ */
+
+#define BENCH_MAX_ARGS 2
+
+typedef struct BenchRun BenchRun;
+
+typedef struct {
+  int64_t arg[BENCH_MAX_ARGS]; // arguments of the instance
+  int thread_index;
+  int threads;
+  uint64_t iterations;      // of the loop of this thread
+  uint64_t bytes_processed; // set by the benchmark, 0: not reported
+  uint64_t items_processed; // set by the benchmark, 0: not reported
+  int skipped;              // set with bench_skip
+  // private to the harness
+  uint64_t left;
+  int started;
+  struct timespec cpu_start;
+  double cpu_seconds;
+  BenchRun *run;
+} BenchState;
+
+typedef void (*BenchFn)(BenchState *state);
+
+// Barrier and clocks around the loop, called by bench_keep_running
+void bench_start_timing(BenchState *state);
+void bench_stop_timing(BenchState *state);
+
+typedef struct BenchFamily BenchFamily;
+
+/**
+ * @brief Register a family of benchmarks
+ *
+ * @param name          -> name of the family, copied
+ * @param fn            -> benchmark function
+ * @return BenchFamily* -> the family, for bench_args and bench_threads
+ */
+BenchFamily *bench_register(const char *name, BenchFn fn);
+
+/**
+ * @brief Add an instance with one argument to a family
+ *
+ * @param family        -> family to add to
+ * @param arg           -> state->arg[0] of the instance
+ * @return BenchFamily* -> the family
+ */
+BenchFamily *bench_arg(BenchFamily *family, int64_t arg);
+
+/**
+ * @brief Add an instance with two arguments to a family
+ *
+ * @param family        -> family to add to
+ * @param arg0          -> state->arg[0] of the instance
+ * @param arg1          -> state->arg[1] of the instance
+ * @return BenchFamily* -> the family
+ */
+BenchFamily *bench_args(BenchFamily *family, int64_t arg0, int64_t arg1);
+
+/**
+ * @brief Add an instance with two arguments, named with label for arg0
+ *
+ * For an arg0 that indexes a table of the benchmark: the instance is named
+ * "family/label/arg1".
+ *
+ * @param family        -> family to add to
+ * @param label         -> shown in place of arg0, copied
+ * @param arg0          -> state->arg[0] of the instance
+ * @param arg1          -> state->arg[1] of the instance
+ * @return BenchFamily* -> the family
+ */
+BenchFamily *bench_args_label(BenchFamily *family, const char *label,
+                              int64_t arg0, int64_t arg1);
+
+/**
+ * @brief Run every instance of a family with this many threads too
+ *
+ * @param family        -> family to change
+ * @param threads       -> thread count
+ * @return BenchFamily* -> the family
+ */
+BenchFamily *bench_threads(BenchFamily *family, int threads);
+
+/**
+ * @brief Loop condition of a benchmark, see the top of the file
+ *
+ * @param state -> state of the benchmark
+ * @return int  -> 1 while the loop must go on
+ */
+static inline int bench_keep_running(BenchState *state) {
+  if (__builtin_expect(!state->started, 0)) {
+    bench_start_timing(state);
+  }
+  if (__builtin_expect(state->left > 0, 1)) {
+    state->left--;
+    return 1;
+  }
+  bench_stop_timing(state);
+  return 0;
+}
+
+/**
+ * @brief Skip an instance that can't run, before its loop
+ *
+ * Every thread of the instance must skip it, none may enter its loop.
+ *
+ * @param state  -> state of the benchmark
+ * @param reason -> why, printed on the console
+ */
+void bench_skip(BenchState *state, const char *reason);
+
+/**
+ * @brief Keep the compiler from optimizing a value of the loop away
+ *
+ * @param p -> pointer to the value
+ */
+static inline void bench_do_not_optimize(const void *p) {
+  __asm__ volatile("" : : "g"(p) : "memory");
+}
+
+/**
+ * @brief Run the registered benchmarks selected by the command line
+ *
+ * --benchmark_filter=REGEX, --benchmark_min_time=SECONDS[s],
+ * --benchmark_format=console|json, --benchmark_out=FILE,
+ * --benchmark_out_format=console|json, --benchmark_context=KEY=VALUE
+ * (repeatable, added to the context of the JSON) and --benchmark_list_tests.
+ *
+ * @param argc -> argument count of main
+ * @param argv -> arguments of main
+ * @return int -> exit status of main
+ */
+int bench_main(int argc, char **argv);
+
+#endif // __BENCH_H__
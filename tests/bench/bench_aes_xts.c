@@ -0,0 +1,73 @@
+#include "../../layers/encryption/ciphers/aes_xts.h"
+#include "bench.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SECTOR_SIZE 4096
+
+static const unsigned char key[AES_XTS_KEY_SIZE] =
+    "0123456789abcdef0123456789abcdeffedcba9876543210fedcba987654321";
+
+// state->arg[0] bytes, sectors of SECTOR_SIZE, with the key expanded once
+static void xts_sectors(BenchState *state, int encrypt) {
+  AesXtsKey *k = aes_xts_key_init(key);
+  if (!k) {
+    bench_skip(state, "aes_xts_key_init failed");
+    return;
+  }
+  size_t len = (size_t)state->arg[0];
+  unsigned char *in = calloc(1, len);
+  unsigned char *out = malloc(len);
+  uint64_t sector = 0;
+  while (bench_keep_running(state)) {
+    if (encrypt) {
+      aes_xts_encrypt_sectors(k, sector, SECTOR_SIZE, in, len, out);
+    } else {
+      aes_xts_decrypt_sectors(k, sector, SECTOR_SIZE, in, len, out);
+    }
+    sector += len / SECTOR_SIZE;
+    bench_do_not_optimize(out);
+  }
+  state->bytes_processed = state->iterations * len;
+  free(out);
+  free(in);
+  aes_xts_key_free(k);
+}
+
+static void bm_aes_xts_encrypt_sectors(BenchState *state) {
+  xts_sectors(state, 1);
+}
+
+static void bm_aes_xts_decrypt_sectors(BenchState *state) {
+  xts_sectors(state, 0);
+}
+
+// One state->arg[0] bytes buffer, keying a new context on every call
+static void bm_aes_xts_encrypt(BenchState *state) {
+  int len = (int)state->arg[0];
+  unsigned char iv[AES_XTS_IV_SIZE] = {0};
+  unsigned char *in = calloc(1, (size_t)len);
+  unsigned char *out = malloc((size_t)len);
+  while (bench_keep_running(state)) {
+    aes_xts_encrypt(key, iv, in, len, out);
+    bench_do_not_optimize(out);
+  }
+  state->bytes_processed = state->iterations * (uint64_t)len;
+  free(out);
+  free(in);
+}
+
+void register_aes_xts_benchmarks(void) {
+  const int64_t sizes[] = {SECTOR_SIZE, 65536, 1 << 20};
+  BenchFamily *encrypt = bench_register("BM_aes_xts_encrypt_sectors",
+                                        bm_aes_xts_encrypt_sectors);
+  BenchFamily *decrypt = bench_register("BM_aes_xts_decrypt_sectors",
+                                        bm_aes_xts_decrypt_sectors);
+  BenchFamily *single =
+      bench_register("BM_aes_xts_encrypt", bm_aes_xts_encrypt);
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    bench_arg(encrypt, sizes[i]);
+    bench_arg(decrypt, sizes[i]);
+    bench_arg(single, sizes[i]);
+  }
+}
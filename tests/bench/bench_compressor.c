@@ -0,0 +1,131 @@
+#include "../../shared/utils/compressor/compressor.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The blocks are text of random words: compressible, like the files of a
+ * storage workload, but with no long repeats a compressor would make trivial.
+ */
+static void *text_buffer(size_t size) {
+  static const char *words[] = {
+      "block", "layer", "file",   "offset", "hash",   "read", "write",
+      "the",   "a",     "of",     "to",     "stored", "data", "index",
+      "cache", "path",  "remote", "local",  "sector", "key",  "\n"};
+  size_t nwords = sizeof(words) / sizeof(words[0]);
+  char *buffer = malloc(size);
+  uint32_t x = 2463534242u;
+  size_t len = 0;
+  while (len < size) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    const char *w = words[x % nwords];
+    for (size_t i = 0; w[i] && len < size; i++) {
+      buffer[len++] = w[i];
+    }
+    if (len < size) {
+      buffer[len++] = ' ';
+    }
+  }
+  return buffer;
+}
+
+typedef struct {
+  Compressor compressor;
+  size_t size;
+  void *data;
+  void *compressed;
+  size_t bound;
+  ssize_t compressed_size;
+} CompressFixture;
+
+// state->arg[0] is the level, state->arg[1] the size of a block
+static int fixture_init(CompressFixture *f, BenchState *state,
+                        compression_algorithm_t algorithm) {
+  if (compressor_init(&f->compressor, algorithm, (int)state->arg[0]) != 0) {
+    bench_skip(state, "compressor_init failed");
+    return -1;
+  }
+  f->size = (size_t)state->arg[1];
+  f->data = text_buffer(f->size);
+  f->bound = f->compressor.get_compress_bound(f->size, f->compressor.level);
+  f->compressed = malloc(f->bound);
+  f->compressed_size = compressor_compress(&f->compressor, f->data, f->size,
+                                           f->compressed, f->bound);
+  return 0;
+}
+
+static void fixture_destroy(CompressFixture *f) {
+  free(f->compressed);
+  free(f->data);
+  compressor_destroy(&f->compressor);
+}
+
+static void compress(BenchState *state, compression_algorithm_t algorithm) {
+  CompressFixture f;
+  if (fixture_init(&f, state, algorithm) != 0) {
+    return;
+  }
+  while (bench_keep_running(state)) {
+    ssize_t n = compressor_compress(&f.compressor, f.data, f.size,
+                                    f.compressed, f.bound);
+    bench_do_not_optimize(&n);
+  }
+  state->bytes_processed = state->iterations * f.size;
+  fixture_destroy(&f);
+}
+
+static void decompress(BenchState *state, compression_algorithm_t algorithm) {
+  CompressFixture f;
+  if (fixture_init(&f, state, algorithm) != 0) {
+    return;
+  }
+  void *out = malloc(f.size);
+  while (bench_keep_running(state)) {
+    size_t size = f.size;
+    ssize_t n = compressor_decompress(&f.compressor, f.compressed,
+                                      (size_t)f.compressed_size, out, &size);
+    bench_do_not_optimize(&n);
+  }
+  state->bytes_processed = state->iterations * f.size;
+  free(out);
+  fixture_destroy(&f);
+}
+
+static void bm_zstd_compress(BenchState *state) {
+  compress(state, COMPRESSION_ZSTD);
+}
+
+static void bm_zstd_decompress(BenchState *state) {
+  decompress(state, COMPRESSION_ZSTD);
+}
+
+static void bm_lz4_compress(BenchState *state) {
+  compress(state, COMPRESSION_LZ4);
+}
+
+static void bm_lz4_decompress(BenchState *state) {
+  decompress(state, COMPRESSION_LZ4);
+}
+
+void register_compressor_benchmarks(void) {
+  const int64_t blocks[] = {4096, 65536, 1 << 20};
+  const int64_t zstd_levels[] = {-5, 1, 3, 9, 19};
+  const int64_t lz4_levels[] = {0, 3, 9, 12};
+  BenchFamily *zc = bench_register("BM_zstd_compress", bm_zstd_compress);
+  BenchFamily *zd = bench_register("BM_zstd_decompress", bm_zstd_decompress);
+  BenchFamily *lc = bench_register("BM_lz4_compress", bm_lz4_compress);
+  BenchFamily *ld = bench_register("BM_lz4_decompress", bm_lz4_decompress);
+  for (size_t b = 0; b < sizeof(blocks) / sizeof(blocks[0]); b++) {
+    for (size_t l = 0; l < sizeof(zstd_levels) / sizeof(zstd_levels[0]); l++) {
+      bench_args(zc, zstd_levels[l], blocks[b]);
+      bench_args(zd, zstd_levels[l], blocks[b]);
+    }
+    for (size_t l = 0; l < sizeof(lz4_levels) / sizeof(lz4_levels[0]); l++) {
+      bench_args(lc, lz4_levels[l], blocks[b]);
+      bench_args(ld, lz4_levels[l], blocks[b]);
+    }
+  }
+}
@@ -0,0 +1,107 @@
+#include "../../shared/utils/conversion.h"
+#include "../../shared/utils/hasher/hasher.h"
+#include "bench.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE 4096
+
+static void *random_buffer(size_t size) {
+  unsigned char *buffer = malloc(size);
+  uint32_t x = 2463534242u;
+  for (size_t i = 0; i < size; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    buffer[i] = (unsigned char)x;
+  }
+  return buffer;
+}
+
+// One buffer of state->arg[0] bytes into a binary digest
+static void hash_buffer(BenchState *state, hash_algorithm_t algorithm) {
+  Hasher hasher;
+  hasher_init(&hasher, algorithm);
+  size_t size = (size_t)state->arg[0];
+  void *buffer = random_buffer(size);
+  unsigned char digest[HASHER_MAX_HASH_SIZE];
+  while (bench_keep_running(state)) {
+    hasher.hash_buffer_binary(buffer, size, digest, sizeof(digest));
+    bench_do_not_optimize(digest);
+  }
+  state->bytes_processed = state->iterations * size;
+  free(buffer);
+}
+
+static void bm_sha256(BenchState *state) { hash_buffer(state, HASH_SHA256); }
+
+static void bm_sha512(BenchState *state) { hash_buffer(state, HASH_SHA512); }
+
+static void bm_blake3(BenchState *state) { hash_buffer(state, HASH_BLAKE3); }
+
+/*
+ * state->arg[0] blocks of BLOCK_SIZE bytes into one hex digest each, as the
+ * anti-tampering layers store them: hash_blocks_binary (with the multi-buffer
+ * SHA-256 when the CPU has it) then bytes_to_hex of every digest.
+ */
+static void hash_blocks_to_hex(BenchState *state, hash_algorithm_t algorithm) {
+  Hasher hasher;
+  hasher_init(&hasher, algorithm);
+  size_t n = (size_t)state->arg[0];
+  size_t digest_size = hasher.get_hash_size();
+  unsigned char *data = random_buffer(n * BLOCK_SIZE);
+  const void **buffers = malloc(n * sizeof(void *));
+  size_t *sizes = malloc(n * sizeof(size_t));
+  for (size_t i = 0; i < n; i++) {
+    buffers[i] = data + i * BLOCK_SIZE;
+    sizes[i] = BLOCK_SIZE;
+  }
+  unsigned char *digests = malloc(n * digest_size);
+  char *hex = malloc(n * (digest_size * 2 + 1));
+  while (bench_keep_running(state)) {
+    hasher.hash_blocks_binary((const void *const *)buffers, sizes, n, digests,
+                              n * digest_size);
+    for (size_t i = 0; i < n; i++) {
+      bytes_to_hex(digests + i * digest_size, digest_size,
+                   hex + i * (digest_size * 2 + 1));
+    }
+    bench_do_not_optimize(hex);
+  }
+  state->bytes_processed = state->iterations * n * BLOCK_SIZE;
+  state->items_processed = state->iterations * n;
+  free(hex);
+  free(digests);
+  free(sizes);
+  free(buffers);
+  free(data);
+}
+
+static void bm_hash_blocks_to_hex_sha256(BenchState *state) {
+  hash_blocks_to_hex(state, HASH_SHA256);
+}
+
+static void bm_hash_blocks_to_hex_sha512(BenchState *state) {
+  hash_blocks_to_hex(state, HASH_SHA512);
+}
+
+void register_hasher_benchmarks(void) {
+  const int64_t sizes[] = {64, 512, 4096, 65536, 1 << 20};
+  BenchFamily *sha256 = bench_register("BM_sha256", bm_sha256);
+  BenchFamily *sha512 = bench_register("BM_sha512", bm_sha512);
+  BenchFamily *blake3 = bench_register("BM_blake3", bm_blake3);
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    bench_arg(sha256, sizes[i]);
+    bench_arg(sha512, sizes[i]);
+    bench_arg(blake3, sizes[i]);
+  }
+
+  const int64_t blocks[] = {1, 8, 64};
+  BenchFamily *hex256 = bench_register("BM_hash_blocks_to_hex_sha256",
+                                       bm_hash_blocks_to_hex_sha256);
+  BenchFamily *hex512 = bench_register("BM_hash_blocks_to_hex_sha512",
+                                       bm_hash_blocks_to_hex_sha512);
+  for (size_t i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+    bench_arg(hex256, blocks[i]);
+    bench_arg(hex512, blocks[i]);
+  }
+}
@@ -0,0 +1,81 @@
+#include "../../shared/utils/locking.h"
+#include "bench.h"
+#include <stdio.h>
+
+/*
+ * Every thread takes and releases a lock per iteration. On one path the
+ * threads contend for the same entry (and shard); on their own paths only
+ * for the shards the paths hash to; with disjoint ranges of one path for the
+ * range list of its entry.
+ */
+
+#define RANGE_SIZE 4096
+
+static LockTable *table;
+
+static void setup(BenchState *state) {
+  if (state->thread_index == 0) {
+    table = locking_init();
+  }
+}
+
+static void teardown(BenchState *state) {
+  state->items_processed = state->iterations;
+  if (state->thread_index == 0) {
+    locking_destroy(table);
+  }
+}
+
+static void bm_locking_read_same_path(BenchState *state) {
+  setup(state);
+  while (bench_keep_running(state)) {
+    locking_acquire_read(table, "/bench/file");
+    locking_release(table, "/bench/file");
+  }
+  teardown(state);
+}
+
+static void bm_locking_write_same_path(BenchState *state) {
+  setup(state);
+  while (bench_keep_running(state)) {
+    locking_acquire_write(table, "/bench/file");
+    locking_release(table, "/bench/file");
+  }
+  teardown(state);
+}
+
+static void bm_locking_write_own_path(BenchState *state) {
+  setup(state);
+  char path[64];
+  snprintf(path, sizeof(path), "/bench/file.%d", state->thread_index);
+  while (bench_keep_running(state)) {
+    locking_acquire_write(table, path);
+    locking_release(table, path);
+  }
+  teardown(state);
+}
+
+static void bm_locking_range_write_disjoint(BenchState *state) {
+  setup(state);
+  off_t offset = (off_t)state->thread_index * RANGE_SIZE;
+  while (bench_keep_running(state)) {
+    locking_acquire_range_write(table, "/bench/file", offset, RANGE_SIZE);
+    locking_release_range(table, "/bench/file", offset, RANGE_SIZE);
+  }
+  teardown(state);
+}
+
+void register_locking_benchmarks(void) {
+  BenchFamily *families[] = {
+      bench_register("BM_locking_read_same_path", bm_locking_read_same_path),
+      bench_register("BM_locking_write_same_path", bm_locking_write_same_path),
+      bench_register("BM_locking_write_own_path", bm_locking_write_own_path),
+      bench_register("BM_locking_range_write_disjoint",
+                     bm_locking_range_write_disjoint),
+  };
+  for (size_t i = 0; i < sizeof(families) / sizeof(families[0]); i++) {
+    for (int threads = 1; threads <= 8; threads *= 2) {
+      bench_threads(families[i], threads);
+    }
+  }
+}
@@ -0,0 +1,17 @@
+#include "bench.h"
+
+// Defined by the bench_*.c suites
+void register_hasher_benchmarks(void);
+void register_compressor_benchmarks(void);
+void register_locking_benchmarks(void);
+void register_parallel_benchmarks(void);
+void register_aes_xts_benchmarks(void);
+
+int main(int argc, char **argv) {
+  register_hasher_benchmarks();
+  register_compressor_benchmarks();
+  register_locking_benchmarks();
+  register_parallel_benchmarks();
+  register_aes_xts_benchmarks();
+  return bench_main(argc, argv);
+}
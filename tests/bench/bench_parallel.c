@@ -0,0 +1,123 @@
+#include "../../shared/types/layer_context.h"
+#include "../../shared/utils/parallel.h"
+#include "bench.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The layers of the fan-out copy the data to or from a buffer of their own,
+ * so the small sizes measure the cost of the fan-out itself and the large
+ * ones how much of the copies it overlaps. BM_sequential_* does the same
+ * calls one layer after the other on the calling thread, as a baseline.
+ */
+
+#define MAX_SIZE (1 << 20)
+
+static ssize_t memory_pwrite(int fd, const void *buffer, size_t nbyte,
+                             off_t offset, LayerContext l) {
+  memcpy((char *)l.internal_state + offset, buffer, nbyte);
+  return (ssize_t)nbyte;
+}
+
+static ssize_t memory_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                            LayerContext l) {
+  memcpy(buffer, (char *)l.internal_state + offset, nbyte);
+  return (ssize_t)nbyte;
+}
+
+static LayerOps memory_ops = {
+    .lpwrite = memory_pwrite,
+    .lpread = memory_pread,
+};
+
+typedef struct {
+  int nlayers;
+  size_t nbyte;
+  LayerContext layers[PARALLEL_MAX_TASKS];
+  int fds[PARALLEL_MAX_TASKS];
+  ssize_t results[PARALLEL_MAX_TASKS];
+  void *buffers[PARALLEL_MAX_TASKS]; // of the reads
+  void *data;
+} FanOutFixture;
+
+// state->arg[0] is the number of layers, state->arg[1] the bytes of a call
+static void fixture_init(FanOutFixture *f, BenchState *state) {
+  memset(f, 0, sizeof(*f));
+  f->nlayers = (int)state->arg[0];
+  f->nbyte = (size_t)state->arg[1];
+  f->data = calloc(1, f->nbyte);
+  for (int i = 0; i < f->nlayers; i++) {
+    f->layers[i].ops = &memory_ops;
+    f->layers[i].internal_state = calloc(1, MAX_SIZE);
+    f->buffers[i] = calloc(1, f->nbyte);
+  }
+}
+
+static void fixture_destroy(FanOutFixture *f, BenchState *state) {
+  state->bytes_processed = state->iterations * f->nbyte * f->nlayers;
+  state->items_processed = state->iterations;
+  for (int i = 0; i < f->nlayers; i++) {
+    free(f->layers[i].internal_state);
+    free(f->buffers[i]);
+  }
+  free(f->data);
+}
+
+static void bm_parallel_write(BenchState *state) {
+  FanOutFixture f;
+  fixture_init(&f, state);
+  ThreadPool *pool = thread_pool_init(f.nlayers, 1);
+  while (bench_keep_running(state)) {
+    ParallelBatch batch;
+    int active = 0;
+    execute_parallel_writes(pool, &batch, f.layers, f.nlayers, f.fds, f.data,
+                            f.nbyte, 0, f.results, &active);
+    parallel_batch_wait(&batch);
+  }
+  thread_pool_destroy(pool);
+  fixture_destroy(&f, state);
+}
+
+static void bm_parallel_read(BenchState *state) {
+  FanOutFixture f;
+  fixture_init(&f, state);
+  ThreadPool *pool = thread_pool_init(f.nlayers, 1);
+  while (bench_keep_running(state)) {
+    ParallelBatch batch;
+    int active = 0;
+    execute_parallel_reads(pool, &batch, f.layers, f.nlayers, f.fds,
+                           f.buffers, f.nbyte, 0, f.results, &active);
+    parallel_batch_wait(&batch);
+  }
+  thread_pool_destroy(pool);
+  fixture_destroy(&f, state);
+}
+
+static void bm_sequential_write(BenchState *state) {
+  FanOutFixture f;
+  fixture_init(&f, state);
+  while (bench_keep_running(state)) {
+    for (int i = 0; i < f.nlayers; i++) {
+      f.results[i] =
+          f.layers[i].ops->lpwrite(f.fds[i], f.data, f.nbyte, 0, f.layers[i]);
+    }
+    bench_do_not_optimize(f.results);
+  }
+  fixture_destroy(&f, state);
+}
+
+void register_parallel_benchmarks(void) {
+  const int64_t layers[] = {1, 2, 4, 8};
+  const int64_t sizes[] = {4096, MAX_SIZE};
+  BenchFamily *write = bench_register("BM_parallel_write", bm_parallel_write);
+  BenchFamily *read = bench_register("BM_parallel_read", bm_parallel_read);
+  BenchFamily *sequential =
+      bench_register("BM_sequential_write", bm_sequential_write);
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    for (size_t l = 0; l < sizeof(layers) / sizeof(layers[0]); l++) {
+      bench_args(write, layers[l], sizes[s]);
+      bench_args(read, layers[l], sizes[s]);
+      bench_args(sequential, layers[l], sizes[s]);
+    }
+  }
+}
@@ -0,0 +1,197 @@
+#include "../../config/loader.h"
+#include "../../shared/types/layer_context.h"
+#include "bench.h"
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * ============================================================================
+ * LAYER STACK BENCHMARKS
+ * ============================================================================
+ *
+ * Every --stack=FILE is a TOML configuration, built once at startup. Over
+ * memory layers (type = "memory") the time of an operation is the CPU cost
+ * of the layers of the stack, with no disk or network in it; the
+ * stacks/memory.toml baseline is the cost of the backend alone.
+ *
+ * For a stack named after its file (stacks/encryption.toml: encryption):
+ *
+ * - BM_pwrite/<stack>/<size>: pwrites of size bytes, in turn over the
+ *   FILE_SIZE bytes of an open file
+ * - BM_pread/<stack>/<size>: the same with preads of a written file
+ * - BM_write_file/<stack>/<size>: open with O_TRUNC, write size bytes in
+ *   CHUNK_SIZE pwrites and close, so that the work a layer does on close
+ *   (the hash of anti_tampering file mode, the compression of file mode) is
+ *   counted too
+ * ============================================================================
+ */
+
+#define FILE_SIZE (8 << 20)
+#define CHUNK_SIZE (1 << 16)
+#define MAX_STACKS 64
+
+typedef struct {
+  char name[64];
+  LayerContext root;
+} Stack;
+
+static Stack stacks[MAX_STACKS];
+static int nstacks;
+
+static int stack_open(LayerContext l, const char *path, int flags) {
+  return l.ops->lopen(path, flags, 0644, l);
+}
+
+static void fill(unsigned char *buffer, size_t size) {
+  // half random, half zeros: compressible like most files
+  uint32_t x = 2463534242u;
+  for (size_t i = 0; i < size; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    buffer[i] = (i / 64) % 2 ? 0 : (unsigned char)x;
+  }
+}
+
+// state->arg[0] is the index of the stack, state->arg[1] the size
+static void bm_pwrite(BenchState *state) {
+  LayerContext l = stacks[state->arg[0]].root;
+  size_t size = (size_t)state->arg[1];
+  unsigned char *buffer = malloc(size);
+  fill(buffer, size);
+  int fd = stack_open(l, "/bench.pwrite", O_CREAT | O_RDWR | O_TRUNC);
+  if (fd < 0) {
+    bench_skip(state, "open failed");
+    free(buffer);
+    return;
+  }
+  off_t offset = 0;
+  while (bench_keep_running(state)) {
+    if (l.ops->lpwrite(fd, buffer, size, offset, l) != (ssize_t)size) {
+      abort();
+    }
+    offset = (offset + (off_t)size) % FILE_SIZE;
+  }
+  state->bytes_processed = state->iterations * size;
+  l.ops->lclose(fd, l);
+  free(buffer);
+}
+
+static void bm_pread(BenchState *state) {
+  LayerContext l = stacks[state->arg[0]].root;
+  size_t size = (size_t)state->arg[1];
+  unsigned char *buffer = malloc(CHUNK_SIZE > size ? CHUNK_SIZE : size);
+  fill(buffer, CHUNK_SIZE);
+  int fd = stack_open(l, "/bench.pread", O_CREAT | O_RDWR | O_TRUNC);
+  if (fd < 0) {
+    bench_skip(state, "open failed");
+    free(buffer);
+    return;
+  }
+  for (off_t off = 0; off < FILE_SIZE; off += CHUNK_SIZE) {
+    l.ops->lpwrite(fd, buffer, CHUNK_SIZE, off, l);
+  }
+  l.ops->lclose(fd, l);
+  fd = stack_open(l, "/bench.pread", O_RDONLY);
+  off_t offset = 0;
+  while (bench_keep_running(state)) {
+    if (l.ops->lpread(fd, buffer, size, offset, l) != (ssize_t)size) {
+      abort();
+    }
+    offset = (offset + (off_t)size) % FILE_SIZE;
+  }
+  state->bytes_processed = state->iterations * size;
+  l.ops->lclose(fd, l);
+  free(buffer);
+}
+
+static void bm_write_file(BenchState *state) {
+  LayerContext l = stacks[state->arg[0]].root;
+  size_t size = (size_t)state->arg[1];
+  unsigned char buffer[CHUNK_SIZE];
+  fill(buffer, sizeof(buffer));
+  while (bench_keep_running(state)) {
+    int fd = stack_open(l, "/bench.file", O_CREAT | O_WRONLY | O_TRUNC);
+    for (size_t off = 0; off < size; off += CHUNK_SIZE) {
+      size_t n = size - off < CHUNK_SIZE ? size - off : CHUNK_SIZE;
+      if (l.ops->lpwrite(fd, buffer, n, (off_t)off, l) != (ssize_t)n) {
+        abort();
+      }
+    }
+    l.ops->lclose(fd, l);
+  }
+  state->bytes_processed = state->iterations * size;
+}
+
+// Build a stack, the messages of its libinit go to stderr
+static void stack_load(const char *path) {
+  if (nstacks == MAX_STACKS) {
+    fprintf(stderr, "more than %d stacks\n", MAX_STACKS);
+    exit(1);
+  }
+  Stack *stack = &stacks[nstacks];
+  char *copy = strdup(path);
+  snprintf(stack->name, sizeof(stack->name), "%s", basename(copy));
+  free(copy);
+  char *dot = strrchr(stack->name, '.');
+  if (dot) {
+    *dot = '\0';
+  }
+
+  fflush(stdout);
+  int out = dup(STDOUT_FILENO);
+  dup2(STDERR_FILENO, STDOUT_FILENO);
+  stack->root = load_config_toml((char *)path);
+  fflush(stdout);
+  dup2(out, STDOUT_FILENO);
+  close(out);
+  if (!stack->root.ops) {
+    fprintf(stderr, "failed to build the stack of %s\n", path);
+    exit(1);
+  }
+  nstacks++;
+}
+
+int main(int argc, char **argv) {
+  // --stack options are ours, the others go to bench_main
+  int n = 1;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--stack=", 8) == 0) {
+      stack_load(argv[i] + 8);
+    } else {
+      argv[n++] = argv[i];
+    }
+  }
+  if (nstacks == 0) {
+    fprintf(stderr, "Usage: %s --stack=FILE... [benchmark options]\n",
+            argv[0]);
+    return 1;
+  }
+
+  const int64_t sizes[] = {4096, 65536};
+  const int64_t file_sizes[] = {1 << 20};
+  BenchFamily *pwrite = bench_register("BM_pwrite", bm_pwrite);
+  BenchFamily *pread = bench_register("BM_pread", bm_pread);
+  BenchFamily *write_file = bench_register("BM_write_file", bm_write_file);
+  for (int s = 0; s < nstacks; s++) {
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      bench_args_label(pwrite, stacks[s].name, s, sizes[i]);
+      bench_args_label(pread, stacks[s].name, s, sizes[i]);
+    }
+    for (size_t i = 0; i < sizeof(file_sizes) / sizeof(file_sizes[0]); i++) {
+      bench_args_label(write_file, stacks[s].name, s, file_sizes[i]);
+    }
+  }
+  int res = bench_main(n, argv);
+
+  for (int s = 0; s < nstacks; s++) {
+    if (stacks[s].root.ops->ldestroy) {
+      stacks[s].root.ops->ldestroy(stacks[s].root);
+    }
+  }
+  return res;
+}
@@ -0,0 +1,32 @@
+#include "compression_helpers.h"
+#include "../layers/local/local.h"
+
+#define TEST_TEXT "compressible test text "
+#define TEST_TEXT_LEN (sizeof(TEST_TEXT) - 1)
+
+static LayerContext local_layer;
+
+CompressionConfig compression_test_config(int block_size) {
+  CompressionConfig config = {.algorithm = COMPRESSION_ZSTD,
+                              .level = 1,
+                              .mode = COMPRESSION_MODE_SPARSE_BLOCK,
+                              .block_size = block_size};
+  return config;
+}
+
+LayerContext create_compression_test_layer(const CompressionConfig *config) {
+  local_layer = local_init();
+  return compression_init(&local_layer, config);
+}
+
+void fill_test_text(char *buf, size_t n, int seed) {
+  for (size_t i = 0; i < n; i++) {
+    buf[i] = TEST_TEXT[(i + (size_t)seed) % TEST_TEXT_LEN];
+  }
+}
+
+CompressedFileMapping *compression_test_mapping(int fd, LayerContext l) {
+  FdToInode *entry = fd_to_inode_lookup(l.internal_state, fd);
+  return get_compressed_file_mapping(entry->device, entry->inode,
+                                     l.internal_state);
+}
@@ -0,0 +1,17 @@
+#ifndef __COMPRESSION_HELPERS_H__
+#define __COMPRESSION_HELPERS_H__
+
+#include "../layers/compression/compression.h"
+#include "../layers/compression/compression_utils.h"
+
+// Config of a sparse_block layer with zstd at level 1, for tests to adjust
+CompressionConfig compression_test_config(int block_size);
+// Compression layer of config over a local layer. The local layer is shared
+// by the layers created, one at a time.
+LayerContext create_compression_test_layer(const CompressionConfig *config);
+// Compressible text, shifted by seed
+void fill_test_text(char *buf, size_t n, int seed);
+// Block index of an open file of a compression layer
+CompressedFileMapping *compression_test_mapping(int fd, LayerContext l);
+
+#endif
@@ -123,6 +123,15 @@ static int mock_unlink(const char *pathname, LayerContext l) {
   return state->unlink_return_value;
 }
 
+static int mock_fallocate(int fd, off_t offset, int mode, off_t length,
+                          LayerContext l) {
+  MockLayerState *state = (MockLayerState *)l.internal_state;
+  state->fallocate_called++;
+  state->last_fallocate_input_offset = offset;
+  state->last_fallocate_input_length = length;
+  return 0;
+}
+
 // Create mock layer operations structure
 static LayerOps mock_ops = {.lpread = mock_pread,
                             .lpwrite = mock_pwrite,
@@ -208,6 +217,10 @@ void enable_mock_pwrite_data_storage(MockLayerState *state) {
   state->enable_pwrite_data_storage = 1;
 }
 
+void enable_mock_fallocate(LayerContext *layer) {
+  layer->ops->lfallocate = mock_fallocate;
+}
+
 void free_mock_pwrite_data_storage(MockLayerState *state) {
   if (state->pwrite_data_storage) {
     free(state->pwrite_data_storage);
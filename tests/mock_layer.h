@@ -47,6 +47,10 @@ typedef struct {
   int unlink_return_value;
 
   int enable_pwrite_data_storage; // Flag to enable capturing writes
+
+  int fallocate_called;
+  off_t last_fallocate_input_offset;
+  off_t last_fallocate_input_length;
 } MockLayerState;
 
 // Function declarations
@@ -55,6 +59,9 @@ void reset_mock_state(MockLayerState *state, int ftruncate_return_value,
                       off_t file_size);
 void destroy_mock_layer(LayerContext layer);
 void enable_mock_pwrite_data_storage(MockLayerState *state);
+// Give the layer an lfallocate, which records its calls in the state it is
+// passed (mock layers have none by default)
+void enable_mock_fallocate(LayerContext *layer);
 void free_mock_pwrite_data_storage(MockLayerState *state);
 
 #endif
@@ -0,0 +1,335 @@
+#define _GNU_SOURCE
+#include "../../../config/parser.h"
+#include "../../../config/reload.h"
+#include "../../../layers/cache/read_cache/read_cache.h"
+#include "../../../layers/demultiplexer/demultiplexer.h"
+#include "../../../layers/local/local.h"
+#include "../../../shared/utils/metadata_service.h"
+#include "types/layer_context.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CONFIG_PATH "test_reload.toml"
+
+// The tree the tests reload: zip stands in for a compression layer, split
+// stripes over a read_cache and a local layer
+static const char *const base_config = "root = \"zip\"\n"
+                                       "log_mode = \"disabled\"\n"
+                                       "\n"
+                                       "[services]\n"
+                                       "type = \"metadata\"\n"
+                                       "cache_size = 65536\n"
+                                       "threads = 0\n"
+                                       "\n"
+                                       "[zip]\n"
+                                       "type = \"compression\"\n"
+                                       "next = \"split\"\n"
+                                       "algorithm = \"zstd\"\n"
+                                       "mode = \"file\"\n"
+                                       "level = 3\n"
+                                       "\n"
+                                       "[split]\n"
+                                       "type = \"demultiplexer\"\n"
+                                       "layers = [\"cache\", \"store\"]\n"
+                                       "options = { layout = \"striped\", "
+                                       "stripe_size = 4096 }\n"
+                                       "\n"
+                                       "[cache]\n"
+                                       "type = \"read_cache\"\n"
+                                       "next = \"disk\"\n"
+                                       "num_blocks = 64\n"
+                                       "admit_misses = 2\n"
+                                       "\n"
+                                       "[disk]\n"
+                                       "type = \"local\"\n"
+                                       "\n"
+                                       "[store]\n"
+                                       "type = \"local\"\n"
+                                       "\n"
+                                       "[spare]\n"
+                                       "type = \"local\"\n";
+
+static char config_text[4096];
+
+// Levels zip was given, -1 if none
+static int level_checked;
+static int level_applied;
+
+static int zip_reconfigure(const void *params, int apply, const char **error,
+                           LayerContext l) {
+  (void)error;
+  (void)l;
+  const CompressionConfig *config = (const CompressionConfig *)params;
+  if (apply) {
+    level_applied = config->level;
+  } else {
+    level_checked = config->level;
+  }
+  return 0;
+}
+
+static LayerOps zip_ops = {.lreconfigure = zip_reconfigure};
+
+typedef struct {
+  LayerContext zip;
+  LayerContext split;
+  LayerContext cache;
+  LayerContext store;
+  LayerContext split_layers[2];
+} Tree;
+
+static LayerParams *params_of(Config *config, const char *name) {
+  for (int i = 0; i < config->n_layers; i++) {
+    if (strcmp(config->layers[i].name, name) == 0) {
+      return &config->layers[i].params;
+    }
+  }
+  assert(0);
+  return NULL;
+}
+
+// Replace the first occurrence of from in the configuration to write
+static void edit_config(const char *from, const char *to) {
+  char *at = strstr(config_text, from);
+  assert(at);
+  size_t from_len = strlen(from);
+  size_t to_len = strlen(to);
+  assert(strlen(config_text) - from_len + to_len < sizeof(config_text));
+  memmove(at + to_len, at + from_len, strlen(at + from_len) + 1);
+  memcpy(at, to, to_len);
+}
+
+static void write_config(void) {
+  FILE *fp = fopen(CONFIG_PATH, "w");
+  assert(fp);
+  assert(fputs(config_text, fp) >= 0);
+  assert(fclose(fp) == 0);
+}
+
+/**
+ * @brief Build and track the tree of base_config, as the loader does
+ */
+static void build_tree(Tree *tree) {
+  strcpy(config_text, base_config);
+  level_checked = -1;
+  level_applied = -1;
+
+  toml_result_t conf = toml_parse(base_config, (int)strlen(base_config));
+  assert(conf.ok);
+  Config config = parse_config(conf.toptab);
+
+  reload_track_begin();
+  LayerContext disk = local_init();
+  reload_track_layer("disk", disk);
+  tree->cache =
+      read_cache_init(&disk, 1, &params_of(&config, "cache")->read_cache);
+  reload_track_layer("cache", tree->cache);
+  tree->store = local_init();
+  reload_track_layer("store", tree->store);
+
+  int passthrough_reads[] = {0, 0};
+  int passthrough_writes[] = {0, 0};
+  int enforced_layers[] = {0, 0};
+  tree->split_layers[0] = tree->cache;
+  tree->split_layers[1] = tree->store;
+  tree->split = demultiplexer_init(
+      tree->split_layers, 2, passthrough_reads, passthrough_writes,
+      enforced_layers, &params_of(&config, "split")->demultiplexer);
+  reload_track_layer("split", tree->split);
+
+  tree->zip = (LayerContext){.ops = &zip_ops, .next_layers = &tree->split,
+                             .nlayers = 1};
+  reload_track_layer("zip", tree->zip);
+  reload_track_end(conf, tree->zip);
+
+  free(config.serviceConfig);
+  free_config(&config);
+}
+
+static void destroy_tree(Tree *tree) {
+  reload_forget(tree->zip);
+  demultiplexer_destroy(tree->split);
+  read_cache_destroy(tree->cache);
+  tree->store.ops->ldestroy(tree->store);
+  unlink(CONFIG_PATH);
+}
+
+// The reload is rejected with an error containing expected
+static void assert_rejected(const char *expected) {
+  char error[512];
+  write_config();
+  assert(reload_config_toml(CONFIG_PATH, error, sizeof(error)) == -1);
+  if (!strstr(error, expected)) {
+    fprintf(stderr, "unexpected error: %s\n", error);
+    assert(0);
+  }
+}
+
+static void assert_reloaded(void) {
+  char error[512];
+  write_config();
+  if (reload_config_toml(CONFIG_PATH, error, sizeof(error)) != 0) {
+    fprintf(stderr, "unexpected error: %s\n", error);
+    assert(0);
+  }
+}
+
+void test_tunables_applied() {
+  printf("Testing the tunables changed by a reload...\n");
+
+  Tree tree;
+  build_tree(&tree);
+  ReadCacheState *cache = (ReadCacheState *)tree.cache.internal_state;
+
+  // nothing changed, no layer is called
+  assert_reloaded();
+  assert(level_checked == -1 && level_applied == -1);
+
+  edit_config("level = 3", "level = 5");
+  edit_config("admit_misses = 2", "admit_misses = 4\nbypass_blocks = 8");
+  assert_reloaded();
+  assert(level_checked == 5);
+  assert(level_applied == 5);
+  assert(cache->admission->admit_misses == 4);
+  assert(cache->bypass_blocks == 8);
+
+  // the next reload compares with the configuration taken
+  level_checked = -1;
+  level_applied = -1;
+  assert_reloaded();
+  assert(level_checked == -1 && level_applied == -1);
+
+  destroy_tree(&tree);
+  printf("✅ Tunables test passed\n");
+}
+
+void test_structural_rejected() {
+  printf("Testing the keys a reload cannot change...\n");
+
+  Tree tree;
+  build_tree(&tree);
+  ReadCacheState *cache = (ReadCacheState *)tree.cache.internal_state;
+
+  // a layer parameter, a nested one and a global setting, named by their
+  // path; the tunables changed with them are not taken
+  edit_config("level = 3", "level = 5");
+  edit_config("num_blocks = 64", "num_blocks = 128");
+  assert_rejected("num_blocks of layer cache cannot change without a remount");
+  strcpy(config_text, base_config);
+  edit_config("stripe_size = 4096", "stripe_size = 8192");
+  assert_rejected(
+      "options.stripe_size of layer split cannot change without a remount");
+  strcpy(config_text, base_config);
+  edit_config("threads = 0", "threads = 2");
+  assert_rejected("services.threads cannot change without a remount");
+  strcpy(config_text, base_config);
+  edit_config("log_mode = \"disabled\"\n",
+              "log_mode = \"disabled\"\nhugepages = true\n");
+  assert_rejected("hugepages cannot change without a remount");
+  assert(level_checked == -1 && level_applied == -1);
+  assert(cache->admission->admit_misses == 2);
+
+  destroy_tree(&tree);
+  printf("✅ Structural changes test passed\n");
+}
+
+void test_layers_added_or_removed() {
+  printf("Testing the layers added or removed by a reload...\n");
+
+  Tree tree;
+  build_tree(&tree);
+
+  strcat(config_text, "\n[extra]\ntype = \"local\"\n");
+  assert_rejected("layer extra is new, adding a layer needs a remount");
+  strcpy(config_text, base_config);
+  edit_config("\n[spare]\ntype = \"local\"\n", "");
+  assert_rejected("layer spare is gone, removing a layer needs a remount");
+
+  destroy_tree(&tree);
+  printf("✅ Added and removed layers test passed\n");
+}
+
+void test_read_policy_on_striped_rejected() {
+  printf("Testing a read_policy change of a striped demultiplexer...\n");
+
+  Tree tree;
+  build_tree(&tree);
+  DemultiplexerState *split = (DemultiplexerState *)tree.split.internal_state;
+
+  // zip accepts its level, but takes it only once split accepted its own
+  edit_config("level = 3", "level = 5");
+  edit_config("stripe_size = 4096 }",
+              "stripe_size = 4096, read_policy = \"preferred\" }");
+  assert_rejected(
+      "layer split: the striped and erasure layouts take no read_policy");
+  assert(level_applied == -1);
+  assert(split->read_policy == DEMULTIPLEXER_READ_ALL);
+
+  destroy_tree(&tree);
+  printf("✅ Striped read_policy test passed\n");
+}
+
+void test_admit_misses_crossing_1_rejected() {
+  printf("Testing an admit_misses change crossing 1...\n");
+
+  Tree tree;
+  build_tree(&tree);
+  ReadCacheState *cache = (ReadCacheState *)tree.cache.internal_state;
+
+  edit_config("admit_misses = 2", "admit_misses = 1\nbypass_blocks = 8");
+  assert_rejected("layer cache: admit_misses cannot cross 1");
+  assert(cache->admission->admit_misses == 2);
+  assert(cache->bypass_blocks == 0);
+
+  // within the values above 1, it changes
+  strcpy(config_text, base_config);
+  edit_config("admit_misses = 2", "admit_misses = 3");
+  assert_reloaded();
+  assert(cache->admission->admit_misses == 3);
+
+  destroy_tree(&tree);
+  printf("✅ admit_misses test passed\n");
+}
+
+void test_metadata_cache_resized() {
+  printf("Testing a resize of the metadata cache...\n");
+
+  Tree tree;
+  build_tree(&tree);
+  MetadataCache *metadata = metadata_service_cache();
+  assert(metadata);
+  assert(metadata->shard_bytes == 65536 / METADATA_CACHE_SHARDS);
+
+  edit_config("cache_size = 65536", "cache_size = 131072");
+  assert_reloaded();
+  assert(metadata_service_cache() == metadata);
+  assert(metadata->shard_bytes == 131072 / METADATA_CACHE_SHARDS);
+
+  // too small to hold an entry in each shard
+  edit_config("cache_size = 131072", "cache_size = 16");
+  assert_rejected("the metadata cache cannot be created or removed live");
+  assert(metadata->shard_bytes == 131072 / METADATA_CACHE_SHARDS);
+
+  destroy_tree(&tree);
+  printf("✅ Metadata cache resize test passed\n");
+}
+
+int main() {
+  printf("Running config/reload.c tests...\n");
+
+  // the service of base_config, as the loader configures it
+  MetadataService service = {.cache_size_bytes = 65536};
+  assert(metadata_service_configure(&service) == 0);
+
+  test_tunables_applied();
+  test_structural_rejected();
+  test_layers_added_or_removed();
+  test_read_policy_on_striped_rejected();
+  test_admit_misses_crossing_1_rejected();
+  test_metadata_cache_resized();
+
+  printf("\nAll config/reload.c tests passed!\n");
+  return 0;
+}
@@ -1,7 +1,9 @@
 #include "../../../../layers/anti_tampering/anti_tampering.h"
+#include "../../../../layers/anti_tampering/anti_tampering_utils.h"
 #include "../../../../shared/utils/hasher/hasher.h"
 #include "../../../mock_layer.h"
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 
@@ -166,7 +168,7 @@ void test_anti_tampering_ftruncate_lock_contention() {
 
   // Manually acquire the write lock first to simulate contention
   AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
-  char *file_path = state->mappings[fd].file_path;
+  const char *file_path = anti_tampering_mapping(state, fd)->file_path;
 
   // We simulate the lock being held by another process
   int lock_result = locking_acquire_write(state->lock_table, file_path);
@@ -244,7 +246,7 @@ void test_anti_tampering_fstat_fails_if_lock_contention() {
 
   // Manually acquire the write lock first to simulate contention
   AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
-  char *file_path = state->mappings[fd].file_path;
+  const char *file_path = anti_tampering_mapping(state, fd)->file_path;
 
   // We simulate the lock being held by another process
   int lock_result = locking_acquire_write(state->lock_table, file_path);
@@ -355,7 +357,8 @@ void test_anti_tampering_unlink_success() {
       "/tmp/test_anti_tampering_unlink_12345.txt", O_RDWR | O_CREAT, 0,
       anti_tampering_layer);
   assert(res >= 0);
-  char *hash_pathname = strdup(state->mappings[res].hash_path);
+  char *hash_pathname =
+      strdup(anti_tampering_mapping(state, res)->hash_path);
   assert(hash_pathname != NULL);
   anti_tampering_layer.ops->lclose(res, anti_tampering_layer);
 
@@ -416,6 +419,140 @@ void test_anti_tampering_unlink_fails_if_lock_contention() {
   printf("✅ unlink fails if lock contention test passed\n");
 }
 
+void test_anti_tampering_interned_paths() {
+  printf("Testing interned paths...\n");
+
+  MockLayerState data_state = {0};
+  MockLayerState hash_state = {0};
+
+  LayerContext data_layer = create_mock_layer(&data_state);
+  LayerContext hash_layer = create_mock_layer(&hash_state);
+
+  AntiTamperingConfig cfg = create_default_anti_tampering_config();
+  LayerContext anti_tampering_layer =
+      anti_tampering_init(data_layer, hash_layer, &cfg);
+  AntiTamperingState *state =
+      (AntiTamperingState *)anti_tampering_layer.internal_state;
+
+  // the hash path and the lock key are those of the plain path
+  const char *file_path = "/tmp/test_anti_tampering_interned.txt";
+  InternedPath *path = intern_path(state, file_path);
+  assert(path != NULL);
+  assert(strcmp(path->file_path, file_path) == 0);
+  char hex[HASHER_MAX_HEX_SIZE];
+  assert(state->hasher.hash_buffer_hex_into(file_path, strlen(file_path), hex,
+                                            sizeof(hex)) >= 0);
+  char *hash_path = construct_hash_pathname(state, hex);
+  assert(strcmp(path->hash_path, hash_path) == 0);
+  free(hash_path);
+  LockKey key;
+  locking_key_init(&key, file_path);
+  assert(path->lock_key.file_path == path->file_path);
+  assert(path->lock_key.path_len == key.path_len);
+  assert(path->lock_key.hash == key.hash);
+  assert(intern_path(state, NULL) == NULL);
+
+  // an open fd holds the paths it was opened with
+  int fd = anti_tampering_layer.ops->lopen(file_path, O_RDWR | O_CREAT, 0,
+                                           anti_tampering_layer);
+  assert(fd >= 0);
+  FileMapping *mapping = anti_tampering_mapping(state, fd);
+  assert(mapping->path != NULL && mapping->path->refs == 1);
+  assert(mapping->file_path == mapping->path->file_path);
+  assert(strcmp(mapping->hash_path, path->hash_path) == 0);
+  InternedPath *held = interned_path_ref(mapping->path);
+  assert(held->refs == 2);
+
+  // closed: the mapping dropped its reference, ours keeps the paths
+  anti_tampering_layer.ops->lclose(fd, anti_tampering_layer);
+  assert(anti_tampering_mapping(state, fd) == NULL);
+  assert(held->refs == 1);
+  assert(strcmp(held->file_path, file_path) == 0);
+  interned_path_unref(held);
+  interned_path_unref(path);
+  interned_path_unref(NULL);
+
+  anti_tampering_destroy(anti_tampering_layer);
+  destroy_mock_layer(data_layer);
+  destroy_mock_layer(hash_layer);
+  printf("✅ interned paths test passed\n");
+}
+
+// lmkdir of the hash layer that records the directories and fails with
+// mkdir_errno, 0 to succeed
+static char made_dirs[4][256];
+static size_t n_made_dirs;
+static int mkdir_errno;
+
+static int recording_mkdir(const char *path, mode_t mode, LayerContext l) {
+  (void)mode;
+  (void)l;
+  if (mkdir_errno) {
+    errno = mkdir_errno;
+    return -1;
+  }
+  assert(n_made_dirs < 4);
+  snprintf(made_dirs[n_made_dirs++], sizeof(made_dirs[0]), "%s", path);
+  return 0;
+}
+
+void test_anti_tampering_hash_fanout() {
+  printf("Testing hash fan-out directories...\n");
+
+  MockLayerState data_state = {0};
+  MockLayerState hash_state = {0};
+
+  LayerContext data_layer = create_mock_layer(&data_state);
+  LayerContext hash_layer = create_mock_layer(&hash_state);
+  hash_layer.ops->lmkdir = recording_mkdir;
+
+  AntiTamperingConfig cfg = create_default_anti_tampering_config();
+  cfg.hash_fanout = 2;
+  LayerContext anti_tampering_layer =
+      anti_tampering_init(data_layer, hash_layer, &cfg);
+  AntiTamperingState *state =
+      (AntiTamperingState *)anti_tampering_layer.internal_state;
+
+  // the hash file is two levels down, named after its first characters
+  const char *file_path = "/tmp/test_anti_tampering_fanout.txt";
+  char hex[HASHER_MAX_HEX_SIZE];
+  assert(state->hasher.hash_buffer_hex_into(file_path, strlen(file_path), hex,
+                                            sizeof(hex)) >= 0);
+  char expected[512];
+  snprintf(expected, sizeof(expected), "/tmp/hashes/%.2s/%.2s/%s.hash", hex,
+           hex + 2, hex);
+  char *hash_path = construct_hash_pathname(state, hex);
+  assert(strcmp(hash_path, expected) == 0);
+  InternedPath *path = intern_path(state, file_path);
+  assert(strcmp(path->hash_path, expected) == 0);
+  interned_path_unref(path);
+
+  // each level is created, from the top
+  n_made_dirs = 0;
+  mkdir_errno = 0;
+  assert(make_hash_dirs(state, hash_path, NULL) == 0);
+  assert(n_made_dirs == 2);
+  assert(strncmp(made_dirs[0], expected, strlen("/tmp/hashes/ab")) == 0);
+  assert(strlen(made_dirs[0]) == strlen("/tmp/hashes/ab"));
+  assert(strncmp(made_dirs[1], expected, strlen("/tmp/hashes/ab/cd")) == 0);
+  assert(strlen(made_dirs[1]) == strlen("/tmp/hashes/ab/cd"));
+
+  // existing directories and layers without directories are no error
+  mkdir_errno = EEXIST;
+  assert(make_hash_dirs(state, hash_path, NULL) == 0);
+  mkdir_errno = ENOSYS;
+  assert(make_hash_dirs(state, hash_path, NULL) == 0);
+  mkdir_errno = EACCES;
+  assert(make_hash_dirs(state, hash_path, NULL) == -1 && errno == EACCES);
+  mkdir_errno = 0;
+  free(hash_path);
+
+  anti_tampering_destroy(anti_tampering_layer);
+  destroy_mock_layer(data_layer);
+  destroy_mock_layer(hash_layer);
+  printf("✅ hash fan-out test passed\n");
+}
+
 int main() {
   printf("Running anti-tampering tests...\n\n");
 
@@ -442,6 +579,9 @@ int main() {
   test_anti_tampering_unlink_fails_if_lock_contention();
   printf("All anti-tampering unlink tests passed!\n");
 
+  test_anti_tampering_interned_paths();
+  test_anti_tampering_hash_fanout();
+
   printf("\nAll anti-tampering tests passed!\n");
   return 0;
 }
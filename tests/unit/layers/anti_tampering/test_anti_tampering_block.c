@@ -1,10 +1,14 @@
 #include "../../../../layers/anti_tampering/anti_tampering.h"
 #include "../../../../layers/anti_tampering/anti_tampering_utils.h"
 #include "../../../../layers/anti_tampering/block_anti_tampering.h"
+#include "../../../../layers/anti_tampering/verified_blocks.h"
 #include "../../../../layers/local/local.h"
+#include "../../../../shared/utils/conversion.h"
 #include "../../../../shared/utils/hasher/hasher.h"
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +23,32 @@ static void cleanup_local_layer(LayerContext *layer) {
   }
 }
 
+// Hash layer opens/closes, to check the hash fd is kept open across block ops
+static int hash_opens = 0;
+static int hash_closes = 0;
+static int (*local_open_fn)(const char *, int, mode_t, LayerContext);
+static int (*local_close_fn)(int, LayerContext);
+
+static int counting_open(const char *pathname, int flags, mode_t mode,
+                         LayerContext l) {
+  hash_opens++;
+  return local_open_fn(pathname, flags, mode, l);
+}
+
+static int counting_close(int fd, LayerContext l) {
+  hash_closes++;
+  return local_close_fn(fd, l);
+}
+
+static LayerContext counting_local_init() {
+  LayerContext layer = local_init();
+  local_open_fn = layer.ops->lopen;
+  local_close_fn = layer.ops->lclose;
+  layer.ops->lopen = counting_open;
+  layer.ops->lclose = counting_close;
+  return layer;
+}
+
 #define BLOCK_SIZE ((size_t)1024)
 #define NUM_BLOCKS ((size_t)3)
 #define TEST_DATA_SIZE (BLOCK_SIZE * NUM_BLOCKS)
@@ -126,20 +156,30 @@ void test_block_write_multiple_hashes() {
   assert(stat(hash_file_path, &st) == 0);
   printf("  Hash file created: %s\n", hash_file_path);
 
-  // Read hash file and verify it contains multiple hashes
-  // SHA256 produces 64 hex characters per hash
+  // Read hash file and verify it contains a header and multiple hashes
+  // SHA256 produces 32 byte (64 hex characters) digests
+  const size_t digest_size = 32;
   const size_t hex_chars = 64;
-  const size_t expected_hash_file_size = NUM_BLOCKS * hex_chars;
+  const size_t expected_hash_file_size =
+      sizeof(BlockHashesHeader) + (NUM_BLOCKS * digest_size);
 
-  assert(st.st_size >= (off_t)expected_hash_file_size);
-  printf("  Hash file size: %ld bytes (expected at least %zu)\n",
-         (long)st.st_size, expected_hash_file_size);
+  assert(st.st_size == (off_t)expected_hash_file_size);
+  printf("  Hash file size: %ld bytes (expected %zu)\n", (long)st.st_size,
+         expected_hash_file_size);
 
   // Read all hashes from the file
   char *hash_file_content =
       read_hash_file(hash_file_path, 0, expected_hash_file_size);
   assert(hash_file_content != NULL);
 
+  BlockHashesHeader header;
+  memcpy(&header, hash_file_content, sizeof(header));
+  assert(memcmp(header.magic, BLOCK_HASHES_MAGIC, sizeof(header.magic)) == 0);
+  assert(header.version == BLOCK_HASHES_VERSION);
+  assert(header.algorithm == HASH_SHA256);
+  assert(header.digest_size == digest_size);
+  assert(header.block_size == BLOCK_SIZE);
+
   // Verify each block's hash
   AntiTamperingState *state_ptr = (AntiTamperingState *)ctx.internal_state;
   for (size_t i = 0; i < NUM_BLOCKS; i++) {
@@ -148,10 +188,11 @@ void test_block_write_multiple_hashes() {
         compute_block_hash(block_data, BLOCK_SIZE, &state_ptr->hasher);
     assert(expected_hash != NULL);
 
-    // Extract hash from file (each hash is hex_chars bytes)
+    // Extract hash from file (each hash is digest_size bytes)
     char stored_hash[hex_chars + 1];
-    memcpy(stored_hash, hash_file_content + (i * hex_chars), hex_chars);
-    stored_hash[hex_chars] = '\0';
+    bytes_to_hex((const unsigned char *)hash_file_content + sizeof(header) +
+                     (i * digest_size),
+                 digest_size, stored_hash);
 
     // Compare
     assert(strncmp(stored_hash, expected_hash, hex_chars) == 0);
@@ -283,6 +324,837 @@ void test_block_read_hash_verification() {
   printf("✅ Block read hash verification test passed\n");
 }
 
+void test_block_hash_fd_reused() {
+  printf("Testing block mode keeps the hash fd open between block ops...\n");
+
+  char test_data_dir[] = "/tmp/test_block_fd_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_block_fd_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+
+  char test_file_path[512];
+  int ret = snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+                     test_data_dir);
+  assert(ret > 0 && ret < (int)sizeof(test_file_path));
+
+  LayerContext data_layer = local_init();
+  LayerContext hash_layer = counting_local_init();
+  AntiTamperingConfig cfg = create_block_config(test_hash_dir);
+  LayerContext ctx = anti_tampering_init(data_layer, hash_layer, &cfg);
+
+  hash_opens = 0;
+  hash_closes = 0;
+  int fd =
+      block_anti_tampering_open(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+  assert(hash_opens == 1);
+
+  char block[BLOCK_SIZE];
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    memset(block, 'a' + (int)i, BLOCK_SIZE);
+    assert(block_anti_tampering_write(fd, block, BLOCK_SIZE,
+                                      (off_t)(i * BLOCK_SIZE),
+                                      ctx) == (ssize_t)BLOCK_SIZE);
+  }
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    assert(block_anti_tampering_read(fd, block, BLOCK_SIZE,
+                                     (off_t)(i * BLOCK_SIZE),
+                                     ctx) == (ssize_t)BLOCK_SIZE);
+    assert(block[0] == 'a' + (int)i);
+  }
+  assert(hash_opens == 1);
+  assert(hash_closes == 0);
+
+  assert(block_anti_tampering_close(fd, ctx) == 0);
+  assert(hash_closes == 1);
+
+  anti_tampering_destroy(ctx);
+  cleanup_local_layer(&data_layer);
+  cleanup_local_layer(&hash_layer);
+  unlink(test_file_path);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+
+  printf("✅ Block mode hash fd reuse test passed\n");
+}
+
+// Data layer advertising digests, like encryption: counts the requests that
+// came with a LayerDigest and the plain ones
+static int digest_reads = 0;
+static int digest_writes = 0;
+static int plain_reads = 0;
+static ssize_t (*local_pread_fn)(int, void *, size_t, off_t, LayerContext);
+static ssize_t (*local_pwrite_fn)(int, const void *, size_t, off_t,
+                                  LayerContext);
+
+static int fill_digests(const LayerDigest *digest, const void *buffer,
+                        size_t nbyte) {
+  const uint8_t *data = buffer;
+  uint8_t *out = digest->digests;
+  for (size_t i = 0; i * digest->block_size < nbyte; i++) {
+    size_t off = i * digest->block_size;
+    size_t n = nbyte - off < digest->block_size ? nbyte - off
+                                                : digest->block_size;
+    if (digest->hash_block(data + off, n, out + (i * digest->digest_size),
+                           digest->arg) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static ssize_t counting_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                              LayerContext l) {
+  plain_reads++;
+  return local_pread_fn(fd, buffer, nbyte, offset, l);
+}
+
+static ssize_t digesting_pread(int fd, void *buffer, size_t nbyte,
+                               off_t offset, const LayerDigest *digest,
+                               LayerContext l) {
+  digest_reads++;
+  ssize_t res = local_pread_fn(fd, buffer, nbyte, offset, l);
+  if (res > 0 && fill_digests(digest, buffer, (size_t)res) != 0) {
+    return -1;
+  }
+  return res;
+}
+
+static ssize_t digesting_pwrite(int fd, const void *buffer, size_t nbyte,
+                                off_t offset, const LayerDigest *digest,
+                                LayerContext l) {
+  digest_writes++;
+  if (fill_digests(digest, buffer, nbyte) != 0) {
+    return -1;
+  }
+  return local_pwrite_fn(fd, buffer, nbyte, offset, l);
+}
+
+static LayerContext digesting_local_init() {
+  LayerContext layer = local_init();
+  local_pread_fn = layer.ops->lpread;
+  local_pwrite_fn = layer.ops->lpwrite;
+  layer.ops->lpread = counting_pread;
+  layer.ops->lpread_digest = digesting_pread;
+  layer.ops->lpwrite_digest = digesting_pwrite;
+  return layer;
+}
+
+void test_block_fused_digests() {
+  printf("Testing block mode with digests from the data layer...\n");
+
+  char test_data_dir[] = "/tmp/test_block_fused_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_block_fused_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+
+  char test_file_path[512];
+  int ret = snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+                     test_data_dir);
+  assert(ret > 0 && ret < (int)sizeof(test_file_path));
+
+  LayerContext data_layer = digesting_local_init();
+  LayerContext hash_layer = local_init();
+  AntiTamperingConfig cfg = create_block_config(test_hash_dir);
+  LayerContext ctx = anti_tampering_init(data_layer, hash_layer, &cfg);
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+
+  int fd =
+      block_anti_tampering_open(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+
+  // a partial last block gets its digest too
+  const size_t size = TEST_DATA_SIZE - 100;
+  char *test_data = malloc(TEST_DATA_SIZE);
+  assert(test_data != NULL);
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    memset(test_data + (i * BLOCK_SIZE), 'k' + (int)i, BLOCK_SIZE);
+  }
+  assert(block_anti_tampering_write(fd, test_data, size, 0, ctx) ==
+         (ssize_t)size);
+  assert(digest_writes == 1);
+
+  // the stored digests are the ones of the plaintext blocks
+  char *hash_file_content = read_hash_file(
+      anti_tampering_mapping(state, fd)->hash_path, 0,
+      sizeof(BlockHashesHeader) + (NUM_BLOCKS * 32));
+  assert(hash_file_content != NULL);
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    size_t n = i + 1 < NUM_BLOCKS ? BLOCK_SIZE : BLOCK_SIZE - 100;
+    char *expected =
+        compute_block_hash(test_data + (i * BLOCK_SIZE), n, &state->hasher);
+    char stored[65];
+    bytes_to_hex((const unsigned char *)hash_file_content +
+                     sizeof(BlockHashesHeader) + (i * 32),
+                 32, stored);
+    assert(strcmp(stored, expected) == 0);
+    free(expected);
+  }
+  free(hash_file_content);
+
+  // reads take the digests of the data layer instead of hashing again
+  char *buf = malloc(TEST_DATA_SIZE);
+  assert(buf != NULL);
+  plain_reads = 0;
+  assert(block_anti_tampering_read(fd, buf, size, 0, ctx) == (ssize_t)size);
+  assert(memcmp(buf, test_data, size) == 0);
+  assert(digest_reads == 1);
+  assert(plain_reads == 0);
+
+  char *hash_path = strdup(anti_tampering_mapping(state, fd)->hash_path);
+  assert(block_anti_tampering_close(fd, ctx) == 0);
+
+  free(buf);
+  free(test_data);
+  anti_tampering_destroy(ctx);
+  cleanup_local_layer(&data_layer);
+  cleanup_local_layer(&hash_layer);
+  unlink(test_file_path);
+  unlink(hash_path);
+  free(hash_path);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+
+  printf("✅ Block mode digests from the data layer test passed\n");
+}
+
+void test_block_legacy_hex_migration() {
+  printf("Testing block mode converts legacy hex hash files...\n");
+
+  char test_data_dir[] = "/tmp/test_block_legacy_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_block_legacy_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+
+  char test_file_path[512];
+  int ret = snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+                     test_data_dir);
+  assert(ret > 0 && ret < (int)sizeof(test_file_path));
+
+  LayerContext data_layer = local_init();
+  LayerContext hash_layer = local_init();
+  AntiTamperingConfig cfg = create_block_config(test_hash_dir);
+  LayerContext ctx = anti_tampering_init(data_layer, hash_layer, &cfg);
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+
+  // Data file and hash file in the legacy format (hex digest per block)
+  char *test_data = malloc(TEST_DATA_SIZE);
+  assert(test_data != NULL);
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    memset(test_data + (i * BLOCK_SIZE), 'K' + (int)i, BLOCK_SIZE);
+  }
+  int direct_fd = open(test_file_path, O_RDWR | O_CREAT, 0644);
+  assert(direct_fd >= 0);
+  assert(pwrite(direct_fd, test_data, TEST_DATA_SIZE, 0) == TEST_DATA_SIZE);
+  close(direct_fd);
+
+  char *file_path_hex_hash =
+      state->hasher.hash_buffer_hex(test_file_path, strlen(test_file_path));
+  char *hash_file_path = construct_hash_pathname(state, file_path_hex_hash);
+  free(file_path_hex_hash);
+  int legacy_fd = open(hash_file_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  assert(legacy_fd >= 0);
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    char *hex = compute_block_hash(test_data + (i * BLOCK_SIZE), BLOCK_SIZE,
+                                   &state->hasher);
+    assert(pwrite(legacy_fd, hex, 64, (off_t)(i * 64)) == 64);
+    free(hex);
+  }
+  close(legacy_fd);
+
+  // Open converts the file, reads keep verifying against the same digests
+  int fd = block_anti_tampering_open(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+
+  struct stat st;
+  assert(stat(hash_file_path, &st) == 0);
+  assert(st.st_size == (off_t)(sizeof(BlockHashesHeader) + (NUM_BLOCKS * 32)));
+
+  char *converted = read_hash_file(hash_file_path, 0, (size_t)st.st_size);
+  assert(converted != NULL);
+  assert(memcmp(converted, BLOCK_HASHES_MAGIC, 4) == 0);
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    unsigned char expected[32];
+    assert(state->hasher.hash_buffer_binary(test_data + (i * BLOCK_SIZE),
+                                            BLOCK_SIZE, expected,
+                                            sizeof(expected)) == 32);
+    assert(memcmp(converted + sizeof(BlockHashesHeader) + (i * 32), expected,
+                  32) == 0);
+  }
+  free(converted);
+
+  char *read_buffer = malloc(TEST_DATA_SIZE);
+  assert(read_buffer != NULL);
+  assert(block_anti_tampering_read(fd, read_buffer, TEST_DATA_SIZE, 0, ctx) ==
+         TEST_DATA_SIZE);
+  assert(memcmp(read_buffer, test_data, TEST_DATA_SIZE) == 0);
+  assert(block_anti_tampering_close(fd, ctx) == 0);
+
+  // A second open leaves the converted file untouched
+  fd = block_anti_tampering_open(test_file_path, O_RDONLY, 0, ctx);
+  assert(fd >= 0);
+  struct stat st2;
+  assert(stat(hash_file_path, &st2) == 0);
+  assert(st2.st_size == st.st_size);
+  assert(block_anti_tampering_close(fd, ctx) == 0);
+
+  free(read_buffer);
+  free(test_data);
+  anti_tampering_destroy(ctx);
+  cleanup_local_layer(&data_layer);
+  cleanup_local_layer(&hash_layer);
+  unlink(test_file_path);
+  unlink(hash_file_path);
+  free(hash_file_path);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+
+  printf("✅ Block mode legacy hex migration test passed\n");
+}
+
+// Hash layer reads, to check verified blocks skip the stored digests
+static int hash_preads = 0;
+static ssize_t (*hash_pread_fn)(int, void *, size_t, off_t, LayerContext);
+
+static ssize_t counting_hash_pread(int fd, void *buffer, size_t nbyte,
+                                   off_t offset, LayerContext l) {
+  hash_preads++;
+  return hash_pread_fn(fd, buffer, nbyte, offset, l);
+}
+
+void test_block_verified_blocks() {
+  printf("Testing block mode skips blocks verified since their last "
+         "write...\n");
+
+  char test_data_dir[] = "/tmp/test_block_verified_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_block_verified_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+
+  char test_file_path[512];
+  int ret = snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+                     test_data_dir);
+  assert(ret > 0 && ret < (int)sizeof(test_file_path));
+
+  LayerContext data_layer = local_init();
+  LayerContext hash_layer = local_init();
+  hash_pread_fn = hash_layer.ops->lpread;
+  hash_layer.ops->lpread = counting_hash_pread;
+  AntiTamperingConfig cfg = create_block_config(test_hash_dir);
+  cfg.verified_block_files = 16;
+  LayerContext ctx = anti_tampering_init(data_layer, hash_layer, &cfg);
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  assert(state->verified != NULL);
+
+  int fd =
+      block_anti_tampering_open(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+
+  char data[TEST_DATA_SIZE];
+  char read_buf[TEST_DATA_SIZE];
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    memset(data + i * BLOCK_SIZE, 'a' + (int)i, BLOCK_SIZE);
+  }
+  assert(block_anti_tampering_write(fd, data, TEST_DATA_SIZE, 0, ctx) ==
+         (ssize_t)TEST_DATA_SIZE);
+
+  // the first read verifies the blocks, the next ones trust them
+  hash_preads = 0;
+  assert(block_anti_tampering_read(fd, read_buf, TEST_DATA_SIZE, 0, ctx) ==
+         (ssize_t)TEST_DATA_SIZE);
+  assert(hash_preads == 1);
+  assert(block_anti_tampering_read(fd, read_buf, TEST_DATA_SIZE, 0, ctx) ==
+         (ssize_t)TEST_DATA_SIZE);
+  assert(block_anti_tampering_read(fd, read_buf, 100, (off_t)BLOCK_SIZE + 10,
+                                   ctx) == 100);
+  assert(hash_preads == 1);
+  assert(state->verified->hits == 2);
+  assert(memcmp(read_buf, data + BLOCK_SIZE + 10, 100) == 0);
+
+  // a write forgets its blocks only
+  memset(data + BLOCK_SIZE, 'z', BLOCK_SIZE);
+  assert(block_anti_tampering_write(fd, data + BLOCK_SIZE, BLOCK_SIZE,
+                                    (off_t)BLOCK_SIZE,
+                                    ctx) == (ssize_t)BLOCK_SIZE);
+  assert(block_anti_tampering_read(fd, read_buf, BLOCK_SIZE, 0, ctx) ==
+         (ssize_t)BLOCK_SIZE);
+  assert(hash_preads == 1);
+  assert(block_anti_tampering_read(fd, read_buf, TEST_DATA_SIZE, 0, ctx) ==
+         (ssize_t)TEST_DATA_SIZE);
+  assert(hash_preads == 2);
+  assert(memcmp(read_buf, data, TEST_DATA_SIZE) == 0);
+
+  // a truncate forgets the whole file
+  assert(block_anti_tampering_ftruncate(fd, (off_t)TEST_DATA_SIZE, ctx) == 0);
+  assert(block_anti_tampering_read(fd, read_buf, BLOCK_SIZE, 0, ctx) ==
+         (ssize_t)BLOCK_SIZE);
+  assert(hash_preads == 3);
+  assert(block_anti_tampering_close(fd, ctx) == 0);
+
+  // so does an open, the file may have changed while it was closed
+  fd = block_anti_tampering_open(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  hash_preads = 0;
+  assert(block_anti_tampering_read(fd, read_buf, BLOCK_SIZE, 0, ctx) ==
+         (ssize_t)BLOCK_SIZE);
+  assert(hash_preads == 1);
+  assert(block_anti_tampering_close(fd, ctx) == 0);
+
+  char *file_path_hex_hash =
+      state->hasher.hash_buffer_hex(test_file_path, strlen(test_file_path));
+  assert(file_path_hex_hash != NULL);
+  char *hash_file_path = construct_hash_pathname(state, file_path_hex_hash);
+  assert(hash_file_path != NULL);
+  free(file_path_hex_hash);
+
+  anti_tampering_destroy(ctx);
+  cleanup_local_layer(&data_layer);
+  cleanup_local_layer(&hash_layer);
+  unlink(test_file_path);
+  unlink(hash_file_path);
+  free(hash_file_path);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+
+  printf("✅ Block mode verified blocks test passed\n");
+}
+
+static int hash_pwrites = 0;
+static ssize_t (*hash_pwrite_fn)(int, const void *, size_t, off_t,
+                                 LayerContext);
+
+static ssize_t counting_hash_pwrite(int fd, const void *buffer, size_t nbyte,
+                                    off_t offset, LayerContext l) {
+  hash_pwrites++;
+  return hash_pwrite_fn(fd, buffer, nbyte, offset, l);
+}
+
+void test_block_digest_cache() {
+  printf("Testing block mode digest cache...\n");
+
+  char test_data_dir[] = "/tmp/test_block_cache_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_block_cache_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+
+  char test_file_path[512];
+  int ret = snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+                     test_data_dir);
+  assert(ret > 0 && ret < (int)sizeof(test_file_path));
+
+  LayerContext data_layer = local_init();
+  LayerContext hash_layer = local_init();
+  hash_pread_fn = hash_layer.ops->lpread;
+  hash_pwrite_fn = hash_layer.ops->lpwrite;
+  hash_layer.ops->lpread = counting_hash_pread;
+  hash_layer.ops->lpwrite = counting_hash_pwrite;
+  AntiTamperingConfig cfg = create_block_config(test_hash_dir);
+  cfg.digest_cache = 1;
+  LayerContext ctx = anti_tampering_init(data_layer, hash_layer, &cfg);
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  const size_t ds = state->hasher.get_hash_size();
+
+  char data[TEST_DATA_SIZE];
+  char read_buf[TEST_DATA_SIZE];
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    memset(data + i * BLOCK_SIZE, 'a' + (int)i, BLOCK_SIZE);
+  }
+
+  // two fds of the path share the digests, which stay in memory until close
+  int fd =
+      block_anti_tampering_open(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+  int fd2 = block_anti_tampering_open(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd2 >= 0);
+  assert(anti_tampering_mapping(state, fd)->blocks != NULL);
+  assert(anti_tampering_mapping(state, fd)->blocks ==
+         anti_tampering_mapping(state, fd2)->blocks);
+
+  hash_preads = 0;
+  hash_pwrites = 0;
+  assert(block_anti_tampering_write(fd, data, TEST_DATA_SIZE, 0, ctx) ==
+         (ssize_t)TEST_DATA_SIZE);
+  assert(block_anti_tampering_read(fd2, read_buf, TEST_DATA_SIZE, 0, ctx) ==
+         (ssize_t)TEST_DATA_SIZE);
+  assert(memcmp(read_buf, data, TEST_DATA_SIZE) == 0);
+  assert(hash_preads == 0);
+  assert(hash_pwrites == 0);
+
+  // the dirty range goes to the hash file in one write
+  assert(block_anti_tampering_close(fd2, ctx) == 0);
+  assert(hash_pwrites == 1);
+  assert(block_anti_tampering_close(fd, ctx) == 0);
+  assert(hash_pwrites == 1);
+
+  char *file_path_hex_hash =
+      state->hasher.hash_buffer_hex(test_file_path, strlen(test_file_path));
+  assert(file_path_hex_hash != NULL);
+  char *hash_file_path = construct_hash_pathname(state, file_path_hex_hash);
+  assert(hash_file_path != NULL);
+  free(file_path_hex_hash);
+
+  int hash_file = open(hash_file_path, O_RDONLY);
+  assert(hash_file >= 0);
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    uint8_t stored[HASHER_MAX_HASH_SIZE];
+    uint8_t expected[HASHER_MAX_HASH_SIZE];
+    assert(pread(hash_file, stored, ds,
+                 (off_t)(sizeof(BlockHashesHeader) + i * ds)) == (ssize_t)ds);
+    assert(state->hasher.hash_buffer_binary(data + i * BLOCK_SIZE, BLOCK_SIZE,
+                                            expected, ds) == (int)ds);
+    assert(memcmp(stored, expected, ds) == 0);
+  }
+  close(hash_file);
+
+  // the next first open reads the whole hash file at once
+  hash_preads = 0;
+  fd = block_anti_tampering_open(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  assert(hash_preads == 2); // header and digests
+  assert(block_anti_tampering_read(fd, read_buf, TEST_DATA_SIZE, 0, ctx) ==
+         (ssize_t)TEST_DATA_SIZE);
+  assert(hash_preads == 2);
+  assert(block_anti_tampering_close(fd, ctx) == 0);
+
+  anti_tampering_destroy(ctx);
+  cleanup_local_layer(&data_layer);
+  cleanup_local_layer(&hash_layer);
+  unlink(test_file_path);
+  unlink(hash_file_path);
+  free(hash_file_path);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+
+  printf("✅ Block mode digest cache test passed\n");
+}
+
+#define FSYNC_THREADS 8
+
+static AntiTamperingState *fsync_state = NULL;
+static int data_fsyncs = 0;
+static int hash_fsyncs = 0;
+static int (*data_fsync_fn)(int, int, LayerContext);
+static int (*hash_fsync_fn)(int, int, LayerContext);
+
+static size_t fsync_calls(void) {
+  GroupCommitStats stats;
+  group_commit_get_stats(&fsync_state->fsyncs, &stats);
+  return stats.calls;
+}
+
+static int counting_data_fsync(int fd, int isdatasync, LayerContext l) {
+  // hold the first fsync until the others arrived
+  if (__atomic_fetch_add(&data_fsyncs, 1, __ATOMIC_SEQ_CST) == 0) {
+    while (fsync_calls() < FSYNC_THREADS) {
+      usleep(1000);
+    }
+  }
+  return data_fsync_fn(fd, isdatasync, l);
+}
+
+static int counting_hash_fsync(int fd, int isdatasync, LayerContext l) {
+  __atomic_add_fetch(&hash_fsyncs, 1, __ATOMIC_SEQ_CST);
+  return hash_fsync_fn(fd, isdatasync, l);
+}
+
+typedef struct {
+  int fd;
+  LayerContext ctx;
+} FsyncJob;
+
+static void *fsync_worker(void *arg) {
+  FsyncJob *job = arg;
+  assert(block_anti_tampering_fsync(job->fd, 0, job->ctx) == 0);
+  return NULL;
+}
+
+void test_block_fsync() {
+  printf("Testing block mode group commit of fsyncs...\n");
+
+  char test_data_dir[] = "/tmp/test_block_fsync_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_block_fsync_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+
+  char test_file_path[512];
+  int ret = snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+                     test_data_dir);
+  assert(ret > 0 && ret < (int)sizeof(test_file_path));
+
+  LayerContext data_layer = local_init();
+  LayerContext hash_layer = local_init();
+  data_fsync_fn = data_layer.ops->lfsync;
+  hash_fsync_fn = hash_layer.ops->lfsync;
+  hash_pwrite_fn = hash_layer.ops->lpwrite;
+  data_layer.ops->lfsync = counting_data_fsync;
+  hash_layer.ops->lfsync = counting_hash_fsync;
+  hash_layer.ops->lpwrite = counting_hash_pwrite;
+  AntiTamperingConfig cfg = create_block_config(test_hash_dir);
+  cfg.digest_cache = 1;
+  LayerContext ctx = anti_tampering_init(data_layer, hash_layer, &cfg);
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  fsync_state = state;
+  const size_t ds = state->hasher.get_hash_size();
+  assert(ctx.ops->lfsync == block_anti_tampering_fsync);
+
+  char data[TEST_DATA_SIZE];
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    memset(data + i * BLOCK_SIZE, 'k' + (int)i, BLOCK_SIZE);
+  }
+  int fd =
+      block_anti_tampering_open(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+  int fd2 = block_anti_tampering_open(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd2 >= 0);
+  assert(block_anti_tampering_write(fd, data, TEST_DATA_SIZE, 0, ctx) ==
+         (ssize_t)TEST_DATA_SIZE);
+
+  // the fsyncs of both fds arriving during the first one share one digest
+  // write and one fsync of each file
+  data_fsyncs = 0;
+  hash_fsyncs = 0;
+  hash_pwrites = 0;
+  pthread_t threads[FSYNC_THREADS];
+  FsyncJob jobs[FSYNC_THREADS];
+  for (int i = 0; i < FSYNC_THREADS; i++) {
+    jobs[i].fd = i % 2 ? fd2 : fd;
+    jobs[i].ctx = ctx;
+    assert(pthread_create(&threads[i], NULL, fsync_worker, &jobs[i]) == 0);
+  }
+  for (int i = 0; i < FSYNC_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  assert(data_fsyncs == 2);
+  assert(hash_fsyncs == 2);
+  assert(hash_pwrites == 1);
+  GroupCommitStats stats;
+  group_commit_get_stats(&state->fsyncs, &stats);
+  assert(stats.calls == FSYNC_THREADS);
+  assert(stats.syncs == 2);
+
+  // the digests are in the hash file before any close
+  char *file_path_hex_hash =
+      state->hasher.hash_buffer_hex(test_file_path, strlen(test_file_path));
+  assert(file_path_hex_hash != NULL);
+  char *hash_file_path = construct_hash_pathname(state, file_path_hex_hash);
+  assert(hash_file_path != NULL);
+  free(file_path_hex_hash);
+  int hash_file = open(hash_file_path, O_RDONLY);
+  assert(hash_file >= 0);
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    uint8_t stored[HASHER_MAX_HASH_SIZE];
+    uint8_t expected[HASHER_MAX_HASH_SIZE];
+    assert(pread(hash_file, stored, ds,
+                 (off_t)(sizeof(BlockHashesHeader) + i * ds)) == (ssize_t)ds);
+    assert(state->hasher.hash_buffer_binary(data + i * BLOCK_SIZE, BLOCK_SIZE,
+                                            expected, ds) == (int)ds);
+    assert(memcmp(stored, expected, ds) == 0);
+  }
+  close(hash_file);
+
+  // nothing is left to write on close
+  assert(block_anti_tampering_close(fd2, ctx) == 0);
+  assert(block_anti_tampering_close(fd, ctx) == 0);
+  assert(hash_pwrites == 1);
+  assert(block_anti_tampering_fsync(fd, 0, ctx) == -1);
+
+  anti_tampering_destroy(ctx);
+  cleanup_local_layer(&data_layer);
+  cleanup_local_layer(&hash_layer);
+  unlink(test_file_path);
+  unlink(hash_file_path);
+  free(hash_file_path);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+
+  printf("✅ Block mode group commit of fsyncs test passed\n");
+}
+
+void test_block_zero_blocks() {
+  printf("Testing block digests of zero blocks...\n");
+
+  char test_hash_dir[] = "/tmp/test_block_zero_hash_XXXXXX";
+  assert(mkdtemp(test_hash_dir) != NULL);
+  AntiTamperingConfig cfg = create_block_config(test_hash_dir);
+  LayerContext ctx = anti_tampering_init(local_init(), local_init(), &cfg);
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  const size_t ds = state->hasher.get_hash_size();
+
+  // the zero block digest is the plain digest of a zero block
+  char *zeroes = calloc(1, BLOCK_SIZE);
+  assert(zeroes != NULL);
+  uint8_t expected[64];
+  assert(state->hasher.hash_buffer_binary(zeroes, BLOCK_SIZE, expected, ds) ==
+         (int)ds);
+  assert(state->zero_block_digest != NULL);
+  assert(memcmp(state->zero_block_digest, expected, ds) == 0);
+
+  // zero, data, zero, zero, then a partial block of zeroes (hashed)
+  const size_t size = (4 * BLOCK_SIZE) + (BLOCK_SIZE / 2);
+  char *buffer = calloc(1, size);
+  assert(buffer != NULL);
+  memset(buffer + BLOCK_SIZE, 'd', BLOCK_SIZE);
+  buffer[(2 * BLOCK_SIZE) - 1] = '\0'; // data block ending with a zero
+  uint8_t plain[5 * 64];
+  uint8_t skipped[5 * 64];
+  assert(hash_blocks_to_binary(buffer, size, BLOCK_SIZE, &state->hasher, NULL,
+                               plain, sizeof(plain)) == 5);
+  assert(hash_blocks_to_binary(buffer, size, BLOCK_SIZE, &state->hasher,
+                               state->zero_block_digest, skipped,
+                               sizeof(skipped)) == 5);
+  assert(memcmp(plain, skipped, 5 * ds) == 0);
+  assert(memcmp(skipped + (3 * ds), expected, ds) == 0);
+  assert(memcmp(skipped + (4 * ds), expected, ds) != 0);
+
+  free(buffer);
+  free(zeroes);
+  anti_tampering_destroy(ctx);
+  rmdir(test_hash_dir);
+  printf("✅ Block digests of zero blocks passed\n");
+}
+
+void test_block_getdigest() {
+  printf("Testing block stored digests of a range...\n");
+
+  char test_data_dir[] = "/tmp/test_block_getdigest_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_block_getdigest_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+
+  char test_file_path[512];
+  int ret = snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+                     test_data_dir);
+  assert(ret > 0 && ret < (int)sizeof(test_file_path));
+
+  LayerContext data_layer = local_init();
+  LayerContext hash_layer = local_init();
+  AntiTamperingConfig cfg = create_block_config(test_hash_dir);
+  LayerContext ctx = anti_tampering_init(data_layer, hash_layer, &cfg);
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  const size_t ds = state->hasher.get_hash_size();
+  assert(ctx.ops->lgetdigest != NULL);
+
+  int fd =
+      block_anti_tampering_open(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+  char block[BLOCK_SIZE];
+  uint8_t expected[NUM_BLOCKS * 64];
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    memset(block, 'a' + (int)i, BLOCK_SIZE);
+    assert(block_anti_tampering_write(fd, block, BLOCK_SIZE,
+                                      (off_t)(i * BLOCK_SIZE),
+                                      ctx) == (ssize_t)BLOCK_SIZE);
+    assert(state->hasher.hash_buffer_binary(block, BLOCK_SIZE,
+                                            expected + (i * ds),
+                                            ds) == (int)ds);
+  }
+
+  // half of block 0 and half of block 1: both their digests
+  uint8_t stored[NUM_BLOCKS * 64];
+  LayerStoredDigests digests = {.digests = stored, .capacity = sizeof(stored)};
+  assert(ctx.ops->lgetdigest(fd, BLOCK_SIZE / 2, BLOCK_SIZE, &digests, ctx) ==
+         2);
+  assert(digests.algorithm == (int)HASH_SHA256);
+  assert(digests.block_size == BLOCK_SIZE && digests.digest_size == ds);
+  assert(digests.first_block == 0);
+  assert(memcmp(stored, expected, 2 * ds) == 0);
+
+  // past the last block, only the stored digests
+  assert(ctx.ops->lgetdigest(fd, (off_t)(2 * BLOCK_SIZE), 3 * BLOCK_SIZE,
+                             &digests, ctx) == 1);
+  assert(digests.first_block == 2);
+  assert(memcmp(stored, expected + (2 * ds), ds) == 0);
+
+  // too small a buffer still says the format
+  digests.capacity = ds;
+  digests.block_size = 0;
+  errno = 0;
+  assert(ctx.ops->lgetdigest(fd, 0, TEST_DATA_SIZE, &digests, ctx) == -1);
+  assert(errno == ERANGE);
+  assert(digests.block_size == BLOCK_SIZE && digests.digest_size == ds);
+
+  assert(block_anti_tampering_close(fd, ctx) == 0);
+  anti_tampering_destroy(ctx);
+  cleanup_local_layer(&data_layer);
+  cleanup_local_layer(&hash_layer);
+  unlink(test_file_path);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+  printf("✅ Block stored digests of a range passed\n");
+}
+
+void test_block_size_rules() {
+  printf("Testing block sizes chosen by path...\n");
+
+  char test_data_dir[] = "/tmp/test_block_sizes_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_block_sizes_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+  char db_path[512];
+  char log_path[512];
+  assert(snprintf(db_path, sizeof(db_path), "%s/pages.db", test_data_dir) > 0);
+  assert(snprintf(log_path, sizeof(log_path), "%s/app.log", test_data_dir) >
+         0);
+
+  AntiTamperingBlockSizeRule rule = {.suffix = ".db",
+                                     .block_size = BLOCK_SIZE / 4};
+  AntiTamperingConfig cfg = create_block_config(test_hash_dir);
+  cfg.block_size_rules = &rule;
+  cfg.nblock_size_rules = 1;
+  LayerContext data_layer = local_init();
+  LayerContext hash_layer = local_init();
+  LayerContext ctx = anti_tampering_init(data_layer, hash_layer, &cfg);
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  const size_t ds = state->hasher.get_hash_size();
+
+  char data[TEST_DATA_SIZE];
+  memset(data, 'p', sizeof(data));
+  uint8_t stored[4 * NUM_BLOCKS * 64];
+  LayerStoredDigests digests = {.digests = stored, .capacity = sizeof(stored)};
+  const char *paths[] = {db_path, log_path};
+  const size_t sizes[] = {BLOCK_SIZE / 4, BLOCK_SIZE};
+  for (int i = 0; i < 2; i++) {
+    int fd = block_anti_tampering_open(paths[i], O_RDWR | O_CREAT, 0644, ctx);
+    assert(fd >= 0);
+    assert(block_anti_tampering_write(fd, data, sizeof(data), 0, ctx) ==
+           (ssize_t)sizeof(data));
+    assert(ctx.ops->lgetdigest(fd, 0, sizeof(data), &digests, ctx) ==
+           (ssize_t)(sizeof(data) / sizes[i]));
+    assert(digests.block_size == sizes[i]);
+    uint8_t expected[64];
+    assert(state->hasher.hash_buffer_binary(data, sizes[i], expected, ds) ==
+           (int)ds);
+    assert(memcmp(stored, expected, ds) == 0);
+    assert(block_anti_tampering_close(fd, ctx) == 0);
+  }
+  anti_tampering_destroy(ctx);
+
+  // without the rule, the file keeps the block size of its header
+  cfg.block_size_rules = NULL;
+  cfg.nblock_size_rules = 0;
+  ctx = anti_tampering_init(data_layer, hash_layer, &cfg);
+  int fd = block_anti_tampering_open(db_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  char read_back[TEST_DATA_SIZE];
+  assert(block_anti_tampering_read(fd, read_back, sizeof(read_back), 0, ctx) ==
+         (ssize_t)sizeof(read_back));
+  assert(memcmp(read_back, data, sizeof(data)) == 0);
+  assert(ctx.ops->lgetdigest(fd, 0, sizeof(data), &digests, ctx) ==
+         (ssize_t)(4 * NUM_BLOCKS));
+  assert(digests.block_size == BLOCK_SIZE / 4);
+  assert(block_anti_tampering_close(fd, ctx) == 0);
+
+  for (int i = 0; i < 2; i++) {
+    assert(block_anti_tampering_unlink(paths[i], ctx) == 0);
+  }
+  anti_tampering_destroy(ctx);
+  cleanup_local_layer(&data_layer);
+  cleanup_local_layer(&hash_layer);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+  printf("✅ Block sizes chosen by path passed\n");
+}
+
 int main() {
   printf("Running block anti-tampering tests...\n\n");
 
@@ -292,6 +1164,15 @@ int main() {
 
   printf("Running block read tests...\n");
   test_block_read_hash_verification();
+  test_block_hash_fd_reused();
+  test_block_legacy_hex_migration();
+  test_block_fused_digests();
+  test_block_verified_blocks();
+  test_block_digest_cache();
+  test_block_fsync();
+  test_block_zero_blocks();
+  test_block_getdigest();
+  test_block_size_rules();
   printf("All block read tests passed!\n\n");
 
   printf("All block anti-tampering tests passed!\n");
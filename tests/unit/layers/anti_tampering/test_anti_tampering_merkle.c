@@ -0,0 +1,486 @@
+#include "../../../../layers/anti_tampering/anti_tampering.h"
+#include "../../../../layers/anti_tampering/anti_tampering_utils.h"
+#include "../../../../layers/anti_tampering/merkle_anti_tampering.h"
+#include "../../../../layers/local/local.h"
+#include "../../../../shared/utils/conversion.h"
+#include "../../../../shared/utils/hasher/hasher.h"
+#include "../../../../shared/utils/hasher/merkle_tree.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE ((size_t)1024)
+#define DIGEST_SIZE ((size_t)32)
+
+// Bytes read from the data layer, to check what close() rehashes
+static size_t data_bytes_read = 0;
+static ssize_t (*local_pread_fn)(int, void *, size_t, off_t, LayerContext);
+
+static ssize_t counting_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                              LayerContext l) {
+  ssize_t res = local_pread_fn(fd, buffer, nbyte, offset, l);
+  if (res > 0) {
+    data_bytes_read += (size_t)res;
+  }
+  return res;
+}
+
+static LayerContext counting_local_init() {
+  LayerContext layer = local_init();
+  local_pread_fn = layer.ops->lpread;
+  layer.ops->lpread = counting_pread;
+  return layer;
+}
+
+static AntiTamperingConfig create_merkle_config(char *hashes_storage) {
+  AntiTamperingConfig cfg = {
+      .data_layer = NULL,
+      .hash_layer = NULL,
+      .hashes_storage = hashes_storage,
+      .algorithm = HASH_SHA256,
+      .mode = ANTI_TAMPERING_MODE_MERKLE,
+      .block_size = CHUNK_SIZE,
+  };
+  return cfg;
+}
+
+static char *hash_path_for(LayerContext ctx, const char *file_path) {
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  char *hex = state->hasher.hash_buffer_hex(file_path, strlen(file_path));
+  assert(hex != NULL);
+  char *hash_path = construct_hash_pathname(state, hex);
+  assert(hash_path != NULL);
+  free(hex);
+  return hash_path;
+}
+
+static char *read_whole_file(const char *path, size_t *size) {
+  struct stat st;
+  assert(stat(path, &st) == 0);
+  char *buffer = malloc((size_t)st.st_size + 1);
+  assert(buffer != NULL);
+  int fd = open(path, O_RDONLY);
+  assert(fd >= 0);
+  assert(pread(fd, buffer, (size_t)st.st_size, 0) == st.st_size);
+  close(fd);
+  buffer[st.st_size] = '\0';
+  *size = (size_t)st.st_size;
+  return buffer;
+}
+
+// Root hex computed from scratch over the current file content
+static void expected_root_hex(const char *file_path, char *out_hex) {
+  Hasher hasher;
+  assert(hasher_init(&hasher, HASH_SHA256) == 0);
+  size_t size;
+  char *data = read_whole_file(file_path, &size);
+
+  MerkleTree tree;
+  assert(merkle_tree_init(&tree, &hasher) == 0);
+  size_t n = size == 0 ? 0 : ((size - 1) / CHUNK_SIZE) + 1;
+  assert(merkle_tree_resize(&tree, n) == 0);
+  for (size_t i = 0; i < n; i++) {
+    size_t len = (i + 1) * CHUNK_SIZE <= size ? CHUNK_SIZE : size % CHUNK_SIZE;
+    assert(hasher.hash_buffer_binary(data + (i * CHUNK_SIZE), len,
+                                     merkle_tree_leaf(&tree, i),
+                                     DIGEST_SIZE) == (int)DIGEST_SIZE);
+  }
+  assert(merkle_tree_commit(&tree) == 0);
+  unsigned char root[DIGEST_SIZE];
+  assert(merkle_tree_root(&tree, root, sizeof(root)) == (int)DIGEST_SIZE);
+  bytes_to_hex(root, DIGEST_SIZE, out_hex);
+
+  merkle_tree_free(&tree);
+  free(data);
+}
+
+static void assert_stored_root_matches(LayerContext ctx,
+                                       const char *file_path) {
+  char *hash_path = hash_path_for(ctx, file_path);
+  size_t size;
+  char *stored = read_whole_file(hash_path, &size);
+  char expected[(DIGEST_SIZE * 2) + 1];
+  expected_root_hex(file_path, expected);
+  assert(strcmp(stored, expected) == 0);
+  free(stored);
+  free(hash_path);
+}
+
+static void cleanup_files(LayerContext ctx, const char *file_path) {
+  char *hash_path = hash_path_for(ctx, file_path);
+  char chunks_path[1024];
+  snprintf(chunks_path, sizeof(chunks_path), "%s%s", hash_path,
+           MERKLE_CHUNKS_SUFFIX);
+  unlink(file_path);
+  unlink(hash_path);
+  unlink(chunks_path);
+  free(hash_path);
+}
+
+void test_merkle_close_stores_root_and_chunks() {
+  printf("Testing merkle mode stores root and chunk list on close...\n");
+
+  char test_data_dir[] = "/tmp/test_merkle_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_merkle_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+  char test_file_path[512];
+  snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+           test_data_dir);
+
+  AntiTamperingConfig cfg = create_merkle_config(test_hash_dir);
+  LayerContext ctx = anti_tampering_init(local_init(), local_init(), &cfg);
+
+  int fd = ctx.ops->lopen(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+
+  // 3 full chunks and a partial one
+  const size_t data_size = (3 * CHUNK_SIZE) + 100;
+  char *data = malloc(data_size);
+  assert(data != NULL);
+  for (size_t i = 0; i < data_size; i++) {
+    data[i] = (char)('A' + (i / CHUNK_SIZE));
+  }
+  assert(ctx.ops->lpwrite(fd, data, data_size, 0, ctx) == (ssize_t)data_size);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  assert_stored_root_matches(ctx, test_file_path);
+
+  // Chunk list: header followed by one digest per chunk
+  char *hash_path = hash_path_for(ctx, test_file_path);
+  char chunks_path[1024];
+  snprintf(chunks_path, sizeof(chunks_path), "%s%s", hash_path,
+           MERKLE_CHUNKS_SUFFIX);
+  size_t chunks_size;
+  char *chunks = read_whole_file(chunks_path, &chunks_size);
+  assert(chunks_size == sizeof(MerkleChunksHeader) + (4 * DIGEST_SIZE));
+
+  MerkleChunksHeader header;
+  memcpy(&header, chunks, sizeof(header));
+  assert(memcmp(header.magic, MERKLE_CHUNKS_MAGIC, 4) == 0);
+  assert(header.version == MERKLE_CHUNKS_VERSION);
+  assert(header.chunk_size == CHUNK_SIZE);
+  assert(header.file_size == data_size);
+  assert(header.digest_size == DIGEST_SIZE);
+
+  Hasher hasher;
+  assert(hasher_init(&hasher, HASH_SHA256) == 0);
+  unsigned char digest[DIGEST_SIZE];
+  assert(hasher.hash_buffer_binary(data + (3 * CHUNK_SIZE), 100, digest,
+                                   sizeof(digest)) == (int)DIGEST_SIZE);
+  assert(memcmp(chunks + sizeof(header) + (3 * DIGEST_SIZE), digest,
+                DIGEST_SIZE) == 0);
+
+  free(chunks);
+  free(hash_path);
+  free(data);
+  cleanup_files(ctx, test_file_path);
+  anti_tampering_destroy(ctx);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+
+  printf("✅ Merkle mode stores root and chunk list on close passed\n");
+}
+
+void test_merkle_close_rehashes_only_dirty_chunks() {
+  printf("Testing merkle mode close only rehashes dirty chunks...\n");
+
+  char test_data_dir[] = "/tmp/test_merkle_inc_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_merkle_inc_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+  char test_file_path[512];
+  snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+           test_data_dir);
+
+  AntiTamperingConfig cfg = create_merkle_config(test_hash_dir);
+  LayerContext ctx =
+      anti_tampering_init(counting_local_init(), local_init(), &cfg);
+
+  const size_t n_chunks = 64;
+  const size_t data_size = n_chunks * CHUNK_SIZE;
+  char *data = malloc(data_size);
+  assert(data != NULL);
+  memset(data, 'z', data_size);
+
+  int fd = ctx.ops->lopen(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lpwrite(fd, data, data_size, 0, ctx) == (ssize_t)data_size);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // Reopen (full verification) then write a few bytes inside one chunk
+  fd = ctx.ops->lopen(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lpwrite(fd, "hello", 5, (5 * CHUNK_SIZE) + 10, ctx) == 5);
+
+  data_bytes_read = 0;
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  printf("  Bytes read on close: %zu (file size %zu)\n", data_bytes_read,
+         data_size);
+  assert(data_bytes_read == CHUNK_SIZE);
+  assert_stored_root_matches(ctx, test_file_path);
+
+  // A close without writes does not read the file at all
+  fd = ctx.ops->lopen(test_file_path, O_RDONLY, 0644, ctx);
+  assert(fd >= 0);
+  data_bytes_read = 0;
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  assert(data_bytes_read == 0);
+  assert_stored_root_matches(ctx, test_file_path);
+
+  free(data);
+  cleanup_files(ctx, test_file_path);
+  anti_tampering_destroy(ctx);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+
+  printf("✅ Merkle mode close only rehashes dirty chunks passed\n");
+}
+
+void test_merkle_parallel_chunk_hashing() {
+  printf("Testing merkle mode with parallel chunk hashing...\n");
+
+  char test_data_dir[] = "/tmp/test_merkle_par_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_merkle_par_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+  char test_file_path[512];
+  snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+           test_data_dir);
+
+  AntiTamperingConfig cfg = create_merkle_config(test_hash_dir);
+  cfg.hash_threads = 4;
+  LayerContext ctx = anti_tampering_init(local_init(), local_init(), &cfg);
+
+  // more chunks than threads and a partial last chunk
+  const size_t data_size = (37 * CHUNK_SIZE) + 321;
+  char *data = malloc(data_size);
+  assert(data != NULL);
+  for (size_t i = 0; i < data_size; i++) {
+    data[i] = (char)(i * 7);
+  }
+
+  // new file: every chunk is hashed on close, in parallel
+  int fd = ctx.ops->lopen(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lpwrite(fd, data, data_size, 0, ctx) == (ssize_t)data_size);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  assert_stored_root_matches(ctx, test_file_path);
+
+  // reopen (parallel verification) and a partial update stay consistent
+  fd = ctx.ops->lopen(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lpwrite(fd, "hello", 5, (20 * CHUNK_SIZE) + 3, ctx) == 5);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  assert_stored_root_matches(ctx, test_file_path);
+
+  free(data);
+  cleanup_files(ctx, test_file_path);
+  anti_tampering_destroy(ctx);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+
+  printf("✅ Merkle mode with parallel chunk hashing passed\n");
+}
+
+void test_merkle_truncate_and_extend() {
+  printf("Testing merkle mode truncate and extend...\n");
+
+  char test_data_dir[] = "/tmp/test_merkle_trunc_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_merkle_trunc_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+  char test_file_path[512];
+  snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+           test_data_dir);
+
+  AntiTamperingConfig cfg = create_merkle_config(test_hash_dir);
+  LayerContext ctx = anti_tampering_init(local_init(), local_init(), &cfg);
+
+  char data[4 * CHUNK_SIZE];
+  memset(data, 'q', sizeof(data));
+
+  int fd = ctx.ops->lopen(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lpwrite(fd, data, sizeof(data), 0, ctx) ==
+         (ssize_t)sizeof(data));
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // Shrink into the middle of a chunk, then write past EOF leaving a hole
+  fd = ctx.ops->lopen(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lftruncate(fd, CHUNK_SIZE + 500, ctx) == 0);
+  assert(ctx.ops->lpwrite(fd, "tail", 4, (6 * CHUNK_SIZE) + 3, ctx) == 4);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  assert_stored_root_matches(ctx, test_file_path);
+
+  // Shrink to a single chunk: root equals the plain file hash
+  fd = ctx.ops->lopen(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lftruncate(fd, 700, ctx) == 0);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  assert_stored_root_matches(ctx, test_file_path);
+
+  Hasher hasher;
+  assert(hasher_init(&hasher, HASH_SHA256) == 0);
+  size_t size;
+  char *content = read_whole_file(test_file_path, &size);
+  char *file_hex = hasher.hash_buffer_hex(content, size);
+  char *hash_path = hash_path_for(ctx, test_file_path);
+  char *stored = read_whole_file(hash_path, &size);
+  assert(strcmp(stored, file_hex) == 0);
+
+  free(stored);
+  free(hash_path);
+  free(file_hex);
+  free(content);
+  cleanup_files(ctx, test_file_path);
+  anti_tampering_destroy(ctx);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+
+  printf("✅ Merkle mode truncate and extend passed\n");
+}
+
+// The reopened file matches its stored chunk list and root
+static void assert_reopen_verifies(LayerContext ctx, const char *file_path) {
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  int fd = ctx.ops->lopen(file_path, O_RDONLY, 0644, ctx);
+  assert(fd >= 0);
+  assert(anti_tampering_mapping(state, fd)->merkle->persisted);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+}
+
+void test_merkle_truncate_without_rehash() {
+  printf("Testing merkle mode size changes without rehashing...\n");
+
+  char test_data_dir[] = "/tmp/test_merkle_size_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_merkle_size_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+  char test_file_path[512];
+  snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+           test_data_dir);
+
+  AntiTamperingConfig cfg = create_merkle_config(test_hash_dir);
+  LayerContext ctx =
+      anti_tampering_init(counting_local_init(), local_init(), &cfg);
+
+  char data[8 * CHUNK_SIZE];
+  memset(data, 'q', sizeof(data));
+  int fd = ctx.ops->lopen(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lpwrite(fd, data, sizeof(data), 0, ctx) ==
+         (ssize_t)sizeof(data));
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // shrink to a chunk boundary: the remaining chunks are unchanged
+  fd = ctx.ops->lopen(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  data_bytes_read = 0;
+  assert(ctx.ops->lftruncate(fd, 4 * CHUNK_SIZE, ctx) == 0);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  assert(data_bytes_read == 0);
+  assert_stored_root_matches(ctx, test_file_path);
+  assert_reopen_verifies(ctx, test_file_path);
+
+  // extend: the added whole chunks are zeroes, only the tail is read
+  fd = ctx.ops->lopen(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  data_bytes_read = 0;
+  assert(ctx.ops->lftruncate(fd, (10 * CHUNK_SIZE) + 100, ctx) == 0);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  assert(data_bytes_read == 100);
+  assert_stored_root_matches(ctx, test_file_path);
+  assert_reopen_verifies(ctx, test_file_path);
+
+  // shrink into a chunk, then a write past EOF leaving a hole of zeroes
+  fd = ctx.ops->lopen(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  data_bytes_read = 0;
+  assert(ctx.ops->lftruncate(fd, (3 * CHUNK_SIZE) + 10, ctx) == 0);
+  assert(ctx.ops->lpwrite(fd, "tail", 4, 7 * CHUNK_SIZE, ctx) == 4);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  // the cut chunk (grown by the hole) and the written one
+  assert(data_bytes_read == CHUNK_SIZE + 4);
+  assert_stored_root_matches(ctx, test_file_path);
+  assert_reopen_verifies(ctx, test_file_path);
+
+  // O_TRUNC by another fd of the open file empties the tree too
+  fd = ctx.ops->lopen(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  int trunc_fd = ctx.ops->lopen(test_file_path, O_RDWR | O_TRUNC, 0644, ctx);
+  assert(trunc_fd >= 0);
+  assert(ctx.ops->lclose(trunc_fd, ctx) == 0);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  assert_stored_root_matches(ctx, test_file_path);
+
+  cleanup_files(ctx, test_file_path);
+  anti_tampering_destroy(ctx);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+
+  printf("✅ Merkle mode size changes without rehashing passed\n");
+}
+
+void test_merkle_shared_between_fds() {
+  printf("Testing merkle mode with two fds on the same file...\n");
+
+  char test_data_dir[] = "/tmp/test_merkle_fds_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_merkle_fds_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+  char test_file_path[512];
+  snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+           test_data_dir);
+
+  AntiTamperingConfig cfg = create_merkle_config(test_hash_dir);
+  LayerContext ctx = anti_tampering_init(local_init(), local_init(), &cfg);
+
+  char data[3 * CHUNK_SIZE];
+  memset(data, 'm', sizeof(data));
+
+  int fd1 = ctx.ops->lopen(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  int fd2 = ctx.ops->lopen(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd1 >= 0 && fd2 >= 0);
+
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  assert(anti_tampering_mapping(state, fd1)->merkle ==
+         anti_tampering_mapping(state, fd2)->merkle);
+
+  // Each fd writes a different chunk; both changes end up in the root
+  assert(ctx.ops->lpwrite(fd1, data, sizeof(data), 0, ctx) ==
+         (ssize_t)sizeof(data));
+  assert(ctx.ops->lpwrite(fd2, "second", 6, 2 * CHUNK_SIZE, ctx) == 6);
+  assert(ctx.ops->lclose(fd2, ctx) == 0);
+  assert(ctx.ops->lpwrite(fd1, "first", 5, 0, ctx) == 5);
+  assert(ctx.ops->lclose(fd1, ctx) == 0);
+  assert(state->merkle_files == NULL);
+
+  assert_stored_root_matches(ctx, test_file_path);
+
+  cleanup_files(ctx, test_file_path);
+  anti_tampering_destroy(ctx);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+
+  printf("✅ Merkle mode with two fds on the same file passed\n");
+}
+
+int main() {
+  printf("Running merkle anti-tampering tests...\n\n");
+
+  test_merkle_close_stores_root_and_chunks();
+  test_merkle_close_rehashes_only_dirty_chunks();
+  test_merkle_parallel_chunk_hashing();
+  test_merkle_truncate_and_extend();
+  test_merkle_truncate_without_rehash();
+  test_merkle_shared_between_fds();
+
+  printf("\nAll merkle anti-tampering tests passed!\n");
+  return 0;
+}
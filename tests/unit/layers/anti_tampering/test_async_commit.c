@@ -0,0 +1,295 @@
+#include "../../../../layers/anti_tampering/async_commit.h"
+#include "../../../../layers/anti_tampering/anti_tampering.h"
+#include "../../../../layers/anti_tampering/anti_tampering_utils.h"
+#include "../../../../layers/local/local.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Commit callback that records the committed paths and can be held back
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int held;               // commits block while set
+  int running;            // a commit is inside the callback
+  int fail;               // commits report an error
+  char committed[16][64]; // committed paths, in order
+  size_t n_committed;
+} FakeCommit;
+
+static void fake_init(FakeCommit *fake) {
+  memset(fake, 0, sizeof(*fake));
+  pthread_mutex_init(&fake->mutex, NULL);
+  pthread_cond_init(&fake->cond, NULL);
+}
+
+static void fake_destroy(FakeCommit *fake) {
+  pthread_cond_destroy(&fake->cond);
+  pthread_mutex_destroy(&fake->mutex);
+}
+
+static void fake_hold(FakeCommit *fake, int held) {
+  pthread_mutex_lock(&fake->mutex);
+  fake->held = held;
+  pthread_cond_broadcast(&fake->cond);
+  pthread_mutex_unlock(&fake->mutex);
+}
+
+// Wait until the committer thread is inside the callback
+static void fake_wait_running(FakeCommit *fake) {
+  pthread_mutex_lock(&fake->mutex);
+  while (!fake->running) {
+    pthread_cond_wait(&fake->cond, &fake->mutex);
+  }
+  pthread_mutex_unlock(&fake->mutex);
+}
+
+static int fake_commit(void *arg, const char *file_path,
+                       const char *hash_path) {
+  FakeCommit *fake = arg;
+  (void)hash_path;
+  pthread_mutex_lock(&fake->mutex);
+  fake->running = 1;
+  pthread_cond_broadcast(&fake->cond);
+  while (fake->held) {
+    pthread_cond_wait(&fake->cond, &fake->mutex);
+  }
+  assert(fake->n_committed < 16);
+  snprintf(fake->committed[fake->n_committed++], 64, "%s", file_path);
+  fake->running = 0;
+  int res = fake->fail ? -1 : 0;
+  pthread_mutex_unlock(&fake->mutex);
+  return res;
+}
+
+void test_async_commit_coalesces_queued_closes() {
+  printf("Testing async commit coalesces closes of a queued path...\n");
+
+  FakeCommit fake;
+  fake_init(&fake);
+  AsyncCommitter *committer = async_commit_init(fake_commit, &fake);
+  assert(committer != NULL);
+
+  // /busy holds the committer thread, the other paths stay queued
+  fake_hold(&fake, 1);
+  assert(async_commit_enqueue(committer, "/busy", "/h/busy") == 0);
+  fake_wait_running(&fake);
+  assert(async_commit_enqueue(committer, "/a", "/h/a") == 0);
+  assert(async_commit_enqueue(committer, "/b", "/h/b") == 0);
+  assert(async_commit_enqueue(committer, "/a", "/h/a") == 0);
+  assert(async_commit_enqueue(committer, "/a", "/h/a") == 0);
+
+  AsyncCommitStats stats;
+  async_commit_get_stats(committer, &stats);
+  assert(stats.queue_depth == 3);
+  assert(stats.max_queue_depth == 3);
+  assert(stats.enqueued == 3);
+  assert(stats.coalesced == 2);
+  assert(stats.committed == 0);
+
+  fake_hold(&fake, 0);
+  async_commit_flush(committer);
+
+  // one commit per path, in first close order
+  assert(fake.n_committed == 3);
+  assert(strcmp(fake.committed[0], "/busy") == 0);
+  assert(strcmp(fake.committed[1], "/a") == 0);
+  assert(strcmp(fake.committed[2], "/b") == 0);
+
+  async_commit_get_stats(committer, &stats);
+  assert(stats.queue_depth == 0);
+  assert(stats.committed == 3);
+  assert(stats.failed == 0);
+  assert(stats.max_lag_ms >= stats.last_lag_ms);
+  assert(stats.total_lag_ms >= stats.max_lag_ms);
+
+  async_commit_destroy(committer);
+  fake_destroy(&fake);
+  printf("✅ Async commit coalesces closes of a queued path passed\n");
+}
+
+void test_async_commit_recommits_path_closed_while_running() {
+  printf("Testing async commit recommits a path closed while committing...\n");
+
+  FakeCommit fake;
+  fake_init(&fake);
+  AsyncCommitter *committer = async_commit_init(fake_commit, &fake);
+  assert(committer != NULL);
+
+  fake_hold(&fake, 1);
+  assert(async_commit_enqueue(committer, "/a", "/h/a") == 0);
+  fake_wait_running(&fake);
+
+  // the running commit may miss these writes: exactly one more commit
+  assert(async_commit_enqueue(committer, "/a", "/h/a") == 0);
+  assert(async_commit_enqueue(committer, "/a", "/h/a") == 0);
+
+  AsyncCommitStats stats;
+  async_commit_get_stats(committer, &stats);
+  assert(stats.queue_depth == 1);
+  assert(stats.enqueued == 2);
+  assert(stats.coalesced == 1);
+
+  fake_hold(&fake, 0);
+  async_commit_wait(committer, "/a");
+  assert(fake.n_committed == 2);
+
+  async_commit_get_stats(committer, &stats);
+  assert(stats.queue_depth == 0);
+  assert(stats.committed == 2);
+
+  async_commit_destroy(committer);
+  fake_destroy(&fake);
+  printf("✅ Async commit recommits a path closed while committing passed\n");
+}
+
+void test_async_commit_failures_and_destroy_drain() {
+  printf("Testing async commit failures and drain on destroy...\n");
+
+  FakeCommit fake;
+  fake_init(&fake);
+  fake.fail = 1;
+  AsyncCommitter *committer = async_commit_init(fake_commit, &fake);
+  assert(committer != NULL);
+
+  assert(async_commit_enqueue(committer, "/a", "/h/a") == 0);
+  async_commit_wait(committer, "/a");
+  AsyncCommitStats stats;
+  async_commit_get_stats(committer, &stats);
+  assert(stats.failed == 1);
+  assert(stats.committed == 0);
+  assert(stats.queue_depth == 0);
+
+  // invalid arguments are rejected so the caller commits synchronously
+  assert(async_commit_enqueue(committer, NULL, "/h/a") == -1);
+  assert(async_commit_enqueue(committer, "/a", NULL) == -1);
+  assert(async_commit_enqueue(NULL, "/a", "/h/a") == -1);
+
+  // destroy commits what is still queued
+  fake.fail = 0;
+  fake_hold(&fake, 1);
+  assert(async_commit_enqueue(committer, "/b", "/h/b") == 0);
+  assert(async_commit_enqueue(committer, "/c", "/h/c") == 0);
+  fake_hold(&fake, 0);
+  async_commit_destroy(committer);
+  assert(fake.n_committed == 3);
+  assert(strcmp(fake.committed[2], "/c") == 0);
+
+  fake_destroy(&fake);
+  printf("✅ Async commit failures and drain on destroy passed\n");
+}
+
+static char *read_stored_hash(LayerContext ctx, const char *file_path) {
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  char hex[HASHER_MAX_HEX_SIZE];
+  assert(state->hasher.hash_buffer_hex_into(file_path, strlen(file_path), hex,
+                                            sizeof(hex)) >= 0);
+  char *hash_path = construct_hash_pathname(state, hex);
+  assert(hash_path != NULL);
+
+  char *stored = calloc(1, HASHER_MAX_HEX_SIZE);
+  assert(stored != NULL);
+  int fd = open(hash_path, O_RDONLY);
+  if (fd >= 0) {
+    assert(read(fd, stored, HASHER_MAX_HEX_SIZE - 1) >= 0);
+    close(fd);
+  }
+  free(hash_path);
+  return stored;
+}
+
+static void expected_hash(const char *content, char *out, size_t out_size) {
+  Hasher hasher;
+  assert(hasher_init(&hasher, HASH_SHA256) == 0);
+  assert(hasher.hash_buffer_hex_into(content, strlen(content), out,
+                                     out_size) >= 0);
+}
+
+void test_async_commit_file_mode() {
+  printf("Testing file mode close with async commit...\n");
+
+  char test_data_dir[] = "/tmp/test_async_commit_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_async_commit_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+  char test_file_path[512];
+  snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+           test_data_dir);
+
+  AntiTamperingConfig cfg = {
+      .data_layer = NULL,
+      .hash_layer = NULL,
+      .hashes_storage = test_hash_dir,
+      .algorithm = HASH_SHA256,
+      .mode = ANTI_TAMPERING_MODE_FILE,
+      .async_commit = 1,
+  };
+  LayerContext ctx = anti_tampering_init(local_init(), local_init(), &cfg);
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  assert(state->async_commit != NULL);
+
+  char expected[HASHER_MAX_HEX_SIZE];
+  const char first[] = "async commit first version";
+  const char second[] = "ASYNC commit first version";
+
+  int fd = ctx.ops->lopen(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lpwrite(fd, first, strlen(first), 0, ctx) ==
+         (ssize_t)strlen(first));
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // reopen waits for the pending commit, so it sees the new hash
+  fd = ctx.ops->lopen(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  char *stored = read_stored_hash(ctx, test_file_path);
+  expected_hash(first, expected, sizeof(expected));
+  assert(strcmp(stored, expected) == 0);
+  free(stored);
+
+  assert(ctx.ops->lpwrite(fd, "ASYNC", 5, 0, ctx) == 5);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  async_commit_flush(state->async_commit);
+  stored = read_stored_hash(ctx, test_file_path);
+  expected_hash(second, expected, sizeof(expected));
+  assert(strcmp(stored, expected) == 0);
+  free(stored);
+
+  AsyncCommitStats stats;
+  anti_tampering_async_commit_stats(ctx, &stats);
+  assert(stats.committed == 2);
+  assert(stats.failed == 0);
+  assert(stats.queue_depth == 0);
+
+  // unlink waits for the commit, so no hash is published afterwards
+  fd = ctx.ops->lopen(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  assert(ctx.ops->lunlink(test_file_path, ctx) == 0);
+  async_commit_flush(state->async_commit);
+  stored = read_stored_hash(ctx, test_file_path);
+  assert(stored[0] == '\0');
+  free(stored);
+
+  anti_tampering_destroy(ctx);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+
+  printf("✅ File mode close with async commit passed\n");
+}
+
+int main() {
+  printf("Running async commit tests...\n\n");
+
+  test_async_commit_coalesces_queued_closes();
+  test_async_commit_recommits_path_closed_while_running();
+  test_async_commit_failures_and_destroy_drain();
+  test_async_commit_file_mode();
+
+  printf("\nAll async commit tests passed!\n");
+  return 0;
+}
@@ -0,0 +1,205 @@
+#include "../../../../layers/anti_tampering/dirty_journal.h"
+#include "../../../../layers/anti_tampering/anti_tampering.h"
+#include "../../../../layers/local/local.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Recover callback that records the paths and commits them
+typedef struct {
+  DirtyJournal *journal;
+  char recovered[8][64];
+  size_t n_recovered;
+} FakeRecover;
+
+static int fake_recover(void *arg, const char *file_path) {
+  FakeRecover *fake = arg;
+  assert(fake->n_recovered < 8);
+  snprintf(fake->recovered[fake->n_recovered++], 64, "%s", file_path);
+  dirty_journal_committed(fake->journal, file_path, NULL);
+  return 0;
+}
+
+// Durable callback of a manifest whose flush is simulated by a flag
+static int fake_durable(void *arg, const char *key) {
+  (void)key;
+  return *(int *)arg;
+}
+
+static off_t journal_size(const char *journal) {
+  struct stat st;
+  assert(stat(journal, &st) == 0);
+  return st.st_size;
+}
+
+void test_dirty_journal_replay() {
+  printf("Testing dirty journal replays the paths left dirty...\n");
+
+  char journal[] = "/tmp/test_dirty_journal_XXXXXX";
+  int fd = mkstemp(journal);
+  assert(fd >= 0);
+  // /d/a is committed, the record of /d/c was cut by the crash
+  const char records[] = "O 1 /d/a\n"
+                         "O 2 /d/b\\nx\n"
+                         "C 1\n"
+                         "O 3 /d/c";
+  assert(write(fd, records, strlen(records)) == (ssize_t)strlen(records));
+  close(fd);
+
+  FakeRecover fake = {0};
+  fake.journal = dirty_journal_init(journal, NULL, NULL);
+  assert(fake.journal != NULL);
+
+  // the journal is rewritten with the dirty path only
+  DirtyJournalStats stats;
+  dirty_journal_get_stats(fake.journal, &stats);
+  assert(stats.replayed == 1);
+  assert(stats.dirty == 1);
+  assert(journal_size(journal) == (off_t)strlen("O 2 /d/b\\nx\n"));
+
+  assert(dirty_journal_recover(fake.journal, fake_recover, &fake) == 0);
+  assert(fake.n_recovered == 1);
+  assert(strcmp(fake.recovered[0], "/d/b\nx") == 0);
+  assert(journal_size(journal) == 0);
+
+  // a new generation follows the replayed ones
+  assert(dirty_journal_mark(fake.journal, "/d/e") == 0);
+  dirty_journal_destroy(fake.journal);
+
+  fake = (FakeRecover){0};
+  fake.journal = dirty_journal_init(journal, NULL, NULL);
+  assert(fake.journal != NULL);
+  assert(dirty_journal_recover(fake.journal, fake_recover, &fake) == 0);
+  assert(fake.n_recovered == 1);
+  assert(strcmp(fake.recovered[0], "/d/e") == 0);
+  dirty_journal_destroy(fake.journal);
+
+  unlink(journal);
+  printf("✅ Dirty journal replays the paths left dirty passed\n");
+}
+
+void test_dirty_journal_clears_committed_paths() {
+  printf("Testing dirty journal clears committed paths...\n");
+
+  char journal[] = "/tmp/test_dirty_journal_XXXXXX";
+  int fd = mkstemp(journal);
+  assert(fd >= 0);
+  close(fd);
+
+  int flushed = 0;
+  DirtyJournal *dj = dirty_journal_init(journal, fake_durable, &flushed);
+  assert(dj != NULL);
+
+  // two writers of /d/a: only the first writes a record
+  assert(dirty_journal_mark(dj, "/d/a") == 0);
+  assert(dirty_journal_mark(dj, "/d/a") == 0);
+  assert(dirty_journal_mark(dj, "/d/b") == 0);
+  DirtyJournalStats stats;
+  dirty_journal_get_stats(dj, &stats);
+  assert(stats.marked == 2);
+  assert(stats.dirty == 2);
+  assert(stats.syncs >= 1 && stats.syncs <= 2);
+
+  // a commit while a writer is left does not clear the path
+  dirty_journal_unmark(dj, "/d/a");
+  dirty_journal_committed(dj, "/d/a", NULL);
+  dirty_journal_get_stats(dj, &stats);
+  assert(stats.dirty == 2);
+
+  dirty_journal_unmark(dj, "/d/a");
+  dirty_journal_committed(dj, "/d/a", NULL);
+  dirty_journal_get_stats(dj, &stats);
+  assert(stats.dirty == 1);
+  assert(stats.cleared == 1);
+
+  // a buffered hash clears the path once it is durable
+  dirty_journal_unmark(dj, "/d/b");
+  dirty_journal_committed(dj, "/d/b", "/h/b");
+  dirty_journal_get_stats(dj, &stats);
+  assert(stats.dirty == 1);
+  assert(journal_size(journal) > 0);
+
+  flushed = 1;
+  dirty_journal_committed(dj, "/d/c", NULL);
+  dirty_journal_get_stats(dj, &stats);
+  assert(stats.dirty == 0);
+  assert(stats.cleared == 2);
+  assert(journal_size(journal) == 0);
+
+  dirty_journal_destroy(dj);
+  unlink(journal);
+  printf("✅ Dirty journal clears committed paths passed\n");
+}
+
+void test_dirty_journal_file_mode() {
+  printf("Testing file mode rehashes the files a crash left dirty...\n");
+
+  char test_data_dir[] = "/tmp/test_dirty_journal_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_dirty_journal_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+  char a[512], journal[512];
+  snprintf(a, sizeof(a), "%s/a", test_data_dir);
+  snprintf(journal, sizeof(journal), "%s/dirty.journal", test_hash_dir);
+
+  AntiTamperingConfig cfg = {
+      .hashes_storage = test_hash_dir,
+      .algorithm = HASH_SHA256,
+      .mode = ANTI_TAMPERING_MODE_FILE,
+      .dirty_journal = journal,
+  };
+  LayerContext ctx = anti_tampering_init(local_init(), local_init(), &cfg);
+
+  const char content[] = "dirty journal content";
+  int fd = ctx.ops->lopen(a, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+  assert(journal_size(journal) > 0);
+  assert(ctx.ops->lpwrite(fd, content, strlen(content), 0, ctx) ==
+         (ssize_t)strlen(content));
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  assert(journal_size(journal) == 0);
+
+  // crash while rewriting the file: the close never comes
+  fd = ctx.ops->lopen(a, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lpwrite(fd, "DIRTY", 5, 0, ctx) == 5);
+  anti_tampering_destroy(ctx);
+
+  cfg.dirty_journal = NULL;
+  ctx = anti_tampering_init(local_init(), local_init(), &cfg);
+  assert(ctx.ops->lverify(a, ctx) == LAYER_VERIFY_MISMATCH);
+  anti_tampering_destroy(ctx);
+
+  cfg.dirty_journal = journal;
+  ctx = anti_tampering_init(local_init(), local_init(), &cfg);
+  assert(ctx.ops->lverify(a, ctx) == LAYER_VERIFY_OK);
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  DirtyJournalStats stats;
+  dirty_journal_get_stats(state->dirty_journal, &stats);
+  assert(stats.replayed == 1);
+  assert(stats.dirty == 0);
+  assert(journal_size(journal) == 0);
+  anti_tampering_destroy(ctx);
+
+  unlink(a);
+  unlink(journal);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+
+  printf("✅ File mode rehashes the files a crash left dirty passed\n");
+}
+
+int main() {
+  printf("Running dirty journal tests...\n\n");
+
+  test_dirty_journal_replay();
+  test_dirty_journal_clears_committed_paths();
+  test_dirty_journal_file_mode();
+
+  printf("\nAll dirty journal tests passed!\n");
+  return 0;
+}
@@ -0,0 +1,400 @@
+#include "../../../../layers/anti_tampering/hash_manifest.h"
+#include "../../../../layers/anti_tampering/anti_tampering.h"
+#include "../../../../layers/anti_tampering/anti_tampering_utils.h"
+#include "../../../../layers/local/local.h"
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define VALUE_SIZE 64
+
+// A VALUE_SIZE hex value made of one repeated character
+static void make_value(char *value, char c) {
+  memset(value, c, VALUE_SIZE);
+  value[VALUE_SIZE] = '\0';
+}
+
+static int manifest_exists(const char *dir, size_t seq) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/manifest-%010zu", dir, seq);
+  return access(path, F_OK) == 0;
+}
+
+// Wait up to 2 seconds for the flusher thread to write a manifest
+static int wait_manifest(const char *dir, size_t seq) {
+  for (int i = 0; i < 200; i++) {
+    if (manifest_exists(dir, seq)) {
+      return 1;
+    }
+    usleep(10000);
+  }
+  return 0;
+}
+
+static size_t count_entries(const char *dir) {
+  DIR *d = opendir(dir);
+  assert(d != NULL);
+  size_t n = 0;
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] != '.') {
+      n++;
+    }
+  }
+  closedir(d);
+  return n;
+}
+
+static void remove_dir(const char *dir) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] != '.') {
+      char path[512];
+      snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+      unlink(path);
+    }
+  }
+  closedir(d);
+  rmdir(dir);
+}
+
+void test_hash_manifest_flush_on_record_count() {
+  printf("Testing hash manifest flush once max_records are buffered...\n");
+
+  char dir[] = "/tmp/test_hash_manifest_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  HashManifest *manifest =
+      hash_manifest_init(local_init(), dir, VALUE_SIZE, 3, 0);
+  assert(manifest != NULL);
+
+  char a[VALUE_SIZE + 1], b[VALUE_SIZE + 1], c[VALUE_SIZE + 1];
+  char out[HASHER_MAX_HEX_SIZE];
+  make_value(a, 'a');
+  make_value(b, 'b');
+  make_value(c, 'c');
+
+  // buffered records are visible before they are written
+  assert(hash_manifest_put(manifest, "/h/a", a) == 0);
+  assert(hash_manifest_put(manifest, "/h/b", b) == 0);
+  assert(hash_manifest_contains(manifest, "/h/a") == 1);
+  assert(hash_manifest_get(manifest, "/h/a", out, sizeof(out)) == VALUE_SIZE);
+  assert(strcmp(out, a) == 0);
+  assert(!manifest_exists(dir, 0));
+
+  // the third record fills the batch: one object for all three
+  assert(hash_manifest_put(manifest, "/h/c", c) == 0);
+  assert(wait_manifest(dir, 0));
+  assert(hash_manifest_flush(manifest) == 0);
+  assert(count_entries(dir) == 1);
+
+  pthread_mutex_lock(&manifest->mutex);
+  assert(manifest->flushed_manifests == 1);
+  assert(manifest->flushed_records == 3);
+  pthread_mutex_unlock(&manifest->mutex);
+
+  // stored records are read back at their indexed offset
+  assert(hash_manifest_get(manifest, "/h/b", out, sizeof(out)) == VALUE_SIZE);
+  assert(strcmp(out, b) == 0);
+  assert(hash_manifest_get(manifest, "/h/c", out, sizeof(out)) == VALUE_SIZE);
+  assert(strcmp(out, c) == 0);
+  assert(hash_manifest_get(manifest, "/h/none", out, sizeof(out)) == 0);
+  assert(hash_manifest_contains(manifest, "/h/none") == 0);
+
+  // invalid values are rejected
+  assert(hash_manifest_put(manifest, "/h/a", "short") == -1);
+  assert(hash_manifest_put(manifest, "/h/a", NULL) == -1);
+  assert(hash_manifest_get(manifest, "/h/a", out, VALUE_SIZE) == -1);
+
+  hash_manifest_destroy(manifest);
+  remove_dir(dir);
+  printf("✅ Hash manifest flush once max_records are buffered passed\n");
+}
+
+void test_hash_manifest_flush_on_interval() {
+  printf("Testing hash manifest flush once the oldest record is old...\n");
+
+  char dir[] = "/tmp/test_hash_manifest_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  HashManifest *manifest =
+      hash_manifest_init(local_init(), dir, VALUE_SIZE, 1000, 50);
+  assert(manifest != NULL);
+
+  char a[VALUE_SIZE + 1], out[HASHER_MAX_HEX_SIZE];
+  make_value(a, 'a');
+  assert(hash_manifest_put(manifest, "/h/a", a) == 0);
+  assert(wait_manifest(dir, 0));
+  assert(hash_manifest_flush(manifest) == 0);
+  assert(hash_manifest_get(manifest, "/h/a", out, sizeof(out)) == VALUE_SIZE);
+  assert(strcmp(out, a) == 0);
+
+  // nothing buffered: no empty manifest is written
+  assert(hash_manifest_flush(manifest) == 0);
+  assert(count_entries(dir) == 1);
+
+  hash_manifest_destroy(manifest);
+  remove_dir(dir);
+  printf("✅ Hash manifest flush once the oldest record is old passed\n");
+}
+
+void test_hash_manifest_tombstones_and_reload() {
+  printf("Testing hash manifest tombstones and index reload...\n");
+
+  char dir[] = "/tmp/test_hash_manifest_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  HashManifest *manifest =
+      hash_manifest_init(local_init(), dir, VALUE_SIZE, 1000, 0);
+  assert(manifest != NULL);
+
+  char a[VALUE_SIZE + 1], b1[VALUE_SIZE + 1], b2[VALUE_SIZE + 1];
+  char out[HASHER_MAX_HEX_SIZE];
+  make_value(a, 'a');
+  make_value(b1, '1');
+  make_value(b2, '2');
+
+  assert(hash_manifest_put(manifest, "/h/a", a) == 0);
+  assert(hash_manifest_put(manifest, "/h/b", b1) == 0);
+  assert(hash_manifest_flush(manifest) == 0);
+
+  // a is removed and b updated in the second manifest
+  assert(hash_manifest_remove(manifest, "/h/a") == 0);
+  assert(hash_manifest_contains(manifest, "/h/a") == 0);
+  assert(hash_manifest_get(manifest, "/h/a", out, sizeof(out)) == 0);
+  assert(hash_manifest_put(manifest, "/h/b", b2) == 0);
+  assert(hash_manifest_put(manifest, "/h/b", b2) == 0); // one record
+  assert(hash_manifest_remove(manifest, "/h/none") == 0);
+  hash_manifest_destroy(manifest); // flushes
+  assert(manifest_exists(dir, 1));
+  assert(count_entries(dir) == 2);
+
+  // the index is rebuilt by replaying both manifests
+  manifest = hash_manifest_init(local_init(), dir, VALUE_SIZE, 1000, 0);
+  assert(manifest != NULL);
+  assert(manifest->next_manifest == 2);
+  assert(manifest->flushed_manifests == 0);
+  assert(hash_manifest_contains(manifest, "/h/a") == 0);
+  assert(hash_manifest_get(manifest, "/h/b", out, sizeof(out)) == VALUE_SIZE);
+  assert(strcmp(out, b2) == 0);
+  hash_manifest_destroy(manifest);
+
+  // manifests of another digest size are refused
+  assert(hash_manifest_init(local_init(), dir, 128, 1000, 0) == NULL);
+
+  remove_dir(dir);
+  printf("✅ Hash manifest tombstones and index reload passed\n");
+}
+
+static int object_exists(const char *dir, const char *kind, size_t seq) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s-%010zu", dir, kind, seq);
+  return access(path, F_OK) == 0;
+}
+
+// Replace the last VALUE_SIZE run of c in a manifest with d
+static void tamper_manifest(const char *dir, size_t seq, char c, char d) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/manifest-%010zu", dir, seq);
+  char content[4096];
+  int fd = open(path, O_RDWR);
+  assert(fd >= 0);
+  ssize_t size = pread(fd, content, sizeof(content), 0);
+  assert(size > 0);
+  char run[VALUE_SIZE];
+  memset(run, c, sizeof(run));
+  for (ssize_t pos = size - VALUE_SIZE; pos >= 0; pos--) {
+    if (memcmp(content + pos, run, VALUE_SIZE) == 0) {
+      memset(run, d, sizeof(run));
+      assert(pwrite(fd, run, VALUE_SIZE, pos) == VALUE_SIZE);
+      close(fd);
+      return;
+    }
+  }
+  assert(0 && "value not found in the manifest");
+}
+
+void test_hash_manifest_anchoring() {
+  printf("Testing hash manifest roots anchored in another layer...\n");
+
+  // both local: the roots are written next to the manifests
+  char dir[] = "/tmp/test_hash_manifest_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  Hasher hasher;
+  assert(hasher_init(&hasher, HASH_SHA256) == 0);
+  HashManifest *manifest = hash_manifest_init_anchored(
+      local_init(), local_init(), &hasher, dir, VALUE_SIZE, 1000, 0);
+  assert(manifest != NULL);
+
+  char a[VALUE_SIZE + 1], b[VALUE_SIZE + 1], c[VALUE_SIZE + 1];
+  char out[HASHER_MAX_HEX_SIZE];
+  make_value(a, 'a');
+  make_value(b, 'b');
+  make_value(c, 'c');
+
+  // one root per manifest, next to its proofs
+  assert(hash_manifest_put(manifest, "/h/a", a) == 0);
+  assert(hash_manifest_put(manifest, "/h/b", b) == 0);
+  assert(hash_manifest_flush(manifest) == 0);
+  assert(hash_manifest_put(manifest, "/h/c", c) == 0);
+  assert(hash_manifest_flush(manifest) == 0);
+  assert(manifest_exists(dir, 1));
+  assert(object_exists(dir, "proof", 0) && object_exists(dir, "proof", 1));
+  assert(object_exists(dir, "root", 0) && object_exists(dir, "root", 1));
+  assert(hash_manifest_get(manifest, "/h/b", out, sizeof(out)) == VALUE_SIZE);
+  assert(strcmp(out, b) == 0);
+  hash_manifest_destroy(manifest);
+
+  // a last manifest whose root was never anchored is not published
+  char root[512];
+  snprintf(root, sizeof(root), "%s/root-%010d", dir, 1);
+  assert(unlink(root) == 0);
+  manifest = hash_manifest_init_anchored(local_init(), local_init(), &hasher,
+                                         dir, VALUE_SIZE, 1000, 0);
+  assert(manifest != NULL);
+  assert(manifest->next_manifest == 1);
+  assert(hash_manifest_contains(manifest, "/h/c") == 0);
+  assert(hash_manifest_put(manifest, "/h/c", c) == 0);
+  hash_manifest_destroy(manifest); // rewrites manifest 1, anchored this time
+  assert(object_exists(dir, "root", 1));
+
+  // a changed record no longer leads to the anchored root
+  tamper_manifest(dir, 0, 'b', 'd');
+  manifest = hash_manifest_init_anchored(local_init(), local_init(), &hasher,
+                                         dir, VALUE_SIZE, 1000, 0);
+  assert(manifest != NULL);
+  assert(hash_manifest_get(manifest, "/h/a", out, sizeof(out)) == VALUE_SIZE);
+  assert(strcmp(out, a) == 0);
+  assert(hash_manifest_get(manifest, "/h/b", out, sizeof(out)) == -1);
+  assert(hash_manifest_get(manifest, "/h/c", out, sizeof(out)) == VALUE_SIZE);
+  assert(strcmp(out, c) == 0);
+  hash_manifest_destroy(manifest);
+
+  // removing the last manifest from the hash layer is detected
+  char last[512];
+  snprintf(last, sizeof(last), "%s/manifest-%010d", dir, 1);
+  assert(unlink(last) == 0);
+  assert(hash_manifest_init_anchored(local_init(), local_init(), &hasher, dir,
+                                     VALUE_SIZE, 1000, 0) == NULL);
+
+  remove_dir(dir);
+  printf("✅ Hash manifest roots anchored in another layer passed\n");
+}
+
+static void write_file(LayerContext ctx, const char *path,
+                       const char *content) {
+  int fd = ctx.ops->lopen(path, O_RDWR | O_CREAT | O_TRUNC, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lpwrite(fd, content, strlen(content), 0, ctx) ==
+         (ssize_t)strlen(content));
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+}
+
+static void file_hash_path(LayerContext ctx, const char *file_path,
+                           char **hash_path) {
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  char hex[HASHER_MAX_HEX_SIZE];
+  assert(state->hasher.hash_buffer_hex_into(file_path, strlen(file_path), hex,
+                                            sizeof(hex)) >= 0);
+  *hash_path = construct_hash_pathname(state, hex);
+  assert(*hash_path != NULL);
+}
+
+void test_hash_manifest_file_mode() {
+  printf("Testing file mode with batched hash publication...\n");
+
+  char test_data_dir[] = "/tmp/test_hash_manifest_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_hash_manifest_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+  char paths[3][512];
+  for (int i = 0; i < 3; i++) {
+    snprintf(paths[i], sizeof(paths[i]), "%s/file%d", test_data_dir, i);
+  }
+
+  AntiTamperingConfig cfg = {
+      .data_layer = NULL,
+      .hash_layer = NULL,
+      .hashes_storage = test_hash_dir,
+      .algorithm = HASH_SHA256,
+      .mode = ANTI_TAMPERING_MODE_FILE,
+      .hash_batch_records = 16,
+      .hash_batch_interval_ms = 0,
+  };
+  LayerContext ctx = anti_tampering_init(local_init(), local_init(), &cfg);
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  assert(state->hash_manifest != NULL);
+
+  const char content[] = "batched hash content";
+  // closes buffer their hash instead of writing a hash file each
+  for (int i = 0; i < 3; i++) {
+    write_file(ctx, paths[i], content);
+  }
+  assert(count_entries(test_hash_dir) == 0);
+
+  char *hash_path = NULL;
+  char stored[HASHER_MAX_HEX_SIZE], expected[HASHER_MAX_HEX_SIZE];
+  Hasher hasher;
+  assert(hasher_init(&hasher, HASH_SHA256) == 0);
+  assert(hasher.hash_buffer_hex_into(content, strlen(content), expected,
+                                     sizeof(expected)) >= 0);
+  file_hash_path(ctx, paths[0], &hash_path);
+  assert(hash_manifest_get(state->hash_manifest, hash_path, stored,
+                           sizeof(stored)) > 0);
+  assert(strcmp(stored, expected) == 0);
+
+  // open verifies against the buffered hash
+  int fd = ctx.ops->lopen(paths[0], O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // unlink tombstones the record
+  assert(ctx.ops->lunlink(paths[2], ctx) == 0);
+  char *unlinked_hash_path = NULL;
+  file_hash_path(ctx, paths[2], &unlinked_hash_path);
+  assert(hash_manifest_contains(state->hash_manifest, unlinked_hash_path) == 0);
+
+  // destroy writes the three hashes and the tombstone as one object
+  anti_tampering_destroy(ctx);
+  assert(count_entries(test_hash_dir) == 1);
+  assert(manifest_exists(test_hash_dir, 0));
+
+  ctx = anti_tampering_init(local_init(), local_init(), &cfg);
+  state = (AntiTamperingState *)ctx.internal_state;
+  assert(hash_manifest_get(state->hash_manifest, hash_path, stored,
+                           sizeof(stored)) > 0);
+  assert(strcmp(stored, expected) == 0);
+  assert(hash_manifest_contains(state->hash_manifest, unlinked_hash_path) == 0);
+  fd = ctx.ops->lopen(paths[1], O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  anti_tampering_destroy(ctx);
+
+  free(hash_path);
+  free(unlinked_hash_path);
+  unlink(paths[0]);
+  unlink(paths[1]);
+  rmdir(test_data_dir);
+  remove_dir(test_hash_dir);
+
+  printf("✅ File mode with batched hash publication passed\n");
+}
+
+int main() {
+  printf("Running hash manifest tests...\n\n");
+
+  test_hash_manifest_flush_on_record_count();
+  test_hash_manifest_flush_on_interval();
+  test_hash_manifest_tombstones_and_reload();
+  test_hash_manifest_anchoring();
+  test_hash_manifest_file_mode();
+
+  printf("\nAll hash manifest tests passed!\n");
+  return 0;
+}
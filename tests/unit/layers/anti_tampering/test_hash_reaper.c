@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include "../../../../layers/anti_tampering/hash_reaper.h"
+#include "../../../../layers/anti_tampering/anti_tampering.h"
+#include "../../../../layers/anti_tampering/anti_tampering_utils.h"
+#include "../../../../layers/local/local.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Reap callback that records the reaped paths and can be held back
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int held;            // the first reap blocks while set
+  int calls;           // reaps that entered the callback
+  char reaped[16][64]; // "path" or "path>target", in order
+  pthread_t threads[16];
+  size_t n_reaped;
+} FakeReap;
+
+static void fake_init(FakeReap *fake) {
+  memset(fake, 0, sizeof(*fake));
+  pthread_mutex_init(&fake->mutex, NULL);
+  pthread_cond_init(&fake->cond, NULL);
+}
+
+static void fake_destroy(FakeReap *fake) {
+  pthread_cond_destroy(&fake->cond);
+  pthread_mutex_destroy(&fake->mutex);
+}
+
+static void fake_hold(FakeReap *fake, int held) {
+  pthread_mutex_lock(&fake->mutex);
+  fake->held = held;
+  pthread_cond_broadcast(&fake->cond);
+  pthread_mutex_unlock(&fake->mutex);
+}
+
+// Wait until the reaper thread is inside the callback
+static void fake_wait_running(FakeReap *fake) {
+  pthread_mutex_lock(&fake->mutex);
+  while (!fake->calls) {
+    pthread_cond_wait(&fake->cond, &fake->mutex);
+  }
+  pthread_mutex_unlock(&fake->mutex);
+}
+
+static int fake_reap(void *arg, const char *hash_path, const char *target) {
+  FakeReap *fake = arg;
+  pthread_mutex_lock(&fake->mutex);
+  // only the first reap, by the reaper thread, is held
+  int first = fake->calls++ == 0;
+  pthread_cond_broadcast(&fake->cond);
+  while (fake->held && first) {
+    pthread_cond_wait(&fake->cond, &fake->mutex);
+  }
+  assert(fake->n_reaped < 16);
+  fake->threads[fake->n_reaped] = pthread_self();
+  snprintf(fake->reaped[fake->n_reaped++], 64, "%s%s%s", hash_path,
+           target ? ">" : "", target ? target : "");
+  pthread_mutex_unlock(&fake->mutex);
+  return 0;
+}
+
+void test_hash_reaper_claims_pending_paths() {
+  printf("Testing hash reaper runs claimed paths in the caller...\n");
+
+  FakeReap fake;
+  fake_init(&fake);
+  HashReaper *reaper = hash_reaper_init(fake_reap, &fake, NULL);
+  assert(reaper != NULL);
+
+  // /h/busy holds the reaper thread, the other entries stay queued
+  fake_hold(&fake, 1);
+  assert(hash_reaper_remove(reaper, "/h/busy") == 0);
+  fake_wait_running(&fake);
+  assert(hash_reaper_remove(reaper, "/h/a") == 0);
+  assert(hash_reaper_move(reaper, "/h/b", "/h/c") == 0);
+  assert(hash_reaper_move(reaper, "/h/d", "/h/d") == 0); // nothing to move
+  assert(hash_reaper_pending(reaper, "/h/a"));
+  assert(hash_reaper_pending(reaper, "/h/c"));
+  assert(!hash_reaper_pending(reaper, "/h/d"));
+
+  // claiming the target of a move runs the move in this thread
+  hash_reaper_claim(reaper, "/h/c");
+  assert(fake.n_reaped == 1);
+  assert(strcmp(fake.reaped[0], "/h/b>/h/c") == 0);
+  assert(pthread_equal(fake.threads[0], pthread_self()));
+  assert(!hash_reaper_pending(reaper, "/h/b"));
+
+  // queuing a move from a pending path runs its removal first
+  assert(hash_reaper_move(reaper, "/h/a", "/h/e") == 0);
+  assert(fake.n_reaped == 2);
+  assert(strcmp(fake.reaped[1], "/h/a") == 0);
+
+  HashReaperStats stats;
+  hash_reaper_get_stats(reaper, &stats);
+  assert(stats.removals == 2);
+  assert(stats.moves == 2);
+  assert(stats.claimed == 2);
+  assert(stats.queue_depth == 2);
+  assert(stats.max_queue_depth == 3);
+
+  fake_hold(&fake, 0);
+  hash_reaper_flush(reaper);
+  assert(fake.n_reaped == 4);
+  assert(strcmp(fake.reaped[2], "/h/busy") == 0);
+  assert(strcmp(fake.reaped[3], "/h/a>/h/e") == 0);
+
+  // invalid arguments are rejected so the caller reaps synchronously
+  assert(hash_reaper_remove(reaper, NULL) == -1);
+  assert(hash_reaper_remove(NULL, "/h/a") == -1);
+  assert(hash_reaper_move(reaper, "/h/a", NULL) == -1);
+  assert(hash_reaper_remove(reaper, "/h/new\nline") == -1);
+
+  hash_reaper_get_stats(reaper, &stats);
+  assert(stats.queue_depth == 0);
+  assert(stats.reaped == 4);
+  assert(stats.failed == 0);
+
+  hash_reaper_destroy(reaper);
+  fake_destroy(&fake);
+  printf("✅ Hash reaper runs claimed paths in the caller passed\n");
+}
+
+void test_hash_reaper_journal_replay() {
+  printf("Testing hash reaper replays its journal...\n");
+
+  char journal[] = "/tmp/test_hash_reaper_journal_XXXXXX";
+  int fd = mkstemp(journal);
+  assert(fd >= 0);
+  // /h/a is done, the record of /h/d was cut by the crash
+  const char records[] = "R /h/a\n"
+                         "M /h/b\t/h/c\n"
+                         "D /h/a\n"
+                         "R /h/x\n"
+                         "R /h/d";
+  assert(write(fd, records, strlen(records)) == (ssize_t)strlen(records));
+  close(fd);
+
+  FakeReap fake;
+  fake_init(&fake);
+  fake_hold(&fake, 1);
+  HashReaper *reaper = hash_reaper_init(fake_reap, &fake, journal);
+  assert(reaper != NULL);
+  fake_wait_running(&fake);
+
+  HashReaperStats stats;
+  hash_reaper_get_stats(reaper, &stats);
+  assert(stats.replayed == 2);
+  assert(!hash_reaper_pending(reaper, "/h/a"));
+  assert(!hash_reaper_pending(reaper, "/h/d"));
+
+  // the journal holds the replayed tombstones until they are reaped
+  struct stat st;
+  assert(stat(journal, &st) == 0 && st.st_size > 0);
+
+  fake_hold(&fake, 0);
+  hash_reaper_flush(reaper);
+  assert(fake.n_reaped == 2);
+  assert(strcmp(fake.reaped[0], "/h/b>/h/c") == 0);
+  assert(strcmp(fake.reaped[1], "/h/x") == 0);
+  assert(stat(journal, &st) == 0 && st.st_size == 0);
+
+  hash_reaper_destroy(reaper);
+  fake_destroy(&fake);
+  unlink(journal);
+  printf("✅ Hash reaper replays its journal passed\n");
+}
+
+static int hash_file_exists(LayerContext ctx, const char *file_path) {
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  InternedPath *path = intern_path(state, file_path);
+  assert(path != NULL);
+  int exists = access(path->hash_path, F_OK) == 0;
+  interned_path_unref(path);
+  return exists;
+}
+
+void test_hash_reaper_file_mode() {
+  printf("Testing file mode unlink and rename with async cleanup...\n");
+
+  char test_data_dir[] = "/tmp/test_hash_reaper_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_hash_reaper_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+  char a[512], b[512];
+  snprintf(a, sizeof(a), "%s/a", test_data_dir);
+  snprintf(b, sizeof(b), "%s/b", test_data_dir);
+
+  AntiTamperingConfig cfg = {
+      .hashes_storage = test_hash_dir,
+      .algorithm = HASH_SHA256,
+      .mode = ANTI_TAMPERING_MODE_FILE,
+      .async_cleanup = 1,
+  };
+  LayerContext ctx = anti_tampering_init(local_init(), local_init(), &cfg);
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  assert(state->hash_reaper != NULL);
+
+  const char content[] = "hash reaper content";
+  int fd = ctx.ops->lopen(a, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lpwrite(fd, content, strlen(content), 0, ctx) ==
+         (ssize_t)strlen(content));
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  assert(hash_file_exists(ctx, a));
+
+  // the hash follows the file; opening the new name claims the move
+  assert(ctx.ops->lrename(a, b, 0, ctx) == 0);
+  fd = ctx.ops->lopen(b, O_RDONLY, 0644, ctx);
+  assert(fd >= 0);
+  assert(hash_file_exists(ctx, b));
+  assert(!hash_file_exists(ctx, a));
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // exchanging two files would exchange their hashes
+  assert(ctx.ops->lrename(b, a, RENAME_EXCHANGE, ctx) == -1);
+
+  assert(ctx.ops->lunlink(b, ctx) == 0);
+  hash_reaper_flush(state->hash_reaper);
+  assert(!hash_file_exists(ctx, b));
+
+  HashReaperStats stats;
+  anti_tampering_hash_reaper_stats(ctx, &stats);
+  assert(stats.moves == 1);
+  assert(stats.removals == 1);
+  assert(stats.failed == 0);
+  assert(stats.queue_depth == 0);
+
+  anti_tampering_destroy(ctx);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+
+  printf("✅ File mode unlink and rename with async cleanup passed\n");
+}
+
+int main() {
+  printf("Running hash reaper tests...\n\n");
+
+  test_hash_reaper_claims_pending_paths();
+  test_hash_reaper_journal_replay();
+  test_hash_reaper_file_mode();
+
+  printf("\nAll hash reaper tests passed!\n");
+  return 0;
+}
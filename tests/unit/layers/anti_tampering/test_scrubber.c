@@ -0,0 +1,271 @@
+#include "../../../../layers/anti_tampering/scrubber.h"
+#include "../../../../layers/anti_tampering/anti_tampering.h"
+#include "../../../../layers/anti_tampering/verify_cache.h"
+#include "../../../../layers/local/local.h"
+#include "../../../../shared/utils/layer_iov.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Verify callback that records the scrubbed paths
+typedef struct {
+  pthread_mutex_t mutex;
+  char scrubbed[16][512]; // scrubbed paths, in order
+  size_t n_scrubbed;
+} FakeVerify;
+
+static ScrubResult fake_verify(void *arg, const char *file_path) {
+  FakeVerify *fake = arg;
+  pthread_mutex_lock(&fake->mutex);
+  assert(fake->n_scrubbed < 16);
+  snprintf(fake->scrubbed[fake->n_scrubbed++], 512, "%s", file_path);
+  pthread_mutex_unlock(&fake->mutex);
+  return strstr(file_path, "plain") ? SCRUB_UNPROTECTED : SCRUB_VERIFIED;
+}
+
+static int fake_scrubbed(FakeVerify *fake, const char *suffix) {
+  size_t len = strlen(suffix);
+  for (size_t i = 0; i < fake->n_scrubbed; i++) {
+    size_t n = strlen(fake->scrubbed[i]);
+    if (n >= len && strcmp(fake->scrubbed[i] + n - len, suffix) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void write_file(const char *dir, const char *name, size_t size) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  assert(fd >= 0);
+  char *data = calloc(1, size + 1);
+  assert(data != NULL);
+  memset(data, 'x', size);
+  assert(write(fd, data, size) == (ssize_t)size);
+  free(data);
+  close(fd);
+}
+
+static void remove_file(const char *dir, const char *name) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  unlink(path);
+}
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void test_scrubber_walks_tree() {
+  printf("Testing scrubber walks the files of its tree...\n");
+
+  char dir[] = "/tmp/test_scrubber_tree_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  char sub[512];
+  snprintf(sub, sizeof(sub), "%s/sub", dir);
+  assert(mkdir(sub, 0755) == 0);
+  write_file(dir, "a", 100);
+  write_file(dir, "plain", 10);
+  write_file(sub, "b", 1000);
+
+  FakeVerify fake = {.n_scrubbed = 0};
+  pthread_mutex_init(&fake.mutex, NULL);
+  Scrubber *scrubber = scrubber_init(local_init(), dir, 0, 3600, fake_verify,
+                                     &fake);
+  assert(scrubber != NULL);
+  scrubber_wait_passes(scrubber, 1);
+
+  assert(fake.n_scrubbed == 3);
+  assert(fake_scrubbed(&fake, "/a"));
+  assert(fake_scrubbed(&fake, "/plain"));
+  assert(fake_scrubbed(&fake, "/sub/b"));
+  ScrubberStats stats;
+  scrubber_get_stats(scrubber, &stats);
+  assert(stats.passes == 1);
+  assert(stats.verified == 2);
+  assert(stats.unprotected == 1);
+  assert(stats.mismatches == 0 && stats.failed == 0);
+  assert(stats.bytes == 1110);
+  assert(stats.last_pass_end != 0);
+
+  // the interval is an hour: only a kick starts the next pass
+  scrubber_kick(scrubber);
+  scrubber_wait_passes(scrubber, 2);
+  scrubber_get_stats(scrubber, &stats);
+  assert(stats.passes == 2);
+  assert(fake.n_scrubbed == 6);
+
+  // busy marks are counted per writer
+  scrubber_mark_writer(scrubber, "/x");
+  scrubber_mark_writer(scrubber, "/x");
+  scrubber_unmark_writer(scrubber, "/x");
+  assert(scrubber_is_busy(scrubber, "/x"));
+  scrubber_unmark_writer(scrubber, "/x");
+  assert(!scrubber_is_busy(scrubber, "/x"));
+  assert(!scrubber_is_busy(NULL, "/x"));
+
+  scrubber_destroy(scrubber);
+  pthread_mutex_destroy(&fake.mutex);
+  remove_file(sub, "b");
+  rmdir(sub);
+  remove_file(dir, "a");
+  remove_file(dir, "plain");
+  rmdir(dir);
+  printf("✅ Scrubber walks the files of its tree passed\n");
+}
+
+void test_scrubber_rate_limit() {
+  printf("Testing scrubber I/O rate limit...\n");
+
+  char dir[] = "/tmp/test_scrubber_rate_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  const char *names[] = {"f0", "f1", "f2", "f3"};
+  for (size_t i = 0; i < 4; i++) {
+    write_file(dir, names[i], 32 * 1024);
+  }
+
+  // a second of burst covers three files, the fourth waits for half a second
+  FakeVerify fake = {.n_scrubbed = 0};
+  pthread_mutex_init(&fake.mutex, NULL);
+  double start = now_s();
+  Scrubber *scrubber = scrubber_init(local_init(), dir, 64 * 1024, 3600,
+                                     fake_verify, &fake);
+  assert(scrubber != NULL);
+  scrubber_wait_passes(scrubber, 1);
+  double elapsed = now_s() - start;
+  assert(fake.n_scrubbed == 4);
+  assert(elapsed >= 0.4);
+  scrubber_destroy(scrubber);
+
+  // destroy interrupts a pass waiting for its budget
+  fake.n_scrubbed = 0;
+  scrubber = scrubber_init(local_init(), dir, 1, 3600, fake_verify, &fake);
+  assert(scrubber != NULL);
+  usleep(100 * 1000);
+  start = now_s();
+  scrubber_destroy(scrubber);
+  assert(now_s() - start < 1.0);
+  assert(fake.n_scrubbed == 1);
+
+  pthread_mutex_destroy(&fake.mutex);
+  for (size_t i = 0; i < 4; i++) {
+    remove_file(dir, names[i]);
+  }
+  rmdir(dir);
+  printf("✅ Scrubber I/O rate limit passed\n");
+}
+
+void test_scrubber_file_mode() {
+  printf("Testing scrubber over anti_tampering file mode...\n");
+
+  char test_data_dir[] = "/tmp/test_scrubber_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_scrubber_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+  char cold_path[512];
+  char hot_path[512];
+  snprintf(cold_path, sizeof(cold_path), "%s/cold", test_data_dir);
+  snprintf(hot_path, sizeof(hot_path), "%s/hot", test_data_dir);
+
+  AntiTamperingConfig cfg = {
+      .hashes_storage = test_hash_dir,
+      .algorithm = HASH_SHA256,
+      .mode = ANTI_TAMPERING_MODE_FILE,
+      .verify_cache_entries = 16,
+      .verify_cache_ttl = 3600,
+      .scrub_root = test_data_dir,
+      .scrub_rate = 0,
+      .scrub_interval = 3600,
+  };
+  LayerContext ctx = anti_tampering_init(local_init(), local_init(), &cfg);
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  assert(state->scrubber != NULL);
+  scrubber_wait_passes(state->scrubber, 1);
+
+  const char cold[] = "cold file content";
+  const char hot[] = "hot file content";
+  int fd = ctx.ops->lopen(cold_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(ctx.ops->lpwrite(fd, cold, strlen(cold), 0, ctx) ==
+         (ssize_t)strlen(cold));
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  fd = ctx.ops->lopen(hot_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(ctx.ops->lpwrite(fd, hot, strlen(hot), 0, ctx) ==
+         (ssize_t)strlen(hot));
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // verified at rest: the next open trusts the scrub
+  verify_cache_invalidate(state->verify_cache, cold_path);
+  scrubber_kick(state->scrubber);
+  scrubber_wait_passes(state->scrubber, 2);
+  ScrubberStats stats;
+  anti_tampering_scrub_stats(ctx, &stats);
+  assert(stats.verified == 2);
+  assert(stats.mismatches == 0);
+  size_t hits = state->verify_cache->hits;
+  fd = ctx.ops->lopen(cold_path, O_RDONLY, 0, ctx);
+  assert(fd >= 0);
+  assert(state->verify_cache->hits == hits + 1);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // a file open for writing has a stale hash: skipped, not a mismatch
+  fd = ctx.ops->lopen(hot_path, O_RDWR, 0, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lpwrite(fd, "HOT", 3, 0, ctx) == 3);
+  // tampered behind the layer's back while cold
+  int raw_fd = open(cold_path, O_WRONLY);
+  assert(raw_fd >= 0);
+  assert(pwrite(raw_fd, "C", 1, 0) == 1);
+  close(raw_fd);
+  scrubber_kick(state->scrubber);
+  scrubber_wait_passes(state->scrubber, 3);
+  anti_tampering_scrub_stats(ctx, &stats);
+  assert(stats.mismatches == 1);
+  assert(stats.last_mismatches == 1);
+  assert(stats.unprotected == 1);
+  assert(stats.verified == 2);
+  // the same checks on demand
+  assert(layer_verify(cold_path, ctx) == LAYER_VERIFY_MISMATCH);
+  assert(layer_verify(hot_path, ctx) == LAYER_VERIFY_UNPROTECTED);
+
+  // committed on close: verified again
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  assert(!scrubber_is_busy(state->scrubber, hot_path));
+  scrubber_kick(state->scrubber);
+  scrubber_wait_passes(state->scrubber, 4);
+  anti_tampering_scrub_stats(ctx, &stats);
+  assert(stats.verified == 3);
+  assert(stats.mismatches == 2);
+  assert(layer_verify(hot_path, ctx) == LAYER_VERIFY_OK);
+
+  // a layer without hashes checks nothing
+  assert(layer_verify(hot_path, state->data_layer) ==
+         LAYER_VERIFY_UNPROTECTED);
+
+  assert(ctx.ops->lunlink(cold_path, ctx) == 0);
+  assert(ctx.ops->lunlink(hot_path, ctx) == 0);
+  assert(layer_verify(hot_path, ctx) == LAYER_VERIFY_UNPROTECTED);
+  anti_tampering_destroy(ctx);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+  printf("✅ Scrubber over anti_tampering file mode passed\n");
+}
+
+int main() {
+  printf("Running scrubber tests...\n\n");
+
+  test_scrubber_walks_tree();
+  test_scrubber_rate_limit();
+  test_scrubber_file_mode();
+
+  printf("\nAll scrubber tests passed!\n");
+  return 0;
+}
@@ -0,0 +1,427 @@
+#include "../../../../layers/anti_tampering/verify_cache.h"
+#include "../../../../layers/anti_tampering/anti_tampering.h"
+#include "../../../../layers/anti_tampering/anti_tampering_utils.h"
+#include "../../../../layers/local/local.h"
+#include "../../../../shared/utils/layer_iov.h"
+#include "../../../../shared/utils/metadata_service.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bytes read from the data layer, to check whether open() rehashes the file
+static size_t data_bytes_read = 0;
+static ssize_t (*local_pread_fn)(int, void *, size_t, off_t, LayerContext);
+
+static ssize_t counting_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                              LayerContext l) {
+  ssize_t res = local_pread_fn(fd, buffer, nbyte, offset, l);
+  if (res > 0) {
+    data_bytes_read += (size_t)res;
+  }
+  return res;
+}
+
+static LayerContext counting_local_init() {
+  LayerContext layer = local_init();
+  local_pread_fn = layer.ops->lpread;
+  layer.ops->lpread = counting_pread;
+  // no backing fd: the hasher would read it directly, uncounted
+  layer.ops->lbacking_fd = NULL;
+  return layer;
+}
+
+static struct stat make_stat(ino_t inode, off_t size, time_t mtime) {
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  st.st_dev = 1;
+  st.st_ino = inode;
+  st.st_size = size;
+  st.st_mtim.tv_sec = mtime;
+  st.st_ctim.tv_sec = mtime;
+  return st;
+}
+
+void test_verify_cache_watermark() {
+  printf("Testing verify cache watermark comparison...\n");
+
+  VerifyCache *cache = verify_cache_init(4, 0);
+  assert(cache != NULL);
+
+  struct stat st = make_stat(10, 100, 1000);
+  assert(verify_cache_lookup(cache, "/a", &st) == 0);
+  verify_cache_insert(cache, "/a", &st);
+  assert(verify_cache_lookup(cache, "/a", &st) == 1);
+
+  // any field change is a miss and drops the entry
+  struct stat changed = st;
+  changed.st_size = 101;
+  assert(verify_cache_lookup(cache, "/a", &changed) == 0);
+  assert(verify_cache_lookup(cache, "/a", &st) == 0);
+
+  verify_cache_insert(cache, "/a", &st);
+  changed = st;
+  changed.st_ctim.tv_nsec = 1;
+  assert(verify_cache_lookup(cache, "/a", &changed) == 0);
+
+  verify_cache_insert(cache, "/a", &st);
+  changed = st;
+  changed.st_ino = 11;
+  assert(verify_cache_lookup(cache, "/a", &changed) == 0);
+
+  // explicit invalidation
+  verify_cache_insert(cache, "/a", &st);
+  verify_cache_invalidate(cache, "/a");
+  assert(verify_cache_lookup(cache, "/a", &st) == 0);
+
+  // stats without timestamps are never cached
+  struct stat no_times = make_stat(12, 100, 0);
+  verify_cache_insert(cache, "/b", &no_times);
+  assert(cache->n_entries == 0);
+  assert(verify_cache_lookup(cache, "/b", &no_times) == 0);
+
+  // disabled cache
+  assert(verify_cache_init(0, 0) == NULL);
+  assert(verify_cache_lookup(NULL, "/a", &st) == 0);
+
+  verify_cache_destroy(cache);
+  printf("✅ Verify cache watermark comparison passed\n");
+}
+
+void test_verify_cache_lru_eviction() {
+  printf("Testing verify cache LRU eviction...\n");
+
+  VerifyCache *cache = verify_cache_init(2, 0);
+  assert(cache != NULL);
+
+  struct stat a = make_stat(1, 10, 100);
+  struct stat b = make_stat(2, 10, 100);
+  struct stat c = make_stat(3, 10, 100);
+  verify_cache_insert(cache, "/a", &a);
+  verify_cache_insert(cache, "/b", &b);
+
+  // touching /a makes /b the least recently used
+  assert(verify_cache_lookup(cache, "/a", &a) == 1);
+  verify_cache_insert(cache, "/c", &c);
+  assert(cache->n_entries == 2);
+
+  assert(verify_cache_lookup(cache, "/b", &b) == 0);
+  assert(verify_cache_lookup(cache, "/a", &a) == 1);
+  assert(verify_cache_lookup(cache, "/c", &c) == 1);
+
+  verify_cache_destroy(cache);
+  printf("✅ Verify cache LRU eviction passed\n");
+}
+
+void test_verify_cache_skips_rehash_on_open() {
+  printf("Testing file mode open skips rehash of unchanged files...\n");
+
+  char test_data_dir[] = "/tmp/test_verify_cache_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_verify_cache_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+  char test_file_path[512];
+  snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+           test_data_dir);
+
+  AntiTamperingConfig cfg = {
+      .data_layer = NULL,
+      .hash_layer = NULL,
+      .hashes_storage = test_hash_dir,
+      .algorithm = HASH_SHA256,
+      .mode = ANTI_TAMPERING_MODE_FILE,
+      .block_size = 0,
+      .verify_cache_entries = 16,
+      .verify_cache_ttl = 60,
+  };
+  LayerContext data_layer = counting_local_init();
+  LayerContext hash_layer = local_init();
+  LayerContext ctx = anti_tampering_init(data_layer, hash_layer, &cfg);
+
+  const char data[] = "verify cache test content";
+  int fd = ctx.ops->lopen(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lpwrite(fd, data, strlen(data), 0, ctx) ==
+         (ssize_t)strlen(data));
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // close hashed the file and the stored hash matches: no rehash on open
+  data_bytes_read = 0;
+  fd = ctx.ops->lopen(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  assert(data_bytes_read == 0);
+
+  // a write invalidates the entry, close caches the new content again
+  assert(ctx.ops->lpwrite(fd, "V", 1, 0, ctx) == 1);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  data_bytes_read = 0;
+  fd = ctx.ops->lopen(test_file_path, O_RDONLY, 0644, ctx);
+  assert(fd >= 0);
+  assert(data_bytes_read == 0);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // modification behind the layer's back changes the watermark: rehash
+  sleep(1);
+  int raw_fd = open(test_file_path, O_WRONLY);
+  assert(raw_fd >= 0);
+  assert(pwrite(raw_fd, "X", 1, 0) == 1);
+  close(raw_fd);
+  data_bytes_read = 0;
+  fd = ctx.ops->lopen(test_file_path, O_RDONLY, 0644, ctx);
+  assert(fd >= 0);
+  assert(data_bytes_read >= strlen(data));
+
+  // mismatching files are not cached
+  data_bytes_read = 0;
+  int fd2 = ctx.ops->lopen(test_file_path, O_RDONLY, 0644, ctx);
+  assert(fd2 >= 0);
+  assert(data_bytes_read >= strlen(data));
+  assert(ctx.ops->lclose(fd2, ctx) == 0);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  assert(ctx.ops->lunlink(test_file_path, ctx) == 0);
+  anti_tampering_destroy(ctx);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+  printf("✅ File mode open skips rehash of unchanged files passed\n");
+}
+
+void test_backing_fd_of_verified_files() {
+  printf("Testing backing files of verified read-only opens...\n");
+
+  char test_data_dir[] = "/tmp/test_backing_fd_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_backing_fd_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+  char test_file_path[512];
+  snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+           test_data_dir);
+
+  AntiTamperingConfig cfg = {
+      .data_layer = NULL,
+      .hash_layer = NULL,
+      .hashes_storage = test_hash_dir,
+      .algorithm = HASH_SHA256,
+      .mode = ANTI_TAMPERING_MODE_FILE,
+      .block_size = 0,
+  };
+  LayerContext data_layer = local_init();
+  LayerContext hash_layer = local_init();
+  LayerContext ctx = anti_tampering_init(data_layer, hash_layer, &cfg);
+
+  // the local layer is its own backing file
+  int local_fd = open(test_file_path, O_RDWR | O_CREAT, 0644);
+  assert(local_fd >= 0);
+  assert(layer_backing_fd(local_fd, data_layer) == local_fd);
+  close(local_fd);
+
+  // no hash yet: nothing was verified
+  const char data[] = "backing file test content";
+  int fd = ctx.ops->lopen(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  assert(layer_backing_fd(fd, ctx) == -1);
+  assert(ctx.ops->lpwrite(fd, data, strlen(data), 0, ctx) ==
+         (ssize_t)strlen(data));
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // verified and read-only: the data layer fd, which reads the content
+  fd = ctx.ops->lopen(test_file_path, O_RDONLY, 0644, ctx);
+  assert(fd >= 0);
+  int backing_fd = layer_backing_fd(fd, ctx);
+  assert(backing_fd >= 0);
+  char buf[64];
+  assert(pread(backing_fd, buf, sizeof(buf), 0) == (ssize_t)strlen(data));
+  assert(memcmp(buf, data, strlen(data)) == 0);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // verified but writable
+  fd = ctx.ops->lopen(test_file_path, O_RDWR, 0644, ctx);
+  assert(fd >= 0);
+  assert(layer_backing_fd(fd, ctx) == -1);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // tampered behind the layer's back
+  int raw_fd = open(test_file_path, O_WRONLY);
+  assert(raw_fd >= 0);
+  assert(pwrite(raw_fd, "X", 1, 0) == 1);
+  close(raw_fd);
+  fd = ctx.ops->lopen(test_file_path, O_RDONLY, 0644, ctx);
+  assert(fd >= 0);
+  assert(layer_backing_fd(fd, ctx) == -1);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // layers without lbacking_fd have none
+  assert(layer_backing_fd(fd, (LayerContext){.ops = &(LayerOps){0}}) == -1);
+
+  assert(ctx.ops->lunlink(test_file_path, ctx) == 0);
+  anti_tampering_destroy(ctx);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+  printf("✅ Backing files of verified read-only opens passed\n");
+}
+
+void test_verify_cache_shared_between_layers() {
+  printf("Testing verifications shared through the metadata service...\n");
+
+  MetadataService service = {.cache_size_bytes = 1024 * 1024};
+  assert(metadata_service_configure(&service) == 0);
+
+  char test_data_dir[] = "/tmp/test_verify_shared_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_verify_shared_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+  char test_file_path[512];
+  snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+           test_data_dir);
+
+  AntiTamperingConfig cfg = {
+      .hashes_storage = test_hash_dir,
+      .algorithm = HASH_SHA256,
+      .mode = ANTI_TAMPERING_MODE_FILE,
+      .verify_cache_entries = 16,
+      .verify_cache_ttl = 60,
+  };
+  LayerContext writer = anti_tampering_init(local_init(), local_init(), &cfg);
+  LayerContext reader =
+      anti_tampering_init(counting_local_init(), local_init(), &cfg);
+  AntiTamperingState *state = (AntiTamperingState *)reader.internal_state;
+  assert(state->metadata == metadata_service_cache());
+
+  const char data[] = "shared verification content";
+  int fd = writer.ops->lopen(test_file_path, O_RDWR | O_CREAT, 0644, writer);
+  assert(fd >= 0);
+  assert(writer.ops->lpwrite(fd, data, strlen(data), 0, writer) ==
+         (ssize_t)strlen(data));
+  assert(writer.ops->lclose(fd, writer) == 0);
+
+  // the other layer knows the hash of the content: it only reads the hash
+  MetadataCacheStats before;
+  metadata_cache_get_stats(state->metadata, &before);
+  data_bytes_read = 0;
+  fd = reader.ops->lopen(test_file_path, O_RDONLY, 0, reader);
+  assert(fd >= 0);
+  assert(data_bytes_read == 0);
+  assert(anti_tampering_mapping(state, fd)->verified);
+  assert(reader.ops->lclose(fd, reader) == 0);
+  MetadataCacheStats after;
+  metadata_cache_get_stats(state->metadata, &after);
+  assert(after.hits == before.hits + 1);
+
+  // and then has it in its own verify cache
+  size_t hits = state->verify_cache->hits;
+  fd = reader.ops->lopen(test_file_path, O_RDONLY, 0, reader);
+  assert(fd >= 0);
+  assert(state->verify_cache->hits == hits + 1);
+  assert(reader.ops->lclose(fd, reader) == 0);
+
+  // modified behind the layers' backs: both caches miss and the file is hashed
+  sleep(1);
+  int raw_fd = open(test_file_path, O_WRONLY);
+  assert(raw_fd >= 0);
+  assert(pwrite(raw_fd, "X", 1, 0) == 1);
+  close(raw_fd);
+  data_bytes_read = 0;
+  fd = reader.ops->lopen(test_file_path, O_RDONLY, 0, reader);
+  assert(fd >= 0);
+  assert(data_bytes_read >= strlen(data));
+  assert(!anti_tampering_mapping(state, fd)->verified);
+  assert(reader.ops->lclose(fd, reader) == 0);
+
+  assert(writer.ops->lunlink(test_file_path, writer) == 0);
+  anti_tampering_destroy(reader);
+  anti_tampering_destroy(writer);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+  printf("✅ Verifications shared through the metadata service passed\n");
+}
+
+void test_hash_prefetch_on_open() {
+  printf("Testing opens that read the stored hash while hashing...\n");
+
+  char test_data_dir[] = "/tmp/test_prefetch_data_XXXXXX";
+  char test_hash_dir[] = "/tmp/test_prefetch_hash_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  assert(mkdtemp(test_hash_dir) != NULL);
+  char test_file_path[512];
+  snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+           test_data_dir);
+
+  AntiTamperingConfig cfg = {
+      .hashes_storage = test_hash_dir,
+      .algorithm = HASH_SHA256,
+      .mode = ANTI_TAMPERING_MODE_FILE,
+      .hash_prefetch = 1,
+  };
+  LayerContext ctx = anti_tampering_init(local_init(), local_init(), &cfg);
+  AntiTamperingState *state = (AntiTamperingState *)ctx.internal_state;
+  assert(state->hash_prefetch);
+
+  // no hash yet: hashed, but nothing to compare with
+  const char data[] = "prefetched hash test content";
+  int fd = ctx.ops->lopen(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lpwrite(fd, data, strlen(data), 0, ctx) ==
+         (ssize_t)strlen(data));
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  fd = ctx.ops->lopen(test_file_path, O_RDONLY, 0644, ctx);
+  assert(fd >= 0);
+  assert(layer_backing_fd(fd, ctx) >= 0); // verified
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // tampered behind the layer's back
+  int raw_fd = open(test_file_path, O_WRONLY);
+  assert(raw_fd >= 0);
+  assert(pwrite(raw_fd, "X", 1, 0) == 1);
+  close(raw_fd);
+  fd = ctx.ops->lopen(test_file_path, O_RDONLY, 0644, ctx);
+  assert(fd >= 0);
+  assert(layer_backing_fd(fd, ctx) == -1);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // an empty file, opened many times
+  assert(ctx.ops->lunlink(test_file_path, ctx) == 0);
+  fd = ctx.ops->lopen(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  int fds[8];
+  for (int i = 0; i < 8; i++) {
+    fds[i] = ctx.ops->lopen(test_file_path, O_RDONLY, 0644, ctx);
+    assert(fds[i] >= 0);
+    assert(layer_backing_fd(fds[i], ctx) >= 0);
+  }
+  for (int i = 0; i < 8; i++) {
+    assert(ctx.ops->lclose(fds[i], ctx) == 0);
+  }
+
+  // with a metadata service cache the stored hash is read first
+  AntiTamperingConfig shared_cfg = cfg;
+  shared_cfg.verify_cache_entries = 4;
+  LayerContext shared = anti_tampering_init(local_init(), local_init(),
+                                            &shared_cfg);
+  assert(!((AntiTamperingState *)shared.internal_state)->hash_prefetch);
+  anti_tampering_destroy(shared);
+
+  assert(ctx.ops->lunlink(test_file_path, ctx) == 0);
+  anti_tampering_destroy(ctx);
+  rmdir(test_data_dir);
+  rmdir(test_hash_dir);
+  printf("✅ Opens that read the stored hash while hashing passed\n");
+}
+
+int main() {
+  printf("Running verify cache tests...\n\n");
+
+  // first: the metadata service is configured before any layer uses it
+  test_verify_cache_shared_between_layers();
+  test_verify_cache_watermark();
+  test_verify_cache_lru_eviction();
+  test_verify_cache_skips_rehash_on_open();
+  test_backing_fd_of_verified_files();
+  test_hash_prefetch_on_open();
+
+  printf("\n✅ All verify cache tests passed!\n");
+  return 0;
+}
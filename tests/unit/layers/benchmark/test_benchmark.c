@@ -4,23 +4,29 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #define num_reps 100000
 #define block_size 4
 #define TESTPATH "test_file.txt"
 #define BENCHMARK_FILE "benchmark.txt"
+#define TRACE_FILE "benchmark.tgtrace"
 
 LayerContext build_tree(int block_align) {
   LayerContext context_local = local_init();
+  BlockAlignConfig block_config = {NULL, block_size}; // block_size is a macro
   LayerContext context_block_align =
-      block_align_init(&context_local, 1, block_size);
+      block_align_init(&context_local, 1, &block_config);
+  BenchmarkConfig benchmark_config = {NULL, num_reps};
   LayerContext context_benchmark;
   if (block_align) {
-    context_benchmark = benchmark_init(&context_block_align, 1, num_reps);
+    context_benchmark =
+        benchmark_init(&context_block_align, 1, &benchmark_config);
   } else {
-    context_benchmark = benchmark_init(&context_local, 1, num_reps);
+    context_benchmark = benchmark_init(&context_local, 1, &benchmark_config);
   }
 
   return context_benchmark;
@@ -121,6 +127,103 @@ void test_benchmark(LayerContext tree_BA, LayerContext tree_no_BA, char *ops) {
   printf("✅ Test of the validation of a Benchmark %s example passed\n", ops);
 }
 
+/**
+ * @brief Read a trace file back
+ *
+ * @return BenchmarkTraceRecord* -> its records, to free
+ */
+BenchmarkTraceRecord *read_trace(BenchmarkTraceHeader *header) {
+  FILE *file = fopen(TRACE_FILE, "rb");
+  assert(file);
+  assert(fread(header, sizeof(*header), 1, file) == 1);
+  assert(strcmp(header->magic, BENCHMARK_TRACE_MAGIC) == 0);
+  assert(header->version == BENCHMARK_TRACE_VERSION);
+  assert(header->record_size == sizeof(BenchmarkTraceRecord));
+  BenchmarkTraceRecord *records =
+      calloc(header->records + 1, sizeof(BenchmarkTraceRecord));
+  assert(fread(records, sizeof(BenchmarkTraceRecord), header->records, file) ==
+         header->records);
+  (void)fclose(file);
+  unlink(TRACE_FILE);
+  return records;
+}
+
+void test_benchmark_trace() {
+  printf("Testing the Benchmark trace mode...\n");
+  // a ring of 4 records keeps the last 4 of the 5 operations
+  LayerContext context_local = local_init();
+  BenchmarkConfig config = {.mode = BENCHMARK_MODE_TRACE,
+                            .trace = TRACE_FILE,
+                            .trace_records = 4,
+                            .trace_sample = 1,
+                            .name = "traced"};
+  LayerContext l = benchmark_init(&context_local, 1, &config);
+  assert(l.ops);
+
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, "12345678", 8, 0, l) == 8);
+  char buffer[8];
+  // each operation runs once in trace mode
+  assert(l.ops->lpread(fd, buffer, 8, 2, l) == 6);
+  assert(l.ops->lftruncate(fd, 3, l) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+
+  BenchmarkTraceHeader header;
+  assert(benchmark_trace_dump(l, TRACE_FILE) == 0);
+  BenchmarkTraceRecord *records = read_trace(&header);
+  assert(header.records == 4 && header.lost == 1 && header.sample == 1);
+  assert(strcmp(header.layer, "traced") == 0);
+  assert(header.pid == (uint32_t)getpid());
+  assert(records[0].op == BENCHMARK_TRACE_PWRITE);
+  assert(records[0].fd == fd && records[0].offset == 0);
+  assert(records[0].size == 8 && records[0].result == 8);
+  assert(records[1].op == BENCHMARK_TRACE_PREAD);
+  assert(records[1].offset == 2 && records[1].result == 6);
+  assert(records[2].op == BENCHMARK_TRACE_FTRUNCATE && records[2].size == 3);
+  assert(records[3].op == BENCHMARK_TRACE_CLOSE && records[3].offset == -1);
+  for (int i = 0; i < 4; i++) {
+    assert(records[i].seq == (uint64_t)i + 2 && records[i].tid != 0);
+    assert(i == 0 ||
+           records[i].start_ns >= records[i - 1].start_ns +
+                                      records[i - 1].dur_ns);
+  }
+  free(records);
+
+  struct stat st;
+  assert(l.ops->llstat(TESTPATH, &st, l) == 0 && st.st_size == 3);
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  // destroying the layer dumps the trace to its file
+  l.ops->ldestroy(l);
+  records = read_trace(&header);
+  assert(header.records == 4 && header.lost == 3);
+  assert(records[2].op == BENCHMARK_TRACE_LSTAT && records[2].fd == -1);
+  assert(records[3].op == BENCHMARK_TRACE_UNLINK);
+  free(records);
+  printf("✅ Test of the Benchmark trace mode passed\n");
+}
+
+void test_benchmark_trace_sample() {
+  printf("Testing the sampling of the Benchmark trace mode...\n");
+  LayerContext context_local = local_init();
+  BenchmarkConfig config = {
+      .mode = BENCHMARK_MODE_TRACE, .trace_records = 64, .trace_sample = 4};
+  LayerContext l = benchmark_init(&context_local, 1, &config);
+  struct stat st;
+  for (int i = 0; i < 10; i++) {
+    assert(l.ops->llstat(".", &st, l) == 0);
+  }
+  BenchmarkTraceHeader header;
+  assert(benchmark_trace_dump(l, TRACE_FILE) == 0);
+  BenchmarkTraceRecord *records = read_trace(&header);
+  // calls 0, 4 and 8 are recorded
+  assert(header.records == 3 && header.lost == 0 && header.sample == 4);
+  assert(strcmp(header.layer, "benchmark") == 0);
+  free(records);
+  l.ops->ldestroy(l);
+  printf("✅ Test of the sampling of the Benchmark trace mode passed\n");
+}
+
 int main(int argc, char const *argv[]) {
   printf("Running the Benchmark unit tests\n");
   LayerContext treeBA = build_tree(1);
@@ -128,6 +231,8 @@ int main(int argc, char const *argv[]) {
 
   test_benchmark(treeBA, tree_no_BA, "read");
   test_benchmark(treeBA, tree_no_BA, "write");
+  test_benchmark_trace();
+  test_benchmark_trace_sample();
 
   printf("🎉 All Benchmark unit tests passed!\n");
   return 0;
@@ -4,8 +4,10 @@
  * their purpose, because, for example, the block frontiers change.
  */
 
+#define _GNU_SOURCE
 #include "../../../../layers/block_align/block_align.h"
 #include "../../../../layers/local/local.h"
+#include "../../../../shared/utils/layer_iov.h"
 #include "../../../mock_layer.h"
 #include "types/layer_context.h"
 #include <assert.h>
@@ -15,13 +17,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define TESTPATH "test_file.txt"
 
 // Test state
 static MockLayerState mock_state;
 static LayerContext mock_layer;
-static int mock_block_size = 4096; // 4KB blocks for testing
+// 4KB blocks for testing
+static BlockAlignConfig block_config = {.block_size = 4096};
 
 void setup_test_with_mock_layer() {
   reset_mock_state(&mock_state, 0, 10240); // 10KB initial file size
@@ -392,7 +396,7 @@ void test_block_align_calls_next_layer_ftruncate() {
 
   setup_test_with_mock_layer();
 
-  LayerContext block_layer = block_align_init(&mock_layer, 1, mock_block_size);
+  LayerContext block_layer = block_align_init(&mock_layer, 1, &block_config);
 
   int result = block_align_ftruncate(5, 2000, block_layer);
 
@@ -409,7 +413,7 @@ void test_block_align_calls_next_layer_fstat() {
 
   setup_test_with_mock_layer();
 
-  LayerContext block_layer = block_align_init(&mock_layer, 1, mock_block_size);
+  LayerContext block_layer = block_align_init(&mock_layer, 1, &block_config);
 
   assert(block_layer.ops->lfstat != NULL);
   assert(block_layer.ops->llstat != NULL);
@@ -428,7 +432,7 @@ void test_block_align_calls_next_layer_lstat() {
 
   setup_test_with_mock_layer();
 
-  LayerContext block_layer = block_align_init(&mock_layer, 1, mock_block_size);
+  LayerContext block_layer = block_align_init(&mock_layer, 1, &block_config);
   assert(block_layer.ops->lfstat != NULL);
   assert(block_layer.ops->llstat != NULL);
 
@@ -516,9 +520,259 @@ void test_read_with_offset_bigger_than_size(LayerContext l) {
   printf("✅ Read operation on offset bigger than the size of the file\n");
 }
 
+void test_vectored_partial_blocks(LayerContext layer_block_align) {
+  printf("Testing preadv/pwritev across partial blocks\n");
+
+  int fd = layer_block_align.ops->lopen(TESTPATH, O_RDWR | O_TRUNC | O_CREAT,
+                                        0666, layer_block_align);
+  BlockAlignState *state = (BlockAlignState *)layer_block_align.internal_state;
+  size_t block_size = state->block_size;
+  fill_file(fd, block_size);
+
+  // 3 buffers from the middle of block 1 to the middle of block 3
+  size_t len = 2 * block_size;
+  char *a = malloc(100), *b = malloc(len - 200), *c = malloc(100);
+  memset(a, 'X', 100);
+  memset(b, 'Y', len - 200);
+  memset(c, 'Z', 100);
+  struct iovec out[] = {{a, 100}, {b, len - 200}, {c, 100}};
+  off_t offset = (off_t)block_size + 1000;
+  assert(layer_block_align.ops->lpwritev(fd, out, 3, offset,
+                                         layer_block_align) == (ssize_t)len);
+
+  // the bytes around the write are untouched, the file size too
+  char *file = malloc(5 * block_size);
+  assert(pread(fd, file, 5 * block_size, 0) == (ssize_t)(5 * block_size));
+  int r = 1;
+  for (size_t i = 0; i < 5 * block_size && r; i++) {
+    char expected = (char)(i / block_size + '0');
+    if (i >= (size_t)offset && i < offset + len) {
+      size_t k = i - offset;
+      expected = k < 100 ? 'X' : k < len - 100 ? 'Y' : 'Z';
+    }
+    r = file[i] == expected;
+  }
+  assert(r);
+
+  // read back into other buffers, ending past the end of the file
+  memset(a, 0, 100);
+  memset(b, 0, len - 200);
+  memset(c, 0, 100);
+  struct iovec in[] = {{a, 100}, {b, len - 200}, {c, 100}};
+  assert(layer_block_align.ops->lpreadv(fd, in, 3, offset,
+                                        layer_block_align) == (ssize_t)len);
+  assert(memcmp(a, file + offset, 100) == 0);
+  assert(memcmp(b, file + offset + 100, len - 200) == 0);
+  assert(memcmp(c, file + offset + len - 100, 100) == 0);
+
+  off_t near_end = (off_t)(5 * block_size) - 150;
+  assert(layer_block_align.ops->lpreadv(fd, in, 3, near_end,
+                                        layer_block_align) == 150);
+  assert(memcmp(a, file + near_end, 100) == 0);
+  assert(memcmp(b, file + near_end + 100, 50) == 0);
+
+  layer_block_align.ops->lclose(fd, layer_block_align);
+  free(file);
+  free(a);
+  free(b);
+  free(c);
+  printf("✅ Vectored partial block test passed\n");
+}
+
+// next layer requests, to check the write combining saves them
+static int next_preads = 0;
+static int next_pwrites = 0;
+static ssize_t (*next_pread_fn)(int, void *, size_t, off_t, LayerContext);
+static ssize_t (*next_pwrite_fn)(int, const void *, size_t, off_t,
+                                 LayerContext);
+
+static ssize_t counting_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                              LayerContext l) {
+  next_preads++;
+  return next_pread_fn(fd, buffer, nbyte, offset, l);
+}
+
+static ssize_t counting_pwrite(int fd, const void *buffer, size_t nbyte,
+                               off_t offset, LayerContext l) {
+  next_pwrites++;
+  return next_pwrite_fn(fd, buffer, nbyte, offset, l);
+}
+
+void test_write_combining() {
+  printf("Testing write combining of consecutive unaligned writes\n");
+
+  LayerContext context_local = local_init();
+  next_pread_fn = context_local.ops->lpread;
+  next_pwrite_fn = context_local.ops->lpwrite;
+  context_local.ops->lpread = counting_pread;
+  context_local.ops->lpwrite = counting_pwrite;
+  BlockAlignConfig config = {.block_size = 4096, .write_combine_ms = 100};
+  LayerContext l = block_align_init(&context_local, 1, &config);
+
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0666, l);
+  assert(fd >= 0);
+  char expected[8192];
+  memset(expected, 0, sizeof(expected));
+
+  // small appends: the block stays pending, nothing is read yet
+  next_preads = 0;
+  next_pwrites = 0;
+  for (int i = 0; i < 10; i++) {
+    char chunk[100];
+    memset(chunk, 'a' + i, sizeof(chunk));
+    memcpy(expected + i * 100, chunk, sizeof(chunk));
+    assert(l.ops->lpwrite(fd, chunk, sizeof(chunk), i * 100, l) == 100);
+  }
+  assert(next_preads == 0);
+  assert(next_pwrites == 0);
+
+  // a read on the fd sees the pending bytes
+  char buf[8192];
+  assert(l.ops->lpread(fd, buf, 1000, 0, l) == 1000);
+  assert(next_pwrites == 1);
+  assert(memcmp(buf, expected, 1000) == 0);
+
+  // a write crossing into the next block completes the first one, the rest
+  // is pending until a continuing write completes it too
+  memset(expected + 1000, 'x', 7192);
+  assert(l.ops->lpwrite(fd, expected + 1000, 4000, 1000, l) == 4000);
+  int pwrites = next_pwrites;
+  assert(l.ops->lpwrite(fd, expected + 5000, 3192, 5000, l) == 3192);
+  assert(next_pwrites == pwrites + 1);
+
+  // the flusher writes a pending block once it expired
+  assert(l.ops->lpwrite(fd, "yyyyyyyyyy", 10, 8192, l) == 10);
+  pwrites = next_pwrites;
+  usleep(300 * 1000);
+  assert(next_pwrites == pwrites + 1);
+
+  // close writes what is still pending
+  assert(l.ops->lpwrite(fd, "z", 1, 8202, l) == 1);
+  assert(next_pwrites == pwrites + 1);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(next_pwrites == pwrites + 2);
+
+  int direct = open(TESTPATH, O_RDONLY);
+  assert(direct >= 0);
+  char tail[12];
+  assert(pread(direct, buf, sizeof(buf), 0) == (ssize_t)sizeof(buf));
+  assert(pread(direct, tail, sizeof(tail), 8192) == 11);
+  close(direct);
+  assert(memcmp(buf, expected, sizeof(buf)) == 0);
+  assert(memcmp(tail, "yyyyyyyyyyz", 11) == 0);
+
+  block_align_destroy(l);
+  unlink(TESTPATH);
+  printf("✅ Write combining test passed\n");
+}
+
+void test_write_combining_other_fd() {
+  printf("Testing write combining with another fd writing the block\n");
+
+  LayerContext context_local = local_init();
+  BlockAlignConfig config = {.block_size = 4096, .write_combine_ms = 1000};
+  LayerContext l = block_align_init(&context_local, 1, &config);
+
+  char expected[4096];
+  memset(expected, '.', sizeof(expected));
+  int direct = open(TESTPATH, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  assert(direct >= 0);
+  assert(write(direct, expected, sizeof(expected)) ==
+         (ssize_t)sizeof(expected));
+  close(direct);
+
+  // fd1 leaves the block pending, fd2 writes elsewhere in it meanwhile
+  int fd1 = l.ops->lopen(TESTPATH, O_RDWR, 0666, l);
+  assert(fd1 >= 0);
+  assert(l.ops->lpwrite(fd1, "AAAAAAAAAA", 10, 0, l) == 10);
+  memset(expected, 'A', 10);
+
+  int fd2 = l.ops->lopen(TESTPATH, O_RDWR, 0666, l);
+  assert(fd2 >= 0);
+  assert(l.ops->lpwrite(fd2, "BBBBBBBBBB", 10, 100, l) == 10);
+  memset(expected + 100, 'B', 10);
+  assert(l.ops->lclose(fd2, l) == 0);
+
+  // the pending bytes of fd1 are merged onto the block as fd2 left it
+  assert(l.ops->lclose(fd1, l) == 0);
+
+  char buf[4096];
+  direct = open(TESTPATH, O_RDONLY);
+  assert(direct >= 0);
+  assert(pread(direct, buf, sizeof(buf), 0) == (ssize_t)sizeof(buf));
+  close(direct);
+  assert(memcmp(buf, expected, sizeof(buf)) == 0);
+
+  block_align_destroy(l);
+  unlink(TESTPATH);
+  printf("✅ Write combining with another fd test passed\n");
+}
+
+void test_direct_io() {
+  printf("Testing O_DIRECT fds\n");
+
+  LayerContext context_local = local_init();
+  LayerContext l = block_align_init(&context_local, 1, &block_config);
+  assert(layer_direct_alignment(context_local) == LOCAL_DIRECT_ALIGNMENT);
+  assert(layer_direct_alignment(l) == 1);
+
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT,
+                        0666, l);
+  assert(fd >= 0);
+  assert((fcntl(fd, F_GETFL) & O_DIRECT) != 0);
+
+  // unaligned writes from unaligned buffers, the file keeps its size
+  char expected[8192];
+  memset(expected, 0, sizeof(expected));
+  memset(expected + 10, 'a', 100);
+  assert(l.ops->lpwrite(fd, expected + 10, 100, 10, l) == 100);
+  struct stat st;
+  assert(l.ops->lfstat(fd, &st, l) == 0);
+  assert(st.st_size == 110);
+  memset(expected + 3000, 'b', 5000);
+  assert(l.ops->lpwrite(fd, expected + 3000, 5000, 3000, l) == 5000);
+  assert(l.ops->lfstat(fd, &st, l) == 0);
+  assert(st.st_size == 8000);
+
+  // whole blocks in an aligned buffer
+  char *aligned = NULL;
+  assert(posix_memalign((void **)&aligned, LOCAL_DIRECT_ALIGNMENT, 4096) == 0);
+  memset(aligned, 'c', 4096);
+  memcpy(expected + 4096, aligned, 4096);
+  assert(l.ops->lpwrite(fd, aligned, 4096, 4096, l) == 4096);
+  assert(l.ops->lpread(fd, aligned, 4096, 0, l) == 4096);
+  assert(memcmp(aligned, expected, 4096) == 0);
+
+  // unaligned reads, across blocks and past the end of the file
+  char buf[200];
+  assert(l.ops->lpread(fd, buf + 1, 50, 4090, l) == 50);
+  assert(memcmp(buf + 1, expected + 4090, 50) == 0);
+  assert(l.ops->lpread(fd, buf, 200, 8100, l) == 92);
+  assert(memcmp(buf, expected + 8100, 92) == 0);
+  free(aligned);
+  assert(l.ops->lclose(fd, l) == 0);
+  block_align_destroy(l);
+
+  // blocks must be a multiple of the alignment of the next layer
+  context_local = local_init();
+  BlockAlignConfig small = {.block_size = 1000};
+  l = block_align_init(&context_local, 1, &small);
+  errno = 0;
+  assert(l.ops->lopen(TESTPATH, O_RDWR | O_DIRECT, 0, l) == -1);
+  assert(errno == EINVAL);
+  fd = l.ops->lopen(TESTPATH, O_RDWR, 0, l);
+  assert(fd >= 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  block_align_destroy(l);
+
+  unlink(TESTPATH);
+  printf("✅ O_DIRECT test passed\n");
+}
+
 LayerContext build_tree() {
   LayerContext context_local = local_init();
-  LayerContext context_block_align = block_align_init(&context_local, 1, 4096);
+  LayerContext context_block_align =
+      block_align_init(&context_local, 1, &block_config);
   return context_block_align;
 }
 
@@ -542,6 +796,7 @@ int main(int argc, char const *argv[]) {
   test_write_cross_block_at_eof(tree);
   test_write_cross_block_not_eof(tree);
   test_write_append_two_blocks(tree);
+  test_vectored_partial_blocks(tree);
   test_write_append_flag(tree);
   test_read_not_allowed(tree);
   test_read_empty_file(tree);
@@ -551,6 +806,10 @@ int main(int argc, char const *argv[]) {
 
   block_align_destroy(tree);
 
+  test_write_combining();
+  test_write_combining_other_fd();
+  test_direct_io();
+
   // ftruncate tests with mock layer
   test_block_align_calls_next_layer_ftruncate();
   // fstat tests with mock layer
@@ -20,6 +20,7 @@ void test_block_size_default_value() {
   BlockAlignConfig config;
   block_align_parse_params(layer, &config);
   assert(config.block_size == 4096);
+  assert(config.write_combine_ms == 0);
 
   printf("✅ Default value test passed\n");
   free(config.next_Layer);
@@ -50,11 +51,37 @@ void test_block_size_parsing() {
   toml_free(result);
 }
 
+void test_write_combine_ms_parsing() {
+  printf("Testing write_combine_ms parsing...\n");
+
+  const char *toml_str = "[layer_1]\n"
+                         "type = \"block_align\"\n"
+                         "next = \"layer2\"\n"
+                         "write_combine_ms = 250\n";
+
+  toml_result_t result = toml_parse(toml_str, (int)strlen(toml_str));
+  assert(result.ok);
+
+  toml_datum_t table = result.toptab;
+  toml_datum_t layer = table.u.tab.value[0];
+  assert(layer.type == TOML_TABLE);
+
+  BlockAlignConfig config;
+  block_align_parse_params(layer, &config);
+  assert(config.block_size == 4096);
+  assert(config.write_combine_ms == 250);
+
+  printf("✅ write_combine_ms parsing test passed\n");
+  free(config.next_Layer);
+  toml_free(result);
+}
+
 int main() {
   printf("Running block_align/config.c tests...\n");
 
   test_block_size_default_value();
   test_block_size_parsing();
+  test_write_combine_ms_parsing();
 
   printf("🎉 All block_align parsing tests passed!\n");
   return 0;
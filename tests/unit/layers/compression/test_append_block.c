@@ -1 +1,246 @@
+#include "../../../../layers/compression/append_block.h"
+#include "../../../../layers/compression/compression.h"
+#include "../../../../layers/compression/compression_utils.h"
+#include "../../../../shared/utils/invalidation.h"
+#include "../../../compression_helpers.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#define TESTPATH "test_append_block.bin"
+#define BLOCK_SIZE 4096
+#define RECORD_SIZE 100
+
+static LayerContext append_block_layer() {
+  CompressionConfig config = compression_test_config(BLOCK_SIZE);
+  config.mode = COMPRESSION_MODE_APPEND_BLOCK;
+  return create_compression_test_layer(&config);
+}
+
+static void fill_record(char *buf, int seq) {
+  snprintf(buf, RECORD_SIZE, "%08d log record of the append block mode", seq);
+  memset(buf + strlen(buf), '.', RECORD_SIZE - strlen(buf));
+}
+
+static off_t physical_size() {
+  struct stat st;
+  assert(stat(TESTPATH, &st) == 0);
+  return st.st_size;
+}
+
+void test_append_block_staging() {
+  printf("Testing append block staging...\n");
+
+  int records = 3 * BLOCK_SIZE / RECORD_SIZE;
+  size_t size = (size_t)records * RECORD_SIZE;
+  char *expected = malloc(size);
+  char *buf = malloc(size);
+
+  LayerContext l = append_block_layer();
+  int fd = l.ops->lopen(TESTPATH, O_WRONLY | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  CompressedFileMapping *mapping = compression_test_mapping(fd, l);
+
+  // small appends stay in memory until their block is full
+  for (int i = 0; i < 10; i++) {
+    fill_record(expected + i * RECORD_SIZE, i);
+    assert(l.ops->lpwrite(fd, expected + i * RECORD_SIZE, RECORD_SIZE,
+                          (off_t)i * RECORD_SIZE, l) == RECORD_SIZE);
+  }
+  assert(physical_size() == 0);
+  assert(mapping->staging_valid && mapping->staging_dirty);
+
+  for (int i = 10; i < records; i++) {
+    fill_record(expected + i * RECORD_SIZE, i);
+    assert(l.ops->lpwrite(fd, expected + i * RECORD_SIZE, RECORD_SIZE,
+                          (off_t)i * RECORD_SIZE, l) == RECORD_SIZE);
+  }
+  // two full blocks were compressed once each, the third one is staged
+  assert(block_stored_size(mapping, 0) > 0);
+  assert(block_stored_size(mapping, 1) > 0);
+  assert(block_stored_size(mapping, 2) == 0);
+  off_t stored = physical_size();
+  assert(stored > 0 && stored < 2 * BLOCK_SIZE);
+
+  // the tail is read back from the staging block, through a new descriptor
+  int rfd = l.ops->lopen(TESTPATH, O_RDONLY, 0, l);
+  assert(rfd >= 0);
+  assert(l.ops->lpread(rfd, buf, size, 0, l) == (ssize_t)size);
+  assert(memcmp(buf, expected, size) == 0);
+  assert(l.ops->lpread(rfd, buf, 50, (off_t)size - 20, l) == 20);
+  assert(memcmp(buf, expected + size - 20, 20) == 0);
+  assert(l.ops->lclose(rfd, l) == 0);
+
+  // fsync stores the partial block and the seek table
+  assert(l.ops->lfsync(fd, 0, l) == 0);
+  assert(!mapping->staging_dirty);
+  assert(block_stored_size(mapping, 2) > 0);
+  assert(physical_size() > stored);
+
+  struct stat st;
+  assert(l.ops->lfstat(fd, &st, l) == 0);
+  assert(st.st_size == (off_t)size);
+  assert(l.ops->lclose(fd, l) == 0);
+  compression_destroy(l);
+
+  unlink(TESTPATH);
+  free(expected);
+  free(buf);
+  printf("✅ Append block staging passed\n");
+}
+
+void test_append_block_reopen() {
+  printf("Testing append block reopen...\n");
+
+  size_t size = 2 * BLOCK_SIZE + 300;
+  char *expected = malloc(size);
+  char *buf = malloc(size);
+  for (size_t i = 0; i < size / RECORD_SIZE; i++) {
+    fill_record(expected + i * RECORD_SIZE, (int)i);
+  }
+
+  LayerContext l = append_block_layer();
+  int fd = l.ops->lopen(TESTPATH, O_WRONLY | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, expected, BLOCK_SIZE + 200, 0, l) ==
+         BLOCK_SIZE + 200);
+  // close stores the staged tail
+  assert(l.ops->lclose(fd, l) == 0);
+  compression_destroy(l);
+
+  // a new instance resumes the partial tail block
+  l = append_block_layer();
+  fd = l.ops->lopen(TESTPATH, O_WRONLY, 0, l);
+  assert(fd >= 0);
+  size_t rest = size - BLOCK_SIZE - 200;
+  assert(l.ops->lpwrite(fd, expected + BLOCK_SIZE + 200, rest,
+                        BLOCK_SIZE + 200, l) == (ssize_t)rest);
+  assert(l.ops->lclose(fd, l) == 0);
+  compression_destroy(l);
+
+  l = append_block_layer();
+  fd = l.ops->lopen(TESTPATH, O_RDONLY, 0, l);
+  assert(fd >= 0);
+  assert(l.ops->lpread(fd, buf, size, 0, l) == (ssize_t)size);
+  assert(memcmp(buf, expected, size) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  compression_destroy(l);
+
+  unlink(TESTPATH);
+  free(expected);
+  free(buf);
+  printf("✅ Append block reopen passed\n");
+}
+
+void test_append_block_overwrite() {
+  printf("Testing append block overwrite and truncate...\n");
+
+  size_t size = BLOCK_SIZE + 1000;
+  char *expected = calloc(1, 2 * BLOCK_SIZE);
+  char *buf = malloc(2 * BLOCK_SIZE);
+  for (size_t i = 0; i < size / RECORD_SIZE; i++) {
+    fill_record(expected + i * RECORD_SIZE, (int)i);
+  }
+
+  LayerContext l = append_block_layer();
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, expected, size, 0, l) == (ssize_t)size);
+  CompressedFileMapping *mapping = compression_test_mapping(fd, l);
+  assert(mapping->staging_valid);
+
+  // a write inside the staged block stores it and rewrites the frame
+  memcpy(expected + BLOCK_SIZE + 10, "patched", 7);
+  assert(l.ops->lpwrite(fd, "patched", 7, BLOCK_SIZE + 10, l) == 7);
+  assert(!mapping->staging_valid);
+  assert(l.ops->lpread(fd, buf, size, 0, l) == (ssize_t)size);
+  assert(memcmp(buf, expected, size) == 0);
+
+  // appends after the overwrite pick up the stored tail
+  memcpy(expected + size, "tail", 4);
+  assert(l.ops->lpwrite(fd, "tail", 4, (off_t)size, l) == 4);
+  size += 4;
+
+  // a truncate of the staged block keeps its head
+  assert(l.ops->lftruncate(fd, BLOCK_SIZE + 500, l) == 0);
+  memset(expected + BLOCK_SIZE + 500, 0, size - BLOCK_SIZE - 500);
+  assert(l.ops->lftruncate(fd, 2 * BLOCK_SIZE, l) == 0);
+  assert(l.ops->lpread(fd, buf, 2 * BLOCK_SIZE, 0, l) == 2 * BLOCK_SIZE);
+  assert(memcmp(buf, expected, 2 * BLOCK_SIZE) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+
+  // truncate by path persists the table
+  assert(l.ops->ltruncate(TESTPATH, 100, l) == 0);
+  struct stat st;
+  assert(l.ops->llstat(TESTPATH, &st, l) == 0);
+  assert(st.st_size == 100);
+
+  unlink(TESTPATH);
+  compression_destroy(l);
+  free(expected);
+  free(buf);
+  printf("✅ Append block overwrite and truncate passed\n");
+}
+
+static int invalidations = 0;
+static dev_t invalidated_device;
+static ino_t invalidated_inode;
+
+static void count_invalidation(dev_t device, ino_t inode, void *ctx) {
+  assert(ctx == &invalidations);
+  invalidated_device = device;
+  invalidated_inode = inode;
+  invalidations++;
+}
+
+void test_append_block_invalidation() {
+  printf("Testing append block attribute invalidation...\n");
+
+  char record[RECORD_SIZE];
+  fill_record(record, 0);
+  LayerContext l = append_block_layer();
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  struct stat st;
+  assert(stat(TESTPATH, &st) == 0);
+  layer_invalidate_hook_set(count_invalidation, &invalidations);
+
+  // appends and truncates that move the logical EOF invalidate the file
+  assert(l.ops->lpwrite(fd, record, RECORD_SIZE, 0, l) == RECORD_SIZE);
+  assert(invalidations >= 1);
+  assert(invalidated_device == st.st_dev && invalidated_inode == st.st_ino);
+  int before = invalidations;
+  assert(l.ops->lftruncate(fd, 2 * BLOCK_SIZE, l) == 0);
+  assert(invalidations > before);
+
+  // a truncate to the current size doesn't
+  before = invalidations;
+  assert(l.ops->lftruncate(fd, 2 * BLOCK_SIZE, l) == 0);
+  assert(invalidations == before);
+
+  // nothing is called once the hook is removed
+  layer_invalidate_hook_set(NULL, NULL);
+  assert(l.ops->lftruncate(fd, BLOCK_SIZE, l) == 0);
+  assert(invalidations == before);
+
+  assert(l.ops->lclose(fd, l) == 0);
+  unlink(TESTPATH);
+  compression_destroy(l);
+  printf("✅ Append block attribute invalidation passed\n");
+}
+
+int main() {
+  printf("Running compression append block tests...\n\n");
+
+  test_append_block_staging();
+  test_append_block_reopen();
+  test_append_block_overwrite();
+  test_append_block_invalidation();
+
+  printf("\nAll compression append block tests passed!\n");
+  return 0;
+}
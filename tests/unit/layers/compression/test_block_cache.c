@@ -0,0 +1,135 @@
+#include "../../../../layers/compression/block_cache.h"
+#include "../../../../layers/compression/compression.h"
+#include "../../../../layers/compression/compression_utils.h"
+#include "../../../compression_helpers.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TESTPATH "test_block_cache.bin"
+#define BLOCK_SIZE 4096
+#define NUM_BLOCKS 8
+#define FILE_SIZE (NUM_BLOCKS * BLOCK_SIZE)
+
+static LayerContext sparse_block_layer(int block_cache) {
+  CompressionConfig config = compression_test_config(BLOCK_SIZE);
+  config.block_cache = block_cache;
+  return create_compression_test_layer(&config);
+}
+
+static size_t cached_blocks(LayerContext l) {
+  BlockCache *cache = ((CompressionState *)l.internal_state)->block_cache;
+  return HASH_COUNT(cache->entries);
+}
+
+// Overwrite the stored data of a block behind the layer
+static void corrupt_block(size_t block) {
+  int fd = open(TESTPATH, O_WRONLY);
+  assert(fd >= 0);
+  assert(pwrite(fd, "garbage", 7, (off_t)(block * BLOCK_SIZE)) == 7);
+  close(fd);
+}
+
+void test_block_cache_lru() {
+  printf("Testing block cache eviction...\n");
+
+  char block[BLOCK_SIZE];
+  char out[BLOCK_SIZE];
+  BlockCache *cache = block_cache_init(2, BLOCK_SIZE);
+  assert(cache);
+
+  for (size_t i = 0; i < 3; i++) {
+    fill_test_text(block, BLOCK_SIZE, (int)i);
+    block_cache_put(cache, 1, 2, i, block, BLOCK_SIZE);
+    if (i == 1) {
+      // block 0 becomes the most recently used
+      assert(block_cache_get(cache, 1, 2, 0, out, BLOCK_SIZE) == 1);
+    }
+  }
+  assert(HASH_COUNT(cache->entries) == 2);
+  assert(block_cache_get(cache, 1, 2, 1, out, BLOCK_SIZE) == 0);
+  assert(block_cache_get(cache, 1, 2, 2, out, BLOCK_SIZE) == 1);
+  fill_test_text(block, BLOCK_SIZE, 2);
+  assert(memcmp(out, block, BLOCK_SIZE) == 0);
+
+  // other inodes and longer reads than the block miss
+  assert(block_cache_get(cache, 1, 3, 2, out, BLOCK_SIZE) == 0);
+  block_cache_put(cache, 1, 3, 0, block, 100);
+  assert(block_cache_get(cache, 1, 3, 0, out, 101) == 0);
+  assert(block_cache_get(cache, 1, 3, 0, out, 100) == 1);
+
+  block_cache_invalidate(cache, 1, 2, 0, SIZE_MAX);
+  assert(block_cache_get(cache, 1, 2, 2, out, BLOCK_SIZE) == 0);
+  assert(HASH_COUNT(cache->entries) == 1);
+  block_cache_destroy(cache);
+
+  printf("✅ Block cache eviction passed\n");
+}
+
+void test_block_cache_reads() {
+  printf("Testing block cache reads...\n");
+
+  char *expected = malloc(FILE_SIZE);
+  char *buf = malloc(FILE_SIZE);
+  fill_test_text(expected, FILE_SIZE, 0);
+
+  LayerContext l = sparse_block_layer(4);
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, expected, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(cached_blocks(l) == 0);
+
+  // a read fills the cache, the least recently used blocks are evicted
+  assert(l.ops->lpread(fd, buf, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(buf, expected, FILE_SIZE) == 0);
+  assert(cached_blocks(l) == 4);
+
+  // cached blocks are not read from storage again
+  corrupt_block(7);
+  assert(l.ops->lpread(fd, buf, BLOCK_SIZE, 7 * BLOCK_SIZE, l) == BLOCK_SIZE);
+  assert(memcmp(buf, expected + 7 * BLOCK_SIZE, BLOCK_SIZE) == 0);
+
+  // an overlapping write drops the block
+  fill_test_text(expected + 7 * BLOCK_SIZE, BLOCK_SIZE, 11);
+  assert(l.ops->lpwrite(fd, expected + 7 * BLOCK_SIZE, BLOCK_SIZE,
+                        7 * BLOCK_SIZE, l) == BLOCK_SIZE);
+  assert(cached_blocks(l) == 3);
+  assert(l.ops->lpread(fd, buf, BLOCK_SIZE, 7 * BLOCK_SIZE, l) == BLOCK_SIZE);
+  assert(memcmp(buf, expected + 7 * BLOCK_SIZE, BLOCK_SIZE) == 0);
+
+  // ftruncate drops the blocks of the file
+  assert(l.ops->lftruncate(fd, 6 * BLOCK_SIZE + 100, l) == 0);
+  assert(cached_blocks(l) == 0);
+  assert(l.ops->lpread(fd, buf, 100, 6 * BLOCK_SIZE, l) == 100);
+  assert(memcmp(buf, expected + 6 * BLOCK_SIZE, 100) == 0);
+  assert(cached_blocks(l) == 1);
+
+  // and so does unlink, once the file is closed
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  assert(cached_blocks(l) == 0);
+  compression_destroy(l);
+
+  // without the option there is no cache
+  l = sparse_block_layer(0);
+  assert(((CompressionState *)l.internal_state)->block_cache == NULL);
+  compression_destroy(l);
+
+  free(expected);
+  free(buf);
+  printf("✅ Block cache reads passed\n");
+}
+
+int main() {
+  printf("Running compression block cache tests...\n\n");
+
+  test_block_cache_lru();
+  test_block_cache_reads();
+
+  printf("\nAll compression block cache tests passed!\n");
+  return 0;
+}
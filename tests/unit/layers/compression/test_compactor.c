@@ -0,0 +1,169 @@
+#include "../../../../layers/compression/compactor.h"
+#include "../../../../layers/compression/compression.h"
+#include "../../../compression_helpers.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TESTPATH "test_compactor.bin"
+#define BLOCK_SIZE 65536
+#define NUM_BLOCKS 16
+#define FILE_SIZE (NUM_BLOCKS * BLOCK_SIZE)
+
+static LayerContext sparse_block_layer(int compaction) {
+  CompressionConfig config = compression_test_config(BLOCK_SIZE);
+  config.free_space = compaction;
+  config.compaction = compaction;
+  config.compaction_threshold = 25;
+  config.compaction_rate = 40;
+  return create_compression_test_layer(&config);
+}
+
+static void fill_random(char *buf, size_t n) {
+  srand(7);
+  for (size_t i = 0; i < n; i++) {
+    buf[i] = (char)(rand() & 0xff);
+  }
+}
+
+static off_t allocated_bytes(void) {
+  struct stat st;
+  assert(stat(TESTPATH, &st) == 0);
+  return (off_t)st.st_blocks * 512;
+}
+
+// Wait for the compactor to finish the files queued so far
+static void wait_compacted(LayerContext l, size_t files) {
+  CompactorStats stats;
+  for (int i = 0; i < 500; i++) {
+    compression_compaction_stats(l, &stats);
+    if (stats.compacted + stats.failed >= files) {
+      return;
+    }
+    usleep(10000);
+  }
+  assert(0 && "compaction did not finish");
+}
+
+static Compactor *fake_compactor;
+static size_t fake_calls;
+
+// Three batches of one block, the first one reports I/O on the layer
+static int fake_compact(void *arg, const char *path, size_t *next_block,
+                        size_t max_blocks, off_t *reclaimed) {
+  (void)arg;
+  assert(strcmp(path, "a") == 0);
+  assert(max_blocks == 1);
+  if (fake_calls++ == 0) {
+    compactor_note_io(fake_compactor);
+  }
+  *next_block += max_blocks;
+  *reclaimed = 100;
+  return *next_block < 3 ? 1 : 0;
+}
+
+void test_compactor_queue() {
+  printf("Testing compactor queue...\n");
+
+  fake_compactor = compactor_init(fake_compact, NULL, 5, 200);
+  assert(fake_compactor);
+  assert(compactor_enqueue(fake_compactor, "a") == 0);
+  // the layer is not idle yet: the second close is coalesced
+  assert(compactor_enqueue(fake_compactor, "a") == 0);
+
+  CompactorStats stats;
+  for (int i = 0; i < 500; i++) {
+    compactor_get_stats(fake_compactor, &stats);
+    if (stats.compacted == 1) {
+      break;
+    }
+    usleep(10000);
+  }
+  assert(stats.compacted == 1);
+  assert(stats.enqueued == 1);
+  assert(stats.coalesced == 1);
+  assert(stats.queue_depth == 0);
+  assert(stats.blocks == 3);
+  assert(stats.yields == 1);
+  assert(stats.reclaimed == 300);
+  assert(fake_calls == 3);
+  compactor_destroy(fake_compactor);
+
+  compactor_get_stats(NULL, &stats);
+  assert(stats.enqueued == 0);
+  assert(compactor_init(fake_compact, NULL, 0, 0) == NULL);
+
+  printf("✅ Compactor queue passed\n");
+}
+
+void test_compactor_reclaims() {
+  printf("Testing compaction of sparse_block files...\n");
+
+  char *random = malloc(FILE_SIZE);
+  char *text = malloc(FILE_SIZE);
+  char *buf = malloc(FILE_SIZE);
+  fill_random(random, FILE_SIZE);
+  fill_test_text(text, FILE_SIZE, 0);
+
+  // Without free_space, rewriting with compressible data leaves the slack of
+  // the raw blocks allocated
+  LayerContext l = sparse_block_layer(0);
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, random, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(l.ops->lpwrite(fd, text, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(((CompressionState *)l.internal_state)->compactor == NULL);
+  compression_destroy(l);
+  off_t before = allocated_bytes();
+  assert(before >= FILE_SIZE);
+
+  l = sparse_block_layer(1);
+  fd = l.ops->lopen(TESTPATH, O_RDWR, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpread(fd, buf, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(buf, text, FILE_SIZE) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  wait_compacted(l, 1);
+
+  CompactorStats stats;
+  compression_compaction_stats(l, &stats);
+  assert(stats.enqueued == 1);
+  assert(stats.compacted == 1);
+  assert(stats.blocks == NUM_BLOCKS);
+  assert(stats.reclaimed > 0);
+  off_t after = allocated_bytes();
+  assert(after < before / 2);
+  assert((uint64_t)(before - after) == stats.reclaimed);
+
+  // the data is intact and a compact file is not queued again
+  fd = l.ops->lopen(TESTPATH, O_RDWR, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpread(fd, buf, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(buf, text, FILE_SIZE) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  compression_compaction_stats(l, &stats);
+  assert(stats.enqueued == 1);
+
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  compression_destroy(l);
+
+  free(random);
+  free(text);
+  free(buf);
+  printf("✅ Compaction of sparse_block files passed\n");
+}
+
+int main() {
+  printf("Running compression compactor tests...\n\n");
+
+  test_compactor_queue();
+  test_compactor_reclaims();
+
+  printf("\nAll compression compactor tests passed!\n");
+  return 0;
+}
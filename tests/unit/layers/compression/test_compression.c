@@ -109,10 +109,9 @@ void test_compression_init_lz4() {
   assert(state->compressor.get_compress_bound != NULL);
   assert(state->compressor.get_original_file_size != NULL);
 
-  for (int i = 0; i < MAX_FDS; i++) {
-    assert(state->fd_to_inode[i].path == NULL);
-  }
-  assert(state->file_mapping == NULL);
+  // no fd table page before the first open
+  assert(fd_table_end(&state->fd_to_inode) == 0);
+  assert(state->file_mapping.count == 0);
   assert(state->lock_table != NULL);
 
   // Verify all operations are set
@@ -150,11 +149,8 @@ void test_compression_init_zstd() {
   assert(state->compressor.get_compress_bound != NULL);
   assert(state->compressor.get_original_file_size != NULL);
 
-  assert(state->fd_to_inode != NULL);
-  for (int i = 0; i < MAX_FDS; i++) {
-    assert(state->fd_to_inode[i].path == NULL);
-  }
-  assert(state->file_mapping == NULL);
+  assert(fd_table_end(&state->fd_to_inode) == 0);
+  assert(state->file_mapping.count == 0);
   assert(state->lock_table != NULL);
 
   printf("✅ compression_init ZSTD test passed\n");
@@ -210,6 +206,207 @@ void test_compression_destroy_success() {
   printf("✅ compression_destroy test passed\n");
 }
 
+//========File mapping table tests========
+
+void test_compression_file_mapping_table() {
+  printf("Testing file mapping table...\n");
+
+  setup_mock_layer();
+  CompressionConfig config = {.algorithm = COMPRESSION_LZ4, .level = 5};
+  LayerContext l = compression_init(&mock_layer, &config);
+  CompressionState *state = (CompressionState *)l.internal_state;
+
+  // enough files to grow the table and reuse pooled mappings
+  const ino_t files = 1000;
+  for (ino_t ino = 0; ino < files; ino++) {
+    assert(create_compressed_file_mapping(test_dev, ino, (off_t)ino, l) == 0);
+  }
+  assert(create_compressed_file_mapping(test_dev, 7, 0, l) == -1);
+  assert(state->file_mapping.count == files);
+  assert(state->file_mapping.count * 2 <= state->file_mapping.capacity);
+
+  // removals keep the other files reachable
+  for (ino_t ino = 0; ino < files; ino += 2) {
+    assert(remove_compressed_file_mapping(test_dev, ino, l) == 0);
+  }
+  assert(remove_compressed_file_mapping(test_dev, 0, l) == -1);
+  for (ino_t ino = 0; ino < files; ino++) {
+    CompressedFileMapping *mapping =
+        get_compressed_file_mapping(test_dev, ino, state);
+    if (ino % 2 == 0) {
+      assert(mapping == NULL);
+    } else {
+      assert(mapping != NULL && mapping->logical_eof == (off_t)ino);
+    }
+  }
+  assert(create_compressed_file_mapping(test_dev, 0, 5, l) == 0);
+  CompressedFileMapping *mapping =
+      get_compressed_file_mapping(test_dev, 0, state);
+  assert(mapping->logical_eof == 5 && mapping->num_blocks == 0);
+  assert(state->file_mapping.count == files / 2 + 1);
+
+  compression_destroy(l);
+  printf("✅ File mapping table test passed\n");
+}
+
+void test_compression_block_index_chunks() {
+  printf("Testing block index chunks...\n");
+
+  setup_mock_layer();
+  CompressionConfig config = {.algorithm = COMPRESSION_LZ4, .level = 5};
+  LayerContext l = compression_init(&mock_layer, &config);
+  CompressionState *state = (CompressionState *)l.internal_state;
+  assert(create_compressed_file_mapping(test_dev, test_ino, 0, l) == 0);
+  CompressedFileMapping *bim =
+      get_compressed_file_mapping(test_dev, test_ino, state);
+
+  // size and raw flag are packed in one entry
+  assert(ensure_block_index_capacity(bim, 3 * BLOCK_INDEX_CHUNK - 10) == 0);
+  assert(bim->capacity == 3 * BLOCK_INDEX_CHUNK);
+  for (size_t i = 0; i < bim->num_blocks; i++) {
+    assert(block_stored_size(bim, i) == 0 && !block_is_raw(bim, i));
+    assert(block_set(bim, i, (off_t)(i % 4096), i % 3 == 0) == 0);
+  }
+  BlockEntry *first_chunk = bim->chunks[0];
+  assert(first_chunk != NULL);
+  block_set(bim, 5, BLOCK_SIZE_UNKNOWN, 0);
+  assert(block_stored_size(bim, 5) == BLOCK_SIZE_UNKNOWN);
+  assert(block_stored_size(bim, 9) == 9 && block_is_raw(bim, 9));
+  assert(block_stored_size(bim, 10) == 10 && !block_is_raw(bim, 10));
+
+  // growing keeps the existing chunks in place
+  assert(ensure_block_index_capacity(bim, 4 * BLOCK_INDEX_CHUNK) == 0);
+  assert(bim->chunks[0] == first_chunk);
+  assert(block_stored_size(bim, 2 * BLOCK_INDEX_CHUNK) ==
+         (off_t)(2 * BLOCK_INDEX_CHUNK % 4096));
+
+  // shrinking frees the chunks past the end and clears the rest of the last
+  size_t keep = BLOCK_INDEX_CHUNK + 1;
+  assert(shrink_block_index(bim, keep) == 0);
+  assert(bim->num_blocks == keep);
+  assert(bim->capacity == 2 * BLOCK_INDEX_CHUNK);
+  assert(block_stored_size(bim, keep - 1) == (off_t)(keep - 1));
+  assert(ensure_block_index_capacity(bim, 3 * BLOCK_INDEX_CHUNK) == 0);
+  assert(block_stored_size(bim, keep) == 0 && !block_is_raw(bim, keep));
+  assert(block_stored_size(bim, 2 * BLOCK_INDEX_CHUNK + 1) == 0);
+
+  assert(shrink_block_index(bim, 0) == 0);
+  assert(bim->capacity == 0 && bim->chunks == NULL);
+
+  compression_destroy(l);
+  printf("✅ Block index chunks test passed\n");
+}
+
+void test_compression_block_index_extents() {
+  printf("Testing block index extents...\n");
+
+  setup_mock_layer();
+  CompressionConfig config = {.algorithm = COMPRESSION_LZ4, .level = 5};
+  LayerContext l = compression_init(&mock_layer, &config);
+  CompressionState *state = (CompressionState *)l.internal_state;
+  assert(create_compressed_file_mapping(test_dev, test_ino, 0, l) == 0);
+  CompressedFileMapping *bim =
+      get_compressed_file_mapping(test_dev, test_ino, state);
+
+  // new chunks are sparse extents without an array
+  assert(ensure_block_index_capacity(bim, 4 * BLOCK_INDEX_CHUNK) == 0);
+  for (size_t c = 0; c < 4; c++) {
+    assert(bim->chunks[c] == NULL);
+  }
+
+  // a chunk written sequentially with full raw blocks folds back
+  for (size_t i = 0; i < BLOCK_INDEX_CHUNK; i++) {
+    assert(block_set(bim, i, 4096, 1) == 0);
+    assert(bim->chunks[0] != NULL || i == BLOCK_INDEX_CHUNK - 1);
+  }
+  assert(bim->chunks[0] == NULL);
+  assert(block_stored_size(bim, 17) == 4096 && block_is_raw(bim, 17));
+
+  // one different block gives the chunk its array again
+  assert(block_set(bim, 17, 100, 0) == 0);
+  assert(bim->chunks[0] != NULL);
+  assert(block_stored_size(bim, 17) == 100 && !block_is_raw(bim, 17));
+  assert(block_stored_size(bim, 18) == 4096 && block_is_raw(bim, 18));
+  assert(get_total_compressed_size(0, BLOCK_INDEX_CHUNK - 1, bim) ==
+         (BLOCK_INDEX_CHUNK - 1) * 4096 + 100);
+
+  // filling whole chunks sets their extent, the edges block by block
+  assert(block_index_fill(bim, BLOCK_INDEX_CHUNK - 2, 2 * BLOCK_INDEX_CHUNK + 4,
+                          BLOCK_SIZE_UNKNOWN, 0) == 0);
+  assert(bim->chunks[1] == NULL && bim->chunks[2] == NULL);
+  assert(block_stored_size(bim, BLOCK_INDEX_CHUNK - 3) == 4096);
+  assert(block_stored_size(bim, BLOCK_INDEX_CHUNK - 2) == BLOCK_SIZE_UNKNOWN);
+  assert(block_stored_size(bim, 3 * BLOCK_INDEX_CHUNK + 1) ==
+         BLOCK_SIZE_UNKNOWN);
+  assert(block_stored_size(bim, 3 * BLOCK_INDEX_CHUNK + 2) == 0);
+
+  // shrinking into an extent clears the blocks past the end
+  assert(block_index_fill(bim, BLOCK_INDEX_CHUNK, BLOCK_INDEX_CHUNK, 512, 0) ==
+         0);
+  assert(shrink_block_index(bim, BLOCK_INDEX_CHUNK + 3) == 0);
+  assert(block_stored_size(bim, BLOCK_INDEX_CHUNK + 2) == 512);
+  assert(block_stored_size(bim, BLOCK_INDEX_CHUNK + 3) == 0);
+
+  compression_destroy(l);
+  printf("✅ Block index extents test passed\n");
+}
+
+void test_compression_block_index_sums() {
+  printf("Testing block index sums...\n");
+
+  setup_mock_layer();
+  CompressionConfig config = {.algorithm = COMPRESSION_LZ4, .level = 5};
+  LayerContext l = compression_init(&mock_layer, &config);
+  CompressionState *state = (CompressionState *)l.internal_state;
+  assert(create_compressed_file_mapping(test_dev, test_ino, 0, l) == 0);
+  CompressedFileMapping *bim =
+      get_compressed_file_mapping(test_dev, test_ino, state);
+
+  // the sums of any range match the entries, across chunks and extents
+  size_t blocks = 5 * BLOCK_INDEX_CHUNK + 7;
+  assert(ensure_block_index_capacity(bim, blocks) == 0);
+  for (size_t i = 0; i < blocks; i++) {
+    off_t size = i % 5 == 0 ? BLOCK_SIZE_UNKNOWN : (off_t)(i % 5000);
+    assert(block_set(bim, i, size, 0) == 0);
+  }
+  assert(block_index_fill(bim, 2 * BLOCK_INDEX_CHUNK, BLOCK_INDEX_CHUNK, 4096,
+                          1) == 0);
+  size_t ranges[][2] = {{0, blocks},
+                        {3, 17},
+                        {BLOCK_INDEX_CHUNK - 1, 3 * BLOCK_INDEX_CHUNK + 1},
+                        {2 * BLOCK_INDEX_CHUNK, 3 * BLOCK_INDEX_CHUNK},
+                        {4 * BLOCK_INDEX_CHUNK + 2, blocks},
+                        {9, 9}};
+  for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+    BlockIndexSum expected = {0};
+    for (size_t i = ranges[r][0]; i < ranges[r][1]; i++) {
+      off_t size = block_stored_size(bim, i);
+      if (size == BLOCK_SIZE_UNKNOWN) {
+        expected.unknown++;
+      } else {
+        expected.stored += (uint64_t)size;
+        expected.allocated += ((uint64_t)size + BLOCK_INDEX_ALLOC_UNIT - 1) /
+                              BLOCK_INDEX_ALLOC_UNIT * BLOCK_INDEX_ALLOC_UNIT;
+      }
+    }
+    BlockIndexSum sum = block_index_sum(bim, ranges[r][0], ranges[r][1]);
+    assert(sum.stored == expected.stored);
+    assert(sum.allocated == expected.allocated);
+    assert(sum.unknown == expected.unknown);
+  }
+
+  // shrinking and growing again leaves the new blocks out of the sums
+  assert(shrink_block_index(bim, BLOCK_INDEX_CHUNK + 10) == 0);
+  assert(ensure_block_index_capacity(bim, blocks) == 0);
+  BlockIndexSum tail = block_index_sum(bim, BLOCK_INDEX_CHUNK + 10, blocks);
+  assert(tail.stored == 0 && tail.allocated == 0 && tail.unknown == 0);
+  assert(get_total_compressed_size(0, (off_t)blocks - 1, bim) ==
+         get_total_compressed_size(0, BLOCK_INDEX_CHUNK + 9, bim));
+
+  compression_destroy(l);
+  printf("✅ Block index sums test passed\n");
+}
+
 // Test: Null pathname
 void test_compression_open_null_path() {
   printf("Testing compression_open with NULL path...\n");
@@ -238,11 +435,11 @@ void test_compression_open_lower_layer_fails() {
   printf("✅ compression_open lower layer fail test passed\n");
 }
 
-// Test: File descriptor exceeds MAX_FDS
+// Test: File descriptor exceeds FD_TABLE_MAX_FDS
 void test_compression_open_fd_exceeds_max() {
-  printf("Testing compression_open with fd >= MAX_FDS...\n");
+  printf("Testing compression_open with fd >= FD_TABLE_MAX_FDS...\n");
   setup_mock_layer();
-  mock_state.open_return_value = MAX_FDS; // Simulate fd too large
+  mock_state.open_return_value = FD_TABLE_MAX_FDS; // Simulate fd too large
   LayerContext compression_layer = create_default_compression_layer();
 
   int fd = compression_open("file.txt", O_RDONLY, 0, compression_layer);
@@ -250,7 +447,7 @@ void test_compression_open_fd_exceeds_max() {
   assert(mock_state.close_called == 1);
 
   compression_destroy(compression_layer);
-  printf("✅ compression_open fd exceeds MAX_FDS test passed\n");
+  printf("✅ compression_open fd exceeds FD_TABLE_MAX_FDS test passed\n");
 }
 // Test: Normal open
 void test_compression_open_success() {
@@ -266,8 +463,8 @@ void test_compression_open_success() {
 
   CompressionState *state =
       (CompressionState *)compression_layer.internal_state;
-  assert(state->fd_to_inode[5].path != NULL);
-  assert(strcmp(state->fd_to_inode[5].path, "file.txt") == 0);
+  assert(fd_to_inode_path(state, 5) != NULL);
+  assert(strcmp(fd_to_inode_path(state, 5), "file.txt") == 0);
 
   compression_destroy(compression_layer);
   printf("✅ compression_open success test passed\n");
@@ -287,11 +484,11 @@ void test_compression_open_reuse_fd() {
   assert(fd1 == 7);
   CompressionState *state =
       (CompressionState *)compression_layer.internal_state;
-  assert(strcmp(state->fd_to_inode[7].path, "file1.txt") == 0);
+  assert(strcmp(fd_to_inode_path(state, 7), "file1.txt") == 0);
 
   int res = compression_close(fd1, compression_layer);
   assert(res == 0);
-  assert(state->fd_to_inode[7].path == NULL);
+  assert(fd_to_inode_path(state, 7) == NULL);
 
   // Second open with same fd, should replace mapping
   // We need to set the dev and ino because if the
@@ -301,7 +498,7 @@ void test_compression_open_reuse_fd() {
   int fd2 =
       compression_open("file2.txt", O_RDONLY | O_CREAT, 0, compression_layer);
   assert(fd2 == 7);
-  assert(strcmp(state->fd_to_inode[7].path, "file2.txt") == 0);
+  assert(strcmp(fd_to_inode_path(state, 7), "file2.txt") == 0);
 
   compression_destroy(compression_layer);
   printf("✅ compression_open reuse fd test passed\n");
@@ -374,8 +571,12 @@ void test_compression_close_invalid_fd() {
   int result = compression_close(-1, compression_layer);
   assert(result == INVALID_FD);
 
-  // Test fd >= MAX_FDS
-  result = compression_close(MAX_FDS, compression_layer);
+  // Test fd >= FD_TABLE_MAX_FDS
+  result = compression_close(FD_TABLE_MAX_FDS, compression_layer);
+  assert(result == INVALID_FD);
+
+  // Test an fd never opened, above the pages of the table
+  result = compression_close(FD_TABLE_PAGE_ENTRIES * 8, compression_layer);
   assert(result == INVALID_FD);
 
   compression_destroy(compression_layer);
@@ -414,15 +615,15 @@ void test_compression_close_with_mapping() {
 
   CompressionState *state =
       (CompressionState *)compression_layer.internal_state;
-  assert(state->fd_to_inode[7].path != NULL);
-  assert(strcmp(state->fd_to_inode[7].path, "test.txt") == 0);
+  assert(fd_to_inode_path(state, 7) != NULL);
+  assert(strcmp(fd_to_inode_path(state, 7), "test.txt") == 0);
 
   // Now close the file
   int result = compression_close(7, compression_layer);
   assert(result == 0);
 
   // Verify the mapping was freed and set to NULL
-  assert(state->fd_to_inode[7].path == NULL);
+  assert(fd_to_inode_path(state, 7) == NULL);
 
   compression_destroy(compression_layer);
   printf("✅ compression_close with mapping test passed\n");
@@ -443,20 +644,20 @@ void test_compression_close_multiple_files() {
 
   CompressionState *state =
       (CompressionState *)compression_layer.internal_state;
-  assert(state->fd_to_inode[5].path != NULL);
-  assert(state->fd_to_inode[7].path != NULL);
+  assert(fd_to_inode_path(state, 5) != NULL);
+  assert(fd_to_inode_path(state, 7) != NULL);
 
   // Close first file
   int result1 = compression_close(5, compression_layer);
   assert(result1 == 0);
-  assert(state->fd_to_inode[5].path == NULL);
-  assert(state->fd_to_inode[7].path !=
+  assert(fd_to_inode_path(state, 5) == NULL);
+  assert(fd_to_inode_path(state, 7) !=
          NULL); // Second mapping should still exist
 
   // Close second file
   int result2 = compression_close(7, compression_layer);
   assert(result2 == 0);
-  assert(state->fd_to_inode[7].path == NULL);
+  assert(fd_to_inode_path(state, 7) == NULL);
 
   compression_destroy(compression_layer);
   printf("✅ compression_close multiple files test passed\n");
@@ -484,10 +685,11 @@ void test_compression_close_with_unlinked_file() {
 
   int result = compression_close(fd, compression_layer);
   assert(result == 0);
-  assert(state->fd_to_inode[fd].fd == INVALID_FD);
-  assert(state->fd_to_inode[fd].device == 0);
-  assert(state->fd_to_inode[fd].inode == 0);
-  assert(state->fd_to_inode[fd].path == NULL);
+  FdToInode *slot = fd_table_get(&state->fd_to_inode, fd);
+  assert(slot->fd == INVALID_FD);
+  assert(slot->device == 0);
+  assert(slot->inode == 0);
+  assert(slot->path == NULL);
 
   off_t logical_size = -1;
   result = get_logical_eof_from_mapping(test_dev, test_ino, compression_layer,
@@ -503,10 +705,11 @@ void test_compression_close_with_unlinked_file() {
 
   result = compression_close(fd, compression_layer);
   assert(result == 0);
-  assert(state->fd_to_inode[fd].fd == INVALID_FD);
-  assert(state->fd_to_inode[fd].device == 0);
-  assert(state->fd_to_inode[fd].inode == 0);
-  assert(state->fd_to_inode[fd].path == NULL);
+  slot = fd_table_get(&state->fd_to_inode, fd);
+  assert(slot->fd == INVALID_FD);
+  assert(slot->device == 0);
+  assert(slot->inode == 0);
+  assert(slot->path == NULL);
 
   result = get_logical_eof_from_mapping(test_dev, test_ino, compression_layer,
                                         &logical_size);
@@ -1598,6 +1801,11 @@ int main() {
 
   test_compression_destroy_success();
 
+  test_compression_file_mapping_table();
+  test_compression_block_index_chunks();
+  test_compression_block_index_extents();
+  test_compression_block_index_sums();
+
   test_compression_open_null_path();
   test_compression_open_lower_layer_fails();
   test_compression_open_fd_exceeds_max();
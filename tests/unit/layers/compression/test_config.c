@@ -220,7 +220,9 @@ void test_block_size_and_mode_parsing() {
                          "algorithm = \"zstd\"\n"
                          "level = 5\n"
                          "mode = \"sparse_block\"\n"
-                         "block_size = 8192\n";
+                         "block_size = 8192\n"
+                         "[layer_1.options]\n"
+                         "bare_blocks = true\n";
 
   toml_result_t result = toml_parse(toml_str, (int)strlen(toml_str));
   assert(result.ok);
@@ -233,6 +235,7 @@ void test_block_size_and_mode_parsing() {
   compression_parse_params(layer, &config);
   assert(config.mode == COMPRESSION_MODE_SPARSE_BLOCK);
   assert(config.block_size == 8192);
+  assert(config.bare_blocks == 1);
 
   if (config.next_layer) {
     free(config.next_layer);
@@ -259,6 +262,61 @@ void test_block_size_and_mode_parsing() {
   compression_parse_params(layer, &config);
   assert(config.mode == COMPRESSION_MODE_FILE);
   assert(config.block_size == 4096); // Default value
+  assert(config.bare_blocks == 0);
+
+  if (config.next_layer) {
+    free(config.next_layer);
+    config.next_layer = NULL;
+  }
+
+  toml_free(result);
+
+  // THIRD CONFIG
+  toml_str = "[layer_1]\n"
+             "type = \"compression\"\n"
+             "next = \"layer_2\"\n"
+             "algorithm = \"lz4\"\n"
+             "level = 1\n"
+             "mode = \"seekable\"\n"
+             "block_size = 65536\n";
+
+  result = toml_parse(toml_str, (int)strlen(toml_str));
+  assert(result.ok);
+
+  table = result.toptab;
+  layer = table.u.tab.value[0];
+  assert(layer.type == TOML_TABLE);
+
+  compression_parse_params(layer, &config);
+  assert(config.mode == COMPRESSION_MODE_SEEKABLE);
+  assert(config.block_size == 65536);
+
+  if (config.next_layer) {
+    free(config.next_layer);
+    config.next_layer = NULL;
+  }
+
+  toml_free(result);
+
+  // FOURTH CONFIG
+  toml_str = "[layer_1]\n"
+             "type = \"compression\"\n"
+             "next = \"layer_2\"\n"
+             "algorithm = \"zstd\"\n"
+             "level = 1\n"
+             "mode = \"append_block\"\n"
+             "block_size = 4096\n";
+
+  result = toml_parse(toml_str, (int)strlen(toml_str));
+  assert(result.ok);
+
+  table = result.toptab;
+  layer = table.u.tab.value[0];
+  assert(layer.type == TOML_TABLE);
+
+  compression_parse_params(layer, &config);
+  assert(config.mode == COMPRESSION_MODE_APPEND_BLOCK);
+  assert(config.block_size == 4096);
 
   if (config.next_layer) {
     free(config.next_layer);
@@ -269,6 +327,58 @@ void test_block_size_and_mode_parsing() {
   printf("✅ Block size and mode parsing test passed\n");
 }
 
+void test_file_mode_options_parsing() {
+  printf("Testing file mode options parsing...\n");
+
+  const char *toml_str = "[layer_1]\n"
+                         "type = \"compression\"\n"
+                         "next = \"layer_2\"\n"
+                         "algorithm = \"zstd\"\n"
+                         "level = 19\n"
+                         "mode = \"file\"\n"
+                         "[layer_1.options]\n"
+                         "workers = 4\n"
+                         "long_distance = true\n"
+                         "window_log = 27\n";
+
+  toml_result_t result = toml_parse(toml_str, (int)strlen(toml_str));
+  assert(result.ok);
+
+  toml_datum_t layer = result.toptab.u.tab.value[0];
+  assert(layer.type == TOML_TABLE);
+
+  CompressionConfig config;
+  compression_parse_params(layer, &config);
+  assert(config.mode == COMPRESSION_MODE_FILE);
+  assert(config.workers == 4);
+  assert(config.long_distance == 1);
+  assert(config.window_log == 27);
+  free(config.next_layer);
+  toml_free(result);
+
+  // the file mode options are ignored by the block modes
+  toml_str = "[layer_1]\n"
+             "type = \"compression\"\n"
+             "next = \"layer_2\"\n"
+             "algorithm = \"zstd\"\n"
+             "level = 3\n"
+             "mode = \"seekable\"\n"
+             "[layer_1.options]\n"
+             "long_distance = true\n"
+             "window_log = 27\n";
+
+  result = toml_parse(toml_str, (int)strlen(toml_str));
+  assert(result.ok);
+  layer = result.toptab.u.tab.value[0];
+  compression_parse_params(layer, &config);
+  assert(config.long_distance == 0);
+  assert(config.window_log == 0);
+  free(config.next_layer);
+  toml_free(result);
+
+  printf("✅ File mode options parsing test passed\n");
+}
+
 int main() {
   printf("Running compression/config.c tests...\n");
 
@@ -278,6 +388,7 @@ int main() {
   test_invalid_level_panics();
   test_invalid_mode_panics();
   test_block_size_and_mode_parsing();
+  test_file_mode_options_parsing();
 
   printf("🎉 All compression parsing tests passed!\n");
   return 0;
@@ -0,0 +1,363 @@
+#include "../../../../layers/compression/compression.h"
+#include "../../../../layers/compression/compression_utils.h"
+#include "../../../../layers/compression/index_file.h"
+#include "../../../compression_helpers.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TESTDIR "test_index_file_dir"
+#define TESTPATH TESTDIR "/data.bin"
+#define TESTINDEX TESTPATH INDEX_FILE_SUFFIX
+#define BLOCK_SIZE 4096
+#define NUM_BLOCKS 8
+#define FILE_SIZE (NUM_BLOCKS * BLOCK_SIZE - 100)
+
+static LayerContext codec_layer(compression_algorithm_t algorithm,
+                                int bare_blocks) {
+  CompressionConfig config = compression_test_config(BLOCK_SIZE);
+  config.algorithm = algorithm;
+  config.index_file = 1;
+  config.bare_blocks = bare_blocks;
+  return create_compression_test_layer(&config);
+}
+
+static LayerContext sparse_block_layer(int index_file) {
+  CompressionConfig config = compression_test_config(BLOCK_SIZE);
+  config.index_file = index_file;
+  return create_compression_test_layer(&config);
+}
+
+static void write_test_file(const char *expected) {
+  LayerContext l = sparse_block_layer(1);
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, expected, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(l.ops->lclose(fd, l) == 0);
+  compression_destroy(l);
+}
+
+static int count_entries(void *buf, const char *name, const struct stat *stbuf,
+                         off_t off, unsigned int flags) {
+  if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+    (*(int *)buf)++;
+  }
+  return 0;
+}
+
+void test_index_file_reopen() {
+  printf("Testing index file reopen...\n");
+
+  char *expected = malloc(FILE_SIZE);
+  char *buf = malloc(FILE_SIZE);
+  fill_test_text(expected, FILE_SIZE, 0);
+  write_test_file(expected);
+  assert(access(TESTINDEX, F_OK) == 0);
+
+  // a new instance takes the block sizes from the index file
+  LayerContext l = sparse_block_layer(1);
+  int fd = l.ops->lopen(TESTPATH, O_RDONLY, 0, l);
+  assert(fd >= 0);
+  CompressedFileMapping *mapping = compression_test_mapping(fd, l);
+  assert(mapping->index_file_current == 1);
+  assert(mapping->num_blocks == NUM_BLOCKS);
+  assert(mapping->logical_eof == FILE_SIZE);
+  for (int i = 0; i < NUM_BLOCKS; i++) {
+    assert(block_stored_size(mapping, i) > 0 &&
+           block_stored_size(mapping, i) < BLOCK_SIZE);
+  }
+  assert(l.ops->lpread(fd, buf, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(buf, expected, FILE_SIZE) == 0);
+
+  // the listing hides the index file
+  int entries = 0;
+  assert(l.ops->lreaddir(TESTDIR, &entries, count_entries, 0, NULL, 0, l) ==
+         0);
+  assert(entries == 1);
+  assert(l.ops->lclose(fd, l) == 0);
+  compression_destroy(l);
+
+  free(expected);
+  free(buf);
+  printf("✅ Index file reopen passed\n");
+}
+
+// Size of data.bin in a listing with attributes
+static int listed_size(void *buf, const char *name, const struct stat *stbuf,
+                       off_t off, unsigned int flags) {
+  if (strcmp(name, "data.bin") == 0) {
+    assert(flags & LAYER_FILL_DIR_PLUS);
+    *(off_t *)buf = stbuf->st_size;
+  }
+  assert(!index_file_is_index(name));
+  return 0;
+}
+
+void test_index_file_readdir_plus() {
+  printf("Testing listing with logical sizes...\n");
+
+  char *expected = malloc(FILE_SIZE);
+  fill_test_text(expected, FILE_SIZE, 0);
+  write_test_file(expected);
+
+  // a new instance takes the size from the index, then from its table
+  LayerContext l = sparse_block_layer(1);
+  off_t size = 0;
+  assert(l.ops->lreaddir(TESTDIR, &size, listed_size, 0, NULL,
+                         LAYER_READDIR_PLUS, l) == 0);
+  assert(size == FILE_SIZE);
+  int fd = l.ops->lopen(TESTPATH, O_RDWR, 0, l);
+  assert(fd >= 0);
+  assert(l.ops->lftruncate(fd, 100, l) == 0);
+  size = 0;
+  assert(l.ops->lreaddir(TESTDIR, &size, listed_size, 0, NULL,
+                         LAYER_READDIR_PLUS, l) == 0);
+  assert(size == 100);
+  assert(l.ops->lclose(fd, l) == 0);
+  compression_destroy(l);
+
+  free(expected);
+  printf("✅ Listing with logical sizes passed\n");
+}
+
+void test_index_file_stale() {
+  printf("Testing stale index file...\n");
+
+  char *expected = malloc(FILE_SIZE);
+  char *buf = malloc(FILE_SIZE);
+  fill_test_text(expected, FILE_SIZE, 3);
+  write_test_file(expected);
+
+  // a change of mtime outside the layer makes the index stale
+  struct timespec times[2] = {{0, UTIME_OMIT}, {1, 0}};
+  assert(utimensat(AT_FDCWD, TESTPATH, times, 0) == 0);
+
+  LayerContext l = sparse_block_layer(1);
+  int fd = l.ops->lopen(TESTPATH, O_RDONLY, 0, l);
+  assert(fd >= 0);
+  CompressedFileMapping *mapping = compression_test_mapping(fd, l);
+  assert(mapping->index_file_current == 0);
+  assert(mapping->logical_eof == FILE_SIZE);
+
+  // only the last block is scanned on open, the others on first read
+  for (int i = 0; i < NUM_BLOCKS - 1; i++) {
+    assert(block_stored_size(mapping, i) == BLOCK_SIZE_UNKNOWN);
+  }
+  assert(block_stored_size(mapping, NUM_BLOCKS - 1) > 0);
+  assert(l.ops->lpread(fd, buf, BLOCK_SIZE, 2 * BLOCK_SIZE, l) == BLOCK_SIZE);
+  assert(memcmp(buf, expected + 2 * BLOCK_SIZE, BLOCK_SIZE) == 0);
+  assert(block_stored_size(mapping, 2) > 0);
+  assert(block_stored_size(mapping, 1) == BLOCK_SIZE_UNKNOWN);
+  assert(block_stored_size(mapping, 3) == BLOCK_SIZE_UNKNOWN);
+
+  assert(l.ops->lpread(fd, buf, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(buf, expected, FILE_SIZE) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  compression_destroy(l);
+
+  // close wrote the rebuilt index back
+  l = sparse_block_layer(1);
+  fd = l.ops->lopen(TESTPATH, O_RDONLY, 0, l);
+  assert(fd >= 0);
+  assert(compression_test_mapping(fd, l)->index_file_current == 1);
+  assert(l.ops->lclose(fd, l) == 0);
+  compression_destroy(l);
+
+  // a corrupt index is ignored
+  FILE *index = fopen(TESTINDEX, "r+");
+  assert(index);
+  assert(fseek(index, INDEX_FILE_HEADER_SIZE, SEEK_SET) == 0);
+  assert(fputc(0x7f, index) != EOF);
+  assert(fclose(index) == 0);
+  l = sparse_block_layer(1);
+  fd = l.ops->lopen(TESTPATH, O_RDONLY, 0, l);
+  assert(fd >= 0);
+  assert(compression_test_mapping(fd, l)->index_file_current == 0);
+  assert(l.ops->lpread(fd, buf, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(buf, expected, FILE_SIZE) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  compression_destroy(l);
+
+  free(expected);
+  free(buf);
+  printf("✅ Stale index file passed\n");
+}
+
+void test_index_file_lifecycle() {
+  printf("Testing index file lifecycle...\n");
+
+  char *expected = malloc(FILE_SIZE);
+  char *buf = malloc(FILE_SIZE);
+  fill_test_text(expected, FILE_SIZE, 5);
+  write_test_file(expected);
+
+  // the first write after a flush removes the index, fsync writes it again
+  LayerContext l = sparse_block_layer(1);
+  int fd = l.ops->lopen(TESTPATH, O_RDWR, 0, l);
+  assert(fd >= 0);
+  fill_test_text(expected + BLOCK_SIZE, BLOCK_SIZE, 9);
+  assert(l.ops->lpwrite(fd, expected + BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE,
+                        l) == BLOCK_SIZE);
+  assert(access(TESTINDEX, F_OK) != 0);
+  assert(l.ops->lfsync(fd, 0, l) == 0);
+  assert(access(TESTINDEX, F_OK) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+
+  // the index follows renames and unlinks
+  assert(l.ops->lrename(TESTPATH, TESTDIR "/moved.bin", 0, l) == 0);
+  assert(access(TESTINDEX, F_OK) != 0);
+  assert(access(TESTDIR "/moved.bin" INDEX_FILE_SUFFIX, F_OK) == 0);
+  compression_destroy(l);
+
+  l = sparse_block_layer(1);
+  fd = l.ops->lopen(TESTDIR "/moved.bin", O_RDONLY, 0, l);
+  assert(fd >= 0);
+  assert(compression_test_mapping(fd, l)->index_file_current == 1);
+  assert(l.ops->lpread(fd, buf, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(buf, expected, FILE_SIZE) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink(TESTDIR "/moved.bin", l) == 0);
+  assert(access(TESTDIR "/moved.bin" INDEX_FILE_SUFFIX, F_OK) != 0);
+  compression_destroy(l);
+
+  // without the option no index file is written
+  l = sparse_block_layer(0);
+  fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, expected, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(access(TESTINDEX, F_OK) != 0);
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  compression_destroy(l);
+
+  free(expected);
+  free(buf);
+  printf("✅ Index file lifecycle passed\n");
+}
+
+void test_index_file_lstat() {
+  printf("Testing lstat from the index header...\n");
+
+  char *expected = malloc(FILE_SIZE);
+  fill_test_text(expected, FILE_SIZE, 2);
+  write_test_file(expected);
+
+  // a new instance sizes the file without building its mapping
+  LayerContext l = sparse_block_layer(1);
+  struct stat st;
+  assert(l.ops->llstat(TESTPATH, &st, l) == 0);
+  assert(st.st_size == FILE_SIZE);
+  assert(get_compressed_file_mapping(st.st_dev, st.st_ino,
+                                     l.internal_state) == NULL);
+  compression_destroy(l);
+
+  // a header that fails its checksum is ignored, the blocks give the size
+  FILE *index = fopen(TESTINDEX, "r+");
+  assert(index);
+  assert(fseek(index, 24, SEEK_SET) == 0); // logical size
+  assert(fputc(0x01, index) != EOF);
+  assert(fclose(index) == 0);
+  l = sparse_block_layer(1);
+  assert(l.ops->llstat(TESTPATH, &st, l) == 0);
+  assert(st.st_size == FILE_SIZE);
+  assert(get_compressed_file_mapping(st.st_dev, st.st_ino,
+                                     l.internal_state) != NULL);
+  compression_destroy(l);
+
+  free(expected);
+  printf("✅ Lstat from the index header passed\n");
+}
+
+// Stored sizes of a file written from scratch by l
+static void write_with(LayerContext l, const char *data, off_t *sizes) {
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, data, FILE_SIZE, 0, l) == FILE_SIZE);
+  CompressedFileMapping *mapping = compression_test_mapping(fd, l);
+  for (int i = 0; i < NUM_BLOCKS; i++) {
+    sizes[i] = block_stored_size(mapping, i);
+    assert(!block_is_raw(mapping, i));
+  }
+  assert(l.ops->lclose(fd, l) == 0);
+  compression_destroy(l);
+}
+
+// Open with l, check if the index was used and read the whole file
+static void read_with(LayerContext l, const char *expected, char *buf,
+                      int index_used) {
+  int fd = l.ops->lopen(TESTPATH, O_RDWR, 0, l);
+  assert(fd >= 0);
+  CompressedFileMapping *mapping = compression_test_mapping(fd, l);
+  assert(mapping->index_file_current == index_used);
+  assert(mapping->logical_eof == FILE_SIZE);
+  assert(l.ops->lpread(fd, buf, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(buf, expected, FILE_SIZE) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  compression_destroy(l);
+}
+
+static void check_bare_blocks(compression_algorithm_t algorithm) {
+  char *expected = malloc(FILE_SIZE);
+  char *buf = malloc(FILE_SIZE);
+  off_t framed[NUM_BLOCKS], bare[NUM_BLOCKS];
+  fill_test_text(expected, FILE_SIZE, 1);
+
+  write_with(codec_layer(algorithm, 0), expected, framed);
+  write_with(codec_layer(algorithm, 1), expected, bare);
+  for (int i = 0; i < NUM_BLOCKS; i++) {
+    assert(bare[i] > COMPRESSOR_BLOCK_HEADER_SIZE && bare[i] < framed[i]);
+  }
+
+  // the index is only used by a layer writing the same codec, the other
+  // scans the file
+  read_with(codec_layer(algorithm, 1), expected, buf, 1);
+  read_with(codec_layer(algorithm, 0), expected, buf, 0);
+  read_with(codec_layer(algorithm, 1), expected, buf, 0);
+
+  // a frame written into a file of bare blocks reads back with them
+  LayerContext l = codec_layer(algorithm, 0);
+  int fd = l.ops->lopen(TESTPATH, O_RDWR, 0, l);
+  assert(fd >= 0);
+  fill_test_text(expected + BLOCK_SIZE, BLOCK_SIZE, 7);
+  assert(l.ops->lpwrite(fd, expected + BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE,
+                        l) == BLOCK_SIZE);
+  assert(l.ops->lclose(fd, l) == 0);
+  compression_destroy(l);
+  unlink(TESTINDEX);
+  read_with(codec_layer(algorithm, 1), expected, buf, 0);
+
+  printf("  %s: block 0 is %lld bytes bare, %lld framed\n",
+         algorithm == COMPRESSION_LZ4 ? "lz4" : "zstd", (long long)bare[0],
+         (long long)framed[0]);
+  free(expected);
+  free(buf);
+}
+
+void test_index_file_bare_blocks() {
+  printf("Testing bare blocks...\n");
+  check_bare_blocks(COMPRESSION_LZ4);
+  check_bare_blocks(COMPRESSION_ZSTD);
+  printf("✅ Bare blocks passed\n");
+}
+
+int main() {
+  printf("Running compression index file tests...\n\n");
+
+  mkdir(TESTDIR, 0755);
+  test_index_file_reopen();
+  test_index_file_readdir_plus();
+  test_index_file_stale();
+  test_index_file_lifecycle();
+  test_index_file_bare_blocks();
+  test_index_file_lstat();
+  unlink(TESTINDEX);
+  unlink(TESTPATH);
+  rmdir(TESTDIR);
+
+  printf("\nAll compression index file tests passed!\n");
+  return 0;
+}
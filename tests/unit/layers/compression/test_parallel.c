@@ -0,0 +1,201 @@
+#include "../../../../layers/compression/compression.h"
+#include "../../../../layers/compression/compression_utils.h"
+#include "../../../compression_helpers.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SERIAL_PATH "test_parallel_serial.bin"
+#define PARALLEL_PATH "test_parallel.bin"
+#define BLOCK_SIZE (64 * 1024)
+#define NUM_BLOCKS 16
+#define FILE_SIZE (NUM_BLOCKS * BLOCK_SIZE)
+
+static LayerContext sparse_block_layer(int workers) {
+  CompressionConfig config = compression_test_config(BLOCK_SIZE);
+  config.level = 3;
+  config.workers = workers;
+  return create_compression_test_layer(&config);
+}
+
+// Compressible blocks with a few incompressible ones in between
+static void fill_blocks(uint8_t *buf) {
+  srand(11);
+  for (size_t b = 0; b < NUM_BLOCKS; b++) {
+    uint8_t *block = buf + b * BLOCK_SIZE;
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+      block[i] = b % 5 == 3 ? (uint8_t)(rand() >> 7)
+                            : (uint8_t)"parallel sparse block "[(i + b) % 22];
+    }
+  }
+}
+
+static void write_file(LayerContext l, const char *path, const uint8_t *data) {
+  int fd = l.ops->lopen(path, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, data, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(l.ops->lclose(fd, l) == 0);
+}
+
+static uint8_t *read_physical(const char *path, off_t *size) {
+  struct stat st;
+  assert(stat(path, &st) == 0);
+  uint8_t *data = calloc(1, (size_t)st.st_size);
+  int fd = open(path, O_RDONLY);
+  assert(fd >= 0);
+  assert(pread(fd, data, (size_t)st.st_size, 0) == st.st_size);
+  close(fd);
+  *size = st.st_size;
+  return data;
+}
+
+void test_parallel_write_matches_serial() {
+  printf("Testing parallel pwrite matches serial pwrite...\n");
+
+  uint8_t *data = malloc(FILE_SIZE);
+  fill_blocks(data);
+
+  LayerContext serial = sparse_block_layer(0);
+  assert(((CompressionState *)serial.internal_state)->pool == NULL);
+  write_file(serial, SERIAL_PATH, data);
+
+  LayerContext parallel = sparse_block_layer(4);
+  assert(((CompressionState *)parallel.internal_state)->pool != NULL);
+  write_file(parallel, PARALLEL_PATH, data);
+
+  // same blocks in the same slots
+  off_t serial_size, parallel_size;
+  uint8_t *serial_bytes = read_physical(SERIAL_PATH, &serial_size);
+  uint8_t *parallel_bytes = read_physical(PARALLEL_PATH, &parallel_size);
+  assert(serial_size == parallel_size);
+  assert(memcmp(serial_bytes, parallel_bytes, (size_t)serial_size) == 0);
+
+  assert(serial.ops->lunlink(SERIAL_PATH, serial) == 0);
+  compression_destroy(serial);
+  compression_destroy(parallel);
+  free(serial_bytes);
+  free(parallel_bytes);
+  free(data);
+  printf("✅ Parallel pwrite matches serial pwrite passed\n");
+}
+
+void test_parallel_read() {
+  printf("Testing parallel pread...\n");
+
+  uint8_t *expected = malloc(FILE_SIZE);
+  uint8_t *buf = malloc(FILE_SIZE);
+  fill_blocks(expected);
+
+  LayerContext l = sparse_block_layer(4);
+  int fd = l.ops->lopen(PARALLEL_PATH, O_RDONLY, 0, l);
+  assert(fd >= 0);
+  assert(l.ops->lpread(fd, buf, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(buf, expected, FILE_SIZE) == 0);
+
+  // a range of blocks in the middle, and a single block
+  memset(buf, 0, FILE_SIZE);
+  assert(l.ops->lpread(fd, buf, 5 * BLOCK_SIZE, 2 * BLOCK_SIZE, l) ==
+         5 * BLOCK_SIZE);
+  assert(memcmp(buf, expected + 2 * BLOCK_SIZE, 5 * BLOCK_SIZE) == 0);
+  assert(l.ops->lpread(fd, buf, BLOCK_SIZE, 3 * BLOCK_SIZE, l) == BLOCK_SIZE);
+  assert(memcmp(buf, expected + 3 * BLOCK_SIZE, BLOCK_SIZE) == 0);
+
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink(PARALLEL_PATH, l) == 0);
+  compression_destroy(l);
+  free(expected);
+  free(buf);
+  printf("✅ Parallel pread passed\n");
+}
+
+// LayerDigest callback: FNV-1a of the block
+static int fnv_block(const void *data, size_t size, void *digest, void *arg) {
+  (void)arg;
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++) {
+    h = (h ^ ((const uint8_t *)data)[i]) * 1099511628211ULL;
+  }
+  memcpy(digest, &h, sizeof(h));
+  return (int)sizeof(h);
+}
+
+static void expected_digests(const uint8_t *data, size_t len,
+                             size_t block_size, uint64_t *digests) {
+  for (size_t done = 0, i = 0; done < len; done += block_size, i++) {
+    size_t n = len - done < block_size ? len - done : block_size;
+    fnv_block(data + done, n, &digests[i], NULL);
+  }
+}
+
+void test_digests_of_plaintext() {
+  printf("Testing digesting pwrite and pread...\n");
+
+  uint8_t *data = malloc(FILE_SIZE);
+  uint8_t *buf = malloc(FILE_SIZE);
+  uint64_t digests[NUM_BLOCKS * 4];
+  uint64_t expected[NUM_BLOCKS * 4];
+  fill_blocks(data);
+
+  // on the pool and on the calling thread, with the layer's granularity
+  // (hashed with each block) and a finer one (hashed from the buffer)
+  for (int workers = 0; workers <= 4; workers += 4) {
+    LayerContext l = sparse_block_layer(workers);
+    assert(l.ops->lpread_digest && l.ops->lpwrite_digest);
+    const size_t sizes[] = {BLOCK_SIZE, BLOCK_SIZE / 4};
+    for (size_t s = 0; s < 2; s++) {
+      LayerDigest digest = {.block_size = sizes[s],
+                            .digest_size = sizeof(uint64_t),
+                            .hash_block = fnv_block,
+                            .digests = digests};
+      int fd = l.ops->lopen(PARALLEL_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+      assert(fd >= 0);
+      const size_t n_digests = FILE_SIZE / sizes[s];
+      expected_digests(data, FILE_SIZE, sizes[s], expected);
+      memset(digests, 0, sizeof(digests));
+      assert(l.ops->lpwrite_digest(fd, data, FILE_SIZE, 0, &digest, l) ==
+             FILE_SIZE);
+      assert(memcmp(digests, expected, n_digests * sizeof(uint64_t)) == 0);
+
+      memset(digests, 0, sizeof(digests));
+      assert(l.ops->lpread_digest(fd, buf, FILE_SIZE, 0, &digest, l) ==
+             FILE_SIZE);
+      assert(memcmp(buf, data, FILE_SIZE) == 0);
+      assert(memcmp(digests, expected, n_digests * sizeof(uint64_t)) == 0);
+
+      // a hole, and a partial last block past the end of the file
+      assert(l.ops->lftruncate(fd, FILE_SIZE + BLOCK_SIZE / 2, l) == 0);
+      memset(buf, 0xff, FILE_SIZE);
+      memset(digests, 0, sizeof(digests));
+      assert(l.ops->lpread_digest(fd, buf, 2 * BLOCK_SIZE, FILE_SIZE, &digest,
+                                  l) == BLOCK_SIZE / 2);
+      uint8_t zeroes[BLOCK_SIZE / 2] = {0};
+      assert(memcmp(buf, zeroes, sizeof(zeroes)) == 0);
+      expected_digests(zeroes, sizeof(zeroes), sizes[s], expected);
+      assert(memcmp(digests, expected,
+                    BLOCK_SIZE / 2 / sizes[s] * sizeof(uint64_t)) == 0);
+      assert(l.ops->lclose(fd, l) == 0);
+    }
+    assert(l.ops->lunlink(PARALLEL_PATH, l) == 0);
+    compression_destroy(l);
+  }
+
+  free(data);
+  free(buf);
+  printf("✅ Digesting pwrite and pread passed\n");
+}
+
+int main() {
+  printf("Running compression parallel block tests...\n\n");
+
+  test_parallel_write_matches_serial();
+  test_parallel_read();
+  test_digests_of_plaintext();
+
+  printf("\nAll compression parallel block tests passed!\n");
+  return 0;
+}
@@ -0,0 +1,151 @@
+#include "../../../../layers/compression/compression.h"
+#include "../../../../layers/compression/compression_utils.h"
+#include "../../../../layers/compression/policy.h"
+#include "../../../compression_helpers.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TESTPATH "test_policy.bin"
+#define BLOCK_SIZE 4096
+#define LEVEL 5
+
+static LayerContext sparse_block_layer(int adaptive) {
+  CompressionConfig config = compression_test_config(BLOCK_SIZE);
+  config.level = LEVEL;
+  config.adaptive = adaptive;
+  return create_compression_test_layer(&config);
+}
+
+static void fill_random(uint8_t *buf, size_t n, unsigned int seed) {
+  srand(seed);
+  for (size_t i = 0; i < n; i++) {
+    buf[i] = (uint8_t)(rand() >> 7);
+  }
+}
+
+void test_policy_sampling() {
+  printf("Testing policy entropy sampling...\n");
+
+  uint8_t *buf = malloc(BLOCK_SIZE);
+  fill_random(buf, BLOCK_SIZE, 1);
+  assert(policy_looks_incompressible(buf, BLOCK_SIZE) == 1);
+
+  fill_test_text((char *)buf, BLOCK_SIZE, 0);
+  assert(policy_looks_incompressible(buf, BLOCK_SIZE) == 0);
+
+  // records whose high bytes are zero compress, every byte position is sampled
+  uint64_t *records = (uint64_t *)buf;
+  fill_random(buf, BLOCK_SIZE, 2);
+  for (size_t i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++) {
+    records[i] &= 0xffff;
+  }
+  assert(policy_looks_incompressible(buf, BLOCK_SIZE) == 0);
+
+  // too small to tell
+  fill_random(buf, 64, 3);
+  assert(policy_looks_incompressible(buf, 64) == 0);
+
+  free(buf);
+  printf("✅ Policy entropy sampling passed\n");
+}
+
+void test_policy_incompressible_file() {
+  printf("Testing policy on an incompressible file...\n");
+
+  size_t size = 32 * BLOCK_SIZE;
+  uint8_t *expected = malloc(size);
+  uint8_t *buf = malloc(size);
+  fill_random(expected, 16 * BLOCK_SIZE, 4);
+  fill_test_text((char *)expected + 16 * BLOCK_SIZE, 16 * BLOCK_SIZE, 0);
+
+  LayerContext l = sparse_block_layer(1);
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+
+  // random blocks are stored raw, after the streak without compressing
+  assert(l.ops->lpwrite(fd, expected, 16 * BLOCK_SIZE, 0, l) ==
+         16 * BLOCK_SIZE);
+  CompressedFileMapping *mapping = compression_test_mapping(fd, l);
+  for (int i = 0; i < 16; i++) {
+    assert(block_is_raw(mapping, i) == 1);
+  }
+  assert(mapping->policy.raw_streak == 16);
+
+  // compressible blocks are picked up again by the next probe
+  for (int i = 16; i < 32; i++) {
+    assert(l.ops->lpwrite(fd, expected + (size_t)i * BLOCK_SIZE, BLOCK_SIZE,
+                          (off_t)i * BLOCK_SIZE, l) == BLOCK_SIZE);
+  }
+  assert(mapping->policy.raw_streak == 0);
+  assert(block_is_raw(mapping, 31) == 0);
+  assert(block_stored_size(mapping, 31) < BLOCK_SIZE / 4);
+
+  assert(l.ops->lpread(fd, buf, size, 0, l) == (ssize_t)size);
+  assert(memcmp(buf, expected, size) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  compression_destroy(l);
+
+  free(expected);
+  free(buf);
+  printf("✅ Policy on an incompressible file passed\n");
+}
+
+void test_policy_level() {
+  printf("Testing policy level adaptation...\n");
+
+  char text[BLOCK_SIZE];
+  fill_test_text(text, BLOCK_SIZE, 0);
+  int level = 0;
+
+  LayerContext l = sparse_block_layer(1);
+  CompressionState *state = (CompressionState *)l.internal_state;
+  CompressionPolicy policy = {0};
+
+  // poorly compressing blocks lower the level, down to the minimum
+  for (int i = 0; i < 2 * LEVEL; i++) {
+    policy_record(state, &policy, BLOCK_SIZE, BLOCK_SIZE - 100, 1);
+  }
+  assert(policy_should_compress(state, &policy, text, BLOCK_SIZE, &level));
+  assert(level == POLICY_MIN_LEVEL);
+
+  // well compressing blocks raise it back to the configured level
+  for (int i = 0; i < 2 * LEVEL; i++) {
+    policy_record(state, &policy, BLOCK_SIZE, BLOCK_SIZE / 4, 1);
+  }
+  assert(policy_should_compress(state, &policy, text, BLOCK_SIZE, &level));
+  assert(level == LEVEL);
+  assert(policy.raw_streak == 0);
+  compression_destroy(l);
+
+  // without the option every block is compressed at the configured level
+  l = sparse_block_layer(0);
+  state = (CompressionState *)l.internal_state;
+  policy = (CompressionPolicy){0};
+  uint8_t random[BLOCK_SIZE];
+  fill_random(random, BLOCK_SIZE, 5);
+  for (int i = 0; i < 2 * POLICY_RAW_STREAK; i++) {
+    policy_record(state, &policy, BLOCK_SIZE, BLOCK_SIZE, 1);
+  }
+  assert(policy_should_compress(state, &policy, random, BLOCK_SIZE, &level));
+  assert(level == LEVEL);
+  compression_destroy(l);
+
+  printf("✅ Policy level adaptation passed\n");
+}
+
+int main() {
+  printf("Running compression policy tests...\n\n");
+
+  test_policy_sampling();
+  test_policy_incompressible_file();
+  test_policy_level();
+
+  printf("\nAll compression policy tests passed!\n");
+  return 0;
+}
@@ -0,0 +1,243 @@
+#include "../../../../layers/compression/compression.h"
+#include "../../../../layers/compression/compression_utils.h"
+#include "../../../../layers/compression/seekable.h"
+#include "../../../compression_helpers.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TESTPATH "test_seekable.bin"
+#define FRAME_SIZE 4096
+#define FILE_SIZE (10 * FRAME_SIZE + 123)
+
+static LayerContext seekable_layer(compression_algorithm_t algorithm) {
+  CompressionConfig config = compression_test_config(FRAME_SIZE);
+  config.algorithm = algorithm;
+  config.mode = COMPRESSION_MODE_SEEKABLE;
+  return create_compression_test_layer(&config);
+}
+
+static off_t physical_size() {
+  struct stat st;
+  assert(stat(TESTPATH, &st) == 0);
+  return st.st_size;
+}
+
+static void check_random_access(compression_algorithm_t algorithm) {
+  LayerContext l = seekable_layer(algorithm);
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+
+  char *expected = calloc(1, FILE_SIZE);
+  char *buf = malloc(FILE_SIZE);
+  fill_test_text(expected, FILE_SIZE, 0);
+  assert(l.ops->lpwrite(fd, expected, FILE_SIZE, 0, l) == FILE_SIZE);
+
+  CompressedFileMapping *mapping = compression_test_mapping(fd, l);
+  assert(mapping->num_blocks == 11);
+  off_t offsets[11], sizes[11];
+  memcpy(offsets, mapping->offsets, sizeof(offsets));
+  for (size_t i = 0; i < 11; i++) {
+    sizes[i] = block_stored_size(mapping, i);
+  }
+  assert(mapping->data_end < FILE_SIZE);
+
+  // an unaligned write spanning two frames only rewrites those two
+  fill_test_text(expected + 3 * FRAME_SIZE + 100, FRAME_SIZE, 7);
+  assert(l.ops->lpwrite(fd, expected + 3 * FRAME_SIZE + 100, FRAME_SIZE,
+                        3 * FRAME_SIZE + 100, l) == FRAME_SIZE);
+  for (int i = 0; i < 11; i++) {
+    if (i != 3 && i != 4) {
+      assert(mapping->offsets[i] == offsets[i]);
+      assert(block_stored_size(mapping, i) == sizes[i]);
+    }
+  }
+
+  // incompressible data is stored raw, after the last frame
+  for (int i = 0; i < FRAME_SIZE; i++) {
+    expected[6 * FRAME_SIZE + i] = (char)(rand() & 0xff);
+  }
+  assert(l.ops->lpwrite(fd, expected + 6 * FRAME_SIZE, FRAME_SIZE,
+                        6 * FRAME_SIZE, l) == FRAME_SIZE);
+  assert(block_is_raw(mapping, 6) == 1);
+  assert(mapping->offsets[6] >= offsets[10] + sizes[10]);
+
+  // a read across frames, and a read ending past EOF
+  assert(l.ops->lpread(fd, buf, 3 * FRAME_SIZE, 2 * FRAME_SIZE + 50, l) ==
+         3 * FRAME_SIZE);
+  assert(memcmp(buf, expected + 2 * FRAME_SIZE + 50, 3 * FRAME_SIZE) == 0);
+  assert(l.ops->lpread(fd, buf, FRAME_SIZE, FILE_SIZE - 23, l) == 23);
+  assert(memcmp(buf, expected + FILE_SIZE - 23, 23) == 0);
+  assert(l.ops->lpread(fd, buf, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(buf, expected, FILE_SIZE) == 0);
+
+  // a write past EOF leaves a hole that reads as zeros
+  assert(l.ops->lpwrite(fd, "tail", 4, 14 * FRAME_SIZE, l) == 4);
+  assert(block_stored_size(mapping, 12) == 0);
+  assert(block_stored_size(mapping, 13) == 0);
+  char zeros[FRAME_SIZE] = {0};
+  assert(l.ops->lpread(fd, buf, FRAME_SIZE, 12 * FRAME_SIZE, l) ==
+         FRAME_SIZE);
+  assert(memcmp(buf, zeros, FRAME_SIZE) == 0);
+  assert(l.ops->lpread(fd, buf, FRAME_SIZE, FILE_SIZE, l) == FRAME_SIZE);
+  assert(memcmp(buf, zeros, FRAME_SIZE) == 0);
+
+  struct stat st;
+  assert(l.ops->lfstat(fd, &st, l) == 0);
+  assert(st.st_size == 14 * FRAME_SIZE + 4);
+
+  assert(l.ops->lclose(fd, l) == 0);
+  unlink(TESTPATH);
+  free(expected);
+  free(buf);
+  compression_destroy(l);
+}
+
+void test_seekable_random_access() {
+  printf("Testing seekable random access...\n");
+  check_random_access(COMPRESSION_ZSTD);
+  check_random_access(COMPRESSION_LZ4);
+  printf("✅ Seekable random access passed\n");
+}
+
+void test_seekable_reopen() {
+  printf("Testing seekable seek table persistence...\n");
+
+  char *expected = malloc(FILE_SIZE);
+  char *buf = malloc(FILE_SIZE);
+  fill_test_text(expected, FILE_SIZE, 3);
+
+  LayerContext l = seekable_layer(COMPRESSION_ZSTD);
+  int fd = l.ops->lopen(TESTPATH, O_WRONLY | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, expected, FILE_SIZE, 0, l) == FILE_SIZE);
+  // a partial frame write through a write-only descriptor
+  memcpy(expected + 5000, "patched", 7);
+  assert(l.ops->lpwrite(fd, "patched", 7, 5000, l) == 7);
+  assert(l.ops->lfsync(fd, 0, l) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  compression_destroy(l);
+
+  // a new instance reads the table back, before and after open
+  l = seekable_layer(COMPRESSION_ZSTD);
+  struct stat st;
+  assert(l.ops->llstat(TESTPATH, &st, l) == 0);
+  assert(st.st_size == FILE_SIZE);
+  fd = l.ops->lopen(TESTPATH, O_RDONLY, 0, l);
+  assert(fd >= 0);
+  assert(l.ops->lpread(fd, buf, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(buf, expected, FILE_SIZE) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  compression_destroy(l);
+
+  // a file written with another frame size is refused
+  CompressionConfig config = compression_test_config(2 * FRAME_SIZE);
+  config.mode = COMPRESSION_MODE_SEEKABLE;
+  l = create_compression_test_layer(&config);
+  assert(l.ops->lopen(TESTPATH, O_RDONLY, 0, l) < 0);
+  compression_destroy(l);
+
+  unlink(TESTPATH);
+  free(expected);
+  free(buf);
+  printf("✅ Seekable seek table persistence passed\n");
+}
+
+void test_seekable_truncate() {
+  printf("Testing seekable truncate...\n");
+
+  char *expected = calloc(1, FILE_SIZE);
+  char *buf = malloc(FILE_SIZE);
+  fill_test_text(expected, FILE_SIZE, 5);
+
+  LayerContext l = seekable_layer(COMPRESSION_LZ4);
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, expected, FILE_SIZE, 0, l) == FILE_SIZE);
+
+  // shrinking inside a frame, then growing back reads zeros
+  off_t cut = 4 * FRAME_SIZE + 10;
+  assert(l.ops->lftruncate(fd, cut, l) == 0);
+  memset(expected + cut, 0, FILE_SIZE - cut);
+  assert(compression_test_mapping(fd, l)->num_blocks == 5);
+  assert(l.ops->lftruncate(fd, FILE_SIZE, l) == 0);
+  assert(l.ops->lpread(fd, buf, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(buf, expected, FILE_SIZE) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+
+  // truncate by path persists the table
+  assert(l.ops->ltruncate(TESTPATH, 100, l) == 0);
+  compression_destroy(l);
+  l = seekable_layer(COMPRESSION_LZ4);
+  struct stat st;
+  assert(l.ops->llstat(TESTPATH, &st, l) == 0);
+  assert(st.st_size == 100);
+  fd = l.ops->lopen(TESTPATH, O_RDWR, 0, l);
+  assert(l.ops->lpread(fd, buf, FILE_SIZE, 0, l) == 100);
+  assert(memcmp(buf, expected, 100) == 0);
+
+  // an empty file has no seek table
+  assert(l.ops->lftruncate(fd, 0, l) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(physical_size() == 0);
+
+  unlink(TESTPATH);
+  compression_destroy(l);
+  free(expected);
+  free(buf);
+  printf("✅ Seekable truncate passed\n");
+}
+
+void test_seekable_compaction() {
+  printf("Testing seekable compaction...\n");
+
+  size_t size = 512 * FRAME_SIZE;
+  char *data = malloc(size);
+  char *buf = malloc(size);
+  for (size_t i = 0; i < size; i++) {
+    data[i] = (char)(rand() & 0xff);
+  }
+
+  LayerContext l = seekable_layer(COMPRESSION_LZ4);
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, data, size, 0, l) == (ssize_t)size);
+  assert(l.ops->lfsync(fd, 0, l) == 0);
+  off_t before = physical_size();
+
+  // compressible frames fit in place, the rest of their slot is garbage
+  size_t rewritten = 384 * FRAME_SIZE;
+  fill_test_text(data, rewritten, 1);
+  assert(l.ops->lpwrite(fd, data, rewritten, 0, l) == (ssize_t)rewritten);
+  CompressedFileMapping *mapping = compression_test_mapping(fd, l);
+  assert(mapping->garbage > mapping->data_end / 2);
+  assert(l.ops->lfsync(fd, 0, l) == 0);
+  assert(mapping->garbage == 0);
+  assert(physical_size() < before / 2);
+
+  assert(l.ops->lpread(fd, buf, size, 0, l) == (ssize_t)size);
+  assert(memcmp(buf, data, size) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+
+  unlink(TESTPATH);
+  compression_destroy(l);
+  free(data);
+  free(buf);
+  printf("✅ Seekable compaction passed\n");
+}
+
+int main() {
+  printf("Running compression seekable tests...\n\n");
+
+  test_seekable_random_access();
+  test_seekable_reopen();
+  test_seekable_truncate();
+  test_seekable_compaction();
+
+  printf("\nAll compression seekable tests passed!\n");
+  return 0;
+}
@@ -132,11 +132,12 @@ void test_compression_sparse_block_pwrite_single_block() {
   assert(mock_state.pwrite_input_nbyte <= expected_compressed_size);
   assert(mock_state.pwrite_called == 1);
 
-  CompressedFileMapping *block_index = state->file_mapping;
+  CompressedFileMapping *block_index =
+      get_compressed_file_mapping(test_dev, test_ino, state);
   assert(block_index != NULL);
   assert(block_index->num_blocks == 1);
-  assert(block_index->sizes[0] > 0);
-  assert(block_index->sizes[0] < config.block_size); // Compressed
+  assert(block_stored_size(block_index, 0) > 0);
+  assert(block_stored_size(block_index, 0) < config.block_size); // Compressed
 
   compression_destroy(layer);
   printf("✅ compression sparse block pwrite single block test passed\n");
@@ -180,19 +181,20 @@ void test_compression_sparse_block_pwrite_multiple_sequential_blocks() {
 
   free(block);
 
-  CompressedFileMapping *block_index = state->file_mapping;
+  CompressedFileMapping *block_index =
+      get_compressed_file_mapping(test_dev, test_ino, state);
   assert(block_index != NULL);
   assert(block_index->num_blocks == 3);
 
   // Verify all blocks have compressed sizes stored
-  assert(block_index->sizes[0] > 0);
-  assert(block_index->sizes[1] > 0);
-  assert(block_index->sizes[2] > 0);
+  assert(block_stored_size(block_index, 0) > 0);
+  assert(block_stored_size(block_index, 1) > 0);
+  assert(block_stored_size(block_index, 2) > 0);
 
   // All should be compressed
-  assert(block_index->sizes[0] < config.block_size);
-  assert(block_index->sizes[1] < config.block_size);
-  assert(block_index->sizes[2] < config.block_size);
+  assert(block_stored_size(block_index, 0) < config.block_size);
+  assert(block_stored_size(block_index, 1) < config.block_size);
+  assert(block_stored_size(block_index, 2) < config.block_size);
 
   compression_destroy(layer);
   printf("✅ compression sparse block pwrite multiple sequential blocks test "
@@ -223,8 +225,9 @@ void test_compression_sparse_block_pwrite_overwrite_existing_block() {
       layer.ops->lpwrite(fd, block1, config.block_size, 0, layer);
   assert(bytes_written == config.block_size);
 
-  CompressedFileMapping *block_index = state->file_mapping;
-  off_t first_size = block_index->sizes[0];
+  CompressedFileMapping *block_index =
+      get_compressed_file_mapping(test_dev, test_ino, state);
+  off_t first_size = block_stored_size(block_index, 0);
   assert(first_size > 0);
 
   // Create different data
@@ -236,7 +239,7 @@ void test_compression_sparse_block_pwrite_overwrite_existing_block() {
   assert(bytes_written == config.block_size);
 
   // Size should be updated (might be different if compression varies)
-  assert(block_index->sizes[0] > 0);
+  assert(block_stored_size(block_index, 0) > 0);
   assert(block_index->num_blocks == 1);
 
   free(block1);
@@ -335,31 +338,31 @@ void test_compression_sparse_block_is_uncompressed_flag() {
   assert(bytes_written == config.block_size);
 
   // Verify the block index
-  CompressedFileMapping *block_index = state->file_mapping;
+  CompressedFileMapping *block_index =
+      get_compressed_file_mapping(test_dev, test_ino, state);
   ;
   assert(block_index != NULL);
   assert(block_index->num_blocks == 1);
 
   // Debug output
   printf("  Block 0: size=%ld, is_uncompressed=%d, block_size=%zu\n",
-         (long)block_index->sizes[0],
-         block_index->is_uncompressed ? (int)block_index->is_uncompressed[0]
-                                      : -1,
+         (long)block_stored_size(block_index, 0),
+         block_is_raw(block_index, 0),
          (size_t)config.block_size);
 
   // Verify is_uncompressed flag exists and matches the size
-  assert(block_index->is_uncompressed != NULL);
+  assert(block_index->chunks != NULL);
 
   // The flag should be 1 if size equals block_size (stored uncompressed)
   // and 0 if size < block_size (stored compressed)
-  if (block_index->sizes[0] == (off_t)config.block_size) {
-    assert(block_index->is_uncompressed[0] == 1);
+  if (block_stored_size(block_index, 0) == (off_t)config.block_size) {
+    assert(block_is_raw(block_index, 0) == 1);
     printf(
         "  ✓ Data stored uncompressed (as expected for high-entropy data)\n");
   } else {
-    assert(block_index->is_uncompressed[0] == 0);
+    assert(block_is_raw(block_index, 0) == 0);
     printf("  ✓ Data stored compressed (compressed from %zu to %ld bytes)\n",
-           (size_t)config.block_size, (long)block_index->sizes[0]);
+           (size_t)config.block_size, (long)block_stored_size(block_index, 0));
   }
 
   free(uncompressable_block);
@@ -369,6 +372,116 @@ void test_compression_sparse_block_is_uncompressed_flag() {
 
 //========Pread tests=========
 
+void test_compression_sparse_block_pwrite_stores_zero_blocks_as_holes() {
+  printf("Testing compression sparse block pwrite stores zero blocks as "
+         "holes...\n");
+
+  setup_mock_layer();
+
+  LayerContext layer = compression_init(&mock_layer, &config);
+  CompressionState *state = (CompressionState *)layer.internal_state;
+
+  mock_state.stat_lower_layer_stat.st_size = 0;
+  mock_state.stat_lower_layer_stat.st_dev = test_dev;
+  mock_state.stat_lower_layer_stat.st_ino = test_ino;
+  int fd = layer.ops->lopen("test.txt", O_CREAT | O_RDWR, 0666, layer);
+  assert(fd != -1);
+
+  // A block of text and two of zeros: the last block keeps its payload, it
+  // gives the logical EOF when the index is rebuilt from storage
+  size_t size = (size_t)3 * config.block_size;
+  char *data = calloc(1, size);
+  char *text = make_repeated_block(test_data, config.block_size);
+  memcpy(data, text, config.block_size);
+
+  int writes_before = mock_state.pwrite_called;
+  assert(layer.ops->lpwrite(fd, data, size, 0, layer) == (ssize_t)size);
+  assert(mock_state.pwrite_called == writes_before + 2);
+
+  CompressedFileMapping *block_index =
+      get_compressed_file_mapping(test_dev, test_ino, state);
+  assert(block_stored_size(block_index, 0) > 0);
+  assert(block_stored_size(block_index, 1) == 0);
+  assert(block_stored_size(block_index, 2) > 0);
+
+  // The hole reads as zeros without the next layer
+  char *read_buffer = malloc(config.block_size);
+  memset(read_buffer, 0xff, config.block_size);
+  int reads_before = mock_state.pread_called;
+  assert(layer.ops->lpread(fd, read_buffer, config.block_size,
+                           (off_t)config.block_size,
+                           layer) == (ssize_t)config.block_size);
+  assert(mock_state.pread_called == reads_before);
+  assert(memcmp(read_buffer, data + config.block_size, config.block_size) ==
+         0);
+
+  // Without free_space the payload of a block can't be punched, zeros
+  // written over it are stored
+  assert(layer.ops->lpwrite(fd, text, config.block_size,
+                            (off_t)config.block_size,
+                            layer) == (ssize_t)config.block_size);
+  assert(layer.ops->lpwrite(fd, data + config.block_size, config.block_size,
+                            (off_t)config.block_size,
+                            layer) == (ssize_t)config.block_size);
+  assert(block_stored_size(block_index, 1) > 0);
+
+  free(data);
+  free(text);
+  free(read_buffer);
+  compression_destroy(layer);
+  printf("✅ compression sparse block pwrite stores zero blocks as holes test "
+         "passed\n");
+}
+
+void test_compression_sparse_block_pwrite_punches_zero_blocks() {
+  printf("Testing compression sparse block pwrite punches zero blocks...\n");
+
+  setup_mock_layer();
+  // the mock reads its counters from the context it is passed
+  enable_mock_fallocate(&mock_layer);
+
+  CompressionConfig punch_config = config;
+  punch_config.free_space = 1;
+  LayerContext layer = compression_init(&mock_layer, &punch_config);
+  CompressionState *state = (CompressionState *)layer.internal_state;
+
+  mock_state.stat_lower_layer_stat.st_size = 0;
+  mock_state.stat_lower_layer_stat.st_dev = test_dev;
+  mock_state.stat_lower_layer_stat.st_ino = test_ino;
+  int fd = layer.ops->lopen("test.txt", O_CREAT | O_RDWR, 0666, layer);
+  assert(fd != -1);
+
+  char *text = make_repeated_block(test_data, config.block_size);
+  for (int i = 0; i < 3; i++) {
+    assert(layer.ops->lpwrite(fd, text, config.block_size,
+                              (off_t)i * config.block_size,
+                              layer) == (ssize_t)config.block_size);
+  }
+  CompressedFileMapping *block_index =
+      get_compressed_file_mapping(test_dev, test_ino, state);
+  off_t old_stored_size = block_stored_size(block_index, 1);
+  assert(old_stored_size > 0);
+
+  // Zeros over the payload of block 1 punch all of it, nothing is written
+  char *zeros = calloc(1, config.block_size);
+  int writes_before = mock_state.pwrite_called;
+  int punches_before = mock_state.fallocate_called;
+  assert(layer.ops->lpwrite(fd, zeros, config.block_size,
+                            (off_t)config.block_size,
+                            layer) == (ssize_t)config.block_size);
+  assert(mock_state.pwrite_called == writes_before);
+  assert(mock_state.fallocate_called == punches_before + 1);
+  assert(mock_state.last_fallocate_input_offset == (off_t)config.block_size);
+  assert(mock_state.last_fallocate_input_length == old_stored_size);
+  assert(block_stored_size(block_index, 1) == 0);
+
+  free(text);
+  free(zeros);
+  compression_destroy(layer);
+  printf("✅ compression sparse block pwrite punches zero blocks test "
+         "passed\n");
+}
+
 void test_compression_sparse_block_pread_returns_0_with_nbyte_0() {
   printf("Testing compression sparse block pread returns 0 with nbyte 0...\n");
   setup_mock_layer();
@@ -602,18 +715,19 @@ void test_compression_sparse_block_pread_uncompressed_data() {
   assert(mock_state.pwrite_data_storage != NULL);
 
   // Verify the block is stored uncompressed
-  CompressedFileMapping *block_index = state->file_mapping;
+  CompressedFileMapping *block_index =
+      get_compressed_file_mapping(test_dev, test_ino, state);
   ;
   assert(block_index != NULL);
   assert(block_index->num_blocks == 1);
-  assert(block_index->is_uncompressed != NULL);
+  assert(block_index->chunks != NULL);
 
   // If data was stored uncompressed (size == block_size), verify the flag
   bool is_stored_uncompressed =
-      (block_index->sizes[0] == (off_t)config.block_size);
+      (block_stored_size(block_index, 0) == (off_t)config.block_size);
   if (is_stored_uncompressed) {
-    assert(block_index->is_uncompressed[0] == 1);
-    printf("  ✓ Data confirmed stored uncompressed (is_uncompressed[0] = 1)\n");
+    assert(block_is_raw(block_index, 0) == 1);
+    printf("  ✓ Data confirmed stored uncompressed (block 0 is raw)\n");
   } else {
     printf("  ⚠ Data was compressed despite high entropy (skipping "
            "uncompressed read test)\n");
@@ -649,6 +763,73 @@ void test_compression_sparse_block_pread_uncompressed_data() {
   printf("✅ compression sparse block pread uncompressed data test passed\n");
 }
 
+void test_compression_sparse_block_pwrite_batches_contiguous_blocks() {
+  printf("Testing compression sparse block pwrite batches contiguous "
+         "blocks...\n");
+
+  setup_mock_layer();
+  enable_mock_pwrite_data_storage(&mock_state);
+
+  CompressionConfig parallel_config = config;
+  parallel_config.workers = 4;
+  LayerContext layer = compression_init(&mock_layer, &parallel_config);
+  CompressionState *state = (CompressionState *)layer.internal_state;
+  assert(state->pool != NULL);
+
+  mock_state.stat_lower_layer_stat.st_size = 0;
+  mock_state.stat_lower_layer_stat.st_dev = test_dev;
+  mock_state.stat_lower_layer_stat.st_ino = test_ino;
+  int fd = layer.ops->lopen("test.txt", O_CREAT | O_RDWR, 0666, layer);
+  assert(fd != -1);
+
+  // 4 incompressible blocks fill their slots, the compressible one after them
+  // is written along with them
+  size_t size = (size_t)5 * config.block_size;
+  char *data = malloc(size);
+  srand(7);
+  for (size_t i = 0; i < 4 * (size_t)config.block_size; i++) {
+    data[i] = (char)(rand() >> 7);
+  }
+  char *text = make_repeated_block(test_data, config.block_size);
+  memcpy(data + 4 * (size_t)config.block_size, text, config.block_size);
+
+  int writes_before = mock_state.pwrite_called;
+  assert(layer.ops->lpwrite(fd, data, size, 0, layer) == (ssize_t)size);
+  assert(mock_state.pwrite_called == writes_before + 1);
+
+  CompressedFileMapping *block_index =
+      get_compressed_file_mapping(test_dev, test_ino, state);
+  for (int i = 0; i < 4; i++) {
+    assert(block_is_raw(block_index, i) == 1);
+  }
+  assert(block_stored_size(block_index, 4) < config.block_size);
+  assert(mock_state.pwrite_input_nbyte ==
+         4 * (size_t)config.block_size +
+             (size_t)block_stored_size(block_index, 4));
+
+  mock_state.mock_pread_data = mock_state.pwrite_data_storage;
+  mock_state.mock_pread_data_size = mock_state.pwrite_data_storage_size;
+  char *read_buffer = malloc(size);
+  assert(layer.ops->lpread(fd, read_buffer, size, 0, layer) == (ssize_t)size);
+  assert(memcmp(read_buffer, data, size) == 0);
+
+  // compressed blocks leave holes, each one is written on its own
+  writes_before = mock_state.pwrite_called;
+  memcpy(data, text, config.block_size);
+  memcpy(data + config.block_size, text, config.block_size);
+  assert(layer.ops->lpwrite(fd, data, 2 * (size_t)config.block_size, 0,
+                            layer) == 2 * (ssize_t)config.block_size);
+  assert(mock_state.pwrite_called == writes_before + 2);
+
+  free(data);
+  free(text);
+  free(read_buffer);
+  free_mock_pwrite_data_storage(&mock_state);
+  compression_destroy(layer);
+  printf("✅ compression sparse block pwrite batches contiguous blocks test "
+         "passed\n");
+}
+
 // ===== ftruncate tests =====
 void test_compression_sparse_block_ftruncate_extend_beyond_size() {
   printf("Testing ftruncate extends logical size beyond current size...\n");
@@ -757,7 +938,8 @@ void test_compression_sparse_block_ftruncate_truncate_exact_block_boundary() {
   assert(logical == target);
 
   // block index should report 2 blocks now
-  CompressedFileMapping *bim = state->file_mapping;
+  CompressedFileMapping *bim =
+      get_compressed_file_mapping(test_dev, test_ino, state);
   assert(bim != NULL);
   assert(bim->num_blocks == 2);
 
@@ -791,7 +973,8 @@ void test_compression_sparse_block_ftruncate_truncate_mid_block() {
   // After writes, prepare mock file data that matches the physical layout.
   // Block 0 is at offset 0 (compressed), block 1 is at offset block_size
   // (compressed).
-  CompressedFileMapping *bim_init = state->file_mapping;
+  CompressedFileMapping *bim_init =
+      get_compressed_file_mapping(test_dev, test_ino, state);
   assert(bim_init != NULL);
   assert(bim_init->num_blocks == 2);
 
@@ -807,7 +990,7 @@ void test_compression_sparse_block_ftruncate_truncate_mid_block() {
   assert(comp_size > 0);
 
   // Build a mock file with space for both blocks
-  size_t block1_size = (size_t)bim_init->sizes[1];
+  size_t block1_size = (size_t)block_stored_size(bim_init, 1);
   size_t keep = (size_t)config.block_size / 2;
   // After truncation, we'll need space for at least 'keep' bytes if stored
   // uncompressed
@@ -836,11 +1019,12 @@ void test_compression_sparse_block_ftruncate_truncate_mid_block() {
   assert(logical == target);
 
   // last block size in mapping should be <= keep
-  CompressedFileMapping *bim = state->file_mapping;
+  CompressedFileMapping *bim =
+      get_compressed_file_mapping(test_dev, test_ino, state);
   assert(bim != NULL);
   assert(bim->num_blocks == 2);
-  assert(bim->sizes[1] > 0);
-  assert((size_t)bim->sizes[1] <= keep);
+  assert(block_stored_size(bim, 1) > 0);
+  assert((size_t)block_stored_size(bim, 1) <= keep);
 
   free(file);
   free(block);
@@ -859,6 +1043,9 @@ int main() {
   test_compression_sparse_block_pwrite_overwrite_existing_block();
   test_compression_sparse_block_original_size_updates_only_on_append();
   test_compression_sparse_block_is_uncompressed_flag();
+  test_compression_sparse_block_pwrite_batches_contiguous_blocks();
+  test_compression_sparse_block_pwrite_stores_zero_blocks_as_holes();
+  test_compression_sparse_block_pwrite_punches_zero_blocks();
 
   test_compression_sparse_block_pread_returns_0_with_nbyte_0();
   test_compression_sparse_block_reads_empty_file_buffer_untouched();
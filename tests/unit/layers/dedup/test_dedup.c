@@ -0,0 +1,306 @@
+#define _GNU_SOURCE
+#include "../../../../layers/anti_tampering/anti_tampering.h"
+#include "../../../../layers/dedup/dedup.h"
+#include "../../../../layers/memory/memory.h"
+#include "../../../../shared/utils/metrics.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define BLOCK_SIZE 4096
+
+static int mismatches(unsigned long long n) {
+  size_t len;
+  char *text = metrics_render(&len);
+  char line[128];
+  snprintf(line, sizeof(line), "tg_anti_tampering_mismatches_total %llu\n",
+           n);
+  int found = text && (n == 0 ? !strstr(text, "tg_anti_tampering_mismatches")
+                              : strstr(text, line) != NULL);
+  free(text);
+  return found;
+}
+
+static LayerContext dedup_over(LayerContext *next) {
+  DedupConfig config = {.block_store = "/store",
+                        .block_size = BLOCK_SIZE,
+                        .algorithm = HASH_SHA256};
+  LayerContext l = dedup_init(next, &config);
+  assert(l.ops);
+  return l;
+}
+
+static uint64_t live_slots(LayerContext l) {
+  DedupState *state = (DedupState *)l.internal_state;
+  return state->nslots - state->nfree;
+}
+
+// blocks[i] of 'A' + pattern[i], '0' for a block of zeros
+static char *make_blocks(const char *pattern) {
+  size_t n = strlen(pattern);
+  char *data = malloc(n * BLOCK_SIZE);
+  for (size_t i = 0; i < n; i++) {
+    memset(data + i * BLOCK_SIZE, pattern[i] == '0' ? 0 : pattern[i],
+           BLOCK_SIZE);
+  }
+  return data;
+}
+
+static void write_file(LayerContext l, const char *path, const void *data,
+                       size_t size) {
+  int fd = l.ops->lopen(path, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, data, size, 0, l) == (ssize_t)size);
+  assert(l.ops->lclose(fd, l) == 0);
+}
+
+static void check_file(LayerContext l, const char *path, const void *data,
+                       size_t size) {
+  char *buf = malloc(size + 16);
+  int fd = l.ops->lopen(path, O_RDONLY, 0, l);
+  assert(fd >= 0);
+  assert(l.ops->lpread(fd, buf, size + 16, 0, l) == (ssize_t)size);
+  assert(memcmp(buf, data, size) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  free(buf);
+}
+
+void test_dedup_shared_blocks() {
+  printf("Testing dedup of the blocks of files...\n");
+
+  LayerContext memory = memory_init();
+  LayerContext l = dedup_over(&memory);
+
+  // a block of zeros is a hole, a repeated block is stored once
+  char *data = make_blocks("ABA0C");
+  write_file(l, "/f", data, 5 * BLOCK_SIZE);
+  assert(live_slots(l) == 3);
+  check_file(l, "/f", data, 5 * BLOCK_SIZE);
+
+  // another file of the same blocks takes references only
+  write_file(l, "/g", data, 5 * BLOCK_SIZE - 100);
+  assert(live_slots(l) == 4); // its cut last block is new
+  struct stat st;
+  assert(l.ops->llstat("/g", &st, l) == 0);
+  assert(st.st_size == 5 * BLOCK_SIZE - 100);
+  check_file(l, "/g", data, 5 * BLOCK_SIZE - 100);
+
+  // rewriting a block moves its reference
+  int fd = l.ops->lopen("/f", O_RDWR, 0, l);
+  assert(l.ops->lpwrite(fd, data + 2 * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE,
+                        l) == BLOCK_SIZE);
+  assert(l.ops->lfstat(fd, &st, l) == 0 && st.st_size == 5 * BLOCK_SIZE);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(live_slots(l) == 4); // B is still used by /g
+
+  // the blocks of removed files are freed with their last reference
+  assert(l.ops->lrename("/g", "/f", 0, l) == 0);
+  assert(l.ops->llstat("/g", &st, l) == -1);
+  check_file(l, "/f", data, 5 * BLOCK_SIZE - 100);
+  assert(live_slots(l) == 3);
+  assert(l.ops->lunlink("/f", l) == 0);
+  assert(live_slots(l) == 0);
+
+  free(data);
+  l.ops->ldestroy(l);
+  memory.ops->ldestroy(memory);
+  printf("✅ Dedup of the blocks of files passed\n");
+}
+
+void test_dedup_partial_writes() {
+  printf("Testing dedup partial writes and truncates...\n");
+
+  LayerContext memory = memory_init();
+  LayerContext l = dedup_over(&memory);
+  char *expected = calloc(1, 4 * BLOCK_SIZE);
+
+  int fd = l.ops->lopen("/f", O_RDWR | O_CREAT, 0644, l);
+  // unaligned, over two blocks, past a hole
+  memset(expected + BLOCK_SIZE + 1000, 'x', 5000);
+  assert(l.ops->lpwrite(fd, expected + BLOCK_SIZE + 1000, 5000,
+                        BLOCK_SIZE + 1000, l) == 5000);
+  memset(expected + BLOCK_SIZE + 10, 'y', 20);
+  assert(l.ops->lpwrite(fd, expected + BLOCK_SIZE + 10, 20, BLOCK_SIZE + 10,
+                        l) == 20);
+  char buf[4 * BLOCK_SIZE];
+  assert(l.ops->lpread(fd, buf, sizeof(buf), 0, l) == BLOCK_SIZE + 6000);
+  assert(memcmp(buf, expected, BLOCK_SIZE + 6000) == 0);
+  assert(l.ops->lpread(fd, buf, 30, BLOCK_SIZE + 5, l) == 30);
+  assert(memcmp(buf, expected + BLOCK_SIZE + 5, 30) == 0);
+
+  // a cut block shows zeros once the file grows again
+  assert(l.ops->lftruncate(fd, BLOCK_SIZE + 1500, l) == 0);
+  assert(l.ops->lftruncate(fd, 3 * BLOCK_SIZE, l) == 0);
+  memset(expected + BLOCK_SIZE + 1500, 0, 2 * BLOCK_SIZE - 1500);
+  assert(l.ops->lpread(fd, buf, sizeof(buf), 0, l) == 3 * BLOCK_SIZE);
+  assert(memcmp(buf, expected, 3 * BLOCK_SIZE) == 0);
+  assert(live_slots(l) == 1);
+  assert(l.ops->lclose(fd, l) == 0);
+
+  // O_TRUNC releases the blocks
+  fd = l.ops->lopen("/f", O_WRONLY | O_TRUNC, 0, l);
+  assert(fd >= 0);
+  assert(live_slots(l) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+
+  // an unlinked file keeps its blocks until it is closed
+  write_file(l, "/g", expected, 2 * BLOCK_SIZE);
+  fd = l.ops->lopen("/g", O_RDONLY, 0, l);
+  assert(l.ops->lunlink("/g", l) == 0);
+  assert(live_slots(l) == 1);
+  assert(l.ops->lpread(fd, buf, sizeof(buf), 0, l) == 2 * BLOCK_SIZE);
+  assert(memcmp(buf, expected, 2 * BLOCK_SIZE) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(live_slots(l) == 0);
+
+  free(expected);
+  l.ops->ldestroy(l);
+  memory.ops->ldestroy(memory);
+  printf("✅ Dedup partial writes and truncates passed\n");
+}
+
+void test_dedup_persistence() {
+  printf("Testing dedup block store reload...\n");
+
+  LayerContext memory = memory_init();
+  LayerContext l = dedup_over(&memory);
+  char *data = make_blocks("ABAB");
+  write_file(l, "/f", data, 4 * BLOCK_SIZE);
+  write_file(l, "/g", data, 2 * BLOCK_SIZE);
+  assert(l.ops->lunlink("/g", l) == 0);
+  write_file(l, "/h", data + BLOCK_SIZE, BLOCK_SIZE);
+  l.ops->ldestroy(l);
+
+  // the slots and their references come back from the index
+  l = dedup_over(&memory);
+  assert(live_slots(l) == 2);
+  check_file(l, "/f", data, 4 * BLOCK_SIZE);
+  check_file(l, "/h", data + BLOCK_SIZE, BLOCK_SIZE);
+  write_file(l, "/i", data, BLOCK_SIZE);
+  assert(live_slots(l) == 2);
+  assert(l.ops->lunlink("/f", l) == 0);
+  assert(l.ops->lunlink("/h", l) == 0);
+  assert(live_slots(l) == 1);
+
+  free(data);
+  l.ops->ldestroy(l);
+  memory.ops->ldestroy(memory);
+  printf("✅ Dedup block store reload passed\n");
+}
+
+static int hash_calls = 0;
+
+static int counting_hash_block(const void *data, size_t size, void *digest,
+                               void *arg) {
+  const Hasher *hasher = arg;
+  hash_calls++;
+  return hasher->hash_buffer_binary(data, size, digest,
+                                    hasher->get_hash_size());
+}
+
+void test_dedup_shared_digests() {
+  printf("Testing dedup digests shared with the caller...\n");
+
+  LayerContext memory = memory_init();
+  LayerContext l = dedup_over(&memory);
+  Hasher hasher;
+  assert(hasher_init(&hasher, HASH_SHA256) == 0);
+  unsigned char digests[4 * 32];
+  LayerDigest digest = {.block_size = BLOCK_SIZE,
+                        .digest_size = 32,
+                        .hash_block = counting_hash_block,
+                        .arg = &hasher,
+                        .digests = digests};
+  assert(l.ops->lpwrite_digest);
+
+  // whole blocks are hashed once for both layers
+  char *data = make_blocks("AB0C");
+  int fd = l.ops->lopen("/f", O_RDWR | O_CREAT, 0644, l);
+  assert(l.ops->lpwrite_digest(fd, data, 4 * BLOCK_SIZE - 10, 0, &digest,
+                               l) == 4 * BLOCK_SIZE - 10);
+  assert(hash_calls == 4);
+  for (size_t i = 0; i < 4; i++) {
+    unsigned char expected[32];
+    size_t n = i < 3 ? BLOCK_SIZE : BLOCK_SIZE - 10;
+    assert(hasher.hash_buffer_binary(data + i * BLOCK_SIZE, n, expected,
+                                     32) >= 0);
+    assert(memcmp(digests + i * 32, expected, 32) == 0);
+  }
+
+  // the caller gets the digests of its bytes, not of the merged block
+  hash_calls = 0;
+  assert(l.ops->lpwrite_digest(fd, data, 100, BLOCK_SIZE, &digest, l) ==
+         100);
+  assert(hash_calls == 2);
+  unsigned char expected[32];
+  assert(hasher.hash_buffer_binary(data, 100, expected, 32) >= 0);
+  assert(memcmp(digests, expected, 32) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+
+  free(data);
+  l.ops->ldestroy(l);
+  memory.ops->ldestroy(memory);
+  printf("✅ Dedup digests shared with the caller passed\n");
+}
+
+void test_dedup_under_block_anti_tampering() {
+  printf("Testing dedup as the data layer of block anti_tampering...\n");
+
+  LayerContext memory = memory_init();
+  LayerContext data_layer = dedup_over(&memory);
+  LayerContext hash_layer = memory_init();
+  AntiTamperingConfig cfg = {
+      .hashes_storage = "/hashes",
+      .algorithm = HASH_SHA256,
+      .mode = ANTI_TAMPERING_MODE_BLOCK,
+      .block_size = BLOCK_SIZE,
+  };
+  LayerContext ctx = anti_tampering_init(data_layer, hash_layer, &cfg);
+
+  char *data = make_blocks("ABAB");
+  int fd = ctx.ops->lopen("/f", O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lpwrite(fd, data, 4 * BLOCK_SIZE, 0, ctx) ==
+         4 * BLOCK_SIZE);
+  assert(live_slots(data_layer) == 2);
+  char buf[4 * BLOCK_SIZE];
+  assert(ctx.ops->lpread(fd, buf, sizeof(buf), 0, ctx) == 4 * BLOCK_SIZE);
+  assert(memcmp(buf, data, sizeof(buf)) == 0);
+
+  // a block changed in the block store is a mismatch in every file using it
+  int blocks = memory.ops->lopen("/store/blocks", O_RDWR, 0, memory);
+  assert(memory.ops->lpwrite(blocks, "X", 1, 0, memory) == 1);
+  assert(memory.ops->lclose(blocks, memory) == 0);
+  assert(mismatches(0));
+  assert(ctx.ops->lpread(fd, buf, BLOCK_SIZE, BLOCK_SIZE, ctx) ==
+         BLOCK_SIZE);
+  assert(mismatches(0));
+  assert(ctx.ops->lpread(fd, buf, BLOCK_SIZE, 2 * BLOCK_SIZE, ctx) ==
+         BLOCK_SIZE);
+  assert(mismatches(1));
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  free(data);
+  anti_tampering_destroy(ctx);
+  data_layer.ops->ldestroy(data_layer);
+  hash_layer.ops->ldestroy(hash_layer);
+  memory.ops->ldestroy(memory);
+  printf("✅ Dedup as the data layer of block anti_tampering passed\n");
+}
+
+int main() {
+  printf("Running dedup layer tests...\n\n");
+
+  test_dedup_shared_blocks();
+  test_dedup_partial_writes();
+  test_dedup_persistence();
+  test_dedup_shared_digests();
+  test_dedup_under_block_anti_tampering();
+
+  printf("\nAll dedup layer tests passed!\n");
+  return 0;
+}
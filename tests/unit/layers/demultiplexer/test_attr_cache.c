@@ -0,0 +1,104 @@
+#include "../../../../layers/demultiplexer/attr_cache.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static struct stat make_stat(ino_t inode, off_t size) {
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  st.st_ino = inode;
+  st.st_size = size;
+  st.st_mode = S_IFREG;
+  return st;
+}
+
+void test_attr_cache_lookup_and_invalidate() {
+  printf("Testing attribute cache lookup and invalidation...\n");
+
+  assert(attr_cache_init(0, 1000) == NULL);
+  assert(attr_cache_init(4, 0) == NULL);
+  AttrCache *cache = attr_cache_init(4, 1000);
+  assert(cache != NULL);
+
+  struct stat st = make_stat(10, 100);
+  struct stat out;
+  assert(attr_cache_lookup(cache, "/a", &out) == 0);
+  attr_cache_insert(cache, "/a", &st);
+  assert(attr_cache_lookup(cache, "/a", &out) == 1);
+  assert(out.st_ino == 10 && out.st_size == 100);
+
+  // inserting again replaces the attributes
+  st.st_size = 200;
+  attr_cache_insert(cache, "/a", &st);
+  assert(attr_cache_lookup(cache, "/a", &out) == 1);
+  assert(out.st_size == 200);
+  assert(cache->n_entries == 1);
+
+  attr_cache_invalidate(cache, "/a");
+  assert(attr_cache_lookup(cache, "/a", &out) == 0);
+  assert(cache->n_entries == 0);
+  assert(cache->hits == 2);
+  assert(cache->misses == 2);
+
+  // NULL caches and paths are no-ops
+  attr_cache_insert(NULL, "/a", &st);
+  attr_cache_invalidate(NULL, "/a");
+  assert(attr_cache_lookup(NULL, "/a", &out) == 0);
+  assert(attr_cache_lookup(cache, NULL, &out) == 0);
+
+  attr_cache_destroy(cache);
+  printf("✅ Attribute cache lookup and invalidation passed\n");
+}
+
+void test_attr_cache_ttl() {
+  printf("Testing attribute cache expiry...\n");
+
+  AttrCache *cache = attr_cache_init(4, 50);
+  assert(cache != NULL);
+
+  struct stat st = make_stat(10, 100);
+  struct stat out;
+  attr_cache_insert(cache, "/a", &st);
+  assert(attr_cache_lookup(cache, "/a", &out) == 1);
+  usleep(80 * 1000);
+  assert(attr_cache_lookup(cache, "/a", &out) == 0);
+  assert(cache->n_entries == 0);
+
+  attr_cache_destroy(cache);
+  printf("✅ Attribute cache expiry passed\n");
+}
+
+void test_attr_cache_lru_eviction() {
+  printf("Testing attribute cache LRU eviction...\n");
+
+  AttrCache *cache = attr_cache_init(2, 1000);
+  assert(cache != NULL);
+
+  struct stat st = make_stat(10, 100);
+  struct stat out;
+  attr_cache_insert(cache, "/a", &st);
+  attr_cache_insert(cache, "/b", &st);
+  // a hit makes /a the most recently used, /b is evicted
+  assert(attr_cache_lookup(cache, "/a", &out) == 1);
+  attr_cache_insert(cache, "/c", &st);
+  assert(cache->n_entries == 2);
+  assert(attr_cache_lookup(cache, "/b", &out) == 0);
+  assert(attr_cache_lookup(cache, "/a", &out) == 1);
+  assert(attr_cache_lookup(cache, "/c", &out) == 1);
+
+  attr_cache_destroy(cache);
+  printf("✅ Attribute cache LRU eviction passed\n");
+}
+
+int main() {
+  printf("Running attribute cache tests...\n\n");
+
+  test_attr_cache_lookup_and_invalidate();
+  test_attr_cache_ttl();
+  test_attr_cache_lru_eviction();
+
+  printf("\nAll attribute cache tests passed!\n");
+  return 0;
+}
@@ -1,7 +1,9 @@
 #include "../../../../layers/demultiplexer/demultiplexer.h"
+#include "../../../../layers/demultiplexer/passthrough_ops.h"
 #include "../../../mock_layer.h"
 #include <assert.h>
 #include <errno.h> // Required for errno testing
+#include <fcntl.h>
 #include <stdio.h>
 #include <sys/wait.h> // Required for waitpid, WIFEXITED, WEXITSTATUS
 #include <unistd.h>   // Required for unlink and fork
@@ -10,6 +12,13 @@
 static MockLayerState mock_states[3]; // For 3 layers
 static LayerContext mock_layers[3];
 
+// Layer fds of a master fd, simulating a previous open call
+static int *layer_fds_of(DemultiplexerState *state, int fd) {
+  DemultiplexerFd *master = fd_table_slot(&state->fds, fd);
+  assert(master != NULL);
+  return master->layer_fds;
+}
+
 void setup_test() {
   // Initialize mock layers
   for (int i = 0; i < 3; i++) {
@@ -28,13 +37,14 @@ void test_demultiplexer_ftruncate_success() {
   int passthrough_writes[] = {0, 0, 0}; // No passthrough writes
   int enforced_layers[] = {1, 1, 1};    // All layers enforced
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
 
   // Set up file descriptor mappings (simulate previous open calls)
   DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
-  state->layer_fds[5][0] = 10; // Master FD 5 maps to layer 0 FD 10
-  state->layer_fds[5][1] = 11; // Master FD 5 maps to layer 1 FD 11
-  state->layer_fds[5][2] = 12; // Master FD 5 maps to layer 2 FD 12
+  layer_fds_of(state, 5)[0] = 10; // Master FD 5 maps to layer 0 FD 10
+  layer_fds_of(state, 5)[1] = 11; // Master FD 5 maps to layer 1 FD 11
+  layer_fds_of(state, 5)[2] = 12; // Master FD 5 maps to layer 2 FD 12
 
   // Set mock return values
   mock_states[0].ftruncate_return_value = 0; // Success
@@ -70,15 +80,18 @@ void test_demultiplexer_ftruncate_invalid_fd() {
   int passthrough_writes[] = {0, 0, 0}; // No passthrough writes
   int enforced_layers[] = {1, 1, 1};    // All layers enforced
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
 
   // Test negative FD
   int result = demultiplexer_ftruncate(-1, 512, demux);
   assert(result == -1);
 
-  // Test FD >= MAX_FDS
+  // Test an FD never opened, and FD >= FD_TABLE_MAX_FDS
   result = demultiplexer_ftruncate(1000000, 512, demux);
   assert(result == -1);
+  result = demultiplexer_ftruncate(FD_TABLE_MAX_FDS, 512, demux);
+  assert(result == -1);
 
   // Verify no mock calls were made
   assert(mock_states[0].ftruncate_called == 0);
@@ -99,13 +112,14 @@ void test_demultiplexer_ftruncate_layer_errors() {
   int passthrough_writes[] = {0, 0, 0}; // No passthrough writes
   int enforced_layers[] = {1, 1, 1};    // All layers enforced
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
 
   // Set up file descriptor mappings
   DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
-  state->layer_fds[5][0] = 10;
-  state->layer_fds[5][1] = 11;
-  state->layer_fds[5][2] = 12;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
 
   // Test case 1: First layer fails
   mock_states[0].ftruncate_return_value = -1; // First layer fails
@@ -117,9 +131,9 @@ void test_demultiplexer_ftruncate_layer_errors() {
 
   // Reset and test case 2: Second layer fails
   setup_test();
-  state->layer_fds[5][0] = 10;
-  state->layer_fds[5][1] = 11;
-  state->layer_fds[5][2] = 12;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
 
   mock_states[0].ftruncate_return_value = 0;  // First layer succeeds
   mock_states[1].ftruncate_return_value = -1; // Second layer fails
@@ -142,13 +156,14 @@ void test_demultiplexer_ftruncate_different_lengths() {
   int passthrough_writes[] = {0, 0, 0}; // No passthrough writes
   int enforced_layers[] = {1, 1, 1};    // All layers enforced
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
 
   // Set up file descriptor mappings
   DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
-  state->layer_fds[5][0] = 10;
-  state->layer_fds[5][1] = 11;
-  state->layer_fds[5][2] = 12;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
 
   // Test with zero length
   int result = demultiplexer_ftruncate(5, 0, demux);
@@ -159,9 +174,9 @@ void test_demultiplexer_ftruncate_different_lengths() {
 
   // Reset and test with large length
   setup_test();
-  state->layer_fds[5][0] = 10;
-  state->layer_fds[5][1] = 11;
-  state->layer_fds[5][2] = 12;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
 
   result = demultiplexer_ftruncate(5, (off_t)(1024 * 1024), demux);
   assert(result == 0);
@@ -184,10 +199,11 @@ void test_demultiplexer_ftruncate_single_layer() {
   int passthrough_writes[] = {0}; // No passthrough writes
   int enforced_layers[] = {1};    // Single layer enforced
   LayerContext demux = demultiplexer_init(mock_layers, 1, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
 
   DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
-  state->layer_fds[5][0] = 10;
+  layer_fds_of(state, 5)[0] = 10;
 
   int result = demultiplexer_ftruncate(5, 256, demux);
   assert(result == 0);
@@ -213,18 +229,19 @@ void test_demultiplexer_ftruncate_multiple_fds() {
   int passthrough_writes[] = {0, 0, 0}; // No passthrough writes
   int enforced_layers[] = {1, 1, 1};    // All layers enforced
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
 
   DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
 
   // Set up mappings for two different FDs
-  state->layer_fds[5][0] = 10;
-  state->layer_fds[5][1] = 11;
-  state->layer_fds[5][2] = 12;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
 
-  state->layer_fds[7][0] = 20;
-  state->layer_fds[7][1] = 21;
-  state->layer_fds[7][2] = 22;
+  layer_fds_of(state, 7)[0] = 20;
+  layer_fds_of(state, 7)[1] = 21;
+  layer_fds_of(state, 7)[2] = 22;
 
   // Call ftruncate on first FD
   int result1 = demultiplexer_ftruncate(5, 512, demux);
@@ -232,12 +249,12 @@ void test_demultiplexer_ftruncate_multiple_fds() {
 
   // Reset mock states
   setup_test();
-  state->layer_fds[5][0] = 10;
-  state->layer_fds[5][1] = 11;
-  state->layer_fds[5][2] = 12;
-  state->layer_fds[7][0] = 20;
-  state->layer_fds[7][1] = 21;
-  state->layer_fds[7][2] = 22;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
+  layer_fds_of(state, 7)[0] = 20;
+  layer_fds_of(state, 7)[1] = 21;
+  layer_fds_of(state, 7)[2] = 22;
 
   // Call ftruncate on second FD
   int result2 = demultiplexer_ftruncate(7, 1024, demux);
@@ -265,11 +282,12 @@ void test_demultiplexer_passthrough_reads() {
   int passthrough_writes[] = {0, 0}; // No passthrough writes
   int enforced_layers[] = {0, 0};    // Both layers enforced
   LayerContext demux = demultiplexer_init(mock_layers, 2, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
 
   DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
-  state->layer_fds[5][0] = 10; // Mock layer FD
-  state->layer_fds[5][1] = 11; // Local layer FD
+  layer_fds_of(state, 5)[0] = 10; // Mock layer FD
+  layer_fds_of(state, 5)[1] = 11; // Local layer FD
 
   mock_states[0].mock_pread_data = "test_data";
   mock_states[0].mock_pread_data_size = 10;
@@ -304,7 +322,7 @@ void test_demultiplexer_init_invalid_both_passthrough() {
   if (pid == 0) {
     // Child process - this should exit with code 1
     demultiplexer_init(mock_layers, 3, passthrough_reads, passthrough_writes,
-                       enforced_layers);
+                       enforced_layers, NULL);
     exit(0); // Should not reach here
   } else if (pid > 0) {
     // Parent process - wait for child and check exit status
@@ -335,7 +353,7 @@ void test_demultiplexer_init_invalid_all_passthrough_reads() {
   if (pid == 0) {
     // Child process - this should exit with code 1
     demultiplexer_init(mock_layers, 3, passthrough_reads, passthrough_writes,
-                       enforced_layers);
+                       enforced_layers, NULL);
     exit(0); // Should not reach here
   } else if (pid > 0) {
     // Parent process - wait for child and check exit status
@@ -364,7 +382,7 @@ void test_demultiplexer_init_invalid_passthrough_and_enforced() {
   if (pid == 0) {
     // Child process - this should exit with code 1
     demultiplexer_init(mock_layers, 3, passthrough_reads, passthrough_writes,
-                       enforced_layers);
+                       enforced_layers, NULL);
     exit(0); // Should not reach here
   } else if (pid > 0) {
     // Parent process - wait for child and check exit status
@@ -395,7 +413,7 @@ void test_demultiplexer_init_invalid_all_passthrough_writes() {
   if (pid == 0) {
     // Child process - this should exit with code 1
     demultiplexer_init(mock_layers, 3, passthrough_reads, passthrough_writes,
-                       enforced_layers);
+                       enforced_layers, NULL);
     exit(0); // Should not reach here
   } else if (pid > 0) {
     // Parent process - wait for child and check exit status
@@ -419,12 +437,13 @@ void test_demultiplexer_pread_success_with_no_enforced() {
   int passthrough_writes[] = {0, 0, 0}; // No passthrough writes
   int enforced_layers[] = {0, 0, 0};    // No enforced layers
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
 
   DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
-  state->layer_fds[5][0] = 10;
-  state->layer_fds[5][1] = 11;
-  state->layer_fds[5][2] = 12;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
 
   mock_states[0].mock_pread_data = "test_data";
   mock_states[0].mock_pread_data_size = 10;
@@ -447,6 +466,1010 @@ void test_demultiplexer_pread_success_with_no_enforced() {
       "✅ demultiplexer_pread success with no enforced layers test passed\n");
 }
 
+static ssize_t failing_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                             LayerContext l) {
+  MockLayerState *state = (MockLayerState *)l.internal_state;
+  state->pread_called++;
+  errno = EIO;
+  return -1;
+}
+
+void test_demultiplexer_pread_preferred_fallback() {
+  printf("Testing demultiplexer_pread with the preferred read policy...\n");
+
+  setup_test();
+
+  int passthrough_reads[] = {0, 0, 0};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {0, 1, 0}; // Layer 1 is read first
+  DemultiplexerConfig config = {.read_policy = DEMULTIPLEXER_READ_PREFERRED};
+  LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
+                                          passthrough_writes, enforced_layers,
+                                          &config);
+
+  DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
+  assert(state->n_read_layers == 3);
+  assert(state->read_order[0] == 1);
+  assert(state->read_order[1] == 0);
+  assert(state->read_order[2] == 2);
+
+  mock_states[0].mock_pread_data = "layer_0_";
+  mock_states[0].mock_pread_data_size = 8;
+  mock_states[1].mock_pread_data = "layer_1_";
+  mock_states[1].mock_pread_data_size = 8;
+  mock_states[2].mock_pread_data = "layer_2_";
+  mock_states[2].mock_pread_data_size = 8;
+
+  // only the first layer in read order is read
+  char test_buffer[8];
+  ssize_t read_result =
+      demux.ops->lpread(5, test_buffer, sizeof(test_buffer), 0, demux);
+  assert(read_result == 8);
+  assert(memcmp(test_buffer, "layer_1_", 8) == 0);
+  assert(mock_states[0].pread_called == 0);
+  assert(mock_states[1].pread_called == 1);
+  assert(mock_states[2].pread_called == 0);
+
+  // a failing layer falls back to the next one
+  mock_layers[1].ops->lpread = failing_pread;
+  read_result =
+      demux.ops->lpread(5, test_buffer, sizeof(test_buffer), 0, demux);
+  assert(read_result == 8);
+  assert(memcmp(test_buffer, "layer_0_", 8) == 0);
+  assert(mock_states[1].pread_called == 2);
+  assert(mock_states[0].pread_called == 1);
+
+  // layers without a file descriptor are skipped, all failing is an error
+  mock_layers[0].ops->lpread = failing_pread;
+  layer_fds_of(state, 5)[2] = INVALID_FD;
+  read_result =
+      demux.ops->lpread(5, test_buffer, sizeof(test_buffer), 0, demux);
+  assert(read_result == -1);
+  assert(mock_states[2].pread_called == 0);
+
+  printf("✅ demultiplexer_pread preferred read policy test passed\n");
+
+  demultiplexer_destroy(demux);
+}
+
+static int async_pwrites = 0;
+
+static int mock_pwrite_async(int fd, const void *buffer, size_t nbyte,
+                             off_t offset, LayerIoCallback callback, void *ctx,
+                             LayerContext l) {
+  __atomic_fetch_add(&async_pwrites, 1, __ATOMIC_RELAXED);
+  callback(l.ops->lpwrite(fd, buffer, nbyte, offset, l), ctx);
+  return 0;
+}
+
+static int mock_pread_async(int fd, void *buffer, size_t nbyte, off_t offset,
+                            LayerIoCallback callback, void *ctx,
+                            LayerContext l) {
+  callback(l.ops->lpread(fd, buffer, nbyte, offset, l), ctx);
+  return 0;
+}
+
+void test_demultiplexer_pwrite_async_layers() {
+  printf("Testing demultiplexer pwrite through async layers...\n");
+
+  setup_test();
+  for (int i = 0; i < 3; i++) {
+    mock_layers[i].ops->lpwrite_async = mock_pwrite_async;
+    mock_layers[i].ops->lpread_async = mock_pread_async;
+  }
+
+  int passthrough_reads[] = {0, 0, 0};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {1, 1, 1};
+  LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
+  DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
+  for (int i = 0; i < 3; i++) {
+    layer_fds_of(state, 5)[i] = 10 + i;
+  }
+
+  // every layer is asynchronous, the write is queued on each of them
+  async_pwrites = 0;
+  assert(demux.ops->lpwrite(5, "data", 4, 0, demux) == 4);
+  assert(async_pwrites == 3);
+  for (int i = 0; i < 3; i++) {
+    assert(mock_states[i].pwrite_called == 1);
+  }
+
+  // a synchronous layer sends the write back to the worker pool
+  mock_layers[2].ops->lpwrite_async = NULL;
+  assert(demux.ops->lpwrite(5, "data", 4, 0, demux) == 4);
+  assert(async_pwrites == 3);
+  for (int i = 0; i < 3; i++) {
+    assert(mock_states[i].pwrite_called == 2);
+  }
+
+  printf("✅ demultiplexer pwrite through async layers test passed\n");
+
+  demultiplexer_destroy(demux);
+}
+
+void test_demultiplexer_vectored_io() {
+  printf("Testing demultiplexer preadv/pwritev...\n");
+
+  setup_test();
+
+  int passthrough_reads[] = {0, 0, 0};
+  int passthrough_writes[] = {0, 0, 1};
+  int enforced_layers[] = {1, 1, 0};
+  DemultiplexerConfig config = {.read_policy = DEMULTIPLEXER_READ_PREFERRED};
+  LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
+                                          passthrough_writes, enforced_layers,
+                                          &config);
+  assert(mock_layers[2].ops->lpwritev == passthrough_pwritev);
+
+  DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
+  for (int i = 0; i < 3; i++) {
+    layer_fds_of(state, 5)[i] = 10 + i;
+    enable_mock_pwrite_data_storage(&mock_states[i]);
+  }
+
+  // every layer storing writes gets the buffers in one call
+  struct iovec out[] = {{"layer_", 6}, {"data", 4}};
+  assert(demux.ops->lpwritev(5, out, 2, 0, demux) == 10);
+  for (int i = 0; i < 2; i++) {
+    assert(mock_states[i].pwrite_called == 1);
+    assert(mock_states[i].pwrite_data_storage_size == 10);
+    assert(memcmp(mock_states[i].pwrite_data_storage, "layer_data", 10) == 0);
+  }
+  assert(mock_states[2].pwrite_called == 0);
+
+  mock_states[0].mock_pread_data = "layer_0_";
+  mock_states[0].mock_pread_data_size = 8;
+  mock_states[1].mock_pread_data = "layer_1_";
+  mock_states[1].mock_pread_data_size = 8;
+
+  // preferred reads go to the first layer in read order only
+  char a[6], b[2];
+  struct iovec in[] = {{a, sizeof(a)}, {b, sizeof(b)}};
+  assert(demux.ops->lpreadv(5, in, 2, 0, demux) == 8);
+  assert(memcmp(a, "layer_", 6) == 0 && memcmp(b, "0_", 2) == 0);
+  assert(mock_states[0].pread_called == 1);
+  assert(mock_states[1].pread_called == 0);
+
+  // the other policies read into a scratch buffer and scatter it
+  state->read_policy = DEMULTIPLEXER_READ_ALL;
+  memset(a, 0, sizeof(a));
+  memset(b, 0, sizeof(b));
+  assert(demux.ops->lpreadv(5, in, 2, 0, demux) == 8);
+  assert(memcmp(a, "layer_", 6) == 0 && memcmp(b, "0_", 2) == 0);
+  assert(mock_states[0].pread_called == 2);
+  assert(mock_states[1].pread_called == 1);
+
+  for (int i = 0; i < 3; i++) {
+    free_mock_pwrite_data_storage(&mock_states[i]);
+  }
+
+  printf("✅ demultiplexer preadv/pwritev test passed\n");
+
+  demultiplexer_destroy(demux);
+}
+
+void test_demultiplexer_pread_all_reuses_scratch_buffers() {
+  printf("Testing demultiplexer_pread reads the first layer in place...\n");
+
+  setup_test();
+
+  int passthrough_reads[] = {0, 0, 1};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {1, 1, 0};
+  LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
+
+  DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
+
+  mock_states[0].mock_pread_data = "test_data";
+  mock_states[0].mock_pread_data_size = 10;
+  mock_states[1].mock_pread_data = "other_dat";
+  mock_states[1].mock_pread_data_size = 10;
+
+  char test_buffer[10];
+  for (int round = 0; round < 3; round++) {
+    ssize_t read_result =
+        demux.ops->lpread(5, test_buffer, sizeof(test_buffer), 0, demux);
+    assert(read_result == 10);
+    assert(memcmp(test_buffer, "test_data", 10) == 0);
+  }
+  assert(mock_states[0].pread_called == 3);
+  assert(mock_states[1].pread_called == 3);
+  assert(mock_states[2].pread_called == 0); // passthrough reads skipped
+
+  // one scratch buffer (layer 1), allocated once and then reused
+  assert(state->scratch->misses == 1);
+  assert(state->scratch->hits == 2);
+
+  // end of file is a successful empty read
+  assert(demux.ops->lpread(5, test_buffer, sizeof(test_buffer), 100, demux) ==
+         0);
+
+  // an enforced layer failing fails the read
+  mock_layers[1].ops->lpread = failing_pread;
+  assert(demux.ops->lpread(5, test_buffer, sizeof(test_buffer), 0, demux) ==
+         -1);
+
+  printf("✅ demultiplexer_pread first layer in place test passed\n");
+
+  demultiplexer_destroy(demux);
+}
+
+// Stored digest of each mock layer's 8 byte blocks
+static const char *mock_digests[3];
+static int getdigest_called[3];
+
+static ssize_t mock_getdigest(int fd, off_t offset, size_t nbyte,
+                              LayerStoredDigests *digests, LayerContext l) {
+  int layer = (int)((MockLayerState *)l.internal_state - mock_states);
+  getdigest_called[layer]++;
+  digests->algorithm = 1;
+  digests->block_size = 8;
+  digests->digest_size = 4;
+  digests->first_block = (size_t)offset / 8;
+  size_t count = nbyte == 0 ? 0
+                            : ((size_t)offset + nbyte - 1) / 8 -
+                                  digests->first_block + 1;
+  if (digests->capacity < count * 4) {
+    errno = ERANGE;
+    return -1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    memcpy((char *)digests->digests + i * 4, mock_digests[layer], 4);
+  }
+  return (ssize_t)count;
+}
+
+static ssize_t unsupported_getdigest(int fd, off_t offset, size_t nbyte,
+                                     LayerStoredDigests *digests,
+                                     LayerContext l) {
+  errno = ENOTSUP;
+  return -1;
+}
+
+void test_demultiplexer_pread_verify_replicas() {
+  printf("Testing demultiplexer_pread with verify_replicas...\n");
+
+  setup_test();
+
+  // layers 0 and 1 are compared by digest, layer 2 by its data
+  memset(getdigest_called, 0, sizeof(getdigest_called));
+  mock_digests[0] = "abcd";
+  mock_digests[1] = "abcd";
+  mock_layers[0].ops->lgetdigest = mock_getdigest;
+  mock_layers[1].ops->lgetdigest = mock_getdigest;
+
+  int passthrough_reads[] = {0, 0, 0};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {1, 1, 0};
+  DemultiplexerConfig config = {.read_policy = DEMULTIPLEXER_READ_ALL,
+                                .verify_replicas = true};
+  LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
+                                          passthrough_writes, enforced_layers,
+                                          &config);
+
+  DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
+  for (int i = 0; i < 3; i++) {
+    layer_fds_of(state, 5)[i] = 10 + i;
+    mock_states[i].mock_pread_data = "test_data";
+    mock_states[i].mock_pread_data_size = 10;
+  }
+
+  char buffer[10];
+  assert(demux.ops->lpread(5, buffer, sizeof(buffer), 0, demux) == 10);
+  assert(memcmp(buffer, "test_data", 10) == 0);
+  assert(state->replica_mismatches == 0);
+  assert(mock_states[0].pread_called == 1);
+  assert(mock_states[1].pread_called == 0); // its digests were enough
+  assert(mock_states[2].pread_called == 1);
+  assert(getdigest_called[0] == 1 && getdigest_called[1] == 1);
+
+  // a layer whose digests differ is counted, the primary's data returned
+  mock_digests[1] = "abce";
+  assert(demux.ops->lpread(5, buffer, sizeof(buffer), 0, demux) == 10);
+  assert(memcmp(buffer, "test_data", 10) == 0);
+  assert(state->replica_mismatches == 1);
+  mock_digests[1] = "abcd";
+
+  // a layer without digests is compared by its data
+  mock_states[2].mock_pread_data = "other_dat";
+  assert(demux.ops->lpread(5, buffer, sizeof(buffer), 0, demux) == 10);
+  assert(memcmp(buffer, "test_data", 10) == 0);
+  assert(state->replica_mismatches == 2);
+  mock_states[2].mock_pread_data = "test_data";
+
+  // digests that cannot be fetched fall back to reading the data
+  mock_layers[1].ops->lgetdigest = unsupported_getdigest;
+  assert(demux.ops->lpread(5, buffer, sizeof(buffer), 0, demux) == 10);
+  assert(mock_states[1].pread_called == 1);
+  assert(state->replica_mismatches == 2);
+
+  printf("✅ demultiplexer_pread with verify_replicas test passed\n");
+
+  mock_layers[0].ops->lgetdigest = NULL;
+  mock_layers[1].ops->lgetdigest = NULL;
+  demultiplexer_destroy(demux);
+}
+
+void test_demultiplexer_init_invalid_verify_replicas() {
+  printf("Testing demultiplexer_init with verify_replicas and another read "
+         "policy...\n");
+
+  setup_test();
+
+  int passthrough_reads[] = {0, 0, 0};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {0, 0, 0};
+  DemultiplexerConfig config = {.read_policy = DEMULTIPLEXER_READ_PREFERRED,
+                                .verify_replicas = true};
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    demultiplexer_init(mock_layers, 3, passthrough_reads, passthrough_writes,
+                       enforced_layers, &config);
+    exit(0); // Should not reach here
+  } else if (pid > 0) {
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+    printf("✅ demultiplexer_init correctly failed for verify_replicas with "
+           "the preferred policy\n");
+  } else {
+    assert(0 && "Fork failed");
+  }
+}
+
+void test_demultiplexer_pread_fastest_order() {
+  printf("Testing demultiplexer_pread with the fastest read policy...\n");
+
+  setup_test();
+
+  int passthrough_reads[] = {0, 0, 0};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {1, 0, 0};
+  DemultiplexerConfig config = {.read_policy = DEMULTIPLEXER_READ_FASTEST};
+  LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
+                                          passthrough_writes, enforced_layers,
+                                          &config);
+
+  DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
+
+  mock_states[0].mock_pread_data = "layer_0_";
+  mock_states[0].mock_pread_data_size = 8;
+  mock_states[1].mock_pread_data = "layer_1_";
+  mock_states[1].mock_pread_data_size = 8;
+  mock_states[2].mock_pread_data = "layer_2_";
+  mock_states[2].mock_pread_data_size = 8;
+
+  // the layer with the lowest latency is read, whatever the read order
+  state->latency[0].ewma_ns = 5000000;
+  state->latency[1].ewma_ns = 1000000;
+  state->latency[2].ewma_ns = 3000000;
+  char test_buffer[8];
+  ssize_t read_result =
+      demux.ops->lpread(5, test_buffer, sizeof(test_buffer), 0, demux);
+  assert(read_result == 8);
+  assert(memcmp(test_buffer, "layer_1_", 8) == 0);
+  assert(mock_states[0].pread_called == 0);
+  assert(mock_states[1].pread_called == 1);
+  assert(mock_states[2].pread_called == 0);
+
+  // a failing layer falls back to the next fastest and is penalized
+  long before = state->latency[1].ewma_ns;
+  mock_layers[1].ops->lpread = failing_pread;
+  read_result =
+      demux.ops->lpread(5, test_buffer, sizeof(test_buffer), 0, demux);
+  assert(read_result == 8);
+  assert(memcmp(test_buffer, "layer_2_", 8) == 0);
+  assert(mock_states[0].pread_called == 0);
+  assert(state->latency[1].ewma_ns > before);
+  assert(state->latency[2].n_samples == 1);
+
+  printf("✅ demultiplexer_pread fastest read policy test passed\n");
+
+  demultiplexer_destroy(demux);
+}
+
+static LayerOps *slow_pread_ops; // ops of the layer slowed down
+static ssize_t (*slow_pread_next)(int, void *, size_t, off_t, LayerContext);
+
+static ssize_t slow_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                          LayerContext l) {
+  usleep(50 * 1000);
+  return slow_pread_next(fd, buffer, nbyte, offset, l);
+}
+
+void test_demultiplexer_pread_hedged() {
+  printf("Testing demultiplexer_pread with the hedged read policy...\n");
+
+  setup_test();
+
+  int passthrough_reads[] = {0, 0, 0};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {1, 0, 0};
+  DemultiplexerConfig config = {.read_policy = DEMULTIPLEXER_READ_HEDGED};
+  LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
+                                          passthrough_writes, enforced_layers,
+                                          &config);
+
+  DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
+
+  mock_states[0].mock_pread_data = "layer_0_";
+  mock_states[0].mock_pread_data_size = 8;
+  mock_states[1].mock_pread_data = "layer_1_";
+  mock_states[1].mock_pread_data_size = 8;
+  mock_states[2].mock_pread_data = "layer_2_";
+  mock_states[2].mock_pread_data_size = 8;
+
+  // a fast answer is not hedged
+  char test_buffer[8];
+  ssize_t read_result =
+      demux.ops->lpread(5, test_buffer, sizeof(test_buffer), 0, demux);
+  assert(read_result == 8);
+  assert(memcmp(test_buffer, "layer_0_", 8) == 0);
+  assert(state->hedged_reads == 0);
+
+  // layer 0 usually answers within 1ms but is now stuck for 50ms
+  for (int i = 0; i < DEMULTIPLEXER_HEDGE_MIN_SAMPLES; i++) {
+    state->latency[0].samples[i] = 1000000;
+  }
+  state->latency[0].n_samples = DEMULTIPLEXER_HEDGE_MIN_SAMPLES;
+  state->latency[0].ewma_ns = 1;
+  state->latency[1].ewma_ns = 2;
+  state->latency[2].ewma_ns = 3;
+  slow_pread_ops = mock_layers[0].ops;
+  slow_pread_next = slow_pread_ops->lpread;
+  slow_pread_ops->lpread = slow_pread;
+
+  read_result =
+      demux.ops->lpread(5, test_buffer, sizeof(test_buffer), 0, demux);
+  assert(read_result == 8);
+  assert(memcmp(test_buffer, "layer_1_", 8) == 0);
+  assert(state->hedged_reads == 1);
+  assert(mock_states[2].pread_called == 0); // a single hedge
+
+  // close waits for the read the slow layer is still doing
+  demux.ops->lclose(5, demux);
+  assert(demultiplexer_fd(state, 5)->inflight_reads == 0);
+  assert(mock_states[0].pread_called == 2);
+
+  printf("✅ demultiplexer_pread hedged read policy test passed\n");
+
+  demultiplexer_destroy(demux);
+}
+
+void test_demultiplexer_pread_first_success() {
+  printf("Testing demultiplexer_pread with the first_success policy...\n");
+
+  setup_test();
+
+  int passthrough_reads[] = {0, 0, 1};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {1, 0, 0};
+  DemultiplexerConfig config = {
+      .read_policy = DEMULTIPLEXER_READ_FIRST_SUCCESS};
+  LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
+                                          passthrough_writes, enforced_layers,
+                                          &config);
+
+  DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
+
+  mock_states[0].mock_pread_data = "layer_0_";
+  mock_states[0].mock_pread_data_size = 8;
+  mock_states[1].mock_pread_data = "layer_1_";
+  mock_states[1].mock_pread_data_size = 8;
+
+  // a failing layer is ignored when another one answers
+  mock_layers[0].ops->lpread = failing_pread;
+  char test_buffer[8];
+  ssize_t read_result =
+      demux.ops->lpread(5, test_buffer, sizeof(test_buffer), 0, demux);
+  assert(read_result == 8);
+  assert(memcmp(test_buffer, "layer_1_", 8) == 0);
+  demux.ops->lclose(5, demux);
+  assert(mock_states[0].pread_called == 1);
+  assert(mock_states[1].pread_called == 1);
+  assert(mock_states[2].pread_called == 0); // passthrough reads skipped
+
+  // every layer failing is an error
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  mock_layers[1].ops->lpread = failing_pread;
+  errno = 0;
+  read_result =
+      demux.ops->lpread(5, test_buffer, sizeof(test_buffer), 0, demux);
+  assert(read_result == -1);
+  assert(errno == EIO);
+
+  printf("✅ demultiplexer_pread first_success read policy test passed\n");
+
+  demultiplexer_destroy(demux);
+}
+
+static ssize_t (*slow_pwrite_next)(int, const void *, size_t, off_t,
+                                   LayerContext);
+
+static ssize_t slow_pwrite(int fd, const void *buffer, size_t nbyte,
+                           off_t offset, LayerContext l) {
+  usleep(50 * 1000);
+  return slow_pwrite_next(fd, buffer, nbyte, offset, l);
+}
+
+static ssize_t failing_pwrite(int fd, const void *buffer, size_t nbyte,
+                              off_t offset, LayerContext l) {
+  MockLayerState *state = (MockLayerState *)l.internal_state;
+  state->pwrite_called++;
+  errno = ENOSPC;
+  return -1;
+}
+
+void test_demultiplexer_pwrite_quorum() {
+  printf("Testing demultiplexer_pwrite with a write quorum...\n");
+
+  setup_test();
+
+  int passthrough_reads[] = {0, 0, 0};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {0, 0, 1}; // read first, but slow
+  DemultiplexerConfig config = {
+      .read_policy = DEMULTIPLEXER_READ_PREFERRED,
+      .write_quorum = 2};
+  LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
+                                          passthrough_writes, enforced_layers,
+                                          &config);
+
+  DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
+  mock_states[0].mock_pread_data = "layer_0_";
+  mock_states[0].mock_pread_data_size = 8;
+  mock_states[2].mock_pread_data = "layer_2_";
+  mock_states[2].mock_pread_data_size = 8;
+
+  slow_pwrite_next = mock_layers[2].ops->lpwrite;
+  mock_layers[2].ops->lpwrite = slow_pwrite;
+
+  // two layers acknowledge, the slow one is left in its replay log
+  ssize_t write_result = demux.ops->lpwrite(5, "new_data", 8, 0, demux);
+  assert(write_result == 8);
+  assert(mock_states[0].pwrite_called == 1);
+  assert(mock_states[1].pwrite_called == 1);
+
+  DemultiplexerReplicaLag lag;
+  assert(demultiplexer_replica_lag(demux, 2, &lag) == 0);
+  assert(lag.entries == 1);
+  assert(lag.bytes == 8);
+  assert(lag.applied == 0);
+  assert(demultiplexer_replica_lag(demux, 3, &lag) == -1);
+
+  // the lagging layer is skipped by reads until it caught up
+  char test_buffer[8];
+  ssize_t read_result =
+      demux.ops->lpread(5, test_buffer, sizeof(test_buffer), 0, demux);
+  assert(read_result == 8);
+  assert(memcmp(test_buffer, "layer_0_", 8) == 0);
+  assert(mock_states[2].pread_called == 0);
+
+  // close waits for the replay log
+  demux.ops->lclose(5, demux);
+  assert(mock_states[2].pwrite_called == 1);
+  assert(demultiplexer_replica_lag(demux, 2, &lag) == 0);
+  assert(lag.entries == 0);
+  assert(lag.bytes == 0);
+  assert(lag.applied == 1);
+
+  // the quorum is out of reach with two failing layers
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
+  mock_layers[0].ops->lpwrite = failing_pwrite;
+  mock_layers[1].ops->lpwrite = failing_pwrite;
+  errno = 0;
+  write_result = demux.ops->lpwrite(5, "new_data", 8, 0, demux);
+  assert(write_result == -1);
+  assert(errno == ENOSPC);
+  demux.ops->lclose(5, demux);
+
+  printf("✅ demultiplexer_pwrite write quorum test passed\n");
+
+  demultiplexer_destroy(demux);
+}
+
+void test_demultiplexer_pwrite_quorum_repairs_on_reopen() {
+  printf("Testing a stale layer is repaired when the file is reopened...\n");
+
+  setup_test();
+
+  int passthrough_reads[] = {0, 0, 0};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {1, 0, 0};
+  DemultiplexerConfig config = {
+      .read_policy = DEMULTIPLEXER_READ_ALL,
+      .write_quorum = 2};
+  LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
+                                          passthrough_writes, enforced_layers,
+                                          &config);
+
+  for (int i = 0; i < 3; i++) {
+    mock_states[i].open_return_value = 5 + i;
+  }
+  mock_states[0].mock_pread_data = "layer_0_";
+  mock_states[0].mock_pread_data_size = 8;
+  mock_states[0].stat_lower_layer_stat.st_size = 8;
+
+  int fd = demux.ops->lopen("/tmp/quorum_file", O_RDWR, 0644, demux);
+  assert(fd == 5);
+
+  // layer 1 fails a write: the quorum holds and layer 1 turns stale
+  LayerOps *ops = mock_layers[1].ops;
+  ssize_t (*pwrite_next)(int, const void *, size_t, off_t, LayerContext) =
+      ops->lpwrite;
+  ops->lpwrite = failing_pwrite;
+  assert(demux.ops->lpwrite(fd, "layer_0_", 8, 0, demux) == 8);
+  demux.ops->lclose(fd, demux);
+  DemultiplexerReplicaLag lag;
+  assert(demultiplexer_replica_lag(demux, 1, &lag) == 0);
+  assert(lag.failed == 1);
+  assert(lag.stale == 1);
+
+  // reopening copies the file from a layer that is not stale
+  ops->lpwrite = pwrite_next;
+  enable_mock_pwrite_data_storage(&mock_states[1]);
+  fd = demux.ops->lopen("/tmp/quorum_file", O_RDWR, 0644, demux);
+  assert(fd == 5);
+  assert(mock_states[1].pwrite_data_storage_size == 8);
+  assert(memcmp(mock_states[1].pwrite_data_storage, "layer_0_", 8) == 0);
+  assert(mock_states[1].last_ftruncate_input_length == 8);
+  assert(demultiplexer_replica_lag(demux, 1, &lag) == 0);
+  assert(lag.stale == 0);
+  demux.ops->lclose(fd, demux);
+
+  printf("✅ stale layer repaired on reopen test passed\n");
+
+  demultiplexer_destroy(demux);
+}
+
+// In-memory file of a layer holding stripes
+typedef struct {
+  char data[256];
+  off_t size;
+} StripeFile;
+
+static StripeFile stripe_files[3];
+static LayerContext stripe_layers[3];
+
+static ssize_t stripe_file_pread(int fd, void *buffer, size_t nbyte,
+                                 off_t offset, LayerContext l) {
+  StripeFile *file = l.internal_state;
+  if (offset >= file->size) {
+    return 0;
+  }
+  size_t n = (size_t)(file->size - offset) < nbyte
+                 ? (size_t)(file->size - offset)
+                 : nbyte;
+  memcpy(buffer, file->data + offset, n);
+  return (ssize_t)n;
+}
+
+static ssize_t stripe_file_pwrite(int fd, const void *buffer, size_t nbyte,
+                                  off_t offset, LayerContext l) {
+  StripeFile *file = l.internal_state;
+  assert(offset + nbyte <= sizeof(file->data));
+  if (offset > file->size) {
+    memset(file->data + file->size, 0, offset - file->size);
+  }
+  memcpy(file->data + offset, buffer, nbyte);
+  if (offset + (off_t)nbyte > file->size) {
+    file->size = offset + (off_t)nbyte;
+  }
+  return (ssize_t)nbyte;
+}
+
+static ssize_t stripe_file_failing_pread(int fd, void *buffer, size_t nbyte,
+                                         off_t offset, LayerContext l) {
+  errno = EIO;
+  return -1;
+}
+
+static ssize_t stripe_file_failing_pwrite(int fd, const void *buffer,
+                                          size_t nbyte, off_t offset,
+                                          LayerContext l) {
+  errno = EIO;
+  return -1;
+}
+
+static int stripe_file_open(const char *pathname, int flags, mode_t mode,
+                            LayerContext l) {
+  StripeFile *file = l.internal_state;
+  if (flags & O_TRUNC) {
+    file->size = 0;
+  }
+  return 10 + (int)(file - stripe_files);
+}
+
+static int stripe_file_close(int fd, LayerContext l) { return 0; }
+
+static int stripe_file_ftruncate(int fd, off_t length, LayerContext l) {
+  StripeFile *file = l.internal_state;
+  if (length > file->size) {
+    memset(file->data + file->size, 0, length - file->size);
+  }
+  file->size = length;
+  return 0;
+}
+
+static int stripe_file_fstat(int fd, struct stat *stbuf, LayerContext l) {
+  StripeFile *file = l.internal_state;
+  memset(stbuf, 0, sizeof(*stbuf));
+  stbuf->st_mode = S_IFREG | 0644;
+  stbuf->st_size = file->size;
+  stbuf->st_blocks = (file->size + 511) / 512;
+  return 0;
+}
+
+static void setup_stripe_layers() {
+  for (int i = 0; i < 3; i++) {
+    memset(&stripe_files[i], 0, sizeof(StripeFile));
+    LayerOps *ops = calloc(1, sizeof(LayerOps));
+    assert(ops != NULL);
+    ops->lpread = stripe_file_pread;
+    ops->lpwrite = stripe_file_pwrite;
+    ops->lopen = stripe_file_open;
+    ops->lclose = stripe_file_close;
+    ops->lftruncate = stripe_file_ftruncate;
+    ops->lfstat = stripe_file_fstat;
+    stripe_layers[i] = (LayerContext){.ops = ops,
+                                      .internal_state = &stripe_files[i]};
+  }
+}
+
+void test_demultiplexer_striped_layout() {
+  printf("Testing demultiplexer striped layout...\n");
+
+  setup_stripe_layers();
+
+  int passthrough_reads[] = {0, 0, 0};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {0, 0, 0};
+  DemultiplexerConfig config = {.read_policy = DEMULTIPLEXER_READ_ALL,
+                                .layout = DEMULTIPLEXER_LAYOUT_STRIPED,
+                                .stripe_size = 4};
+  LayerContext demux = demultiplexer_init(stripe_layers, 3, passthrough_reads,
+                                          passthrough_writes, enforced_layers,
+                                          &config);
+  DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
+  for (int i = 0; i < 3; i++) {
+    assert(state->options[i].enforced);
+    layer_fds_of(state, 5)[i] = 10 + i;
+  }
+
+  // units of 4 bytes go round-robin, each layer's units are contiguous
+  const char *alphabet = "abcdefghijklmnopqrstuvwxyz";
+  assert(demux.ops->lpwrite(5, alphabet, 26, 0, demux) == 26);
+  assert(stripe_files[0].size == 10);
+  assert(memcmp(stripe_files[0].data, "abcdmnopyz", 10) == 0);
+  assert(stripe_files[1].size == 8);
+  assert(memcmp(stripe_files[1].data, "efghqrst", 8) == 0);
+  assert(stripe_files[2].size == 8);
+  assert(memcmp(stripe_files[2].data, "ijkluvwx", 8) == 0);
+
+  // a vectored read crossing units and buffers
+  char head[5];
+  char tail[40];
+  struct iovec iov[2] = {{.iov_base = head, .iov_len = sizeof(head)},
+                         {.iov_base = tail, .iov_len = sizeof(tail)}};
+  assert(demux.ops->lpreadv(5, iov, 2, 0, demux) == 26);
+  assert(memcmp(head, "abcde", 5) == 0);
+  assert(memcmp(tail, alphabet + 5, 21) == 0);
+  char buffer[64];
+  assert(demux.ops->lpread(5, buffer, 16, 20, demux) == 6);
+  assert(memcmp(buffer, "uvwxyz", 6) == 0);
+
+  struct stat st;
+  assert(demux.ops->lfstat(5, &st, demux) == 0);
+  assert(st.st_size == 26);
+
+  // each layer keeps its share of the length
+  assert(demux.ops->lftruncate(5, 9, demux) == 0);
+  assert(stripe_files[0].size == 4);
+  assert(stripe_files[1].size == 4);
+  assert(stripe_files[2].size == 1);
+  assert(demux.ops->lfstat(5, &st, demux) == 0);
+  assert(st.st_size == 9);
+
+  // a write past the end leaves a hole that reads as zeros
+  assert(demux.ops->lpwrite(5, "Z", 1, 40, demux) == 1);
+  assert(stripe_files[1].size == 13);
+  memset(buffer, 'x', sizeof(buffer));
+  assert(demux.ops->lpread(5, buffer, sizeof(buffer), 0, demux) == 41);
+  assert(memcmp(buffer, "abcdefghi", 9) == 0);
+  for (int i = 9; i < 40; i++) {
+    assert(buffer[i] == '\0');
+  }
+  assert(buffer[40] == 'Z');
+  assert(demux.ops->lfstat(5, &st, demux) == 0);
+  assert(st.st_size == 41);
+
+  // without redundancy, a failing layer fails the read
+  stripe_layers[2].ops->lpread = stripe_file_failing_pread;
+  errno = 0;
+  assert(demux.ops->lpread(5, buffer, sizeof(buffer), 0, demux) == -1);
+  assert(errno == EIO);
+  // unless the read does not reach it
+  assert(demux.ops->lpread(5, buffer, 8, 0, demux) == 8);
+
+  demultiplexer_destroy(demux);
+  for (int i = 0; i < 3; i++) {
+    free(stripe_layers[i].ops);
+  }
+  printf("✅ demultiplexer striped layout test passed\n");
+}
+
+void test_demultiplexer_init_invalid_striped() {
+  printf("Testing demultiplexer_init with a striped write quorum...\n");
+
+  setup_test();
+
+  int passthrough_reads[] = {0, 0, 0};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {0, 0, 0};
+  DemultiplexerConfig config = {.read_policy = DEMULTIPLEXER_READ_ALL,
+                                .write_quorum = 2,
+                                .layout = DEMULTIPLEXER_LAYOUT_STRIPED,
+                                .stripe_size = 4};
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    demultiplexer_init(mock_layers, 3, passthrough_reads, passthrough_writes,
+                       enforced_layers, &config);
+    exit(0); // Should not reach here
+  } else if (pid > 0) {
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+    printf("✅ demultiplexer_init correctly failed for a striped write "
+           "quorum\n");
+  } else {
+    assert(0 && "Fork failed");
+  }
+}
+
+void test_demultiplexer_erasure_layout() {
+  printf("Testing demultiplexer erasure coded layout...\n");
+
+  setup_stripe_layers();
+
+  int passthrough_reads[] = {0, 0, 0};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {0, 0, 0};
+  DemultiplexerConfig config = {.read_policy = DEMULTIPLEXER_READ_ALL,
+                                .layout = DEMULTIPLEXER_LAYOUT_ERASURE,
+                                .stripe_size = 4,
+                                .data_layers = 2};
+  LayerContext demux = demultiplexer_init(stripe_layers, 3, passthrough_reads,
+                                          passthrough_writes, enforced_layers,
+                                          &config);
+  int fd = demux.ops->lopen("/erasure", O_RDWR | O_CREAT, 0644, demux);
+  assert(fd == 10);
+
+  // two data layers hold the units, the third their parity
+  const char *alphabet = "abcdefghijklmnopqrstuvwxyz";
+  assert(demux.ops->lpwrite(fd, alphabet, 26, 0, demux) == 26);
+  assert(stripe_files[0].size == 14);
+  assert(memcmp(stripe_files[0].data, "abcdijklqrstyz", 14) == 0);
+  assert(stripe_files[1].size == 12);
+  assert(memcmp(stripe_files[1].data, "efghmnopuvwx", 12) == 0);
+  assert(stripe_files[2].size == 26);
+
+  char buffer[64];
+  assert(demux.ops->lpread(fd, buffer, sizeof(buffer), 0, demux) == 26);
+  assert(memcmp(buffer, alphabet, 26) == 0);
+  struct stat st;
+  assert(demux.ops->lfstat(fd, &st, demux) == 0);
+  assert(st.st_size == 26);
+
+  // a failing data layer is rebuilt from the parity
+  stripe_layers[0].ops->lpread = stripe_file_failing_pread;
+  memset(buffer, 0, sizeof(buffer));
+  assert(demux.ops->lpread(fd, buffer, sizeof(buffer), 0, demux) == 26);
+  assert(memcmp(buffer, alphabet, 26) == 0);
+  assert(demux.ops->lpread(fd, buffer, 10, 5, demux) == 10);
+  assert(memcmp(buffer, "fghijklmno", 10) == 0);
+  stripe_layers[0].ops->lpread = stripe_file_pread;
+  assert(demux.ops->lclose(fd, demux) == 0);
+
+  // the layer is back once the file is reopened; each data layer keeps its
+  // share of a truncated file, the parity the length
+  fd = demux.ops->lopen("/erasure", O_RDWR, 0644, demux);
+  assert(fd == 10);
+  assert(demux.ops->lftruncate(fd, 11, demux) == 0);
+  assert(stripe_files[0].size == 7);
+  assert(stripe_files[1].size == 4);
+  assert(stripe_files[2].size == 11);
+  stripe_layers[1].ops->lpread = stripe_file_failing_pread;
+  assert(demux.ops->lpread(fd, buffer, sizeof(buffer), 0, demux) == 11);
+  assert(memcmp(buffer, "abcdefghijk", 11) == 0);
+  stripe_layers[1].ops->lpread = stripe_file_pread;
+  assert(demux.ops->lclose(fd, demux) == 0);
+
+  // a layer missing a write is stale, the next open rebuilds its shard
+  fd = demux.ops->lopen("/erasure", O_RDWR, 0644, demux);
+  assert(fd == 10);
+  stripe_layers[0].ops->lpwrite = stripe_file_failing_pwrite;
+  assert(demux.ops->lpwrite(fd, "XYZ", 3, 2, demux) == 3);
+  assert(demux.ops->lpread(fd, buffer, sizeof(buffer), 0, demux) == 11);
+  assert(memcmp(buffer, "abXYZfghijk", 11) == 0);
+  DemultiplexerReplicaLag lag;
+  assert(demultiplexer_replica_lag(demux, 0, &lag) == 0);
+  assert(lag.stale == 1);
+  stripe_layers[0].ops->lpwrite = stripe_file_pwrite;
+  assert(demux.ops->lclose(fd, demux) == 0);
+
+  fd = demux.ops->lopen("/erasure", O_RDWR, 0644, demux);
+  assert(fd == 10);
+  assert(demultiplexer_replica_lag(demux, 0, &lag) == 0);
+  assert(lag.stale == 0);
+  assert(stripe_files[0].size == 7);
+  assert(memcmp(stripe_files[0].data, "abXYijk", 7) == 0);
+  assert(demux.ops->lfstat(fd, &st, demux) == 0);
+  assert(st.st_size == 11);
+  assert(demux.ops->lclose(fd, demux) == 0);
+
+  demultiplexer_destroy(demux);
+  for (int i = 0; i < 3; i++) {
+    free(stripe_layers[i].ops);
+  }
+  printf("✅ demultiplexer erasure coded layout test passed\n");
+}
+
+void test_demultiplexer_init_invalid_erasure() {
+  printf("Testing demultiplexer_init without parity layers...\n");
+
+  setup_test();
+
+  int passthrough_reads[] = {0, 0, 0};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {0, 0, 0};
+  DemultiplexerConfig config = {.read_policy = DEMULTIPLEXER_READ_ALL,
+                                .layout = DEMULTIPLEXER_LAYOUT_ERASURE,
+                                .stripe_size = 4,
+                                .data_layers = 3};
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    demultiplexer_init(mock_layers, 3, passthrough_reads, passthrough_writes,
+                       enforced_layers, &config);
+    exit(0); // Should not reach here
+  } else if (pid > 0) {
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+    printf("✅ demultiplexer_init correctly failed without parity layers\n");
+  } else {
+    assert(0 && "Fork failed");
+  }
+}
+
 // ================================ Fstat tests ================================
 void test_demultiplexer_fstat_success() {
   printf("Testing demultiplexer_fstat success case...\n");
@@ -458,9 +1481,16 @@ void test_demultiplexer_fstat_success() {
 
   int enforced_layers[] = {1, 1, 1}; // All layers enforced
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
   assert(demux.ops->lfstat != NULL);
 
+  // Set up file descriptor mappings
+  DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
+
   struct stat stbuf;
   int result = demultiplexer_fstat(5, &stbuf, demux);
   assert(result == 0);
@@ -482,7 +1512,8 @@ void test_demultiplexer_lstat_success() {
   int passthrough_writes[] = {0, 0, 0}; // No passthrough writes
   int enforced_layers[] = {1, 1, 1};    // All layers enforced
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
   assert(demux.ops->llstat != NULL);
 
   struct stat stbuf;
@@ -506,13 +1537,14 @@ void test_demultiplexer_fstat_errno_propagation() {
   int passthrough_writes[] = {0, 0, 0}; // No passthrough writes
   int enforced_layers[] = {1, 1, 1};    // All layers enforced
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
 
   // Set up file descriptor mappings
   DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
-  state->layer_fds[5][0] = 10;
-  state->layer_fds[5][1] = 11;
-  state->layer_fds[5][2] = 12;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
 
   // Test case 1: First enforced layer fails with EBADF
   mock_states[0].fstat_return_value = -1;
@@ -544,13 +1576,14 @@ void test_demultiplexer_fstat_errno_multiple_failures() {
   int passthrough_writes[] = {0, 0, 0}; // No passthrough writes
   int enforced_layers[] = {1, 1, 1};    // All layers enforced
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
 
   // Set up file descriptor mappings
   DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
-  state->layer_fds[5][0] = 10;
-  state->layer_fds[5][1] = 11;
-  state->layer_fds[5][2] = 12;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
 
   // Test case: Multiple layers fail with different errno values
   // Should propagate errno from first enforced layer that failed
@@ -586,13 +1619,14 @@ void test_demultiplexer_fstat_errno_second_layer_fails() {
   int passthrough_writes[] = {0, 0, 0}; // No passthrough writes
   int enforced_layers[] = {0, 1, 1};    // Only layers 1 and 2 enforced
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
 
   // Set up file descriptor mappings
   DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
-  state->layer_fds[5][0] = 10;
-  state->layer_fds[5][1] = 11;
-  state->layer_fds[5][2] = 12;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
 
   // First layer succeeds but is not enforced, second layer (first enforced)
   // fails
@@ -627,7 +1661,8 @@ void test_demultiplexer_lstat_errno_propagation() {
   int passthrough_writes[] = {0, 0, 0}; // No passthrough writes
   int enforced_layers[] = {1, 1, 1};    // All layers enforced
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
 
   // Test case 1: First enforced layer fails with ENOENT
   mock_states[0].lstat_return_value = -1;
@@ -659,7 +1694,8 @@ void test_demultiplexer_lstat_errno_multiple_failures() {
   int passthrough_writes[] = {0, 0, 0}; // No passthrough writes
   int enforced_layers[] = {1, 1, 1};    // All layers enforced
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
 
   // Test case: Multiple layers fail with different errno values
   // Should propagate errno from first enforced layer that failed
@@ -694,7 +1730,8 @@ void test_demultiplexer_lstat_errno_permission_denied() {
   int passthrough_writes[] = {0, 0, 0}; // No passthrough writes
   int enforced_layers[] = {0, 1, 0};    // Only middle layer enforced
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
 
   // First layer succeeds but not enforced, second layer (enforced) fails
   mock_states[0].lstat_return_value = 0; // Success but not enforced
@@ -726,13 +1763,14 @@ void test_demultiplexer_errno_success_no_change() {
   int passthrough_writes[] = {0, 0, 0}; // No passthrough writes
   int enforced_layers[] = {1, 1, 1};    // All layers enforced
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
 
   // Set up file descriptor mappings for fstat
   DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
-  state->layer_fds[5][0] = 10;
-  state->layer_fds[5][1] = 11;
-  state->layer_fds[5][2] = 12;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
 
   // Set all operations to succeed
   mock_states[0].fstat_return_value = 0;
@@ -762,6 +1800,143 @@ void test_demultiplexer_errno_success_no_change() {
   demultiplexer_destroy(demux);
 }
 
+void test_demultiplexer_stat_metadata_layer() {
+  printf("Testing demultiplexer fstat/lstat served by the metadata layer...\n");
+
+  setup_test();
+
+  int passthrough_reads[] = {0, 0, 0};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {1, 1, 1};
+  DemultiplexerConfig config = {.has_metadata_layer = true,
+                                .metadata_layer = 1};
+  LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
+                                          passthrough_writes, enforced_layers,
+                                          &config);
+
+  DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
+  for (int i = 0; i < 3; i++) {
+    mock_states[i].stat_lower_layer_stat.st_size = 100 * (i + 1);
+  }
+
+  // only the metadata layer is asked
+  struct stat stbuf;
+  assert(demultiplexer_fstat(5, &stbuf, demux) == 0);
+  assert(stbuf.st_size == 200);
+  assert(demultiplexer_lstat("/tmp/file", &stbuf, demux) == 0);
+  assert(stbuf.st_size == 200);
+  assert(mock_states[0].fstat_called == 0);
+  assert(mock_states[1].fstat_called == 1);
+  assert(mock_states[2].fstat_called == 0);
+  assert(mock_states[0].lstat_called == 0);
+  assert(mock_states[1].lstat_called == 1);
+
+  // its errors are returned as they are
+  mock_states[1].lstat_return_value = -1;
+  mock_states[1].stat_errno_value = ENOENT;
+  errno = 0;
+  assert(demultiplexer_lstat("/tmp/file", &stbuf, demux) == -1);
+  assert(errno == ENOENT);
+
+  printf("✅ demultiplexer metadata layer test passed\n");
+
+  demultiplexer_destroy(demux);
+}
+
+void test_demultiplexer_stat_metadata_check() {
+  printf("Testing demultiplexer metadata checks against the other layers...\n");
+
+  setup_test();
+
+  int passthrough_reads[] = {0, 0, 0};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {1, 1, 0};
+  DemultiplexerConfig config = {
+      .has_metadata_layer = true, .metadata_layer = 1, .metadata_check = true};
+  LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
+                                          passthrough_writes, enforced_layers,
+                                          &config);
+
+  DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
+  for (int i = 0; i < 3; i++) {
+    mock_states[i].stat_lower_layer_stat.st_size = 100;
+  }
+
+  // every layer is asked and the answers agree
+  struct stat stbuf;
+  assert(demultiplexer_lstat("/tmp/file", &stbuf, demux) == 0);
+  assert(stbuf.st_size == 100);
+  assert(mock_states[0].lstat_called == 1);
+  assert(mock_states[1].lstat_called == 1);
+  assert(mock_states[2].lstat_called == 1);
+  assert(state->metadata_mismatches == 0);
+
+  // an enforced layer disagreeing is reported, the metadata layer wins
+  mock_states[0].stat_lower_layer_stat.st_size = 50;
+  mock_states[2].stat_lower_layer_stat.st_size = 70; // not enforced
+  assert(demultiplexer_lstat("/tmp/file", &stbuf, demux) == 0);
+  assert(stbuf.st_size == 100);
+  assert(state->metadata_mismatches == 1);
+
+  printf("✅ demultiplexer metadata check test passed\n");
+
+  demultiplexer_destroy(demux);
+}
+
+void test_demultiplexer_stat_attr_cache() {
+  printf("Testing demultiplexer attribute cache...\n");
+
+  setup_test();
+
+  int passthrough_reads[] = {0, 0, 0};
+  int passthrough_writes[] = {0, 0, 0};
+  int enforced_layers[] = {1, 1, 1};
+  DemultiplexerConfig config = {.attr_cache_entries = 16,
+                                .attr_cache_ttl_ms = 60000};
+  LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
+                                          passthrough_writes, enforced_layers,
+                                          &config);
+
+  for (int i = 0; i < 3; i++) {
+    mock_states[i].open_return_value = 5 + i;
+    mock_states[i].stat_lower_layer_stat.st_size = 100;
+  }
+  int fd = demux.ops->lopen("/tmp/cached_file", O_RDWR, 0644, demux);
+  assert(fd == 5);
+
+  // fstat and lstat of the same path share the cached attributes
+  struct stat stbuf;
+  assert(demultiplexer_lstat("/tmp/cached_file", &stbuf, demux) == 0);
+  assert(demultiplexer_lstat("/tmp/cached_file", &stbuf, demux) == 0);
+  assert(demultiplexer_fstat(fd, &stbuf, demux) == 0);
+  assert(stbuf.st_size == 100);
+  assert(mock_states[0].lstat_called == 1);
+  assert(mock_states[0].fstat_called == 0);
+
+  // a write invalidates the path
+  mock_states[0].stat_lower_layer_stat.st_size = 108;
+  assert(demux.ops->lpwrite(fd, "new_data", 8, 100, demux) == 8);
+  assert(demultiplexer_fstat(fd, &stbuf, demux) == 0);
+  assert(stbuf.st_size == 108);
+  assert(mock_states[0].fstat_called == 1);
+
+  // and so do truncate and unlink
+  assert(demultiplexer_ftruncate(fd, 0, demux) == 0);
+  assert(demultiplexer_fstat(fd, &stbuf, demux) == 0);
+  assert(mock_states[0].fstat_called == 2);
+  demux.ops->lclose(fd, demux);
+  assert(demultiplexer_unlink("/tmp/cached_file", demux) == 0);
+  assert(demultiplexer_lstat("/tmp/cached_file", &stbuf, demux) == 0);
+  assert(mock_states[0].lstat_called == 2);
+
+  printf("✅ demultiplexer attribute cache test passed\n");
+
+  demultiplexer_destroy(demux);
+}
+
 // ================================ Unlink tests
 // ================================
 void test_demultiplexer_unlink_success() {
@@ -773,14 +1948,15 @@ void test_demultiplexer_unlink_success() {
   int passthrough_writes[] = {0, 0, 0}; // No passthrough writes
   int enforced_layers[] = {1, 1, 1};    // All layers enforced
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
   assert(demux.ops->lunlink != NULL);
 
   // Set up file descriptor mappings
   DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
-  state->layer_fds[5][0] = 10;
-  state->layer_fds[5][1] = 11;
-  state->layer_fds[5][2] = 12;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
 
   // Test case: All layers succeed
   mock_states[0].unlink_return_value = 0; // Success
@@ -806,13 +1982,14 @@ void test_demultiplexer_unlink_fails_when_enforced_layer_fails() {
   int passthrough_writes[] = {0, 0, 0}; // No passthrough writes
   int enforced_layers[] = {0, 1, 1};    // All layers enforced
   LayerContext demux = demultiplexer_init(mock_layers, 3, passthrough_reads,
-                                          passthrough_writes, enforced_layers);
+                                          passthrough_writes, enforced_layers,
+                                          NULL);
 
   // Set up file descriptor mappings
   DemultiplexerState *state = (DemultiplexerState *)demux.internal_state;
-  state->layer_fds[5][0] = 10;
-  state->layer_fds[5][1] = 11;
-  state->layer_fds[5][2] = 12;
+  layer_fds_of(state, 5)[0] = 10;
+  layer_fds_of(state, 5)[1] = 11;
+  layer_fds_of(state, 5)[2] = 12;
 
   // Test case 1: Optional layers fail
   mock_states[0].unlink_return_value = -1; // Success
@@ -885,6 +2062,24 @@ int main() {
   test_demultiplexer_lstat_errno_permission_denied();
 
   test_demultiplexer_pread_success_with_no_enforced();
+  test_demultiplexer_pread_preferred_fallback();
+  test_demultiplexer_vectored_io();
+  test_demultiplexer_pwrite_async_layers();
+  test_demultiplexer_pread_all_reuses_scratch_buffers();
+  test_demultiplexer_pread_verify_replicas();
+  test_demultiplexer_init_invalid_verify_replicas();
+  test_demultiplexer_pread_fastest_order();
+  test_demultiplexer_pread_hedged();
+  test_demultiplexer_pread_first_success();
+  test_demultiplexer_pwrite_quorum();
+  test_demultiplexer_pwrite_quorum_repairs_on_reopen();
+  test_demultiplexer_striped_layout();
+  test_demultiplexer_init_invalid_striped();
+  test_demultiplexer_erasure_layout();
+  test_demultiplexer_init_invalid_erasure();
+  test_demultiplexer_stat_metadata_layer();
+  test_demultiplexer_stat_metadata_check();
+  test_demultiplexer_stat_attr_cache();
   test_demultiplexer_errno_success_no_change();
 
   test_demultiplexer_unlink_success();
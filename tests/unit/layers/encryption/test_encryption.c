@@ -0,0 +1,371 @@
+#include "../../../../layers/encryption/ciphers/aes_xts.h"
+#include "../../../../layers/encryption/encryption.h"
+#include "../../../../layers/local/local.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TESTPATH "test_encryption.bin"
+#define TAGPATH TESTPATH ENCRYPTION_TAG_SUFFIX
+#define RENAMED "test_encryption_renamed.bin"
+#define BLOCK_SIZE 4096
+#define NUM_BLOCKS 8
+#define FILE_SIZE (NUM_BLOCKS * BLOCK_SIZE)
+#define KEY "7da46e98f9643f34e8a4c68079816ec1ca9bbf4c68a3e50f842808848df50119"
+#define NUM_THREADS 4
+
+static LayerContext local_layer;
+
+static LayerContext encryption_layer(void) {
+  EncryptionConfig config = {.block_size = BLOCK_SIZE,
+                             .encryption_key = (char *)KEY};
+  local_layer = local_init();
+  return encryption_init(&local_layer, &config);
+}
+
+static LayerContext aead_layer(aead_cipher_t cipher) {
+  EncryptionConfig config = {.block_size = BLOCK_SIZE,
+                             .mode = ENCRYPTION_MODE_AEAD,
+                             .cipher = cipher,
+                             .encryption_key = (char *)KEY};
+  local_layer = local_init();
+  return encryption_init(&local_layer, &config);
+}
+
+static void fill_text(unsigned char *buf, size_t n, int seed) {
+  for (size_t i = 0; i < n; i++) {
+    buf[i] = (unsigned char)"per sector tweaks "[(i + seed) % 18];
+  }
+}
+
+void test_encryption_sectors() {
+  printf("Testing multi-sector AES-XTS...\n");
+
+  unsigned char *plain = malloc(FILE_SIZE);
+  unsigned char *batched = malloc(FILE_SIZE);
+  unsigned char *out = malloc(FILE_SIZE);
+  fill_text(plain, FILE_SIZE, 0);
+
+  AesXtsKey *key = aes_xts_key_init((const unsigned char *)KEY);
+  assert(key);
+
+  // one call over the request matches a call per sector with its tweak
+  assert(aes_xts_encrypt_sectors(key, 10, BLOCK_SIZE, plain, FILE_SIZE,
+                                 batched) == 0);
+  for (uint64_t i = 0; i < NUM_BLOCKS; i++) {
+    unsigned char iv[AES_XTS_IV_SIZE] = {0};
+    uint64_t sector = 10 + i;
+    memcpy(iv, &sector, sizeof(sector));
+    assert(aes_xts_encrypt((const unsigned char *)KEY, iv,
+                           plain + i * BLOCK_SIZE, BLOCK_SIZE,
+                           out + i * BLOCK_SIZE) == BLOCK_SIZE);
+  }
+  assert(memcmp(out, batched, FILE_SIZE) == 0);
+
+  // the same data encrypts differently in another sector
+  assert(aes_xts_encrypt_sectors(key, 11, BLOCK_SIZE, plain, BLOCK_SIZE,
+                                 out) == 0);
+  assert(memcmp(out, batched, BLOCK_SIZE) != 0);
+
+  // in place, with a short last sector
+  memcpy(out, batched, FILE_SIZE);
+  assert(aes_xts_decrypt_sectors(key, 10, BLOCK_SIZE, out, FILE_SIZE - 100,
+                                 out) == 0);
+  assert(memcmp(out, plain, BLOCK_SIZE * (NUM_BLOCKS - 1)) == 0);
+  assert(aes_xts_decrypt_sectors(key, 10, BLOCK_SIZE, batched, FILE_SIZE,
+                                 out) == 0);
+  assert(memcmp(out, plain, FILE_SIZE) == 0);
+
+  // sectors shorter than an AES block are rejected
+  assert(aes_xts_encrypt_sectors(key, 0, BLOCK_SIZE, plain, BLOCK_SIZE + 8,
+                                 out) == -1);
+  aes_xts_key_free(key);
+
+  free(plain);
+  free(batched);
+  free(out);
+  printf("✅ Multi-sector AES-XTS passed\n");
+}
+
+static void *crypt_thread(void *arg) {
+  AesXtsKey *key = arg;
+  unsigned char plain[BLOCK_SIZE * 2];
+  unsigned char cipher[BLOCK_SIZE * 2];
+  fill_text(plain, sizeof(plain), 3);
+  for (int i = 0; i < 100; i++) {
+    assert(aes_xts_encrypt_sectors(key, (uint64_t)i, BLOCK_SIZE, plain,
+                                   sizeof(plain), cipher) == 0);
+    assert(aes_xts_decrypt_sectors(key, (uint64_t)i, BLOCK_SIZE, cipher,
+                                   sizeof(cipher), cipher) == 0);
+    assert(memcmp(cipher, plain, sizeof(plain)) == 0);
+  }
+  return NULL;
+}
+
+void test_encryption_threads() {
+  printf("Testing AES-XTS thread contexts...\n");
+
+  AesXtsKey *key = aes_xts_key_init((const unsigned char *)KEY);
+  assert(key);
+  pthread_t threads[NUM_THREADS];
+  for (int i = 0; i < NUM_THREADS; i++) {
+    assert(pthread_create(&threads[i], NULL, crypt_thread, key) == 0);
+  }
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  // the key is also freed with the contexts of a live thread
+  crypt_thread(key);
+  aes_xts_key_free(key);
+
+  printf("✅ AES-XTS thread contexts passed\n");
+}
+
+void test_encryption_layer() {
+  printf("Testing encryption layer...\n");
+
+  unsigned char *plain = malloc(FILE_SIZE);
+  unsigned char *buf = malloc(FILE_SIZE);
+  fill_text(plain, FILE_SIZE, 5);
+
+  LayerContext l = encryption_layer();
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, plain, FILE_SIZE, 0, l) == FILE_SIZE);
+
+  // storage holds ciphertext
+  assert(pread(fd, buf, FILE_SIZE, 0) == FILE_SIZE);
+  assert(memcmp(buf, plain, BLOCK_SIZE) != 0);
+
+  // the tweak of a block is its position: blocks read back one by one
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    assert(l.ops->lpread(fd, buf, BLOCK_SIZE, (off_t)(i * BLOCK_SIZE), l) ==
+           BLOCK_SIZE);
+    assert(memcmp(buf, plain + i * BLOCK_SIZE, BLOCK_SIZE) == 0);
+  }
+
+  // and a block rewritten alone is read back with the rest of the file
+  fill_text(plain + 5 * BLOCK_SIZE, BLOCK_SIZE, 9);
+  assert(l.ops->lpwrite(fd, plain + 5 * BLOCK_SIZE, BLOCK_SIZE,
+                        5 * BLOCK_SIZE, l) == BLOCK_SIZE);
+  assert(l.ops->lpread(fd, buf, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(buf, plain, FILE_SIZE) == 0);
+
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  encryption_destroy(l);
+
+  free(plain);
+  free(buf);
+  printf("✅ Encryption layer passed\n");
+}
+
+// LayerDigest callback: a position dependent checksum of the block
+static int checksum_block(const void *data, size_t size, void *digest,
+                          void *arg) {
+  (*(int *)arg)++;
+  uint64_t sum = 0;
+  for (size_t i = 0; i < size; i++) {
+    sum = sum * 31 + ((const unsigned char *)data)[i];
+  }
+  memcpy(digest, &sum, sizeof(sum));
+  return (int)sizeof(sum);
+}
+
+void test_encryption_digests() {
+  printf("Testing encryption with digests...\n");
+
+  unsigned char *plain = malloc(FILE_SIZE);
+  unsigned char *buf = malloc(FILE_SIZE);
+  fill_text(plain, FILE_SIZE, 7);
+
+  uint64_t expected[NUM_BLOCKS];
+  uint64_t digests[NUM_BLOCKS];
+  int calls = 0;
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    checksum_block(plain + i * BLOCK_SIZE, BLOCK_SIZE, &expected[i], &calls);
+  }
+
+  LayerContext l = encryption_layer();
+  assert(l.ops->lpread_digest && l.ops->lpwrite_digest);
+  LayerDigest digest = {.block_size = BLOCK_SIZE,
+                        .digest_size = sizeof(uint64_t),
+                        .hash_block = checksum_block,
+                        .arg = &calls,
+                        .digests = digests};
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+
+  // digests of the plaintext, one per block, on writes and reads
+  calls = 0;
+  memset(digests, 0, sizeof(digests));
+  assert(l.ops->lpwrite_digest(fd, plain, FILE_SIZE, 0, &digest, l) ==
+         FILE_SIZE);
+  assert(calls == NUM_BLOCKS);
+  assert(memcmp(digests, expected, sizeof(digests)) == 0);
+
+  memset(digests, 0, sizeof(digests));
+  assert(l.ops->lpread_digest(fd, buf, FILE_SIZE, 0, &digest, l) ==
+         FILE_SIZE);
+  assert(memcmp(buf, plain, FILE_SIZE) == 0);
+  assert(memcmp(digests, expected, sizeof(digests)) == 0);
+
+  // digest blocks spanning several sectors
+  uint64_t pair;
+  digest.block_size = 2 * BLOCK_SIZE;
+  checksum_block(plain + 2 * BLOCK_SIZE, 2 * BLOCK_SIZE, &pair, &calls);
+  assert(l.ops->lpread_digest(fd, buf, 2 * BLOCK_SIZE, 2 * BLOCK_SIZE,
+                              &digest, l) == 2 * BLOCK_SIZE);
+  assert(digests[0] == pair);
+  assert(memcmp(buf, plain + 2 * BLOCK_SIZE, 2 * BLOCK_SIZE) == 0);
+
+  // and digest blocks smaller than a sector, hashed in a second pass
+  digest.block_size = BLOCK_SIZE / 2;
+  checksum_block(plain + BLOCK_SIZE / 2, BLOCK_SIZE / 2, &pair, &calls);
+  assert(l.ops->lpread_digest(fd, buf, BLOCK_SIZE, 0, &digest, l) ==
+         BLOCK_SIZE);
+  assert(digests[1] == pair);
+
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  encryption_destroy(l);
+
+  free(plain);
+  free(buf);
+  printf("✅ Encryption with digests passed\n");
+}
+
+static int exists(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0;
+}
+
+static void test_aead_cipher(aead_cipher_t cipher) {
+  unsigned char *plain = malloc(FILE_SIZE);
+  unsigned char *buf = malloc(FILE_SIZE);
+  unsigned char saved[ENCRYPTION_TAG_RECORD_SIZE];
+  fill_text(plain, FILE_SIZE, 11);
+
+  LayerContext l = aead_layer(cipher);
+  assert(l.ops->lpread_digest == NULL);
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, plain, FILE_SIZE, 0, l) == FILE_SIZE);
+
+  // ciphertext of the same size, one record per block in the tag file
+  struct stat st;
+  assert(stat(TESTPATH, &st) == 0 && st.st_size == FILE_SIZE);
+  assert(stat(TAGPATH, &st) == 0 &&
+         st.st_size == NUM_BLOCKS * ENCRYPTION_TAG_RECORD_SIZE);
+  assert(pread(fd, buf, BLOCK_SIZE, 0) == BLOCK_SIZE);
+  assert(memcmp(buf, plain, BLOCK_SIZE) != 0);
+
+  assert(l.ops->lpread(fd, buf, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(buf, plain, FILE_SIZE) == 0);
+  // unaligned reads check the whole blocks they cover
+  assert(l.ops->lpread(fd, buf, 5000, 100, l) == 5000);
+  assert(memcmp(buf, plain + 100, 5000) == 0);
+  // the blocks between the edges are read straight into the buffer
+  assert(l.ops->lpread(fd, buf, 3 * BLOCK_SIZE, 10, l) == 3 * BLOCK_SIZE);
+  assert(memcmp(buf, plain + 10, 3 * BLOCK_SIZE) == 0);
+  assert(l.ops->lpread(fd, buf, 2 * BLOCK_SIZE - 10, BLOCK_SIZE, l) ==
+         2 * BLOCK_SIZE - 10);
+  assert(memcmp(buf, plain + BLOCK_SIZE, 2 * BLOCK_SIZE - 10) == 0);
+  assert(l.ops->lpread(fd, buf, 10, BLOCK_SIZE + 20, l) == 10);
+  assert(memcmp(buf, plain + BLOCK_SIZE + 20, 10) == 0);
+  assert(l.ops->lpread(fd, buf, 2 * BLOCK_SIZE, FILE_SIZE - BLOCK_SIZE - 7,
+                       l) == BLOCK_SIZE + 7);
+  assert(memcmp(buf, plain + FILE_SIZE - BLOCK_SIZE - 7, BLOCK_SIZE + 7) == 0);
+
+  // writes must start on a block boundary
+  errno = 0;
+  assert(l.ops->lpwrite(fd, plain, 10, 10, l) == -1 && errno == EINVAL);
+
+  // a short last block, and a block written past the end leaves a hole
+  assert(l.ops->lpwrite(fd, plain, 100, FILE_SIZE, l) == 100);
+  assert(l.ops->lpread(fd, buf, BLOCK_SIZE, FILE_SIZE, l) == 100);
+  assert(memcmp(buf, plain, 100) == 0);
+  assert(l.ops->lpwrite(fd, plain, BLOCK_SIZE, FILE_SIZE + 3 * BLOCK_SIZE,
+                        l) == BLOCK_SIZE);
+  assert(l.ops->lpread(fd, buf, 3 * BLOCK_SIZE, FILE_SIZE, l) ==
+         3 * BLOCK_SIZE);
+  assert(memcmp(buf, plain, 100) == 0);
+  assert(buf[100] == 0 && buf[2 * BLOCK_SIZE] == 0);
+
+  // a flipped byte of a block fails its reads, not those of other blocks
+  unsigned char byte;
+  assert(pread(fd, &byte, 1, 2 * BLOCK_SIZE + 7) == 1);
+  byte ^= 1;
+  assert(pwrite(fd, &byte, 1, 2 * BLOCK_SIZE + 7) == 1);
+  errno = 0;
+  assert(l.ops->lpread(fd, buf, BLOCK_SIZE, 2 * BLOCK_SIZE, l) == -1 &&
+         errno == EIO);
+  assert(l.ops->lpread(fd, buf, FILE_SIZE, 0, l) == -1);
+  assert(l.ops->lpread(fd, buf, 3 * BLOCK_SIZE, BLOCK_SIZE + 1, l) == -1);
+  assert(l.ops->lpread(fd, buf, BLOCK_SIZE, BLOCK_SIZE, l) == BLOCK_SIZE);
+  byte ^= 1;
+  assert(pwrite(fd, &byte, 1, 2 * BLOCK_SIZE + 7) == 1);
+  assert(l.ops->lpread(fd, buf, BLOCK_SIZE, 2 * BLOCK_SIZE, l) ==
+         BLOCK_SIZE);
+
+  // a block and its record moved elsewhere in the file do not authenticate
+  int tag_fd = open(TAGPATH, O_RDWR);
+  assert(tag_fd >= 0);
+  assert(pread(tag_fd, saved, sizeof(saved), 0) == sizeof(saved));
+  assert(pwrite(tag_fd, saved, sizeof(saved), ENCRYPTION_TAG_RECORD_SIZE) ==
+         sizeof(saved));
+  assert(pread(fd, buf, BLOCK_SIZE, 0) == BLOCK_SIZE);
+  assert(pwrite(fd, buf, BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+  assert(l.ops->lpread(fd, buf, BLOCK_SIZE, BLOCK_SIZE, l) == -1);
+  assert(l.ops->lpread(fd, buf, BLOCK_SIZE, 0, l) == BLOCK_SIZE);
+  // a dropped record fails the block too
+  memset(saved, 0, sizeof(saved));
+  assert(pwrite(tag_fd, saved, sizeof(saved), 0) == sizeof(saved));
+  assert(l.ops->lpread(fd, buf, BLOCK_SIZE, 0, l) == -1);
+  close(tag_fd);
+
+  // the tag file follows the data file
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lrename(TESTPATH, RENAMED, 0, l) == 0);
+  assert(!exists(TAGPATH) && exists(RENAMED ENCRYPTION_TAG_SUFFIX));
+  fd = l.ops->lopen(RENAMED, O_RDONLY, 0, l);
+  assert(fd >= 0);
+  assert(l.ops->lpread(fd, buf, BLOCK_SIZE, 2 * BLOCK_SIZE, l) ==
+         BLOCK_SIZE);
+  assert(memcmp(buf, plain + 2 * BLOCK_SIZE, BLOCK_SIZE) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink(RENAMED, l) == 0);
+  assert(!exists(RENAMED ENCRYPTION_TAG_SUFFIX));
+  encryption_destroy(l);
+
+  free(plain);
+  free(buf);
+}
+
+void test_encryption_aead() {
+  printf("Testing aead mode...\n");
+
+  test_aead_cipher(AEAD_CHACHA20_POLY1305);
+  test_aead_cipher(AEAD_AES_256_GCM);
+
+  printf("✅ aead mode passed\n");
+}
+
+int main() {
+  printf("Running encryption tests...\n\n");
+
+  test_encryption_sectors();
+  test_encryption_threads();
+  test_encryption_layer();
+  test_encryption_digests();
+  test_encryption_aead();
+
+  printf("\nAll encryption tests passed!\n");
+  return 0;
+}
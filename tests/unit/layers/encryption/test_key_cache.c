@@ -0,0 +1,178 @@
+#include "../../../../layers/encryption/encryption.h"
+#include "../../../../layers/encryption/key_cache.h"
+#include "../../../../layers/local/local.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TESTPATH "test_key_cache.bin"
+#define ADDR "http://127.0.0.1:1"
+
+// Fetch callback serving a configurable key, that can be held back
+static pthread_mutex_t fake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fake_cond = PTHREAD_COND_INITIALIZER;
+static int fake_held;             // fetches block while set
+static int fake_fail;             // fetches fail while set
+static const char *fake_key = ""; // key returned by the fetches
+static size_t fake_calls;
+
+static char *fake_fetch(const char *vault_addr, const char *api_key,
+                        const char *secret_path, long *lease_seconds) {
+  (void)vault_addr;
+  (void)api_key;
+  (void)secret_path;
+  *lease_seconds = 0;
+  pthread_mutex_lock(&fake_mutex);
+  fake_calls++;
+  while (fake_held) {
+    pthread_cond_wait(&fake_cond, &fake_mutex);
+  }
+  char *key = fake_fail ? NULL : strdup(fake_key);
+  pthread_mutex_unlock(&fake_mutex);
+  return key;
+}
+
+static void fake_set(int held, int fail, const char *key) {
+  pthread_mutex_lock(&fake_mutex);
+  fake_held = held;
+  fake_fail = fail;
+  fake_key = key;
+  pthread_cond_broadcast(&fake_cond);
+  pthread_mutex_unlock(&fake_mutex);
+}
+
+static long elapsed_ms(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000 +
+         (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+void test_key_cache_shared() {
+  printf("Testing shared key cache entries...\n");
+  char key[KEY_CACHE_MAX_KEY_SIZE];
+
+  // acquiring never waits for the fetch
+  fake_set(1, 0, "first key");
+  KeyCacheEntry *a =
+      key_cache_acquire(ADDR, "token", "v1/a", 60000, fake_fetch);
+  assert(a);
+  KeyCacheEntry *b =
+      key_cache_acquire(ADDR, "token", "v1/a", 60000, fake_fetch);
+  assert(b == a);
+  KeyCacheEntry *other =
+      key_cache_acquire(ADDR, "token", "v1/b", 60000, fake_fetch);
+  assert(other && other != a);
+  assert(key_cache_get(a, 50, key, sizeof(key)) == -1);
+
+  fake_set(0, 0, "first key");
+  assert(key_cache_get(a, 5000, key, sizeof(key)) == 9);
+  assert(strcmp(key, "first key") == 0);
+  assert(key_cache_get(a, 0, key, 4) == -1);
+
+  // one fetch per secret, whatever the number of layers
+  KeyCacheStats stats;
+  key_cache_get_stats(a, &stats);
+  assert(stats.fetches == 1 && stats.version == 1);
+  key_cache_release(b);
+  assert(key_cache_get(a, 0, key, sizeof(key)) == 9);
+  key_cache_release(a);
+  key_cache_release(other);
+
+  // the last release frees the entry, a new one fetches again
+  size_t calls = fake_calls;
+  a = key_cache_acquire(ADDR, "token", "v1/a", 60000, fake_fetch);
+  assert(key_cache_get(a, 5000, key, sizeof(key)) == 9);
+  assert(fake_calls == calls + 1);
+  key_cache_release(a);
+
+  key_cache_get_stats(NULL, &stats);
+  assert(stats.fetches == 0);
+  assert(key_cache_acquire(ADDR, "token", "v1/a", 0, fake_fetch) == NULL);
+
+  printf("✅ Shared key cache entries passed\n");
+}
+
+void test_key_cache_refresh() {
+  printf("Testing key cache refresh...\n");
+  char key[KEY_CACHE_MAX_KEY_SIZE];
+  KeyCacheStats stats;
+
+  // refreshed after two thirds of its 300 ms lease
+  fake_set(0, 0, "old key");
+  KeyCacheEntry *entry =
+      key_cache_acquire(ADDR, "token", "v1/refresh", 300, fake_fetch);
+  assert(key_cache_get(entry, 5000, key, sizeof(key)) == 7);
+  fake_set(0, 0, "new key");
+  for (int i = 0; i < 100; i++) {
+    key_cache_get_stats(entry, &stats);
+    if (stats.fetches >= 2) {
+      break;
+    }
+    usleep(10000);
+  }
+  assert(stats.fetches >= 2);
+  assert(stats.rotations == 1 && stats.version == 2);
+  assert(key_cache_get(entry, 0, key, sizeof(key)) == 7);
+  assert(strcmp(key, "new key") == 0);
+
+  // failed refreshes let the lease run out and the key is wiped
+  fake_set(0, 1, "new key");
+  for (int i = 0; i < 100; i++) {
+    key_cache_get_stats(entry, &stats);
+    if (stats.expired == 1) {
+      break;
+    }
+    usleep(10000);
+  }
+  assert(stats.expired == 1 && stats.failures >= 1);
+  assert(key_cache_get(entry, 0, key, sizeof(key)) == -1);
+  key_cache_release(entry);
+
+  printf("✅ Key cache refresh passed\n");
+}
+
+void test_key_cache_layer() {
+  printf("Testing encryption layer keyed from Vault...\n");
+
+  // Vault is not reachable: init does not wait for it, I/O fails once
+  // key_wait_ms ran out
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  EncryptionConfig config = {.block_size = 4096,
+                             .api_key = "token",
+                             .vault_addr = ADDR,
+                             .secret_path = "v1/secret/data/unreachable",
+                             .key_wait_ms = 100};
+  LayerContext local_layer = local_init();
+  LayerContext l = encryption_init(&local_layer, &config);
+  assert(elapsed_ms(&start) < 1000);
+
+  char buf[4096] = {0};
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  errno = 0;
+  assert(l.ops->lpwrite(fd, buf, sizeof(buf), 0, l) == -1 && errno == EIO);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  encryption_destroy(l);
+
+  printf("✅ Encryption layer keyed from Vault passed\n");
+}
+
+int main() {
+  printf("Running encryption key cache tests...\n\n");
+
+  test_key_cache_shared();
+  test_key_cache_refresh();
+  test_key_cache_layer();
+
+  printf("\nAll encryption key cache tests passed!\n");
+  return 0;
+}
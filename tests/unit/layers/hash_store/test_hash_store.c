@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+#include "../../../../layers/anti_tampering/anti_tampering.h"
+#include "../../../../layers/hash_store/hash_store.h"
+#include "../../../../layers/local/local.h"
+#include "../../../../shared/utils/layer_iov.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char store_path[] = "/tmp/test_hash_store_XXXXXX";
+
+static LayerContext store_open() {
+  HashStoreConfig config = {.path = store_path,
+                            .initial_size = HASH_STORE_DEFAULT_INITIAL_SIZE};
+  LayerContext l = hash_store_init(&config);
+  assert(l.ops);
+  return l;
+}
+
+static void store_remove() {
+  unlink(store_path);
+  char compact_path[sizeof(store_path) + sizeof(".compact")];
+  snprintf(compact_path, sizeof(compact_path), "%s.compact", store_path);
+  unlink(compact_path);
+}
+
+void test_hash_store_read_write() {
+  printf("Testing hash store reads and writes...\n");
+
+  LayerContext l = store_open();
+  int fd = l.ops->lopen("/a", O_RDWR | O_CREAT, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, "hello", 5, 0, l) == 5);
+  char buf[256];
+  assert(l.ops->lpread(fd, buf, sizeof(buf), 0, l) == 5);
+  assert(memcmp(buf, "hello", 5) == 0);
+
+  // past the capacity of the record: the record moves, the data with it
+  char big[200];
+  memset(big, 'x', sizeof(big));
+  assert(l.ops->lpwrite(fd, big, sizeof(big), 40, l) == sizeof(big));
+  assert(l.ops->lpread(fd, buf, sizeof(buf), 0, l) == 240);
+  assert(memcmp(buf, "hello\0\0\0", 8) == 0);
+  assert(memcmp(buf + 40, big, sizeof(big)) == 0);
+
+  struct stat st;
+  assert(l.ops->lfstat(fd, &st, l) == 0);
+  assert(st.st_size == 240 && S_ISREG(st.st_mode));
+  assert(l.ops->lfsync(fd, 0, l) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+
+  // O_TRUNC and O_EXCL
+  fd = l.ops->lopen("/a", O_WRONLY | O_TRUNC, 0, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, "abc", 3, 0, l) == 3);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->llstat("/a", &st, l) == 0 && st.st_size == 3);
+  errno = 0;
+  assert(l.ops->lopen("/a", O_RDWR | O_CREAT | O_EXCL, 0644, l) == -1);
+  assert(errno == EEXIST);
+  errno = 0;
+  assert(l.ops->lopen("/missing", O_RDONLY, 0, l) == -1);
+  assert(errno == ENOENT);
+
+  l.ops->ldestroy(l);
+  store_remove();
+  printf("✅ Hash store reads and writes passed\n");
+}
+
+void test_hash_store_namespace() {
+  printf("Testing hash store truncate, unlink and rename...\n");
+
+  LayerContext l = store_open();
+  struct stat st;
+  int fd = l.ops->lopen("/a", O_RDWR | O_CREAT, 0644, l);
+  assert(l.ops->lpwrite(fd, "0123456789", 10, 0, l) == 10);
+  assert(l.ops->lftruncate(fd, 4, l) == 0);
+  assert(l.ops->ltruncate("/a", 8, l) == 0);
+  char buf[8];
+  assert(l.ops->lpread(fd, buf, 8, 0, l) == 8);
+  assert(memcmp(buf, "0123\0\0\0\0", 8) == 0);
+
+  int other = l.ops->lopen("/b", O_RDWR | O_CREAT, 0644, l);
+  assert(l.ops->lclose(other, l) == 0);
+  errno = 0;
+  assert(l.ops->lrename("/a", "/b", RENAME_NOREPLACE, l) == -1);
+  assert(errno == EEXIST);
+  assert(l.ops->lrename("/a", "/b", 0, l) == 0);
+  assert(l.ops->llstat("/a", &st, l) == -1 && errno == ENOENT);
+  assert(l.ops->llstat("/b", &st, l) == 0 && st.st_size == 8);
+
+  // an unlinked file lives until its last descriptor is closed
+  assert(l.ops->lunlink("/b", l) == 0);
+  assert(l.ops->llstat("/b", &st, l) == -1 && errno == ENOENT);
+  assert(l.ops->lpread(fd, buf, 4, 0, l) == 4);
+  assert(memcmp(buf, "0123", 4) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink("/b", l) == -1 && errno == ENOENT);
+
+  l.ops->ldestroy(l);
+  store_remove();
+  printf("✅ Hash store truncate, unlink and rename passed\n");
+}
+
+void test_hash_store_persistence() {
+  printf("Testing hash store replay and compaction...\n");
+
+  LayerContext l = store_open();
+  int fd = l.ops->lopen("/kept", O_RDWR | O_CREAT, 0644, l);
+  assert(l.ops->lpwrite(fd, "kept", 4, 0, l) == 4);
+  assert(l.ops->lclose(fd, l) == 0);
+  // moved a few times, only its last record is live
+  fd = l.ops->lopen("/moved", O_RDWR | O_CREAT, 0644, l);
+  char value[1000];
+  for (size_t i = 0; i < sizeof(value); i++) {
+    value[i] = (char)i;
+  }
+  assert(l.ops->lpwrite(fd, value, sizeof(value), 0, l) == sizeof(value));
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lrename("/moved", "/renamed", 0, l) == 0);
+  fd = l.ops->lopen("/gone", O_RDWR | O_CREAT, 0644, l);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink("/gone", l) == 0);
+  l.ops->ldestroy(l);
+
+  l = store_open();
+  struct stat st;
+  char buf[sizeof(value)];
+  assert(l.ops->llstat("/moved", &st, l) == -1 && errno == ENOENT);
+  assert(l.ops->llstat("/gone", &st, l) == -1 && errno == ENOENT);
+  fd = l.ops->lopen("/renamed", O_RDONLY, 0, l);
+  assert(fd >= 0);
+  assert(l.ops->lpread(fd, buf, sizeof(buf), 0, l) == sizeof(value));
+  assert(memcmp(buf, value, sizeof(value)) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+
+  // more dead than live bytes, and enough of them: compacted at init
+  fd = l.ops->lopen("/big", O_RDWR | O_CREAT, 0644, l);
+  char *big = calloc(1, 2 << 20);
+  assert(l.ops->lpwrite(fd, big, 2 << 20, 0, l) == 2 << 20);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink("/big", l) == 0);
+  free(big);
+  l.ops->ldestroy(l);
+  struct stat before;
+  assert(stat(store_path, &before) == 0);
+
+  l = store_open();
+  struct stat after;
+  assert(stat(store_path, &after) == 0);
+  assert(after.st_size < before.st_size);
+  fd = l.ops->lopen("/kept", O_RDONLY, 0, l);
+  assert(l.ops->lpread(fd, buf, sizeof(buf), 0, l) == 4);
+  assert(memcmp(buf, "kept", 4) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->llstat("/renamed", &st, l) == 0 &&
+         st.st_size == sizeof(value));
+  l.ops->ldestroy(l);
+
+  store_remove();
+  printf("✅ Hash store replay and compaction passed\n");
+}
+
+void test_hash_store_anti_tampering() {
+  printf("Testing anti_tampering with its hashes in a hash store...\n");
+
+  char test_data_dir[] = "/tmp/test_hash_store_data_XXXXXX";
+  assert(mkdtemp(test_data_dir) != NULL);
+  char test_file_path[512];
+  snprintf(test_file_path, sizeof(test_file_path), "%s/testfile",
+           test_data_dir);
+
+  AntiTamperingConfig cfg = {
+      .hashes_storage = "/hashes",
+      .algorithm = HASH_SHA256,
+      .mode = ANTI_TAMPERING_MODE_FILE,
+  };
+  LayerContext data_layer = local_init();
+  LayerContext hash_layer = store_open();
+  LayerContext ctx = anti_tampering_init(data_layer, hash_layer, &cfg);
+
+  const char data[] = "hash store test content";
+  int fd = ctx.ops->lopen(test_file_path, O_RDWR | O_CREAT, 0644, ctx);
+  assert(fd >= 0);
+  assert(ctx.ops->lpwrite(fd, data, strlen(data), 0, ctx) ==
+         (ssize_t)strlen(data));
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+  anti_tampering_destroy(ctx);
+  hash_layer.ops->ldestroy(hash_layer);
+
+  // the hash written on close is in the store after a restart
+  hash_layer = store_open();
+  ctx = anti_tampering_init(data_layer, hash_layer, &cfg);
+  fd = ctx.ops->lopen(test_file_path, O_RDONLY, 0644, ctx);
+  assert(fd >= 0);
+  assert(layer_backing_fd(fd, ctx) >= 0); // verified
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  // tampered behind the layer's back
+  int raw_fd = open(test_file_path, O_WRONLY);
+  assert(raw_fd >= 0);
+  assert(pwrite(raw_fd, "X", 1, 0) == 1);
+  close(raw_fd);
+  fd = ctx.ops->lopen(test_file_path, O_RDONLY, 0644, ctx);
+  assert(fd >= 0);
+  assert(layer_backing_fd(fd, ctx) == -1);
+  assert(ctx.ops->lclose(fd, ctx) == 0);
+
+  assert(ctx.ops->lunlink(test_file_path, ctx) == 0);
+  anti_tampering_destroy(ctx);
+  hash_layer.ops->ldestroy(hash_layer);
+  rmdir(test_data_dir);
+  store_remove();
+  printf("✅ Anti_tampering with its hashes in a hash store passed\n");
+}
+
+int main() {
+  printf("Running hash store layer tests...\n\n");
+
+  // a fresh name for the store, created by hash_store_init
+  int fd = mkstemp(store_path);
+  assert(fd >= 0);
+  close(fd);
+  store_remove();
+
+  test_hash_store_read_write();
+  test_hash_store_namespace();
+  test_hash_store_persistence();
+  test_hash_store_anti_tampering();
+
+  printf("\nAll hash store layer tests passed!\n");
+  return 0;
+}
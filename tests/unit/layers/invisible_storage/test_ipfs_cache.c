@@ -0,0 +1,219 @@
+#include "../../../../layers/invisible_storage/ipfs_opendal/ipfs_cache.h"
+#include "../../../../layers/local/local.h"
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_DIR "test_ipfs_cache.d"
+#define OBJECT_SIZE (300 * 1024)
+#define CACHE_SIZE (2 * OBJECT_SIZE + 1000) // two objects fit, not three
+#define MAX_OBJECT (OBJECT_SIZE + 1000)
+
+static LayerContext local_layer;
+static LayerOps counted_ops;
+static int preads; // preads that reached the local layer
+
+static ssize_t counted_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                             LayerContext l) {
+  preads++;
+  return local_pread(fd, buffer, nbyte, offset, l);
+}
+
+static LayerContext cache_layer(void) {
+  IpfsOpendalConfig config = {.cache_dir = CACHE_DIR,
+                              .cache_size = CACHE_SIZE,
+                              .cache_max_object = MAX_OBJECT};
+  local_layer = local_init();
+  counted_ops = *local_layer.ops;
+  counted_ops.lpread = counted_pread;
+  counted_ops.ldestroy = NULL; // the ops copy is static
+  local_layer.ops = &counted_ops;
+  return ipfs_cache_init(&local_layer, &config);
+}
+
+static IpfsCacheState *state_of(LayerContext l) {
+  return (IpfsCacheState *)l.internal_state;
+}
+
+static void fill_pattern(unsigned char *data, size_t size, int seed) {
+  for (size_t i = 0; i < size; i++) {
+    data[i] = (unsigned char)(i * 7 + seed);
+  }
+}
+
+static void write_object(const char *path, size_t size, int seed) {
+  unsigned char *data = malloc(size);
+  fill_pattern(data, size, seed);
+  int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  assert(fd >= 0);
+  assert(write(fd, data, size) == (ssize_t)size);
+  close(fd);
+  free(data);
+}
+
+// Read path through the layer and check it holds the pattern of seed
+static void check_object(LayerContext l, const char *path, size_t size,
+                         int seed) {
+  unsigned char *expected = malloc(size);
+  unsigned char *out = malloc(size + 100);
+  fill_pattern(expected, size, seed);
+  int fd = l.ops->lopen(path, O_RDONLY, 0, l);
+  assert(fd >= 0);
+  assert(l.ops->lpread(fd, out, 100, 5, l) == 100);
+  assert(memcmp(out, expected + 5, 100) == 0);
+  assert(l.ops->lpread(fd, out, size + 100, 0, l) == (ssize_t)size);
+  assert(memcmp(out, expected, size) == 0);
+  assert(l.ops->lpread(fd, out, 100, (off_t)size, l) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  free(expected);
+  free(out);
+}
+
+static void remove_cache_dir(void) {
+  DIR *dir = opendir(CACHE_DIR);
+  if (!dir) {
+    return;
+  }
+  struct dirent *entry;
+  char path[512];
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.') {
+      snprintf(path, sizeof(path), "%s/%s", CACHE_DIR, entry->d_name);
+      unlink(path);
+    }
+  }
+  closedir(dir);
+  rmdir(CACHE_DIR);
+}
+
+void test_ipfs_cache_hits() {
+  printf("Testing reads served from the cache...\n");
+  remove_cache_dir();
+  write_object("test_ipfs_a.bin", OBJECT_SIZE, 1);
+
+  LayerContext l = cache_layer();
+  preads = 0;
+  check_object(l, "test_ipfs_a.bin", OBJECT_SIZE, 1);
+  assert(preads > 0); // copied once, whole
+  assert(state_of(l)->misses == 1 && state_of(l)->used == OBJECT_SIZE);
+
+  // another open of the same object does not reach IPFS
+  preads = 0;
+  check_object(l, "test_ipfs_a.bin", OBJECT_SIZE, 1);
+  assert(preads == 0);
+  assert(state_of(l)->hits == 1);
+
+  // objects over cache_max_object are read from IPFS every time
+  write_object("test_ipfs_big.bin", MAX_OBJECT + 1, 2);
+  check_object(l, "test_ipfs_big.bin", MAX_OBJECT + 1, 2);
+  preads = 0;
+  check_object(l, "test_ipfs_big.bin", MAX_OBJECT + 1, 2);
+  assert(preads == 3);
+  assert(state_of(l)->used == OBJECT_SIZE);
+  assert(unlink("test_ipfs_big.bin") == 0);
+
+  l.ops->ldestroy(l);
+}
+
+void test_ipfs_cache_invalidation() {
+  printf("Testing invalidation on writes...\n");
+  LayerContext l = cache_layer();
+  unsigned char buffer[100];
+  unsigned char expected[100];
+
+  int reader = l.ops->lopen("test_ipfs_a.bin", O_RDONLY, 0, l);
+  assert(reader >= 0);
+  assert(l.ops->lpread(reader, buffer, 100, 0, l) == 100);
+
+  // a write through the layer drops the copy, the open reader sees it
+  memset(expected, 0xAB, sizeof(expected));
+  int writer = l.ops->lopen("test_ipfs_a.bin", O_WRONLY, 0, l);
+  assert(writer >= 0);
+  assert(l.ops->lpwrite(writer, expected, 100, 0, l) == 100);
+  assert(l.ops->lclose(writer, l) == 0);
+  assert(state_of(l)->used == 0);
+  preads = 0;
+  assert(l.ops->lpread(reader, buffer, 100, 0, l) == 100);
+  assert(memcmp(buffer, expected, 100) == 0);
+  assert(preads == 1);
+  assert(l.ops->lclose(reader, l) == 0);
+
+  // a change made below the layer is caught by the size and mtime of open
+  preads = 0;
+  write_object("test_ipfs_a.bin", OBJECT_SIZE, 3);
+  check_object(l, "test_ipfs_a.bin", OBJECT_SIZE, 3);
+  assert(preads > 0);
+  write_object("test_ipfs_a.bin", OBJECT_SIZE - 10, 4);
+  check_object(l, "test_ipfs_a.bin", OBJECT_SIZE - 10, 4);
+  assert(state_of(l)->used == OBJECT_SIZE - 10);
+
+  // unlink drops the copy
+  assert(l.ops->lunlink("test_ipfs_a.bin", l) == 0);
+  assert(state_of(l)->used == 0);
+  assert(HASH_COUNT(state_of(l)->entries) == 0);
+
+  l.ops->ldestroy(l);
+}
+
+void test_ipfs_cache_eviction_and_reload() {
+  printf("Testing eviction and reload of the cache dir...\n");
+  write_object("test_ipfs_1.bin", OBJECT_SIZE, 11);
+  write_object("test_ipfs_2.bin", OBJECT_SIZE, 12);
+  write_object("test_ipfs_3.bin", OBJECT_SIZE, 13);
+
+  LayerContext l = cache_layer();
+  check_object(l, "test_ipfs_1.bin", OBJECT_SIZE, 11);
+  check_object(l, "test_ipfs_2.bin", OBJECT_SIZE, 12);
+  check_object(l, "test_ipfs_1.bin", OBJECT_SIZE, 11); // 2 is now the oldest
+  check_object(l, "test_ipfs_3.bin", OBJECT_SIZE, 13);
+  assert(HASH_COUNT(state_of(l)->entries) == 2);
+  assert(state_of(l)->used <= CACHE_SIZE);
+  preads = 0;
+  check_object(l, "test_ipfs_1.bin", OBJECT_SIZE, 11);
+  check_object(l, "test_ipfs_3.bin", OBJECT_SIZE, 13);
+  assert(preads == 0);
+  l.ops->ldestroy(l);
+
+  // a new instance reads the copies back, and drops the incomplete ones
+  int junk = open(CACHE_DIR "/0123456789abcdef.obj", O_CREAT | O_WRONLY,
+                  0600);
+  assert(junk >= 0 && write(junk, "junk", 4) == 4);
+  close(junk);
+  junk = open(CACHE_DIR "/0123456789abcdef.7.tmp", O_CREAT | O_WRONLY, 0600);
+  assert(junk >= 0);
+  close(junk);
+
+  l = cache_layer();
+  assert(HASH_COUNT(state_of(l)->entries) == 2);
+  assert(access(CACHE_DIR "/0123456789abcdef.obj", F_OK) != 0);
+  assert(access(CACHE_DIR "/0123456789abcdef.7.tmp", F_OK) != 0);
+  preads = 0;
+  check_object(l, "test_ipfs_3.bin", OBJECT_SIZE, 13);
+  check_object(l, "test_ipfs_1.bin", OBJECT_SIZE, 11);
+  assert(preads == 0);
+  check_object(l, "test_ipfs_2.bin", OBJECT_SIZE, 12);
+  assert(preads > 0);
+  assert(HASH_COUNT(state_of(l)->entries) == 2); // 3 was evicted
+  l.ops->ldestroy(l);
+
+  assert(unlink("test_ipfs_1.bin") == 0);
+  assert(unlink("test_ipfs_2.bin") == 0);
+  assert(unlink("test_ipfs_3.bin") == 0);
+  remove_cache_dir();
+}
+
+int main() {
+  printf("Running ipfs cache tests...\n\n");
+
+  test_ipfs_cache_hits();
+  test_ipfs_cache_invalidation();
+  test_ipfs_cache_eviction_and_reload();
+
+  printf("\nAll ipfs cache tests passed!\n");
+  return 0;
+}
@@ -0,0 +1,134 @@
+#include "../../../../layers/invisible_storage/s3_opendal/s3_parallel.h"
+#include "../../../../layers/local/local.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TESTPATH "test_s3_parallel.bin"
+#define PIECE (64 * 1024)
+#define CONCURRENCY 4
+#define FILE_SIZE (10 * PIECE + 1000)
+
+static LayerContext local_layer;
+static LayerOps counted_ops;
+static int calls;     // preads and pwrites that reached the local layer
+static int inflight;  // of them running now
+static int max_inflight;
+
+static void enter(void) {
+  __atomic_add_fetch(&calls, 1, __ATOMIC_RELAXED);
+  int now = __atomic_add_fetch(&inflight, 1, __ATOMIC_SEQ_CST);
+  int max = __atomic_load_n(&max_inflight, __ATOMIC_RELAXED);
+  while (now > max && !__atomic_compare_exchange_n(&max_inflight, &max, now,
+                                                   false, __ATOMIC_SEQ_CST,
+                                                   __ATOMIC_RELAXED)) {
+  }
+  usleep(2000); // a round trip, so that the pieces overlap
+}
+
+static void leave(void) { __atomic_sub_fetch(&inflight, 1, __ATOMIC_SEQ_CST); }
+
+static ssize_t counted_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                             LayerContext l) {
+  enter();
+  ssize_t n = local_pread(fd, buffer, nbyte, offset, l);
+  leave();
+  return n;
+}
+
+static ssize_t counted_pwrite(int fd, const void *buffer, size_t nbyte,
+                              off_t offset, LayerContext l) {
+  enter();
+  ssize_t n = local_pwrite(fd, buffer, nbyte, offset, l);
+  leave();
+  return n;
+}
+
+static LayerContext parallel_layer(void) {
+  S3OpendalConfig config = {.connections = CONCURRENCY,
+                            .part_size = PIECE,
+                            .upload_concurrency = CONCURRENCY,
+                            .range_size = PIECE,
+                            .download_concurrency = CONCURRENCY};
+  local_layer = local_init();
+  counted_ops = *local_layer.ops;
+  counted_ops.lpread = counted_pread;
+  counted_ops.lpwrite = counted_pwrite;
+  counted_ops.ldestroy = NULL; // the ops copy is static
+  local_layer.ops = &counted_ops;
+  return s3_parallel_init(&local_layer, &config);
+}
+
+static void reset_counters(void) {
+  calls = 0;
+  max_inflight = 0;
+}
+
+void test_s3_parallel_transfers() {
+  printf("Testing multipart writes and ranged reads...\n");
+
+  unsigned char *data = malloc(FILE_SIZE);
+  unsigned char *out = malloc(FILE_SIZE + 2 * PIECE);
+  for (size_t i = 0; i < FILE_SIZE; i++) {
+    data[i] = (unsigned char)(i * 31 + i / PIECE);
+  }
+
+  LayerContext l = parallel_layer();
+  int fd = l.ops->lopen(TESTPATH, O_CREAT | O_TRUNC | O_RDWR, 0644, l);
+  assert(fd >= 0);
+
+  // one part per part_size bytes, the last one shorter, some at once
+  reset_counters();
+  assert(l.ops->lpwrite(fd, data, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(calls == FILE_SIZE / PIECE + 1);
+  assert(max_inflight >= 2 && max_inflight <= CONCURRENCY);
+  int plain = open(TESTPATH, O_RDONLY);
+  assert(plain >= 0);
+  assert(pread(plain, out, FILE_SIZE, 0) == FILE_SIZE);
+  assert(memcmp(out, data, FILE_SIZE) == 0);
+  close(plain);
+
+  // ranged reads, one call per range
+  reset_counters();
+  memset(out, 0, FILE_SIZE);
+  assert(l.ops->lpread(fd, out, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(out, data, FILE_SIZE) == 0);
+  assert(calls == FILE_SIZE / PIECE + 1);
+  assert(max_inflight >= 2 && max_inflight <= CONCURRENCY);
+
+  // a read past the end stops at it, from an unaligned offset
+  memset(out, 0, FILE_SIZE);
+  assert(l.ops->lpread(fd, out, FILE_SIZE + 2 * PIECE, 100, l) ==
+         FILE_SIZE - 100);
+  assert(memcmp(out, data + 100, FILE_SIZE - 100) == 0);
+  assert(l.ops->lpread(fd, out, 3 * PIECE, FILE_SIZE, l) == 0);
+
+  // small requests go as they are
+  reset_counters();
+  assert(l.ops->lpwrite(fd, data, PIECE, 5, l) == PIECE);
+  assert(l.ops->lpread(fd, out, PIECE, 5, l) == PIECE);
+  assert(memcmp(out, data, PIECE) == 0);
+  assert(calls == 2);
+
+  struct stat st;
+  assert(l.ops->lfstat(fd, &st, l) == 0 && st.st_size == FILE_SIZE);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  l.ops->ldestroy(l);
+
+  free(data);
+  free(out);
+}
+
+int main() {
+  printf("Running s3 parallel transfer tests...\n\n");
+
+  test_s3_parallel_transfers();
+
+  printf("\nAll s3 parallel transfer tests passed!\n");
+  return 0;
+}
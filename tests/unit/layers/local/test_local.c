@@ -334,6 +334,64 @@ void test_unlink_success() {
   printf("✅ unlink success test passed\n");
 }
 
+// Records the listing of the file of test_readdir_plus
+typedef struct {
+  const char *name;
+  struct stat st;
+  unsigned int flags;
+  int seen;
+} ListedFile;
+
+static int record_entry(void *buf, const char *name, const struct stat *stbuf,
+                        off_t off, unsigned int flags) {
+  ListedFile *file = buf;
+  assert(off == 0);
+  if (strcmp(name, file->name) == 0) {
+    file->st = *stbuf;
+    file->flags = flags;
+    file->seen++;
+  }
+  return 0;
+}
+
+void test_readdir_plus() {
+  printf("Testing readdir with attributes...\n");
+
+  char dir[] = "/tmp/test_readdir_XXXXXX";
+  assert(mkdtemp(dir));
+  char path[64];
+  snprintf(path, sizeof(path), "%s/file", dir);
+  int fd = open(path, O_WRONLY | O_CREAT, 0640);
+  assert(fd != -1);
+  assert(write(fd, "content", 7) == 7);
+  close(fd);
+  LayerContext ctx = local_init();
+
+  // without LAYER_READDIR_PLUS, only the inode number and the type
+  ListedFile file = {.name = "file"};
+  assert(local_readdir(dir, &file, record_entry, 0, NULL, 0, ctx) == 0);
+  assert(file.seen == 1);
+  assert(file.flags == 0);
+  assert(S_ISREG(file.st.st_mode) && file.st.st_size == 0);
+
+  // with it, the attributes lstat gives
+  struct stat st;
+  assert(lstat(path, &st) == 0);
+  memset(&file, 0, sizeof(file));
+  file.name = "file";
+  assert(local_readdir(dir, &file, record_entry, 0, NULL, LAYER_READDIR_PLUS,
+                       ctx) == 0);
+  assert(file.seen == 1);
+  assert(file.flags == LAYER_FILL_DIR_PLUS);
+  assert(file.st.st_ino == st.st_ino && file.st.st_dev == st.st_dev);
+  assert(file.st.st_mode == st.st_mode && file.st.st_size == 7);
+
+  unlink(path);
+  rmdir(dir);
+  free(ctx.ops);
+  printf("✅ readdir with attributes test passed\n");
+}
+
 int main() {
   printf("Running local layer tests...\n");
   printf("Running ftruncate tests...\n");
@@ -348,6 +406,7 @@ int main() {
   test_lstat_success();
   test_lstat_symlink();
   test_unlink_success();
+  test_readdir_plus();
 
   printf("All local_ftruncate tests passed!\n");
   printf("\n🎉All local layer tests passed!\n");
@@ -0,0 +1,221 @@
+#include "../../../../layers/local/local_uring.h"
+#include "../../../../shared/utils/layer_async.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TESTPATH "test_local_uring.txt"
+#define N_ASYNC 64
+#define ASYNC_CHUNK 512
+
+static LocalConfig uring_config() {
+  LocalConfig config;
+  memset(&config, 0, sizeof(config));
+  config.mode = LOCAL_MODE_URING;
+  config.uring_entries = 8;
+  config.uring_sqpoll_idle_ms = LOCAL_URING_DEFAULT_SQPOLL_IDLE_MS;
+  config.uring_fixed_buffer_size = LOCAL_URING_DEFAULT_FIXED_BUFFER_SIZE;
+  return config;
+}
+
+static void check_read_write(LayerContext l) {
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+
+  assert(l.ops->lpwrite(fd, "hello uring", 11, 0, l) == 11);
+  char buf[32] = {0};
+  assert(l.ops->lpread(fd, buf, sizeof(buf), 0, l) == 11);
+  assert(memcmp(buf, "hello uring", 11) == 0);
+  // reads past the end of the file return 0
+  assert(l.ops->lpread(fd, buf, sizeof(buf), 100, l) == 0);
+
+  struct iovec out[] = {{"abc", 3}, {"defg", 4}};
+  assert(l.ops->lpwritev(fd, out, 2, 11, l) == 7);
+  char a[5], b[13];
+  struct iovec in[] = {{a, sizeof(a)}, {b, sizeof(b)}};
+  assert(l.ops->lpreadv(fd, in, 2, 0, l) == 18);
+  assert(memcmp(a, "hello", 5) == 0);
+  assert(memcmp(b, " uringabcdefg", 13) == 0);
+
+  assert(l.ops->lfsync(fd, 0, l) == 0);
+  assert(l.ops->lfsync(fd, 1, l) == 0);
+
+  // failures surface as -1 with errno
+  errno = 0;
+  assert(l.ops->lpread(-1, buf, sizeof(buf), 0, l) == -1);
+  assert(errno == EBADF);
+
+  assert(l.ops->lclose(fd, l) == 0);
+  unlink(TESTPATH);
+}
+
+void test_local_uring_read_write() {
+  printf("Testing io_uring reads and writes...\n");
+
+  LocalConfig config = uring_config();
+  LayerContext l = local_uring_init(&config);
+  LocalUringState *state = (LocalUringState *)l.internal_state;
+  if (state->ring_fd < 0) {
+    printf("io_uring unavailable, checking the system call fallback\n");
+  }
+  check_read_write(l);
+
+  l.ops->ldestroy(l);
+  printf("✅ io_uring reads and writes passed\n");
+}
+
+void test_local_uring_registered() {
+  printf("Testing registered files and buffers...\n");
+
+  LocalConfig config = uring_config();
+  config.uring_registered_files = 64;
+  config.uring_fixed_buffers = 2;
+  config.uring_fixed_buffer_size = 4096;
+  LayerContext l = local_uring_init(&config);
+  LocalUringState *state = (LocalUringState *)l.internal_state;
+  if (state->ring_fd < 0) {
+    printf("io_uring unavailable, skipping\n");
+    l.ops->ldestroy(l);
+    return;
+  }
+  check_read_write(l);
+
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+  if (fd < state->n_files) {
+    assert(state->file_registered[fd]);
+  }
+
+  char *first = local_uring_buffer_get(l);
+  char *second = local_uring_buffer_get(l);
+  assert(first != NULL && second != NULL && first != second);
+  assert(local_uring_buffer_get(l) == NULL);
+
+  memset(first, 'x', 4096);
+  assert(l.ops->lpwrite(fd, first, 4096, 0, l) == 4096);
+  // the tail of a registered buffer is still a fixed buffer read
+  assert(l.ops->lpread(fd, second + 96, 4000, 96, l) == 4000);
+  assert(memcmp(second + 96, first, 4000) == 0);
+
+  local_uring_buffer_put(l, first);
+  assert(local_uring_buffer_get(l) == first);
+  local_uring_buffer_put(l, first);
+  local_uring_buffer_put(l, second);
+
+  assert(l.ops->lclose(fd, l) == 0);
+  if (fd < state->n_files) {
+    assert(!state->file_registered[fd]);
+  }
+  unlink(TESTPATH);
+
+  l.ops->ldestroy(l);
+  printf("✅ Registered files and buffers passed\n");
+}
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int completed;
+  int failed;
+} AsyncProgress;
+
+static void on_complete(ssize_t res, void *ctx) {
+  AsyncProgress *progress = ctx;
+  pthread_mutex_lock(&progress->mutex);
+  if (res != ASYNC_CHUNK) {
+    progress->failed++;
+  }
+  progress->completed++;
+  pthread_cond_signal(&progress->cond);
+  pthread_mutex_unlock(&progress->mutex);
+}
+
+static void wait_completed(AsyncProgress *progress, int n) {
+  pthread_mutex_lock(&progress->mutex);
+  while (progress->completed < n) {
+    pthread_cond_wait(&progress->cond, &progress->mutex);
+  }
+  pthread_mutex_unlock(&progress->mutex);
+}
+
+void test_local_uring_async() {
+  printf("Testing asynchronous submission...\n");
+
+  // more requests than ring entries, submitters wait for free slots
+  LocalConfig config = uring_config();
+  LayerContext l = local_uring_init(&config);
+  LocalUringState *state = (LocalUringState *)l.internal_state;
+  assert(layer_has_native_async(l) == (state->ring_fd >= 0));
+
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, l);
+  assert(fd >= 0);
+
+  char *out = malloc(N_ASYNC * ASYNC_CHUNK);
+  char *in = calloc(N_ASYNC, ASYNC_CHUNK);
+  for (int i = 0; i < N_ASYNC * ASYNC_CHUNK; i++) {
+    out[i] = (char)(i % 251);
+  }
+
+  AsyncProgress progress = {PTHREAD_MUTEX_INITIALIZER,
+                            PTHREAD_COND_INITIALIZER, 0, 0};
+  for (int i = 0; i < N_ASYNC; i++) {
+    assert(layer_pwrite_async(fd, out + i * ASYNC_CHUNK, ASYNC_CHUNK,
+                              i * ASYNC_CHUNK, on_complete, &progress,
+                              l) == 0);
+  }
+  wait_completed(&progress, N_ASYNC);
+  assert(progress.failed == 0);
+
+  progress.completed = 0;
+  for (int i = N_ASYNC - 1; i >= 0; i--) {
+    assert(layer_pread_async(fd, in + i * ASYNC_CHUNK, ASYNC_CHUNK,
+                             i * ASYNC_CHUNK, on_complete, &progress, l) == 0);
+  }
+  wait_completed(&progress, N_ASYNC);
+  assert(progress.failed == 0);
+  assert(memcmp(in, out, N_ASYNC * ASYNC_CHUNK) == 0);
+
+  assert(l.ops->lclose(fd, l) == 0);
+  unlink(TESTPATH);
+  free(out);
+  free(in);
+
+  l.ops->ldestroy(l);
+  printf("✅ Asynchronous submission passed\n");
+}
+
+void test_local_uring_sqpoll() {
+  printf("Testing submission queue polling...\n");
+
+  // falls back to a plain ring when polling is not permitted
+  LocalConfig config = uring_config();
+  config.uring_sqpoll = true;
+  config.uring_sqpoll_idle_ms = 10;
+  config.uring_registered_files = 64;
+  LayerContext l = local_uring_init(&config);
+
+  check_read_write(l);
+  // let the poller go idle, the next submission has to wake it up
+  usleep(50 * 1000);
+  check_read_write(l);
+
+  l.ops->ldestroy(l);
+  printf("✅ Submission queue polling passed\n");
+}
+
+int main() {
+  printf("Running local io_uring tests...\n\n");
+
+  test_local_uring_read_write();
+  test_local_uring_registered();
+  test_local_uring_async();
+  test_local_uring_sqpoll();
+
+  printf("\nAll local io_uring tests passed!\n");
+  return 0;
+}
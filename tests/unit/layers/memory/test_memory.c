@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include "../../../../layers/memory/memory.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+void test_memory_read_write() {
+  printf("Testing memory reads and writes...\n");
+
+  LayerContext l = memory_init();
+  assert(l.ops);
+
+  int fd = l.ops->lopen("/a", O_RDWR | O_CREAT, 0600, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, "hello", 5, 0, l) == 5);
+  // a write past the end leaves a hole of zeros
+  assert(l.ops->lpwrite(fd, "world", 5, 10000, l) == 5);
+
+  char buf[16];
+  assert(l.ops->lpread(fd, buf, 5, 0, l) == 5);
+  assert(memcmp(buf, "hello", 5) == 0);
+  assert(l.ops->lpread(fd, buf, 4, 5, l) == 4);
+  assert(memcmp(buf, "\0\0\0\0", 4) == 0);
+  // short read at the end, nothing past it
+  assert(l.ops->lpread(fd, buf, sizeof(buf), 10002, l) == 3);
+  assert(memcmp(buf, "rld", 3) == 0);
+  assert(l.ops->lpread(fd, buf, sizeof(buf), 20000, l) == 0);
+
+  struct stat st;
+  assert(l.ops->lfstat(fd, &st, l) == 0);
+  assert(st.st_size == 10005);
+  assert(S_ISREG(st.st_mode) && (st.st_mode & 0777) == 0600);
+  assert(l.ops->lfsync(fd, 0, l) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+
+  // the data outlives the descriptor
+  fd = l.ops->lopen("/a", O_RDONLY, 0, l);
+  assert(fd >= 0);
+  assert(l.ops->lpread(fd, buf, 5, 0, l) == 5);
+  assert(memcmp(buf, "hello", 5) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+
+  l.ops->ldestroy(l);
+  printf("✅ Memory reads and writes passed\n");
+}
+
+void test_memory_open_flags() {
+  printf("Testing memory open flags...\n");
+
+  LayerContext l = memory_init();
+
+  errno = 0;
+  assert(l.ops->lopen("/missing", O_RDONLY, 0, l) == -1);
+  assert(errno == ENOENT);
+
+  int fd = l.ops->lopen("/f", O_WRONLY | O_CREAT | O_EXCL, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, "data", 4, 0, l) == 4);
+  errno = 0;
+  assert(l.ops->lopen("/f", O_WRONLY | O_CREAT | O_EXCL, 0644, l) == -1);
+  assert(errno == EEXIST);
+
+  // O_TRUNC empties the file, for every descriptor of it
+  int fd2 = l.ops->lopen("/f", O_WRONLY | O_TRUNC, 0, l);
+  assert(fd2 >= 0 && fd2 != fd);
+  struct stat st;
+  assert(l.ops->lfstat(fd, &st, l) == 0);
+  assert(st.st_size == 0);
+
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lclose(fd2, l) == 0);
+  errno = 0;
+  assert(l.ops->lclose(fd, l) == -1);
+  assert(errno == EBADF);
+  char c;
+  assert(l.ops->lpread(fd, &c, 1, 0, l) == -1);
+  assert(errno == EBADF);
+
+  l.ops->ldestroy(l);
+  printf("✅ Memory open flags passed\n");
+}
+
+void test_memory_namespace() {
+  printf("Testing memory truncate, unlink and rename...\n");
+
+  LayerContext l = memory_init();
+  struct stat st;
+
+  int fd = l.ops->lopen("/a", O_RDWR | O_CREAT, 0644, l);
+  assert(l.ops->lpwrite(fd, "0123456789", 10, 0, l) == 10);
+  assert(l.ops->lftruncate(fd, 4, l) == 0);
+  assert(l.ops->llstat("/a", &st, l) == 0);
+  assert(st.st_size == 4);
+  assert(l.ops->ltruncate("/a", 8, l) == 0);
+  char buf[8];
+  assert(l.ops->lpread(fd, buf, 8, 0, l) == 8);
+  assert(memcmp(buf, "0123\0\0\0\0", 8) == 0);
+
+  // rename over an existing file replaces it, unless RENAME_NOREPLACE
+  int other = l.ops->lopen("/b", O_RDWR | O_CREAT, 0644, l);
+  assert(l.ops->lclose(other, l) == 0);
+  errno = 0;
+  assert(l.ops->lrename("/a", "/b", RENAME_NOREPLACE, l) == -1);
+  assert(errno == EEXIST);
+  assert(l.ops->lrename("/a", "/b", 0, l) == 0);
+  assert(l.ops->llstat("/a", &st, l) == -1 && errno == ENOENT);
+  assert(l.ops->llstat("/b", &st, l) == 0);
+  assert(st.st_size == 8);
+
+  // an unlinked file lives until its last descriptor is closed
+  assert(l.ops->lunlink("/b", l) == 0);
+  assert(l.ops->llstat("/b", &st, l) == -1 && errno == ENOENT);
+  assert(l.ops->lpread(fd, buf, 4, 0, l) == 4);
+  assert(memcmp(buf, "0123", 4) == 0);
+  assert(l.ops->lfstat(fd, &st, l) == 0);
+  assert(st.st_nlink == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink("/b", l) == -1 && errno == ENOENT);
+
+  // layers don't share their files
+  LayerContext l2 = memory_init();
+  fd = l.ops->lopen("/shared", O_RDWR | O_CREAT, 0644, l);
+  assert(l2.ops->llstat("/shared", &st, l2) == -1 && errno == ENOENT);
+
+  // destroy frees the files left open
+  l2.ops->ldestroy(l2);
+  l.ops->ldestroy(l);
+  printf("✅ Memory truncate, unlink and rename passed\n");
+}
+
+int main() {
+  printf("Running memory layer tests...\n\n");
+
+  test_memory_read_write();
+  test_memory_open_flags();
+  test_memory_namespace();
+
+  printf("\nAll memory layer tests passed!\n");
+  return 0;
+}
@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+#include "../../../../layers/memory/memory.h"
+#include "../../../../layers/qos/qos.h"
+#include "../../../../shared/utils/metrics.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_TEST_FDS 1024
+
+/*
+ * Next layer of the scheduling tests: the memory layer, with reads that
+ * take delay_us, log the first letter of their file in dispatch order, and
+ * of which the first one can be held until held is cleared
+ */
+static LayerContext memory;
+static char letters[MAX_TEST_FDS];
+static char order[64];
+static int norder;
+static int delay_us;
+static int hold;          // hold the next read
+static int held;          // a read is held
+static pthread_mutex_t order_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int slow_open(const char *pathname, int flags, mode_t mode,
+                     LayerContext l) {
+  (void)l;
+  int fd = memory.ops->lopen(pathname, flags, mode, memory);
+  if (fd >= 0 && fd < MAX_TEST_FDS) {
+    letters[fd] = pathname[1];
+  }
+  return fd;
+}
+
+static int slow_close(int fd, LayerContext l) {
+  (void)l;
+  return memory.ops->lclose(fd, memory);
+}
+
+static ssize_t slow_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                          LayerContext l) {
+  (void)l;
+  pthread_mutex_lock(&order_mutex);
+  if (norder < (int)sizeof(order)) {
+    order[norder++] = letters[fd];
+  }
+  int wait = hold;
+  hold = 0;
+  pthread_mutex_unlock(&order_mutex);
+  if (wait) {
+    __atomic_store_n(&held, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&held, __ATOMIC_SEQ_CST)) {
+      usleep(1000);
+    }
+  }
+  if (delay_us) {
+    usleep((useconds_t)delay_us);
+  }
+  return memory.ops->lpread(fd, buffer, nbyte, offset, memory);
+}
+
+static ssize_t slow_pwrite(int fd, const void *buffer, size_t nbyte,
+                           off_t offset, LayerContext l) {
+  (void)l;
+  return memory.ops->lpwrite(fd, buffer, nbyte, offset, memory);
+}
+
+static LayerContext slow_layer(void) {
+  static LayerOps ops = {.lpread = slow_pread,
+                         .lpwrite = slow_pwrite,
+                         .lopen = slow_open,
+                         .lclose = slow_close};
+  memory = memory_init();
+  assert(memory.ops);
+  norder = 0;
+  delay_us = 0;
+  LayerContext l = {.ops = &ops};
+  return l;
+}
+
+static QosClassConfig qos_class(const char *name, int weight) {
+  QosClassConfig cls = {.name = (char *)name,
+                        .weight = weight,
+                        .uid = -1,
+                        .burst_ms = QOS_DEFAULT_BURST_MS};
+  return cls;
+}
+
+static LayerContext qos_over(LayerContext *next, QosClassConfig *classes,
+                             int nclasses, int max_inflight) {
+  QosConfig config = {.classes = classes,
+                      .nclasses = nclasses,
+                      .max_inflight = max_inflight,
+                      .window_ms = 20};
+  LayerContext l = qos_init(next, &config);
+  assert(l.ops);
+  return l;
+}
+
+static const QosClassStats *class_stats(QosStats *stats, const char *name) {
+  for (int c = 0; c < stats->nclasses; c++) {
+    if (strcmp(stats->names[c], name) == 0) {
+      return &stats->classes[c];
+    }
+  }
+  assert(0);
+  return NULL;
+}
+
+static int open_file(LayerContext l, const char *path) {
+  int fd = l.ops->lopen(path, O_RDWR | O_CREAT, 0644, l);
+  assert(fd >= 0);
+  return fd;
+}
+
+void test_qos_classes() {
+  printf("Testing the classes of qos fds...\n");
+
+  LayerContext next = memory_init();
+  QosClassConfig classes[3] = {qos_class("db", 4), qos_class("tenant", 1),
+                               qos_class(QOS_DEFAULT_CLASS, 1)};
+  classes[0].path_prefix = "/db/";
+  classes[1].uid = (long)geteuid() + 1;
+  LayerContext l = qos_over(&next, classes, 3, 8);
+
+  // prefixes match whole components
+  int db = open_file(l, "/db");
+  int db_file = open_file(l, "/db/table");
+  int dbx = open_file(l, "/dbx");
+  // the uid is the one of the caller the frontend sets
+  qos_set_caller(geteuid() + 1, getpid());
+  int tenant = open_file(l, "/tenant");
+  int tenant_db = open_file(l, "/db/other"); // first match wins
+  qos_set_caller(geteuid(), getpid());
+  int own = open_file(l, "/own");
+
+  char buf[16] = "0123456789";
+  int fds[6] = {db, db_file, dbx, tenant, tenant_db, own};
+  for (int i = 0; i < 6; i++) {
+    assert(l.ops->lpwrite(fds[i], buf, 10, 0, l) == 10);
+    assert(l.ops->lpread(fds[i], buf, 4, 0, l) == 4);
+    assert(l.ops->lfsync(fds[i], 0, l) == 0);
+  }
+
+  QosStats stats;
+  qos_get_stats(l, &stats);
+  assert(stats.nclasses == 3);
+  assert(class_stats(&stats, "db")->ops == 3 * 3);
+  assert(class_stats(&stats, "db")->bytes == 3 * 14);
+  assert(class_stats(&stats, "tenant")->ops == 3);
+  assert(class_stats(&stats, QOS_DEFAULT_CLASS)->ops == 2 * 3);
+  assert(class_stats(&stats, "db")->queued == 0);
+  assert(stats.other_limit == 8);
+
+  for (int i = 0; i < 6; i++) {
+    assert(l.ops->lclose(fds[i], l) == 0);
+  }
+  l.ops->ldestroy(l);
+  next.ops->ldestroy(next);
+  printf("✅ Classes of qos fds passed\n");
+}
+
+void test_qos_rate_limits() {
+  printf("Testing the token buckets of qos classes...\n");
+
+  LayerContext next = memory_init();
+  QosClassConfig classes[3] = {qos_class("bytes", 1), qos_class("iops", 1),
+                               qos_class(QOS_DEFAULT_CLASS, 1)};
+  classes[0].path_prefix = "/bytes";
+  classes[0].bytes_per_sec = 1 << 20;
+  classes[0].burst_ms = 50;
+  classes[1].path_prefix = "/iops";
+  classes[1].iops = 100;
+  classes[1].burst_ms = 10;
+  LayerContext l = qos_over(&next, classes, 3, 8);
+
+  // 320 KiB at 1 MiB/s, the first 51 KiB from the full bucket
+  int fd = open_file(l, "/bytes");
+  char *data = calloc(1, 32 << 10);
+  uint64_t start = metrics_now();
+  for (int i = 0; i < 10; i++) {
+    assert(l.ops->lpwrite(fd, data, 32 << 10, (off_t)i << 15, l) ==
+           32 << 10);
+  }
+  uint64_t elapsed = metrics_now() - start;
+  assert(elapsed >= 200000000ULL);
+  assert(l.ops->lclose(fd, l) == 0);
+
+  // 21 requests at 100 per second, the first one from the bucket
+  fd = open_file(l, "/iops");
+  start = metrics_now();
+  for (int i = 0; i < 21; i++) {
+    assert(l.ops->lpread(fd, data, 1, 0, l) == 0);
+  }
+  elapsed = metrics_now() - start;
+  assert(elapsed >= 180000000ULL);
+  assert(l.ops->lclose(fd, l) == 0);
+
+  // the other classes are not held
+  fd = open_file(l, "/other");
+  start = metrics_now();
+  for (int i = 0; i < 10; i++) {
+    assert(l.ops->lpwrite(fd, data, 32 << 10, (off_t)i << 15, l) ==
+           32 << 10);
+  }
+  assert(metrics_now() - start < 100000000ULL);
+  assert(l.ops->lclose(fd, l) == 0);
+
+  QosStats stats;
+  qos_get_stats(l, &stats);
+  assert(class_stats(&stats, "bytes")->throttled > 0);
+  assert(class_stats(&stats, "bytes")->throttle_ns >= 150000000ULL);
+  assert(class_stats(&stats, "iops")->throttled > 0);
+  assert(class_stats(&stats, QOS_DEFAULT_CLASS)->throttled == 0);
+
+  free(data);
+  l.ops->ldestroy(l);
+  next.ops->ldestroy(next);
+  printf("✅ Token buckets of qos classes passed\n");
+}
+
+typedef struct {
+  LayerContext l;
+  int fd;
+  volatile int *stop; // loop until set, one read if NULL
+} Reader;
+
+static void *reader(void *arg) {
+  Reader *r = (Reader *)arg;
+  char buf[16];
+  do {
+    assert(r->l.ops->lpread(r->fd, buf, sizeof(buf), 0, r->l) >= 0);
+  } while (r->stop && !*r->stop);
+  return NULL;
+}
+
+void test_qos_fair_queuing() {
+  printf("Testing the fair queuing of qos classes...\n");
+
+  LayerContext next = slow_layer();
+  QosClassConfig classes[3] = {qos_class("a", 3), qos_class("b", 1),
+                               qos_class(QOS_DEFAULT_CLASS, 1)};
+  classes[0].path_prefix = "/a";
+  classes[1].path_prefix = "/b";
+  LayerContext l = qos_over(&next, classes, 3, 1);
+  int fd_a = open_file(l, "/a");
+  int fd_b = open_file(l, "/b");
+
+  // one read of a holds the next layer while both classes queue theirs
+  hold = 1;
+  Reader first = {.l = l, .fd = fd_a};
+  pthread_t first_thread;
+  assert(pthread_create(&first_thread, NULL, reader, &first) == 0);
+  while (!__atomic_load_n(&held, __ATOMIC_SEQ_CST)) {
+    usleep(1000);
+  }
+  Reader readers[16];
+  pthread_t threads[16];
+  for (int i = 0; i < 16; i++) {
+    readers[i] = (Reader){.l = l, .fd = i % 2 ? fd_b : fd_a};
+    assert(pthread_create(&threads[i], NULL, reader, &readers[i]) == 0);
+  }
+  QosStats stats;
+  do {
+    usleep(1000);
+    qos_get_stats(l, &stats);
+  } while (class_stats(&stats, "a")->queued < 8 ||
+           class_stats(&stats, "b")->queued < 8);
+  __atomic_store_n(&held, 0, __ATOMIC_SEQ_CST);
+
+  pthread_join(first_thread, NULL);
+  for (int i = 0; i < 16; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // while both are busy, a gets 3 requests of 4
+  assert(norder == 17);
+  assert(order[0] == 'a');
+  int a = 0;
+  for (int i = 1; i <= 8; i++) {
+    a += order[i] == 'a';
+  }
+  assert(a == 6);
+  // then b has the next layer to itself
+  assert(memcmp(order + 12, "bbbbb", 5) == 0);
+
+  assert(l.ops->lclose(fd_a, l) == 0);
+  assert(l.ops->lclose(fd_b, l) == 0);
+  l.ops->ldestroy(l);
+  memory.ops->ldestroy(memory);
+  printf("✅ Fair queuing of qos classes passed\n");
+}
+
+void test_qos_latency_target() {
+  printf("Testing the latency target of a qos class...\n");
+
+  LayerContext next = slow_layer();
+  QosClassConfig classes[2] = {qos_class("db", 1),
+                               qos_class(QOS_DEFAULT_CLASS, 1)};
+  classes[0].path_prefix = "/db";
+  classes[0].p99_us = 500;
+  LayerContext l = qos_over(&next, classes, 2, 8);
+  int fd_db = open_file(l, "/db");
+  int fd_batch = open_file(l, "/batch");
+
+  // reads of 2 ms miss the target of 0.5 ms, the batch class is held
+  // to fewer and fewer requests in the next layer
+  delay_us = 2000;
+  volatile int stop = 0;
+  Reader readers[8];
+  pthread_t threads[8];
+  for (int i = 0; i < 8; i++) {
+    readers[i] = (Reader){.l = l, .fd = i % 2 ? fd_batch : fd_db,
+                          .stop = &stop};
+    assert(pthread_create(&threads[i], NULL, reader, &readers[i]) == 0);
+  }
+  usleep(300000);
+  stop = 1;
+  for (int i = 0; i < 8; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  QosStats stats;
+  qos_get_stats(l, &stats);
+  assert(stats.other_limit == 1);
+  assert(stats.p99_ns >= 2000000ULL);
+  assert(class_stats(&stats, QOS_DEFAULT_CLASS)->queued > 0);
+
+  // a window without reads of db gives the batch class its requests back
+  delay_us = 0;
+  char buf[16];
+  for (int i = 0; i < 2; i++) {
+    usleep(30000);
+    assert(l.ops->lpread(fd_batch, buf, sizeof(buf), 0, l) == 0);
+  }
+  qos_get_stats(l, &stats);
+  assert(stats.other_limit == 8);
+
+  assert(l.ops->lclose(fd_db, l) == 0);
+  assert(l.ops->lclose(fd_batch, l) == 0);
+  l.ops->ldestroy(l);
+  memory.ops->ldestroy(memory);
+  printf("✅ Latency target of a qos class passed\n");
+}
+
+int main() {
+  printf("Running qos layer tests...\n\n");
+
+  test_qos_classes();
+  test_qos_rate_limits();
+  test_qos_fair_queuing();
+  test_qos_latency_target();
+
+  printf("\nAll qos layer tests passed!\n");
+  return 0;
+}
@@ -4,18 +4,44 @@
  * their purpose, because, for example, the block frontiers change.
  */
 
+#define _GNU_SOURCE
 #include "../../../../layers/block_align/block_align.h"
 #include "../../../../layers/cache/read_cache/read_cache.h"
 #include "../../../../layers/local/local.h"
 #include "types/layer_context.h"
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <time.h>
 
 #define TESTPATH "test_file.txt"
 
+// Read cache slot of an open fd
+static FdInode *fd_slot(ReadCacheState *state, int fd) {
+  return fd_table_get(&state->fd_to_inode, fd);
+}
+
+static void remove_dir(const char *dir) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] != '.') {
+      char path[512];
+      snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+      unlink(path);
+    }
+  }
+  closedir(d);
+  rmdir(dir);
+}
+
 void fill_file(int fd, size_t block_size) {
   char *buffer = malloc(block_size * sizeof(char));
   int i, j;
@@ -718,11 +744,441 @@ void test_unlink_opened_file(LayerContext l) {
   printf("✅ Unlinking opened file test passed\n");
 }
 
+#define CONCURRENT_THREADS 8
+#define CONCURRENT_ROUNDS 200
+
+typedef struct {
+  LayerContext l;
+  int id;
+} ConcurrentArgs;
+
+static void *open_read_close(void *arg) {
+  ConcurrentArgs *args = arg;
+  char path[64];
+  char buffer[40];
+  snprintf(path, sizeof(path), "test_file_%d.txt", args->id);
+
+  int fd = args->l.ops->lopen(path, O_RDWR | O_CREAT | O_TRUNC, 0666, args->l);
+  assert(fd >= 0);
+  fill_file(fd, 16);
+  assert(args->l.ops->lclose(fd, args->l) == 0);
+
+  // every open registers the same inode, reads fill and hit the cache
+  for (int i = 0; i < CONCURRENT_ROUNDS; i++) {
+    fd = args->l.ops->lopen(path, O_RDWR, 0666, args->l);
+    assert(fd >= 0);
+    assert(args->l.ops->lpread(fd, buffer, 40, 0, args->l) == 40);
+    assert(buffer[0] == '0' && buffer[16] == '1' && buffer[39] == '2');
+    assert(args->l.ops->lclose(fd, args->l) == 0);
+  }
+  assert(args->l.ops->lunlink(path, args->l) == 0);
+  return NULL;
+}
+
+void test_concurrent_open_close(LayerContext l) {
+  printf("Testing concurrent opens and closes\n");
+
+  pthread_t threads[CONCURRENT_THREADS];
+  ConcurrentArgs args[CONCURRENT_THREADS];
+  for (int i = 0; i < CONCURRENT_THREADS; i++) {
+    args[i].l = l;
+    args[i].id = i;
+    assert(pthread_create(&threads[i], NULL, open_read_close, &args[i]) == 0);
+  }
+  for (int i = 0; i < CONCURRENT_THREADS; i++)
+    pthread_join(threads[i], NULL);
+
+  // fds never opened through the layer are rejected
+  LayerContext read_cache = *l.next_layers;
+  char buffer[16];
+  errno = 0;
+  assert(read_cache.ops->lpread(12345, buffer, 16, 0, read_cache) == -1);
+  assert(errno == EBADF);
+  assert(read_cache.ops->lclose(-1, read_cache) == -1 && errno == EBADF);
+
+  printf("✅ Concurrent opens and closes test passed\n");
+}
+
+void test_sequential_readahead() {
+  printf("Testing read-ahead of sequential reads\n");
+
+  // 64 cached blocks, so windows of up to 16 blocks
+  LayerContext local = local_init();
+  ReadCacheLayerConfig config = {
+      .block_size = 16, .num_blocks = 64, .readahead_blocks = 32};
+  LayerContext l = read_cache_init(&local, 1, &config);
+  ReadCacheState *state = (ReadCacheState *)l.internal_state;
+  assert(state->readahead_max == 16);
+
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0666, l);
+  char block[16];
+  for (int i = 0; i < 40; i++) {
+    memset(block, 'a' + (i % 26), sizeof(block));
+    assert(l.ops->lpwrite(fd, block, sizeof(block), i * 16, l) == 16);
+  }
+
+  // reading blocks 0 and 1 starts a stream and prefetches the next ones
+  char buffer[16];
+  assert(l.ops->lpread(fd, buffer, 16, 0, l) == 16);
+  assert(l.ops->lpread(fd, buffer, 16, 16, l) == 16);
+  ReadaheadStats stats;
+  for (int i = 0; i < 100; i++) {
+    read_cache_get_readahead_stats(l, &stats);
+    if (stats.blocks >= 4)
+      break;
+    usleep(10000);
+  }
+  assert(stats.requests >= 1 && stats.blocks >= 4);
+  CacheKey key = {.dev = fd_slot(state, fd)->dev,
+                  .inode = fd_slot(state, fd)->inode,
+                  .epoch = fd_slot(state, fd)->info->epoch,
+                  .block = 4};
+  assert(state->ops.contain_item(state->cache_wrapper, &key, sizeof(key)));
+  assert(fd_slot(state, fd)->window == 8);
+
+  // the prefetched blocks hold the file's content, up to its end
+  for (int i = 2; i < 40; i++) {
+    assert(l.ops->lpread(fd, buffer, 16, i * 16, l) == 16);
+    assert(buffer[0] == 'a' + (i % 26) && buffer[15] == 'a' + (i % 26));
+  }
+  assert(fd_slot(state, fd)->window == 16);
+
+  // random reads shrink the window
+  assert(l.ops->lpread(fd, buffer, 16, 5 * 16, l) == 16);
+  assert(l.ops->lpread(fd, buffer, 16, 30 * 16, l) == 16);
+  assert(fd_slot(state, fd)->window == 4);
+
+  // a write drops the blocks a prefetch read before it
+  memset(block, 'Z', sizeof(block));
+  assert(l.ops->lpwrite(fd, block, sizeof(block), 39 * 16, l) == 16);
+  assert(l.ops->lpread(fd, buffer, 16, 39 * 16, l) == 16);
+  assert(buffer[0] == 'Z');
+
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  read_cache_destroy(l);
+
+  printf("✅ Read-ahead of sequential reads test passed\n");
+}
+
+void test_invalidation() {
+  printf("Testing the invalidation of whole files\n");
+
+  LayerContext local = local_init();
+  ReadCacheLayerConfig config = {.block_size = 16, .num_blocks = 256};
+  LayerContext l = read_cache_init(&local, 1, &config);
+  ReadCacheState *state = (ReadCacheState *)l.internal_state;
+
+  // cache more blocks than a truncate removes one by one
+  int blocks = READ_CACHE_REMOVE_BLOCKS + 8;
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0666, l);
+  char block[16], buffer[16];
+  memset(block, 'a', sizeof(block));
+  for (int i = 0; i < blocks; i++)
+    assert(l.ops->lpwrite(fd, block, 16, i * 16, l) == 16);
+  for (int i = 0; i < blocks; i++)
+    assert(l.ops->lpread(fd, buffer, 16, i * 16, l) == 16);
+  uint64_t epoch = fd_slot(state, fd)->info->epoch;
+  assert(epoch != 0);
+  CacheKey key = {.dev = fd_slot(state, fd)->dev,
+                  .inode = fd_slot(state, fd)->inode,
+                  .epoch = epoch,
+                  .block = 1};
+  assert(state->ops.contain_item(state->cache_wrapper, &key, sizeof(key)));
+
+  // a truncate of a few blocks keeps the epoch, a longer one renews it, and
+  // the other fds of the file see the new one
+  int fd2 = l.ops->lopen(TESTPATH, O_RDONLY, 0, l);
+  assert(l.ops->lftruncate(fd, (blocks - 2) * 16, l) == 0);
+  assert(fd_slot(state, fd)->info->epoch == epoch);
+  assert(l.ops->lftruncate(fd, 16 + 5, l) == 0);
+  assert(fd_slot(state, fd)->info->epoch != epoch);
+  assert(fd_slot(state, fd2)->info->epoch == fd_slot(state, fd)->info->epoch);
+  assert(l.ops->lpread(fd2, buffer, 16, 16, l) == 5);
+  assert(l.ops->lpread(fd2, buffer, 16, 32, l) == 0);
+
+  // so does O_TRUNC, and the new content is read
+  epoch = fd_slot(state, fd)->info->epoch;
+  assert(l.ops->lclose(fd, l) == 0);
+  fd = l.ops->lopen(TESTPATH, O_RDWR | O_TRUNC, 0, l);
+  assert(fd_slot(state, fd)->info->epoch != epoch);
+  memset(block, 'b', sizeof(block));
+  assert(l.ops->lpwrite(fd, block, 16, 0, l) == 16);
+  assert(l.ops->lpread(fd2, buffer, 16, 0, l) == 16 && buffer[0] == 'b');
+  assert(l.ops->lclose(fd2, l) == 0);
+
+  // a file reusing the inode of an unlinked one gets a new epoch too
+  epoch = fd_slot(state, fd)->info->epoch;
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT, 0666, l);
+  assert(fd_slot(state, fd)->info->epoch != epoch);
+  assert(l.ops->lpread(fd, buffer, 16, 0, l) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  read_cache_destroy(l);
+
+  printf("✅ Invalidation of whole files test passed\n");
+}
+
+// Whether block i of the file of fd is in the cache
+static int block_cached(ReadCacheState *state, int fd, uint64_t block) {
+  CacheKey key = {.dev = fd_slot(state, fd)->dev,
+                  .inode = fd_slot(state, fd)->inode,
+                  .epoch = fd_slot(state, fd)->info->epoch,
+                  .block = block};
+  return state->ops.contain_item(state->cache_wrapper, &key, sizeof(key));
+}
+
+void test_admission() {
+  printf("Testing the admission of missed blocks\n");
+
+  // a file of 128 blocks, written below the cache
+  LayerContext local = local_init();
+  int fd = local.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0666, local);
+  char block[16], buffer[16];
+  for (int i = 0; i < 128; i++) {
+    memset(block, 'a' + (i % 26), sizeof(block));
+    assert(local.ops->lpwrite(fd, block, 16, i * 16, local) == 16);
+  }
+  assert(local.ops->lclose(fd, local) == 0);
+
+  // a cache that isn't full yet takes every miss, a full one only the blocks
+  // missed twice
+  ReadCacheLayerConfig config = {
+      .block_size = 16, .num_blocks = 64, .admit_misses = 2};
+  LayerContext l = read_cache_init(&local, 1, &config);
+  ReadCacheState *state = (ReadCacheState *)l.internal_state;
+  fd = l.ops->lopen(TESTPATH, O_RDONLY, 0, l);
+  for (int i = 0; i < 64; i++)
+    assert(l.ops->lpread(fd, buffer, 16, i * 16, l) == 16);
+  assert(block_cached(state, fd, 63));
+  assert(l.ops->lpread(fd, buffer, 16, 100 * 16, l) == 16);
+  assert(buffer[0] == 'a' + (100 % 26));
+  assert(!block_cached(state, fd, 100));
+  assert(l.ops->lpread(fd, buffer, 16, 100 * 16, l) == 16);
+  assert(block_cached(state, fd, 100));
+  AdmissionStats stats;
+  read_cache_get_admission_stats(l, &stats);
+  assert(stats.admitted == 65 && stats.rejected == 1 && stats.bypassed == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  read_cache_destroy(l);
+
+  // long sequential runs and O_NOATIME fds read around the cache
+  local = local_init();
+  config.admit_misses = 0;
+  config.bypass_blocks = 8;
+  l = read_cache_init(&local, 1, &config);
+  state = (ReadCacheState *)l.internal_state;
+  fd = l.ops->lopen(TESTPATH, O_RDONLY, 0, l);
+  for (int i = 0; i < 16; i++)
+    assert(l.ops->lpread(fd, buffer, 16, i * 16, l) == 16);
+  assert(block_cached(state, fd, 7));
+  assert(!block_cached(state, fd, 8) && !block_cached(state, fd, 15));
+  assert(l.ops->lpread(fd, buffer, 16, 40 * 16, l) == 16);
+  assert(block_cached(state, fd, 40));
+
+  int noreuse = l.ops->lopen(TESTPATH, O_RDONLY | O_NOATIME, 0, l);
+  assert(noreuse != -1);
+  assert(l.ops->lpread(noreuse, buffer, 16, 50 * 16, l) == 16);
+  assert(buffer[0] == 'a' + (50 % 26));
+  assert(!block_cached(state, fd, 50));
+  assert(l.ops->lpread(noreuse, buffer, 16, 7 * 16, l) == 16);
+  read_cache_get_admission_stats(l, &stats);
+  assert(stats.admitted == 9 && stats.bypassed == 9);
+  assert(l.ops->lclose(noreuse, l) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  read_cache_destroy(l);
+
+  printf("✅ Admission of missed blocks test passed\n");
+}
+
+void test_write_modes() {
+  printf("Testing write_through and write_back modes\n");
+
+  LayerContext local = local_init();
+  ReadCacheLayerConfig config = {.block_size = 16,
+                                 .num_blocks = 64,
+                                 .write_mode = READ_CACHE_WRITE_THROUGH};
+  LayerContext l = read_cache_init(&local, 1, &config);
+  ReadCacheState *state = (ReadCacheState *)l.internal_state;
+  assert(state->write_back == NULL);
+
+  // write_through caches whole written blocks, but not partial ones
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0666, l);
+  char block[32];
+  memset(block, 'a', sizeof(block));
+  assert(l.ops->lpwrite(fd, block, 20, 0, l) == 20);
+  CacheKey key = {.dev = fd_slot(state, fd)->dev,
+                  .inode = fd_slot(state, fd)->inode,
+                  .epoch = fd_slot(state, fd)->info->epoch};
+  assert(state->ops.contain_item(state->cache_wrapper, &key, sizeof(key)));
+  key.block = 1;
+  assert(!state->ops.contain_item(state->cache_wrapper, &key, sizeof(key)));
+  assert(l.ops->lclose(fd, l) == 0);
+  read_cache_destroy(l);
+
+  local = local_init();
+  config.write_mode = READ_CACHE_WRITE_BACK;
+  config.flush_ms = 60000;
+  l = read_cache_init(&local, 1, &config);
+  state = (ReadCacheState *)l.internal_state;
+
+  // whole blocks are absorbed, the next layer doesn't see them yet
+  fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0666, l);
+  memset(block, 'b', 16);
+  memset(block + 16, 'c', 16);
+  assert(l.ops->lpwrite(fd, block, 32, 0, l) == 32);
+  WriteBackStats stats;
+  read_cache_get_write_back_stats(l, &stats);
+  assert(stats.absorbed == 2 && stats.dirty == 2 && stats.written == 0);
+  struct stat stbuf;
+  assert(local.ops->lfstat(fd, &stbuf, local) == 0 && stbuf.st_size == 0);
+
+  // and reads are served from the cache
+  char buffer[32];
+  assert(l.ops->lpread(fd, buffer, 32, 0, l) == 32);
+  assert(memcmp(buffer, block, 32) == 0);
+
+  // fstat writes the dirty blocks first
+  assert(l.ops->lfstat(fd, &stbuf, l) == 0 && stbuf.st_size == 32);
+  read_cache_get_write_back_stats(l, &stats);
+  assert(stats.dirty == 0 && stats.written == 2);
+
+  // rewriting a dirty block keeps it dirty once, close writes it
+  assert(l.ops->lpwrite(fd, block, 16, 32, l) == 16);
+  assert(l.ops->lpwrite(fd, block + 16, 16, 32, l) == 16);
+  read_cache_get_write_back_stats(l, &stats);
+  assert(stats.dirty == 1 && stats.rewritten == 1);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(local.ops->llstat(TESTPATH, &stbuf, local) == 0);
+  assert(stbuf.st_size == 48);
+
+  fd = local.ops->lopen(TESTPATH, O_RDONLY, 0, local);
+  assert(local.ops->lpread(fd, buffer, 16, 32, local) == 16);
+  assert(memcmp(buffer, block + 16, 16) == 0);
+  assert(local.ops->lclose(fd, local) == 0);
+
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  read_cache_destroy(l);
+
+  printf("✅ write_through and write_back modes test passed\n");
+}
+
+void test_warm_restart() {
+  printf("Testing warm restarts of a persistent cache\n");
+
+  char dir[] = "/tmp/test_read_cache_XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  LayerContext local = local_init();
+  ReadCacheLayerConfig config = {
+      .block_size = 16, .num_blocks = 64, .persist_dir = dir};
+  LayerContext l = read_cache_init(&local, 1, &config);
+  ReadCacheState *state = (ReadCacheState *)l.internal_state;
+
+  // cache the two blocks of the file
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0666, l);
+  char block[32], buffer[32];
+  memset(block, 'a', sizeof(block));
+  assert(l.ops->lpwrite(fd, block, 32, 0, l) == 32);
+  assert(l.ops->lpread(fd, buffer, 32, 0, l) == 32);
+  uint64_t epoch = fd_slot(state, fd)->info->epoch;
+  assert(epoch != 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  read_cache_destroy(l);
+
+  // the next run finds them, the file didn't change
+  local = local_init();
+  l = read_cache_init(&local, 1, &config);
+  state = (ReadCacheState *)l.internal_state;
+  fd = l.ops->lopen(TESTPATH, O_RDWR, 0, l);
+  assert(fd_slot(state, fd)->info->epoch == epoch);
+  CacheKey key = {.dev = fd_slot(state, fd)->dev,
+                  .inode = fd_slot(state, fd)->inode,
+                  .epoch = epoch,
+                  .block = 1};
+  assert(state->ops.contain_item(state->cache_wrapper, &key, sizeof(key)));
+  assert(l.ops->lclose(fd, l) == 0);
+  read_cache_destroy(l);
+
+  // a write while the cache is down makes the file a new version
+  local = local_init();
+  fd = local.ops->lopen(TESTPATH, O_RDWR, 0, local);
+  memset(block, 'b', 16);
+  assert(local.ops->lpwrite(fd, block, 16, 0, local) == 16);
+  assert(local.ops->lclose(fd, local) == 0);
+
+  l = read_cache_init(&local, 1, &config);
+  state = (ReadCacheState *)l.internal_state;
+  fd = l.ops->lopen(TESTPATH, O_RDWR, 0, l);
+  assert(fd_slot(state, fd)->info->epoch != epoch);
+  assert(l.ops->lpread(fd, buffer, 32, 0, l) == 32);
+  assert(buffer[0] == 'b' && buffer[16] == 'a');
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  read_cache_destroy(l);
+  remove_dir(dir);
+
+  printf("✅ Warm restarts of a persistent cache test passed\n");
+}
+
+void test_file_pools() {
+  printf("Testing the cache pools of files\n");
+
+  char *prefixes[] = {"scan_"};
+  LayerContext local = local_init();
+  ReadCacheLayerConfig config = {.block_size = 16,
+                                 .num_blocks = 64,
+                                 .eviction = READ_CACHE_EVICT_2Q,
+                                 .pool_prefixes = prefixes,
+                                 .num_pool_prefixes = 1,
+                                 .large_file_mb = 1};
+  LayerContext l = read_cache_init(&local, 1, &config);
+  ReadCacheState *state = (ReadCacheState *)l.internal_state;
+
+  // a prefix wins over the size of the file
+  int scan = l.ops->lopen("scan_file.txt", O_RDWR | O_CREAT | O_TRUNC, 0666, l);
+  assert(fd_slot(state, scan)->pool == 1);
+  int fd = l.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0666, l);
+  assert(fd_slot(state, fd)->pool == 0);
+
+  // the size class is chosen at the first open, later opens share the pool
+  char *large = calloc(1, 1024 * 1024);
+  assert(l.ops->lpwrite(fd, large, 1024 * 1024, 0, l) == 1024 * 1024);
+  int again = l.ops->lopen(TESTPATH, O_RDONLY, 0, l);
+  assert(fd_slot(state, again)->pool == 0);
+  assert(l.ops->lclose(again, l) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+
+  // a new file of 1 MiB or more goes to the large file pool
+  fd = local.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0666, local);
+  assert(local.ops->lpwrite(fd, large, 1024 * 1024, 0, local) == 1024 * 1024);
+  assert(local.ops->lclose(fd, local) == 0);
+  fd = l.ops->lopen(TESTPATH, O_RDONLY, 0, l);
+  assert(fd_slot(state, fd)->pool == 2);
+  char buffer[16];
+  assert(l.ops->lpread(fd, buffer, 16, 0, l) == 16);
+  assert(l.ops->lclose(fd, l) == 0);
+  free(large);
+
+  assert(l.ops->lclose(scan, l) == 0);
+  assert(l.ops->lunlink("scan_file.txt", l) == 0);
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  read_cache_destroy(l);
+
+  printf("✅ Cache pools of files test passed\n");
+}
+
 LayerContext build_tree() {
   LayerContext context_local = local_init();
-  LayerContext context_read_cache = read_cache_init(&context_local, 1, 16, 10);
+  ReadCacheLayerConfig config = {.block_size = 16, .num_blocks = 10};
+  LayerContext context_read_cache =
+      read_cache_init(&context_local, 1, &config);
+  BlockAlignConfig block_config = {.block_size = 16};
   LayerContext context_block_align =
-      block_align_init(&context_read_cache, 1, 16);
+      block_align_init(&context_read_cache, 1, &block_config);
 
   return context_block_align;
 }
@@ -748,6 +1204,13 @@ int main() {
   test_cache_misses_grouping(tree);
   test_unlink_with_no_fds_open(tree);
   test_unlink_opened_file(tree);
+  test_concurrent_open_close(tree);
+  test_sequential_readahead();
+  test_invalidation();
+  test_admission();
+  test_write_modes();
+  test_warm_restart();
+  test_file_pools();
 
   unlink(TESTPATH);
 
@@ -0,0 +1,296 @@
+#include "../../../../layers/local/local.h"
+#include "../../../../layers/staging/staging.h"
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TESTPATH "test_staging.bin"
+#define RENAMED "test_staging_renamed.bin"
+#define JOURNAL_DIR "test_staging_journals"
+#define PART_SIZE (64 * 1024)
+#define NUM_WRITES 1000
+#define WRITE_SIZE 100
+#define FILE_SIZE (NUM_WRITES * WRITE_SIZE)
+
+static LayerContext local_layer;
+static LayerOps counted_ops;
+static int writes; // pwrites that reached the local layer
+
+static ssize_t counted_pwrite(int fd, const void *buffer, size_t nbyte,
+                              off_t offset, LayerContext l) {
+  __atomic_add_fetch(&writes, 1, __ATOMIC_RELAXED);
+  return local_pwrite(fd, buffer, nbyte, offset, l);
+}
+
+static LayerContext staging_layer(long max_staged) {
+  StagingConfig config = {.journal_dir = JOURNAL_DIR,
+                          .max_staged = max_staged,
+                          .part_size = PART_SIZE,
+                          .upload_threads = 1};
+  local_layer = local_init();
+  counted_ops = *local_layer.ops;
+  counted_ops.lpwrite = counted_pwrite;
+  local_layer.ops = &counted_ops;
+  writes = 0;
+  return staging_init(&local_layer, &config);
+}
+
+static void fill_text(unsigned char *buf, size_t n, int seed) {
+  for (size_t i = 0; i < n; i++) {
+    buf[i] = (unsigned char)"staged in the journal "[(i + seed) % 22];
+  }
+}
+
+static int count_journals(void) {
+  DIR *dir = opendir(JOURNAL_DIR);
+  assert(dir);
+  int n = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strstr(entry->d_name, STAGING_JOURNAL_SUFFIX)) {
+      n++;
+    }
+  }
+  closedir(dir);
+  return n;
+}
+
+// Content of the only journal, its path in path
+static unsigned char *read_journal(char *path, size_t size, size_t *len) {
+  DIR *dir = opendir(JOURNAL_DIR);
+  assert(dir);
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strstr(entry->d_name, STAGING_JOURNAL_SUFFIX)) {
+      break;
+    }
+  }
+  assert(entry);
+  snprintf(path, size, "%s/%s", JOURNAL_DIR, entry->d_name);
+  closedir(dir);
+
+  int fd = open(path, O_RDONLY);
+  assert(fd >= 0);
+  struct stat st;
+  assert(fstat(fd, &st) == 0);
+  unsigned char *data = malloc(st.st_size);
+  assert(pread(fd, data, st.st_size, 0) == st.st_size);
+  close(fd);
+  *len = st.st_size;
+  return data;
+}
+
+static void check_file(const unsigned char *expected, size_t len) {
+  unsigned char *out = malloc(len);
+  int fd = open(TESTPATH, O_RDONLY);
+  assert(fd >= 0);
+  assert(pread(fd, out, len, 0) == (ssize_t)len);
+  assert(memcmp(out, expected, len) == 0);
+  close(fd);
+  free(out);
+}
+
+void test_staging_absorb() {
+  printf("Testing staged writes...\n");
+
+  unsigned char *data = malloc(FILE_SIZE);
+  unsigned char *out = malloc(FILE_SIZE);
+  fill_text(data, FILE_SIZE, 0);
+
+  LayerContext l = staging_layer(STAGING_DEFAULT_MAX_STAGED);
+  int fd = l.ops->lopen(TESTPATH, O_CREAT | O_TRUNC | O_RDWR, 0644, l);
+  assert(fd >= 0);
+  for (int i = 0; i < NUM_WRITES; i++) {
+    assert(l.ops->lpwrite(fd, data + i * WRITE_SIZE, WRITE_SIZE,
+                          i * WRITE_SIZE, l) == WRITE_SIZE);
+  }
+
+  // nothing went below, the layer shows the staged file
+  assert(writes == 0);
+  struct stat st;
+  assert(stat(TESTPATH, &st) == 0 && st.st_size == 0);
+  assert(l.ops->lfstat(fd, &st, l) == 0 && st.st_size == FILE_SIZE);
+  assert(l.ops->llstat(TESTPATH, &st, l) == 0 && st.st_size == FILE_SIZE);
+  assert(count_journals() == 1);
+
+  // newer writes win, also in the middle of older extents
+  fill_text(data + 150, 1000, 7);
+  assert(l.ops->lpwrite(fd, data + 150, 1000, 150, l) == 1000);
+  fill_text(data + 400, 10, 3);
+  assert(l.ops->lpwrite(fd, data + 400, 10, 400, l) == 10);
+  assert(l.ops->lpread(fd, out, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(out, data, FILE_SIZE) == 0);
+  assert(l.ops->lpread(fd, out, 1000, FILE_SIZE - 10, l) == 10);
+  assert(l.ops->lpread(fd, out, 10, FILE_SIZE, l) == 0);
+
+  // a hole past the end of the file below reads as zeros
+  assert(l.ops->lpwrite(fd, "tail", 4, FILE_SIZE + 96, l) == 4);
+  assert(l.ops->lpread(fd, out, 100, FILE_SIZE, l) == 100);
+  for (int i = 0; i < 96; i++) {
+    assert(out[i] == 0);
+  }
+  assert(memcmp(out + 96, "tail", 4) == 0);
+
+  // the close uploads the file in parts, and drops the journal
+  assert(l.ops->lclose(fd, l) == 0);
+  l.ops->ldestroy(l);
+  assert(writes == (FILE_SIZE + PART_SIZE - 1) / PART_SIZE + 1);
+  assert(count_journals() == 0);
+  check_file(data, FILE_SIZE);
+  assert(stat(TESTPATH, &st) == 0 && st.st_size == FILE_SIZE + 100);
+
+  // reopened, a read of an unstaged file goes below
+  l = staging_layer(STAGING_DEFAULT_MAX_STAGED);
+  fd = l.ops->lopen(TESTPATH, O_RDONLY, 0, l);
+  assert(fd >= 0);
+  assert(l.ops->lpread(fd, out, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(out, data, FILE_SIZE) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  l.ops->ldestroy(l);
+
+  unlink(TESTPATH);
+  free(data);
+  free(out);
+}
+
+void test_staging_max_staged() {
+  printf("Testing uploads started by max_staged...\n");
+
+  unsigned char *data = malloc(FILE_SIZE);
+  fill_text(data, FILE_SIZE, 5);
+
+  // uploads run while the file is written, the fsync makes them start
+  LayerContext l = staging_layer(WRITE_SIZE * 10);
+  int fd = l.ops->lopen(TESTPATH, O_CREAT | O_TRUNC | O_RDWR, 0644, l);
+  assert(fd >= 0);
+  for (int i = 0; i < NUM_WRITES; i++) {
+    assert(l.ops->lpwrite(fd, data + i * WRITE_SIZE, WRITE_SIZE,
+                          i * WRITE_SIZE, l) == WRITE_SIZE);
+  }
+  assert(l.ops->lfsync(fd, 0, l) == 0);
+  unsigned char *out = malloc(FILE_SIZE);
+  assert(l.ops->lpread(fd, out, FILE_SIZE, 0, l) == FILE_SIZE);
+  assert(memcmp(out, data, FILE_SIZE) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  l.ops->ldestroy(l);
+
+  assert(writes > 0);
+  assert(count_journals() == 0);
+  check_file(data, FILE_SIZE);
+
+  unlink(TESTPATH);
+  free(data);
+  free(out);
+}
+
+void test_staging_recovery() {
+  printf("Testing journal replay...\n");
+
+  unsigned char *data = malloc(FILE_SIZE);
+  fill_text(data, FILE_SIZE, 11);
+
+  LayerContext l = staging_layer(STAGING_DEFAULT_MAX_STAGED);
+  int fd = l.ops->lopen(TESTPATH, O_CREAT | O_TRUNC | O_RDWR, 0600, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, data, FILE_SIZE / 2, 0, l) == FILE_SIZE / 2);
+  assert(l.ops->lpwrite(fd, data + FILE_SIZE / 2, FILE_SIZE / 2,
+                        FILE_SIZE / 2, l) == FILE_SIZE / 2);
+  // keep the journal as a crash would leave it, before the upload starts
+  char path[512];
+  size_t len;
+  unsigned char *journal = read_journal(path, sizeof(path), &len);
+  assert(l.ops->lfsync(fd, 1, l) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+  l.ops->ldestroy(l);
+
+  // the file below lost the upload, and the journal has a torn record
+  assert(truncate(TESTPATH, 0) == 0);
+  int jfd = open(path, O_CREAT | O_WRONLY, 0600);
+  assert(jfd >= 0);
+  assert(pwrite(jfd, journal, len, 0) == (ssize_t)len);
+  StagingRecord torn = {STAGING_RECORD_MAGIC, 4096, 0, 0};
+  assert(pwrite(jfd, &torn, sizeof(torn), len) == sizeof(torn));
+  assert(pwrite(jfd, "torn", 4, len + sizeof(torn)) == 4);
+  close(jfd);
+
+  // init replays the whole records and uploads them
+  l = staging_layer(STAGING_DEFAULT_MAX_STAGED);
+  struct stat st;
+  assert(l.ops->llstat(TESTPATH, &st, l) == 0 && st.st_size == FILE_SIZE);
+  l.ops->ldestroy(l);
+  assert(count_journals() == 0);
+  check_file(data, FILE_SIZE);
+
+  unlink(TESTPATH);
+  free(journal);
+  free(data);
+}
+
+void test_staging_metadata() {
+  printf("Testing truncate, rename and unlink of staged files...\n");
+
+  unsigned char data[4096];
+  unsigned char out[4096];
+  fill_text(data, sizeof(data), 2);
+
+  // truncates see the staged writes first
+  LayerContext l = staging_layer(STAGING_DEFAULT_MAX_STAGED);
+  int fd = l.ops->lopen(TESTPATH, O_CREAT | O_TRUNC | O_RDWR, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, data, sizeof(data), 0, l) == sizeof(data));
+  assert(l.ops->lftruncate(fd, 1000, l) == 0);
+  check_file(data, 1000);
+  assert(l.ops->lpwrite(fd, data, 10, 2000, l) == 10);
+  assert(l.ops->ltruncate(TESTPATH, 1500, l) == 0);
+  struct stat st;
+  assert(l.ops->lfstat(fd, &st, l) == 0 && st.st_size == 1500);
+  assert(l.ops->lpread(fd, out, sizeof(out), 0, l) == 1500);
+  assert(memcmp(out, data, 1000) == 0);
+
+  // a renamed file brings its staged writes along
+  assert(l.ops->lpwrite(fd, data, sizeof(data), 0, l) == sizeof(data));
+  assert(l.ops->lrename(TESTPATH, RENAMED, 0, l) == 0);
+  assert(l.ops->lpwrite(fd, "renamed", 7, 0, l) == 7);
+  assert(l.ops->llstat(RENAMED, &st, l) == 0 &&
+         st.st_size == sizeof(data));
+  assert(l.ops->lclose(fd, l) == 0);
+
+  // an unlinked file is not brought back by its upload
+  fd = l.ops->lopen(TESTPATH, O_CREAT | O_TRUNC | O_RDWR, 0644, l);
+  assert(fd >= 0);
+  assert(l.ops->lpwrite(fd, data, sizeof(data), 0, l) == sizeof(data));
+  assert(l.ops->lunlink(TESTPATH, l) == 0);
+  assert(l.ops->lpwrite(fd, data, sizeof(data), 0, l) == sizeof(data));
+  assert(l.ops->lclose(fd, l) == 0);
+  l.ops->ldestroy(l);
+
+  assert(access(TESTPATH, F_OK) != 0 && errno == ENOENT);
+  assert(count_journals() == 0);
+  fd = open(RENAMED, O_RDONLY);
+  assert(fd >= 0);
+  assert(pread(fd, out, sizeof(out), 0) == sizeof(data));
+  assert(memcmp(out, "renamed", 7) == 0);
+  assert(memcmp(out + 7, data + 7, sizeof(data) - 7) == 0);
+  close(fd);
+
+  unlink(RENAMED);
+}
+
+int main() {
+  printf("Running staging tests...\n\n");
+
+  test_staging_absorb();
+  test_staging_max_staged();
+  test_staging_recovery();
+  test_staging_metadata();
+
+  rmdir(JOURNAL_DIR);
+  printf("\nAll staging tests passed!\n");
+  return 0;
+}
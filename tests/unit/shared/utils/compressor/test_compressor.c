@@ -1,10 +1,12 @@
 #include "../../../../../shared/utils/compressor/compressor.h"
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <unistd.h>
 #define ZSTD_STATIC_LINKING_ONLY
 #include "../../../../../lib/zstd/lib/zstd.h"
 
@@ -280,6 +282,37 @@ static void test_zstd_level_validation() {
   printf("✅ ZSTD level validation passed\n");
 }
 
+static void test_zstd_set_level() {
+  printf("Testing ZSTD level change...\n");
+
+  Compressor compressor;
+  compressor_init(&compressor, COMPRESSION_ZSTD, 1);
+  size_t bound = 0;
+  void *compressed = create_compress_buffer(test_data_size, &compressor, &bound);
+  void *decompressed = malloc(test_data_size);
+  assert(compressed && decompressed);
+  ssize_t fast = compressor.compress_data(test_data, test_data_size,
+                                          compressed, bound, compressor.level);
+  assert(fast > 0);
+
+  // clamped as by init, and frames of either level decompress the same way
+  assert(compressor_set_level(&compressor, INT_MAX) == 0);
+  assert(compressor.level == ZSTD_maxCLevel());
+  ssize_t csize = compressor.compress_data(test_data, test_data_size,
+                                           compressed, bound, compressor.level);
+  assert(csize > 0 && csize <= fast);
+  size_t out_size = test_data_size;
+  assert(compressor.decompress_data(compressed, (size_t)csize, decompressed,
+                                    &out_size) == (ssize_t)test_data_size);
+  assert(memcmp(decompressed, test_data, test_data_size) == 0);
+
+  assert(compressor_set_level(NULL, 3) == -1);
+
+  free(compressed);
+  free(decompressed);
+  printf("✅ ZSTD level change passed\n");
+}
+
 static void test_zstd_compression_round_trip() {
   printf("Testing ZSTD compression round-trip...\n");
 
@@ -553,6 +586,320 @@ static void test_compression_ratios() {
   printf("✅ Compression ratios test passed\n");
 }
 
+// Compress and decompress repeatedly with the same thread contexts, with a
+// failed decompression in between that leaves the LZ4 context mid-frame
+static void *round_trips(void *arg) {
+  const Compressor *compressor = arg;
+  size_t bound = 0;
+  char *compressed = create_compress_buffer(test_data_size, compressor, &bound);
+  char *decompressed = malloc(test_data_size);
+  assert(compressed && decompressed);
+
+  for (int i = 0; i < 200; i++) {
+    ssize_t csize = compressor->compress_data(
+        test_data, test_data_size, compressed, bound, compressor->level);
+    assert(csize > 0);
+
+    size_t out_size = test_data_size;
+    if (i % 10 == 0) {
+      assert(compressor->decompress_data(compressed, (size_t)csize / 2,
+                                         decompressed, &out_size) !=
+             (ssize_t)test_data_size);
+      out_size = test_data_size;
+    }
+    assert(compressor->decompress_data(compressed, (size_t)csize,
+                                       decompressed,
+                                       &out_size) == (ssize_t)test_data_size);
+    assert(memcmp(decompressed, test_data, test_data_size) == 0);
+    assert(compressor->get_original_file_size(compressed, (size_t)csize) ==
+           (off_t)test_data_size);
+  }
+
+  free(compressed);
+  free(decompressed);
+  return NULL;
+}
+
+static void test_context_reuse() {
+  printf("Testing context reuse across calls and threads...\n");
+
+  compression_algorithm_t algorithms[] = {COMPRESSION_LZ4, COMPRESSION_ZSTD};
+  for (int a = 0; a < 2; a++) {
+    Compressor compressor;
+    assert(compressor_init(&compressor, algorithms[a], 3) == 0);
+    round_trips(&compressor);
+
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+      assert(pthread_create(&threads[i], NULL, round_trips, &compressor) == 0);
+    }
+    for (int i = 0; i < 4; i++) {
+      assert(pthread_join(threads[i], NULL) == 0);
+    }
+  }
+
+  printf("✅ Context reuse passed\n");
+}
+
+static void test_zstd_dictionary() {
+  printf("Testing ZSTD dictionary...\n");
+
+  const char *dict_path = "test_compressor_dictionary.bin";
+  const char dict[] = "{\"timestamp\": \"2026-01-01T00:00:00Z\", \"level\": "
+                      "\"info\", \"service\": \"storage\", \"message\": "
+                      "\"request completed\", \"status\": 200}\n";
+  FILE *file = fopen(dict_path, "wb");
+  assert(file);
+  assert(fwrite(dict, 1, sizeof(dict) - 1, file) == sizeof(dict) - 1);
+  assert(fclose(file) == 0);
+
+  const char record[] = "{\"timestamp\": \"2026-01-02T10:11:12Z\", \"level\": "
+                        "\"warn\", \"service\": \"storage\", \"message\": "
+                        "\"request completed\", \"status\": 404}\n";
+  size_t record_size = sizeof(record) - 1;
+
+  Compressor plain, with_dict;
+  compressor_init(&plain, COMPRESSION_ZSTD, 3);
+  compressor_init(&with_dict, COMPRESSION_ZSTD, 3);
+  assert(with_dict.dictionary == NULL);
+  assert(compressor_load_dictionary(&with_dict, "missing_dictionary.bin") ==
+         -1);
+  assert(compressor_load_dictionary(&with_dict, dict_path) == 0);
+  assert(with_dict.dictionary != NULL);
+  // a second dictionary is refused
+  assert(compressor_load_dictionary(&with_dict, dict_path) == -1);
+
+  size_t bound = 0;
+  void *plain_buffer = create_compress_buffer(record_size, &plain, &bound);
+  void *dict_buffer = malloc(bound);
+  char *decompressed = malloc(record_size);
+
+  // without a dictionary the wrappers match the function pointers
+  ssize_t plain_size =
+      compressor_compress(&plain, record, record_size, plain_buffer, bound);
+  assert(plain_size > 0);
+  size_t out_size = record_size;
+  assert(compressor_decompress(&plain, plain_buffer, (size_t)plain_size,
+                               decompressed,
+                               &out_size) == (ssize_t)record_size);
+
+  ssize_t dict_size =
+      compressor_compress(&with_dict, record, record_size, dict_buffer, bound);
+  assert(dict_size > 0 && dict_size < plain_size);
+  out_size = record_size;
+  assert(compressor_decompress(&with_dict, dict_buffer, (size_t)dict_size,
+                               decompressed,
+                               &out_size) == (ssize_t)record_size);
+  assert(memcmp(decompressed, record, record_size) == 0);
+
+  // the frame still carries its size, but needs the dictionary to decode
+  assert(with_dict.get_original_file_size(dict_buffer, (size_t)dict_size) ==
+         (off_t)record_size);
+  out_size = record_size;
+  assert(plain.decompress_data(dict_buffer, (size_t)dict_size, decompressed,
+                               &out_size) == -1);
+
+  // bare blocks use it too
+  ssize_t bare_size = compressor_compress_block(
+      &with_dict, record, record_size, dict_buffer, bound, with_dict.level);
+  assert(bare_size > 0 && bare_size < dict_size);
+  out_size = record_size;
+  assert(compressor_decompress_block(&with_dict, dict_buffer,
+                                     (size_t)bare_size, decompressed,
+                                     &out_size) == (ssize_t)record_size);
+  assert(memcmp(decompressed, record, record_size) == 0);
+
+  printf("  Record: %zu bytes, without dictionary: %zd, with: %zd\n",
+         record_size, plain_size, dict_size);
+
+  // LZ4 has no dictionary support
+  Compressor lz4;
+  compressor_init(&lz4, COMPRESSION_LZ4, 0);
+  assert(compressor_load_dictionary(&lz4, dict_path) ==
+         DICTIONARY_UNSUPPORTED_ERROR);
+  assert(lz4.dictionary == NULL);
+
+  compressor_destroy(&with_dict);
+  assert(with_dict.dictionary == NULL);
+  compressor_destroy(&plain);
+  unlink(dict_path);
+  free(plain_buffer);
+  free(dict_buffer);
+  free(decompressed);
+
+  printf("✅ ZSTD dictionary passed\n");
+}
+
+static void test_zstd_params() {
+  printf("Testing ZSTD workers and long distance matching...\n");
+
+  // 1 MiB of noise repeated 4 times: only the repeats compress
+  const size_t chunk = 1 << 20;
+  const size_t size = 4 * chunk;
+  char *data = malloc(size);
+  assert(data);
+  srand(7);
+  for (size_t i = 0; i < chunk; i++) {
+    data[i] = (char)rand();
+  }
+  for (size_t i = 1; i < 4; i++) {
+    memcpy(data + (i * chunk), data, chunk);
+  }
+
+  Compressor zstd;
+  compressor_init(&zstd, COMPRESSION_ZSTD, 3);
+  int multithread = ZSTD_cParam_getBounds(ZSTD_c_nbWorkers).upperBound > 0;
+  CompressorZstdParams params = {
+      .workers = multithread ? 2 : 0, .long_distance = 1, .window_log = 23};
+  assert(compressor_set_zstd_params(&zstd, &params) == 0);
+  assert(zstd.zstd.long_distance == 1 && zstd.zstd.window_log == 23);
+
+  size_t bound = 0;
+  void *compressed = create_compress_buffer(size, &zstd, &bound);
+  char *decompressed = malloc(size);
+  assert(compressed && decompressed);
+  ssize_t csize = compressor_compress(&zstd, data, size, compressed, bound);
+  assert(csize > 0 && (size_t)csize < size / 2);
+
+  // a regular frame: it carries its size and decodes on one thread
+  assert(zstd.get_original_file_size(compressed, (size_t)csize) ==
+         (off_t)size);
+  size_t out_size = size;
+  assert(zstd.decompress_data(compressed, (size_t)csize, decompressed,
+                              &out_size) == (ssize_t)size);
+  assert(memcmp(decompressed, data, size) == 0);
+
+  // the thread's context is left as it was for the plain calls
+  ssize_t plain = zstd.compress_data(test_data, test_data_size, compressed,
+                                     bound, zstd.level);
+  assert(plain > 0);
+  out_size = test_data_size;
+  assert(zstd.decompress_data(compressed, (size_t)plain, decompressed,
+                              &out_size) == (ssize_t)test_data_size);
+  assert(memcmp(decompressed, test_data, test_data_size) == 0);
+
+  // out of the library's bounds
+  CompressorZstdParams invalid = {.window_log = 100};
+  assert(compressor_set_zstd_params(&zstd, &invalid) == -1);
+  invalid = (CompressorZstdParams){.workers = -1};
+  assert(compressor_set_zstd_params(&zstd, &invalid) == -1);
+  if (!multithread) {
+    invalid = (CompressorZstdParams){.workers = 2};
+    assert(compressor_set_zstd_params(&zstd, &invalid) == -1);
+  }
+  assert(zstd.zstd.window_log == 23); // left unchanged
+
+  Compressor lz4;
+  compressor_init(&lz4, COMPRESSION_LZ4, 0);
+  assert(compressor_set_zstd_params(&lz4, &params) ==
+         ZSTD_PARAMS_UNSUPPORTED_ERROR);
+
+  printf("  %zu bytes to %zd with %d workers\n", size, csize,
+         params.workers);
+
+  free(data);
+  free(compressed);
+  free(decompressed);
+  printf("✅ ZSTD workers and long distance matching passed\n");
+}
+
+// Bare blocks of every level kind round trip, and beat the frames
+static void check_bare_blocks(compression_algorithm_t algorithm,
+                              const int *levels, int nlevels) {
+  Compressor compressor;
+  compressor_init(&compressor, algorithm, levels[0]);
+  size_t bound = 0;
+  char *frame = create_compress_buffer(test_data_size, &compressor, &bound);
+  char block[sizeof(test_data)];
+  char out[sizeof(test_data)];
+  assert(frame);
+
+  for (int i = 0; i < nlevels; i++) {
+    ssize_t size = compressor_compress_block(&compressor, test_data,
+                                             test_data_size, block,
+                                             test_data_size, levels[i]);
+    ssize_t frame_size = compressor.compress_data(
+        test_data, test_data_size, frame, bound, levels[i]);
+    assert(size > COMPRESSOR_BLOCK_HEADER_SIZE && frame_size > 0);
+    assert(size < frame_size);
+
+    size_t stored = 0;
+    assert(compressor_detect_block(&compressor, block, (size_t)size,
+                                   &stored) == 0);
+    assert(stored == (size_t)size);
+    assert(compressor_detect_block(&compressor, block, (size_t)size - 1,
+                                   &stored) == -1);
+    assert(compressor.detect_format(block, (size_t)size) == -1);
+    assert(compressor_detect_block(&compressor, frame, (size_t)frame_size,
+                                   &stored) == -1);
+
+    size_t out_size = sizeof(out);
+    assert(compressor_decompress_block(&compressor, block, (size_t)size, out,
+                                       &out_size) == (ssize_t)test_data_size);
+    assert(out_size == test_data_size);
+    assert(memcmp(out, test_data, test_data_size) == 0);
+
+    // frames still decompress through the same call
+    out_size = sizeof(out);
+    assert(compressor_decompress_block(&compressor, frame, (size_t)frame_size,
+                                       out, &out_size) ==
+           (ssize_t)test_data_size);
+    assert(memcmp(out, test_data, test_data_size) == 0);
+
+    // a truncated block does not decode
+    out_size = sizeof(out);
+    assert(compressor_decompress_block(&compressor, block, (size_t)size - 1,
+                                       out, &out_size) == -1);
+    printf("  level %d: %zd bytes bare, %zd framed\n", levels[i], size,
+           frame_size);
+  }
+
+  // a block that does not fit is left to the caller to store raw
+  char noise[4096];
+  char noise_block[sizeof(noise)];
+  srand(11);
+  for (size_t i = 0; i < sizeof(noise); i++) {
+    noise[i] = (char)rand();
+  }
+  assert(compressor_compress_block(&compressor, noise, sizeof(noise),
+                                   noise_block, sizeof(noise) - 1,
+                                   compressor.level) == 0);
+  assert(compressor_compress_block(&compressor, test_data, test_data_size,
+                                   block, COMPRESSOR_BLOCK_HEADER_SIZE,
+                                   compressor.level) == 0);
+
+  // the payload length is 16 bits
+  size_t large = COMPRESSOR_BLOCK_MAX_SIZE + 1;
+  char *big = calloc(1, large);
+  assert(big);
+  assert(compressor_compress_block(&compressor, big, large, big, large,
+                                   compressor.level) == -1);
+  free(big);
+  free(frame);
+}
+
+static void test_bare_blocks() {
+  printf("Testing bare blocks...\n");
+
+  const int lz4_levels[] = {0, -5, 9};
+  check_bare_blocks(COMPRESSION_LZ4, lz4_levels, 3);
+  const int zstd_levels[] = {3, 1, 19};
+  check_bare_blocks(COMPRESSION_ZSTD, zstd_levels, 3);
+
+  // a bare block of one algorithm is not one of the other's
+  Compressor lz4, zstd;
+  compressor_init(&lz4, COMPRESSION_LZ4, 0);
+  compressor_init(&zstd, COMPRESSION_ZSTD, 3);
+  char block[sizeof(test_data)];
+  ssize_t size = compressor_compress_block(&lz4, test_data, test_data_size,
+                                           block, sizeof(block), lz4.level);
+  size_t stored = 0;
+  assert(size > 0);
+  assert(compressor_detect_block(&zstd, block, (size_t)size, &stored) == -1);
+
+  printf("✅ Bare blocks passed\n");
+}
+
 // ============================================================================
 // TEST RUNNER
 // ============================================================================
@@ -576,6 +923,7 @@ int main() {
   printf("=== ZSTD COMPRESSOR TESTS ===\n");
   test_zstd_init();
   test_zstd_level_validation();
+  test_zstd_set_level();
   test_zstd_compression_round_trip();
   test_zstd_edge_cases();
   test_zstd_get_original_file_size();
@@ -590,6 +938,10 @@ int main() {
   printf("=== COMMON TESTS ===\n");
   test_error_conditions();
   test_compression_ratios();
+  test_context_reuse();
+  test_zstd_dictionary();
+  test_zstd_params();
+  test_bare_blocks();
   printf("\n");
 
   printf("🎉 All compressor tests passed!\n");
@@ -0,0 +1,300 @@
+#include "../../../../../shared/utils/hasher/blake3_hasher.h"
+#include "../../../../../shared/utils/hasher/hasher.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Official BLAKE3 test vectors: input byte i is (i % 251)
+typedef struct {
+  size_t len;
+  const char *hash;
+  const char *keyed_hash;
+} Blake3Vector;
+
+static const Blake3Vector vectors[] = {
+    {0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262",
+     "92b2b75604ed3c761f9d6f62392c8a9227ad0ea3f09573e783f1498a4ed60d26"},
+    {1023, "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11",
+     "c951ecdf03288d0fcc96ee3413563d8a6d3589547f2c2fb36d9786470f1b9d6e"},
+    {1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7",
+     "75c46f6f3d9eb4f55ecaaee480db732e6c2105546f1e675003687c31719c7ba4"},
+    {1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444",
+     "357dc55de0c7e382c900fd6e320acc04146be01db6a8ce7210b7189bd664ea69"},
+    {2048, "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a",
+     "879cf1fa2ea0e79126cb1063617a05b6ad9d0b696d0d757cf053439f60a99dd1"},
+    {3073, "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3",
+     "68dede9bef00ba89e43f31a6825f4cf433389fedae75c04ee9f0cf16a427c95a"},
+    {5121, "628bd2cb2004694adaab7bbd778a25df25c47b9d4155a55f8fbd79f2fe154cff",
+     "6ccf1c34753e7a044db80798ecd0782a8f76f33563accaddbfbb2e0ea4b2d024"},
+    {102400,
+     "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085",
+     "1c35d1a5811083fd7119f5d5d1ba027b4d01c0c6c49fb6ff2cf75393ea5db4a7"},
+};
+
+static const uint8_t test_key[BLAKE3_KEY_LEN] = "whats the Elvish word for friend";
+
+static uint8_t *make_input(size_t len) {
+  uint8_t *input = malloc(len + 1);
+  assert(input != NULL);
+  for (size_t i = 0; i < len; i++) {
+    input[i] = (uint8_t)(i % 251);
+  }
+  return input;
+}
+
+// In-memory "file" read in short, unaligned reads
+static const uint8_t *file_data = NULL;
+static size_t file_size = 0;
+
+static ssize_t memory_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                            LayerContext l) {
+  (void)fd;
+  (void)l;
+  if ((size_t)offset >= file_size) {
+    return 0;
+  }
+  size_t n = file_size - (size_t)offset;
+  if (n > nbyte) {
+    n = nbyte;
+  }
+  if (n > 1500) {
+    n = 1500;
+  }
+  memcpy(buffer, file_data + offset, n);
+  return (ssize_t)n;
+}
+
+static LayerContext memory_layer(const uint8_t *data, size_t size) {
+  static LayerOps ops;
+  memset(&ops, 0, sizeof(ops));
+  ops.lpread = memory_pread;
+  file_data = data;
+  file_size = size;
+  LayerContext layer = {.ops = &ops};
+  return layer;
+}
+
+// ============================================================================
+// BLAKE3 HASHER TESTS
+// ============================================================================
+
+static void test_blake3_init() {
+  printf("Testing BLAKE3 hasher initialization...\n");
+
+  Hasher hasher;
+  int result = hasher_init(&hasher, HASH_BLAKE3);
+
+  assert(result == 0);
+  assert(hasher.algorithm == HASH_BLAKE3);
+  assert(hasher.hash_file_hex != NULL);
+  assert(hasher.hash_buffer_hex != NULL);
+  assert(hasher.hash_file_binary != NULL);
+  assert(hasher.hash_buffer_binary != NULL);
+  assert(hasher.hash_blocks_binary != NULL);
+  assert(hasher.get_hash_size() == 32);
+  assert(hasher.get_hex_size() == 65);
+
+  printf("✅ BLAKE3 hasher initialization passed\n");
+}
+
+static void test_blake3_vectors() {
+  printf("Testing BLAKE3 test vectors...\n");
+
+  Hasher hasher;
+  hasher_init(&hasher, HASH_BLAKE3);
+
+  char *abc = hasher.hash_buffer_hex("abc", 3);
+  assert(abc != NULL);
+  assert(strcmp(abc,
+                "6437b3ac38465133ffb63b75273a8db548c558465d79db03fd359c6cd5bd9d"
+                "85") == 0);
+  free(abc);
+
+  for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+    uint8_t *input = make_input(vectors[i].len);
+    char *hash = hasher.hash_buffer_hex(input, vectors[i].len);
+    assert(hash != NULL);
+    assert(strcmp(hash, vectors[i].hash) == 0);
+    free(hash);
+    free(input);
+  }
+
+  printf("✅ BLAKE3 test vectors passed\n");
+}
+
+static void test_blake3_incremental_update() {
+  printf("Testing BLAKE3 incremental updates...\n");
+
+  // uneven updates across block and chunk boundaries match one-shot hashing
+  const size_t len = 102400;
+  uint8_t *input = make_input(len);
+  const size_t steps[] = {1, 63, 64, 65, 1000, 1024, 4099};
+
+  uint8_t expected[BLAKE3_OUT_LEN];
+  Blake3State state;
+  blake3_init(&state);
+  blake3_update(&state, input, len);
+  blake3_final(&state, expected);
+
+  for (size_t s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+    uint8_t out[BLAKE3_OUT_LEN];
+    blake3_init(&state);
+    for (size_t off = 0; off < len; off += steps[s]) {
+      size_t n = len - off < steps[s] ? len - off : steps[s];
+      blake3_update(&state, input + off, n);
+    }
+    blake3_final(&state, out);
+    assert(memcmp(out, expected, BLAKE3_OUT_LEN) == 0);
+  }
+
+  free(input);
+  printf("✅ BLAKE3 incremental updates passed\n");
+}
+
+static void test_blake3_file_hashing() {
+  printf("Testing BLAKE3 file hashing...\n");
+
+  Hasher hasher;
+  hasher_init(&hasher, HASH_BLAKE3);
+
+  for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+    uint8_t *input = make_input(vectors[i].len);
+    LayerContext layer = memory_layer(input, vectors[i].len);
+
+    char *hash = hasher.hash_file_hex(0, layer);
+    assert(hash != NULL);
+    assert(strcmp(hash, vectors[i].hash) == 0);
+    free(hash);
+
+    uint8_t binary[BLAKE3_OUT_LEN];
+    uint8_t expected[BLAKE3_OUT_LEN];
+    assert(hasher.hash_file_binary(0, layer, binary, sizeof(binary)) == 32);
+    assert(hasher.hash_buffer_binary(input, vectors[i].len, expected,
+                                     sizeof(expected)) == 32);
+    assert(memcmp(binary, expected, BLAKE3_OUT_LEN) == 0);
+    free(input);
+  }
+
+  printf("✅ BLAKE3 file hashing passed\n");
+}
+
+static void test_blake3_blocks_binary() {
+  printf("Testing BLAKE3 batch block hashing...\n");
+
+  Hasher hasher;
+  hasher_init(&hasher, HASH_BLAKE3);
+
+  const size_t n = sizeof(vectors) / sizeof(vectors[0]);
+  const void *buffers[sizeof(vectors) / sizeof(vectors[0])];
+  size_t sizes[sizeof(vectors) / sizeof(vectors[0])];
+  for (size_t i = 0; i < n; i++) {
+    buffers[i] = make_input(vectors[i].len);
+    sizes[i] = vectors[i].len;
+  }
+
+  uint8_t *out = malloc(n * BLAKE3_OUT_LEN);
+  assert(out != NULL);
+  assert(hasher.hash_blocks_binary(buffers, sizes, n, out,
+                                   n * BLAKE3_OUT_LEN) == (int)n);
+  for (size_t i = 0; i < n; i++) {
+    uint8_t expected[BLAKE3_OUT_LEN];
+    hasher.hash_buffer_binary(buffers[i], sizes[i], expected,
+                              sizeof(expected));
+    assert(memcmp(out + (i * BLAKE3_OUT_LEN), expected, BLAKE3_OUT_LEN) == 0);
+  }
+
+  // output buffer too small
+  assert(hasher.hash_blocks_binary(buffers, sizes, n, out,
+                                   (n * BLAKE3_OUT_LEN) - 1) == -1);
+
+  for (size_t i = 0; i < n; i++) {
+    free((void *)buffers[i]);
+  }
+  free(out);
+  printf("✅ BLAKE3 batch block hashing passed\n");
+}
+
+static void test_blake3_error_conditions() {
+  printf("Testing BLAKE3 error conditions...\n");
+
+  Hasher hasher;
+  hasher_init(&hasher, HASH_BLAKE3);
+
+  assert(hasher.hash_buffer_hex(NULL, 10) == NULL);
+
+  unsigned char buffer[32];
+  assert(hasher.hash_buffer_binary("abc", 3, NULL, 32) == -1);
+  assert(hasher.hash_buffer_binary("abc", 3, buffer, 31) == -1);
+
+  LayerContext no_ops = {.ops = NULL};
+  assert(hasher.hash_file_hex(0, no_ops) == NULL);
+  assert(hasher.hash_file_binary(-1, no_ops, buffer, sizeof(buffer)) == -1);
+
+  printf("✅ BLAKE3 error conditions passed\n");
+}
+
+static void test_blake3_keyed() {
+  printf("Testing keyed BLAKE3 hasher...\n");
+
+  // no key set yet
+  Hasher hasher;
+  assert(hasher_init(&hasher, HASH_BLAKE3_KEYED) == -1);
+
+  assert(blake3_hasher_set_key(test_key) == 0);
+  assert(blake3_hasher_set_key(test_key) == 0); // same key again
+  uint8_t other_key[BLAKE3_KEY_LEN];
+  memcpy(other_key, test_key, sizeof(other_key));
+  other_key[0] ^= 1;
+  assert(blake3_hasher_set_key(other_key) == -1);
+
+  assert(hasher_init(&hasher, HASH_BLAKE3_KEYED) == 0);
+  assert(hasher.algorithm == HASH_BLAKE3_KEYED);
+  assert(hasher.get_hash_size() == 32);
+
+  for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+    uint8_t *input = make_input(vectors[i].len);
+    char *hash = hasher.hash_buffer_hex(input, vectors[i].len);
+    assert(hash != NULL);
+    assert(strcmp(hash, vectors[i].keyed_hash) == 0);
+    free(hash);
+
+    LayerContext layer = memory_layer(input, vectors[i].len);
+    hash = hasher.hash_file_hex(0, layer);
+    assert(hash != NULL);
+    assert(strcmp(hash, vectors[i].keyed_hash) == 0);
+    free(hash);
+    free(input);
+  }
+
+  // the regular hasher is not affected by the key
+  Hasher plain;
+  hasher_init(&plain, HASH_BLAKE3);
+  char *hash = plain.hash_buffer_hex("", 0);
+  assert(strcmp(hash, vectors[0].hash) == 0);
+  free(hash);
+
+  printf("✅ Keyed BLAKE3 hasher passed\n");
+}
+
+// ============================================================================
+// TEST RUNNER
+// ============================================================================
+
+int main() {
+  printf("Starting BLAKE3 hasher unit tests...\n\n");
+
+  printf("=== BLAKE3 HASHER TESTS ===\n");
+  test_blake3_init();
+  test_blake3_vectors();
+  test_blake3_incremental_update();
+  test_blake3_file_hashing();
+  test_blake3_blocks_binary();
+  test_blake3_error_conditions();
+  test_blake3_keyed();
+  printf("\n");
+
+  printf("🎉 All BLAKE3 hasher tests passed!\n");
+  return 0;
+}
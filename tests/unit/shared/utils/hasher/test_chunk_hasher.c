@@ -0,0 +1,270 @@
+#include "../../../../../shared/utils/hasher/chunk_hasher.h"
+#include "../../../../../shared/utils/hasher/hasher.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE 4096
+
+// In-memory "file" read in short reads, shared by all hashing threads
+static const uint8_t *file_data = NULL;
+static size_t file_size = 0;
+
+static ssize_t memory_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                            LayerContext l) {
+  (void)fd;
+  (void)l;
+  if ((size_t)offset >= file_size) {
+    return 0;
+  }
+  size_t n = file_size - (size_t)offset;
+  if (n > nbyte) {
+    n = nbyte;
+  }
+  if (n > 1500) {
+    n = 1500;
+  }
+  memcpy(buffer, file_data + offset, n);
+  return (ssize_t)n;
+}
+
+static ssize_t failing_pread(int fd, void *buffer, size_t nbyte, off_t offset,
+                             LayerContext l) {
+  if (offset >= 3 * CHUNK_SIZE) {
+    return -1;
+  }
+  return memory_pread(fd, buffer, nbyte, offset, l);
+}
+
+static LayerContext memory_layer(const uint8_t *data, size_t size) {
+  static LayerOps ops;
+  memset(&ops, 0, sizeof(ops));
+  ops.lpread = memory_pread;
+  file_data = data;
+  file_size = size;
+  LayerContext layer = {.ops = &ops};
+  return layer;
+}
+
+static uint8_t *make_input(size_t len) {
+  uint8_t *input = malloc(len + 1);
+  assert(input != NULL);
+  for (size_t i = 0; i < len; i++) {
+    input[i] = (uint8_t)((i * 31) ^ (i >> 8));
+  }
+  return input;
+}
+
+// Leaves computed one chunk at a time with hash_buffer_binary
+static uint8_t *sequential_leaves(const Hasher *hasher, const uint8_t *data,
+                                  size_t size) {
+  const size_t ds = hasher->get_hash_size();
+  const size_t n = chunk_hasher_count((off_t)size, CHUNK_SIZE);
+  uint8_t *leaves = malloc((n * ds) + 1);
+  assert(leaves != NULL);
+  for (size_t i = 0; i < n; i++) {
+    size_t len = size - (i * CHUNK_SIZE);
+    if (len > CHUNK_SIZE) {
+      len = CHUNK_SIZE;
+    }
+    assert(hasher->hash_buffer_binary(data + (i * CHUNK_SIZE), len,
+                                      leaves + (i * ds), ds) == (int)ds);
+  }
+  return leaves;
+}
+
+// ============================================================================
+// CHUNK HASHER TESTS
+// ============================================================================
+
+void test_chunk_hasher_count() {
+  printf("Testing chunk count...\n");
+
+  assert(chunk_hasher_count(0, CHUNK_SIZE) == 0);
+  assert(chunk_hasher_count(1, CHUNK_SIZE) == 1);
+  assert(chunk_hasher_count(CHUNK_SIZE, CHUNK_SIZE) == 1);
+  assert(chunk_hasher_count(CHUNK_SIZE + 1, CHUNK_SIZE) == 2);
+  assert(chunk_hasher_count(16 * CHUNK_SIZE, CHUNK_SIZE) == 16);
+  assert(chunk_hasher_count(100, 0) == 0);
+
+  printf("✅ Chunk count passed\n");
+}
+
+void test_chunk_hasher_matches_sequential() {
+  printf("Testing parallel leaves match sequential hashing...\n");
+
+  const hash_algorithm_t algorithms[] = {HASH_SHA256, HASH_SHA512,
+                                         HASH_BLAKE3};
+  // one chunk, exact chunks, partial last chunk, more chunks than threads
+  const size_t sizes[] = {100, CHUNK_SIZE, 8 * CHUNK_SIZE,
+                          (13 * CHUNK_SIZE) + 777, (40 * CHUNK_SIZE) + 1};
+  const size_t threads[] = {0, 1, 4, 16};
+  // threads started per file, or the workers of a pool smaller than some
+  ThreadPool *pool = thread_pool_init(1, 3);
+  assert(pool != NULL);
+  ThreadPool *const pools[] = {NULL, pool};
+
+  for (size_t a = 0; a < sizeof(algorithms) / sizeof(algorithms[0]); a++) {
+    Hasher hasher;
+    assert(hasher_init(&hasher, algorithms[a]) == 0);
+    const size_t ds = hasher.get_hash_size();
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+      uint8_t *input = make_input(sizes[s]);
+      uint8_t *expected = sequential_leaves(&hasher, input, sizes[s]);
+      const size_t n = chunk_hasher_count((off_t)sizes[s], CHUNK_SIZE);
+      LayerContext layer = memory_layer(input, sizes[s]);
+
+      for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+        for (size_t p = 0; p < 2; p++) {
+          uint8_t *leaves = calloc(n, ds);
+          assert(leaves != NULL);
+          assert(chunk_hasher_hash_file(&hasher, 0, layer, (off_t)sizes[s],
+                                        CHUNK_SIZE, threads[t], pools[p],
+                                        leaves, n * ds) == 0);
+          assert(memcmp(leaves, expected, n * ds) == 0);
+          free(leaves);
+        }
+      }
+
+      free(expected);
+      free(input);
+    }
+  }
+
+  thread_pool_destroy(pool);
+  printf("✅ Parallel leaves match sequential hashing passed\n");
+}
+
+void test_chunk_hasher_empty_file() {
+  printf("Testing empty file...\n");
+
+  Hasher hasher;
+  assert(hasher_init(&hasher, HASH_SHA256) == 0);
+  LayerContext layer = memory_layer(NULL, 0);
+
+  // no chunks: nothing is written, even without an output buffer
+  assert(chunk_hasher_hash_file(&hasher, 0, layer, 0, CHUNK_SIZE, 4, NULL,
+                                NULL, 0) == 0);
+
+  printf("✅ Empty file passed\n");
+}
+
+void test_chunk_hasher_error_conditions() {
+  printf("Testing error conditions...\n");
+
+  Hasher hasher;
+  assert(hasher_init(&hasher, HASH_SHA256) == 0);
+  const size_t ds = hasher.get_hash_size();
+  const size_t size = 8 * CHUNK_SIZE;
+  uint8_t *input = make_input(size);
+  LayerContext layer = memory_layer(input, size);
+  uint8_t leaves[8 * 32];
+
+  // invalid arguments
+  assert(chunk_hasher_hash_file(NULL, 0, layer, size, CHUNK_SIZE, 4, NULL,
+                                leaves, sizeof(leaves)) == -1);
+  assert(chunk_hasher_hash_file(&hasher, -1, layer, size, CHUNK_SIZE, 4, NULL,
+                                leaves, sizeof(leaves)) == -1);
+  assert(chunk_hasher_hash_file(&hasher, 0, layer, size, 0, 4, NULL, leaves,
+                                sizeof(leaves)) == -1);
+
+  // output buffer too small for every leaf
+  assert(chunk_hasher_hash_file(&hasher, 0, layer, size, CHUNK_SIZE, 4, NULL,
+                                leaves, (7 * ds)) == -1);
+
+  // a failing read fails the whole file, whatever thread hits it
+  LayerOps failing_ops = {0};
+  failing_ops.lpread = failing_pread;
+  LayerContext failing = {.ops = &failing_ops};
+  assert(chunk_hasher_hash_file(&hasher, 0, failing, size, CHUNK_SIZE, 1,
+                                NULL, leaves, sizeof(leaves)) == -1);
+  assert(chunk_hasher_hash_file(&hasher, 0, failing, size, CHUNK_SIZE, 4,
+                                NULL, leaves, sizeof(leaves)) == -1);
+  ThreadPool *pool = thread_pool_init(1, 3);
+  assert(pool != NULL);
+  assert(chunk_hasher_hash_file(&hasher, 0, failing, size, CHUNK_SIZE, 4,
+                                pool, leaves, sizeof(leaves)) == -1);
+  thread_pool_destroy(pool);
+
+  free(input);
+  printf("✅ Error conditions passed\n");
+}
+
+// Local file read through its backing fd only
+static int identity_backing_fd(int fd, LayerContext l) {
+  (void)l;
+  return fd;
+}
+
+void test_chunk_hasher_sparse_file() {
+  printf("Testing sparse file chunks...\n");
+
+  Hasher hasher;
+  assert(hasher_init(&hasher, HASH_SHA256) == 0);
+  const size_t ds = hasher.get_hash_size();
+
+  // data in chunks 5 and 40, holes elsewhere, up to a partial last chunk
+  const size_t size = (64 * CHUNK_SIZE) + 100;
+  uint8_t *content = calloc(1, size);
+  assert(content != NULL);
+  memset(content + (5 * CHUNK_SIZE), 'a', CHUNK_SIZE);
+  memset(content + (40 * CHUNK_SIZE) + 10, 'b', 20);
+  char path[] = "/tmp/test_chunk_sparse_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  assert(ftruncate(fd, (off_t)size) == 0);
+  assert(pwrite(fd, content + (5 * CHUNK_SIZE), CHUNK_SIZE,
+                5 * CHUNK_SIZE) == CHUNK_SIZE);
+  assert(pwrite(fd, content + (40 * CHUNK_SIZE) + 10, 20,
+                (40 * CHUNK_SIZE) + 10) == 20);
+
+  LayerOps ops = {0};
+  ops.lpread = failing_pread;
+  ops.lbacking_fd = identity_backing_fd;
+  LayerContext layer = {.ops = &ops};
+  file_size = 0; // lpread is never used
+
+  uint8_t *expected = sequential_leaves(&hasher, content, size);
+  const size_t n = chunk_hasher_count((off_t)size, CHUNK_SIZE);
+  const size_t threads[] = {1, 4};
+  for (size_t t = 0; t < 2; t++) {
+    uint8_t *leaves = calloc(n, ds);
+    assert(leaves != NULL);
+    assert(chunk_hasher_hash_file(&hasher, fd, layer, (off_t)size, CHUNK_SIZE,
+                                  threads[t], NULL, leaves, n * ds) == 0);
+    assert(memcmp(leaves, expected, n * ds) == 0);
+    free(leaves);
+  }
+  // the holes were looked up without moving the file position
+  assert(lseek(fd, 0, SEEK_CUR) == 0);
+
+  free(expected);
+  free(content);
+  close(fd);
+  unlink(path);
+  printf("✅ Sparse file chunks passed\n");
+}
+
+// ============================================================================
+// TEST RUNNER
+// ============================================================================
+
+int main() {
+  printf("Starting chunk hasher unit tests...\n\n");
+
+  printf("=== CHUNK HASHER TESTS ===\n");
+  test_chunk_hasher_count();
+  test_chunk_hasher_matches_sequential();
+  test_chunk_hasher_empty_file();
+  test_chunk_hasher_error_conditions();
+  test_chunk_hasher_sparse_file();
+  printf("\n");
+
+  printf("🎉 All chunk hasher tests passed!\n");
+  return 0;
+}
@@ -1,9 +1,12 @@
 #include "../../../../../shared/utils/hasher/hasher.h"
+#include "../../../../../shared/utils/hasher/hasher_context.h"
 #include <assert.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 // Test data
 static const char test_data[] =
@@ -243,6 +246,146 @@ static void test_hasher_large_data() {
   printf("✅ Large data hashing passed\n");
 }
 
+static void *get_thread_context(void *arg) {
+  (void)arg;
+  return hasher_context_get();
+}
+
+static void test_hasher_thread_context() {
+  printf("Testing thread-local hasher context reuse...\n");
+
+  HasherContext *ctx = hasher_context_get();
+  assert(ctx != NULL);
+  assert(ctx->mdctx != NULL);
+  assert(hasher_context_get() == ctx);
+
+  // hashing reuses the same context and keeps its buffers
+  Hasher hasher;
+  hasher_init(&hasher, HASH_SHA256);
+  unsigned char binary[32];
+  assert(hasher.hash_buffer_binary(test_data, test_data_size, binary,
+                                   sizeof(binary)) == 32);
+  assert(hasher_context_get() == ctx);
+
+  // buffers only grow
+  unsigned char *scratch = hasher_context_scratch(ctx, 128);
+  assert(scratch != NULL);
+  assert(hasher_context_scratch(ctx, 64) == scratch);
+  assert(ctx->scratch_size >= 128);
+  assert(hasher_context_read_buffer(ctx, 4096) != NULL);
+  assert(ctx->read_buffer_size >= 4096);
+  assert(hasher_context_scratch(NULL, 1) == NULL);
+
+  // every thread has its own context
+  pthread_t thread;
+  void *other = NULL;
+  assert(pthread_create(&thread, NULL, get_thread_context, NULL) == 0);
+  assert(pthread_join(thread, &other) == 0);
+  assert(other != NULL);
+  assert(other != ctx);
+
+  // released contexts are recreated on next use
+  hasher_context_release();
+  ctx = hasher_context_get();
+  assert(ctx != NULL);
+  assert(ctx->scratch == NULL);
+  assert(hasher.hash_buffer_binary(test_data, test_data_size, binary,
+                                   sizeof(binary)) == 32);
+
+  printf("✅ Thread-local hasher context reuse passed\n");
+}
+
+// Layer reading its fd, and one only reachable through its backing fd
+static ssize_t plain_pread(int fd, void *buf, size_t n, off_t off,
+                           LayerContext l) {
+  (void)l;
+  return pread(fd, buf, n, off);
+}
+
+static ssize_t failing_pread(int fd, void *buf, size_t n, off_t off,
+                             LayerContext l) {
+  (void)fd, (void)buf, (void)n, (void)off, (void)l;
+  return -1;
+}
+
+static int identity_backing_fd(int fd, LayerContext l) {
+  (void)l;
+  return fd;
+}
+
+static void test_hasher_backing_fd() {
+  printf("Testing file hashing through the backing fd...\n");
+
+  char path[] = "/tmp/test_hasher_backing_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  // more than one read buffer of every algorithm
+  size_t size = 300 * 1024 + 7;
+  unsigned char *data = malloc(size);
+  assert(data != NULL);
+  for (size_t i = 0; i < size; i++) {
+    data[i] = (unsigned char)(i * 31);
+  }
+  assert(write(fd, data, size) == (ssize_t)size);
+
+  LayerOps plain_ops = {.lpread = plain_pread};
+  LayerOps backed_ops = {.lpread = failing_pread,
+                         .lbacking_fd = identity_backing_fd};
+  LayerContext plain = {.ops = &plain_ops};
+  LayerContext backed = {.ops = &backed_ops};
+
+  hash_algorithm_t algorithms[] = {HASH_SHA256, HASH_SHA512, HASH_BLAKE3};
+  for (size_t a = 0; a < 3; a++) {
+    Hasher hasher;
+    assert(hasher_init(&hasher, algorithms[a]) == 0);
+    unsigned char expected[64];
+    unsigned char hash[64];
+    int n = hasher.hash_buffer_binary(data, size, expected, sizeof(expected));
+    assert(n > 0);
+    assert(hasher.hash_file_binary(fd, plain, hash, sizeof(hash)) == n);
+    assert(memcmp(hash, expected, n) == 0);
+    // the layer is bypassed entirely
+    memset(hash, 0, sizeof(hash));
+    assert(hasher.hash_file_binary(fd, backed, hash, sizeof(hash)) == n);
+    assert(memcmp(hash, expected, n) == 0);
+  }
+
+  // without a backing fd the layer's own error is reported
+  LayerOps failing_ops = {.lpread = failing_pread};
+  LayerContext failing = {.ops = &failing_ops};
+  Hasher hasher;
+  assert(hasher_init(&hasher, HASH_SHA256) == 0);
+  unsigned char hash[32];
+  assert(hasher.hash_file_binary(fd, failing, hash, sizeof(hash)) == -1);
+
+  // a sparse file: its holes are zeroes, found without reading them
+  assert(ftruncate(fd, 0) == 0);
+  assert(ftruncate(fd, (off_t)size) == 0);
+  assert(pwrite(fd, data, 1000, 200 * 1024) == 1000);
+  unsigned char *sparse = calloc(1, size);
+  assert(sparse != NULL);
+  memcpy(sparse + (200 * 1024), data, 1000);
+  unsigned char expected[32];
+  assert(hasher.hash_buffer_binary(sparse, size, expected, 32) == 32);
+  assert(hasher.hash_file_binary(fd, backed, hash, sizeof(hash)) == 32);
+  assert(memcmp(hash, expected, 32) == 0);
+  HasherFileReader reader;
+  hasher_file_reader_open(&reader, fd, backed, 1);
+  if (reader.sparse_size >= 0) {
+    // the file system reports holes (at block granularity)
+    assert(hasher_file_zeroes(&reader, 0, 4096) == 4096);
+    assert(hasher_file_zeroes(&reader, 200 * 1024, 4096) == 0);
+    assert(hasher_file_zeroes(&reader, (off_t)size - 10, 4096) == 10);
+  }
+  hasher_file_reader_close(&reader);
+  free(sparse);
+
+  free(data);
+  close(fd);
+  unlink(path);
+  printf("✅ File hashing through the backing fd passed\n");
+}
+
 // ============================================================================
 // COMMON TESTS FOR ALL ALGORITHMS
 // ============================================================================
@@ -284,6 +427,18 @@ static void test_algorithm_common_properties(hash_algorithm_t algorithm,
   assert(hash1 != NULL);
   assert(hash2 != NULL);
   assert(strcmp(hash1, hash2) == 0);
+  // Test the allocation-free variant matches the allocating one
+  char *expected = hasher.hash_buffer_hex(test_data, test_data_size);
+  char hex[HASHER_MAX_HEX_SIZE];
+  assert(hex_size <= sizeof(hex));
+  assert(hasher.hash_buffer_hex_into(test_data, test_data_size, hex,
+                                     hex_size) == (int)(hash_size * 2));
+  assert(strcmp(hex, expected) == 0);
+  assert(hasher.hash_buffer_hex_into(test_data, test_data_size, hex,
+                                     hex_size - 1) == -1);
+  assert(hasher.hash_buffer_hex_into(NULL, 1, hex, hex_size) == -1);
+  free(expected);
+
   free(hash1);
   free(hash2);
 
@@ -307,12 +462,15 @@ int main() {
   test_hasher_cross_algorithm_compatibility();
   test_hasher_performance_consistency();
   test_hasher_large_data();
+  test_hasher_thread_context();
+  test_hasher_backing_fd();
   printf("\n");
 
   // Common algorithm tests
   printf("=== COMMON ALGORITHM TESTS ===\n");
   test_algorithm_common_properties(HASH_SHA256, "SHA256");
   test_algorithm_common_properties(HASH_SHA512, "SHA512");
+  test_algorithm_common_properties(HASH_BLAKE3, "BLAKE3");
   printf("\n");
 
   printf("🎉 All hasher interface tests passed!\n");
@@ -0,0 +1,219 @@
+#include "../../../../../shared/utils/hasher/merkle_tree.h"
+#include "../../../../../shared/utils/hasher/hasher.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DS 32 // SHA256 digest size
+
+// Reference root: rebuild every level from the leaves
+static void reference_root(const Hasher *hasher, const uint8_t *leaves,
+                           size_t n, uint8_t *out) {
+  if (n == 0) {
+    static const uint8_t empty = 0;
+    assert(hasher->hash_buffer_binary(&empty, 0, out, DS) == DS);
+    return;
+  }
+
+  uint8_t *level = malloc(n * DS);
+  assert(level != NULL);
+  memcpy(level, leaves, n * DS);
+
+  uint8_t input[1 + (2 * DS)];
+  input[0] = 0x01;
+  while (n > 1) {
+    size_t parents = (n + 1) / 2;
+    for (size_t i = 0; i < parents; i++) {
+      if (2 * i + 1 < n) {
+        memcpy(input + 1, level + (2 * i * DS), DS);
+        memcpy(input + 1 + DS, level + ((2 * i + 1) * DS), DS);
+        assert(hasher->hash_buffer_binary(input, sizeof(input),
+                                          level + (i * DS), DS) == DS);
+      } else {
+        memmove(level + (i * DS), level + (2 * i * DS), DS);
+      }
+    }
+    n = parents;
+  }
+  memcpy(out, level, DS);
+  free(level);
+}
+
+static void fill_leaf(uint8_t *leaf, size_t idx, unsigned int salt) {
+  for (size_t b = 0; b < DS; b++) {
+    leaf[b] = (uint8_t)((idx * 31) + (b * 7) + salt);
+  }
+}
+
+static void assert_root_matches(MerkleTree *tree, const Hasher *hasher) {
+  uint8_t root[DS];
+  uint8_t expected[DS];
+  assert(merkle_tree_commit(tree) == 0);
+  assert(merkle_tree_root(tree, root, sizeof(root)) == DS);
+  reference_root(hasher, tree->n_leaves ? tree->levels[0] : NULL,
+                 tree->n_leaves, expected);
+  assert(memcmp(root, expected, DS) == 0);
+}
+
+static void test_merkle_empty_and_single_leaf() {
+  printf("Testing Merkle tree empty and single leaf roots...\n");
+
+  Hasher hasher;
+  assert(hasher_init(&hasher, HASH_SHA256) == 0);
+  MerkleTree tree;
+  assert(merkle_tree_init(&tree, &hasher) == 0);
+
+  // Empty tree: root is the hash of the empty input
+  uint8_t root[DS];
+  uint8_t expected[DS];
+  assert(merkle_tree_commit(&tree) == 0);
+  assert(merkle_tree_root(&tree, root, sizeof(root)) == DS);
+  assert(hasher.hash_buffer_binary("", 0, expected, DS) == DS);
+  assert(memcmp(root, expected, DS) == 0);
+
+  // Single leaf: root is the leaf itself (same as hashing the whole file)
+  const char data[] = "single chunk file";
+  assert(merkle_tree_resize(&tree, 1) == 0);
+  assert(merkle_tree_is_dirty(&tree, 0));
+  assert(hasher.hash_buffer_binary(data, strlen(data),
+                                   merkle_tree_leaf(&tree, 0), DS) == DS);
+  assert(merkle_tree_commit(&tree) == 0);
+  assert(!merkle_tree_is_dirty(&tree, 0));
+  assert(merkle_tree_root(&tree, root, sizeof(root)) == DS);
+  assert(hasher.hash_buffer_binary(data, strlen(data), expected, DS) == DS);
+  assert(memcmp(root, expected, DS) == 0);
+
+  merkle_tree_free(&tree);
+  printf("✅ Merkle tree empty and single leaf roots passed\n");
+}
+
+static void test_merkle_incremental_update() {
+  printf("Testing Merkle tree incremental update...\n");
+
+  Hasher hasher;
+  assert(hasher_init(&hasher, HASH_SHA256) == 0);
+  MerkleTree tree;
+  assert(merkle_tree_init(&tree, &hasher) == 0);
+
+  const size_t n = 37; // odd count exercises promoted nodes
+  assert(merkle_tree_resize(&tree, n) == 0);
+  assert(tree.dirty_count == n);
+  for (size_t i = 0; i < n; i++) {
+    fill_leaf(merkle_tree_leaf(&tree, i), i, 0);
+  }
+  assert_root_matches(&tree, &hasher);
+  assert(tree.dirty_count == 0);
+
+  // Change a few leaves and only flag those
+  const size_t changed[] = {0, 17, 36};
+  for (size_t k = 0; k < sizeof(changed) / sizeof(changed[0]); k++) {
+    fill_leaf(merkle_tree_leaf(&tree, changed[k]), changed[k], 99);
+    merkle_tree_mark_dirty(&tree, changed[k], changed[k]);
+  }
+  assert(tree.dirty_count == 3);
+  assert_root_matches(&tree, &hasher);
+
+  // Out of range indexes are clamped
+  merkle_tree_mark_dirty(&tree, 30, 1000);
+  assert(tree.dirty_count == n - 30);
+  assert(merkle_tree_leaf(&tree, n) == NULL);
+  assert_root_matches(&tree, &hasher);
+
+  merkle_tree_free(&tree);
+  printf("✅ Merkle tree incremental update passed\n");
+}
+
+static void test_merkle_resize() {
+  printf("Testing Merkle tree grow and shrink...\n");
+
+  Hasher hasher;
+  assert(hasher_init(&hasher, HASH_SHA256) == 0);
+  MerkleTree tree;
+  assert(merkle_tree_init(&tree, &hasher) == 0);
+
+  const size_t sizes[] = {4, 5, 8, 9, 3, 16, 1, 2, 0, 7};
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t old_n = tree.n_leaves;
+    assert(merkle_tree_resize(&tree, sizes[s]) == 0);
+    assert(tree.n_leaves == sizes[s]);
+
+    // new leaves and the last leaf are flagged, older ones keep their digest
+    for (size_t i = 0; i < tree.n_leaves; i++) {
+      if (i >= old_n) {
+        assert(merkle_tree_is_dirty(&tree, i));
+      }
+      if (merkle_tree_is_dirty(&tree, i)) {
+        fill_leaf(merkle_tree_leaf(&tree, i), i, (unsigned int)s);
+      }
+    }
+    if (tree.n_leaves > 0) {
+      assert(merkle_tree_is_dirty(&tree, tree.n_leaves - 1));
+    }
+    assert_root_matches(&tree, &hasher);
+  }
+
+  merkle_tree_free(&tree);
+  printf("✅ Merkle tree grow and shrink passed\n");
+}
+
+static void test_merkle_inclusion_proofs() {
+  printf("Testing Merkle tree inclusion proofs...\n");
+
+  Hasher hasher;
+  assert(hasher_init(&hasher, HASH_SHA256) == 0);
+  MerkleTree tree;
+  assert(merkle_tree_init(&tree, &hasher) == 0);
+
+  const size_t sizes[] = {1, 2, 3, 5, 8, 13};
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    const size_t n = sizes[s];
+    assert(merkle_tree_resize(&tree, n) == 0);
+    for (size_t i = 0; i < n; i++) {
+      fill_leaf(merkle_tree_leaf(&tree, i), i, (unsigned int)s);
+    }
+    merkle_tree_mark_dirty(&tree, 0, n - 1);
+    assert(merkle_tree_commit(&tree) == 0);
+    uint8_t root[DS];
+    assert(merkle_tree_root(&tree, root, sizeof(root)) == DS);
+
+    const size_t depth = merkle_proof_depth(n);
+    assert(depth == tree.n_levels - 1);
+    uint8_t proof[8 * DS];
+    for (size_t i = 0; i < n; i++) {
+      uint8_t leaf[DS];
+      memcpy(leaf, merkle_tree_leaf(&tree, i), DS);
+      assert(merkle_tree_proof(&tree, i, proof, sizeof(proof)) ==
+             (int)(depth * DS));
+      assert(merkle_proof_verify(&hasher, leaf, i, n, proof, root) == 1);
+
+      // another leaf, index or sibling does not lead to the root
+      leaf[0] ^= 1;
+      assert(merkle_proof_verify(&hasher, leaf, i, n, proof, root) == 0);
+      leaf[0] ^= 1;
+      if (n > 1) {
+        assert(merkle_proof_verify(&hasher, leaf, (i + 1) % n, n, proof,
+                                   root) == 0);
+        proof[0] ^= 1;
+        assert(merkle_proof_verify(&hasher, leaf, i, n, proof, root) ==
+               (i == n - 1 && n % 2 == 1 ? 1 : 0)); // promoted: no sibling
+      }
+    }
+  }
+
+  merkle_tree_free(&tree);
+  printf("✅ Merkle tree inclusion proofs passed\n");
+}
+
+int main() {
+  printf("Running Merkle tree tests...\n\n");
+
+  test_merkle_empty_and_single_leaf();
+  test_merkle_incremental_update();
+  test_merkle_resize();
+  test_merkle_inclusion_proofs();
+
+  printf("\n✅ All Merkle tree tests passed!\n");
+  return 0;
+}
@@ -1,4 +1,5 @@
 #include "../../../../../shared/utils/hasher/hasher.h"
+#include "../../../../../shared/utils/hasher/sha256_mb.h"
 #include <assert.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -252,6 +253,79 @@ static void test_sha256_memory_management() {
   printf("✅ SHA256 memory management passed\n");
 }
 
+static void test_sha256_blocks_binary() {
+  printf("Testing SHA256 batch hashing of many blocks...\n");
+
+  Hasher hasher;
+  hasher_init(&hasher, HASH_SHA256);
+
+  // 19 blocks: two groups of 8 equal sizes and a mixed tail
+  enum { N = 19, MAX_BLOCK = 4096 };
+  static unsigned char data[N][MAX_BLOCK];
+  const void *buffers[N];
+  size_t sizes[N];
+  for (size_t i = 0; i < N; i++) {
+    for (size_t b = 0; b < MAX_BLOCK; b++) {
+      data[i][b] = (unsigned char)((i * 131) + (b * 7));
+    }
+    buffers[i] = data[i];
+    sizes[i] = i < 16 ? MAX_BLOCK : (i * 13) % 200;
+  }
+
+  unsigned char batch[N * 32];
+  assert(hasher.hash_blocks_binary(buffers, sizes, N, batch, sizeof(batch)) ==
+         N);
+  for (size_t i = 0; i < N; i++) {
+    unsigned char single[32];
+    assert(hasher.hash_buffer_binary(buffers[i], sizes[i], single,
+                                     sizeof(single)) == 32);
+    assert(memcmp(batch + (i * 32), single, 32) == 0);
+  }
+
+  // output buffer too small
+  assert(hasher.hash_blocks_binary(buffers, sizes, N, batch,
+                                   sizeof(batch) - 1) == -1);
+
+  printf("✅ SHA256 batch hashing passed\n");
+}
+
+static void test_sha256_multi_buffer_kernel() {
+  printf("Testing SHA256 multi-buffer kernel...\n");
+
+  if (!sha256_mb_available()) {
+    printf("  AVX2 not available, skipping\n");
+    printf("✅ SHA256 multi-buffer kernel passed\n");
+    return;
+  }
+
+  Hasher hasher;
+  hasher_init(&hasher, HASH_SHA256);
+
+  // lengths around the padding boundaries (55/56/64 bytes) and block sizes
+  const size_t lengths[] = {0, 1, 55, 56, 63, 64, 65, 119, 120, 1000, 4096};
+  static unsigned char data[SHA256_MB_LANES][4096];
+  const void *lanes[SHA256_MB_LANES];
+  for (size_t lane = 0; lane < SHA256_MB_LANES; lane++) {
+    for (size_t b = 0; b < sizeof(data[lane]); b++) {
+      data[lane][b] = (unsigned char)((lane * 29) ^ (b * 3));
+    }
+    lanes[lane] = data[lane];
+  }
+
+  for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+    unsigned char out[SHA256_MB_LANES * SHA256_MB_DIGEST_SIZE];
+    assert(sha256_mb_hash_lanes(lanes, lengths[l], out) == 0);
+    for (size_t lane = 0; lane < SHA256_MB_LANES; lane++) {
+      unsigned char expected[32];
+      assert(hasher.hash_buffer_binary(lanes[lane], lengths[l], expected,
+                                       sizeof(expected)) == 32);
+      assert(memcmp(out + (lane * SHA256_MB_DIGEST_SIZE), expected, 32) == 0);
+    }
+  }
+
+  printf("✅ SHA256 multi-buffer kernel passed\n");
+}
+
 // ============================================================================
 // TEST RUNNER
 // ============================================================================
@@ -269,6 +343,8 @@ int main() {
   test_sha256_edge_cases();
   test_sha256_error_conditions();
   test_sha256_memory_management();
+  test_sha256_blocks_binary();
+  test_sha256_multi_buffer_kernel();
   printf("\n");
 
   printf("🎉 All SHA256 hasher tests passed!\n");
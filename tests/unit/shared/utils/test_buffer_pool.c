@@ -0,0 +1,192 @@
+#include "../../../../shared/utils/buffer_pool.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void test_buffer_pool_size_classes() {
+  printf("Testing buffer pool size classes and alignment...\n");
+
+  BufferPool *pool = buffer_pool_init(8, 0, 0);
+  assert(pool);
+
+  // sizes are rounded up to a power of two class, buffers are aligned
+  char *small = buffer_pool_get(pool, 10);
+  assert(small);
+  assert((uintptr_t)small % BUFFER_POOL_ALIGNMENT == 0);
+  assert(buffer_pool_capacity(small) == BUFFER_POOL_MIN_SIZE);
+  char *medium = buffer_pool_get(pool, 5000);
+  assert(medium);
+  assert((uintptr_t)medium % BUFFER_POOL_ALIGNMENT == 0);
+  assert(buffer_pool_capacity(medium) == 2 * BUFFER_POOL_MIN_SIZE);
+  memset(small, 'a', buffer_pool_capacity(small));
+  memset(medium, 'b', buffer_pool_capacity(medium));
+  assert(pool->misses == 2);
+
+  // a buffer is reused for any size of its class, not for another class
+  buffer_pool_put(pool, small);
+  buffer_pool_put(pool, medium);
+  assert(buffer_pool_get(pool, 4096) == small);
+  assert(buffer_pool_get(pool, 8000) == medium);
+  assert(pool->hits == 2);
+  assert(pool->thread_hits == 2);
+  char *large = buffer_pool_get(pool, 3 * BUFFER_POOL_MIN_SIZE);
+  assert(large && large != small && large != medium);
+  assert(buffer_pool_capacity(large) == 4 * BUFFER_POOL_MIN_SIZE);
+  assert(pool->misses == 3);
+
+  // zeroed gets are zero-filled even when reused
+  buffer_pool_put(pool, small);
+  char *zeroed = buffer_pool_get_zeroed(pool, 100);
+  assert(zeroed == small);
+  for (int i = 0; i < 100; i++) {
+    assert(zeroed[i] == 0);
+  }
+
+  // resize keeps the content and moves to a larger class when needed
+  memcpy(zeroed, "content", 7);
+  assert(buffer_pool_resize(pool, zeroed, 4000) == zeroed);
+  char *grown = buffer_pool_resize(pool, zeroed, 6000);
+  assert(grown && buffer_pool_capacity(grown) >= 6000);
+  assert(memcmp(grown, "content", 7) == 0);
+
+  buffer_pool_put(pool, grown);
+  buffer_pool_put(pool, large);
+  buffer_pool_destroy(pool);
+  printf("✅ Buffer pool size classes and alignment passed\n");
+}
+
+void test_buffer_pool_limits() {
+  printf("Testing buffer pool cache limits...\n");
+
+  BufferPool *pool = buffer_pool_init(1, 2 * BUFFER_POOL_MIN_SIZE, 0);
+  assert(pool);
+
+  // buffers above max_buffer_size are freed on put
+  char *big = buffer_pool_get(pool, 3 * BUFFER_POOL_MIN_SIZE);
+  assert(big);
+  assert((uintptr_t)big % BUFFER_POOL_ALIGNMENT == 0);
+  buffer_pool_put(pool, big);
+  BufferPoolStats stats;
+  buffer_pool_get_stats(pool, &stats);
+  assert(stats.cached == 0);
+  big = buffer_pool_get(pool, 3 * BUFFER_POOL_MIN_SIZE);
+  assert(pool->misses == 2);
+  buffer_pool_put(pool, big);
+
+  // the thread keeps its buffers first, then the pool up to max_buffers of
+  // the class
+  void *buffers[BUFFER_POOL_THREAD_BUFFERS + 2];
+  for (int i = 0; i < BUFFER_POOL_THREAD_BUFFERS + 2; i++) {
+    buffers[i] = buffer_pool_get(pool, 100);
+    assert(buffers[i]);
+  }
+  for (int i = 0; i < BUFFER_POOL_THREAD_BUFFERS + 2; i++) {
+    buffer_pool_put(pool, buffers[i]);
+  }
+  buffer_pool_get_stats(pool, &stats);
+  assert(stats.cached == 1);
+
+  buffer_pool_destroy(pool);
+  printf("✅ Buffer pool cache limits passed\n");
+}
+
+static void *get_and_put(void *arg) {
+  BufferPool *pool = arg;
+  for (int i = 0; i < 1000; i++) {
+    char *buffer = buffer_pool_get(pool, (size_t)(i % 3 + 1) * 4096);
+    assert(buffer);
+    memset(buffer, i, 4096);
+    buffer_pool_put(pool, buffer);
+  }
+  return NULL;
+}
+
+void test_buffer_pool_threads() {
+  printf("Testing buffer pool per-thread caches...\n");
+
+  BufferPool *pool = buffer_pool_init(16, 0, 0);
+  assert(pool);
+
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++) {
+    assert(pthread_create(&threads[i], NULL, get_and_put, pool) == 0);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // a thread allocates each class at most once (less if it started after
+  // another one exited), reuses its own buffers and gives them back to the
+  // pool on exit
+  BufferPoolStats stats;
+  buffer_pool_get_stats(pool, &stats);
+  assert(stats.misses >= 3 && stats.misses <= 4 * 3);
+  assert(stats.hits + stats.misses == 4 * 1000);
+  assert(stats.thread_hits >= 4 * 1000 - 2 * 4 * 3);
+  assert(stats.cached == stats.misses);
+
+  buffer_pool_destroy(pool);
+  printf("✅ Buffer pool per-thread caches passed\n");
+}
+
+void test_buffer_pool_hugepages() {
+  printf("Testing buffer pool hugepage buffers...\n");
+
+  BufferPool *pool = buffer_pool_init(2, 0, BUFFER_POOL_HUGEPAGES);
+  assert(pool);
+
+  // large buffers get hugepages, or regular pages when none are reserved
+  char *buffer = buffer_pool_get(pool, BUFFER_POOL_HUGEPAGE_SIZE);
+  assert(buffer);
+  assert((uintptr_t)buffer % BUFFER_POOL_ALIGNMENT == 0);
+  assert(buffer_pool_capacity(buffer) >= BUFFER_POOL_HUGEPAGE_SIZE);
+  memset(buffer, 'h', BUFFER_POOL_HUGEPAGE_SIZE);
+  BufferPoolStats stats;
+  buffer_pool_get_stats(pool, &stats);
+  assert(stats.hugepage_buffers + stats.hugepage_fallbacks == 1);
+
+  // small buffers never do
+  void *small = buffer_pool_get(pool, 100);
+  buffer_pool_get_stats(pool, &stats);
+  assert(stats.hugepage_buffers + stats.hugepage_fallbacks == 1);
+
+  buffer_pool_put(pool, small);
+  buffer_pool_put(pool, buffer);
+  assert(buffer_pool_get(pool, BUFFER_POOL_HUGEPAGE_SIZE) == buffer);
+  buffer_pool_put(pool, buffer);
+  buffer_pool_destroy(pool);
+  printf("✅ Buffer pool hugepage buffers passed\n");
+}
+
+void test_buffer_pool_shared() {
+  printf("Testing the shared buffer pool...\n");
+
+  assert(buffer_pool_configure_shared(0) == 0);
+  BufferPool *pool = buffer_pool_shared();
+  assert(pool);
+  assert(buffer_pool_shared() == pool);
+  assert(pool->max_buffers == BUFFER_POOL_SHARED_BUFFERS);
+  assert(buffer_pool_configure_shared(BUFFER_POOL_HUGEPAGES) == -1);
+  assert(pool->flags == 0);
+
+  void *buffer = buffer_pool_get(pool, 4096);
+  assert(buffer);
+  buffer_pool_put(pool, buffer);
+  printf("✅ Shared buffer pool passed\n");
+}
+
+int main() {
+  printf("Running buffer pool tests...\n\n");
+
+  test_buffer_pool_size_classes();
+  test_buffer_pool_limits();
+  test_buffer_pool_threads();
+  test_buffer_pool_hugepages();
+  test_buffer_pool_shared();
+
+  printf("\nAll buffer pool tests passed!\n");
+  return 0;
+}
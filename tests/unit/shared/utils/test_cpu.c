@@ -0,0 +1,131 @@
+#include "../../../../shared/utils/cpu.h"
+#include "../../../../shared/utils/hasher/sha256_mb.h"
+#include "../../../../shared/utils/reed_solomon.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SHARD_LEN 1000 // not a multiple of the vector size
+
+static const CpuKernelImpl test_impls[] = {
+    {"avx512", CPU_AVX512, NULL},
+    {"avx2", CPU_AVX2, NULL},
+    {"neon", CPU_NEON, NULL},
+    {"generic", 0, NULL},
+};
+static CpuKernel test_kernel = CPU_KERNEL_INIT("test", test_impls);
+
+// First implementation of test_impls the features run
+static const char *fastest(unsigned features) {
+  for (size_t i = 0; i < sizeof(test_impls) / sizeof(test_impls[0]); i++) {
+    if ((test_impls[i].features & features) == test_impls[i].features) {
+      return test_impls[i].name;
+    }
+  }
+  return NULL;
+}
+
+void test_cpu_features() {
+  printf("Testing CPU feature detection...\n");
+
+  unsigned detected = cpu_detected();
+#if defined(__x86_64__)
+  assert(!!(detected & CPU_AVX2) == !!__builtin_cpu_supports("avx2"));
+  assert(!!(detected & CPU_SHA) == !!__builtin_cpu_supports("sha"));
+  assert(!(detected & CPU_NEON));
+#endif
+  assert(cpu_features() == detected);
+  assert(cpu_has(0));
+
+  assert(cpu_feature("avx512") == CPU_AVX512);
+  assert(cpu_feature("sse2") == 0);
+  char names[64];
+  cpu_feature_names(CPU_AVX2 | CPU_SHA, names, sizeof(names));
+  assert(strcmp(names, "avx2 sha") == 0);
+  cpu_feature_names(0, names, sizeof(names));
+  assert(strcmp(names, "none") == 0);
+
+  printf("✅ CPU feature detection passed\n");
+}
+
+void test_cpu_kernel_select() {
+  printf("Testing CPU kernel selection...\n");
+
+  unsigned detected = cpu_detected();
+  cpu_configure(0);
+  assert(strcmp(cpu_kernel_select(&test_kernel)->name, fastest(detected)) ==
+         0);
+
+  // disabled features are treated as absent
+  cpu_configure(CPU_AVX512 | CPU_AVX2 | CPU_NEON);
+  assert(!cpu_has(CPU_AVX2) || !(detected & CPU_AVX2));
+  assert(strcmp(cpu_kernel_select(&test_kernel)->name, "generic") == 0);
+
+  // an override is followed if the host runs it
+  cpu_configure(0);
+  assert(cpu_kernel_override("test", "generic") == 0);
+  assert(strcmp(cpu_kernel_select(&test_kernel)->name, "generic") == 0);
+  cpu_configure(0);
+  assert(cpu_kernel_override("test", "avx512") == 0);
+  assert(strcmp(cpu_kernel_select(&test_kernel)->name, fastest(detected)) ==
+         0);
+
+  // and never selects what the host can't run
+  cpu_configure(CPU_AVX512);
+  assert(cpu_kernel_override("test", "avx512") == 0);
+  assert(strcmp(cpu_kernel_select(&test_kernel)->name,
+                fastest(detected & ~CPU_AVX512)) == 0);
+
+  cpu_configure(0);
+  assert(strcmp(cpu_kernel_select(&test_kernel)->name, fastest(detected)) ==
+         0);
+
+  printf("✅ CPU kernel selection passed\n");
+}
+
+void test_cpu_kernels_agree() {
+  printf("Testing the kernels of the library agree...\n");
+
+  // Reed-Solomon parity is the same with the vector and scalar code
+  ReedSolomon rs;
+  assert(reed_solomon_init(&rs, 4, 2) == 0);
+  static uint8_t shards[4][SHARD_LEN];
+  static uint8_t fast[2][SHARD_LEN], slow[2][SHARD_LEN];
+  for (int s = 0; s < 4; s++) {
+    for (int i = 0; i < SHARD_LEN; i++) {
+      shards[s][i] = (uint8_t)((i * 31) + (s * 7));
+    }
+  }
+  const uint8_t *data[] = {shards[0], shards[1], shards[2], shards[3]};
+  uint8_t *fast_parity[] = {fast[0], fast[1]};
+  uint8_t *slow_parity[] = {slow[0], slow[1]};
+  cpu_configure(0);
+  reed_solomon_encode(&rs, data, fast_parity, SHARD_LEN);
+  assert(cpu_kernel_override("reed_solomon", "generic") == 0);
+  reed_solomon_encode(&rs, data, slow_parity, SHARD_LEN);
+  assert(memcmp(fast, slow, sizeof(fast)) == 0);
+
+  // the multi-buffer SHA-256 is chosen as configured, when it can run
+  cpu_configure(0);
+  assert(cpu_kernel_override("sha256", "multi_buffer") == 0);
+  assert(sha256_mb_preferred() == sha256_mb_available());
+  cpu_configure(0);
+  assert(cpu_kernel_override("sha256", "openssl") == 0);
+  assert(sha256_mb_preferred() == 0);
+  cpu_configure(CPU_AVX2);
+  assert(sha256_mb_available() == 0 && sha256_mb_preferred() == 0);
+  cpu_configure(0);
+
+  printf("✅ The kernels of the library agree passed\n");
+}
+
+int main() {
+  printf("Running CPU dispatch tests...\n\n");
+
+  test_cpu_features();
+  test_cpu_kernel_select();
+  test_cpu_kernels_agree();
+
+  printf("\nAll CPU dispatch tests passed!\n");
+  return 0;
+}
@@ -0,0 +1,135 @@
+#include "../../../../shared/utils/fd_table.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+  int fd;
+  int used;
+} Entry;
+
+static void init_entry(void *entry) {
+  ((Entry *)entry)->fd = -1;
+  ((Entry *)entry)->used = 0;
+}
+
+void test_fd_table_grows_on_demand() {
+  printf("Testing fd table growth on demand...\n");
+
+  FdTable table;
+  fd_table_init(&table, sizeof(Entry), init_entry);
+  assert(fd_table_end(&table) == 0);
+  assert(fd_table_get(&table, 0) == NULL);
+  assert(fd_table_get(&table, -1) == NULL);
+
+  // a slot grows its page, whose entries are initialized
+  Entry *entry = fd_table_slot(&table, 3);
+  assert(entry != NULL);
+  assert(entry->fd == -1 && entry->used == 0);
+  entry->fd = 3;
+  assert(fd_table_end(&table) == FD_TABLE_PAGE_ENTRIES);
+  assert(fd_table_get(&table, 3) == entry);
+  assert(fd_table_slot(&table, 3) == entry);
+  Entry *neighbour = fd_table_get(&table, FD_TABLE_PAGE_ENTRIES - 1);
+  assert(neighbour != NULL && neighbour->fd == -1);
+  assert(neighbour == entry + (FD_TABLE_PAGE_ENTRIES - 1 - 3));
+  assert(fd_table_get(&table, FD_TABLE_PAGE_ENTRIES) == NULL);
+
+  // a far fd only grows its own page
+  int far = 100 * FD_TABLE_PAGE_ENTRIES + 7;
+  Entry *far_entry = fd_table_slot(&table, far);
+  assert(far_entry != NULL && far_entry->fd == -1);
+  assert(fd_table_end(&table) == 101 * FD_TABLE_PAGE_ENTRIES);
+  assert(fd_table_get(&table, 50 * FD_TABLE_PAGE_ENTRIES) == NULL);
+  // earlier entries do not move
+  assert(((Entry *)fd_table_get(&table, 3))->fd == 3);
+
+  // beyond the table
+  assert(fd_table_slot(&table, FD_TABLE_MAX_FDS) == NULL);
+  assert(fd_table_slot(&table, -1) == NULL);
+  assert(fd_table_get(&table, FD_TABLE_MAX_FDS) == NULL);
+  assert(fd_table_slot(&table, FD_TABLE_MAX_FDS - 1) != NULL);
+
+  fd_table_destroy(&table);
+  assert(fd_table_end(&table) == 0);
+  assert(fd_table_get(&table, 3) == NULL);
+  printf("✅ Fd table growth on demand passed\n");
+}
+
+void test_fd_table_zeroed() {
+  printf("Testing fd table without an entry initializer...\n");
+
+  FdTable table;
+  fd_table_init(&table, sizeof(void *), NULL);
+  for (int fd = 0; fd < 3 * FD_TABLE_PAGE_ENTRIES; fd += 97) {
+    void **slot = fd_table_slot(&table, fd);
+    assert(slot != NULL && *slot == NULL);
+    *slot = &table;
+  }
+  for (int fd = 0; fd < fd_table_end(&table); fd++) {
+    void **slot = fd_table_get(&table, fd);
+    assert(*slot == (fd % 97 == 0 ? (void *)&table : NULL));
+  }
+  fd_table_destroy(&table);
+  printf("✅ Fd table without an entry initializer passed\n");
+}
+
+typedef struct {
+  FdTable *table;
+  int base;
+  Entry *seen[64];
+} GrowArg;
+
+static void *grow(void *arg) {
+  GrowArg *grow_arg = arg;
+  // every thread grows the same pages, each at its own fds
+  for (int i = 0; i < 64; i++) {
+    int fd = i * FD_TABLE_PAGE_ENTRIES + grow_arg->base;
+    Entry *entry = fd_table_slot(grow_arg->table, fd);
+    assert(entry != NULL);
+    entry->fd = fd;
+    grow_arg->seen[i] = entry;
+  }
+  return NULL;
+}
+
+void test_fd_table_concurrent_growth() {
+  printf("Testing fd table concurrent growth...\n");
+
+  FdTable table;
+  fd_table_init(&table, sizeof(Entry), init_entry);
+  pthread_t threads[8];
+  GrowArg args[8];
+  for (int t = 0; t < 8; t++) {
+    args[t] = (GrowArg){.table = &table, .base = t};
+    assert(pthread_create(&threads[t], NULL, grow, &args[t]) == 0);
+  }
+  for (int t = 0; t < 8; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  // one page won each race: no write was lost to a discarded page
+  assert(fd_table_end(&table) == 64 * FD_TABLE_PAGE_ENTRIES);
+  for (int t = 0; t < 8; t++) {
+    for (int i = 0; i < 64; i++) {
+      int fd = i * FD_TABLE_PAGE_ENTRIES + t;
+      Entry *entry = fd_table_get(&table, fd);
+      assert(entry == args[t].seen[i]);
+      assert(entry->fd == fd);
+    }
+  }
+  fd_table_destroy(&table);
+  printf("✅ Fd table concurrent growth passed\n");
+}
+
+int main() {
+  printf("Running fd table tests...\n\n");
+
+  test_fd_table_grows_on_demand();
+  test_fd_table_zeroed();
+  test_fd_table_concurrent_growth();
+
+  printf("\nAll fd table tests passed!\n");
+  return 0;
+}
@@ -0,0 +1,135 @@
+#include "../../../../shared/utils/fiber.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define OUTSTANDING 1000
+
+// Request of a task, completed by another thread as a remote reply would be
+typedef struct {
+  FiberEvent event;
+  pthread_t loop_thread; // thread the task ran on
+  int waited;            // set once the event is signalled
+  int *finished;         // tasks returned
+} Request;
+
+static void wait_request(void *arg) {
+  Request *request = arg;
+  assert(fiber_self() != NULL);
+  request->loop_thread = pthread_self();
+  fiber_event_wait(&request->event);
+  // resumed on the thread of the loop
+  assert(pthread_equal(request->loop_thread, pthread_self()));
+  request->waited = 1;
+  __atomic_add_fetch(request->finished, 1, __ATOMIC_RELAXED);
+}
+
+static void *complete_requests(void *arg) {
+  Request *requests = arg;
+  for (int i = OUTSTANDING - 1; i >= 0; i--) {
+    fiber_event_signal(&requests[i].event);
+  }
+  return NULL;
+}
+
+void test_fiber_outstanding() {
+  printf("Testing one loop keeps many tasks waiting...\n");
+
+  FiberLoop *loop = fiber_loop_init(64 * 1024, OUTSTANDING);
+  assert(loop != NULL);
+  assert(fiber_self() == NULL);
+
+  Request *requests = calloc(OUTSTANDING, sizeof(Request));
+  int finished = 0;
+  for (int i = 0; i < OUTSTANDING; i++) {
+    fiber_event_init(&requests[i].event);
+    requests[i].finished = &finished;
+    assert(fiber_loop_submit(loop, wait_request, &requests[i]) == 0);
+  }
+
+  // the loop is full until the tasks return
+  assert(fiber_loop_submit(loop, wait_request, NULL) == -1);
+  assert(errno == EAGAIN);
+
+  // all of them wait at once on the single loop thread
+  FiberLoopStats stats;
+  do {
+    usleep(1000);
+    fiber_loop_get_stats(loop, &stats);
+  } while (stats.parks < OUTSTANDING);
+  assert(__atomic_load_n(&finished, __ATOMIC_RELAXED) == 0);
+
+  pthread_t completer;
+  assert(pthread_create(&completer, NULL, complete_requests, requests) == 0);
+  pthread_join(completer, NULL);
+  fiber_loop_destroy(loop);
+
+  assert(finished == OUTSTANDING);
+  for (int i = 1; i < OUTSTANDING; i++) {
+    assert(requests[i].waited);
+    assert(pthread_equal(requests[i].loop_thread, requests[0].loop_thread));
+  }
+  free(requests);
+
+  printf("✅ One loop keeps many tasks waiting passed\n");
+}
+
+static void signal_now(void *arg) { fiber_event_signal(arg); }
+
+void test_fiber_event_signalled_first() {
+  printf("Testing events signalled before the wait...\n");
+
+  // a thread waiting on an event a task signals
+  FiberLoop *loop = fiber_loop_init(0, 0);
+  FiberEvent event;
+  fiber_event_init(&event);
+  assert(fiber_loop_submit(loop, signal_now, &event) == 0);
+  fiber_event_wait(&event);
+
+  // a task waiting on an event signalled before its wait
+  Request request = {0};
+  int finished = 0;
+  request.finished = &finished;
+  fiber_event_init(&request.event);
+  fiber_event_signal(&request.event);
+  assert(fiber_loop_submit(loop, wait_request, &request) == 0);
+  fiber_loop_destroy(loop);
+  assert(finished == 1);
+
+  printf("✅ Events signalled before the wait passed\n");
+}
+
+static void count_task(void *arg) {
+  __atomic_add_fetch((int *)arg, 1, __ATOMIC_RELAXED);
+}
+
+void test_fiber_stacks_reused() {
+  printf("Testing stacks of finished tasks are reused...\n");
+
+  FiberLoop *loop = fiber_loop_init(0, 0);
+  int count = 0;
+  for (int i = 0; i < 10000; i++) {
+    while (fiber_loop_submit(loop, count_task, &count) != 0) {
+      assert(errno == EAGAIN);
+      usleep(100);
+    }
+  }
+  fiber_loop_destroy(loop);
+  assert(count == 10000);
+
+  printf("✅ Stacks of finished tasks are reused passed\n");
+}
+
+int main() {
+  printf("Running fiber tests...\n\n");
+
+  test_fiber_outstanding();
+  test_fiber_event_signalled_first();
+  test_fiber_stacks_reused();
+
+  printf("\nAll fiber tests passed!\n");
+  return 0;
+}
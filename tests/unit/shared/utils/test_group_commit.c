@@ -0,0 +1,126 @@
+#include "../../../../shared/utils/group_commit.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define WAITERS 8
+
+static GroupCommit gc;
+static int runs = 0;           // syncs of key "a"
+static int datasyncs[2] = {0}; // isdatasync of the first two syncs
+
+static size_t calls(void) {
+  GroupCommitStats stats;
+  group_commit_get_stats(&gc, &stats);
+  return stats.calls;
+}
+
+static int sync_a(void *arg, int isdatasync) {
+  (void)arg;
+  int run = __atomic_fetch_add(&runs, 1, __ATOMIC_SEQ_CST);
+  if (run < 2) {
+    datasyncs[run] = isdatasync;
+  }
+  if (run == 0) {
+    // hold the first sync until every other fsync has arrived
+    while (calls() < 1 + WAITERS + 1) {
+      usleep(1000);
+    }
+    return 0;
+  }
+  errno = EIO;
+  return -1;
+}
+
+static int sync_b(void *arg, int isdatasync) {
+  (void)isdatasync;
+  (*(int *)arg)++;
+  return 0;
+}
+
+static void *leader(void *arg) {
+  (void)arg;
+  assert(group_commit_sync(&gc, "a", 1, 1, sync_a, NULL) == 0);
+  return NULL;
+}
+
+static void *waiter(void *arg) {
+  int isdatasync = (int)(long)arg;
+  errno = 0;
+  assert(group_commit_sync(&gc, "a", 1, isdatasync, sync_a, NULL) == -1);
+  assert(errno == EIO);
+  return NULL;
+}
+
+void test_group_commit_single() {
+  printf("Testing group commit of a lone fsync...\n");
+
+  assert(group_commit_init(&gc) == 0);
+  int count = 0;
+  assert(group_commit_sync(&gc, "b", 1, 0, sync_b, &count) == 0);
+  assert(group_commit_sync(&gc, "b", 1, 0, sync_b, &count) == 0);
+  assert(count == 2);
+  assert(gc.entries == NULL); // idle keys are dropped
+
+  GroupCommitStats stats;
+  group_commit_get_stats(&gc, &stats);
+  assert(stats.calls == 2 && stats.syncs == 2);
+  group_commit_destroy(&gc);
+  printf("✅ Group commit of a lone fsync passed\n");
+}
+
+void test_group_commit_batches() {
+  printf("Testing group commit of concurrent fsyncs...\n");
+
+  assert(group_commit_init(&gc) == 0);
+  pthread_t first;
+  assert(pthread_create(&first, NULL, leader, NULL) == 0);
+  while (__atomic_load_n(&runs, __ATOMIC_SEQ_CST) == 0) {
+    usleep(1000);
+  }
+
+  // the fsyncs arriving during the first sync make one batch, an fdatasync
+  // only if all of them are
+  pthread_t threads[WAITERS];
+  for (long i = 0; i < WAITERS; i++) {
+    void *isdatasync = (void *)(long)(i != 3);
+    assert(pthread_create(&threads[i], NULL, waiter, isdatasync) == 0);
+  }
+
+  // another key is not held by the running sync
+  int count = 0;
+  assert(group_commit_sync(&gc, "b", 1, 0, sync_b, &count) == 0);
+  assert(count == 1);
+
+  pthread_join(first, NULL);
+  for (int i = 0; i < WAITERS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // one sync for the first fsync, one for all the waiters, whose error
+  // every one of them returned
+  assert(runs == 2);
+  assert(datasyncs[0] == 1);
+  assert(datasyncs[1] == 0);
+  GroupCommitStats stats;
+  group_commit_get_stats(&gc, &stats);
+  assert(stats.calls == 1 + WAITERS + 1);
+  assert(stats.syncs == 3);
+  assert(gc.entries == NULL);
+  group_commit_destroy(&gc);
+  printf("✅ Group commit of concurrent fsyncs passed\n");
+}
+
+int main() {
+  printf("Running group commit tests...\n\n");
+
+  test_group_commit_single();
+  test_group_commit_batches();
+
+  printf("\nAll group commit tests passed!\n");
+  return 0;
+}
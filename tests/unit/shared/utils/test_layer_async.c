@@ -0,0 +1,159 @@
+#include "../../../../layers/local/local.h"
+#include "../../../../shared/utils/layer_async.h"
+#include "../../../mock_layer.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int done;
+  ssize_t res;
+  pthread_t thread;
+} Completion;
+
+static void on_complete(ssize_t res, void *ctx) {
+  Completion *c = ctx;
+  pthread_mutex_lock(&c->mutex);
+  c->res = res;
+  c->thread = pthread_self();
+  c->done = 1;
+  pthread_cond_signal(&c->cond);
+  pthread_mutex_unlock(&c->mutex);
+}
+
+static void wait_completion(Completion *c) {
+  pthread_mutex_lock(&c->mutex);
+  while (!c->done) {
+    pthread_cond_wait(&c->cond, &c->mutex);
+  }
+  pthread_mutex_unlock(&c->mutex);
+}
+
+static int native_calls = 0;
+
+static int native_pwrite_async(int fd, const void *buffer, size_t nbyte,
+                               off_t offset, LayerIoCallback callback,
+                               void *ctx, LayerContext l) {
+  native_calls++;
+  callback((ssize_t)nbyte, ctx);
+  return 0;
+}
+
+void test_layer_async_adapter() {
+  printf("Testing the async adapter of a synchronous layer...\n");
+
+  MockLayerState state = {0};
+  reset_mock_state(&state, 0, 0);
+  state.mock_pread_data = "0123456789";
+  state.mock_pread_data_size = 10;
+  LayerContext mock = create_mock_layer(&state);
+  assert(!layer_has_native_async(mock));
+
+  // the blocking op runs on a pool worker, not on the submitter
+  Completion c = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0};
+  char buf[4];
+  assert(layer_pread_async(0, buf, sizeof(buf), 3, on_complete, &c, mock) ==
+         0);
+  wait_completion(&c);
+  assert(c.res == 4);
+  assert(memcmp(buf, "3456", 4) == 0);
+  assert(!pthread_equal(c.thread, pthread_self()));
+  assert(state.pread_called == 1);
+
+  // failures are reported as -errno
+  LayerContext local = local_init();
+  c.done = 0;
+  assert(layer_pwrite_async(-1, "x", 1, 0, on_complete, &c, local) == 0);
+  wait_completion(&c);
+  assert(c.res == -EBADF);
+  local.ops->ldestroy(local);
+
+  destroy_mock_layer(mock);
+  printf("✅ Async adapter passed\n");
+}
+
+void test_layer_async_native() {
+  printf("Testing native async ops...\n");
+
+  MockLayerState state = {0};
+  reset_mock_state(&state, 0, 0);
+  LayerContext mock = create_mock_layer(&state);
+  mock.ops->lpwrite_async = native_pwrite_async;
+  // both ops are needed to count as asynchronous
+  assert(!layer_has_native_async(mock));
+
+  Completion c = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0};
+  assert(layer_pwrite_async(0, "abc", 3, 0, on_complete, &c, mock) == 0);
+  wait_completion(&c);
+  assert(c.res == 3);
+  assert(native_calls == 1);
+  assert(state.pwrite_called == 0);
+
+  destroy_mock_layer(mock);
+  printf("✅ Native async ops passed\n");
+}
+
+void test_layer_completion_queue() {
+  printf("Testing the completion queue...\n");
+
+  MockLayerState states[3];
+  LayerContext layers[3];
+  for (int i = 0; i < 3; i++) {
+    memset(&states[i], 0, sizeof(states[i]));
+    reset_mock_state(&states[i], 0, 0);
+    states[i].mock_pread_data = "abcdefgh";
+    states[i].mock_pread_data_size = 8;
+    layers[i] = create_mock_layer(&states[i]);
+  }
+  layers[1].ops->lpwrite_async = native_pwrite_async;
+
+  LayerCompletionQueue cq;
+  LayerCompletion writes[3];
+  layer_cq_init(&cq);
+  for (int i = 0; i < 3; i++) {
+    assert(layer_cq_pwrite(&cq, &writes[i], i, "data", 4, 0, layers[i]) == 0);
+  }
+  layer_cq_wait(&cq);
+  for (int i = 0; i < 3; i++) {
+    assert(writes[i].res == 4);
+  }
+  assert(states[0].pwrite_called == 1 && states[2].pwrite_called == 1);
+
+  // reads of several layers complete into their own buffers
+  char bufs[3][8];
+  LayerCompletion reads[3];
+  layer_cq_init(&cq);
+  for (int i = 0; i < 3; i++) {
+    assert(layer_cq_pread(&cq, &reads[i], i, bufs[i], 8, i, layers[i]) == 0);
+  }
+  layer_cq_wait(&cq);
+  for (int i = 0; i < 3; i++) {
+    assert(reads[i].res == 8 - i);
+    assert(memcmp(bufs[i], "abcdefgh" + i, 8 - i) == 0);
+  }
+
+  // an empty queue does not wait
+  layer_cq_init(&cq);
+  layer_cq_wait(&cq);
+
+  for (int i = 0; i < 3; i++) {
+    destroy_mock_layer(layers[i]);
+  }
+  printf("✅ Completion queue passed\n");
+}
+
+int main() {
+  printf("Running layer async tests...\n\n");
+
+  test_layer_async_adapter();
+  test_layer_async_native();
+  test_layer_completion_queue();
+
+  printf("\nAll layer async tests passed!\n");
+  return 0;
+}
@@ -0,0 +1,156 @@
+#include "../../../../layers/local/local.h"
+#include "../../../../shared/utils/layer_iov.h"
+#include "../../../mock_layer.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TESTPATH "test_layer_iov.txt"
+#define COPYPATH "test_layer_iov_copy.txt"
+
+void test_layer_iov_fallback_read() {
+  printf("Testing preadv falling back to pread...\n");
+
+  MockLayerState state = {0};
+  reset_mock_state(&state, 0, 0);
+  state.mock_pread_data = "0123456789";
+  state.mock_pread_data_size = 10;
+  LayerContext mock = create_mock_layer(&state);
+  assert(mock.ops->lpreadv == NULL);
+
+  // several buffers are read with a single pread and scattered
+  char a[3], b[4], c[5];
+  struct iovec iov[] = {{a, sizeof(a)}, {b, sizeof(b)}, {c, sizeof(c)}};
+  assert(iov_length(iov, 3) == 12);
+  ssize_t res = layer_preadv(0, iov, 3, 1, mock);
+  assert(res == 9);
+  assert(state.pread_called == 1);
+  assert(memcmp(a, "123", 3) == 0);
+  assert(memcmp(b, "4567", 4) == 0);
+  assert(memcmp(c, "89", 2) == 0);
+
+  // a single buffer is read in place
+  char d[4];
+  struct iovec one = {d, sizeof(d)};
+  assert(layer_preadv(0, &one, 1, 0, mock) == 4);
+  assert(memcmp(d, "0123", 4) == 0);
+  assert(state.pread_called == 2);
+
+  assert(layer_preadv(0, iov, 0, 0, mock) == 0);
+  assert(state.pread_called == 2);
+
+  destroy_mock_layer(mock);
+  printf("✅ preadv fallback passed\n");
+}
+
+void test_layer_iov_fallback_write() {
+  printf("Testing pwritev falling back to pwrite...\n");
+
+  MockLayerState state = {0};
+  reset_mock_state(&state, 0, 0);
+  enable_mock_pwrite_data_storage(&state);
+  LayerContext mock = create_mock_layer(&state);
+
+  struct iovec iov[] = {{"abc", 3}, {"", 0}, {"defg", 4}};
+  assert(layer_pwritev(0, iov, 3, 0, mock) == 7);
+  assert(state.pwrite_called == 1);
+  assert(state.pwrite_data_storage_size == 7);
+  assert(memcmp(state.pwrite_data_storage, "abcdefg", 7) == 0);
+
+  free_mock_pwrite_data_storage(&state);
+  destroy_mock_layer(mock);
+  printf("✅ pwritev fallback passed\n");
+}
+
+void test_layer_iov_native_local() {
+  printf("Testing native preadv/pwritev of the local layer...\n");
+
+  LayerContext local = local_init();
+  assert(local.ops->lpreadv != NULL && local.ops->lpwritev != NULL);
+
+  int fd = local.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, local);
+  assert(fd >= 0);
+
+  struct iovec out[] = {{"hello ", 6}, {"scatter ", 8}, {"gather", 6}};
+  assert(layer_pwritev(fd, out, 3, 2, local) == 20);
+
+  char a[8], b[14];
+  struct iovec in[] = {{a, sizeof(a)}, {b, sizeof(b)}};
+  assert(layer_preadv(fd, in, 2, 0, local) == 22);
+  assert(a[0] == '\0' && a[1] == '\0');
+  assert(memcmp(a + 2, "hello ", 6) == 0);
+  assert(memcmp(b, "scatter gather", 14) == 0);
+
+  local.ops->lclose(fd, local);
+  unlink(TESTPATH);
+  local.ops->ldestroy(local);
+  printf("✅ Native local preadv/pwritev passed\n");
+}
+
+void test_layer_iov_fallback_copy() {
+  printf("Testing copy_file_range falling back to pread/pwrite...\n");
+
+  MockLayerState state = {0};
+  reset_mock_state(&state, 0, 0);
+  state.mock_pread_data = "0123456789";
+  state.mock_pread_data_size = 10;
+  enable_mock_pwrite_data_storage(&state);
+  LayerContext mock = create_mock_layer(&state);
+  assert(mock.ops->lcopy_file_range == NULL);
+
+  // read and written through the layer, stopping at the end of the source
+  assert(layer_copy_file_range(0, 4, 1, 0, 100, 0, mock) == 6);
+  assert(state.pwrite_called == 1);
+  assert(state.pwrite_data_storage_size == 6);
+  assert(memcmp(state.pwrite_data_storage, "456789", 6) == 0);
+
+  assert(layer_copy_file_range(0, 0, 1, 0, 0, 0, mock) == 0);
+  assert(layer_copy_file_range(0, 0, 1, 0, 4, 1, mock) == -1);
+
+  free_mock_pwrite_data_storage(&state);
+  destroy_mock_layer(mock);
+  printf("✅ copy_file_range fallback passed\n");
+}
+
+void test_layer_iov_native_copy_local() {
+  printf("Testing native copy_file_range of the local layer...\n");
+
+  LayerContext local = local_init();
+  assert(local.ops->lcopy_file_range != NULL);
+
+  int in = local.ops->lopen(TESTPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, local);
+  int out = local.ops->lopen(COPYPATH, O_RDWR | O_CREAT | O_TRUNC, 0644, local);
+  assert(in >= 0 && out >= 0);
+  assert(local.ops->lpwrite(in, "copy me through the kernel", 26, 0, local) ==
+         26);
+
+  // a clone or a copy in the kernel, a short count at the end of the source
+  assert(layer_copy_file_range(in, 5, out, 2, 64, 0, local) == 21);
+  char buf[23] = {0};
+  assert(local.ops->lpread(out, buf, sizeof(buf), 0, local) == 23);
+  assert(buf[0] == '\0' && buf[1] == '\0');
+  assert(memcmp(buf + 2, "me through the kernel", 21) == 0);
+
+  local.ops->lclose(in, local);
+  local.ops->lclose(out, local);
+  unlink(TESTPATH);
+  unlink(COPYPATH);
+  local.ops->ldestroy(local);
+  printf("✅ Native local copy_file_range passed\n");
+}
+
+int main() {
+  printf("Running layer iov tests...\n\n");
+
+  test_layer_iov_fallback_read();
+  test_layer_iov_fallback_write();
+  test_layer_iov_native_local();
+  test_layer_iov_fallback_copy();
+  test_layer_iov_native_copy_local();
+
+  printf("\nAll layer iov tests passed!\n");
+  return 0;
+}
@@ -0,0 +1,130 @@
+#include "../../../../layers/local/local.h"
+#include "../../../../shared/utils/lazy_layer.h"
+#include "../../../../shared/utils/layer_iov.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_FILE "test_lazy_layer.bin"
+#define N_THREADS 8
+
+static int builds;   // calls of build_local
+static int releases; // calls of release_arg
+static LayerOps partial_ops;
+
+static LayerContext build_local(void *arg) {
+  __atomic_add_fetch(&builds, 1, __ATOMIC_RELAXED);
+  usleep(10000); // slow enough for the other first callers to wait
+  LayerContext l = local_init();
+  if (arg) {
+    // a layer without some of the optional ops
+    partial_ops = *l.ops;
+    partial_ops.lrename = NULL;
+    partial_ops.lfsync = NULL;
+    partial_ops.lpreadv = NULL;
+    partial_ops.ldestroy = NULL; // the ops copy is static
+    local_destroy(l);
+    l.ops = &partial_ops;
+  }
+  return l;
+}
+
+static void release_arg(void *arg) {
+  (void)arg;
+  releases++;
+}
+
+void test_lazy_layer_first_use() {
+  printf("Testing the build on the first operation...\n");
+  builds = releases = 0;
+  LayerContext l = lazy_layer_init(build_local, release_arg, NULL);
+  assert(l.ops && !lazy_layer_built(l));
+  assert(builds == 0);
+
+  int fd = l.ops->lopen(TEST_FILE, O_CREAT | O_TRUNC | O_RDWR, 0644, l);
+  assert(fd >= 0);
+  assert(lazy_layer_built(l));
+  assert(builds == 1 && releases == 1);
+
+  char out[6] = {0};
+  assert(l.ops->lpwrite(fd, "hello", 5, 0, l) == 5);
+  assert(l.ops->lpread(fd, out, 5, 0, l) == 5);
+  assert(strcmp(out, "hello") == 0);
+  struct stat st;
+  assert(l.ops->lfstat(fd, &st, l) == 0 && st.st_size == 5);
+  assert(l.ops->lclose(fd, l) == 0);
+  assert(builds == 1);
+
+  l.ops->ldestroy(l);
+  assert(releases == 1);
+
+  // never used: destroyed without a build, arg still released
+  l = lazy_layer_init(build_local, release_arg, NULL);
+  l.ops->ldestroy(l);
+  assert(builds == 1 && releases == 2);
+}
+
+static void *first_lstat(void *arg) {
+  LayerContext *l = (LayerContext *)arg;
+  struct stat st;
+  assert(l->ops->llstat(TEST_FILE, &st, *l) == 0);
+  assert(st.st_size == 5);
+  return NULL;
+}
+
+void test_lazy_layer_concurrent_first_use() {
+  printf("Testing concurrent first operations...\n");
+  builds = releases = 0;
+  LayerContext l = lazy_layer_init(build_local, release_arg, NULL);
+  pthread_t threads[N_THREADS];
+  for (int i = 0; i < N_THREADS; i++) {
+    assert(pthread_create(&threads[i], NULL, first_lstat, &l) == 0);
+  }
+  for (int i = 0; i < N_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  assert(builds == 1 && releases == 1);
+  l.ops->ldestroy(l);
+}
+
+void test_lazy_layer_missing_ops() {
+  printf("Testing operations the built layer lacks...\n");
+  builds = releases = 0;
+  int partial = 1;
+  LayerContext l = lazy_layer_init(build_local, NULL, &partial);
+  int fd = l.ops->lopen(TEST_FILE, O_RDWR, 0, l);
+  assert(fd >= 0);
+
+  // preadv falls back to lpread, fsync has nothing to do
+  char a[2], b[3];
+  struct iovec iov[2] = {{a, sizeof(a)}, {b, sizeof(b)}};
+  assert(l.ops->lpreadv(fd, iov, 2, 0, l) == 5);
+  assert(memcmp(a, "he", 2) == 0 && memcmp(b, "llo", 3) == 0);
+  assert(l.ops->lfsync(fd, 0, l) == 0);
+  assert(l.ops->lclose(fd, l) == 0);
+
+  errno = 0;
+  assert(l.ops->lrename(TEST_FILE, TEST_FILE ".2", 0, l) == -1);
+  assert(errno == ENOSYS);
+  assert(access(TEST_FILE, F_OK) == 0);
+  assert(l.ops->lpread_digest == NULL && l.ops->lpwrite_digest == NULL);
+
+  assert(l.ops->lunlink(TEST_FILE, l) == 0);
+  l.ops->ldestroy(l);
+  assert(builds == 1 && releases == 0);
+}
+
+int main() {
+  printf("Running lazy layer tests...\n\n");
+
+  test_lazy_layer_first_use();
+  test_lazy_layer_concurrent_first_use();
+  test_lazy_layer_missing_ops();
+
+  printf("\nAll lazy layer tests passed!\n");
+  return 0;
+}
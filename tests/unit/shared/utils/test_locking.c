@@ -0,0 +1,320 @@
+#include "../../../../shared/utils/locking.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STRESS_THREADS 16
+#define STRESS_ITERATIONS 20000
+#define STRESS_PATHS 8
+
+// Number of entries in the hash chains of a table (no thread may use it)
+static size_t count_live_entries(LockTable *lock_table) {
+  size_t n = 0;
+  for (int i = 0; i < LOCK_TABLE_SHARDS; i++) {
+    for (int j = 0; j < LOCK_SHARD_SIZE; j++) {
+      for (LockEntry *e = lock_table->shards[i].buckets[j]; e; e = e->next) {
+        n++;
+      }
+    }
+  }
+  return n;
+}
+
+static size_t count_pooled_entries(LockTable *lock_table) {
+  size_t n = 0;
+  for (int i = 0; i < LOCK_TABLE_SHARDS; i++) {
+    n += lock_table->shards[i].pool_size;
+  }
+  return n;
+}
+
+void test_locking_entries_are_pooled() {
+  printf("Testing lock entries are released to the shard pool...\n");
+
+  LockTable *lock_table = locking_init();
+  assert(lock_table != NULL);
+
+  assert(locking_acquire_read(lock_table, "/a") == 0);
+  assert(locking_acquire_read(lock_table, "/a") == 0); // shared
+  assert(locking_acquire_write(lock_table, "/b") == 0);
+  assert(count_live_entries(lock_table) == 2);
+
+  assert(locking_release(lock_table, "/a") == 0);
+  assert(count_live_entries(lock_table) == 2);
+  assert(locking_release(lock_table, "/a") == 0);
+  assert(locking_release(lock_table, "/b") == 0);
+  assert(count_live_entries(lock_table) == 0);
+  assert(count_pooled_entries(lock_table) == 2);
+
+  // a pooled entry is reused, also for a longer path
+  char long_path[512];
+  memset(long_path, 'x', sizeof(long_path) - 1);
+  long_path[0] = '/';
+  long_path[sizeof(long_path) - 1] = '\0';
+  assert(locking_acquire_write(lock_table, long_path) == 0);
+  assert(locking_acquire_write(lock_table, "/a") == 0);
+  assert(locking_acquire_write(lock_table, "/b") == 0);
+  assert(count_live_entries(lock_table) == 3);
+  assert(locking_release(lock_table, long_path) == 0);
+  assert(locking_release(lock_table, "/a") == 0);
+  assert(locking_release(lock_table, "/b") == 0);
+
+  // releasing a path that is not locked fails
+  assert(locking_release(lock_table, "/a") == -1);
+  assert(locking_release(lock_table, NULL) == -1);
+  assert(locking_acquire_read(NULL, "/a") == -1);
+
+  locking_destroy(lock_table);
+  printf("✅ Lock entries are released to the shard pool passed\n");
+}
+
+// Thread that takes one lock, records that it got it, then releases it
+typedef struct {
+  LockTable *lock_table;
+  off_t offset;
+  size_t len;   // 0 with whole: whole-file lock
+  int whole;    // whole-file lock instead of a range
+  int write;    // write lock instead of a read lock
+  int acquired; // set once the lock is held
+  pthread_mutex_t mutex;
+} Contender;
+
+static void *contender_worker(void *arg) {
+  Contender *c = arg;
+  int res;
+  if (c->whole) {
+    res = c->write ? locking_acquire_write(c->lock_table, "/db")
+                   : locking_acquire_read(c->lock_table, "/db");
+  } else {
+    res = c->write ? locking_acquire_range_write(c->lock_table, "/db",
+                                                 c->offset, c->len)
+                   : locking_acquire_range_read(c->lock_table, "/db",
+                                                c->offset, c->len);
+  }
+  assert(res == 0);
+  pthread_mutex_lock(&c->mutex);
+  c->acquired = 1;
+  pthread_mutex_unlock(&c->mutex);
+  if (c->whole) {
+    assert(locking_release(c->lock_table, "/db") == 0);
+  } else {
+    assert(locking_release_range(c->lock_table, "/db", c->offset, c->len) ==
+           0);
+  }
+  return NULL;
+}
+
+static int contender_acquired(Contender *c) {
+  pthread_mutex_lock(&c->mutex);
+  int acquired = c->acquired;
+  pthread_mutex_unlock(&c->mutex);
+  return acquired;
+}
+
+// Start a contender and report whether it got its lock within 100 ms
+static int contender_start(Contender *c, pthread_t *thread) {
+  pthread_mutex_init(&c->mutex, NULL);
+  c->acquired = 0;
+  assert(pthread_create(thread, NULL, contender_worker, c) == 0);
+  for (int i = 0; i < 10 && !contender_acquired(c); i++) {
+    usleep(10000);
+  }
+  return contender_acquired(c);
+}
+
+static void contender_finish(Contender *c, pthread_t thread) {
+  pthread_join(thread, NULL);
+  assert(c->acquired);
+  pthread_mutex_destroy(&c->mutex);
+}
+
+void test_locking_byte_ranges() {
+  printf("Testing byte-range locks...\n");
+
+  LockTable *lock_table = locking_init();
+  assert(lock_table != NULL);
+  pthread_t thread;
+
+  // disjoint write ranges are held at the same time
+  assert(locking_acquire_range_write(lock_table, "/db", 0, 4096) == 0);
+  Contender disjoint = {.lock_table = lock_table,
+                        .offset = 4096,
+                        .len = 4096,
+                        .write = 1};
+  assert(contender_start(&disjoint, &thread));
+  contender_finish(&disjoint, thread);
+
+  // an overlapping range waits for the release
+  Contender overlap = {.lock_table = lock_table,
+                       .offset = 4095,
+                       .len = 2,
+                       .write = 0};
+  assert(!contender_start(&overlap, &thread));
+  assert(locking_release_range(lock_table, "/db", 0, 4096) == 0);
+  contender_finish(&overlap, thread);
+
+  // read ranges share, a whole-file write waits for all of them
+  assert(locking_acquire_range_read(lock_table, "/db", 0, 8192) == 0);
+  assert(locking_acquire_range_read(lock_table, "/db", 4096, 0) == 0);
+  Contender whole = {.lock_table = lock_table, .whole = 1, .write = 1};
+  assert(!contender_start(&whole, &thread));
+  assert(locking_release_range(lock_table, "/db", 0, 8192) == 0);
+  usleep(20000);
+  assert(!contender_acquired(&whole));
+  assert(locking_release_range(lock_table, "/db", 4096, 0) == 0);
+  contender_finish(&whole, thread);
+
+  // a whole-file read lock blocks range writes but not range reads
+  assert(locking_acquire_read(lock_table, "/db") == 0);
+  Contender reader = {.lock_table = lock_table, .offset = 100, .len = 1};
+  assert(contender_start(&reader, &thread));
+  contender_finish(&reader, thread);
+  Contender writer = {.lock_table = lock_table,
+                      .offset = 1 << 30,
+                      .len = 1,
+                      .write = 1};
+  assert(!contender_start(&writer, &thread));
+  assert(locking_release(lock_table, "/db") == 0);
+  contender_finish(&writer, thread);
+
+  // a thread overlapping its own write range gets an error, not a deadlock
+  assert(locking_acquire_range_write(lock_table, "/db", 0, 4096) == 0);
+  assert(locking_acquire_range_read(lock_table, "/db", 1024, 1) == -1);
+  assert(locking_acquire_write(lock_table, "/db") == -1);
+  assert(locking_release_range(lock_table, "/db", 0, 4096) == 0);
+
+  // only held ranges can be released, negative offsets are rejected
+  assert(locking_release_range(lock_table, "/db", 0, 4096) == -1);
+  assert(locking_acquire_range_write(lock_table, "/db", -1, 10) == -1);
+  assert(count_live_entries(lock_table) == 0);
+
+  locking_destroy(lock_table);
+  printf("✅ Byte-range locks passed\n");
+}
+
+typedef struct {
+  LockTable *lock_table;
+  long counters[STRESS_PATHS]; // shared, protected by the path write locks
+} StressState;
+
+typedef struct {
+  StressState *state;
+  int id;
+} StressArg;
+
+static StressState stress_state;
+
+static void *stress_worker(void *arg) {
+  StressArg *stress = arg;
+  StressState *state = stress->state;
+  char path[64];
+
+  for (int i = 0; i < STRESS_ITERATIONS; i++) {
+    int p = (i + stress->id) % STRESS_PATHS;
+    snprintf(path, sizeof(path), "/data/file-%d", p);
+    if (i % 4 == 0) {
+      assert(locking_acquire_read(state->lock_table, path) == 0);
+      long value = state->counters[p];
+      assert(value >= 0);
+    } else {
+      assert(locking_acquire_write(state->lock_table, path) == 0);
+      // a lost update would show up in the final counts
+      long value = state->counters[p];
+      state->counters[p] = value + 1;
+    }
+    assert(locking_release(state->lock_table, path) == 0);
+  }
+  return NULL;
+}
+
+void test_locking_write_exclusion_under_contention() {
+  printf("Testing write locks exclude each other under contention...\n");
+
+  memset(&stress_state, 0, sizeof(stress_state));
+  stress_state.lock_table = locking_init();
+  assert(stress_state.lock_table != NULL);
+
+  pthread_t threads[STRESS_THREADS];
+  StressArg args[STRESS_THREADS];
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    args[t].state = &stress_state;
+    args[t].id = t;
+    assert(pthread_create(&threads[t], NULL, stress_worker, &args[t]) == 0);
+  }
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  long total = 0;
+  for (int p = 0; p < STRESS_PATHS; p++) {
+    total += stress_state.counters[p];
+  }
+  assert(total == (long)STRESS_THREADS * (STRESS_ITERATIONS * 3 / 4));
+  assert(count_live_entries(stress_state.lock_table) == 0);
+  assert(count_pooled_entries(stress_state.lock_table) <=
+         (size_t)LOCK_TABLE_SHARDS * LOCK_POOL_SIZE);
+
+  locking_destroy(stress_state.lock_table);
+  printf("✅ Write locks exclude each other under contention passed\n");
+}
+
+void test_locking_keys() {
+  printf("Testing locks on hashed keys...\n");
+
+  LockTable *lock_table = locking_init();
+  assert(lock_table != NULL);
+  pthread_t thread;
+  LockKey key;
+  locking_key_init(&key, "/db");
+  assert(key.path_len == 3);
+
+  // a key locks the entry of its path
+  assert(locking_acquire_write_key(lock_table, &key) == 0);
+  assert(count_live_entries(lock_table) == 1);
+  Contender whole = {.lock_table = lock_table, .whole = 1, .write = 0};
+  assert(!contender_start(&whole, &thread));
+  assert(locking_release(lock_table, "/db") == 0);
+  contender_finish(&whole, thread);
+
+  assert(locking_acquire_range_write_key(lock_table, &key, 0, 4096) == 0);
+  Contender overlap = {.lock_table = lock_table,
+                       .offset = 4095,
+                       .len = 2,
+                       .write = 0};
+  assert(!contender_start(&overlap, &thread));
+  assert(locking_release_range_key(lock_table, &key, 0, 4096) == 0);
+  contender_finish(&overlap, thread);
+
+  // whole-file and range locks by key release by path, and the other way
+  assert(locking_acquire_range_read_key(lock_table, &key, 100, 0) == 0);
+  assert(locking_acquire_read(lock_table, "/db") == 0);
+  assert(locking_release_key(lock_table, &key) == 0);
+  assert(locking_release_range(lock_table, "/db", 100, 0) == 0);
+  assert(locking_release_key(lock_table, &key) == -1);
+  assert(count_live_entries(lock_table) == 0);
+
+  // a key without a path locks nothing
+  LockKey none;
+  locking_key_init(&none, NULL);
+  assert(locking_acquire_read_key(lock_table, &none) == -1);
+  assert(locking_acquire_write_key(lock_table, NULL) == -1);
+  assert(locking_acquire_range_write_key(lock_table, &key, -1, 1) == -1);
+
+  locking_destroy(lock_table);
+  printf("✅ Locks on hashed keys passed\n");
+}
+
+int main() {
+  printf("Running locking tests...\n\n");
+
+  test_locking_entries_are_pooled();
+  test_locking_write_exclusion_under_contention();
+  test_locking_byte_ranges();
+  test_locking_keys();
+
+  printf("\nAll locking tests passed!\n");
+  return 0;
+}
@@ -0,0 +1,217 @@
+// the tests use every level, whatever the build's TG_LOG_LEVEL
+#undef TG_LOG_LEVEL
+#include "../../../../logdef.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAX_CAPTURED 4096
+#define N_THREADS 4
+#define PER_THREAD 500
+
+static pthread_mutex_t captured_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char captured[MAX_CAPTURED][256];
+static LogMode captured_levels[MAX_CAPTURED];
+static int n_captured;
+static int block_sink;  // the sink waits while set
+static int sink_entered; // the sink is waiting
+
+static void capture(LogMode level, const char *message) {
+  if (__atomic_load_n(&block_sink, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n(&sink_entered, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&block_sink, __ATOMIC_ACQUIRE)) {
+      usleep(1000);
+    }
+  }
+  pthread_mutex_lock(&captured_mutex);
+  if (n_captured < MAX_CAPTURED) {
+    snprintf(captured[n_captured], sizeof(captured[0]), "%s", message);
+    captured_levels[n_captured] = level;
+  }
+  n_captured++;
+  pthread_mutex_unlock(&captured_mutex);
+}
+
+static void configure(size_t ring_records, unsigned rate_limit) {
+  LogOptions options = {.async = 1,
+                        .ring_records = ring_records,
+                        .rate_limit = rate_limit,
+                        .sink = capture};
+  LOG_CONFIGURE(&options);
+}
+
+void test_deferred_formatting() {
+  printf("Testing the formatting of drained records...\n");
+  n_captured = 0;
+  char expected[256];
+  snprintf(expected, sizeof(expected),
+           "[TEST] %d %-5s|%5.2f %zu %lx %c %% %.*s %s %lld", -42, "ab",
+           3.14159, (size_t)123456789, 0xbeefUL, 'z', 3, "abcdef",
+           "(null)", -1LL);
+  INFO_MSG("[TEST] %d %-5s|%5.2f %zu %lx %c %% %.*s %s %lld", -42, "ab",
+           3.14159, (size_t)123456789, 0xbeefUL, 'z', 3, "abcdef",
+           (char *)NULL, -1LL);
+  DEBUG_MSG("[TEST] %*d|%-*.*f|", 6, 7, 8, 1, 2.25);
+  char long_string[200];
+  memset(long_string, 'x', sizeof(long_string) - 1);
+  long_string[sizeof(long_string) - 1] = '\0';
+  // more than a record holds: formatted on the caller
+  WARN_MSG("[TEST] %.150s", long_string);
+  WARN_MSG("[TEST] %Lf", (long double)1.5);
+  LOG_FLUSH();
+
+  assert(n_captured == 4);
+  assert(strcmp(captured[0], expected) == 0);
+  assert(captured_levels[0] == LOG_INFO);
+  assert(strcmp(captured[1], "[TEST]      7|2.2     |") == 0);
+  assert(captured_levels[1] == LOG_DEBUG);
+  assert(strncmp(captured[2], "[TEST] xxxx", 11) == 0);
+  assert(strlen(captured[2]) == 7 + 150);
+  assert(captured_levels[2] == LOG_WARN);
+  assert(strcmp(captured[3], "[TEST] 1.500000") == 0);
+}
+
+static void *log_thread(void *arg) {
+  long id = (long)arg;
+  for (int i = 0; i < PER_THREAD; i++) {
+    INFO_MSG("[TEST] thread %ld message %d", id, i);
+  }
+  return NULL;
+}
+
+void test_concurrent_threads() {
+  printf("Testing messages of concurrent threads...\n");
+  n_captured = 0;
+  LogStats before, after;
+  LOG_STATS(&before);
+  pthread_t threads[N_THREADS];
+  for (long t = 0; t < N_THREADS; t++) {
+    assert(pthread_create(&threads[t], NULL, log_thread, (void *)t) == 0);
+  }
+  for (int t = 0; t < N_THREADS; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  LOG_FLUSH();
+  LOG_STATS(&after);
+  assert(n_captured == N_THREADS * PER_THREAD);
+  assert(after.logged - before.logged == N_THREADS * PER_THREAD);
+  assert(after.dropped == before.dropped);
+
+  // each thread's messages stay in order
+  int next[N_THREADS] = {0};
+  for (int i = 0; i < n_captured; i++) {
+    long id;
+    int n;
+    assert(sscanf(captured[i], "[TEST] thread %ld message %d", &id, &n) == 2);
+    assert(n == next[id]);
+    next[id]++;
+  }
+}
+
+static int ring_ready;  // the thread has its ring
+static int flood_start; // the thread may fill it
+
+static void *flood_thread(void *arg) {
+  (void)arg;
+  INFO_MSG("[TEST] first");
+  __atomic_store_n(&ring_ready, 1, __ATOMIC_RELEASE);
+  while (!__atomic_load_n(&flood_start, __ATOMIC_ACQUIRE)) {
+    usleep(1000);
+  }
+  for (int i = 0; i < 100; i++) {
+    INFO_MSG("[TEST] flood %d", i);
+  }
+  return NULL;
+}
+
+void test_full_ring_drops() {
+  printf("Testing records dropped on a full ring...\n");
+  configure(4, 0);
+  LogStats before, after;
+  LOG_STATS(&before);
+  n_captured = 0;
+
+  pthread_t thread;
+  assert(pthread_create(&thread, NULL, flood_thread, NULL) == 0);
+  while (!__atomic_load_n(&ring_ready, __ATOMIC_ACQUIRE)) {
+    usleep(1000);
+  }
+  // hold the drainer in the sink while the thread logs
+  __atomic_store_n(&block_sink, 1, __ATOMIC_RELEASE);
+  INFO_MSG("[TEST] blocker");
+  while (!__atomic_load_n(&sink_entered, __ATOMIC_ACQUIRE)) {
+    usleep(1000);
+  }
+  __atomic_store_n(&flood_start, 1, __ATOMIC_RELEASE);
+  pthread_join(thread, NULL);
+  __atomic_store_n(&block_sink, 0, __ATOMIC_RELEASE);
+  LOG_FLUSH();
+
+  LOG_STATS(&after);
+  unsigned long long dropped = after.dropped - before.dropped;
+  assert(dropped >= 95); // at most the 4 records of the ring were free
+  assert(n_captured + dropped == 102);
+  assert(after.logged - before.logged == (unsigned long long)n_captured);
+  configure(0, 0);
+}
+
+void test_rate_limit() {
+  printf("Testing rate limited messages...\n");
+  configure(0, 5);
+  LogStats before, after;
+  LOG_STATS(&before);
+  n_captured = 0;
+  for (int i = 0; i < 100; i++) {
+    INFO_MSG_RATELIMITED("[TEST] hot path %d", i);
+  }
+  LOG_FLUSH();
+  LOG_STATS(&after);
+  // 5 a second, twice that if the loop crossed a second
+  assert(n_captured >= 5 && n_captured <= 10);
+  assert(after.suppressed - before.suppressed ==
+         (unsigned long long)(100 - n_captured));
+  assert(strcmp(captured[0], "[TEST] hot path 0") == 0);
+
+  configure(0, 0);
+  n_captured = 0;
+  for (int i = 0; i < 100; i++) {
+    INFO_MSG_RATELIMITED("[TEST] hot path %d", i);
+  }
+  LOG_FLUSH();
+  assert(n_captured == 100);
+}
+
+void test_error_drains_first() {
+  printf("Testing errors after the queued messages...\n");
+  n_captured = 0;
+  INFO_MSG("[TEST] before the error");
+  ERROR_MSG("[TEST] error");
+  assert(n_captured == 1);
+  assert(strcmp(captured[0], "[TEST] before the error") == 0);
+}
+
+int main() {
+  printf("Running logdef tests...\n\n");
+
+  // zlog.conf of the repository logs to logs/
+  (void)mkdir("logs", 0755);
+  LOG_INIT(LOG_DEBUG);
+  configure(0, 0);
+
+  test_deferred_formatting();
+  test_concurrent_threads();
+  test_full_ring_drops();
+  test_rate_limit();
+  test_error_drains_first();
+
+  n_captured = 0;
+  INFO_MSG("[TEST] left for exit");
+  LOG_EXIT(LOG_DEBUG);
+  assert(n_captured == 1);
+
+  printf("\nAll logdef tests passed!\n");
+  return 0;
+}
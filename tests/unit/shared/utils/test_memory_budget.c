@@ -0,0 +1,166 @@
+#include "../../../../shared/utils/memory_budget.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// The accounts and the limit are process-wide: each test uses its own
+// accounts, and resets the limit it sets
+
+void test_memory_budget_unbounded() {
+  printf("Testing charges without budget only count...\n");
+
+  MemoryAccount *account = memory_budget_account("unbounded");
+  assert(account != NULL);
+  assert(memory_budget_account("unbounded") == account);
+  assert(memory_budget_headroom(account) == SIZE_MAX);
+
+  assert(memory_budget_try_charge(account, 1 << 20) == 0);
+  memory_budget_charge(account, 1 << 20);
+  MemoryBudgetStats stats;
+  memory_budget_get_stats(account, &stats);
+  assert(stats.charged == 2 << 20);
+  assert(stats.peak == 2 << 20);
+  assert(stats.denied == 0);
+
+  memory_budget_release(account, 2 << 20);
+  memory_budget_get_stats(account, &stats);
+  assert(stats.charged == 0);
+  assert(stats.peak == 2 << 20);
+
+  // no account: nothing is charged nor refused
+  assert(memory_budget_try_charge(NULL, 1 << 30) == 0);
+  assert(memory_budget_headroom(NULL) == SIZE_MAX);
+
+  printf("✅ Charges without budget only count passed\n");
+}
+
+void test_memory_budget_denies() {
+  printf("Testing try charges over the budget are denied...\n");
+
+  assert(memory_budget_set("denied", 1000) == 0);
+  MemoryAccount *account = memory_budget_account("denied");
+  assert(memory_budget_headroom(account) == 1000);
+
+  assert(memory_budget_try_charge(account, 600) == 0);
+  assert(memory_budget_headroom(account) == 400);
+  assert(memory_budget_try_charge(account, 600) == -1);
+  assert(memory_budget_try_charge(account, 400) == 0);
+  assert(memory_budget_headroom(account) == 0);
+
+  MemoryBudgetStats stats;
+  memory_budget_get_stats(account, &stats);
+  assert(stats.budget == 1000);
+  assert(stats.charged == 1000);
+  assert(stats.denied == 1);
+
+  memory_budget_release(account, 1000);
+  assert(memory_budget_headroom(account) == 1000);
+
+  printf("✅ Try charges over the budget are denied passed\n");
+}
+
+// Cache of fixed size entries that gives them back when asked
+typedef struct {
+  MemoryAccount *account;
+  size_t entries;
+  size_t entry_bytes;
+} FakeCache;
+
+static size_t fake_shrink(void *arg, size_t bytes) {
+  FakeCache *cache = arg;
+  size_t released = 0;
+  while (cache->entries > 0 && released < bytes) {
+    cache->entries--;
+    released += cache->entry_bytes;
+  }
+  memory_budget_release(cache->account, released);
+  return released;
+}
+
+void test_memory_budget_shrinkers() {
+  printf("Testing charges shrink the caches first...\n");
+
+  assert(memory_budget_set("shrunk", 1000) == 0);
+  FakeCache cache = {.account = memory_budget_account("shrunk"),
+                     .entry_bytes = 100};
+  assert(memory_budget_add_shrinker(cache.account, fake_shrink, &cache) == 0);
+  for (; cache.entries < 10; cache.entries++) {
+    assert(memory_budget_try_charge(cache.account, 100) == 0);
+  }
+
+  // over its budget, the account shrinks its own cache
+  assert(memory_budget_try_charge(cache.account, 250) == 0);
+  assert(cache.entries == 7);
+  MemoryBudgetStats stats;
+  memory_budget_get_stats(cache.account, &stats);
+  assert(stats.charged == 950);
+  assert(stats.reclaimed == 300);
+  memory_budget_release(cache.account, 250);
+
+  // over the process limit, another account shrinks it too
+  MemoryAccount *other = memory_budget_account("shrinking");
+  memory_budget_configure(memory_budget_charged() + 100);
+  assert(memory_budget_try_charge(other, 300) == 0);
+  assert(cache.entries == 5);
+  memory_budget_get_stats(other, &stats);
+  assert(stats.charged == 300);
+  assert(stats.reclaimed == 0);
+
+  // nothing left to shrink
+  memory_budget_remove_shrinker(fake_shrink, &cache);
+  assert(memory_budget_try_charge(other, 100) == -1);
+  assert(cache.entries == 5);
+
+  memory_budget_configure(0);
+  memory_budget_release(other, 300);
+  memory_budget_release(cache.account, 500);
+
+  printf("✅ Charges shrink the caches first passed\n");
+}
+
+static void *release_later(void *arg) {
+  MemoryAccount *account = arg;
+  usleep(50000);
+  memory_budget_release(account, 800);
+  return NULL;
+}
+
+void test_memory_budget_blocks() {
+  printf("Testing blocking charges wait for releases...\n");
+
+  assert(memory_budget_set("queue", 1000) == 0);
+  MemoryAccount *account = memory_budget_account("queue");
+
+  // an empty account always gets its entry, even a larger one
+  memory_budget_charge(account, 1200);
+  memory_budget_release(account, 1200);
+
+  memory_budget_charge(account, 800);
+  pthread_t consumer;
+  assert(pthread_create(&consumer, NULL, release_later, account) == 0);
+  memory_budget_charge(account, 800);
+  pthread_join(consumer, NULL);
+
+  MemoryBudgetStats stats;
+  memory_budget_get_stats(account, &stats);
+  assert(stats.charged == 800);
+  assert(stats.waits == 1);
+  assert(stats.peak == 1200);
+  memory_budget_release(account, 800);
+
+  printf("✅ Blocking charges wait for releases passed\n");
+}
+
+int main() {
+  printf("Running memory budget tests...\n\n");
+
+  test_memory_budget_unbounded();
+  test_memory_budget_denies();
+  test_memory_budget_shrinkers();
+  test_memory_budget_blocks();
+
+  printf("\nAll memory budget tests passed!\n");
+  return 0;
+}
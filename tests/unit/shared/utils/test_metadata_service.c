@@ -0,0 +1,253 @@
+#include "../../../../shared/utils/metadata_service.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Stat of a file with a watermark
+static struct stat file_stat(ino_t inode, off_t size, time_t mtime) {
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  st.st_dev = 42;
+  st.st_ino = inode;
+  st.st_size = size;
+  st.st_mtim.tv_sec = mtime;
+  st.st_ctim.tv_sec = mtime;
+  return st;
+}
+
+void test_metadata_cache_sizes() {
+  printf("Testing metadata cache logical sizes...\n");
+
+  MetadataCache *cache = metadata_cache_init(1024 * 1024);
+  assert(cache);
+
+  struct stat st = file_stat(1, 100, 1000);
+  off_t size = 0;
+  assert(metadata_cache_get_size(cache, &st, &size) == -1);
+  metadata_cache_set_size(cache, &st, 4096);
+  assert(metadata_cache_get_size(cache, &st, &size) == 0);
+  assert(size == 4096);
+
+  // another file of the same device, and the same inode of another device
+  struct stat other = file_stat(2, 100, 1000);
+  assert(metadata_cache_get_size(cache, &other, &size) == -1);
+  other = st;
+  other.st_dev = 43;
+  assert(metadata_cache_get_size(cache, &other, &size) == -1);
+
+  // a modified file misses, and the stale size is gone for good
+  struct stat modified = file_stat(1, 100, 1001);
+  assert(metadata_cache_get_size(cache, &modified, &size) == -1);
+  assert(metadata_cache_get_size(cache, &st, &size) == -1);
+  modified = file_stat(1, 120, 1000);
+  metadata_cache_set_size(cache, &st, 4096);
+  assert(metadata_cache_get_size(cache, &modified, &size) == -1);
+
+  // a stat without timestamps is no watermark
+  struct stat timeless = file_stat(3, 100, 0);
+  metadata_cache_set_size(cache, &timeless, 4096);
+  assert(metadata_cache_get_size(cache, &timeless, &size) == -1);
+
+  // invalidation drops the file
+  metadata_cache_set_size(cache, &st, 4096);
+  metadata_cache_invalidate(cache, st.st_dev, st.st_ino);
+  assert(metadata_cache_get_size(cache, &st, &size) == -1);
+
+  // a NULL cache always misses
+  assert(metadata_cache_get_size(NULL, &st, &size) == -1);
+  metadata_cache_set_size(NULL, &st, 1);
+  metadata_cache_invalidate(NULL, 1, 1);
+
+  MetadataCacheStats stats;
+  metadata_cache_get_stats(cache, &stats);
+  assert(stats.hits == 1);
+  assert(stats.misses == 7);
+  metadata_cache_destroy(cache);
+  printf("✅ Metadata cache logical sizes passed\n");
+}
+
+void test_metadata_cache_verification() {
+  printf("Testing metadata cache verification state...\n");
+
+  MetadataCache *cache = metadata_cache_init(1024 * 1024);
+  assert(cache);
+
+  struct stat st = file_stat(7, 100, 1000);
+  assert(!metadata_cache_is_verified(cache, &st, "hashes/a", 0));
+  metadata_cache_set_verified(cache, &st, "hashes/a");
+  assert(metadata_cache_is_verified(cache, &st, "hashes/a", 0));
+  // verified against another stored hash is not verified against this one
+  assert(!metadata_cache_is_verified(cache, &st, "hashes/b", 0));
+  assert(metadata_cache_is_verified(cache, &st, "hashes/a", 0));
+
+  // the size and the verification of a file live side by side
+  off_t size = 0;
+  metadata_cache_set_size(cache, &st, 10);
+  assert(metadata_cache_is_verified(cache, &st, "hashes/a", 0));
+  assert(metadata_cache_get_size(cache, &st, &size) == 0 && size == 10);
+
+  // a modified file is not verified, whatever the tag
+  struct stat modified = file_stat(7, 100, 1001);
+  assert(!metadata_cache_is_verified(cache, &modified, "hashes/a", 0));
+  assert(!metadata_cache_is_verified(cache, &st, "hashes/a", 0));
+  assert(metadata_cache_get_size(cache, &st, &size) == 0);
+
+  // verifications expire after the ttl
+  metadata_cache_set_verified(cache, &st, "hashes/a");
+  assert(metadata_cache_is_verified(cache, &st, "hashes/a", 1));
+  sleep(1);
+  assert(!metadata_cache_is_verified(cache, &st, "hashes/a", 1));
+  assert(metadata_cache_is_verified(cache, &st, "hashes/a", 0));
+
+  MetadataCacheStats stats;
+  metadata_cache_get_stats(cache, &stats);
+  assert(stats.entries == 1);
+  assert(stats.bytes == sizeof(MetadataEntry) + strlen("hashes/a") + 1);
+  metadata_cache_destroy(cache);
+  printf("✅ Metadata cache verification state passed\n");
+}
+
+void test_metadata_cache_bound() {
+  printf("Testing metadata cache byte bound...\n");
+
+  // too small for an entry per shard
+  assert(metadata_cache_init(sizeof(MetadataEntry)) == NULL);
+
+  const size_t max_bytes = METADATA_CACHE_SHARDS * 4 * sizeof(MetadataEntry);
+  MetadataCache *cache = metadata_cache_init(max_bytes);
+  assert(cache);
+  for (ino_t i = 1; i <= 1000; i++) {
+    struct stat st = file_stat(i, 1, 1000);
+    metadata_cache_set_size(cache, &st, (off_t)i);
+    metadata_cache_set_verified(cache, &st, "hashes/some/long/path");
+  }
+
+  MetadataCacheStats stats;
+  metadata_cache_get_stats(cache, &stats);
+  assert(stats.bytes <= max_bytes);
+  assert(stats.entries > 0 && stats.entries < 1000);
+  assert(stats.evictions >= 1000 - stats.entries);
+
+  // the most recent file survives, the oldest ones are gone
+  off_t size = 0;
+  struct stat last = file_stat(1000, 1, 1000);
+  assert(metadata_cache_get_size(cache, &last, &size) == 0 && size == 1000);
+  assert(metadata_cache_is_verified(cache, &last, "hashes/some/long/path", 0));
+  struct stat first = file_stat(1, 1, 1000);
+  assert(metadata_cache_get_size(cache, &first, &size) == -1);
+
+  // a tag that cannot fit in a shard is not recorded
+  char *huge = malloc(max_bytes);
+  assert(huge);
+  memset(huge, 'x', max_bytes - 1);
+  huge[max_bytes - 1] = '\0';
+  metadata_cache_set_verified(cache, &last, huge);
+  assert(!metadata_cache_is_verified(cache, &last, huge, 0));
+  free(huge);
+
+  metadata_cache_destroy(cache);
+  printf("✅ Metadata cache byte bound passed\n");
+}
+
+typedef struct {
+  MetadataCache *cache;
+  ino_t base;
+} HammerArg;
+
+static void *hammer(void *arg) {
+  HammerArg *hammer_arg = arg;
+  for (int round = 0; round < 200; round++) {
+    for (ino_t i = 0; i < 50; i++) {
+      struct stat st = file_stat(hammer_arg->base + i, 1, 1000 + round);
+      off_t size = 0;
+      if (metadata_cache_get_size(hammer_arg->cache, &st, &size) == 0) {
+        assert(size == (off_t)(st.st_ino * 2));
+      }
+      metadata_cache_set_size(hammer_arg->cache, &st, (off_t)(st.st_ino * 2));
+      metadata_cache_set_verified(hammer_arg->cache, &st, "tag");
+      if (i % 7 == 0) {
+        metadata_cache_invalidate(hammer_arg->cache, st.st_dev, st.st_ino);
+      }
+    }
+  }
+  return NULL;
+}
+
+void test_metadata_cache_concurrent() {
+  printf("Testing metadata cache concurrent use...\n");
+
+  const size_t max_bytes = METADATA_CACHE_SHARDS * 8 * sizeof(MetadataEntry);
+  MetadataCache *cache = metadata_cache_init(max_bytes);
+  assert(cache);
+  pthread_t threads[4];
+  HammerArg args[4];
+  for (int t = 0; t < 4; t++) {
+    // overlapping inode ranges, so threads share entries
+    args[t] = (HammerArg){.cache = cache, .base = (ino_t)(t * 25)};
+    assert(pthread_create(&threads[t], NULL, hammer, &args[t]) == 0);
+  }
+  for (int t = 0; t < 4; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  MetadataCacheStats stats;
+  metadata_cache_get_stats(cache, &stats);
+  assert(stats.bytes <= max_bytes);
+  metadata_cache_destroy(cache);
+  printf("✅ Metadata cache concurrent use passed\n");
+}
+
+static void *count_task(void *arg) {
+  __atomic_add_fetch((int *)arg, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+void test_metadata_service_shared() {
+  printf("Testing metadata service shared cache and pool...\n");
+
+  MetadataService service = {.num_background_threads = 2,
+                             .cache_size_bytes = 1024 * 1024};
+  assert(metadata_service_configure(&service) == 0);
+  assert(metadata_service_configure(NULL) == -1);
+
+  MetadataCache *cache = metadata_service_cache();
+  assert(cache != NULL);
+  assert(metadata_service_cache() == cache);
+  ThreadPool *pool = metadata_service_pool();
+  assert(pool != NULL && pool->nworkers == 2);
+  assert(metadata_service_pool() == pool);
+
+  // created: the configuration is final
+  MetadataService none = {0};
+  assert(metadata_service_configure(&none) == -1);
+  assert(metadata_service_cache() == cache);
+
+  int count = 0;
+  ThreadPoolTask tasks[8];
+  ThreadPoolBatch batch;
+  thread_pool_batch_init(&batch);
+  for (int i = 0; i < 8; i++) {
+    assert(thread_pool_submit(pool, 0, &tasks[i], &batch, count_task,
+                              &count) == 0);
+  }
+  thread_pool_wait(pool, &batch);
+  assert(count == 8);
+
+  printf("✅ Metadata service shared cache and pool passed\n");
+}
+
+int main() {
+  printf("Running metadata service tests...\n\n");
+
+  test_metadata_cache_sizes();
+  test_metadata_cache_verification();
+  test_metadata_cache_bound();
+  test_metadata_cache_concurrent();
+  test_metadata_service_shared();
+
+  printf("\nAll metadata service tests passed!\n");
+  return 0;
+}
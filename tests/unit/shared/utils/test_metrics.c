@@ -0,0 +1,169 @@
+#include "../../../../layers/local/local.h"
+#include "../../../../shared/utils/metrics.h"
+#include "../../../../shared/utils/metrics_layer.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define TEST_FILE "test_metrics.bin"
+#define TEST_SOCKET "test_metrics.sock"
+#define N_THREADS 8
+#define PER_THREAD 1000
+
+void test_metrics_percentiles() {
+  printf("Testing the latency percentiles...\n");
+  MetricsSet *set = metrics_register("percentiles");
+  assert(set);
+  uint64_t now = metrics_now();
+  // 1..1000 us, one of each: start so that the latency is i us
+  for (int i = 1; i <= 1000; i++) {
+    metrics_record(set, METRICS_OP_PREAD, now - (uint64_t)i * 1000, 4096);
+  }
+  metrics_record(set, METRICS_OP_PREAD, now, -1);
+
+  MetricsSummary s;
+  metrics_summary(set, METRICS_OP_PREAD, &s);
+  assert(s.count == 1001 && s.errors == 1);
+  assert(s.bytes == 1000ULL * 4096);
+  // the latencies are a little longer than i us, by the time to record
+  assert(s.p50_ns >= 500000 && s.p50_ns <= 500000 * 1.25);
+  assert(s.p90_ns >= 900000 && s.p90_ns <= 900000 * 1.25);
+  assert(s.p99_ns >= 990000 && s.p99_ns <= 990000 * 1.25);
+  assert(s.max_ns >= 1000000 && s.max_ns <= 1000000 * 1.25);
+
+  metrics_summary(set, METRICS_OP_OPEN, &s);
+  assert(s.count == 0 && s.p99_ns == 0);
+  metrics_unregister(set);
+}
+
+static void *record_thread(void *arg) {
+  MetricsSet *set = (MetricsSet *)arg;
+  for (int i = 0; i < PER_THREAD; i++) {
+    metrics_record(set, METRICS_OP_PWRITE, metrics_now(), 1);
+  }
+  return NULL;
+}
+
+void test_metrics_threads() {
+  printf("Testing records of concurrent threads...\n");
+  MetricsSet *set = metrics_register("threads");
+  pthread_t threads[N_THREADS];
+  for (int t = 0; t < N_THREADS; t++) {
+    assert(pthread_create(&threads[t], NULL, record_thread, set) == 0);
+  }
+  for (int t = 0; t < N_THREADS; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  MetricsSummary s;
+  metrics_summary(set, METRICS_OP_PWRITE, &s);
+  assert(s.count == N_THREADS * PER_THREAD);
+  assert(s.bytes == N_THREADS * PER_THREAD);
+  metrics_unregister(set);
+}
+
+void test_metrics_layer() {
+  printf("Testing the metrics layer...\n");
+  LayerContext local = local_init();
+  LayerContext l = metrics_layer_init(&local, "storage");
+  assert(l.ops);
+  MetricsSet *set = metrics_layer_metrics(l);
+
+  int fd = l.ops->lopen(TEST_FILE, O_CREAT | O_TRUNC | O_RDWR, 0644, l);
+  assert(fd >= 0);
+  char out[6] = {0};
+  assert(l.ops->lpwrite(fd, "hello", 5, 0, l) == 5);
+  assert(l.ops->lpread(fd, out, 5, 0, l) == 5);
+  assert(strcmp(out, "hello") == 0);
+  struct iovec iov = {out, 5};
+  assert(l.ops->lpreadv(fd, &iov, 1, 0, l) == 5);
+  assert(l.ops->lclose(fd, l) == 0);
+  struct stat st;
+  assert(l.ops->llstat(TEST_FILE ".missing", &st, l) == -1);
+  assert(l.ops->lunlink(TEST_FILE, l) == 0);
+
+  MetricsSummary s;
+  metrics_summary(set, METRICS_OP_PREAD, &s);
+  assert(s.count == 1 && s.bytes == 5 && s.errors == 0);
+  metrics_summary(set, METRICS_OP_PWRITE, &s);
+  assert(s.count == 1 && s.bytes == 5);
+  metrics_summary(set, METRICS_OP_PREADV, &s);
+  assert(s.count == 1 && s.bytes == 5);
+  metrics_summary(set, METRICS_OP_LSTAT, &s);
+  assert(s.count == 1 && s.errors == 1);
+  metrics_summary(set, METRICS_OP_OPEN, &s);
+  assert(s.count == 1 && s.bytes == 0);
+
+  size_t len;
+  char *text = metrics_render(&len);
+  assert(text && strlen(text) == len);
+  assert(strstr(text, "# TYPE tg_layer_operations_total counter\n"));
+  assert(strstr(text, "tg_layer_operations_total{layer=\"storage\","
+                      "op=\"pread\"} 1\n"));
+  assert(strstr(text, "tg_layer_errors_total{layer=\"storage\","
+                      "op=\"lstat\"} 1\n"));
+  assert(strstr(text, "tg_layer_bytes_total{layer=\"storage\","
+                      "op=\"pwrite\"} 5\n"));
+  assert(strstr(text, "tg_layer_latency_seconds_bucket{layer=\"storage\","
+                      "op=\"pread\",le=\"+Inf\"} 1\n"));
+  assert(strstr(text, "tg_layer_latency_seconds_count{layer=\"storage\","
+                      "op=\"close\"} 1\n"));
+  // operations that never ran aren't exported
+  assert(!strstr(text, "op=\"fsync\""));
+  free(text);
+
+  l.ops->ldestroy(l);
+  text = metrics_render(&len);
+  assert(!strstr(text, "layer=\"storage\""));
+  free(text);
+}
+
+void test_metrics_serve() {
+  printf("Testing the metrics endpoint...\n");
+  metrics_count("tg_test_events_total", "Events of the test", 2);
+  metrics_count("tg_test_events_total", "Events of the test", 3);
+  assert(metrics_serve("unix:" TEST_SOCKET) == 0);
+  assert(metrics_serve("unix:" TEST_SOCKET) == -1 && errno == EBUSY);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un sun = {.sun_family = AF_UNIX};
+  strcpy(sun.sun_path, TEST_SOCKET);
+  assert(connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0);
+  const char *request = "GET /metrics HTTP/1.0\r\n\r\n";
+  assert(write(fd, request, strlen(request)) == (ssize_t)strlen(request));
+  char response[8192];
+  size_t len = 0;
+  ssize_t n;
+  while ((n = read(fd, response + len, sizeof(response) - 1 - len)) > 0) {
+    len += (size_t)n;
+  }
+  response[len] = '\0';
+  close(fd);
+
+  assert(strncmp(response, "HTTP/1.0 200 OK\r\n", 17) == 0);
+  assert(strstr(response, "Content-Type: text/plain; version=0.0.4\r\n"));
+  assert(strstr(response, "# TYPE tg_test_events_total counter\n"
+                          "tg_test_events_total 5\n"));
+
+  metrics_stop();
+  assert(access(TEST_SOCKET, F_OK) == -1);
+  assert(metrics_serve("udp:1234") == -1 && errno == EINVAL);
+}
+
+int main() {
+  printf("Running metrics tests...\n\n");
+
+  test_metrics_percentiles();
+  test_metrics_threads();
+  test_metrics_layer();
+  test_metrics_serve();
+
+  printf("\nAll metrics tests passed!\n");
+  return 0;
+}
@@ -0,0 +1,78 @@
+#define _GNU_SOURCE
+#include "../../../../shared/utils/numa_policy.h"
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define STEERED_THREADS 4
+
+void test_numa_policy_off() {
+  printf("Testing NUMA placement before it is configured...\n");
+
+  // a single node, and nothing is pinned
+  assert(numa_policy_nodes() == 1);
+  assert(numa_policy_local() == 0);
+  assert(numa_policy_bind_thread(3) == 0);
+  assert(numa_policy_steer_thread() == 0);
+
+  printf("✅ NUMA placement before it is configured passed\n");
+}
+
+static void *steer(void *arg) {
+  int *node = arg;
+  *node = numa_policy_steer_thread();
+  // pinned once, the next requests of the thread keep their node
+  assert(numa_policy_steer_thread() == *node);
+  assert(numa_policy_local() == *node);
+  return NULL;
+}
+
+void test_numa_policy_steering() {
+  printf("Testing threads are steered to the nodes round robin...\n");
+
+  // every node of the machine; without a topology to read, placement stays
+  // off and the checks below hold for the single node
+  int configured = numa_policy_configure(0);
+  int nodes = numa_policy_nodes();
+  assert(configured == -1 || configured == nodes);
+  assert(nodes >= 1 && nodes <= NUMA_POLICY_MAX_NODES);
+
+  // a node the machine doesn't have leaves the placement as it was
+  assert(numa_policy_configure(1UL << 63) == -1);
+  assert(numa_policy_nodes() == nodes);
+
+  assert(numa_policy_bind_thread(nodes - 1) == 0);
+  assert(numa_policy_local() == nodes - 1);
+
+  pthread_t threads[STEERED_THREADS];
+  int steered[STEERED_THREADS];
+  for (int i = 0; i < STEERED_THREADS; i++) {
+    assert(pthread_create(&threads[i], NULL, steer, &steered[i]) == 0);
+    pthread_join(threads[i], NULL);
+    assert(steered[i] == i % nodes);
+  }
+
+  // a mapping can be placed on a node before it is touched
+  size_t length = 1024 * 1024;
+  char *map = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(map != MAP_FAILED);
+  assert(numa_policy_bind_memory(map, length, 0) == 0);
+  map[0] = map[length - 1] = 1;
+  munmap(map, length);
+
+  printf("✅ Threads are steered to the nodes round robin passed\n");
+}
+
+int main() {
+  printf("Running NUMA policy tests...\n\n");
+
+  test_numa_policy_off();
+  test_numa_policy_steering();
+
+  printf("\nAll NUMA policy tests passed!\n");
+  return 0;
+}
@@ -0,0 +1,111 @@
+#include "../../../../shared/utils/reed_solomon.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SHARD_LEN 1000 // not a multiple of the 32 bytes of the AVX2 kernel
+
+void test_reed_solomon_init() {
+  printf("Testing Reed-Solomon shard counts...\n");
+
+  ReedSolomon rs;
+  assert(reed_solomon_init(&rs, 4, 2) == 0);
+  assert(rs.data_shards == 4 && rs.parity_shards == 2);
+  assert(reed_solomon_init(&rs, 0, 2) == -1);
+  assert(reed_solomon_init(&rs, 4, 0) == -1);
+  assert(reed_solomon_init(&rs, REED_SOLOMON_MAX_SHARDS, 1) == -1);
+  assert(reed_solomon_init(NULL, 4, 2) == -1);
+
+  printf("✅ Reed-Solomon shard counts passed\n");
+}
+
+void test_reed_solomon_single_parity_is_xor() {
+  printf("Testing Reed-Solomon with one parity shard...\n");
+
+  // 1 / ((k + 0) ^ j) is not 1, but any single erasure is still recovered
+  ReedSolomon rs;
+  assert(reed_solomon_init(&rs, 2, 1) == 0);
+  uint8_t a[SHARD_LEN], b[SHARD_LEN], p[SHARD_LEN];
+  for (int i = 0; i < SHARD_LEN; i++) {
+    a[i] = (uint8_t)(i * 7);
+    b[i] = (uint8_t)(i * 13 + 1);
+  }
+  const uint8_t *data[] = {a, b};
+  uint8_t *parity[] = {p};
+  reed_solomon_encode(&rs, data, parity, SHARD_LEN);
+
+  uint8_t lost[SHARD_LEN];
+  memcpy(lost, a, SHARD_LEN);
+  memset(a, 0, SHARD_LEN);
+  uint8_t *shards[] = {a, b, p};
+  bool present[] = {false, true, true};
+  assert(reed_solomon_reconstruct(&rs, shards, present, SHARD_LEN) == 0);
+  assert(memcmp(a, lost, SHARD_LEN) == 0);
+
+  printf("✅ Reed-Solomon with one parity shard passed\n");
+}
+
+void test_reed_solomon_any_k_shards() {
+  printf("Testing Reed-Solomon recovery from any k shards...\n");
+
+  const int k = 4;
+  const int m = 3;
+  ReedSolomon rs;
+  assert(reed_solomon_init(&rs, k, m) == 0);
+
+  uint8_t *original[7];
+  uint8_t *shards[7];
+  srand(42);
+  for (int i = 0; i < k + m; i++) {
+    original[i] = malloc(SHARD_LEN);
+    shards[i] = malloc(SHARD_LEN);
+    assert(original[i] && shards[i]);
+  }
+  for (int i = 0; i < k; i++) {
+    for (int j = 0; j < SHARD_LEN; j++) {
+      original[i][j] = (uint8_t)rand();
+    }
+  }
+  reed_solomon_encode(&rs, (const uint8_t *const *)original, original + k,
+                      SHARD_LEN);
+
+  // every subset of at most m erased shards
+  for (int mask = 0; mask < (1 << (k + m)); mask++) {
+    int erased = __builtin_popcount(mask);
+    bool present[7];
+    for (int i = 0; i < k + m; i++) {
+      present[i] = !(mask & (1 << i));
+      memcpy(shards[i], original[i], SHARD_LEN);
+      if (!present[i]) {
+        memset(shards[i], 0xee, SHARD_LEN);
+      }
+    }
+    int res = reed_solomon_reconstruct(&rs, shards, present, SHARD_LEN);
+    if (erased > m) {
+      assert(res == -1);
+      continue;
+    }
+    assert(res == 0);
+    for (int i = 0; i < k; i++) {
+      assert(memcmp(shards[i], original[i], SHARD_LEN) == 0);
+    }
+  }
+
+  for (int i = 0; i < k + m; i++) {
+    free(original[i]);
+    free(shards[i]);
+  }
+  printf("✅ Reed-Solomon recovery from any k shards passed\n");
+}
+
+int main() {
+  printf("Running Reed-Solomon tests...\n\n");
+
+  test_reed_solomon_init();
+  test_reed_solomon_single_parity_is_xor();
+  test_reed_solomon_any_k_shards();
+
+  printf("\nAll Reed-Solomon tests passed!\n");
+  return 0;
+}
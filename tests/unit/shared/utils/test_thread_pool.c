@@ -0,0 +1,303 @@
+#include "../../../../shared/utils/numa_policy.h"
+#include "../../../../shared/utils/thread_pool.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FANOUT_TASKS 64
+
+// Counter incremented by count_task
+typedef struct {
+  pthread_mutex_t mutex;
+  int count;
+} Counter;
+
+static void *count_task(void *arg) {
+  Counter *counter = arg;
+  pthread_mutex_lock(&counter->mutex);
+  counter->count++;
+  pthread_mutex_unlock(&counter->mutex);
+  return NULL;
+}
+
+static int counter_get(Counter *counter) {
+  pthread_mutex_lock(&counter->mutex);
+  int count = counter->count;
+  pthread_mutex_unlock(&counter->mutex);
+  return count;
+}
+
+// Task that blocks its worker until the gate is opened
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int entered;
+  int open;
+} Gate;
+
+static void *gate_task(void *arg) {
+  Gate *gate = arg;
+  pthread_mutex_lock(&gate->mutex);
+  gate->entered = 1;
+  pthread_cond_broadcast(&gate->cond);
+  while (!gate->open) {
+    pthread_cond_wait(&gate->cond, &gate->mutex);
+  }
+  pthread_mutex_unlock(&gate->mutex);
+  return NULL;
+}
+
+static void gate_wait_entered(Gate *gate) {
+  pthread_mutex_lock(&gate->mutex);
+  while (!gate->entered) {
+    pthread_cond_wait(&gate->cond, &gate->mutex);
+  }
+  pthread_mutex_unlock(&gate->mutex);
+}
+
+static void gate_open(Gate *gate) {
+  pthread_mutex_lock(&gate->mutex);
+  gate->open = 1;
+  pthread_cond_broadcast(&gate->cond);
+  pthread_mutex_unlock(&gate->mutex);
+}
+
+static size_t pool_stat(ThreadPool *pool, size_t *field) {
+  pthread_mutex_lock(&pool->mutex);
+  size_t value = *field;
+  pthread_mutex_unlock(&pool->mutex);
+  return value;
+}
+
+void test_thread_pool_fanout() {
+  printf("Testing thread pool fan-out and reuse...\n");
+
+  ThreadPool *pool = thread_pool_init(3, 2);
+  assert(pool != NULL);
+  assert(pool->nworkers == 6);
+
+  Counter counter = {.count = 0};
+  pthread_mutex_init(&counter.mutex, NULL);
+  ThreadPoolTask tasks[FANOUT_TASKS];
+
+  // the same workers serve batch after batch
+  for (int round = 0; round < 100; round++) {
+    ThreadPoolBatch batch;
+    thread_pool_batch_init(&batch);
+    for (int i = 0; i < FANOUT_TASKS; i++) {
+      assert(thread_pool_submit(pool, i % 3, &tasks[i], &batch, count_task,
+                                &counter) == 0);
+    }
+    thread_pool_wait(pool, &batch);
+    assert(counter_get(&counter) == (round + 1) * FANOUT_TASKS);
+  }
+
+  // an empty batch completes immediately
+  ThreadPoolBatch empty;
+  thread_pool_batch_init(&empty);
+  thread_pool_wait(pool, &empty);
+
+  // invalid queues and pools are rejected
+  ThreadPoolBatch batch;
+  thread_pool_batch_init(&batch);
+  assert(thread_pool_submit(pool, 3, &tasks[0], &batch, count_task,
+                            &counter) == -1);
+  assert(thread_pool_submit(pool, -2, &tasks[0], &batch, count_task,
+                            &counter) == -1);
+  assert(thread_pool_submit(NULL, 0, &tasks[0], &batch, count_task,
+                            &counter) == -1);
+  thread_pool_wait(pool, &batch);
+  assert(thread_pool_init(0, 1) == NULL);
+  assert(thread_pool_init(1, 0) == NULL);
+
+  thread_pool_destroy(pool);
+  pthread_mutex_destroy(&counter.mutex);
+  printf("✅ Thread pool fan-out and reuse passed\n");
+}
+
+void test_thread_pool_work_stealing() {
+  printf("Testing idle workers steal from a blocked queue...\n");
+
+  ThreadPool *pool = thread_pool_init(2, 1);
+  assert(pool != NULL);
+
+  // occupy one worker, whichever picks the blocking task up
+  Gate gate = {.entered = 0, .open = 0};
+  pthread_mutex_init(&gate.mutex, NULL);
+  pthread_cond_init(&gate.cond, NULL);
+  ThreadPoolBatch blocked;
+  ThreadPoolTask blocked_task;
+  thread_pool_batch_init(&blocked);
+  assert(thread_pool_submit(pool, 0, &blocked_task, &blocked, gate_task,
+                            &gate) == 0);
+  gate_wait_entered(&gate);
+
+  // tasks queued behind it on queue 0 are run by the other worker
+  Counter counter = {.count = 0};
+  pthread_mutex_init(&counter.mutex, NULL);
+  ThreadPoolBatch batch;
+  ThreadPoolTask tasks[8];
+  thread_pool_batch_init(&batch);
+  for (int i = 0; i < 8; i++) {
+    assert(thread_pool_submit(pool, 0, &tasks[i], &batch, count_task,
+                              &counter) == 0);
+  }
+  for (int i = 0; i < 100 && counter_get(&counter) < 8; i++) {
+    usleep(10000);
+  }
+  assert(counter_get(&counter) == 8);
+  assert(pool_stat(pool, &pool->stolen) >= 1);
+
+  gate_open(&gate);
+  thread_pool_wait(pool, &batch);
+  thread_pool_wait(pool, &blocked);
+
+  thread_pool_destroy(pool);
+  pthread_cond_destroy(&gate.cond);
+  pthread_mutex_destroy(&gate.mutex);
+  pthread_mutex_destroy(&counter.mutex);
+  printf("✅ Idle workers steal from a blocked queue passed\n");
+}
+
+void test_thread_pool_waiter_runs_queued_tasks() {
+  printf("Testing a waiting submitter runs its queued tasks...\n");
+
+  ThreadPool *pool = thread_pool_init(1, 1);
+  assert(pool != NULL);
+
+  Gate gate = {.entered = 0, .open = 0};
+  pthread_mutex_init(&gate.mutex, NULL);
+  pthread_cond_init(&gate.cond, NULL);
+  ThreadPoolBatch blocked;
+  ThreadPoolTask blocked_task;
+  thread_pool_batch_init(&blocked);
+  assert(thread_pool_submit(pool, 0, &blocked_task, &blocked, gate_task,
+                            &gate) == 0);
+  gate_wait_entered(&gate);
+
+  // the only worker is blocked: the batch completes on the calling thread
+  Counter counter = {.count = 0};
+  pthread_mutex_init(&counter.mutex, NULL);
+  ThreadPoolBatch batch;
+  ThreadPoolTask tasks[4];
+  thread_pool_batch_init(&batch);
+  for (int i = 0; i < 4; i++) {
+    assert(thread_pool_submit(pool, 0, &tasks[i], &batch, count_task,
+                              &counter) == 0);
+  }
+  thread_pool_wait(pool, &batch);
+  assert(counter_get(&counter) == 4);
+  assert(pool_stat(pool, &pool->helped) == 4);
+
+  gate_open(&gate);
+  thread_pool_wait(pool, &blocked);
+
+  thread_pool_destroy(pool);
+  pthread_cond_destroy(&gate.cond);
+  pthread_mutex_destroy(&gate.mutex);
+  pthread_mutex_destroy(&counter.mutex);
+  printf("✅ A waiting submitter runs its queued tasks passed\n");
+}
+
+// Detached task owning its storage
+typedef struct {
+  ThreadPoolTask task;
+  Counter *counter;
+} OwnedTask;
+
+static void *owned_task(void *arg) {
+  OwnedTask *owned = arg;
+  count_task(owned->counter);
+  free(owned); // the pool does not touch the task once fn returns
+  return NULL;
+}
+
+void test_thread_pool_detached_tasks() {
+  printf("Testing detached tasks run before destroy...\n");
+
+  ThreadPool *pool = thread_pool_init(1, 1);
+  assert(pool != NULL);
+
+  Gate gate = {.entered = 0, .open = 0};
+  pthread_mutex_init(&gate.mutex, NULL);
+  pthread_cond_init(&gate.cond, NULL);
+  ThreadPoolBatch blocked;
+  ThreadPoolTask blocked_task;
+  thread_pool_batch_init(&blocked);
+  assert(thread_pool_submit(pool, 0, &blocked_task, &blocked, gate_task,
+                            &gate) == 0);
+  gate_wait_entered(&gate);
+
+  // queued behind the blocked worker, nobody waits for them
+  Counter counter = {.count = 0};
+  pthread_mutex_init(&counter.mutex, NULL);
+  for (int i = 0; i < 8; i++) {
+    OwnedTask *owned = malloc(sizeof(OwnedTask));
+    assert(owned != NULL);
+    owned->counter = &counter;
+    assert(thread_pool_submit(pool, 0, &owned->task, NULL, owned_task,
+                              owned) == 0);
+  }
+  assert(counter_get(&counter) == 0);
+
+  gate_open(&gate);
+  thread_pool_wait(pool, &blocked);
+
+  // destroy drains the queues before the workers exit
+  thread_pool_destroy(pool);
+  assert(counter.count == 8);
+
+  pthread_cond_destroy(&gate.cond);
+  pthread_mutex_destroy(&gate.mutex);
+  pthread_mutex_destroy(&counter.mutex);
+  printf("✅ Detached tasks run before destroy passed\n");
+}
+
+void test_thread_pool_local_queue() {
+  printf("Testing tasks submitted to the queue of the local node...\n");
+
+  // spread over the nodes of the machine, a single one when it has no NUMA
+  // topology to read
+  int configured = numa_policy_configure(0);
+  int nodes = numa_policy_nodes();
+  assert(configured == -1 || configured == nodes);
+
+  ThreadPool *pool = thread_pool_init(nodes, 2);
+  assert(pool != NULL);
+  for (int i = 0; i < pool->nworkers; i++) {
+    assert(pool->workers[i].node == i % nodes);
+    assert(pool->workers[i].home == i % nodes);
+  }
+
+  Counter counter = {.count = 0};
+  pthread_mutex_init(&counter.mutex, NULL);
+  ThreadPoolTask tasks[FANOUT_TASKS];
+  ThreadPoolBatch batch;
+  thread_pool_batch_init(&batch);
+  for (int i = 0; i < FANOUT_TASKS; i++) {
+    assert(thread_pool_submit(pool, THREAD_POOL_LOCAL_QUEUE, &tasks[i],
+                              &batch, count_task, &counter) == 0);
+  }
+  thread_pool_wait(pool, &batch);
+  assert(counter_get(&counter) == FANOUT_TASKS);
+
+  thread_pool_destroy(pool);
+  pthread_mutex_destroy(&counter.mutex);
+  printf("✅ Tasks submitted to the queue of the local node passed\n");
+}
+
+int main() {
+  printf("Running thread pool tests...\n\n");
+
+  test_thread_pool_fanout();
+  test_thread_pool_work_stealing();
+  test_thread_pool_waiter_runs_queued_tasks();
+  test_thread_pool_detached_tasks();
+  test_thread_pool_local_queue();
+
+  printf("\nAll thread pool tests passed!\n");
+  return 0;
+}
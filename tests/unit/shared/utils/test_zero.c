@@ -0,0 +1,83 @@
+#include "../../../../shared/utils/cpu.h"
+#include "../../../../shared/utils/zero.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BUF_LEN 4096
+
+static const char *kernels[] = {"avx512", "avx2", "neon", "generic"};
+
+// Every length and misalignment up to a few vectors, with one byte set at
+// each position, with the implementation selected
+static void check_positions(void) {
+  static uint8_t buf[1024 + 64];
+  memset(buf, 0, sizeof(buf));
+  for (size_t align = 0; align < 64; align += 7) {
+    for (size_t len = 0; len <= 1024; len += 37) {
+      uint8_t *data = buf + align;
+      assert(mem_is_zero(data, len));
+      for (size_t i = 0; i < len; i++) {
+        data[i] = 0x80;
+        assert(!mem_is_zero(data, len));
+        data[i] = 0;
+      }
+      // bytes around the buffer are not checked
+      if (align > 0) {
+        data[-1] = 1;
+      }
+      data[len] = 1;
+      assert(mem_is_zero(data, len));
+      data[len] = 0;
+      if (align > 0) {
+        data[-1] = 0;
+      }
+    }
+  }
+}
+
+void test_zero_detect() {
+  printf("Testing zero detection...\n");
+
+  static uint8_t block[BUF_LEN];
+  memset(block, 0, sizeof(block));
+  assert(mem_is_zero(block, sizeof(block)));
+  assert(mem_is_zero(block, 0));
+  assert(mem_is_zero(NULL, 0));
+
+  block[BUF_LEN - 1] = 1;
+  assert(!mem_is_zero(block, sizeof(block)));
+  assert(mem_is_zero(block, sizeof(block) - 1));
+  block[BUF_LEN - 1] = 0;
+  block[0] = 1;
+  assert(!mem_is_zero(block, sizeof(block)));
+
+  printf("✅ Zero detection passed\n");
+}
+
+void test_zero_kernels() {
+  printf("Testing the zero detection kernels...\n");
+
+  // the implementations the host can't run fall back to the fastest one
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    cpu_configure(0);
+    assert(cpu_kernel_override("zero", kernels[k]) == 0);
+    check_positions();
+  }
+  cpu_configure(CPU_AVX512 | CPU_AVX2 | CPU_NEON);
+  check_positions();
+  cpu_configure(0);
+
+  printf("✅ The zero detection kernels passed\n");
+}
+
+int main() {
+  printf("Running zero detection tests...\n\n");
+
+  test_zero_detect();
+  test_zero_kernels();
+
+  printf("\nAll zero detection tests passed!\n");
+  return 0;
+}